@@ -1,154 +1,543 @@
-#include <arpa/inet.h>
+/*
+ * Load generator for bloomd. Drives a filter from many threads and
+ * connections, with a uniform or zipf key distribution, a mix of
+ * checks and sets, pipelined commands and multi or bulk batches.
+ * It runs closed loop, keeping every connection at its pipeline
+ * depth, or open loop at a fixed rate. Latency percentiles and
+ * throughput are reported over time, and for the whole run.
+ *
+ * Open loop commands are timed from when they were due, not from
+ * when they were sent, so a server that stalls shows up in the
+ * latencies instead of slowing down the generator with it.
+ */
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
+#include "src/bloomd/histogram.h"
 
-static int NUM_THREADS = 1;
-static int NUM_KEYS = 1000000;
-static char* HOST = "127.0.0.1";
-static int PORT = 8673;
-static char *FILTER_NAME = "foobar%d";
+/**
+ * The most commands in flight on a connection
+ */
+#define MAX_DEPTH 1024
+
+/**
+ * The longest a key or command name is formatted to
+ */
+#define KEY_LEN 32
+#define CMD_LEN 256
+
+/**
+ * The keys of a load request, and the size of a read
+ */
+#define LOAD_BATCH 1000
+#define READ_BUF 65536
+
+/**
+ * How long commands in flight are waited on once the run ends
+ */
+#define DRAIN_NSEC 2000000000ULL
+
+/**
+ * The longest a thread waits on its connections at once
+ */
+#define POLL_NSEC 100000000ULL
+
+/**
+ * The settings of a run, from the command line
+ */
+typedef struct {
+    char *host;
+    char *port;
+    char *filter;
+    int threads;
+    int conns;          // Connections per thread
+    uint64_t keys;      // Size of the key space
+    double zipf;        // Zipf exponent, 0 for uniform keys
+    double reads;       // Fraction of the commands that are checks
+    int depth;          // Commands in flight per connection
+    int batch;          // Keys per command, multi and bulk above 1
+    double rate;        // Commands per second, 0 to run closed loop
+    int duration;       // Seconds to run
+    int interval;       // Seconds between reports
+    int load;           // Sets every key before the run
+} bench_config;
+
+static bench_config CONFIG = {"127.0.0.1", "8673", "bench", 1, 1, 1000000,
+    0, 0.9, 1, 1, 0, 10, 1, 0};
+
+/**
+ * The zipf distribution of Gray et al, "Quickly Generating
+ * Billion-Record Synthetic Databases". Rank 0 is the hottest key.
+ */
+typedef struct {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf_dist;
+
+/**
+ * A connection, with the commands that are not sent yet
+ * and the due times of the commands in flight
+ */
+typedef struct {
+    int fd;
+    char *out;
+    int out_len;
+    char first;             // First byte of the response being read
+    int head;               // Oldest command in flight
+    int inflight;
+    uint64_t due[MAX_DEPTH];
+} bench_conn;
 
 typedef struct {
-    int conn_fd;
-    char filter_name[32];
-    char cmd_buf[128];
-} conn_info;
-
-int connect_fd(conn_info *info) {
-    struct sockaddr_in addr;
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = PF_INET;
-    addr.sin_port = htons(PORT);
-    inet_pton(PF_INET, HOST, &addr.sin_addr);
-
-    info->conn_fd = socket(PF_INET, SOCK_STREAM, 0);
-    return connect(info->conn_fd, (struct sockaddr*)&addr, sizeof(addr));
-}
-
-int timediff(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
-}
-
-void *thread_main(void *in) {
-    printf("Thread started.");
-    conn_info info;
-    int sets = 0;
-    int checks = 0;
-
-    // Generate a filter name
-    char *buf = (char*)&info.filter_name;
-    sprintf(buf, FILTER_NAME, rand());
-    printf("Using filter: %s\n", buf);
-
-    struct timeval start_connect, start_create, start_set, start_check, end;
-    char out_buf[16];
-    int num, sent, len;
-
-    // Connect
-    gettimeofday(&start_connect, NULL);
-    int res = connect_fd(&info);
-    if (res) {
-        printf("Failed to connect!");
-        return NULL;
+    int id;
+    pthread_t thread;
+    uint64_t rng;
+    bench_conn *conns;
+} bench_thread;
+
+static zipf_dist ZIPF;
+static uint64_t START;              // Start of the run, in nsec
+static latency_histogram LATENCY;   // Of every command, in usec
+static uint64_t COMMANDS, KEYS, ERRORS;
+static int FAILED;
+
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * xorshift64*, each thread has its own state
+ */
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_double(uint64_t *state) {
+    return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(zipf_dist *z, uint64_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = 0;
+    for (uint64_t i=1; i <= n; i++) z->zetan += 1 / pow(i, theta);
+    double zeta2 = 1 + pow(0.5, theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(zipf_dist *z, double u) {
+    double uz = u * z->zetan;
+    if (uz < 1) return 0;
+    if (uz < 1 + pow(0.5, z->theta)) return 1;
+    uint64_t rank = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+    return (rank < z->n) ? rank : z->n - 1;
+}
+
+static uint64_t next_key(bench_thread *t) {
+    if (CONFIG.zipf > 0) return zipf_next(&ZIPF, next_double(&t->rng));
+    return next_rand(&t->rng) % CONFIG.keys;
+}
+
+/**
+ * Connects to bloomd, with Nagle disabled.
+ * @return The socket, or -1 on failure.
+ */
+static int connect_fd() {
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(CONFIG.host, CONFIG.port, &hints, &addrs)) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *a = addrs; a; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd == -1) continue;
+        if (!connect(fd, a->ai_addr, a->ai_addrlen)) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd == -1) return -1;
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+/**
+ * Sends a command and reads the line of its response,
+ * for the setup of a run.
+ * @return 0 on success, -1 on failure.
+ */
+static int send_and_read(int fd, char *cmd, int len, char *line, int line_len) {
+    for (int sent=0, res; sent < len; sent += res) {
+        res = send(fd, cmd + sent, len - sent, MSG_NOSIGNAL);
+        if (res <= 0) return -1;
     }
-    gettimeofday(&end, NULL);
-    printf("Connect: %d msec\n", timediff(&start_connect, &end));
-
-    // Make filer
-    gettimeofday(&start_create, NULL);
-
-    len = sprintf((char*)&info.cmd_buf, "create %s\n", buf);
-    send(info.conn_fd, info.cmd_buf, len, 0);
-    num = recv(info.conn_fd, (char*)&out_buf, 5, 0);
-    if (strcmp(out_buf, "Done\n") != 0) {
-        printf("Failed to create filter!");
-        return NULL;
-   }
-
-    gettimeofday(&end, NULL);
-    printf("Create: %d msec\n", timediff(&start_create, &end));
-
-    // Set
-    gettimeofday(&start_set, NULL);
-    for (int i=0; i< NUM_KEYS; i++) {
-        sprintf((char*)&info.cmd_buf, "set %s test%d\n", buf, i);
-        sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
-        if (sent == -1) {
-            printf("Failed to send!");
-            return NULL;
+    // Only the start of a long line is kept
+    int pos = 0;
+    char c;
+    while (recv(fd, &c, 1, 0) == 1) {
+        if (c == '\n') {
+            line[pos] = '\0';
+            return 0;
         }
+        if (pos < line_len - 1) line[pos++] = c;
     }
+    return -1;
+}
 
-    for (int i=0; i< NUM_KEYS; i++) {
-        num = recv(info.conn_fd, (char*)out_buf, 1, 0);
-        if (num == -1) {
-            printf("Failed to read!");
-            return NULL;
-        }
-        if (out_buf[0] == 'Y') {
-            sets++;
-            recv(info.conn_fd, (char*)out_buf, 3, 0); // Yes\n
-        } else {
-            recv(info.conn_fd, (char*)out_buf, 2, 0); // No\n
-        }
+/**
+ * Creates the filter, sized for the key space,
+ * and sets every key if asked to.
+ * @return 0 on success, -1 on failure.
+ */
+static int setup_filter() {
+    int fd = connect_fd();
+    if (fd == -1) {
+        fprintf(stderr, "Failed to connect to %s:%s\n", CONFIG.host, CONFIG.port);
+        return -1;
+    }
+
+    char line[CMD_LEN];
+    int len = snprintf(line, sizeof(line), "create %s capacity=%llu\n",
+            CONFIG.filter, (unsigned long long)CONFIG.keys);
+    if (send_and_read(fd, line, len, line, sizeof(line)) ||
+            (strcmp(line, "Done") && strcmp(line, "Exists"))) {
+        fprintf(stderr, "Failed to create filter %s: %s\n", CONFIG.filter, line);
+        close(fd);
+        return -1;
     }
-    gettimeofday(&end, NULL);
-    printf("Set: %d msec. Num: %d\n", timediff(&start_set, &end), sets);
-
-    // Check
-    gettimeofday(&start_check, NULL);
-    for (int i=0; i< NUM_KEYS; i++) {
-        sprintf((char*)&info.cmd_buf, "check %s test%d\n", buf, i);
-        sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
-        if (sent == -1) {
-            printf("Failed to send! (check)");
-            return NULL;
+
+    char *cmd = malloc(CMD_LEN + LOAD_BATCH * KEY_LEN);
+    for (uint64_t key=0; CONFIG.load && key < CONFIG.keys;) {
+        len = sprintf(cmd, "bulk %s", CONFIG.filter);
+        for (int i=0; i < LOAD_BATCH && key < CONFIG.keys; i++, key++)
+            len += sprintf(cmd + len, " key%llu", (unsigned long long)key);
+        cmd[len++] = '\n';
+        if (send_and_read(fd, cmd, len, line, sizeof(line)) ||
+                (line[0] != 'Y' && line[0] != 'N')) {
+            fprintf(stderr, "Failed to load filter %s: %s\n", CONFIG.filter, line);
+            free(cmd);
+            close(fd);
+            return -1;
         }
     }
+    free(cmd);
+    close(fd);
+    return 0;
+}
+
+/**
+ * Queues a command on a connection.
+ * @arg due The time the command is timed from
+ */
+static void issue(bench_thread *t, bench_conn *c, uint64_t due) {
+    int write = next_double(&t->rng) >= CONFIG.reads;
+    char *name = (CONFIG.batch > 1) ? (write ? "bulk" : "multi") : (write ? "set" : "check");
+    c->out_len += sprintf(c->out + c->out_len, "%s %s", name, CONFIG.filter);
+    for (int i=0; i < CONFIG.batch; i++)
+        c->out_len += sprintf(c->out + c->out_len, " key%llu", (unsigned long long)next_key(t));
+    c->out[c->out_len++] = '\n';
+    c->due[(c->head + c->inflight) % MAX_DEPTH] = due;
+    c->inflight++;
+}
 
-    for (int i=0; i< NUM_KEYS; i++) {
-        num = recv(info.conn_fd, (char*)out_buf, 1, 0);
-        if (num == -1) {
-            printf("Failed to read! (check)");
-            return NULL;
+/**
+ * Sends the queued commands that the socket takes.
+ * @return 0 on success, -1 on failure.
+ */
+static int flush_conn(bench_conn *c) {
+    int sent = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+    if (sent == -1) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    return 0;
+}
+
+/**
+ * Reads responses, and times the commands they complete.
+ * Every response is a single line.
+ * @return 0 on success, -1 on failure.
+ */
+static int read_conn(bench_conn *c, char *buf) {
+    int len = recv(c->fd, buf, READ_BUF, 0);
+    if (len == 0) return -1;
+    if (len == -1) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    uint64_t now = now_nsec();
+    for (char *pos = buf, *end = buf + len; pos < end;) {
+        if (!c->first) c->first = *pos;
+        char *eol = memchr(pos, '\n', end - pos);
+        if (!eol) break;
+        pos = eol + 1;
+        if (!c->inflight) return -1;
+
+        // Checks and sets answer Yes or No for each key
+        if (c->first != 'Y' && c->first != 'N') __atomic_add_fetch(&ERRORS, 1, __ATOMIC_RELAXED);
+        c->first = 0;
+        uint64_t due = c->due[c->head];
+        hist_record(&LATENCY, (now > due) ? (now - due) / 1000 : 0);
+        c->head = (c->head + 1) % MAX_DEPTH;
+        c->inflight--;
+        __atomic_add_fetch(&COMMANDS, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&KEYS, CONFIG.batch, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/**
+ * Runs the connections of a thread until the end of the run,
+ * then waits for the commands in flight.
+ */
+static void* thread_main(void *in) {
+    bench_thread *t = in;
+    struct pollfd *fds = calloc(CONFIG.conns, sizeof(struct pollfd));
+    char *buf = malloc(READ_BUF);
+    for (int i=0; i < CONFIG.conns; i++) fds[i].fd = t->conns[i].fd;
+
+    // Open loop threads take turns, each at an even share of the rate
+    uint64_t end = START + CONFIG.duration * 1000000000ULL;
+    double gap = (CONFIG.rate > 0) ? CONFIG.threads * 1e9 / CONFIG.rate : 0;
+    double next_due = START + t->id * gap / CONFIG.threads;
+    int next_conn = 0;
+
+    while (!__atomic_load_n(&FAILED, __ATOMIC_RELAXED)) {
+        uint64_t now = now_nsec();
+        int inflight = 0;
+        if (now < end && gap) {
+            // Commands due with every connection full wait, and are
+            // still timed from when they were due
+            while (next_due <= now) {
+                int i;
+                for (i=0; i < CONFIG.conns; i++) {
+                    bench_conn *c = t->conns + (next_conn + i) % CONFIG.conns;
+                    if (c->inflight < CONFIG.depth) break;
+                }
+                if (i == CONFIG.conns) break;
+                issue(t, t->conns + (next_conn + i) % CONFIG.conns, next_due);
+                next_conn = (next_conn + i + 1) % CONFIG.conns;
+                next_due += gap;
+            }
+        } else if (now < end) {
+            for (int i=0; i < CONFIG.conns; i++) {
+                while (t->conns[i].inflight < CONFIG.depth) issue(t, t->conns + i, now);
+            }
         }
-        if (out_buf[0] == 'Y') {
-            checks++;
-            recv(info.conn_fd, (char*)out_buf, 3, 0); // Yes\n
-        } else {
-            recv(info.conn_fd, (char*)out_buf, 2, 0); // No\n
+        for (int i=0; i < CONFIG.conns; i++) inflight += t->conns[i].inflight;
+        if (now >= end && (!inflight || now >= end + DRAIN_NSEC)) break;
+
+        for (int i=0; i < CONFIG.conns; i++) {
+            fds[i].events = POLLIN | ((t->conns[i].out_len) ? POLLOUT : 0);
+            fds[i].revents = 0;
         }
-    }
-    gettimeofday(&end, NULL);
-    printf("Check: %d msec. Num: %d\n", timediff(&start_check, &end), checks);
+        // Sleep until the next command is due, rather than spin, so
+        // the generator does not take the cores of a local bloomd
+        uint64_t timeout = POLL_NSEC;
+        if (now < end && gap) {
+            timeout = (next_due > now) ? next_due - now : 0;
+            if (timeout > POLL_NSEC) timeout = POLL_NSEC;
+        }
+        struct timespec ts = {timeout / 1000000000ULL, timeout % 1000000000ULL};
+        if (ppoll(fds, CONFIG.conns, &ts, NULL) == -1 && errno != EINTR) break;
 
+        for (int i=0; i < CONFIG.conns; i++) {
+            bench_conn *c = t->conns + i;
+            int res = 0;
+            if (fds[i].revents & POLLOUT) res |= flush_conn(c);
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) res |= read_conn(c, buf);
+            if (res) {
+                fprintf(stderr, "Connection to bloomd failed!\n");
+                __atomic_store_n(&FAILED, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+    free(buf);
+    free(fds);
     return NULL;
 }
 
+/**
+ * Prints the latencies of a histogram, in usec
+ */
+static void print_percentiles(latency_histogram *hist) {
+    printf("p50 %llu p99 %llu p99.9 %llu",
+            (unsigned long long)hist_percentile(hist, 50),
+            (unsigned long long)hist_percentile(hist, 99),
+            (unsigned long long)hist_percentile(hist, 99.9));
+}
+
+/**
+ * Prints the throughput and latencies since the last report
+ */
+static void report_interval(double elapsed, double secs, latency_histogram *last,
+        uint64_t *last_keys) {
+    latency_histogram now, delta;
+    memset(&now, 0, sizeof(now));
+    hist_merge(&now, &LATENCY);
+    uint64_t commands = 0;
+    for (int i=0; i < HIST_BUCKETS; i++) {
+        delta.counts[i] = now.counts[i] - last->counts[i];
+        commands += delta.counts[i];
+    }
+    uint64_t keys = __atomic_load_n(&KEYS, __ATOMIC_RELAXED);
+
+    printf("%7.1fs %10.0f cmd/s %10.0f keys/s  ", elapsed,
+            commands / secs, (keys - *last_keys) / secs);
+    print_percentiles(&delta);
+    printf(" usec\n");
+    fflush(stdout);
+    memcpy(last, &now, sizeof(now));
+    *last_keys = keys;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n\
+  -h host       bloomd host, defaults to 127.0.0.1\n\
+  -p port       bloomd port, defaults to 8673\n\
+  -f filter     The filter to use, created if needed, defaults to bench\n\
+  -t threads    Client threads, defaults to 1\n\
+  -c conns      Connections per thread, defaults to 1\n\
+  -k keys       Size of the key space, defaults to 1000000\n\
+  -z theta      Zipf keys with this exponent, below 1, defaults to uniform\n\
+  -r reads      Fraction of the commands that are checks, defaults to 0.9\n\
+  -d depth      Commands in flight per connection, defaults to 1\n\
+  -b batch      Keys per command, multi and bulk above 1, defaults to 1\n\
+  -R rate       Commands per second, open loop, defaults to closed loop\n\
+  -T seconds    Length of the run, defaults to 10\n\
+  -i seconds    Time between reports, defaults to 1\n\
+  -l            Set every key before the run\n", prog);
+}
+
 int main(int argc, char **argv) {
-    // Read random seed
-    int randfh = open("/dev/random", O_RDONLY);
-    unsigned seed = 0;
-    read(randfh, &seed, sizeof(seed));
-    close(randfh);
-
-    srand(seed);
-    pthread_t t[NUM_THREADS];
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_create(&t[i], NULL, thread_main, NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:f:t:c:k:z:r:d:b:R:T:i:l")) != -1) {
+        switch (opt) {
+            case 'h': CONFIG.host = optarg; break;
+            case 'p': CONFIG.port = optarg; break;
+            case 'f': CONFIG.filter = optarg; break;
+            case 't': CONFIG.threads = atoi(optarg); break;
+            case 'c': CONFIG.conns = atoi(optarg); break;
+            case 'k': CONFIG.keys = strtoull(optarg, NULL, 10); break;
+            case 'z': CONFIG.zipf = atof(optarg); break;
+            case 'r': CONFIG.reads = atof(optarg); break;
+            case 'd': CONFIG.depth = atoi(optarg); break;
+            case 'b': CONFIG.batch = atoi(optarg); break;
+            case 'R': CONFIG.rate = atof(optarg); break;
+            case 'T': CONFIG.duration = atoi(optarg); break;
+            case 'i': CONFIG.interval = atoi(optarg); break;
+            case 'l': CONFIG.load = 1; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
     }
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_join(t[i], NULL);
+    if (CONFIG.threads < 1 || CONFIG.conns < 1 || CONFIG.keys < 1 ||
+            CONFIG.zipf < 0 || CONFIG.zipf >= 1 || CONFIG.reads < 0 || CONFIG.reads > 1 ||
+            CONFIG.depth < 1 || CONFIG.depth > MAX_DEPTH || CONFIG.batch < 1 ||
+            CONFIG.rate < 0 || CONFIG.duration < 1 || CONFIG.interval < 1 ||
+            strlen(CONFIG.filter) > CMD_LEN - 64) {
+        usage(argv[0]);
+        return 1;
     }
-    return 0;
+    if (CONFIG.zipf > 0) zipf_init(&ZIPF, CONFIG.keys, CONFIG.zipf);
+    if (setup_filter()) return 1;
+
+    // Connect everything before the clock starts
+    bench_thread *threads = calloc(CONFIG.threads, sizeof(bench_thread));
+    uint64_t seed = now_nsec();
+    for (int i=0; i < CONFIG.threads; i++) {
+        threads[i].id = i;
+        threads[i].rng = seed + (i + 1) * 0x9E3779B97F4A7C15ULL;
+        threads[i].conns = calloc(CONFIG.conns, sizeof(bench_conn));
+        for (int j=0; j < CONFIG.conns; j++) {
+            bench_conn *c = threads[i].conns + j;
+            c->fd = connect_fd();
+            if (c->fd == -1) {
+                fprintf(stderr, "Failed to connect to %s:%s\n", CONFIG.host, CONFIG.port);
+                return 1;
+            }
+            fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+            c->out = malloc(CONFIG.depth * (CMD_LEN + CONFIG.batch * KEY_LEN));
+        }
+    }
+
+    printf("%d threads, %d connections each, depth %d, batch %d, %s keys of %llu, %.0f%% checks, ",
+            CONFIG.threads, CONFIG.conns, CONFIG.depth, CONFIG.batch,
+            (CONFIG.zipf > 0) ? "zipf" : "uniform", (unsigned long long)CONFIG.keys,
+            CONFIG.reads * 100);
+    if (CONFIG.rate > 0) {
+        printf("open loop at %.0f cmd/s\n", CONFIG.rate);
+    } else {
+        printf("closed loop\n");
+    }
+
+    START = now_nsec();
+    for (int i=0; i < CONFIG.threads; i++)
+        pthread_create(&threads[i].thread, NULL, thread_main, threads + i);
+
+    // Report until the run ends
+    latency_histogram last;
+    memset(&last, 0, sizeof(last));
+    uint64_t last_keys = 0;
+    uint64_t end = START + CONFIG.duration * 1000000000ULL;
+    for (uint64_t next = START; next < end && !__atomic_load_n(&FAILED, __ATOMIC_RELAXED);) {
+        uint64_t prev = next;
+        next += CONFIG.interval * 1000000000ULL;
+        if (next > end) next = end;
+        uint64_t now = now_nsec();
+        if (next > now) {
+            struct timespec ts = {(next - now) / 1000000000ULL, (next - now) % 1000000000ULL};
+            nanosleep(&ts, NULL);
+        }
+        report_interval((next - START) / 1e9, (next - prev) / 1e9, &last, &last_keys);
+    }
+    for (int i=0; i < CONFIG.threads; i++) pthread_join(threads[i].thread, NULL);
+    double secs = (now_nsec() - START) / 1e9;
+
+    // Summarize the run
+    uint64_t commands = COMMANDS;
+    printf("\n%llu commands, %llu keys, %llu errors in %.2fs\n",
+            (unsigned long long)commands, (unsigned long long)KEYS,
+            (unsigned long long)ERRORS, secs);
+    printf("Throughput: %.0f cmd/s, %.0f keys/s\n", commands / secs, KEYS / secs);
+    printf("Latency: mean %.1f ", (commands) ? (double)LATENCY.sum / commands : 0);
+    print_percentiles(&LATENCY);
+    printf(" p99.99 %llu max %llu usec\n",
+            (unsigned long long)hist_percentile(&LATENCY, 99.99),
+            (unsigned long long)hist_percentile(&LATENCY, 100));
+
+    for (int i=0; i < CONFIG.threads; i++) {
+        for (int j=0; j < CONFIG.conns; j++) {
+            close(threads[i].conns[j].fd);
+            free(threads[i].conns[j].out);
+        }
+        free(threads[i].conns);
+    }
+    free(threads);
+    return (FAILED) ? 1 : 0;
 }
@@ -0,0 +1,276 @@
+/*
+ * Measures how the filter manager scales with threads, without
+ * any networking. Each step runs a number of threads doing mixed
+ * checks and sets over a set of filters, while a churn thread
+ * creates and drops filters and the vacuum thread reclaims them.
+ * Reports the throughput of every thread count, and the version
+ * backlog, the versions published since the oldest version a
+ * client may still use, which holds the garbage of the churn.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+#include "filter_manager.h"
+
+/**
+ * The most keys per call, and the most threads
+ */
+#define MAX_BATCH 1024
+#define MAX_THREADS 256
+
+/**
+ * How often the backlog is sampled
+ */
+#define SAMPLE_USEC 10000
+
+/**
+ * Filters the churn thread keeps alive at once
+ */
+#define CHURN_LIVE 16
+
+static int MAX_THREAD_COUNT = 8;
+static int NUM_FILTERS = 64;
+static int BATCH = 1;
+static double READS = 0.9;
+static int SECONDS = 3;
+static int CHURN_RATE = 100;        // Creates and drops per second, 0 for none
+static int CHECKPOINT_CALLS = 16;   // Calls between client checkpoints
+static int USE_CACHE = 1;
+static int PERSIST = 0;
+static char *DATA_DIR = "/tmp/bench_filtmgr";
+
+static bloom_filtmgr *MGR;
+static int RUNNING;
+static int CHURN_NEXT;              // Churn names are not reused across steps
+
+typedef struct {
+    pthread_t thread;
+    uint64_t rng;
+    uint64_t calls;
+    uint64_t errors;
+} worker;
+
+static uint64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * xorshift64*, each thread has its own state
+ */
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Runs checks and sets over random filters until stopped,
+ * checkpointing as a worker of bloomd does
+ */
+static void* worker_main(void *in) {
+    worker *w = in;
+    bloom_filtmgr_cache cache;
+    memset(&cache, 0, sizeof(cache));
+    char name[32], key_buf[MAX_BATCH][24], results[MAX_BATCH];
+    char *keys[MAX_BATCH];
+    for (int i=0; i < BATCH; i++) keys[i] = key_buf[i];
+
+    filtmgr_client_checkpoint(MGR);
+    while (__atomic_load_n(&RUNNING, __ATOMIC_RELAXED)) {
+        uint64_t r = next_rand(&w->rng);
+        snprintf(name, sizeof(name), "bench%d", (int)(r % NUM_FILTERS));
+        for (int i=0; i < BATCH; i++)
+            snprintf(key_buf[i], sizeof(key_buf[i]), "key%llu",
+                    (unsigned long long)(next_rand(&w->rng) % 10000000));
+
+        int res;
+        int check = (r >> 32) % 1000 < READS * 1000;
+        bloom_filtmgr_cache *c = (USE_CACHE) ? &cache : NULL;
+        if (check) {
+            res = filtmgr_check_keys_len(MGR, c, name, keys, NULL, BATCH, results);
+        } else {
+            res = filtmgr_set_keys_len(MGR, c, name, keys, NULL, BATCH, results);
+        }
+        if (res) w->errors++;
+        if (!(++w->calls % CHECKPOINT_CALLS)) filtmgr_client_checkpoint(MGR);
+    }
+    filtmgr_client_leave(MGR);
+    return NULL;
+}
+
+/**
+ * Creates and drops filters at CHURN_RATE until stopped,
+ * keeping CHURN_LIVE of them alive
+ */
+static void* churn_main(void *in) {
+    uint64_t *ops = in;
+    char name[32];
+    uint64_t start = now_usec();
+    int first = CHURN_NEXT, created = 0, dropped = 0;
+    filtmgr_client_checkpoint(MGR);
+    while (__atomic_load_n(&RUNNING, __ATOMIC_RELAXED)) {
+        uint64_t due = start + *ops * 1000000ULL / CHURN_RATE;
+        uint64_t now = now_usec();
+        if (due > now) {
+            usleep(due - now);
+            continue;
+        }
+        if (created - dropped < CHURN_LIVE) {
+            snprintf(name, sizeof(name), "churn%d", first + created++);
+            filtmgr_create_filter(MGR, name, NULL);
+        } else {
+            snprintf(name, sizeof(name), "churn%d", first + dropped++);
+            filtmgr_drop_filter(MGR, name);
+        }
+        (*ops)++;
+        filtmgr_client_checkpoint(MGR);
+    }
+
+    // Leave nothing behind for the next step
+    for (int i=dropped; i < created; i++) {
+        snprintf(name, sizeof(name), "churn%d", first + i);
+        filtmgr_drop_filter(MGR, name);
+    }
+    CHURN_NEXT = first + created;
+    filtmgr_client_leave(MGR);
+    return NULL;
+}
+
+/**
+ * Runs a step with a number of threads, and reports it
+ */
+static void run_step(int threads) {
+    worker *workers = calloc(threads, sizeof(worker));
+    pthread_t churn;
+    uint64_t churn_ops = 0;
+
+    __atomic_store_n(&RUNNING, 1, __ATOMIC_RELEASE);
+    uint64_t start = now_usec();
+    for (int i=0; i < threads; i++) {
+        workers[i].rng = (start + 1) * (i + 1) * 0x9E3779B97F4A7C15ULL;
+        pthread_create(&workers[i].thread, NULL, worker_main, workers + i);
+    }
+    if (CHURN_RATE) pthread_create(&churn, NULL, churn_main, &churn_ops);
+
+    // Sample the backlog while the step runs
+    uint64_t end = start + SECONDS * 1000000ULL, samples = 0, sum = 0, max = 0;
+    for (uint64_t now = start; now < end; now = now_usec()) {
+        usleep(SAMPLE_USEC);
+        unsigned long long backlog = filtmgr_version_backlog(MGR);
+        sum += backlog;
+        samples++;
+        if (backlog > max) max = backlog;
+    }
+    __atomic_store_n(&RUNNING, 0, __ATOMIC_RELEASE);
+    uint64_t secs_usec = now_usec() - start;
+
+    uint64_t calls = 0, errors = 0;
+    for (int i=0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        calls += workers[i].calls;
+        errors += workers[i].errors;
+    }
+    if (CHURN_RATE) pthread_join(churn, NULL);
+
+    double secs = secs_usec / 1e6;
+    printf("%7d %12.0f %12.0f %12.0f %10.0f %10.1f %8llu %8llu\n", threads,
+            calls / secs, calls * BATCH / secs, calls / secs / threads, churn_ops / secs,
+            (samples) ? (double)sum / samples : 0, (unsigned long long)max,
+            (unsigned long long)errors);
+    fflush(stdout);
+    free(workers);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n\
+  -t threads    Most worker threads, doubled from 1, defaults to 8\n\
+  -f filters    Filters the workers use, defaults to 64\n\
+  -b batch      Keys per call, defaults to 1\n\
+  -r reads      Fraction of the calls that are checks, defaults to 0.9\n\
+  -s seconds    Length of each step, defaults to 3\n\
+  -c rate       Creates and drops per second, 0 for none, defaults to 100\n\
+  -k calls      Calls between client checkpoints, defaults to 16\n\
+  -n            Look the filter up on every call, without a cache\n\
+  -p            Persist the filters, instead of keeping them in memory\n\
+  -d dir        The data directory, defaults to /tmp/bench_filtmgr\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:b:r:s:c:k:npd:")) != -1) {
+        switch (opt) {
+            case 't': MAX_THREAD_COUNT = atoi(optarg); break;
+            case 'f': NUM_FILTERS = atoi(optarg); break;
+            case 'b': BATCH = atoi(optarg); break;
+            case 'r': READS = atof(optarg); break;
+            case 's': SECONDS = atoi(optarg); break;
+            case 'c': CHURN_RATE = atoi(optarg); break;
+            case 'k': CHECKPOINT_CALLS = atoi(optarg); break;
+            case 'n': USE_CACHE = 0; break;
+            case 'p': PERSIST = 1; break;
+            case 'd': DATA_DIR = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (MAX_THREAD_COUNT < 1 || MAX_THREAD_COUNT > MAX_THREADS || NUM_FILTERS < 1 ||
+            BATCH < 1 || BATCH > MAX_BATCH || READS < 0 || READS > 1 || SECONDS < 1 ||
+            CHURN_RATE < 0 || CHECKPOINT_CALLS < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bloom_config *config = calloc(1, sizeof(bloom_config));
+    if (config_from_filename(NULL, config)) return 1;
+    config->data_dir = DATA_DIR;
+    config->in_memory = !PERSIST;
+    config->flush_interval = 0;
+    config->cold_interval = 0;
+    if (validate_config(config)) return 1;
+    if (init_filter_manager(config, 1, &MGR)) {
+        fprintf(stderr, "Failed to start the filter manager in %s!\n", DATA_DIR);
+        return 1;
+    }
+
+    char name[32];
+    filtmgr_client_checkpoint(MGR);
+    for (int i=0; i < NUM_FILTERS; i++) {
+        snprintf(name, sizeof(name), "bench%d", i);
+        if (filtmgr_create_filter(MGR, name, NULL) == -2) {
+            fprintf(stderr, "Failed to create filter %s!\n", name);
+            return 1;
+        }
+    }
+    filtmgr_client_leave(MGR);
+
+    printf("%d filters, batch %d, %.0f%% checks, %d churn/s, checkpoint every %d calls, %s\n",
+            NUM_FILTERS, BATCH, READS * 100, CHURN_RATE, CHECKPOINT_CALLS,
+            (USE_CACHE) ? "cached lookups" : "uncached lookups");
+    printf("%7s %12s %12s %12s %10s %10s %8s %8s\n", "threads", "calls/s", "keys/s",
+            "calls/s/thr", "churn/s", "backlog", "max", "errors");
+    for (int threads=1; threads <= MAX_THREAD_COUNT; threads *= 2) {
+        run_step(threads);
+        if (threads < MAX_THREAD_COUNT && threads * 2 > MAX_THREAD_COUNT) run_step(MAX_THREAD_COUNT);
+    }
+
+    // Leave the data directory as it was
+    filtmgr_client_checkpoint(MGR);
+    for (int i=0; i < NUM_FILTERS; i++) {
+        snprintf(name, sizeof(name), "bench%d", i);
+        filtmgr_drop_filter(MGR, name);
+    }
+    filtmgr_client_leave(MGR);
+    destroy_filter_manager(MGR);
+    free(config);
+    return 0;
+}
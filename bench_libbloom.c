@@ -0,0 +1,401 @@
+/*
+ * Measures the primitives of libbloom in isolation: hashing,
+ * bf_add and bf_contains, sbf_add and sbf_contains, and
+ * bitmap_flush. Filter sizes are swept from cache resident up to
+ * a configurable limit, along with the key length, k, the layers
+ * of an SBF and the bitmap mode. Each result is the time per
+ * operation, and the last level cache misses per operation where
+ * the hardware counters can be read.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bloom.h"
+#include "sbf.h"
+
+/**
+ * The smallest filter measured, which fits in the L2 cache
+ */
+#define MIN_FILTER_BYTES (256 * 1024ULL)
+
+/**
+ * The filter size the bitmap modes and key lengths are measured at
+ */
+#define MODE_FILTER_BYTES (64 * 1024 * 1024ULL)
+
+/**
+ * The capacity of the first layer of the SBFs measured
+ */
+#define SBF_INITIAL_CAPACITY 10000
+
+static int NUM_OPS = 1000000;
+static uint64_t MAX_BYTES = 1024 * 1024 * 1024ULL;
+static char *DATA_DIR = "/tmp";
+static volatile uint64_t SINK;      // Keeps the loops from being optimized out
+static int PERF_FD = -1;
+
+/**
+ * A set of keys of one length, back to back in a single buffer
+ */
+typedef struct {
+    char *buf;
+    int len;
+    int num;
+} key_set;
+
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Opens a counter of the last level cache misses of this
+ * thread. Virtual machines and a high perf_event_paranoid
+ * often do not allow it, the misses are then not reported.
+ */
+static void perf_open() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    PERF_FD = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start() {
+    if (PERF_FD == -1) return;
+    ioctl(PERF_FD, PERF_EVENT_IOC_RESET, 0);
+    ioctl(PERF_FD, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/**
+ * @return The misses since perf_start, or -1 without a counter
+ */
+static int64_t perf_stop() {
+    if (PERF_FD == -1) return -1;
+    ioctl(PERF_FD, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count;
+    if (read(PERF_FD, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+}
+
+/**
+ * Makes distinct keys of a given length, from a seed so the
+ * keys that are present and absent do not overlap
+ */
+static void make_keys(key_set *keys, int len, int num, int seed) {
+    keys->len = len;
+    keys->num = num;
+    keys->buf = malloc((uint64_t)len * num + 32);
+    char tmp[32];
+    for (int i=0; i < num; i++) {
+        char *key = keys->buf + (uint64_t)len * i;
+        memset(key, 'k', len);
+
+        // Short keys keep the tail, where the keys differ
+        int n = snprintf(tmp, sizeof(tmp), "%d:%d", seed, i);
+        int copy = (n < len) ? n : len;
+        memcpy(key + len - copy, tmp + n - copy, copy);
+    }
+}
+
+static char* key_at(key_set *keys, int i) {
+    return keys->buf + (uint64_t)keys->len * i;
+}
+
+/**
+ * Prints the cost of a measured loop
+ */
+static void report(char *op, char *args, uint64_t start, uint64_t end, int64_t misses, uint64_t ops) {
+    printf("%-18s %-36s %10.1f ns/op", op, args, (double)(end - start) / ops);
+    if (misses >= 0) printf(" %8.2f miss/op", (double)misses / ops);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void size_name(uint64_t bytes, char *buf, int len) {
+    if (bytes >= 1024 * 1024 * 1024ULL) {
+        snprintf(buf, len, "%lluGB", (unsigned long long)(bytes >> 30));
+    } else if (bytes >= 1024 * 1024) {
+        snprintf(buf, len, "%lluMB", (unsigned long long)(bytes >> 20));
+    } else {
+        snprintf(buf, len, "%lluKB", (unsigned long long)(bytes >> 10));
+    }
+}
+
+static char* mode_name(bitmap_mode mode) {
+    if (mode & SHARED) return "shared";
+    if (mode & PERSISTENT) return "persistent";
+    return "anonymous";
+}
+
+/**
+ * Maps a bitmap in a mode, backed by a new file unless anonymous
+ * @return 0 on success
+ */
+static int open_bitmap(bitmap_mode mode, uint64_t bytes, bloom_bitmap *map) {
+    if (mode & ANONYMOUS) return bitmap_from_file(-1, bytes, ANONYMOUS, map);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/bench_libbloom.mmap", DATA_DIR);
+    unlink(path);
+    int res = bitmap_from_filename(path, bytes, 1, (mode & PERSISTENT) ? mode | NEW_BITMAP : mode, map);
+    unlink(path);
+    return res;
+}
+
+/**
+ * Measures hashing over the key lengths, hash families and k
+ */
+static void bench_hashes() {
+    int lens[] = {8, 16, 32, 64, 256};
+    uint32_t ks[] = {4, 8, 16};
+    bloom_hash_family families[] = {HASH_MURMUR_SPOOKY, HASH_WYHASH};
+    uint64_t hashes[16];
+    char args[128];
+
+    for (unsigned l=0; l < sizeof(lens) / sizeof(int); l++) {
+        key_set keys;
+        make_keys(&keys, lens[l], NUM_OPS, 0);
+        for (unsigned f=0; f < sizeof(families) / sizeof(families[0]); f++) {
+            for (unsigned k=0; k < sizeof(ks) / sizeof(uint32_t); k++) {
+                perf_start();
+                uint64_t start = now_nsec();
+                for (int i=0; i < NUM_OPS; i++) {
+                    bf_compute_hashes_len(families[f], ks[k], key_at(&keys, i), keys.len, hashes);
+                    SINK += hashes[0];
+                }
+                uint64_t end = now_nsec();
+                snprintf(args, sizeof(args), "%s key=%d k=%u",
+                        (families[f] == HASH_WYHASH) ? "wyhash" : "murmur_spooky", lens[l], ks[k]);
+                report("hashes", args, start, end, perf_stop(), NUM_OPS);
+            }
+        }
+        free(keys.buf);
+    }
+}
+
+/**
+ * Measures adds, checks of present keys and checks of absent
+ * keys on a single filter
+ */
+static void bench_filter(bitmap_mode mode, uint64_t bytes, uint32_t k, key_set *present, key_set *absent) {
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    if (open_bitmap(mode, bytes, &map)) {
+        fprintf(stderr, "Failed to create a %llu byte filter!\n", (unsigned long long)bytes);
+        return;
+    }
+
+    // Fault the bitmap in first, so the adds do not measure page faults
+    memset(map.mmap, 0, map.size);
+    bf_from_bitmap(&map, k, 1, &filter);
+
+    char args[128], size[16];
+    size_name(bytes, size, sizeof(size));
+    snprintf(args, sizeof(args), "size=%s k=%u key=%d %s", size, k, present->len, mode_name(mode));
+
+    perf_start();
+    uint64_t start = now_nsec();
+    for (int i=0; i < present->num; i++)
+        SINK += bf_add_len(&filter, key_at(present, i), present->len);
+    uint64_t end = now_nsec();
+    report("bf_add", args, start, end, perf_stop(), present->num);
+
+    perf_start();
+    start = now_nsec();
+    for (int i=0; i < present->num; i++)
+        SINK += bf_contains_len(&filter, key_at(present, i), present->len);
+    end = now_nsec();
+    report("bf_contains", args, start, end, perf_stop(), present->num);
+
+    perf_start();
+    start = now_nsec();
+    for (int i=0; i < absent->num; i++)
+        SINK += bf_contains_len(&filter, key_at(absent, i), absent->len);
+    end = now_nsec();
+    report("bf_contains_miss", args, start, end, perf_stop(), absent->num);
+
+    bf_close(&filter);
+}
+
+/**
+ * Sweeps the filter size and k, then the key length and
+ * the bitmap mode at a fixed size
+ */
+static void bench_filters() {
+    key_set present, absent;
+    make_keys(&present, 16, NUM_OPS, 0);
+    make_keys(&absent, 16, NUM_OPS, 1);
+    uint32_t ks[] = {4, 8, 16};
+    for (uint64_t bytes = MIN_FILTER_BYTES; bytes <= MAX_BYTES; bytes *= 4) {
+        for (unsigned k=0; k < sizeof(ks) / sizeof(uint32_t); k++)
+            bench_filter(ANONYMOUS, bytes, ks[k], &present, &absent);
+    }
+
+    uint64_t bytes = (MODE_FILTER_BYTES < MAX_BYTES) ? MODE_FILTER_BYTES : MAX_BYTES;
+    bench_filter(PERSISTENT, bytes, 8, &present, &absent);
+    bench_filter(SHARED, bytes, 8, &present, &absent);
+    free(present.buf);
+    free(absent.buf);
+
+    int lens[] = {8, 64, 256};
+    for (unsigned l=0; l < sizeof(lens) / sizeof(int); l++) {
+        make_keys(&present, lens[l], NUM_OPS, 0);
+        make_keys(&absent, lens[l], NUM_OPS, 1);
+        bench_filter(ANONYMOUS, bytes, 8, &present, &absent);
+        free(present.buf);
+        free(absent.buf);
+    }
+}
+
+/**
+ * Measures adds while an SBF grows to a number of layers, then
+ * checks of present and absent keys, which probe every layer
+ */
+static void bench_sbf(uint32_t layers) {
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = SBF_INITIAL_CAPACITY;
+    params.scale_size = 2;
+    bloom_sbf sbf;
+    if (sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf)) {
+        fprintf(stderr, "Failed to create an SBF!\n");
+        return;
+    }
+
+    // Each layer takes twice the keys of the one before
+    int num = SBF_INITIAL_CAPACITY * ((1 << layers) - 1) - SBF_INITIAL_CAPACITY / 2;
+    key_set present, absent;
+    make_keys(&present, 16, num, 0);
+    make_keys(&absent, 16, NUM_OPS, 1);
+    char args[128];
+
+    perf_start();
+    uint64_t start = now_nsec();
+    for (int i=0; i < num; i++)
+        SINK += sbf_add_len(&sbf, key_at(&present, i), present.len);
+    uint64_t end = now_nsec();
+    snprintf(args, sizeof(args), "layers=%u key=16", sbf.num_filters);
+    report("sbf_add", args, start, end, perf_stop(), num);
+
+    int ops = (num < NUM_OPS) ? num : NUM_OPS;
+    perf_start();
+    start = now_nsec();
+    for (int i=0; i < ops; i++)
+        SINK += sbf_contains_len(&sbf, key_at(&present, i), present.len);
+    end = now_nsec();
+    report("sbf_contains", args, start, end, perf_stop(), ops);
+
+    perf_start();
+    start = now_nsec();
+    for (int i=0; i < absent.num; i++)
+        SINK += sbf_contains_len(&sbf, key_at(&absent, i), absent.len);
+    end = now_nsec();
+    report("sbf_contains_miss", args, start, end, perf_stop(), absent.num);
+
+    sbf_close(&sbf);
+    free(present.buf);
+    free(absent.buf);
+}
+
+/**
+ * Measures bitmap_flush with a fraction of the pages dirty
+ */
+static void bench_flush(bitmap_mode mode, uint64_t bytes, int percent) {
+    bloom_bitmap map;
+    if (open_bitmap(mode, bytes, &map)) {
+        fprintf(stderr, "Failed to create a %llu byte bitmap!\n", (unsigned long long)bytes);
+        return;
+    }
+    bitmap_flush(&map);
+
+    // Dirty an even spread of the pages
+    uint64_t pages = bytes / 4096, dirty = 0;
+    for (uint64_t p=0; p < pages; p++) {
+        if ((p * percent) % 100 >= (uint64_t)percent) continue;
+        map.mmap[p * 4096] = 1;
+        bitmap_mark_dirty(&map, p * 4096 * 8);
+        dirty++;
+    }
+
+    perf_start();
+    uint64_t start = now_nsec();
+    bitmap_flush(&map);
+    uint64_t end = now_nsec();
+    int64_t misses = perf_stop();
+
+    char args[128], size[16];
+    size_name(bytes, size, sizeof(size));
+    snprintf(args, sizeof(args), "size=%s dirty=%d%% %s", size, percent, mode_name(mode));
+    report("bitmap_flush", args, start, end, misses, (dirty) ? dirty : 1);
+    bitmap_close(&map);
+}
+
+static void bench_flushes() {
+    uint64_t bytes = (MODE_FILTER_BYTES < MAX_BYTES) ? MODE_FILTER_BYTES : MAX_BYTES;
+    bitmap_mode modes[] = {ANONYMOUS, PERSISTENT, SHARED};
+    int percents[] = {1, 10, 100};
+    for (unsigned m=0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        for (unsigned p=0; p < sizeof(percents) / sizeof(int); p++)
+            bench_flush(modes[m], bytes, percents[p]);
+    }
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-n ops] [-m max_mb] [-d dir] [hashes|filter|sbf|flush]...\n\
+  -n ops      Operations per measurement, defaults to 1000000\n\
+  -m max_mb   Largest filter measured, defaults to 1024, up to 16384\n\
+  -d dir      Directory of the file backed bitmaps, defaults to /tmp\n\
+Runs every suite if none is named. bitmap_flush is reported per dirty page.\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:d:")) != -1) {
+        switch (opt) {
+            case 'n': NUM_OPS = atoi(optarg); break;
+            case 'm': MAX_BYTES = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
+            case 'd': DATA_DIR = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (NUM_OPS <= 0 || MAX_BYTES < MIN_FILTER_BYTES || MAX_BYTES > 16384 * 1024 * 1024ULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    perf_open();
+    if (PERF_FD == -1) printf("Cache miss counters are not available: %s\n", strerror(errno));
+
+    int all = (optind == argc);
+    for (int i=optind; i < argc; i++) {
+        if (strcmp(argv[i], "hashes") && strcmp(argv[i], "filter") &&
+                strcmp(argv[i], "sbf") && strcmp(argv[i], "flush")) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for (int i=optind; all || i < argc; i++) {
+        char *suite = (all) ? NULL : argv[i];
+        if (!suite || !strcmp(suite, "hashes")) bench_hashes();
+        if (!suite || !strcmp(suite, "filter")) bench_filters();
+        if (!suite || !strcmp(suite, "sbf")) {
+            for (uint32_t layers=1; layers <= 8; layers *= 2) bench_sbf(layers);
+        }
+        if (!suite || !strcmp(suite, "flush")) bench_flushes();
+        all = 0;
+    }
+    if (PERF_FD != -1) close(PERF_FD);
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Measures the cost of determining the command of a line,
+ * without any networking. The command parser is static, so
+ * the connection handler is included directly.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "src/bloomd/conn_handler.c"
+
+static int NUM_LINES = 10000000;
+static volatile int SINK;   // Keeps the loops from being optimized out
+
+static char *LINES[] = {
+    "c foobar key_1234567\n",
+    "s foobar key_1234567\n",
+    "m foobar key_1 key_2 key_3\n",
+    "b foobar key_1 key_2 key_3\n",
+    "check foobar key_1234567\r\n",
+    "set foobar key_1234567\r\n",
+    "multi_unset foobar key_1 key_2\n",
+    "info foobar\n",
+    "stats\n",
+    "bogus foobar\n",
+};
+#define NUM_TEMPLATES (sizeof(LINES) / sizeof(char*))
+
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Parses one template NUM_LINES times. The parser
+ * terminates the line in place, so it is copied first.
+ * @return The nanoseconds spent per line
+ */
+static double bench_line(char *line, conn_cmd_type *type) {
+    int len = strlen(line);
+    char buf[128];
+    char *arg_buf;
+    int arg_len;
+
+    uint64_t start = now_nsec();
+    for (int i=0; i < NUM_LINES; i++) {
+        memcpy(buf, line, len);
+        buf[len-1] = '\0';
+        *type = determine_client_command(buf, len, &arg_buf, &arg_len);
+        SINK += *type;
+    }
+    uint64_t end = now_nsec();
+    return (double)(end - start) / NUM_LINES;
+}
+
+/**
+ * Measures the memcpy of the template alone,
+ * so it can be subtracted from the results.
+ */
+static double bench_copy(char *line) {
+    int len = strlen(line);
+    char buf[128];
+    uint64_t start = now_nsec();
+    for (int i=0; i < NUM_LINES; i++) {
+        memcpy(buf, line, len);
+        buf[len-1] = '\0';
+        SINK += buf[0];
+    }
+    uint64_t end = now_nsec();
+    return (double)(end - start) / NUM_LINES;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) NUM_LINES = atoi(argv[1]);
+    if (NUM_LINES <= 0) {
+        printf("Usage: %s [lines]\n", argv[0]);
+        return 1;
+    }
+
+    conn_cmd_type type = UNKNOWN;
+    double total, copy;
+    for (unsigned i=0; i < NUM_TEMPLATES; i++) {
+        total = bench_line(LINES[i], &type);
+        copy = bench_copy(LINES[i]);
+        printf("%-32.*s type %2d  %6.2f ns/line (%.2f ns copying)\n",
+                (int)strcspn(LINES[i], "\r\n"), LINES[i], type, total - copy, copy);
+    }
+    return 0;
+}
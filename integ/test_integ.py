@@ -2,6 +2,7 @@ import os
 import os.path
 import shutil
 import socket
+import struct
 import subprocess
 import sys
 import tempfile
@@ -27,7 +28,8 @@ def pytest_funcarg__servers(request):
     conf = """[bloomd]
 data_dir = %(dir)s
 port = %(port)d
-""" % {"dir": tmpdir, "port": port}
+udp_port = %(udp_port)d
+""" % {"dir": tmpdir, "port": port, "udp_port": port + 1}
     open(config_path, "w").write(conf)
 
     # Start the process
@@ -97,6 +99,47 @@ class TestInteg(object):
         assert "foobar2" in fh.readline()
         assert fh.readline() == "END\n"
 
+    def test_list_pages(self, servers):
+        "Tests listing in pages"
+        server, _ = servers
+        fh = server.makefile()
+        for name in ("foobar1", "foobar2", "foobar3"):
+            server.sendall("create %s\n" % name)
+            assert fh.readline() == "Done\n"
+        time.sleep(1) # Wait for vacuum
+        server.sendall("list foo limit=2\n")
+        assert fh.readline() == "START\n"
+        assert "foobar1" in fh.readline()
+        assert "foobar2" in fh.readline()
+        assert fh.readline() == "END\n"
+        server.sendall("list foo limit=2 after=foobar2\n")
+        assert fh.readline() == "START\n"
+        assert "foobar3" in fh.readline()
+        assert fh.readline() == "END\n"
+        server.sendall("list foo limit=x\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+
+    def test_stats(self, servers):
+        "Tests the server wide stats"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("s foobar test\n")
+        assert fh.readline() == "Yes\n"
+        server.sendall("stats\n")
+        assert fh.readline() == "START\n"
+        stats = {}
+        while True:
+            line = fh.readline()
+            if line == "END\n":
+                break
+            key, val = line.split()
+            stats[key] = val
+        assert stats["filters"] == "1"
+        assert stats["sets"] == "1"
+        assert int(stats["connections"]) >= 1
+
     def test_create(self, servers):
         "Tests creating a filter"
         server, _ = servers
@@ -214,6 +257,46 @@ class TestInteg(object):
         server.sendall("bulk foobar test blah\n")
         assert fh.readline() == "Yes Yes\n"
 
+    def test_bulk_reject_full(self, servers):
+        "Tests a bulk set that overflows a full fixed filter is rejected whole"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar capacity=10001 scalable=0 reject_full=1\n")
+        assert fh.readline() == "Done\n"
+
+        def size():
+            server.sendall("list foobar\n")
+            assert fh.readline() == "START\n"
+            line = fh.readline()
+            assert fh.readline() == "END\n"
+            return int(line.split()[-1])
+
+        # Fill the filter until a bulk no longer fits
+        for i in xrange(11):
+            keys = " ".join("key%d_%d" % (i, j) for j in xrange(1000))
+            server.sendall("bulk foobar %s\n" % keys)
+            resp = fh.readline()
+            if resp == "Filter is full\n":
+                break
+            before = size()
+        assert resp == "Filter is full\n"
+
+        # None of the rejected keys were set
+        assert size() == before
+        server.sendall("multi foobar key%d_0 key%d_999\n" % (i, i))
+        assert fh.readline() == "No No\n"
+
+        # Sets of known keys, and batches that fit, are still taken
+        server.sendall("bulk foobar key0_0 key0_1\n")
+        assert fh.readline() == "No No\n"
+        room = 10001 - before
+        if room:
+            keys = " ".join("more%d" % j for j in xrange(room))
+            server.sendall("bulk foobar %s\n" % keys)
+            assert fh.readline() != "Filter is full\n"
+        server.sendall("set foobar rejected\n")
+        assert fh.readline() == "Filter is full\n"
+
     def test_doubleset(self, servers):
         "Tests setting a value"
         server, _ = servers
@@ -249,6 +332,96 @@ class TestInteg(object):
         server.sendall("multi foobar test test1 test2\n")
         assert fh.readline() == "Yes No No\n"
 
+    def test_pipelined(self, servers):
+        "Tests pipelined checks and sets are answered in order"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+
+        # A repeated set in the same run is not new
+        server.sendall("set foobar a\nset foobar b\nset foobar a\ncheck foobar a\n"
+                       "check foobar c\ncheck noexist a\nset foobar c\ncheck foobar c\n")
+        resps = [fh.readline() for _ in xrange(8)]
+        assert resps == ["Yes\n", "Yes\n", "No\n", "Yes\n", "No\n",
+                         "Filter does not exist\n", "Yes\n", "Yes\n"]
+
+        # Long runs are answered in full
+        server.sendall("".join("set foobar key%d\n" % x for x in xrange(1000)))
+        assert [fh.readline() for _ in xrange(1000)] == ["Yes\n"] * 1000
+        server.sendall("".join("check foobar key%d\n" % x for x in xrange(1000)))
+        assert [fh.readline() for _ in xrange(1000)] == ["Yes\n"] * 1000
+
+    def test_udp(self, servers):
+        "Tests sets sent over UDP"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+
+        # Datagrams are not answered, so wait for the sets
+        udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        udp_addr = ("localhost", server.getpeername()[1] + 1)
+        udp.sendto("create other\n", udp_addr)
+        udp.sendto("set foobar test\nbulk foobar test1 test2", udp_addr)
+        for x in xrange(10):
+            server.sendall("multi foobar test test1 test2\n")
+            if fh.readline() == "Yes Yes Yes\n":
+                break
+            time.sleep(0.1)
+        else:
+            assert False
+
+        # Other commands are rejected
+        server.sendall("stats\n")
+        assert fh.readline() == "START\n"
+        stats = {}
+        while True:
+            line = fh.readline()
+            if line == "END\n":
+                break
+            key, val = line.split()
+            stats[key] = val
+        assert stats["udp_datagrams"] == "2"
+        assert stats["udp_rejects"] == "1"
+        assert stats["filters"] == "1"
+
+    def test_hex(self, servers):
+        "Tests setting and checking with hex bitsets"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk_hex foobar a b c d e\n")
+        assert fh.readline() == "f8\n"
+        server.sendall("bulk_hex foobar a b f\n")
+        assert fh.readline() == "2\n"
+        server.sendall("multi_hex foobar a x b y c\n")
+        assert fh.readline() == "a8\n"
+        server.sendall("multi_hex noexist a\n")
+        assert fh.readline() == "Filter does not exist\n"
+
+    def test_noreply(self, servers):
+        "Tests that sets are not answered with noreply on"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("noreply on\n")
+        assert fh.readline() == "Done\n"
+
+        # Only the failed set and the check are answered
+        server.sendall("set foobar test\nbulk foobar test1 test2\nset noexist test\ncheck foobar test2\n")
+        assert fh.readline() == "Filter does not exist\n"
+        assert fh.readline() == "Yes\n"
+
+        server.sendall("noreply off\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("set foobar test3\n")
+        assert fh.readline() == "Yes\n"
+        server.sendall("noreply maybe\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+
     def test_aliases(self, servers):
         "Tests aliases"
         server, _ = servers
@@ -451,6 +624,76 @@ class TestInteg(object):
         assert "test:create:filter:with:long:prefix:2" in fh.readline()
         assert fh.readline() == "END\n"
 
+    def test_binary_check_set(self, servers):
+        "Tests set and check with the binary protocol"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("binary\n")
+        assert fh.readline() == "Done\n"
+
+        def request(op, name, keys):
+            body = name + "".join(struct.pack("!H", len(k)) + k for k in keys)
+            return struct.pack("!BBHII", 0xB1, op, len(name), len(keys), len(body)) + body
+
+        def response():
+            magic, status, _, num = struct.unpack("!BBHI", fh.read(8))
+            assert magic == 0xB2
+            bits = fh.read((num + 7) / 8) if num else ""
+            return status, [(ord(bits[i / 8]) >> (i % 8)) & 1 for i in xrange(num)]
+
+        server.sendall(request(2, "foobar", ["test1", "test3"]))
+        assert response() == (0, [1, 1])
+        server.sendall(request(1, "foobar", ["test1", "test2", "test3"]))
+        assert response() == (0, [1, 0, 1])
+        server.sendall(request(1, "noexist", ["test1"]))
+        assert response() == (1, [])
+
+    def test_tagged(self, servers):
+        "Tests that the responses of tagged commands echo the tag"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("#1 create foobar\n")
+        assert fh.readline() == "#1 Done\n"
+        server.sendall("#a set foobar test\n")
+        assert fh.readline() == "#a Yes\n"
+        server.sendall("#b check foobar test\n#c check foobar blah\n")
+        assert fh.readline() == "#b Yes\n"
+        assert fh.readline() == "#c No\n"
+        server.sendall("#d multi noexist test\n")
+        assert fh.readline() == "#d Filter does not exist\n"
+
+    def test_tagged_mixed(self, servers):
+        "Tests tagged commands mixed with untagged commands"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("#x set foobar test\nset foobar test1\n#y check foobar test\ncheck foobar blah\n")
+        assert fh.readline() == "#x Yes\n"
+        assert fh.readline() == "Yes\n"
+        assert fh.readline() == "#y Yes\n"
+        assert fh.readline() == "No\n"
+
+    def test_tagged_out_of_order(self, servers):
+        "Tests that a tagged check of a closed filter may be answered last"
+        server, _ = servers
+        fh = server.makefile()
+        for name in ("cold", "hot"):
+            server.sendall("create %s\n" % name)
+            assert fh.readline() == "Done\n"
+        server.sendall("set cold test\n")
+        assert fh.readline() == "Yes\n"
+        server.sendall("close cold\n")
+        assert fh.readline() == "Done\n"
+
+        # The order depends on the fault, the tags tell them apart
+        server.sendall("#1 check cold test\n#2 check hot test\ncheck hot blah\n")
+        resps = [fh.readline() for _ in xrange(3)]
+        assert sorted(resps) == ["#1 Yes\n", "#2 No\n", "No\n"]
+        assert resps.index("#2 No\n") < resps.index("No\n")
+
 if __name__ == "__main__":
     sys.exit(pytest.main(args="-k TestInteg."))
 
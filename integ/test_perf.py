@@ -0,0 +1,231 @@
+"""
+Performance regression suite. Boots ./bloomd with fixed configurations
+and drives it with the ./bench load generator through canonical
+scenarios, comparing each result against a stored baseline.
+
+It only runs when BLOOMD_PERF is set, as its results depend on the
+machine:
+
+    BLOOMD_PERF=1 py.test integ/test_perf.py
+
+The baselines are kept in integ/perf_baselines.json, or the file
+named by BLOOMD_PERF_BASELINES. A result without a baseline is
+recorded as the baseline, and BLOOMD_PERF_RECORD=1 records every
+result. A result fails when it is worse than its baseline by more
+than BLOOMD_PERF_TOLERANCE, 0.25 by default.
+"""
+import json
+import os
+import os.path
+import random
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+try:
+    import pytest
+except ImportError:
+    sys.stderr.write("Integ tests require pytests!\n")
+    sys.exit(1)
+
+pytestmark = pytest.mark.skipif("'BLOOMD_PERF' not in os.environ")
+
+BASELINES = os.environ.get("BLOOMD_PERF_BASELINES",
+        os.path.join(os.path.dirname(os.path.abspath(__file__)), "perf_baselines.json"))
+TOLERANCE = float(os.environ.get("BLOOMD_PERF_TOLERANCE", "0.25"))
+RECORD = "BLOOMD_PERF_RECORD" in os.environ
+
+
+class Server(object):
+    "Runs ./bloomd in a temporary data directory"
+    def __init__(self, extra_config=""):
+        self.tmpdir = tempfile.mkdtemp()
+        self.port = random.randint(2000, 60000)
+        config_path = os.path.join(self.tmpdir, "config.cfg")
+        conf = """[bloomd]
+data_dir = %(dir)s
+port = %(port)d
+udp_port = 0
+log_level = WARN
+""" % {"dir": self.tmpdir, "port": self.port}
+        open(config_path, "w").write(conf + extra_config)
+        self.proc = subprocess.Popen(["./bloomd", "-f", config_path])
+
+        for x in range(10):
+            try:
+                self.conn = self.connect()
+                return
+            except socket.error:
+                time.sleep(0.5)
+        self.stop()
+        raise EnvironmentError("Failed to connect!")
+
+    def connect(self):
+        conn = socket.create_connection(("localhost", self.port), 5)
+        return conn
+
+    def command(self, cmd, conn=None):
+        "Sends a command, and returns its single line reply"
+        conn = conn or self.conn
+        conn.sendall((cmd + "\n").encode())
+        reply = b""
+        while not reply.endswith(b"\n"):
+            chunk = conn.recv(4096)
+            if not chunk:
+                raise EnvironmentError("Connection closed!")
+            reply += chunk
+        return reply.decode().strip()
+
+    def stop(self):
+        try:
+            self.proc.kill()
+            self.proc.wait()
+        except OSError:
+            pass
+        shutil.rmtree(self.tmpdir, True)
+
+
+def run_bench(server, args):
+    "Runs ./bench against a server, and parses its summary"
+    cmd = ["./bench", "-p", str(server.port), "-i", "60"] + args
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE)
+    out = proc.communicate()[0].decode()
+    assert proc.returncode == 0, out
+
+    result = {}
+    match = re.search(r"Throughput: (\d+) cmd/s, (\d+) keys/s", out)
+    result["cmd_per_sec"] = float(match.group(1))
+    result["keys_per_sec"] = float(match.group(2))
+    match = re.search(r"Latency: mean ([\d.]+) p50 (\d+) p99 (\d+) p99.9 (\d+)", out)
+    result["mean_usec"] = float(match.group(1))
+    result["p99_usec"] = float(match.group(3))
+    result["p999_usec"] = float(match.group(4))
+    return result
+
+
+def check_baselines(scenario, results):
+    """
+    Compares results against their baselines. Metrics ending in
+    _per_sec are better higher, all others are better lower.
+    """
+    baselines = {}
+    if os.path.exists(BASELINES):
+        baselines = json.load(open(BASELINES))
+    stored = baselines.setdefault(scenario, {})
+
+    failures, recorded = [], False
+    for metric, value in sorted(results.items()):
+        base = stored.get(metric)
+        sys.stdout.write("%s %s: %.1f (baseline %s)\n" % (scenario, metric, value, base))
+        if base is None or RECORD:
+            stored[metric] = value
+            recorded = True
+        elif metric.endswith("_per_sec"):
+            if value < base * (1 - TOLERANCE):
+                failures.append("%s %.1f below baseline %.1f" % (metric, value, base))
+        elif value > base * (1 + TOLERANCE):
+            failures.append("%s %.1f above baseline %.1f" % (metric, value, base))
+
+    if recorded:
+        fh = open(BASELINES, "w")
+        json.dump(baselines, fh, indent=2, sort_keys=True)
+        fh.write("\n")
+        fh.close()
+    assert not failures, "%s regressed: %s" % (scenario, ", ".join(failures))
+
+
+class TestPerf(object):
+    def test_pipelined_checks(self):
+        "Checks from pipelined connections, closed loop"
+        server = Server()
+        try:
+            res = run_bench(server, ["-f", "checks", "-t", "2", "-c", "4", "-d", "32",
+                "-k", "100000", "-r", "1", "-T", "5", "-l"])
+            check_baselines("pipelined_checks", {
+                "cmd_per_sec": res["cmd_per_sec"],
+                "p99_usec": res["p99_usec"]})
+        finally:
+            server.stop()
+
+    def test_bulk_load(self):
+        "Loads new keys with bulk sets"
+        server = Server()
+        try:
+            res = run_bench(server, ["-f", "load", "-t", "2", "-d", "4", "-b", "100",
+                "-k", "100000000", "-r", "0", "-T", "5"])
+            check_baselines("bulk_load", {
+                "keys_per_sec": res["keys_per_sec"],
+                "p99_usec": res["p99_usec"]})
+        finally:
+            server.stop()
+
+    def test_cold_fault_in(self):
+        "Times the first check of a closed filter, which maps it back in"
+        server = Server()
+        try:
+            assert server.command("create cold capacity=10000000") == "Done"
+            keys = " ".join("key%d" % i for i in range(1000))
+            server.command("bulk cold " + keys)
+            times = []
+            for x in range(20):
+                assert server.command("close cold") == "Done"
+                start = time.time()
+                assert server.command("check cold key1") == "Yes"
+                times.append(time.time() - start)
+            times.sort()
+            check_baselines("cold_fault_in", {
+                "median_usec": times[len(times) // 2] * 1e6})
+        finally:
+            server.stop()
+
+    def test_flush_under_load(self):
+        "Latency of an open loop of sets while the filters flush every second"
+        server = Server("flush_interval = 1\n")
+        try:
+            res = run_bench(server, ["-f", "flush", "-c", "4", "-k", "10000000",
+                "-r", "0.5", "-R", "20000", "-T", "6"])
+            check_baselines("flush_under_load", {
+                "cmd_per_sec": res["cmd_per_sec"],
+                "p99_usec": res["p99_usec"],
+                "p999_usec": res["p999_usec"]})
+        finally:
+            server.stop()
+
+    def test_create_drop_storm(self):
+        "Checks and sets on one filter while other filters are created and dropped"
+        server = Server()
+        try:
+            done = threading.Event()
+            ops = [0]
+
+            def storm():
+                conn = server.connect()
+                while not done.is_set():
+                    name = "storm%d" % ops[0]
+                    server.command("create %s in_memory=1" % name, conn)
+                    server.command("drop %s" % name, conn)
+                    ops[0] += 1
+                conn.close()
+
+            # Create the filter before the storm, so the run times the same span
+            server.command("create storm_target")
+            t = threading.Thread(target=storm)
+            start = time.time()
+            t.start()
+            try:
+                res = run_bench(server, ["-f", "storm_target", "-t", "2", "-c", "4",
+                    "-d", "8", "-k", "1000000", "-T", "5"])
+            finally:
+                done.set()
+                t.join()
+            check_baselines("create_drop_storm", {
+                "cmd_per_sec": res["cmd_per_sec"],
+                "p99_usec": res["p99_usec"],
+                "storm_ops_per_sec": ops[0] / (time.time() - start)})
+        finally:
+            server.stop()
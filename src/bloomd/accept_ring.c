@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "accept_ring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_ACCEPT_MULTISHOT)
+#define ACCEPT_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef ACCEPT_HAVE_IO_URING
+
+// Submissions are only the accept and its cancel
+#define ACCEPT_SQ_ENTRIES 2
+
+// Completions are clients waiting to be taken. The accept is
+// stopped by the kernel past this, and armed again once reaped.
+#define ACCEPT_CQ_ENTRIES 256
+
+// The user data of the accept, and of its cancel
+#define ACCEPT_DATA 1
+#define CANCEL_DATA 2
+
+struct bloom_accept_ring {
+    int listen_fd;
+    int ring_fd;
+    int armed;          // Set while the accept posts clients
+    unsigned *sq_tail, *sq_mask, *sq_array, *sq_flags;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/**
+ * Static declarations
+ */
+static int ring_setup(bloom_accept_ring *ring);
+static void ring_teardown(bloom_accept_ring *ring);
+static int ring_enter(bloom_accept_ring *ring, unsigned to_submit, unsigned wait_nr);
+static void ring_queue(bloom_accept_ring *ring, uint8_t opcode, uint64_t user_data);
+static int ring_arm(bloom_accept_ring *ring);
+
+/**
+ * Sets up a ring, and arms a multishot accept on the listener.
+ * The clients are accepted non-blocking and close on exec.
+ * @arg listen_fd The listening socket
+ * @arg ring Output, the ring
+ * @return 0 on success, -ENOTSUP if the kernel has no io_uring
+ * or no multishot accept, or negative on other failures.
+ */
+int accept_ring_create(int listen_fd, bloom_accept_ring **ring) {
+    bloom_accept_ring *r = calloc(1, sizeof(bloom_accept_ring));
+    if (!r) return -ENOMEM;
+    r->listen_fd = listen_fd;
+    int res = ring_setup(r);
+    if (res) {
+        free(r);
+        return (res == -ENOSYS || res == -EPERM) ? -ENOTSUP : res;
+    }
+
+    // Kernels before the multishot accept reject it at
+    // submission, which posts the error right away
+    res = ring_arm(r);
+    unsigned head = *r->cq_head;
+    if (!res && head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = r->cqes + (head & *r->cq_mask);
+        if (cqe->res == -EINVAL && !(cqe->flags & IORING_CQE_F_MORE)) res = -ENOTSUP;
+    }
+    if (res) {
+        ring_teardown(r);
+        free(r);
+        return res;
+    }
+    *ring = r;
+    return 0;
+}
+
+/**
+ * Returns the fd of the ring, to watch for accepted clients
+ */
+int accept_ring_fd(bloom_accept_ring *ring) {
+    return ring->ring_fd;
+}
+
+/**
+ * Takes the next accepted client. The accept is armed again
+ * if the kernel stopped it, which it does on errors and when
+ * the completion queue overflows.
+ * @arg ring The ring
+ * @return The client fd, -EAGAIN if no client is waiting, or
+ * the negative errno of a failed accept.
+ */
+int accept_ring_next(bloom_accept_ring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        // Completions past a full queue are only moved into it on enter
+        if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+            ring_enter(ring, 0, 0);
+            if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return accept_ring_next(ring);
+        }
+        if (!ring->armed) ring_arm(ring);
+        return -EAGAIN;
+    }
+
+    struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+    int res = cqe->res;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (!more) {
+        ring->armed = 0;
+        ring_arm(ring);
+    }
+    return res;
+}
+
+/**
+ * Cancels the accept and closes the ring. Clients accepted
+ * but not taken are closed, the rest wait in the backlog of
+ * the listener.
+ */
+void accept_ring_destroy(bloom_accept_ring *ring) {
+    // The accept posts its last client before the cancel completes
+    ring_queue(ring, IORING_OP_ASYNC_CANCEL, CANCEL_DATA);
+    // Without the cancel, nothing would end the wait
+    int cancelled = 0;
+    if (ring_enter(ring, 1, 0) != 1) {
+        cancelled = 1;
+        ring->armed = 0;
+    }
+    unsigned head;
+    struct io_uring_cqe *cqe;
+    while (!cancelled || ring->armed) {
+        head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (ring_enter(ring, 0, 1) < 0) break;
+            continue;
+        }
+        cqe = ring->cqes + (head & *ring->cq_mask);
+        if (cqe->user_data == CANCEL_DATA) {
+            cancelled = 1;
+        } else {
+            if (cqe->res >= 0) close(cqe->res);
+            if (!(cqe->flags & IORING_CQE_F_MORE)) ring->armed = 0;
+        }
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    ring_teardown(ring);
+    free(ring);
+}
+
+/**
+ * Sets up the io_uring and maps the rings
+ */
+static int ring_setup(bloom_accept_ring *ring) {
+    struct io_uring_params p;
+    int res;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = ACCEPT_CQ_ENTRIES;
+    int fd = syscall(__NR_io_uring_setup, ACCEPT_SQ_ENTRIES, &p);
+    if (fd < 0) return -errno;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto ERROR;
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        goto ERROR;
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        munmap(ring->cq_ring, ring->cq_ring_size);
+        goto ERROR;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->sq_flags = (unsigned*)(sq + p.sq_off.flags);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring->ring_fd = fd;
+    return 0;
+
+ERROR:
+    res = -errno;
+    close(fd);
+    return res;
+}
+
+/**
+ * Unmaps the rings and closes the io_uring
+ */
+static void ring_teardown(bloom_accept_ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+}
+
+/**
+ * Submits the queued entries, and optionally waits for completions.
+ * Without entries to submit, flushes the overflowed completions.
+ * @return The entries submitted, or negative on failure.
+ */
+static int ring_enter(bloom_accept_ring *ring, unsigned to_submit, unsigned wait_nr) {
+    int res;
+    unsigned flags = (wait_nr || !to_submit) ? IORING_ENTER_GETEVENTS : 0;
+    do {
+        res = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr, flags, NULL, 0);
+    } while (res < 0 && errno == EINTR);
+    return (res < 0) ? -errno : res;
+}
+
+/**
+ * Puts the accept, or its cancel, in the submission queue.
+ * Each is submitted right away, so there is always room.
+ */
+static void ring_queue(bloom_accept_ring *ring, uint8_t opcode, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = ring->sqes + idx;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    if (opcode == IORING_OP_ACCEPT) {
+        sqe->fd = ring->listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else {
+        sqe->fd = -1;
+        sqe->addr = ACCEPT_DATA;
+    }
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Arms the multishot accept. An entry the kernel did not
+ * take is dropped, so that a retry does not arm it twice.
+ * @return 0 on success, negative on failure.
+ */
+static int ring_arm(bloom_accept_ring *ring) {
+    unsigned tail = *ring->sq_tail;
+    ring_queue(ring, IORING_OP_ACCEPT, ACCEPT_DATA);
+    int res = ring_enter(ring, 1, 0);
+    if (res == 1) {
+        ring->armed = 1;
+        return 0;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    return (res < 0) ? res : -EAGAIN;
+}
+
+#else
+
+struct bloom_accept_ring {
+    int ring_fd;
+};
+
+int accept_ring_create(int listen_fd, bloom_accept_ring **ring) {
+    (void)listen_fd;
+    (void)ring;
+    return -ENOTSUP;
+}
+
+int accept_ring_fd(bloom_accept_ring *ring) {
+    return ring->ring_fd;
+}
+
+int accept_ring_next(bloom_accept_ring *ring) {
+    (void)ring;
+    return -EAGAIN;
+}
+
+void accept_ring_destroy(bloom_accept_ring *ring) {
+    free(ring);
+}
+
+#endif
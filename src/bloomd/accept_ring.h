@@ -0,0 +1,47 @@
+#ifndef BLOOM_ACCEPT_RING_H
+#define BLOOM_ACCEPT_RING_H
+
+/**
+ * Accepts the clients of a listener with a multishot accept on
+ * an io_uring. A single submission keeps accepting, and the
+ * clients are reaped from the completion queue in user space,
+ * instead of taking an accept4() syscall for each after the
+ * listener polls readable. The ring fd polls readable while
+ * accepted clients wait in the completion queue, so it is
+ * watched by the event loop in place of the listener.
+ */
+typedef struct bloom_accept_ring bloom_accept_ring;
+
+/**
+ * Sets up a ring, and arms a multishot accept on the listener.
+ * The clients are accepted non-blocking and close on exec.
+ * @arg listen_fd The listening socket
+ * @arg ring Output, the ring
+ * @return 0 on success, -ENOTSUP if the kernel has no io_uring
+ * or no multishot accept, or negative on other failures.
+ */
+int accept_ring_create(int listen_fd, bloom_accept_ring **ring);
+
+/**
+ * Returns the fd of the ring, to watch for accepted clients
+ */
+int accept_ring_fd(bloom_accept_ring *ring);
+
+/**
+ * Takes the next accepted client. The accept is armed again
+ * if the kernel stopped it, which it does on errors and when
+ * the completion queue overflows.
+ * @arg ring The ring
+ * @return The client fd, -EAGAIN if no client is waiting, or
+ * the negative errno of a failed accept.
+ */
+int accept_ring_next(bloom_accept_ring *ring);
+
+/**
+ * Cancels the accept and closes the ring. Clients accepted
+ * but not taken are closed, the rest wait in the backlog of
+ * the listener.
+ */
+void accept_ring_destroy(bloom_accept_ring *ring);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "arena.h"
+
+// The alignment of every allocation
+#define ARENA_ALIGN 16
+
+static arena_block* new_block(bloom_arena *arena, size_t min_size);
+
+/**
+ * Allocates from an arena. The memory is valid until the reset.
+ */
+void* arena_alloc(bloom_arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_block *b = arena->head;
+    if (!b || b->size - b->used < size) b = new_block(arena, size);
+    void *mem = b->data + b->used;
+    b->used += size;
+    return mem;
+}
+
+/**
+ * Formats a string into an arena, as asprintf does. The
+ * string is formatted into the free space of the block,
+ * and only formatted twice if it does not fit.
+ */
+int arena_printf(bloom_arena *arena, char **out, const char *fmt, ...) {
+    va_list args;
+    arena_block *b = arena->head;
+    size_t avail = (b) ? b->size - b->used : 0;
+
+    va_start(args, fmt);
+    int len = vsnprintf((b) ? b->data + b->used : NULL, avail, fmt, args);
+    va_end(args);
+    if ((size_t)len < avail) {
+        *out = arena_alloc(arena, len + 1);
+        return len;
+    }
+
+    *out = arena_alloc(arena, len + 1);
+    va_start(args, fmt);
+    vsnprintf(*out, len + 1, fmt, args);
+    va_end(args);
+    return len;
+}
+
+/**
+ * Frees all the allocations of an arena, keeping a single block.
+ * A chain is replaced by one block large enough for all of it,
+ * unless it is past ARENA_KEEP.
+ */
+void arena_reset(bloom_arena *arena) {
+    arena_block *b = arena->head;
+    if (!b) return;
+    if (!b->prev && b->size <= ARENA_KEEP) {
+        b->used = 0;
+        return;
+    }
+    size_t total = arena->total;
+    arena_destroy(arena);
+    if (total <= ARENA_KEEP) new_block(arena, total);
+}
+
+/**
+ * Frees all the memory of an arena.
+ */
+void arena_destroy(bloom_arena *arena) {
+    arena_block *b = arena->head, *prev;
+    while (b) {
+        prev = b->prev;
+        free(b);
+        b = prev;
+    }
+    arena->head = NULL;
+    arena->total = 0;
+}
+
+/**
+ * Chains a block that holds at least the given bytes,
+ * at least doubling the arena.
+ */
+static arena_block* new_block(bloom_arena *arena, size_t min_size) {
+    size_t size = (arena->total > ARENA_BLOCK) ? arena->total : ARENA_BLOCK;
+    if (size < min_size) size = min_size;
+    arena_block *b;
+    if (posix_memalign((void**)&b, ARENA_ALIGN, sizeof(arena_block) + size)) abort();
+    b->size = size;
+    b->used = 0;
+    b->prev = arena->head;
+    arena->head = b;
+    arena->total += size;
+    return b;
+}
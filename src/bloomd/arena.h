@@ -0,0 +1,70 @@
+#ifndef BLOOM_ARENA_H
+#define BLOOM_ARENA_H
+#include <stddef.h>
+
+/**
+ * A bump allocator for the memory of a command, which is all
+ * freed at once when the arena is reset. Allocations are carved
+ * from a block, and a request that does not fit chains a larger
+ * block. A reset folds the chain into a single block of the
+ * total size, so an arena settles on a block that holds the
+ * commands it serves, and stops calling malloc.
+ * Not thread safe, each thread uses an arena of its own.
+ */
+#define ARENA_BLOCK 65536
+
+/**
+ * The most bytes kept by a reset. An arena that grew past it
+ * for a large command is freed, rather than held by the thread.
+ */
+#define ARENA_KEEP (4 * 1024 * 1024)
+
+/**
+ * A block of an arena
+ */
+typedef struct arena_block {
+    size_t size;                // The usable bytes of the block
+    size_t used;                // The bytes handed out
+    struct arena_block *prev;   // The block filled before this one
+    char data[] __attribute__ ((aligned (16)));
+} arena_block;
+
+/**
+ * An arena, zeroed before first use
+ */
+typedef struct {
+    arena_block *head;          // The block allocations are carved from
+    size_t total;               // The bytes of all the blocks
+} bloom_arena;
+
+/**
+ * Allocates from an arena. The memory is valid until the reset.
+ * @arg arena The arena
+ * @arg size The bytes to allocate
+ * @return The memory, aligned for any type.
+ */
+void* arena_alloc(bloom_arena *arena, size_t size);
+
+/**
+ * Formats a string into an arena, as asprintf does.
+ * @arg arena The arena
+ * @arg out Output, the NUL terminated string
+ * @return The length of the string.
+ */
+int arena_printf(bloom_arena *arena, char **out, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+/**
+ * Frees all the allocations of an arena, keeping
+ * a single block for later use.
+ * @arg arena The arena
+ */
+void arena_reset(bloom_arena *arena);
+
+/**
+ * Frees all the memory of an arena.
+ * @arg arena The arena
+ */
+void arena_destroy(bloom_arena *arena);
+
+#endif
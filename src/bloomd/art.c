@@ -2,9 +2,13 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
-#include <emmintrin.h>
 #include <assert.h>
 #include "art.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 /**
  * Macros to manipulate pointer tags
@@ -13,32 +17,134 @@
 #define SET_LEAF(x) ((void*)((uintptr_t)x | 1))
 #define LEAF_RAW(x) ((void*)((uintptr_t)x & ~1))
 
+/**
+ * Prefetches a child node or leaf
+ */
+#define PREFETCH_CHILD(x) __builtin_prefetch(LEAF_RAW(x))
+
+/**
+ * Nodes are carved out of cache line aligned slabs, with a
+ * free list for each node type. Every node then starts on a
+ * cache line, and freed nodes are reused without malloc.
+ * The pools are shared by all trees, and never shrink.
+ */
+#define CACHE_LINE 64
+#define SLAB_SIZE (64 * 1024)
+#define CACHE_ALIGN(x) (((x) + CACHE_LINE - 1) & ~(CACHE_LINE - 1))
+
+typedef struct pool_entry {
+    struct pool_entry *next;
+} pool_entry;
+
+typedef struct {
+    volatile int lock;      // Spin lock, nodes are freed by several threads
+    pool_entry *free;       // Freed nodes to reuse
+    char *slab;             // Unused space of the current slab
+    size_t slab_left;
+} node_pool;
+
+static node_pool NODE_POOLS[NODE256 + 1];
+static const size_t NODE_SIZES[NODE256 + 1] = {
+    0,
+    CACHE_ALIGN(sizeof(art_node4)),
+    CACHE_ALIGN(sizeof(art_node16)),
+    CACHE_ALIGN(sizeof(art_node48)),
+    CACHE_ALIGN(sizeof(art_node256))
+};
+
 /**
  * Allocates a node of the given type,
  * initializes to zero and sets the type.
  */
 static art_node* alloc_node(uint8_t type) {
+    if (type < NODE4 || type > NODE256) abort();
+    node_pool *pool = NODE_POOLS + type;
+    size_t size = NODE_SIZES[type];
+
     art_node* n;
-    switch (type) {
-        case NODE4:
-            n = calloc(1, sizeof(art_node4));
-            break;
-        case NODE16:
-            n = calloc(1, sizeof(art_node16));
-            break;
-        case NODE48:
-            n = calloc(1, sizeof(art_node48));
-            break;
-        case NODE256:
-            n = calloc(1, sizeof(art_node256));
-            break;
-        default:
-            abort();
+    while (__sync_lock_test_and_set(&pool->lock, 1)) ;
+    if (pool->free) {
+        n = (art_node*)pool->free;
+        pool->free = pool->free->next;
+    } else {
+        // Start a new slab once the current one is used up
+        if (pool->slab_left < size) {
+            void *slab;
+            if (posix_memalign(&slab, CACHE_LINE, SLAB_SIZE)) abort();
+            pool->slab = slab;
+            pool->slab_left = SLAB_SIZE;
+        }
+        n = (art_node*)pool->slab;
+        pool->slab += size;
+        pool->slab_left -= size;
     }
+    __sync_lock_release(&pool->lock);
+
+    memset(n, 0, size);
     n->type = type;
+    n->ref_count = 1;
     return n;
 }
 
+/**
+ * Returns a node to the pool of its type
+ */
+static void free_node(art_node *n) {
+    node_pool *pool = NODE_POOLS + n->type;
+    pool_entry *e = (pool_entry*)n;
+    while (__sync_lock_test_and_set(&pool->lock, 1)) ;
+    e->next = pool->free;
+    pool->free = e;
+    __sync_lock_release(&pool->lock);
+}
+
+/**
+ * Returns a bitmask of the first num keys of a node16
+ * that are equal to a key byte, bit i for key i.
+ */
+static inline unsigned node16_equal(unsigned char *keys, unsigned char c, int num) {
+    unsigned mask = (1 << num) - 1;
+#if defined(__SSE2__)
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c), _mm_loadu_si128((__m128i*)keys));
+    return _mm_movemask_epi8(cmp) & mask;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t bits[16] = {1,2,4,8,16,32,64,128,1,2,4,8,16,32,64,128};
+    uint8x16_t cmp = vandq_u8(vceqq_u8(vdupq_n_u8(c), vld1q_u8(keys)), vld1q_u8(bits));
+    return (vaddv_u8(vget_low_u8(cmp)) | (vaddv_u8(vget_high_u8(cmp)) << 8)) & mask;
+#else
+    unsigned bitfield = 0;
+    for (int i=0; i < num; i++) {
+        if (keys[i] == c) bitfield |= 1 << i;
+    }
+    return bitfield;
+#endif
+}
+
+/**
+ * Returns a bitmask of the first num keys of a node16
+ * that are greater than a key byte, bit i for key i.
+ */
+static inline unsigned node16_greater(unsigned char *keys, unsigned char c, int num) {
+    unsigned mask = (1 << num) - 1;
+#if defined(__SSE2__)
+    // SSE2 only compares signed bytes, so flip the sign bits
+    __m128i flip = _mm_set1_epi8((char)0x80);
+    __m128i cmp = _mm_cmplt_epi8(_mm_xor_si128(_mm_set1_epi8(c), flip),
+            _mm_xor_si128(_mm_loadu_si128((__m128i*)keys), flip));
+    return _mm_movemask_epi8(cmp) & mask;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t bits[16] = {1,2,4,8,16,32,64,128,1,2,4,8,16,32,64,128};
+    uint8x16_t cmp = vandq_u8(vcltq_u8(vdupq_n_u8(c), vld1q_u8(keys)), vld1q_u8(bits));
+    return (vaddv_u8(vget_low_u8(cmp)) | (vaddv_u8(vget_high_u8(cmp)) << 8)) & mask;
+#else
+    unsigned bitfield = 0;
+    for (int i=0; i < num; i++) {
+        if (keys[i] > c) bitfield |= 1 << i;
+    }
+    return bitfield;
+#endif
+}
+
 /**
  * Initializes an ART tree
  * @return 0 on success.
@@ -64,6 +170,9 @@ static void destroy_node(art_node *n) {
         return;
     }
 
+    // Only release shared nodes once the last reference is gone
+    if (__sync_sub_and_fetch(&n->ref_count, 1)) return;
+
     // Handle each node type
     int i;
     union {
@@ -89,7 +198,8 @@ static void destroy_node(art_node *n) {
 
         case NODE48:
             p.p3 = (art_node48*)n;
-            for (i=0;i<n->num_children;i++) {
+            // Deletes leave holes, so check every slot
+            for (i=0;i<48;i++) {
                 destroy_node(p.p3->children[i]);
             }
             break;
@@ -107,7 +217,7 @@ static void destroy_node(art_node *n) {
     }
 
     // Free ourself on the way up
-    free(n);
+    free_node(n);
 }
 
 /**
@@ -125,7 +235,7 @@ int destroy_art_tree(art_tree *t) {
 extern inline uint64_t art_size(art_tree *t);
 
 static art_node** find_child(art_node *n, unsigned char c) {
-    int i, mask, bitfield;
+    int i, bitfield;
     union {
         art_node4 *p1;
         art_node16 *p2;
@@ -141,18 +251,11 @@ static art_node** find_child(art_node *n, unsigned char c) {
             }
             break;
 
-        {
-        __m128i cmp;
         case NODE16:
             p.p2 = (art_node16*)n;
 
-            // Compare the key to all 16 stored keys
-            cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
-                    _mm_loadu_si128((__m128i*)p.p2->keys));
-
-            // Use a mask to ignore children that don't exist
-            mask = (1 << n->num_children) - 1;
-            bitfield = _mm_movemask_epi8(cmp) & mask;
+            // Compare the key to all 16 stored keys at once
+            bitfield = node16_equal(p.p2->keys, c, n->num_children);
 
             /*
              * If we have a match (any bit set) then we can
@@ -162,7 +265,6 @@ static art_node** find_child(art_node *n, unsigned char c) {
             if (bitfield)
                 return &p.p2->children[__builtin_ctz(bitfield)];
             break;
-        }
 
         case NODE48:
             p.p3 = (art_node48*)n;
@@ -345,6 +447,66 @@ static void copy_header(art_node *dest, art_node *src) {
     memcpy(dest->partial, src->partial, min(MAX_PREFIX_LEN, src->partial_len));
 }
 
+// Adds a reference to a node or leaf
+static void share_node(art_node *n) {
+    if (!n) return;
+    if (IS_LEAF(n))
+        __sync_fetch_and_add(&((art_leaf*)LEAF_RAW(n))->ref_count, 1);
+    else
+        __sync_fetch_and_add(&n->ref_count, 1);
+}
+
+/**
+ * Makes the node at a reference safe to change, by copying it
+ * if it is shared with another tree. The copy shares all the
+ * children of the node. The parent of the reference must be
+ * unshared already, so that only the path being changed is copied.
+ * @return The unshared node
+ */
+static art_node* unshare_node(art_node **ref) {
+    art_node *n = *ref;
+    if (IS_LEAF(n) || __atomic_load_n(&n->ref_count, __ATOMIC_ACQUIRE) == 1) return n;
+
+    // Copy the node, sharing the children
+    art_node *copy = alloc_node(n->type);
+    copy_header(copy, n);
+    art_node **children;
+    int num;
+    switch (n->type) {
+        case NODE4:
+            memcpy(((art_node4*)copy)->keys, ((art_node4*)n)->keys, 4);
+            memcpy(((art_node4*)copy)->children, ((art_node4*)n)->children, 4*sizeof(void*));
+            children = ((art_node4*)copy)->children;
+            num = n->num_children;
+            break;
+        case NODE16:
+            memcpy(((art_node16*)copy)->keys, ((art_node16*)n)->keys, 16);
+            memcpy(((art_node16*)copy)->children, ((art_node16*)n)->children, 16*sizeof(void*));
+            children = ((art_node16*)copy)->children;
+            num = n->num_children;
+            break;
+        case NODE48:
+            memcpy(((art_node48*)copy)->keys, ((art_node48*)n)->keys, 256);
+            memcpy(((art_node48*)copy)->children, ((art_node48*)n)->children, 48*sizeof(void*));
+            children = ((art_node48*)copy)->children;
+            num = 48;
+            break;
+        case NODE256:
+            memcpy(((art_node256*)copy)->children, ((art_node256*)n)->children, 256*sizeof(void*));
+            children = ((art_node256*)copy)->children;
+            num = 256;
+            break;
+        default:
+            abort();
+    }
+    for (int i=0; i < num; i++) share_node(children[i]);
+
+    // Swap in the copy, and drop our reference to the shared node
+    *ref = copy;
+    destroy_node(n);
+    return copy;
+}
+
 static void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
     (void)ref;
     n->n.num_children++;
@@ -367,22 +529,15 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
+        free_node((art_node*)n);
         add_child256(new, ref, c, child);
     }
 }
 
 static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 16) {
-        __m128i cmp;
-
-        // Compare the key to all 16 stored keys
-        cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                _mm_loadu_si128((__m128i*)n->keys));
-
-        // Use a mask to ignore children that don't exist
-        unsigned mask = (1 << n->n.num_children) - 1;
-        unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
+        // Find the first stored key greater than the key
+        unsigned bitfield = node16_greater(n->keys, c, n->n.num_children);
 
         // Check if less than any
         unsigned idx;
@@ -410,7 +565,7 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
+        free_node((art_node*)n);
         add_child48(new, ref, c, child);
     }
 }
@@ -442,7 +597,7 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
                 sizeof(unsigned char)*n->n.num_children);
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
+        free_node((art_node*)n);
         add_child16(new, ref, c, child);
     }
 }
@@ -497,11 +652,17 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
     if (IS_LEAF(n)) {
         art_leaf *l = LEAF_RAW(n);
 
-        // Check if we are updating an existing value
+        // Check if we are updating an existing value, replacing
+        // the leaf if it is shared with another tree
         if (!leaf_matches(l, key, key_len, depth)) {
             *old = 1;
             void *old_val = l->value;
-            l->value = value;
+            if (__atomic_load_n(&l->ref_count, __ATOMIC_ACQUIRE) == 1) {
+                l->value = value;
+            } else {
+                *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
+                destroy_node(n);
+            }
             return old_val;
         }
 
@@ -522,6 +683,9 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         return NULL;
     }
 
+    // Copy the node if it is shared, since we may change it
+    n = unshare_node(ref);
+
     // Check if given node has a prefix
     if (n->partial_len) {
         // Determine if the prefixes differ, since we need to split
@@ -606,7 +770,7 @@ static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
                 pos++;
             }
         }
-        free(n);
+        free_node((art_node*)n);
     }
 }
 
@@ -630,7 +794,7 @@ static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
                 child++;
             }
         }
-        free(n);
+        free_node((art_node*)n);
     }
 }
 
@@ -646,7 +810,7 @@ static void remove_child16(art_node16 *n, art_node **ref, art_node **l) {
         copy_header((art_node*)new, (art_node*)n);
         memcpy(new->keys, n->keys, 4);
         memcpy(new->children, n->children, 4*sizeof(void*));
-        free(n);
+        free_node((art_node*)n);
     }
 }
 
@@ -660,6 +824,9 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
     if (n->n.num_children == 1) {
         art_node *child = n->children[0];
         if (!IS_LEAF(child)) {
+            // The prefix is moved into the child, so it must not be shared
+            child = unshare_node(n->children);
+
             // Concatenate the prefixes
             int prefix = n->n.partial_len;
             if (prefix < MAX_PREFIX_LEN) {
@@ -677,7 +844,7 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
             child->partial_len += n->n.partial_len + 1;
         }
         *ref = child;
-        free(n);
+        free_node((art_node*)n);
     }
 }
 
@@ -723,6 +890,12 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
     art_node **child = find_child(n, key[depth]);
     if (!child) return NULL;
 
+    // Copy the node if it is shared, since we will change it
+    if (n != unshare_node(ref)) {
+        n = *ref;
+        child = find_child(n, key[depth]);
+    }
+
     // If the child is leaf, delete from this node
     if (IS_LEAF(*child)) {
         art_leaf *l = LEAF_RAW(*child);
@@ -775,6 +948,7 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
     switch (n->type) {
         case NODE4:
             for (int i=0; i < n->num_children; i++) {
+                if (i + 1 < n->num_children) PREFETCH_CHILD(((art_node4*)n)->children[i+1]);
                 res = recursive_iter(((art_node4*)n)->children[i], cb, data);
                 if (res) return res;
             }
@@ -782,6 +956,7 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
 
         case NODE16:
             for (int i=0; i < n->num_children; i++) {
+                if (i + 1 < n->num_children) PREFETCH_CHILD(((art_node16*)n)->children[i+1]);
                 res = recursive_iter(((art_node16*)n)->children[i], cb, data);
                 if (res) return res;
             }
@@ -898,80 +1073,104 @@ int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback c
     return 0;
 }
 
-// Recursively copies a tree
-static art_node* recursive_copy(art_node *n) {
-    // Handle the NULL nodes
-    if (!n) return NULL;
+/**
+ * Checks if a leaf is past the start of an iteration
+ * @arg inclusive Should a leaf equal to the start match
+ * @return 1 if the leaf key is after the start.
+ */
+static int leaf_after(art_leaf *l, unsigned char *start, int start_len, int inclusive) {
+    uint32_t len = (l->key_len < (uint32_t)start_len) ? l->key_len : (uint32_t)start_len;
+    int cmp = memcmp(l->key, start, len);
+    if (!cmp) cmp = (l->key_len > (uint32_t)start_len) - (l->key_len < (uint32_t)start_len);
+    return cmp > 0 || (inclusive && !cmp);
+}
 
-    // Handle leaves
+// Iterates the leaves of a node after a start key, in order
+static int recursive_iter_from(art_node *n, unsigned char *start, int start_len, int inclusive, art_callback cb, void *data) {
+    // Handle base cases
+    if (!n) return 0;
     if (IS_LEAF(n)) {
-        // Re-use leaf, increment ref-count
         art_leaf *l = LEAF_RAW(n);
-        __sync_fetch_and_add(&l->ref_count, 1);
-        return n;
+        if (!leaf_after(l, start, start_len, inclusive)) return 0;
+        return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
     }
 
-    union {
-        art_node4 *p1;
-        art_node16 *p2;
-        art_node48 *p3;
-        art_node256 *p4;
-    } p;
+    // Skip subtrees entirely before the start, and
+    // iterate subtrees entirely after it without comparing
+    if (!leaf_after(maximum(n), start, start_len, inclusive)) return 0;
+    if (leaf_after(minimum(n), start, start_len, inclusive)) return recursive_iter(n, cb, data);
+
+    int idx, res;
     switch (n->type) {
         case NODE4:
-            p.p1 = (art_node4*)alloc_node(NODE4);
-            copy_header((art_node*)p.p1, n);
-            memcpy(p.p1->keys, ((art_node4*)n)->keys, 4);
             for (int i=0; i < n->num_children; i++) {
-                p.p1->children[i] = recursive_copy(((art_node4*)n)->children[i]);
+                res = recursive_iter_from(((art_node4*)n)->children[i], start, start_len, inclusive, cb, data);
+                if (res) return res;
             }
-            return (art_node*)p.p1;
+            break;
 
         case NODE16:
-            p.p2 = (art_node16*)alloc_node(NODE16);
-            copy_header((art_node*)p.p2, n);
-            memcpy(p.p1->keys, ((art_node16*)n)->keys, 16);
             for (int i=0; i < n->num_children; i++) {
-                p.p2->children[i] = recursive_copy(((art_node16*)n)->children[i]);
+                res = recursive_iter_from(((art_node16*)n)->children[i], start, start_len, inclusive, cb, data);
+                if (res) return res;
             }
-            return (art_node*)p.p2;
+            break;
 
         case NODE48:
-            p.p3 = (art_node48*)alloc_node(NODE48);
-            copy_header((art_node*)p.p3, n);
-            memcpy(p.p3->keys, ((art_node48*)n)->keys, 256);
-            for (int i=0; i < n->num_children; i++) {
-                p.p3->children[i] = recursive_copy(((art_node48*)n)->children[i]);
+            for (int i=0; i < 256; i++) {
+                idx = ((art_node48*)n)->keys[i];
+                if (!idx) continue;
+                res = recursive_iter_from(((art_node48*)n)->children[idx-1], start, start_len, inclusive, cb, data);
+                if (res) return res;
             }
-            return (art_node*)p.p3;
+            break;
 
         case NODE256:
-            p.p4 = (art_node256*)alloc_node(NODE256);
-            copy_header((art_node*)p.p4, n);
             for (int i=0; i < 256; i++) {
-                p.p4->children[i] = recursive_copy(((art_node256*)n)->children[i]);
+                if (!((art_node256*)n)->children[i]) continue;
+                res = recursive_iter_from(((art_node256*)n)->children[i], start, start_len, inclusive, cb, data);
+                if (res) return res;
             }
-            return (art_node*)p.p4;
+            break;
 
         default:
             abort();
     }
+    return 0;
+}
+
+/**
+ * Iterates through the entries pairs in the map in order,
+ * starting at a given key, invoking a callback for each.
+ * Subtrees before the start are skipped, so resuming an
+ * iteration does not revisit the keys before it.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg start The key to start at. Need not be in the tree.
+ * @arg start_len The length of the start key
+ * @arg inclusive Should the start key itself be visited
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_from(art_tree *t, unsigned char *start, int start_len, int inclusive, art_callback cb, void *data) {
+    return recursive_iter_from(t->root, start, start_len, inclusive, cb, data);
 }
 
 /**
- * Creates a copy of an ART tree. The two trees will
- * share the internal leaves, but will NOT share internal nodes.
- * This allows leaves to be added and deleted from each tree
- * individually. It is important that concurrent updates to
- * a given key has no well defined behavior since the leaves are
- * shared.
+ * Creates a copy of an ART tree in constant time. The two trees
+ * share all their nodes, and an insert or delete in either tree
+ * copies only the nodes on the path it changes. The trees can then
+ * be changed individually, and searching a tree is safe while
+ * another is changed. Changes to the same tree must be serialized.
  * @arg dst The destination tree. Not initialized yet.
  * @arg src The source tree, must be initialized.
  * @return 0 on success.
  */
 int art_copy(art_tree *dst, art_tree *src) {
     dst->size = src->size;
-    dst->root = recursive_copy(src->root);
+    dst->root = src->root;
+    share_node(dst->root);
     return 0;
 }
 
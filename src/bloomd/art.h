@@ -18,6 +18,7 @@ typedef int(*art_callback)(void *data, const unsigned char *key, uint32_t key_le
 typedef struct {
     uint8_t type;
     uint8_t num_children;
+    uint32_t ref_count;     // Number of parents and trees sharing the node
     uint32_t partial_len;
     unsigned char partial[MAX_PREFIX_LEN];
 } art_node;
@@ -63,7 +64,7 @@ typedef struct {
  * of arbitrary size, as they include the key.
  */
 typedef struct {
-    uint16_t ref_count;
+    uint32_t ref_count;
     void *value;
     uint32_t key_len;
     unsigned char key[];
@@ -166,12 +167,27 @@ int art_iter(art_tree *t, art_callback cb, void *data);
 int art_iter_prefix(art_tree *t, unsigned char *prefix, int prefix_len, art_callback cb, void *data);
 
 /**
- * Creates a copy of an ART tree. The two trees will
- * share the internal leaves, but will NOT share internal nodes.
- * This allows leaves to be added and deleted from each tree
- * individually. It is important that concurrent updates to
- * a given key has no well defined behavior since the leaves are
- * shared.
+ * Iterates through the entries pairs in the map in order,
+ * starting at a given key, invoking a callback for each.
+ * Subtrees before the start are skipped, so resuming an
+ * iteration does not revisit the keys before it.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg start The key to start at. Need not be in the tree.
+ * @arg start_len The length of the start key
+ * @arg inclusive Should the start key itself be visited
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_from(art_tree *t, unsigned char *start, int start_len, int inclusive, art_callback cb, void *data);
+
+/**
+ * Creates a copy of an ART tree in constant time. The two trees
+ * share all their nodes, and an insert or delete in either tree
+ * copies only the nodes on the path it changes. The trees can then
+ * be changed individually, and searching a tree is safe while
+ * another is changed. Changes to the same tree must be serialized.
  * @arg dst The destination tree. Not initialized yet.
  * @arg src The source tree, must be initialized.
  * @return 0 on success.
@@ -1,6 +1,9 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
 #include "background.h"
+#include "stats.h"
 
 
 /**
@@ -23,8 +26,61 @@
 */
 #define PERIODIC_CHECKPOINT 16
 
+/**
+ * How often in seconds the flush thread checks if filters
+ * should be prepared to grow, or rotate their generations.
+ */
+#define MAINTENANCE_INTERVAL 1
+
+/**
+ * How often in seconds the cold unmap thread checks
+ * for filters predicted to be used soon.
+ */
+#define PREWARM_INTERVAL 30
+
+/**
+ * How often in seconds the cold unmap thread checks
+ * the mapped bytes against max_memory.
+ */
+#define EVICT_INTERVAL 1
+
+/**
+ * Eviction frees this fraction of max_memory below the budget,
+ * so that the budget is not crossed again by the next page in.
+ */
+#define EVICT_HEADROOM 0.1
+
+/**
+ * The flush threads. Each scheduled flush is a pass over the
+ * dirty filters in priority order, and every thread takes the
+ * next filter of the pass until none are left.
+ */
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;  // Signals a new pass, or to stop
+    pthread_cond_t done_cond;   // Signals the workers finished a pass
+    char **names;               // The filters of the pass
+    int num;
+    int next;                   // The next filter to flush
+    unsigned int pass;          // Counts the passes
+    int busy;                   // Workers still in the pass
+    int workers;                // The other flush threads
+    int stop;
+} flush_pool;
+
 static void* flush_thread_main(void *in);
+static void* flush_worker_main(void *in);
+static bloom_flusher* pool_flusher(bloom_config *config);
+static void scheduled_flush(flush_pool *pool, bloom_flusher *flusher);
+static void flush_pass(flush_pool *pool, bloom_flusher *flusher);
 static void* unmap_thread_main(void *in);
+static void* wal_thread_main(void *in);
+static void* writeback_thread_main(void *in);
+static void maintain_filters(bloom_config *config, bloom_filtmgr *mgr);
+static void prewarm_filters(bloom_config *config, bloom_filtmgr *mgr);
+static void evict_filters(bloom_config *config, bloom_filtmgr *mgr);
 typedef struct {
     bloom_config *config;
     bloom_filtmgr *mgr;
@@ -66,16 +122,19 @@ int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run
         return 0;
     }
 
-    // Start thread
+    // Start thread, which runs the flushes requested by the clients
     background_thread_args *args;
     PACK_ARGS();
+    filtmgr_set_flush_scheduler(mgr, 1);
     pthread_create(t, NULL, flush_thread_main, args);
     return 1;
 }
 
 /**
  * Starts a cold unmap thread which on every
- * cold interval unamps cold filtesr.
+ * cold interval unamps cold filtesr. It also evicts
+ * filters once max_memory is exceeded, and warms
+ * the filters predicted to be used soon.
  * @arg config The configuration
  * @arg mgr The filter manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -85,7 +144,7 @@ int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run
  */
 int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
     // Return if we are not scheduled
-    if(config->cold_interval <= 0) {
+    if(config->cold_interval <= 0 && config->max_memory <= 0) {
         return 0;
     }
 
@@ -96,6 +155,54 @@ int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *shoul
     return 1;
 }
 
+/**
+ * Starts a thread which syncs the write-ahead logs
+ * of the filters every wal_sync_msec, committing all
+ * the sets since the last sync together.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_wal_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if the sets are not logged
+    if (!config->wal) {
+        return 0;
+    }
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    pthread_create(t, NULL, wal_thread_main, args);
+    return 1;
+}
+
+/**
+ * Starts a thread which starts the writeback of the
+ * filters mapped from their data files every writeback_msec,
+ * so their pages trickle out instead of at each flush.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_writeback_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not scheduled
+    if (config->writeback_msec <= 0) {
+        return 0;
+    }
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    pthread_create(t, NULL, writeback_thread_main, args);
+    return 1;
+}
+
 
 static void* flush_thread_main(void *in) {
     bloom_config *config;
@@ -106,38 +213,268 @@ static void* flush_thread_main(void *in) {
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(mgr);
 
-    syslog(LOG_INFO, "Flush thread started. Interval: %d seconds.", config->flush_interval);
+    // Start the other flush threads, this thread is the first
+    flush_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.config = config;
+    pool.mgr = mgr;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start_cond, NULL);
+    pthread_cond_init(&pool.done_cond, NULL);
+    int num_workers = pool.workers = config->flush_threads - 1;
+    pthread_t *workers = calloc(num_workers + 1, sizeof(pthread_t));
+    for (int i=0; i < num_workers; i++) {
+        pthread_create(workers + i, NULL, flush_worker_main, &pool);
+    }
+
+    // Flushes are queued on a flusher, so that the
+    // writes of many filters can overlap
+    bloom_flusher *flusher = pool_flusher(config);
+
+    syslog(LOG_INFO, "Flush thread started. Interval: %d seconds. Threads: %d.",
+            config->flush_interval, config->flush_threads);
     unsigned int ticks = 0;
     while (*should_run) {
         usleep(PERIODIC_TIME_USEC);
         filtmgr_client_checkpoint(mgr);
-        if ((++ticks % SEC_TO_TICKS(config->flush_interval)) == 0 && *should_run) {
-            // List all the filters
-            syslog(LOG_INFO, "Scheduled flush started.");
-            bloom_filter_list_head *head;
-            int res = filtmgr_list_filters(mgr, NULL, &head);
-            if (res != 0) {
-                syslog(LOG_WARNING, "Failed to list filters for flushing!");
-                continue;
-            }
+        ++ticks;
+        if ((ticks % SEC_TO_TICKS(MAINTENANCE_INTERVAL)) == 0 && *should_run) {
+            maintain_filters(config, mgr);
+        }
+        // Flush on the interval, or once a client requests it. The
+        // interval can change on a reload, but not to 0.
+        int flush_interval = __atomic_load_n(&config->flush_interval, __ATOMIC_RELAXED);
+        uint64_t ticket = filtmgr_flush_requested(mgr);
+        if (((ticks % SEC_TO_TICKS(flush_interval)) == 0 || ticket) && *should_run) {
+            scheduled_flush(&pool, flusher);
+            if (ticket) filtmgr_complete_flush(mgr, ticket);
+        }
+    }
 
-            // Flush all, ignore errors since
-            // filters might get deleted in the process
-            bloom_filter_list *node = head->head;
-            unsigned int cmds = 0;
-            while (node) {
-                filtmgr_flush_filter(mgr, node->filter_name);
-                if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
-                node = node->next;
-            }
+    // Finish the flushes requested before the shutdown
+    uint64_t ticket = filtmgr_flush_requested(mgr);
+    if (ticket) {
+        scheduled_flush(&pool, flusher);
+        filtmgr_complete_flush(mgr, ticket);
+    }
+    filtmgr_set_flush_scheduler(mgr, 0);
 
-            // Cleanup
-            filtmgr_cleanup_list(head);
+    // Stop the other flush threads
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.start_cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i=0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_cond_destroy(&pool.done_cond);
+    pthread_cond_destroy(&pool.start_cond);
+    pthread_mutex_destroy(&pool.lock);
+    flusher_destroy(flusher);
+    return NULL;
+}
+
+/**
+ * The other flush threads, which wait for each pass
+ */
+static void* flush_worker_main(void *in) {
+    flush_pool *pool = in;
+    bloom_flusher *flusher = pool_flusher(pool->config);
+
+    unsigned int pass = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->pass == pass && !pool->stop) {
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
         }
+        if (pool->stop) break;
+        pass = pool->pass;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Only hold back the vacuum during a pass
+        filtmgr_client_checkpoint(pool->mgr);
+        flush_pass(pool, flusher);
+        filtmgr_client_leave(pool->mgr);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->busy) pthread_cond_signal(&pool->done_cond);
     }
+    pthread_mutex_unlock(&pool->lock);
+    flusher_destroy(flusher);
     return NULL;
 }
 
+/**
+ * Creates the flusher of a flush thread. The threads
+ * split the in flight cap and the bandwidth budget.
+ * With group commit, each drain of the flusher syncs
+ * the filters flushed since the last one at once.
+ */
+static bloom_flusher* pool_flusher(bloom_config *config) {
+    uint64_t threads = config->flush_threads;
+    bloom_flusher *flusher;
+    flusher_create((uint64_t)config->flush_inflight_mb * 1024 * 1024 / threads, &flusher);
+    flusher_set_rate(flusher, (uint64_t)config->flush_bandwidth_mb * 1024 * 1024 / threads);
+    flusher_set_group_commit(flusher, config->group_commit);
+    return flusher;
+}
+
+/**
+ * Runs a flush pass over the dirty filters, on all the flush
+ * threads, then compacts the filters that were flushed
+ */
+static void scheduled_flush(flush_pool *pool, bloom_flusher *flusher) {
+    // List the dirty filters, the clean ones are skipped
+    bloom_filtmgr *mgr = pool->mgr;
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_dirty_filters(mgr, &head);
+    if (res != 0) {
+        syslog(LOG_WARNING, "Failed to list filters for flushing!");
+        return;
+    }
+    syslog(LOG_INFO, "Scheduled flush started. Dirty filters: %d.", head->size);
+    if (!head->size) {
+        filtmgr_cleanup_list(head);
+        return;
+    }
+
+    // Hand the pass to the workers, and take part in it.
+    // Errors are ignored, since filters might get deleted.
+    char **names = malloc(head->size * sizeof(char*));
+    int num = 0;
+    for (bloom_filter_list *node=head->head; node; node=node->next) {
+        names[num++] = node->filter_name;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->names = names;
+    pool->num = num;
+    pool->next = 0;
+    pool->busy = pool->workers;
+    pool->pass++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    flush_pass(pool, flusher);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy) pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pool->names = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    free(names);
+
+    // Compact and seal once the flushes are done, since both
+    // wait for the asynchronous flushes of a filter
+    bloom_filter_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node) {
+        filtmgr_compact_filter(mgr, node->filter_name);
+        filtmgr_seal_filter(mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) {
+            filtmgr_client_checkpoint(mgr);
+        }
+        node = node->next;
+    }
+
+    // Cleanup
+    filtmgr_cleanup_list(head);
+}
+
+/**
+ * Flushes the filters of a pass until none are left
+ */
+static void flush_pass(flush_pool *pool, bloom_flusher *flusher) {
+    unsigned int cmds = 0;
+    int i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->num) {
+        filtmgr_flush_filter_async(pool->mgr, pool->names[i], flusher);
+        flusher_poll(flusher, 0);
+
+        // Filters may be deleted after a checkpoint, so
+        // their flushes must finish first
+        if (!(++cmds % PERIODIC_CHECKPOINT)) {
+            flusher_drain(flusher);
+            filtmgr_client_checkpoint(pool->mgr);
+        }
+    }
+    flusher_drain(flusher);
+}
+
+/**
+ * Prepares the filters that are nearly full to
+ * grow, so that the next layer is ready for them,
+ * ages out the keys of windowed filters, and
+ * adapts the order checks probe the layers in.
+ */
+static void maintain_filters(bloom_config *config, bloom_filtmgr *mgr) {
+    bloom_filter_list_head *head;
+    if (filtmgr_list_filters(mgr, NULL, &head) != 0) {
+        syslog(LOG_WARNING, "Failed to list filters for maintenance!");
+        return;
+    }
+
+    bloom_filter_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node) {
+        filtmgr_prepare_filter(mgr, node->filter_name);
+        filtmgr_rotate_filter(mgr, node->filter_name);
+        if (config->adaptive_checks) {
+            filtmgr_reorder_filter(mgr, node->filter_name);
+        }
+        if (!(++cmds % PERIODIC_CHECKPOINT)) {
+            filtmgr_client_checkpoint(mgr);
+        }
+        node = node->next;
+    }
+    filtmgr_cleanup_list(head);
+}
+
+/**
+ * Warms the cold filters that are predicted to be used
+ * soon, so their first use does not wait for a fault.
+ */
+static void prewarm_filters(bloom_config *config, bloom_filtmgr *mgr) {
+    bloom_filter_list_head *head;
+    if (filtmgr_list_prewarm_filters(mgr, config->prewarm_lead, &head) != 0) return;
+
+    bloom_filter_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node) {
+        syslog(LOG_INFO, "Warming filter '%s' ahead of its predicted use.", node->filter_name);
+        filtmgr_warm_filter(mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+        node = node->next;
+    }
+    filtmgr_cleanup_list(head);
+}
+
+/**
+ * Evicts mapped filters in CLOCK order once the mapped
+ * bytes exceed max_memory, until they are below it by
+ * the headroom.
+ */
+static void evict_filters(bloom_config *config, bloom_filtmgr *mgr) {
+    int64_t budget = (int64_t)config->max_memory * 1024 * 1024;
+    int64_t mapped = stats_value(STAT_MAPPED_BYTES);
+    if (mapped <= budget) return;
+
+    bloom_filter_list_head *head;
+    int64_t target = budget - (int64_t)(budget * EVICT_HEADROOM);
+    if (filtmgr_list_evict_filters(mgr, mapped - target, &head) != 0) return;
+    syslog(LOG_INFO, "Mapped bytes over the memory budget: %lld. Evicting %d filters.",
+            (long long)mapped, head->size);
+
+    bloom_filter_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node) {
+        syslog(LOG_INFO, "Unmapping filter '%s' for the memory budget.", node->filter_name);
+        filtmgr_unmap_filter(mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+        node = node->next;
+    }
+    filtmgr_cleanup_list(head);
+}
+
 static void* unmap_thread_main(void *in) {
     bloom_config *config;
     bloom_filtmgr *mgr;
@@ -147,12 +484,23 @@ static void* unmap_thread_main(void *in) {
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(mgr);
 
-    syslog(LOG_INFO, "Cold unmap thread started. Interval: %d seconds.", config->cold_interval);
+    syslog(LOG_INFO, "Cold unmap thread started. Interval: %d seconds. Max memory: %d MB.",
+            config->cold_interval, config->max_memory);
     unsigned int ticks = 0;
     while (*should_run) {
         usleep(PERIODIC_TIME_USEC);
         filtmgr_client_checkpoint(mgr);
-        if ((++ticks % SEC_TO_TICKS(config->cold_interval)) == 0 && *should_run) {
+        ++ticks;
+
+        // The settings can change on a reload, so read them once
+        int cold_interval = __atomic_load_n(&config->cold_interval, __ATOMIC_RELAXED);
+        if (config->max_memory && (ticks % SEC_TO_TICKS(EVICT_INTERVAL)) == 0 && *should_run) {
+            evict_filters(config, mgr);
+        }
+        if (config->prewarm_lead && (ticks % SEC_TO_TICKS(PREWARM_INTERVAL)) == 0 && *should_run) {
+            prewarm_filters(config, mgr);
+        }
+        if (cold_interval > 0 && (ticks % SEC_TO_TICKS(cold_interval)) == 0 && *should_run) {
             // List the cold filters
             syslog(LOG_INFO, "Cold unmap started.");
             bloom_filter_list_head *head;
@@ -179,4 +527,39 @@ static void* unmap_thread_main(void *in) {
     return NULL;
 }
 
+static void* wal_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    UNPACK_ARGS();
+
+    // Perform the initial checkpoint with the manager
+    filtmgr_client_checkpoint(mgr);
 
+    syslog(LOG_INFO, "WAL sync thread started. Interval: %d msec.", config->wal_sync_msec);
+    while (*should_run) {
+        usleep(config->wal_sync_msec * 1000);
+        filtmgr_client_checkpoint(mgr);
+        filtmgr_sync_wals(mgr);
+    }
+    return NULL;
+}
+
+static void* writeback_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    UNPACK_ARGS();
+
+    // Perform the initial checkpoint with the manager
+    filtmgr_client_checkpoint(mgr);
+
+    syslog(LOG_INFO, "Writeback thread started. Interval: %d msec.", config->writeback_msec);
+    while (*should_run) {
+        usleep(config->writeback_msec * 1000);
+        filtmgr_client_checkpoint(mgr);
+        int failed = filtmgr_writeback(mgr);
+        if (failed) syslog(LOG_WARNING, "Failed to start the writeback of %d filters.", failed);
+    }
+    return NULL;
+}
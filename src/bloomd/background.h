@@ -18,7 +18,9 @@ int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run
 
 /**
  * Starts a cold unmap thread which on every
- * cold interval unamps cold filtesr.
+ * cold interval unamps cold filtesr. It also evicts
+ * filters once max_memory is exceeded, and warms
+ * the filters predicted to be used soon.
  * @arg config The configuration
  * @arg mgr The filter manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -28,4 +30,30 @@ int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run
  */
 int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *);
 
+/**
+ * Starts a thread which syncs the write-ahead logs
+ * of the filters every wal_sync_msec, committing all
+ * the sets since the last sync together.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_wal_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Starts a thread which starts the writeback of the
+ * filters mapped from their data files every writeback_msec,
+ * so their pages trickle out instead of at each flush.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_writeback_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
 #endif
@@ -0,0 +1,99 @@
+#ifndef BLOOM_BINARY_PROTOCOL_H
+#define BLOOM_BINARY_PROTOCOL_H
+#include <stdint.h>
+
+/**
+ * The binary protocol is an optional protocol for high volume
+ * clients. A connection switches to it with the "binary" text
+ * command, which is answered with "Done\n". All later input of
+ * the connection is binary.
+ *
+ * Requests name the filter once and carry length prefixed keys,
+ * so the keys are hashed in place without being scanned. Results
+ * come back as a bitset, one bit per key. All integers are sent
+ * in network byte order.
+ *
+ * A request without a name, where name_len is 0, uses the filter
+ * named by the last request of the connection.
+ *
+ * A request is a header, followed by body_len bytes of body:
+ *
+ *   uint8   magic       BIN_REQUEST_MAGIC
+ *   uint8   op          One of bloom_binary_op
+ *   uint16  name_len    Length of the filter name
+ *   uint32  num_keys    Number of keys
+ *   uint32  body_len    Length of the body
+ *   char    name[name_len]
+ *   num_keys times:
+ *     uint16  key_len
+ *     char    key[key_len]
+ *
+ * A response is a header, followed by the results bitset if
+ * the status is BIN_OK. Key i is set if bit (i % 8) of byte
+ * (i / 8) is set. Errors have no results.
+ *
+ *   uint8   magic       BIN_RESPONSE_MAGIC
+ *   uint8   status      One of bloom_binary_status
+ *   uint16  reserved    Zero
+ *   uint32  num_keys    Number of results in the bitset
+ *   uint8   results[(num_keys + 7) / 8]
+ *
+ * A request with the wrong magic, or a body over BIN_MAX_BODY,
+ * cannot be skipped, so it is answered with BIN_BAD_REQUEST and
+ * the connection is closed.
+ */
+
+#define BIN_REQUEST_MAGIC 0xB1
+#define BIN_RESPONSE_MAGIC 0xB2
+
+/**
+ * The largest request body accepted. 64MB.
+ */
+#define BIN_MAX_BODY (64 * 1024 * 1024)
+
+/**
+ * The operations of binary requests. Multi and bulk
+ * are simply requests with more than one key.
+ */
+typedef enum {
+    BIN_CHECK = 1,      // Check keys, like check and multi
+    BIN_SET = 2,        // Set keys, like set and bulk
+    BIN_UNSET = 3,      // Unset keys, like unset and multi_unset
+} bloom_binary_op;
+
+/**
+ * The status of binary responses
+ */
+typedef enum {
+    BIN_OK = 0,             // Results follow
+    BIN_FILT_NOT_EXIST = 1, // Filter does not exist
+    BIN_INTERNAL_ERR = 2,   // Internal error
+    BIN_NOT_SUPPORTED = 3,  // Filter does not support unset
+    BIN_FILT_FULL = 4,      // Filter is full
+    BIN_BAD_REQUEST = 5,    // Malformed request
+    BIN_FILT_FROZEN = 6,    // Filter is frozen
+    BIN_TIMEOUT = 7,        // Waited past the deadline of the connection
+} bloom_binary_status;
+
+/**
+ * Request header
+ */
+typedef struct {
+    uint8_t magic;
+    uint8_t op;
+    uint16_t name_len;
+    uint32_t num_keys;
+    uint32_t body_len;
+} __attribute__ ((packed)) bloom_binary_request;
+
+/**
+ * Response header
+ */
+typedef struct {
+    uint8_t magic;
+    uint8_t status;
+    uint16_t reserved;
+    uint32_t num_keys;
+} __attribute__ ((packed)) bloom_binary_response;
+
+#endif
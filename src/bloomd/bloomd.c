@@ -19,11 +19,15 @@
 #include "networking.h"
 #include "filter_manager.h"
 #include "background.h"
+#include "numa.h"
+#include "handoff.h"
 
 // Simple struct that holds args for the workers
 typedef struct {
     bloom_filtmgr *mgr;
     bloom_networking *netconf;
+    bloom_config *config;
+    int next_worker;    // Used to hand out worker ids
 } worker_args;
 static void worker_main(worker_args *args);
 
@@ -34,6 +38,12 @@ static void worker_main(worker_args *args);
  */
 static int SHOULD_RUN = 1;
 
+/**
+ * Set by our SIGHUP handler, to reload
+ * the number of workers from the config.
+ */
+static volatile sig_atomic_t SHOULD_RELOAD = 0;
+
 /**
  * Prints our usage to stderr
  */
@@ -117,6 +127,16 @@ void signal_handler(int signum) {
 }
 
 
+/**
+ * Our SIGHUP handler, which asks the
+ * main loop to reload the config.
+ */
+void reload_handler(int signum) {
+    (void)signum;
+    SHOULD_RELOAD = 1;
+}
+
+
 int main(int argc, char **argv) {
     // Initialize syslog
     setup_syslog();
@@ -151,6 +171,13 @@ int main(int argc, char **argv) {
     // Log that we are starting up
     syslog(LOG_INFO, "Starting bloomd.");
 
+    // Take over from the running bloomd, if any
+    bloom_handoff *handoff = NULL;
+    if (config->handoff_socket && init_handoff(config, &handoff)) {
+        syslog(LOG_ERR, "Failed to take over from the running bloomd!");
+        return 1;
+    }
+
     // Initialize the filters
     bloom_filtmgr *mgr;
     int mgr_res = init_filter_manager(config, 1, &mgr);
@@ -158,12 +185,15 @@ int main(int argc, char **argv) {
         syslog(LOG_ERR, "Failed to initialize bloomd filter manager!");
         return 1;
     }
+    if (handoff) handoff_warm_filters(handoff, mgr);
 
     // Start the background tasks
-    int flush_on, unmap_on;
-    pthread_t flush_thread, unmap_thread;
+    int flush_on, unmap_on, wal_on, writeback_on;
+    pthread_t flush_thread, unmap_thread, wal_thread, writeback_thread;
     flush_on = start_flush_thread(config, mgr, &SHOULD_RUN, &flush_thread);
     unmap_on = start_cold_unmap_thread(config, mgr, &SHOULD_RUN, &unmap_thread);
+    wal_on = start_wal_thread(config, mgr, &SHOULD_RUN, &wal_thread);
+    writeback_on = start_writeback_thread(config, mgr, &SHOULD_RUN, &writeback_thread);
 
     // Initialize the networking
     bloom_networking *netconf = NULL;
@@ -173,21 +203,30 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // Start the network workers
-    worker_args wargs = {mgr, netconf};
-    pthread_t *threads = calloc(config->worker_threads, sizeof(pthread_t));
-    for (int i=0; i < config->worker_threads; i++) {
+    // Start the network workers, the ones past
+    // worker_threads start out parked
+    worker_args wargs = {mgr, netconf, config, 0};
+    int num_threads = networking_max_workers(config);
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    for (int i=0; i < num_threads; i++) {
         pthread_create(&threads[i], NULL, (void*(*)(void*))worker_main, &wargs);
     }
 
     // Prepare our signal handlers to loop until we are signaled to quit
     signal(SIGPIPE, SIG_IGN);       // Ignore SIG_IGN
-    signal(SIGHUP, SIG_IGN);        // Ignore SIG_IGN
+    signal(SIGHUP, reload_handler);
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
+    // Serve the next bloomd to take over
+    if (handoff) handoff_serve(handoff, &SHOULD_RUN);
+
     // Loop forever
-    enter_main_loop(netconf, &SHOULD_RUN, threads);
+    enter_main_loop(netconf, &SHOULD_RUN, &SHOULD_RELOAD, config_file, threads);
+
+    // Hand the listeners over before they are closed
+    int handing_off = handoff && handoff_requested(handoff);
+    if (handing_off) handoff_send_listeners(handoff, netconf);
 
     // Begin the shutdown/cleanup
     shutdown_networking(netconf, threads);
@@ -195,9 +234,14 @@ int main(int argc, char **argv) {
     // Shutdown the background tasks
     if (flush_on) pthread_join(flush_thread, NULL);
     if (unmap_on) pthread_join(unmap_thread, NULL);
+    if (wal_on) pthread_join(wal_thread, NULL);
+    if (writeback_on) pthread_join(writeback_thread, NULL);
 
-    // Cleanup the filters
+    // Cleanup the filters. The next bloomd starts
+    // once they are closed, and the handoff is done.
+    if (handing_off) handoff_send_filters(handoff, mgr);
     destroy_filter_manager(mgr);
+    if (handoff) destroy_handoff(handoff);
 
     // Free our memory
     free(threads);
@@ -209,6 +253,15 @@ int main(int argc, char **argv) {
 
 // Main entry point for the worker threads
 static void worker_main(worker_args *args) {
+    // Spread the workers over the NUMA nodes
+    int id = __atomic_fetch_add(&args->next_worker, 1, __ATOMIC_RELAXED);
+    if (args->config->numa_policy != NUMA_OFF && numa_num_nodes() > 1) {
+        int node = id % numa_num_nodes();
+        if (!numa_bind_thread(node)) {
+            syslog(LOG_INFO, "Pinned worker %d to NUMA node %d.", id, node);
+        }
+    }
+
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(args->mgr);
 
@@ -0,0 +1,129 @@
+#include <sched.h>
+#include <time.h>
+#include "brlock.h"
+
+/**
+ * The table of readers. A slot holds the lock its
+ * reader has taken, or NULL if it is free.
+ */
+static bloom_brlock *READERS[BRLOCK_SLOTS];
+
+/**
+ * The address of this thread local identifies the thread
+ */
+static __thread char THREAD_ID;
+
+static uint64_t now_nsec(void);
+static inline bloom_brlock** reader_slot(bloom_brlock *lock);
+
+/**
+ * Initializes a lock. It starts biased.
+ * @arg lock The lock
+ * @return 0 on success.
+ */
+int brlock_init(bloom_brlock *lock) {
+    lock->rbias = 1;
+    lock->inhibit_until = 0;
+    return pthread_rwlock_init(&lock->rwlock, NULL);
+}
+
+/**
+ * Destroys a lock.
+ * @arg lock The lock
+ * @return 0 on success.
+ */
+int brlock_destroy(bloom_brlock *lock) {
+    return pthread_rwlock_destroy(&lock->rwlock);
+}
+
+/**
+ * Takes a lock for reading.
+ * @arg lock The lock
+ * @return The slot taken, to pass to brlock_rdunlock.
+ * NULL if the rwlock was taken.
+ */
+void* brlock_rdlock(bloom_brlock *lock) {
+    if (__atomic_load_n(&lock->rbias, __ATOMIC_RELAXED)) {
+        bloom_brlock **slot = reader_slot(lock);
+        bloom_brlock *expected = NULL;
+        if (__atomic_compare_exchange_n(slot, &expected, lock, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            // Pairs with the store in brlock_wrlock, either the
+            // writer sees the slot, or we see the bias cleared
+            if (__atomic_load_n(&lock->rbias, __ATOMIC_SEQ_CST))
+                return slot;
+            __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+        }
+    }
+
+    // Slot in use or unbiased, take the rwlock
+    pthread_rwlock_rdlock(&lock->rwlock);
+
+    // Restore the bias once the inhibition has passed. No
+    // writer holds the rwlock, so it will see this.
+    if (!__atomic_load_n(&lock->rbias, __ATOMIC_RELAXED) &&
+            now_nsec() >= __atomic_load_n(&lock->inhibit_until, __ATOMIC_RELAXED))
+        __atomic_store_n(&lock->rbias, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/**
+ * Releases a lock taken for reading.
+ * @arg lock The lock
+ * @arg slot The slot returned by brlock_rdlock
+ */
+void brlock_rdunlock(bloom_brlock *lock, void *slot) {
+    if (slot)
+        __atomic_store_n((bloom_brlock**)slot, NULL, __ATOMIC_RELEASE);
+    else
+        pthread_rwlock_unlock(&lock->rwlock);
+}
+
+/**
+ * Takes a lock for writing, revoking the bias.
+ * @arg lock The lock
+ */
+void brlock_wrlock(bloom_brlock *lock) {
+    pthread_rwlock_wrlock(&lock->rwlock);
+    if (!__atomic_load_n(&lock->rbias, __ATOMIC_RELAXED)) return;
+
+    // Clear the bias, and wait out the readers that skipped the rwlock
+    __atomic_store_n(&lock->rbias, 0, __ATOMIC_SEQ_CST);
+    uint64_t start = now_nsec();
+    for (int i=0; i < BRLOCK_SLOTS; i++) {
+        while (__atomic_load_n(READERS + i, __ATOMIC_ACQUIRE) == lock)
+            sched_yield();
+    }
+    uint64_t end = now_nsec();
+    __atomic_store_n(&lock->inhibit_until,
+            end + (end - start) * BRLOCK_INHIBIT_MULT, __ATOMIC_RELAXED);
+}
+
+/**
+ * Releases a lock taken for writing.
+ * @arg lock The lock
+ */
+void brlock_wrunlock(bloom_brlock *lock) {
+    pthread_rwlock_unlock(&lock->rwlock);
+}
+
+/**
+ * Returns the monotonic time in nanoseconds
+ */
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Returns the slot of the readers table for a
+ * lock taken by this thread.
+ */
+static inline bloom_brlock** reader_slot(bloom_brlock *lock) {
+    uint64_t h = (uintptr_t)lock ^ ((uintptr_t)&THREAD_ID * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return READERS + (h % BRLOCK_SLOTS);
+}
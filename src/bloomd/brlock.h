@@ -0,0 +1,83 @@
+#ifndef BLOOM_BRLOCK_H
+#define BLOOM_BRLOCK_H
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Reader biased locks, in the style of BRAVO. A brlock wraps
+ * a rwlock, and while it is read biased, readers skip the
+ * rwlock. A reader instead publishes the lock in a slot of a
+ * table shared by all the locks, picked by hashing the lock
+ * and the thread, so readers of a hot lock on other threads
+ * write to other slots, and never to the lock itself.
+ *
+ * A writer takes the rwlock, clears the bias, and waits for
+ * the table to have no readers of the lock. Revoking is slow,
+ * so the bias is only set again by a reader once
+ * BRLOCK_INHIBIT_MULT times the revocation has passed. Locks
+ * written often are then mostly unbiased, and cost what the
+ * rwlock does.
+ */
+
+/**
+ * The slots of the table of readers
+ */
+#define BRLOCK_SLOTS 4096
+
+/**
+ * A revocation keeps the lock unbiased for this
+ * many times how long the revocation took
+ */
+#define BRLOCK_INHIBIT_MULT 9
+
+/**
+ * A reader biased lock
+ */
+typedef struct {
+    pthread_rwlock_t rwlock;
+    volatile int rbias;         // Set if readers may skip the rwlock
+    uint64_t inhibit_until;     // No bias until then, in nanoseconds
+} bloom_brlock;
+
+/**
+ * Initializes a lock. It starts biased.
+ * @arg lock The lock
+ * @return 0 on success.
+ */
+int brlock_init(bloom_brlock *lock);
+
+/**
+ * Destroys a lock.
+ * @arg lock The lock
+ * @return 0 on success.
+ */
+int brlock_destroy(bloom_brlock *lock);
+
+/**
+ * Takes a lock for reading.
+ * @arg lock The lock
+ * @return The slot taken, to pass to brlock_rdunlock.
+ * NULL if the rwlock was taken.
+ */
+void* brlock_rdlock(bloom_brlock *lock);
+
+/**
+ * Releases a lock taken for reading.
+ * @arg lock The lock
+ * @arg slot The slot returned by brlock_rdlock
+ */
+void brlock_rdunlock(bloom_brlock *lock, void *slot);
+
+/**
+ * Takes a lock for writing, revoking the bias.
+ * @arg lock The lock
+ */
+void brlock_wrlock(bloom_brlock *lock);
+
+/**
+ * Releases a lock taken for writing.
+ * @arg lock The lock
+ */
+void brlock_wrunlock(bloom_brlock *lock);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include "bulk.h"
+
+/**
+ * A job of chunks, on the stack of the thread running it.
+ * The threads of the pool only join a job while it is
+ * queued, and the job is not left until they are out.
+ */
+typedef struct bulk_job {
+    int num_chunks;
+    bulk_chunk_cb cb;
+    void *data;
+    int next;           // Next chunk to claim
+    int done;           // Chunks done
+    int helpers;        // Threads of the pool in the job
+    struct bulk_job *next_job;
+} bulk_job;
+
+struct bloom_bulk_pool {
+    bloom_filtmgr *mgr;
+    int num_threads;
+    pthread_t *threads;
+    int run;                // Cleared to stop the threads
+    pthread_mutex_t lock;   // Protects the queue
+    pthread_cond_t cond;    // Signaled when a job is queued, or to stop
+    bulk_job *jobs;         // Jobs with chunks left to claim, oldest first
+};
+
+static void* bulk_thread_main(void *in);
+static void run_chunks(bulk_job *job);
+static void unqueue_job(bloom_bulk_pool *pool, bulk_job *job);
+
+/**
+ * Starts a pool of threads.
+ * @arg mgr The filter manager, the threads are its clients
+ * @arg threads The number of threads
+ * @arg pool Output, the pool
+ * @return 0 on success, negative on failure.
+ */
+int init_bulk_pool(bloom_filtmgr *mgr, int threads, bloom_bulk_pool **pool) {
+    bloom_bulk_pool *p = calloc(1, sizeof(bloom_bulk_pool));
+    if (!p) return -1;
+    p->mgr = mgr;
+    p->run = 1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->threads = calloc(threads, sizeof(pthread_t));
+    for (; p->num_threads < threads; p->num_threads++) {
+        if (pthread_create(p->threads + p->num_threads, NULL, bulk_thread_main, p)) {
+            perror("Failed to start bulk thread!");
+            break;
+        }
+    }
+    *pool = p;
+    return 0;
+}
+
+/**
+ * Runs the chunks of a job on the calling thread and the
+ * threads of the pool. Returns once every chunk is done.
+ * @arg pool The pool
+ * @arg num_chunks The number of chunks
+ * @arg cb Runs each chunk
+ * @arg data Passed to cb
+ */
+void bulk_pool_run(bloom_bulk_pool *pool, int num_chunks, bulk_chunk_cb cb, void *data) {
+    bulk_job job = {num_chunks, cb, data, 0, 0, 0, NULL};
+
+    // Queue the job for the idle threads
+    pthread_mutex_lock(&pool->lock);
+    bulk_job **tail = &pool->jobs;
+    while (*tail) tail = &(*tail)->next_job;
+    *tail = &job;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Claim chunks until none are left, then wait for the
+    // chunks claimed by the pool and for it to leave the job
+    run_chunks(&job);
+    unqueue_job(pool, &job);
+    while (__atomic_load_n(&job.done, __ATOMIC_ACQUIRE) < num_chunks ||
+            __atomic_load_n(&job.helpers, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+/**
+ * Stops the threads of a pool and frees it.
+ * @arg pool The pool
+ * @return 0 on success.
+ */
+int destroy_bulk_pool(bloom_bulk_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->run = 0;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i=0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return 0;
+}
+
+/**
+ * Joins the oldest queued job, until the pool is stopped
+ */
+static void* bulk_thread_main(void *in) {
+    bloom_bulk_pool *pool = in;
+    bulk_job *job;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->run && !pool->jobs)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        job = pool->jobs;
+        if (job) __atomic_add_fetch(&job->helpers, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool->lock);
+        if (!job) break;
+
+        // Every chunk is claimed once we are out, so the
+        // job is taken off the queue for the next one
+        filtmgr_client_checkpoint(pool->mgr);
+        run_chunks(job);
+        filtmgr_client_leave(pool->mgr);
+        unqueue_job(pool, job);
+        __atomic_sub_fetch(&job->helpers, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * Claims and runs the chunks of a job, until none are left
+ */
+static void run_chunks(bulk_job *job) {
+    int chunk;
+    while ((chunk = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->num_chunks) {
+        job->cb(job->data, chunk);
+        __atomic_add_fetch(&job->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Takes a job off the queue, if it is still queued
+ */
+static void unqueue_job(bloom_bulk_pool *pool, bulk_job *job) {
+    pthread_mutex_lock(&pool->lock);
+    bulk_job **prev = &pool->jobs;
+    while (*prev && *prev != job) prev = &(*prev)->next_job;
+    if (*prev) *prev = job->next_job;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,48 @@
+#ifndef BLOOM_BULK_H
+#define BLOOM_BULK_H
+#include "filter_manager.h"
+
+/**
+ * Runs the chunks of large bulk commands in parallel. The
+ * worker handling a command queues a job of chunks, and then
+ * claims chunks of it, along with the idle threads of the pool.
+ * A chunk is claimed with an atomic increment, so a thread that
+ * is done with its chunk takes the next one, and slow chunks
+ * do not hold up the others.
+ */
+typedef struct bloom_bulk_pool bloom_bulk_pool;
+
+/**
+ * Runs a chunk of a job.
+ * @arg data The data of the job
+ * @arg chunk The index of the chunk
+ */
+typedef void(*bulk_chunk_cb)(void *data, int chunk);
+
+/**
+ * Starts a pool of threads.
+ * @arg mgr The filter manager, the threads are its clients
+ * @arg threads The number of threads
+ * @arg pool Output, the pool
+ * @return 0 on success, negative on failure.
+ */
+int init_bulk_pool(bloom_filtmgr *mgr, int threads, bloom_bulk_pool **pool);
+
+/**
+ * Runs the chunks of a job on the calling thread and the
+ * threads of the pool. Returns once every chunk is done.
+ * @arg pool The pool
+ * @arg num_chunks The number of chunks
+ * @arg cb Runs each chunk
+ * @arg data Passed to cb
+ */
+void bulk_pool_run(bloom_bulk_pool *pool, int num_chunks, bulk_chunk_cb cb, void *data);
+
+/**
+ * Stops the threads of a pool and frees it.
+ * @arg pool The pool
+ * @return 0 on success.
+ */
+int destroy_bulk_pool(bloom_bulk_pool *pool);
+
+#endif
@@ -0,0 +1,425 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "catalog.h"
+#include "art.h"
+
+/**
+ * The first line of a catalog, with the version of the format
+ */
+static const char CATALOG_HEADER[] = "bloomd-catalog 7\n";
+
+/**
+ * The first line of a catalog of the previous version,
+ * whose records have no hashed flag
+ */
+static const char CATALOG_HEADER_V6[] = "bloomd-catalog 6\n";
+
+/**
+ * The first line of an older catalog, whose records
+ * have no optimize profile either
+ */
+static const char CATALOG_HEADER_V5[] = "bloomd-catalog 5\n";
+
+/**
+ * The first line of a catalog of the version before,
+ * whose records have no pin flag either
+ */
+static const char CATALOG_HEADER_V4[] = "bloomd-catalog 4\n";
+
+/**
+ * The first line of an older catalog, whose records
+ * have no frozen flag either
+ */
+static const char CATALOG_HEADER_V3[] = "bloomd-catalog 3\n";
+
+/**
+ * The first line of the oldest catalog, whose records
+ * have no partitions either
+ */
+static const char CATALOG_HEADER_V2[] = "bloomd-catalog 2\n";
+
+/**
+ * The longest record. Filter names are at most 200 bytes,
+ * and the numbers of a config fit in the rest.
+ */
+#define MAX_RECORD_LEN 512
+
+/**
+ * The suffix of a catalog until it is committed
+ */
+#define TMP_SUFFIX ".tmp"
+
+static int replay_record(art_tree *live, char *line, int version);
+static int catalog_load_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int catalog_free_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int append_record(bloom_catalog *catalog, char *record, int len);
+static uint64_t* map_generation(char *data_dir);
+
+/**
+ * Passed through the iteration of the live filters
+ */
+typedef struct {
+    catalog_cb cb;
+    void *data;
+} catalog_load_ctx;
+
+/**
+ * Reads the catalog of a data directory. The callback is only
+ * invoked once the whole catalog is read, and only if it is valid.
+ * A record torn by a crash at the end of the catalog is ignored.
+ * @arg data_dir The data directory
+ * @arg cb The callback, invoked for each live filter
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, -ENOENT if there is no catalog,
+ * -EINVAL if it is corrupt, or another negative errno.
+ */
+int catalog_load(char *data_dir, catalog_cb cb, void *data) {
+    char *path = join_path(data_dir, CATALOG_FILENAME);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+    size_t len = st.st_size;
+    size_t header_len = sizeof(CATALOG_HEADER) - 1;
+    if (len < header_len) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    // Map the whole catalog, it is read once in order
+    char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) return -errno;
+    madvise(buf, len, MADV_SEQUENTIAL);
+
+    // Replay the records, the last record of a filter wins
+    art_tree live;
+    init_art_tree(&live);
+    int version = 7, res = 0;
+    if (!memcmp(buf, CATALOG_HEADER_V2, header_len)) {
+        version = 2;
+    } else if (!memcmp(buf, CATALOG_HEADER_V3, header_len)) {
+        version = 3;
+    } else if (!memcmp(buf, CATALOG_HEADER_V4, header_len)) {
+        version = 4;
+    } else if (!memcmp(buf, CATALOG_HEADER_V5, header_len)) {
+        version = 5;
+    } else if (!memcmp(buf, CATALOG_HEADER_V6, header_len)) {
+        version = 6;
+    } else if (memcmp(buf, CATALOG_HEADER, header_len)) {
+        res = -EINVAL;
+    }
+    char line[MAX_RECORD_LEN];
+    char *pos = buf + header_len;
+    char *end = buf + len;
+    char *eol;
+    while (!res && pos < end) {
+        // A record without a newline was torn, and is the last
+        eol = memchr(pos, '\n', end - pos);
+        if (!eol) break;
+        if (eol - pos >= MAX_RECORD_LEN) {
+            res = -EINVAL;
+            break;
+        }
+        memcpy(line, pos, eol - pos);
+        line[eol - pos] = '\0';
+        res = replay_record(&live, line, version);
+        pos = eol + 1;
+    }
+    munmap(buf, len);
+
+    // Only hand out the filters of a valid catalog
+    if (!res) {
+        catalog_load_ctx ctx = {cb, data};
+        art_iter(&live, catalog_load_cb, &ctx);
+    }
+    art_iter(&live, catalog_free_cb, NULL);
+    destroy_art_tree(&live);
+    return res;
+}
+
+/**
+ * Applies a single record to the live filters
+ * @arg version The version of the catalog
+ * @return 0 on success, -EINVAL if the record is corrupt.
+ */
+static int replay_record(art_tree *live, char *line, int version) {
+    char name[MAX_RECORD_LEN];
+    int consumed = 0;
+    void *old;
+
+    if (line[0] == '-') {
+        if (sscanf(line, "- %s%n", name, &consumed) != 1 || line[consumed]) return -EINVAL;
+        old = art_delete(live, (unsigned char*)name, strlen(name)+1);
+        free(old);
+        return 0;
+
+    } else if (line[0] != '+') {
+        return -EINVAL;
+    }
+
+    bloom_filter_config *config = calloc(1, sizeof(bloom_filter_config));
+    unsigned long long initial_capacity, size, capacity, bytes;
+    int engine, optimize = OPTIMIZE_MEMORY;
+    int fields, expected = version + 14;
+    if (version == 2) {
+        config->partitions = 1;
+        fields = sscanf(line, "+ %s %llu %lg %d %lg %d %d %d %d %d %d %d %d %llu %llu %llu%n",
+                name, &initial_capacity, &config->default_probability,
+                &config->scale_size, &config->probability_reduction,
+                &config->in_memory, &config->counting, &engine,
+                &config->window, &config->generations, &config->scalable,
+                &config->reject_full, &config->container, &size, &capacity,
+                &bytes, &consumed);
+    } else if (version == 3) {
+        fields = sscanf(line, "+ %s %llu %lg %d %lg %d %d %d %d %d %d %d %d %d %llu %llu %llu%n",
+                name, &initial_capacity, &config->default_probability,
+                &config->scale_size, &config->probability_reduction,
+                &config->in_memory, &config->counting, &engine,
+                &config->window, &config->generations, &config->scalable,
+                &config->reject_full, &config->container, &config->partitions,
+                &size, &capacity, &bytes, &consumed);
+    } else if (version == 4) {
+        fields = sscanf(line, "+ %s %llu %lg %d %lg %d %d %d %d %d %d %d %d %d %d %llu %llu %llu%n",
+                name, &initial_capacity, &config->default_probability,
+                &config->scale_size, &config->probability_reduction,
+                &config->in_memory, &config->counting, &engine,
+                &config->window, &config->generations, &config->scalable,
+                &config->reject_full, &config->container, &config->partitions,
+                &config->frozen, &size, &capacity, &bytes, &consumed);
+    } else if (version == 5) {
+        fields = sscanf(line, "+ %s %llu %lg %d %lg %d %d %d %d %d %d %d %d %d %d %d %llu %llu %llu%n",
+                name, &initial_capacity, &config->default_probability,
+                &config->scale_size, &config->probability_reduction,
+                &config->in_memory, &config->counting, &engine,
+                &config->window, &config->generations, &config->scalable,
+                &config->reject_full, &config->container, &config->partitions,
+                &config->frozen, &config->pin, &size, &capacity, &bytes, &consumed);
+    } else if (version == 6) {
+        fields = sscanf(line, "+ %s %llu %lg %d %lg %d %d %d %d %d %d %d %d %d %d %d %d %llu %llu %llu%n",
+                name, &initial_capacity, &config->default_probability,
+                &config->scale_size, &config->probability_reduction,
+                &config->in_memory, &config->counting, &engine,
+                &config->window, &config->generations, &config->scalable,
+                &config->reject_full, &config->container, &config->partitions,
+                &config->frozen, &config->pin, &optimize, &size, &capacity,
+                &bytes, &consumed);
+    } else {
+        fields = sscanf(line, "+ %s %llu %lg %d %lg %d %d %d %d %d %d %d %d %d %d %d %d %d %llu %llu %llu%n",
+                name, &initial_capacity, &config->default_probability,
+                &config->scale_size, &config->probability_reduction,
+                &config->in_memory, &config->counting, &engine,
+                &config->window, &config->generations, &config->scalable,
+                &config->reject_full, &config->container, &config->partitions,
+                &config->frozen, &config->pin, &optimize, &config->hashed, &size,
+                &capacity, &bytes, &consumed);
+    }
+    if (fields != expected || line[consumed]) {
+        free(config);
+        return -EINVAL;
+    }
+    config->initial_capacity = initial_capacity;
+    config->engine = (engine == ENGINE_CUCKOO) ? ENGINE_CUCKOO : ENGINE_BLOOM;
+    config->optimize = (optimize == OPTIMIZE_SPEED || optimize == OPTIMIZE_BALANCED) ?
+        optimize : OPTIMIZE_MEMORY;
+    config->size = size;
+    config->capacity = capacity;
+    config->bytes = bytes;
+
+    old = art_insert(live, (unsigned char*)name, strlen(name)+1, config);
+    free(old);
+    return 0;
+}
+
+/**
+ * Hands a live filter to the callback of catalog_load
+ */
+static int catalog_load_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    catalog_load_ctx *ctx = data;
+    ctx->cb(ctx->data, (char*)key, value);
+    return 0;
+}
+
+/**
+ * Releases the config of a live filter
+ */
+static int catalog_free_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)data;
+    (void)key;
+    (void)key_len;
+    free(value);
+    return 0;
+}
+
+/**
+ * Starts a new catalog for a data directory. The records are
+ * written to a temporary file until the catalog is committed,
+ * so the old catalog stays valid until then.
+ * @arg data_dir The data directory
+ * @arg catalog Output, the new catalog
+ * @return 0 on success, negative errno on failure.
+ */
+int init_catalog(char *data_dir, bloom_catalog **catalog) {
+    bloom_catalog *c = calloc(1, sizeof(bloom_catalog));
+    c->path = join_path(data_dir, CATALOG_FILENAME);
+    c->tmp_path = malloc(strlen(c->path) + sizeof(TMP_SUFFIX));
+    strcpy(c->tmp_path, c->path);
+    strcat(c->tmp_path, TMP_SUFFIX);
+
+    c->f = fopen(c->tmp_path, "w");
+    if (!c->f || fputs(CATALOG_HEADER, c->f) == EOF) {
+        int res = -errno;
+        syslog(LOG_ERR, "Failed to create the catalog '%s'. %s", c->tmp_path, strerror(errno));
+        if (c->f) fclose(c->f);
+        unlink(c->tmp_path);
+        free(c->tmp_path);
+        free(c->path);
+        free(c);
+        return res;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+
+    // The data files may have changed while we were down
+    c->generation = map_generation(data_dir);
+    catalog_bump(c);
+    *catalog = c;
+    return 0;
+}
+
+/**
+ * Syncs the new catalog and renames it into place. Records
+ * added afterwards are appended to the committed catalog.
+ * @arg catalog The catalog
+ * @return 0 on success, negative errno on failure.
+ */
+int catalog_commit(bloom_catalog *catalog) {
+    int res = 0;
+    pthread_mutex_lock(&catalog->lock);
+    if (fflush(catalog->f) || fsync(fileno(catalog->f)) ||
+            rename(catalog->tmp_path, catalog->path)) {
+        res = -errno;
+        syslog(LOG_ERR, "Failed to commit the catalog '%s'. %s", catalog->path, strerror(errno));
+    } else {
+        free(catalog->tmp_path);
+        catalog->tmp_path = NULL;
+    }
+    pthread_mutex_unlock(&catalog->lock);
+    return res;
+}
+
+/**
+ * Closes a catalog. An uncommitted catalog is discarded.
+ * @arg catalog The catalog
+ * @return 0 on success.
+ */
+int destroy_catalog(bloom_catalog *catalog) {
+    fclose(catalog->f);
+    if (catalog->tmp_path) {
+        unlink(catalog->tmp_path);
+        free(catalog->tmp_path);
+    }
+    free(catalog->path);
+    if (catalog->generation) munmap(catalog->generation, GENERATION_FILE_SIZE);
+    pthread_mutex_destroy(&catalog->lock);
+    free(catalog);
+    return 0;
+}
+
+/**
+ * Records a new filter, or a new config of a filter.
+ * Thread safe.
+ * @arg catalog The catalog
+ * @arg filter_name The name of the filter
+ * @arg config The filter config
+ * @return 0 on success, negative errno on failure.
+ */
+int catalog_add(bloom_catalog *catalog, char *filter_name, bloom_filter_config *config) {
+    char record[MAX_RECORD_LEN];
+    int len = snprintf(record, sizeof(record),
+            "+ %s %llu %.17g %d %.17g %d %d %d %d %d %d %d %d %d %d %d %d %d %llu %llu %llu\n",
+            filter_name, (unsigned long long)config->initial_capacity,
+            config->default_probability, config->scale_size,
+            config->probability_reduction, config->in_memory,
+            config->counting, (int)config->engine, config->window,
+            config->generations, config->scalable, config->reject_full,
+            config->container, config->partitions, config->frozen, config->pin,
+            (int)config->optimize, config->hashed, (unsigned long long)config->size,
+            (unsigned long long)config->capacity,
+            (unsigned long long)config->bytes);
+    if (len >= MAX_RECORD_LEN) return -ENAMETOOLONG;
+    return append_record(catalog, record, len);
+}
+
+/**
+ * Records that a filter was deleted. Thread safe.
+ * @arg catalog The catalog
+ * @arg filter_name The name of the filter
+ * @return 0 on success, negative errno on failure.
+ */
+int catalog_remove(bloom_catalog *catalog, char *filter_name) {
+    char record[MAX_RECORD_LEN];
+    int len = snprintf(record, sizeof(record), "- %s\n", filter_name);
+    if (len >= MAX_RECORD_LEN) return -ENAMETOOLONG;
+    return append_record(catalog, record, len);
+}
+
+/**
+ * Appends a whole record to the catalog. The record is
+ * flushed right away, so a crash can only tear the last one.
+ */
+static int append_record(bloom_catalog *catalog, char *record, int len) {
+    int res = 0;
+    pthread_mutex_lock(&catalog->lock);
+    if (fwrite(record, 1, len, catalog->f) != (size_t)len || fflush(catalog->f)) {
+        res = -errno;
+        syslog(LOG_ERR, "Failed to append to the catalog '%s'. %s", catalog->path, strerror(errno));
+    }
+    pthread_mutex_unlock(&catalog->lock);
+    return res;
+}
+
+
+/**
+ * Bumps the generation, once the data files of a filter were
+ * added, removed or replaced. Thread safe.
+ */
+void catalog_bump(bloom_catalog *catalog) {
+    if (catalog->generation)
+        __atomic_add_fetch(catalog->generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Maps the generation file of a data directory, creating it
+ * if needed. The counter is kept across restarts.
+ * @return The counter, or NULL on failure.
+ */
+static uint64_t* map_generation(char *data_dir) {
+    char *path = join_path(data_dir, GENERATION_FILENAME);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    void *addr = MAP_FAILED;
+    struct stat st;
+    if (fd >= 0 && !fstat(fd, &st) &&
+            (st.st_size >= GENERATION_FILE_SIZE || !ftruncate(fd, GENERATION_FILE_SIZE))) {
+        addr = mmap(NULL, GENERATION_FILE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (addr == MAP_FAILED) {
+        syslog(LOG_WARNING, "Failed to map the generation file '%s'. %s", path, strerror(errno));
+        addr = NULL;
+    }
+    if (fd >= 0) close(fd);
+    free(path);
+    return addr;
+}
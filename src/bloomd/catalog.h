@@ -0,0 +1,115 @@
+#ifndef BLOOM_CATALOG_H
+#define BLOOM_CATALOG_H
+#include <stdio.h>
+#include <pthread.h>
+#include "config.h"
+
+/**
+ * The catalog records every filter in the data directory, with
+ * its filter config, in a single append-only file. Startup reads
+ * the catalog in one pass, instead of scanning the folder and
+ * reading the config of each filter. The folders are only scanned
+ * if the catalog is missing or corrupt.
+ *
+ * Each record is a line. Adds record the whole config, and replace
+ * any earlier record of the filter. Removes only record the name.
+ * The catalog is rewritten with just the live filters on startup.
+ */
+
+/**
+ * The name of the catalog in the data directory. It must not
+ * look like the folder of a filter, which start with "bloomd."
+ */
+#define CATALOG_FILENAME "filters.catalog"
+
+/**
+ * The name of the generation file in the data directory. It holds
+ * a counter, at the start of a page, that is bumped whenever the
+ * data files of a filter change. Processes reading the data files
+ * directly map it, and reopen the data files once it moves.
+ */
+#define GENERATION_FILENAME "filters.gen"
+#define GENERATION_FILE_SIZE 4096
+
+/**
+ * An open catalog, which records are appended to
+ */
+typedef struct bloom_catalog {
+    pthread_mutex_t lock;   // Serializes the appends
+    FILE *f;
+    char *path;             // Path of the catalog
+    char *tmp_path;         // Path of the catalog until committed
+    uint64_t *generation;   // Mapped counter of data file changes, may be NULL
+} bloom_catalog;
+
+/**
+ * Invoked for each filter in the catalog
+ * @arg data Opaque handle
+ * @arg filter_name The name of the filter
+ * @arg config The filter config of the filter
+ */
+typedef void(*catalog_cb)(void *data, char *filter_name, bloom_filter_config *config);
+
+/**
+ * Reads the catalog of a data directory. The callback is only
+ * invoked once the whole catalog is read, and only if it is valid.
+ * A record torn by a crash at the end of the catalog is ignored.
+ * @arg data_dir The data directory
+ * @arg cb The callback, invoked for each live filter
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, -ENOENT if there is no catalog,
+ * -EINVAL if it is corrupt, or another negative errno.
+ */
+int catalog_load(char *data_dir, catalog_cb cb, void *data);
+
+/**
+ * Starts a new catalog for a data directory. The records are
+ * written to a temporary file until the catalog is committed,
+ * so the old catalog stays valid until then.
+ * @arg data_dir The data directory
+ * @arg catalog Output, the new catalog
+ * @return 0 on success, negative errno on failure.
+ */
+int init_catalog(char *data_dir, bloom_catalog **catalog);
+
+/**
+ * Syncs the new catalog and renames it into place. Records
+ * added afterwards are appended to the committed catalog.
+ * @arg catalog The catalog
+ * @return 0 on success, negative errno on failure.
+ */
+int catalog_commit(bloom_catalog *catalog);
+
+/**
+ * Closes a catalog. An uncommitted catalog is discarded.
+ * @arg catalog The catalog
+ * @return 0 on success.
+ */
+int destroy_catalog(bloom_catalog *catalog);
+
+/**
+ * Records a new filter, or a new config of a filter.
+ * Thread safe.
+ * @arg catalog The catalog
+ * @arg filter_name The name of the filter
+ * @arg config The filter config
+ * @return 0 on success, negative errno on failure.
+ */
+int catalog_add(bloom_catalog *catalog, char *filter_name, bloom_filter_config *config);
+
+/**
+ * Records that a filter was deleted. Thread safe.
+ * @arg catalog The catalog
+ * @arg filter_name The name of the filter
+ * @return 0 on success, negative errno on failure.
+ */
+int catalog_remove(bloom_catalog *catalog, char *filter_name);
+
+/**
+ * Bumps the generation, once the data files of a filter were
+ * added, removed or replaced. Thread safe.
+ * @arg catalog The catalog
+ */
+void catalog_bump(bloom_catalog *catalog);
+
+#endif
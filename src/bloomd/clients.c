@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "clients.h"
+#include "spinlock.h"
+
+/**
+ * The table of one thread. Names are never removed, so a
+ * slot keeps its name, and the gauge of the connections sums
+ * to zero over the threads once they are all closed.
+ */
+typedef struct client_block {
+    bloom_spinlock lock;
+    bloom_client_entry slots[CLIENT_SLOTS];
+    int used;
+    struct client_block *next;
+} __attribute__ ((aligned (64))) client_block;
+
+// The block of the calling thread, allocated on first use
+static __thread client_block *LOCAL_BLOCK = NULL;
+
+// All the blocks. Pushed without a lock, and never freed
+static client_block *BLOCKS = NULL;
+
+// The ticks in a microsecond, measured once
+static pthread_once_t CALIBRATE_ONCE = PTHREAD_ONCE_INIT;
+static double TICKS_PER_USEC = 1000;
+
+static client_block* local_block(void);
+static bloom_client_entry* block_slot(client_block *b, const char *name);
+static void usage_add(bloom_client_usage *to, bloom_client_usage *from);
+static void calibrate(void);
+static uint64_t monotonic_nsec(void);
+static int entry_cmp(const void *a, const void *b);
+
+/**
+ * Reads a cheap timestamp, for the time spent on a client.
+ * @return The timestamp, in ticks.
+ */
+uint64_t clients_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_nsec();
+#endif
+}
+
+/**
+ * Counts usage of the calling thread under a client name.
+ * @notes Thread safe.
+ */
+void clients_add(const char *name, bloom_client_usage *usage) {
+    client_block *b = LOCAL_BLOCK;
+    if (!b) b = local_block();
+    if (!name || !*name) name = CLIENT_UNNAMED;
+
+    LOCK_BLOOM_SPIN(&b->lock);
+    usage_add(&block_slot(b, name)->usage, usage);
+    UNLOCK_BLOOM_SPIN(&b->lock);
+}
+
+/**
+ * Reads the usage of the clients, summed over the threads.
+ * @notes Thread safe.
+ */
+void clients_read(bloom_client_entry *out, int *num) {
+    pthread_once(&CALIBRATE_ONCE, calibrate);
+
+    // Sum the tables of the threads, by name
+    bloom_client_entry *all = NULL, *e;
+    int n = 0, cap = 0, j;
+    client_block *b = __atomic_load_n(&BLOCKS, __ATOMIC_ACQUIRE);
+    for (; b; b = b->next) {
+        cap += CLIENT_SLOTS;
+        all = realloc(all, cap * sizeof(bloom_client_entry));
+        LOCK_BLOOM_SPIN(&b->lock);
+        for (int i=0; i < b->used; i++) {
+            e = b->slots + i;
+            for (j=0; j < n && strcmp(all[j].name, e->name); j++);
+            if (j < n) {
+                usage_add(&all[j].usage, &e->usage);
+            } else {
+                all[n++] = *e;
+            }
+        }
+        UNLOCK_BLOOM_SPIN(&b->lock);
+    }
+
+    for (int i=0; i < n; i++) all[i].cpu_usec = all[i].usage.ticks / TICKS_PER_USEC;
+    qsort(all, n, sizeof(bloom_client_entry), entry_cmp);
+    if (n > *num) n = *num;
+    if (n) memcpy(out, all, n * sizeof(bloom_client_entry));
+    *num = n;
+    free(all);
+}
+
+/**
+ * Returns the slot of a name in a table, taking a free
+ * one, or the overflow slot once the table is full.
+ */
+static bloom_client_entry* block_slot(client_block *b, const char *name) {
+    for (int i=0; i < b->used; i++) {
+        if (strncmp(b->slots[i].name, name, CLIENT_NAME) == 0) return b->slots + i;
+    }
+
+    // The last slot is kept for the overflow
+    if (b->used == CLIENT_SLOTS - 1) name = CLIENT_OVERFLOW;
+    else if (b->used == CLIENT_SLOTS) return block_slot(b, CLIENT_OVERFLOW);
+
+    bloom_client_entry *e = b->slots + b->used++;
+    strncpy(e->name, name, CLIENT_NAME);
+    e->name[CLIENT_NAME] = '\0';
+    return e;
+}
+
+/**
+ * Adds one usage to another
+ */
+static void usage_add(bloom_client_usage *to, bloom_client_usage *from) {
+    to->connections += from->connections;
+    to->commands += from->commands;
+    to->keys += from->keys;
+    to->bytes_in += from->bytes_in;
+    to->bytes_out += from->bytes_out;
+    to->ticks += from->ticks;
+}
+
+/**
+ * Measures the rate of the time stamp counter against the
+ * monotonic clock. Other platforms count nanoseconds.
+ */
+static void calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t start_ns = monotonic_nsec(), start = clients_ticks();
+    struct timespec wait = {0, 10000000};
+    nanosleep(&wait, NULL);
+    uint64_t end_ns = monotonic_nsec(), end = clients_ticks();
+    if (end_ns > start_ns && end > start) {
+        TICKS_PER_USEC = (double)(end - start) * 1000 / (end_ns - start_ns);
+    }
+#endif
+}
+
+// Returns the monotonic time in nanoseconds
+static uint64_t monotonic_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Orders entries by the time spent, busiest first
+ */
+static int entry_cmp(const void *a, const void *b) {
+    uint64_t ticks_a = ((bloom_client_entry*)a)->usage.ticks;
+    uint64_t ticks_b = ((bloom_client_entry*)b)->usage.ticks;
+    return (ticks_a < ticks_b) ? 1 : (ticks_a > ticks_b) ? -1 : 0;
+}
+
+/**
+ * Allocates and registers the block of the calling thread
+ */
+static client_block* local_block(void) {
+    client_block *b;
+    if (posix_memalign((void**)&b, 64, sizeof(client_block))) abort();
+    memset(b, 0, sizeof(client_block));
+    INIT_BLOOM_SPIN(&b->lock);
+
+    // Push onto the list of blocks
+    b->next = __atomic_load_n(&BLOCKS, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&BLOCKS, &b->next, b, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    LOCAL_BLOCK = b;
+    return b;
+}
@@ -0,0 +1,76 @@
+#ifndef BLOOM_CLIENTS_H
+#define BLOOM_CLIENTS_H
+#include <stdint.h>
+
+/**
+ * Attributes the load to the clients, by the name a connection
+ * gives with the hello command. Each thread counts the usage of
+ * the connections it handles into a table of its own, which has
+ * a lock that is only contended by a read. Connections without a
+ * name are counted under CLIENT_UNNAMED.
+ */
+#define CLIENT_SLOTS 128
+
+/**
+ * The most bytes of a client name
+ */
+#define CLIENT_NAME 64
+
+/**
+ * The name of the connections that did not give one
+ */
+#define CLIENT_UNNAMED "-"
+
+/**
+ * The name the usage of a thread is counted under once
+ * its table is full of other names
+ */
+#define CLIENT_OVERFLOW "*"
+
+/**
+ * The usage of a client
+ */
+typedef struct {
+    int64_t connections;    // Gauge of the open connections
+    uint64_t commands;      // Commands handled
+    uint64_t keys;          // Keys checked, set or unset
+    uint64_t bytes_in;      // Bytes of input read
+    uint64_t bytes_out;     // Bytes of responses
+    uint64_t ticks;         // Time spent handling the commands, see clients_ticks
+} bloom_client_usage;
+
+/**
+ * The usage of a named client, as read
+ */
+typedef struct {
+    char name[CLIENT_NAME + 1];
+    bloom_client_usage usage;
+    uint64_t cpu_usec;      // The ticks, in microseconds
+} bloom_client_entry;
+
+/**
+ * Reads a cheap timestamp, for the time spent on a client.
+ * This is the time stamp counter on x86, which the kernel keeps
+ * constant rate and in sync across cores, and the monotonic clock
+ * in nanoseconds elsewhere.
+ * @return The timestamp, in ticks.
+ */
+uint64_t clients_ticks(void);
+
+/**
+ * Counts usage of the calling thread under a client name.
+ * @notes Thread safe.
+ * @arg name The client name, or NULL for an unnamed client
+ * @arg usage The usage to add. The connections may be negative.
+ */
+void clients_add(const char *name, bloom_client_usage *usage);
+
+/**
+ * Reads the usage of the clients, summed over the threads.
+ * @notes Thread safe.
+ * @arg out Output, the clients, most time spent first
+ * @arg num Input, the most clients. Output, the clients read.
+ */
+void clients_read(bloom_client_entry *out, int *num);
+
+#endif
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "cluster.h"
+
+extern void WyHash128(const void *key, uint64_t len, uint64_t seed, uint64_t *out);
+
+/**
+ * The points of each node on the ring. More points
+ * spread the filters more evenly over the nodes.
+ */
+#define CLUSTER_VNODES 128
+
+/**
+ * The most idle connections kept to each node
+ */
+#define CLUSTER_POOL_SIZE 16
+
+/**
+ * How long a request may wait on a node before
+ * the node is considered unavailable
+ */
+#define CLUSTER_TIMEOUT_SEC 5
+
+/**
+ * The initial size of the response buffer
+ */
+#define CLUSTER_RESP_SIZE 4096
+
+/**
+ * The first command of each connection, which stops
+ * the other node from proxying our commands
+ */
+static const char PEER_CMD[] = "peer\n";
+static const char DONE_LINE[] = "Done\n";
+
+/**
+ * A point of a node on the ring
+ */
+typedef struct {
+    uint64_t hash;
+    int node;
+} ring_point;
+
+/**
+ * A connection to another node
+ */
+typedef struct peer_conn {
+    int fd;
+    struct peer_conn *next;
+} peer_conn;
+
+/**
+ * A node of the cluster
+ */
+typedef struct {
+    char *name;             // host:port, as configured
+    char *host;
+    char *port;
+    pthread_mutex_t lock;   // Protects the pool
+    peer_conn *idle;        // Connections not in use
+    int num_idle;
+} cluster_node;
+
+struct bloom_cluster {
+    int self;               // Index of this node
+    int num_nodes;
+    cluster_node *nodes;
+    int num_points;
+    ring_point *ring;       // Sorted by hash
+};
+
+static int parse_nodes(char *list, bloom_cluster *cluster);
+static int point_cmp(const void *a, const void *b);
+static uint64_t name_hash(const char *name, int len);
+static peer_conn* take_conn(cluster_node *n, int *fresh);
+static void give_conn(cluster_node *n, peer_conn *pc);
+static int connect_node(cluster_node *n, peer_conn **out);
+static int send_all(int fd, const char *buf, int len);
+static int read_responses(int fd, int num, char **resp, int *resp_lens);
+
+/**
+ * Builds the ring of the nodes of the config.
+ * @arg config The configuration, with the nodes and this node
+ * @arg cluster Output, the cluster
+ * @return 0 on success, -EINVAL if the nodes are bad.
+ */
+int init_cluster(bloom_config *config, bloom_cluster **cluster) {
+    bloom_cluster *c = calloc(1, sizeof(bloom_cluster));
+    c->self = -1;
+    if (parse_nodes(config->cluster_nodes, c)) {
+        syslog(LOG_ERR, "Bad list of cluster nodes: %s", config->cluster_nodes);
+        destroy_cluster(c);
+        return -EINVAL;
+    }
+    for (int i=0; i < c->num_nodes; i++) {
+        if (config->cluster_self && !strcmp(c->nodes[i].name, config->cluster_self)) c->self = i;
+    }
+    if (c->self == -1) {
+        syslog(LOG_ERR, "This node, %s, is not one of the cluster nodes.",
+                (config->cluster_self) ? config->cluster_self : "(none)");
+        destroy_cluster(c);
+        return -EINVAL;
+    }
+
+    // Place the points of every node, by the hash of its name
+    char point[256];
+    int len;
+    c->ring = malloc((unsigned)c->num_nodes * CLUSTER_VNODES * sizeof(ring_point));
+    for (int i=0; i < c->num_nodes; i++) {
+        for (int v=0; v < CLUSTER_VNODES; v++) {
+            len = snprintf(point, sizeof(point), "%s#%d", c->nodes[i].name, v);
+            c->ring[c->num_points].hash = name_hash(point, len);
+            c->ring[c->num_points].node = i;
+            c->num_points++;
+        }
+    }
+    qsort(c->ring, c->num_points, sizeof(ring_point), point_cmp);
+
+    syslog(LOG_INFO, "Joined a cluster of %d nodes as %s", c->num_nodes, c->nodes[c->self].name);
+    *cluster = c;
+    return 0;
+}
+
+/**
+ * Splits a list of host:port pairs, separated by commas
+ * @return 0 on success, 1 if the list is bad.
+ */
+static int parse_nodes(char *list, bloom_cluster *cluster) {
+    if (!list) return 1;
+    char *copy = strdup(list);
+    char *save = NULL;
+    int num = 0;
+    for (char *p=copy; *p; p++) if (*p == ',') num++;
+    cluster->nodes = calloc(num + 1, sizeof(cluster_node));
+
+    int res = 0;
+    char *port;
+    cluster_node *n;
+    for (char *tok=strtok_r(copy, ", ", &save); tok; tok=strtok_r(NULL, ", ", &save)) {
+        port = strrchr(tok, ':');
+        if (!port || port == tok || atoi(port + 1) <= 0 || atoi(port + 1) > 65535) {
+            res = 1;
+            break;
+        }
+
+        n = cluster->nodes + cluster->num_nodes++;
+        n->name = strdup(tok);
+        n->port = strdup(port + 1);
+        n->host = strndup(tok, port - tok);
+        if (n->host[0] == '[' && n->host[port - tok - 1] == ']') {
+            memmove(n->host, n->host + 1, port - tok - 2);
+            n->host[port - tok - 2] = '\0';
+        }
+        pthread_mutex_init(&n->lock, NULL);
+    }
+    free(copy);
+    return (res || !cluster->num_nodes) ? 1 : 0;
+}
+
+/**
+ * Closes the pooled connections and frees the ring.
+ * @arg cluster The cluster
+ * @return 0 on success.
+ */
+int destroy_cluster(bloom_cluster *cluster) {
+    cluster_node *n;
+    peer_conn *pc, *next;
+    for (int i=0; i < cluster->num_nodes; i++) {
+        n = cluster->nodes + i;
+        for (pc=n->idle; pc; pc=next) {
+            next = pc->next;
+            close(pc->fd);
+            free(pc);
+        }
+        pthread_mutex_destroy(&n->lock);
+        free(n->name);
+        free(n->host);
+        free(n->port);
+    }
+    free(cluster->nodes);
+    free(cluster->ring);
+    free(cluster);
+    return 0;
+}
+
+/**
+ * Returns the node that owns a filter, the node
+ * of the first point at or after its hash.
+ */
+int cluster_owner(bloom_cluster *cluster, const char *filter_name, int name_len) {
+    uint64_t hash = name_hash(filter_name, name_len);
+    int low = 0, high = cluster->num_points;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (cluster->ring[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == cluster->num_points) low = 0;
+    return cluster->ring[low].node;
+}
+
+int cluster_self(bloom_cluster *cluster) {
+    return cluster->self;
+}
+
+int cluster_num_nodes(bloom_cluster *cluster) {
+    return cluster->num_nodes;
+}
+
+char* cluster_node_name(bloom_cluster *cluster, int node) {
+    return cluster->nodes[node].name;
+}
+
+/**
+ * Sends commands to another node, and reads their responses. A
+ * response is a line, or the lines from START to END. Thread safe.
+ * @arg cluster The cluster
+ * @arg node The index of the node
+ * @arg req The command lines, each ending in a newline
+ * @arg req_len The length of the commands
+ * @arg num_cmds The number of commands
+ * @arg resp Output, the responses. Must be free'd.
+ * @arg resp_lens Output, the length of each response,
+ * with room for num_cmds lengths.
+ * @return 0 on success, negative errno on failure.
+ */
+int cluster_request(bloom_cluster *cluster, int node, char *req, int req_len, int num_cmds,
+        char **resp, int *resp_lens) {
+    cluster_node *n = cluster->nodes + node;
+    int fresh, res = -EIO;
+
+    // A pooled connection may have been closed by the node while
+    // idle, so a failure on one is retried on a new connection
+    for (int attempt=0; attempt < 2; attempt++) {
+        peer_conn *pc = take_conn(n, &fresh);
+        if (!pc) {
+            res = connect_node(n, &pc);
+            if (res) break;
+            fresh = 1;
+        }
+
+        res = send_all(pc->fd, req, req_len);
+        if (!res) res = read_responses(pc->fd, num_cmds, resp, resp_lens);
+        if (!res) {
+            give_conn(n, pc);
+            return 0;
+        }
+        close(pc->fd);
+        free(pc);
+        if (fresh) break;
+    }
+    syslog(LOG_WARNING, "Failed to proxy to node %s. %s", n->name, strerror(-res));
+    return res;
+}
+
+/**
+ * Logs the filters of this node that the ring places on another
+ * node. They are still served here, until they are moved.
+ * @arg cluster The cluster
+ * @arg mgr The filter manager
+ * @return The number of misplaced filters.
+ */
+int cluster_check_placement(bloom_cluster *cluster, bloom_filtmgr *mgr) {
+    bloom_filter_list_head *head;
+    if (filtmgr_list_filters(mgr, NULL, &head)) return 0;
+
+    int misplaced = 0, node;
+    for (bloom_filter_list *f=head->head; f; f=f->next) {
+        node = cluster_owner(cluster, f->filter_name, strlen(f->filter_name));
+        if (node == cluster->self) continue;
+        syslog(LOG_WARNING, "Filter %s belongs on node %s, it is served here until it is moved.",
+                f->filter_name, cluster->nodes[node].name);
+        misplaced++;
+    }
+    filtmgr_cleanup_list(head);
+    return misplaced;
+}
+
+// Orders the points of the ring by hash
+static int point_cmp(const void *a, const void *b) {
+    const ring_point *pa = a, *pb = b;
+    if (pa->hash < pb->hash) return -1;
+    return (pa->hash > pb->hash) ? 1 : 0;
+}
+
+// Hashes a name onto the ring
+static uint64_t name_hash(const char *name, int len) {
+    uint64_t hash[2];
+    WyHash128(name, len, 0, hash);
+    return hash[0];
+}
+
+/**
+ * Takes an idle connection to a node from the pool
+ * @return The connection, or NULL if there is none.
+ */
+static peer_conn* take_conn(cluster_node *n, int *fresh) {
+    pthread_mutex_lock(&n->lock);
+    peer_conn *pc = n->idle;
+    if (pc) {
+        n->idle = pc->next;
+        n->num_idle--;
+    }
+    pthread_mutex_unlock(&n->lock);
+    *fresh = 0;
+    return pc;
+}
+
+/**
+ * Returns a connection to the pool, or closes
+ * it if the pool is full
+ */
+static void give_conn(cluster_node *n, peer_conn *pc) {
+    pthread_mutex_lock(&n->lock);
+    if (n->num_idle < CLUSTER_POOL_SIZE) {
+        pc->next = n->idle;
+        n->idle = pc;
+        n->num_idle++;
+        pc = NULL;
+    }
+    pthread_mutex_unlock(&n->lock);
+    if (pc) {
+        close(pc->fd);
+        free(pc);
+    }
+}
+
+/**
+ * Connects to a node, and marks the connection as a peer
+ * @return 0 on success, negative errno on failure.
+ */
+static int connect_node(cluster_node *n, peer_conn **out) {
+    struct addrinfo hints, *addrs, *a;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(n->host, n->port, &hints, &addrs)) return -EHOSTUNREACH;
+
+    int fd = -1, res = -ECONNREFUSED;
+    for (a=addrs; a; a=a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd == -1) continue;
+        if (!connect(fd, a->ai_addr, a->ai_addrlen)) break;
+        res = -errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd == -1) return res;
+
+    struct timeval timeout = {CLUSTER_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // The node must accept the peer command
+    char *resp;
+    int resp_len;
+    res = send_all(fd, PEER_CMD, sizeof(PEER_CMD) - 1);
+    if (!res) res = read_responses(fd, 1, &resp, &resp_len);
+    if (!res) {
+        if (resp_len != sizeof(DONE_LINE) - 1 || memcmp(resp, DONE_LINE, resp_len)) res = -EPROTO;
+        free(resp);
+    }
+    if (res) {
+        close(fd);
+        return res;
+    }
+
+    peer_conn *pc = calloc(1, sizeof(peer_conn));
+    pc->fd = fd;
+    *out = pc;
+    return 0;
+}
+
+/**
+ * Sends a whole buffer, retrying short sends
+ * @return 0 on success, negative errno on failure.
+ */
+static int send_all(int fd, const char *buf, int len) {
+    ssize_t res;
+    int total = 0;
+    while (total < len) {
+        res = send(fd, buf + total, len - total, MSG_NOSIGNAL);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN) ? -ETIMEDOUT : -errno;
+        }
+        total += res;
+    }
+    return 0;
+}
+
+/**
+ * Reads a number of responses. Nothing is sent by a node
+ * but responses, so the last response ends the input.
+ * @return 0 on success, negative errno on failure.
+ */
+static int read_responses(int fd, int num, char **resp, int *resp_lens) {
+    int cap = CLUSTER_RESP_SIZE, len = 0;
+    char *buf = malloc(cap);
+    int done = 0, start = 0, scan = 0, in_block = 0;
+    char *eol;
+    ssize_t res;
+    while (done < num) {
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        res = recv(fd, buf + len, cap - len, 0);
+        if (res <= 0) {
+            if (res == -1 && errno == EINTR) continue;
+            int err = (res == 0) ? -EPIPE : ((errno == EAGAIN) ? -ETIMEDOUT : -errno);
+            free(buf);
+            return err;
+        }
+        len += res;
+
+        // Find the ends of the responses, line by line
+        while (done < num && (eol = memchr(buf + scan, '\n', len - scan))) {
+            int line_len = eol - (buf + scan);
+            if (in_block) {
+                if (line_len == 3 && !memcmp(buf + scan, "END", 3)) in_block = 0;
+            } else if (line_len == 5 && !memcmp(buf + scan, "START", 5)) {
+                in_block = 1;
+            }
+            scan += line_len + 1;
+            if (!in_block) {
+                resp_lens[done++] = scan - start;
+                start = scan;
+            }
+        }
+    }
+    *resp = buf;
+    return 0;
+}
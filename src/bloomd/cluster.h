@@ -0,0 +1,90 @@
+#ifndef BLOOM_CLUSTER_H
+#define BLOOM_CLUSTER_H
+#include "config.h"
+#include "filter_manager.h"
+
+/**
+ * A cluster spreads the filters over several nodes. Every node is
+ * configured with the same list of nodes, from which each builds the
+ * same consistent hash ring of filter names, so every node agrees on
+ * the owner of a filter without talking to the others. Adding a node
+ * only moves the filters of its share of the ring.
+ *
+ * A node proxies the commands for filters owned by another node over
+ * a pool of connections to that node, and relays the responses. A run
+ * of commands for the same node is sent together, and the responses
+ * read back in order, so the round trip is shared. The connections
+ * start with the peer command, so a node never proxies the commands
+ * of another node.
+ */
+
+/**
+ * The nodes of a cluster, and the pooled connections to them
+ */
+typedef struct bloom_cluster bloom_cluster;
+
+/**
+ * Builds the ring of the nodes of the config.
+ * @arg config The configuration, with the nodes and this node
+ * @arg cluster Output, the cluster
+ * @return 0 on success, -EINVAL if the nodes are bad.
+ */
+int init_cluster(bloom_config *config, bloom_cluster **cluster);
+
+/**
+ * Closes the pooled connections and frees the ring.
+ * @arg cluster The cluster
+ * @return 0 on success.
+ */
+int destroy_cluster(bloom_cluster *cluster);
+
+/**
+ * Returns the node that owns a filter.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @arg name_len The length of the name
+ * @return The index of the node.
+ */
+int cluster_owner(bloom_cluster *cluster, const char *filter_name, int name_len);
+
+/**
+ * Returns the index of this node.
+ */
+int cluster_self(bloom_cluster *cluster);
+
+/**
+ * Returns the number of nodes.
+ */
+int cluster_num_nodes(bloom_cluster *cluster);
+
+/**
+ * Returns the host:port of a node.
+ */
+char* cluster_node_name(bloom_cluster *cluster, int node);
+
+/**
+ * Sends commands to another node, and reads their responses. A
+ * response is a line, or the lines from START to END. Thread safe.
+ * @arg cluster The cluster
+ * @arg node The index of the node
+ * @arg req The command lines, each ending in a newline
+ * @arg req_len The length of the commands
+ * @arg num_cmds The number of commands
+ * @arg resp Output, the responses. Must be free'd.
+ * @arg resp_lens Output, the length of each response,
+ * with room for num_cmds lengths.
+ * @return 0 on success, negative errno on failure.
+ */
+int cluster_request(bloom_cluster *cluster, int node, char *req, int req_len, int num_cmds,
+        char **resp, int *resp_lens);
+
+/**
+ * Logs the filters of this node that the ring places on another
+ * node. They are still served here, until they are moved.
+ * @arg cluster The cluster
+ * @arg mgr The filter manager
+ * @return The number of misplaced filters.
+ */
+int cluster_check_placement(bloom_cluster *cluster, bloom_filtmgr *mgr);
+
+#endif
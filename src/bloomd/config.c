@@ -1,10 +1,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <unistd.h>
 #include "config.h"
@@ -30,7 +33,64 @@ static const bloom_config DEFAULT_CONFIG = {
     3600,               // Cold after an hour
     0,                  // Persist to disk by default
     1,                  // Only a single worker thread by default
-    0                   // Do NOT use mmap by default
+    0,                  // Do NOT use mmap by default
+    0,                  // Serialize sets with the filter lock
+    256,                // Write back up to 1MB of dirty pages at once
+    64,                 // Up to 64MB of flush writes in flight per device
+    0,                  // Do NOT use huge pages by default
+    "off",              // No NUMA placement by default
+    NUMA_OFF,
+    0,                  // Leave cold data files uncompressed
+    0,                  // Read in PERSISTENT files eagerly
+    0,                  // PERSISTENT files go through the page cache
+    0,                  // SHARED files are not mapped with MAP_SYNC
+    0,                  // Flushes do not cut a consistent image
+    0,                  // No cache of positive checks
+    0,                  // Each flush syncs its own files
+    0,                  // No limit on the client connections
+    0,                  // Plain filters, without unset, by default
+    "bloom",            // Bloom filters by default
+    ENGINE_BLOOM,
+    0.9,                // Create the next layer at 90% of capacity
+    0,                  // Filters scale instead of aging out keys
+    4,                  // Windowed filters keep 4 generations
+    1,                  // Filters scale by default
+    0,                  // Full fixed filters warn, instead of rejecting sets
+    0,                  // Checks probe the newest layer first
+    0,                  // No metrics listener by default
+    0,                  // Connections stay on the worker they are placed on
+    2,                  // Fault in cold filters on 2 threads
+    300,                // Warm filters 5 minutes before their predicted use
+    0,                  // No memory budget by default
+    0,                  // A data file per layer by default
+    1,                  // Flush on a single thread by default
+    0,                  // No flush bandwidth budget by default
+    0,                  // No write-ahead log by default
+    200,                // Sync the write-ahead logs 5 times a second
+    0,                  // Deltas are full copies by default
+    NULL,               // No replicas by default
+    10,                 // Gather changes for replicas for 10 msec
+    64,                 // Drop the backlog of a replica over 64MB
+    NULL,               // Not in a cluster by default
+    NULL,
+    1,                  // Filters are not partitioned by default
+    1,                  // Admin commands run on a thread of their own
+    NULL,               // No hot restarts by default
+    0,                  // Any worker handles any filter by default
+    0,                  // Bulk commands run on their worker by default
+    0,                  // Checks are run one client at a time by default
+    NULL,               // No Unix socket listener by default
+    0,                  // All the layers of a filter share a mode by default
+    0,                  // Filters are not locked in memory by default
+    0,                  // Shared maps are only written back by flushes by default
+    "memory",           // New layers use the ideal k by default
+    OPTIMIZE_MEMORY,
+    10000,              // Commands over 10 msec are logged as slow by default
+    100,                // One in 100 commands is sampled for hot filters and keys
+    0,                  // Workers cannot be added at runtime by default
+    0,                  // Keys are hashed by the server by default
+    0,                  // Late commands are not shed by default
+    0                   // Layers are not summarized by default
 };
 
 /**
@@ -120,16 +180,108 @@ static int config_callback(void* user, const char* section, const char* name, co
          return value_to_int(value, &config->use_mmap);
     } else if (NAME_MATCH("workers")) {
          return value_to_int(value, &config->worker_threads);
+    } else if (NAME_MATCH("max_workers")) {
+         return value_to_int(value, &config->max_worker_threads);
+    } else if (NAME_MATCH("concurrent_sets")) {
+         return value_to_int(value, &config->concurrent_sets);
+    } else if (NAME_MATCH("flush_run_pages")) {
+         return value_to_int(value, &config->flush_run_pages);
+    } else if (NAME_MATCH("flush_inflight_mb")) {
+         return value_to_int(value, &config->flush_inflight_mb);
+    } else if (NAME_MATCH("use_huge_pages")) {
+         return value_to_int(value, &config->use_huge_pages);
+    } else if (NAME_MATCH("cold_snapshots")) {
+         return value_to_int(value, &config->cold_snapshots);
+    } else if (NAME_MATCH("lazy_page_in")) {
+         return value_to_int(value, &config->lazy_page_in);
+    } else if (NAME_MATCH("direct_io")) {
+         return value_to_int(value, &config->direct_io);
+    } else if (NAME_MATCH("use_dax")) {
+         return value_to_int(value, &config->use_dax);
+    } else if (NAME_MATCH("consistent_flush")) {
+         return value_to_int(value, &config->consistent_flush);
+    } else if (NAME_MATCH("positive_cache")) {
+         return value_to_int(value, &config->positive_cache);
+    } else if (NAME_MATCH("group_commit")) {
+         return value_to_int(value, &config->group_commit);
+    } else if (NAME_MATCH("max_connections")) {
+         return value_to_int(value, &config->max_connections);
+    } else if (NAME_MATCH("counting")) {
+         return value_to_int(value, &config->counting);
+    } else if (NAME_MATCH("window")) {
+         return value_to_int(value, &config->window);
+    } else if (NAME_MATCH("generations")) {
+         return value_to_int(value, &config->generations);
+    } else if (NAME_MATCH("scalable")) {
+         return value_to_int(value, &config->scalable);
+    } else if (NAME_MATCH("reject_full")) {
+         return value_to_int(value, &config->reject_full);
+    } else if (NAME_MATCH("adaptive_checks")) {
+         return value_to_int(value, &config->adaptive_checks);
+    } else if (NAME_MATCH("metrics_port")) {
+         return value_to_int(value, &config->metrics_port);
+    } else if (NAME_MATCH("migrate_connections")) {
+         return value_to_int(value, &config->migrate_connections);
+    } else if (NAME_MATCH("fault_threads")) {
+         return value_to_int(value, &config->fault_threads);
+    } else if (NAME_MATCH("prewarm_lead")) {
+         return value_to_int(value, &config->prewarm_lead);
+    } else if (NAME_MATCH("max_memory")) {
+         return value_to_int(value, &config->max_memory);
+    } else if (NAME_MATCH("container")) {
+         return value_to_int(value, &config->container);
+    } else if (NAME_MATCH("flush_threads")) {
+         return value_to_int(value, &config->flush_threads);
+    } else if (NAME_MATCH("flush_bandwidth_mb")) {
+         return value_to_int(value, &config->flush_bandwidth_mb);
+    } else if (NAME_MATCH("wal")) {
+         return value_to_int(value, &config->wal);
+    } else if (NAME_MATCH("wal_sync_msec")) {
+         return value_to_int(value, &config->wal_sync_msec);
+    } else if (NAME_MATCH("delta_snapshots")) {
+         return value_to_int(value, &config->delta_snapshots);
+    } else if (NAME_MATCH("replica_batch_msec")) {
+         return value_to_int(value, &config->replica_batch_msec);
+    } else if (NAME_MATCH("replica_backlog_mb")) {
+         return value_to_int(value, &config->replica_backlog_mb);
+    } else if (NAME_MATCH("partitions")) {
+         return value_to_int(value, &config->partitions);
+    } else if (NAME_MATCH("admin_threads")) {
+         return value_to_int(value, &config->admin_threads);
+    } else if (NAME_MATCH("filter_affinity")) {
+         return value_to_int(value, &config->filter_affinity);
+    } else if (NAME_MATCH("bulk_threads")) {
+         return value_to_int(value, &config->bulk_threads);
+    } else if (NAME_MATCH("group_checks")) {
+         return value_to_int(value, &config->group_checks);
+    } else if (NAME_MATCH("tiered_layers")) {
+         return value_to_int(value, &config->tiered_layers);
+    } else if (NAME_MATCH("pin")) {
+         return value_to_int(value, &config->pin);
+    } else if (NAME_MATCH("writeback_msec")) {
+         return value_to_int(value, &config->writeback_msec);
+    } else if (NAME_MATCH("slowlog_usec")) {
+         return value_to_int(value, &config->slowlog_usec);
+    } else if (NAME_MATCH("hot_sample")) {
+         return value_to_int(value, &config->hot_sample);
+    } else if (NAME_MATCH("hashed")) {
+         return value_to_int(value, &config->hashed);
+    } else if (NAME_MATCH("shed_lag_msec")) {
+         return value_to_int(value, &config->shed_lag_msec);
 
     // Handle the int64 cases
     } else if (NAME_MATCH("initial_capacity")) {
          return value_to_int64(value, &config->initial_capacity);
+    } else if (NAME_MATCH("summary_capacity")) {
+         return value_to_int64(value, &config->summary_capacity);
 
     // Handle the double cases
     } else if (NAME_MATCH("default_probability")) {
          return value_to_double(value, &config->default_probability);
     } else if (NAME_MATCH("probability_reduction")) {
          return value_to_double(value, &config->probability_reduction);
+    } else if (NAME_MATCH("prealloc_fill")) {
+         return value_to_double(value, &config->prealloc_fill);
 
     // Copy the string values
     } else if (NAME_MATCH("data_dir")) {
@@ -138,6 +290,22 @@ static int config_callback(void* user, const char* section, const char* name, co
         config->log_level = strdup(value);
     } else if (NAME_MATCH("bind_address")) {
         config->bind_address = strdup(value);
+    } else if (NAME_MATCH("numa_mode")) {
+        config->numa_mode = strdup(value);
+    } else if (NAME_MATCH("engine")) {
+        config->engine = strdup(value);
+    } else if (NAME_MATCH("optimize")) {
+        config->optimize = strdup(value);
+    } else if (NAME_MATCH("replicas")) {
+        config->replicas = strdup(value);
+    } else if (NAME_MATCH("cluster_nodes")) {
+        config->cluster_nodes = strdup(value);
+    } else if (NAME_MATCH("cluster_self")) {
+        config->cluster_self = strdup(value);
+    } else if (NAME_MATCH("handoff_socket")) {
+        config->handoff_socket = strdup(value);
+    } else if (NAME_MATCH("unix_socket")) {
+        config->unix_socket = strdup(value);
 
     // Unknown parameter?
     } else {
@@ -375,6 +543,570 @@ int sane_worker_threads(int threads) {
     return 0;
 }
 
+int sane_max_worker_threads(int threads) {
+    if (threads < 0) {
+        syslog(LOG_ERR,
+               "Max workers cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_hashed(int hashed) {
+    if (hashed != 0 && hashed != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for hashed. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_concurrent_sets(int concurrent) {
+    if (concurrent != 0 && concurrent != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for concurrent_sets. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_run_pages(int pages) {
+    if (pages < 1) {
+        syslog(LOG_ERR,
+               "Flush run pages cannot be less than 1!");
+        return 1;
+    } else if (pages > 65536) {
+        syslog(LOG_WARNING,
+               "Flush run pages is very large! Each write may block for a long time.");
+    }
+    return 0;
+}
+
+int sane_flush_inflight_mb(int mb) {
+    if (mb < 1) {
+        syslog(LOG_ERR,
+               "Flush inflight MB cannot be less than 1!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_use_huge_pages(int use_huge_pages) {
+    if (use_huge_pages != 0 && use_huge_pages != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_huge_pages. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_cold_snapshots(int cold_snapshots) {
+    if (cold_snapshots != 0 && cold_snapshots != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for cold_snapshots. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_numa_mode(char *numa_mode, bloom_numa_policy *policy) {
+    if (strcasecmp(numa_mode, "off") == 0) {
+        *policy = NUMA_OFF;
+    } else if (strcasecmp(numa_mode, "interleave") == 0) {
+        *policy = NUMA_INTERLEAVE;
+    } else if (strcasecmp(numa_mode, "filter") == 0) {
+        *policy = NUMA_PER_FILTER;
+    } else {
+        syslog(LOG_ERR,
+               "Unknown numa_mode '%s'. Must be off, interleave or filter.", numa_mode);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_lazy_page_in(int lazy_page_in) {
+    if (lazy_page_in != 0 && lazy_page_in != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for lazy_page_in. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_direct_io(int direct_io) {
+    if (direct_io != 0 && direct_io != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for direct_io. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_use_dax(int use_dax) {
+    if (use_dax != 0 && use_dax != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_dax. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_consistent_flush(int consistent_flush) {
+    if (consistent_flush != 0 && consistent_flush != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for consistent_flush. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_positive_cache(int entries) {
+    if (entries < 0) {
+        syslog(LOG_ERR,
+               "Positive cache cannot be negative!");
+        return 1;
+    } else if (entries > (1 << 24)) {
+        syslog(LOG_ERR,
+               "Positive cache cannot be more than 16M entries!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_group_commit(int group_commit) {
+    if (group_commit != 0 && group_commit != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for group_commit. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_max_connections(int max_connections) {
+    if (max_connections < 0) {
+        syslog(LOG_ERR,
+               "Max connections cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_engine(char *engine, bloom_filter_engine *type) {
+    if (strcasecmp(engine, "bloom") == 0) {
+        *type = ENGINE_BLOOM;
+    } else if (strcasecmp(engine, "cuckoo") == 0) {
+        *type = ENGINE_CUCKOO;
+    } else {
+        syslog(LOG_ERR,
+               "Unknown engine '%s'. Must be bloom or cuckoo.", engine);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_prealloc_fill(double fill) {
+    if (fill < 0 || fill >= 1) {
+        syslog(LOG_ERR,
+               "Illegal value for prealloc_fill. Must be at least 0 and less than 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_window(int window) {
+    if (window < 0) {
+        syslog(LOG_ERR,
+               "Illegal value for window. Must be at least 0.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_generations(int generations) {
+    if (generations < 2 || generations > 32) {
+        syslog(LOG_ERR,
+               "Illegal value for generations. Must be between 2 and 32.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_scalable(int scalable) {
+    if (scalable != 0 && scalable != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for scalable. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_reject_full(int reject_full) {
+    if (reject_full != 0 && reject_full != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for reject_full. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_adaptive_checks(int adaptive_checks) {
+    if (adaptive_checks != 0 && adaptive_checks != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for adaptive_checks. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_migrate_connections(int migrate) {
+    if (migrate != 0 && migrate != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for migrate_connections. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_fault_threads(int threads) {
+    if (threads < 0) {
+        syslog(LOG_ERR,
+               "Fault threads cannot be negative!");
+        return 1;
+    } else if (threads == 0) {
+        syslog(LOG_WARNING,
+               "Cold filters are faulted in on the workers! Other clients may stall.");
+    }
+    return 0;
+}
+
+int sane_admin_threads(int threads) {
+    if (threads < 0) {
+        syslog(LOG_ERR,
+               "Admin threads cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_filter_affinity(int affinity) {
+    if (affinity != 0 && affinity != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for filter_affinity. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_bulk_threads(int threads) {
+    if (threads < 0) {
+        syslog(LOG_ERR,
+               "Bulk threads cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_group_checks(int group) {
+    if (group != 0 && group != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for group_checks. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_tiered_layers(int tiered) {
+    if (tiered != 0 && tiered != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for tiered_layers. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_pin(int pin) {
+    if (pin != 0 && pin != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for pin. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_writeback_msec(int msec) {
+    if (msec < 0) {
+        syslog(LOG_ERR,
+               "Writeback msec cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_slowlog_usec(int usec) {
+    if (usec < 0) {
+        syslog(LOG_ERR,
+               "Slowlog usec cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_shed_lag_msec(int msec) {
+    if (msec < 0) {
+        syslog(LOG_ERR,
+               "Shed lag msec cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_summary_capacity(int64_t capacity) {
+    if (capacity < 0) {
+        syslog(LOG_ERR,
+               "Summary capacity cannot be negative!");
+        return 1;
+    } else if (capacity > 1000000000) {
+        syslog(LOG_WARNING, "Summary capacity set very high!");
+    }
+    return 0;
+}
+
+int sane_hot_sample(int every) {
+    if (every < 0) {
+        syslog(LOG_ERR,
+               "Hot sample cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_optimize(char *optimize, bloom_optimize *type) {
+    if (strcasecmp(optimize, "memory") == 0) {
+        *type = OPTIMIZE_MEMORY;
+    } else if (strcasecmp(optimize, "balanced") == 0) {
+        *type = OPTIMIZE_BALANCED;
+    } else if (strcasecmp(optimize, "speed") == 0) {
+        *type = OPTIMIZE_SPEED;
+    } else {
+        syslog(LOG_ERR,
+               "Unknown optimize profile '%s'. Must be memory, balanced or speed.", optimize);
+        return 1;
+    }
+    return 0;
+}
+
+const char* optimize_name(bloom_optimize type) {
+    switch (type) {
+        case OPTIMIZE_BALANCED: return "balanced";
+        case OPTIMIZE_SPEED: return "speed";
+        default: return "memory";
+    }
+}
+
+int sane_handoff_socket(char *path) {
+    if (!path) return 0;
+    if (*path != '/' || strlen(path) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        syslog(LOG_ERR,
+               "Illegal handoff socket '%s'. Must be an absolute path of under %d bytes.",
+               path, (int)sizeof(((struct sockaddr_un*)0)->sun_path));
+        return 1;
+    }
+    return 0;
+}
+
+int sane_unix_socket(char *path) {
+    if (!path) return 0;
+    if (*path != '/' || strlen(path) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        syslog(LOG_ERR,
+               "Illegal unix socket '%s'. Must be an absolute path of under %d bytes.",
+               path, (int)sizeof(((struct sockaddr_un*)0)->sun_path));
+        return 1;
+    }
+    return 0;
+}
+
+int sane_prewarm_lead(int lead) {
+    if (lead < 0) {
+        syslog(LOG_ERR,
+               "Pre-warm lead cannot be negative!");
+        return 1;
+    } else if (lead > 0 && lead < 60) {
+        syslog(LOG_WARNING,
+               "Pre-warm lead is less than a minute. Predicted uses may be missed.");
+    }
+    return 0;
+}
+
+int sane_max_memory(int max_memory) {
+    if (max_memory < 0) {
+        syslog(LOG_ERR,
+               "Max memory cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_container(int container) {
+    if (container != 0 && container != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for container. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_threads(int threads) {
+    if (threads < 1) {
+        syslog(LOG_ERR,
+               "Must have at least 1 flush thread!");
+        return 1;
+    } else if (threads > 64) {
+        syslog(LOG_WARNING,
+               "More than 64 flush threads! Flushes may compete for the disk.");
+    }
+    return 0;
+}
+
+int sane_flush_bandwidth_mb(int mb) {
+    if (mb < 0) {
+        syslog(LOG_ERR,
+               "Flush bandwidth MB cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_wal(int wal) {
+    if (wal != 0 && wal != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for wal. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_wal_sync_msec(int msec) {
+    if (msec < 1) {
+        syslog(LOG_ERR,
+               "WAL sync msec must be at least 1!");
+        return 1;
+    } else if (msec > 10000) {
+        syslog(LOG_WARNING,
+               "WAL sync msec is over 10 seconds! Acknowledged sets may be lost on a crash.");
+    }
+    return 0;
+}
+
+int sane_delta_snapshots(int delta_snapshots) {
+    if (delta_snapshots != 0 && delta_snapshots != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for delta_snapshots. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_replicas(char *replicas) {
+    if (!replicas) return 0;
+
+    // Each replica is a host and a port, separated by commas
+    char *copy = strdup(replicas);
+    char *save = NULL, *port;
+    int res = 0;
+    for (char *tok=strtok_r(copy, ", ", &save); tok; tok=strtok_r(NULL, ", ", &save)) {
+        port = strrchr(tok, ':');
+        if (!port || port == tok || atoi(port + 1) <= 0 || atoi(port + 1) > 65535) {
+            syslog(LOG_ERR,
+                   "Illegal replica '%s'. Must be host:port.", tok);
+            res = 1;
+        }
+    }
+    free(copy);
+    return res;
+}
+
+int sane_replica_batch_msec(int msec) {
+    if (msec < 0) {
+        syslog(LOG_ERR,
+               "Replica batch msec cannot be negative!");
+        return 1;
+    } else if (msec > 1000) {
+        syslog(LOG_WARNING,
+               "Replica batch msec is over a second! Replicas will lag behind.");
+    }
+    return 0;
+}
+
+int sane_replica_backlog_mb(int mb) {
+    if (mb < 1) {
+        syslog(LOG_ERR,
+               "Replica backlog MB must be at least 1!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_partitions(int partitions) {
+    if (partitions < 1 || partitions > MAX_PARTITIONS || (partitions & (partitions - 1))) {
+        syslog(LOG_ERR,
+               "Illegal value for partitions. Must be a power of 2, up to 64.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_cluster_nodes(char *nodes) {
+    if (!nodes) return 0;
+
+    // Each node is a host and a port, separated by commas
+    char *copy = strdup(nodes);
+    char *save = NULL, *port;
+    int res = 0;
+    for (char *tok=strtok_r(copy, ", ", &save); tok; tok=strtok_r(NULL, ", ", &save)) {
+        port = strrchr(tok, ':');
+        if (!port || port == tok || atoi(port + 1) <= 0 || atoi(port + 1) > 65535) {
+            syslog(LOG_ERR,
+                   "Illegal cluster node '%s'. Must be host:port.", tok);
+            res = 1;
+        }
+    }
+    free(copy);
+    return res;
+}
+
+int sane_cluster_self(char *self, char *nodes) {
+    if (!nodes) return 0;
+    if (!self) {
+        syslog(LOG_ERR,
+               "Cluster self must be set with cluster nodes!");
+        return 1;
+    }
+
+    // This node must be one of the nodes, exactly as listed
+    char *copy = strdup(nodes);
+    char *save = NULL;
+    int found = 0;
+    for (char *tok=strtok_r(copy, ", ", &save); tok; tok=strtok_r(NULL, ", ", &save)) {
+        if (!strcmp(tok, self)) found = 1;
+    }
+    free(copy);
+    if (!found) {
+        syslog(LOG_ERR,
+               "Cluster self '%s' is not one of the cluster nodes.", self);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_counting(int counting) {
+    if (counting != 0 && counting != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for counting. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
 
 /**
  * Validates the configuration
@@ -395,10 +1127,308 @@ int validate_config(bloom_config *config) {
     res |= sane_in_memory(config->in_memory);
     res |= sane_use_mmap(config->use_mmap);
     res |= sane_worker_threads(config->worker_threads);
+    res |= sane_max_worker_threads(config->max_worker_threads);
+    res |= sane_concurrent_sets(config->concurrent_sets);
+    res |= sane_flush_run_pages(config->flush_run_pages);
+    res |= sane_flush_inflight_mb(config->flush_inflight_mb);
+    res |= sane_use_huge_pages(config->use_huge_pages);
+    res |= sane_numa_mode(config->numa_mode, &config->numa_policy);
+    res |= sane_cold_snapshots(config->cold_snapshots);
+    res |= sane_lazy_page_in(config->lazy_page_in);
+    res |= sane_direct_io(config->direct_io);
+    res |= sane_use_dax(config->use_dax);
+    res |= sane_consistent_flush(config->consistent_flush);
+    res |= sane_positive_cache(config->positive_cache);
+    res |= sane_group_commit(config->group_commit);
+    res |= sane_max_connections(config->max_connections);
+    res |= sane_counting(config->counting);
+    res |= sane_engine(config->engine, &config->engine_type);
+    res |= sane_prealloc_fill(config->prealloc_fill);
+    res |= sane_window(config->window);
+    res |= sane_generations(config->generations);
+    res |= sane_scalable(config->scalable);
+    res |= sane_reject_full(config->reject_full);
+    res |= sane_adaptive_checks(config->adaptive_checks);
+    res |= sane_migrate_connections(config->migrate_connections);
+    res |= sane_fault_threads(config->fault_threads);
+    res |= sane_prewarm_lead(config->prewarm_lead);
+    res |= sane_max_memory(config->max_memory);
+    res |= sane_container(config->container);
+    res |= sane_flush_threads(config->flush_threads);
+    res |= sane_flush_bandwidth_mb(config->flush_bandwidth_mb);
+    res |= sane_wal(config->wal);
+    res |= sane_wal_sync_msec(config->wal_sync_msec);
+    res |= sane_delta_snapshots(config->delta_snapshots);
+    res |= sane_replicas(config->replicas);
+    res |= sane_replica_batch_msec(config->replica_batch_msec);
+    res |= sane_replica_backlog_mb(config->replica_backlog_mb);
+    res |= sane_cluster_nodes(config->cluster_nodes);
+    res |= sane_cluster_self(config->cluster_self, config->cluster_nodes);
+    res |= sane_partitions(config->partitions);
+    res |= sane_admin_threads(config->admin_threads);
+    res |= sane_handoff_socket(config->handoff_socket);
+    res |= sane_filter_affinity(config->filter_affinity);
+    res |= sane_bulk_threads(config->bulk_threads);
+    res |= sane_group_checks(config->group_checks);
+    res |= sane_unix_socket(config->unix_socket);
+    res |= sane_tiered_layers(config->tiered_layers);
+    res |= sane_pin(config->pin);
+    res |= sane_writeback_msec(config->writeback_msec);
+    res |= sane_optimize(config->optimize, &config->optimize_type);
+    res |= sane_slowlog_usec(config->slowlog_usec);
+    res |= sane_hot_sample(config->hot_sample);
+    res |= sane_hashed(config->hashed);
+    res |= sane_shed_lag_msec(config->shed_lag_msec);
+    res |= sane_summary_capacity(config->summary_capacity);
+
+    return res;
+}
+
+/**
+ * Applies the options of a new filter to a copy of the
+ * configuration, and validates them.
+ * @arg config The config object to update.
+ * @arg options Space separated options, modified in place.
+ * @return 0 on success, 1 on an unknown or invalid option.
+ */
+int apply_filter_options(bloom_config *config, char *options, char **like) {
+    char *save = NULL;
+    int invalid = 0;
+    for (char *param = strtok_r(options, " ", &save); param; param = strtok_r(NULL, " ", &save)) {
+        // Check for the custom params
+        int match = 0;
+        match |= sscanf(param, "capacity=%llu", (unsigned long long*)&config->initial_capacity);
+        match |= sscanf(param, "prob=%lf", &config->default_probability);
+        match |= sscanf(param, "in_memory=%d", &config->in_memory);
+        match |= sscanf(param, "counting=%d", &config->counting);
+        match |= sscanf(param, "window=%d", &config->window);
+        match |= sscanf(param, "generations=%d", &config->generations);
+        match |= sscanf(param, "scalable=%d", &config->scalable);
+        match |= sscanf(param, "reject_full=%d", &config->reject_full);
+        match |= sscanf(param, "container=%d", &config->container);
+        match |= sscanf(param, "partitions=%d", &config->partitions);
+        match |= sscanf(param, "pin=%d", &config->pin);
+        match |= sscanf(param, "hashed=%d", &config->hashed);
+        if (strncmp(param, "engine=", 7) == 0) {
+            match = 1;
+            invalid |= sane_engine(param + 7, &config->engine_type);
+        }
+        if (strncmp(param, "optimize=", 9) == 0) {
+            match = 1;
+            invalid |= sane_optimize(param + 9, &config->optimize_type);
+        }
+        if (like && strncmp(param, "like=", 5) == 0 && param[5]) {
+            match = 1;
+            *like = param + 5;
+        }
+        if (!match) return 1;
+    }
+
+    // Validate the params
+    invalid |= sane_initial_capacity(config->initial_capacity);
+    invalid |= sane_default_probability(config->default_probability);
+    invalid |= sane_in_memory(config->in_memory);
+    invalid |= sane_counting(config->counting);
+    invalid |= sane_window(config->window);
+    invalid |= sane_generations(config->generations);
+    invalid |= sane_scalable(config->scalable);
+    invalid |= sane_reject_full(config->reject_full);
+    invalid |= sane_container(config->container);
+    invalid |= sane_partitions(config->partitions);
+    invalid |= sane_pin(config->pin);
+    invalid |= sane_hashed(config->hashed);
+    return invalid;
+}
 
+// Serializes the changes to the running configuration
+static pthread_mutex_t UPDATE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static int update_tunables(bloom_config *config, bloom_config *next);
+
+/**
+ * The settings that can be changed while running, in the
+ * order they are listed
+ */
+static const char *TUNABLES[] = {
+    "flush_interval", "cold_interval", "initial_capacity", "default_probability",
+    "scale_size", "probability_reduction", "max_memory", "prewarm_lead",
+    "slowlog_usec", "hot_sample", "shed_lag_msec", "summary_capacity", NULL
+};
+
+/**
+ * Finds the field of a tunable setting. Exactly one
+ * of the outputs is set.
+ * @return 0 on success, 1 if the setting is not tunable.
+ */
+static int tunable_field(bloom_config *config, const char *name,
+        int **int_val, uint64_t **int64_val, double **double_val) {
+    *int_val = NULL;
+    *int64_val = NULL;
+    *double_val = NULL;
+    if (NAME_MATCH("flush_interval")) {
+        *int_val = &config->flush_interval;
+    } else if (NAME_MATCH("cold_interval")) {
+        *int_val = &config->cold_interval;
+    } else if (NAME_MATCH("scale_size")) {
+        *int_val = &config->scale_size;
+    } else if (NAME_MATCH("max_memory")) {
+        *int_val = &config->max_memory;
+    } else if (NAME_MATCH("prewarm_lead")) {
+        *int_val = &config->prewarm_lead;
+    } else if (NAME_MATCH("slowlog_usec")) {
+        *int_val = &config->slowlog_usec;
+    } else if (NAME_MATCH("hot_sample")) {
+        *int_val = &config->hot_sample;
+    } else if (NAME_MATCH("shed_lag_msec")) {
+        *int_val = &config->shed_lag_msec;
+    } else if (NAME_MATCH("initial_capacity")) {
+        *int64_val = &config->initial_capacity;
+    } else if (NAME_MATCH("summary_capacity")) {
+        *int64_val = &config->summary_capacity;
+    } else if (NAME_MATCH("default_probability")) {
+        *double_val = &config->default_probability;
+    } else if (NAME_MATCH("probability_reduction")) {
+        *double_val = &config->probability_reduction;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Applies the tunable settings of a new configuration to
+ * the running one. The settings are validated first, and
+ * none are applied if any is invalid. Each is stored
+ * atomically, so the threads reading it see either value.
+ * @notes Thread safe.
+ * @arg config The running configuration to update
+ * @arg next The configuration to take the settings from
+ * @return 0 on success, -1 if a setting is invalid.
+ */
+int config_update(bloom_config *config, bloom_config *next) {
+    pthread_mutex_lock(&UPDATE_LOCK);
+    int res = update_tunables(config, next);
+    pthread_mutex_unlock(&UPDATE_LOCK);
+    return res;
+}
+
+/**
+ * Applies the tunable settings, with the update lock held
+ */
+static int update_tunables(bloom_config *config, bloom_config *next) {
+    int invalid = 0;
+    invalid |= sane_flush_interval(next->flush_interval);
+    invalid |= sane_cold_interval(next->cold_interval);
+    invalid |= sane_initial_capacity(next->initial_capacity);
+    invalid |= sane_default_probability(next->default_probability);
+    invalid |= sane_scale_size(next->scale_size);
+    invalid |= sane_probability_reduction(next->probability_reduction);
+    invalid |= sane_max_memory(next->max_memory);
+    invalid |= sane_prewarm_lead(next->prewarm_lead);
+    invalid |= sane_slowlog_usec(next->slowlog_usec);
+    invalid |= sane_hot_sample(next->hot_sample);
+    invalid |= sane_shed_lag_msec(next->shed_lag_msec);
+    invalid |= sane_summary_capacity(next->summary_capacity);
+    if (invalid) return -1;
+
+    // The background threads are only started at boot
+    if ((next->flush_interval > 0) != (config->flush_interval > 0)) {
+        syslog(LOG_ERR, "Flushing cannot be turned on or off without a restart!");
+        return -1;
+    }
+    if ((next->cold_interval > 0 || next->max_memory > 0) !=
+            (config->cold_interval > 0 || config->max_memory > 0)) {
+        syslog(LOG_ERR, "Cold unmapping cannot be turned on or off without a restart!");
+        return -1;
+    }
+
+    #define STORE(field) __atomic_store(&config->field, &next->field, __ATOMIC_RELAXED)
+    STORE(flush_interval);
+    STORE(cold_interval);
+    STORE(initial_capacity);
+    STORE(default_probability);
+    STORE(scale_size);
+    STORE(probability_reduction);
+    STORE(max_memory);
+    STORE(prewarm_lead);
+    STORE(slowlog_usec);
+    STORE(hot_sample);
+    STORE(shed_lag_msec);
+    STORE(summary_capacity);
+    #undef STORE
+    return 0;
+}
+
+/**
+ * Changes a tunable setting of the running configuration,
+ * as config_update does.
+ * @arg config The running configuration to update
+ * @arg name The setting, such as flush_interval
+ * @arg value The new value
+ * @return 0 on success, 1 if the setting is not tunable,
+ * -1 if the value is invalid.
+ */
+int config_set(bloom_config *config, const char *name, const char *value) {
+    bloom_config next;
+    int *int_val;
+    uint64_t *int64_val;
+    double *double_val;
+    if (tunable_field(&next, name, &int_val, &int64_val, &double_val)) return 1;
+
+    // Parse the whole value
+    char *end;
+    errno = 0;
+    double double_parsed = 0;
+    long long parsed = 0;
+    if (double_val) {
+        double_parsed = strtod(value, &end);
+    } else {
+        parsed = strtoll(value, &end, 10);
+    }
+    if (end == value || *end || errno) return -1;
+    if (int_val && (parsed < INT_MIN || parsed > INT_MAX)) return -1;
+
+    // Change the setting on a copy, so the others are kept
+    pthread_mutex_lock(&UPDATE_LOCK);
+    memcpy(&next, config, sizeof(bloom_config));
+    if (int_val) *int_val = parsed;
+    else if (int64_val) *int64_val = parsed;
+    else *double_val = double_parsed;
+    int res = update_tunables(config, &next);
+    pthread_mutex_unlock(&UPDATE_LOCK);
     return res;
 }
 
+/**
+ * Formats the tunable settings of the running configuration,
+ * one "name value" line each.
+ * @arg config The running configuration
+ * @return A new string, that uses a malloc()'d buffer.
+ */
+char* config_tunables(bloom_config *config) {
+    // Each line is a name and at most a 20 digit value
+    char *out = malloc(sizeof(TUNABLES) / sizeof(char*) * 64);
+    int len = 0;
+    for (int i=0; TUNABLES[i]; i++) {
+        int *int_val;
+        uint64_t *int64_val;
+        double *double_val;
+        tunable_field(config, TUNABLES[i], &int_val, &int64_val, &double_val);
+        if (int_val) {
+            len += sprintf(out + len, "%s %d\n", TUNABLES[i], __atomic_load_n(int_val, __ATOMIC_RELAXED));
+        } else if (int64_val) {
+            len += sprintf(out + len, "%s %llu\n", TUNABLES[i],
+                    (unsigned long long)__atomic_load_n(int64_val, __ATOMIC_RELAXED));
+        } else {
+            double val;
+            __atomic_load(double_val, &val, __ATOMIC_RELAXED);
+            len += sprintf(out + len, "%s %g\n", TUNABLES[i], val);
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
 /**
  * Callback function to use with INI-H.
  * @arg user Opaque user value. We use the bloom_config pointer
@@ -424,6 +1454,32 @@ static int filter_config_callback(void* user, const char* section, const char* n
         return value_to_int(value, &config->scale_size);
     } else if (NAME_MATCH("in_memory")) {
          return value_to_int(value, &config->in_memory);
+    } else if (NAME_MATCH("counting")) {
+         return value_to_int(value, &config->counting);
+    } else if (NAME_MATCH("window")) {
+         return value_to_int(value, &config->window);
+    } else if (NAME_MATCH("generations")) {
+         return value_to_int(value, &config->generations);
+    } else if (NAME_MATCH("scalable")) {
+         return value_to_int(value, &config->scalable);
+    } else if (NAME_MATCH("reject_full")) {
+         return value_to_int(value, &config->reject_full);
+    } else if (NAME_MATCH("container")) {
+         return value_to_int(value, &config->container);
+    } else if (NAME_MATCH("partitions")) {
+         return value_to_int(value, &config->partitions);
+    } else if (NAME_MATCH("frozen")) {
+         return value_to_int(value, &config->frozen);
+    } else if (NAME_MATCH("pin")) {
+         return value_to_int(value, &config->pin);
+    } else if (NAME_MATCH("hashed")) {
+         return value_to_int(value, &config->hashed);
+
+    // Handle the enum cases
+    } else if (NAME_MATCH("engine")) {
+         return sane_engine((char*)value, &config->engine) == 0;
+    } else if (NAME_MATCH("optimize")) {
+         return sane_optimize((char*)value, &config->optimize) == 0;
 
     // Handle the int64 cases
     } else if (NAME_MATCH("initial_capacity")) {
@@ -474,15 +1530,23 @@ int filter_config_from_filename(char *filename, bloom_filter_config *config) {
 
 /**
  * Writes the configuration to a filename.
- * Writes the file as an INI configuration
+ * Writes the file as an INI configuration. The file is
+ * written aside and renamed over the old one, so a crash
+ * leaves either the old or the new configuration.
  * @arg filename The name of the file to write.
  * @arg config The config object to write out.
  * @return 0 on success, negative on error.
  */
 int update_filename_from_filter_config(char *filename, bloom_filter_config *config) {
     // Try to open the file
-    FILE* f = fopen(filename, "w+");
-    if (!f) return -errno;
+    char *tmp_name;
+    if (asprintf(&tmp_name, "%s.tmp", filename) == -1) return -ENOMEM;
+    FILE* f = fopen(tmp_name, "w+");
+    if (!f) {
+        int res = -errno;
+        free(tmp_name);
+        return res;
+    }
 
     // Write out
     fprintf(f, "[bloomd]\n\
@@ -491,6 +1555,18 @@ default_probability = %f\n\
 scale_size = %d\n\
 probability_reduction = %f\n\
 in_memory = %d\n\
+counting = %d\n\
+engine = %s\n\
+window = %d\n\
+generations = %d\n\
+scalable = %d\n\
+reject_full = %d\n\
+container = %d\n\
+partitions = %d\n\
+frozen = %d\n\
+pin = %d\n\
+optimize = %s\n\
+hashed = %d\n\
 size = %llu\n\
 capacity = %llu\n\
 bytes = %llu\n", (unsigned long long)config->initial_capacity,
@@ -498,13 +1574,28 @@ bytes = %llu\n", (unsigned long long)config->initial_capacity,
                  config->scale_size,
                  config->probability_reduction,
                  config->in_memory,
+                 config->counting,
+                 (config->engine == ENGINE_CUCKOO) ? "cuckoo" : "bloom",
+                 config->window,
+                 config->generations,
+                 config->scalable,
+                 config->reject_full,
+                 config->container,
+                 config->partitions,
+                 config->frozen,
+                 config->pin,
+                 optimize_name(config->optimize),
+                 config->hashed,
                  (unsigned long long)config->size,
                  (unsigned long long)config->capacity,
                  (unsigned long long)config->bytes
     );
 
-    // Close
-    fclose(f);
-    return 0;
+    // Close, then replace the old file
+    int res = (fclose(f)) ? -errno : 0;
+    if (!res && rename(tmp_name, filename)) res = -errno;
+    if (res) unlink(tmp_name);
+    free(tmp_name);
+    return res;
 }
 
@@ -2,6 +2,24 @@
 #define BLOOM_CONFIG_H
 #include <stdint.h>
 #include <syslog.h>
+#include "bloom.h"
+
+/**
+ * NUMA placement policies, set by numa_mode
+ */
+typedef enum {
+    NUMA_OFF        = 0, // No pinning or placement
+    NUMA_INTERLEAVE = 1, // Bitmaps interleaved over all the nodes
+    NUMA_PER_FILTER = 2, // Each filter is bound to a home node
+} bloom_numa_policy;
+
+/**
+ * The filter engines, set by engine
+ */
+typedef enum {
+    ENGINE_BLOOM  = 0, // Scalable bloom filters
+    ENGINE_CUCKOO = 1, // Scalable cuckoo filters, supports unset
+} bloom_filter_engine;
 
 /**
  * Stores our configuration
@@ -22,8 +40,70 @@ typedef struct {
     int in_memory;
     int worker_threads;
     int use_mmap;
+    int concurrent_sets;
+    int flush_run_pages;
+    int flush_inflight_mb;
+    int use_huge_pages;
+    char *numa_mode;
+    bloom_numa_policy numa_policy;
+    int cold_snapshots;
+    int lazy_page_in;
+    int direct_io;
+    int use_dax;
+    int consistent_flush;
+    int positive_cache;
+    int group_commit;
+    int max_connections;
+    int counting;
+    char *engine;
+    bloom_filter_engine engine_type;
+    double prealloc_fill;
+    int window;
+    int generations;
+    int scalable;
+    int reject_full;
+    int adaptive_checks;
+    int metrics_port;
+    int migrate_connections;
+    int fault_threads;
+    int prewarm_lead;
+    int max_memory;
+    int container;
+    int flush_threads;
+    int flush_bandwidth_mb;
+    int wal;
+    int wal_sync_msec;
+    int delta_snapshots;
+    char *replicas;
+    int replica_batch_msec;
+    int replica_backlog_mb;
+    char *cluster_nodes;
+    char *cluster_self;
+    int partitions;
+    int admin_threads;
+    char *handoff_socket;
+    int filter_affinity;
+    int bulk_threads;
+    int group_checks;
+    char *unix_socket;
+    int tiered_layers;
+    int pin;
+    int writeback_msec;
+    char *optimize;
+    bloom_optimize optimize_type;
+    int slowlog_usec;
+    int hot_sample;
+    int max_worker_threads;
+    int hashed;
+    int shed_lag_msec;
+    uint64_t summary_capacity;
 } bloom_config;
 
+/**
+ * The most partitions of a filter
+ */
+#define MAX_PARTITIONS 64
+
 /**
  * This structure is used to persist
  * filter specific settings to an INI file.
@@ -34,6 +114,18 @@ typedef struct {
     int scale_size;
     double probability_reduction;
     int in_memory;
+    int counting;           // Counting filter, supports unset
+    bloom_filter_engine engine; // The filter engine
+    int window;             // Seconds keys are kept, 0 to never age out
+    int generations;        // Generations of a windowed filter
+    int scalable;           // Grows in layers, or a single fixed filter
+    int reject_full;        // Fixed filters reject sets once full
+    int container;          // All layers in a single container file
+    int partitions;         // Partitions by key hash, 1 if not partitioned
+    int frozen;             // Read only, mapped with no locks or dirty tracking
+    int pin;                // Bitmaps locked in memory, never paged out
+    bloom_optimize optimize; // Memory and probe trade off of new layers
+    int hashed;             // Keys are 128bit hashes sent by the client
     uint64_t size;          // Total size
     uint64_t capacity;      // Total capacity
     uint64_t bytes;         // Total byte size
@@ -75,6 +167,49 @@ int update_filename_from_filter_config(char *filename, bloom_filter_config *conf
  */
 int validate_config(bloom_config *config);
 
+/**
+ * Applies the options of a new filter, such as
+ * "capacity=1000000 prob=0.001", to a copy of the
+ * configuration, and validates them.
+ * @arg config The config object to update.
+ * @arg options Space separated options, modified in place.
+ * @arg like Output, the filter named by a like option, which
+ * points into the options. Can be NULL to reject the option.
+ * @return 0 on success, 1 on an unknown or invalid option.
+ */
+int apply_filter_options(bloom_config *config, char *options, char **like);
+
+/**
+ * Applies the tunable settings of a new configuration to the
+ * running one, such as flush_interval and default_probability.
+ * The others need a restart to change. None are applied if any
+ * is invalid, and each is stored atomically.
+ * @notes Thread safe.
+ * @arg config The running configuration to update
+ * @arg next The configuration to take the settings from
+ * @return 0 on success, -1 if a setting is invalid.
+ */
+int config_update(bloom_config *config, bloom_config *next);
+
+/**
+ * Changes a tunable setting of the running configuration.
+ * @notes Thread safe.
+ * @arg config The running configuration to update
+ * @arg name The setting, such as flush_interval
+ * @arg value The new value
+ * @return 0 on success, 1 if the setting is not tunable,
+ * -1 if the value is invalid.
+ */
+int config_set(bloom_config *config, const char *name, const char *value);
+
+/**
+ * Formats the tunable settings of the running configuration,
+ * one "name value" line each.
+ * @arg config The running configuration
+ * @return A new string, that uses a malloc()'d buffer.
+ */
+char* config_tunables(bloom_config *config);
+
 // Configuration validation methods
 int sane_data_dir(char *data_dir);
 int sane_log_level(char *log_level, int *syslog_level);
@@ -87,6 +222,64 @@ int sane_cold_interval(int intv);
 int sane_in_memory(int in_mem);
 int sane_use_mmap(int use_mmap);
 int sane_worker_threads(int threads);
+int sane_concurrent_sets(int concurrent);
+int sane_flush_run_pages(int pages);
+int sane_flush_inflight_mb(int mb);
+int sane_use_huge_pages(int use_huge_pages);
+int sane_numa_mode(char *numa_mode, bloom_numa_policy *policy);
+int sane_cold_snapshots(int cold_snapshots);
+int sane_lazy_page_in(int lazy_page_in);
+int sane_direct_io(int direct_io);
+int sane_use_dax(int use_dax);
+int sane_consistent_flush(int consistent_flush);
+int sane_positive_cache(int entries);
+int sane_group_commit(int group_commit);
+int sane_max_connections(int max_connections);
+int sane_counting(int counting);
+int sane_engine(char *engine, bloom_filter_engine *type);
+int sane_prealloc_fill(double fill);
+int sane_window(int window);
+int sane_generations(int generations);
+int sane_scalable(int scalable);
+int sane_reject_full(int reject_full);
+int sane_adaptive_checks(int adaptive_checks);
+int sane_migrate_connections(int migrate);
+int sane_fault_threads(int threads);
+int sane_prewarm_lead(int lead);
+int sane_max_memory(int max_memory);
+int sane_container(int container);
+int sane_flush_threads(int threads);
+int sane_flush_bandwidth_mb(int mb);
+int sane_wal(int wal);
+int sane_wal_sync_msec(int msec);
+int sane_delta_snapshots(int delta_snapshots);
+int sane_replicas(char *replicas);
+int sane_replica_batch_msec(int msec);
+int sane_replica_backlog_mb(int mb);
+int sane_cluster_nodes(char *nodes);
+int sane_partitions(int partitions);
+int sane_admin_threads(int threads);
+int sane_handoff_socket(char *path);
+int sane_filter_affinity(int affinity);
+int sane_bulk_threads(int threads);
+int sane_group_checks(int group);
+int sane_unix_socket(char *path);
+int sane_tiered_layers(int tiered);
+int sane_pin(int pin);
+int sane_writeback_msec(int msec);
+int sane_optimize(char *optimize, bloom_optimize *type);
+int sane_slowlog_usec(int usec);
+int sane_hot_sample(int every);
+int sane_max_worker_threads(int threads);
+int sane_hashed(int hashed);
+int sane_shed_lag_msec(int msec);
+int sane_summary_capacity(int64_t capacity);
+int sane_cluster_self(char *self, char *nodes);
+
+/**
+ * Returns the name of an optimize profile, as taken by sane_optimize
+ */
+const char* optimize_name(bloom_optimize type);
 
 /**
  * Joins two strings as part of a path,
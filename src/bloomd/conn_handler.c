@@ -1,10 +1,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <regex.h>
 #include <assert.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "conn_handler.h"
+#include "binary_protocol.h"
+#include "stats.h"
 #include "handler_constants.c"
+#include "scan.h"
+#include "load.h"
+#include "shm_ring.h"
+#include "probes.h"
+#include "slowlog.h"
+#include "hot.h"
+#include "clients.h"
+#include "arena.h"
 
 /**
  * Defines the number of keys we set/check in a single
@@ -15,6 +32,122 @@
  */
 #define MULTI_OP_SIZE 32
 
+/**
+ * Multi commands start with chunks of MULTI_OP_SIZE keys. A chunk
+ * that held the filter for less than MULTI_OP_BUDGET_USEC doubles
+ * the next chunk, up to MULTI_OP_MAX keys, and one that took longer
+ * halves it. Large bulks take the lock far fewer times, while the
+ * time it is held stays bounded.
+ */
+#define MULTI_OP_MAX 1024
+#define MULTI_OP_BUDGET_USEC 200
+
+/**
+ * The most layers listed by the layer_hits of info.
+ */
+#define INFO_MAX_LAYERS 64
+
+/**
+ * The longest filter name, as allowed by VALID_FILTER_NAMES_PATTERN
+ */
+#define MAX_FILTER_NAME 200
+
+/**
+ * The size of the results bitset kept on the stack for binary
+ * requests, larger requests take it from the arena. Covers 4096 keys.
+ */
+#define BIN_STACK_RESULTS 512
+
+/**
+ * The size of the chunks a filter listing is sent in
+ */
+#define LIST_CHUNK_SIZE 65536
+
+/**
+ * The most commands for another node sent together
+ */
+#define PROXY_RUN_MAX 128
+
+/**
+ * With bulk threads, the keys of a multi command over
+ * BULK_PARALLEL_CHUNKS chunks of BULK_CHUNK_BYTES are
+ * split into chunks, which are run in parallel.
+ */
+#define BULK_CHUNK_BYTES (64 * 1024)
+#define BULK_PARALLEL_CHUNKS 4
+
+/**
+ * The most keys of a sampled command counted as hot,
+ * and the filters and keys returned by "stats hot"
+ */
+#define HOT_MAX_KEYS 16
+#define HOT_TOP 20
+
+/**
+ * The most clients returned by "stats clients"
+ */
+#define CLIENTS_TOP 100
+
+/**
+ * The arena of the commands of the calling thread. The
+ * buffers of a command are carved from it, and freed at
+ * once when the input of the connection is handled.
+ */
+static __thread bloom_arena LOCAL_ARENA;
+
+/**
+ * How a multi key command replies
+ */
+typedef enum {
+    REPLY_ALL = 0,      // Yes or No for each key
+    REPLY_ERRORS,       // Only errors, for noreply connections
+    REPLY_NEW,          // The indices of the keys newly set
+    REPLY_HEX,          // A bit for each key, in hex digits
+} multi_reply;
+
+/**
+ * The bits of a hex reply not yet sent, since the chunks
+ * of the keys need not end on a digit
+ */
+typedef struct {
+    int digit;          // The bits of the partial digit
+    int bits;           // How many bits the partial digit has
+} hex_reply;
+
+typedef int(*multi_key_func)(bloom_filtmgr *, bloom_filtmgr_cache *, char*, char **, uint64_t *, int, char*);
+
+/**
+ * A chunk of the keys of a multi command run in parallel.
+ * The keys up to the first error have results.
+ */
+typedef struct {
+    char *keys;
+    int keys_len;
+    char *results;
+    int num;            // Keys with results
+    int res;            // Error of the keys after them, or 0
+} bulk_chunk;
+
+/**
+ * A check gathered by handle_client_checks
+ */
+typedef struct {
+    char *filter;
+    char *key;
+    uint64_t key_len;
+    int conn;           // Index of the client
+} grouped_check;
+
+/**
+ * A multi command run in parallel
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    char *filter;
+    multi_key_func func;
+    bulk_chunk *chunks;
+} bulk_command;
+
 /**
  * Invoked in any context with a bloom_conn_handler
  * to send out an INTERNAL_ERROR message to the client.
@@ -22,23 +155,88 @@
 #define INTERNAL_ERROR() (handle_client_resp(handle->conn, (char*)INTERNAL_ERR, INTERNAL_ERR_LEN))
 
 /* Static method declarations */
-static void handle_check_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_check_multi_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_set_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_set_multi_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_set_new_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_check_hex_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_set_hex_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_unset_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_unset_multi_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_hash_cmd(bloom_conn_handler *handle, char *args, int args_len, int set);
+static void handle_mcheck_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_slice_cmd(bloom_conn_handler *handle, char *args, int args_len, int unslice);
+static void handle_scheck_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_combine_cmd(bloom_conn_handler *handle, char *args, int args_len, int intersect);
 static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_filt_cmd(bloom_conn_handler *handle, char *args, int args_len,
+        int(*filtmgr_func)(bloom_filtmgr *, char*));
 static void handle_drop_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static int count_batch_names(char *args, int args_len);
+static int split_batch_names(char *args, int args_len, char **names, char **rest);
+static void handle_batch_response(bloom_conn_handler *handle, const char **words, int *results, int num);
 static void handle_close_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_reset_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_warm_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len);
-static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_estimate_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_freeze_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_shrink_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static int handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static int is_flush_wait(char *args);
+static void flush_all_filters(bloom_conn_handler *handle);
+static void handle_delta_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_load_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_dump_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_restore_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_restored_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_stats_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_binary_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_noreply_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_peer_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_hello_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_shm_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_slowlog_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_workers_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_config_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_deadline_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void log_slow_command(conn_cmd_type type, char *args, int args_len, int num_cmds, uint64_t usec);
+static void sample_hot_command(conn_cmd_type type, char *args, int args_len);
+static void handle_stats_hot_cmd(bloom_conn_handler *handle);
+static void handle_stats_clients_cmd(bloom_conn_handler *handle);
+static int handle_filt_key_run(bloom_conn_handler *handle, conn_cmd_type *type, char **args, int *args_len, int *num_cmds);
+static void handle_bulk_parallel(bloom_conn_handler *handle, char *filter, char *keys, int keys_len,
+        multi_reply reply, multi_key_func func);
+static void run_bulk_chunk(void *data, int chunk);
+static int grouped_check_cmp(const void *a, const void *b);
+static int command_filter_name(conn_cmd_type type, char *args, int args_len, char *name);
+static int park_cold_filter(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int park_affine_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int park_admin_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static void dispatch_admin_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int remote_owner(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int proxy_command_run(bloom_conn_handler *handle, int node, conn_cmd_type *type, char **args, int *args_len, int *num_cmds);
+static void list_remote_filters(bloom_conn_handler *handle, char *prefix, char *after, int limit);
+
+static int handle_text_commands(bloom_conn_handler *handle);
+static int handle_binary_requests(bloom_conn_handler *handle);
+static void handle_binary_request(bloom_conn_handler *handle, bloom_binary_request *req, char *body, uint32_t body_len);
+static void handle_binary_response(bloom_conn_handler *handle, int status, char *results, uint32_t num_keys);
 
 static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int num_keys, char *res_buf, int end_of_input);
+static void handle_hex_response(bloom_conn_handler *handle, int num_keys, char *res_buf, hex_reply *hex, int end_of_input);
+static void handle_new_keys_response(bloom_conn_handler *handle, int num_keys, char *res_buf, int offset, int *num_new, int end_of_input);
 static inline void handle_client_resp(bloom_conn_info *conn, char* resp_mesg, int resp_len);
 static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len);
 static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len);
+static conn_cmd_type split_command_tag(bloom_conn_info *conn, char *line, int line_len, char **arg_buf, int *arg_len);
+static int command_latency(conn_cmd_type type);
+static int command_sheddable(conn_cmd_type type);
 static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len);
+static int split_filt_key(char *args, int args_len, char **key, int *key_len);
+static int split_keys(char **buf, int *buf_len, char **keys, uint64_t *lens, int max_keys);
 
 /**
  * Invoked to initialize the conn handler layer.
@@ -55,66 +253,776 @@ void init_conn_handler() {
  * Invoked by the networking layer when there is new
  * data to be handled. The connection handler should
  * consume all the input possible, and generate responses
- * to all requests.
+ * to all requests. It stops early once the budget of the
+ * handle is used up, leaving the rest of the input.
  * @arg handle The connection related information
  * @return 0 on success.
  */
 int handle_client_connect(bloom_conn_handler *handle) {
+    // Binary connections frame their own input
+    int res;
+    if (conn_binary_protocol(handle->conn))
+        res = handle_binary_requests(handle);
+    else
+        res = handle_text_commands(handle);
+
+    // Free the buffers of the commands handled
+    arena_reset(&LOCAL_ARENA);
+    return res;
+}
+
+/**
+ * Handles the command lines of a text connection,
+ * until the input or the budget runs out.
+ */
+static int handle_text_commands(bloom_conn_handler *handle) {
     // Look for the next command line
     char *buf, *arg_buf;
-    int buf_len, arg_buf_len, should_free;
+    int buf_len, arg_buf_len;
     int status;
+    conn_cmd_type type;
+    int read_ahead = 0;     // A command was read ahead by a run
+    int resumed;            // The command waited for its filter to fault in
+    int num_cmds;
     while (1) {
-        status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free);
-        if (status == -1) break; // Return if no command is available
+        resumed = 0;
+        if (!read_ahead) {
+            // Yield to the other clients, a command read ahead
+            // is already consumed so it is always handled
+            if (handle->budget <= 0) break;
+
+            // Handle the command of a parked connection first
+            status = take_parked_command(handle->conn, &arg_buf, &arg_buf_len);
+            if (status >= 0) {
+                type = status;
+                resumed = 1;
+            } else if (conn_sending_file(handle->conn)) {
+                // The commands after a dump wait for it to be sent
+                break;
+            } else if ((status = take_unread_command(handle->conn, &arg_buf, &arg_buf_len)) >= 0) {
+                // Read ahead by the worker owning a filter
+                type = status;
+            } else {
+                status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len);
+                if (status == -1) break; // Return if no command is available
+
+                // Determine the command type
+                type = determine_client_command(buf, buf_len, &arg_buf, &arg_buf_len);
+            }
+        }
+        read_ahead = 0;
+        num_cmds = 1;
+
+        // The responses of a tagged command are prefixed with its tag
+        if (type == TAGGED) type = split_command_tag(handle->conn, arg_buf, arg_buf_len, &arg_buf, &arg_buf_len);
+        BLOOM_PROBE3(command, type, arg_buf, arg_buf_len);
+
+        // Answer the commands that waited past their deadline
+        // without running them, so that a backlog clears quickly
+        if (command_sheddable(type) && conn_expired(handle->conn)) {
+            stats_add(STAT_TIMEOUTS, 1);
+            handle_client_resp(handle->conn, (char*)TIMEOUT_RESP, TIMEOUT_RESP_LEN);
+            set_client_tag(handle->conn, NULL, 0);
+            handle->budget--;
+            continue;
+        }
+
+        // Send the commands for filters owned by other nodes to them
+        int node = (handle->cluster && !resumed) ? remote_owner(handle, type, arg_buf, arg_buf_len) : -1;
+        if (node >= 0) {
+            read_ahead = proxy_command_run(handle, node, &type, &arg_buf, &arg_buf_len, &num_cmds);
+            set_client_tag(handle->conn, NULL, 0);
+            handle->budget -= num_cmds;
+            continue;
+        }
 
-        // Determine the command type
-        conn_cmd_type type = determine_client_command(buf, buf_len, &arg_buf, &arg_buf_len);
+        // Wait for a cold filter to fault in, without blocking the
+        // worker. A resumed command is handled even if the fault
+        // failed, so that the error is reported.
+        if (!resumed && park_cold_filter(handle, type, arg_buf, arg_buf_len)) break;
+
+        // Hand the commands on a filter owned by another worker to it
+        if (!resumed && park_affine_command(handle, type, arg_buf, arg_buf_len)) break;
+
+        // Hand the slow admin commands to an admin thread, so
+        // the data commands of the worker are not held up
+        if (!resumed && park_admin_command(handle, type, arg_buf, arg_buf_len)) break;
+
+        // Time the commands that keep a latency histogram, and
+        // every command if slow commands are logged. The command
+        // is kept, a run of checks or sets moves on to the last.
+        int latency = command_latency(type);
+        uint64_t slow_usec = handle->config->slowlog_usec;
+        conn_cmd_type slow_type = type;
+        char *slow_args = arg_buf;
+        int slow_args_len = arg_buf_len;
+        if (handle->config->hot_sample && hot_sample_next(handle->config->hot_sample)) {
+            sample_hot_command(type, arg_buf, arg_buf_len);
+        }
+        uint64_t start = 0;
+        if (latency >= 0 || slow_usec) {
+            start = hist_now_usec();
+            if (slow_usec) slowlog_begin();
+        }
 
         // Handle an error or unknown response
         switch(type) {
             case CHECK:
-                handle_check_cmd(handle, arg_buf, arg_buf_len);
+            case SET:
+                read_ahead = handle_filt_key_run(handle, &type, &arg_buf, &arg_buf_len, &num_cmds);
                 break;
             case CHECK_MULTI:
                 handle_check_multi_cmd(handle, arg_buf, arg_buf_len);
                 break;
-            case SET:
-                handle_set_cmd(handle, arg_buf, arg_buf_len);
-                break;
             case SET_MULTI:
                 handle_set_multi_cmd(handle, arg_buf, arg_buf_len);
                 break;
-            case CREATE:
-                handle_create_cmd(handle, arg_buf, arg_buf_len);
+            case HCHECK:
+            case HSET:
+                handle_hash_cmd(handle, arg_buf, arg_buf_len, type == HSET);
                 break;
-            case DROP:
-                handle_drop_cmd(handle, arg_buf, arg_buf_len);
+            case SET_NEW:
+                handle_set_new_cmd(handle, arg_buf, arg_buf_len);
                 break;
-            case CLOSE:
-                handle_close_cmd(handle, arg_buf, arg_buf_len);
+            case CHECK_HEX:
+                handle_check_hex_cmd(handle, arg_buf, arg_buf_len);
                 break;
-            case CLEAR:
-                handle_clear_cmd(handle, arg_buf, arg_buf_len);
+            case SET_HEX:
+                handle_set_hex_cmd(handle, arg_buf, arg_buf_len);
                 break;
-            case LIST:
-                handle_list_cmd(handle, arg_buf, arg_buf_len);
+            case UNSET:
+                handle_unset_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case UNSET_MULTI:
+                handle_unset_multi_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case MCHECK:
+                handle_mcheck_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SCHECK:
+                handle_scheck_cmd(handle, arg_buf, arg_buf_len);
                 break;
+            case UNION:
+            case INTERSECT:
+            case RESET:
+            case ESTIMATE:
+            case CREATE:
+            case DROP:
+            case CLOSE:
+            case CLEAR:
+            case LIST:
             case INFO:
-                handle_info_cmd(handle, arg_buf, arg_buf_len);
+            case DELTA:
+            case FREEZE:
+            case LOAD:
+            case DUMP:
+            case RESTORED:
+            case SLICE:
+            case UNSLICE:
+            case SHRINK:
+                dispatch_admin_command(handle, type, arg_buf, arg_buf_len);
+                break;
+            case RESTORE:
+                handle_restore_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case WARM:
+                handle_warm_cmd(handle, arg_buf, arg_buf_len);
                 break;
             case FLUSH:
-                handle_flush_cmd(handle, arg_buf, arg_buf_len);
+                // A resumed flush waited for its ticket to complete
+                if (resumed) {
+                    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+                } else if (handle_flush_cmd(handle, arg_buf, arg_buf_len)) {
+                    return 0;
+                }
+                break;
+            case BINARY:
+                handle_binary_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case STATS:
+                handle_stats_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case NOREPLY:
+                handle_noreply_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case DEADLINE:
+                handle_deadline_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case PEER:
+                handle_peer_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case HELLO:
+                handle_hello_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SHM:
+                handle_shm_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SLOWLOG:
+                handle_slowlog_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case WORKERS:
+                handle_workers_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case CONFIG:
+                handle_config_cmd(handle, arg_buf, arg_buf_len);
                 break;
             default:
                 handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
                 break;
         }
+        if (latency >= 0 || slow_usec) {
+            uint64_t elapsed = hist_now_usec() - start;
+
+            // Each command of a run waited for the whole run
+            if (latency >= 0) {
+                for (int i=0; i < num_cmds; i++) stats_record_latency(latency, elapsed);
+            }
+            if (slow_usec && elapsed >= slow_usec) {
+                log_slow_command(slow_type, slow_args, slow_args_len, num_cmds, elapsed);
+            }
+        }
+        set_client_tag(handle->conn, NULL, 0);
+        handle->budget -= num_cmds;
+
+        // Any input after switching protocols is binary
+        if (conn_binary_protocol(handle->conn)) return handle_binary_requests(handle);
+    }
+
+    return 0;
+}
+
+/**
+ * Parks the connection if a command needs a filter that is
+ * not in memory. The filter is faulted in off the worker, and
+ * the command is handled once the connection resumes.
+ * @arg handle The connection related information
+ * @arg type The command type
+ * @arg args The arguments of the command, left unchanged
+ * @arg args_len The length of the arguments
+ * @return 1 if the connection was parked, 0 otherwise.
+ */
+static int park_cold_filter(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    char name[MAX_FILTER_NAME + 1];
+    if (command_filter_name(type, args, args_len, name)) return 0;
+
+    // A tagged command waits on its own, the connection goes on
+    if (conn_tagged(handle->conn))
+        return !park_tagged_command(handle->conn, handle->mgr, name, type, args, args_len);
+    return !park_client_command(handle->conn, handle->mgr, name, type, args, args_len);
+}
+
+/**
+ * Parks the connection if a command is on a filter owned by
+ * another worker, with filter_affinity. The owner handles the
+ * command, and the connection resumes with its responses.
+ * @arg handle The connection related information
+ * @arg type The command type
+ * @arg args The arguments of the command, left unchanged
+ * @arg args_len The length of the arguments
+ * @return 1 if the connection was parked, 0 otherwise.
+ */
+static int park_affine_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    if (!handle->config->filter_affinity) return 0;
+    char name[MAX_FILTER_NAME + 1];
+    if (command_filter_name(type, args, args_len, name)) return 0;
+    return !park_client_affine(handle->conn, name, type, args, args_len);
+}
+
+/**
+ * Handles the leading checks of the clients that became
+ * readable together. The checks are sorted by filter, and
+ * each filter is checked once for all of its keys.
+ */
+void handle_client_checks(bloom_conn_handler *handle, bloom_conn_info **conns, int num) {
+    // Checks may belong to other nodes or workers
+    if (handle->cluster || handle->config->filter_affinity) return;
+
+    grouped_check checks[CHECK_GROUP_MAX];
+    char *buf, *args, *space;
+    int buf_len, args_len, n = 0;
+    conn_cmd_type type;
+    for (int i=0; i < num && i < CHECK_GROUP_MAX; i++) {
+        // Late checks are left to be answered with Timeout
+        if (conn_binary_protocol(conns[i]) || conn_expired(conns[i])) continue;
+        if (extract_to_terminator(conns[i], '\n', &buf, &buf_len)) continue;
+
+        // Leave anything but a check with a key to the client, as read
+        type = determine_client_command(buf, buf_len, &args, &args_len);
+        space = (type == CHECK && args) ? memchr(args, ' ', args_len) : NULL;
+        if (!space || args_len - (space - args) - 1 <= 1) {
+            unread_command(conns[i], type, args, args_len);
+            continue;
+        }
+        handle->conn = conns[i];
+        if (park_cold_filter(handle, type, args, args_len)) continue;
+
+        // The key length includes the NUL of the command
+        *space = '\0';
+        checks[n].filter = args;
+        checks[n].key = space + 1;
+        checks[n].key_len = args_len - (space - args) - 2;
+        checks[n].conn = i;
+        n++;
+    }
+    qsort(checks, n, sizeof(grouped_check), grouped_check_cmp);
+
+    // Check each run of keys on a filter at once
+    char *key_buf[CHECK_GROUP_MAX];
+    uint64_t len_buf[CHECK_GROUP_MAX];
+    char result_buf[CHECK_GROUP_MAX];
+    int latency = command_latency(CHECK);
+    int start, end, res;
+    for (start=0; start < n; start = end) {
+        for (end=start; end < n && !strcmp(checks[end].filter, checks[start].filter); end++) {
+            key_buf[end - start] = checks[end].key;
+            len_buf[end - start] = checks[end].key_len;
+        }
+        uint64_t began = hist_now_usec();
+        memset(result_buf, 2, end - start);
+        res = filtmgr_check_keys_len(handle->mgr, NULL, checks[start].filter,
+                key_buf, len_buf, end - start, result_buf);
+        uint64_t elapsed = hist_now_usec() - began;
+
+        // Answer each client, the responses are corked
+        for (int i=start; i < end; i++) {
+            handle->conn = conns[checks[i].conn];
+            conn_count_usage(handle->conn, 1, 1);
+            if (res) {
+                handle_multi_response(handle, res, 1, result_buf + i - start, 1);
+            } else if (result_buf[i - start]) {
+                handle_client_resp(handle->conn, (char*)YES_RESP, YES_RESP_LEN);
+            } else {
+                handle_client_resp(handle->conn, (char*)NO_RESP, NO_RESP_LEN);
+            }
+            if (latency >= 0) stats_record_latency(latency, elapsed);
+        }
+    }
+}
+
+// Orders gathered checks by filter, then by client
+static int grouped_check_cmp(const void *a, const void *b) {
+    const grouped_check *ca = a, *cb = b;
+    int cmp = strcmp(ca->filter, cb->filter);
+    return (cmp) ? cmp : ca->conn - cb->conn;
+}
+
+/**
+ * Copies out the filter name of a data command on a single
+ * filter, so that the arguments are not changed.
+ * @arg type The command type
+ * @arg args The arguments of the command
+ * @arg args_len The length of the arguments
+ * @arg name Output, at least MAX_FILTER_NAME + 1 bytes
+ * @return 0 if the name was copied, -1 if the command
+ * is not on a single filter.
+ */
+static int command_filter_name(conn_cmd_type type, char *args, int args_len, char *name) {
+    switch (type) {
+        case CHECK:
+        case SET:
+        case CHECK_MULTI:
+        case SET_MULTI:
+        case HCHECK:
+        case HSET:
+        case SET_NEW:
+        case CHECK_HEX:
+        case SET_HEX:
+        case UNSET:
+        case UNSET_MULTI:
+            break;
+        default:
+            return -1;
+    }
+    if (!args) return -1;
+
+    // The filter name ends at the first space
+    char *space = memchr(args, ' ', args_len);
+    int name_len = (space) ? space - args : (int)strlen(args);
+    if (name_len > MAX_FILTER_NAME) return -1;
+    memcpy(name, args, name_len);
+    name[name_len] = '\0';
+    return 0;
+}
+
+/**
+ * Handles a command forwarded by another worker, on the
+ * worker owning its filter. A run of checks or sets also
+ * handles the same commands on the filter that follow it.
+ */
+void handle_affine_command(bloom_conn_handler *handle, int type, char *args, int args_len) {
+    conn_cmd_type cmd = type;
+    int latency = command_latency(cmd);
+    uint64_t start = (latency >= 0) ? hist_now_usec() : 0;
+    int num_cmds = 1;
+    switch (cmd) {
+        case CHECK:
+        case SET:
+            // The command that ended the run is not ours
+            if (handle_filt_key_run(handle, &cmd, &args, &args_len, &num_cmds))
+                unread_command(handle->conn, cmd, args, args_len);
+            break;
+        case CHECK_MULTI:
+            handle_check_multi_cmd(handle, args, args_len);
+            break;
+        case SET_MULTI:
+            handle_set_multi_cmd(handle, args, args_len);
+            break;
+        case HCHECK:
+        case HSET:
+            handle_hash_cmd(handle, args, args_len, cmd == HSET);
+            break;
+        case SET_NEW:
+            handle_set_new_cmd(handle, args, args_len);
+            break;
+        case CHECK_HEX:
+            handle_check_hex_cmd(handle, args, args_len);
+            break;
+        case SET_HEX:
+            handle_set_hex_cmd(handle, args, args_len);
+            break;
+        case UNSET:
+            handle_unset_cmd(handle, args, args_len);
+            break;
+        case UNSET_MULTI:
+            handle_unset_multi_cmd(handle, args, args_len);
+            break;
+        default:
+            break;
+    }
+    if (latency >= 0) {
+        uint64_t elapsed = hist_now_usec() - start;
+        for (int i=0; i < num_cmds; i++) stats_record_latency(latency, elapsed);
+    }
+}
+
+/**
+ * Parks the connection while an admin command runs on an
+ * admin thread. A flush of all the filters is not parked, it
+ * is handed to the flush thread instead.
+ * @arg handle The connection related information
+ * @arg type The command type
+ * @arg args The arguments of the command, left unchanged
+ * @arg args_len The length of the arguments
+ * @return 1 if the connection was parked, 0 otherwise.
+ */
+static int park_admin_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    switch (type) {
+        case CREATE:
+        case DROP:
+        case CLOSE:
+        case CLEAR:
+        case LIST:
+        case INFO:
+        case DELTA:
+        case FREEZE:
+        case LOAD:
+        case DUMP:
+        case RESTORED:
+        case SLICE:
+        case UNSLICE:
+        case SHRINK:
+        case UNION:
+        case INTERSECT:
+        case RESET:
+        case ESTIMATE:
+            break;
+        case FLUSH:
+            if (args && !is_flush_wait(args)) break;
+            return 0;
+        default:
+            return 0;
+    }
+    return !park_client_admin(handle->conn, type, args, args_len);
+}
+
+/**
+ * Handles the admin command of a parked connection,
+ * on an admin thread.
+ */
+void handle_admin_command(bloom_conn_handler *handle, int type, char *args, int args_len) {
+    int latency = command_latency(type);
+    uint64_t start = (latency >= 0) ? hist_now_usec() : 0;
+    dispatch_admin_command(handle, type, args, args_len);
+    if (latency >= 0) stats_record_latency(latency, hist_now_usec() - start);
+    arena_reset(&LOCAL_ARENA);
+}
+
+// Handles an admin command, on a worker or an admin thread
+static void dispatch_admin_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    switch (type) {
+        case CREATE:
+            handle_create_cmd(handle, args, args_len);
+            break;
+        case DROP:
+            handle_drop_cmd(handle, args, args_len);
+            break;
+        case CLOSE:
+            handle_close_cmd(handle, args, args_len);
+            break;
+        case CLEAR:
+            handle_clear_cmd(handle, args, args_len);
+            break;
+        case LIST:
+            handle_list_cmd(handle, args, args_len);
+            break;
+        case INFO:
+            handle_info_cmd(handle, args, args_len);
+            break;
+        case DELTA:
+            handle_delta_cmd(handle, args, args_len);
+            break;
+        case FREEZE:
+            handle_freeze_cmd(handle, args, args_len);
+            break;
+        case LOAD:
+            handle_load_cmd(handle, args, args_len);
+            break;
+        case DUMP:
+            handle_dump_cmd(handle, args, args_len);
+            break;
+        case RESTORED:
+            handle_restored_cmd(handle, args, args_len);
+            break;
+        case SLICE:
+        case UNSLICE:
+            handle_slice_cmd(handle, args, args_len, type == UNSLICE);
+            break;
+        case SHRINK:
+            handle_shrink_cmd(handle, args, args_len);
+            break;
+        case UNION:
+        case INTERSECT:
+            handle_combine_cmd(handle, args, args_len, type == INTERSECT);
+            break;
+        case RESET:
+            handle_reset_cmd(handle, args, args_len);
+            break;
+        case ESTIMATE:
+            handle_estimate_cmd(handle, args, args_len);
+            break;
+        case FLUSH:
+            handle_filt_cmd(handle, args, args_len, filtmgr_flush_filter);
+            break;
+        default:
+            handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
+            break;
+    }
+}
+
+// Returns the command name sent to another node for a
+// command on a filter, or NULL if it is handled locally
+static const char* proxy_cmd_name(conn_cmd_type type) {
+    switch (type) {
+        case CHECK: return "c";
+        case SET: return "s";
+        case CHECK_MULTI: return "m";
+        case SET_MULTI: return "b";
+        case HCHECK: return "hcheck";
+        case HSET: return "hset";
+        case SET_NEW: return "bulk_new";
+        case CHECK_HEX: return "multi_hex";
+        case SET_HEX: return "bulk_hex";
+        case UNSET: return "u";
+        case UNSET_MULTI: return "mu";
+        case CREATE: return "create";
+        case DROP: return "drop";
+        case CLOSE: return "close";
+        case CLEAR: return "clear";
+        case RESET: return "reset";
+        case WARM: return "warm";
+        case INFO: return "info";
+        case ESTIMATE: return "estimate";
+        case FLUSH: return "flush";
+        case DELTA: return "delta";
+        case FREEZE: return "freeze";
+        case SHRINK: return "shrink";
+        default: return NULL;
+    }
+}
+
+// Used to check if a filter exists locally
+static void exists_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)data;
+    (void)filter_name;
+    (void)filter;
+}
+
+/**
+ * Finds the node that a command must be sent to. A filter
+ * that exists locally is always served locally, even if the
+ * ring places it on another node, until it is moved.
+ * @arg handle The connection related information
+ * @arg type The command type
+ * @arg args The arguments of the command, left unchanged
+ * @arg args_len The length of the arguments
+ * @return The index of the node, or -1 to handle it locally.
+ */
+static int remote_owner(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    // The commands of other nodes are always handled locally
+    if (!args || !proxy_cmd_name(type) || conn_peer(handle->conn)) return -1;
+    if (type == FLUSH && is_flush_wait(args)) return -1;
+    if ((type == CREATE || type == DROP) && count_batch_names(args, args_len) > 1) return -1;
+
+    char *space = memchr(args, ' ', args_len);
+    int name_len = (space) ? space - args : (int)strnlen(args, args_len);
+    if (!name_len || name_len > MAX_FILTER_NAME) return -1;
+    int node = cluster_owner(handle->cluster, args, name_len);
+    if (node == cluster_self(handle->cluster)) return -1;
+
+    char name[MAX_FILTER_NAME + 1];
+    memcpy(name, args, name_len);
+    name[name_len] = '\0';
+    if (!filtmgr_filter_cb(handle->mgr, name, exists_filter_cb, NULL)) return -1;
+    return node;
+}
+
+// Appends a command line for another node to a growing buffer,
+// which is moved to a larger one in the arena when full
+static void append_proxy_cmd(char **req, int *req_len, int *req_size,
+        conn_cmd_type type, char *args, int args_len) {
+    const char *cmd = proxy_cmd_name(type);
+    int cmd_len = strlen(cmd);
+    int len = strnlen(args, args_len);
+    if (*req_len + cmd_len + len + 2 > *req_size) {
+        while (*req_len + cmd_len + len + 2 > *req_size) *req_size *= 2;
+        char *grown = arena_alloc(&LOCAL_ARENA, *req_size);
+        memcpy(grown, *req, *req_len);
+        *req = grown;
+    }
+    memcpy(*req + *req_len, cmd, cmd_len);
+    (*req)[*req_len + cmd_len] = ' ';
+    memcpy(*req + *req_len + cmd_len + 1, args, len);
+    (*req)[*req_len + cmd_len + len + 1] = '\n';
+    *req_len += cmd_len + len + 2;
+}
+
+// Checks if a response is the results of keys, not an error
+static int is_key_results(char *resp, int len) {
+    return (len >= YES_SPACE_LEN && !memcmp(resp, YES_SPACE, YES_SPACE_LEN - 1)) ||
+           (len >= NO_SPACE_LEN && !memcmp(resp, NO_SPACE, NO_SPACE_LEN - 1));
+}
+
+/**
+ * Sends a run of commands owned by the same node to it, and
+ * relays the responses. Reads ahead for more commands for the
+ * node, so the round trip is shared.
+ * @arg handle The connection related information
+ * @arg node The node owning the filter of the first command
+ * @arg type The type of the first command. Output, the type
+ * of the command read ahead.
+ * @arg args The arguments of the first command. Output, the
+ * arguments of the command read ahead.
+ * @arg args_len The length of the arguments. Output, the
+ * length of the arguments of the command read ahead.
+ * @arg num_cmds Output, the number of commands sent
+ * @return 1 if a command was read ahead, 0 otherwise.
+ */
+static int proxy_command_run(bloom_conn_handler *handle, int node, conn_cmd_type *type, char **args, int *args_len, int *num_cmds) {
+    int req_size = 4096, req_len = 0;
+    char *req = arena_alloc(&LOCAL_ARENA, req_size);
+    conn_cmd_type types[PROXY_RUN_MAX];
+    types[0] = *type;
+    append_proxy_cmd(&req, &req_len, &req_size, *type, *args, *args_len);
+    int num = 1;
+
+    // Scan ahead for commands for the same node
+    int read_ahead = 0;
+    char *buf, *next_args;
+    int buf_len, next_len;
+    while (num < PROXY_RUN_MAX) {
+        if (extract_to_terminator(handle->conn, '\n', &buf, &buf_len)) break;
+        conn_cmd_type next = determine_client_command(buf, buf_len, &next_args, &next_len);
+        if (remote_owner(handle, next, next_args, next_len) != node) {
+            *type = next;
+            *args = next_args;
+            *args_len = next_len;
+            read_ahead = 1;
+            break;
+        }
+        types[num++] = next;
+        append_proxy_cmd(&req, &req_len, &req_size, next, next_args, next_len);
+    }
+    *num_cmds = num;
+
+    char *resp = NULL;
+    int resp_lens[PROXY_RUN_MAX];
+    int res = cluster_request(handle->cluster, node, req, req_len, num, &resp, (int*)&resp_lens);
+    if (res) {
+        syslog(LOG_ERR, "Failed to proxy %d commands to %s. Err: %d",
+                num, cluster_node_name(handle->cluster, node), res);
+        for (int i=0; i < num; i++) {
+            INTERNAL_ERROR();
+        }
+        return read_ahead;
+    }
 
-        // Make sure to free the command buffer if we need to
-        if (should_free) free(buf);
+    // Relay the responses, sets in no-reply mode only on errors
+    int quiet = conn_noreply(handle->conn);
+    char *resp_bufs[PROXY_RUN_MAX];
+    int resp_buf_lens[PROXY_RUN_MAX];
+    int sent = 0;
+    char *pos = resp;
+    for (int i=0; i < num; i++) {
+        int is_set = types[i] == SET || types[i] == SET_MULTI || types[i] == HSET;
+        if (!(quiet && is_set && is_key_results(pos, resp_lens[i]))) {
+            resp_bufs[sent] = pos;
+            resp_buf_lens[sent++] = resp_lens[i];
+        }
+        pos += resp_lens[i];
     }
+    if (sent) send_client_response(handle->conn, (char**)&resp_bufs, (int*)&resp_buf_lens, sent);
+    free(resp);
+    return read_ahead;
+}
+
+/**
+ * Invoked by the networking layer with a UDP datagram.
+ * Each line of the datagram is a set or bulk command, the
+ * last line need not be terminated. Other commands are
+ * ignored, and no responses are sent.
+ * @arg handle The connection related information
+ * @arg buf The datagram, NUL terminated
+ * @arg buf_len The length of the datagram
+ * @return 0 on success.
+ */
+int handle_client_datagram(bloom_conn_handler *handle, char *buf, int buf_len) {
+    char *next, *arg_buf;
+    int next_len, line_len, arg_buf_len;
+    while (buf_len > 0) {
+        // Split off the next line, counting the terminator as
+        // determine_client_command expects. The last line is
+        // terminated by the NUL after the datagram.
+        if (buffer_after_terminator(buf, buf_len, '\n', &next, &next_len)) {
+            line_len = buf_len + 1;
+            next_len = 0;
+        } else {
+            line_len = next - buf;
+        }
+
+        // Skip the empty lines
+        if (line_len > 1) {
+            conn_cmd_type type = determine_client_command(buf, line_len, &arg_buf, &arg_buf_len);
+            int latency = command_latency(type);
+            uint64_t start = hist_now_usec();
+            switch (type) {
+                case SET:
+                    handle_set_cmd(handle, arg_buf, arg_buf_len);
+                    break;
+                case SET_MULTI:
+                    handle_set_multi_cmd(handle, arg_buf, arg_buf_len);
+                    break;
+                default:
+                    stats_add(STAT_UDP_REJECTS, 1);
+                    latency = -1;
+                    break;
+            }
+            if (latency >= 0) stats_record_latency(latency, hist_now_usec() - start);
+        }
 
+        buf = next;
+        buf_len = next_len;
+    }
+    arena_reset(&LOCAL_ARENA);
     return 0;
 }
 
@@ -130,48 +1038,148 @@ void periodic_update(bloom_conn_handler *handle) {
 /**
  * Internal method to handle a command that relies
  * on a filter name and a single key, responses are handled using
- * handle_multi_response.
+ * handle_multi_response. If quiet, only errors are answered.
  */
-static void handle_filt_key_cmd(bloom_conn_handler *handle, char *args, int args_len,
-        int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*)) {
+static void handle_filt_key_cmd(bloom_conn_handler *handle, char *args, int args_len, int quiet,
+        int(*filtmgr_func)(bloom_filtmgr *, bloom_filtmgr_cache *, char*, char **, uint64_t *, int, char*)) {
     #define CHECK_ARG_ERR() { \
         handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN); \
         return; \
     }
-    // If we have no args, complain.
-    if (!args) CHECK_ARG_ERR();
-
-    // Scan past the filter name
+    // Scan past the filter name, complain if there is no key
     char *key;
     int key_len;
-    int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
-    if (err || key_len <= 1) CHECK_ARG_ERR();
+    if (split_filt_key(args, args_len, &key, &key_len)) CHECK_ARG_ERR();
 
-    // Setup the buffers
+    // Setup the buffers, the key is hashed in place. The
+    // key length includes the NUL terminator of the command.
     char *key_buf[] = {key};
+    uint64_t len_buf[] = {key_len - 1};
     char result_buf[1];
 
-    // Call into the filter manager
-    int res = filtmgr_func(handle->mgr, args, (char**)&key_buf, 1, (char*)&result_buf);
-    handle_multi_response(handle, res, 1, (char*)&result_buf, 1);
+    // Call into the filter manager, through the filter cache
+    bloom_filtmgr_cache *cache = conn_filter_cache(handle->conn);
+    int res = filtmgr_func(handle->mgr, cache, args, (char**)&key_buf, (uint64_t*)&len_buf, 1, (char*)&result_buf);
+    handle->keys++;
+    if (!quiet || res) handle_multi_response(handle, res, 1, (char*)&result_buf, 1);
 }
 
-static void handle_check_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_key_cmd(handle, args, args_len, filtmgr_check_keys);
+static void handle_set_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_key_cmd(handle, args, args_len, conn_noreply(handle->conn), filtmgr_set_keys_len);
 }
 
-static void handle_set_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_key_cmd(handle, args, args_len, filtmgr_set_keys);
+
+/**
+ * Handles a run of check or set commands on one filter, as sent
+ * back to back by a pipelining client, with a single call into the
+ * filter manager. The commands already read are scanned ahead, up
+ * to MULTI_OP_SIZE, and each gets its own response. A command read
+ * ahead that does not join the run is returned to be handled next.
+ * @arg handle The connection related information
+ * @arg type The command type, CHECK or SET. Output, the type of
+ * the command read ahead.
+ * @arg args The arguments of the command. Output, the arguments
+ * of the command read ahead.
+ * @arg args_len The length of args. Output, the length of the
+ * arguments of the command read ahead.
+ * @arg num_cmds Output, the number of commands handled.
+ * @return 1 if a command was read ahead, 0 otherwise.
+ */
+static int handle_filt_key_run(bloom_conn_handler *handle, conn_cmd_type *type, char **args, int *args_len, int *num_cmds) {
+    int(*filtmgr_func)(bloom_filtmgr *, bloom_filtmgr_cache *, char*, char **, uint64_t *, int, char*) =
+        (*type == CHECK) ? filtmgr_check_keys_len : filtmgr_set_keys_len;
+    conn_cmd_type run_type = *type;
+    *num_cmds = 1;
+
+    // Split the first command, complain if there is no key
+    char *filter = *args;
+    char *key;
+    int key_len;
+    if (split_filt_key(*args, *args_len, &key, &key_len)) {
+        handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN);
+        return 0;
+    }
+    int filter_len = strlen(filter);
+
+    // Setup the buffers, the keys are hashed in place. The
+    // key lengths include the NUL terminator of the commands.
+    char *key_buf[MULTI_OP_SIZE];
+    uint64_t len_buf[MULTI_OP_SIZE];
+    char result_buf[MULTI_OP_SIZE];
+    key_buf[0] = key;
+    len_buf[0] = key_len - 1;
+    int num = 1;
+
+    // Scan ahead for commands of the same type on the same filter
+    int read_ahead = 0;
+    char *buf, *next_args, *space;
+    int buf_len, next_len;
+    while (num < MULTI_OP_SIZE) {
+        if (extract_to_terminator(handle->conn, '\n', &buf, &buf_len)) break;
+        conn_cmd_type next = determine_client_command(buf, buf_len, &next_args, &next_len);
+
+        // Only a command with a key joins the run, others are
+        // returned untouched so they are handled as usual
+        space = (next == run_type && next_args) ? memchr(next_args, ' ', next_len) : NULL;
+        if (!space || space - next_args != filter_len ||
+                memcmp(next_args, filter, filter_len) ||
+                next_len - filter_len - 1 <= 1) {
+            *type = next;
+            *args = next_args;
+            *args_len = next_len;
+            read_ahead = 1;
+            break;
+        }
+
+        // Add the key to the run
+        *space = '\0';
+        key_buf[num] = space + 1;
+        len_buf[num] = next_len - filter_len - 2;
+        num++;
+    }
+    *num_cmds = num;
+
+    // Call into the filter manager, through the filter cache. The
+    // results are set in order, up to the first key with an error.
+    bloom_filtmgr_cache *cache = conn_filter_cache(handle->conn);
+    memset(result_buf, 2, num);     // Results are 0 or 1
+    int res = filtmgr_func(handle->mgr, cache, filter, (char**)&key_buf, (uint64_t*)&len_buf, num, (char*)&result_buf);
+    handle->keys += num;
+
+    // Respond to each command, sets in no-reply mode only on errors
+    int quiet = run_type == SET && conn_noreply(handle->conn);
+    char *resp_bufs[MULTI_OP_SIZE];
+    int resp_buf_lens[MULTI_OP_SIZE];
+    int done = 0;
+    for (; done < num && result_buf[done] != 2; done++) {
+        resp_bufs[done] = (char*)((result_buf[done]) ? YES_RESP : NO_RESP);
+        resp_buf_lens[done] = (result_buf[done]) ? YES_RESP_LEN : NO_RESP_LEN;
+    }
+    if (done && !quiet) send_client_response(handle->conn, (char**)&resp_bufs, (int*)&resp_buf_lens, done);
+    if (!res) return read_ahead;
+
+    // The first key without a result gets the error, the keys
+    // after it were not reached and are handled one at a time
+    handle_multi_response(handle, res, 1, (char*)&result_buf, 1);
+    for (int i=done+1; i < num; i++) {
+        res = filtmgr_func(handle->mgr, cache, filter, key_buf + i, len_buf + i, 1, (char*)&result_buf);
+        if (!quiet || res) handle_multi_response(handle, res, 1, (char*)&result_buf, 1);
+    }
+    return read_ahead;
+}
+
+static void handle_unset_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_key_cmd(handle, args, args_len, 0, filtmgr_unset_keys_len);
 }
 
 
 /**
  * Internal method to handle a command that relies
  * on a filter name and multiple keys, responses are handled using
- * handle_multi_response.
+ * handle_multi_response. If quiet, only errors are answered.
  */
-static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, int args_len,
-        int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*)) {
+static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, int args_len, multi_reply reply,
+        multi_key_func filtmgr_func) {
     #define CHECK_ARG_ERR() { \
         handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN); \
         return; \
@@ -180,8 +1188,10 @@ static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, in
     if (!args) CHECK_ARG_ERR();
 
     // Setup the buffers
-    char *key_buf[MULTI_OP_SIZE];
-    char result_buf[MULTI_OP_SIZE];
+    char *key_buf[MULTI_OP_MAX];
+    uint64_t len_buf[MULTI_OP_MAX];
+    char result_buf[MULTI_OP_MAX];
+    int chunk = MULTI_OP_SIZE;
 
     // Scan all the keys
     char *key;
@@ -189,46 +1199,288 @@ static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, in
     int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
     if (err || key_len <= 1) CHECK_ARG_ERR();
 
-    // Parse any options
-    char *curr_key = key;
-    int index = 0;
-    #define HAS_ANOTHER_KEY() (curr_key && *curr_key != '\0')
-    while (HAS_ANOTHER_KEY()) {
-        // Adds a zero terminator to the current key, scans forward
-        buffer_after_terminator(key, key_len, ' ', &key, &key_len);
-
-        // Set the key
-        key_buf[index] = curr_key;
+    // Spread very large commands over the bulk threads. Sets
+    // serialize on the filter, unless they are concurrent.
+    key_len--;
+    if (handle->bulk && key_len > BULK_PARALLEL_CHUNKS * BULK_CHUNK_BYTES &&
+            (filtmgr_func == filtmgr_check_keys_len ||
+             (filtmgr_func == filtmgr_set_keys_len && handle->config->concurrent_sets))) {
+        handle_bulk_parallel(handle, args, key, key_len, reply, filtmgr_func);
+        return;
+    }
 
-        // Advance to the next key
-        curr_key = key;
-        index++;
+    // Handle the keys in chunks, the last one ends at the NUL of the command
+    bloom_filtmgr_cache *cache = conn_filter_cache(handle->conn);
+    int num, res;
+    int offset = 0, num_new = 0;
+    hex_reply hex = {0, 0};
+    while (key_len > 0) {
+        num = split_keys(&key, &key_len, key_buf, len_buf, chunk);
+        uint64_t start = hist_now_usec();
+        res = filtmgr_func(handle->mgr, cache, args, key_buf, len_buf, num, result_buf);
+        uint64_t elapsed = hist_now_usec() - start;
+        handle->keys += num;
+        if (res || reply == REPLY_ALL) {
+            res = handle_multi_response(handle, res, num, result_buf, key_len == 0);
+        } else if (reply == REPLY_NEW) {
+            handle_new_keys_response(handle, num, result_buf, offset, &num_new, key_len == 0);
+        } else if (reply == REPLY_HEX) {
+            handle_hex_response(handle, num, result_buf, &hex, key_len == 0);
+        }
+        if (res) return;
+        offset += num;
+
+        // Size the next chunk by how long this one took
+        if (elapsed < MULTI_OP_BUDGET_USEC && chunk < MULTI_OP_MAX) {
+            chunk *= 2;
+        } else if (elapsed > MULTI_OP_BUDGET_USEC && chunk > MULTI_OP_SIZE) {
+            chunk /= 2;
+        }
+    }
+}
 
-        // If we have filled the buffer, check now
-        if (index == MULTI_OP_SIZE) {
-            //  Handle the keys now
-            int res = filtmgr_func(handle->mgr, args, (char**)&key_buf, index, (char*)&result_buf);
-            res = handle_multi_response(handle, res, index, (char*)&result_buf, !HAS_ANOTHER_KEY());
-            if (res) return;
+/**
+ * Runs the keys of a multi command in chunks on the bulk
+ * threads, and replies to them in order once all are done.
+ * A chunk stops at its first error, which ends the reply,
+ * though the chunks after it were still run.
+ */
+static void handle_bulk_parallel(bloom_conn_handler *handle, char *filter, char *keys, int keys_len,
+        multi_reply reply, multi_key_func func) {
+    // Split the keys at the first space after each chunk. A
+    // chunk must not end in a space, or an empty key is lost.
+    int max_chunks = keys_len / BULK_CHUNK_BYTES + 1;
+    bulk_chunk *chunks = arena_alloc(&LOCAL_ARENA, max_chunks * sizeof(bulk_chunk));
+    memset(chunks, 0, max_chunks * sizeof(bulk_chunk));
+    int num_chunks = 0;
+    char *end = keys + keys_len, *split;
+    while (keys < end) {
+        split = (end - keys > BULK_CHUNK_BYTES) ? memchr(keys + BULK_CHUNK_BYTES, ' ', end - keys - BULK_CHUNK_BYTES) : NULL;
+        if (!split) split = end;
+        while (split < end && split - 1 > keys && split[-1] == ' ') split--;
+        chunks[num_chunks].keys = keys;
+        chunks[num_chunks].keys_len = split - keys;
+
+        // A key takes at least its space, so this holds every result
+        chunks[num_chunks].results = arena_alloc(&LOCAL_ARENA, split - keys + 1);
+        num_chunks++;
+        keys = split + 1;
+    }
 
-            // Reset the index
-            index = 0;
+    bulk_command cmd = {handle->mgr, filter, func, chunks};
+    bulk_pool_run(handle->bulk, num_chunks, run_bulk_chunk, &cmd);
+
+    // Reply in order, in pieces the responses can hold
+    int offset = 0, num_new = 0, res = 0;
+    hex_reply hex = {0, 0};
+    bulk_chunk *c;
+    for (int i=0; i < num_chunks; i++) handle->keys += chunks[i].num;
+    for (int i=0; i < num_chunks && !res; i++) {
+        c = chunks + i;
+        for (int done=0, n; done < c->num && !res; done += n) {
+            n = (c->num - done < MULTI_OP_MAX) ? c->num - done : MULTI_OP_MAX;
+            int last = i == num_chunks - 1 && done + n == c->num && !c->res;
+            if (reply == REPLY_ALL) {
+                res = handle_multi_response(handle, 0, n, c->results + done, last);
+            } else if (reply == REPLY_NEW) {
+                handle_new_keys_response(handle, n, c->results + done, offset + done, &num_new, last);
+            } else if (reply == REPLY_HEX) {
+                handle_hex_response(handle, n, c->results + done, &hex, last);
+            }
         }
+        offset += c->num;
+        if (c->res && !res) res = handle_multi_response(handle, c->res, 1, c->results, 1);
     }
+}
 
-    // Handle any remaining keys
-    if (index) {
-        int res = filtmgr_func(handle->mgr, args, key_buf, index, result_buf);
-        handle_multi_response(handle, res, index, (char*)&result_buf, 1);
+/**
+ * Runs a chunk of a multi command, on a bulk thread
+ * or the worker. The filter cache is not shared, and
+ * the results are allocated by the worker.
+ */
+static void run_bulk_chunk(void *data, int chunk) {
+    bulk_command *cmd = data;
+    bulk_chunk *c = cmd->chunks + chunk;
+    char *key_buf[MULTI_OP_MAX];
+    uint64_t len_buf[MULTI_OP_MAX];
+    char *key = c->keys;
+    int key_len = c->keys_len;
+    int num;
+    while (key_len > 0) {
+        num = split_keys(&key, &key_len, key_buf, len_buf, MULTI_OP_MAX);
+        c->res = cmd->func(cmd->mgr, NULL, cmd->filter, key_buf, len_buf, num, c->results + c->num);
+        if (c->res) return;
+        c->num += num;
     }
 }
 
 static void handle_check_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_multi_key_cmd(handle, args, args_len, filtmgr_check_keys);
+    handle_filt_multi_key_cmd(handle, args, args_len, REPLY_ALL, filtmgr_check_keys_len);
 }
 
 static void handle_set_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_multi_key_cmd(handle, args, args_len, filtmgr_set_keys);
+    multi_reply reply = conn_noreply(handle->conn) ? REPLY_ERRORS : REPLY_ALL;
+    handle_filt_multi_key_cmd(handle, args, args_len, reply, filtmgr_set_keys_len);
+}
+
+static void handle_set_new_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_multi_key_cmd(handle, args, args_len, REPLY_NEW, filtmgr_set_keys_len);
+}
+
+static void handle_check_hex_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_multi_key_cmd(handle, args, args_len, REPLY_HEX, filtmgr_check_keys_len);
+}
+
+static void handle_set_hex_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_multi_key_cmd(handle, args, args_len, REPLY_HEX, filtmgr_set_keys_len);
+}
+
+static void handle_unset_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_multi_key_cmd(handle, args, args_len, REPLY_ALL, filtmgr_unset_keys_len);
+}
+
+/**
+ * Handles the hcheck and hset commands, which take the 128bit
+ * hashes of the keys as 32 hex digits, hashed by the client.
+ * They are only taken by a filter created with hashed, since
+ * the hashes index the bits of its layers directly.
+ */
+static void handle_hash_cmd(bloom_conn_handler *handle, char *args, int args_len, int set) {
+    char name[MAX_FILTER_NAME + 1];
+    if (command_filter_name(HCHECK, args, args_len, name)) {
+        handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN);
+        return;
+    }
+    switch (filtmgr_filter_hashed(handle->mgr, conn_filter_cache(handle->conn), name)) {
+        case 1:
+            break;
+        case 0:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_HASHED, FILT_NOT_HASHED_LEN);
+            return;
+        default:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            return;
+    }
+    if (set) {
+        handle_set_multi_cmd(handle, args, args_len);
+    } else {
+        handle_check_multi_cmd(handle, args, args_len);
+    }
+}
+
+
+/**
+ * Handles the mcheck command, which checks one key in
+ * several filters. The key comes first, and the results
+ * are in the order of the filters.
+ */
+static void handle_mcheck_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // Scan past the key, complain if there is no filter
+    char *filters;
+    int filters_len;
+    if (split_filt_key(args, args_len, &filters, &filters_len)) {
+        handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN);
+        return;
+    }
+    uint64_t key_len = filters - args - 1;
+
+    // Split the filter names, there is a result for each
+    char *names[MULTI_OP_MAX];
+    uint64_t name_lens[MULTI_OP_MAX];
+    char result_buf[MULTI_OP_MAX];
+    filters_len--;
+    int num = split_keys(&filters, &filters_len, names, name_lens, MULTI_OP_MAX);
+    if (filters_len) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    // The filter manager needs terminated names, each one
+    // ends at a space or the NUL of the command
+    for (int i=0; i < num; i++) names[i][name_lens[i]] = '\0';
+
+    int res = filtmgr_check_filters(handle->mgr, names, num, args, key_len, result_buf);
+    handle->keys++;
+    handle_multi_response(handle, res, num, result_buf, 1);
+}
+
+
+/**
+ * Handles the slice and unslice commands, which slice the
+ * filters under a prefix for scheck, or drop the slices.
+ */
+static void handle_slice_cmd(bloom_conn_handler *handle, char *args, int args_len, int unslice) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&PREFIX_NEEDED, PREFIX_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the prefix
+    char *rest;
+    int rest_len;
+    if (!buffer_after_terminator(args, args_len, ' ', &rest, &rest_len)) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    int res = (unslice) ? filtmgr_unslice_filters(handle->mgr, args) :
+        filtmgr_slice_filters(handle->mgr, args);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)SLICE_NOT_EXIST, SLICE_NOT_EXIST_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+/**
+ * Handles the union and intersect commands, which combine
+ * the source filters into the first filter, in place.
+ */
+static void handle_combine_cmd(bloom_conn_handler *handle, char *args, int args_len, int intersect) {
+    // Split the filter names, the first is changed. The
+    // length of the arguments includes the NUL of the command.
+    char *names[MULTI_OP_MAX];
+    uint64_t name_lens[MULTI_OP_MAX];
+    int num = 0;
+    if (args) {
+        args_len--;
+        num = split_keys(&args, &args_len, names, name_lens, MULTI_OP_MAX);
+    }
+    if (num < 2) {
+        handle_client_err(handle->conn, (char*)&FILT_SRC_NEEDED, FILT_SRC_NEEDED_LEN);
+        return;
+    } else if (args_len) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    for (int i=0; i < num; i++) names[i][name_lens[i]] = '\0';
+
+    int res = filtmgr_combine_filters(handle->mgr, names[0], names + 1, num - 1, intersect);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_COMPATIBLE, FILT_NOT_COMPATIBLE_LEN);
+            break;
+        case -5:
+            handle_client_resp(handle->conn, (char*)FILT_FROZEN, FILT_FROZEN_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
 }
 
 
@@ -242,59 +1494,48 @@ static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_l
         return;
     }
 
-    // Scan for options after the filter name
-    char *options;
-    int options_len;
-    int res = buffer_after_terminator(args, args_len, ' ', &options, &options_len);
+    // Several names before the options create a batch
+    int num = count_batch_names(args, args_len);
+    char **names = NULL;
+    char *options = NULL;
+    int options_len = 0;
+    int res;
+    if (num > 1) {
+        names = arena_alloc(&LOCAL_ARENA, num * sizeof(char*));
+        split_batch_names(args, args_len, names, &options);
+        res = (options) ? 0 : -1;
+    } else {
+        // Scan for options after the filter name
+        res = buffer_after_terminator(args, args_len, ' ', &options, &options_len);
+    }
 
-    // Verify the filter name is valid
+    // Verify the filter names are valid
     char *filter_name = args;
-    if (regexec(&VALID_FILTER_NAMES_RE, filter_name, 0, NULL, 0) != 0) {
-        handle_client_err(handle->conn, (char*)&BAD_FILT_NAME, BAD_FILT_NAME_LEN);
-        return;
+    for (int i=0; i < ((names) ? num : 1); i++) {
+        if (regexec(&VALID_FILTER_NAMES_RE, (names) ? names[i] : filter_name, 0, NULL, 0) != 0) {
+            handle_client_err(handle->conn, (char*)&BAD_FILT_NAME, BAD_FILT_NAME_LEN);
+            return;
+        }
     }
 
     // Parse the options
     bloom_config *config = NULL;
+    char *like = NULL;
     int err = 0;
     if (res == 0) {
         // Make a new config store, copy the current
         config = malloc(sizeof(bloom_config));
         memcpy(config, handle->config, sizeof(bloom_config));
 
-        // Parse any options
-        char *param = options;
-        while (param) {
-            // Adds a zero terminator to the current param, scans forward
-            buffer_after_terminator(options, options_len, ' ', &options, &options_len);
-
-            // Check for the custom params
-            int match = 0;
-            match |= sscanf(param, "capacity=%llu", (unsigned long long*)&config->initial_capacity);
-            match |= sscanf(param, "prob=%lf", &config->default_probability);
-            match |= sscanf(param, "in_memory=%d", &config->in_memory);
-
-            // Check if there was no match
-            if (!match) {
-                err = 1;
-                handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
-                break;
-            }
-
-            // Advance to the next param
-            param = options;
-        }
-
-        // Validate the params
-        int invalid_config = 0;
-        invalid_config |= sane_initial_capacity(config->initial_capacity);
-        invalid_config |= sane_default_probability(config->default_probability);
-        invalid_config |= sane_in_memory(config->in_memory);
-
-        // Barf if the configs are bad
-        if (invalid_config) {
+        // Parse and validate the options
+        if (apply_filter_options(config, options, &like)) {
             err = 1;
             handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+
+        // Size the filter after the earlier one it is like
+        } else if (like && filtmgr_size_like(handle->mgr, like, config)) {
+            err = 1;
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
         }
     }
 
@@ -304,6 +1545,15 @@ static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_l
         return;
     }
 
+    // Create the batch as a single change, each filter copies the config
+    if (names) {
+        int *results = arena_alloc(&LOCAL_ARENA, num * sizeof(int));
+        filtmgr_create_filters(handle->mgr, names, num, config, results);
+        handle_batch_response(handle, CREATE_RESULTS, results, num);
+        if (config) free(config);
+        return;
+    }
+
     // Create a new filter
     res = filtmgr_create_filter(handle->mgr, filter_name, config);
     switch (res) {
@@ -360,14 +1610,105 @@ static void handle_filt_cmd(bloom_conn_handler *handle, char *args, int args_len
         case -2:
             handle_client_resp(handle->conn, (char*)FILT_NOT_PROXIED, FILT_NOT_PROXIED_LEN);
             break;
+        case -5:
+            handle_client_resp(handle->conn, (char*)FILT_FROZEN, FILT_FROZEN_LEN);
+            break;
         default:
             INTERNAL_ERROR();
             break;
     }
 }
 
+/**
+ * Handles the drop command. Several names are dropped as
+ * a batch, and "prefix" followed by a prefix drops all the
+ * filters with names starting with it.
+ */
 static void handle_drop_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_cmd(handle, args, args_len, filtmgr_drop_filter);
+    int num = (args) ? count_batch_names(args, args_len) : 0;
+    if (num <= 1) {
+        handle_filt_cmd(handle, args, args_len, filtmgr_drop_filter);
+        return;
+    }
+
+    char *rest;
+    char **names = arena_alloc(&LOCAL_ARENA, num * sizeof(char*));
+    split_batch_names(args, args_len, names, &rest);
+    if (rest) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Reply with the number of filters dropped by a prefix
+    if (num == 2 && !strcmp(names[0], "prefix")) {
+        char buf[24];
+        int len = sprintf(buf, "%d\n", filtmgr_drop_prefix(handle->mgr, names[1]));
+        handle_client_resp(handle->conn, buf, len);
+        return;
+    }
+
+    int *results = arena_alloc(&LOCAL_ARENA, num * sizeof(int));
+    filtmgr_drop_filters(handle->mgr, names, num, results);
+    handle_batch_response(handle, DROP_RESULTS, results, num);
+}
+
+/**
+ * Counts the filter names that lead the arguments of a create
+ * or drop, which end at the first option, having an '='.
+ */
+static int count_batch_names(char *args, int args_len) {
+    char *end = args + strnlen(args, args_len);
+    char *pos = args, *space;
+    int num = 0;
+    for (; pos < end; pos = space + 1) {
+        space = memchr(pos, ' ', end - pos);
+        if (!space) space = end;
+        if (space == pos) continue;
+        if (memchr(pos, '=', space - pos)) break;
+        num++;
+    }
+    return num;
+}
+
+/**
+ * Splits the leading filter names of a create or drop in place,
+ * see count_batch_names.
+ * @arg names Output, the names, as many as count_batch_names
+ * @arg rest Output, the arguments after the names, or NULL
+ * @return The number of names.
+ */
+static int split_batch_names(char *args, int args_len, char **names, char **rest) {
+    char *end = args + strnlen(args, args_len);
+    char *pos = args, *space;
+    int num = 0;
+    *rest = NULL;
+    for (; pos < end; pos = space + 1) {
+        space = memchr(pos, ' ', end - pos);
+        if (!space) space = end;
+        if (space == pos) continue;
+        if (memchr(pos, '=', space - pos)) {
+            *rest = pos;
+            break;
+        }
+        *space = '\0';
+        names[num++] = pos;
+    }
+    return num;
+}
+
+/**
+ * Replies to a batch with a word for the result of each name
+ * @arg words The words, indexed by -result
+ */
+static void handle_batch_response(bloom_conn_handler *handle, const char **words, int *results, int num) {
+    int size = 0;
+    for (int i=0; i < num; i++) size += strlen(words[-results[i]]) + 1;
+    char *buf = arena_alloc(&LOCAL_ARENA, size + 1);
+    int len = 0;
+    for (int i=0; i < num; i++) {
+        len += sprintf(buf + len, "%s%s", words[-results[i]], (i + 1 < num) ? " " : "\n");
+    }
+    handle_client_resp(handle->conn, buf, len);
 }
 
 static void handle_close_cmd(bloom_conn_handler *handle, char *args, int args_len) {
@@ -378,184 +1719,1369 @@ static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_le
     handle_filt_cmd(handle, args, args_len, filtmgr_clear_filter);
 }
 
+static void handle_reset_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_cmd(handle, args, args_len, filtmgr_reset_filter);
+}
+
+static void handle_warm_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_cmd(handle, args, args_len, filtmgr_warm_filter);
+}
+
+// Buffers the lines of a listing, which is sent in chunks
+// so that a large listing is never held in memory at once
+typedef struct {
+    bloom_conn_info *conn;
+    int len;
+    char buf[LIST_CHUNK_SIZE];
+} list_chunk;
+
+// Sends the buffered lines of a listing
+static void flush_list_chunk(list_chunk *chunk) {
+    if (!chunk->len) return;
+    char *bufs[] = {chunk->buf};
+    int lens[] = {chunk->len};
+    send_client_response(chunk->conn, bufs, lens, 1);
+    chunk->len = 0;
+}
+
+// Appends a line to a listing, sending the chunk when full
+static void append_list_chunk(list_chunk *chunk, const char *fmt, ...) {
+    va_list args;
+    int len;
+    for (int retry=0; retry < 2; retry++) {
+        va_start(args, fmt);
+        len = vsnprintf(chunk->buf + chunk->len, LIST_CHUNK_SIZE - chunk->len, fmt, args);
+        va_end(args);
+        if (len < LIST_CHUNK_SIZE - chunk->len) {
+            chunk->len += len;
+            return;
+        }
+        flush_list_chunk(chunk);
+    }
+}
+
 // Callback invoked by list command to create an output
 // line for each filter. We hold a filter handle which we
 // can use to get some info about it
 static void list_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
-    char **out = data;
-    int res;
-    res = asprintf(out, "%s %f %llu %llu %llu\n",
+    append_list_chunk(data, "%s %f %llu %llu %llu\n",
             filter_name,
             filter->filter_config.default_probability,
             (unsigned long long)bloomf_byte_size(filter),
             (unsigned long long)bloomf_capacity(filter),
             (unsigned long long)bloomf_size(filter));
+}
+
+static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // Parse the prefix and options
+    char *prefix = NULL, *after = NULL;
+    int limit = 0;
+    char *param = args, *rest = args;
+    int rest_len = args_len;
+    while (param) {
+        // Adds a zero terminator to the current param, scans forward
+        buffer_after_terminator(rest, rest_len, ' ', &rest, &rest_len);
+
+        if (strncmp(param, "limit=", 6) == 0) {
+            if (sscanf(param + 6, "%d", &limit) != 1 || limit < 0) break;
+        } else if (strncmp(param, "after=", 6) == 0) {
+            after = param + 6;
+        } else if (param == args) {
+            prefix = param;
+        } else
+            break;
+        param = rest;
+    }
+    if (param) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    // Stream the filters between the START/END lines
+    list_chunk *chunk = arena_alloc(&LOCAL_ARENA, sizeof(list_chunk));
+    chunk->conn = handle->conn;
+    chunk->len = 0;
+    append_list_chunk(chunk, "%s", START_RESP);
+    filtmgr_iter_filters(handle->mgr, prefix, after, limit, list_filter_cb, chunk);
+    if (handle->cluster && !conn_peer(handle->conn)) {
+        flush_list_chunk(chunk);
+        list_remote_filters(handle, prefix, after, limit);
+    }
+    append_list_chunk(chunk, "%s", END_RESP);
+    flush_list_chunk(chunk);
+}
+
+
+/**
+ * Handles the scheck command, which checks one key in the
+ * sliced filters under a prefix. The filters that contain
+ * the key are listed between START/END lines.
+ */
+static void handle_scheck_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // Scan past the prefix, the key is the rest of the line
+    char *key;
+    int key_len;
+    if (split_filt_key(args, args_len, &key, &key_len)) {
+        handle_client_err(handle->conn, (char*)&PREFIX_KEY_NEEDED, PREFIX_KEY_NEEDED_LEN);
+        return;
+    }
+
+    bloom_filter_list_head *head;
+    int res = filtmgr_scheck_filters(handle->mgr, args, key, key_len - 1, &head);
+    handle->keys++;
+    if (res == -1) {
+        handle_client_resp(handle->conn, (char*)SLICE_NOT_EXIST, SLICE_NOT_EXIST_LEN);
+        return;
+    } else if (res) {
+        INTERNAL_ERROR();
+        return;
+    }
+
+    list_chunk *chunk = arena_alloc(&LOCAL_ARENA, sizeof(list_chunk));
+    chunk->conn = handle->conn;
+    chunk->len = 0;
+    append_list_chunk(chunk, "%s", START_RESP);
+    for (bloom_filter_list *node=head->head; node; node=node->next) {
+        append_list_chunk(chunk, "%s\n", node->filter_name);
+    }
+    append_list_chunk(chunk, "%s", END_RESP);
+    flush_list_chunk(chunk);
+    filtmgr_cleanup_list(head);
+}
+
+
+/**
+ * Lists the filters of the other nodes of the cluster, after
+ * the local ones. The lines between the START/END lines of each
+ * node are relayed. A node that fails is skipped, so a listing
+ * is never held up by a single node.
+ */
+static void list_remote_filters(bloom_conn_handler *handle, char *prefix, char *after, int limit) {
+    char req[MAX_FILTER_NAME * 2 + 64];
+    int req_len = snprintf(req, sizeof(req), "list%s%s%s%s",
+            (prefix) ? " " : "", (prefix) ? prefix : "",
+            (after) ? " after=" : "", (after) ? after : "");
+    if (limit) req_len += snprintf(req + req_len, sizeof(req) - req_len, " limit=%d", limit);
+    req_len += snprintf(req + req_len, sizeof(req) - req_len, "\n");
+    if (req_len >= (int)sizeof(req)) return;
+
+    char *resp;
+    int resp_len;
+    for (int node=0; node < cluster_num_nodes(handle->cluster); node++) {
+        if (node == cluster_self(handle->cluster)) continue;
+        int res = cluster_request(handle->cluster, node, req, req_len, 1, &resp, &resp_len);
+        if (res) {
+            syslog(LOG_WARNING, "Failed to list the filters of %s. Err: %d",
+                    cluster_node_name(handle->cluster, node), res);
+            continue;
+        }
+        if (resp_len > START_RESP_LEN + END_RESP_LEN && !memcmp(resp, START_RESP, START_RESP_LEN)) {
+            char *bufs[] = {resp + START_RESP_LEN};
+            int lens[] = {resp_len - START_RESP_LEN - END_RESP_LEN};
+            send_client_response(handle->conn, bufs, lens, 1);
+        }
+        free(resp);
+    }
+}
+
+
+// Callback invoked by list command to create an output
+// line for each filter. We hold a filter handle which we
+// can use to get some info about it
+static void info_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+
+    // Cast the intput
+    char **out = data;
+    char *layer_hits = out[0];
+    char *resident_bytes = out[1];
+    char *dirty_bytes = out[2];
+    out += 3;
+
+    // Get some metrics
+    filter_counters c, *counters = &c;
+    bloomf_counters(filter, counters);
+    uint64_t capacity = bloomf_capacity(filter);
+    uint64_t storage = bloomf_byte_size(filter);
+    uint64_t size = bloomf_size(filter);
+    uint64_t checks = counters->check_hits + counters->check_misses;
+    uint64_t sets = counters->set_hits + counters->set_misses;
+    uint64_t unsets = counters->unset_hits + counters->unset_misses;
+    bitmap_io_counters io;
+    bloomf_io(filter, &io);
+
+    // Cold filters have no latencies since they were unmapped
+    static latency_histogram no_latencies;
+    filter_hot_state *hot = bloomf_hot_state(filter);
+    latency_histogram *flush_lat = (hot) ? &hot->flush_latency : &no_latencies;
+    latency_histogram *page_in_lat = (hot) ? &hot->page_in_latency : &no_latencies;
+
+    // Generate a formatted string output
+    int res;
+    res = arena_printf(&LOCAL_ARENA, out, "capacity %llu\n\
+checks %llu\n\
+check_hits %llu\n\
+check_misses %llu\n\
+compactions %llu\n\
+counting %d\n\
+dirty_bytes %s\n\
+engine %s\n\
+flush_bytes %llu\n\
+flushes %llu\n\
+frozen %d\n\
+hashed %d\n\
+in_memory %d\n\
+latency_flush_p50_usec %llu\n\
+latency_flush_p99_usec %llu\n\
+latency_flush_p999_usec %llu\n\
+latency_page_in_p50_usec %llu\n\
+latency_page_in_p99_usec %llu\n\
+latency_page_in_p999_usec %llu\n\
+layer_hits %s\n\
+load_bytes %llu\n\
+load_total %llu\n\
+numa_node %d\n\
+optimize %s\n\
+page_in_bytes %llu\n\
+page_ins %llu\n\
+page_outs %llu\n\
+partitions %d\n\
+pin %d\n\
+probability %f\n\
+resident_bytes %s\n\
+scalable %d\n\
+sets %llu\n\
+set_hits %llu\n\
+set_misses %llu\n\
+size %llu\n\
+storage %llu\n\
+unsets %llu\n\
+unset_hits %llu\n\
+unset_misses %llu\n\
+window %d\n",
+    (unsigned long long)capacity, (unsigned long long)checks,
+    (unsigned long long)counters->check_hits, (unsigned long long)counters->check_misses,
+    (unsigned long long)counters->compactions, filter->filter_config.counting, dirty_bytes,
+    (filter->filter_config.engine == ENGINE_CUCKOO) ? "cuckoo" : "bloom",
+    (unsigned long long)io.bytes_written, (unsigned long long)counters->flushes,
+    filter->filter_config.frozen, filter->filter_config.hashed, ((bloomf_is_proxied(filter)) ? 0 : 1),
+    (unsigned long long)hist_percentile(flush_lat, 50),
+    (unsigned long long)hist_percentile(flush_lat, 99),
+    (unsigned long long)hist_percentile(flush_lat, 99.9),
+    (unsigned long long)hist_percentile(page_in_lat, 50),
+    (unsigned long long)hist_percentile(page_in_lat, 99),
+    (unsigned long long)hist_percentile(page_in_lat, 99.9),
+    layer_hits, (unsigned long long)__atomic_load_n(&filter->load_bytes, __ATOMIC_RELAXED),
+    (unsigned long long)__atomic_load_n(&filter->load_total, __ATOMIC_RELAXED), filter->numa_node,
+    optimize_name(filter->filter_config.optimize), (unsigned long long)io.bytes_read,
+    (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
+    filter->filter_config.partitions, filter->filter_config.pin,
+    filter->filter_config.default_probability, resident_bytes, filter->filter_config.scalable,
+    (unsigned long long)sets, (unsigned long long)counters->set_hits,
+    (unsigned long long)counters->set_misses, (unsigned long long)size, (unsigned long long)storage,
+    (unsigned long long)unsets, (unsigned long long)counters->unset_hits,
+    (unsigned long long)counters->unset_misses, filter->filter_config.window);
     assert(res != -1);
 }
 
-static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    (void)args_len;
-
+static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the filter name
+    char *key;
+    int key_len;
+    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (after == 0) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Create output buffers
+    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
+
+    // Format the hits of the layers, newest first
+    uint64_t hits[INFO_MAX_LAYERS];
+    int num_layers = filtmgr_layer_hits(handle->mgr, args, (uint64_t*)&hits, INFO_MAX_LAYERS);
+    char layer_hits[INFO_MAX_LAYERS * 21 + 2] = "0";
+    int offset = 0;
+    for (int i=0; i < num_layers; i++) {
+        offset += sprintf(layer_hits + offset, (i) ? ",%llu" : "%llu", (unsigned long long)hits[i]);
+    }
+
+    // Count the resident and dirty pages, a proxied filter has none
+    uint64_t resident = 0, dirty = 0;
+    filtmgr_memory_bytes(handle->mgr, args, &resident, &dirty);
+    char resident_bytes[21], dirty_bytes[21];
+    sprintf(resident_bytes, "%llu", (unsigned long long)resident);
+    sprintf(dirty_bytes, "%llu", (unsigned long long)dirty);
+
+    // Invoke the callback to get the filter stats
+    char *cb_data[] = {layer_hits, resident_bytes, dirty_bytes, NULL};
+    int res = filtmgr_filter_cb(handle->mgr, args, info_filter_cb, &cb_data);
+    output[1] = cb_data[3];
+
+    // Check for no filter
+    if (res != 0) {
+        switch (res) {
+            case -1:
+                handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+                break;
+            default:
+                INTERNAL_ERROR();
+                break;
+        }
+        return;
+    }
+
+    // Adjust the buffer size
+    lens[1] = strlen(output[1]);
+
+    // Write out the bufs
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+}
+
+
+/**
+ * Handles the estimate command, which replies with the
+ * estimated number of distinct keys in a filter.
+ */
+static void handle_estimate_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the filter name
+    char *key;
+    int key_len;
+    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (after == 0) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    uint64_t estimate;
+    int res = filtmgr_estimate_filter(handle->mgr, args, &estimate);
+    switch (res) {
+        case 0: {
+            char buf[24];
+            int len = sprintf(buf, "%llu\n", (unsigned long long)estimate);
+            handle_client_resp(handle->conn, buf, len);
+            break;
+        }
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+/**
+ * Handles the freeze command, which makes a filter read only.
+ */
+static void handle_freeze_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the filter name
+    char *key;
+    int key_len;
+    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (after == 0) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    int res = filtmgr_freeze_filter(handle->mgr, args);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_FREEZABLE, FILT_NOT_FREEZABLE_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+/**
+ * Handles the shrink command, which folds the sparse layers of a
+ * filter into half their size. A false positive probability for
+ * the filter to stay within may follow the filter name.
+ */
+static void handle_shrink_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    char *prob_arg;
+    int prob_len, consumed = 0;
+    double prob = 0;
+    if (buffer_after_terminator(args, args_len, ' ', &prob_arg, &prob_len) == 0) {
+        if (sscanf(prob_arg, "%lf%n", &prob, &consumed) != 1 || consumed != (int)strlen(prob_arg) ||
+                !(prob > 0 && prob < 1)) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+    }
+
+    int res = filtmgr_shrink_filter(handle->mgr, args, prob);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_SHRINKABLE, FILT_NOT_SHRINKABLE_LEN);
+            break;
+        case -5:
+            handle_client_resp(handle->conn, (char*)FILT_FROZEN, FILT_FROZEN_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+/**
+ * Handles the delta command, which exports the pages of a filter
+ * changed since an epoch, and replies with the epoch and the path
+ * of the delta.
+ */
+static void handle_delta_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // An epoch may follow the filter name
+    char *since_arg;
+    int since_len, consumed = 0;
+    unsigned long long since = 0;
+    if (buffer_after_terminator(args, args_len, ' ', &since_arg, &since_len) == 0) {
+        if (sscanf(since_arg, "%llu%n", &since, &consumed) != 1 || consumed != (int)strlen(since_arg)) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+    }
+
+    uint64_t epoch;
+    char *path;
+    int res = filtmgr_export_delta(handle->mgr, args, since, &epoch, &path);
+    switch (res) {
+        case 0: {
+            char *buf;
+            int len = arena_printf(&LOCAL_ARENA, &buf, "%llu %s\n", (unsigned long long)epoch, path);
+            handle_client_resp(handle->conn, buf, len);
+            free(path);
+            break;
+        }
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+/**
+ * Handles the load command, which sets the keys of a file
+ * on the server in a filter. The keys are set by lanes, as
+ * many as given after parallel, or a single one.
+ */
+static void handle_load_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // The path follows the filter name
+    char *path, *opts;
+    int path_len, opts_len;
+    if (buffer_after_terminator(args, args_len, ' ', &path, &path_len) || !*path) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    // Then the optional number of lanes
+    int lanes = 1, consumed = 0;
+    if (buffer_after_terminator(path, path_len, ' ', &opts, &opts_len) == 0) {
+        if (sscanf(opts, "parallel %d%n", &lanes, &consumed) != 1 ||
+                consumed != (int)strlen(opts) || lanes < 1 || lanes > LOAD_MAX_LANES) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+    }
+
+    int res = load_key_file(handle->mgr, handle->bulk, args, path, lanes);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        case -4:
+            handle_client_resp(handle->conn, (char*)FILT_FULL, FILT_FULL_LEN);
+            break;
+        case -5:
+            handle_client_resp(handle->conn, (char*)FILT_FROZEN, FILT_FROZEN_LEN);
+            break;
+        case -6:
+            handle_client_resp(handle->conn, (char*)LOAD_FAILED, LOAD_FAILED_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+/**
+ * Handles the dump command, which sends the layers of a filter as
+ * a full delta, after a line with the length of the delta.
+ */
+static void handle_dump_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    uint64_t epoch;
+    char *path;
+    int res = filtmgr_export_delta(handle->mgr, args, 0, &epoch, &path);
+    if (res == -1) {
+        handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+        return;
+    } else if (res) {
+        INTERNAL_ERROR();
+        return;
+    }
+
+    // The delta is only needed while it is sent
+    int fd = open(path, O_RDONLY);
+    unlink(path);
+    free(path);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st)) {
+        if (fd != -1) close(fd);
+        INTERNAL_ERROR();
+        return;
+    }
+
+    char *buf;
+    int len = arena_printf(&LOCAL_ARENA, &buf, "%llu\n", (unsigned long long)st.st_size);
+    handle_client_resp(handle->conn, buf, len);
+    send_client_file(handle->conn, fd, st.st_size);
+}
+
+
+/**
+ * Handles the restore command, which is followed by a dump of the
+ * given length. The dump is written aside as it is read, and the
+ * filter is created from it by the restored command once it is
+ * complete. The dump is dropped if the filter name is bad.
+ */
+static void handle_restore_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // The length of the dump follows the filter name
+    char *len_arg;
+    int len_len, consumed = 0;
+    unsigned long long len = 0;
+    if (buffer_after_terminator(args, args_len, ' ', &len_arg, &len_len) ||
+            sscanf(len_arg, "%llu%n", &len, &consumed) != 1 ||
+            consumed != (int)strlen(len_arg) || !len) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    if (regexec(&VALID_FILTER_NAMES_RE, args, 0, NULL, 0) != 0) {
+        receive_client_file(handle->conn, -1, "", len, -1, NULL, 0);
+        handle_client_err(handle->conn, (char*)&BAD_FILT_NAME, BAD_FILT_NAME_LEN);
+        return;
+    }
+
+    char *path = join_path(handle->config->data_dir, "restore.XXXXXX");
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to create '%s' to restore filter %s. %s", path, args, strerror(errno));
+        receive_client_file(handle->conn, -1, "", len, -1, NULL, 0);
+        INTERNAL_ERROR();
+        free(path);
+        return;
+    }
+
+    char *cmd;
+    int cmd_len = arena_printf(&LOCAL_ARENA, &cmd, "%s %s", args, path);
+    if (receive_client_file(handle->conn, fd, path, len, RESTORED, cmd, cmd_len)) {
+        unlink(path);
+        INTERNAL_ERROR();
+    }
+    free(path);
+}
+
+
+/**
+ * Handles the command left once the dump of a restore is received,
+ * with the filter name and the path of the dump. Creates the filter,
+ * and deletes the dump.
+ */
+static void handle_restored_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    char *path;
+    int path_len;
+    if (!args || buffer_after_terminator(args, args_len, ' ', &path, &path_len)) {
+        INTERNAL_ERROR();
+        return;
+    }
+
+    int res = filtmgr_restore_filter(handle->mgr, args, path);
+    unlink(path);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)EXISTS_RESP, EXISTS_RESP_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)DELETE_IN_PROGRESS, DELETE_IN_PROGRESS_LEN);
+            break;
+        case -4:
+            handle_client_resp(handle->conn, (char*)RESTORE_FAILED, RESTORE_FAILED_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+static void handle_stats_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args && strcmp(args, "hot") == 0) {
+        handle_stats_hot_cmd(handle);
+        return;
+    } else if (args && strcmp(args, "clients") == 0) {
+        handle_stats_clients_cmd(handle);
+        return;
+    } else if (args) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Read the counters of all the threads
+    bloom_stats stats;
+    stats_read(&stats);
+    int64_t *v = stats.values;
+
+    // Format the percentiles of the commands, in order of name
+    static const bloom_latency lat_order[] = {LAT_BULK, LAT_CHECK, LAT_CREATE, LAT_FLUSH, LAT_MULTI, LAT_SET};
+    static const char *lat_names[] = {"check", "multi", "set", "bulk", "create", "flush"};
+    char latencies[LAT_NUM * 3 * 64];
+    int offset = 0;
+    latency_histogram hist;
+    for (int i=0; i < LAT_NUM; i++) {
+        stats_read_latency(lat_order[i], &hist);
+        offset += sprintf(latencies + offset,
+                "latency_%s_p50_usec %llu\nlatency_%s_p99_usec %llu\nlatency_%s_p999_usec %llu\n",
+                lat_names[lat_order[i]], (unsigned long long)hist_percentile(&hist, 50),
+                lat_names[lat_order[i]], (unsigned long long)hist_percentile(&hist, 99),
+                lat_names[lat_order[i]], (unsigned long long)hist_percentile(&hist, 99.9));
+    }
+
+    // Generate a formatted string output
+    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
+    int res = arena_printf(&LOCAL_ARENA, output+1, "buffer_bytes %lld\n\
+checks %lld\n\
+checks_per_sec %f\n\
+connections %lld\n\
+filters %lld\n\
+flush_bytes %lld\n\
+%s\
+lock_spins %lld\n\
+lock_waits %lld\n\
+mapped_bytes %lld\n\
+mapped_filters %lld\n\
+packed_bytes %lld\n\
+page_in_bytes %lld\n\
+page_ins %lld\n\
+page_outs %lld\n\
+positive_hits %lld\n\
+proxied_filters %lld\n\
+rejected_connections %lld\n\
+sets %lld\n\
+sets_per_sec %f\n\
+timeouts %lld\n\
+udp_datagrams %lld\n\
+udp_drops %lld\n\
+udp_rejects %lld\n\
+version_backlog %llu\n",
+    (long long)v[STAT_BUFFER_BYTES],
+    (long long)v[STAT_CHECKS], stats.checks_per_sec, (long long)v[STAT_CONNECTIONS],
+    (long long)v[STAT_FILTERS], (long long)v[STAT_FLUSH_BYTES], latencies,
+    (long long)v[STAT_LOCK_SPINS], (long long)v[STAT_LOCK_WAITS],
+    (long long)v[STAT_MAPPED_BYTES], (long long)v[STAT_MAPPED_FILTERS], (long long)v[STAT_PACKED_BYTES],
+    (long long)v[STAT_PAGE_IN_BYTES], (long long)v[STAT_PAGE_INS], (long long)v[STAT_PAGE_OUTS],
+    (long long)v[STAT_POSITIVE_HITS], (long long)(v[STAT_FILTERS] - v[STAT_MAPPED_FILTERS]),
+    (long long)v[STAT_CONN_REJECTS],
+    (long long)v[STAT_SETS], stats.sets_per_sec, (long long)v[STAT_TIMEOUTS],
+    (long long)v[STAT_UDP_DATAGRAMS],
+    (long long)v[STAT_UDP_DROPS], (long long)v[STAT_UDP_REJECTS], filtmgr_version_backlog(handle->mgr));
+    assert(res != -1);
+    lens[1] = res;
+
+    // Write out the bufs
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+}
+
+/**
+ * Handles the slowlog command, which is one of "slowlog get [count]",
+ * "slowlog len" or "slowlog reset". Get returns the newest slow
+ * commands of all the workers, 10 unless a count is given.
+ */
+static void handle_slowlog_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    char *rest;
+    int rest_len, count = 10;
+    buffer_after_terminator(args, args_len, ' ', &rest, &rest_len);
+
+    if (strcmp(args, "reset") == 0 && !rest) {
+        slowlog_reset();
+        handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+        return;
+    } else if (strcmp(args, "len") == 0 && !rest) {
+        char out[24];
+        int len = snprintf(out, sizeof(out), "%d\n", slowlog_len());
+        handle_client_resp(handle->conn, out, len);
+        return;
+    } else if (strcmp(args, "get") != 0 || (rest && (sscanf(rest, "%d", &count) != 1 || count < 0))) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    // One line per command: id, time, usec, command, filter, keys, events
+    bloom_slowlog_entry *entries = arena_alloc(&LOCAL_ARENA, (count + 1) * sizeof(bloom_slowlog_entry));
+    int num = slowlog_read(entries, count);
+    char *output = arena_alloc(&LOCAL_ARENA, START_RESP_LEN + num * (SLOWLOG_NAME + 128) + END_RESP_LEN + 1);
+    int offset = sprintf(output, "%s", START_RESP);
+    for (int i=0; i < num; i++) {
+        bloom_slowlog_entry *e = entries + i;
+        offset += sprintf(output + offset, "%llu %llu %llu %s %s %u %s\n",
+                (unsigned long long)e->id, (unsigned long long)e->time,
+                (unsigned long long)e->usec, e->command, (e->filter[0]) ? e->filter : "-",
+                e->keys, (e->events == (SLOWLOG_PAGE_IN | SLOWLOG_GROWTH)) ? "page_in,growth" :
+                (e->events == SLOWLOG_PAGE_IN) ? "page_in" :
+                (e->events == SLOWLOG_GROWTH) ? "growth" : "-");
+    }
+    offset += sprintf(output + offset, "%s", END_RESP);
+    handle_client_resp(handle->conn, output, offset);
+}
+
+/**
+ * Handles the "stats hot" command, which returns the filters
+ * and keys used the most, as sampled. A line is either
+ * "filter name count error" or "key filter hash count error",
+ * with the counts scaled up by the sampling.
+ */
+static void handle_stats_hot_cmd(bloom_conn_handler *handle) {
+    bloom_hot_entry filters[HOT_TOP], keys[HOT_TOP];
+    int num_filters = HOT_TOP, num_keys = HOT_TOP;
+    hot_read(filters, &num_filters, keys, &num_keys);
+
+    uint64_t every = (handle->config->hot_sample) ? handle->config->hot_sample : 1;
+    char *output = arena_alloc(&LOCAL_ARENA, START_RESP_LEN + HOT_TOP * 2 * (HOT_NAME + 96) + END_RESP_LEN + 1);
+    int offset = sprintf(output, "%s", START_RESP);
+    for (int i=0; i < num_filters; i++) {
+        offset += sprintf(output + offset, "filter %s %llu %llu\n", filters[i].filter,
+                (unsigned long long)(filters[i].count * every),
+                (unsigned long long)(filters[i].error * every));
+    }
+    for (int i=0; i < num_keys; i++) {
+        offset += sprintf(output + offset, "key %s %016llx %llu %llu\n", keys[i].filter,
+                (unsigned long long)keys[i].key_hash,
+                (unsigned long long)(keys[i].count * every),
+                (unsigned long long)(keys[i].error * every));
+    }
+    offset += sprintf(output + offset, "%s", END_RESP);
+    handle_client_resp(handle->conn, output, offset);
+}
+
+/**
+ * Handles the stats clients command, which lists the usage of
+ * the clients by name, the clients that took the most time first.
+ */
+static void handle_stats_clients_cmd(bloom_conn_handler *handle) {
+    bloom_client_entry *clients = arena_alloc(&LOCAL_ARENA, CLIENTS_TOP * sizeof(bloom_client_entry));
+    int num = CLIENTS_TOP;
+    clients_read(clients, &num);
+
+    char *output = arena_alloc(&LOCAL_ARENA, START_RESP_LEN + num * (CLIENT_NAME + 160) + END_RESP_LEN + 1);
+    int offset = sprintf(output, "%s", START_RESP);
+    bloom_client_usage *u;
+    for (int i=0; i < num; i++) {
+        u = &clients[i].usage;
+        offset += sprintf(output + offset, "client %s %lld %llu %llu %llu %llu %llu\n", clients[i].name,
+                (long long)u->connections, (unsigned long long)u->commands, (unsigned long long)u->keys,
+                (unsigned long long)u->bytes_in, (unsigned long long)u->bytes_out,
+                (unsigned long long)clients[i].cpu_usec);
+    }
+    offset += sprintf(output + offset, "%s", END_RESP);
+    handle_client_resp(handle->conn, output, offset);
+}
+
+/**
+ * Counts the filter and keys of a sampled command, before it
+ * runs. Only the first HOT_MAX_KEYS keys of a multi or bulk
+ * command are counted, so a large one stays cheap.
+ */
+static void sample_hot_command(conn_cmd_type type, char *args, int args_len) {
+    switch (type) {
+        case CHECK:
+        case SET:
+        case UNSET:
+        case CHECK_MULTI:
+        case SET_MULTI:
+        case HCHECK:
+        case HSET:
+        case SET_NEW:
+        case CHECK_HEX:
+        case SET_HEX:
+        case UNSET_MULTI:
+            break;
+        default:
+            return;
+    }
+    if (!args) return;
+
+    // Split on spaces, without terminating the tokens
+    char *keys[HOT_MAX_KEYS];
+    int lens[HOT_MAX_KEYS], num_keys = 0;
+    char *space = memchr(args, ' ', args_len);
+    char *end = args + args_len;
+    while (space && num_keys < HOT_MAX_KEYS) {
+        char *key = space + 1;
+        space = memchr(key, ' ', end - key);
+        int len = ((space) ? space : end) - key;
+        if (len > 0 && key[len-1] == '\0') len--;
+        if (len <= 0) continue;
+        keys[num_keys] = key;
+        lens[num_keys++] = len;
+    }
+    hot_count(args, args_len, keys, lens, num_keys);
+}
+
+/**
+ * Handles the workers command. Without arguments it returns the
+ * active workers and the most that can be active, as "4 16". With
+ * a count it changes the active workers, and returns "Done".
+ */
+static void handle_workers_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (!args) {
+        int max;
+        int active = conn_active_workers(handle->conn, &max);
+        char out[32];
+        int len = snprintf(out, sizeof(out), "%d %d\n", active, max);
+        handle_client_resp(handle->conn, out, len);
+        return;
+    }
+
+    char *end;
+    long workers = strtol(args, &end, 10);
+    if (*end || end == args || workers > INT_MAX || conn_set_active_workers(handle->conn, workers)) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
+
+/**
+ * Handles the config command. With no arguments it returns the
+ * settings that can be changed while running, one "name value"
+ * line each, and "config set name value" changes one of them.
+ */
+static void handle_config_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (!args) {
+        char *tunables = config_tunables(handle->config);
+        char *output[] = {(char*)&START_RESP, tunables, (char*)&END_RESP};
+        int lens[] = {START_RESP_LEN, strlen(tunables), END_RESP_LEN};
+        send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+        free(tunables);
+        return;
+    }
+
+    // Split out the name and the value
+    char *name, *value;
+    int name_len, value_len;
+    buffer_after_terminator(args, args_len, ' ', &name, &name_len);
+    if (strcmp(args, "set") != 0 || !name ||
+            buffer_after_terminator(name, name_len, ' ', &value, &value_len) ||
+            config_set(handle->config, name, value)) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
+
+/**
+ * Logs a slow command. The arguments are read after the command
+ * ran, so a space or NUL written by the handler ends a token.
+ * @arg num_cmds The commands of a run of checks or sets
+ */
+static void log_slow_command(conn_cmd_type type, char *args, int args_len, int num_cmds, uint64_t usec) {
+    // The commands that do not start with a filter name
+    switch (type) {
+        case UNKNOWN:
+        case LIST:
+        case STATS:
+        case BINARY:
+        case NOREPLY:
+        case DEADLINE:
+        case MCHECK:
+        case SLICE:
+        case SCHECK:
+        case UNSLICE:
+        case PEER:
+        case HELLO:
+        case SHM:
+        case SLOWLOG:
+        case WORKERS:
+        case CONFIG:
+            args = NULL;
+            break;
+        default:
+            break;
+    }
+
+    // Count the keys after the filter name
+    uint32_t keys = 0;
+    switch (type) {
+        case CHECK:
+        case SET:
+        case UNSET:
+            keys = num_cmds;
+            break;
+        case CHECK_MULTI:
+        case SET_MULTI:
+        case HCHECK:
+        case HSET:
+        case SET_NEW:
+        case CHECK_HEX:
+        case SET_HEX:
+        case UNSET_MULTI:
+            for (int i=0; args && i < args_len; i++) {
+                if ((args[i] == ' ' || args[i] == '\0') && i + 1 < args_len &&
+                        args[i+1] != ' ' && args[i+1] != '\0') keys++;
+            }
+            break;
+        default:
+            break;
+    }
+    slowlog_record(CMD_NAMES[type], args, (args) ? args_len : 0, keys, usec);
+}
+
+// Checks if the arguments of a flush wait for a flush of all the
+// filters, the name of a filter is never just "wait"
+static int is_flush_wait(char *args) {
+    return !strncmp(args, FLUSH_WAIT, FLUSH_WAIT_LEN) &&
+        (args[FLUSH_WAIT_LEN] == '\0' || args[FLUSH_WAIT_LEN] == ' ');
+}
+
+/**
+ * Handles the flush command. A flush of all the filters is
+ * requested from the flush thread, and replies with its ticket
+ * without waiting. A flush wait parks the connection until a
+ * new flush, or the flush of a given ticket, completes.
+ * @return 1 if the connection was parked, 0 otherwise.
+ */
+static int handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have a specfic filter, use filt_cmd
+    if (args && !is_flush_wait(args)) {
+        handle_filt_cmd(handle, args, args_len, filtmgr_flush_filter);
+        return 0;
+    }
+
+    // Wait for a given ticket, or request a new flush
+    uint64_t ticket = 0;
+    if (args && args[FLUSH_WAIT_LEN] == ' ') {
+        unsigned long long arg;
+        int consumed = 0;
+        char *ticket_arg = args + FLUSH_WAIT_LEN + 1;
+        if (sscanf(ticket_arg, "%llu%n", &arg, &consumed) != 1 || consumed != (int)strlen(ticket_arg)) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return 0;
+        }
+        ticket = arg;
+    } else if (filtmgr_request_flush(handle->mgr, &ticket)) {
+        // Without a flush thread, flush all the filters now
+        flush_all_filters(handle);
+        return 0;
+    }
+
+    // Reply with the ticket, without waiting
+    if (!args) {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "Queued %llu\n", (unsigned long long)ticket);
+        handle_client_resp(handle->conn, buf, len);
+        return 0;
+    }
+
+    switch (park_client_flush(handle->conn, handle->mgr, ticket, FLUSH, args, args_len)) {
+        case 0:
+            return 1;
+        case 1:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            return 0;
+        default:
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return 0;
+    }
+}
+
+/**
+ * Flushes all the filters on the worker, when there is
+ * no flush thread to hand them to
+ */
+static void flush_all_filters(bloom_conn_handler *handle) {
     // List all the filters
     bloom_filter_list_head *head;
-    int res = filtmgr_list_filters(handle->mgr, args, &head);
+    int res = filtmgr_list_filters(handle->mgr, NULL, &head);
     if (res != 0) {
         INTERNAL_ERROR();
         return;
     }
 
-    // Allocate buffers for the responses
-    int num_out = (head->size+2);
-    char** output_bufs = malloc(num_out * sizeof(char*));
-    int* output_bufs_len = malloc(num_out * sizeof(int));
-
-    // Setup the START/END lines
-    output_bufs[0] = (char*)&START_RESP;
-    output_bufs_len[0] = START_RESP_LEN;
-    output_bufs[head->size+1] = (char*)&END_RESP;
-    output_bufs_len[head->size+1] = END_RESP_LEN;
-
-    // Generate the responses
-    char *resp;
+    // Flush all, ignore errors since
+    // filters might get deleted in the process
     bloom_filter_list *node = head->head;
-    for (int i=0; i < head->size; i++) {
-        res = filtmgr_filter_cb(handle->mgr, node->filter_name, list_filter_cb, &resp);
-        if (res == 0) {
-            output_bufs[i+1] = resp;
-            output_bufs_len[i+1] = strlen(resp);
-        } else { // Skip this output
-            output_bufs[i+1] = NULL;
-            output_bufs_len[i+1] = 0;
-        }
+    while (node) {
+        filtmgr_flush_filter(handle->mgr, node->filter_name);
         node = node->next;
     }
 
-    // Write the response
-    send_client_response(handle->conn, output_bufs, output_bufs_len, num_out);
+    // Respond
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
 
     // Cleanup
-    for (int i=1; i <= head->size; i++) if(output_bufs[i]) free(output_bufs[i]);
-    free(output_bufs);
-    free(output_bufs_len);
     filtmgr_cleanup_list(head);
 }
 
 
-// Callback invoked by list command to create an output
-// line for each filter. We hold a filter handle which we
-// can use to get some info about it
-static void info_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
-    (void)filter_name;
-
-    // Cast the intput
-    char **out = data;
-
-    // Get some metrics
-    filter_counters *counters = bloomf_counters(filter);
-    uint64_t capacity = bloomf_capacity(filter);
-    uint64_t storage = bloomf_byte_size(filter);
-    uint64_t size = bloomf_size(filter);
-    uint64_t checks = counters->check_hits + counters->check_misses;
-    uint64_t sets = counters->set_hits + counters->set_misses;
+/**
+ * Internal command used to switch a connection to the
+ * binary protocol. All later input is binary.
+ */
+static void handle_binary_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+    set_conn_binary_protocol(handle->conn);
+}
 
-    // Generate a formatted string output
-    int res;
-    res = asprintf(out, "capacity %llu\n\
-checks %llu\n\
-check_hits %llu\n\
-check_misses %llu\n\
-in_memory %d\n\
-page_ins %llu\n\
-page_outs %llu\n\
-probability %f\n\
-sets %llu\n\
-set_hits %llu\n\
-set_misses %llu\n\
-size %llu\n\
-storage %llu\n",
-    (unsigned long long)capacity, (unsigned long long)checks,
-    (unsigned long long)counters->check_hits, (unsigned long long)counters->check_misses,
-    ((bloomf_is_proxied(filter)) ? 0 : 1),
-    (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
-    filter->filter_config.default_probability,
-    (unsigned long long)sets, (unsigned long long)counters->set_hits,
-    (unsigned long long)counters->set_misses, (unsigned long long)size, (unsigned long long)storage);
-    assert(res != -1);
+static void handle_noreply_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args && strcmp(args, "on") == 0) {
+        set_conn_noreply(handle->conn, 1);
+    } else if (args && strcmp(args, "off") == 0) {
+        set_conn_noreply(handle->conn, 0);
+    } else {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
 }
 
-static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    // If we have no args, complain.
-    if (!args) {
-        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+/**
+ * Handles the deadline command, which takes the milliseconds a
+ * command on keys may wait before it is answered with Timeout
+ * instead of run, or 0 to wait without a limit.
+ */
+static void handle_deadline_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    int msec, consumed = 0;
+    if (!args || sscanf(args, "%d%n", &msec, &consumed) != 1 ||
+            consumed != (int)strlen(args) || msec < 0) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
         return;
     }
+    set_conn_deadline(handle->conn, msec);
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
 
-    // Scan past the filter name
-    char *key;
-    int key_len;
-    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
-    if (after == 0) {
+static void handle_peer_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
         handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
         return;
     }
+    set_conn_peer(handle->conn);
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
 
-    // Create output buffers
-    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
-    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
-
-    // Invoke the callback to get the filter stats
-    int res = filtmgr_filter_cb(handle->mgr, args, info_filter_cb, &output[1]);
+/**
+ * Handles the hello command, which names the client the
+ * usage of the connection is counted under, see stats clients.
+ */
+static void handle_hello_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (!args || strlen(args) > CLIENT_NAME || regexec(&VALID_FILTER_NAMES_RE, args, 0, NULL, 0)) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    set_conn_client_name(handle->conn, args);
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
 
-    // Check for no filter
-    if (res != 0) {
-        switch (res) {
-            case -1:
-                handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
-                break;
-            default:
-                INTERNAL_ERROR();
-                break;
-        }
+/**
+ * Moves a client on the Unix socket to shared memory rings, of
+ * the size given in bytes or SHM_RING_DEFAULT. The reply passing
+ * the rings is sent by the networking layer.
+ */
+static void handle_shm_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    unsigned long size = SHM_RING_DEFAULT;
+    int consumed = 0;
+    if (args && (sscanf(args, "%lu%n", &size, &consumed) != 1 ||
+            consumed != (int)strlen(args))) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    if (size < SHM_RING_MIN || size > SHM_RING_MAX || (size & (size - 1))) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
         return;
     }
 
-    // Adjust the buffer size
-    lens[1] = strlen(output[1]);
+    switch (start_client_shm(handle->conn, size)) {
+        case 0:
+            break;
+        case -1:
+            handle_client_err(handle->conn, (char*)&SHM_NEEDS_LOCAL, SHM_NEEDS_LOCAL_LEN);
+            break;
+        case -2:
+            handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
 
-    // Write out the bufs
-    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
-    free(output[1]);
+
+/**
+ * Handles the complete binary requests of a connection, up
+ * to the budget of the handle. Requests are parsed in place
+ * in the input buffer.
+ * @return 0 on success, 1 if the connection should be closed.
+ */
+static int handle_binary_requests(bloom_conn_handler *handle) {
+    bloom_binary_request req;
+    uint32_t body_len;
+    char *buf;
+    int avail;
+    while (handle->budget > 0 && (avail = peek_input(handle->conn, &buf)) >= (int)sizeof(req)) {
+        // The input is not aligned, copy the header out
+        memcpy(&req, buf, sizeof(req));
+        body_len = ntohl(req.body_len);
+
+        // A bad header cannot be skipped, so give up on the connection
+        if (req.magic != BIN_REQUEST_MAGIC || body_len > BIN_MAX_BODY) {
+            handle_binary_response(handle, BIN_BAD_REQUEST, NULL, 0);
+            return 1;
+        }
+
+        // Wait for the rest of the request
+        if ((uint64_t)avail < sizeof(req) + body_len) break;
+        if (conn_expired(handle->conn)) {
+            stats_add(STAT_TIMEOUTS, 1);
+            handle_binary_response(handle, BIN_TIMEOUT, NULL, 0);
+        } else {
+            handle_binary_request(handle, &req, buf + sizeof(req), body_len);
+        }
+        consume_input(handle->conn, sizeof(req) + body_len);
+        handle->budget--;
+    }
+    return 0;
 }
 
 
-static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    // If we have a specfic filter, use filt_cmd
-    if (args) {
-        handle_filt_cmd(handle, args, args_len, filtmgr_flush_filter);
+/**
+ * Handles a single complete binary request.
+ * @arg handle The conn handle
+ * @arg req The request header, in network byte order
+ * @arg body The request body
+ * @arg body_len The length of the body
+ */
+static void handle_binary_request(bloom_conn_handler *handle, bloom_binary_request *req, char *body, uint32_t body_len) {
+    uint16_t name_len = ntohs(req->name_len);
+    uint32_t num_keys = ntohl(req->num_keys);
+
+    // Determine the operation
+    int(*filtmgr_func)(bloom_filtmgr *, bloom_filtmgr_cache *, char*, char **, uint64_t *, int, char*);
+    switch (req->op) {
+        case BIN_CHECK:
+            filtmgr_func = filtmgr_check_keys_len;
+            break;
+        case BIN_SET:
+            filtmgr_func = filtmgr_set_keys_len;
+            break;
+        case BIN_UNSET:
+            filtmgr_func = filtmgr_unset_keys_len;
+            break;
+        default:
+            handle_binary_response(handle, BIN_BAD_REQUEST, NULL, 0);
+            return;
+    }
+
+    // Since every key has a length prefix, this also bounds the results
+    if (name_len > MAX_FILTER_NAME || name_len > body_len ||
+            num_keys > (body_len - name_len) / sizeof(uint16_t)) {
+        handle_binary_response(handle, BIN_BAD_REQUEST, NULL, 0);
         return;
     }
 
-    // List all the filters
-    bloom_filter_list_head *head;
-    int res = filtmgr_list_filters(handle->mgr, NULL, &head);
-    if (res != 0) {
-        INTERNAL_ERROR();
+    // Validate the key lengths before any key is used
+    char *end = body + body_len;
+    char *pos = body + name_len;
+    uint16_t key_len;
+    for (uint32_t i=0; i < num_keys; i++) {
+        if (end - pos < (int)sizeof(key_len)) break;
+        memcpy(&key_len, pos, sizeof(key_len));
+        pos += sizeof(key_len) + ntohs(key_len);
+        if (pos > end) break;
+    }
+    if (pos != end) {
+        handle_binary_response(handle, BIN_BAD_REQUEST, NULL, 0);
         return;
     }
 
-    // Flush all, ignore errors since
-    // filters might get deleted in the process
-    bloom_filter_list *node = head->head;
-    while (node) {
-        filtmgr_flush_filter(handle->mgr, node->filter_name);
-        node = node->next;
+    // Without a name, use the filter of the last request. The filter
+    // manager needs a terminated name, so reuse the cached name if
+    // it matches, and copy it otherwise.
+    bloom_filtmgr_cache *cache = conn_filter_cache(handle->conn);
+    char name_buf[MAX_FILTER_NAME + 1];
+    char *filter_name = cache->name;
+    if (name_len == 0) {
+        if (cache->name[0] == '\0') {
+            handle_binary_response(handle, BIN_BAD_REQUEST, NULL, 0);
+            return;
+        }
+    } else if (memcmp(cache->name, body, name_len) != 0 || cache->name[name_len] != '\0') {
+        memcpy(name_buf, body, name_len);
+        name_buf[name_len] = '\0';
+        filter_name = name_buf;
     }
 
-    // Respond
-    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+    // Setup the results bitset
+    char stack_results[BIN_STACK_RESULTS];
+    uint32_t results_len = (num_keys + 7) / 8;
+    char *results = (results_len <= BIN_STACK_RESULTS) ? stack_results : arena_alloc(&LOCAL_ARENA, results_len);
+    memset(results, 0, results_len);
 
-    // Cleanup
-    filtmgr_cleanup_list(head);
+    // Handle the keys in batches, so locks are not held too long
+    char *key_buf[MULTI_OP_SIZE];
+    uint64_t len_buf[MULTI_OP_SIZE];
+    char result_buf[MULTI_OP_SIZE];
+    int status = BIN_OK, index = 0, res;
+    uint32_t done = 0;
+    pos = body + name_len;
+    for (uint32_t i=0; i < num_keys; i++) {
+        memcpy(&key_len, pos, sizeof(key_len));
+        key_buf[index] = pos + sizeof(key_len);
+        len_buf[index] = ntohs(key_len);
+        pos += sizeof(key_len) + len_buf[index];
+        index++;
+        if (index < MULTI_OP_SIZE && i + 1 < num_keys) continue;
+
+        res = filtmgr_func(handle->mgr, cache, filter_name, key_buf, len_buf, index, result_buf);
+        handle->keys += index;
+        if (res != 0) {
+            switch (res) {
+                case -1:
+                    status = BIN_FILT_NOT_EXIST;
+                    break;
+                case -3:
+                    status = BIN_NOT_SUPPORTED;
+                    break;
+                case -4:
+                    status = BIN_FILT_FULL;
+                    break;
+                case -5:
+                    status = BIN_FILT_FROZEN;
+                    break;
+                case -6:
+                    status = BIN_BAD_REQUEST;
+                    break;
+                default:
+                    status = BIN_INTERNAL_ERR;
+                    break;
+            }
+            break;
+        }
+        for (int j=0; j < index; j++, done++) {
+            if (result_buf[j]) results[done / 8] |= 1 << (done % 8);
+        }
+        index = 0;
+    }
+
+    // Respond, errors have no results
+    if (status == BIN_OK)
+        handle_binary_response(handle, status, results, num_keys);
+    else
+        handle_binary_response(handle, status, NULL, 0);
+}
+
+
+/**
+ * Sends a binary response.
+ * @arg handle The conn handle
+ * @arg status The status of the response
+ * @arg results The results bitset, or NULL
+ * @arg num_keys The number of results in the bitset
+ */
+static void handle_binary_response(bloom_conn_handler *handle, int status, char *results, uint32_t num_keys) {
+    bloom_binary_response resp = {BIN_RESPONSE_MAGIC, status, 0, htonl(num_keys)};
+    char *buffers[] = {(char*)&resp, results};
+    int sizes[] = {sizeof(resp), (num_keys + 7) / 8};
+    send_client_response(handle->conn, (char**)&buffers, (int*)&sizes, (num_keys) ? 2 : 1);
 }
 
 
@@ -565,20 +3091,32 @@ static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_le
  * @arg handle The conn handle
  * @arg cmd_res The result of the command
  * @arg num_keys The number of keys in the result buffer. This should NOT be
- * more than MULTI_OP_SIZE.
+ * more than MULTI_OP_MAX.
  * @arg res_buf The result buffer
  * @arg end_of_input Should the last result include a new line
  * @return 0 on success, 1 if we should stop.
  */
 static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int num_keys, char *res_buf, int end_of_input) {
     // Do nothing if we get too many keys
-    if (num_keys > MULTI_OP_SIZE || num_keys <= 0) return 1;
+    if (num_keys > MULTI_OP_MAX || num_keys <= 0) return 1;
 
     if (cmd_res != 0) {
         switch (cmd_res) {
             case -1:
                 handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
                 break;
+            case -3:
+                handle_client_resp(handle->conn, (char*)FILT_NOT_COUNTING, FILT_NOT_COUNTING_LEN);
+                break;
+            case -4:
+                handle_client_resp(handle->conn, (char*)FILT_FULL, FILT_FULL_LEN);
+                break;
+            case -5:
+                handle_client_resp(handle->conn, (char*)FILT_FROZEN, FILT_FROZEN_LEN);
+                break;
+            case -6:
+                handle_client_resp(handle->conn, (char*)BAD_KEY_HASH, BAD_KEY_HASH_LEN);
+                break;
             default:
                 INTERNAL_ERROR();
                 break;
@@ -586,22 +3124,18 @@ static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int nu
         return 1;
     }
 
-    // Allocate buffers for our response, plus a newline
-    char *resp_bufs[MULTI_OP_SIZE];
-    int resp_buf_lens[MULTI_OP_SIZE];
-
-    // Set the response buffers according to the results
-    int last_key = 1;
+    // Encode the responses into one buffer, "Yes " is the longest
+    char resp_buf[MULTI_OP_MAX * YES_SPACE_LEN];
+    int resp_len = 0;
     for (int i=0; i < num_keys; i++) {
-        last_key = end_of_input && (i == (num_keys - 1));
         switch (res_buf[i]) {
             case 0:
-                resp_bufs[i] = (char*)((last_key) ? NO_RESP : NO_SPACE);
-                resp_buf_lens[i] = (last_key) ? NO_RESP_LEN: NO_SPACE_LEN;
+                memcpy(resp_buf + resp_len, NO_SPACE, NO_SPACE_LEN);
+                resp_len += NO_SPACE_LEN;
                 break;
             case 1:
-                resp_bufs[i] = (char*)((last_key) ? YES_RESP : YES_SPACE);
-                resp_buf_lens[i] = (last_key) ? YES_RESP_LEN: YES_SPACE_LEN;
+                memcpy(resp_buf + resp_len, YES_SPACE, YES_SPACE_LEN);
+                resp_len += YES_SPACE_LEN;
                 break;
             default:
                 INTERNAL_ERROR();
@@ -609,11 +3143,66 @@ static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int nu
         }
     }
 
+    // The last key ends the line instead of the space
+    if (end_of_input) resp_buf[resp_len - 1] = '\n';
+
     // Write out!
-    send_client_response(handle->conn, (char**)&resp_bufs, (int*)&resp_buf_lens, num_keys);
+    handle_client_resp(handle->conn, resp_buf, resp_len);
     return 0;
 }
 
+/**
+ * Sends the indices of the keys of a chunk that were newly
+ * set, space separated. Keys already present are left out,
+ * so the reply scales with the new keys.
+ * @arg num_keys The number of keys in the chunk
+ * @arg res_buf The results of the chunk
+ * @arg offset The index of the first key of the chunk
+ * @arg num_new The new keys sent so far, updated
+ * @arg end_of_input Is this the last chunk, which ends the line
+ */
+static void handle_new_keys_response(bloom_conn_handler *handle, int num_keys, char *res_buf, int offset, int *num_new, int end_of_input) {
+    // Each index takes at most 10 digits and a space
+    char resp_buf[MULTI_OP_MAX * 11 + 1];
+    int resp_len = 0;
+    for (int i=0; i < num_keys; i++) {
+        if (res_buf[i] != 1) continue;
+        if ((*num_new)++) resp_buf[resp_len++] = ' ';
+        resp_len += sprintf(resp_buf + resp_len, "%d", offset + i);
+    }
+    if (end_of_input) resp_buf[resp_len++] = '\n';
+    if (resp_len) handle_client_resp(handle->conn, resp_buf, resp_len);
+}
+
+/**
+ * Sends the results of a chunk as a bitset in hex digits. The
+ * first key is the highest bit of the first digit, so each digit
+ * holds 4 keys. Bits that do not fill a digit are kept for the
+ * next chunk, and the last digit is padded with zeros.
+ * @arg num_keys The number of keys in the chunk
+ * @arg res_buf The results of the chunk
+ * @arg hex The bits not yet sent, updated
+ * @arg end_of_input Is this the last chunk, which ends the line
+ */
+static void handle_hex_response(bloom_conn_handler *handle, int num_keys, char *res_buf, hex_reply *hex, int end_of_input) {
+    static const char DIGITS[] = "0123456789abcdef";
+    char resp_buf[MULTI_OP_MAX / 4 + 2];
+    int resp_len = 0;
+    for (int i=0; i < num_keys; i++) {
+        hex->digit = (hex->digit << 1) | (res_buf[i] == 1);
+        if (++hex->bits == 4) {
+            resp_buf[resp_len++] = DIGITS[hex->digit];
+            hex->digit = hex->bits = 0;
+        }
+    }
+    if (end_of_input) {
+        if (hex->bits) resp_buf[resp_len++] = DIGITS[hex->digit << (4 - hex->bits)];
+        resp_buf[resp_len++] = '\n';
+    }
+    if (resp_len) handle_client_resp(handle->conn, resp_buf, resp_len);
+}
+
+
 
 /**
  * Sends a client response message back. Simple convenience wrapper
@@ -640,6 +3229,10 @@ static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len)
 
 /**
  * Determines the client command.
+ * The command is matched on its length and first byte,
+ * so a line is compared against at most a few names, and
+ * the one letter forms that make up most of the traffic
+ * are decided by a single switch.
  * @arg cmd_buf A command buffer
  * @arg buf_len The length of the buffer
  * @arg arg_buf Output. Sets the start address of the command arguments.
@@ -649,44 +3242,266 @@ static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len)
  */
 static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len) {
     // Check if we are ending with \r, and remove it.
-    if (cmd_buf[buf_len-2] == '\r') {
+    if (buf_len > 1 && cmd_buf[buf_len-2] == '\r') {
         cmd_buf[buf_len-2] = '\0';
         buf_len -= 1;
     }
 
+    // A tagged command is left whole, split_command_tag splits it
+    if (cmd_buf[0] == '#') {
+        *arg_buf = cmd_buf;
+        *arg_len = buf_len;
+        return TAGGED;
+    }
+
     // Scan for a space. This will setup the arg_buf and arg_len
     // if we do find the terminator. It will also insert a null terminator
-    // at the space, so we can compare the cmd_buf to the commands.
-    buffer_after_terminator(cmd_buf, buf_len, ' ', arg_buf, arg_len);
-
-    // Search for the command
-    conn_cmd_type type = UNKNOWN;
-    #define CMD_MATCH(name) (strcmp(name, cmd_buf) == 0)
-    if (CMD_MATCH("c") || CMD_MATCH("check")) {
-        type = CHECK;
-    } else if (CMD_MATCH("m") || CMD_MATCH("multi")) {
-        type = CHECK_MULTI;
-    } else if (CMD_MATCH("s") || CMD_MATCH("set")) {
-        type = SET;
-    } else if (CMD_MATCH("b") || CMD_MATCH("bulk")) {
-        type = SET_MULTI;
-    } else if (CMD_MATCH("list")) {
-        type = LIST;
-    } else if (CMD_MATCH("info")) {
-        type = INFO;
-    } else if (CMD_MATCH("create")) {
-        type = CREATE;
-    } else if (CMD_MATCH("drop")) {
-        type = DROP;
-    } else if (CMD_MATCH("close")) {
-        type = CLOSE;
-    } else if (CMD_MATCH("clear")) {
-        type = CLEAR;
-    } else if (CMD_MATCH("flush")) {
-        type = FLUSH;
-    }
-
-    return type;
+    // at the space, so the command is terminated either way.
+    int cmd_len;
+    if (buffer_after_terminator(cmd_buf, buf_len, ' ', arg_buf, arg_len)) {
+        cmd_len = buf_len - 1;
+    } else {
+        cmd_len = *arg_buf - cmd_buf - 1;
+    }
+
+    // Fast path for the short forms
+    if (cmd_len == 1) {
+        switch (cmd_buf[0]) {
+            case 'c': return CHECK;
+            case 'm': return CHECK_MULTI;
+            case 's': return SET;
+            case 'b': return SET_MULTI;
+            case 'u': return UNSET;
+            default: return UNKNOWN;
+        }
+    }
+
+    // Search for the command among those of the same first byte
+    #define CMD_MATCH(name) (cmd_len == sizeof(name) - 1 && memcmp(name, cmd_buf, sizeof(name) - 1) == 0)
+    switch (cmd_buf[0]) {
+        case 'b':
+            if (CMD_MATCH("bulk")) return SET_MULTI;
+            if (CMD_MATCH("bulk_new")) return SET_NEW;
+            if (CMD_MATCH("bulk_hex")) return SET_HEX;
+            if (CMD_MATCH("binary")) return BINARY;
+            break;
+        case 'c':
+            if (CMD_MATCH("check")) return CHECK;
+            if (CMD_MATCH("create")) return CREATE;
+            if (CMD_MATCH("close")) return CLOSE;
+            if (CMD_MATCH("clear")) return CLEAR;
+            if (CMD_MATCH("config")) return CONFIG;
+            break;
+        case 'd':
+            if (CMD_MATCH("drop")) return DROP;
+            if (CMD_MATCH("delta")) return DELTA;
+            if (CMD_MATCH("dump")) return DUMP;
+            if (CMD_MATCH("deadline")) return DEADLINE;
+            break;
+        case 'e':
+            if (CMD_MATCH("estimate")) return ESTIMATE;
+            break;
+        case 'f':
+            if (CMD_MATCH("flush")) return FLUSH;
+            if (CMD_MATCH("freeze")) return FREEZE;
+            break;
+        case 'h':
+            if (CMD_MATCH("hcheck")) return HCHECK;
+            if (CMD_MATCH("hset")) return HSET;
+            if (CMD_MATCH("hello")) return HELLO;
+            break;
+        case 'i':
+            if (CMD_MATCH("info")) return INFO;
+            if (CMD_MATCH("intersect")) return INTERSECT;
+            break;
+        case 'l':
+            if (CMD_MATCH("list")) return LIST;
+            if (CMD_MATCH("load")) return LOAD;
+            break;
+        case 'm':
+            if (CMD_MATCH("mu")) return UNSET_MULTI;
+            if (CMD_MATCH("multi")) return CHECK_MULTI;
+            if (CMD_MATCH("mcheck")) return MCHECK;
+            if (CMD_MATCH("multi_hex")) return CHECK_HEX;
+            if (CMD_MATCH("multi_unset")) return UNSET_MULTI;
+            break;
+        case 'n':
+            if (CMD_MATCH("noreply")) return NOREPLY;
+            break;
+        case 'p':
+            if (CMD_MATCH("peer")) return PEER;
+            break;
+        case 'r':
+            if (CMD_MATCH("reset")) return RESET;
+            if (CMD_MATCH("restore")) return RESTORE;
+            break;
+        case 's':
+            if (CMD_MATCH("set")) return SET;
+            if (CMD_MATCH("stats")) return STATS;
+            if (CMD_MATCH("shm")) return SHM;
+            if (CMD_MATCH("slowlog")) return SLOWLOG;
+            if (CMD_MATCH("slice")) return SLICE;
+            if (CMD_MATCH("scheck")) return SCHECK;
+            if (CMD_MATCH("shrink")) return SHRINK;
+            break;
+        case 'u':
+            if (CMD_MATCH("unset")) return UNSET;
+            if (CMD_MATCH("union")) return UNION;
+            if (CMD_MATCH("unslice")) return UNSLICE;
+            break;
+        case 'w':
+            if (CMD_MATCH("warm")) return WARM;
+            if (CMD_MATCH("workers")) return WORKERS;
+            break;
+    }
+    #undef CMD_MATCH
+    return UNKNOWN;
+}
+
+
+/**
+ * Splits the tag off a tagged command line, and sets it on the
+ * connection. The tag starts with '#' and ends at the first space.
+ * @arg conn The client connection
+ * @arg line The command line, starting with the tag
+ * @arg line_len The length of the line
+ * @arg arg_buf Output. Sets the start address of the command arguments.
+ * @arg arg_len Output. Sets the length of arg_buf.
+ * @return The type of the command after the tag. UNKNOWN if
+ * there is none, or it is tagged again.
+ */
+static conn_cmd_type split_command_tag(bloom_conn_info *conn, char *line, int line_len, char **arg_buf, int *arg_len) {
+    char *cmd;
+    int cmd_len;
+    if (buffer_after_terminator(line, line_len, ' ', &cmd, &cmd_len)) {
+        set_client_tag(conn, line, strlen(line));
+        *arg_buf = NULL;
+        return UNKNOWN;
+    }
+    set_client_tag(conn, line, cmd - line - 1);
+    conn_cmd_type type = determine_client_command(cmd, cmd_len, arg_buf, arg_len);
+    return (type == TAGGED) ? UNKNOWN : type;
+}
+
+/**
+ * Returns the latency histogram of a command type.
+ * @return The bloom_latency, or -1 if the command has none.
+ */
+static int command_latency(conn_cmd_type type) {
+    switch (type) {
+        case CHECK: return LAT_CHECK;
+        case CHECK_MULTI: return LAT_MULTI;
+        case SET: return LAT_SET;
+        case SET_MULTI: return LAT_BULK;
+        case HCHECK: return LAT_MULTI;
+        case HSET: return LAT_BULK;
+        case SET_NEW: return LAT_BULK;
+        case CHECK_HEX: return LAT_MULTI;
+        case SET_HEX: return LAT_BULK;
+        case CREATE: return LAT_CREATE;
+        case FLUSH: return LAT_FLUSH;
+        default: return -1;
+    }
+}
+
+/**
+ * Checks if a command is answered with Timeout once it waited
+ * past its deadline. Only the commands on keys are shed, the
+ * others are rare, or change the state of the connection.
+ */
+static int command_sheddable(conn_cmd_type type) {
+    switch (type) {
+        case CHECK:
+        case SET:
+        case CHECK_MULTI:
+        case SET_MULTI:
+        case HCHECK:
+        case HSET:
+        case SET_NEW:
+        case CHECK_HEX:
+        case SET_HEX:
+        case UNSET:
+        case UNSET_MULTI:
+        case MCHECK:
+        case SCHECK:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Splits the arguments of a command on a filter and a single
+ * key at the first space, leaving the filter name NUL terminated.
+ * @arg args The arguments, may be NULL
+ * @arg args_len The length of args
+ * @arg key Output. Set to the key.
+ * @arg key_len Output. The length of the key, including the NUL
+ * terminator of the command.
+ * @return 0 on success, -1 if there is no key.
+ */
+static int split_filt_key(char *args, int args_len, char **key, int *key_len) {
+    if (!args) return -1;
+    int err = buffer_after_terminator(args, args_len, ' ', key, key_len);
+    if (err || *key_len <= 1) return -1;
+    return 0;
+}
+
+/**
+ * Splits space separated keys off the front of a buffer.
+ * The keys are not terminated, their lengths are returned
+ * instead. Spaces are found 16 bytes at a time, so a long
+ * bulk is split in a single pass. A trailing space does
+ * not make an empty key.
+ * @arg buf The keys. Updated to the keys that remain.
+ * @arg buf_len The length of buf. Updated to the length that remains.
+ * @arg keys Output. The start of each key.
+ * @arg lens Output. The length of each key.
+ * @arg max_keys The most keys to split off
+ * @return The number of keys split off.
+ */
+static int split_keys(char **buf, int *buf_len, char **keys, uint64_t *lens, int max_keys) {
+    char *key = *buf;
+    char *pos = key;
+    char *end = key + *buf_len;
+    int num = 0;
+
+    // Take each space of a block, lowest first
+    unsigned mask;
+    int offset;
+    for (; end - pos >= 16; pos += 16) {
+        mask = byte_mask(pos, ' ');
+        while (mask) {
+            offset = __builtin_ctz(mask);
+            keys[num] = key;
+            lens[num] = pos + offset - key;
+            key = pos + offset + 1;
+            mask &= mask - 1;
+            if (++num == max_keys) goto DONE;
+        }
+    }
+
+    // Scan the rest a byte at a time
+    for (; pos < end; pos++) {
+        if (*pos != ' ') continue;
+        keys[num] = key;
+        lens[num] = pos - key;
+        key = pos + 1;
+        if (++num == max_keys) goto DONE;
+    }
+
+    // The last key runs to the end
+    if (key < end) {
+        keys[num] = key;
+        lens[num] = end - key;
+        key = end;
+        num++;
+    }
+
+DONE:
+    *buf = key;
+    *buf_len = end - key;
+    return num;
 }
 
 
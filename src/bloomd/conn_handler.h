@@ -3,6 +3,8 @@
 #include "config.h"
 #include "networking.h"
 #include "filter_manager.h"
+#include "cluster.h"
+#include "bulk.h"
 
 /**
  * This structure is used to communicate
@@ -12,7 +14,11 @@
 typedef struct {
     bloom_config *config;     // Global bloom configuration
     bloom_filtmgr *mgr;       // Filter manager
+    bloom_cluster *cluster;   // The cluster, or NULL
     bloom_conn_info *conn;    // Opaque handle into the networking stack
+    int budget;               // Commands handled before yielding, counts down
+    uint64_t keys;            // Keys handled, counted towards the client
+    bloom_bulk_pool *bulk;    // Runs large bulk commands in parallel, or NULL
 } bloom_conn_handler;
 
 /**
@@ -24,12 +30,67 @@ void init_conn_handler();
  * Invoked by the networking layer when there is new
  * data to be handled. The connection handler should
  * consume all the input possible, and generate responses
- * to all requests.
+ * to all requests. It stops early once the budget of the
+ * handle is used up, leaving the rest of the input.
  * @arg handle The connection related information
  * @return 0 on success.
  */
 int handle_client_connect(bloom_conn_handler *handle);
 
+/**
+ * Invoked by the networking layer with a UDP datagram.
+ * Each line of the datagram is a set or bulk command, the
+ * last line need not be terminated. Other commands are
+ * ignored, and no responses are sent.
+ * @arg handle The connection related information
+ * @arg buf The datagram, NUL terminated
+ * @arg buf_len The length of the datagram
+ * @return 0 on success.
+ */
+int handle_client_datagram(bloom_conn_handler *handle, char *buf, int buf_len);
+
+/**
+ * Invoked by the networking layer on an admin thread, with
+ * the admin command of a parked connection. The responses
+ * are written once the connection resumes on its worker.
+ * @arg handle The connection related information
+ * @arg type The type of the command
+ * @arg args The arguments of the command
+ * @arg args_len The length of the arguments
+ */
+void handle_admin_command(bloom_conn_handler *handle, int type, char *args, int args_len);
+
+/**
+ * Invoked by the networking layer on the worker owning a
+ * filter, with a command forwarded by another worker. The
+ * responses are written once the connection resumes on its
+ * worker. A command read ahead that is not on the filter is
+ * left for the worker of the connection.
+ * @arg handle The connection related information
+ * @arg type The type of the command
+ * @arg args The arguments of the command
+ * @arg args_len The length of the arguments
+ */
+void handle_affine_command(bloom_conn_handler *handle, int type, char *args, int args_len);
+
+/**
+ * The most clients passed to handle_client_checks
+ */
+#define CHECK_GROUP_MAX 256
+
+/**
+ * Invoked by the networking layer on a worker, with the clients
+ * that became readable in one pass of its event loop. The first
+ * command of each client is handled if it is a check, and the
+ * checks on a filter are run as one batch. The other commands are
+ * left to handle_client_connect. A client whose check needs a cold
+ * filter is parked.
+ * @arg handle The connection related information, conn is not used
+ * @arg conns The clients
+ * @arg num The number of clients, at most CHECK_GROUP_MAX
+ */
+void handle_client_checks(bloom_conn_handler *handle, bloom_conn_info **conns, int num);
+
 /**
  * Invoked by the networking layer periodically to
  * handle state updates. Does not provide
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "container.h"
+
+/**
+ * Magic of the container format
+ */
+#define CONTAINER_MAGIC 0x42504b31    // "BPK1"
+
+static int write_header(bloom_container *c);
+static uint64_t layers_end(bloom_container *c);
+
+/**
+ * Opens the container at a path, creating an empty one
+ * if it does not exist.
+ * @arg path The path of the container
+ * @arg container Output, the opened container
+ * @return 0 on success, -EINVAL if the container is corrupt,
+ * or another negative errno.
+ */
+int container_open(char *path, bloom_container **container) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) return -errno;
+
+    struct stat buf;
+    if (fstat(fd, &buf)) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+
+    bloom_container *c = calloc(1, sizeof(bloom_container));
+    c->fd = fd;
+    int res = 0;
+    if (buf.st_size == 0) {
+        // A new container, with an empty table
+        c->header.magic = CONTAINER_MAGIC;
+        res = write_header(c);
+
+    } else if (buf.st_size < CONTAINER_HEADER_SIZE ||
+            pread(fd, &c->header, sizeof(container_header), 0) != sizeof(container_header)) {
+        res = -EINVAL;
+
+    } else if (c->header.magic != CONTAINER_MAGIC || c->header.num_layers > CONTAINER_MAX_LAYERS) {
+        res = -EINVAL;
+
+    } else {
+        // Every layer must be aligned, and within the file
+        container_layer *l;
+        for (uint32_t i=0; i < c->header.num_layers && !res; i++) {
+            l = c->header.layers + i;
+            if (l->offset < CONTAINER_HEADER_SIZE || l->offset % 4096 || l->size == 0 ||
+                    l->offset + l->size > (uint64_t)buf.st_size) {
+                res = -EINVAL;
+            }
+        }
+    }
+
+    if (res) {
+        syslog(LOG_ERR, "Failed to open container: %s. Err: %d", path, res);
+        close(fd);
+        free(c);
+        return res;
+    }
+    *container = c;
+    return 0;
+}
+
+/**
+ * Closes the container. The bitmaps of its layers
+ * must be closed first.
+ * @arg container The container
+ * @return 0 on success.
+ */
+int container_close(bloom_container *container) {
+    int res = close(container->fd);
+    free(container);
+    return (res) ? -errno : 0;
+}
+
+/**
+ * Adds a layer at the end of the container. The space of the
+ * layer is allocated before the layer is added to the table.
+ * @arg container The container
+ * @arg size The size of the layer in bytes
+ * @arg offset Output, the offset of the new layer
+ * @return 0 on success, -ENOSPC if the table is full,
+ * or another negative errno.
+ */
+int container_add_layer(bloom_container *container, uint64_t size, uint64_t *offset) {
+    container_header *h = &container->header;
+    if (h->num_layers == CONTAINER_MAX_LAYERS) return -ENOSPC;
+
+    // Allocate the whole layer up front, so it is not fragmented.
+    // File systems without fallocate get a sparse layer instead.
+    uint64_t start = layers_end(container);
+    if (fallocate(container->fd, 0, start, size)) {
+        if (errno != EOPNOTSUPP) return -errno;
+        if (ftruncate(container->fd, start + size)) return -errno;
+    }
+
+    h->layers[h->num_layers].offset = start;
+    h->layers[h->num_layers].size = size;
+    h->num_layers++;
+    int res = write_header(container);
+    if (res) {
+        h->num_layers--;
+        return res;
+    }
+    *offset = start;
+    return 0;
+}
+
+/**
+ * Removes a layer from the table, and punches its space out
+ * of the file. The layers after it move down in the table.
+ * @arg container The container
+ * @arg idx The index of the layer
+ * @return 0 on success, negative errno on failure.
+ */
+int container_remove_layer(bloom_container *container, int idx) {
+    container_header *h = &container->header;
+    if (idx < 0 || (uint32_t)idx >= h->num_layers) return -EINVAL;
+
+    // Drop the layer from the table before its space
+    container_layer layer = h->layers[idx];
+    memmove(h->layers + idx, h->layers + idx + 1,
+            (h->num_layers - idx - 1) * sizeof(container_layer));
+    h->num_layers--;
+    int res = write_header(container);
+    if (res) return res;
+
+    if (fallocate(container->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                layer.offset, layer.size)) {
+        syslog(LOG_WARNING, "Failed to free the space of a removed layer. %s", strerror(errno));
+    }
+    return 0;
+}
+
+/**
+ * Removes all but the first layers, and truncates the
+ * file after them.
+ * @arg container The container
+ * @arg num The number of layers to keep
+ * @return 0 on success, negative errno on failure.
+ */
+int container_truncate(bloom_container *container, int num) {
+    container_header *h = &container->header;
+    if (num < 0 || (uint32_t)num > h->num_layers) return -EINVAL;
+
+    h->num_layers = num;
+    int res = write_header(container);
+    if (res) return res;
+    if (ftruncate(container->fd, layers_end(container))) return -errno;
+    return 0;
+}
+
+/**
+ * Writes out and syncs the header page
+ */
+static int write_header(bloom_container *c) {
+    unsigned char page[CONTAINER_HEADER_SIZE];
+    memset(page, 0, sizeof(page));
+    memcpy(page, &c->header, sizeof(container_header));
+
+    ssize_t res;
+    uint64_t total = 0;
+    while (total < sizeof(page)) {
+        res = pwrite(c->fd, page + total, sizeof(page) - total, total);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        total += res;
+    }
+    if (fdatasync(c->fd)) return -errno;
+    return 0;
+}
+
+/**
+ * Returns the page aligned end of the last layer in the file
+ */
+static uint64_t layers_end(bloom_container *c) {
+    uint64_t end = CONTAINER_HEADER_SIZE, layer_end;
+    container_layer *l;
+    for (uint32_t i=0; i < c->header.num_layers; i++) {
+        l = c->header.layers + i;
+        layer_end = (l->offset + l->size + 4095) & ~4095ULL;
+        if (layer_end > end) end = layer_end;
+    }
+    return end;
+}
@@ -0,0 +1,95 @@
+#ifndef BLOOM_CONTAINER_H
+#define BLOOM_CONTAINER_H
+#include <stdint.h>
+
+/**
+ * A container stores all the layers of a filter in a single
+ * file, instead of a data file per layer. The first page holds
+ * a table of the layers, which follow it at page aligned offsets.
+ * The layers are mapped over the one file handle of the container,
+ * so a filter takes a single file descriptor however much it grows.
+ */
+
+/**
+ * The size of the header page, layers start after it
+ */
+#define CONTAINER_HEADER_SIZE 4096
+
+/**
+ * The most layers a container can hold
+ */
+#define CONTAINER_MAX_LAYERS 254
+
+/**
+ * A layer in the table of a container
+ */
+typedef struct {
+    uint64_t offset;        // Offset of the layer in the file
+    uint64_t size;          // Size of the layer in bytes
+} __attribute__ ((packed)) container_layer;
+
+/**
+ * The header page at the start of a container
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t num_layers;
+    container_layer layers[CONTAINER_MAX_LAYERS];
+} __attribute__ ((packed)) container_header;
+
+/**
+ * An open container
+ */
+typedef struct {
+    int fd;                 // Shared by the bitmaps of the layers
+    container_header header;
+} bloom_container;
+
+/**
+ * Opens the container at a path, creating an empty one
+ * if it does not exist.
+ * @arg path The path of the container
+ * @arg container Output, the opened container
+ * @return 0 on success, -EINVAL if the container is corrupt,
+ * or another negative errno.
+ */
+int container_open(char *path, bloom_container **container);
+
+/**
+ * Closes the container. The bitmaps of its layers
+ * must be closed first.
+ * @arg container The container
+ * @return 0 on success.
+ */
+int container_close(bloom_container *container);
+
+/**
+ * Adds a layer at the end of the container. The space of the
+ * layer is allocated before the layer is added to the table.
+ * @arg container The container
+ * @arg size The size of the layer in bytes
+ * @arg offset Output, the offset of the new layer
+ * @return 0 on success, -ENOSPC if the table is full,
+ * or another negative errno.
+ */
+int container_add_layer(bloom_container *container, uint64_t size, uint64_t *offset);
+
+/**
+ * Removes a layer from the table, and punches its space out
+ * of the file. The layers after it move down in the table.
+ * @arg container The container
+ * @arg idx The index of the layer
+ * @return 0 on success, negative errno on failure.
+ */
+int container_remove_layer(bloom_container *container, int idx);
+
+/**
+ * Removes all but the first layers, and truncates the
+ * file after them.
+ * @arg container The container
+ * @arg num The number of layers to keep
+ * @return 0 on success, negative errno on failure.
+ */
+int container_truncate(bloom_container *container, int num);
+
+#endif
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "delta.h"
+
+/**
+ * The suffix of a delta until it is complete
+ */
+#define TMP_SUFFIX ".tmp"
+
+static int write_pages(FILE *f, delta_header *header, uint32_t num, bloom_bitmap *map);
+
+/**
+ * Writes a delta of the pages changed after an epoch. The delta
+ * is written aside, and renamed into place once it is synced.
+ * @arg path The path of the delta
+ * @arg header The header, the num_layers gives the layers
+ * @arg nums The numbers of the data files of the layers
+ * @arg maps The bitmaps of the layers
+ * @return The number of pages written, or negative errno.
+ */
+int delta_write(char *path, delta_header *header, uint32_t *nums, bloom_bitmap **maps) {
+    char *tmp_path = malloc(strlen(path) + sizeof(TMP_SUFFIX));
+    strcpy(tmp_path, path);
+    strcat(tmp_path, TMP_SUFFIX);
+
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        int res = -errno;
+        syslog(LOG_ERR, "Failed to create the delta '%s'. %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return res;
+    }
+
+    // Write the header and the table of the layers
+    header->magic = DELTA_MAGIC;
+    int res = (fwrite(header, sizeof(delta_header), 1, f) == 1) ? 0 : -EIO;
+    delta_layer layer;
+    for (uint32_t i=0; i < header->num_layers && !res; i++) {
+        memset(&layer, 0, sizeof(layer));
+        layer.num = nums[i];
+        layer.size = maps[i]->size;
+        if (fwrite(&layer, sizeof(delta_layer), 1, f) != 1) res = -EIO;
+    }
+
+    // Write the changed pages of each layer
+    int num = 0;
+    for (uint32_t i=0; i < header->num_layers && res >= 0; i++) {
+        res = write_pages(f, header, nums[i], maps[i]);
+        if (res > 0) num += res;
+    }
+
+    delta_page end = {DELTA_END, DELTA_END};
+    if (res >= 0 && fwrite(&end, sizeof(delta_page), 1, f) != 1) res = -EIO;
+    if (res >= 0 && (fflush(f) || fsync(fileno(f)))) res = -errno;
+    if (fclose(f) && res >= 0) res = -errno;
+    if (res >= 0 && rename(tmp_path, path)) res = -errno;
+
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to write the delta '%s'. Err: %d", path, res);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return (res < 0) ? res : num;
+}
+
+/**
+ * Writes the pages of a layer changed after the epoch
+ * of the delta, or all of them if it is full.
+ * @return The number of pages written, or negative errno.
+ */
+static int write_pages(FILE *f, delta_header *header, uint32_t num, bloom_bitmap *map) {
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    delta_page rec = {num, 0};
+    uint64_t offset, len;
+    int written = 0;
+    for (uint64_t p=0; p < pages; p++) {
+        if (!header->full && bitmap_page_epoch(map, p) <= header->since) continue;
+        offset = p * 4096;
+        len = (offset + 4096 > map->size) ? map->size - offset : 4096;
+        rec.page = p;
+        if (fwrite(&rec, sizeof(delta_page), 1, f) != 1 ||
+                fwrite(map->mmap + offset, 1, len, f) != len) {
+            return -EIO;
+        }
+        written++;
+    }
+    return written;
+}
+
+/**
+ * Reads a delta.
+ * @arg path The path of the delta
+ * @arg header Output, the header of the delta
+ * @arg layers Output, the table of the layers. Must be free'd.
+ * @arg cb The callback, invoked for each page
+ * @arg data Opaque handle passed to the callback
+ * @return The number of pages read, -EINVAL if the delta is
+ * corrupt or truncated, or another negative errno.
+ */
+int delta_read(char *path, delta_header *header, delta_layer **layers, delta_page_cb cb, void *data) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+    uint64_t len = st.st_size;
+    if (len < sizeof(delta_header)) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    // Map the whole delta, it is read once in order
+    unsigned char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) return -errno;
+    madvise(buf, len, MADV_SEQUENTIAL);
+
+    memcpy(header, buf, sizeof(delta_header));
+    uint64_t pos = sizeof(delta_header);
+    uint64_t table_len = (uint64_t)header->num_layers * sizeof(delta_layer);
+    if (header->magic != DELTA_MAGIC || table_len > len - pos) {
+        munmap(buf, len);
+        return -EINVAL;
+    }
+    delta_layer *l = *layers = malloc(table_len + sizeof(delta_layer));
+    memcpy(l, buf + pos, table_len);
+    pos += table_len;
+
+    // Every page must be within its layer, and the delta must end
+    int num = 0, res = -EINVAL;
+    delta_page rec;
+    uint64_t offset, size, page_len;
+    while (pos + sizeof(delta_page) <= len) {
+        memcpy(&rec, buf + pos, sizeof(delta_page));
+        pos += sizeof(delta_page);
+        if (rec.layer == DELTA_END) {
+            res = num;
+            break;
+        }
+
+        size = 0;
+        for (uint32_t i=0; i < header->num_layers; i++) {
+            if (l[i].num == rec.layer) size = l[i].size;
+        }
+        offset = (uint64_t)rec.page * 4096;
+        if (offset >= size) break;
+        page_len = (offset + 4096 > size) ? size - offset : 4096;
+        if (page_len > len - pos) break;
+
+        cb(data, rec.layer, offset, buf + pos, page_len);
+        pos += page_len;
+        num++;
+    }
+    munmap(buf, len);
+    if (res < 0) {
+        free(*layers);
+        *layers = NULL;
+    }
+    return res;
+}
@@ -0,0 +1,94 @@
+#ifndef BLOOM_DELTA_H
+#define BLOOM_DELTA_H
+#include <stdint.h>
+#include "bitmap.h"
+
+/**
+ * A delta holds the pages of a filter that changed since an
+ * epoch, so a backup or a replica can be brought up to date
+ * without copying whole data files. The flushes stamp each page
+ * they write with the current epoch of the filter, and every
+ * export starts a new epoch. A delta since the epoch of the last
+ * export then holds every page changed since that export.
+ *
+ * A delta starts with a header and the table of the layers, by
+ * data file number and size. The changed pages follow, each as a
+ * delta_page and the bytes of the page, up to 4K. The last page of
+ * a layer may be shorter. A delta_page with a layer of DELTA_END
+ * ends the delta. A full delta holds every page of every layer, and
+ * replaces the layers of the filter, instead of patching them.
+ */
+
+/**
+ * Magic of the delta format
+ */
+#define DELTA_MAGIC 0x42444c31    // "BDL1"
+
+/**
+ * The layer of the delta_page that ends a delta
+ */
+#define DELTA_END UINT32_MAX
+
+/**
+ * The header at the start of a delta
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t full;          // Holds every page, not only the changed ones
+    uint64_t since;         // The epoch the delta starts after
+    uint64_t epoch;         // The epoch the delta brings a copy up to
+    uint32_t num_layers;    // Size of the table of the layers
+    uint32_t reserved;
+} __attribute__ ((packed)) delta_header;
+
+/**
+ * A layer in the table of a delta
+ */
+typedef struct {
+    uint32_t num;           // Number of the data file
+    uint32_t reserved;
+    uint64_t size;          // Size of the layer in bytes
+} __attribute__ ((packed)) delta_layer;
+
+/**
+ * Precedes the bytes of each page in a delta
+ */
+typedef struct {
+    uint32_t layer;         // Number of the data file, or DELTA_END
+    uint32_t page;          // Index of the 4K page in the layer
+} __attribute__ ((packed)) delta_page;
+
+/**
+ * Invoked for each page of a delta
+ * @arg data Opaque handle
+ * @arg layer The number of the data file
+ * @arg offset The byte offset of the page in the layer
+ * @arg bytes The bytes of the page
+ * @arg len The length of the page
+ */
+typedef void(*delta_page_cb)(void *data, uint32_t layer, uint64_t offset, const unsigned char *bytes, uint32_t len);
+
+/**
+ * Writes a delta of the pages changed after an epoch. The delta
+ * is written aside, and renamed into place once it is synced.
+ * @arg path The path of the delta
+ * @arg header The header, the num_layers gives the layers
+ * @arg nums The numbers of the data files of the layers
+ * @arg maps The bitmaps of the layers
+ * @return The number of pages written, or negative errno.
+ */
+int delta_write(char *path, delta_header *header, uint32_t *nums, bloom_bitmap **maps);
+
+/**
+ * Reads a delta.
+ * @arg path The path of the delta
+ * @arg header Output, the header of the delta
+ * @arg layers Output, the table of the layers. Must be free'd.
+ * @arg cb The callback, invoked for each page
+ * @arg data Opaque handle passed to the callback
+ * @return The number of pages read, -EINVAL if the delta is
+ * corrupt or truncated, or another negative errno.
+ */
+int delta_read(char *path, delta_header *header, delta_layer **layers, delta_page_cb cb, void *data);
+
+#endif
@@ -0,0 +1,1058 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <syslog.h>
+#include <alloca.h>
+#include <string.h>
+#include "engine.h"
+
+/**
+ * The number of keys hashed and prefetched together
+ * by the batch checks of a fixed filter.
+ */
+#define FIXED_BATCH_SIZE 16
+
+/**
+ * A fixed filter is a single bloom filter, sized once
+ * for the initial capacity.
+ */
+typedef struct {
+    bloom_bloomfilter filter;
+    uint64_t capacity;
+    uint64_t hits;          // Checks found in the filter, approximate
+    int reject_full;        // Reject adds once full, instead of warning
+    int warned;             // Set once the overfill warning is logged
+} fixed_engine;
+
+/**
+ * Static declarations
+ */
+static int sbf_engine_open(bloom_engine_params *params, int num_maps, bloom_bitmap **maps, void **engine);
+static void open_summary(bloom_engine_params *params, bloom_sbf *sbf);
+static int sbf_engine_add(void *engine, const char *key, uint64_t len);
+static int sbf_engine_add_concurrent(void *engine, const char *key, uint64_t len);
+static int sbf_engine_add_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results);
+static int sbf_engine_fits(void *engine, char **keys, uint64_t *key_lens, int num_keys);
+static int sbf_engine_remove(void *engine, const char *key, uint64_t len);
+static int sbf_engine_contains(void *engine, const char *key, uint64_t len);
+static int sbf_engine_contains_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results);
+static int sbf_engine_contains_hashed(void *engine, bloom_key_hashes *hashes);
+static int sbf_engine_flush(void *engine);
+static int sbf_engine_flush_async(void *engine, bloom_flusher *flusher, bloom_flush_cb cb, void *data);
+static int sbf_engine_close(void *engine);
+static int sbf_engine_stage(void *engine);
+static int sbf_engine_serialize(void *engine, bloom_engine_map_cb cb, void *data);
+static int sbf_engine_compact(void *engine, int *num);
+static int sbf_engine_shrink(void *engine, double fp_probability, bloom_engine_fold_cb cb, void *data, int *num);
+static int sbf_engine_combine(void *engine, void *src, int intersect);
+static int sbf_engine_reset(void *engine);
+static int sbf_engine_prepare(void *engine, double fill);
+static int sbf_engine_rotate(void *engine, uint64_t now, uint64_t period);
+static int sbf_engine_reorder(void *engine, int apply);
+static int sbf_engine_layer_hits(void *engine, uint64_t **hits);
+static uint64_t sbf_engine_size(void *engine);
+static uint64_t sbf_engine_estimate(void *engine);
+static uint64_t sbf_engine_capacity(void *engine);
+static uint64_t sbf_engine_byte_size(void *engine);
+static int cuckoo_engine_add_concurrent(void *engine, const char *key, uint64_t len);
+static int fixed_engine_open(bloom_engine_params *params, int num_maps, bloom_bitmap **maps, void **engine);
+static int fixed_engine_add(void *engine, const char *key, uint64_t len);
+static int fixed_engine_add_concurrent(void *engine, const char *key, uint64_t len);
+static int fixed_engine_add_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results);
+static int fixed_engine_fits(void *engine, char **keys, uint64_t *key_lens, int num_keys);
+static int fixed_engine_remove(void *engine, const char *key, uint64_t len);
+static int fixed_engine_contains(void *engine, const char *key, uint64_t len);
+static int fixed_engine_contains_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results);
+static int fixed_engine_contains_hashed(void *engine, bloom_key_hashes *hashes);
+static int fixed_engine_flush(void *engine);
+static int fixed_engine_flush_async(void *engine, bloom_flusher *flusher, bloom_flush_cb cb, void *data);
+static int fixed_engine_close(void *engine);
+static int fixed_engine_stage(void *engine);
+static int fixed_engine_serialize(void *engine, bloom_engine_map_cb cb, void *data);
+static int fixed_engine_compact(void *engine, int *num);
+static int fixed_engine_shrink(void *engine, double fp_probability, bloom_engine_fold_cb cb, void *data, int *num);
+static int fixed_engine_combine(void *engine, void *src, int intersect);
+static int fixed_engine_reset(void *engine);
+static int fixed_engine_prepare(void *engine, double fill);
+static int fixed_engine_rotate(void *engine, uint64_t now, uint64_t period);
+static int fixed_engine_reorder(void *engine, int apply);
+static int fixed_engine_layer_hits(void *engine, uint64_t **hits);
+static inline void fixed_count_hit(fixed_engine *fixed);
+static uint64_t fixed_engine_size(void *engine);
+static uint64_t fixed_engine_estimate(void *engine);
+static uint64_t fixed_engine_capacity(void *engine);
+static uint64_t fixed_engine_byte_size(void *engine);
+static bloom_layout config_layout(bloom_filter_config *config);
+static bloom_hash_family config_family(bloom_filter_config *config);
+static int frozen_engine_add(void *engine, const char *key, uint64_t len);
+static int frozen_engine_add_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results);
+static int frozen_engine_flush(void *engine);
+static int frozen_engine_flush_async(void *engine, bloom_flusher *flusher, bloom_flush_cb cb, void *data);
+static int frozen_engine_stage(void *engine);
+static int frozen_engine_compact(void *engine, int *num);
+static int frozen_engine_shrink(void *engine, double fp_probability, bloom_engine_fold_cb cb, void *data, int *num);
+static int frozen_engine_combine(void *engine, void *src, int intersect);
+static int frozen_engine_reset(void *engine);
+static int frozen_engine_prepare(void *engine, double fill);
+static int frozen_engine_rotate(void *engine, uint64_t now, uint64_t period);
+static int frozen_engine_reorder(void *engine, int apply);
+
+/**
+ * Scalable bloom filters. Counting filters are the same
+ * engine, with the counting layout for the layers.
+ */
+static const bloom_engine_ops BLOOM_ENGINE = {
+    "bloom",
+    sbf_engine_open,
+    sbf_engine_add,
+    sbf_engine_add_concurrent,
+    sbf_engine_add_batch,
+    sbf_engine_fits,
+    sbf_engine_remove,
+    sbf_engine_contains,
+    sbf_engine_contains_batch,
+    sbf_engine_contains_hashed,
+    sbf_engine_flush,
+    sbf_engine_flush_async,
+    sbf_engine_close,
+    sbf_engine_stage,
+    sbf_engine_serialize,
+    sbf_engine_compact,
+    sbf_engine_shrink,
+    sbf_engine_combine,
+    sbf_engine_reset,
+    sbf_engine_prepare,
+    sbf_engine_rotate,
+    sbf_engine_reorder,
+    sbf_engine_layer_hits,
+    sbf_engine_size,
+    sbf_engine_estimate,
+    sbf_engine_capacity,
+    sbf_engine_byte_size
+};
+
+/**
+ * Scalable cuckoo filters. The layers are kept by an SBF, but
+ * inserts move fingerprints around, so adds are always exclusive.
+ */
+static const bloom_engine_ops CUCKOO_ENGINE = {
+    "cuckoo",
+    sbf_engine_open,
+    sbf_engine_add,
+    cuckoo_engine_add_concurrent,
+    sbf_engine_add_batch,
+    sbf_engine_fits,
+    sbf_engine_remove,
+    sbf_engine_contains,
+    sbf_engine_contains_batch,
+    sbf_engine_contains_hashed,
+    sbf_engine_flush,
+    sbf_engine_flush_async,
+    sbf_engine_close,
+    sbf_engine_stage,
+    sbf_engine_serialize,
+    sbf_engine_compact,
+    sbf_engine_shrink,
+    sbf_engine_combine,
+    sbf_engine_reset,
+    sbf_engine_prepare,
+    sbf_engine_rotate,
+    sbf_engine_reorder,
+    sbf_engine_layer_hits,
+    sbf_engine_size,
+    sbf_engine_estimate,
+    sbf_engine_capacity,
+    sbf_engine_byte_size
+};
+
+/**
+ * Fixed filters of any layout. There is a single filter, so
+ * nothing grows and checks always probe a single layer.
+ */
+static const bloom_engine_ops FIXED_ENGINE = {
+    "fixed",
+    fixed_engine_open,
+    fixed_engine_add,
+    fixed_engine_add_concurrent,
+    fixed_engine_add_batch,
+    fixed_engine_fits,
+    fixed_engine_remove,
+    fixed_engine_contains,
+    fixed_engine_contains_batch,
+    fixed_engine_contains_hashed,
+    fixed_engine_flush,
+    fixed_engine_flush_async,
+    fixed_engine_close,
+    fixed_engine_stage,
+    fixed_engine_serialize,
+    fixed_engine_compact,
+    fixed_engine_shrink,
+    fixed_engine_combine,
+    fixed_engine_reset,
+    fixed_engine_prepare,
+    fixed_engine_rotate,
+    fixed_engine_reorder,
+    fixed_engine_layer_hits,
+    fixed_engine_size,
+    fixed_engine_estimate,
+    fixed_engine_capacity,
+    fixed_engine_byte_size
+};
+
+/**
+ * Frozen filters are mapped read only. Checks use the engine as
+ * is, but nothing may change the layers or the order they are
+ * probed in, so checks can run without any lock.
+ */
+static const bloom_engine_ops FROZEN_BLOOM_ENGINE = {
+    "frozen bloom",
+    sbf_engine_open,
+    frozen_engine_add,
+    frozen_engine_add,
+    frozen_engine_add_batch,
+    sbf_engine_fits,
+    frozen_engine_add,
+    sbf_engine_contains,
+    sbf_engine_contains_batch,
+    sbf_engine_contains_hashed,
+    frozen_engine_flush,
+    frozen_engine_flush_async,
+    sbf_engine_close,
+    frozen_engine_stage,
+    sbf_engine_serialize,
+    frozen_engine_compact,
+    frozen_engine_shrink,
+    frozen_engine_combine,
+    frozen_engine_reset,
+    frozen_engine_prepare,
+    frozen_engine_rotate,
+    frozen_engine_reorder,
+    sbf_engine_layer_hits,
+    sbf_engine_size,
+    sbf_engine_estimate,
+    sbf_engine_capacity,
+    sbf_engine_byte_size
+};
+
+static const bloom_engine_ops FROZEN_CUCKOO_ENGINE = {
+    "frozen cuckoo",
+    sbf_engine_open,
+    frozen_engine_add,
+    frozen_engine_add,
+    frozen_engine_add_batch,
+    sbf_engine_fits,
+    frozen_engine_add,
+    sbf_engine_contains,
+    sbf_engine_contains_batch,
+    sbf_engine_contains_hashed,
+    frozen_engine_flush,
+    frozen_engine_flush_async,
+    sbf_engine_close,
+    frozen_engine_stage,
+    sbf_engine_serialize,
+    frozen_engine_compact,
+    frozen_engine_shrink,
+    frozen_engine_combine,
+    frozen_engine_reset,
+    frozen_engine_prepare,
+    frozen_engine_rotate,
+    frozen_engine_reorder,
+    sbf_engine_layer_hits,
+    sbf_engine_size,
+    sbf_engine_estimate,
+    sbf_engine_capacity,
+    sbf_engine_byte_size
+};
+
+static const bloom_engine_ops FROZEN_FIXED_ENGINE = {
+    "frozen fixed",
+    fixed_engine_open,
+    frozen_engine_add,
+    frozen_engine_add,
+    frozen_engine_add_batch,
+    fixed_engine_fits,
+    frozen_engine_add,
+    fixed_engine_contains,
+    fixed_engine_contains_batch,
+    fixed_engine_contains_hashed,
+    frozen_engine_flush,
+    frozen_engine_flush_async,
+    fixed_engine_close,
+    frozen_engine_stage,
+    fixed_engine_serialize,
+    frozen_engine_compact,
+    frozen_engine_shrink,
+    frozen_engine_combine,
+    frozen_engine_reset,
+    frozen_engine_prepare,
+    frozen_engine_rotate,
+    frozen_engine_reorder,
+    fixed_engine_layer_hits,
+    fixed_engine_size,
+    fixed_engine_estimate,
+    fixed_engine_capacity,
+    fixed_engine_byte_size
+};
+
+/**
+ * Returns the operations of an engine type.
+ * @arg type The engine type
+ * @return The operations, never NULL.
+ */
+const bloom_engine_ops* engine_ops(bloom_filter_engine type) {
+    switch (type) {
+        case ENGINE_CUCKOO:
+            return &CUCKOO_ENGINE;
+        default:
+            return &BLOOM_ENGINE;
+    }
+}
+
+/**
+ * Returns the operations to use for a filter config.
+ * @arg config The filter config
+ * @return The operations, never NULL.
+ */
+const bloom_engine_ops* config_engine_ops(bloom_filter_config *config) {
+    if (config->frozen) {
+        if (!config->scalable && !config->window) return &FROZEN_FIXED_ENGINE;
+        return (config->engine == ENGINE_CUCKOO) ? &FROZEN_CUCKOO_ENGINE : &FROZEN_BLOOM_ENGINE;
+    }
+    if (!config->scalable && !config->window) return &FIXED_ENGINE;
+    return engine_ops(config->engine);
+}
+
+/**
+ * Returns the hashes of a key for a hash family, computing
+ * them or extending the hashes already computed as needed.
+ * The first hashes of a family do not depend on how many
+ * are computed, so every engine sees the same values.
+ * @return The hashes, or NULL if more than ENGINE_MAX_HASHES are needed.
+ */
+uint64_t* engine_key_hashes(bloom_key_hashes *hashes, bloom_hash_family family, uint32_t num_hashes) {
+    if (num_hashes > ENGINE_MAX_HASHES) return NULL;
+    if (hashes->num_hashes == 0 || hashes->family != family) {
+        bf_compute_hashes_len(family, num_hashes, hashes->key, hashes->len, hashes->hashes);
+        hashes->family = family;
+        hashes->num_hashes = num_hashes;
+    } else if (hashes->num_hashes < num_hashes) {
+        bf_extend_hashes(family, hashes->num_hashes, num_hashes, hashes->hashes);
+        hashes->num_hashes = num_hashes;
+    }
+    return hashes->hashes;
+}
+
+/**
+ * Returns the layout of new layers. Cuckoo
+ * filters support removal on their own.
+ */
+static bloom_layout config_layout(bloom_filter_config *config) {
+    if (config->engine == ENGINE_CUCKOO) {
+        return LAYOUT_CUCKOO;
+    } else if (config->counting) {
+        return LAYOUT_COUNTING;
+    }
+    return LAYOUT_PARTITIONED;
+}
+
+/**
+ * Returns the hash family of new layers. The keys of hashed
+ * filters are already hashes, sent by the clients.
+ */
+static bloom_hash_family config_family(bloom_filter_config *config) {
+    return (config->hashed) ? HASH_CLIENT : HASH_MURMUR_SPOOKY;
+}
+
+/**
+ * Opens an SBF over the existing data files. The layers on disk
+ * decide the engine and if this is a counting filter, since the
+ * data files may predate those settings in the filter config.
+ */
+static int sbf_engine_open(bloom_engine_params *params, int num_maps, bloom_bitmap **maps, void **engine) {
+    bloom_filter_config *config = params->config;
+
+    // Load the layers, the SBF keeps the newest first
+    int res = 0;
+    bloom_bloomfilter **filters = NULL;
+    if (num_maps > 0) {
+        filters = calloc(num_maps, sizeof(bloom_bloomfilter*));
+    }
+    for (int i=0; i < num_maps; i++) {
+        bloom_bloomfilter *filter = filters[num_maps - i - 1] = malloc(sizeof(bloom_bloomfilter));
+        res = bf_from_bitmap(maps[i], 1, 0, filter);
+        if (res != 0) {
+            syslog(LOG_ERR, "Failed to load bloom filter from data file %d. [%d]", i, res);
+            break;
+        }
+    }
+    if (!res && num_maps > 0) {
+        config->counting = filters[0]->layout == LAYOUT_COUNTING;
+        config->engine = (filters[0]->layout == LAYOUT_CUCKOO) ? ENGINE_CUCKOO : ENGINE_BLOOM;
+        config->hashed = filters[0]->header->hash_family == HASH_CLIENT;
+
+        // Scaling data files cannot be used as generations
+        if (config->window && num_maps != config->generations) {
+            syslog(LOG_WARNING, "Found %d data files for %d generations, not using a window.",
+                    num_maps, config->generations);
+            config->window = 0;
+        }
+    }
+
+    bloom_layout layout = config_layout(config);
+
+    // Create the SBF, it copies the filter list
+    bloom_sbf *sbf = NULL;
+    if (!res) {
+        bloom_sbf_params sbf_params = {
+            config->initial_capacity,
+            config->default_probability,
+            config->scale_size,
+            config->probability_reduction,
+            layout,
+            config_family(config),
+            INDEX_MODULO,
+            BIT_ORDER_BYTE,
+            (config->window) ? config->generations : 0,
+            config->optimize
+        };
+        sbf = malloc(sizeof(bloom_sbf));
+        res = sbf_from_filters(&sbf_params, params->callback, params->callback_input,
+                num_maps, filters, sbf);
+        if (res != 0) {
+            free(sbf);
+        }
+    }
+
+    // The bitmaps are left to the caller on failure
+    if (res != 0) {
+        for (int i=0; i < num_maps; i++) free(filters[i]);
+    } else {
+        if (params->summary && !config->counting && !config->window) open_summary(params, sbf);
+        *engine = sbf;
+    }
+    free(filters);
+    return res;
+}
+
+/**
+ * Opens the summary of the layers of an SBF. A summary is only
+ * created for an empty SBF, since it must see every key. The SBF
+ * works without one, so failures are only logged.
+ */
+static void open_summary(bloom_engine_params *params, bloom_sbf *sbf) {
+    bloom_filter_params summary_params;
+    uint64_t bytes = 0;
+    if (params->summary_capacity && !sbf_size(sbf) &&
+            !sbf_summary_params(sbf, params->summary_capacity, &summary_params)) {
+        bytes = summary_params.bytes;
+    }
+
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    int res = params->summary(params->callback_input, bytes, map);
+    if (res < 0) {
+        if (res != -ENOENT) syslog(LOG_ERR, "Failed to open the layer summary. Err: %d", res);
+        free(map);
+        return;
+    }
+
+    res = sbf_attach_summary(sbf, map, (res) ? NULL : &summary_params);
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to load the layer summary. Err: %d", res);
+        bitmap_close(map);
+        free(map);
+    } else if (!res) {
+        syslog(LOG_WARNING, "The layer summary is stale, checks probe every layer until a reset.");
+    }
+}
+
+static int sbf_engine_add(void *engine, const char *key, uint64_t len) {
+    return sbf_add_len(engine, key, len);
+}
+
+static int sbf_engine_add_concurrent(void *engine, const char *key, uint64_t len) {
+    return sbf_add_concurrent_len(engine, key, len);
+}
+
+static int sbf_engine_add_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    return sbf_add_batch_len(engine, keys, key_lens, num_keys, results);
+}
+
+/**
+ * Scalable filters grow instead of rejecting keys.
+ */
+static int sbf_engine_fits(void *engine, char **keys, uint64_t *key_lens, int num_keys) {
+    (void)engine;
+    (void)keys;
+    (void)key_lens;
+    (void)num_keys;
+    return 1;
+}
+
+static int cuckoo_engine_add_concurrent(void *engine, const char *key, uint64_t len) {
+    (void)engine;
+    (void)key;
+    (void)len;
+    return -EAGAIN;
+}
+
+static int sbf_engine_remove(void *engine, const char *key, uint64_t len) {
+    return sbf_remove_len(engine, key, len);
+}
+
+static int sbf_engine_contains(void *engine, const char *key, uint64_t len) {
+    return sbf_contains_len(engine, key, len);
+}
+
+static int sbf_engine_contains_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    return sbf_contains_batch_len(engine, keys, key_lens, num_keys, results);
+}
+
+static int sbf_engine_contains_hashed(void *engine, bloom_key_hashes *hashes) {
+    bloom_sbf *sbf = engine;
+    uint32_t num_hashes = sbf_num_hashes(sbf);
+    uint64_t *key_hashes = engine_key_hashes(hashes, sbf_hash_family(sbf), num_hashes);
+    if (!key_hashes) return sbf_contains_len(sbf, hashes->key, hashes->len);
+    return sbf_contains_hashed(sbf, key_hashes, num_hashes);
+}
+
+static int sbf_engine_flush(void *engine) {
+    return sbf_flush(engine);
+}
+
+static int sbf_engine_flush_async(void *engine, bloom_flusher *flusher, bloom_flush_cb cb, void *data) {
+    return sbf_flush_async(engine, flusher, cb, data);
+}
+
+static int sbf_engine_stage(void *engine) {
+    return sbf_stage(engine);
+}
+
+static int sbf_engine_close(void *engine) {
+    int res = sbf_close(engine);
+    free(engine);
+    return res;
+}
+
+/**
+ * The layers are stored newest first, so layer i is the data
+ * file num_filters - i - 1. A prepared layer is the next file.
+ * Rotating a windowed SBF shifts its generations as a ring.
+ */
+static int sbf_engine_serialize(void *engine, bloom_engine_map_cb cb, void *data) {
+    bloom_sbf *sbf = engine;
+    int res;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        res = cb(data, (sbf->num_filters - i - 1 + sbf->rotation) % sbf->num_filters, sbf->filters[i]->map);
+        if (res) return res;
+    }
+    if (sbf->spare) return cb(data, sbf->num_filters, sbf->spare->map);
+    return 0;
+}
+
+/**
+ * Layer i is the data file num_filters - i - 1, so the
+ * newer layers are the data files after the merged one.
+ */
+static int sbf_engine_compact(void *engine, int *num) {
+    bloom_sbf *sbf = engine;
+    uint32_t num_filters = sbf->num_filters;
+    uint32_t merged;
+    int res = sbf_compact(sbf, &merged);
+    if (res == 1) *num = num_filters - merged - 1;
+    return res;
+}
+
+/**
+ * The folded layer keeps its data file, since the layers
+ * around it do not move. Windowed SBFs are never folded,
+ * so the rotation does not apply.
+ */
+static int sbf_engine_shrink(void *engine, double fp_probability, bloom_engine_fold_cb cb, void *data, int *num) {
+    bloom_sbf *sbf = engine;
+    uint32_t idx;
+    int res = sbf_fold_candidate(sbf, fp_probability, &idx);
+    if (res != 1) return res;
+
+    bloom_bitmap *map = calloc(1, sizeof(bloom_bitmap));
+    *num = sbf->num_filters - idx - 1;
+    res = cb(data, *num, bf_folded_bytes(sbf->filters[idx]), map);
+    if (!res) {
+        res = sbf_fold_layer(sbf, idx, map);
+        if (res) bitmap_close(map);
+    }
+    if (res) {
+        free(map);
+        return res;
+    }
+    return 1;
+}
+
+static int sbf_engine_combine(void *engine, void *src, int intersect) {
+    return sbf_combine(engine, src, intersect);
+}
+
+static int sbf_engine_reset(void *engine) {
+    return sbf_reset(engine);
+}
+
+static int sbf_engine_prepare(void *engine, double fill) {
+    return sbf_prepare_filter(engine, fill);
+}
+
+/**
+ * The newest generation is stamped with the time on the first
+ * rotation. Later epochs stay aligned to the periods, and after a
+ * long pause the recycled generations get consecutive periods.
+ */
+static int sbf_engine_rotate(void *engine, uint64_t now, uint64_t period) {
+    bloom_sbf *sbf = engine;
+    if (!sbf->params.generations) return 0;
+
+    uint64_t epoch = sbf_epoch(sbf);
+    if (!epoch) return (sbf_rotate(sbf, now)) ? -1 : 1;
+    if (now < epoch + period) return 0;
+
+    uint64_t periods = (now - epoch) / period;
+    uint64_t num = (periods < sbf->params.generations) ? periods : sbf->params.generations;
+    int res;
+    for (uint64_t i=0; i < num; i++) {
+        res = sbf_rotate(sbf, epoch + (periods - num + i + 1) * period);
+        if (res) return res;
+    }
+    return num;
+}
+
+static int sbf_engine_reorder(void *engine, int apply) {
+    return sbf_reorder(engine, apply);
+}
+
+static int sbf_engine_layer_hits(void *engine, uint64_t **hits) {
+    bloom_sbf *sbf = engine;
+    *hits = sbf->hits;
+    return sbf->num_filters;
+}
+
+static uint64_t sbf_engine_size(void *engine) {
+    return sbf_size(engine);
+}
+
+static uint64_t sbf_engine_estimate(void *engine) {
+    return sbf_estimate_size(engine);
+}
+
+static uint64_t sbf_engine_capacity(void *engine) {
+    return sbf_total_capacity(engine);
+}
+
+static uint64_t sbf_engine_byte_size(void *engine) {
+    return sbf_total_byte_size(engine);
+}
+
+/**
+ * Opens a fixed filter over its data file. Several data files
+ * are layers of a scaling filter, which is opened as an SBF.
+ */
+static int fixed_engine_open(bloom_engine_params *params, int num_maps, bloom_bitmap **maps, void **engine) {
+    bloom_filter_config *config = params->config;
+    if (num_maps > 1) {
+        syslog(LOG_WARNING, "Found %d data files for a fixed filter, opening it as scalable.", num_maps);
+        config->scalable = 1;
+        return sbf_engine_open(params, num_maps, maps, engine);
+    }
+
+    fixed_engine *fixed = calloc(1, sizeof(fixed_engine));
+    fixed->reject_full = config->reject_full;
+    bloom_bitmap *map;
+    int res;
+    if (num_maps == 1) {
+        // Load the existing filter, the data file decides the layout
+        map = maps[0];
+        res = bf_from_bitmap(map, 1, 0, &fixed->filter);
+        if (res != 0) {
+            syslog(LOG_ERR, "Failed to load bloom filter from data file 0. [%d]", res);
+            free(fixed);
+            return res;
+        }
+        config->counting = fixed->filter.layout == LAYOUT_COUNTING;
+        config->engine = (fixed->filter.layout == LAYOUT_CUCKOO) ? ENGINE_CUCKOO : ENGINE_BLOOM;
+        config->hashed = fixed->filter.header->hash_family == HASH_CLIENT;
+    } else {
+        // Size the filter for the full capacity and probability,
+        // since there are no later layers to tighten it
+        bloom_filter_params bf_params = {0, 0, config->initial_capacity, config->default_probability,
+            config_layout(config), config_family(config), INDEX_MODULO, BIT_ORDER_BYTE, config->optimize};
+        res = bf_params_for_capacity(&bf_params);
+        if (res != 0) {
+            free(fixed);
+            return res;
+        }
+        map = calloc(1, sizeof(bloom_bitmap));
+        res = params->callback(params->callback_input, bf_params.bytes, map);
+        if (res == 0) {
+            res = bf_from_bitmap_params(map, &bf_params, 1, &fixed->filter);
+            if (res != 0) bitmap_close(map);
+        }
+        if (res != 0) {
+            free(map);
+            free(fixed);
+            return res;
+        }
+    }
+
+    fixed->capacity = fixed->filter.header->capacity;
+    if (!fixed->capacity) fixed->capacity = config->initial_capacity;
+    *engine = fixed;
+    return 0;
+}
+
+/**
+ * Once the filter is full, adds are either rejected, or
+ * accepted at a false positive rate above the configured one.
+ */
+static int fixed_engine_add(void *engine, const char *key, uint64_t len) {
+    fixed_engine *fixed = engine;
+    if (bf_size(&fixed->filter) >= fixed->capacity && bf_contains_len(&fixed->filter, key, len) != 1) {
+        if (fixed->reject_full) return -ENOSPC;
+        if (!fixed->warned) {
+            fixed->warned = 1;
+            syslog(LOG_WARNING, "Fixed filter is full at %llu items, false positives will increase.",
+                    (unsigned long long)fixed->capacity);
+        }
+    }
+    return bf_add_len(&fixed->filter, key, len);
+}
+
+/**
+ * Full filters take the exclusive path, so that the rejections
+ * and warnings are handled in one place.
+ */
+static int fixed_engine_add_concurrent(void *engine, const char *key, uint64_t len) {
+    fixed_engine *fixed = engine;
+    bloom_bloomfilter *filter = &fixed->filter;
+    if (filter->layout == LAYOUT_COUNTING || filter->layout == LAYOUT_CUCKOO ||
+            bf_size(filter) >= fixed->capacity) {
+        return -EAGAIN;
+    }
+
+    uint32_t k_num = (filter->header->k_num > 4) ? filter->header->k_num : 4;
+    uint64_t *hashes = alloca(k_num * sizeof(uint64_t));
+    bf_compute_hashes_len(filter->header->hash_family, k_num, key, len, hashes);
+    return bf_add_hashed_atomic(filter, hashes);
+}
+
+/**
+ * Large batches are set in address order. Batches that could fill
+ * the filter are added in turn, to reject or warn at the right key.
+ */
+static int fixed_engine_add_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    fixed_engine *fixed = engine;
+    bloom_bloomfilter *filter = &fixed->filter;
+    if (num_keys < BLOOM_BATCH_MIN || filter->layout == LAYOUT_COUNTING ||
+            filter->layout == LAYOUT_CUCKOO || bf_size(filter) + num_keys > fixed->capacity) {
+        return -EAGAIN;
+    }
+
+    uint32_t k_num = (filter->header->k_num > 4) ? filter->header->k_num : 4;
+    uint64_t *hashes = malloc((uint64_t)num_keys * k_num * sizeof(uint64_t));
+    if (!hashes) return -ENOMEM;
+    for (int i=0; i < num_keys; i++) {
+        bf_compute_hashes_len(filter->header->hash_family, k_num, keys[i],
+                (key_lens) ? key_lens[i] : strlen(keys[i]), hashes + (uint64_t)i * k_num);
+    }
+    int res = bf_add_batch_hashed(filter, hashes, k_num, num_keys, results);
+    free(hashes);
+    return (res < 0) ? res : 0;
+}
+
+/**
+ * A rejecting filter has room for a batch if it has room for each
+ * key of the batch that is not present. A key that repeats in the
+ * batch is counted each time, so the batch is never rejected midway.
+ */
+static int fixed_engine_fits(void *engine, char **keys, uint64_t *key_lens, int num_keys) {
+    fixed_engine *fixed = engine;
+    bloom_bloomfilter *filter = &fixed->filter;
+    uint64_t size = bf_size(filter);
+    if (!fixed->reject_full || size + num_keys <= fixed->capacity) return 1;
+    for (int i=0; i < num_keys; i++) {
+        if (bf_contains_len(filter, keys[i], (key_lens) ? key_lens[i] : strlen(keys[i])) == 1) continue;
+        if (++size > fixed->capacity) return 0;
+    }
+    return 1;
+}
+
+static int fixed_engine_remove(void *engine, const char *key, uint64_t len) {
+    fixed_engine *fixed = engine;
+    return bf_remove_len(&fixed->filter, key, len);
+}
+
+static int fixed_engine_contains(void *engine, const char *key, uint64_t len) {
+    fixed_engine *fixed = engine;
+    int res = bf_contains_len(&fixed->filter, key, len);
+    if (res == 1) fixed_count_hit(fixed);
+    return res;
+}
+
+static int fixed_engine_contains_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    fixed_engine *fixed = engine;
+    bloom_bloomfilter *filter = &fixed->filter;
+    uint32_t k_num = (filter->header->k_num > 4) ? filter->header->k_num : 4;
+    uint64_t *hashes = alloca(FIXED_BATCH_SIZE * k_num * sizeof(uint64_t));
+    int batch, i;
+
+    for (int start=0; start < num_keys; start += FIXED_BATCH_SIZE) {
+        batch = num_keys - start;
+        if (batch > FIXED_BATCH_SIZE) batch = FIXED_BATCH_SIZE;
+
+        // Hash all the keys and prefetch, then resolve the probes
+        for (i=0; i < batch; i++) {
+            bf_compute_hashes_len(filter->header->hash_family, k_num, keys[start + i],
+                    (key_lens) ? key_lens[start + i] : strlen(keys[start + i]), hashes + i * k_num);
+            bf_prefetch_hashed(filter, hashes + i * k_num);
+        }
+        for (i=0; i < batch; i++) {
+            results[start + i] = bf_contains_hashed(filter, hashes + i * k_num) == 1;
+            if (results[start + i]) fixed_count_hit(fixed);
+        }
+    }
+    return 0;
+}
+
+static int fixed_engine_contains_hashed(void *engine, bloom_key_hashes *hashes) {
+    fixed_engine *fixed = engine;
+    bloom_bloomfilter *filter = &fixed->filter;
+    uint32_t k_num = (filter->header->k_num > 4) ? filter->header->k_num : 4;
+    uint64_t *key_hashes = engine_key_hashes(hashes, filter->header->hash_family, k_num);
+    int res;
+    if (key_hashes) {
+        res = bf_contains_hashed(filter, key_hashes);
+    } else {
+        res = bf_contains_len(filter, hashes->key, hashes->len);
+    }
+    if (res == 1) fixed_count_hit(fixed);
+    return res;
+}
+
+static int fixed_engine_flush(void *engine) {
+    fixed_engine *fixed = engine;
+    return bf_flush(&fixed->filter);
+}
+
+static int fixed_engine_flush_async(void *engine, bloom_flusher *flusher, bloom_flush_cb cb, void *data) {
+    fixed_engine *fixed = engine;
+    return bitmap_flush_async(flusher, fixed->filter.map, cb, data);
+}
+
+static int fixed_engine_stage(void *engine) {
+    fixed_engine *fixed = engine;
+    return bitmap_stage(fixed->filter.map);
+}
+
+static int fixed_engine_close(void *engine) {
+    fixed_engine *fixed = engine;
+    bloom_bitmap *map = fixed->filter.map;
+    int res = bf_close(&fixed->filter);
+    free(map);
+    free(fixed);
+    return res;
+}
+
+static int fixed_engine_serialize(void *engine, bloom_engine_map_cb cb, void *data) {
+    fixed_engine *fixed = engine;
+    return cb(data, 0, fixed->filter.map);
+}
+
+static int fixed_engine_compact(void *engine, int *num) {
+    (void)engine;
+    (void)num;
+    return 0;
+}
+
+/**
+ * A fixed filter is folded like a layer of an SBF, if
+ * the folded filter is at most half full.
+ */
+static int fixed_engine_shrink(void *engine, double fp_probability, bloom_engine_fold_cb cb, void *data, int *num) {
+    fixed_engine *fixed = engine;
+    bloom_bloomfilter *filter = &fixed->filter;
+    uint32_t factor = bf_fold_factor(filter);
+    if (!factor || bf_size(filter) * 2 * factor > fixed->capacity) return 0;
+    if (bf_estimate_folded_fp_probability(filter) > fp_probability) return 0;
+
+    bloom_bitmap *map = calloc(1, sizeof(bloom_bitmap));
+    bloom_bloomfilter folded;
+    *num = 0;
+    int res = cb(data, 0, bf_folded_bytes(filter), map);
+    if (!res) {
+        res = bf_fold(filter, map, &folded);
+        if (!res) {
+            folded.header->capacity = fixed->capacity / factor;
+            res = bf_flush(&folded);
+        }
+        if (res) bitmap_close(map);
+    }
+    if (res) {
+        free(map);
+        return res;
+    }
+
+    // Close the old filter
+    bloom_bitmap *old_map = filter->map;
+    bf_close(filter);
+    free(old_map);
+    fixed->filter = folded;
+    fixed->capacity = folded.header->capacity;
+    fixed->warned = 0;
+    return 1;
+}
+
+static int fixed_engine_combine(void *engine, void *src, int intersect) {
+    fixed_engine *fixed = engine;
+    fixed_engine *other = src;
+    if (intersect) return bf_intersect(&fixed->filter, &other->filter);
+    int res = bf_merge(&fixed->filter, &other->filter);
+    if (!res) fixed->capacity += other->capacity;
+    return res;
+}
+
+static int fixed_engine_reset(void *engine) {
+    fixed_engine *fixed = engine;
+    int res = bf_clear(&fixed->filter);
+    fixed->hits = 0;
+    fixed->warned = 0;
+    return (res) ? res : 1;
+}
+
+static int fixed_engine_prepare(void *engine, double fill) {
+    (void)engine;
+    (void)fill;
+    return 0;
+}
+
+static int fixed_engine_rotate(void *engine, uint64_t now, uint64_t period) {
+    (void)engine;
+    (void)now;
+    (void)period;
+    return 0;
+}
+
+static int fixed_engine_reorder(void *engine, int apply) {
+    (void)engine;
+    (void)apply;
+    return 0;
+}
+
+static int fixed_engine_layer_hits(void *engine, uint64_t **hits) {
+    fixed_engine *fixed = engine;
+    *hits = &fixed->hits;
+    return 1;
+}
+
+/**
+ * Counts a hit, concurrent checks may lose some counts
+ */
+static inline void fixed_count_hit(fixed_engine *fixed) {
+    __atomic_store_n(&fixed->hits, __atomic_load_n(&fixed->hits, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t fixed_engine_size(void *engine) {
+    fixed_engine *fixed = engine;
+    return bf_size(&fixed->filter);
+}
+
+static uint64_t fixed_engine_estimate(void *engine) {
+    fixed_engine *fixed = engine;
+    return bf_estimate_size(&fixed->filter);
+}
+
+static uint64_t fixed_engine_capacity(void *engine) {
+    fixed_engine *fixed = engine;
+    return fixed->capacity;
+}
+
+static uint64_t fixed_engine_byte_size(void *engine) {
+    fixed_engine *fixed = engine;
+    return fixed->filter.map->size;
+}
+
+/**
+ * The layers of a frozen filter are read only, so every
+ * change is refused. Removes and concurrent adds share this.
+ */
+static int frozen_engine_add(void *engine, const char *key, uint64_t len) {
+    (void)engine;
+    (void)key;
+    (void)len;
+    return -EROFS;
+}
+
+static int frozen_engine_add_batch(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    (void)engine;
+    (void)keys;
+    (void)key_lens;
+    (void)num_keys;
+    (void)results;
+    return -EROFS;
+}
+
+static int frozen_engine_flush(void *engine) {
+    (void)engine;
+    return 0;
+}
+
+static int frozen_engine_flush_async(void *engine, bloom_flusher *flusher, bloom_flush_cb cb, void *data) {
+    (void)engine;
+    (void)flusher;
+    cb(data, 0);
+    return 0;
+}
+
+static int frozen_engine_stage(void *engine) {
+    (void)engine;
+    return 0;
+}
+
+static int frozen_engine_compact(void *engine, int *num) {
+    (void)engine;
+    (void)num;
+    return 0;
+}
+
+static int frozen_engine_shrink(void *engine, double fp_probability, bloom_engine_fold_cb cb, void *data, int *num) {
+    (void)engine;
+    (void)fp_probability;
+    (void)cb;
+    (void)data;
+    (void)num;
+    return -EROFS;
+}
+
+static int frozen_engine_combine(void *engine, void *src, int intersect) {
+    (void)engine;
+    (void)src;
+    (void)intersect;
+    return -EROFS;
+}
+
+static int frozen_engine_reset(void *engine) {
+    (void)engine;
+    return -EROFS;
+}
+
+static int frozen_engine_prepare(void *engine, double fill) {
+    (void)engine;
+    (void)fill;
+    return 0;
+}
+
+static int frozen_engine_rotate(void *engine, uint64_t now, uint64_t period) {
+    (void)engine;
+    (void)now;
+    (void)period;
+    return 0;
+}
+
+static int frozen_engine_reorder(void *engine, int apply) {
+    (void)engine;
+    (void)apply;
+    return 0;
+}
@@ -0,0 +1,238 @@
+#ifndef BLOOM_ENGINE_H
+#define BLOOM_ENGINE_H
+#include <stdint.h>
+#include "config.h"
+#include "sbf.h"
+#include "flusher.h"
+
+/**
+ * A filter engine is the data structure behind a bloom_filter.
+ * The filter only uses its engine through these operations, so
+ * each engine can specialize its paths, including the batch paths,
+ * without the filter branching on the engine type. The operations
+ * have the same thread safety as the bloomf_* method using them.
+ */
+
+/**
+ * Invoked by serialize for each bitmap of an engine.
+ * @arg data Opaque callback data
+ * @arg num The number of the data file holding the bitmap
+ * @arg map The bitmap
+ * @return 0 to continue, non-zero to stop.
+ */
+typedef int (*bloom_engine_map_cb)(void *data, int num, bloom_bitmap *map);
+
+/**
+ * The most hashes of a key that are shared between
+ * engines. An engine needing more hashes the key itself.
+ */
+#define ENGINE_MAX_HASHES 32
+
+/**
+ * The hashes of a key, shared by the checks of several
+ * engines. They are computed by the first engine to use
+ * them, and reused or extended by the engines of the same
+ * hash family. Set num_hashes to 0 for a new key.
+ */
+typedef struct {
+    const char *key;
+    uint64_t len;
+    bloom_hash_family family;
+    uint32_t num_hashes;                // Hashes computed, 0 if none
+    uint64_t hashes[ENGINE_MAX_HASHES];
+} bloom_key_hashes;
+
+/**
+ * Opens the bitmap of the summary of the layers, with the
+ * callback input. If the summary does not exist yet, it is
+ * created with the given bytes.
+ * @arg bytes The size of a new summary, 0 to not create one
+ * @return 1 if an existing summary was opened, 0 if one was created,
+ * -ENOENT if there is none and bytes is 0, negative on failure.
+ */
+typedef int (*bloom_engine_summary_cb)(void *data, uint64_t bytes, bloom_bitmap *out);
+
+/**
+ * Creates the bitmap a data file is folded into by shrink.
+ * @arg data Opaque callback data
+ * @arg num The number of the data file being folded
+ * @arg bytes The size of the folded bitmap
+ * @arg out The bitmap to setup, zeroed
+ * @return 0 on success, negative on failure.
+ */
+typedef int (*bloom_engine_fold_cb)(void *data, int num, uint64_t bytes, bloom_bitmap *out);
+
+/**
+ * Parameters used to open an engine
+ */
+typedef struct {
+    bloom_filter_config *config;    // Filter config, updated from existing data
+    bloom_sbf_callback callback;    // Allocates the bitmaps of new data files
+    void *callback_input;           // Opaque input for the callbacks
+    bloom_engine_summary_cb summary; // Opens the summary of the layers, or NULL for none
+    uint64_t summary_capacity;      // Keys a new summary is sized for, 0 to not create one
+} bloom_engine_params;
+
+/**
+ * The operations of an engine
+ */
+typedef struct {
+    const char *name;
+
+    /**
+     * Opens an engine over the existing data files.
+     * @arg params The parameters to use
+     * @arg num_maps The number of existing bitmaps
+     * @arg maps The existing bitmaps, in data file order. The engine
+     * owns them on success, and the caller must close them on failure.
+     * @arg engine Output, set to the new engine
+     * @return 0 on success, negative on failure.
+     */
+    int (*open)(bloom_engine_params *params, int num_maps, bloom_bitmap **maps, void **engine);
+
+    // Key operations, return 1 or 0 as the bloomf_* methods do. Keys have
+    // a length and need not be NUL terminated, key_lens may be NULL if
+    // they are.
+    int (*add)(void *engine, const char *key, uint64_t len);              // -ENOSPC if full and rejecting
+    int (*add_concurrent)(void *engine, const char *key, uint64_t len);   // -EAGAIN if exclusive access is needed
+    int (*add_batch)(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results); // 0, or -EAGAIN to add in turn
+    int (*fits)(void *engine, char **keys, uint64_t *key_lens, int num_keys); // 0 if rejecting a full filter would reject a key
+    int (*remove)(void *engine, const char *key, uint64_t len);           // -EINVAL if not supported
+    int (*contains)(void *engine, const char *key, uint64_t len);
+    int (*contains_batch)(void *engine, char **keys, uint64_t *key_lens, int num_keys, char *results);
+    int (*contains_hashed)(void *engine, bloom_key_hashes *hashes);
+
+    // Persistence, close also frees the engine
+    int (*flush)(void *engine);
+    int (*flush_async)(void *engine, bloom_flusher *flusher, bloom_flush_cb cb, void *data);
+    int (*close)(void *engine);
+
+    /**
+     * Cuts a consistent image of the engine, which the next flush
+     * writes while adds go on. Needs exclusive access.
+     * @return 0 on success, negative on failure.
+     */
+    int (*stage)(void *engine);
+
+    /**
+     * Visits each bitmap of the engine with its data file number,
+     * so that the data can be written out in another form.
+     * @return 0 on success, or the first non-zero callback result.
+     */
+    int (*serialize)(void *engine, bloom_engine_map_cb cb, void *data);
+
+    /**
+     * Merges a data file into another, so that checks probe less
+     * data. The merged data file is closed, and the data files
+     * after it are numbered one lower.
+     * @arg num Output, the number of the data file merged away
+     * @return 1 if a data file was merged, 0 if not, negative on failure.
+     */
+    int (*compact)(void *engine, int *num);
+
+    /**
+     * Folds a data file whose keys are far below its capacity
+     * into a smaller one, see bf_fold. The keys are all kept,
+     * at a higher false positive probability. The new bitmap is
+     * made durable, and replaces the old one, which is closed.
+     * Needs exclusive access.
+     * @arg fp_probability The probability the engine must stay within
+     * @arg cb Creates the bitmap of the folded data file
+     * @arg data Opaque data for the callback
+     * @arg num Output, the number of the data file folded
+     * @return 1 if a data file was folded, 0 if not, negative on
+     * failure. The bitmap of the callback is closed on failure.
+     */
+    int (*shrink)(void *engine, double fp_probability, bloom_engine_fold_cb cb, void *data, int *num);
+
+    /**
+     * Merges, or intersects, the keys of another engine of the
+     * same type into this one, in place. Needs exclusive access,
+     * and read access to the other engine.
+     * @arg src The engine to read, which is left as is
+     * @arg intersect Intersect the keys instead of merging them
+     * @return 0 on success, -EINVAL if the data does not line up,
+     * negative on failure.
+     */
+    int (*combine)(void *engine, void *src, int intersect);
+
+    /**
+     * Clears all the keys of the engine in place, closing the
+     * data it grew into. Needs exclusive access.
+     * @return The number of data files kept, which are the first
+     * ones, or negative on failure.
+     */
+    int (*reset)(void *engine);
+
+    /**
+     * Creates new data ahead of time, so that adds do not stall
+     * to grow the engine. Safe to call concurrently with adds
+     * and checks, but not with the other operations.
+     * @arg fill How full the engine gets before growing is prepared
+     * @return 1 if prepared, 0 if not needed, negative on failure.
+     */
+    int (*prepare)(void *engine, double fill);
+
+    /**
+     * Ages out the oldest keys of a windowed engine, once the
+     * newest generation is a period old. If several periods have
+     * passed, as many generations are recycled, up to all of them.
+     * Needs exclusive access.
+     * @arg now The current time, in seconds
+     * @arg period The seconds each generation covers
+     * @return The number of generations recycled, 0 if none or
+     * if the engine is not windowed, negative on failure.
+     */
+    int (*rotate)(void *engine, uint64_t now, uint64_t period);
+
+    /**
+     * Reorders the probes of checks by the observed hits of
+     * each layer, so that positive checks probe fewer layers.
+     * @arg apply If 0, only checks if the order would change, which
+     * is safe with adds and checks. Otherwise needs exclusive access.
+     * @return 1 if the order changes, 0 otherwise.
+     */
+    int (*reorder)(void *engine, int apply);
+
+    /**
+     * Returns the approximate number of checks found in each
+     * layer, with the newest layer first.
+     * @arg hits Output, set to the hits of the layers. Valid until
+     * the layers change.
+     * @return The number of layers.
+     */
+    int (*layer_hits)(void *engine, uint64_t **hits);
+
+    // Metrics
+    uint64_t (*size)(void *engine);
+    uint64_t (*estimate)(void *engine);   // Distinct keys, estimated from the bits set
+    uint64_t (*capacity)(void *engine);
+    uint64_t (*byte_size)(void *engine);
+} bloom_engine_ops;
+
+/**
+ * Returns the operations of an engine type.
+ * @arg type The engine type
+ * @return The operations, never NULL.
+ */
+const bloom_engine_ops* engine_ops(bloom_filter_engine type);
+
+/**
+ * Returns the hashes of a key for a hash family, computing
+ * them or extending the hashes already computed as needed.
+ * @arg hashes The shared hashes of the key
+ * @arg family The hash family needed
+ * @arg num_hashes The number of hashes needed, at least 4
+ * @return The hashes, or NULL if more than ENGINE_MAX_HASHES are needed.
+ */
+uint64_t* engine_key_hashes(bloom_key_hashes *hashes, bloom_hash_family family, uint32_t num_hashes);
+
+/**
+ * Returns the operations to use for a filter config. Filters
+ * that do not scale use a single filter, of any engine type.
+ * @arg config The filter config
+ * @return The operations, never NULL.
+ */
+const bloom_engine_ops* config_engine_ops(bloom_filter_config *config);
+
+#endif
@@ -1,15 +1,25 @@
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include <assert.h>
 #include "filter.h"
 #include "type_compat.h"
+#include "numa.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "delta.h"
+#include "probes.h"
+#include "slowlog.h"
 
 /*
  * Generates the folder name, given a filter name.
@@ -21,21 +31,192 @@ static const char* FILTER_FOLDER_NAME = "bloomd.%s";
  */
 static const char* DATA_FILE_NAME = "data.%03d.mmap";
 
+/**
+ * Format for the data files being folded by a shrink. They do
+ * not end in .mmap, so a fold that is cut short is not loaded.
+ */
+static const char* FOLD_FILE_NAME = "data.%03d.fold";
+
+/**
+ * Format for the compressed snapshots of cold data files.
+ */
+static const char* SNAPSHOT_FILE_NAME = "data.%03d.snap";
+
+/**
+ * The container of a filter, which holds all
+ * its layers if the filter uses one.
+ */
+static const char* CONTAINER_FILE_NAME = "data.pack";
+
+/**
+ * The summary of the keys of all the layers of a filter.
+ * It is not a data file, so it does not end in .mmap.
+ */
+static const char* SUMMARY_FILE_NAME = "summary.bits";
+
 /*
  * Generates the config file name
  */
 static const char* CONFIG_FILENAME = "config.ini";
 
+/**
+ * Generates the file name of a delta, given its epoch
+ */
+static const char* DELTA_FILE_NAME = "delta.%llu";
+
+/**
+ * Generates the folder name of a partition, in the
+ * folder of the partitioned filter.
+ */
+static const char* PARTITION_FOLDER_NAME = "part.%03d";
+
+/**
+ * Seeds the hash that picks the partition of a key, so that
+ * it is independent of the hashes the partitions set bits by.
+ */
+#define PARTITION_SEED 0x5bd1e9955bd1e995ULL
+
+// Hashes keys to partitions, provided by libbloom
+extern void WyHash128(const void *key, uint64_t len, uint64_t seed, uint64_t *out);
+
+#define KEY_LEN(keys, key_lens, i) ((key_lens) ? (key_lens)[i] : strlen((keys)[i]))
+
 /*
  * Static delarations
  */
 static int thread_safe_fault(bloom_filter *f);
 static int discover_existing_filters(bloom_filter *f);
-static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters);
-static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out);
+static int open_container(bloom_filter *f);
+static int restore_snapshots(bloom_filter *f);
+static int renumber_data_files(bloom_filter *f, struct dirent **namelist, int num);
+static int close_filter(bloom_filter *filter, int snapshot);
+static int snapshot_map(void *data, int num, bloom_bitmap *map);
+static int pack_map(void *data, int num, bloom_bitmap *map);
+static int pack_filter(bloom_filter *f);
+static int unpack_filter(bloom_filter *f);
+static void free_packed(bloom_filter *f);
+static int open_engine(bloom_filter *f, int num, bloom_bitmap **maps);
+static int bloomf_map_callback(void* in, uint64_t bytes, bloom_bitmap *out);
+static int bloomf_summary_callback(void *in, uint64_t bytes, bloom_bitmap *out);
+static int bloomf_fold_callback(void *in, int num, uint64_t bytes, bloom_bitmap *out);
+static char* data_file_path(bloom_filter *f, const char *format, int num);
 static int timediff_msec(struct timeval *t1, struct timeval *t2);
+static uint64_t timediff_usec(struct timeval *t1, struct timeval *t2);
+static int update_flush_config(bloom_filter *filter);
+static void write_filter_config(bloom_filter *filter);
+static bitmap_mode file_bitmap_mode(bloom_filter *f);
+static void place_bitmap(bloom_filter *f, bloom_bitmap *map);
+static void bloomf_flush_done(void *data, int res);
+static void count_mapped_bytes(bloom_filter *f, int64_t delta);
+static void report_io(bloom_filter *f);
+static void recount_mapped_bytes(bloom_filter *f);
+static filter_hot_state* hot_state(bloom_filter *f);
+static filter_counter_shard* counter_shard(bloom_filter *f);
+static int replay_wal(bloom_filter *f, void *engine);
+static void replay_wal_cb(void *data, const char *key, uint32_t len);
+static void track_bitmap(bloom_filter *f, bloom_bitmap *map);
+static int delta_map_cb(void *data, int num, bloom_bitmap *map);
+static void restore_page_cb(void *data, uint32_t layer, uint64_t offset, const unsigned char *bytes, uint32_t len);
+static uint64_t realtime_usec(void);
+static void publish_layers(bloom_filter *f);
+static int tiered(bloom_filter *f);
+static int seal_map_cb(void *data, int num, bloom_bitmap *map);
+static int resident_map_cb(void *data, int num, bloom_bitmap *map);
+static int dirty_map_cb(void *data, int num, bloom_bitmap *map);
+static int writeback_map_cb(void *data, int num, bloom_bitmap *map);
+static void alloc_parts(bloom_filter *f);
+static int fault_parts(bloom_filter *f);
+static int flush_parts(bloom_filter *f, bloom_flusher *flusher);
+static int close_parts(bloom_filter *f, int snapshot);
+static uint64_t sum_parts(bloom_filter *f, uint64_t (*metric)(bloom_filter*));
+static int key_part(bloom_filter *f, const char *key, uint64_t len);
+static int* group_parts(bloom_filter *f, char **keys, uint64_t *key_lens, int num_keys, int *starts);
+static void renew_generation(bloom_filter *f);
+static int positive_cached(bloom_filter *f);
+static int contains_batch(bloom_filter *filter, char **keys, uint64_t *key_lens, int num_keys, char *results);
+
+/**
+ * The most shards of the counters of a filter
+ */
+#define MAX_COUNTER_SHARDS 16
+
+/**
+ * Adds to a counter of a filter, in the shard of the calling thread.
+ * Atomic, since threads share a shard once there are more than shards.
+ */
+#define COUNT(filter, field, delta) \
+    __atomic_fetch_add(&counter_shard(filter)->counters.field, (delta), __ATOMIC_RELAXED)
+
+// The counter shard index of the calling thread, plus 1. 0 until assigned.
+static __thread unsigned int COUNTER_THREAD = 0;
+static unsigned int NEXT_COUNTER_THREAD = 0;
+
+// The next filter generation. Generations are never reused,
+// so a generation also names the filter it was taken by.
+static uint64_t NEXT_GENERATION = 1;
+
+/**
+ * A positive check remembered by the positive cache
+ */
+typedef struct {
+    uint64_t generation;    // The generation of the filter, 0 if unused
+    uint64_t hash;          // The hash of the key
+} positive_entry;
+
+// The direct-mapped positive cache of the calling thread,
+// allocated on first use and never freed
+static __thread positive_entry *POSITIVE_CACHE = NULL;
+static __thread uint64_t POSITIVE_MASK = 0;
+
+/**
+ * Tracks the snapshots written or packed by a cold unmap
+ */
+typedef struct {
+    bloom_filter *filter;
+    char **data_paths;      // Data files that were snapshotted
+    int num_paths;
+    int err;
+} snapshot_state;
+
+/**
+ * Tracks an asynchronous flush of a filter
+ */
+typedef struct {
+    bloom_filter *filter;
+    struct timeval start;
+} async_flush;
+
+/**
+ * Passed through the replay of a write-ahead log
+ */
+typedef struct {
+    bloom_filter *filter;
+    void *engine;
+} wal_replay_state;
+
+/**
+ * Collects the bitmaps of a filter for a delta
+ */
+typedef struct {
+    uint32_t *nums;
+    bloom_bitmap **maps;
+    uint32_t num_maps;
+    uint32_t capacity;
+} delta_maps;
+
+/**
+ * Passed through the read of a delta being restored
+ */
+typedef struct {
+    char *full_path;        // Folder of the filter
+    int *fds;               // Data files, by number, or -1
+    uint32_t num_fds;
+    int err;
+} restore_state;
 
 static int filter_out_special(CONST_DIRENT_T *d);
+static int filter_data_files(CONST_DIRENT_T *d);
+static bloom_filter* alloc_filter(bloom_config *config, char *filter_name);
 
 /**
  * Initializes a bloom filter wrapper.
@@ -47,50 +228,39 @@ static int filter_out_special(CONST_DIRENT_T *d);
  * @return 0 on success
  */
 int init_bloom_filter(bloom_config *config, char *filter_name, int discover, bloom_filter **filter) {
-    // Allocate the buffers
-    bloom_filter *f = *filter = calloc(1, sizeof(bloom_filter));
-
-    // Store the things
-    f->config = config;
-    f->filter_name = strdup(filter_name);
-
-    // Copy filter configs
-    f->filter_config.initial_capacity = config->initial_capacity;
-    f->filter_config.capacity = config->initial_capacity;
-    f->filter_config.default_probability = config->default_probability;
-    f->filter_config.scale_size = config->scale_size;
-    f->filter_config.probability_reduction = config->probability_reduction;
-    f->filter_config.in_memory = config->in_memory;
-
-    // Get the folder name
-    char *folder_name = NULL;
-    int res;
-    res = asprintf(&folder_name, FILTER_FOLDER_NAME, f->filter_name);
-    assert(res != -1);
-
-    // Compute the full path
-    f->full_path = join_path(config->data_dir, folder_name);
-    free(folder_name);
-
-    // Initialize the locks
-    INIT_BLOOM_SPIN(&f->counter_lock);
-    pthread_mutex_init(&f->sbf_lock, NULL);
+    bloom_filter *f = *filter = alloc_filter(config, filter_name);
 
     // Try to create the folder path
-    res = mkdir(f->full_path, 0755);
+    int res = mkdir(f->full_path, 0755);
     if (res && errno != EEXIST) {
         syslog(LOG_ERR, "Failed to create filter directory '%s'. Err: %d [%d]", f->full_path, res, errno);
         return res;
     }
 
-    // Read in the filter_config
+    // Read in the filter_config. The configs of filters from
+    // before partitions do not have them.
+    int partitions = f->filter_config.partitions;
+    f->filter_config.partitions = 1;
     char *config_name = join_path(f->full_path, (char*)CONFIG_FILENAME);
     res = filter_config_from_filename(config_name, &f->filter_config);
     free(config_name);
+    if (res == -ENOENT) f->filter_config.partitions = partitions;
     if (res && res != -ENOENT) {
         syslog(LOG_ERR, "Failed to read filter '%s' configuration. Err: %d [%d]", f->filter_name, res, errno);
         return res;
     }
+    f->ops = config_engine_ops(&f->filter_config);
+
+    // The partitions take their sizes from their own configs
+    if (f->filter_config.partitions > 1) {
+        alloc_parts(f);
+        for (int i=0; i < f->filter_config.partitions; i++) {
+            config_name = join_path(f->parts[i]->full_path, (char*)CONFIG_FILENAME);
+            filter_config_from_filename(config_name, &f->parts[i]->filter_config);
+            free(config_name);
+            f->parts[i]->ops = config_engine_ops(&f->parts[i]->filter_config);
+        }
+    }
 
     // Discover the existing filters if we need to
     res = 0;
@@ -110,30 +280,134 @@ int init_bloom_filter(bloom_config *config, char *filter_name, int discover, blo
     return res;
 }
 
+/**
+ * Initializes a proxied bloom filter wrapper from a known filter
+ * config, as recorded in the catalog. Neither the folder nor the
+ * config file of the filter are touched until it is faulted in.
+ * @arg config The configuration to use
+ * @arg filter_name The name of the filter
+ * @arg filter_config The filter config of the filter
+ * @arg filter Output parameter, the new filter
+ * @return 0 on success
+ */
+int init_cataloged_filter(bloom_config *config, char *filter_name, bloom_filter_config *filter_config, bloom_filter **filter) {
+    bloom_filter *f = *filter = alloc_filter(config, filter_name);
+    f->filter_config = *filter_config;
+    f->ops = config_engine_ops(&f->filter_config);
+    if (f->filter_config.partitions > 1) alloc_parts(f);
+    return 0;
+}
+
+/**
+ * Allocates a proxied filter, with the filter config
+ * taken from the defaults of the configuration.
+ */
+static bloom_filter* alloc_filter(bloom_config *config, char *filter_name) {
+    // Allocate the buffers
+    bloom_filter *f = calloc(1, sizeof(bloom_filter));
+
+    // Store the things
+    f->config = config;
+    f->filter_name = strdup(filter_name);
+    f->generation = __atomic_fetch_add(&NEXT_GENERATION, 1, __ATOMIC_RELAXED);
+
+    // Copy filter configs
+    f->filter_config.initial_capacity = config->initial_capacity;
+    f->filter_config.capacity = config->initial_capacity;
+    f->filter_config.default_probability = config->default_probability;
+    f->filter_config.scale_size = config->scale_size;
+    f->filter_config.probability_reduction = config->probability_reduction;
+    f->filter_config.in_memory = config->in_memory;
+    f->filter_config.counting = config->counting;
+    f->filter_config.engine = config->engine_type;
+    f->filter_config.window = config->window;
+    f->filter_config.generations = config->generations;
+    f->filter_config.scalable = config->scalable;
+    f->filter_config.reject_full = config->reject_full;
+    f->filter_config.container = config->container;
+    f->filter_config.partitions = config->partitions;
+    f->filter_config.pin = config->pin;
+    f->filter_config.optimize = config->optimize_type;
+    f->filter_config.hashed = config->hashed;
+    f->flushed_at = time(NULL);
+
+    // Epochs follow the clock, so they keep increasing across restarts
+    f->epoch = f->layout_epoch = realtime_usec();
+
+    // Pick the home node of the filter
+    f->numa_node = -1;
+    if (config->numa_policy == NUMA_PER_FILTER) {
+        f->numa_node = numa_filter_node(f->filter_name, numa_num_nodes());
+    }
+
+    // Get the folder name
+    char *folder_name = NULL;
+    int res;
+    res = asprintf(&folder_name, FILTER_FOLDER_NAME, f->filter_name);
+    assert(res != -1);
+
+    // Compute the full path
+    f->full_path = join_path(config->data_dir, folder_name);
+    free(folder_name);
+
+    // Initialize the locks
+    pthread_mutex_init(&f->engine_lock, NULL);
+    return f;
+}
+
 /**
  * Destroys a bloom filter
  * @arg filter The filter to destroy
  * @return 0 on success
  */
 int destroy_bloom_filter(bloom_filter *filter) {
-    // Close first
+    // Close first, a cold in-memory filter only has its packed layers
     bloomf_close(filter);
+    free_packed(filter);
+
+    // Destroy the partitions
+    for (int i=0; filter->parts && i < filter->filter_config.partitions; i++) {
+        destroy_bloom_filter(filter->parts[i]);
+        pthread_rwlock_destroy(filter->part_locks + i);
+    }
+    free(filter->parts);
+    free(filter->part_locks);
 
     // Cleanup
     free(filter->filter_name);
     free(filter->full_path);
+    free(filter->hot);
     free(filter);
     return 0;
 }
 
 /**
- * Gets the counters that belong to a filter
+ * Gets the counters that belong to a filter, summed
+ * over the counters of all the threads.
  * @notes Thread safe, but may be inconsistent.
  * @arg filter The filter
- * @return A reference to the counters of a filter
+ * @arg counters Output, the counters of the filter
  */
-filter_counters* bloomf_counters(bloom_filter *filter) {
-    return &filter->counters;
+void bloomf_counters(bloom_filter *filter, filter_counters *counters) {
+    uint64_t *out = (uint64_t*)counters, *in = (uint64_t*)&filter->cold_counters;
+    for (size_t j=0; j < sizeof(filter_counters) / sizeof(uint64_t); j++)
+        out[j] = __atomic_load_n(in + j, __ATOMIC_RELAXED);
+
+    filter_hot_state *hot = __atomic_load_n(&filter->hot, __ATOMIC_ACQUIRE);
+    for (int i=0; hot && i <= hot->counter_mask; i++) {
+        in = (uint64_t*)&hot->counter_shards[i].counters;
+        for (size_t j=0; j < sizeof(filter_counters) / sizeof(uint64_t); j++)
+            out[j] += __atomic_load_n(in + j, __ATOMIC_RELAXED);
+    }
+
+    // The keys are counted by the partitions
+    filter_counters part;
+    for (int i=0; filter->parts && i < filter->filter_config.partitions; i++) {
+        bloomf_counters(filter->parts[i], &part);
+        in = (uint64_t*)&part;
+        for (size_t j=0; j < sizeof(filter_counters) / sizeof(uint64_t); j++)
+            out[j] += in[j];
+    }
 }
 
 /**
@@ -143,7 +417,25 @@ filter_counters* bloomf_counters(bloom_filter *filter) {
  * @return 0 if in-memory, 1 if proxied.
  */
 int bloomf_is_proxied(bloom_filter *filter) {
-    return !(filter->sbf);
+    if (filter->parts) {
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if (!filter->parts[i]->engine) return 1;
+        }
+        return 0;
+    }
+    return !(filter->engine);
+}
+
+/**
+ * Faults in a proxied filter, so that the next
+ * operation on it does not wait on the disk.
+ * Idempotent if the filter is in memory.
+ * @notes Thread safe.
+ * @arg filter The filter to fault in
+ * @return 0 on success.
+ */
+int bloomf_fault(bloom_filter *filter) {
+    return thread_safe_fault(filter);
 }
 
 /**
@@ -153,40 +445,38 @@ int bloomf_is_proxied(bloom_filter *filter) {
  * @return 0 on success.
  */
 int bloomf_flush(bloom_filter *filter) {
+    if (filter->parts) return flush_parts(filter, NULL);
+
     // Only do things if we are non-proxied
-    if (filter->sbf) {
+    if (filter->engine) {
         // Time how long this takes
         struct timeval start, end;
         gettimeofday(&start, NULL);
 
         // If our size has not changed, there is no need to flush
-        uint64_t new_size = bloomf_size(filter);
-        if (new_size == filter->filter_config.size && filter->filter_config.bytes != 0) {
+        int staged = filter->staged;
+        if (!update_flush_config(filter)) {
+            if (staged && filter->wal) wal_checkpoint_end(filter->wal, 0);
             return 0;
         }
 
-        // Store our properties for a future unmap
-        filter->filter_config.size = new_size;
-        filter->filter_config.capacity = bloomf_capacity(filter);
-        filter->filter_config.bytes = bloomf_byte_size(filter);
-
-        // Write out filter_config
-        char *config_name = join_path(filter->full_path, (char*)CONFIG_FILENAME);
-        int res = update_filename_from_filter_config(config_name, &filter->filter_config);
-        free(config_name);
-        if (res) {
-            syslog(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
-                    filter->filter_name, res);
-        }
-
-        // Flush the filter
-        res = 0;
+        // Flush the filter. The log is moved aside first, since
+        // the flush covers the keys recorded so far. A cut moved
+        // it aside already, with the keys the cut covers.
+        int res = 0;
         if (!filter->filter_config.in_memory) {
-            res = sbf_flush((bloom_sbf*)filter->sbf);
+            BLOOM_PROBE1(flush__start, filter->filter_name);
+            if (filter->wal && !staged) wal_checkpoint_begin(filter->wal);
+            res = filter->ops->flush(filter->engine);
+            if (filter->wal) wal_checkpoint_end(filter->wal, res);
+            BLOOM_PROBE2(flush__done, filter->filter_name, res);
         }
 
         // Compute the elapsed time
         gettimeofday(&end, NULL);
+        hist_record(&hot_state(filter)->flush_latency, timediff_usec(&start, &end));
+        if (!res) COUNT(filter, flushes, 1);
+        report_io(filter);
         syslog(LOG_INFO, "Flushed filter '%s'. Total time: %d msec.",
                 filter->filter_name, timediff_msec(&start, &end));
         return res;
@@ -195,191 +485,1782 @@ int bloomf_flush(bloom_filter *filter) {
 }
 
 /**
- * Gracefully closes a bloom filter.
- * @arg filter The filter to close
+ * Cuts a consistent image of the filter for the next
+ * flush. No sets may run during the call.
+ * @arg filter The filter to cut
  * @return 0 on success.
  */
-int bloomf_close(bloom_filter *filter) {
-    // Acquire lock
-    pthread_mutex_lock(&filter->sbf_lock);
-
-    // Only act if we are non-proxied
-    if (filter->sbf) {
-        bloomf_flush(filter);
-
-        bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
-        filter->sbf = NULL;
+int bloomf_stage(bloom_filter *filter) {
+    if (filter->parts) {
+        int res = 0;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            res |= bloomf_stage(filter->parts[i]);
+        }
+        return res;
+    }
 
-        sbf_close(sbf);
-        free(sbf);
+    // Only cut filters with data files, that changed
+    if (!filter->engine || filter->filter_config.in_memory || filter->staged) return 0;
+    uint64_t size = bloomf_size(filter);
+    if (size == filter->filter_config.size && filter->filter_config.bytes != 0) return 0;
 
-        filter->counters.page_outs += 1;
+    // Pages the cut misses are written by the next flush instead
+    int res = filter->ops->stage(filter->engine);
+    if (res) {
+        syslog(LOG_ERR, "Failed to cut filter '%s' for a flush. Err: %d.",
+                filter->filter_name, res);
+        return res;
     }
 
-    // Release lock
-    pthread_mutex_unlock(&filter->sbf_lock);
+    // The new log starts with the sets after the cut
+    if (filter->wal) wal_checkpoint_begin(filter->wal);
+    filter->staged_size = size;
+    filter->staged = 1;
     return 0;
 }
 
 /**
- * Deletes the bloom filter with
- * extreme prejudice.
- * @arg filter The filter to delete
+ * Starts an asynchronous flush of the filter. Idempotent
+ * if the filter is proxied or not dirty.
+ * @arg filter The filter to flush
+ * @arg flusher The flusher to use
  * @return 0 on success.
  */
-int bloomf_delete(bloom_filter *filter) {
-    // Close first
-    bloomf_close(filter);
-
-    // Delete the files
-    struct dirent **namelist = NULL;
-    int num;
+int bloomf_flush_async(bloom_filter *filter, bloom_flusher *flusher) {
+    if (filter->parts) return flush_parts(filter, flusher);
 
-    // Filter only data dirs, in sorted order
-    num = scandir(filter->full_path, &namelist, filter_out_special, NULL);
-    syslog(LOG_INFO, "Deleting %d files for filter %s.", num, filter->filter_name);
+    // Only do things if we are non-proxied
+    if (!filter->engine) return 0;
 
-    // Free the memory associated with scandir
-    for (int i=0; i < num; i++) {
-        char *file_path = join_path(filter->full_path, namelist[i]->d_name);
-        syslog(LOG_INFO, "Deleting: %s.", file_path);
-        if (unlink(file_path)) {
-            syslog(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
-        }
-        free(file_path);
+    // If our size has not changed, there is no need to flush
+    int staged = filter->staged;
+    if (!update_flush_config(filter) || filter->filter_config.in_memory) {
+        if (staged && filter->wal) wal_checkpoint_end(filter->wal, 0);
+        return 0;
     }
 
-    // Free the memory associated with scandir
-    for (int i=0; i < num; i++) {
-        free(namelist[i]);
-    }
-    if (namelist)
-        free(namelist);
+    async_flush *flush = malloc(sizeof(async_flush));
+    flush->filter = filter;
+    gettimeofday(&flush->start, NULL);
 
-    // Delete the directory
-    if (rmdir(filter->full_path)) {
-        syslog(LOG_ERR, "Failed to delete: %s. %s", filter->full_path, strerror(errno));
+    // Hold off closing the filter until the flush is done
+    __atomic_add_fetch(&filter->flushes_inflight, 1, __ATOMIC_ACQ_REL);
+    BLOOM_PROBE1(flush__start, filter->filter_name);
+    if (filter->wal && !staged) wal_checkpoint_begin(filter->wal);
+    int res = filter->ops->flush_async(filter->engine, flusher, bloomf_flush_done, flush);
+    if (res) {
+        BLOOM_PROBE2(flush__done, filter->filter_name, res);
+        if (filter->wal) wal_checkpoint_end(filter->wal, res);
+        __atomic_sub_fetch(&filter->flushes_inflight, 1, __ATOMIC_ACQ_REL);
+        free(flush);
     }
-
-    return 0;
+    return res;
 }
 
 /**
- * Checks if the filter contains a given key
- * @note Thread safe, as long as bloomf_add is not invoked.
- * @arg filter The filter to check
- * @arg key The key to check
- * @return 0 if not contained, 1 if contained.
+ * Invoked by the flusher once a filter is flushed
  */
-int bloomf_contains(bloom_filter *filter, char *key) {
-    if (!filter->sbf) {
-        if (thread_safe_fault(filter) != 0) return -1;
-    }
+static void bloomf_flush_done(void *data, int res) {
+    async_flush *flush = data;
+    bloom_filter *filter = flush->filter;
 
-    // Check the SBF
-    int res = sbf_contains((bloom_sbf*)filter->sbf, key);
-
-    // Safely update the counters
-    LOCK_BLOOM_SPIN(&filter->counter_lock);
-    if (res == 1)
-        filter->counters.check_hits += 1;
-    else if (res == 0)
-        filter->counters.check_misses += 1;
-    UNLOCK_BLOOM_SPIN(&filter->counter_lock);
+    // Compute the elapsed time
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    if (res) {
+        syslog(LOG_ERR, "Failed to flush filter '%s'. Err: %d.", filter->filter_name, res);
+    } else {
+        hist_record(&hot_state(filter)->flush_latency, timediff_usec(&flush->start, &end));
+        COUNT(filter, flushes, 1);
+        syslog(LOG_INFO, "Flushed filter '%s'. Total time: %d msec.",
+                filter->filter_name, timediff_msec(&flush->start, &end));
+    }
+    report_io(filter);
+    free(flush);
+    BLOOM_PROBE2(flush__done, filter->filter_name, res);
 
-    return res;
+    // The log is closed only once the flushes are done
+    if (filter->wal) wal_checkpoint_end(filter->wal, res);
+    __atomic_sub_fetch(&filter->flushes_inflight, 1, __ATOMIC_ACQ_REL);
 }
 
 /**
- * Adds a key to the given filter
- * @arg filter The filter to add to
- * @arg key The key to add
- * @return 0 if not added, 1 if added.
+ * Writes out and syncs the write-ahead log of the filter,
+ * if it has one. Skipped if the filter is being faulted
+ * in or closed, which sync the log themselves.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @return 0 on success.
  */
-int bloomf_add(bloom_filter *filter, char *key) {
-    if (!filter->sbf) {
-        if (thread_safe_fault(filter) != 0) return -1;
+int bloomf_sync_wal(bloom_filter *filter) {
+    if (filter->parts) {
+        int res = 0;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if (bloomf_sync_wal(filter->parts[i])) res = -1;
+        }
+        return res;
     }
+    if (!filter->wal) return 0;
 
-    // Add the SBF
-    int res = sbf_add((bloom_sbf*)filter->sbf, key);
-
-    // Safely update the counters
-    LOCK_BLOOM_SPIN(&filter->counter_lock);
-    if (res == 1)
-        filter->counters.set_hits += 1;
-    else if (res == 0)
-        filter->counters.set_misses += 1;
-    UNLOCK_BLOOM_SPIN(&filter->counter_lock);
-
+    // The lock keeps the log from being closed
+    if (pthread_mutex_trylock(&filter->engine_lock)) return 0;
+    int res = 0;
+    if (filter->wal) res = wal_sync(filter->wal);
+    pthread_mutex_unlock(&filter->engine_lock);
     return res;
 }
 
 /**
- * Gets the size of the filter in keys
- * @note Thread safe.
- * @arg filter The filter to check
- * @return The total size of the filter
+ * Starts the writeback of the dirty pages of the
+ * filter that are mapped from its data files.
+ * @arg filter The filter
+ * @return 0 on success.
  */
-uint64_t bloomf_size(bloom_filter *filter) {
-    if (filter->sbf) {
-        return sbf_size((bloom_sbf*)filter->sbf);
-    } else {
-        return filter->filter_config.size;
+int bloomf_writeback(bloom_filter *filter) {
+    if (filter->parts) {
+        int res = 0;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            pthread_rwlock_rdlock(filter->part_locks + i);
+            if (bloomf_writeback(filter->parts[i])) res = -1;
+            pthread_rwlock_unlock(filter->part_locks + i);
+        }
+        return res;
     }
+    if (!filter->engine || filter->filter_config.in_memory || filter->filter_config.frozen) return 0;
+
+    // The lock keeps the maps from being closed, a filter
+    // being faulted in is left for the next pass
+    if (pthread_mutex_trylock(&filter->engine_lock)) return 0;
+    int res = 0;
+    if (filter->engine) res = filter->ops->serialize(filter->engine, writeback_map_cb, filter);
+    pthread_mutex_unlock(&filter->engine_lock);
+    return res;
 }
 
 /**
- * Gets the maximum capacity of the filter
- * @note Thread safe.
- * @arg filter The filter to check
- * @return The total capacity of the filter
+ * Updates and writes out the filter config if the
+ * filter changed since the last flush.
+ * @return 1 if the filter needs to be flushed, 0 otherwise.
  */
-uint64_t bloomf_capacity(bloom_filter *filter) {
-    if (filter->sbf) {
-        return sbf_total_capacity((bloom_sbf*)filter->sbf);
-    } else {
-        return filter->filter_config.capacity;
+static int update_flush_config(bloom_filter *filter) {
+    // If our size has not changed, there is no need to flush.
+    // A cut is flushed with the size it had.
+    uint64_t new_size = (filter->staged) ? filter->staged_size : bloomf_size(filter);
+    filter->staged = 0;
+    if (new_size == filter->filter_config.size && filter->filter_config.bytes != 0) {
+        return 0;
     }
+
+    // Store our properties for a future unmap
+    filter->flushed_at = time(NULL);
+    filter->filter_config.size = new_size;
+    filter->filter_config.capacity = bloomf_capacity(filter);
+    filter->filter_config.bytes = bloomf_byte_size(filter);
+    write_filter_config(filter);
+    return 1;
 }
 
 /**
- * Gets the current byte size of the filter
- * @note Thread safe.
- * @arg filter The filter
- * @return The total byte size of the filter
+ * Writes out the filter config, and records it in the catalog
  */
-uint64_t bloomf_byte_size(bloom_filter *filter) {
-    if (filter->sbf) {
-        return sbf_total_byte_size((bloom_sbf*)filter->sbf);
-    } else {
-        return filter->filter_config.bytes;
+static void write_filter_config(bloom_filter *filter) {
+    char *config_name = join_path(filter->full_path, (char*)CONFIG_FILENAME);
+    int res = update_filename_from_filter_config(config_name, &filter->filter_config);
+    free(config_name);
+    if (res) {
+        syslog(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
+                filter->filter_name, res);
+    }
+    if (filter->catalog) {
+        catalog_add(filter->catalog, filter->filter_name, &filter->filter_config);
     }
 }
 
 /**
- * Provides a thread safe faulting of filters.
- * The main use case of this is to allow
+ * Gracefully closes a bloom filter.
+ * @arg filter The filter to close
+ * @return 0 on success.
+ */
+int bloomf_close(bloom_filter *filter) {
+    return close_filter(filter, 0);
+}
+
+/**
+ * Closes a filter that has gone cold. If cold snapshots
+ * are enabled, the data files are replaced with compressed
+ * snapshots, which are restored on the next fault. The
+ * layers of an in-memory filter are packed into memory.
+ * @arg filter The filter to unmap
+ * @return 0 on success.
+ */
+int bloomf_unmap(bloom_filter *filter) {
+    return close_filter(filter, filter->config->cold_snapshots);
+}
+
+/**
+ * Closes the filter, optionally snapshotting the data files
+ */
+static int close_filter(bloom_filter *filter, int snapshot) {
+    renew_generation(filter);
+    if (filter->parts) return close_parts(filter, snapshot);
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->engine_lock);
+
+    // Wait for any asynchronous flushes, they use the maps
+    while (__atomic_load_n(&filter->flushes_inflight, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    // An in-memory filter that cannot be packed stays mapped,
+    // since it has no data files to fault in from
+    if (filter->engine && snapshot && filter->filter_config.in_memory && pack_filter(filter)) {
+        pthread_mutex_unlock(&filter->engine_lock);
+        return -1;
+    }
+
+    // Only act if we are non-proxied
+    if (filter->engine) {
+        int res = bloomf_flush(filter);
+
+        void *engine = filter->engine;
+        filter->engine = NULL;
+
+        // Snapshot the bitmaps while they are still mapped. The
+        // layers of a container are not snapshotted.
+        snapshot_state state = {filter, NULL, 0, 0};
+        if (snapshot && !filter->container && !filter->filter_config.in_memory) {
+            filter->ops->serialize(engine, snapshot_map, &state);
+        }
+
+        // The bitmaps share the file of the container, so it is closed last
+        filter->ops->close(engine);
+        if (filter->container) {
+            container_close(filter->container);
+            filter->container = NULL;
+        }
+
+        // The log is not needed once the filter is flushed
+        if (filter->wal) {
+            wal_close(filter->wal, !res);
+            filter->wal = NULL;
+        }
+
+        // The snapshots replace the data files
+        for (int i=0; i < state.num_paths; i++) {
+            if (unlink(state.data_paths[i])) {
+                syslog(LOG_ERR, "Failed to delete: %s. %s", state.data_paths[i], strerror(errno));
+            }
+            free(state.data_paths[i]);
+        }
+        free(state.data_paths);
+
+        COUNT(filter, page_outs, 1);
+        stats_add(STAT_PAGE_OUTS, 1);
+        report_io(filter);
+        stats_add(STAT_MAPPED_FILTERS, -1);
+        count_mapped_bytes(filter, -__atomic_load_n(&filter->mapped_bytes, __ATOMIC_RELAXED));
+    }
+
+    // Release lock
+    pthread_mutex_unlock(&filter->engine_lock);
+    return 0;
+}
+
+/**
+ * Compacts a filter, merging its data files where the
+ * engine allows it, so that checks probe less data.
+ * @arg filter The filter to compact
+ * @return The number of data files merged away, negative on failure.
+ */
+int bloomf_compact(bloom_filter *filter) {
+    if (filter->parts) {
+        int merged = 0, res;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if ((res = bloomf_compact(filter->parts[i])) < 0) return res;
+            merged += res;
+        }
+        return merged;
+    }
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->engine_lock);
+
+    // Wait for any asynchronous flushes, they use the maps
+    while (__atomic_load_n(&filter->flushes_inflight, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    int merged = 0, res = 0, num;
+    while (filter->engine && (res = filter->ops->compact(filter->engine, &num)) == 1) {
+        syslog(LOG_INFO, "Merged data file %d of filter %s.", num, filter->filter_name);
+        merged++;
+        COUNT(filter, compactions, 1);
+        if (filter->filter_config.in_memory) continue;
+
+        // Drop the merged layer from the container, the table keeps the order
+        if (filter->container) {
+            if ((res = container_remove_layer(filter->container, num))) break;
+            continue;
+        }
+
+        // Delete the merged data file, and close the gap it leaves
+        char *name = NULL;
+        int name_len = asprintf(&name, DATA_FILE_NAME, num);
+        assert(name_len != -1);
+        char *path = join_path(filter->full_path, name);
+        if (unlink(path)) {
+            syslog(LOG_ERR, "Failed to delete: %s. %s", path, strerror(errno));
+        }
+        free(path);
+        free(name);
+
+        struct dirent **namelist = NULL;
+        int num_files = scandir(filter->full_path, &namelist, filter_data_files, alphasort);
+        if (num_files == -1) {
+            syslog(LOG_ERR, "Failed to scan files for filter '%s'. %s",
+                    filter->filter_name, strerror(errno));
+            res = -1;
+            break;
+        }
+        res = renumber_data_files(filter, namelist, num_files);
+        if (!res) filter->num_files = num_files;
+        for (int i=0; i < num_files; i++) free(namelist[i]);
+        free(namelist);
+        if (res) break;
+    }
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to compact filter %s. Err: %d", filter->filter_name, res);
+    }
+    if (merged && filter->engine) recount_mapped_bytes(filter);
+
+    // The data files moved, so deltas since before are full
+    if (merged) {
+        filter->layout_epoch = __atomic_load_n(&filter->epoch, __ATOMIC_SEQ_CST);
+        publish_layers(filter);
+    }
+
+    // Release lock
+    pthread_mutex_unlock(&filter->engine_lock);
+    return (res < 0) ? res : merged;
+}
+
+/**
+ * Shrinks a filter, folding the data files whose keys are
+ * far below their capacity into smaller ones.
+ * @arg filter The filter to shrink
+ * @arg fp_probability The probability the filter must stay within,
+ * or 0 for the probability of the filter
+ * @return The number of data files folded, -EROFS if the filter is
+ * frozen, -ENOTSUP if it has a container, negative on failure.
+ */
+int bloomf_shrink(bloom_filter *filter, double fp_probability) {
+    if (filter->parts) {
+        int folded = 0, res;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if ((res = bloomf_shrink(filter->parts[i], fp_probability)) < 0) return res;
+            folded += res;
+        }
+        return folded;
+    }
+    if (filter->filter_config.frozen) return -EROFS;
+    if (!fp_probability) fp_probability = filter->filter_config.default_probability;
+
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // The layers of a container are packed, so one cannot be replaced
+    if (filter->container) return -ENOTSUP;
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->engine_lock);
+
+    // Wait for any asynchronous flushes, they use the maps
+    while (__atomic_load_n(&filter->flushes_inflight, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    int folded = 0, res = 0, num = -1;
+    char *fold_path, *path;
+    while (filter->engine && (res = filter->ops->shrink(filter->engine, fp_probability,
+                    bloomf_fold_callback, filter, &num)) == 1) {
+        syslog(LOG_INFO, "Folded data file %d of filter %s.", num, filter->filter_name);
+        folded++;
+        if (filter->filter_config.in_memory) continue;
+
+        // The folded data file is durable, so it replaces the old one
+        fold_path = data_file_path(filter, FOLD_FILE_NAME, num);
+        path = data_file_path(filter, DATA_FILE_NAME, num);
+        if (rename(fold_path, path)) {
+            syslog(LOG_ERR, "Failed to rename: %s. %s", fold_path, strerror(errno));
+            res = -1;
+        }
+        free(fold_path);
+        free(path);
+        num = -1;
+        if (res < 0) break;
+    }
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to shrink filter %s. Err: %d", filter->filter_name, res);
+        if (num >= 0 && !filter->filter_config.in_memory) {
+            fold_path = data_file_path(filter, FOLD_FILE_NAME, num);
+            unlink(fold_path);
+            free(fold_path);
+        }
+    }
+
+    // The data files changed, so deltas since before are full,
+    // and the config records the smaller size
+    if (folded) {
+        recount_mapped_bytes(filter);
+        filter->layout_epoch = __atomic_load_n(&filter->epoch, __ATOMIC_SEQ_CST);
+        publish_layers(filter);
+        filter->filter_config.capacity = bloomf_capacity(filter);
+        filter->filter_config.bytes = bloomf_byte_size(filter);
+        if (!filter->filter_config.in_memory) write_filter_config(filter);
+    }
+
+    // Release lock
+    pthread_mutex_unlock(&filter->engine_lock);
+    return (res < 0) ? res : folded;
+}
+
+/**
+ * Merges, or intersects, the keys of another filter into this one.
+ * @arg filter The filter to change
+ * @arg src The filter to read
+ * @arg intersect Intersect the keys instead of merging them
+ * @return 0 on success, -EINVAL if the filters do not line up,
+ * -EROFS if the filter is frozen, negative on failure.
+ */
+int bloomf_combine(bloom_filter *filter, bloom_filter *src, int intersect) {
+    // Partitioned filters line up partition by partition
+    if (filter->parts || src->parts) {
+        if (!filter->parts || !src->parts ||
+                filter->filter_config.partitions != src->filter_config.partitions) return -EINVAL;
+        int res;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if ((res = bloomf_combine(filter->parts[i], src->parts[i], intersect))) return res;
+        }
+        return 0;
+    }
+    if (filter->filter_config.frozen) return -EROFS;
+
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+    if (!src->engine) {
+        if (thread_safe_fault(src) != 0) return -1;
+    }
+
+    // A frozen source lines up with the engine it was frozen from
+    bloom_filter_config src_config = src->filter_config;
+    src_config.frozen = 0;
+    if (filter->ops != config_engine_ops(&src_config)) return -EINVAL;
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->engine_lock);
+
+    // Wait for any asynchronous flushes, they use the maps
+    while (__atomic_load_n(&filter->flushes_inflight, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    int res = -1;
+    if (filter->engine) {
+        res = filter->ops->combine(filter->engine, src->engine, intersect);
+    }
+    if (intersect) renew_generation(filter);
+
+    // The log does not record the combined keys, nor the cleared
+    // ones, so it is replaced by a flush of the filter
+    if (!res && filter->wal) {
+        res = filter->ops->flush(filter->engine);
+        if (!res) res = wal_reset(filter->wal);
+    }
+    if (res && res != -EINVAL) {
+        syslog(LOG_ERR, "Failed to %s filter %s into %s. Err: %d",
+                intersect ? "intersect" : "merge", src->filter_name,
+                filter->filter_name, res);
+    }
+
+    // Release lock
+    pthread_mutex_unlock(&filter->engine_lock);
+    return res;
+}
+
+/**
+ * Clears all the keys of a filter in place, deleting
+ * the data files of the layers it grew into.
+ * @arg filter The filter to reset
+ * @return 0 on success, negative on failure.
+ */
+int bloomf_reset(bloom_filter *filter) {
+    if (filter->parts) {
+        int res;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if ((res = bloomf_reset(filter->parts[i]))) return res;
+        }
+        return 0;
+    }
+    if (filter->filter_config.frozen) return -EROFS;
+
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->engine_lock);
+
+    // Wait for any asynchronous flushes, they use the maps
+    while (__atomic_load_n(&filter->flushes_inflight, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    int kept = -1, res = 0;
+    if (filter->engine) kept = filter->ops->reset(filter->engine);
+    renew_generation(filter);
+    if (kept < 0) {
+        syslog(LOG_ERR, "Failed to reset filter %s. Err: %d", filter->filter_name, kept);
+        pthread_mutex_unlock(&filter->engine_lock);
+        return kept;
+    }
+    recount_mapped_bytes(filter);
+
+    // The cleared pages are not flushed, so deltas since before are full
+    filter->layout_epoch = __atomic_load_n(&filter->epoch, __ATOMIC_SEQ_CST);
+    if (filter->filter_config.in_memory) {
+        pthread_mutex_unlock(&filter->engine_lock);
+        return 0;
+    }
+
+    // Make the cleared layers durable, then delete the data files
+    // after them, so new layers are numbered from the kept ones
+    res = filter->ops->flush(filter->engine);
+    if (!res && filter->wal && wal_reset(filter->wal)) res = -1;
+    if (filter->container) {
+        if (container_truncate(filter->container, kept)) res = -1;
+        syslog(LOG_INFO, "Reset filter %s, kept %d layers.", filter->filter_name, kept);
+        pthread_mutex_unlock(&filter->engine_lock);
+        return res;
+    }
+    struct dirent **namelist = NULL;
+    int num_files = scandir(filter->full_path, &namelist, filter_data_files, alphasort);
+    if (num_files == -1) {
+        syslog(LOG_ERR, "Failed to scan files for filter '%s'. %s",
+                filter->filter_name, strerror(errno));
+        res = -1;
+    }
+    for (int i=0; i < num_files; i++) {
+        if (i >= kept) {
+            char *path = join_path(filter->full_path, namelist[i]->d_name);
+            if (unlink(path)) {
+                syslog(LOG_ERR, "Failed to delete: %s. %s", path, strerror(errno));
+                res = -1;
+            }
+            free(path);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    if (num_files > kept) filter->num_files = kept;
+    syslog(LOG_INFO, "Reset filter %s, kept %d data files.", filter->filter_name, kept);
+    publish_layers(filter);
+
+    // Release lock
+    pthread_mutex_unlock(&filter->engine_lock);
+    return res;
+}
+
+/**
+ * Prepares a filter to grow, once it is filled past the
+ * prealloc_fill of the config.
+ * @arg filter The filter to prepare
+ * @return 1 if prepared, 0 if not needed, negative on failure.
+ */
+int bloomf_prepare(bloom_filter *filter) {
+    // A partition may grow while another is prepared
+    if (filter->parts) {
+        int res = 0, part_res;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            pthread_rwlock_rdlock(filter->part_locks + i);
+            part_res = bloomf_prepare(filter->parts[i]);
+            pthread_rwlock_unlock(filter->part_locks + i);
+            if (part_res < 0) return part_res;
+            if (part_res > res) res = part_res;
+        }
+        return res;
+    }
+    if (!filter->engine || filter->config->prealloc_fill <= 0) return 0;
+
+    // The lock keeps the engine from being closed or compacted
+    pthread_mutex_lock(&filter->engine_lock);
+    int res = 0;
+    if (filter->engine) {
+        res = filter->ops->prepare(filter->engine, filter->config->prealloc_fill);
+    }
+    pthread_mutex_unlock(&filter->engine_lock);
+
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to prepare filter %s to grow. Err: %d", filter->filter_name, res);
+    } else if (res == 1) {
+        syslog(LOG_INFO, "Prepared filter %s to grow.", filter->filter_name);
+        publish_layers(filter);
+    }
+    return res;
+}
+
+/**
+ * Rotates the generations of a windowed filter.
+ * @arg filter The filter to rotate
+ * @return The number of generations recycled, negative on failure.
+ */
+int bloomf_rotate(bloom_filter *filter) {
+    if (filter->parts) {
+        int recycled = 0, res;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if ((res = bloomf_rotate(filter->parts[i])) < 0) return res;
+            recycled += res;
+        }
+        return recycled;
+    }
+    if (!filter->engine || !filter->filter_config.window) return 0;
+    uint64_t period = filter->filter_config.window / filter->filter_config.generations;
+    if (!period) period = 1;
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->engine_lock);
+
+    // Wait for any asynchronous flushes, they use the maps
+    while (__atomic_load_n(&filter->flushes_inflight, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    int res = 0;
+    if (filter->engine) {
+        res = filter->ops->rotate(filter->engine, time(NULL), period);
+        if (res > 0) recount_mapped_bytes(filter);
+        if (res > 0) renew_generation(filter);
+
+        // Recycled generations are not flushed, so deltas since before are full
+        if (res > 0) filter->layout_epoch = __atomic_load_n(&filter->epoch, __ATOMIC_SEQ_CST);
+    }
+
+    // Release lock
+    pthread_mutex_unlock(&filter->engine_lock);
+
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to rotate filter %s. Err: %d", filter->filter_name, res);
+    } else if (res > 0) {
+        syslog(LOG_DEBUG, "Rotated %d generations of filter %s.", res, filter->filter_name);
+        publish_layers(filter);
+    }
+    return res;
+}
+
+/**
+ * State of sealing the layers of a filter
+ */
+typedef struct {
+    bloom_filter *filter;
+    int newest;     // Data file of the newest layer, -1 until visited
+    int sealed;     // Number of layers moved to the page cache
+} seal_state;
+
+/**
+ * Moves the older layers of a tiered filter to the page cache.
+ * @arg filter The filter to seal
+ * @return The number of layers moved, negative on failure.
+ */
+int bloomf_seal(bloom_filter *filter) {
+    if (filter->parts) {
+        int sealed = 0, res;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if ((res = bloomf_seal(filter->parts[i])) < 0) return res;
+            sealed += res;
+        }
+        return sealed;
+    }
+    if (!filter->engine || !tiered(filter) || filter->container) return 0;
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->engine_lock);
+
+    // Wait for any asynchronous flushes, they use the maps
+    while (__atomic_load_n(&filter->flushes_inflight, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    seal_state state = {filter, -1, 0};
+    int res = 0;
+    if (filter->engine) res = filter->ops->serialize(filter->engine, seal_map_cb, &state);
+
+    // Release lock
+    pthread_mutex_unlock(&filter->engine_lock);
+
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to seal filter %s. Err: %d", filter->filter_name, res);
+        return res;
+    } else if (state.sealed) {
+        syslog(LOG_INFO, "Moved %d layers of filter %s to the page cache.",
+                state.sealed, filter->filter_name);
+    }
+    return state.sealed;
+}
+
+/**
+ * Freezes a filter, so that it no longer changes.
+ * @arg filter The filter to freeze
+ * @return 0 on success, -2 if the filter cannot be frozen,
+ * -1 on failure.
+ */
+int bloomf_freeze(bloom_filter *filter) {
+    bloom_filter_config *fc = &filter->filter_config;
+    if (fc->frozen) return 0;
+    if (filter->parts || fc->in_memory || fc->window) return -2;
+
+    // Closing the filter flushes it, and drops its log
+    if (thread_safe_fault(filter) || close_filter(filter, 0)) return -1;
+
+    // The engine is opened again read only. Checks that skip the lock
+    // only see the frozen flag with the read only engine in place.
+    __atomic_store_n(&fc->frozen, 1, __ATOMIC_RELEASE);
+    filter->ops = config_engine_ops(fc);
+    write_filter_config(filter);
+    int res = thread_safe_fault(filter);
+    if (res) {
+        syslog(LOG_ERR, "Failed to map frozen filter %s. Err: %d", filter->filter_name, res);
+        return -1;
+    }
+    syslog(LOG_INFO, "Froze filter %s.", filter->filter_name);
+    return 0;
+}
+
+/**
+ * Reorders the probes of the checks of a filter.
+ * @arg filter The filter to reorder
+ * @arg apply If 0, only checks if the order would change
+ * @return 1 if the order changes, 0 otherwise.
+ */
+int bloomf_reorder(bloom_filter *filter, int apply) {
+    if (filter->parts) {
+        int res = 0;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            res |= bloomf_reorder(filter->parts[i], apply);
+        }
+        return res;
+    }
+    if (!filter->engine) return 0;
+
+    // The lock keeps the engine from being closed or compacted
+    pthread_mutex_lock(&filter->engine_lock);
+    int res = 0;
+    if (filter->engine) {
+        res = filter->ops->reorder(filter->engine, apply);
+    }
+    pthread_mutex_unlock(&filter->engine_lock);
+
+    if (res == 1 && apply) {
+        syslog(LOG_DEBUG, "Reordered the checks of filter %s.", filter->filter_name);
+    }
+    return res;
+}
+
+/**
+ * Copies the number of checks found in each data file of a filter.
+ * @arg filter The filter
+ * @arg hits Output array
+ * @arg max The size of the output array
+ * @return The number of hits copied.
+ */
+int bloomf_layer_hits(bloom_filter *filter, uint64_t *hits, int max) {
+    // The partitions grow apart, so their layers do not line up
+    if (!filter->engine || filter->parts) return 0;
+
+    pthread_mutex_lock(&filter->engine_lock);
+    int num = 0;
+    if (filter->engine) {
+        uint64_t *layer_hits;
+        num = filter->ops->layer_hits(filter->engine, &layer_hits);
+        if (num > max) num = max;
+        for (int i=0; i < num; i++) {
+            hits[i] = __atomic_load_n(layer_hits + i, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&filter->engine_lock);
+    return num;
+}
+
+/**
+ * Counts the bytes of the bitmaps of a filter that are
+ * resident in memory.
+ * @arg filter The filter
+ * @return The resident bytes.
+ */
+uint64_t bloomf_resident_bytes(bloom_filter *filter) {
+    if (filter->parts) {
+        uint64_t bytes = 0;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            pthread_rwlock_rdlock(filter->part_locks + i);
+            bytes += bloomf_resident_bytes(filter->parts[i]);
+            pthread_rwlock_unlock(filter->part_locks + i);
+        }
+        return bytes;
+    }
+    if (!filter->engine) return 0;
+
+    pthread_mutex_lock(&filter->engine_lock);
+    uint64_t bytes = 0;
+    if (filter->engine) filter->ops->serialize(filter->engine, resident_map_cb, &bytes);
+    pthread_mutex_unlock(&filter->engine_lock);
+    return bytes;
+}
+
+/**
+ * Counts the bytes of the dirty pages of the bitmaps
+ * of a filter, which the next flush writes.
+ * @arg filter The filter
+ * @return The dirty bytes.
+ */
+uint64_t bloomf_dirty_page_bytes(bloom_filter *filter) {
+    if (filter->parts) {
+        uint64_t bytes = 0;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            pthread_rwlock_rdlock(filter->part_locks + i);
+            bytes += bloomf_dirty_page_bytes(filter->parts[i]);
+            pthread_rwlock_unlock(filter->part_locks + i);
+        }
+        return bytes;
+    }
+    if (!filter->engine) return 0;
+
+    pthread_mutex_lock(&filter->engine_lock);
+    uint64_t bytes = 0;
+    if (filter->engine) filter->ops->serialize(filter->engine, dirty_map_cb, &bytes);
+    pthread_mutex_unlock(&filter->engine_lock);
+    return bytes;
+}
+
+/**
+ * Visits the bitmaps of the layers of a filter.
+ * @return 0 on success, negative on failure.
+ */
+int bloomf_visit_maps(bloom_filter *filter, bloom_engine_map_cb cb, void *data) {
+    if (filter->parts) return -2;
+    if (thread_safe_fault(filter)) return -1;
+
+    pthread_mutex_lock(&filter->engine_lock);
+    int res = (filter->engine) ? filter->ops->serialize(filter->engine, cb, data) : -1;
+    pthread_mutex_unlock(&filter->engine_lock);
+    return (res < 0) ? -1 : 0;
+}
+
+/**
+ * Gets the bytes the bitmaps of a filter have read
+ * in and written out, summed over the partitions.
+ * @arg filter The filter
+ * @arg io Output, the bytes read and written
+ */
+void bloomf_io(bloom_filter *filter, bitmap_io_counters *io) {
+    io->bytes_read = __atomic_load_n(&filter->io.bytes_read, __ATOMIC_RELAXED);
+    io->bytes_written = __atomic_load_n(&filter->io.bytes_written, __ATOMIC_RELAXED);
+
+    bitmap_io_counters part;
+    for (int i=0; filter->parts && i < filter->filter_config.partitions; i++) {
+        bloomf_io(filter->parts[i], &part);
+        io->bytes_read += part.bytes_read;
+        io->bytes_written += part.bytes_written;
+    }
+}
+
+/**
+ * Deletes the bloom filter with
+ * extreme prejudice.
+ * @arg filter The filter to delete
+ * @return 0 on success.
+ */
+int bloomf_delete(bloom_filter *filter) {
+    // Close first
+    bloomf_close(filter);
+
+    // The partitions are folders in the folder of the filter
+    for (int i=0; filter->parts && i < filter->filter_config.partitions; i++) {
+        bloomf_delete(filter->parts[i]);
+    }
+
+    // Delete the files
+    struct dirent **namelist = NULL;
+    int num;
+
+    // Filter only data dirs, in sorted order
+    num = scandir(filter->full_path, &namelist, filter_out_special, NULL);
+    syslog(LOG_INFO, "Deleting %d files for filter %s.", num, filter->filter_name);
+
+    // Free the memory associated with scandir
+    for (int i=0; i < num; i++) {
+        char *file_path = join_path(filter->full_path, namelist[i]->d_name);
+        syslog(LOG_INFO, "Deleting: %s.", file_path);
+        if (unlink(file_path)) {
+            syslog(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
+        }
+        free(file_path);
+    }
+
+    // Free the memory associated with scandir
+    for (int i=0; i < num; i++) {
+        free(namelist[i]);
+    }
+    if (namelist)
+        free(namelist);
+
+    // Delete the directory
+    if (rmdir(filter->full_path)) {
+        syslog(LOG_ERR, "Failed to delete: %s. %s", filter->full_path, strerror(errno));
+    }
+    publish_layers(filter);
+
+    return 0;
+}
+
+/**
+ * Checks if the filter contains a given key
+ * @note Thread safe, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @return 0 if not contained, 1 if contained.
+ */
+int bloomf_contains(bloom_filter *filter, char *key) {
+    return bloomf_contains_len(filter, key, strlen(key));
+}
+
+/**
+ * Checks if the filter contains a given key of a given length. The key
+ * need not be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to use
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The same as bloomf_contains.
+ */
+int bloomf_contains_len(bloom_filter *filter, const char *key, uint64_t len) {
+    if (filter->parts) {
+        int p = key_part(filter, key, len);
+        pthread_rwlock_rdlock(filter->part_locks + p);
+        int res = bloomf_contains_len(filter->parts[p], key, len);
+        pthread_rwlock_unlock(filter->part_locks + p);
+        return res;
+    }
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Check the engine
+    int res = filter->ops->contains(filter->engine, key, len);
+
+    // Update the counters of this thread
+    if (res == 1)
+        COUNT(filter, check_hits, 1);
+    else if (res == 0)
+        COUNT(filter, check_misses, 1);
+    stats_add(STAT_CHECKS, 1);
+
+    return res;
+}
+
+/**
+ * Same as bloomf_contains_len, with hashes shared with the
+ * checks of other filters.
+ */
+int bloomf_contains_hashed(bloom_filter *filter, bloom_key_hashes *hashes) {
+    if (filter->parts) {
+        int p = key_part(filter, hashes->key, hashes->len);
+        pthread_rwlock_rdlock(filter->part_locks + p);
+        int res = bloomf_contains_hashed(filter->parts[p], hashes);
+        pthread_rwlock_unlock(filter->part_locks + p);
+        return res;
+    }
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Check the engine
+    int res = filter->ops->contains_hashed(filter->engine, hashes);
+
+    // Update the counters of this thread
+    if (res == 1)
+        COUNT(filter, check_hits, 1);
+    else if (res == 0)
+        COUNT(filter, check_misses, 1);
+    stats_add(STAT_CHECKS, 1);
+
+    return res;
+}
+
+/**
+ * Checks if the filter contains many keys. The keys are checked
+ * in batches, overlapping their memory accesses.
+ * @note Thread safe, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if contained, 0 if not.
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_batch(bloom_filter *filter, char **keys, int num_keys, char *results) {
+    return bloomf_contains_batch_len(filter, keys, NULL, num_keys, results);
+}
+
+/**
+ * Checks if the filter contains many keys of given lengths.
+ * @note Thread safe, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg keys The keys to check, need not be NUL terminated
+ * @arg key_lens The lengths of the keys, or NULL if the
+ * keys are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if contained, 0 if not.
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_batch_len(bloom_filter *filter, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    if (!positive_cached(filter)) return contains_batch(filter, keys, key_lens, num_keys, results);
+
+    // Take the generation before checking, so a positive is
+    // not remembered across a removal that raced the check
+    uint64_t gen = __atomic_load_n(&filter->generation, __ATOMIC_ACQUIRE);
+    uint64_t *hashes = malloc(num_keys * (2 * sizeof(uint64_t) + sizeof(char*) + sizeof(int) + 1));
+    uint64_t *miss_lens = hashes + num_keys;
+    char **miss_keys = (char**)(miss_lens + num_keys);
+    int *misses = (int*)(miss_keys + num_keys);
+    char *miss_results = (char*)(misses + num_keys);
+
+    // Answer the keys remembered as positive
+    int num_misses = 0;
+    positive_entry *e;
+    for (int i=0; i < num_keys; i++) {
+        miss_lens[num_misses] = KEY_LEN(keys, key_lens, i);
+        bf_compute_hashes_len(HASH_WYHASH, 1, keys[i], miss_lens[num_misses], hashes + i);
+        e = POSITIVE_CACHE + (hashes[i] & POSITIVE_MASK);
+        if (e->generation == gen && e->hash == hashes[i]) {
+            results[i] = 1;
+            continue;
+        }
+        misses[num_misses] = i;
+        miss_keys[num_misses++] = keys[i];
+    }
+    int hits = num_keys - num_misses;
+
+    // Check the rest, in place if none were remembered
+    int res = 0;
+    if (!hits) {
+        res = contains_batch(filter, keys, key_lens, num_keys, results);
+    } else if (num_misses) {
+        res = contains_batch(filter, miss_keys, miss_lens, num_misses, miss_results);
+        for (int j=0; j < num_misses && !res; j++) results[misses[j]] = miss_results[j];
+    }
+
+    // Remember the new positives
+    for (int j=0; j < num_misses && !res; j++) {
+        int i = misses[j];
+        if (!results[i]) continue;
+        e = POSITIVE_CACHE + (hashes[i] & POSITIVE_MASK);
+        e->generation = gen;
+        e->hash = hashes[i];
+    }
+    free(hashes);
+
+    // The remembered keys are checks and hits all the same
+    if (hits) {
+        COUNT(filter, check_hits, hits);
+        stats_add(STAT_CHECKS, hits);
+        stats_add(STAT_POSITIVE_HITS, hits);
+    }
+    return res;
+}
+
+/**
+ * Checks many keys against the engine, or the partitions
+ */
+static int contains_batch(bloom_filter *filter, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    // Check the keys of each partition as a batch of their own
+    if (filter->parts) {
+        int starts[MAX_PARTITIONS + 1];
+        int *order = group_parts(filter, keys, key_lens, num_keys, starts);
+        char **part_keys = malloc(num_keys * (sizeof(char*) + sizeof(uint64_t) + 1));
+        uint64_t *part_lens = (uint64_t*)(part_keys + num_keys);
+        char *part_results = (char*)(part_lens + num_keys);
+        int res = 0, n, k;
+        for (int p=0; p < filter->filter_config.partitions && !res; p++) {
+            if (!(n = starts[p+1] - starts[p])) continue;
+            for (int j=0; j < n; j++) {
+                k = order[starts[p] + j];
+                part_keys[j] = keys[k];
+                part_lens[j] = KEY_LEN(keys, key_lens, k);
+            }
+            pthread_rwlock_rdlock(filter->part_locks + p);
+            res = contains_batch(filter->parts[p], part_keys, part_lens, n, part_results);
+            pthread_rwlock_unlock(filter->part_locks + p);
+            for (int j=0; j < n && !res; j++) results[order[starts[p] + j]] = part_results[j];
+        }
+        free(part_keys);
+        free(order);
+        return res;
+    }
+
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Check the engine
+    if (filter->ops->contains_batch(filter->engine, keys, key_lens, num_keys, results) != 0) {
+        return -1;
+    }
+
+    // Count the hits
+    uint64_t hits = 0;
+    for (int i=0; i < num_keys; i++) {
+        hits += results[i];
+    }
+
+    // Update the counters of this thread, once for the batch
+    COUNT(filter, check_hits, hits);
+    COUNT(filter, check_misses, num_keys - hits);
+    stats_add(STAT_CHECKS, num_keys);
+    return 0;
+}
+
+/**
+ * Adds a key to the given filter
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @return 0 if not added, 1 if added.
+ */
+int bloomf_add(bloom_filter *filter, char *key) {
+    return bloomf_add_len(filter, key, strlen(key));
+}
+
+/**
+ * Adds a key of a given length to the given filter. The key
+ * need not be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to use
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The same as bloomf_add.
+ */
+int bloomf_add_len(bloom_filter *filter, const char *key, uint64_t len) {
+    if (filter->parts) {
+        int p = key_part(filter, key, len);
+        pthread_rwlock_wrlock(filter->part_locks + p);
+        int res = bloomf_add_len(filter->parts[p], key, len);
+        pthread_rwlock_unlock(filter->part_locks + p);
+        return res;
+    }
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Add to the engine, which may grow a data file
+    int num_files = filter->num_files;
+    int res = filter->ops->add(filter->engine, key, len);
+    if (filter->num_files != num_files) publish_layers(filter);
+    if (res == -ENOSPC) return -2;
+    if (res == -EROFS) return -3;
+    if (res == 1 && filter->wal) wal_append(filter->wal, key, len);
+
+    // Update the counters of this thread
+    if (res == 1)
+        COUNT(filter, set_hits, 1);
+    else if (res == 0)
+        COUNT(filter, set_misses, 1);
+    stats_add(STAT_SETS, 1);
+
+    return res;
+}
+
+/**
+ * Adds many keys to the given filter. The keys of a partitioned
+ * filter are grouped by partition, and set under the lock of each
+ * partition in turn, so that batches on other partitions proceed.
+ * Large batches are set in address order where the engine can.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys, or NULL
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if added, 0 if not
+ * @return 0 on success, -2 if full and rejecting, -1 on error.
+ */
+int bloomf_add_batch_len(bloom_filter *filter, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    int res = 0;
+    if (!filter->parts) {
+        if (!filter->engine) {
+            if (thread_safe_fault(filter) != 0) return -1;
+        }
+
+        // Large batches are set by the engine in address order
+        int num_files = filter->num_files;
+        res = filter->ops->add_batch(filter->engine, keys, key_lens, num_keys, results);
+        if (filter->num_files != num_files) publish_layers(filter);
+        if (res == -EROFS) return -3;
+        if (res == 0) {
+            uint64_t hits = 0;
+            for (int i=0; i < num_keys; i++) {
+                if (!results[i]) continue;
+                hits++;
+                if (filter->wal) wal_append(filter->wal, keys[i], KEY_LEN(keys, key_lens, i));
+            }
+            COUNT(filter, set_hits, hits);
+            COUNT(filter, set_misses, num_keys - hits);
+            stats_add(STAT_SETS, num_keys);
+            return 0;
+        }
+
+        // Otherwise add the keys in turn
+        res = 0;
+        for (int i=0; i < num_keys && res >= 0; i++) {
+            res = bloomf_add_len(filter, keys[i], KEY_LEN(keys, key_lens, i));
+            if (res >= 0) results[i] = res;
+        }
+        return (res < 0) ? res : 0;
+    }
+
+    // In concurrent mode, sets use atomic bit updates under the read
+    // lock of the partition, which is upgraded only to grow it
+    int starts[MAX_PARTITIONS + 1];
+    int *order = group_parts(filter, keys, key_lens, num_keys, starts);
+    int concurrent = filter->config->concurrent_sets;
+    char **part_keys = malloc(num_keys * (sizeof(char*) + sizeof(uint64_t) + 1));
+    uint64_t *part_lens = (uint64_t*)(part_keys + num_keys);
+    char *part_results = (char*)(part_lens + num_keys);
+    int k, j, n;
+    for (int p=0; p < filter->filter_config.partitions && res >= 0; p++) {
+        if (starts[p] == starts[p+1]) continue;
+        bloom_filter *part = filter->parts[p];
+        j = starts[p];
+        if (concurrent) {
+            pthread_rwlock_rdlock(filter->part_locks + p);
+            for (; j < starts[p+1]; j++) {
+                k = order[j];
+                res = bloomf_add_concurrent_len(part, keys[k], KEY_LEN(keys, key_lens, k));
+                if (res < 0) break;
+                results[k] = res;
+            }
+            pthread_rwlock_unlock(filter->part_locks + p);
+            if (res == -1) break;
+        }
+        if (j < starts[p+1]) {
+            n = starts[p+1] - j;
+            for (int i=0; i < n; i++) {
+                k = order[j + i];
+                part_keys[i] = keys[k];
+                part_lens[i] = KEY_LEN(keys, key_lens, k);
+                part_results[i] = 2;
+            }
+            pthread_rwlock_wrlock(filter->part_locks + p);
+            res = bloomf_add_batch_len(part, part_keys, part_lens, n, part_results);
+            pthread_rwlock_unlock(filter->part_locks + p);
+            for (int i=0; i < n && part_results[i] != 2; i++) results[order[j + i]] = part_results[i];
+        }
+    }
+    free(part_keys);
+    free(order);
+    return (res < 0) ? res : 0;
+}
+
+/**
+ * Checks that a batch of keys can be set without a full filter
+ * rejecting any of them. The keys of a partitioned filter are
+ * checked against the partition each one is set in.
+ * @arg filter The filter to check
+ * @arg keys The keys to set
+ * @arg key_lens The lengths of the keys, or NULL
+ * @arg num_keys The number of keys
+ * @return 1 if the keys fit, 0 if not, -1 on error.
+ */
+int bloomf_fits(bloom_filter *filter, char **keys, uint64_t *key_lens, int num_keys) {
+    if (!filter->parts) {
+        if (!filter->engine) {
+            if (thread_safe_fault(filter) != 0) return -1;
+        }
+        return filter->ops->fits(filter->engine, keys, key_lens, num_keys);
+    }
+
+    int starts[MAX_PARTITIONS + 1];
+    int *order = group_parts(filter, keys, key_lens, num_keys, starts);
+    char **part_keys = malloc(num_keys * (sizeof(char*) + sizeof(uint64_t)));
+    uint64_t *part_lens = (uint64_t*)(part_keys + num_keys);
+    int res = 1, n, k;
+    for (int p=0; p < filter->filter_config.partitions && res == 1; p++) {
+        n = starts[p+1] - starts[p];
+        if (!n) continue;
+        for (int i=0; i < n; i++) {
+            k = order[starts[p] + i];
+            part_keys[i] = keys[k];
+            part_lens[i] = KEY_LEN(keys, key_lens, k);
+        }
+        pthread_rwlock_rdlock(filter->part_locks + p);
+        res = bloomf_fits(filter->parts[p], part_keys, part_lens, n);
+        pthread_rwlock_unlock(filter->part_locks + p);
+    }
+    free(part_keys);
+    free(order);
+    return res;
+}
+
+/**
+ * Removes a key from the given filter. Only supported
+ * by counting and cuckoo filters.
+ * @arg filter The filter to remove from
+ * @arg key The key to remove
+ * @return 0 if not contained, 1 if removed, -1 on error.
+ */
+int bloomf_remove(bloom_filter *filter, char *key) {
+    return bloomf_remove_len(filter, key, strlen(key));
+}
+
+/**
+ * Removes a key of a given length from the given filter. The key
+ * need not be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to use
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The same as bloomf_remove.
+ */
+int bloomf_remove_len(bloom_filter *filter, const char *key, uint64_t len) {
+    if (filter->parts) {
+        int p = key_part(filter, key, len);
+        pthread_rwlock_wrlock(filter->part_locks + p);
+        int res = bloomf_remove_len(filter->parts[p], key, len);
+        pthread_rwlock_unlock(filter->part_locks + p);
+        return res;
+    }
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Remove from the engine
+    int res = filter->ops->remove(filter->engine, key, len);
+    if (res == -EROFS) return -3;
+    if (res < 0) return -1;
+
+    // Update the counters of this thread
+    if (res == 1) {
+        renew_generation(filter);
+        COUNT(filter, unset_hits, 1);
+    } else {
+        COUNT(filter, unset_misses, 1);
+    }
+
+    return res;
+}
+
+/**
+ * Adds a key to the given filter using atomic bit sets.
+ * @note Thread safe with other concurrent adds and with checks,
+ * but not with bloomf_add.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @return 0 if not added, 1 if added, -2 if the filter must
+ * grow, in which case bloomf_add should be used with exclusive access.
+ */
+int bloomf_add_concurrent(bloom_filter *filter, char *key) {
+    return bloomf_add_concurrent_len(filter, key, strlen(key));
+}
+
+/**
+ * Adds a key of a given length using atomic bit sets. The key
+ * need not be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to use
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The same as bloomf_add_concurrent.
+ */
+int bloomf_add_concurrent_len(bloom_filter *filter, const char *key, uint64_t len) {
+    // A partition grows under its own lock, so a partitioned
+    // filter never needs exclusive access to grow
+    if (filter->parts) {
+        int p = key_part(filter, key, len);
+        pthread_rwlock_rdlock(filter->part_locks + p);
+        int res = bloomf_add_concurrent_len(filter->parts[p], key, len);
+        pthread_rwlock_unlock(filter->part_locks + p);
+        if (res != -2) return res;
+        pthread_rwlock_wrlock(filter->part_locks + p);
+        res = bloomf_add_len(filter->parts[p], key, len);
+        pthread_rwlock_unlock(filter->part_locks + p);
+        return res;
+    }
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Add to the engine
+    int res = filter->ops->add_concurrent(filter->engine, key, len);
+    if (res == -EAGAIN) return -2;
+    if (res == -EROFS) return -3;
+    if (res == 1 && filter->wal) wal_append(filter->wal, key, len);
+
+    // Update the counters of this thread
+    if (res == 1)
+        COUNT(filter, set_hits, 1);
+    else if (res == 0)
+        COUNT(filter, set_misses, 1);
+    stats_add(STAT_SETS, 1);
+
+    return res;
+}
+
+/**
+ * Gets the size of the filter in keys
+ * @note Thread safe.
+ * @arg filter The filter to check
+ * @return The total size of the filter
+ */
+uint64_t bloomf_size(bloom_filter *filter) {
+    if (filter->parts) {
+        return sum_parts(filter, bloomf_size);
+    } else if (filter->engine) {
+        return filter->ops->size(filter->engine);
+    } else {
+        return filter->filter_config.size;
+    }
+}
+
+/**
+ * Estimates the number of distinct keys in the filter
+ * @arg filter The filter to estimate
+ * @arg estimate Output, the estimated number of keys
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_estimate(bloom_filter *filter, uint64_t *estimate) {
+    if (filter->parts) {
+        uint64_t part;
+        *estimate = 0;
+        for (int i=0; i < filter->filter_config.partitions; i++) {
+            if (bloomf_estimate(filter->parts[i], &part)) return -1;
+            *estimate += part;
+        }
+        return 0;
+    }
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+    *estimate = filter->ops->estimate(filter->engine);
+    return 0;
+}
+
+/**
+ * Gets the maximum capacity of the filter
+ * @note Thread safe.
+ * @arg filter The filter to check
+ * @return The total capacity of the filter
+ */
+uint64_t bloomf_capacity(bloom_filter *filter) {
+    if (filter->parts) {
+        return sum_parts(filter, bloomf_capacity);
+    } else if (filter->engine) {
+        return filter->ops->capacity(filter->engine);
+    } else {
+        return filter->filter_config.capacity;
+    }
+}
+
+/**
+ * Gets the current byte size of the filter
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return The total byte size of the filter
+ */
+uint64_t bloomf_byte_size(bloom_filter *filter) {
+    if (filter->parts) {
+        return sum_parts(filter, bloomf_byte_size);
+    } else if (filter->engine) {
+        return filter->ops->byte_size(filter->engine);
+    } else {
+        return filter->filter_config.bytes;
+    }
+}
+
+/**
+ * Estimates the bytes the next flush of the filter writes.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return The estimated dirty bytes
+ */
+uint64_t bloomf_dirty_bytes(bloom_filter *filter) {
+    if (filter->parts) return sum_parts(filter, bloomf_dirty_bytes);
+    if (!filter->engine || filter->filter_config.in_memory) return 0;
+    uint64_t bytes = bloomf_byte_size(filter);
+    if (filter->filter_config.bytes == 0) return bytes;
+
+    // Removes lower the size, so either way counts
+    uint64_t size = bloomf_size(filter);
+    uint64_t flushed = filter->filter_config.size;
+    uint64_t changed = (size > flushed) ? size - flushed : flushed - size;
+    return (changed < bytes / 4096) ? changed * 4096 : bytes;
+}
+
+/**
+ * Exports the pages of the filter changed since an epoch to a
+ * delta in the folder of the filter, and starts a new epoch. The
+ * delta is full if the changes since the epoch are not known.
+ * The filter is faulted in if needed.
+ * @note Thread safe.
+ * @arg filter The filter to export
+ * @arg since The epoch of an earlier delta, or 0 for a full delta
+ * @arg epoch Output, the epoch of the delta, to export the
+ * next delta since
+ * @arg path Output, the path of the delta. Must be free'd.
+ * @return The number of pages exported, negative on error.
+ */
+int bloomf_export_delta(bloom_filter *filter, uint64_t since, uint64_t *epoch, char **path) {
+    // The partitions have data files of their own
+    if (filter->parts) {
+        syslog(LOG_WARNING, "Deltas of partitioned filter %s are not supported.", filter->filter_name);
+        return -EINVAL;
+    }
+    if (!filter->engine) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // The lock keeps the engine from being closed or compacted
+    pthread_mutex_lock(&filter->engine_lock);
+    if (!filter->engine) {
+        pthread_mutex_unlock(&filter->engine_lock);
+        return -1;
+    }
+
+    // Start a new epoch before the pages are read. A page changed
+    // after it is read is claimed later, and stamped with the new
+    // epoch, so the delta covers the epochs before the new one.
+    uint64_t next = realtime_usec();
+    uint64_t cur = __atomic_load_n(&filter->epoch, __ATOMIC_SEQ_CST);
+    if (next <= cur) next = cur + 1;
+    __atomic_store_n(&filter->epoch, next, __ATOMIC_SEQ_CST);
+
+    delta_header header;
+    memset(&header, 0, sizeof(header));
+    header.since = since;
+    header.epoch = next - 1;
+    header.full = (since < filter->layout_epoch);
+
+    delta_maps maps = {NULL, NULL, 0, 0};
+    filter->ops->serialize(filter->engine, delta_map_cb, &maps);
+    header.num_layers = maps.num_maps;
+
+    char *name = NULL;
+    int name_len = asprintf(&name, DELTA_FILE_NAME, (unsigned long long)header.epoch);
+    assert(name_len != -1);
+    *path = join_path(filter->full_path, name);
+    free(name);
+    int res = delta_write(*path, &header, maps.nums, maps.maps);
+    *epoch = header.epoch;
+
+    // Release lock
+    pthread_mutex_unlock(&filter->engine_lock);
+    free(maps.nums);
+    free(maps.maps);
+
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to export a delta of filter %s. Err: %d", filter->filter_name, res);
+    } else {
+        syslog(LOG_INFO, "Exported %d pages of filter %s since epoch %llu. Full: %d.",
+                res, filter->filter_name, (unsigned long long)since, header.full);
+    }
+    return res;
+}
+
+/**
+ * Writes the layers of a full delta as the data files of a
+ * filter, which loads them once it is created. The filter
+ * must not have data files yet.
+ * @arg config The configuration, with the data directory
+ * @arg filter_name The name of the filter
+ * @arg path The path of the delta
+ * @return The number of layers written, -EINVAL if the delta is
+ * not full or is corrupt, -ENOTSUP if the filters of the config
+ * do not keep data files, -EEXIST if the filter has data files,
+ * or another negative errno.
+ */
+int bloomf_restore_delta(bloom_config *config, char *filter_name, char *path) {
+    // The layers of the delta are written as plain data files
+    if (config->in_memory || config->container || config->partitions > 1) {
+        syslog(LOG_WARNING, "Restores into filter %s are not supported by the config.", filter_name);
+        return -ENOTSUP;
+    }
+
+    char *folder_name = NULL;
+    int res = asprintf(&folder_name, FILTER_FOLDER_NAME, filter_name);
+    assert(res != -1);
+    restore_state state = {join_path(config->data_dir, folder_name), NULL, 0, 0};
+    free(folder_name);
+    if (mkdir(state.full_path, 0755) && errno != EEXIST) {
+        res = -errno;
+        syslog(LOG_ERR, "Failed to create filter directory '%s'. %s", state.full_path, strerror(errno));
+        free(state.full_path);
+        return res;
+    }
+
+    // Never mix the layers with those of an earlier filter
+    struct dirent **namelist = NULL;
+    int num_files = scandir(state.full_path, &namelist, filter_data_files, alphasort);
+    for (int i=0; i < num_files; i++) free(namelist[i]);
+    free(namelist);
+    if (num_files != 0) {
+        free(state.full_path);
+        return (num_files > 0) ? -EEXIST : -EIO;
+    }
+
+    delta_header header;
+    delta_layer *layers = NULL;
+    res = delta_read(path, &header, &layers, restore_page_cb, &state);
+    if (res >= 0 && !header.full) res = -EINVAL;
+    if (res >= 0 && state.err) res = state.err;
+
+    // Every layer of a full delta has pages, the sizes cover a short last page
+    for (uint32_t i=0; res >= 0 && i < header.num_layers; i++) {
+        int fd = (layers[i].num < state.num_fds) ? state.fds[layers[i].num] : -1;
+        if (fd < 0) {
+            res = -EINVAL;
+        } else if (ftruncate(fd, layers[i].size) || fsync(fd)) {
+            res = -errno;
+        }
+    }
+    if (res >= 0) res = header.num_layers;
+
+    // Remove the data files of a failed restore
+    char *name, *file_path;
+    for (uint32_t i=0; i < state.num_fds; i++) {
+        if (state.fds[i] < 0) continue;
+        close(state.fds[i]);
+        if (res >= 0) continue;
+        int name_len = asprintf(&name, DATA_FILE_NAME, i);
+        assert(name_len != -1);
+        file_path = join_path(state.full_path, name);
+        unlink(file_path);
+        free(file_path);
+        free(name);
+    }
+
+    if (res < 0) {
+        rmdir(state.full_path);
+        syslog(LOG_ERR, "Failed to restore filter %s from '%s'. Err: %d", filter_name, path, res);
+    } else {
+        syslog(LOG_INFO, "Restored %d layers of filter %s.", res, filter_name);
+    }
+    free(layers);
+    free(state.fds);
+    free(state.full_path);
+    return res;
+}
+
+/**
+ * Writes a page of a delta being restored to its data file
+ */
+static void restore_page_cb(void *data, uint32_t layer, uint64_t offset, const unsigned char *bytes, uint32_t len) {
+    restore_state *state = data;
+    if (state->err) return;
+
+    // The data files are numbered with three digits
+    if (layer > 999) {
+        state->err = -EINVAL;
+        return;
+    }
+    if (layer >= state->num_fds) {
+        state->fds = realloc(state->fds, (layer + 1) * sizeof(int));
+        for (uint32_t i=state->num_fds; i <= layer; i++) state->fds[i] = -1;
+        state->num_fds = layer + 1;
+    }
+
+    if (state->fds[layer] < 0) {
+        char *name = NULL;
+        int name_len = asprintf(&name, DATA_FILE_NAME, layer);
+        assert(name_len != -1);
+        char *path = join_path(state->full_path, name);
+        free(name);
+        state->fds[layer] = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (state->fds[layer] < 0) {
+            state->err = -errno;
+            syslog(LOG_ERR, "Failed to create the data file '%s'. %s", path, strerror(errno));
+        }
+        free(path);
+        if (state->err) return;
+    }
+    if (pwrite(state->fds[layer], bytes, len, offset) != (ssize_t)len) state->err = -EIO;
+}
+
+/**
+ * Collects a bitmap of the engine for a delta
+ */
+static int delta_map_cb(void *data, int num, bloom_bitmap *map) {
+    delta_maps *maps = data;
+    if (maps->num_maps == maps->capacity) {
+        maps->capacity = (maps->capacity) ? maps->capacity * 2 : 8;
+        maps->nums = realloc(maps->nums, maps->capacity * sizeof(uint32_t));
+        maps->maps = realloc(maps->maps, maps->capacity * sizeof(bloom_bitmap*));
+    }
+    maps->nums[maps->num_maps] = num;
+    maps->maps[maps->num_maps++] = map;
+    return 0;
+}
+
+/**
+ * Returns the wall clock time in microseconds
+ */
+static uint64_t realtime_usec(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/**
+ * Provides a thread safe faulting of filters.
+ * The main use case of this is to allow
  * bloomf_contains to be safe.
  */
 static int thread_safe_fault(bloom_filter *f) {
+    if (f->parts) return fault_parts(f);
+
+    // Time the fault, including the wait for the lock
+    uint64_t start = hist_now_usec();
+    BLOOM_PROBE1(fault__start, f->filter_name);
+
     // Acquire lock
-    pthread_mutex_lock(&f->sbf_lock);
+    pthread_mutex_lock(&f->engine_lock);
 
     int res = 0;
-    if (!f->sbf) {
+    if (!f->engine) {
+        // Cataloged filters may not have a folder yet
+        if (mkdir(f->full_path, 0755) && errno != EEXIST) {
+            syslog(LOG_ERR, "Failed to create filter directory '%s'. Err: %d", f->full_path, errno);
+        }
         if (f->filter_config.in_memory) {
-            res = create_sbf(f, 0, NULL);
+            res = (f->packed) ? unpack_filter(f) : open_engine(f, 0, NULL);
+        } else if (f->filter_config.container) {
+            res = open_container(f);
         } else {
             res = discover_existing_filters(f);
         }
+        if (!res) {
+            hist_record(&hot_state(f)->page_in_latency, hist_now_usec() - start);
+            slowlog_note(SLOWLOG_PAGE_IN);
+            publish_layers(f);
+        }
     }
 
     // Release lock
-    pthread_mutex_unlock(&f->sbf_lock);
+    pthread_mutex_unlock(&f->engine_lock);
+    BLOOM_PROBE2(fault__done, f->filter_name, res);
     return res;
 }
 
+/**
+ * Tells the processes reading the data files of a filter that
+ * they changed, through the generation kept with the catalog.
+ * The partitions share the catalog of their filter.
+ */
+static void publish_layers(bloom_filter *f) {
+    bloom_catalog *catalog = (f->parent) ? f->parent->catalog : f->catalog;
+    if (catalog && !f->filter_config.in_memory) catalog_bump(catalog);
+}
+
 /**
  * Discovers existing filters, and faults them in.
  */
@@ -426,13 +2307,241 @@ static int filter_data_files(CONST_DIRENT_T *d) {
     return 0;
 }
 
+/**
+ * Works with scandir to filter out non-snapshot files.
+ */
+static int filter_snapshot_files(CONST_DIRENT_T *d) {
+    char *name = (char*)d->d_name;
+    int name_len = strlen(name);
+    if (name_len < 6) return 0;
+    return strcmp(name+(name_len-5), ".snap") == 0;
+}
+
+/**
+ * Serialize callback that writes a snapshot of a
+ * bitmap, recording the data file it replaces.
+ */
+static int snapshot_map(void *data, int num, bloom_bitmap *map) {
+    snapshot_state *state = data;
+    bloom_filter *f = state->filter;
+    char *name = NULL, *snap_name = NULL;
+    int res = asprintf(&name, DATA_FILE_NAME, num);
+    assert(res != -1);
+    res = asprintf(&snap_name, SNAPSHOT_FILE_NAME, num);
+    assert(res != -1);
+
+    char *snap_path = join_path(f->full_path, snap_name);
+    if (snapshot_write(map, snap_path)) {
+        syslog(LOG_ERR, "Failed to snapshot layer %d of filter %s.", num, f->filter_name);
+        state->err = -1;
+    } else {
+        state->data_paths = realloc(state->data_paths, (state->num_paths + 1) * sizeof(char*));
+        state->data_paths[state->num_paths++] = join_path(f->full_path, name);
+    }
+    free(snap_path);
+    free(snap_name);
+    free(name);
+    return 0;
+}
+
+/**
+ * Serialize callback that packs a bitmap of an
+ * in-memory filter into memory, by its layer number.
+ */
+static int pack_map(void *data, int num, bloom_bitmap *map) {
+    snapshot_state *state = data;
+    bloom_filter *f = state->filter;
+    snapshot_packed *packed = snapshot_pack(map);
+    if (!packed) {
+        syslog(LOG_ERR, "Failed to pack layer %d of filter %s.", num, f->filter_name);
+        state->err = -1;
+        return 1;
+    }
+    if (num >= f->num_packed) {
+        f->packed = realloc(f->packed, (num + 1) * sizeof(snapshot_packed*));
+        memset(f->packed + f->num_packed, 0, (num + 1 - f->num_packed) * sizeof(snapshot_packed*));
+        f->num_packed = num + 1;
+    }
+    f->packed[num] = packed;
+    stats_add(STAT_PACKED_BYTES, snapshot_packed_bytes(packed));
+    return 0;
+}
+
+/**
+ * Packs the layers of an in-memory filter, so that the
+ * filter can be closed without losing its keys. Needs
+ * the engine lock, and that nothing writes the filter.
+ * @return 0 on success, -1 if a layer failed to pack.
+ */
+static int pack_filter(bloom_filter *f) {
+    snapshot_state state = {f, NULL, 0, 0};
+    f->ops->serialize(f->engine, pack_map, &state);
+    if (state.err) {
+        free_packed(f);
+        return -1;
+    }
+
+    uint64_t bytes = 0;
+    for (int i=0; i < f->num_packed; i++) {
+        if (f->packed[i]) bytes += snapshot_packed_bytes(f->packed[i]);
+    }
+    syslog(LOG_INFO, "Packed filter %s. Size: %llu Packed: %llu", f->filter_name,
+            (unsigned long long)__atomic_load_n(&f->mapped_bytes, __ATOMIC_RELAXED),
+            (unsigned long long)bytes);
+    return 0;
+}
+
+/**
+ * Unpacks the layers of a cold in-memory filter into new
+ * anonymous bitmaps, and opens the engine over them. The
+ * packed layers are kept if this fails.
+ * @return 0 on success. -1 on error.
+ */
+static int unpack_filter(bloom_filter *f) {
+    int num = f->num_packed, err = 0;
+    bloom_bitmap **maps = calloc(num, sizeof(bloom_bitmap*));
+    bitmap_mode mode = ANONYMOUS | ((f->config->use_huge_pages) ? HUGE_PAGES : 0);
+    for (int i=0; i < num && !err; i++) {
+        if (!f->packed[i]) {
+            err = 1;
+            break;
+        }
+        bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+        if (bitmap_from_file(-1, f->packed[i]->size, mode, map)) {
+            free(map);
+            err = 1;
+            break;
+        }
+        place_bitmap(f, map);
+        maps[i] = map;
+        if (snapshot_unpack(f->packed[i], map)) err = 1;
+    }
+
+    // Open the engine over the bitmaps
+    if (!err && open_engine(f, num, maps)) err = 1;
+
+    // Cleanup on err, the engine only owns the bitmaps on success
+    if (err) {
+        syslog(LOG_ERR, "Failed to unpack filter %s.", f->filter_name);
+        for (int i=0; i < num; i++) {
+            if (!maps[i]) continue;
+            bitmap_close(maps[i]);
+            free(maps[i]);
+        }
+    } else {
+        free_packed(f);
+        COUNT(f, page_ins, 1);
+        stats_add(STAT_PAGE_INS, 1);
+    }
+    free(maps);
+    return (err) ? -1 : 0;
+}
+
+/**
+ * Frees the packed layers of a filter, if any
+ */
+static void free_packed(bloom_filter *f) {
+    for (int i=0; i < f->num_packed; i++) {
+        if (!f->packed[i]) continue;
+        stats_add(STAT_PACKED_BYTES, -(int64_t)snapshot_packed_bytes(f->packed[i]));
+        snapshot_free_packed(f->packed[i]);
+    }
+    free(f->packed);
+    f->packed = NULL;
+    f->num_packed = 0;
+}
+
+/**
+ * Renames the data files so that they are numbered in order
+ * without gaps, since new data files are named by the count
+ * of the existing ones. Gaps are left by compaction, or if it
+ * is interrupted. The names in the list are updated.
+ * @arg namelist The data files, in sorted order
+ * @arg num The number of data files
+ * @return 0 on success. -1 on error.
+ */
+static int renumber_data_files(bloom_filter *f, struct dirent **namelist, int num) {
+    char *name = NULL;
+    int res;
+    for (int i=0; i < num; i++) {
+        res = asprintf(&name, DATA_FILE_NAME, i);
+        assert(res != -1);
+        if (strcmp(name, namelist[i]->d_name)) {
+            char *old_path = join_path(f->full_path, namelist[i]->d_name);
+            char *new_path = join_path(f->full_path, name);
+            res = rename(old_path, new_path);
+            if (res) {
+                syslog(LOG_ERR, "Failed to rename: %s to %s. %s", old_path, new_path, strerror(errno));
+            } else {
+                snprintf(namelist[i]->d_name, sizeof(namelist[i]->d_name), "%s", name);
+            }
+            free(old_path);
+            free(new_path);
+            if (res) {
+                free(name);
+                return -1;
+            }
+        }
+        free(name);
+    }
+    return 0;
+}
+
+/**
+ * Restores any snapshots left by a cold unmap into
+ * plain data files, so that they can be discovered.
+ * @return 0 on success. -1 on error.
+ */
+static int restore_snapshots(bloom_filter *f) {
+    struct dirent **namelist = NULL;
+    int num = scandir(f->full_path, &namelist, filter_snapshot_files, alphasort);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan snapshots for filter '%s'. %s",
+                f->filter_name, strerror(errno));
+        return -1;
+    }
+
+    int err = 0;
+    for (int i=0; i < num; i++) {
+        char *snap_path = join_path(f->full_path, namelist[i]->d_name);
+
+        // The data file has the same name, with the .mmap suffix
+        char *data_path = strdup(snap_path);
+        memcpy(data_path + strlen(data_path) - 4, "mmap", 4);
+
+        // A data file is only renamed into place once it is complete,
+        // so if it exists the snapshot is stale.
+        int res = 0;
+        struct stat buf;
+        if (stat(data_path, &buf)) {
+            syslog(LOG_INFO, "Restoring snapshot: %s.", snap_path);
+            res = snapshot_restore(snap_path, data_path, SNAPSHOT_RESTORE_THREADS);
+        }
+        if (res) {
+            syslog(LOG_ERR, "Failed to restore snapshot: %s. Err: %d", snap_path, res);
+            err = -1;
+        } else if (unlink(snap_path)) {
+            syslog(LOG_ERR, "Failed to delete: %s. %s", snap_path, strerror(errno));
+        }
+        free(data_path);
+        free(snap_path);
+    }
+
+    for (int i=0; i < num; i++) free(namelist[i]);
+    free(namelist);
+    return err;
+}
+
 /**
  * This beast mode method scans the data directory
  * belonging to this filter for any existing filters,
- * and restores the SBF
+ * and opens the engine over them
  * @return 0 on success. -1 on error.
  */
 static int discover_existing_filters(bloom_filter *f) {
+    // Inflate any snapshots of a cold unmap first
+    if (restore_snapshots(f)) return -1;
+
     // Scan through the folder looking for data files
     struct dirent **namelist;
     int num;
@@ -446,22 +2555,34 @@ static int discover_existing_filters(bloom_filter *f) {
     }
     syslog(LOG_INFO, "Found %d files for filter %s.", num, f->filter_name);
 
+    // Close any gaps left by an interrupted compaction
+    if (renumber_data_files(f, namelist, num)) {
+        for (int i=0; i < num; i++) free(namelist[i]);
+        free(namelist);
+        return -1;
+    }
+
+    f->num_files = num;
+
     // Speical case when there are no filters
     if (num == 0) {
-        int res = create_sbf(f, 0, NULL);
+        int res = open_engine(f, 0, NULL);
         return res;
     }
 
-    // Allocate space for all the filter
-    bloom_bitmap **maps = malloc(num * sizeof(bloom_bitmap*));
-    bloom_bloomfilter **filters = malloc(num * sizeof(bloom_bloomfilter*));
+    // Allocate space for all the bitmaps
+    bloom_bitmap **maps = calloc(num, sizeof(bloom_bitmap*));
 
-    // Initialize the bitmaps and bloom filters
+    // Initialize the bitmaps, the engine loads its data from them
     int res;
     int err = 0;
     uint64_t size;
-    bitmap_mode mode = (f->config->use_mmap) ? SHARED : PERSISTENT;
+    bitmap_mode mode = file_bitmap_mode(f);
     for (int i=0; i < num && !err; i++) {
+        // Older layers of a tiered filter are left in the page cache,
+        // only the newest data file takes adds
+        bitmap_mode map_mode = (tiered(f) && i < num - 1) ? SHARED : mode;
+
         // Get the full path to the bitmap
         char *bitmap_path = join_path(f->full_path, namelist[i]->d_name);
         syslog(LOG_INFO, "Discovered bloom filter: %s.", bitmap_path);
@@ -476,8 +2597,8 @@ static int discover_existing_filters(bloom_filter *f) {
         }
 
         // Create the bitmap
-        bloom_bitmap *bitmap = maps[num - i - 1] = malloc(sizeof(bloom_bitmap));
-        res = bitmap_from_filename(bitmap_path, size, 0, mode, bitmap);
+        bloom_bitmap *bitmap = malloc(sizeof(bloom_bitmap));
+        res = bitmap_from_filename(bitmap_path, size, 0, map_mode, bitmap);
         if (res != 0) {
             err = 1;
             syslog(LOG_ERR, "Failed to load bitmap for: %s. %s", bitmap_path, strerror(errno));
@@ -485,19 +2606,10 @@ static int discover_existing_filters(bloom_filter *f) {
             free(bitmap_path);
             break;
         }
-
-        // Create the bloom filter
-        bloom_bloomfilter *filter = filters[num - i - 1] = malloc(sizeof(bloom_bloomfilter));
-        res = bf_from_bitmap(bitmap, 1, 0, filter);
-        if (res != 0) {
-            err = 1;
-            syslog(LOG_ERR, "Failed to load bloom filter for: %s. [%d]", bitmap_path, res);
-            free(filter);
-            bitmap_close(bitmap);
-            free(bitmap);
-            free(bitmap_path);
-            break;
-        }
+        bitmap->max_flush_pages = f->config->flush_run_pages;
+        place_bitmap(f, bitmap);
+        track_bitmap(f, bitmap);
+        maps[i] = bitmap;
 
         // Cleanup
         free(bitmap_path);
@@ -507,100 +2619,340 @@ static int discover_existing_filters(bloom_filter *f) {
     for (int i=0; i < num; i++) free(namelist[i]);
     free(namelist);
 
-    // Return if there was an error
-    if (err) return -1;
+    // Open the engine over the bitmaps
+    if (!err && open_engine(f, num, maps)) err = 1;
 
-    // Create the SBF
-    res = create_sbf(f, num, filters);
+    // Cleanup on err, the engine only owns the bitmaps on success
+    if (err) {
+        for (int i=0; i < num; i++) {
+            if (!maps[i]) continue;
+            bitmap_close(maps[i]);
+            free(maps[i]);
+        }
+    } else {
+        // Increase our page ins
+        COUNT(f, page_ins, 1);
+        stats_add(STAT_PAGE_INS, 1);
+        report_io(f);
+    }
 
-    // Cleanup on err
-    if (res != 0) {
-        syslog(LOG_ERR, "Failed to make scalable bloom filter for: %s.", f->filter_name);
+    free(maps);
+    return (err) ? -1 : 0;
+}
+
+/**
+ * Opens the container of a filter, and the engine over
+ * the layers in it. Creates the container if it is new.
+ * @return 0 on success. -1 on error.
+ */
+static int open_container(bloom_filter *f) {
+    char *path = join_path(f->full_path, (char*)CONTAINER_FILE_NAME);
+    int res = container_open(path, &f->container);
+    free(path);
+    if (res) return -1;
+
+    container_header *h = &f->container->header;
+    int num = h->num_layers;
+    syslog(LOG_INFO, "Found %d layers in the container of filter %s.", num, f->filter_name);
+
+    // Map each layer over the file of the container
+    bloom_bitmap **maps = calloc(num + 1, sizeof(bloom_bitmap*));
+    int err = 0;
+    bitmap_mode mode = file_bitmap_mode(f) | BORROW_FILE;
+    for (int i=0; i < num; i++) {
+        bloom_bitmap *bitmap = malloc(sizeof(bloom_bitmap));
+        res = bitmap_from_file_range(f->container->fd, h->layers[i].offset, h->layers[i].size, mode, bitmap);
+        if (res != 0) {
+            err = 1;
+            syslog(LOG_ERR, "Failed to load layer %d of filter %s. Err: %d", i, f->filter_name, res);
+            free(bitmap);
+            break;
+        }
+        bitmap->max_flush_pages = f->config->flush_run_pages;
+        place_bitmap(f, bitmap);
+        track_bitmap(f, bitmap);
+        maps[i] = bitmap;
+    }
+
+    // Open the engine, any layers it creates are added to the container
+    if (!err && open_engine(f, num, maps)) err = 1;
 
-        // For fucks sake. We need to clean up so much shit now.
+    // Cleanup on err, the engine only owns the bitmaps on success
+    if (err) {
         for (int i=0; i < num; i++) {
-            bf_close(filters[i]);
+            if (!maps[i]) continue;
             bitmap_close(maps[i]);
-            free(filters[i]);
             free(maps[i]);
         }
+        container_close(f->container);
+        f->container = NULL;
+    } else {
+        COUNT(f, page_ins, 1);
+        stats_add(STAT_PAGE_INS, 1);
+        report_io(f);
     }
 
-    // Increase our page ins
-    f->counters.page_ins += 1;
-
-    // Remove the filters list
     free(maps);
-    free(filters);
     return (err) ? -1 : 0;
 }
 
 /**
- * Internal method to create the SBF
+ * Internal method to open the engine of a filter
  */
-static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters) {
-    // Setup the SBF params
-    bloom_sbf_params params = {
-        f->filter_config.initial_capacity,
-        f->filter_config.default_probability,
-        f->filter_config.scale_size,
-        f->filter_config.probability_reduction
+static int open_engine(bloom_filter *f, int num, bloom_bitmap **maps) {
+    // Frozen filters cannot write a new summary
+    bloom_engine_params params = {
+        &f->filter_config,
+        bloomf_map_callback,
+        f,
+        bloomf_summary_callback,
+        (f->filter_config.frozen) ? 0 : __atomic_load_n(&f->config->summary_capacity, __ATOMIC_RELAXED)
     };
 
-    // Create the SBF
-    f->sbf = malloc(sizeof(bloom_sbf));
-    int res = sbf_from_filters(&params, bloomf_sbf_callback, f, num, filters, (bloom_sbf*)f->sbf);
+    void *engine = NULL;
+    int res = f->ops->open(&params, num, maps, &engine);
 
     // Handle a failure
     if (res != 0) {
-        syslog(LOG_ERR, "Failed to create SBF: %s. Err: %d", f->filter_name, res);
-        free((bloom_sbf*)f->sbf);
-        f->sbf = NULL;
+        syslog(LOG_ERR, "Failed to open %s engine: %s. Err: %d",
+                f->ops->name, f->filter_name, res);
     } else {
-        syslog(LOG_INFO, "Loaded SBF: %s. Num filters: %d.", f->filter_name, num);
+        // The data files may have changed the engine
+        f->ops = config_engine_ops(&f->filter_config);
+        if (!f->filter_config.in_memory && !f->filter_config.frozen) replay_wal(f, engine);
+        f->engine = engine;
+
+        // Count the loaded data, new bitmaps are counted as they are made
+        stats_add(STAT_MAPPED_FILTERS, 1);
+        recount_mapped_bytes(f);
+        syslog(LOG_INFO, "Loaded %s engine: %s. Num files: %d.",
+                f->ops->name, f->filter_name, num);
+    }
+    return res;
+}
+
+/**
+ * Replays the write-ahead log of a filter into its engine, before
+ * the engine is published, and opens the log if the filter is
+ * logged. Only sets that are idempotent are logged, so that keys
+ * replayed after their flush are harmless.
+ * @return 0 on success.
+ */
+static int replay_wal(bloom_filter *f, void *engine) {
+    wal_replay_state state = {f, engine};
+    int num = wal_replay(f->full_path, replay_wal_cb, &state);
+    if (num < 0) {
+        syslog(LOG_ERR, "Failed to replay the log of filter %s. Err: %d", f->filter_name, num);
+    } else if (num > 0) {
+        syslog(LOG_INFO, "Replayed %d keys from the log of filter %s.", num, f->filter_name);
+    }
+
+    bloom_filter_config *fc = &f->filter_config;
+    int logged = f->config->wal && !fc->counting && fc->engine == ENGINE_BLOOM && !fc->window;
+    if (logged) {
+        int res = wal_open(f->full_path, &f->wal);
+        if (res) syslog(LOG_ERR, "Failed to open the log of filter %s. Err: %d", f->filter_name, res);
+        return res;
+    }
+
+    // The log was turned off, so the replayed keys are flushed instead
+    if (num > 0 && !f->ops->flush(engine)) {
+        bloom_wal *wal;
+        if (!wal_open(f->full_path, &wal)) wal_close(wal, 1);
+    }
+    return 0;
+}
+
+/**
+ * Adds a key from the log to the engine being opened
+ */
+static void replay_wal_cb(void *data, const char *key, uint32_t len) {
+    wal_replay_state *state = data;
+    state->filter->ops->add(state->engine, key, len);
+}
+
+/**
+ * Checks if the older layers of a filter are kept in the page
+ * cache. Only scalable filters stop setting bits in a layer
+ * once it is full, the other engines write every layer. Pinned
+ * filters are kept in memory as a whole.
+ */
+static int tiered(bloom_filter *f) {
+    bloom_filter_config *fc = &f->filter_config;
+    return f->config->tiered_layers && !f->config->use_mmap && !f->config->use_huge_pages &&
+        !fc->in_memory && !fc->frozen && !fc->counting && !fc->window && !fc->pin &&
+        fc->engine == ENGINE_BLOOM;
+}
+
+/**
+ * Invoked by serialize for each layer, newest first. Moves the
+ * clean layers behind the newest one to the page cache. The spare
+ * layer of a filter prepared to grow is numbered past the newest.
+ */
+static int seal_map_cb(void *data, int num, bloom_bitmap *map) {
+    seal_state *state = data;
+    if (state->newest < 0) {
+        state->newest = num;
+        return 0;
+    }
+    if (num > state->newest || map->mode != PERSISTENT || bitmap_dirty_bytes(map)) return 0;
+
+    int res = bitmap_share(map);
+    if (res) {
+        syslog(LOG_WARNING, "Failed to seal data file %d of filter %s. Err: %d",
+                num, state->filter->filter_name, res);
+        return 0;
+    }
+    state->sealed++;
+    return 0;
+}
+
+/**
+ * Returns the bitmap mode to use for file backed bitmaps.
+ * Huge pages, lazy page in and direct I/O only apply to the
+ * PERSISTENT mode, since SHARED bitmaps live in the page cache. Frozen
+ * filters are always SHARED, and mapped read only.
+ */
+static bitmap_mode file_bitmap_mode(bloom_filter *f) {
+    if (f->filter_config.frozen) return SHARED | READ_ONLY;
+    if (f->config->use_mmap) return SHARED | ((f->config->use_dax) ? DAX : 0);
+    return PERSISTENT | ((f->config->use_huge_pages) ? HUGE_PAGES : 0) |
+        ((f->config->lazy_page_in) ? LAZY : 0) |
+        ((f->config->direct_io) ? DIRECT_IO : 0);
+}
+
+/**
+ * Applies the NUMA policy to a new bitmap, and locks it
+ * in memory if the filter is pinned. A pin that exceeds
+ * RLIMIT_MEMLOCK is logged, and the bitmap left unlocked.
+ * The I/O of the bitmap is counted from here on.
+ */
+static void place_bitmap(bloom_filter *f, bloom_bitmap *map) {
+    bitmap_count_io(map, &f->io);
+    numa_place_memory(map->mmap, map->mapped_len, f->config->numa_policy, f->numa_node);
+    if (f->filter_config.pin && mlock(map->mmap, map->mapped_len)) {
+        syslog(LOG_WARNING, "Failed to pin a bitmap of filter %s. %s",
+                f->filter_name, strerror(errno));
     }
+}
 
+/**
+ * Invoked by serialize for each layer, starts the writeback of
+ * the layers mapped SHARED. The other modes are written by flushes.
+ */
+static int writeback_map_cb(void *data, int num, bloom_bitmap *map) {
+    bloom_filter *f = data;
+    int res = bitmap_writeback(map);
+    if (res) {
+        syslog(LOG_WARNING, "Failed to write back data file %d of filter %s. Err: %d",
+                num, f->filter_name, res);
+    }
     return res;
 }
 
 /**
- * Callback used with SBF to generate file names.
+ * The most pages checked by a single mincore call
+ */
+#define RESIDENT_CHUNK_PAGES 4096
+
+/**
+ * Invoked by serialize for each layer, adds the
+ * bytes of its resident pages.
+ */
+static int resident_map_cb(void *data, int num, bloom_bitmap *map) {
+    (void)num;
+    uint64_t *bytes = data;
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+    // mincore needs a page aligned start
+    uintptr_t start = (uintptr_t)map->mmap & ~(page_size - 1);
+    uintptr_t end = (uintptr_t)map->mmap + map->mapped_len;
+    unsigned char vec[RESIDENT_CHUNK_PAGES];
+    while (start < end) {
+        uint64_t len = end - start;
+        if (len > RESIDENT_CHUNK_PAGES * page_size) len = RESIDENT_CHUNK_PAGES * page_size;
+        if (mincore((void*)start, len, vec)) return 0;
+        uint64_t pages = (len + page_size - 1) / page_size;
+        for (uint64_t i=0; i < pages; i++) {
+            if (vec[i] & 1) *bytes += page_size;
+        }
+        start += len;
+    }
+    return 0;
+}
+
+/**
+ * Invoked by serialize for each layer, adds
+ * the bytes of its dirty pages.
+ */
+static int dirty_map_cb(void *data, int num, bloom_bitmap *map) {
+    (void)num;
+    uint64_t *bytes = data;
+    *bytes += bitmap_dirty_bytes(map);
+    return 0;
+}
+
+/**
+ * Tracks the epochs of the pages of a new bitmap, for deltas.
+ * Bitmaps that do not track their dirty pages are not tracked,
+ * and all their pages are exported.
  */
-static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
+static void track_bitmap(bloom_filter *f, bloom_bitmap *map) {
+    if (!f->config->delta_snapshots || map->mode != PERSISTENT) return;
+    if (bitmap_track_epochs(map, &f->epoch)) {
+        syslog(LOG_WARNING, "Failed to track the page epochs of filter %s.", f->filter_name);
+    }
+}
+
+/**
+ * Callback used with the engine to create new bitmaps.
+ */
+static int bloomf_map_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
     // Cast the input pointer
     bloom_filter *filt = in;
+    slowlog_note(SLOWLOG_GROWTH);
 
     // Check if we are in-memory
     if (filt->filter_config.in_memory) {
         syslog(LOG_INFO, "Creating new in-memory bitmap for filter %s. Size: %llu",
             filt->filter_name, (unsigned long long)bytes);
-        return bitmap_from_file(-1, bytes, ANONYMOUS, out);
-    }
-
-    // Scan through the folder looking for data files
-    struct dirent **namelist = NULL;
-    int num_files;
-
-    // Filter only data dirs, in sorted order
-    num_files = scandir(filt->full_path, &namelist, filter_data_files, NULL);
-    syslog(LOG_INFO, "Found %d files for filter %s.", num_files, filt->filter_name);
-    if (num_files < 0) {
-        syslog(LOG_ERR, "Error discovering files for filter '%s'. %s",
-                filt->filter_name, strerror(errno));
-        return -1;
+        int res = bitmap_from_file(-1, bytes,
+                ANONYMOUS | ((filt->config->use_huge_pages) ? HUGE_PAGES : 0), out);
+        if (!res) {
+            place_bitmap(filt, out);
+            count_mapped_bytes(filt, bytes);
+        }
+        return res;
     }
 
-
-    // Free the memory associated with scandir
-    for (int i=0; i < num_files; i++) {
-        free(namelist[i]);
+    // Add a layer to the container, if the filter has one
+    if (filt->container) {
+        uint64_t offset;
+        int res = container_add_layer(filt->container, bytes, &offset);
+        if (!res) {
+            res = bitmap_from_file_range(filt->container->fd, offset, bytes,
+                    file_bitmap_mode(filt) | BORROW_FILE | NEW_BITMAP, out);
+            if (res) container_truncate(filt->container, filt->container->header.num_layers - 1);
+        }
+        if (res) {
+            syslog(LOG_CRIT, "Failed to add a layer to the container of filter %s. Err: %d",
+                filt->filter_name, res);
+        } else {
+            syslog(LOG_INFO, "Added layer %d to the container of filter %s. Size: %llu",
+                filt->container->header.num_layers - 1, filt->filter_name, (unsigned long long)bytes);
+            out->max_flush_pages = filt->config->flush_run_pages;
+            place_bitmap(filt, out);
+            track_bitmap(filt, out);
+            count_mapped_bytes(filt, bytes);
+        }
+        return res;
     }
-    if (namelist) free(namelist);
 
-    // Generate the new file name
+    // Generate the new file name. The data files are numbered
+    // without gaps, so the count of them names the next one.
     char *filename = NULL;
     int file_name_len;
-    file_name_len = asprintf(&filename, DATA_FILE_NAME, num_files);
+    file_name_len = asprintf(&filename, DATA_FILE_NAME, filt->num_files);
     assert(file_name_len != -1);
 
     // Get the full path
@@ -610,11 +2962,100 @@ static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
             full_path, filt->filter_name, (unsigned long long)bytes);
 
     // Create the bitmap
-    bitmap_mode mode = (filt->config->use_mmap) ? SHARED : PERSISTENT;
+    bitmap_mode mode = file_bitmap_mode(filt);
     int res = bitmap_from_filename(full_path, bytes, 1, mode, out);
     if (res) {
         syslog(LOG_CRIT, "Failed to create new file: %s for filter %s. Err: %s",
             full_path, filt->filter_name, strerror(errno));
+    } else {
+        filt->num_files++;
+        out->max_flush_pages = filt->config->flush_run_pages;
+        place_bitmap(filt, out);
+        track_bitmap(filt, out);
+        count_mapped_bytes(filt, bytes);
+    }
+    free(full_path);
+    return res;
+}
+
+/**
+ * Callback used with the engine to create the bitmap a data file
+ * is folded into. On disk, it is a file of its own, which replaces
+ * the data file once the fold is durable.
+ */
+static int bloomf_fold_callback(void *in, int num, uint64_t bytes, bloom_bitmap *out) {
+    bloom_filter *filt = in;
+    int res;
+    if (filt->filter_config.in_memory) {
+        res = bitmap_from_file(-1, bytes,
+                ANONYMOUS | ((filt->config->use_huge_pages) ? HUGE_PAGES : 0), out);
+        if (!res) place_bitmap(filt, out);
+        return res;
+    }
+
+    // A fold that was cut short leaves its file, which must not be reused
+    char *full_path = data_file_path(filt, FOLD_FILE_NAME, num);
+    unlink(full_path);
+    syslog(LOG_INFO, "Creating folded file: %s for filter %s. Size: %llu",
+            full_path, filt->filter_name, (unsigned long long)bytes);
+    res = bitmap_from_filename(full_path, bytes, 1, file_bitmap_mode(filt), out);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create folded file: %s for filter %s. Err: %s",
+            full_path, filt->filter_name, strerror(errno));
+    } else {
+        out->max_flush_pages = filt->config->flush_run_pages;
+        place_bitmap(filt, out);
+        track_bitmap(filt, out);
+    }
+    free(full_path);
+    return res;
+}
+
+/**
+ * Returns the path of a file of a filter, named by a format
+ * with the number of a data file. Must be free'd.
+ */
+static char* data_file_path(bloom_filter *f, const char *format, int num) {
+    char *name = NULL;
+    int name_len = asprintf(&name, format, num);
+    assert(name_len != -1);
+    char *path = join_path(f->full_path, name);
+    free(name);
+    return path;
+}
+
+/**
+ * Callback used with the engine to open the summary of the
+ * layers. The summary is a file of its own, next to the data files.
+ */
+static int bloomf_summary_callback(void *in, uint64_t bytes, bloom_bitmap *out) {
+    bloom_filter *filt = in;
+    int res;
+    if (filt->filter_config.in_memory) {
+        if (!bytes) return -ENOENT;
+        res = bitmap_from_file(-1, bytes,
+                ANONYMOUS | ((filt->config->use_huge_pages) ? HUGE_PAGES : 0), out);
+        if (!res) place_bitmap(filt, out);
+        return res;
+    }
+
+    // Open the existing summary, or create it if the layers are summarized
+    char *full_path = join_path(filt->full_path, (char*)SUMMARY_FILE_NAME);
+    struct stat buf;
+    int exists = stat(full_path, &buf) == 0;
+    if (!exists && !bytes) {
+        free(full_path);
+        return -ENOENT;
+    }
+    res = bitmap_from_filename(full_path, (exists) ? (uint64_t)buf.st_size : bytes, !exists,
+            file_bitmap_mode(filt), out);
+    if (res) {
+        syslog(LOG_ERR, "Failed to open the summary: %s for filter %s. Err: %s",
+            full_path, filt->filter_name, strerror(errno));
+    } else {
+        out->max_flush_pages = filt->config->flush_run_pages;
+        place_bitmap(filt, out);
+        res = exists;
     }
     free(full_path);
     return res;
@@ -625,8 +3066,304 @@ static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
  * between two timeval structures.
  */
 static int timediff_msec(struct timeval *t1, struct timeval *t2) {
+    return timediff_usec(t1, t2) / 1000;
+}
+
+/**
+ * Computes the difference in time in microseconds
+ * between two timeval structures.
+ */
+static uint64_t timediff_usec(struct timeval *t1, struct timeval *t2) {
     uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
+    uint64_t micro2 = t2->tv_sec * 1000000 + t2->tv_usec;
+    return micro2 - micro1;
+}
+
+/**
+ * Allocates the partitions of a filter, proxied. Each partition
+ * is a filter in a folder of its own, in the folder of the
+ * filter, and is sized for its share of the keys.
+ */
+static void alloc_parts(bloom_filter *f) {
+    int num = f->filter_config.partitions;
+    f->parts = calloc(num, sizeof(bloom_filter*));
+    f->part_locks = calloc(num, sizeof(pthread_rwlock_t));
+    while ((1 << f->part_bits) < num) f->part_bits++;
+
+    char name[32];
+    bloom_filter *part;
+    for (int i=0; i < num; i++) {
+        part = f->parts[i] = alloc_filter(f->config, f->filter_name);
+        snprintf(name, sizeof(name), PARTITION_FOLDER_NAME, i);
+        free(part->full_path);
+        part->full_path = join_path(f->full_path, name);
+        part->parent = f;
+        part->numa_node = f->numa_node;
+
+        part->filter_config = f->filter_config;
+        part->filter_config.partitions = 1;
+        part->filter_config.initial_capacity = f->filter_config.initial_capacity / num + 1;
+        part->filter_config.size = f->filter_config.size / num;
+        part->filter_config.capacity = f->filter_config.capacity / num;
+        part->filter_config.bytes = f->filter_config.bytes / num;
+        part->ops = config_engine_ops(&part->filter_config);
+        pthread_rwlock_init(f->part_locks + i, NULL);
+    }
+}
+
+/**
+ * Faults in the partitions of a filter that are proxied
+ */
+static int fault_parts(bloom_filter *f) {
+    uint64_t start = hist_now_usec();
+    pthread_mutex_lock(&f->engine_lock);
+
+    // Cataloged filters may not have a folder yet
+    if (mkdir(f->full_path, 0755) && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create filter directory '%s'. Err: %d", f->full_path, errno);
+    }
+    int res = 0, faulted = 0;
+    for (int i=0; i < f->filter_config.partitions && !res; i++) {
+        if (f->parts[i]->engine) continue;
+        res = thread_safe_fault(f->parts[i]);
+        faulted = 1;
+    }
+    if (!res && faulted) hist_record(&hot_state(f)->page_in_latency, hist_now_usec() - start);
+
+    pthread_mutex_unlock(&f->engine_lock);
+    return res;
+}
+
+/**
+ * Flushes the partitions of a filter, each under its lock
+ * since it may grow meanwhile, then writes out the config
+ * of the filter with the totals of the partitions.
+ * @arg flusher The flusher to use, or NULL to flush now
+ */
+static int flush_parts(bloom_filter *f, bloom_flusher *flusher) {
+    uint64_t start = hist_now_usec();
+    int res = 0, part_res;
+    for (int i=0; i < f->filter_config.partitions; i++) {
+        pthread_rwlock_rdlock(f->part_locks + i);
+        if (flusher) {
+            part_res = bloomf_flush_async(f->parts[i], flusher);
+        } else {
+            part_res = bloomf_flush(f->parts[i]);
+        }
+        pthread_rwlock_unlock(f->part_locks + i);
+        if (part_res && !res) res = part_res;
+    }
+    if (update_flush_config(f) && !flusher) {
+        hist_record(&hot_state(f)->flush_latency, hist_now_usec() - start);
+    }
+    return res;
+}
+
+/**
+ * Closes the partitions of a filter, and writes out the
+ * config of the filter with their totals
+ */
+static int close_parts(bloom_filter *f, int snapshot) {
+    pthread_mutex_lock(&f->engine_lock);
+    int mapped = 0;
+    for (int i=0; i < f->filter_config.partitions; i++) {
+        if (f->parts[i]->engine) mapped = 1;
+        close_filter(f->parts[i], snapshot);
+    }
+    if (mapped) update_flush_config(f);
+    pthread_mutex_unlock(&f->engine_lock);
+    return 0;
+}
+
+/**
+ * Sums a metric over the partitions of a filter
+ */
+static uint64_t sum_parts(bloom_filter *f, uint64_t (*metric)(bloom_filter*)) {
+    uint64_t total = 0;
+    for (int i=0; i < f->filter_config.partitions; i++) {
+        total += metric(f->parts[i]);
+    }
+    return total;
+}
+
+/**
+ * Returns the partition of a key, from the high bits of its hash
+ */
+static int key_part(bloom_filter *f, const char *key, uint64_t len) {
+    uint64_t hash[2];
+    WyHash128(key, len, PARTITION_SEED, hash);
+    return hash[0] >> (64 - f->part_bits);
+}
+
+/**
+ * Groups the keys of a batch by partition. The keys of partition
+ * p are keys[order[i]] for i from starts[p] to starts[p+1].
+ * @arg starts Output, the start of each partition in the order,
+ * with room for a partition past the last
+ * @return The order. Must be free'd.
+ */
+static int* group_parts(bloom_filter *f, char **keys, uint64_t *key_lens, int num_keys, int *starts) {
+    int num = f->filter_config.partitions;
+    int *order = malloc(2 * num_keys * sizeof(int) + 1);
+    int *key_parts = order + num_keys;
+    memset(starts, 0, (num + 1) * sizeof(int));
+    for (int i=0; i < num_keys; i++) {
+        key_parts[i] = key_part(f, keys[i], KEY_LEN(keys, key_lens, i));
+        starts[key_parts[i] + 1]++;
+    }
+    for (int p=0; p < num; p++) starts[p+1] += starts[p];
+
+    // Place the keys in order within their partition
+    int next[MAX_PARTITIONS];
+    memcpy(next, starts, num * sizeof(int));
+    for (int i=0; i < num_keys; i++) order[next[key_parts[i]]++] = i;
+    return order;
+}
+
+/**
+ * Counts a change of the bytes mapped by a filter, both
+ * for the filter and in the server wide stats.
+ */
+static void count_mapped_bytes(bloom_filter *f, int64_t delta) {
+    __atomic_add_fetch(&f->mapped_bytes, delta, __ATOMIC_RELAXED);
+    if (f->parent) __atomic_add_fetch(&f->parent->mapped_bytes, delta, __ATOMIC_RELAXED);
+    stats_add(STAT_MAPPED_BYTES, delta);
+}
+
+/**
+ * Adds the I/O of a filter since the last report to the
+ * stats. The reported bytes are swapped in atomically, so
+ * reports that race still sum to the bytes counted.
+ */
+static void report_io(bloom_filter *f) {
+    uint64_t read = __atomic_load_n(&f->io.bytes_read, __ATOMIC_RELAXED);
+    uint64_t written = __atomic_load_n(&f->io.bytes_written, __ATOMIC_RELAXED);
+    read -= __atomic_exchange_n(&f->io_reported.bytes_read, read, __ATOMIC_RELAXED);
+    written -= __atomic_exchange_n(&f->io_reported.bytes_written, written, __ATOMIC_RELAXED);
+    if (read) stats_add(STAT_PAGE_IN_BYTES, (int64_t)read);
+    if (written) stats_add(STAT_FLUSH_BYTES, (int64_t)written);
+}
+
+/**
+ * Counts the bytes mapped by a filter again from its engine,
+ * after a change that may free data. Needs the engine lock.
+ */
+static void recount_mapped_bytes(bloom_filter *f) {
+    // A frozen filter lives in the page cache, which the kernel reclaims itself
+    int64_t bytes = (f->filter_config.frozen) ? 0 : f->ops->byte_size(f->engine);
+    count_mapped_bytes(f, bytes - __atomic_load_n(&f->mapped_bytes, __ATOMIC_RELAXED));
+}
+
+
+/**
+ * Returns the hot state of a filter, allocating it on first use.
+ * There is a counter shard for each worker thread, rounded up to
+ * a power of 2, so that filters do not pay for shards that are
+ * never used. Racing threads install one of their states.
+ */
+static filter_hot_state* hot_state(bloom_filter *f) {
+    filter_hot_state *hot = __atomic_load_n(&f->hot, __ATOMIC_ACQUIRE);
+    if (hot) return hot;
+
+    int num = 1;
+    while (num < f->config->worker_threads && num < MAX_COUNTER_SHARDS) num <<= 1;
+    size_t size = sizeof(filter_hot_state) + num * sizeof(filter_counter_shard);
+    if (posix_memalign((void**)&hot, 64, size)) abort();
+    memset(hot, 0, size);
+    hot->counter_mask = num - 1;
+
+    filter_hot_state *expected = NULL;
+    if (!__atomic_compare_exchange_n(&f->hot, &expected, hot, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(hot);
+        hot = expected;
+    }
+    return hot;
+}
+
+/**
+ * Gets the hot state of a filter, with its latencies.
+ */
+filter_hot_state* bloomf_hot_state(bloom_filter *filter) {
+    return __atomic_load_n(&filter->hot, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Detaches the hot state of an unmapped filter and its partitions.
+ * The counters are added to the totals before the state is taken,
+ * so a racing read may count them twice, but never misses them.
+ */
+filter_hot_state* bloomf_detach_hot(bloom_filter *filter) {
+    filter_hot_state *chain = NULL, *part;
+    for (int i=0; filter->parts && i < filter->filter_config.partitions; i++) {
+        part = bloomf_detach_hot(filter->parts[i]);
+        if (!part) continue;
+        part->next = chain;
+        chain = part;
+    }
+
+    filter_hot_state *hot = __atomic_load_n(&filter->hot, __ATOMIC_ACQUIRE);
+    if (!hot) return chain;
+    uint64_t *out = (uint64_t*)&filter->cold_counters, *in;
+    for (int i=0; i <= hot->counter_mask; i++) {
+        in = (uint64_t*)&hot->counter_shards[i].counters;
+        for (size_t j=0; j < sizeof(filter_counters) / sizeof(uint64_t); j++)
+            __atomic_fetch_add(out + j, __atomic_load_n(in + j, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&filter->hot, NULL, __ATOMIC_RELEASE);
+    hot->next = chain;
+    return hot;
+}
+
+/**
+ * Frees the hot states returned by bloomf_detach_hot
+ */
+void bloomf_free_hot(filter_hot_state *hot) {
+    filter_hot_state *next;
+    while (hot) {
+        next = hot->next;
+        free(hot);
+        hot = next;
+    }
+}
+
+/**
+ * Returns the counter shard of the calling thread. Threads
+ * are numbered as they first count, to spread them over the shards.
+ */
+static filter_counter_shard* counter_shard(bloom_filter *f) {
+    unsigned int id = COUNTER_THREAD;
+    if (!id) id = COUNTER_THREAD = __atomic_add_fetch(&NEXT_COUNTER_THREAD, 1, __ATOMIC_RELAXED);
+    filter_hot_state *hot = hot_state(f);
+    return hot->counter_shards + ((id - 1) & hot->counter_mask);
+}
+
+/**
+ * Renews the generation of a filter once keys may have left
+ * it, which forgets the positives remembered for it. The
+ * filter of a partition takes a new generation as well.
+ */
+static void renew_generation(bloom_filter *f) {
+    for (; f; f = f->parent) {
+        uint64_t gen = __atomic_fetch_add(&NEXT_GENERATION, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&f->generation, gen, __ATOMIC_RELEASE);
+    }
 }
 
+/**
+ * Checks if the checks of a filter use the positive cache,
+ * allocating the cache of the calling thread on first use.
+ * Cuckoo filters evict keys and windowed filters expire
+ * them without a removal, so their positives are not kept.
+ */
+static int positive_cached(bloom_filter *f) {
+    if (f->config->positive_cache <= 0) return 0;
+    if (f->filter_config.engine == ENGINE_CUCKOO || f->filter_config.window) return 0;
+    if (POSITIVE_CACHE) return 1;
+
+    uint64_t entries = 1;
+    while (entries < (uint64_t)f->config->positive_cache) entries <<= 1;
+    POSITIVE_CACHE = calloc(entries, sizeof(positive_entry));
+    if (!POSITIVE_CACHE) return 0;
+    POSITIVE_MASK = entries - 1;
+    return 1;
+}
@@ -1,9 +1,14 @@
 #ifndef BLOOM_FILTER_H
 #define BLOOM_FILTER_H
 #include <pthread.h>
+#include <time.h>
 #include "config.h"
-#include "spinlock.h"
-#include "sbf.h"
+#include "engine.h"
+#include "histogram.h"
+#include "catalog.h"
+#include "container.h"
+#include "wal.h"
+#include "snapshot.h"
 
 /*
  * Functions are NOT thread safe unless explicitly documented
@@ -19,12 +24,47 @@ typedef struct {
     uint64_t check_misses;
     uint64_t set_hits;
     uint64_t set_misses;
+    uint64_t unset_hits;
+    uint64_t unset_misses;
     uint64_t page_ins;
     uint64_t page_outs;
+    uint64_t compactions;
+    uint64_t flushes;
 } filter_counters;
 
 /**
- * Representation of a bloom filters
+ * A shard of the counters of a filter. Each thread counts
+ * into one shard, on cache lines of its own, so the workers
+ * of a hot filter do not contend on the counters. The shards
+ * are only summed when the counters are read.
+ */
+typedef struct {
+    filter_counters counters;
+} __attribute__ ((aligned (64))) filter_counter_shard;
+
+/**
+ * The state a filter only keeps while it is in use, which is most
+ * of its size: the counter shards and the latency histograms. It is
+ * allocated on the first count or latency of the filter, and taken
+ * away once the filter is unmapped, see bloomf_detach_hot. A cold
+ * filter then keeps only the totals of its counters.
+ */
+typedef struct filter_hot_state {
+    latency_histogram page_in_latency;  // Time to fault in the filter
+    latency_histogram flush_latency;    // Time to flush the filter
+    struct filter_hot_state *next;      // Chains the states detached together
+    int counter_mask;                   // The number of shards, minus 1
+    filter_counter_shard counter_shards[];  // Counters, by thread
+} filter_hot_state;
+
+/**
+ * Representation of a bloom filters. A partitioned filter splits
+ * its keys over partitions by the high bits of a hash of the key.
+ * Each partition is a filter of its own, with its own lock, data
+ * and growth, so the keys of different partitions are set in
+ * parallel. The key operations of a partitioned filter take the
+ * lock of the partition, so they are thread safe with each other.
+ * A partitioned filter has no engine of its own.
  */
 typedef struct bloom_filter {
     bloom_config *config;           // bloomd configuration
@@ -33,11 +73,38 @@ typedef struct bloom_filter {
     char *filter_name;              // The name of the filter
     char *full_path;                // Path to our data
 
-    volatile bloom_sbf *sbf;        // Underlying SBF
-    pthread_mutex_t sbf_lock;       // Protects faulting in the SBF
+    const bloom_engine_ops *ops;    // Operations of the engine
+    void * volatile engine;         // Underlying engine, NULL if proxied
+    pthread_mutex_t engine_lock;    // Protects faulting in the engine
+
+    filter_hot_state * volatile hot;    // Counters and latencies while in use, or NULL
+    filter_counters cold_counters;      // The counters of the detached hot states
+
+    int flushes_inflight;           // Asynchronous flushes in progress
+    int numa_node;                  // Home NUMA node, -1 if not bound
+    int64_t mapped_bytes;           // Bytes counted as mapped in the stats
+    bloom_catalog *catalog;         // Records config changes, may be NULL
+    bloom_container *container;     // Holds the layers, NULL for data files
+    int num_files;                  // Data files on disk, numbers the next one
+    time_t flushed_at;              // When the last flush started
+    bloom_wal *wal;                 // Logs the sets, NULL if not logged
+    snapshot_packed **packed;       // Layers of a cold in-memory filter, or NULL
+    int num_packed;
+    uint64_t epoch;                 // Stamped on the pages flushes claim
+    uint64_t layout_epoch;          // Deltas since before it are full
+    uint64_t load_bytes;            // Bytes of the key file loaded so far
+    uint64_t load_total;            // Bytes of the key file of the last load
+    int staged;                     // Set if the next flush writes the cut of bloomf_stage
+    uint64_t staged_size;           // The size of the filter at the cut
 
-    filter_counters counters;       // Counters
-    bloom_spinlock counter_lock;    // Protect the counters
+    struct bloom_filter **parts;    // The partitions, NULL if not partitioned
+    pthread_rwlock_t *part_locks;   // Protects each partition
+    int part_bits;                  // High hash bits that pick the partition
+    struct bloom_filter *parent;    // The filter of a partition, or NULL
+    uint64_t generation;            // Renewed once keys may have left the filter
+
+    bitmap_io_counters io;              // Bytes the bitmaps read and wrote
+    bitmap_io_counters io_reported;     // Part of the io added to the stats
 } bloom_filter;
 
 /**
@@ -51,6 +118,18 @@ typedef struct bloom_filter {
  */
 int init_bloom_filter(bloom_config *config, char *filter_name, int discover, bloom_filter **filter);
 
+/**
+ * Initializes a proxied bloom filter wrapper from a known filter
+ * config, as recorded in the catalog. Neither the folder nor the
+ * config file of the filter are touched until it is faulted in.
+ * @arg config The configuration to use
+ * @arg filter_name The name of the filter
+ * @arg filter_config The filter config of the filter
+ * @arg filter Output parameter, the new filter
+ * @return 0 on success
+ */
+int init_cataloged_filter(bloom_config *config, char *filter_name, bloom_filter_config *filter_config, bloom_filter **filter);
+
 /**
  * Destroys a bloom filter
  * @arg filter The filter to destroy
@@ -59,12 +138,39 @@ int init_bloom_filter(bloom_config *config, char *filter_name, int discover, blo
 int destroy_bloom_filter(bloom_filter *filter);
 
 /**
- * Gets the counters that belong to a filter
+ * Gets the counters that belong to a filter, summed
+ * over the counters of all the threads.
  * @notes Thread safe, but may be inconsistent.
  * @arg filter The filter
- * @return A reference to the counters of a filter
+ * @arg counters Output, the counters of the filter
+ */
+void bloomf_counters(bloom_filter *filter, filter_counters *counters);
+
+/**
+ * Gets the hot state of a filter, with its latencies.
+ * @notes Thread safe. The state is only valid until the
+ * caller checkpoints with the filter manager.
+ * @arg filter The filter
+ * @return The hot state, or NULL if the filter is cold.
  */
-filter_counters* bloomf_counters(bloom_filter *filter);
+filter_hot_state* bloomf_hot_state(bloom_filter *filter);
+
+/**
+ * Detaches the hot state of an unmapped filter and its
+ * partitions, adding their counters to the totals of the
+ * filters. The states are freed by the caller with
+ * bloomf_free_hot, once no thread can still use them.
+ * @notes Not thread safe, the filter must not be in use.
+ * @arg filter The filter
+ * @return The detached states, chained, or NULL if none.
+ */
+filter_hot_state* bloomf_detach_hot(bloom_filter *filter);
+
+/**
+ * Frees the hot states returned by bloomf_detach_hot
+ * @arg hot The chained states
+ */
+void bloomf_free_hot(filter_hot_state *hot);
 
 /**
  * Checks if a filter is currectly mapped into
@@ -74,6 +180,16 @@ filter_counters* bloomf_counters(bloom_filter *filter);
  */
 int bloomf_is_proxied(bloom_filter *filter);
 
+/**
+ * Faults in a proxied filter, so that the next
+ * operation on it does not wait on the disk.
+ * Idempotent if the filter is in memory.
+ * @notes Thread safe.
+ * @arg filter The filter to fault in
+ * @return 0 on success.
+ */
+int bloomf_fault(bloom_filter *filter);
+
 /**
  * Flushes the filter. Idempotent if the
  * filter is proxied or not dirty.
@@ -82,6 +198,50 @@ int bloomf_is_proxied(bloom_filter *filter);
  */
 int bloomf_flush(bloom_filter *filter);
 
+/**
+ * Cuts a consistent image of the filter for the next bloomf_flush.
+ * The dirty pages are copied aside, and the size and the log are
+ * cut with them, so that the flush writes the filter as it is now
+ * while sets go on. No sets may run during the call. Idempotent if
+ * the filter is proxied, in memory, or not dirty.
+ * @arg filter The filter to cut
+ * @return 0 on success.
+ */
+int bloomf_stage(bloom_filter *filter);
+
+/**
+ * Starts an asynchronous flush of the filter. Idempotent
+ * if the filter is proxied or not dirty. The filter is
+ * not closed until the flush completes, which happens
+ * as the flusher is polled.
+ * @arg filter The filter to flush
+ * @arg flusher The flusher to use
+ * @return 0 on success.
+ */
+int bloomf_flush_async(bloom_filter *filter, bloom_flusher *flusher);
+
+/**
+ * Writes out and syncs the write-ahead log of the filter,
+ * if it has one. Skipped if the filter is being faulted
+ * in or closed, which sync the log themselves.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @return 0 on success.
+ */
+int bloomf_sync_wal(bloom_filter *filter);
+
+/**
+ * Starts writing back the dirty pages of the data files of a
+ * filter that are mapped SHARED, such as with use_mmap, without
+ * waiting for them. Done often, this spreads the writes of the
+ * filter out, and leaves little for the sync of its next flush.
+ * Skipped if the filter is being faulted in or closed.
+ * @note This should be invoked with adds excluded.
+ * @arg filter The filter
+ * @return 0 on success.
+ */
+int bloomf_writeback(bloom_filter *filter);
+
 /**
  * Gracefully closes a bloom filter.
  * @arg filter The filter to close
@@ -89,6 +249,182 @@ int bloomf_flush(bloom_filter *filter);
  */
 int bloomf_close(bloom_filter *filter);
 
+/**
+ * Closes a filter that has gone cold. If cold snapshots
+ * are enabled, the data files are replaced with compressed
+ * snapshots, which are restored on the next fault.
+ * @arg filter The filter to unmap
+ * @return 0 on success.
+ */
+int bloomf_unmap(bloom_filter *filter);
+
+/**
+ * Compacts a filter, merging its data files where the
+ * engine allows it, so that checks probe less data.
+ * This is a no-op if the filter is proxied.
+ * @note Must be invoked with exclusive access to the filter.
+ * @arg filter The filter to compact
+ * @return The number of data files merged away, negative on failure.
+ */
+int bloomf_compact(bloom_filter *filter);
+
+/**
+ * Shrinks a filter, folding its data files whose keys are far
+ * below their capacity into smaller ones, see bf_fold. Data
+ * files are folded again while they stay sparse, and the filter
+ * stays within the probability. The keys are all kept. The folded
+ * data files are written next to the old ones, and replace them.
+ * Filters with a container cannot be shrunk.
+ * @note Must be invoked with exclusive access to the filter.
+ * @arg filter The filter to shrink
+ * @arg fp_probability The false positive probability the filter
+ * must stay within, or 0 for the probability of the filter
+ * @return The number of data files folded, -EROFS if the filter is
+ * frozen, -ENOTSUP if it has a container, negative on failure.
+ */
+int bloomf_shrink(bloom_filter *filter, double fp_probability);
+
+/**
+ * Merges, or intersects, the keys of another filter into this
+ * one, in place. The filters must use the same engine, with data
+ * that lines up: the same layers, sizes and hashing.
+ * @note Must be invoked with exclusive access to the filter,
+ * and read access to src.
+ * @arg filter The filter to change
+ * @arg src The filter to read, which is left as is
+ * @arg intersect Intersect the keys instead of merging them
+ * @return 0 on success, -EINVAL if the filters do not line up,
+ * -EROFS if the filter is frozen, negative on failure.
+ */
+int bloomf_combine(bloom_filter *filter, bloom_filter *src, int intersect);
+
+/**
+ * Clears all the keys of a filter in place, without closing it.
+ * The filter goes back to its initial layer, and the data files
+ * of the other layers are deleted. The pages of the kept data are
+ * dropped instead of written with zeros, where the OS allows it.
+ * @note Must be invoked with exclusive access to the filter.
+ * @arg filter The filter to reset
+ * @return 0 on success, -EROFS if the filter is frozen,
+ * negative on failure.
+ */
+int bloomf_reset(bloom_filter *filter);
+
+/**
+ * Prepares a filter to grow, once it is filled past the
+ * prealloc_fill of the config, so that adds do not stall.
+ * This is a no-op if the filter is proxied.
+ * @note Thread safe with adds and checks.
+ * @arg filter The filter to prepare
+ * @return 1 if prepared, 0 if not needed, negative on failure.
+ */
+int bloomf_prepare(bloom_filter *filter);
+
+/**
+ * Rotates the generations of a windowed filter, once the
+ * newest generation is window / generations seconds old. The
+ * oldest generation is cleared in place and takes the new adds.
+ * This is a no-op if the filter is proxied or not windowed.
+ * @note This should be invoked with exclusive access.
+ * @arg filter The filter to rotate
+ * @return The number of generations recycled, negative on failure.
+ */
+int bloomf_rotate(bloom_filter *filter);
+
+/**
+ * Moves the older layers of a scalable filter out of memory
+ * and into the page cache, when tiered_layers is set. A layer
+ * is moved once the filter grew past it and it was flushed, by
+ * mapping its data file at the same address. Only the newest
+ * layer takes adds, so the kernel can evict the pages of the
+ * older ones. This is a no-op if the filter is proxied.
+ * @note Must be invoked with exclusive access to the filter.
+ * @arg filter The filter to seal
+ * @return The number of layers moved, negative on failure.
+ */
+int bloomf_seal(bloom_filter *filter);
+
+/**
+ * Freezes a filter, so that it no longer changes. The filter is
+ * flushed, and mapped again read only from its data files, so it
+ * has no dirty pages and its memory is left to the page cache.
+ * Checks of a frozen filter need no lock. Partitioned, windowed
+ * and in-memory filters cannot be frozen.
+ * @note Must be invoked with exclusive access to the filter.
+ * @arg filter The filter to freeze
+ * @return 0 on success, -2 if the filter cannot be frozen,
+ * -1 on failure.
+ */
+int bloomf_freeze(bloom_filter *filter);
+
+/**
+ * Reorders the probes of the checks of a filter by the hits
+ * of its data files. This is a no-op if the filter is proxied.
+ * @note The check is thread safe with adds and checks, applying
+ * the order should be invoked with exclusive access.
+ * @arg filter The filter to reorder
+ * @arg apply If 0, only checks if the order would change
+ * @return 1 if the order changes, 0 otherwise.
+ */
+int bloomf_reorder(bloom_filter *filter, int apply);
+
+/**
+ * Copies the approximate number of checks found in each
+ * data file of a filter, newest first. Nothing is copied
+ * if the filter is proxied.
+ * @note This should be invoked with adds excluded.
+ * @arg filter The filter
+ * @arg hits Output array
+ * @arg max The size of the output array
+ * @return The number of hits copied.
+ */
+int bloomf_layer_hits(bloom_filter *filter, uint64_t *hits, int max);
+
+/**
+ * Counts the bytes of the bitmaps of a filter that are resident
+ * in memory, so that a check touches no page that needs a major
+ * fault. Pinned filters are fully resident once faulted in.
+ * Nothing is counted if the filter is proxied.
+ * @note This should be invoked with adds excluded.
+ * @arg filter The filter
+ * @return The resident bytes.
+ */
+uint64_t bloomf_resident_bytes(bloom_filter *filter);
+
+/**
+ * Counts the bytes of the dirty pages of the bitmaps of a
+ * filter, which the next flush writes. Only bitmaps that
+ * write their own pages track them, so the page cache of
+ * filters mapped SHARED is not counted.
+ * @note This should be invoked with adds excluded.
+ * @arg filter The filter
+ * @return The dirty bytes.
+ */
+uint64_t bloomf_dirty_page_bytes(bloom_filter *filter);
+
+/**
+ * Visits the bitmaps of the layers of a filter, faulting it
+ * in if it is proxied. Filters with partitions are not visited.
+ * @note This should be invoked with adds excluded, the bitmaps
+ * must not be kept past the callback.
+ * @arg filter The filter
+ * @arg cb Invoked with each bitmap
+ * @arg data Opaque data for the callback
+ * @return 0 on success, -2 if the filter has partitions,
+ * -1 on failure.
+ */
+int bloomf_visit_maps(bloom_filter *filter, bloom_engine_map_cb cb, void *data);
+
+/**
+ * Gets the bytes the bitmaps of a filter have read in when
+ * faulted in, and written out when flushed, since the filter
+ * was initialized.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @arg io Output, the bytes read and written
+ */
+void bloomf_io(bloom_filter *filter, bitmap_io_counters *io);
+
 /**
  * Deletes the bloom filter with
  * extreme prejudice.
@@ -106,14 +442,144 @@ int bloomf_delete(bloom_filter *filter);
  */
 int bloomf_contains(bloom_filter *filter, char *key);
 
+/**
+ * Same as bloomf_contains, for a key of a given length. The key
+ * need not be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to use
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The same as bloomf_contains.
+ */
+int bloomf_contains_len(bloom_filter *filter, const char *key, uint64_t len);
+
+/**
+ * Same as bloomf_contains_len, with hashes shared with the
+ * checks of other filters. The key is only hashed again if
+ * this filter uses another hash family.
+ * @arg filter The filter to use
+ * @arg hashes The shared hashes of the key
+ * @return The same as bloomf_contains.
+ */
+int bloomf_contains_hashed(bloom_filter *filter, bloom_key_hashes *hashes);
+
+/**
+ * Checks if the filter contains many keys. The keys are checked
+ * in batches, overlapping their memory accesses.
+ * @note Thread safe, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if contained, 0 if not.
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_batch(bloom_filter *filter, char **keys, int num_keys, char *results);
+
+/**
+ * Checks if the filter contains many keys of given lengths.
+ * @note Thread safe, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg keys The keys to check, need not be NUL terminated
+ * @arg key_lens The lengths of the keys, or NULL if the
+ * keys are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if contained, 0 if not.
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_batch_len(bloom_filter *filter, char **keys, uint64_t *key_lens, int num_keys, char *results);
+
 /**
  * Adds a key to the given filter
  * @arg filter The filter to add to
  * @arg key The key to add
- * @return 0 if not added, 1 if added.
+ * @return 0 if not added, 1 if added. -2 if the filter
+ * is full and rejects sets, -3 if it is frozen, -1 on error.
  */
 int bloomf_add(bloom_filter *filter, char *key);
 
+/**
+ * Same as bloomf_add, for a key of a given length. The key
+ * need not be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to use
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The same as bloomf_add.
+ */
+int bloomf_add_len(bloom_filter *filter, const char *key, uint64_t len);
+
+/**
+ * Adds many keys to the given filter. The keys of a partitioned
+ * filter are grouped by partition, and set under the lock of each
+ * partition in turn.
+ * @note Thread safe with other adds and checks for a partitioned
+ * filter. Otherwise the same as bloomf_add.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add, need not be NUL terminated
+ * @arg key_lens The lengths of the keys, or NULL if the
+ * keys are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if added, 0 if not. Left as is
+ * for the keys not set after an error.
+ * @return 0 on success, -2 if the filter is full and
+ * rejects sets, -1 on error.
+ */
+int bloomf_add_batch_len(bloom_filter *filter, char **keys, uint64_t *key_lens, int num_keys, char *results);
+
+/**
+ * Checks that a batch of keys can be set without a full fixed
+ * filter that rejects sets rejecting any of them.
+ * @note Must be called with exclusive access to the filter,
+ * so that nothing is set between the check and the sets.
+ * @arg filter The filter to check
+ * @arg keys The keys to set, need not be NUL terminated
+ * @arg key_lens The lengths of the keys, or NULL if the
+ * keys are NUL terminated
+ * @arg num_keys The number of keys
+ * @return 1 if the keys fit, 0 if not, -1 on error.
+ */
+int bloomf_fits(bloom_filter *filter, char **keys, uint64_t *key_lens, int num_keys);
+
+/**
+ * Removes a key from the given filter. Only supported
+ * by counting and cuckoo filters.
+ * @arg filter The filter to remove from
+ * @arg key The key to remove
+ * @return 0 if not contained, 1 if removed, -3 if the
+ * filter is frozen, -1 on error.
+ */
+int bloomf_remove(bloom_filter *filter, char *key);
+
+/**
+ * Same as bloomf_remove, for a key of a given length. The key
+ * need not be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to use
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The same as bloomf_remove.
+ */
+int bloomf_remove_len(bloom_filter *filter, const char *key, uint64_t len);
+
+/**
+ * Adds a key to the given filter using atomic bit sets.
+ * @note Thread safe with other concurrent adds and with checks,
+ * but not with bloomf_add.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @return 0 if not added, 1 if added, -2 if the filter must
+ * grow, in which case bloomf_add should be used with exclusive access.
+ * -3 if the filter is frozen.
+ */
+int bloomf_add_concurrent(bloom_filter *filter, char *key);
+
+/**
+ * Same as bloomf_add_concurrent, for a key of a given length. The key
+ * need not be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to use
+ * @arg key The key
+ * @arg len The length of the key
+ * @return The same as bloomf_add_concurrent.
+ */
+int bloomf_add_concurrent_len(bloom_filter *filter, const char *key, uint64_t len);
+
 /**
  * Gets the size of the filter in keys
  * @note Thread safe.
@@ -122,6 +588,46 @@ int bloomf_add(bloom_filter *filter, char *key);
  */
 uint64_t bloomf_size(bloom_filter *filter);
 
+/**
+ * Estimates the number of distinct keys in the filter from the
+ * bits that are set. The filter is faulted in if needed, and the
+ * first estimate after a change counts the bits of the data.
+ * @note Thread safe, as long as bloomf_combine is not invoked.
+ * @arg filter The filter to estimate
+ * @arg estimate Output, the estimated number of keys
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_estimate(bloom_filter *filter, uint64_t *estimate);
+
+/**
+ * Exports the pages of the filter changed since an epoch to a
+ * delta in the folder of the filter, and starts a new epoch. The
+ * delta is full if the changes since the epoch are not known.
+ * The filter is faulted in if needed.
+ * @note Thread safe.
+ * @arg filter The filter to export
+ * @arg since The epoch of an earlier delta, or 0 for a full delta
+ * @arg epoch Output, the epoch of the delta, to export the
+ * next delta since
+ * @arg path Output, the path of the delta. Must be free'd.
+ * @return The number of pages exported, negative on error.
+ */
+int bloomf_export_delta(bloom_filter *filter, uint64_t since, uint64_t *epoch, char **path);
+
+/**
+ * Writes the layers of a full delta, such as the one sent by
+ * a dump, as the data files of a new filter. The filter loads
+ * them once it is created. The filter must not have data files.
+ * @arg config The configuration, with the data directory
+ * @arg filter_name The name of the filter
+ * @arg path The path of the delta
+ * @return The number of layers written, -EINVAL if the delta is
+ * not full or is corrupt, -ENOTSUP if the filters of the config
+ * do not keep data files, -EEXIST if the filter has data files,
+ * or another negative errno.
+ */
+int bloomf_restore_delta(bloom_config *config, char *filter_name, char *path);
+
 /**
  * Gets the maximum capacity of the filter
  * @note Thread safe.
@@ -138,4 +644,15 @@ uint64_t bloomf_capacity(bloom_filter *filter);
  */
 uint64_t bloomf_byte_size(bloom_filter *filter);
 
+/**
+ * Estimates the bytes the next flush of the filter writes.
+ * Each key added or removed since the last flush dirties at
+ * most a page. A filter that was never flushed is all dirty.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return The estimated dirty bytes, 0 if the filter is clean,
+ * proxied or in-memory.
+ */
+uint64_t bloomf_dirty_bytes(bloom_filter *filter);
+
 #endif
@@ -3,85 +3,269 @@
 #include <syslog.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <errno.h>
 #include <string.h>
-#include "spinlock.h"
+#include <unistd.h>
+#include <time.h>
 #include "filter_manager.h"
 #include "art.h"
 #include "filter.h"
 #include "type_compat.h"
+#include "stats.h"
+#include "catalog.h"
+#include "replication.h"
+#include "brlock.h"
+#include "probes.h"
 
 /**
- * This defines how log we sleep between vacuum poll
- * iterations in microseconds
+ * This defines how long the vacuum thread waits for the
+ * clients to checkpoint, in microseconds. A checkpoint
+ * past the version it waits on wakes it up sooner.
  */
 #define VACUUM_POLL_USEC 500000
 
+/**
+ * The client slots are padded to a cache line, so the
+ * checkpoint of one thread does not contend with another
+ */
+#define CLIENT_SLOT_SIZE 64
+
+/**
+ * The client slots allocated at a time
+ */
+#define CLIENT_BLOCK_SLOTS 64
+
+/**
+ * The most retired entries a shard frees in one vacuum pass,
+ * so that one shard with many drops does not starve the rest
+ */
+#define VACUUM_BATCH 64
+
+/**
+ * The length of the i'th key, when key lengths are optional
+ */
+#define KEY_LEN(keys, key_lens, i) ((key_lens) ? (key_lens)[i] : strlen((keys)[i]))
+
+/**
+ * The smallest number of slots of a filter name index
+ */
+#define INDEX_MIN_SLOTS 16
+
+/**
+ * The number of shards of the filters, a power of 2
+ */
+#define FILTMGR_SHARDS 16
+
+/**
+ * The most threads that load the existing filters at startup,
+ * or close them at shutdown, and the fewest filters each
+ * thread is started for at startup
+ */
+#define MAX_LOAD_THREADS 16
+#define FILTERS_PER_LOAD_THREAD 64
+
+/**
+ * The number of wakes of a filter kept to predict the next one
+ */
+#define WAKE_HISTORY 4
+
+/**
+ * The periods between the last wakes of a filter may differ by
+ * up to 1 / PERIOD_TOLERANCE of the latest one to be predicted
+ */
+#define PERIOD_TOLERANCE 10
+
+/**
+ * How often in seconds the progress of closing
+ * the filters at shutdown is logged
+ */
+#define CLOSE_PROGRESS_INTERVAL 5
+
+/**
+ * A filter sized like an earlier one has room for
+ * 1 / LINEAGE_HEADROOM more keys than it ended with
+ */
+#define LINEAGE_HEADROOM 4
+
+/**
+ * The fewest layers of the same geometry that a slice group
+ * slices. The filters with layers of a rarer geometry are
+ * checked directly, which costs about as much.
+ */
+#define SLICE_MIN_LAYERS 4
+
+// Hashes filter names for the index, provided by libbloom
+extern void WyHash128(const void *key, uint64_t len, uint64_t seed, uint64_t *out);
+
 /**
  * Wraps a bloom_filter to ensure only a single
  * writer access it at a time. Tracks the outstanding
  * references, to allow a sane close to take place.
+ *
+ * The existing filters start as stubs, with only a name and
+ * the filter config from the catalog, if any. The filter of a
+ * stub is loaded on its first use, see load_stub.
  */
 typedef struct {
     volatile int is_active;         // Set to 0 when we are trying to delete it
     volatile int is_hot;            // Used to mark a filter as hot
     volatile int should_delete;     // Used to control deletion
 
-    bloom_filter *filter;    // The actual filter object
-    pthread_rwlock_t rwlock; // Protects the filter
+    bloom_filter *filter;    // The actual filter object, NULL for a stub
+    bloom_brlock lock;      // Protects the filter, biased to checks
     bloom_config *custom;   // Custom config to cleanup
+
+    char *stub_name;                    // Name of a stub, kept once loaded
+    bloom_filter_config *stub_config;   // Filter config of a stub, NULL to read it
+
+    /*
+     * Samples the accesses to predict when a cold filter is next
+     * used. An access is sampled when it marks the filter hot,
+     * so at most once per cold interval. An access after a gap
+     * of two cold intervals is a wake, the filter likely went
+     * cold before it.
+     */
+    volatile int is_warm;           // Warmed ahead of use, kept through a cold unmap
+    time_t last_access;             // Latest sampled access
+    time_t wakes[WAKE_HISTORY];     // Latest wakes, a ring
+    int num_wakes;                  // Wakes sampled in total
+    time_t warmed_for;              // The predicted wake last warmed for
 } bloom_filter_wrapper;
 
 /**
- * We use a linked list of filtmgr_client
- * structs to track any clients of the filter manager.
- * Each client maintains a thread ID as well as the
- * last known version they used. The vacuum thread
- * uses this information to safely garbage collect
- * old versions.
+ * We use slots of filtmgr_client structs to track any
+ * clients of the filter manager. Each client claims a
+ * slot for its thread and stores the last known version
+ * it used. The vacuum thread uses this information to
+ * safely garbage collect old versions. A thread remembers
+ * its slot, so a checkpoint is a single store.
  */
-typedef struct filtmgr_client {
+typedef struct {
+    volatile int active;            // Set while claimed by a client
     pthread_t id;
-    unsigned long long vsn;
-    struct filtmgr_client *next;
+    volatile unsigned long long vsn;
+    char pad[CLIENT_SLOT_SIZE - sizeof(int) - sizeof(pthread_t) -
+        sizeof(unsigned long long)];
 } filtmgr_client;
 
-// Enum of possible delta updates
-typedef enum {
-    CREATE,
-    DELETE,
-    BARRIER
-} delta_type;
+/**
+ * The slots are allocated in blocks, pushed without a
+ * lock and only freed with the manager, so they can be
+ * scanned at any time.
+ */
+typedef struct filtmgr_client_block {
+    filtmgr_client slots[CLIENT_BLOCK_SLOTS];
+    struct filtmgr_client_block *next;
+} filtmgr_client_block;
 
-// Simple linked list of filter wrappers
-typedef struct filter_list {
-    unsigned long long vsn;
-    delta_type type;
-    bloom_filter_wrapper *filter;
-    struct filter_list *next;
-} filter_list;
+/**
+ * The slot each thread last claimed, and the manager of it.
+ * Managers are numbered, since a new one may reuse the
+ * address of a destroyed one.
+ */
+static unsigned long long next_mgr_id = 1;
+static __thread unsigned long long client_mgr_id;
+static __thread filtmgr_client *client_slot;
+
+/**
+ * A queued fault of a filter, see filtmgr_fault_filter_async
+ */
+typedef struct fault_request {
+    char *filter_name;
+    fault_cb cb;
+    void *data;
+    struct fault_request *next;
+} fault_request;
+
+/**
+ * A client waiting for a flush ticket, see filtmgr_wait_flush_async
+ */
+typedef struct flush_waiter {
+    uint64_t ticket;
+    fault_cb cb;
+    void *data;
+    struct flush_waiter *next;
+} flush_waiter;
 
 /**
- * We use a a simple form of Multi-Version Concurrency Controll (MVCC)
- * to prevent locking on access to the map of filter name -> bloom_filter_wrapper.
+ * A slot of the filter name index
+ */
+typedef struct {
+    uint64_t hash;                  // Hash of the filter name
+    bloom_filter_wrapper *filter;   // The filter, NULL if empty
+} filter_slot;
+
+/**
+ * An immutable snapshot of the map of filter names. Once
+ * published, a snapshot is never changed, so it can be
+ * searched without any locking.
  *
- * The way it works is we have 2 ART trees, the "primary" and an alternate.
- * All the clients of the filter manager have reads go through the primary
- * without any locking. We also maintain a delta list of new and deleted filters,
- * which is a simple linked list.
+ * The ART map serves the prefix listing, while exact lookups
+ * use an open addressing hash index built beside it. The index
+ * is rebuilt for each snapshot, so it never needs deletes.
+ */
+typedef struct {
+    unsigned long long vsn;     // The version that published the snapshot
+    art_tree map;               // Maps key names -> bloom_filter_wrapper
+    uint64_t index_mask;        // The number of index slots, minus 1
+    filter_slot *index;         // Linear probed, at most half full
+} filter_snapshot;
+
+/**
+ * Linked list of garbage which clients may still reference,
+ * either a replaced snapshot or a removed filter. Newest first.
+ */
+typedef struct retired_list {
+    unsigned long long vsn;         // The version that retired it
+    filter_snapshot *snapshot;      // Replaced snapshot, or NULL
+    bloom_filter_wrapper *filter;   // Removed filter, or NULL
+    filter_hot_state *hot;          // Hot states detached from a cold filter, or NULL
+    char *filter_name;              // Name of the removed filter
+    struct retired_list *next;
+} retired_list;
+
+/**
+ * We use a form of Read-Copy-Update (RCU) to prevent locking
+ * on access to the map of filter name -> bloom_filter_wrapper.
  *
- * We use a separate vacuum thread to merge changes from the delta lists
- * into the alternate tree, and then do a pointer swap to rotate the
- * primary tree for the alternate.
+ * Reads load the current snapshot with a single atomic load and
+ * search it, so a lookup does not depend on the number of changes.
+ * Writers copy the current snapshot, change the copy, and publish it
+ * as a new version. The ART copy is constant time, and a change only
+ * copies the nodes on its path, sharing the rest with older snapshots.
  *
- * This mechanism ensures we have at most 2 ART trees, reads are lock-free,
- * and performance does not degrade with the number of filters.
+ * The filters are split into shards by the hash of their names, and
+ * each shard publishes its own snapshots under its own write lock. A
+ * create or drop then only copies and serializes with the filters
+ * of one shard. All the shards share one version counter.
  *
+ * The replaced snapshots and removed filters are retired with the
+ * version that made them unreachable. The vacuum thread frees them
+ * once every client has checkpointed at or past that version, since
+ * the clients can then only reach newer snapshots.
  */
+typedef struct {
+    pthread_mutex_t write_lock;     // Serializes changes to the shard
+
+    // The current snapshot, replaced under the write lock
+    filter_snapshot *snapshot;
+
+    /**
+     * List of retired garbage, changed under the write lock.
+     * Removed filters stay on it until the vacuum thread has
+     * deleted or closed them, which allows create to return a
+     * "Delete in progress".
+     */
+    retired_list *retired;
+} filtmgr_shard;
+
 struct bloom_filtmgr {
     bloom_config *config;
 
     int should_run;  // Used to stop the vacuum thread
     pthread_t vacuum_thread;
+    pthread_mutex_t vacuum_lock;    // Protects the vacuum condition
+    pthread_cond_t vacuum_cond;     // Signaled when there is garbage, or to stop
 
     /*
      * To support vacuuming of old versions, we require that
@@ -90,30 +274,213 @@ struct bloom_filtmgr {
      * can scan for the minimum seen version and clean all older
      * versions.
      */
-    filtmgr_client *clients;
-    bloom_spinlock clients_lock;
+    filtmgr_client_block *clients;
+    unsigned long long id;          // Identifies the manager to the client threads
+
+    // Set to the minimum version while the vacuum thread waits
+    // on the clients to checkpoint, so that they can wake it
+    unsigned long long vacuum_waiting;
 
-    // This is the current version. Should be used under the write lock.
+    // This is the current version. Atomically incremented by each publish.
     unsigned long long vsn;
-    pthread_mutex_t write_lock;
 
-    // Maps key names -> bloom_filter_wrapper
-    unsigned long long primary_vsn; // This is the version that filter_map represents
-    art_tree *filter_map;
-    art_tree *alt_filter_map;
+    // The shards of the filters
+    filtmgr_shard shards[FILTMGR_SHARDS];
+
+    // Fault in proxied filters for the clients, in the order queued
+    int num_fault_threads;
+    pthread_t *fault_threads;
+    int faults_run;                 // Cleared to stop the fault threads
+    pthread_mutex_t fault_lock;     // Protects the fault queue
+    pthread_cond_t fault_cond;      // Signaled when a fault is queued, or to stop
+    fault_request *faults;          // Head of the fault queue
+    fault_request *faults_tail;
+
+    // Flushes of all the filters requested by the clients,
+    // run by the flush thread. Tickets count up from 1.
+    pthread_mutex_t flush_lock;     // Protects the tickets and waiters
+    int flush_scheduler;            // Set while the flush thread runs
+    uint64_t flush_requested;       // The last ticket handed out
+    uint64_t flush_done;            // The last ticket flushed
+    flush_waiter *flush_waiters;
+
+    // The stubs of the existing filters are loaded one at a time.
+    // Stubs found without the catalog are loaded by the sweep
+    // thread, which then writes a new catalog.
+    pthread_mutex_t stub_lock;
+    int uncataloged;                // Stubs without a filter config at startup
+    int sweep_run;                  // Cleared to stop the sweep thread
+    pthread_t sweep_thread;
+
+    // The hand of the eviction clock, the last filter it visited
+    int clock_shard;
+    char *clock_name;               // NULL before the first sweep
+
+    bloom_catalog *catalog;         // Catalog of the filters, may be NULL
+    bloom_replicator *replicator;   // Replicas of the filters, may be NULL
+
+    // Bit-sliced groups of the filters under a prefix, see
+    // filtmgr_slice_filters. Changes under a prefix stale
+    // its groups, which are built again on the next check.
+    pthread_rwlock_t slice_lock;    // Protects the list of groups
+    pthread_mutex_t slice_build_lock;   // Serializes building the groups
+    struct slice_group *slices;
+    uint64_t slice_changes;         // Counts the changes that staled a group
+};
 
-    /**
-     * List of pending deletes. This is necessary
-     * because the filter may reflect that a delete has
-     * taken place, while the vacuum thread has not yet performed the
-     * delete. This allows create to return a "Delete in progress".
-     */
-    bloom_filter_list *pending_deletes;
-    bloom_spinlock pending_lock;
+/**
+ * The layers of a slice group with the same geometry, sliced
+ * BLOOM_SLICE_MAX at a time. Column j of slice i is a layer of
+ * the member columns[i * BLOOM_SLICE_MAX + j].
+ */
+typedef struct slice_geometry {
+    bloom_slice shape;              // The geometry, without words
+    int num_layers;
+    int added;                      // Layers added so far
+    bloom_slice *slices;
+    int *columns;
+    struct slice_geometry *next;
+} slice_geometry;
 
-    // Delta lists for non-merged operations
-    filter_list *delta;
-};
+/**
+ * A bit-sliced group of the filters under a prefix. Only frozen
+ * filters are sliced, since they never change. The others, and
+ * the frozen ones with layers of a rare geometry, are checked
+ * directly, as mcheck does.
+ */
+typedef struct slice_group {
+    char *prefix;
+    volatile int stale;             // Set when a member may have changed
+    int num_members;
+    char **members;                 // Names of the members, sorted
+    int num_direct;
+    int *direct;                    // Members checked directly
+    slice_geometry *geometries;
+    uint64_t bytes;                 // Bytes of the words of the slices
+    struct slice_group *next;
+} slice_group;
+
+/**
+ * The state of building a slice group, passed to the
+ * callback visiting the layers of a member
+ */
+typedef struct {
+    slice_group *group;
+    int member;
+    int sliceable;                  // Cleared if a layer cannot be sliced
+    int num_geoms;
+    slice_geometry **geoms;         // Geometry of each layer, on the first pass
+    int adding;                     // Set on the second pass, which adds the layers
+} slice_builder;
+
+/**
+ * A filter collected for a listing. The name
+ * is the key of the snapshot that listed it.
+ */
+typedef struct {
+    char *name;
+    bloom_filter_wrapper *filter;
+} filter_entry;
+
+/**
+ * The filters collected from one shard for a listing, in order
+ */
+typedef struct {
+    char *prefix;           // The prefix listed, or NULL
+    int prefix_len;
+    int limit;              // The most filters to collect, 0 for all
+    int size;
+    int capacity;
+    int pos;                // The next entry to merge
+    filter_entry *entries;
+} filter_page;
+
+/**
+ * A mapped filter visited by the eviction clock. The name
+ * is the key of the snapshot that listed it.
+ */
+typedef struct {
+    int shard;
+    char *name;
+    bloom_filter_wrapper *filter;
+    int listed;             // Listed for eviction in this sweep
+} clock_entry;
+
+/**
+ * The mapped filters of all the shards, in the order of the clock
+ */
+typedef struct {
+    int shard;              // The shard being collected
+    int size;
+    int capacity;
+    clock_entry *entries;
+} clock_scan;
+
+/**
+ * A dirty filter, with the priority of its flush
+ */
+typedef struct {
+    char *name;
+    double priority;
+} dirty_entry;
+
+/**
+ * The dirty filters of all the shards
+ */
+typedef struct {
+    time_t now;
+    int interval;           // The flush interval, scales the age
+    int size;
+    int capacity;
+    dirty_entry *entries;
+} dirty_scan;
+
+/**
+ * A filter closed at shutdown, with its dirty bytes
+ */
+typedef struct {
+    bloom_filter_wrapper *filter;
+    uint64_t dirty;
+} close_entry;
+
+/**
+ * The filters closed in parallel at shutdown. Each thread
+ * takes the next filter, the dirtiest first, and flushes it
+ * within its share of the flush bandwidth before closing it.
+ */
+typedef struct {
+    bloom_config *config;
+    int size;
+    int capacity;
+    close_entry *entries;
+    int threads;
+    int next;               // The next filter to close
+    int closed;             // The filters closed so far
+    time_t logged;          // When the progress was last logged
+} filter_closer;
+
+/**
+ * The filters of a batch created in parallel. Each thread
+ * takes the next filter to create, and stores it at the
+ * index of its name. Names not to be created are skipped.
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    char **names;
+    bloom_config *custom;           // Copied for each filter, or NULL
+    int *results;                   // Only names at 0 are created
+    bloom_filter_wrapper **filters; // Output, NULL if not created
+    int num;
+    int next;                       // The next name to create
+} filter_creator;
+
+/**
+ * A name of a batch, sorted to find the repeated names
+ */
+typedef struct {
+    char *name;
+    int index;                      // The index of the name in the batch
+} batch_name;
 
 /**
  * We warn if there are this many outstanding versions
@@ -127,16 +494,65 @@ struct bloom_filtmgr {
 static const char FOLDER_PREFIX[] = "bloomd.";
 static const int FOLDER_PREFIX_LEN = sizeof(FOLDER_PREFIX) - 1;
 
+static filtmgr_shard* filter_shard(bloom_filtmgr *mgr, char *filter_name, uint64_t *hash);
 static bloom_filter_wrapper* find_filter(bloom_filtmgr *mgr, char *filter_name);
 static bloom_filter_wrapper* take_filter(bloom_filtmgr *mgr, char *filter_name);
+static bloom_filter_wrapper* take_cached_filter(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name);
 static void delete_filter(bloom_filter_wrapper *filt);
-static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot, int delta);
+static bloom_filter_wrapper* new_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot);
+static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot, int publish);
 static int filter_map_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
-static int filter_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_page_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_close_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int close_entry_cmp(const void *a, const void *b);
+static void close_filters(bloom_filtmgr *mgr);
+static void* close_thread_main(void *in);
 static int load_existing_filters(bloom_filtmgr *mgr);
-static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt);
+static void add_stub(bloom_filtmgr *mgr, char *filter_name, bloom_filter_config *config);
+static void load_cataloged_filter(void *data, char *filter_name, bloom_filter_config *config);
+static inline int is_stub(bloom_filter_wrapper *filt);
+static int load_stub(bloom_filtmgr *mgr, bloom_filter_wrapper *filt);
+static void sweep_stubs(bloom_filtmgr *mgr);
+static int filter_map_stub_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static void* sweep_thread_main(void *in);
+static void start_catalog(bloom_filtmgr *mgr);
+static int filter_map_catalog_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static filter_snapshot* copy_snapshot(filtmgr_shard *shard);
+static void index_snapshot(filter_snapshot *snap);
+static void destroy_snapshot(filter_snapshot *snap);
+static unsigned long long publish_snapshot(bloom_filtmgr *mgr, filtmgr_shard *shard, filter_snapshot *snap);
+static void retire(bloom_filtmgr *mgr, filtmgr_shard *shard, unsigned long long vsn, filter_snapshot *snap, bloom_filter_wrapper *filt);
+static void remove_filter(bloom_filtmgr *mgr, filtmgr_shard *shard, bloom_filter_wrapper *filt);
+static void retire_hot_state(bloom_filtmgr *mgr, char *filter_name, filter_hot_state *hot);
+static void lock_batch_shards(bloom_filtmgr *mgr, char **filter_names, int num, filter_snapshot **snaps);
+static unsigned long long publish_batch(bloom_filtmgr *mgr, filter_snapshot **snaps);
+static void unlock_batch_shards(bloom_filtmgr *mgr, filter_snapshot **snaps);
+static void* create_thread_main(void *in);
+static int batch_name_cmp(const void *a, const void *b);
+static int reclaim_retired(filtmgr_shard *shard, unsigned long long min_vsn, int max);
+static void sort_filter_list(bloom_filter_list_head *head);
 static void* filtmgr_thread_main(void *in);
+static void* fault_thread_main(void *in);
+static inline void mark_hot(bloom_filtmgr *mgr, bloom_filter_wrapper *filt);
+static inline int lock_free_checks(bloom_filter_wrapper *filt);
+static int bad_hashes(bloom_filter_wrapper *filt, char **keys, uint64_t *key_lens, int num_keys);
+static time_t predict_wake(bloom_filter_wrapper *filt);
+static int filter_map_list_prewarm_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_clock_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_dirty_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int dirty_entry_cmp(const void *a, const void *b);
+static int filter_map_sync_wal_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_writeback_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static void replicate_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, int unset, char *filter_name,
+        char **keys, uint64_t *key_lens, char *result, int start, int end);
+static slice_group* find_slice_group(bloom_filtmgr *mgr, char *prefix);
+static void stale_slices(bloom_filtmgr *mgr, char *name);
+static int rebuild_slice_group(bloom_filtmgr *mgr, char *prefix, int force);
+static int build_slice_group(bloom_filtmgr *mgr, slice_group *group);
+static int slice_layer_cb(void *data, int num, bloom_bitmap *map);
+static void clear_slice_group(slice_group *group);
+static void free_slice_group(slice_group *group);
 
 /**
  * Initializer
@@ -152,34 +568,59 @@ int init_filter_manager(bloom_config *config, int vacuum, bloom_filtmgr **mgr) {
 
     // Copy the config
     m->config = config;
-
-    // Initialize the locks
-    pthread_mutex_init(&m->write_lock, NULL);
-    INIT_BLOOM_SPIN(&m->clients_lock);
-    INIT_BLOOM_SPIN(&m->pending_lock);
-
-    // Allocate storage for the art trees
-    art_tree *trees = calloc(2, sizeof(art_tree));
-    m->filter_map = trees;
-    m->alt_filter_map = trees+1;
-
-    // Allocate the initial art tree
-    int res = init_art_tree(m->filter_map);
-    if (res) {
-        syslog(LOG_ERR, "Failed to allocate filter map!");
-        free(m);
-        return -1;
+    m->id = __sync_fetch_and_add(&next_mgr_id, 1);
+    pthread_mutex_init(&m->vacuum_lock, NULL);
+    pthread_cond_init(&m->vacuum_cond, NULL);
+    pthread_rwlock_init(&m->slice_lock, NULL);
+    pthread_mutex_init(&m->slice_build_lock, NULL);
+
+    // Allocate the initial snapshots
+    filtmgr_shard *shard;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        shard = m->shards + i;
+        pthread_mutex_init(&shard->write_lock, NULL);
+        shard->snapshot = calloc(1, sizeof(filter_snapshot));
+        init_art_tree(&shard->snapshot->map);
     }
 
-    // Discover existing filters
+    // Discover existing filters, and record them in a new catalog.
+    // The configs of filters found without the catalog are read
+    // first, in the background unless there are no threads.
+    pthread_mutex_init(&m->stub_lock, NULL);
     load_existing_filters(m);
+    for (int i=0; i < FILTMGR_SHARDS; i++)
+        index_snapshot(m->shards[i].snapshot);
+    m->sweep_run = 1;
+    if (!m->uncataloged) {
+        start_catalog(m);
+    } else if (!vacuum) {
+        sweep_stubs(m);
+        start_catalog(m);
+    }
 
-    // Initialize the alternate map
-    res = art_copy(m->alt_filter_map, m->filter_map);
-    if (res) {
-        syslog(LOG_ERR, "Failed to copy filter map to alternate!");
-        destroy_filter_manager(m);
-        return -1;
+    // Start replicating, if there are replicas
+    if (config->replicas && *config->replicas && init_replicator(config, &m->replicator)) {
+        syslog(LOG_ERR, "Failed to start replicating, continuing without replicas");
+        m->replicator = NULL;
+    }
+
+    // Start the fault threads
+    pthread_mutex_init(&m->flush_lock, NULL);
+    pthread_mutex_init(&m->fault_lock, NULL);
+    pthread_cond_init(&m->fault_cond, NULL);
+    m->faults_run = 1;
+    m->fault_threads = calloc(config->fault_threads, sizeof(pthread_t));
+    for (; m->num_fault_threads < config->fault_threads; m->num_fault_threads++) {
+        if (pthread_create(m->fault_threads + m->num_fault_threads, NULL, fault_thread_main, m)) {
+            perror("Failed to start fault thread!");
+            break;
+        }
+    }
+
+    // Start the sweep thread
+    if (vacuum && m->uncataloged && pthread_create(&m->sweep_thread, NULL, sweep_thread_main, m)) {
+        perror("Failed to start sweep thread!");
+        m->sweep_thread = 0;
     }
 
     // Start the vacuum thread
@@ -200,43 +641,131 @@ int init_filter_manager(bloom_config *config, int vacuum, bloom_filtmgr **mgr) {
  * @return 0 on success.
  */
 int destroy_filter_manager(bloom_filtmgr *mgr) {
+    // Stop the sweep thread, a new catalog waits for the next start
+    mgr->sweep_run = 0;
+    if (mgr->sweep_thread) pthread_join(mgr->sweep_thread, NULL);
+
     // Stop the vacuum thread
+    pthread_mutex_lock(&mgr->vacuum_lock);
     mgr->should_run = 0;
+    pthread_cond_signal(&mgr->vacuum_cond);
+    pthread_mutex_unlock(&mgr->vacuum_lock);
     if (mgr->vacuum_thread) pthread_join(mgr->vacuum_thread, NULL);
 
-    // Nuke all the keys in the current version.
-    art_iter(mgr->filter_map, filter_map_delete_cb, mgr);
+    // Send the last changes to the replicas
+    if (mgr->replicator) destroy_replicator(mgr->replicator);
 
-    // Handle any delta operations
-    filter_list *next, *current = mgr->delta;
-    while (current) {
-        // Only delete pending creates, pending
-        // deletes are still in the primary tree
-        if (current->type == CREATE)
-            delete_filter(current->filter);
-        next = current->next;
-        free(current);
-        current = next;
-    }
+    // Stop the fault threads, once the queued faults are done
+    pthread_mutex_lock(&mgr->fault_lock);
+    mgr->faults_run = 0;
+    pthread_cond_broadcast(&mgr->fault_cond);
+    pthread_mutex_unlock(&mgr->fault_lock);
+    for (int i=0; i < mgr->num_fault_threads; i++)
+        pthread_join(mgr->fault_threads[i], NULL);
+    free(mgr->fault_threads);
+
+    // Finish any pending deletes, free the old snapshots, and
+    // close all the filters in the current version.
+    for (int i=0; i < FILTMGR_SHARDS; i++)
+        reclaim_retired(mgr->shards + i, mgr->vsn, 0);
+    close_filters(mgr);
 
     // Free the clients
-    filtmgr_client *cl_next, *cl = mgr->clients;
-    while (cl) {
-        cl_next = cl->next;
-        free(cl);
-        cl = cl_next;
+    filtmgr_client_block *block_next, *block = mgr->clients;
+    while (block) {
+        block_next = block->next;
+        free(block);
+        block = block_next;
     }
 
-    // Destroy the ART trees
-    destroy_art_tree(mgr->filter_map);
-    destroy_art_tree(mgr->alt_filter_map);
-    free((mgr->filter_map < mgr->alt_filter_map) ? mgr->filter_map : mgr->alt_filter_map);
+    // Destroy the current snapshots
+    for (int i=0; i < FILTMGR_SHARDS; i++)
+        destroy_snapshot(mgr->shards[i].snapshot);
+
+    // Closing the filters may record their configs, so
+    // the catalog is closed last
+    if (mgr->catalog) destroy_catalog(mgr->catalog);
+
+    // Free the slice groups
+    slice_group *group_next, *group = mgr->slices;
+    while (group) {
+        group_next = group->next;
+        free_slice_group(group);
+        group = group_next;
+    }
 
     // Free the manager
+    free(mgr->clock_name);
+    pthread_cond_destroy(&mgr->fault_cond);
+    pthread_mutex_destroy(&mgr->fault_lock);
+    pthread_mutex_destroy(&mgr->flush_lock);
+    pthread_mutex_destroy(&mgr->stub_lock);
+    pthread_cond_destroy(&mgr->vacuum_cond);
+    pthread_mutex_destroy(&mgr->vacuum_lock);
+    pthread_rwlock_destroy(&mgr->slice_lock);
+    pthread_mutex_destroy(&mgr->slice_build_lock);
     free(mgr);
     return 0;
 }
 
+/**
+ * Finds the slot the calling thread holds, if any. A thread
+ * only remembers the slot of the last manager it used.
+ * This is O(n), but N is small and its done infrequently
+ */
+static filtmgr_client* find_client_slot(bloom_filtmgr *mgr) {
+    pthread_t id = pthread_self();
+    filtmgr_client_block *block = __atomic_load_n(&mgr->clients, __ATOMIC_SEQ_CST);
+    filtmgr_client *cl;
+    for (; block != NULL; block=block->next) {
+        for (int i=0; i < CLIENT_BLOCK_SLOTS; i++) {
+            cl = block->slots + i;
+            if (cl->active && pthread_equal(cl->id, id)) return cl;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Claims a client slot for the calling thread, adding a
+ * block of slots if they are all claimed. The version is
+ * stored before a free slot is claimed.
+ */
+static filtmgr_client* claim_client_slot(bloom_filtmgr *mgr, unsigned long long vsn) {
+    pthread_t id = pthread_self();
+    filtmgr_client_block *block, *head;
+    filtmgr_client *cl = find_client_slot(mgr);
+    if (cl) {
+        __atomic_store_n(&cl->vsn, vsn, __ATOMIC_SEQ_CST);
+        return cl;
+    }
+    while (1) {
+        // Take the first free slot
+        head = __atomic_load_n(&mgr->clients, __ATOMIC_SEQ_CST);
+        for (block = head; block; block = block->next) {
+            for (int i=0; i < CLIENT_BLOCK_SLOTS; i++) {
+                cl = block->slots + i;
+                if (cl->active) continue;
+                __atomic_store_n(&cl->vsn, vsn, __ATOMIC_SEQ_CST);
+                if (!__sync_bool_compare_and_swap(&cl->active, 0, 1)) continue;
+                cl->id = id;
+                return cl;
+            }
+        }
+
+        // Push a new block at the head, scanning again if
+        // another client got there first
+        if (posix_memalign((void**)&block, CLIENT_SLOT_SIZE, sizeof(filtmgr_client_block)))
+            abort();
+        memset(block, 0, sizeof(filtmgr_client_block));
+        block->next = head;
+        if (!__sync_bool_compare_and_swap(&mgr->clients, head, block)) {
+            free(block);
+            continue;
+        }
+    }
+}
+
 /**
  * Should be invoked periodically by client threads to allow
  * the vacuum thread to cleanup garbage state. It should also
@@ -246,33 +775,24 @@ int destroy_filter_manager(bloom_filtmgr *mgr) {
  * @arg mgr The manager
  */
 void filtmgr_client_checkpoint(bloom_filtmgr *mgr) {
-    // Get a reference to ourself
-    pthread_t id = pthread_self();
+    unsigned long long vsn = __atomic_load_n(&mgr->vsn, __ATOMIC_SEQ_CST);
 
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
-    filtmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            cl->vsn = mgr->vsn;
-            return;
-        }
-        cl = cl->next;
+    // Update our slot, if we still hold it
+    if (client_mgr_id == mgr->id) {
+        __atomic_store_n(&client_slot->vsn, vsn, __ATOMIC_SEQ_CST);
+    } else {
+        client_slot = claim_client_slot(mgr, vsn);
+        client_mgr_id = mgr->id;
     }
 
-    // If we make it here, we are not a client yet
-    // so we need to safely add ourself
-    cl = malloc(sizeof(filtmgr_client));
-    cl->id = id;
-    cl->vsn = mgr->vsn;
-
-    // Critical section for the flip
-    LOCK_BLOOM_SPIN(&mgr->clients_lock);
-
-    cl->next = mgr->clients;
-    mgr->clients = cl;
-
-    UNLOCK_BLOOM_SPIN(&mgr->clients_lock);
+    // Wake the vacuum thread if it waits on our old version
+    unsigned long long waiting = __atomic_load_n(&mgr->vacuum_waiting, __ATOMIC_SEQ_CST);
+    if (waiting && waiting < vsn &&
+            __sync_bool_compare_and_swap(&mgr->vacuum_waiting, waiting, 0)) {
+        pthread_mutex_lock(&mgr->vacuum_lock);
+        pthread_cond_signal(&mgr->vacuum_cond);
+        pthread_mutex_unlock(&mgr->vacuum_lock);
+    }
 }
 
 /**
@@ -282,29 +802,13 @@ void filtmgr_client_checkpoint(bloom_filtmgr *mgr) {
  * @arg mgr The manager
  */
 void filtmgr_client_leave(bloom_filtmgr *mgr) {
-    // Get a reference to ourself
-    pthread_t id = pthread_self();
-
-    // Critical section
-    LOCK_BLOOM_SPIN(&mgr->clients_lock);
-
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
-    filtmgr_client **last_next = &mgr->clients;
-    filtmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            // Set the last prev pointer to skip the current entry
-            *last_next = cl->next;
-
-            // Cleanup the memory associated
-            free(cl);
-            break;
-        }
-        last_next = &cl->next;
-        cl = cl->next;
-    }
-    UNLOCK_BLOOM_SPIN(&mgr->clients_lock);
+    // Release our slot, stopping holding back the vacuum. The
+    // slot is kept, since the vacuum thread may be scanning it.
+    filtmgr_client *cl = client_slot;
+    if (client_mgr_id != mgr->id) cl = find_client_slot(mgr);
+    if (cl) __atomic_store_n(&cl->active, 0, __ATOMIC_SEQ_CST);
+    client_mgr_id = 0;
+    client_slot = NULL;
 }
 
 /**
@@ -317,282 +821,1683 @@ int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name) {
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
 
+    // Cut the filter with the sets held off, so the flush
+    // writes a consistent image while they go on
+    if (mgr->config->consistent_flush && !bloomf_is_proxied(filt->filter)) {
+        brlock_wrlock(&filt->lock);
+        bloomf_stage(filt->filter);
+        brlock_wrunlock(&filt->lock);
+    }
+
     // Flush
     bloomf_flush(filt->filter);
     return 0;
 }
 
 /**
- * Checks for the presence of keys in a given filter
- * @arg filter_name The name of the filter containing the keys
- * @arg keys A list of points to character arrays to check
- * @arg num_keys The number of keys to check
- * @arg result Ouput array, stores a 0 if the key does not exist
- * or 1 if the key does exist.
- * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * Starts an asynchronous flush of the filter with the given name.
+ * @arg filter_name The name of the filter to flush
+ * @arg flusher The flusher to use
+ * @return 0 on success. -1 if the filter does not exist.
  */
-int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
+int filtmgr_flush_filter_async(bloom_filtmgr *mgr, char *filter_name, bloom_flusher *flusher) {
     // Get the filter
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
 
-    // Acquire the write lock
-    pthread_rwlock_rdlock(&filt->rwlock);
-
-    // Check the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = bloomf_contains(filt->filter, keys[i]);
-        if (res == -1) break;
-        *(result+i) = res;
+    // Cut the filter as filtmgr_flush_filter does
+    if (mgr->config->consistent_flush && !bloomf_is_proxied(filt->filter)) {
+        brlock_wrlock(&filt->lock);
+        bloomf_stage(filt->filter);
+        brlock_wrunlock(&filt->lock);
     }
 
-    // Mark as hot
-    filt->is_hot = 1;
+    // Start the flush
+    bloomf_flush_async(filt->filter, flusher);
+    return 0;
+}
 
-    // Release the lock
-    pthread_rwlock_unlock(&filt->rwlock);
-    return (res == -1) ? -2 : 0;
+/**
+ * Prepares the filter with the given name to grow.
+ * @arg filter_name The name of the filter to prepare
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_prepare_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // The engine handles racing adds, so no lock is needed
+    if (!bloomf_is_proxied(filt->filter)) bloomf_prepare(filt->filter);
+    return 0;
 }
 
 /**
- * Sets keys in a given filter
- * @arg filter_name The name of the filter
- * @arg keys A list of points to character arrays to add
- * @arg num_keys The number of keys to add
- * @arg result Ouput array, stores a 0 if the key already is set
- * or 1 if the key is set.
- * * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * Rotates the generations of the filter with the given name.
+ * @arg filter_name The name of the filter to rotate
+ * @return 0 on success. -1 if the filter does not exist.
  */
-int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
+int filtmgr_rotate_filter(bloom_filtmgr *mgr, char *filter_name) {
     // Get the filter
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
 
-    // Acquire the write lock
-    pthread_rwlock_wrlock(&filt->rwlock);
+    // Skip filters that do not age out, or are not mapped in
+    if (!filt->filter->filter_config.window || bloomf_is_proxied(filt->filter)) return 0;
 
-    // Set the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = bloomf_add(filt->filter, keys[i]);
-        if (res == -1) break;
-        *(result+i) = res;
-    }
+    // Rotation clears a generation, so it needs the write lock
+    brlock_wrlock(&filt->lock);
+    bloomf_rotate(filt->filter);
+    brlock_wrunlock(&filt->lock);
+    return 0;
+}
 
-    // Mark as hot
-    filt->is_hot = 1;
+/**
+ * Reorders the probes of the checks of the filter with the given name.
+ * @arg filter_name The name of the filter to reorder
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_reorder_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    if (bloomf_is_proxied(filt->filter)) return 0;
+
+    // Check with the read lock, since the order rarely changes
+    void *slot = brlock_rdlock(&filt->lock);
+    int res = bloomf_reorder(filt->filter, 0);
+    brlock_rdunlock(&filt->lock, slot);
+    if (res != 1) return 0;
+
+    // Checks read the order, so it is changed with the write lock
+    brlock_wrlock(&filt->lock);
+    bloomf_reorder(filt->filter, 1);
+    brlock_wrunlock(&filt->lock);
+    return 0;
+}
 
-    // Release the lock
-    pthread_rwlock_unlock(&filt->rwlock);
-    return (res == -1) ? -2 : 0;
+/**
+ * Checks if the keys of a filter are client hashes.
+ * @arg cache Optional, can be NULL. Caches the filter between calls.
+ * @arg filter_name The name of the filter
+ * @return 1 if the filter is hashed, 0 if not, -1 if the
+ * filter does not exist.
+ */
+int filtmgr_filter_hashed(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name) {
+    bloom_filter_wrapper *filt = take_cached_filter(mgr, cache, filter_name);
+    if (!filt) return -1;
+    return filt->filter->filter_config.hashed;
 }
 
 /**
- * Creates a new filter of the given name and parameters.
+ * Copies the number of checks found in each data
+ * file of the filter with the given name.
  * @arg filter_name The name of the filter
- * @arg custom_config Optional, can be null. Configs that override the defaults.
- * @return 0 on success, -1 if the filter already exists.
- * -2 for internal error. -3 if there is a pending delete.
+ * @arg hits Output array
+ * @arg max The size of the output array
+ * @return The number of hits copied. -1 if the filter does not exist.
  */
-int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *custom_config) {
-    int res = 0;
-    pthread_mutex_lock(&mgr->write_lock);
+int filtmgr_layer_hits(bloom_filtmgr *mgr, char *filter_name, uint64_t *hits, int max) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Growing replaces the hits, so adds are excluded
+    void *slot = brlock_rdlock(&filt->lock);
+    int res = bloomf_layer_hits(filt->filter, hits, max);
+    brlock_rdunlock(&filt->lock, slot);
+    return res;
+}
+
+/**
+ * Counts the resident and dirty bytes of the filter with the given name.
+ * @arg filter_name The name of the filter
+ * @arg resident Output, the resident bytes
+ * @arg dirty Output, the bytes the next flush writes
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_memory_bytes(bloom_filtmgr *mgr, char *filter_name, uint64_t *resident, uint64_t *dirty) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Growing replaces the layers, so adds are excluded
+    void *slot = brlock_rdlock(&filt->lock);
+    *resident = bloomf_resident_bytes(filt->filter);
+    *dirty = bloomf_dirty_page_bytes(filt->filter);
+    brlock_rdunlock(&filt->lock, slot);
+    return 0;
+}
+
+/**
+ * Compacts the filter with the given name, merging
+ * its data files where possible.
+ * @arg filter_name The name of the filter to compact
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_compact_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Skip filters that are not mapped in, instead of faulting them
+    if (bloomf_is_proxied(filt->filter)) return 0;
+
+    // Compaction replaces the layers, so it needs the write lock
+    brlock_wrlock(&filt->lock);
+    bloomf_compact(filt->filter);
+    brlock_wrunlock(&filt->lock);
+    return 0;
+}
+
+/**
+ * Moves the older layers of a filter to the page cache,
+ * when tiered_layers is set.
+ * @arg filter_name The name of the filter to seal
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_seal_filter(bloom_filtmgr *mgr, char *filter_name) {
+    if (!mgr->config->tiered_layers) return 0;
+
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Skip filters that are not mapped in, instead of faulting them
+    if (bloomf_is_proxied(filt->filter)) return 0;
+
+    // Checks must not fault a layer while its mapping is replaced
+    brlock_wrlock(&filt->lock);
+    bloomf_seal(filt->filter);
+    brlock_wrunlock(&filt->lock);
+    return 0;
+}
+
+/**
+ * Checks for the presence of keys in a given filter
+ * @arg filter_name The name of the filter containing the keys
+ * @arg keys A list of points to character arrays to check
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -6 if the filter is hashed and a key
+ * is not a client hash.
+ */
+int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
+    return filtmgr_check_keys_len(mgr, NULL, filter_name, keys, NULL, num_keys, result);
+}
+
+/**
+ * Checks for the presence of keys of given lengths in a given filter.
+ * The keys need not be NUL terminated, so they can be checked in place.
+ * @arg key_lens The lengths of the keys, or NULL if the keys are
+ * NUL terminated. Otherwise the same as filtmgr_check_keys.
+ * @arg cache Optional, can be NULL. Caches the filter between calls.
+ */
+int filtmgr_check_keys_len(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name,
+        char **keys, uint64_t *key_lens, int num_keys, char *result) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_cached_filter(mgr, cache, filter_name);
+    if (!filt) return -1;
+    if (bad_hashes(filt, keys, key_lens, num_keys)) return -6;
+
+    // Frozen filters never change, so they are checked without the lock
+    int res;
+    if (lock_free_checks(filt)) {
+        res = bloomf_contains_batch_len(filt->filter, keys, key_lens, num_keys, result);
+        mark_hot(mgr, filt);
+        return (res == -1) ? -2 : 0;
+    }
+
+    // Acquire the read lock, which is biased to checks, so a
+    // check of a hot filter does not write to the filter
+    BLOOM_PROBE2(lock__wait, filter_name, 0);
+    void *slot = brlock_rdlock(&filt->lock);
+    BLOOM_PROBE2(lock__acquire, filter_name, 0);
+
+    // Check the keys in batches, store the results
+    res = bloomf_contains_batch_len(filt->filter, keys, key_lens, num_keys, result);
+
+    // Mark as hot
+    mark_hot(mgr, filt);
+
+    // Release the lock
+    brlock_rdunlock(&filt->lock, slot);
+    BLOOM_PROBE2(lock__release, filter_name, 0);
+    return (res == -1) ? -2 : 0;
+}
+
+/**
+ * Checks for the presence of a key in several filters.
+ * The filters are locked one at a time, so a missing filter
+ * is only found once the filters before it are checked.
+ */
+int filtmgr_check_filters(bloom_filtmgr *mgr, char **filter_names, int num_filters,
+        const char *key, uint64_t len, char *result) {
+    bloom_key_hashes hashes;
+    hashes.key = key;
+    hashes.len = len;
+    hashes.num_hashes = 0;
+
+    bloom_filter_wrapper *filt;
+    int res;
+    for (int i=0; i < num_filters; i++) {
+        // Get the filter
+        filt = take_filter(mgr, filter_names[i]);
+        if (!filt) return -1;
+
+        // Check under the read lock, unless frozen, and mark as hot
+        if (lock_free_checks(filt)) {
+            res = bloomf_contains_hashed(filt->filter, &hashes);
+            mark_hot(mgr, filt);
+        } else {
+            void *slot = brlock_rdlock(&filt->lock);
+            res = bloomf_contains_hashed(filt->filter, &hashes);
+            mark_hot(mgr, filt);
+            brlock_rdunlock(&filt->lock, slot);
+        }
+        if (res < 0) return -2;
+        result[i] = res;
+    }
+    return 0;
+}
+
+/**
+ * Slices the filters under a prefix into a group, or slices
+ * them again if they are already grouped.
+ */
+int filtmgr_slice_filters(bloom_filtmgr *mgr, char *prefix) {
+    // Register the group first, so a change while it is
+    // built stales it
+    pthread_rwlock_wrlock(&mgr->slice_lock);
+    if (!find_slice_group(mgr, prefix)) {
+        slice_group *group = calloc(1, sizeof(slice_group));
+        group->prefix = strdup(prefix);
+        group->stale = 1;
+        group->next = mgr->slices;
+        __atomic_store_n(&mgr->slices, group, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&mgr->slice_lock);
+    return rebuild_slice_group(mgr, prefix, 1);
+}
+
+/**
+ * Drops the slice group of a prefix.
+ */
+int filtmgr_unslice_filters(bloom_filtmgr *mgr, char *prefix) {
+    pthread_rwlock_wrlock(&mgr->slice_lock);
+    slice_group *group = NULL, **prev = &mgr->slices;
+    for (; *prev; prev = &(*prev)->next) {
+        if (!strcmp((*prev)->prefix, prefix)) {
+            group = *prev;
+            *prev = group->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&mgr->slice_lock);
+    if (!group) return -1;
+    free_slice_group(group);
+    return 0;
+}
+
+/**
+ * Checks a key in the filters of a slice group. The sliced
+ * layers are checked a word at a time, with the hashes of the
+ * key shared by the layers of the same hash family.
+ */
+int filtmgr_scheck_filters(bloom_filtmgr *mgr, char *prefix, const char *key, uint64_t len,
+        bloom_filter_list_head **head) {
+    // A stale group is sliced again before the check
+    pthread_rwlock_rdlock(&mgr->slice_lock);
+    slice_group *group = find_slice_group(mgr, prefix);
+    if (group && group->stale) {
+        pthread_rwlock_unlock(&mgr->slice_lock);
+        int res = rebuild_slice_group(mgr, prefix, 0);
+        if (res) return res;
+        pthread_rwlock_rdlock(&mgr->slice_lock);
+        group = find_slice_group(mgr, prefix);
+    }
+    if (!group) {
+        pthread_rwlock_unlock(&mgr->slice_lock);
+        return -1;
+    }
+
+    bloom_key_hashes hashes;
+    hashes.key = key;
+    hashes.len = len;
+    hashes.num_hashes = 0;
+    char *result = calloc(group->num_members, 1);
+
+    // Each bit of a slice word is a layer containing the key
+    uint64_t *key_hashes, bits;
+    for (slice_geometry *geom=group->geometries; geom; geom=geom->next) {
+        key_hashes = engine_key_hashes(&hashes, geom->shape.hash_family, geom->shape.k_num);
+        for (int i=0; i * BLOOM_SLICE_MAX < geom->num_layers; i++) {
+            bits = bf_slice_contains_hashed(geom->slices + i, key_hashes);
+            while (bits) {
+                result[geom->columns[i * BLOOM_SLICE_MAX + __builtin_ctzll(bits)]] = 1;
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    // Check the other members as mcheck does, a dropped one is skipped
+    bloom_filter_wrapper *filt;
+    int res = 0;
+    for (int i=0; i < group->num_direct && res >= 0; i++) {
+        filt = take_filter(mgr, group->members[group->direct[i]]);
+        if (!filt) continue;
+        if (lock_free_checks(filt)) {
+            res = bloomf_contains_hashed(filt->filter, &hashes);
+            mark_hot(mgr, filt);
+        } else {
+            void *slot = brlock_rdlock(&filt->lock);
+            res = bloomf_contains_hashed(filt->filter, &hashes);
+            mark_hot(mgr, filt);
+            brlock_rdunlock(&filt->lock, slot);
+        }
+        if (res > 0) result[group->direct[i]] = 1;
+    }
+
+    // List the members containing the key, in order of name
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+    bloom_filter_list *node;
+    for (int i=0; i < group->num_members && res >= 0; i++) {
+        if (!result[i]) continue;
+        node = malloc(sizeof(bloom_filter_list));
+        node->filter_name = strdup(group->members[i]);
+        node->next = NULL;
+        if (!h->head) {
+            h->head = node;
+        } else {
+            h->tail->next = node;
+        }
+        h->tail = node;
+        h->size++;
+    }
+    pthread_rwlock_unlock(&mgr->slice_lock);
+    free(result);
+    if (res < 0) {
+        filtmgr_cleanup_list(h);
+        *head = NULL;
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * Merges, or intersects, several filters into another. Each
+ * source is combined with the destination write locked and the
+ * source read locked. The pair is locked in address order, so
+ * that combines in opposite directions cannot deadlock.
+ */
+int filtmgr_combine_filters(bloom_filtmgr *mgr, char *dest_name, char **src_names,
+        int num_srcs, int intersect) {
+    bloom_filter_wrapper *dest = take_filter(mgr, dest_name);
+    if (!dest) return -1;
+
+    // Find all the sources first, so a missing one changes nothing
+    bloom_filter_wrapper **srcs = malloc(num_srcs * sizeof(bloom_filter_wrapper*));
+    int res = 0;
+    for (int i=0; i < num_srcs; i++) {
+        srcs[i] = take_filter(mgr, src_names[i]);
+        if (!srcs[i]) {
+            res = -1;
+            goto LEAVE;
+        }
+    }
+
+    bloom_filter_wrapper *src;
+    void *slot;
+    for (int i=0; i < num_srcs && !res; i++) {
+        // Combining a filter with itself changes nothing
+        src = srcs[i];
+        if (src == dest) continue;
+        if (src < dest) {
+            slot = brlock_rdlock(&src->lock);
+            brlock_wrlock(&dest->lock);
+        } else {
+            brlock_wrlock(&dest->lock);
+            slot = brlock_rdlock(&src->lock);
+        }
+        res = bloomf_combine(dest->filter, src->filter, intersect);
+        if (!res && mgr->replicator) repl_combine(mgr->replicator, dest_name, src_names + i, 1, intersect);
+        mark_hot(mgr, dest);
+        brlock_rdunlock(&src->lock, slot);
+        brlock_wrunlock(&dest->lock);
+    }
+    if (res == -EINVAL)
+        res = -3;
+    else if (res == -EROFS)
+        res = -5;
+    else if (res < 0)
+        res = -2;
+
+LEAVE:
+    free(srcs);
+    return res;
+}
+
+/**
+ * Resets a filter in place. Unlike a drop and create, the filter
+ * stays in the manager, so there is no delete for the vacuum
+ * thread, and no files are created again.
+ */
+int filtmgr_reset_filter(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    brlock_wrlock(&filt->lock);
+    int res = bloomf_reset(filt->filter);
+    if (!res && mgr->replicator) repl_filter_cmd(mgr->replicator, "reset", filter_name);
+    mark_hot(mgr, filt);
+    brlock_wrunlock(&filt->lock);
+    if (res == -EROFS) return -5;
+    return (res) ? -3 : 0;
+}
+
+/**
+ * Freezes a filter under the write lock, so no set or check
+ * is in flight while its engine is mapped again read only.
+ */
+int filtmgr_freeze_filter(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    brlock_wrlock(&filt->lock);
+    int res = bloomf_freeze(filt->filter);
+    if (!res && mgr->replicator) repl_filter_cmd(mgr->replicator, "freeze", filter_name);
+    mark_hot(mgr, filt);
+    brlock_wrunlock(&filt->lock);
+    if (!res) stale_slices(mgr, filter_name);
+    if (res == -2) return -3;
+    return (res) ? -2 : 0;
+}
+
+/**
+ * Shrinks a filter under the write lock, so no set or check
+ * is in flight while its layers are replaced.
+ */
+int filtmgr_shrink_filter(bloom_filtmgr *mgr, char *filter_name, double fp_probability) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    brlock_wrlock(&filt->lock);
+    int res = bloomf_shrink(filt->filter, fp_probability);
+    mark_hot(mgr, filt);
+    brlock_wrunlock(&filt->lock);
+    if (res == -EROFS) return -5;
+    if (res == -ENOTSUP) return -3;
+    return (res < 0) ? -2 : 0;
+}
+
+/**
+ * Estimates the distinct keys of a filter, under the read lock
+ * since combining filters changes the bits.
+ */
+int filtmgr_estimate_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t *estimate) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    void *slot = brlock_rdlock(&filt->lock);
+    int res = bloomf_estimate(filt->filter, estimate);
+    mark_hot(mgr, filt);
+    brlock_rdunlock(&filt->lock, slot);
+    return (res) ? -2 : 0;
+}
+
+/**
+ * Exports the pages of a filter changed since an epoch to
+ * a delta in the folder of the filter.
+ * @arg filter_name The name of the filter
+ * @arg since The epoch of an earlier delta, or 0 for a full delta
+ * @arg epoch Output, the epoch of the delta
+ * @arg path Output, the path of the delta. Must be free'd.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error.
+ */
+int filtmgr_export_delta(bloom_filtmgr *mgr, char *filter_name, uint64_t since, uint64_t *epoch, char **path) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    *path = NULL;
+    void *slot = brlock_rdlock(&filt->lock);
+    int res = bloomf_export_delta(filt->filter, since, epoch, path);
+    brlock_rdunlock(&filt->lock, slot);
+    if (res < 0) {
+        free(*path);
+        *path = NULL;
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * Sets keys in a given filter
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -4 if the filter is full and rejects sets.
+ * -6 if the filter is hashed and a key is not a client hash.
+ */
+int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
+    return filtmgr_set_keys_len(mgr, NULL, filter_name, keys, NULL, num_keys, result);
+}
+
+/**
+ * Sets keys of given lengths in a given filter. The keys need
+ * not be NUL terminated, so they can be hashed in place.
+ * @arg key_lens The lengths of the keys, or NULL if the keys are
+ * NUL terminated. Otherwise the same as filtmgr_set_keys.
+ * @arg cache Optional, can be NULL. Caches the filter between calls.
+ */
+int filtmgr_set_keys_len(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name,
+        char **keys, uint64_t *key_lens, int num_keys, char *result) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_cached_filter(mgr, cache, filter_name);
+    if (!filt) return -1;
+    if (filt->filter->filter_config.frozen) return -5;
+    if (bad_hashes(filt, keys, key_lens, num_keys)) return -6;
+
+    // A fixed filter that rejects sets once full takes all of a
+    // batch or none of it, so the batch is checked and set exclusively
+    int res = 0;
+    int i = 0, start;
+    bloom_filter_config *filter_config = &filt->filter->filter_config;
+    if (filter_config->reject_full && !filter_config->scalable && !filter_config->window) {
+        BLOOM_PROBE2(lock__wait, filter_name, 1);
+        brlock_wrlock(&filt->lock);
+        BLOOM_PROBE2(lock__acquire, filter_name, 1);
+        res = bloomf_fits(filt->filter, keys, key_lens, num_keys);
+        if (res == 1) {
+            memset(result, 2, num_keys);
+            res = bloomf_add_batch_len(filt->filter, keys, key_lens, num_keys, result);
+            while (i < num_keys && result[i] != 2) i++;
+            replicate_keys(mgr, filt, 0, filter_name, keys, key_lens, result, 0, i);
+        } else if (res == 0) {
+            res = -2;
+        }
+        brlock_wrunlock(&filt->lock);
+        BLOOM_PROBE2(lock__release, filter_name, 1);
+        goto LEAVE;
+    }
+
+    // Partitioned filters lock each partition themselves, so
+    // sets on different partitions only share the read lock
+    if (filt->filter->parts) {
+        memset(result, 2, num_keys);
+        BLOOM_PROBE2(lock__wait, filter_name, 0);
+        void *slot = brlock_rdlock(&filt->lock);
+        BLOOM_PROBE2(lock__acquire, filter_name, 0);
+        res = bloomf_add_batch_len(filt->filter, keys, key_lens, num_keys, result);
+        while (i < num_keys && result[i] != 2) i++;
+        replicate_keys(mgr, filt, 0, filter_name, keys, key_lens, result, 0, i);
+        brlock_rdunlock(&filt->lock, slot);
+        BLOOM_PROBE2(lock__release, filter_name, 0);
+        goto LEAVE;
+    }
+
+    // In concurrent mode, sets use atomic bit updates and only
+    // need the read lock. We upgrade to the write lock only if the
+    // filter needs to grow, and finish the batch exclusively.
+    if (mgr->config->concurrent_sets) {
+        BLOOM_PROBE2(lock__wait, filter_name, 0);
+        void *slot = brlock_rdlock(&filt->lock);
+        BLOOM_PROBE2(lock__acquire, filter_name, 0);
+        for (; i<num_keys; i++) {
+            res = bloomf_add_concurrent_len(filt->filter, keys[i], KEY_LEN(keys, key_lens, i));
+            if (res < 0) break;
+            *(result+i) = res;
+        }
+        replicate_keys(mgr, filt, 0, filter_name, keys, key_lens, result, 0, i);
+        brlock_rdunlock(&filt->lock, slot);
+        BLOOM_PROBE2(lock__release, filter_name, 0);
+        if (res == -1) goto LEAVE;
+    }
+
+    // Acquire the write lock
+    if (i < num_keys) {
+        BLOOM_PROBE2(lock__wait, filter_name, 1);
+        brlock_wrlock(&filt->lock);
+        BLOOM_PROBE2(lock__acquire, filter_name, 1);
+
+        // Set the keys, store the results
+        for (start=i; i<num_keys; i++) {
+            res = bloomf_add_len(filt->filter, keys[i], KEY_LEN(keys, key_lens, i));
+            if (res < 0) break;
+            *(result+i) = res;
+        }
+        replicate_keys(mgr, filt, 0, filter_name, keys, key_lens, result, start, i);
+
+        // Release the lock
+        brlock_wrunlock(&filt->lock);
+        BLOOM_PROBE2(lock__release, filter_name, 1);
+    }
+
+LEAVE:
+    // Mark as hot
+    mark_hot(mgr, filt);
+    if (res == -2) return -4;
+    if (res == -3) return -5;
+    return (res < 0) ? -2 : 0;
+}
+
+/**
+ * Unsets keys in a given counting or cuckoo filter
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to remove
+ * @arg num_keys The number of keys to remove
+ * @arg result Ouput array, stores a 0 if the key was not set
+ * or 1 if the key is unset.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -3 if the filter does not support unset.
+ * -6 if the filter is hashed and a key is not a client hash.
+ */
+int filtmgr_unset_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
+    return filtmgr_unset_keys_len(mgr, NULL, filter_name, keys, NULL, num_keys, result);
+}
+
+/**
+ * Unsets keys of given lengths in a given counting or cuckoo filter.
+ * @arg key_lens The lengths of the keys, or NULL if the keys are
+ * NUL terminated. Otherwise the same as filtmgr_unset_keys.
+ * @arg cache Optional, can be NULL. Caches the filter between calls.
+ */
+int filtmgr_unset_keys_len(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name,
+        char **keys, uint64_t *key_lens, int num_keys, char *result) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_cached_filter(mgr, cache, filter_name);
+    if (!filt) return -1;
+    bloom_filter_config *filter_config = &filt->filter->filter_config;
+    if (filter_config->frozen) return -5;
+    if (!filter_config->counting && filter_config->engine != ENGINE_CUCKOO) return -3;
+    if (bad_hashes(filt, keys, key_lens, num_keys)) return -6;
+
+    // Removes decrement counters, and always need the write lock,
+    // of the partition of the key if the filter is partitioned
+    void *slot = NULL;
+    if (filt->filter->parts) {
+        slot = brlock_rdlock(&filt->lock);
+    } else {
+        brlock_wrlock(&filt->lock);
+    }
+
+    // Unset the keys, store the results
+    int res = 0;
+    int i = 0;
+    for (; i<num_keys; i++) {
+        res = bloomf_remove_len(filt->filter, keys[i], KEY_LEN(keys, key_lens, i));
+        if (res < 0) break;
+        *(result+i) = res;
+    }
+    replicate_keys(mgr, filt, 1, filter_name, keys, key_lens, result, 0, i);
+
+    // Release the lock
+    if (filt->filter->parts) {
+        brlock_rdunlock(&filt->lock, slot);
+    } else {
+        brlock_wrunlock(&filt->lock);
+    }
+
+    // Mark as hot
+    mark_hot(mgr, filt);
+    if (res == -3) return -5;
+    return (res < 0) ? -2 : 0;
+}
+
+/**
+ * Replicates the keys of a batch from start up to end, under
+ * the lock of the filter, so a reset is ordered with the sets.
+ * Sets of filters that log only new keys are idempotent, so only
+ * the keys new to the filter are sent. Unsets send the keys removed.
+ */
+static void replicate_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, int unset, char *filter_name,
+        char **keys, uint64_t *key_lens, char *result, int start, int end) {
+    if (!mgr->replicator || end <= start) return;
+    bloom_filter_config *fc = &filt->filter->filter_config;
+    int only_new = unset || (!fc->counting && fc->engine == ENGINE_BLOOM && !fc->window);
+    repl_keys(mgr->replicator, unset, filter_name, keys + start,
+            (key_lens) ? key_lens + start : NULL, (only_new) ? result + start : NULL, end - start);
+}
+
+/**
+ * Sizes a new filter after an earlier filter of its lineage.
+ * @arg filter_name The name of the earlier filter
+ * @arg config The config of the new filter, updated in place
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_size_like(bloom_filtmgr *mgr, char *filter_name, bloom_config *config) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // A proxied filter reports the size it was closed with
+    uint64_t size = bloomf_size(filt->filter);
+    uint64_t capacity = size + size / LINEAGE_HEADROOM;
+    if (capacity > config->initial_capacity) config->initial_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Creates a new filter of the given name and parameters.
+ * @arg filter_name The name of the filter
+ * @arg custom_config Optional, can be null. Configs that override the defaults.
+ * @return 0 on success, -1 if the filter already exists.
+ * -2 for internal error. -3 if there is a pending delete.
+ */
+int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *custom_config) {
+    int res = 0;
+    uint64_t hash[2];
+    filtmgr_shard *shard = filter_shard(mgr, filter_name, hash);
+    pthread_mutex_lock(&shard->write_lock);
+
+    // Bail if the filter already exists.
+    bloom_filter_wrapper *filt = find_filter(mgr, filter_name);
+    if (filt) {
+        res = -1;
+        goto LEAVE;
+    }
+
+    // Scan the retired filters for a pending delete
+    for (retired_list *r=shard->retired; r; r=r->next) {
+        if (r->filter_name && !strcmp(r->filter_name, filter_name)) {
+            res = -3; // Pending delete
+            goto LEAVE;
+        }
+    }
+
+    // Use a custom config if provided, else the default
+    bloom_config *config = (custom_config) ? custom_config : mgr->config;
+
+    // Add the filter to the new version
+    if (add_filter(mgr, filter_name, config, 1, 1)) {
+        res = -2; // Internal error
+    } else {
+        stale_slices(mgr, filter_name);
+        if (mgr->replicator) repl_create(mgr->replicator, filter_name, config);
+    }
+
+LEAVE:
+    pthread_mutex_unlock(&shard->write_lock);
+    return res;
+}
+
+/**
+ * Creates a new filter from a full delta, such as the one sent by
+ * a dump. The layers of the delta become the data files of the
+ * filter, which takes the default parameters.
+ * @arg filter_name The name of the filter
+ * @arg path The path of the delta
+ * @return 0 on success, -1 if the filter already exists.
+ * -2 for internal error, -3 if a delete is pending, -4 if
+ * the delta is not full or is corrupt.
+ */
+int filtmgr_restore_filter(bloom_filtmgr *mgr, char *filter_name, char *path) {
+    int res = 0;
+    uint64_t hash[2];
+    filtmgr_shard *shard = filter_shard(mgr, filter_name, hash);
+    pthread_mutex_lock(&shard->write_lock);
 
     // Bail if the filter already exists.
     bloom_filter_wrapper *filt = find_filter(mgr, filter_name);
     if (filt) {
-        res = (filt->is_active) ? -1 : -3;
+        res = -1;
+        goto LEAVE;
+    }
+
+    // Scan the retired filters for a pending delete
+    for (retired_list *r=shard->retired; r; r=r->next) {
+        if (r->filter_name && !strcmp(r->filter_name, filter_name)) {
+            res = -3; // Pending delete
+            goto LEAVE;
+        }
+    }
+
+    // Write the data files, the new filter discovers them. The
+    // keys are not replicated, the replicas must be restored too.
+    res = bloomf_restore_delta(mgr->config, filter_name, path);
+    if (res < 0) {
+        res = (res == -EINVAL) ? -4 : -2;
+    } else if (add_filter(mgr, filter_name, mgr->config, 1, 1)) {
+        res = -2; // Internal error
+    } else {
+        stale_slices(mgr, filter_name);
+        res = 0;
+    }
+
+LEAVE:
+    pthread_mutex_unlock(&shard->write_lock);
+    return res;
+}
+
+/**
+ * Deletes the filter entirely. This removes it from the filter
+ * manager and deletes it from disk. This is a permanent operation.
+ * @arg filter_name The name of the filter to delete
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name) {
+    int res = 0;
+    uint64_t hash[2];
+    filtmgr_shard *shard = filter_shard(mgr, filter_name, hash);
+    pthread_mutex_lock(&shard->write_lock);
+
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) {
+        res = -1;
+        goto LEAVE;
+    }
+
+    // Set the filter to be non-active and mark for deletion
+    filt->is_active = 0;
+    filt->should_delete = 1;
+    remove_filter(mgr, shard, filt);
+    stale_slices(mgr, filter_name);
+    if (mgr->replicator) repl_filter_cmd(mgr->replicator, "drop", filter_name);
+
+LEAVE:
+    pthread_mutex_unlock(&shard->write_lock);
+    return res;
+}
+
+/**
+ * Creates many filters of the same parameters as a single change.
+ * @return The number of filters created.
+ */
+int filtmgr_create_filters(bloom_filtmgr *mgr, char **filter_names, int num,
+        bloom_config *custom_config, int *results) {
+    filter_snapshot *snaps[FILTMGR_SHARDS];
+    lock_batch_shards(mgr, filter_names, num, snaps);
+
+    // A name repeated in the batch exists after its first create
+    batch_name *sorted = malloc(num * sizeof(batch_name));
+    for (int i=0; i < num; i++) {
+        sorted[i].name = filter_names[i];
+        sorted[i].index = i;
+        results[i] = 0;
+    }
+    qsort(sorted, num, sizeof(batch_name), batch_name_cmp);
+    for (int i=1; i < num; i++) {
+        if (!strcmp(sorted[i-1].name, sorted[i].name)) results[sorted[i].index] = -1;
+    }
+    free(sorted);
+
+    // Bail on the filters that exist or have a pending delete
+    uint64_t hash[2];
+    filtmgr_shard *shard;
+    for (int i=0; i < num; i++) {
+        if (results[i]) continue;
+        shard = filter_shard(mgr, filter_names[i], hash);
+        if (art_search(&snaps[shard - mgr->shards]->map, (unsigned char*)filter_names[i],
+                    strlen(filter_names[i])+1)) {
+            results[i] = -1;
+            continue;
+        }
+        for (retired_list *r=shard->retired; r; r=r->next) {
+            if (r->filter_name && !strcmp(r->filter_name, filter_names[i])) {
+                results[i] = -3; // Pending delete
+                break;
+            }
+        }
+    }
+
+    // Create the filters on several threads, this thread included,
+    // since each create makes a folder and writes a config file
+    filter_creator creator = {mgr, filter_names, custom_config, results,
+        calloc(num, sizeof(bloom_filter_wrapper*)), num, 0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = num / FILTERS_PER_LOAD_THREAD;
+    if (threads > cpus) threads = cpus;
+    if (threads > MAX_LOAD_THREADS) threads = MAX_LOAD_THREADS;
+    pthread_t tids[MAX_LOAD_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(tids + started, NULL, create_thread_main, &creator)) break;
+    }
+    create_thread_main(&creator);
+    for (int i=0; i < started; i++) pthread_join(tids[i], NULL);
+
+    // Add the filters to the snapshots of their shards
+    int created = 0;
+    bloom_filter_wrapper *filt;
+    for (int i=0; i < num; i++) {
+        if (results[i]) continue;
+        filt = creator.filters[i];
+        if (!filt) {
+            results[i] = -2; // Internal error
+            continue;
+        }
+        if (mgr->catalog) {
+            filt->filter->catalog = mgr->catalog;
+            catalog_add(mgr->catalog, filter_names[i], &filt->filter->filter_config);
+        }
+        shard = filter_shard(mgr, filter_names[i], hash);
+        art_insert(&snaps[shard - mgr->shards]->map, (unsigned char*)filter_names[i],
+                strlen(filter_names[i])+1, filt);
+        stats_add(STAT_FILTERS, 1);
+        stale_slices(mgr, filter_names[i]);
+        if (mgr->replicator) {
+            repl_create(mgr->replicator, filter_names[i], (filt->custom) ? filt->custom : mgr->config);
+        }
+        created++;
+    }
+    free(creator.filters);
+
+    publish_batch(mgr, snaps);
+    unlock_batch_shards(mgr, snaps);
+    return created;
+}
+
+/**
+ * Deletes many filters as a single change.
+ * @return The number of filters dropped.
+ */
+int filtmgr_drop_filters(bloom_filtmgr *mgr, char **filter_names, int num, int *results) {
+    filter_snapshot *snaps[FILTMGR_SHARDS];
+    lock_batch_shards(mgr, filter_names, num, snaps);
+
+    // Remove the filters from the snapshots of their shards
+    bloom_filter_wrapper **filters = calloc(num, sizeof(bloom_filter_wrapper*));
+    uint64_t hash[2];
+    filtmgr_shard *shard;
+    bloom_filter_wrapper *filt;
+    int dropped = 0;
+    for (int i=0; i < num; i++) {
+        shard = filter_shard(mgr, filter_names[i], hash);
+        art_tree *map = &snaps[shard - mgr->shards]->map;
+        filt = art_search(map, (unsigned char*)filter_names[i], strlen(filter_names[i])+1);
+        if (!filt || !filt->is_active) {
+            results[i] = -1;
+            continue;
+        }
+        art_delete(map, (unsigned char*)filter_names[i], strlen(filter_names[i])+1);
+        filt->is_active = 0;
+        filt->should_delete = 1;
+        filters[i] = filt;
+        results[i] = 0;
+        dropped++;
+    }
+
+    // Retire the filters at the version that removed them
+    unsigned long long vsn = publish_batch(mgr, snaps);
+    for (int i=0; i < num; i++) {
+        if (!filters[i]) continue;
+        shard = filter_shard(mgr, filter_names[i], hash);
+        retire(mgr, shard, vsn, NULL, filters[i]);
+        stale_slices(mgr, filter_names[i]);
+        if (mgr->replicator) repl_filter_cmd(mgr->replicator, "drop", filter_names[i]);
+    }
+    unlock_batch_shards(mgr, snaps);
+    free(filters);
+    return dropped;
+}
+
+/**
+ * Deletes the filters whose names start with a prefix
+ * as a single change.
+ * @return The number of filters dropped.
+ */
+int filtmgr_drop_prefix(bloom_filtmgr *mgr, char *prefix) {
+    bloom_filter_list_head *head;
+    filtmgr_list_filters(mgr, prefix, &head);
+    if (!head->size) {
+        filtmgr_cleanup_list(head);
+        return 0;
+    }
+
+    char **names = malloc(head->size * sizeof(char*));
+    int num = 0;
+    for (bloom_filter_list *node=head->head; node; node=node->next) names[num++] = node->filter_name;
+    int *results = malloc(num * sizeof(int));
+    int dropped = filtmgr_drop_filters(mgr, names, num, results);
+    free(results);
+    free(names);
+    filtmgr_cleanup_list(head);
+    return dropped;
+}
+
+/**
+ * Clears the filter from the internal data stores. This can only
+ * be performed if the filter is proxied.
+ * @arg filter_name The name of the filter to delete
+ * @return 0 on success, -1 if the filter does not exist, -2
+ * if the filter is not proxied.
+ */
+int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name) {
+    int res = 0;
+    uint64_t hash[2];
+    filtmgr_shard *shard = filter_shard(mgr, filter_name, hash);
+    pthread_mutex_lock(&shard->write_lock);
+
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) {
+        res = -1;
         goto LEAVE;
     }
 
-    // Scan the pending delete queue
-    LOCK_BLOOM_SPIN(&mgr->pending_lock);
-    if (mgr->pending_deletes) {
-        bloom_filter_list *node = mgr->pending_deletes;
-        while (node) {
-            if (!strcmp(node->filter_name, filter_name)) {
-                res = -3; // Pending delete
-                UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
-                goto LEAVE;
-            }
-            node = node->next;
-        }
-    }
-    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
+    // Check if the filter is proxied. A frozen filter may be
+    // checked without the lock, so it is closed by the vacuum.
+    if (!bloomf_is_proxied(filt->filter) && !filt->filter->filter_config.frozen) {
+        res = -2;
+        goto LEAVE;
+    }
+
+    // This is critical, as it prevents it from
+    // being deleted. Instead, it is merely closed.
+    filt->is_active = 0;
+    filt->should_delete = 0;
+    remove_filter(mgr, shard, filt);
+    stale_slices(mgr, filter_name);
+
+LEAVE:
+    pthread_mutex_unlock(&shard->write_lock);
+    return res;
+}
+
+/**
+ * Unmaps the filter from memory, but leaves it
+ * registered in the filter manager. This is rarely invoked
+ * by a client, as it can be handled automatically by bloomd,
+ * but particular clients with specific needs may use it as an
+ * optimization.
+ * @arg filter_name The name of the filter to delete
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Skip if we are in memory, unless cold filters are packed,
+    // or frozen, since frozen filters are checked without the lock
+    bloom_filter *f = filt->filter;
+    if ((f->filter_config.in_memory && !f->config->cold_snapshots) || f->filter_config.frozen)
+        goto LEAVE;
+
+    // Acquire the write lock
+    brlock_wrlock(&filt->lock);
+
+    // Close the filter, and give up its counter shards and
+    // latencies until it is used again
+    bloomf_unmap(filt->filter);
+    filter_hot_state *hot = NULL;
+    if (bloomf_is_proxied(filt->filter)) hot = bloomf_detach_hot(filt->filter);
+
+    // Release the lock
+    brlock_wrunlock(&filt->lock);
+    if (hot) retire_hot_state(mgr, filter_name, hot);
+
+LEAVE:
+    return 0;
+}
+
+/**
+ * Starts an asynchronous fault of the filter with the given name,
+ * if it is proxied. The filter is faulted in on one of the fault
+ * threads, so the caller is not blocked reading its data files.
+ * @arg cache The filter cache of the client, or NULL
+ * @arg filter_name The name of the filter to fault in
+ * @arg cb Invoked on the fault thread once the fault completes
+ * @arg data Opaque handle passed to the callback
+ * @return 0 if the fault was started, 1 if the filter is in memory
+ * or there are no fault threads, -1 if the filter does not exist.
+ */
+int filtmgr_fault_filter_async(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name, fault_cb cb, void *data) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_cached_filter(mgr, cache, filter_name);
+    if (!filt) return -1;
+    if (!mgr->num_fault_threads || !bloomf_is_proxied(filt->filter)) return 1;
+
+    // Queue the fault by name, the filter may be dropped before
+    // a fault thread gets to it
+    fault_request *req = malloc(sizeof(fault_request));
+    req->filter_name = strdup(filter_name);
+    req->cb = cb;
+    req->data = data;
+    req->next = NULL;
+
+    pthread_mutex_lock(&mgr->fault_lock);
+    if (mgr->faults_tail)
+        mgr->faults_tail->next = req;
+    else
+        mgr->faults = req;
+    mgr->faults_tail = req;
+    pthread_cond_signal(&mgr->fault_cond);
+    pthread_mutex_unlock(&mgr->fault_lock);
+    return 0;
+}
+
+// Completes a warm, errors show up on the next use
+static void warm_complete(void *data, int res) {
+    (void)data;
+    (void)res;
+}
+
+/**
+ * Warms a filter ahead of use. It is faulted in on a fault
+ * thread, or by the caller if there are none, and it is kept
+ * through the next cold unmap even if it is not used.
+ */
+int filtmgr_warm_filter(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    if (!bloomf_is_proxied(filt->filter)) return 0;
+
+    // Warming does not mark the filter hot, so
+    // that its next use is still sampled
+    filt->is_warm = 1;
+    if (filtmgr_fault_filter_async(mgr, NULL, filter_name, warm_complete, NULL) != 1) return 0;
+
+    void *slot = brlock_rdlock(&filt->lock);
+    int res = bloomf_fault(filt->filter);
+    brlock_rdunlock(&filt->lock, slot);
+    return (res) ? -3 : 0;
+}
+
+/**
+ * Allocates space for and returns a linked
+ * list of all the filters.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to list or NULL
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_head **head) {
+    // Allocate the head
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+
+    // Iterate the current snapshots through a callback to append
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        if (prefix)
+            art_iter_prefix(&snap->map, (unsigned char*)prefix, strlen(prefix), filter_map_list_cb, h);
+        else
+            art_iter(&snap->map, filter_map_list_cb, h);
+    }
+
+    // List in order of name, as a single map would
+    sort_filter_list(h);
+    return 0;
+}
+
+
+/**
+ * Invokes a callback with the filters in order of name,
+ * without allocating a list or looking each filter up again.
+ * Listing can be resumed after the last filter of a call.
+ * The filters are not locked, as with filtmgr_filter_cb.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to list or NULL
+ * @arg after Optional, only lists the filters named after it
+ * @arg limit The most filters to list, or 0 for all
+ * @arg cb The callback to invoke with each filter
+ * @arg data Opaque handle passed to the callback
+ * @return The number of filters listed.
+ */
+int filtmgr_iter_filters(bloom_filtmgr *mgr, char *prefix, char *after, int limit, filter_cb cb, void *data) {
+    // Start at the cursor if it sorts after the prefix,
+    // past the cursor itself, otherwise at the prefix
+    unsigned char *start = (unsigned char*)"";
+    int start_len = 0, inclusive = 1;
+    if (prefix) {
+        start = (unsigned char*)prefix;
+        start_len = strlen(prefix);
+    }
+    if (after && (!prefix || strcmp(after, prefix) >= 0)) {
+        start = (unsigned char*)after;
+        start_len = strlen(after) + 1;
+        inclusive = 0;
+    }
+
+    // Collect the first filters of each shard. Since each shard is
+    // in order, no shard contributes more than the limit.
+    filter_page pages[FILTMGR_SHARDS];
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        filter_page *p = pages+i;
+        memset(p, 0, sizeof(filter_page));
+        p->prefix = prefix;
+        p->prefix_len = (prefix) ? strlen(prefix) : 0;
+        p->limit = limit;
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        art_iter_from(&snap->map, start, start_len, inclusive, filter_map_page_cb, p);
+    }
+
+    // Merge the shards in order of name
+    int listed = 0, next;
+    while (!limit || listed < limit) {
+        next = -1;
+        for (int i=0; i < FILTMGR_SHARDS; i++) {
+            if (pages[i].pos == pages[i].size) continue;
+            if (next == -1 || strcmp(pages[i].entries[pages[i].pos].name,
+                        pages[next].entries[pages[next].pos].name) < 0)
+                next = i;
+        }
+        if (next == -1) break;
+
+        filter_entry *e = pages[next].entries + pages[next].pos++;
+        if (load_stub(mgr, e->filter)) continue;
+        cb(data, e->name, e->filter->filter);
+        listed++;
+    }
+
+    for (int i=0; i < FILTMGR_SHARDS; i++) free(pages[i].entries);
+    return listed;
+}
+
+
+/**
+ * Allocates space for and returns a linked
+ * list of all the cold filters. This has the side effect
+ * of clearing the list of cold filters!
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_cold_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head) {
+    // Allocate the head of a new hashmap
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+
+    // Scan the current snapshots for the cold filters
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        art_iter(&snap->map, filter_map_list_cold_cb, h);
+    }
+    return 0;
+}
+
+
+/**
+ * Selects the filters to warm, see filtmgr_list_prewarm_filters
+ */
+typedef struct {
+    bloom_filter_list_head *head;
+    time_t now;
+    time_t lead;
+} prewarm_scan;
+
+/**
+ * Called as part of the hashmap callback to list
+ * the proxied filters predicted to wake soon.
+ */
+static int filter_map_list_prewarm_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    prewarm_scan *scan = data;
+    bloom_filter_wrapper *filt = value;
+    if (is_stub(filt) || !bloomf_is_proxied(filt->filter)) return 0;
 
-    // Use a custom config if provided, else the default
-    bloom_config *config = (custom_config) ? custom_config : mgr->config;
+    // Warm once per prediction, until the lead passed the wake
+    time_t wake = predict_wake(filt);
+    if (!wake || wake == filt->warmed_for) return 0;
+    if (scan->now < wake - scan->lead || scan->now > wake + scan->lead) return 0;
+    filt->warmed_for = wake;
 
-    // Add the filter to the new version
-    if (add_filter(mgr, filter_name, config, 1, 1)) {
-        res = -2; // Internal error
+    bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+    node->filter_name = strdup((char*)key);
+    node->next = scan->head->head;
+    scan->head->head = node;
+    scan->head->size++;
+    return 0;
+}
+
+/**
+ * Allocates space for and returns a linked list of the
+ * proxied filters that are predicted to be used within
+ * the lead time. Each prediction is only listed once.
+ */
+int filtmgr_list_prewarm_filters(bloom_filtmgr *mgr, int lead, bloom_filter_list_head **head) {
+    prewarm_scan scan;
+    scan.head = *head = calloc(1, sizeof(bloom_filter_list_head));
+    scan.now = time(NULL);
+    scan.lead = lead;
+
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        art_iter(&snap->map, filter_map_list_prewarm_cb, &scan);
     }
+    return 0;
+}
 
-LEAVE:
-    pthread_mutex_unlock(&mgr->write_lock);
-    return res;
+
+/**
+ * Called as part of the hashmap callback to collect
+ * the filters the eviction clock may evict.
+ */
+static int filter_map_clock_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    clock_scan *scan = data;
+    bloom_filter_wrapper *filt = value;
+    if (is_stub(filt)) return 0;
+    bloom_filter_config *fc = &filt->filter->filter_config;
+    if (bloomf_is_proxied(filt->filter) || fc->in_memory || fc->frozen || fc->pin) return 0;
+
+    if (scan->size == scan->capacity) {
+        scan->capacity = (scan->capacity) ? scan->capacity * 2 : 64;
+        scan->entries = realloc(scan->entries, scan->capacity * sizeof(clock_entry));
+    }
+    clock_entry *e = scan->entries + scan->size++;
+    e->shard = scan->shard;
+    e->name = (char*)key;
+    e->filter = filt;
+    e->listed = 0;
+    return 0;
 }
 
 /**
- * Deletes the filter entirely. This removes it from the filter
- * manager and deletes it from disk. This is a permanent operation.
- * @arg filter_name The name of the filter to delete
- * @return 0 on success, -1 if the filter does not exist.
+ * Sweeps the mapped filters in CLOCK order from where the last
+ * sweep stopped. A hot or warmed filter gets a second chance, its
+ * mark is cleared and it is passed over. Other filters are listed
+ * until their bytes add up, so the hand goes around at most twice.
+ * Only one thread may sweep, since it moves the hand.
  */
-int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name) {
-    int res = 0;
-    pthread_mutex_lock(&mgr->write_lock);
+int filtmgr_list_evict_filters(bloom_filtmgr *mgr, uint64_t bytes, bloom_filter_list_head **head) {
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
 
-    // Get the filter
-    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
-    if (!filt) {
-        res = -1;
-        goto LEAVE;
+    // Collect the mapped filters, ordered by shard and name
+    clock_scan scan = {0, 0, 0, NULL};
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        scan.shard = i;
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        art_iter(&snap->map, filter_map_clock_cb, &scan);
+    }
+    if (!scan.size) return 0;
+
+    // Start just past the hand
+    int start = 0;
+    clock_entry *e;
+    while (mgr->clock_name && start < scan.size) {
+        e = scan.entries + start;
+        if (e->shard > mgr->clock_shard) break;
+        if (e->shard == mgr->clock_shard && strcmp(e->name, mgr->clock_name) > 0) break;
+        start++;
     }
 
-    // Set the filter to be non-active and mark for deletion
-    filt->is_active = 0;
-    filt->should_delete = 1;
-    create_delta_update(mgr, DELETE, filt);
+    uint64_t listed = 0;
+    bloom_filter_wrapper *filt;
+    bloom_filter_list *node;
+    e = NULL;
+    for (int i=0; i < 2 * scan.size && listed < bytes; i++) {
+        e = scan.entries + (start + i) % scan.size;
+        filt = e->filter;
+        if (e->listed) continue;
+        if (filt->is_hot) {
+            filt->is_hot = 0;
+            continue;
+        }
+        if (filt->is_warm) {
+            filt->is_warm = 0;
+            continue;
+        }
 
-LEAVE:
-    pthread_mutex_unlock(&mgr->write_lock);
-    return res;
+        e->listed = 1;
+        listed += __atomic_load_n(&filt->filter->mapped_bytes, __ATOMIC_RELAXED);
+        node = malloc(sizeof(bloom_filter_list));
+        node->filter_name = strdup(e->name);
+        node->next = h->head;
+        h->head = node;
+        h->size++;
+    }
+
+    // Leave the hand at the last filter visited
+    if (e) {
+        free(mgr->clock_name);
+        mgr->clock_name = strdup(e->name);
+        mgr->clock_shard = e->shard;
+    }
+    free(scan.entries);
+    return 0;
 }
 
+
 /**
- * Clears the filter from the internal data stores. This can only
- * be performed if the filter is proxied.
- * @arg filter_name The name of the filter to delete
- * @return 0 on success, -1 if the filter does not exist, -2
- * if the filter is not proxied.
+ * Called as part of the hashmap callback to collect
+ * the dirty filters, with the priority of their flush.
  */
-int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name) {
-    int res = 0;
-    pthread_mutex_lock(&mgr->write_lock);
+static int filter_map_dirty_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    dirty_scan *scan = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active || is_stub(filt)) return 0;
 
-    // Get the filter
-    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
-    if (!filt) {
-        res = -1;
-        goto LEAVE;
-    }
+    uint64_t bytes = bloomf_dirty_bytes(filt->filter);
+    if (!bytes) return 0;
 
-    // Check if the filter is proxied
-    if (!bloomf_is_proxied(filt->filter)) {
-        res = -2;
-        goto LEAVE;
+    if (scan->size == scan->capacity) {
+        scan->capacity = (scan->capacity) ? scan->capacity * 2 : 64;
+        scan->entries = realloc(scan->entries, scan->capacity * sizeof(dirty_entry));
     }
 
-    // This is critical, as it prevents it from
-    // being deleted. Instead, it is merely closed.
-    filt->is_active = 0;
-    filt->should_delete = 0;
-    create_delta_update(mgr, DELETE, filt);
+    // Filters gain a flush interval of weight for each interval
+    // they wait, so small filters are not starved by large ones
+    time_t age = scan->now - filt->filter->flushed_at;
+    if (age < 0) age = 0;
+    dirty_entry *e = scan->entries + scan->size++;
+    e->name = (char*)key;
+    e->priority = (double)bytes * (1 + (double)age / scan->interval);
+    return 0;
+}
 
-LEAVE:
-    pthread_mutex_unlock(&mgr->write_lock);
-    return res;
+/**
+ * Orders the dirty filters by decreasing priority
+ */
+static int dirty_entry_cmp(const void *a, const void *b) {
+    double pa = ((const dirty_entry*)a)->priority;
+    double pb = ((const dirty_entry*)b)->priority;
+    return (pa < pb) - (pa > pb);
 }
 
 /**
- * Unmaps the filter from memory, but leaves it
- * registered in the filter manager. This is rarely invoked
- * by a client, as it can be handled automatically by bloomd,
- * but particular clients with specific needs may use it as an
- * optimization.
- * @arg filter_name The name of the filter to delete
- * @return 0 on success, -1 if the filter does not exist.
+ * Allocates space for and returns a linked list of the
+ * dirty filters, in the order they should be flushed.
  */
-int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name) {
-    // Get the filter
-    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
-    if (!filt) return -1;
+int filtmgr_list_dirty_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head) {
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
 
-    // Skip if we are in memory
-    if (filt->filter->filter_config.in_memory)
-        goto LEAVE;
+    dirty_scan scan = {time(NULL), mgr->config->flush_interval, 0, 0, NULL};
+    if (scan.interval <= 0) scan.interval = 1;
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        art_iter(&snap->map, filter_map_dirty_cb, &scan);
+    }
+    if (!scan.size) return 0;
+    qsort(scan.entries, scan.size, sizeof(dirty_entry), dirty_entry_cmp);
+
+    // Link the list in priority order
+    bloom_filter_list *node;
+    for (int i=0; i < scan.size; i++) {
+        node = malloc(sizeof(bloom_filter_list));
+        node->filter_name = strdup(scan.entries[i].name);
+        node->next = NULL;
+        if (h->tail) h->tail->next = node;
+        else h->head = node;
+        h->tail = node;
+        h->size++;
+    }
+    free(scan.entries);
+    return 0;
+}
 
-    // Acquire the write lock
-    pthread_rwlock_wrlock(&filt->rwlock);
+/**
+ * Syncs the write-ahead log of an active filter
+ */
+static int filter_map_sync_wal_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    int *failed = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active || is_stub(filt)) return 0;
+    if (!filt->filter->wal && !filt->filter->parts) return 0;
+    if (bloomf_sync_wal(filt->filter)) {
+        syslog(LOG_ERR, "Failed to sync the log of filter %s.", (char*)key);
+        (*failed)++;
+    }
+    return 0;
+}
 
-    // Close the filter
-    bloomf_close(filt->filter);
+/**
+ * Writes out and syncs the write-ahead logs of the
+ * mapped filters, so that their sets are durable.
+ * @note Must be invoked by a client of the manager.
+ * @arg mgr The manager
+ * @return The number of logs that failed to sync.
+ */
+int filtmgr_sync_wals(bloom_filtmgr *mgr) {
+    int failed = 0;
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        art_iter(&snap->map, filter_map_sync_wal_cb, &failed);
+    }
+    return failed;
+}
 
-    // Release the lock
-    pthread_rwlock_unlock(&filt->rwlock);
+/**
+ * Called as part of the hashmap callback to start
+ * the writeback of each mapped filter.
+ */
+static int filter_map_writeback_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key;
+    (void)key_len;
+    int *failed = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active || is_stub(filt) || bloomf_is_proxied(filt->filter)) return 0;
 
-LEAVE:
+    // Growing replaces the layers, so adds are excluded
+    void *slot = brlock_rdlock(&filt->lock);
+    if (bloomf_writeback(filt->filter)) (*failed)++;
+    brlock_rdunlock(&filt->lock, slot);
     return 0;
 }
 
 /**
- * Allocates space for and returns a linked
- * list of all the filters.
- * @arg mgr The manager to list from
- * @arg prefix The prefix to list or NULL
- * @arg head Output, sets to the address of the list header
- * @return 0 on success.
+ * Starts the writeback of the dirty pages of the mapped
+ * filters that are mapped SHARED from their data files.
+ * @note Must be invoked by a client of the manager.
+ * @arg mgr The manager
+ * @return The number of filters that failed to start it.
  */
-int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_head **head) {
-    // Allocate the head
-    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
-
-    // Iterate through a callback to append
-    int prefix_len = 0;
-    if (prefix) {
-        prefix_len = strlen(prefix);
-        art_iter_prefix(mgr->filter_map, (unsigned char*)prefix, prefix_len, filter_map_list_cb, h);
-    } else
-        art_iter(mgr->filter_map, filter_map_list_cb, h);
-
-    // Joy... we have to potentially handle the delta updates
-    if (mgr->primary_vsn == mgr->vsn) return 0;
+int filtmgr_writeback(bloom_filtmgr *mgr) {
+    int failed = 0;
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        art_iter(&snap->map, filter_map_writeback_cb, &failed);
+    }
+    return failed;
+}
 
-    filter_list *current = mgr->delta;
-    bloom_filter_wrapper *f;
-    while (current) {
-        // Check if this is a match (potential prefix)
-        if (current->type == CREATE) {
-            f = current->filter;
-            if (!prefix_len || !strncmp(f->filter->filter_name, prefix, prefix_len)) {
-                f = current->filter;
-                filter_map_list_cb(h, (unsigned char*)f->filter->filter_name, 0, f);
-            }
+/**
+ * Takes the waiters of the tickets up to the last one flushed,
+ * which are called back outside of the lock.
+ * @note Must be invoked with the flush lock held.
+ */
+static flush_waiter* take_flush_waiters(bloom_filtmgr *mgr) {
+    flush_waiter *done = NULL, *w, **prev = &mgr->flush_waiters;
+    while ((w = *prev)) {
+        if (w->ticket <= mgr->flush_done) {
+            *prev = w->next;
+            w->next = done;
+            done = w;
+        } else {
+            prev = &w->next;
         }
+    }
+    return done;
+}
 
-        // Don't seek past what the primary map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
+// Calls back and frees the waiters of completed tickets
+static void complete_flush_waiters(flush_waiter *w) {
+    flush_waiter *next;
+    for (; w; w = next) {
+        next = w->next;
+        w->cb(w->data, 0);
+        free(w);
     }
+}
 
-    return 0;
+/**
+ * Marks whether the flush thread runs the flushes requested by
+ * the clients. Once it stops, the outstanding tickets complete.
+ */
+void filtmgr_set_flush_scheduler(bloom_filtmgr *mgr, int running) {
+    pthread_mutex_lock(&mgr->flush_lock);
+    mgr->flush_scheduler = running;
+    if (!running) mgr->flush_done = mgr->flush_requested;
+    flush_waiter *done = take_flush_waiters(mgr);
+    pthread_mutex_unlock(&mgr->flush_lock);
+    complete_flush_waiters(done);
 }
 
+/**
+ * Requests a flush of all the filters from the flush thread,
+ * without waiting for it.
+ */
+int filtmgr_request_flush(bloom_filtmgr *mgr, uint64_t *ticket) {
+    pthread_mutex_lock(&mgr->flush_lock);
+    int res = -1;
+    if (mgr->flush_scheduler) {
+        *ticket = ++mgr->flush_requested;
+        res = 0;
+    }
+    pthread_mutex_unlock(&mgr->flush_lock);
+    return res;
+}
 
 /**
- * Allocates space for and returns a linked
- * list of all the cold filters. This has the side effect
- * of clearing the list of cold filters!
- * @arg mgr The manager to list from
- * @arg head Output, sets to the address of the list header
- * @return 0 on success.
+ * Returns the last ticket requested, if any are outstanding.
  */
-int filtmgr_list_cold_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head) {
-    // Allocate the head of a new hashmap
-    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+uint64_t filtmgr_flush_requested(bloom_filtmgr *mgr) {
+    pthread_mutex_lock(&mgr->flush_lock);
+    uint64_t ticket = (mgr->flush_requested > mgr->flush_done) ? mgr->flush_requested : 0;
+    pthread_mutex_unlock(&mgr->flush_lock);
+    return ticket;
+}
 
-    // Scan for the cold filters. Ignore deltas, since they are either
-    // new (e.g. hot), or being deleted anyways.
-    art_iter(mgr->filter_map, filter_map_list_cold_cb, h);
-    return 0;
+/**
+ * Completes the tickets up to the given one.
+ */
+void filtmgr_complete_flush(bloom_filtmgr *mgr, uint64_t ticket) {
+    pthread_mutex_lock(&mgr->flush_lock);
+    if (ticket > mgr->flush_done) mgr->flush_done = ticket;
+    flush_waiter *done = take_flush_waiters(mgr);
+    pthread_mutex_unlock(&mgr->flush_lock);
+    complete_flush_waiters(done);
+}
+
+/**
+ * Waits for a ticket without blocking the caller.
+ */
+int filtmgr_wait_flush_async(bloom_filtmgr *mgr, uint64_t ticket, fault_cb cb, void *data) {
+    pthread_mutex_lock(&mgr->flush_lock);
+    int res = 0;
+    if (!ticket || ticket > mgr->flush_requested) {
+        res = -1;
+    } else if (ticket <= mgr->flush_done) {
+        res = 1;
+    } else {
+        flush_waiter *w = malloc(sizeof(flush_waiter));
+        w->ticket = ticket;
+        w->cb = cb;
+        w->data = data;
+        w->next = mgr->flush_waiters;
+        mgr->flush_waiters = w;
+    }
+    pthread_mutex_unlock(&mgr->flush_lock);
+    return res;
 }
 
 
+
 /**
  * This method allows a callback function to be invoked with bloom filter.
  * The purpose of this is to ensure that a bloom filter is not deleted or
@@ -626,55 +2531,187 @@ void filtmgr_cleanup_list(bloom_filter_list_head *head) {
     free(head);
 }
 
-// Searches the primary tree and the delta list for a filter
-static bloom_filter_wrapper* find_filter(bloom_filtmgr *mgr, char *filter_name) {
-    // Search the tree first
-    bloom_filter_wrapper *filt = art_search(mgr->filter_map,
-            (unsigned char*)filter_name, strlen(filter_name)+1);
-    if (filt) return filt;
+// Orders filter list nodes by name
+static int filter_list_cmp(const void *a, const void *b) {
+    return strcmp((*(bloom_filter_list**)a)->filter_name, (*(bloom_filter_list**)b)->filter_name);
+}
 
-    // Check if the primary has all delta changes
-    if (mgr->primary_vsn == mgr->vsn) return NULL;
+/**
+ * Sorts a filter list by name, since each shard
+ * lists its own filters in order.
+ */
+static void sort_filter_list(bloom_filter_list_head *head) {
+    if (head->size < 2) return;
+
+    // Sort an array of the nodes, and relink them
+    bloom_filter_list **nodes = malloc(head->size * sizeof(bloom_filter_list*));
+    int i = 0;
+    for (bloom_filter_list *n=head->head; n; n=n->next) nodes[i++] = n;
+    qsort(nodes, head->size, sizeof(bloom_filter_list*), filter_list_cmp);
+    for (i=0; i < head->size - 1; i++) nodes[i]->next = nodes[i+1];
+    nodes[i]->next = NULL;
+    head->head = nodes[0];
+    head->tail = nodes[i];
+    free(nodes);
+}
 
-    // Search the delta list
-    filter_list *current = mgr->delta;
-    while (current) {
-        // Check if this is a match
-        if (current->type != BARRIER &&
-            strcmp(current->filter->filter->filter_name, filter_name) == 0) {
-            return current->filter;
-        }
+// Hashes a filter name, and returns the shard of the filter
+static filtmgr_shard* filter_shard(bloom_filtmgr *mgr, char *filter_name, uint64_t *hash) {
+    WyHash128(filter_name, strlen(filter_name), 0, hash);
+    return mgr->shards + (hash[1] & (FILTMGR_SHARDS - 1));
+}
 
-        // Don't seek past what the primary map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
-    }
+// The name of a filter, a stub keeps its own
+static inline char* filter_wrapper_name(bloom_filter_wrapper *filt) {
+    return (filt->stub_name) ? filt->stub_name : filt->filter->filter_name;
+}
 
-    // Not found
-    return NULL;
+// Searches the index of the current snapshot of the shard for a filter
+static bloom_filter_wrapper* find_filter(bloom_filtmgr *mgr, char *filter_name) {
+    uint64_t hash[2];
+    filtmgr_shard *shard = filter_shard(mgr, filter_name, hash);
+    filter_snapshot *snap = __atomic_load_n(&shard->snapshot, __ATOMIC_ACQUIRE);
+
+    // Probe until an empty slot, comparing names only on a hash match
+    filter_slot *slot;
+    for (uint64_t i=hash[0]; ; i++) {
+        slot = snap->index + (i & snap->index_mask);
+        if (!slot->filter) return NULL;
+        if (slot->hash == hash[0] && !strcmp(filter_wrapper_name(slot->filter), filter_name))
+            return slot->filter;
+    }
 }
 
-// Gets the bloom filter in a thread safe way.
+// Gets the bloom filter in a thread safe way, loading a stub
 static bloom_filter_wrapper* take_filter(bloom_filtmgr *mgr, char *filter_name) {
     bloom_filter_wrapper *filt = find_filter(mgr, filter_name);
+    BLOOM_PROBE3(filter__lookup, filter_name, filt, 0);
+    if (filt && filt->is_active && load_stub(mgr, filt)) return NULL;
+    return (filt && filt->is_active) ? filt : NULL;
+}
+
+/**
+ * Gets the bloom filter through a client cache. A cached filter
+ * cannot have been freed while the version is unchanged, since every
+ * drop makes a new version, and the vacuum thread only frees it once
+ * this client checkpoints past that version.
+ */
+static bloom_filter_wrapper* take_cached_filter(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name) {
+    if (!cache) return take_filter(mgr, filter_name);
+
+    // Read the version before the lookup, a racing create or drop
+    // then leaves a stale version and the next call looks up again
+    unsigned long long vsn = mgr->vsn;
+    bloom_filter_wrapper *filt;
+    if (cache->filter && cache->vsn == vsn && strcmp(cache->name, filter_name) == 0) {
+        filt = cache->filter;
+        BLOOM_PROBE3(filter__lookup, filter_name, filt, 1);
+    } else {
+        // Only active filters are cached, closed ones may be freed
+        filt = find_filter(mgr, filter_name);
+        BLOOM_PROBE3(filter__lookup, filter_name, filt, 0);
+        if (filt && filt->is_active && load_stub(mgr, filt)) filt = NULL;
+        cache->filter = NULL;
+        if (strlen(filter_name) <= FILTMGR_CACHE_NAME) {
+            if (cache->name != filter_name) strcpy(cache->name, filter_name);
+            if (filt && filt->is_active) {
+                cache->vsn = vsn;
+                cache->filter = filt;
+            }
+        }
+    }
     return (filt && filt->is_active) ? filt : NULL;
 }
 
 
+/**
+ * Marks a filter as hot. The access that marks it is sampled
+ * for the pre-warming, only one of racing accesses wins the mark.
+ */
+static inline void mark_hot(bloom_filtmgr *mgr, bloom_filter_wrapper *filt) {
+    if (filt->is_hot || !__sync_bool_compare_and_swap(&filt->is_hot, 0, 1)) return;
+
+    // Sample the access, and a wake after an idle gap. The first
+    // access since startup is not a wake, the gap is unknown.
+    time_t now = time(NULL);
+    time_t last = filt->last_access;
+    filt->last_access = now;
+    if (!last || now - last <= 2 * (time_t)mgr->config->cold_interval) return;
+    filt->wakes[filt->num_wakes % WAKE_HISTORY] = now;
+    __atomic_store_n(&filt->num_wakes, filt->num_wakes + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Checks if a filter can be checked without its lock. A frozen
+ * filter is never unmapped, so once it is mapped it never changes.
+ * Until then it is checked under the lock, which faults it in.
+ */
+static inline int lock_free_checks(bloom_filter_wrapper *filt) {
+    return __atomic_load_n(&filt->filter->filter_config.frozen, __ATOMIC_ACQUIRE) &&
+        !bloomf_is_proxied(filt->filter);
+}
+
+/**
+ * Checks that the keys of a hashed filter are all client
+ * hashes, since its layers only decode the keys.
+ * @return 1 if a key of a hashed filter is not a hash.
+ */
+static int bad_hashes(bloom_filter_wrapper *filt, char **keys, uint64_t *key_lens, int num_keys) {
+    if (!filt->filter->filter_config.hashed) return 0;
+    for (int i=0; i < num_keys; i++) {
+        uint64_t len = (key_lens) ? key_lens[i] : strlen(keys[i]);
+        if (!bf_is_client_hash(keys[i], len)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Predicts the next wake of a filter, if its last wakes
+ * were evenly spaced. A daily filter is predicted to wake
+ * a day after its last wake.
+ * @return The predicted time, or 0 if there is no pattern.
+ */
+static time_t predict_wake(bloom_filter_wrapper *filt) {
+    int n = __atomic_load_n(&filt->num_wakes, __ATOMIC_ACQUIRE);
+    if (n < 3) return 0;
+    time_t w1 = filt->wakes[(n - 3) % WAKE_HISTORY];
+    time_t w2 = filt->wakes[(n - 2) % WAKE_HISTORY];
+    time_t w3 = filt->wakes[(n - 1) % WAKE_HISTORY];
+    time_t period = w3 - w2;
+    time_t diff = period - (w2 - w1);
+    if (period <= 0 || (diff < 0 ? -diff : diff) > period / PERIOD_TOLERANCE) return 0;
+    return w3 + period;
+}
+
+
 /**
  * Invoked to cleanup a filter once we
  * have hit 0 remaining references.
  */
 static void delete_filter(bloom_filter_wrapper *filt) {
-    // Delete or Close the filter
-    if (filt->should_delete)
+    // A stub is never deleted, drops load it first. One that
+    // failed to load was no longer counted.
+    if (!filt->filter) {
+        if (filt->is_active) stats_add(STAT_FILTERS, -1);
+        free(filt->stub_name);
+        free(filt->stub_config);
+        free(filt);
+        return;
+    }
+
+    // Delete or Close the filter. The delete is recorded after the
+    // fact, so a crash before the delete leaves the filter listed
+    // just as its folder does.
+    if (filt->should_delete) {
         bloomf_delete(filt->filter);
-    else
+        if (filt->filter->catalog)
+            catalog_remove(filt->filter->catalog, filt->filter->filter_name);
+    } else
         bloomf_close(filt->filter);
 
     // Cleanup the filter
     destroy_bloom_filter(filt->filter);
+    stats_add(STAT_FILTERS, -1);
 
     // Release any custom configs
     if (filt->custom) {
@@ -682,6 +2719,8 @@ static void delete_filter(bloom_filter_wrapper *filt) {
     }
 
     // Release the struct
+    free(filt->stub_name);
+    free(filt->stub_config);
     free(filt);
     return;
 }
@@ -692,16 +2731,49 @@ static void delete_filter(bloom_filter_wrapper *filt) {
  * @arg filter_name The name of the filter
  * @arg config The configuration for the filter
  * @arg is_hot Is the filter hot. False for existing.
- * @arg delta Is this a delta update or should the map be updated
+ * @arg publish Should a new snapshot be published, or the
+ * current one updated. Only safe to update before there are clients.
+ * Publishing must be done with the write lock of the shard.
  * @return 0 on success, -1 on error
  */
-static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot, int delta) {
+static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot, int publish) {
+    bloom_filter_wrapper *filt = new_filter(mgr, filter_name, config, is_hot);
+    if (!filt) return -1;
+
+    // Record the new filter, later configs are recorded by the filter
+    if (mgr->catalog) {
+        filt->filter->catalog = mgr->catalog;
+        catalog_add(mgr->catalog, filter_name, &filt->filter->filter_config);
+    }
+
+    // Check if we are publishing a new snapshot or directly updating ART tree
+    uint64_t hash[2];
+    filtmgr_shard *shard = filter_shard(mgr, filter_name, hash);
+    if (publish) {
+        filter_snapshot *snap = copy_snapshot(shard);
+        art_insert(&snap->map, (unsigned char*)filter_name, strlen(filter_name)+1, filt);
+        publish_snapshot(mgr, shard, snap);
+    } else
+        art_insert(&shard->snapshot->map, (unsigned char*)filter_name, strlen(filter_name)+1, filt);
+    stats_add(STAT_FILTERS, 1);
+    return 0;
+}
+
+/**
+ * Creates the wrapper and the underlying filter, without adding
+ * it to the manager. Safe to call from many threads at once.
+ * @arg filter_name The name of the filter
+ * @arg config The configuration for the filter
+ * @arg is_hot Is the filter hot. False for existing.
+ * @return The filter, or NULL on error
+ */
+static bloom_filter_wrapper* new_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot) {
     // Create the filter
     bloom_filter_wrapper *filt = calloc(1, sizeof(bloom_filter_wrapper));
     filt->is_active = 1;
     filt->is_hot = is_hot;
     filt->should_delete = 0;
-    pthread_rwlock_init(&filt->rwlock, NULL);
+    brlock_init(&filt->lock);
 
     // Set the custom filter if its not the same
     if (mgr->config != config) {
@@ -712,15 +2784,9 @@ static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *confi
     int res = init_bloom_filter(config, filter_name, is_hot, &filt->filter);
     if (res != 0) {
         free(filt);
-        return -1;
+        return NULL;
     }
-
-    // Check if we are adding a delta value or directly updating ART tree
-    if (delta)
-        create_delta_update(mgr, CREATE, filt);
-    else
-        art_insert(mgr->filter_map, (unsigned char*)filter_name, strlen(filter_name)+1, filt);
-    return 0;
+    return filt;
 }
 
 /**
@@ -754,8 +2820,36 @@ static int filter_map_list_cb(void *data, const unsigned char *key, uint32_t key
         head->tail->next = node;
         head->tail = node;
     }
-    head->size++;
-    return 0;
+    head->size++;
+    return 0;
+}
+
+/**
+ * Called as part of the map callback to collect a
+ * page of filters. Stops when the keys pass the prefix,
+ * or once the page has reached its limit.
+ */
+static int filter_map_page_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    filter_page *page = data;
+
+    // The keys are in order, so the first without the prefix ends it
+    if (page->prefix && (key_len < (uint32_t)page->prefix_len ||
+                memcmp(key, page->prefix, page->prefix_len)))
+        return 1;
+
+    // Filter out the non-active nodes
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active) return 0;
+
+    // Grow the entries as needed
+    if (page->size == page->capacity) {
+        page->capacity = (page->capacity) ? page->capacity * 2 : 16;
+        page->entries = realloc(page->entries, page->capacity * sizeof(filter_entry));
+    }
+    page->entries[page->size].name = (char*)key;
+    page->entries[page->size].filter = filt;
+    page->size++;
+    return (page->limit && page->size == page->limit);
 }
 
 /**
@@ -769,14 +2863,24 @@ static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_
     bloom_filter_list_head *head = data;
     bloom_filter_wrapper *filt = value;
 
+    // Stubs are not mapped
+    if (is_stub(filt)) return 0;
+
     // Check if hot, turn off and skip
     if (filt->is_hot) {
         filt->is_hot = 0;
         return 0;
     }
 
-    // Check if proxied
-    if (bloomf_is_proxied(filt->filter)) {
+    // Keep a warmed filter for its predicted use
+    if (filt->is_warm) {
+        filt->is_warm = 0;
+        return 0;
+    }
+
+    // Check if proxied, frozen and pinned filters stay mapped
+    bloom_filter_config *fc = &filt->filter->filter_config;
+    if (bloomf_is_proxied(filt->filter) || fc->frozen || fc->pin) {
         return 0;
     }
 
@@ -794,23 +2898,106 @@ static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_
 }
 
 /**
- * Called as part of the hashmap callback
- * to cleanup the filters.
+ * Collects the filters to close at shutdown
  */
-static int filter_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
-    (void)data;
+static int filter_map_close_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
     (void)key;
     (void)key_len;
-
-    // Cast the inputs
+    filter_closer *closer = data;
     bloom_filter_wrapper *filt = value;
-
-    // Delete, but not the underlying files
-    filt->should_delete = 0;
-    delete_filter(filt);
+    if (closer->size == closer->capacity) {
+        closer->capacity = (closer->capacity) ? closer->capacity * 2 : 64;
+        closer->entries = realloc(closer->entries, closer->capacity * sizeof(close_entry));
+    }
+    close_entry *e = closer->entries + closer->size++;
+    e->filter = filt;
+    e->dirty = (is_stub(filt)) ? 0 : bloomf_dirty_bytes(filt->filter);
     return 0;
 }
 
+/**
+ * Orders the filters to close by decreasing dirty bytes
+ */
+static int close_entry_cmp(const void *a, const void *b) {
+    uint64_t da = ((const close_entry*)a)->dirty;
+    uint64_t db = ((const close_entry*)b)->dirty;
+    return (da < db) - (da > db);
+}
+
+/**
+ * Closes all the filters at shutdown, on several threads, this
+ * thread included. The dirty filters are flushed first, largest
+ * first, so the threads finish together. Clean filters are only
+ * unmapped.
+ */
+static void close_filters(bloom_filtmgr *mgr) {
+    filter_closer closer;
+    memset(&closer, 0, sizeof(closer));
+    closer.config = mgr->config;
+    for (int i=0; i < FILTMGR_SHARDS; i++)
+        art_iter(&mgr->shards[i].snapshot->map, filter_map_close_cb, &closer);
+    if (!closer.size) return;
+    qsort(closer.entries, closer.size, sizeof(close_entry), close_entry_cmp);
+
+    int dirty = 0;
+    while (dirty < closer.size && closer.entries[dirty].dirty) dirty++;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = (dirty) ? dirty : 1;
+    if (threads > cpus) threads = cpus;
+    if (threads > MAX_LOAD_THREADS) threads = MAX_LOAD_THREADS;
+    if (threads < 1) threads = 1;
+    closer.threads = threads;
+    time_t start = closer.logged = time(NULL);
+    syslog(LOG_INFO, "Closing %d filters, %d dirty, on %d threads", closer.size, dirty, threads);
+
+    pthread_t tids[MAX_LOAD_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(tids + started, NULL, close_thread_main, &closer)) break;
+    }
+    close_thread_main(&closer);
+    for (int i=0; i < started; i++) pthread_join(tids[i], NULL);
+
+    syslog(LOG_INFO, "Closed %d filters in %d seconds", closer.size, (int)(time(NULL) - start));
+    free(closer.entries);
+}
+
+/**
+ * Closes the filters of a closer until none are left
+ */
+static void* close_thread_main(void *in) {
+    filter_closer *closer = in;
+    bloom_config *config = closer->config;
+    bloom_flusher *flusher;
+    flusher_create((uint64_t)config->flush_inflight_mb * 1024 * 1024 / closer->threads, &flusher);
+    flusher_set_rate(flusher, (uint64_t)config->flush_bandwidth_mb * 1024 * 1024 / closer->threads);
+
+    bloom_filter_wrapper *filt;
+    int i, closed;
+    time_t now, logged;
+    while ((i = __atomic_fetch_add(&closer->next, 1, __ATOMIC_RELAXED)) < closer->size) {
+        // Flush within the bandwidth budget, then close
+        filt = closer->entries[i].filter;
+        if (closer->entries[i].dirty) {
+            bloomf_flush_async(filt->filter, flusher);
+            flusher_drain(flusher);
+        }
+        filt->should_delete = 0;
+        delete_filter(filt);
+
+        // One thread logs the progress every so often
+        closed = __atomic_add_fetch(&closer->closed, 1, __ATOMIC_RELAXED);
+        now = time(NULL);
+        logged = __atomic_load_n(&closer->logged, __ATOMIC_RELAXED);
+        if (now - logged >= CLOSE_PROGRESS_INTERVAL &&
+                __atomic_compare_exchange_n(&closer->logged, &logged, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            syslog(LOG_INFO, "Closed %d of %d filters", closed, closer->size);
+        }
+    }
+    flusher_destroy(flusher);
+    return NULL;
+}
+
 /**
  * Works with scandir to filter out non-bloomd folders.
  */
@@ -834,10 +3021,22 @@ static int filter_bloomd_folders(CONST_DIRENT_T *d) {
 }
 
 /**
- * Loads the existing filters. This is not thread
+ * Adds stubs of the existing filters. This is not thread
  * safe and assumes that we are being initialized.
  */
 static int load_existing_filters(bloom_filtmgr *mgr) {
+    // Read the catalog, unless it is missing or corrupt
+    int res = catalog_load(mgr->config->data_dir, load_cataloged_filter, mgr);
+    if (!res) {
+        syslog(LOG_INFO, "Found %llu existing filters in the catalog",
+                (unsigned long long)stats_value(STAT_FILTERS));
+        return 0;
+    } else if (res == -EINVAL) {
+        syslog(LOG_WARNING, "The filter catalog is corrupt, scanning the data directory");
+    } else if (res != -ENOENT) {
+        syslog(LOG_WARNING, "Failed to read the filter catalog, scanning the data directory. Err: %d", res);
+    }
+
     struct dirent **namelist;
     int num;
 
@@ -848,164 +3047,451 @@ static int load_existing_filters(bloom_filtmgr *mgr) {
     }
     syslog(LOG_INFO, "Found %d existing filters", num);
 
-    // Add all the filters
-    for (int i=0; i< num; i++) {
-        char *folder_name = namelist[i]->d_name;
-        char *filter_name = folder_name + FOLDER_PREFIX_LEN;
-        if (add_filter(mgr, filter_name, mgr->config, 0, 0)) {
-            syslog(LOG_ERR, "Failed to load filter '%s'!", filter_name);
-        }
+    // The configs of the filters are read by the sweep
+    for (int i=0; i < num; i++) {
+        add_stub(mgr, namelist[i]->d_name + FOLDER_PREFIX_LEN, NULL);
+        free(namelist[i]);
     }
-
-    for (int i=0; i < num; i++) free(namelist[i]);
     free(namelist);
+    mgr->uncataloged = num;
     return 0;
 }
 
-
 /**
- * Creates a new delta update and adds to the head of the list.
- * This must be invoked with the write lock as it is unsafe.
- * @arg mgr The manager
- * @arg type The type of delta
- * @arg filt The filter that is affected
- * @return The new version we created
+ * Adds a stub of an existing filter, see load_existing_filters.
+ * The snapshot is not published yet.
+ * @arg filter_name The name of the filter
+ * @arg config The filter config from the catalog, or NULL
  */
-static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt) {
-    filter_list *delta = malloc(sizeof(filter_list));
-    delta->vsn = ++mgr->vsn;
-    delta->type = type;
-    delta->filter = filt;
-    delta->next = mgr->delta;
-    mgr->delta = delta;
-    return delta->vsn;
+static void add_stub(bloom_filtmgr *mgr, char *filter_name, bloom_filter_config *config) {
+    bloom_filter_wrapper *filt = calloc(1, sizeof(bloom_filter_wrapper));
+    filt->is_active = 1;
+    filt->stub_name = strdup(filter_name);
+    if (config) {
+        filt->stub_config = malloc(sizeof(bloom_filter_config));
+        memcpy(filt->stub_config, config, sizeof(bloom_filter_config));
+    }
+
+    uint64_t hash[2];
+    filtmgr_shard *shard = filter_shard(mgr, filter_name, hash);
+    art_insert(&shard->snapshot->map, (unsigned char*)filter_name, strlen(filter_name)+1, filt);
+    stats_add(STAT_FILTERS, 1);
 }
 
 /**
- * Merges changes into the alternate tree from the delta lists
- * Safety: Safe ONLY if no other thread is using alt_filter_map
+ * Adds a filter read from the catalog, see load_existing_filters.
  */
-static void merge_old_versions(bloom_filtmgr *mgr, filter_list *delta, unsigned long long min_vsn) {
-    // Handle older delta first (bottom up)
-    if (delta->next) merge_old_versions(mgr, delta->next, min_vsn);
+static void load_cataloged_filter(void *data, char *filter_name, bloom_filter_config *config) {
+    add_stub(data, filter_name, config);
+}
 
-    // Check if we should skip this update
-    if (delta->vsn > min_vsn) return;
+// Checks if a filter is a stub, that is not loaded yet
+static inline int is_stub(bloom_filter_wrapper *filt) {
+    return !__atomic_load_n(&filt->filter, __ATOMIC_ACQUIRE);
+}
 
-    // Handle current update
-    bloom_filter_wrapper *s = delta->filter;
-    switch (delta->type) {
-        case CREATE:
-            art_insert(mgr->alt_filter_map, (unsigned char*)s->filter->filter_name, strlen(s->filter->filter_name)+1, s);
-            break;
-        case DELETE:
-            art_delete(mgr->alt_filter_map, (unsigned char*)s->filter->filter_name, strlen(s->filter->filter_name)+1);
-            break;
-        case BARRIER:
-            // Ignore the barrier...
-            break;
+/**
+ * Loads the filter of a stub, as it was loaded at startup
+ * before stubs. The loads are serialized, so racing uses
+ * of a stub wait for a single load. A stub that fails to
+ * load is deactivated, as if it was not found.
+ * @arg filt The filter, a loaded filter is left as is
+ * @return 0 on success, -1 if the stub failed to load.
+ */
+static int load_stub(bloom_filtmgr *mgr, bloom_filter_wrapper *filt) {
+    if (!is_stub(filt)) return 0;
+    pthread_mutex_lock(&mgr->stub_lock);
+    if (!filt->filter && filt->is_active) {
+        bloom_filter *f = NULL;
+        int res;
+        if (filt->stub_config)
+            res = init_cataloged_filter(mgr->config, filt->stub_name, filt->stub_config, &f);
+        else
+            res = init_bloom_filter(mgr->config, filt->stub_name, 0, &f);
+
+        if (res) {
+            syslog(LOG_ERR, "Failed to load filter '%s'!", filt->stub_name);
+            filt->is_active = 0;
+            stats_add(STAT_FILTERS, -1);
+        } else {
+            brlock_init(&filt->lock);
+            f->catalog = mgr->catalog;
+            __atomic_store_n(&filt->filter, f, __ATOMIC_RELEASE);
+        }
     }
+    int res = (filt->filter) ? 0 : -1;
+    pthread_mutex_unlock(&mgr->stub_lock);
+    return res;
 }
 
 /**
- * Updates the pending deletes list with a list of pending deletes
+ * Loads the stubs of every shard, until stopped. The sweep
+ * is a client of the manager while it scans a shard, so the
+ * snapshot and its filters are not freed under it.
  */
-static void mark_pending_deletes(bloom_filtmgr *mgr, unsigned long long min_vsn) {
-    bloom_filter_list *tmp, *pending = NULL;
+static void sweep_stubs(bloom_filtmgr *mgr) {
+    filter_snapshot *snap;
+    for (int i=0; i < FILTMGR_SHARDS && mgr->sweep_run; i++) {
+        filtmgr_client_checkpoint(mgr);
+        snap = __atomic_load_n(&mgr->shards[i].snapshot, __ATOMIC_ACQUIRE);
+        art_iter(&snap->map, filter_map_stub_cb, mgr);
+    }
+    filtmgr_client_leave(mgr);
+}
 
-    // Add each delete
-    filter_list *delta = mgr->delta;
-    while (delta) {
-        if (delta->vsn <= min_vsn && delta->type == DELETE) {
-            tmp = malloc(sizeof(bloom_filter_list));
-            tmp->filter_name = strdup(delta->filter->filter->filter_name);
-            tmp->next = pending;
-            pending = tmp;
-        }
-        delta = delta->next;
+/**
+ * Loads a stub, see sweep_stubs
+ */
+static int filter_map_stub_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key;
+    (void)key_len;
+    bloom_filtmgr *mgr = data;
+    bloom_filter_wrapper *filt = value;
+    if (!mgr->sweep_run) return 1;
+    if (filt->is_active) load_stub(mgr, filt);
+    return 0;
+}
+
+/**
+ * Reads the configs of the filters found without the catalog,
+ * then records them in a new catalog. The filters are usable
+ * meanwhile, each is loaded on its first use if the sweep has
+ * not reached it.
+ */
+static void* sweep_thread_main(void *in) {
+    bloom_filtmgr *mgr = in;
+    time_t start = time(NULL);
+    sweep_stubs(mgr);
+    if (!mgr->sweep_run) return NULL;
+    syslog(LOG_INFO, "Read the configs of %d existing filters in %d seconds",
+            mgr->uncataloged, (int)(time(NULL) - start));
+    start_catalog(mgr);
+    return NULL;
+}
+
+/**
+ * Writes a new catalog of the loaded filters, which drops the
+ * records of deleted filters and old configs. If that fails, the
+ * old catalog is removed, so the next start scans the folders
+ * instead of missing the filters created meanwhile.
+ *
+ * The filters created once the catalog is set are recorded
+ * by add_filter. Each shard is scanned under its write lock,
+ * so a racing create is recorded at least once.
+ */
+static void start_catalog(bloom_filtmgr *mgr) {
+    bloom_catalog *catalog;
+    if (init_catalog(mgr->config->data_dir, &catalog)) goto FAILED;
+    __atomic_store_n(&mgr->catalog, catalog, __ATOMIC_RELEASE);
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        pthread_mutex_lock(&mgr->shards[i].write_lock);
+        art_iter(&mgr->shards[i].snapshot->map, filter_map_catalog_cb, catalog);
+        pthread_mutex_unlock(&mgr->shards[i].write_lock);
+    }
+    if (!catalog_commit(catalog)) return;
+
+    // The filters keep appending to the uncommitted catalog,
+    // which is discarded when it is destroyed
+FAILED:
+    {
+        char *path = join_path(mgr->config->data_dir, CATALOG_FILENAME);
+        unlink(path);
+        free(path);
+    }
+}
+
+/**
+ * Records a loaded filter, or the config of a stub, in the new catalog
+ */
+static int filter_map_catalog_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    bloom_catalog *catalog = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active) return 0;
+    if (is_stub(filt)) {
+        if (filt->stub_config) catalog_add(catalog, (char*)key, filt->stub_config);
+        return 0;
     }
+    __atomic_store_n(&filt->filter->catalog, catalog, __ATOMIC_RELEASE);
+    catalog_add(catalog, (char*)key, &filt->filter->filter_config);
+    return 0;
+}
+
+
+/**
+ * Copies the current snapshot of a shard, so that it can be
+ * changed and published. This must be invoked with the write lock.
+ * @arg shard The shard
+ * @return The new snapshot
+ */
+static filter_snapshot* copy_snapshot(filtmgr_shard *shard) {
+    filter_snapshot *snap = calloc(1, sizeof(filter_snapshot));
+    art_copy(&snap->map, &shard->snapshot->map);
+    return snap;
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to add the filters to an index.
+ */
+static int filter_map_index_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    filter_snapshot *snap = data;
+    uint64_t hash[2];
+    WyHash128(key, key_len - 1, 0, hash);
+
+    // Linear probe for a free slot
+    uint64_t i = hash[0];
+    while (snap->index[i & snap->index_mask].filter) i++;
+    snap->index[i & snap->index_mask].hash = hash[0];
+    snap->index[i & snap->index_mask].filter = value;
+    return 0;
+}
+
+/**
+ * Builds the name index of a snapshot from its map. This
+ * must be done before the snapshot is published.
+ * @arg snap The snapshot to index
+ */
+static void index_snapshot(filter_snapshot *snap) {
+    // Size for a load factor of at most a half
+    uint64_t slots = INDEX_MIN_SLOTS;
+    while (slots < 2 * art_size(&snap->map)) slots <<= 1;
+    snap->index_mask = slots - 1;
+    snap->index = calloc(slots, sizeof(filter_slot));
+    art_iter(&snap->map, filter_map_index_cb, snap);
+}
+
+/**
+ * Frees a snapshot and its index. The filters are not freed.
+ * @arg snap The snapshot to free
+ */
+static void destroy_snapshot(filter_snapshot *snap) {
+    destroy_art_tree(&snap->map);
+    free(snap->index);
+    free(snap);
+}
+
+/**
+ * Publishes a snapshot of a shard as a new version, and retires
+ * the replaced one. This must be invoked with the write lock.
+ * @arg mgr The manager
+ * @arg shard The shard
+ * @arg snap The snapshot to publish
+ * @return The new version we created
+ */
+static unsigned long long publish_snapshot(bloom_filtmgr *mgr, filtmgr_shard *shard, filter_snapshot *snap) {
+    filter_snapshot *old = shard->snapshot;
+    index_snapshot(snap);
+
+    // Publish the snapshot before the version, so that a client
+    // at the new version can only load the new snapshot
+    __atomic_store_n(&shard->snapshot, snap, __ATOMIC_SEQ_CST);
+    snap->vsn = __atomic_add_fetch(&mgr->vsn, 1, __ATOMIC_SEQ_CST);
+    retire(mgr, shard, snap->vsn, old, NULL);
+    return snap->vsn;
+}
+
+/**
+ * Adds garbage to the head of the retired list of a shard, and
+ * wakes the vacuum thread. This must be invoked with the write lock.
+ * @arg mgr The manager
+ * @arg shard The shard
+ * @arg vsn The version that made the garbage unreachable
+ * @arg snap A replaced snapshot, or NULL
+ * @arg filt A removed filter, or NULL
+ */
+static void retire(bloom_filtmgr *mgr, filtmgr_shard *shard, unsigned long long vsn, filter_snapshot *snap, bloom_filter_wrapper *filt) {
+    retired_list *r = malloc(sizeof(retired_list));
+    r->vsn = vsn;
+    r->snapshot = snap;
+    r->filter = filt;
+    r->hot = NULL;
+    r->filter_name = (filt) ? strdup(filter_wrapper_name(filt)) : NULL;
+    r->next = shard->retired;
+    shard->retired = r;
+
+    // Signal under the lock, so the wakeup cannot be lost
+    pthread_mutex_lock(&mgr->vacuum_lock);
+    pthread_cond_signal(&mgr->vacuum_cond);
+    pthread_mutex_unlock(&mgr->vacuum_lock);
+}
+
+/**
+ * Retires the hot states detached from a cold filter. Clients may
+ * still read them without the lock of the filter, such as for an
+ * info, so they are freed once the clients pass a new version.
+ * @arg mgr The manager
+ * @arg filter_name The name of the filter
+ * @arg hot The detached states
+ */
+static void retire_hot_state(bloom_filtmgr *mgr, char *filter_name, filter_hot_state *hot) {
+    uint64_t hash[2];
+    filtmgr_shard *shard = filter_shard(mgr, filter_name, hash);
+    pthread_mutex_lock(&shard->write_lock);
+    unsigned long long vsn = __atomic_add_fetch(&mgr->vsn, 1, __ATOMIC_SEQ_CST);
+    retire(mgr, shard, vsn, NULL, NULL);
+    shard->retired->hot = hot;
+    pthread_mutex_unlock(&shard->write_lock);
+}
 
-    LOCK_BLOOM_SPIN(&mgr->pending_lock);
-    mgr->pending_deletes = pending;
-    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
+/**
+ * Publishes a snapshot without a filter, and retires the filter
+ * to be deleted or closed. This must be invoked with the write lock.
+ * @arg mgr The manager
+ * @arg shard The shard of the filter
+ * @arg filt The filter to remove
+ */
+static void remove_filter(bloom_filtmgr *mgr, filtmgr_shard *shard, bloom_filter_wrapper *filt) {
+    char *filter_name = filter_wrapper_name(filt);
+    filter_snapshot *snap = copy_snapshot(shard);
+    art_delete(&snap->map, (unsigned char*)filter_name, strlen(filter_name)+1);
+    unsigned long long vsn = publish_snapshot(mgr, shard, snap);
+    retire(mgr, shard, vsn, NULL, filt);
 }
 
 /**
- * Clears the pending deletes
+ * Locks the shards of the filters of a batch, in the order of
+ * the shards so that batches cannot deadlock, and copies their
+ * snapshots to be changed.
+ * @arg filter_names The names of the filters
+ * @arg num The number of names
+ * @arg snaps Output, the copies indexed by shard, NULL for
+ * the shards without a filter of the batch
  */
-static void clear_pending_deletes(bloom_filtmgr *mgr) {
-    // Get a reference to the head
-    bloom_filter_list *pending = mgr->pending_deletes;
-    if (!pending) return;
+static void lock_batch_shards(bloom_filtmgr *mgr, char **filter_names, int num, filter_snapshot **snaps) {
+    uint64_t hash[2];
+    memset(snaps, 0, FILTMGR_SHARDS * sizeof(filter_snapshot*));
+    for (int i=0; i < num; i++) {
+        snaps[filter_shard(mgr, filter_names[i], hash) - mgr->shards] = (filter_snapshot*)1;
+    }
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        if (!snaps[i]) continue;
+        pthread_mutex_lock(&mgr->shards[i].write_lock);
+        snaps[i] = copy_snapshot(mgr->shards + i);
+    }
+}
 
-    // filter the pending list to NULL safely
-    LOCK_BLOOM_SPIN(&mgr->pending_lock);
-    mgr->pending_deletes = NULL;
-    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
+/**
+ * Publishes the snapshots of a batch under a single version, and
+ * retires the replaced ones. This must be invoked with the write
+ * locks from lock_batch_shards.
+ * @arg snaps The snapshots indexed by shard, NULL to leave a shard
+ * @return The new version we created
+ */
+static unsigned long long publish_batch(bloom_filtmgr *mgr, filter_snapshot **snaps) {
+    // Index the snapshots before any is published
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        if (snaps[i]) index_snapshot(snaps[i]);
+    }
 
-    // Free the nodes
-    bloom_filter_list *next;
-    while (pending) {
-        free(pending->filter_name);
-        next = pending->next;
-        free(pending);
-        pending = next;
+    // Publish the snapshots before the version, as publish_snapshot does
+    filter_snapshot *old[FILTMGR_SHARDS];
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        if (!snaps[i]) continue;
+        old[i] = mgr->shards[i].snapshot;
+        __atomic_store_n(&mgr->shards[i].snapshot, snaps[i], __ATOMIC_SEQ_CST);
+    }
+    unsigned long long vsn = __atomic_add_fetch(&mgr->vsn, 1, __ATOMIC_SEQ_CST);
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        if (!snaps[i]) continue;
+        snaps[i]->vsn = vsn;
+        retire(mgr, mgr->shards + i, vsn, old[i], NULL);
     }
+    return vsn;
 }
 
 /**
- * Swap the alternate / primary maps, filters the primary_vsn
- * This is always safe, since its just a pointer swap.
+ * Unlocks the shards locked by lock_batch_shards
+ * @arg snaps The snapshots indexed by shard
  */
-static void swap_filter_maps(bloom_filtmgr *mgr, unsigned long long primary_vsn) {
-    art_tree *tmp = mgr->filter_map;
-    mgr->filter_map = mgr->alt_filter_map;
-    mgr->alt_filter_map = tmp;
-    mgr->primary_vsn = primary_vsn;
+static void unlock_batch_shards(bloom_filtmgr *mgr, filter_snapshot **snaps) {
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        if (snaps[i]) pthread_mutex_unlock(&mgr->shards[i].write_lock);
+    }
 }
 
-/*
- * Scans a filter_list* until it finds an entry with a version
- * less than min_vsn. It NULLs the pointer to that version
- * and returns a pointer to that node.
- *
- * Safety: This is ONLY safe if the minimum client version
- * and the primary_vsn is strictly greater than the min_vsn argument.
- * This ensures access to older delta entries will not happen.
+/**
+ * Creates the filters of a batch, on one of several threads
  */
-static filter_list* remove_delta_versions(filter_list *init, filter_list **ref, unsigned long long min_vsn) {
-    filter_list *current = init;
-    filter_list **prev = ref;
-    while (current && current->vsn > min_vsn) {
-        prev = &current->next;
-        current = current->next;
+static void* create_thread_main(void *in) {
+    filter_creator *creator = in;
+    bloom_config *config;
+    int i;
+    while ((i = __atomic_fetch_add(&creator->next, 1, __ATOMIC_RELAXED)) < creator->num) {
+        if (creator->results[i]) continue;
+        config = creator->mgr->config;
+        if (creator->custom) {
+            config = malloc(sizeof(bloom_config));
+            memcpy(config, creator->custom, sizeof(bloom_config));
+        }
+        creator->filters[i] = new_filter(creator->mgr, creator->names[i], config, 1);
+        if (!creator->filters[i] && creator->custom) free(config);
     }
+    return NULL;
+}
 
-    // NULL out the reference pointer to current node if any
-    if (current) *prev = NULL;
-    return current;
+// Orders the names of a batch, repeats by their index
+static int batch_name_cmp(const void *a, const void *b) {
+    const batch_name *na = a, *nb = b;
+    int cmp = strcmp(na->name, nb->name);
+    return (cmp) ? cmp : na->index - nb->index;
 }
 
 /**
- * Deletes old versions from the delta lists, and calls
- * delete_filter on the filters in the destroyed list.
+ * Frees the garbage of a shard retired at or before a version, calling
+ * delete_filter on the removed filters. The filters are only
+ * unlinked once they are deleted, so that create cannot
+ * race with the delete.
  *
- * Safety: Same as remove_delta_versions
+ * Safety: This is ONLY safe if no client is at a version
+ * before min_vsn, and only one thread reclaims at a time.
+ * @arg shard The shard
+ * @arg min_vsn The minimum version of the clients
+ * @arg max The most entries to free, the oldest first. 0 for all.
+ * @return 1 if there is more garbage to free at min_vsn, else 0.
  */
-static void delete_old_versions(bloom_filtmgr *mgr, unsigned long long min_vsn) {
-    // Get the merged in pending ops, lock to avoid a race
-    pthread_mutex_lock(&mgr->write_lock);
-    filter_list *old = remove_delta_versions(mgr->delta, &mgr->delta, min_vsn);
-    pthread_mutex_unlock(&mgr->write_lock);
+static int reclaim_retired(filtmgr_shard *shard, unsigned long long min_vsn, int max) {
+    // Find the old garbage, newer entries are only pushed at the head
+    pthread_mutex_lock(&shard->write_lock);
+    retired_list *old = shard->retired;
+    while (old && old->vsn > min_vsn) old = old->next;
+    pthread_mutex_unlock(&shard->write_lock);
+    if (!old) return 0;
+
+    // Bound the batch to the oldest entries
+    int more = 0;
+    if (max) {
+        int num = 0;
+        for (retired_list *r=old; r; r=r->next) num++;
+        for (; num > max; num--) {
+            old = old->next;
+            more = 1;
+        }
+    }
 
-    // Delete the filters now that we have merged into both trees
-    filter_list *next, *current = old;
-    while (current) {
-        if (current->type == DELETE) delete_filter(current->filter);
-        next = current->next;
-        free(current);
-        current = next;
+    // Free the garbage, the old entries do not change
+    for (retired_list *r=old; r; r=r->next) {
+        if (r->snapshot) destroy_snapshot(r->snapshot);
+        if (r->filter) delete_filter(r->filter);
+        if (r->hot) bloomf_free_hot(r->hot);
+    }
+
+    // Unlink the old entries
+    pthread_mutex_lock(&shard->write_lock);
+    retired_list **prev = &shard->retired;
+    while (*prev != old) prev = &(*prev)->next;
+    *prev = NULL;
+    pthread_mutex_unlock(&shard->write_lock);
+
+    // Free the entries
+    retired_list *next;
+    while (old) {
+        next = old->next;
+        free(old->filter_name);
+        free(old);
+        old = next;
     }
+    return more;
 }
 
 /**
@@ -1014,135 +3500,432 @@ static void delete_old_versions(bloom_filtmgr *mgr, unsigned long long min_vsn)
  */
 static unsigned long long client_min_vsn(bloom_filtmgr *mgr) {
     // Determine the minimum version
-    unsigned long long thread_vsn, min_vsn = mgr->vsn;
-    for (filtmgr_client *cl=mgr->clients; cl != NULL; cl=cl->next) {
-        thread_vsn = cl->vsn;
-        if (thread_vsn < min_vsn) min_vsn = thread_vsn;
+    unsigned long long thread_vsn, min_vsn = __atomic_load_n(&mgr->vsn, __ATOMIC_SEQ_CST);
+    filtmgr_client_block *block = __atomic_load_n(&mgr->clients, __ATOMIC_SEQ_CST);
+    filtmgr_client *cl;
+    for (; block != NULL; block=block->next) {
+        for (int i=0; i < CLIENT_BLOCK_SLOTS; i++) {
+            cl = block->slots + i;
+            if (!__atomic_load_n(&cl->active, __ATOMIC_SEQ_CST)) continue;
+            thread_vsn = __atomic_load_n(&cl->vsn, __ATOMIC_SEQ_CST);
+            if (thread_vsn < min_vsn) min_vsn = thread_vsn;
+        }
     }
     return min_vsn;
 }
 
 /**
- * Creates a barrier that is implicit by adding a
- * new version, and waiting for all clients to reach
- * that version. This can be used as a non-locking
- * syncronization mechanism.
+ * Checks if any shard has retired garbage
+ */
+static int has_garbage(bloom_filtmgr *mgr) {
+    for (int i=0; i < FILTMGR_SHARDS; i++) {
+        if (__atomic_load_n(&mgr->shards[i].retired, __ATOMIC_SEQ_CST)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Waits up to VACUUM_POLL_USEC for a client to checkpoint
+ * past the given version, or until stopped
  */
-static void version_barrier(bloom_filtmgr *mgr) {
-    // Create a new delta
-    pthread_mutex_lock(&mgr->write_lock);
-    unsigned long long vsn = create_delta_update(mgr, BARRIER, NULL);
-    pthread_mutex_unlock(&mgr->write_lock);
+static void wait_for_clients(bloom_filtmgr *mgr, unsigned long long min_vsn) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += VACUUM_POLL_USEC / 1000000;
+    deadline.tv_nsec += (VACUUM_POLL_USEC % 1000000) * 1000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
 
-    // Wait until we converge on the version
-    while (mgr->should_run && client_min_vsn(mgr) < vsn)
-        usleep(VACUUM_POLL_USEC);
+    // A version of 0 is never waited on, since no garbage has it
+    pthread_mutex_lock(&mgr->vacuum_lock);
+    __atomic_store_n(&mgr->vacuum_waiting, min_vsn ? min_vsn : 1, __ATOMIC_SEQ_CST);
+    int res = 0;
+    while (res != ETIMEDOUT && mgr->should_run &&
+            __atomic_load_n(&mgr->vacuum_waiting, __ATOMIC_SEQ_CST))
+        res = pthread_cond_timedwait(&mgr->vacuum_cond, &mgr->vacuum_lock, &deadline);
+    __atomic_store_n(&mgr->vacuum_waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&mgr->vacuum_lock);
 }
 
 /**
  * This thread is started after initialization to maintain
  * the state of the filter manager. It's current use is to
- * cleanup the garbage created by our MVCC model. We do this
+ * cleanup the garbage created by our RCU model. We do this
  * by making use of periodic 'checkpoints'. Our worker threads
  * report the version they are currently using, and we are always
- * able to delete versions that are strictly less than the minimum.
+ * able to free garbage retired at or before the minimum.
  */
 static void* filtmgr_thread_main(void *in) {
     // Extract our arguments
     bloom_filtmgr *mgr = in;
-    unsigned long long min_vsn, mgr_vsn;
+    unsigned long long min_vsn;
+    int more;
     while (mgr->should_run) {
-        // Do nothing if there is no changes
-        if (mgr->vsn == mgr->primary_vsn) {
-            usleep(VACUUM_POLL_USEC);
-            continue;
-        }
-
-        /*
-         * Because we use a version barrier, we always
-         * end up creating a new version when we try to
-         * apply delta updates. We need to handle the special case
-         * where we are 1 version behind and the only delta is
-         * a barrier. Do this by just updating primary_vsn.
-         */
-        mgr_vsn = mgr->vsn;
-        if ((mgr_vsn - mgr->primary_vsn) == 1) {
-            pthread_mutex_lock(&mgr->write_lock);
-
-            // Ensure no version created in the mean time
-            int should_continue = 0;
-            if (mgr_vsn == mgr->vsn && mgr->delta->type == BARRIER) {
-                mgr->primary_vsn = mgr_vsn;
-                should_continue = 1;
-            }
-
-            // Release the lock and see if we should loop back
-            pthread_mutex_unlock(&mgr->write_lock);
-            if (should_continue) {
-                syslog(LOG_INFO, "All updates applied. (vsn: %llu)", mgr_vsn);
-                continue;
-            }
-        }
+        // Sleep until there is garbage, retire signals us
+        pthread_mutex_lock(&mgr->vacuum_lock);
+        while (mgr->should_run && !has_garbage(mgr))
+            pthread_cond_wait(&mgr->vacuum_cond, &mgr->vacuum_lock);
+        pthread_mutex_unlock(&mgr->vacuum_lock);
+        if (!mgr->should_run) break;
 
         // Determine the minimum version
         min_vsn = client_min_vsn(mgr);
 
-        // Warn if there are a lot of outstanding deltas
+        // Warn if there are a lot of outstanding versions
         if (mgr->vsn - min_vsn > WARN_THRESHOLD) {
-            syslog(LOG_WARNING, "Many delta versions detected! min: %llu (vsn: %llu)",
+            syslog(LOG_WARNING, "Many retired versions detected! min: %llu (vsn: %llu)",
                     min_vsn, mgr->vsn);
         } else {
-            syslog(LOG_DEBUG, "Applying delta update up to: %llu (vsn: %llu)",
+            syslog(LOG_DEBUG, "Reclaiming versions up to: %llu (vsn: %llu)",
                     min_vsn, mgr->vsn);
         }
 
-        // Merge the old versions into the alternate three
-        merge_old_versions(mgr, mgr->delta, min_vsn);
+        // Free a batch of what no client can reach in each shard
+        more = 0;
+        for (int i=0; i < FILTMGR_SHARDS; i++)
+            more |= reclaim_retired(mgr->shards + i, min_vsn, VACUUM_BATCH);
 
-        /*
-         * Mark any pending deletes so that create does not allow
-         * a filter to be created before we manage to call delete_old_versions.
-         * There is an unforunate race that can happen if a client
-         * does a create/drop/create cycle, where the create/drop are
-         * reflected in the filter_map, and thus the second create is allowed
-         * BEFORE we have had a chance to actually handle the delete.
-         */
-        mark_pending_deletes(mgr, min_vsn);
-
-        // Swap the maps
-        swap_filter_maps(mgr, min_vsn);
-
-        // Wait on a barrier until nobody is using the old tree
-        version_barrier(mgr);
+        // Wait while the rest waits on clients to checkpoint, the
+        // first checkpoint past the minimum version wakes us
+        if (!more) wait_for_clients(mgr, min_vsn);
+    }
+    return NULL;
+}
 
-        // Merge the changes into the other tree now that its safe
-        merge_old_versions(mgr, mgr->delta, min_vsn);
 
-        // Both trees have the changes incorporated, safe to delete
-        delete_old_versions(mgr, min_vsn);
+/**
+ * The fault threads fault in the filters queued by
+ * filtmgr_fault_filter_async. Each fault takes the read
+ * lock of the filter like the other operations do, so it
+ * cannot race an unmap. A thread is only a client of the
+ * manager while it faults, so idle threads never hold
+ * back the vacuum.
+ */
+static void* fault_thread_main(void *in) {
+    bloom_filtmgr *mgr = in;
+    fault_request *req;
+    bloom_filter_wrapper *filt;
+    int res;
+    while (1) {
+        // Wait for a fault, the queue is drained before stopping
+        pthread_mutex_lock(&mgr->fault_lock);
+        while (mgr->faults_run && !mgr->faults)
+            pthread_cond_wait(&mgr->fault_cond, &mgr->fault_lock);
+        req = mgr->faults;
+        if (req) {
+            mgr->faults = req->next;
+            if (!mgr->faults) mgr->faults_tail = NULL;
+        }
+        pthread_mutex_unlock(&mgr->fault_lock);
+        if (!req) break;
 
-        // Clear the pending delete list, since delete_old_versions() will
-        // block untill all deletes are completed.
-        clear_pending_deletes(mgr);
+        // Fault in the filter, if it still exists
+        filtmgr_client_checkpoint(mgr);
+        res = -1;
+        filt = take_filter(mgr, req->filter_name);
+        if (filt) {
+            void *slot = brlock_rdlock(&filt->lock);
+            res = bloomf_fault(filt->filter);
+            brlock_rdunlock(&filt->lock, slot);
+        }
+        filtmgr_client_leave(mgr);
 
-        // Log that we finished
-        syslog(LOG_INFO, "Finished delta updates up to: %llu (vsn: %llu)",
-                min_vsn, mgr->vsn);
+        req->cb(req->data, res);
+        free(req->filter_name);
+        free(req);
     }
     return NULL;
 }
 
 
+/**
+ * Returns the number of versions published since the oldest
+ * version a client may still use. These versions hold garbage
+ * that cannot be vacuumed yet.
+ * @arg mgr The manager
+ * @return The version backlog.
+ */
+unsigned long long filtmgr_version_backlog(bloom_filtmgr *mgr) {
+    unsigned long long min_vsn = client_min_vsn(mgr);
+    return __atomic_load_n(&mgr->vsn, __ATOMIC_SEQ_CST) - min_vsn;
+}
+
+
 /**
  * This method is used to force a vacuum up to the current
  * version. It is generally unsafe to use in bloomd,
  * but can be used in an embeded or test environment.
  */
 void filtmgr_vacuum(bloom_filtmgr *mgr) {
-    unsigned long long vsn = mgr->vsn;
-    merge_old_versions(mgr, mgr->delta, vsn);
-    swap_filter_maps(mgr, vsn);
-    merge_old_versions(mgr, mgr->delta, vsn);
-    delete_old_versions(mgr, vsn);
+    for (int i=0; i < FILTMGR_SHARDS; i++)
+        reclaim_retired(mgr->shards + i, mgr->vsn, 0);
+}
+
+
+
+/**
+ * Finds the slice group of a prefix, with the slice lock held.
+ * @return The group, or NULL if the prefix is not sliced.
+ */
+static slice_group* find_slice_group(bloom_filtmgr *mgr, char *prefix) {
+    for (slice_group *group=mgr->slices; group; group=group->next) {
+        if (!strcmp(group->prefix, prefix)) return group;
+    }
+    return NULL;
+}
+
+/**
+ * Stales the slice groups a filter may be a member of, once it
+ * is created, dropped or frozen. A prefix that is dropped whole
+ * also stales the groups of the longer prefixes under it.
+ * @arg name The name of the filter, or a dropped prefix
+ */
+static void stale_slices(bloom_filtmgr *mgr, char *name) {
+    if (!__atomic_load_n(&mgr->slices, __ATOMIC_ACQUIRE)) return;
+    size_t name_len = strlen(name), len;
+    int staled = 0;
+    pthread_rwlock_rdlock(&mgr->slice_lock);
+    for (slice_group *group=mgr->slices; group; group=group->next) {
+        len = strlen(group->prefix);
+        if (len > name_len) len = name_len;
+        if (strncmp(group->prefix, name, len)) continue;
+        __atomic_store_n(&group->stale, 1, __ATOMIC_RELEASE);
+        staled = 1;
+    }
+    if (staled) __atomic_add_fetch(&mgr->slice_changes, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&mgr->slice_lock);
+}
+
+/**
+ * Slices the members of a group again, outside the slice lock,
+ * and swaps in the new slices unless the group was dropped
+ * meanwhile. A change while the group is built stales it again.
+ * @arg force Slices the group even if it is no longer stale
+ * @return 0 on success, -1 if there is no group, -2 on failure.
+ */
+static int rebuild_slice_group(bloom_filtmgr *mgr, char *prefix, int force) {
+    pthread_mutex_lock(&mgr->slice_build_lock);
+
+    // Another check may have sliced the group while this one waited
+    if (!force) {
+        pthread_rwlock_rdlock(&mgr->slice_lock);
+        slice_group *group = find_slice_group(mgr, prefix);
+        int fresh = group && !group->stale;
+        pthread_rwlock_unlock(&mgr->slice_lock);
+        if (fresh) {
+            pthread_mutex_unlock(&mgr->slice_build_lock);
+            return 0;
+        }
+    }
+
+    slice_group build;
+    memset(&build, 0, sizeof(build));
+    build.prefix = prefix;
+    uint64_t changes = __atomic_load_n(&mgr->slice_changes, __ATOMIC_ACQUIRE);
+    int res = build_slice_group(mgr, &build);
+    if (!res) {
+        syslog(LOG_INFO, "Sliced %d of %d filters under %s into %llu bytes.",
+                build.num_members - build.num_direct, build.num_members, prefix,
+                (unsigned long long)build.bytes);
+    }
+
+    // Swap the slices, the old ones are freed outside the lock
+    pthread_rwlock_wrlock(&mgr->slice_lock);
+    slice_group *group = find_slice_group(mgr, prefix);
+    if (!group) res = -1;
+    if (!res) {
+        slice_group old = *group;
+        group->num_members = build.num_members;
+        group->members = build.members;
+        group->num_direct = build.num_direct;
+        group->direct = build.direct;
+        group->geometries = build.geometries;
+        group->bytes = build.bytes;
+        group->stale = (__atomic_load_n(&mgr->slice_changes, __ATOMIC_ACQUIRE) != changes);
+        build = old;
+    }
+    pthread_rwlock_unlock(&mgr->slice_lock);
+    pthread_mutex_unlock(&mgr->slice_build_lock);
+
+    clear_slice_group(&build);
+    return res;
+}
+
+/**
+ * Builds the slices of the filters under the prefix of a group.
+ * The frozen filters are visited twice, first to count the
+ * layers of each geometry, then to add them to the slices.
+ * @return 0 on success, -2 on failure.
+ */
+static int build_slice_group(bloom_filtmgr *mgr, slice_group *group) {
+    bloom_filter_list_head *head;
+    filtmgr_list_filters(mgr, group->prefix, &head);
+    int num = head->size;
+    group->members = calloc(num + 1, sizeof(char*));
+    for (bloom_filter_list *node=head->head; node; node=node->next) {
+        group->members[group->num_members++] = node->filter_name;
+        node->filter_name = NULL;
+    }
+    filtmgr_cleanup_list(head);
+
+    // Count the layers of each geometry of the frozen members
+    slice_builder *builders = calloc(num + 1, sizeof(slice_builder));
+    bloom_filter_wrapper **filters = calloc(num + 1, sizeof(bloom_filter_wrapper*));
+    slice_builder *b;
+    int res = 0;
+    for (int i=0; i < num && !res; i++) {
+        b = builders + i;
+        b->group = group;
+        b->member = i;
+        filters[i] = take_filter(mgr, group->members[i]);
+        if (!filters[i] || !__atomic_load_n(&filters[i]->filter->filter_config.frozen, __ATOMIC_ACQUIRE))
+            continue;
+        b->sliceable = 1;
+        int err = bloomf_visit_maps(filters[i]->filter, slice_layer_cb, b);
+        if (err == -2) {
+            b->sliceable = 0;
+        } else if (err) {
+            res = -2;
+        }
+    }
+
+    // The members with a layer of a rare geometry are checked
+    // directly, which may make another geometry rare in turn
+    int changed = 1;
+    while (changed && !res) {
+        changed = 0;
+        for (int i=0; i < num; i++) {
+            b = builders + i;
+            int rare = !b->sliceable;
+            for (int l=0; l < b->num_geoms && !rare; l++) {
+                rare = b->geoms[l]->num_layers < SLICE_MIN_LAYERS;
+            }
+            if (!rare || !b->num_geoms) continue;
+            for (int l=0; l < b->num_geoms; l++) b->geoms[l]->num_layers--;
+            b->num_geoms = 0;
+            b->sliceable = 0;
+            changed = 1;
+        }
+    }
+
+    // Drop the unused geometries, and allocate the slices of the rest
+    slice_geometry *geom, **prev = &group->geometries;
+    while (!res && (geom = *prev)) {
+        if (!geom->num_layers) {
+            *prev = geom->next;
+            free(geom);
+            continue;
+        }
+        geom->slices = calloc((geom->num_layers + BLOOM_SLICE_MAX - 1) / BLOOM_SLICE_MAX, sizeof(bloom_slice));
+        geom->columns = malloc(geom->num_layers * sizeof(int));
+        prev = &geom->next;
+    }
+
+    // Add the layers of the sliced members, check the rest directly
+    group->direct = malloc((num + 1) * sizeof(int));
+    for (int i=0; i < num && !res; i++) {
+        b = builders + i;
+        if (!b->sliceable) {
+            group->direct[group->num_direct++] = i;
+            continue;
+        }
+        b->adding = 1;
+        if (bloomf_visit_maps(filters[i]->filter, slice_layer_cb, b)) res = -2;
+    }
+
+    for (int i=0; i < num; i++) free(builders[i].geoms);
+    free(builders);
+    free(filters);
+    if (res) clear_slice_group(group);
+    return res;
+}
+
+/**
+ * Invoked by bloomf_visit_maps for each layer of a member of
+ * a slice group. Counts the layer in its geometry, or adds it
+ * to a slice on the second pass. Empty layers are skipped.
+ * @return 0 to continue, 1 if the member cannot be sliced,
+ * -1 on failure.
+ */
+static int slice_layer_cb(void *data, int num, bloom_bitmap *map) {
+    (void)num;
+    slice_builder *b = data;
+    slice_group *group = b->group;
+
+    // Only reads the header of the layer, which has the k_num
+    bloom_bloomfilter layer;
+    if (bf_from_bitmap(map, 1, 0, &layer) || layer.layout != LAYOUT_PARTITIONED ||
+            layer.header->hash_family == HASH_CLIENT || layer.header->k_num > ENGINE_MAX_HASHES) {
+        b->sliceable = 0;
+        return 1;
+    }
+    if (!bf_size(&layer)) return 0;
+
+    slice_geometry *geom = group->geometries;
+    while (geom && !bf_slice_matches(&geom->shape, &layer)) geom = geom->next;
+    if (b->adding) {
+        // A frozen member has the layers it had on the first pass
+        if (!geom || geom->added == geom->num_layers) return -1;
+        int idx = geom->added / BLOOM_SLICE_MAX;
+        bloom_slice *slice = geom->slices + idx;
+        if (!slice->words) {
+            int left = geom->num_layers - idx * BLOOM_SLICE_MAX;
+            if (bf_slice_init(&layer, (left < BLOOM_SLICE_MAX) ? left : BLOOM_SLICE_MAX, slice)) return -1;
+            group->bytes += bf_slice_bytes(slice);
+        }
+        if (bf_slice_add(slice, &layer) < 0) return -1;
+        geom->columns[geom->added++] = b->member;
+        return 0;
+    }
+
+    if (!geom) {
+        geom = calloc(1, sizeof(slice_geometry));
+        geom->shape.k_num = layer.header->k_num;
+        geom->shape.offset = layer.offset;
+        geom->shape.index_mode = layer.index_mode;
+        geom->shape.hash_family = layer.header->hash_family;
+        geom->next = group->geometries;
+        group->geometries = geom;
+    }
+    geom->num_layers++;
+    b->geoms = realloc(b->geoms, (b->num_geoms + 1) * sizeof(slice_geometry*));
+    b->geoms[b->num_geoms++] = geom;
+    return 0;
+}
+
+/**
+ * Frees the members and slices of a group, but not its prefix.
+ */
+static void clear_slice_group(slice_group *group) {
+    for (int i=0; i < group->num_members; i++) free(group->members[i]);
+    free(group->members);
+    free(group->direct);
+    slice_geometry *next, *geom = group->geometries;
+    while (geom) {
+        next = geom->next;
+        for (int i=0; geom->slices && i * BLOOM_SLICE_MAX < geom->num_layers; i++) {
+            bf_slice_destroy(geom->slices + i);
+        }
+        free(geom->slices);
+        free(geom->columns);
+        free(geom);
+        geom = next;
+    }
+    group->num_members = 0;
+    group->members = NULL;
+    group->num_direct = 0;
+    group->direct = NULL;
+    group->geometries = NULL;
+    group->bytes = 0;
 }
 
+/**
+ * Frees a slice group.
+ */
+static void free_slice_group(slice_group *group) {
+    clear_slice_group(group);
+    free(group->prefix);
+    free(group);
+}
@@ -23,6 +23,24 @@ typedef struct {
    bloom_filter_list *tail;
 } bloom_filter_list_head;
 
+/**
+ * The longest filter name kept by a filter cache
+ */
+#define FILTMGR_CACHE_NAME 200
+
+/**
+ * Caches the filter last used by a client, such as a connection,
+ * so that repeated commands on one filter skip the lookup. The
+ * cached filter is only used while no filter has been created or
+ * dropped since it was found. The name of the last filter used is
+ * always kept, so it can be looked up again. Zero initialize before use.
+ */
+typedef struct {
+    unsigned long long vsn;         // Manager version the filter was found at
+    void *filter;                   // The cached filter, NULL if none
+    char name[FILTMGR_CACHE_NAME + 1];  // Name of the cached filter
+} bloom_filtmgr_cache;
+
 /**
  * Initializer
  * @arg config The configuration
@@ -65,6 +83,91 @@ void filtmgr_client_leave(bloom_filtmgr *mgr);
  */
 int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Starts an asynchronous flush of the filter with the given name.
+ * The flusher must be drained before the next client checkpoint,
+ * since the filter may be deleted after it.
+ * @arg filter_name The name of the filter to flush
+ * @arg flusher The flusher to use
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_flush_filter_async(bloom_filtmgr *mgr, char *filter_name, bloom_flusher *flusher);
+
+/**
+ * Prepares the filter with the given name to grow, if
+ * it is mapped in and nearly full. This does not block
+ * the adds and checks of the filter.
+ * @arg filter_name The name of the filter to prepare
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_prepare_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Rotates the generations of the filter with the given
+ * name, if it is windowed and a period has passed. Filters
+ * that are not mapped in are skipped, they catch up once
+ * they are mapped in again.
+ * @arg filter_name The name of the filter to rotate
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_rotate_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Reorders the probes of the checks of the filter with the
+ * given name by the hits of its data files, if the order
+ * changed. Filters that are not mapped in are skipped.
+ * @arg filter_name The name of the filter to reorder
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_reorder_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Checks if the keys of a filter are client hashes.
+ * @arg cache Optional, can be NULL. Caches the filter between calls.
+ * @arg filter_name The name of the filter
+ * @return 1 if the filter is hashed, 0 if not, -1 if the
+ * filter does not exist.
+ */
+int filtmgr_filter_hashed(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name);
+
+/**
+ * Copies the number of checks found in each data
+ * file of the filter with the given name.
+ * @arg filter_name The name of the filter
+ * @arg hits Output array
+ * @arg max The size of the output array
+ * @return The number of hits copied. -1 if the filter does not exist.
+ */
+int filtmgr_layer_hits(bloom_filtmgr *mgr, char *filter_name, uint64_t *hits, int max);
+
+/**
+ * Counts the bytes of the filter with the given name that
+ * are resident in memory, and that are dirty.
+ * @arg filter_name The name of the filter
+ * @arg resident Output, the resident bytes
+ * @arg dirty Output, the bytes the next flush writes
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_memory_bytes(bloom_filtmgr *mgr, char *filter_name, uint64_t *resident, uint64_t *dirty);
+
+/**
+ * Compacts the filter with the given name, merging
+ * its data files where possible. Filters that are not
+ * mapped in are skipped.
+ * @arg filter_name The name of the filter to compact
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_compact_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Moves the older layers of a filter to the page cache,
+ * when tiered_layers is set. Filters that are not mapped
+ * in are skipped.
+ * @arg filter_name The name of the filter to seal
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_seal_filter(bloom_filtmgr *mgr, char *filter_name);
+
 /**
  * Checks for the presence of keys in a given filter
  * @arg filter_name The name of the filter containing the keys
@@ -73,10 +176,144 @@ int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name);
  * @arg result Ouput array, stores a 0 if the key does not exist
  * or 1 if the key does exist.
  * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * -2 on internal error. -6 if the filter is hashed and a key
+ * is not a client hash.
  */
 int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result);
 
+/**
+ * Checks for the presence of keys of given lengths in a given filter.
+ * The keys need not be NUL terminated, so they are hashed in place.
+ * @arg key_lens The lengths of the keys, or NULL if the keys are
+ * NUL terminated. Otherwise the same as filtmgr_check_keys.
+ * @arg cache Optional, can be NULL. Caches the filter between calls.
+ */
+int filtmgr_check_keys_len(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name,
+        char **keys, uint64_t *key_lens, int num_keys, char *result);
+
+/**
+ * Checks for the presence of a key in several filters. The key
+ * is hashed once, and the hashes are shared by the filters that
+ * use the same hash family.
+ * @arg filter_names The names of the filters
+ * @arg num_filters The number of filters
+ * @arg key The key to check, need not be NUL terminated
+ * @arg len The length of the key
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * in a filter or 1 if it does.
+ * @return 0 on success, -1 if a filter does not exist.
+ * -2 on internal error.
+ */
+int filtmgr_check_filters(bloom_filtmgr *mgr, char **filter_names, int num_filters,
+        const char *key, uint64_t len, char *result);
+
+/**
+ * Slices the filters under a prefix into a bit-sliced group,
+ * so that a key is checked in all of them a word at a time.
+ * The layers of the frozen filters are copied into the slices,
+ * the other filters are checked directly. Creating, dropping or
+ * freezing a filter under the prefix slices it again on the
+ * next check. Slicing a prefix again slices it now. The groups
+ * are kept in memory only.
+ * @arg prefix The prefix of the names of the filters
+ * @return 0 on success, -2 on internal error.
+ */
+int filtmgr_slice_filters(bloom_filtmgr *mgr, char *prefix);
+
+/**
+ * Drops the bit-sliced group of a prefix.
+ * @arg prefix The prefix of the group
+ * @return 0 on success, -1 if the prefix is not sliced.
+ */
+int filtmgr_unslice_filters(bloom_filtmgr *mgr, char *prefix);
+
+/**
+ * Checks for the presence of a key in the filters of a
+ * bit-sliced group, see filtmgr_slice_filters.
+ * @arg prefix The prefix of the group
+ * @arg key The key to check, need not be NUL terminated
+ * @arg len The length of the key
+ * @arg head Output, set to the list of the filters that contain
+ * the key, in order of name. Freed with filtmgr_cleanup_list.
+ * @return 0 on success, -1 if the prefix is not sliced.
+ * -2 on internal error.
+ */
+int filtmgr_scheck_filters(bloom_filtmgr *mgr, char *prefix, const char *key, uint64_t len,
+        bloom_filter_list_head **head);
+
+/**
+ * Merges, or intersects, the keys of several filters into
+ * another, in place. The filters must use the same engine,
+ * with data that lines up. Sources are combined in order, so
+ * an error can leave the earlier sources combined.
+ * @arg dest_name The name of the filter to change
+ * @arg src_names The names of the filters to read
+ * @arg num_srcs The number of sources
+ * @arg intersect Intersect the keys instead of merging them
+ * @return 0 on success, -1 if a filter does not exist.
+ * -2 on internal error. -3 if the filters do not line up.
+ * -5 if the filter to change is frozen.
+ */
+int filtmgr_combine_filters(bloom_filtmgr *mgr, char *dest_name, char **src_names,
+        int num_srcs, int intersect);
+
+/**
+ * Estimates the number of distinct keys in a filter from
+ * the bits that are set. Unlike the size of the filter,
+ * this stays meaningful after combining filters.
+ * @arg filter_name The name of the filter
+ * @arg estimate Output, the estimated number of keys
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error.
+ */
+int filtmgr_estimate_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t *estimate);
+
+/**
+ * Exports the pages of a filter changed since an epoch to
+ * a delta in the folder of the filter.
+ * @arg filter_name The name of the filter
+ * @arg since The epoch of an earlier delta, or 0 for a full delta
+ * @arg epoch Output, the epoch of the delta
+ * @arg path Output, the path of the delta. Must be free'd.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error.
+ */
+int filtmgr_export_delta(bloom_filtmgr *mgr, char *filter_name, uint64_t since, uint64_t *epoch, char **path);
+
+/**
+ * Clears all the keys of a filter in place. The filter stays
+ * open, and goes back to its initial size.
+ * @arg filter_name The name of the filter to reset
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 on internal error. -5 if the filter is frozen.
+ */
+int filtmgr_reset_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Freezes a filter, so that it no longer changes. A frozen
+ * filter is mapped read only from the page cache, and is
+ * checked without taking its lock. It stays mapped in, and
+ * is not unmapped when cold or evicted.
+ * @arg filter_name The name of the filter to freeze
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -3 if the filter cannot be frozen.
+ */
+int filtmgr_freeze_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Shrinks a filter, folding its layers whose keys are far below
+ * their capacity into smaller ones. The keys are all kept, at
+ * a higher false positive probability. Runs under the write lock,
+ * since the layers are replaced.
+ * @arg filter_name The name of the filter to shrink
+ * @arg fp_probability The probability the filter must stay within,
+ * or 0 for the probability of the filter
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -3 if the filter cannot be shrunk.
+ * -5 if the filter is frozen.
+ */
+int filtmgr_shrink_filter(bloom_filtmgr *mgr, char *filter_name, double fp_probability);
+
 /**
  * Sets keys in a given filter
  * @arg filter_name The name of the filter
@@ -85,10 +322,46 @@ int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int n
  * @arg result Ouput array, stores a 0 if the key already is set
  * or 1 if the key is set.
  * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * -2 on internal error. -4 if the filter is full and rejects sets.
+ * -5 if the filter is frozen. -6 if the filter is hashed and
+ * a key is not a client hash.
  */
 int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result);
 
+/**
+ * Sets keys of given lengths in a given filter.
+ * The keys need not be NUL terminated, so they are hashed in place.
+ * @arg key_lens The lengths of the keys, or NULL if the keys are
+ * NUL terminated. Otherwise the same as filtmgr_set_keys.
+ * @arg cache Optional, can be NULL. Caches the filter between calls.
+ */
+int filtmgr_set_keys_len(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name,
+        char **keys, uint64_t *key_lens, int num_keys, char *result);
+
+/**
+ * Unsets keys in a given counting or cuckoo filter
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to remove
+ * @arg num_keys The number of keys to remove
+ * @arg result Ouput array, stores a 0 if the key was not set
+ * or 1 if the key is unset.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -3 if the filter does not support unset.
+ * -5 if the filter is frozen. -6 if the filter is hashed and
+ * a key is not a client hash.
+ */
+int filtmgr_unset_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result);
+
+/**
+ * Unsets keys of given lengths in a given counting or cuckoo filter.
+ * The keys need not be NUL terminated, so they are hashed in place.
+ * @arg key_lens The lengths of the keys, or NULL if the keys are
+ * NUL terminated. Otherwise the same as filtmgr_unset_keys.
+ * @arg cache Optional, can be NULL. Caches the filter between calls.
+ */
+int filtmgr_unset_keys_len(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name,
+        char **keys, uint64_t *key_lens, int num_keys, char *result);
+
 /**
  * Creates a new filter of the given name and parameters.
  * @arg filter_name The name of the filter
@@ -98,6 +371,30 @@ int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num
  */
 int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *custom_config);
 
+/**
+ * Sizes a new filter after an earlier filter of its lineage,
+ * such as the filter of the day before, so that it holds the
+ * keys of that filter in its initial layer. The initial capacity
+ * is only ever raised, to the size of the earlier filter plus
+ * a margin for growth.
+ * @arg filter_name The name of the earlier filter
+ * @arg config The config of the new filter, updated in place
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_size_like(bloom_filtmgr *mgr, char *filter_name, bloom_config *config);
+
+/**
+ * Creates a new filter from a full delta, such as the one sent by
+ * a dump. The layers of the delta become the data files of the
+ * filter, which takes the default parameters.
+ * @arg filter_name The name of the filter
+ * @arg path The path of the delta
+ * @return 0 on success, -1 if the filter already exists.
+ * -2 for internal error, -3 if a delete is pending, -4 if
+ * the delta is not full or is corrupt.
+ */
+int filtmgr_restore_filter(bloom_filtmgr *mgr, char *filter_name, char *path);
+
 /**
  * Deletes the filter entirely. This removes it from the filter
  * manager and deletes it from disk. This is a permanent operation.
@@ -106,20 +403,86 @@ int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *c
  */
 int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Creates many filters of the same parameters as a single change.
+ * The filters of each shard are added to one snapshot, and the
+ * shards are published under one version, so a batch costs a
+ * single version to vacuum instead of one per filter. The filters
+ * are created on several threads.
+ * @arg filter_names The names of the filters
+ * @arg num The number of names
+ * @arg custom_config Optional, can be null. Configs that override
+ * the defaults. Each filter takes a copy, it is not kept.
+ * @arg results Output, the result of each name, as filtmgr_create_filter
+ * returns. A name repeated in the batch already exists.
+ * @return The number of filters created.
+ */
+int filtmgr_create_filters(bloom_filtmgr *mgr, char **filter_names, int num,
+        bloom_config *custom_config, int *results);
+
+/**
+ * Deletes many filters as a single change, see filtmgr_create_filters.
+ * The vacuum thread deletes their folders once no client can reach them.
+ * @arg filter_names The names of the filters
+ * @arg num The number of names
+ * @arg results Output, 0 if the filter was dropped, -1 if it does not exist.
+ * @return The number of filters dropped.
+ */
+int filtmgr_drop_filters(bloom_filtmgr *mgr, char **filter_names, int num, int *results);
+
+/**
+ * Deletes the filters whose names start with a prefix as a single
+ * change. Filters created while it runs may be kept.
+ * @arg prefix The prefix of the names
+ * @return The number of filters dropped.
+ */
+int filtmgr_drop_prefix(bloom_filtmgr *mgr, char *prefix);
+
 /**
  * Unmaps the filter from memory, but leaves it
  * registered in the filter manager. This is rarely invoked
  * by a client, as it can be handled automatically by bloomd,
  * but particular clients with specific needs may use it as an
- * optimization.
+ * optimization. In-memory and frozen filters stay mapped.
  * @arg filter_name The name of the filter to delete
  * @return 0 on success, -1 if the filter does not exist.
  */
 int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Invoked on a fault thread once a fault completes.
+ * The result is 0 if the filter was faulted in.
+ */
+typedef void(*fault_cb)(void *data, int res);
+
+/**
+ * Starts an asynchronous fault of the filter with the given name,
+ * if it is proxied. The filter is faulted in on one of the fault
+ * threads, so the caller is not blocked reading its data files.
+ * @arg cache The filter cache of the client, or NULL
+ * @arg filter_name The name of the filter to fault in
+ * @arg cb Invoked on the fault thread once the fault completes
+ * @arg data Opaque handle passed to the callback
+ * @return 0 if the fault was started, 1 if the filter is in memory
+ * or there are no fault threads, -1 if the filter does not exist.
+ */
+int filtmgr_fault_filter_async(bloom_filtmgr *mgr, bloom_filtmgr_cache *cache, char *filter_name, fault_cb cb, void *data);
+
+/**
+ * Warms the filter with the given name, so that its next use
+ * does not wait for it to fault in. A proxied filter is faulted
+ * in on a fault thread, or by the caller if there are none. A
+ * warmed filter is kept through the next cold unmap, even if
+ * it is not used.
+ * @arg filter_name The name of the filter to warm
+ * @return 0 on success, -1 if the filter does not exist,
+ * -3 if it failed to fault in.
+ */
+int filtmgr_warm_filter(bloom_filtmgr *mgr, char *filter_name);
+
 /**
  * Clears the filter from the internal data stores. This can only
- * be performed if the filter is proxied.
+ * be performed if the filter is proxied, or frozen.
  * @arg filter_name The name of the filter to delete
  * @return 0 on success, -1 if the filter does not exist, -2
  * if the filter is not proxied.
@@ -148,6 +511,115 @@ int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_hea
  */
 int filtmgr_list_cold_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head);
 
+/**
+ * Allocates space for and returns a linked list of the
+ * proxied filters predicted to be used within the lead time.
+ * A filter is predicted to be used once its last wakes, the
+ * first uses after being idle for two cold intervals, are
+ * evenly spaced. Each prediction is only listed once. The
+ * memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg lead The seconds before and after a predicted use
+ * the filter is listed
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_prewarm_filters(bloom_filtmgr *mgr, int lead, bloom_filter_list_head **head);
+
+/**
+ * Allocates space for and returns a linked list of the mapped
+ * filters to evict to free at least the given bytes, if there
+ * are enough. The filters are swept in an approximate LRU (CLOCK)
+ * order, continuing from where the last sweep stopped. The hot
+ * and warmed filters are spared once, and their marks cleared.
+ * In-memory filters are never listed. Only a single thread may
+ * list. The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg bytes The mapped bytes to free
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_evict_filters(bloom_filtmgr *mgr, uint64_t bytes, bloom_filter_list_head **head);
+
+/**
+ * Allocates space for and returns a linked list of the
+ * mapped filters changed since their last flush, in the order
+ * they should be flushed. Filters with more dirty bytes come
+ * first, weighted by how long it has been since their last
+ * flush. Clean, proxied and in-memory filters are not listed.
+ * The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_dirty_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head);
+
+/**
+ * Writes out and syncs the write-ahead logs of the
+ * mapped filters, so that their sets are durable.
+ * @note Must be invoked by a client of the manager.
+ * @arg mgr The manager
+ * @return The number of logs that failed to sync.
+ */
+int filtmgr_sync_wals(bloom_filtmgr *mgr);
+
+/**
+ * Starts the writeback of the dirty pages of the mapped
+ * filters that are mapped SHARED from their data files,
+ * without waiting for the writes.
+ * @note Must be invoked by a client of the manager.
+ * @arg mgr The manager
+ * @return The number of filters that failed to start it.
+ */
+int filtmgr_writeback(bloom_filtmgr *mgr);
+
+/**
+ * Marks whether the flush thread runs the flushes of all the
+ * filters requested by the clients. Once it stops, every
+ * outstanding ticket completes.
+ * @arg mgr The manager
+ * @arg running 1 once the flush thread starts, 0 once it stops
+ */
+void filtmgr_set_flush_scheduler(bloom_filtmgr *mgr, int running);
+
+/**
+ * Requests a flush of all the filters from the flush thread,
+ * and returns without waiting for it. Thread safe.
+ * @arg mgr The manager
+ * @arg ticket Output, the ticket of the flush
+ * @return 0 if the flush was requested, -1 if there is no
+ * flush thread, and the caller should flush the filters.
+ */
+int filtmgr_request_flush(bloom_filtmgr *mgr, uint64_t *ticket);
+
+/**
+ * Returns the last ticket requested, which a flush of all the
+ * filters started now completes. Invoked by the flush thread.
+ * @arg mgr The manager
+ * @return The ticket, or 0 if no tickets are outstanding.
+ */
+uint64_t filtmgr_flush_requested(bloom_filtmgr *mgr);
+
+/**
+ * Completes the tickets up to the given one, once a flush that
+ * started after it was requested is done. The waiters of the
+ * tickets are called back. Invoked by the flush thread.
+ * @arg mgr The manager
+ * @arg ticket The ticket returned by filtmgr_flush_requested
+ */
+void filtmgr_complete_flush(bloom_filtmgr *mgr, uint64_t ticket);
+
+/**
+ * Waits for a ticket to complete, without blocking. Thread safe.
+ * @arg mgr The manager
+ * @arg ticket The ticket to wait for
+ * @arg cb Invoked on the flush thread once the ticket completes
+ * @arg data Opaque handle passed to the callback
+ * @return 0 if the callback will be invoked, 1 if the ticket
+ * is already complete, -1 if the ticket was never handed out.
+ */
+int filtmgr_wait_flush_async(bloom_filtmgr *mgr, uint64_t ticket, fault_cb cb, void *data);
+
 /**
  * Convenience method to cleanup a filter list.
  */
@@ -164,6 +636,30 @@ void filtmgr_cleanup_list(bloom_filter_list_head *head);
 typedef void(*filter_cb)(void* in, char *filter_name, bloom_filter *filter);
 int filtmgr_filter_cb(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void* data);
 
+/**
+ * Invokes a callback with the filters in order of name,
+ * without allocating a list or looking each filter up again.
+ * Listing can be resumed after the last filter of a call.
+ * The filters are not locked, as with filtmgr_filter_cb.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to list or NULL
+ * @arg after Optional, only lists the filters named after it
+ * @arg limit The most filters to list, or 0 for all
+ * @arg cb The callback to invoke with each filter
+ * @arg data Opaque handle passed to the callback
+ * @return The number of filters listed.
+ */
+int filtmgr_iter_filters(bloom_filtmgr *mgr, char *prefix, char *after, int limit, filter_cb cb, void *data);
+
+/**
+ * Returns the number of versions published since the oldest
+ * version a client may still use. These versions hold garbage
+ * that cannot be vacuumed yet.
+ * @arg mgr The manager
+ * @return The version backlog.
+ */
+unsigned long long filtmgr_version_backlog(bloom_filtmgr *mgr);
+
 /**
  * This method is used to force a vacuum up to the current
  * version. It is generally unsafe to use in bloomd,
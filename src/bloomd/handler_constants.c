@@ -21,6 +21,15 @@ static const int FILT_KEY_NEEDED_LEN = sizeof(FILT_KEY_NEEDED) - 1;
 static const char FILT_NEEDED[] = "Must provide filter name";
 static const int FILT_NEEDED_LEN = sizeof(FILT_NEEDED) - 1;
 
+static const char PREFIX_NEEDED[] = "Must provide prefix";
+static const int PREFIX_NEEDED_LEN = sizeof(PREFIX_NEEDED) - 1;
+
+static const char PREFIX_KEY_NEEDED[] = "Must provide prefix and key";
+static const int PREFIX_KEY_NEEDED_LEN = sizeof(PREFIX_KEY_NEEDED) - 1;
+
+static const char FILT_SRC_NEEDED[] = "Must provide filter name and source filters";
+static const int FILT_SRC_NEEDED_LEN = sizeof(FILT_SRC_NEEDED) - 1;
+
 static const char BAD_FILT_NAME[] = "Bad filter name";
 static const int BAD_FILT_NAME_LEN = sizeof(BAD_FILT_NAME) - 1;
 
@@ -30,18 +39,66 @@ static const int INTERNAL_ERR_LEN = sizeof(INTERNAL_ERR) - 1;
 static const char FILT_NOT_EXIST[] = "Filter does not exist\n";
 static const int FILT_NOT_EXIST_LEN = sizeof(FILT_NOT_EXIST) - 1;
 
+static const char SLICE_NOT_EXIST[] = "Slice does not exist\n";
+static const int SLICE_NOT_EXIST_LEN = sizeof(SLICE_NOT_EXIST) - 1;
+
 static const char FILT_NOT_PROXIED[] = "Filter is not proxied. Close it first.\n";
 static const int FILT_NOT_PROXIED_LEN = sizeof(FILT_NOT_PROXIED) - 1;
 
+static const char FILT_NOT_COUNTING[] = "Filter does not support unset\n";
+static const int FILT_NOT_COUNTING_LEN = sizeof(FILT_NOT_COUNTING) - 1;
+
+static const char FILT_NOT_COMPATIBLE[] = "Filters are not compatible\n";
+static const int FILT_NOT_COMPATIBLE_LEN = sizeof(FILT_NOT_COMPATIBLE) - 1;
+
+static const char FILT_FULL[] = "Filter is full\n";
+static const int FILT_FULL_LEN = sizeof(FILT_FULL) - 1;
+
+static const char FILT_FROZEN[] = "Filter is frozen\n";
+static const int FILT_FROZEN_LEN = sizeof(FILT_FROZEN) - 1;
+
+static const char FILT_NOT_FREEZABLE[] = "Filter cannot be frozen\n";
+static const int FILT_NOT_FREEZABLE_LEN = sizeof(FILT_NOT_FREEZABLE) - 1;
+
+static const char FILT_NOT_SHRINKABLE[] = "Filter cannot be shrunk\n";
+static const int FILT_NOT_SHRINKABLE_LEN = sizeof(FILT_NOT_SHRINKABLE) - 1;
+
+static const char FILT_NOT_HASHED[] = "Filter does not take key hashes\n";
+static const int FILT_NOT_HASHED_LEN = sizeof(FILT_NOT_HASHED) - 1;
+
+static const char BAD_KEY_HASH[] = "Keys must be 32 hex digit hashes\n";
+static const int BAD_KEY_HASH_LEN = sizeof(BAD_KEY_HASH) - 1;
+
+static const char TIMEOUT_RESP[] = "Timeout\n";
+static const int TIMEOUT_RESP_LEN = sizeof(TIMEOUT_RESP) - 1;
+
+static const char LOAD_FAILED[] = "Failed to read key file\n";
+static const int LOAD_FAILED_LEN = sizeof(LOAD_FAILED) - 1;
+
+static const char RESTORE_FAILED[] = "Failed to restore dump\n";
+static const int RESTORE_FAILED_LEN = sizeof(RESTORE_FAILED) - 1;
+
+static const char SHM_NEEDS_LOCAL[] = "Must be an idle Unix socket connection";
+static const int SHM_NEEDS_LOCAL_LEN = sizeof(SHM_NEEDS_LOCAL) - 1;
+
 static const char DELETE_IN_PROGRESS[] = "Delete in progress\n";
 static const int DELETE_IN_PROGRESS_LEN = sizeof(DELETE_IN_PROGRESS) - 1;
 
 static const char DONE_RESP[] = "Done\n";
 static const int DONE_RESP_LEN = sizeof(DONE_RESP) - 1;
 
+static const char FLUSH_WAIT[] = "wait";
+static const int FLUSH_WAIT_LEN = sizeof(FLUSH_WAIT) - 1;
+
 static const char EXISTS_RESP[] = "Exists\n";
 static const int EXISTS_RESP_LEN = sizeof(EXISTS_RESP) - 1;
 
+/* The result of each name of a batch create, indexed by -res */
+static const char *CREATE_RESULTS[] = {"Done", "Exists", "Error", "Deleting"};
+
+/* The result of each name of a batch drop, indexed by -res */
+static const char *DROP_RESULTS[] = {"Done", "Missing"};
+
 static const char YES_SPACE[] = "Yes ";
 static const int YES_SPACE_LEN = sizeof(YES_SPACE) - 1;
 
@@ -69,15 +126,60 @@ typedef enum {
     CHECK_MULTI,    // Check multiple space-seperated keys
     SET,            // Set a single key
     SET_MULTI,      // Set multiple space-seperated keys
+    SET_NEW,        // Set multiple keys, reply with the new ones
+    CHECK_HEX,      // Check multiple keys, reply with a hex bitset
+    SET_HEX,        // Set multiple keys, reply with a hex bitset
+    UNSET,          // Unset a single key
+    UNSET_MULTI,    // Unset multiple space-seperated keys
     LIST,           // List filters
     INFO,           // Info about a fileter
     CREATE,         // Creates a filter
     DROP,           // Drop a filter
     CLOSE,          // Close a filter
     CLEAR,          // Clears a filter from the internals
+    RESET,          // Clears the keys of a filter in place
     FLUSH,          // Force flush a filter
+    STATS,          // Server wide stats
+    BINARY,         // Switch to the binary protocol
+    NOREPLY,        // Toggle replies to sets
+    MCHECK,         // Check a single key in multiple filters
+    UNION,          // Merge filters into another
+    INTERSECT,      // Intersect filters into another
+    ESTIMATE,       // Estimate the distinct keys of a filter
+    WARM,           // Fault in a filter ahead of use
+    DELTA,          // Export the changed pages of a filter
+    PEER,           // Marks a connection from another node
+    FREEZE,         // Makes a filter read only
+    LOAD,           // Sets the keys of a file on the server
+    DUMP,           // Sends the layers of a filter
+    RESTORE,        // Receives the layers of a new filter
+    RESTORED,       // Creates the filter once its layers are received
+    SHM,            // Moves a local client to shared memory rings
+    SLOWLOG,        // Reads or resets the slow commands
+    WORKERS,        // Reads or changes the active workers
+    CONFIG,         // Reads or changes the tunable settings
+    HCHECK,         // Check multiple key hashes
+    HSET,           // Set multiple key hashes
+    DEADLINE,       // Sets the deadline of the commands of the connection
+    SLICE,          // Slices the filters under a prefix
+    SCHECK,         // Check a single key in the sliced filters
+    UNSLICE,        // Drops the slices of a prefix
+    SHRINK,         // Folds the sparse layers of a filter
+    HELLO,          // Names the client the connection is counted under
+    TAGGED,         // A command prefixed with a tag, answered with the tag
 } conn_cmd_type;
 
+/* The names of the commands, indexed by conn_cmd_type */
+static const char *CMD_NAMES[] = {
+    "unknown", "check", "multi", "set", "bulk", "bulk_new", "multi_hex",
+    "bulk_hex", "unset", "multi_unset", "list", "info", "create", "drop", "close", "clear",
+    "reset", "flush", "stats", "binary", "noreply", "mcheck", "union",
+    "intersect", "estimate", "warm", "delta", "peer", "freeze", "load",
+    "dump", "restore", "restored", "shm", "slowlog", "workers",
+    "config", "hcheck", "hset", "deadline", "slice", "scheck",
+    "unslice", "shrink", "hello", "tagged"
+};
+
 /* Static regexes */
 static regex_t VALID_FILTER_NAMES_RE;
 static const char *VALID_FILTER_NAMES_PATTERN = "^[^ \t\n\r]{1,200}$";
@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "bitmap.h"
+#include "filter.h"
+#include "handoff.h"
+
+/**
+ * How often the serving thread checks if it should stop
+ */
+#define HANDOFF_POLL_MSEC 500
+
+/**
+ * How long a new bloomd may take to send its request
+ */
+#define HANDOFF_REQUEST_TIMEOUT_SEC 5
+
+/**
+ * The longest filter name that is handed off
+ */
+#define HANDOFF_MAX_NAME 4096
+
+/**
+ * The records sent over the socket. Each is a single packet,
+ * and the listeners and memfds carry their descriptor.
+ */
+typedef enum {
+    HANDOFF_REQUEST = 1,    // Sent by the new bloomd to take over
+    HANDOFF_TCP,            // A TCP listener
+    HANDOFF_UDP,            // A UDP socket
+    HANDOFF_MEMFD,          // The memfd of a file range
+    HANDOFF_FILTER,         // The name of a filter in memory
+    HANDOFF_END             // The last record, before the socket is closed
+} handoff_type;
+
+typedef struct {
+    uint32_t type;
+    uint32_t name_len;      // Length of the name that follows
+    uint64_t dev;           // Identity of the range of a memfd
+    uint64_t ino;
+    uint64_t offset;
+    uint64_t len;
+} handoff_record;
+
+struct bloom_handoff {
+    char *path;             // The handoff socket
+    int listen_fd;          // Serves the handoff socket, or -1
+    int peer_fd;            // The new bloomd taking over, or -1
+    int requested;          // Set once a new bloomd took over
+    int stop;               // Stops the serving thread
+    int *should_run;        // Cleared once a new bloomd took over
+    int serving;
+    pthread_t thread;
+
+    // The filters that were in memory in the previous bloomd
+    char **filters;
+    int num_filters;
+};
+
+static int send_record(int fd, handoff_record *rec, char *name, int send_fd);
+static int recv_record(int fd, handoff_record *rec, char *name, int *recv_fd);
+static int take_over(bloom_handoff *handoff, int fd);
+static void warm_done(void *data, int res);
+static void* serve_thread_main(void *in);
+static int accept_request(int fd);
+static void send_filter_cb(void *data, char *filter_name, bloom_filter *filter);
+static int send_memfd_cb(void *data, int memfd, uint64_t dev, uint64_t ino,
+        uint64_t offset, uint64_t len);
+
+/**
+ * Takes over from the bloomd serving the handoff socket, if there
+ * is one. Blocks until it has closed its filters.
+ */
+int init_handoff(bloom_config *config, bloom_handoff **handoff) {
+    bloom_handoff *h = calloc(1, sizeof(bloom_handoff));
+    if (!h) return -ENOMEM;
+    h->path = config->handoff_socket;
+    h->listen_fd = -1;
+    h->peer_fd = -1;
+    *handoff = h;
+
+    // Back the bitmaps with memfds, so we can hand them off in turn
+    bitmap_use_memfd(1);
+
+    // Connect to the running bloomd, if any
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, h->path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -errno;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            syslog(LOG_WARNING, "Failed to connect to the handoff socket %s. Err: %s",
+                    h->path, strerror(errno));
+        }
+        close(fd);
+        return 0;
+    }
+
+    int res = take_over(h, fd);
+    close(fd);
+    return res;
+}
+
+/**
+ * Requests the handoff, and reads the records
+ * until the previous bloomd closes the socket.
+ */
+static int take_over(bloom_handoff *handoff, int fd) {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    syslog(LOG_INFO, "Taking over from the running bloomd.");
+
+    handoff_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_REQUEST;
+    if (send_record(fd, &rec, NULL, -1)) {
+        syslog(LOG_ERR, "Failed to request the handoff. Err: %s", strerror(errno));
+        return -errno;
+    }
+
+    int tcp_fds[64], udp_fds[64];
+    int num_tcp = 0, num_udp = 0, num_memfds = 0, done = 0;
+    char name[HANDOFF_MAX_NAME + 1];
+    int res, recv_fd;
+    while ((res = recv_record(fd, &rec, name, &recv_fd)) > 0) {
+        switch (rec.type) {
+            case HANDOFF_TCP:
+                if (recv_fd >= 0 && num_tcp < 64) tcp_fds[num_tcp++] = recv_fd;
+                else if (recv_fd >= 0) close(recv_fd);
+                break;
+            case HANDOFF_UDP:
+                if (recv_fd >= 0 && num_udp < 64) udp_fds[num_udp++] = recv_fd;
+                else if (recv_fd >= 0) close(recv_fd);
+                break;
+            case HANDOFF_MEMFD:
+                if (recv_fd < 0) break;
+                if (bitmap_inherit_memfd(recv_fd, rec.dev, rec.ino, rec.offset, rec.len)) {
+                    close(recv_fd);
+                } else {
+                    num_memfds++;
+                }
+                break;
+            case HANDOFF_FILTER:
+                handoff->filters = realloc(handoff->filters, (handoff->num_filters + 1) * sizeof(char*));
+                handoff->filters[handoff->num_filters++] = strdup(name);
+                break;
+            case HANDOFF_END:
+                done = 1;
+                break;
+            default:
+                if (recv_fd >= 0) close(recv_fd);
+                break;
+        }
+    }
+
+    // The listeners are good as they are, but the memory of the filters
+    // is only complete once the running bloomd has sent it all
+    if (res < 0 || !done) {
+        syslog(LOG_ERR, "The running bloomd stopped before the end of the handoff! Reading the filters from disk.");
+        bitmap_release_inherited();
+        for (int i=0; i < handoff->num_filters; i++) free(handoff->filters[i]);
+        free(handoff->filters);
+        handoff->filters = NULL;
+        handoff->num_filters = 0;
+        num_memfds = 0;
+    }
+    networking_inherit_listeners(tcp_fds, num_tcp, udp_fds, num_udp);
+
+    gettimeofday(&end, NULL);
+    uint64_t msec = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+    syslog(LOG_INFO, "Took over %d listeners, %d memfds and %d filters in %llu msec.",
+            num_tcp + num_udp, num_memfds, handoff->num_filters, (unsigned long long)msec);
+    return 0;
+}
+
+// Counts down the faults of the warm
+static void warm_done(void *data, int res) {
+    (void)res;
+    __atomic_sub_fetch((int*)data, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Faults in the filters that were in memory in the previous
+ * bloomd, and releases the memfds no filter mapped.
+ */
+int handoff_warm_filters(bloom_handoff *handoff, bloom_filtmgr *mgr) {
+    // Fault in on the fault threads, if there are any
+    int pending = 0, warmed = 0;
+    for (int i=0; i < handoff->num_filters; i++) {
+        __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+        int res = filtmgr_fault_filter_async(mgr, NULL, handoff->filters[i], warm_done, &pending);
+        if (res) __atomic_sub_fetch(&pending, 1, __ATOMIC_RELAXED);
+        if (res == 1) filtmgr_warm_filter(mgr, handoff->filters[i]);
+        if (res != -1) warmed++;
+    }
+    while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE)) usleep(1000);
+
+    int released = bitmap_release_inherited();
+    if (released) {
+        syslog(LOG_WARNING, "Released %d handed off memfds not mapped by a filter.", released);
+    }
+    for (int i=0; i < handoff->num_filters; i++) free(handoff->filters[i]);
+    free(handoff->filters);
+    handoff->filters = NULL;
+    handoff->num_filters = 0;
+    return warmed;
+}
+
+/**
+ * Starts serving the handoff socket
+ */
+int handoff_serve(bloom_handoff *handoff, int *should_run) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, handoff->path, sizeof(addr.sun_path) - 1);
+
+    // Replace the socket of the previous bloomd
+    unlink(handoff->path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -errno;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || chmod(handoff->path, 0600) ||
+            listen(fd, 1)) {
+        int err = errno;
+        syslog(LOG_ERR, "Failed to serve the handoff socket %s. Err: %s", handoff->path, strerror(err));
+        close(fd);
+        return -err;
+    }
+
+    handoff->listen_fd = fd;
+    handoff->should_run = should_run;
+    if (pthread_create(&handoff->thread, NULL, serve_thread_main, handoff)) {
+        close(fd);
+        handoff->listen_fd = -1;
+        return -1;
+    }
+    handoff->serving = 1;
+    return 0;
+}
+
+/**
+ * Waits for a new bloomd to take over, and stops the
+ * main loop once it does.
+ */
+static void* serve_thread_main(void *in) {
+    bloom_handoff *handoff = in;
+    struct pollfd pfd;
+    pfd.fd = handoff->listen_fd;
+    pfd.events = POLLIN;
+    while (!__atomic_load_n(&handoff->stop, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(handoff->should_run, __ATOMIC_RELAXED)) {
+        if (poll(&pfd, 1, HANDOFF_POLL_MSEC) <= 0) continue;
+        int peer = accept4(handoff->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (peer < 0) continue;
+        if (accept_request(peer)) {
+            close(peer);
+            continue;
+        }
+
+        syslog(LOG_WARNING, "A new bloomd is taking over! Exiting...");
+        handoff->peer_fd = peer;
+        __atomic_store_n(&handoff->requested, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(handoff->should_run, 0, __ATOMIC_RELAXED);
+        break;
+    }
+    return NULL;
+}
+
+/**
+ * Checks that a new bloomd of the same user requested the handoff
+ * @return 0 if it did.
+ */
+static int accept_request(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || cred.uid != getuid()) {
+        syslog(LOG_WARNING, "Refused a handoff to another user.");
+        return -1;
+    }
+
+    struct timeval timeout = {HANDOFF_REQUEST_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    handoff_record rec;
+    int recv_fd;
+    if (recv_record(fd, &rec, NULL, &recv_fd) <= 0 || rec.type != HANDOFF_REQUEST) {
+        if (recv_fd >= 0) close(recv_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks if a new bloomd is taking over
+ */
+int handoff_requested(bloom_handoff *handoff) {
+    return __atomic_load_n(&handoff->requested, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Passes the listeners to the new bloomd
+ */
+int handoff_send_listeners(bloom_handoff *handoff, bloom_networking *netconf) {
+    int *tcp_fds, *udp_fds, num_tcp, num_udp;
+    networking_listeners(netconf, &tcp_fds, &num_tcp, &udp_fds, &num_udp);
+
+    handoff_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_TCP;
+    for (int i=0; i < num_tcp; i++) {
+        if (send_record(handoff->peer_fd, &rec, NULL, tcp_fds[i])) return -errno;
+    }
+    rec.type = HANDOFF_UDP;
+    for (int i=0; i < num_udp; i++) {
+        if (send_record(handoff->peer_fd, &rec, NULL, udp_fds[i])) return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Flushes the filters, and passes the memfds and the
+ * names of the filters in memory to the new bloomd
+ */
+int handoff_send_filters(bloom_handoff *handoff, bloom_filtmgr *mgr) {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // The files must match the memfds. Errors are
+    // ignored, the filter is read from disk instead.
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(mgr, NULL, &head);
+    if (res) return res;
+    for (bloom_filter_list *node = head->head; node; node = node->next) {
+        filtmgr_flush_filter(mgr, node->filter_name);
+    }
+
+    // Send the names of the filters in memory, then the memfds
+    for (bloom_filter_list *node = head->head; node; node = node->next) {
+        filtmgr_filter_cb(mgr, node->filter_name, send_filter_cb, handoff);
+    }
+    filtmgr_cleanup_list(head);
+    res = bitmap_export_memfds(send_memfd_cb, handoff);
+
+    handoff_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_END;
+    if (!res && send_record(handoff->peer_fd, &rec, NULL, -1)) res = -errno;
+
+    gettimeofday(&end, NULL);
+    uint64_t msec = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+    if (res) {
+        syslog(LOG_ERR, "Failed to hand off the filters. Err: %s", strerror(-res));
+    } else {
+        syslog(LOG_INFO, "Handed off the filters in %llu msec.", (unsigned long long)msec);
+    }
+    return res;
+}
+
+// Sends the name of a filter in memory
+static void send_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    bloom_handoff *handoff = data;
+    if (bloomf_is_proxied(filter) || strlen(filter_name) > HANDOFF_MAX_NAME) return;
+    handoff_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_FILTER;
+    rec.name_len = strlen(filter_name);
+    send_record(handoff->peer_fd, &rec, filter_name, -1);
+}
+
+// Sends a memfd, and the file range it holds
+static int send_memfd_cb(void *data, int memfd, uint64_t dev, uint64_t ino,
+        uint64_t offset, uint64_t len) {
+    bloom_handoff *handoff = data;
+    handoff_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_MEMFD;
+    rec.dev = dev;
+    rec.ino = ino;
+    rec.offset = offset;
+    rec.len = len;
+    return send_record(handoff->peer_fd, &rec, NULL, memfd) ? -errno : 0;
+}
+
+/**
+ * Stops serving the handoff socket. Closing the
+ * socket of the new bloomd lets it start.
+ */
+int destroy_handoff(bloom_handoff *handoff) {
+    if (handoff->serving) {
+        __atomic_store_n(&handoff->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(handoff->thread, NULL);
+    }
+    if (handoff->listen_fd >= 0) {
+        close(handoff->listen_fd);
+        unlink(handoff->path);
+    }
+    if (handoff->peer_fd >= 0) close(handoff->peer_fd);
+    for (int i=0; i < handoff->num_filters; i++) free(handoff->filters[i]);
+    free(handoff->filters);
+    free(handoff);
+    return 0;
+}
+
+/**
+ * Sends a record as a single packet, with an optional
+ * name and descriptor.
+ * @return 0 on success, -1 on failure.
+ */
+static int send_record(int fd, handoff_record *rec, char *name, int send_fd) {
+    struct iovec iov[2];
+    iov[0].iov_base = rec;
+    iov[0].iov_len = sizeof(handoff_record);
+    iov[1].iov_base = name;
+    iov[1].iov_len = (name) ? rec->name_len : 0;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (name) ? 2 : 1;
+    if (send_fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &send_fd, sizeof(int));
+    }
+
+    ssize_t res;
+    do {
+        res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (res < 0 && errno == EINTR);
+    return (res < 0) ? -1 : 0;
+}
+
+/**
+ * Receives a record, with its name and descriptor.
+ * @arg name Output, the NUL terminated name, or NULL to discard it
+ * @arg recv_fd Output, the descriptor, or -1 if there is none
+ * @return 1 on success, 0 once the socket is closed, -1 on failure.
+ */
+static int recv_record(int fd, handoff_record *rec, char *name, int *recv_fd) {
+    char buf[sizeof(handoff_record) + HANDOFF_MAX_NAME];
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *recv_fd = -1;
+    ssize_t res;
+    do {
+        res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (res < 0 && errno == EINTR);
+    if (res <= 0) return (res < 0) ? -1 : 0;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(recv_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    // Skip truncated or short packets
+    memset(rec, 0, sizeof(handoff_record));
+    if ((size_t)res < sizeof(handoff_record) || (msg.msg_flags & MSG_TRUNC)) return 1;
+    memcpy(rec, buf, sizeof(handoff_record));
+    if (rec->name_len > res - sizeof(handoff_record)) rec->name_len = res - sizeof(handoff_record);
+    if (name) {
+        memcpy(name, buf + sizeof(handoff_record), rec->name_len);
+        name[rec->name_len] = '\0';
+    }
+    return 1;
+}
@@ -0,0 +1,89 @@
+#ifndef BLOOM_HANDOFF_H
+#define BLOOM_HANDOFF_H
+#include "config.h"
+#include "filter_manager.h"
+#include "networking.h"
+
+/**
+ * A handoff restarts bloomd without losing the memory of its
+ * filters. The PERSISTENT bitmaps of a running bloomd are backed
+ * by memfds, and it serves a Unix socket. A new bloomd connects
+ * to it on start, and the running bloomd stops serving, flushes
+ * its filters, and passes its listeners, the memfds and the names
+ * of the filters in memory over the socket. It closes the socket
+ * once its filters are closed. The new bloomd then loads the
+ * filters, mapping the memfds in place of reading the files, and
+ * starts accepting on the inherited listeners, whose pending
+ * connections are kept through the restart.
+ */
+
+/**
+ * The handoff of a bloomd, and the state handed to it
+ */
+typedef struct bloom_handoff bloom_handoff;
+
+/**
+ * Takes over from the bloomd serving the handoff socket, if there
+ * is one. Blocks until it has closed its filters. The inherited
+ * memfds are registered with the bitmaps, and the listeners with
+ * the networking.
+ * @arg config The configuration, with the handoff socket
+ * @arg handoff Output, the handoff
+ * @return 0 on success, negative on failure.
+ */
+int init_handoff(bloom_config *config, bloom_handoff **handoff);
+
+/**
+ * Faults in the filters that were in memory in the previous
+ * bloomd, and releases the memfds no filter mapped.
+ * @arg handoff The handoff
+ * @arg mgr The filter manager
+ * @return The number of filters faulted in.
+ */
+int handoff_warm_filters(bloom_handoff *handoff, bloom_filtmgr *mgr);
+
+/**
+ * Starts serving the handoff socket. Once a new bloomd
+ * connects, should_run is cleared.
+ * @arg handoff The handoff
+ * @arg should_run Cleared to stop running
+ * @return 0 on success, negative on failure.
+ */
+int handoff_serve(bloom_handoff *handoff, int *should_run);
+
+/**
+ * Checks if a new bloomd is taking over.
+ * @arg handoff The handoff
+ * @return 1 if a new bloomd connected, 0 otherwise.
+ */
+int handoff_requested(bloom_handoff *handoff);
+
+/**
+ * Passes the listeners to the new bloomd. Must be
+ * done before the networking is shut down.
+ * @arg handoff The handoff
+ * @arg netconf The networking stack
+ * @return 0 on success, negative on failure.
+ */
+int handoff_send_listeners(bloom_handoff *handoff, bloom_networking *netconf);
+
+/**
+ * Flushes the filters, and passes the memfds and the names of
+ * the filters in memory to the new bloomd. Must be done after
+ * the networking is shut down, so the filters do not change.
+ * @arg handoff The handoff
+ * @arg mgr The filter manager
+ * @return 0 on success, negative on failure.
+ */
+int handoff_send_filters(bloom_handoff *handoff, bloom_filtmgr *mgr);
+
+/**
+ * Stops serving the handoff socket. A new bloomd taking
+ * over starts once this is called, so the filters must
+ * be closed first.
+ * @arg handoff The handoff
+ * @return 0 on success.
+ */
+int destroy_handoff(bloom_handoff *handoff);
+
+#endif
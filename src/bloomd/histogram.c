@@ -0,0 +1,86 @@
+#include <math.h>
+#include <time.h>
+#include "histogram.h"
+
+static int bucket_index(uint64_t usec);
+
+/**
+ * Records a latency.
+ * @notes Thread safe.
+ * @arg hist The histogram
+ * @arg usec The latency in microseconds
+ */
+void hist_record(latency_histogram *hist, uint64_t usec) {
+    __atomic_fetch_add(hist->counts + bucket_index(usec), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, usec, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds the counts of one histogram to another.
+ * @arg dst The histogram to add to
+ * @arg src The histogram to add
+ */
+void hist_merge(latency_histogram *dst, latency_histogram *src) {
+    for (int i=0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += __atomic_load_n(src->counts + i, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns a percentile of the recorded latencies. This is
+ * the highest latency of the bucket holding the percentile.
+ * @arg hist The histogram
+ * @arg pct The percentile, between 0 and 100
+ * @return The latency in microseconds, 0 if none are recorded.
+ */
+uint64_t hist_percentile(latency_histogram *hist, double pct) {
+    uint64_t counts[HIST_BUCKETS], total = 0;
+    for (int i=0; i < HIST_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(hist->counts + i, __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    if (!total) return 0;
+
+    // Find the bucket holding the rank of the percentile
+    uint64_t rank = ceil(total * pct / 100.0), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int i=0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) return hist_bucket_highest(i);
+    }
+    return hist_bucket_highest(HIST_BUCKETS - 1);
+}
+
+/**
+ * Returns the highest latency that falls in a bucket,
+ * so the buckets up to it count the latencies up to it.
+ * @arg idx The bucket, below HIST_BUCKETS
+ * @return The latency in microseconds
+ */
+uint64_t hist_bucket_highest(int idx) {
+    if (idx < HIST_SUB_BUCKETS) return idx;
+    int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t lowest = (uint64_t)(HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS) << shift;
+    return lowest + (1ULL << shift) - 1;
+}
+
+/**
+ * Returns a monotonic time in microseconds, to time latencies
+ */
+uint64_t hist_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Returns the bucket of a latency. Small values have a bucket
+ * each, larger ones are bucketed by their top HIST_SUB_BITS bits
+ * below the highest set bit.
+ */
+static int bucket_index(uint64_t usec) {
+    if (usec >> HIST_MAX_BITS) usec = (1ULL << HIST_MAX_BITS) - 1;
+    if (usec < HIST_SUB_BUCKETS) return usec;
+    int shift = 63 - __builtin_clzll(usec) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + ((usec >> shift) & (HIST_SUB_BUCKETS - 1));
+}
@@ -0,0 +1,77 @@
+#ifndef BLOOM_HISTOGRAM_H
+#define BLOOM_HISTOGRAM_H
+#include <stdint.h>
+
+/**
+ * Log bucketed latency histograms, in the style of HDR
+ * histograms. Each power of 2 of microseconds is split into
+ * HIST_SUB_BUCKETS linear buckets, so a recorded value is
+ * known to within 25%, whatever its magnitude. Values from 1
+ * microsecond up to HIST_MAX_BITS bits, over an hour, are kept.
+ *
+ * Recording is a single relaxed atomic add, so a histogram
+ * can be recorded by many threads and read at any time.
+ */
+
+/**
+ * The bits of each power of 2 kept, and the buckets they make
+ */
+#define HIST_SUB_BITS 2
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+
+/**
+ * Values are capped at HIST_MAX_BITS bits of microseconds
+ */
+#define HIST_MAX_BITS 32
+
+/**
+ * The number of buckets of a histogram
+ */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/**
+ * A latency histogram. Zero initialize before use.
+ */
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t sum;       // Sum of the recorded latencies
+} latency_histogram;
+
+/**
+ * Records a latency.
+ * @notes Thread safe.
+ * @arg hist The histogram
+ * @arg usec The latency in microseconds
+ */
+void hist_record(latency_histogram *hist, uint64_t usec);
+
+/**
+ * Adds the counts of one histogram to another.
+ * @arg dst The histogram to add to
+ * @arg src The histogram to add
+ */
+void hist_merge(latency_histogram *dst, latency_histogram *src);
+
+/**
+ * Returns a percentile of the recorded latencies. This is
+ * the highest latency of the bucket holding the percentile.
+ * @arg hist The histogram
+ * @arg pct The percentile, between 0 and 100
+ * @return The latency in microseconds, 0 if none are recorded.
+ */
+uint64_t hist_percentile(latency_histogram *hist, double pct);
+
+/**
+ * Returns the highest latency that falls in a bucket,
+ * so the buckets up to it count the latencies up to it.
+ * @arg idx The bucket, below HIST_BUCKETS
+ * @return The latency in microseconds
+ */
+uint64_t hist_bucket_highest(int idx);
+
+/**
+ * Returns a monotonic time in microseconds, to time latencies
+ */
+uint64_t hist_now_usec(void);
+
+#endif
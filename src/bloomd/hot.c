@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hot.h"
+#include "spinlock.h"
+
+/**
+ * A Space-Saving sketch. A new item takes a free slot, or
+ * replaces the item with the lowest count, inheriting that
+ * count as its error.
+ */
+typedef struct {
+    bloom_hot_entry slots[HOT_SLOTS];
+    int used;
+} hot_sketch;
+
+/**
+ * The sketches of one thread
+ */
+typedef struct hot_block {
+    bloom_spinlock lock;
+    hot_sketch filters;
+    hot_sketch keys;
+    struct hot_block *next;
+} __attribute__ ((aligned (64))) hot_block;
+
+// The block of the calling thread, allocated on first use
+static __thread hot_block *LOCAL_BLOCK = NULL;
+
+// The commands until the next sample of the calling thread
+static __thread int LOCAL_COUNTDOWN = 0;
+
+// All the blocks. Pushed without a lock, and never freed
+static hot_block *BLOCKS = NULL;
+
+static hot_block* local_block(void);
+static void sketch_add(hot_sketch *s, const char *filter, int filter_len, uint64_t key_hash);
+static void merge_top(hot_sketch *s, bloom_hot_entry *out, int *num);
+static int entry_cmp(const void *a, const void *b);
+
+/**
+ * Decides if the next command of the calling thread is sampled.
+ * @notes Thread safe.
+ * @arg every Samples one in this many commands
+ * @return 1 if the command is sampled.
+ */
+int hot_sample_next(int every) {
+    if (--LOCAL_COUNTDOWN > 0) return 0;
+    LOCAL_COUNTDOWN = every;
+    return 1;
+}
+
+/**
+ * Counts a sampled command of the calling thread.
+ * @notes Thread safe.
+ */
+void hot_count(const char *filter, int filter_len, char **keys, int *lens, int num_keys) {
+    hot_block *b = LOCAL_BLOCK;
+    if (!b) b = local_block();
+
+    // The name ends at a space, or where the handler terminated it
+    int len = 0;
+    if (filter_len > HOT_NAME) filter_len = HOT_NAME;
+    while (len < filter_len && filter[len] != ' ' && filter[len] != '\0') len++;
+
+    LOCK_BLOOM_SPIN(&b->lock);
+    sketch_add(&b->filters, filter, len, 0);
+    for (int i=0; i < num_keys; i++) {
+        sketch_add(&b->keys, filter, len, hot_key_hash(keys[i], lens[i]));
+    }
+    UNLOCK_BLOOM_SPIN(&b->lock);
+}
+
+/**
+ * Reads the heaviest filters and keys, summed over the threads.
+ * @notes Thread safe.
+ */
+void hot_read(bloom_hot_entry *filters, int *num_filters, bloom_hot_entry *keys, int *num_keys) {
+    // Sum the sketches of the threads, by item
+    hot_sketch thread_filters, thread_keys;
+    int n_filters = 0, n_keys = 0, cap = 0;
+    bloom_hot_entry *f = NULL, *k = NULL;
+
+    hot_block *b = __atomic_load_n(&BLOCKS, __ATOMIC_ACQUIRE);
+    for (; b; b = b->next) {
+        cap += HOT_SLOTS;
+        f = realloc(f, cap * sizeof(bloom_hot_entry));
+        k = realloc(k, cap * sizeof(bloom_hot_entry));
+        LOCK_BLOOM_SPIN(&b->lock);
+        memcpy(&thread_filters, &b->filters, sizeof(hot_sketch));
+        memcpy(&thread_keys, &b->keys, sizeof(hot_sketch));
+        UNLOCK_BLOOM_SPIN(&b->lock);
+        merge_top(&thread_filters, f, &n_filters);
+        merge_top(&thread_keys, k, &n_keys);
+    }
+
+    qsort(f, n_filters, sizeof(bloom_hot_entry), entry_cmp);
+    qsort(k, n_keys, sizeof(bloom_hot_entry), entry_cmp);
+    if (n_filters > *num_filters) n_filters = *num_filters;
+    if (n_keys > *num_keys) n_keys = *num_keys;
+    if (n_filters) memcpy(filters, f, n_filters * sizeof(bloom_hot_entry));
+    if (n_keys) memcpy(keys, k, n_keys * sizeof(bloom_hot_entry));
+    *num_filters = n_filters;
+    *num_keys = n_keys;
+    free(f);
+    free(k);
+}
+
+/**
+ * Hashes a key as hot_count does, 64 bit FNV-1a
+ */
+uint64_t hot_key_hash(const char *key, int len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i=0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Counts an item into a sketch
+ */
+static void sketch_add(hot_sketch *s, const char *filter, int filter_len, uint64_t key_hash) {
+    bloom_hot_entry *min = NULL;
+    for (int i=0; i < s->used; i++) {
+        bloom_hot_entry *e = s->slots + i;
+        if (e->key_hash == key_hash && strncmp(e->filter, filter, filter_len) == 0 &&
+                e->filter[filter_len] == '\0') {
+            e->count++;
+            return;
+        }
+        if (!min || e->count < min->count) min = e;
+    }
+
+    // Take a free slot, or replace the lowest count
+    bloom_hot_entry *e;
+    if (s->used < HOT_SLOTS) {
+        e = s->slots + s->used++;
+        e->count = 1;
+        e->error = 0;
+    } else {
+        e = min;
+        e->error = e->count;
+        e->count++;
+    }
+    memcpy(e->filter, filter, filter_len);
+    e->filter[filter_len] = '\0';
+    e->key_hash = key_hash;
+}
+
+/**
+ * Adds the items of a sketch to a list, summing those
+ * already listed from other threads
+ */
+static void merge_top(hot_sketch *s, bloom_hot_entry *out, int *num) {
+    int listed = *num;
+    for (int i=0; i < s->used; i++) {
+        bloom_hot_entry *e = s->slots + i;
+        int j = 0;
+        for (; j < listed; j++) {
+            if (out[j].key_hash == e->key_hash && strcmp(out[j].filter, e->filter) == 0) break;
+        }
+        if (j < listed) {
+            out[j].count += e->count;
+            out[j].error += e->error;
+        } else {
+            out[(*num)++] = *e;
+        }
+    }
+}
+
+/**
+ * Orders entries by count, heaviest first
+ */
+static int entry_cmp(const void *a, const void *b) {
+    uint64_t count_a = ((bloom_hot_entry*)a)->count;
+    uint64_t count_b = ((bloom_hot_entry*)b)->count;
+    return (count_a < count_b) ? 1 : (count_a > count_b) ? -1 : 0;
+}
+
+/**
+ * Allocates and registers the block of the calling thread
+ */
+static hot_block* local_block(void) {
+    hot_block *b;
+    if (posix_memalign((void**)&b, 64, sizeof(hot_block))) abort();
+    memset(b, 0, sizeof(hot_block));
+    INIT_BLOOM_SPIN(&b->lock);
+
+    // Push onto the list of blocks
+    b->next = __atomic_load_n(&BLOCKS, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&BLOCKS, &b->next, b, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    LOCAL_BLOCK = b;
+    return b;
+}
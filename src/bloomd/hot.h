@@ -0,0 +1,65 @@
+#ifndef BLOOM_HOT_H
+#define BLOOM_HOT_H
+#include <stdint.h>
+
+/**
+ * Finds the filters and keys that drive the load, from a sample
+ * of the commands. Each thread counts the sampled filters and
+ * keys into Space-Saving sketches of its own, which keep the
+ * HOT_SLOTS heaviest of each with a bounded overcount. A sketch
+ * has a lock, which is only contended by a read, and only taken
+ * for a sampled command.
+ */
+#define HOT_SLOTS 64
+
+/**
+ * The most bytes of a filter name kept
+ */
+#define HOT_NAME 64
+
+/**
+ * A heavy hitter. Keys are identified by the 64 bit FNV-1a
+ * hash of the key, along with the filter they are used on.
+ */
+typedef struct {
+    char filter[HOT_NAME + 1];  // The filter name, truncated
+    uint64_t key_hash;          // The hash of the key, 0 for a filter
+    uint64_t count;             // The sampled uses, possibly overcounted
+    uint64_t error;             // The most the count is overcounted by
+} bloom_hot_entry;
+
+/**
+ * Decides if the next command of the calling thread is sampled.
+ * @notes Thread safe.
+ * @arg every Samples one in this many commands
+ * @return 1 if the command is sampled.
+ */
+int hot_sample_next(int every);
+
+/**
+ * Counts a sampled command of the calling thread.
+ * @notes Thread safe.
+ * @arg filter The filter name, which ends at a space or NUL
+ * @arg filter_len The most bytes of the filter name
+ * @arg keys The keys, can be NULL
+ * @arg lens The lengths of the keys
+ * @arg num_keys The number of keys
+ */
+void hot_count(const char *filter, int filter_len, char **keys, int *lens, int num_keys);
+
+/**
+ * Reads the heaviest filters and keys, summed over the threads.
+ * @notes Thread safe.
+ * @arg filters Output, the filters, heaviest first
+ * @arg num_filters Input, the most filters. Output, the filters read.
+ * @arg keys Output, the keys, heaviest first
+ * @arg num_keys Input, the most keys. Output, the keys read.
+ */
+void hot_read(bloom_hot_entry *filters, int *num_filters, bloom_hot_entry *keys, int *num_keys);
+
+/**
+ * Hashes a key as hot_count does, 64 bit FNV-1a
+ */
+uint64_t hot_key_hash(const char *key, int len);
+
+#endif
@@ -0,0 +1,274 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "config.h"
+#include "filter_manager.h"
+#include "background.h"
+#include "libbloomd.h"
+
+/**
+ * The longest filter name, as taken by the create command
+ */
+#define MAX_NAME_LEN 200
+
+struct bloomd {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int should_run;     // Cleared to stop the background threads
+    int flush_on, unmap_on, wal_on, writeback_on;
+    pthread_t flush_thread, unmap_thread, wal_thread, writeback_thread;
+};
+
+/**
+ * Holds back the reclaiming of filters while a call runs
+ */
+#define ENTER(db) filtmgr_client_checkpoint((db)->mgr)
+#define LEAVE(db) filtmgr_client_leave((db)->mgr)
+
+static int valid_name(const char *name);
+static int map_error(int res);
+
+/**
+ * Opens the filters of a configuration, and starts the
+ * background threads.
+ */
+int bloomd_open(const char *config_file, bloomd **db_out) {
+    bloom_config *config = calloc(1, sizeof(bloom_config));
+    if (!config) return BLOOMD_INTERNAL;
+    if (config_from_filename((char*)config_file, config) || validate_config(config)) {
+        syslog(LOG_ERR, "Invalid configuration for the embedded filters!");
+        free(config);
+        return BLOOMD_BAD_ARGS;
+    }
+
+    bloomd *db = calloc(1, sizeof(bloomd));
+    if (!db) {
+        free(config);
+        return BLOOMD_INTERNAL;
+    }
+    db->config = config;
+    if (init_filter_manager(config, 1, &db->mgr)) {
+        syslog(LOG_ERR, "Failed to initialize the embedded filter manager!");
+        free(db);
+        free(config);
+        return BLOOMD_INTERNAL;
+    }
+
+    // Start the background tasks, as bloomd does
+    db->should_run = 1;
+    db->flush_on = start_flush_thread(config, db->mgr, &db->should_run, &db->flush_thread);
+    db->unmap_on = start_cold_unmap_thread(config, db->mgr, &db->should_run, &db->unmap_thread);
+    db->wal_on = start_wal_thread(config, db->mgr, &db->should_run, &db->wal_thread);
+    db->writeback_on = start_writeback_thread(config, db->mgr, &db->should_run, &db->writeback_thread);
+    *db_out = db;
+    return 0;
+}
+
+
+/**
+ * Stops the background threads, flushes and closes the
+ * filters, and frees the handle.
+ */
+int bloomd_close(bloomd *db) {
+    __atomic_store_n(&db->should_run, 0, __ATOMIC_RELEASE);
+    if (db->flush_on) pthread_join(db->flush_thread, NULL);
+    if (db->unmap_on) pthread_join(db->unmap_thread, NULL);
+    if (db->wal_on) pthread_join(db->wal_thread, NULL);
+    if (db->writeback_on) pthread_join(db->writeback_thread, NULL);
+    destroy_filter_manager(db->mgr);
+    free(db->config);
+    free(db);
+    return 0;
+}
+
+
+/**
+ * Creates a filter.
+ */
+int bloomd_create(bloomd *db, const char *name, const char *options) {
+    if (!valid_name(name)) return BLOOMD_BAD_ARGS;
+
+    // Apply the options to a copy of the configuration,
+    // which is owned by the filter once it is created
+    bloom_config *config = NULL;
+    char *like = NULL;
+    int res = 0;
+    ENTER(db);
+    if (options) {
+        char *opts = strdup(options);
+        config = malloc(sizeof(bloom_config));
+        memcpy(config, db->config, sizeof(bloom_config));
+        if (apply_filter_options(config, opts, &like)) {
+            res = BLOOMD_BAD_ARGS;
+        } else if (like && filtmgr_size_like(db->mgr, like, config)) {
+            res = BLOOMD_NO_FILTER;
+        }
+        free(opts);
+        if (res) {
+            LEAVE(db);
+            free(config);
+            return res;
+        }
+    }
+
+    res = filtmgr_create_filter(db->mgr, (char*)name, config);
+    LEAVE(db);
+    if (res && config) free(config);
+    switch (res) {
+        case 0: return 0;
+        case -1: return BLOOMD_EXISTS;
+        case -3: return BLOOMD_DELETING;
+        default: return BLOOMD_INTERNAL;
+    }
+}
+
+
+/**
+ * Drops a filter, deleting it from disk.
+ */
+int bloomd_drop(bloomd *db, const char *name) {
+    ENTER(db);
+    int res = filtmgr_drop_filter(db->mgr, (char*)name);
+    LEAVE(db);
+    return map_error(res);
+}
+
+
+/**
+ * Closes a filter, unmapping it from memory.
+ */
+int bloomd_close_filter(bloomd *db, const char *name) {
+    ENTER(db);
+    int res = filtmgr_unmap_filter(db->mgr, (char*)name);
+    LEAVE(db);
+    return map_error(res);
+}
+
+
+/**
+ * Flushes a filter to disk, or all of them.
+ */
+int bloomd_flush(bloomd *db, const char *name) {
+    ENTER(db);
+    int res = 0;
+    if (name) {
+        res = filtmgr_flush_filter(db->mgr, (char*)name);
+    } else {
+        bloom_filter_list_head *head;
+        res = filtmgr_list_filters(db->mgr, NULL, &head);
+        if (!res) {
+            // A filter dropped since it was listed is not flushed
+            for (bloom_filter_list *node = head->head; node; node = node->next)
+                filtmgr_flush_filter(db->mgr, node->filter_name);
+            filtmgr_cleanup_list(head);
+        }
+    }
+    LEAVE(db);
+    return map_error(res);
+}
+
+
+/**
+ * Checks for keys in a filter.
+ */
+int bloomd_check_keys(bloomd *db, const char *name, const char **keys,
+        const uint64_t *lens, int num_keys, char *results) {
+    ENTER(db);
+    int res = filtmgr_check_keys_len(db->mgr, NULL, (char*)name, (char**)keys,
+            (uint64_t*)lens, num_keys, results);
+    LEAVE(db);
+    return map_error(res);
+}
+
+
+/**
+ * Sets keys in a filter.
+ */
+int bloomd_set_keys(bloomd *db, const char *name, const char **keys,
+        const uint64_t *lens, int num_keys, char *results) {
+    ENTER(db);
+    int res = filtmgr_set_keys_len(db->mgr, NULL, (char*)name, (char**)keys,
+            (uint64_t*)lens, num_keys, results);
+    LEAVE(db);
+    return map_error(res);
+}
+
+
+/**
+ * Unsets keys in a counting or cuckoo filter.
+ */
+int bloomd_unset_keys(bloomd *db, const char *name, const char **keys,
+        const uint64_t *lens, int num_keys, char *results) {
+    ENTER(db);
+    int res = filtmgr_unset_keys_len(db->mgr, NULL, (char*)name, (char**)keys,
+            (uint64_t*)lens, num_keys, results);
+    LEAVE(db);
+    return (res == -3) ? BLOOMD_NOT_COUNTING : map_error(res);
+}
+
+
+/**
+ * Checks for a key in a filter.
+ */
+int bloomd_check(bloomd *db, const char *name, const char *key, size_t len) {
+    uint64_t key_len = len;
+    char result = 0;
+    int res = bloomd_check_keys(db, name, &key, &key_len, 1, &result);
+    return (res) ? res : result;
+}
+
+
+/**
+ * Sets a key in a filter.
+ */
+int bloomd_set(bloomd *db, const char *name, const char *key, size_t len) {
+    uint64_t key_len = len;
+    char result = 0;
+    int res = bloomd_set_keys(db, name, &key, &key_len, 1, &result);
+    return (res) ? res : result;
+}
+
+
+/**
+ * Lists the filters.
+ */
+int bloomd_list(bloomd *db, const char *prefix, bloomd_list_cb cb, void *data) {
+    bloom_filter_list_head *head;
+    ENTER(db);
+    int res = filtmgr_list_filters(db->mgr, (char*)prefix, &head);
+    LEAVE(db);
+    if (res) return BLOOMD_INTERNAL;
+
+    int num = 0;
+    for (bloom_filter_list *node = head->head; node; node = node->next, num++)
+        cb(data, node->filter_name);
+    filtmgr_cleanup_list(head);
+    return num;
+}
+
+
+/**
+ * Checks a filter name as the create command does, it
+ * must be 1 to 200 characters, without whitespace.
+ */
+static int valid_name(const char *name) {
+    if (!name) return 0;
+    size_t len = strlen(name);
+    return len > 0 && len <= MAX_NAME_LEN && !name[strcspn(name, " \t\n\r")];
+}
+
+
+/**
+ * Maps the errors of the filter manager shared by the calls.
+ */
+static int map_error(int res) {
+    switch (res) {
+        case 0: return 0;
+        case -1: return BLOOMD_NO_FILTER;
+        case -4: return BLOOMD_FULL;
+        case -5: return BLOOMD_FROZEN;
+        case -6: return BLOOMD_BAD_ARGS;
+        default: return BLOOMD_INTERNAL;
+    }
+}
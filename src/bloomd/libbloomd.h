@@ -0,0 +1,147 @@
+#ifndef LIBBLOOMD_H
+#define LIBBLOOMD_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Embeds the filter management of bloomd in another process,
+ * without the networking. The filters are kept in the data_dir
+ * of a bloomd configuration file, and flushed, unmapped when
+ * cold and synced to their write-ahead logs by background
+ * threads, just as bloomd does. A data_dir must only be used
+ * by one bloomd or embedding process at a time.
+ *
+ * Every function may be called from any thread. A call holds
+ * back the reclaiming of dropped filters only while it runs,
+ * so threads need not register or leave.
+ */
+typedef struct bloomd bloomd;
+
+/**
+ * The errors returned by the functions, all negative
+ */
+#define BLOOMD_NO_FILTER    -1  // The filter does not exist
+#define BLOOMD_INTERNAL     -2  // Internal error, see syslog
+#define BLOOMD_EXISTS       -3  // The filter already exists
+#define BLOOMD_FULL         -4  // The filter is full and rejects sets
+#define BLOOMD_FROZEN       -5  // The filter is frozen
+#define BLOOMD_DELETING     -6  // A delete of the filter is in progress
+#define BLOOMD_BAD_ARGS     -7  // Bad filter name, options or configuration
+#define BLOOMD_NOT_COUNTING -8  // The filter does not support unset
+
+/**
+ * Opens the filters of a configuration, and starts the
+ * background threads.
+ * @arg config_file A bloomd configuration file, or NULL for
+ * the defaults. The networking options are ignored.
+ * @arg db Output, the handle
+ * @return 0 on success, or BLOOMD_BAD_ARGS or BLOOMD_INTERNAL.
+ */
+int bloomd_open(const char *config_file, bloomd **db);
+
+/**
+ * Stops the background threads, flushes and closes the
+ * filters, and frees the handle. No calls may be in progress.
+ * @arg db The handle
+ * @return 0 on success.
+ */
+int bloomd_close(bloomd *db);
+
+/**
+ * Creates a filter.
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg options Space separated options, as taken by the create
+ * command, such as "capacity=1000000 prob=0.001". Can be NULL.
+ * @return 0 on success, BLOOMD_EXISTS, BLOOMD_DELETING,
+ * BLOOMD_BAD_ARGS, BLOOMD_NO_FILTER if the filter named by a
+ * like option does not exist, or BLOOMD_INTERNAL.
+ */
+int bloomd_create(bloomd *db, const char *name, const char *options);
+
+/**
+ * Drops a filter, deleting it from disk.
+ * @return 0 on success, or BLOOMD_NO_FILTER.
+ */
+int bloomd_drop(bloomd *db, const char *name);
+
+/**
+ * Closes a filter, unmapping it from memory. It is
+ * faulted back in by its next use.
+ * @return 0 on success, or BLOOMD_NO_FILTER.
+ */
+int bloomd_close_filter(bloomd *db, const char *name);
+
+/**
+ * Flushes a filter to disk.
+ * @arg name The name of the filter, or NULL for all of them
+ * @return 0 on success, or BLOOMD_NO_FILTER.
+ */
+int bloomd_flush(bloomd *db, const char *name);
+
+/**
+ * Checks for keys in a filter. The keys are checked together,
+ * which overlaps their probes.
+ * @arg db The handle
+ * @arg name The name of the filter
+ * @arg keys The keys, which need not be NUL terminated
+ * @arg lens The lengths of the keys, or NULL if they are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output, 1 for each key that is in the filter, 0 otherwise
+ * @return 0 on success, BLOOMD_NO_FILTER or BLOOMD_INTERNAL. The
+ * keys of a hashed filter are 32 hex digits of a 128bit hash, and
+ * BLOOMD_BAD_ARGS is returned if any is not.
+ */
+int bloomd_check_keys(bloomd *db, const char *name, const char **keys,
+        const uint64_t *lens, int num_keys, char *results);
+
+/**
+ * Sets keys in a filter.
+ * @arg results Output, 1 for each key that was newly set, 0 otherwise.
+ * Otherwise the same as bloomd_check_keys.
+ * @return 0 on success, BLOOMD_NO_FILTER, BLOOMD_FULL,
+ * BLOOMD_FROZEN or BLOOMD_INTERNAL.
+ */
+int bloomd_set_keys(bloomd *db, const char *name, const char **keys,
+        const uint64_t *lens, int num_keys, char *results);
+
+/**
+ * Unsets keys in a counting or cuckoo filter.
+ * @arg results Output, 1 for each key that was removed, 0 otherwise.
+ * Otherwise the same as bloomd_check_keys.
+ * @return 0 on success, BLOOMD_NO_FILTER, BLOOMD_NOT_COUNTING,
+ * BLOOMD_FROZEN or BLOOMD_INTERNAL.
+ */
+int bloomd_unset_keys(bloomd *db, const char *name, const char **keys,
+        const uint64_t *lens, int num_keys, char *results);
+
+/**
+ * Checks for a key in a filter.
+ * @return 1 if the key is in the filter, 0 if it is not, or
+ * an error as returned by bloomd_check_keys.
+ */
+int bloomd_check(bloomd *db, const char *name, const char *key, size_t len);
+
+/**
+ * Sets a key in a filter.
+ * @return 1 if the key was newly set, 0 if it was set, or
+ * an error as returned by bloomd_set_keys.
+ */
+int bloomd_set(bloomd *db, const char *name, const char *key, size_t len);
+
+/**
+ * Invoked with the name of each filter listed.
+ */
+typedef void(*bloomd_list_cb)(void *data, const char *name);
+
+/**
+ * Lists the filters.
+ * @arg db The handle
+ * @arg prefix Only lists the filters starting with it. Can be NULL.
+ * @arg cb Invoked with each filter name
+ * @arg data Passed to cb
+ * @return The number of filters listed, or BLOOMD_INTERNAL.
+ */
+int bloomd_list(bloomd *db, const char *prefix, bloomd_list_cb cb, void *data);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "load.h"
+#include "filter.h"
+#include "scan.h"
+
+/**
+ * A load in progress, on the stack of the thread running it
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    char *filter_name;
+    const char *data;       // The mapped file
+    uint64_t size;          // The bytes of the file
+    int num_segments;
+    int next;               // Next segment to claim
+    uint64_t done;          // Bytes of the segments done
+    int res;                // First error, 0 if none
+} load_job;
+
+static void run_load_lane(void *data, int lane);
+static int load_segment(load_job *job, bloom_filtmgr_cache *cache, int segment,
+        char **keys, uint64_t *lens, char *results);
+static const char* line_after(const char *pos, const char *end);
+static int split_lines(const char **buf, const char *end, char **keys, uint64_t *lens, int max_keys);
+static void set_load_error(load_job *job, int res);
+static void set_load_progress(load_job *job);
+static void load_progress_cb(void *data, char *filter_name, bloom_filter *filter);
+
+/**
+ * Sets the keys of a file in a filter. Empty lines are skipped,
+ * and a trailing carriage return is not part of a key.
+ * @arg mgr The filter manager
+ * @arg pool The bulk pool to run the lanes on, or NULL
+ * @arg filter_name The name of the filter
+ * @arg path The path of the key file
+ * @arg lanes The number of lanes, up to LOAD_MAX_LANES
+ * @return 0 on success, -1 if the filter does not exist, -2 on
+ * internal error, -4 if the filter is full and rejects sets, -5
+ * if it is frozen, -6 if the file cannot be read.
+ */
+int load_key_file(bloom_filtmgr *mgr, bloom_bulk_pool *pool, char *filter_name, char *path, int lanes) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to open key file %s. %s", path, strerror(errno));
+        return -6;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        syslog(LOG_ERR, "Key file %s is not a regular file.", path);
+        close(fd);
+        return -6;
+    }
+
+    load_job job = {mgr, filter_name, NULL, st.st_size, 0, 0, 0, 0};
+    if (job.size) {
+        job.data = mmap(NULL, job.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (job.data == MAP_FAILED) {
+            syslog(LOG_ERR, "Failed to map key file %s. %s", path, strerror(errno));
+            close(fd);
+            return -6;
+        }
+        madvise((void*)job.data, job.size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // Start the progress, this also checks the filter exists
+    if (filtmgr_filter_cb(mgr, filter_name, load_progress_cb, &job) != 0) {
+        if (job.size) munmap((void*)job.data, job.size);
+        return -1;
+    }
+
+    job.num_segments = (job.size + LOAD_SEGMENT_BYTES - 1) / LOAD_SEGMENT_BYTES;
+    if (lanes > LOAD_MAX_LANES) lanes = LOAD_MAX_LANES;
+    if (lanes > job.num_segments) lanes = job.num_segments;
+    if (lanes > 1 && pool) {
+        bulk_pool_run(pool, lanes, run_load_lane, &job);
+    } else if (lanes > 0) {
+        run_load_lane(&job, 0);
+    }
+
+    if (job.size) munmap((void*)job.data, job.size);
+    return job.res;
+}
+
+/**
+ * Claims and loads segments until none are left, or a
+ * lane fails. Each lane has its own batch and filter cache.
+ */
+static void run_load_lane(void *data, int lane) {
+    (void)lane;
+    load_job *job = data;
+    char **keys = malloc(LOAD_BATCH_KEYS * (sizeof(char*) + sizeof(uint64_t) + 1));
+    if (!keys) {
+        set_load_error(job, -2);
+        return;
+    }
+    uint64_t *lens = (uint64_t*)(keys + LOAD_BATCH_KEYS);
+    char *results = (char*)(lens + LOAD_BATCH_KEYS);
+    bloom_filtmgr_cache cache;
+    memset(&cache, 0, sizeof(cache));
+
+    int segment, res;
+    while (!__atomic_load_n(&job->res, __ATOMIC_RELAXED) &&
+            (segment = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->num_segments) {
+        res = load_segment(job, &cache, segment, keys, lens, results);
+        if (res) {
+            set_load_error(job, res);
+            break;
+        }
+
+        // A load can run for long, so let the manager
+        // reclaim the filters released in the meantime
+        filtmgr_client_checkpoint(job->mgr);
+        set_load_progress(job);
+    }
+    free(keys);
+}
+
+/**
+ * Sets the keys of the lines that start in a segment. The
+ * last line may run past the end of the segment.
+ * @return 0 on success, or the error of filtmgr_set_keys_len.
+ */
+static int load_segment(load_job *job, bloom_filtmgr_cache *cache, int segment,
+        char **keys, uint64_t *lens, char *results) {
+    const char *file_end = job->data + job->size;
+    const char *pos = job->data + (uint64_t)segment * LOAD_SEGMENT_BYTES;
+    const char *end = pos + LOAD_SEGMENT_BYTES;
+
+    // The line running into the segment belongs to the one
+    // before, and the line running out of it belongs to it
+    if (segment > 0 && pos[-1] != '\n') pos = line_after(pos, file_end);
+    if (end >= file_end) {
+        end = file_end;
+    } else if (end[-1] != '\n') {
+        end = line_after(end, file_end);
+    }
+
+    int num_keys, res = 0;
+    while (pos < end && !res) {
+        num_keys = split_lines(&pos, end, keys, lens, LOAD_BATCH_KEYS);
+        if (num_keys) res = filtmgr_set_keys_len(job->mgr, cache, job->filter_name, keys, lens, num_keys, results);
+    }
+    return res;
+}
+
+/**
+ * Returns the start of the line after the one at pos
+ */
+static const char* line_after(const char *pos, const char *end) {
+    const char *eol = memchr(pos, '\n', end - pos);
+    return (eol) ? eol + 1 : end;
+}
+
+/**
+ * Adds a line to a batch, unless it is empty. A
+ * trailing carriage return is not part of the key.
+ */
+static inline int add_line(const char *line, const char *eol, char **keys, uint64_t *lens, int num) {
+    if (eol > line && eol[-1] == '\r') eol--;
+    if (eol == line) return num;
+    keys[num] = (char*)line;
+    lens[num] = eol - line;
+    return num + 1;
+}
+
+/**
+ * Splits lines off the front of a buffer, as split_keys does
+ * for spaces. Newlines are found 16 bytes at a time.
+ * @arg buf The lines. Updated to the lines that remain.
+ * @arg end The end of the lines
+ * @arg keys Output. The start of each key.
+ * @arg lens Output. The length of each key.
+ * @arg max_keys The most keys to split off
+ * @return The number of keys split off.
+ */
+static int split_lines(const char **buf, const char *end, char **keys, uint64_t *lens, int max_keys) {
+    const char *line = *buf;
+    const char *pos = line;
+    int num = 0;
+
+    // Take each newline of a block, lowest first
+    unsigned mask;
+    int offset;
+    for (; end - pos >= 16; pos += 16) {
+        mask = byte_mask(pos, '\n');
+        while (mask) {
+            offset = __builtin_ctz(mask);
+            num = add_line(line, pos + offset, keys, lens, num);
+            line = pos + offset + 1;
+            mask &= mask - 1;
+            if (num == max_keys) goto DONE;
+        }
+    }
+
+    // Scan the rest a byte at a time
+    for (; pos < end; pos++) {
+        if (*pos != '\n') continue;
+        num = add_line(line, pos, keys, lens, num);
+        line = pos + 1;
+        if (num == max_keys) goto DONE;
+    }
+
+    // The last line may not end in a newline
+    if (line < end) {
+        num = add_line(line, end, keys, lens, num);
+        line = end;
+    }
+
+DONE:
+    *buf = line;
+    return num;
+}
+
+/**
+ * Keeps the first error of a load, which stops the other lanes
+ */
+static void set_load_error(load_job *job, int res) {
+    int none = 0;
+    __atomic_compare_exchange_n(&job->res, &none, res, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds a segment to the progress of the load
+ */
+static void set_load_progress(load_job *job) {
+    __atomic_add_fetch(&job->done, LOAD_SEGMENT_BYTES, __ATOMIC_RELAXED);
+    filtmgr_filter_cb(job->mgr, job->filter_name, load_progress_cb, job);
+}
+
+/**
+ * Stores the progress of a load in its filter
+ */
+static void load_progress_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    load_job *job = data;
+    uint64_t done = __atomic_load_n(&job->done, __ATOMIC_RELAXED);
+    __atomic_store_n(&filter->load_bytes, (done < job->size) ? done : job->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&filter->load_total, job->size, __ATOMIC_RELAXED);
+}
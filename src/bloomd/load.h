@@ -0,0 +1,46 @@
+#ifndef BLOOM_LOAD_H
+#define BLOOM_LOAD_H
+#include <stdint.h>
+#include "filter_manager.h"
+#include "bulk.h"
+
+/**
+ * A load sets the keys of a file on the server in a filter, so
+ * that bulk imports skip the protocol. The file holds a key per
+ * line, and is mapped and split into segments at line boundaries.
+ * Lanes claim the segments in turn, and set the keys of each in
+ * large batches, which take the sorted batch path of the filter.
+ * The lanes run on the bulk pool when there is one. The progress
+ * of a load is kept in the filter, and shown by info.
+ */
+
+/**
+ * The bytes of the file in a segment
+ */
+#define LOAD_SEGMENT_BYTES (4 * 1024 * 1024)
+
+/**
+ * The most keys set in one batch
+ */
+#define LOAD_BATCH_KEYS 16384
+
+/**
+ * The most lanes of a load
+ */
+#define LOAD_MAX_LANES 64
+
+/**
+ * Sets the keys of a file in a filter. Empty lines are skipped,
+ * and a trailing carriage return is not part of a key.
+ * @arg mgr The filter manager
+ * @arg pool The bulk pool to run the lanes on, or NULL
+ * @arg filter_name The name of the filter
+ * @arg path The path of the key file
+ * @arg lanes The number of lanes, up to LOAD_MAX_LANES
+ * @return 0 on success, -1 if the filter does not exist, -2 on
+ * internal error, -4 if the filter is full and rejects sets, -5
+ * if it is frozen, -6 if the file cannot be read.
+ */
+int load_key_file(bloom_filtmgr *mgr, bloom_bulk_pool *pool, char *filter_name, char *path, int lanes);
+
+#endif
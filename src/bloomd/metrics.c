@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "metrics.h"
+#include "stats.h"
+
+/**
+ * The initial size of the metrics buffer. Enough for all
+ * the histograms, so it is rarely grown.
+ */
+#define METRICS_BUF_SIZE 32768
+
+/**
+ * A growing output buffer
+ */
+typedef struct {
+    char *buf;
+    int len;
+    int size;
+    int err;        // Set if an allocation failed
+} metrics_buf;
+
+// The names of the latency histograms, indexed by bloom_latency
+static const char *LATENCY_NAMES[] = {"check", "multi", "set", "bulk", "create", "flush"};
+
+static void append(metrics_buf *out, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+static void format_counter(metrics_buf *out, const char *name, const char *help, int64_t value);
+static void format_gauge(metrics_buf *out, const char *name, const char *help, int64_t value);
+static void format_latency(metrics_buf *out, bloom_latency cmd);
+
+/**
+ * Formats the metrics of the server.
+ * @notes Thread safe.
+ * @arg mgr The filter manager
+ * @arg out Output, set to the formatted metrics.
+ * The memory should be free'd by the caller.
+ * @return The length of the metrics, or -1 on error.
+ */
+int metrics_format(bloom_filtmgr *mgr, char **out) {
+    metrics_buf m = {malloc(METRICS_BUF_SIZE), 0, METRICS_BUF_SIZE, 0};
+    if (!m.buf) return -1;
+
+    // Read the counters of all the threads
+    bloom_stats stats;
+    stats_read(&stats);
+    int64_t *v = stats.values;
+
+    format_counter(&m, "bloomd_checks", "Keys checked.", v[STAT_CHECKS]);
+    format_counter(&m, "bloomd_sets", "Keys set.", v[STAT_SETS]);
+    format_counter(&m, "bloomd_page_ins", "Filters faulted in.", v[STAT_PAGE_INS]);
+    format_counter(&m, "bloomd_page_outs", "Filters paged out.", v[STAT_PAGE_OUTS]);
+    format_counter(&m, "bloomd_page_in_bytes", "Bytes read in by page ins.", v[STAT_PAGE_IN_BYTES]);
+    format_counter(&m, "bloomd_flush_bytes", "Bytes written out by flushes.", v[STAT_FLUSH_BYTES]);
+    format_counter(&m, "bloomd_udp_datagrams", "UDP datagrams received.", v[STAT_UDP_DATAGRAMS]);
+    format_counter(&m, "bloomd_udp_drops", "UDP datagrams dropped.", v[STAT_UDP_DROPS]);
+    format_counter(&m, "bloomd_udp_rejects", "UDP commands ignored, other than set and bulk.",
+            v[STAT_UDP_REJECTS]);
+    format_counter(&m, "bloomd_timeouts", "Commands not run, past their deadline.", v[STAT_TIMEOUTS]);
+    format_counter(&m, "bloomd_lock_spins", "Contended lock acquisitions taken by spinning.",
+            v[STAT_LOCK_SPINS]);
+    format_counter(&m, "bloomd_lock_waits", "Contended lock acquisitions that slept.",
+            v[STAT_LOCK_WAITS]);
+    format_counter(&m, "bloomd_positive_hits", "Keys answered by the positive cache.",
+            v[STAT_POSITIVE_HITS]);
+    format_counter(&m, "bloomd_rejected_connections", "Client connections rejected over max_connections.",
+            v[STAT_CONN_REJECTS]);
+    format_gauge(&m, "bloomd_connections", "Open client connections.", v[STAT_CONNECTIONS]);
+    format_gauge(&m, "bloomd_buffer_bytes", "Bytes of the connection buffers.", v[STAT_BUFFER_BYTES]);
+    format_gauge(&m, "bloomd_filters", "Filters.", v[STAT_FILTERS]);
+    format_gauge(&m, "bloomd_mapped_filters", "Filters mapped in.", v[STAT_MAPPED_FILTERS]);
+    format_gauge(&m, "bloomd_proxied_filters", "Filters not mapped in.",
+            v[STAT_FILTERS] - v[STAT_MAPPED_FILTERS]);
+    format_gauge(&m, "bloomd_mapped_bytes", "Bytes of the filters mapped in.", v[STAT_MAPPED_BYTES]);
+    format_gauge(&m, "bloomd_packed_bytes", "Bytes of the cold in-memory filters packed in memory.",
+            v[STAT_PACKED_BYTES]);
+    format_gauge(&m, "bloomd_version_backlog", "Filter manager versions not yet vacuumed.",
+            (int64_t)filtmgr_version_backlog(mgr));
+
+    // All the commands are one family, labeled by command
+    append(&m, "# TYPE bloomd_command_latency_seconds histogram\n"
+               "# UNIT bloomd_command_latency_seconds seconds\n"
+               "# HELP bloomd_command_latency_seconds Latency of the commands.\n");
+    for (int i=0; i < LAT_NUM; i++) format_latency(&m, i);
+    append(&m, "# EOF\n");
+
+    if (m.err) {
+        free(m.buf);
+        return -1;
+    }
+    *out = m.buf;
+    return m.len;
+}
+
+/**
+ * Appends formatted text to the buffer, growing it as needed
+ */
+static void append(metrics_buf *out, const char *fmt, ...) {
+    if (out->err) return;
+    va_list args;
+    while (1) {
+        va_start(args, fmt);
+        int n = vsnprintf(out->buf + out->len, out->size - out->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            out->err = 1;
+            return;
+        }
+        if (n < out->size - out->len) {
+            out->len += n;
+            return;
+        }
+
+        // Grow and retry
+        char *buf = realloc(out->buf, out->size * 2);
+        if (!buf) {
+            out->err = 1;
+            return;
+        }
+        out->buf = buf;
+        out->size *= 2;
+    }
+}
+
+/**
+ * Formats a counter family with a single sample
+ */
+static void format_counter(metrics_buf *out, const char *name, const char *help, int64_t value) {
+    append(out, "# TYPE %s counter\n# HELP %s %s\n%s_total %lld\n",
+            name, name, help, name, (long long)value);
+}
+
+/**
+ * Formats a gauge family with a single sample
+ */
+static void format_gauge(metrics_buf *out, const char *name, const char *help, int64_t value) {
+    append(out, "# TYPE %s gauge\n# HELP %s %s\n%s %lld\n",
+            name, name, help, name, (long long)value);
+}
+
+/**
+ * Formats the latency histogram of a command. Buckets are
+ * emitted at each power of 2 of microseconds, summing the
+ * finer buckets of the histogram below it.
+ */
+static void format_latency(metrics_buf *out, bloom_latency cmd) {
+    latency_histogram hist;
+    stats_read_latency(cmd, &hist);
+
+    const char *name = LATENCY_NAMES[cmd];
+    uint64_t count = 0;
+    for (int i=0; i < HIST_BUCKETS; i++) {
+        count += hist.counts[i];
+        if ((i + 1) % HIST_SUB_BUCKETS) continue;
+        append(out, "bloomd_command_latency_seconds_bucket{command=\"%s\",le=\"%.6f\"} %llu\n",
+                name, (hist_bucket_highest(i) + 1) / 1e6, (unsigned long long)count);
+    }
+    append(out, "bloomd_command_latency_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n"
+                "bloomd_command_latency_seconds_count{command=\"%s\"} %llu\n"
+                "bloomd_command_latency_seconds_sum{command=\"%s\"} %.6f\n",
+            name, (unsigned long long)count,
+            name, (unsigned long long)count,
+            name, hist.sum / 1e6);
+}
@@ -0,0 +1,27 @@
+#ifndef BLOOM_METRICS_H
+#define BLOOM_METRICS_H
+#include "filter_manager.h"
+
+/**
+ * Formats the server wide statistics for scraping, in the
+ * OpenMetrics text format. Everything is read from the per
+ * thread counters and histograms, and from the filter manager
+ * state, so no filter is locked or walked.
+ */
+
+/**
+ * The content type of the formatted metrics
+ */
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/**
+ * Formats the metrics of the server.
+ * @notes Thread safe.
+ * @arg mgr The filter manager
+ * @arg out Output, set to the formatted metrics.
+ * The memory should be free'd by the caller.
+ * @return The length of the metrics, or -1 on error.
+ */
+int metrics_format(bloom_filtmgr *mgr, char **out);
+
+#endif
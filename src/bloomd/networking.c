@@ -18,6 +18,7 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <sys/uio.h>
@@ -26,9 +27,18 @@
 #include <limits.h>
 #include <math.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "conn_handler.h"
 #include "spinlock.h"
 #include "barrier.h"
+#include "stats.h"
+#include "metrics.h"
+#include "cluster.h"
+#include "shm_ring.h"
+#include "accept_ring.h"
+#include "clients.h"
 
 
 /**
@@ -54,6 +64,44 @@
  */
 #define CONN_BUF_MULTIPLIER 8
 
+/**
+ * Closed connections are kept on a free list per thread, up
+ * to CONN_POOL_SIZE, with their buffers back at the initial
+ * size, so that short lived clients do not churn the allocator.
+ * Buffers a large command grew past CONN_BUF_SHRINK_SIZE are
+ * shrunk back to the initial size once they are drained.
+ */
+#define CONN_POOL_SIZE 256
+#define CONN_BUF_SHRINK_SIZE (INIT_CONN_BUF_SIZE * CONN_BUF_MULTIPLIER * CONN_BUF_MULTIPLIER)
+
+/**
+ * The buffers of a connection that read nothing for this many
+ * periodic ticks are shrunk back to the initial size, so idle
+ * clients do not pin the buffers of their past commands.
+ */
+#define IDLE_SHRINK_TICKS 40
+
+/**
+ * Sent to the clients rejected over max_connections
+ */
+static const char TOO_MANY_CONNS[] = "Client Error: Too many connections\n";
+
+/**
+ * The responses to the commands of one read are gathered
+ * and written together. Once this many bytes are gathered
+ * they are written early, so large listings stream out.
+ */
+#define CORK_FLUSH_SIZE 65536
+
+
+/**
+ * The most commands handled for a connection before it
+ * yields to the other clients of its worker. Reading from
+ * a connection stops while its unsent output is above
+ * OUTPUT_HIGH_WATER, until the output is written.
+ */
+#define CONN_CMD_BUDGET 1024
+#define OUTPUT_HIGH_WATER (4 * CORK_FLUSH_SIZE)
 
 /**
  * This defines how often we invoke the
@@ -63,21 +111,125 @@
  */
 #define PERIODIC_TIME_SEC 0.25
 
+/**
+ * The longest metrics request read, and how
+ * long a metrics client has to read its response.
+ */
+#define METRICS_REQUEST_SIZE 4096
+#define METRICS_TIMEOUT_SEC 5.0
+
+/**
+ * The largest UDP datagram read, and how many datagrams
+ * are read with each call. Longer datagrams are dropped.
+ */
+#define UDP_MAX_DATAGRAM 65536
+#define UDP_BATCH_SIZE 16
+
+/**
+ * The most batches read before returning to the event
+ * loop, so that TCP clients of the worker are not starved.
+ */
+#define UDP_MAX_BATCHES 4
+
+/**
+ * The most clients a worker accepts before returning
+ * to the event loop, so that its clients are not starved.
+ */
+#define MAX_ACCEPTS 16
+
+/**
+ * The commands forwarded from one worker to another with
+ * filter_affinity, before the forwarding worker handles
+ * them itself instead of waiting for the owner.
+ */
+#define AFFINE_RING_SIZE 256
+
+// Hashes filter names to their owning workers, provided by libbloom
+extern void WyHash128(const void *key, uint64_t len, uint64_t seed, uint64_t *out);
+
+/**
+ * Load is counted in connection equivalents. The load of a
+ * worker is its connections, plus one for each LOAD_TICK_BYTES
+ * read and each LOAD_LAG_SEC of event loop lag in its last
+ * periodic tick. Clients are only placed away from the worker
+ * that accepts them if it is LOAD_SLACK above the least loaded.
+ */
+#define LOAD_TICK_BYTES (256 * 1024)
+#define LOAD_LAG_SEC 0.005
+#define LOAD_SLACK 2
+
+/**
+ * The periodic ticks a worker must stay LOAD_SLACK above
+ * the least loaded before it migrates a busy connection.
+ */
+#define MIGRATE_TICKS 4
+
+/**
+ * The most bytes of a file sent to a client in one write,
+ * so that the other clients of the worker are not held up.
+ */
+#define SEND_FILE_CHUNK (1024 * 1024)
+
+
+/**
+ * The most response buffers prefixed with a tag in one
+ * write, more are written after the tag
+ */
+#define TAG_MAX_BUFS 8
 
 /**
  * Stores the worker thread specific user data.
  */
 typedef struct conn_info conn_info;
+typedef struct udp_batch udp_batch;
+typedef struct tagged_command tagged_command;
 typedef struct {
     bloom_networking *netconf;
     ev_loop *loop;
-    int pipefd[2];
-    ev_io pipe_client;
+    int id;             // Index in netconf->workers
+    ev_async notify;        // Wakes the worker for handoffs or to quit
+    conn_info *handoffs;    // Connections handed to the worker, newest first
+    int quit;               // Set by another thread to stop the worker
     ev_timer periodic;
     int should_run;
 
     // Used to free inactive connections
     conn_info *inactive;
+
+    // The connections scheduled on the worker, linked by client_next
+    conn_info *clients;
+
+    // Connections parked while their filters are faulted in
+    int faults;             // Faults in flight, the worker waits for them on exit
+    conn_info *faulted;     // Connections whose faults completed, newest first
+    tagged_command *tagged; // Tagged commands whose faults completed, newest first
+
+    // Accepts on the TCP listener of the worker, with SO_REUSEPORT
+    ev_io tcp_client;
+    bloom_accept_ring *accept_ring; // Accepts for tcp_client, or NULL
+
+    // Load signals read by the other threads. The connections
+    // are counted by the thread that places them on the worker.
+    int conns;
+    int64_t tick_load;      // Load of the bytes read and lag in the last tick
+
+    // Measures the load of the current tick
+    uint64_t tick_bytes;    // Bytes read in the current tick
+    unsigned tick;          // Number of the current tick
+    ev_tstamp last_tick;    // Loop time of the last tick, 0 if none
+    int overloaded_ticks;   // Consecutive ticks above the least loaded
+    int shedding;           // Lagged over shed_lag_msec in the last tick
+    int migrate_to;         // Worker to migrate a busy connection to, or -1
+
+    // Clients that became readable in this pass of the loop, with
+    // group_checks. Their checks are gathered once the pass is done.
+    ev_check gather;
+    conn_info *ready;       // Newest first, linked by ready_next
+
+    // Reads the UDP socket of the worker, if it has one
+    ev_io udp_client;
+    udp_batch *udp;
+    conn_info *udp_conn;    // Discards the responses
 } worker_ev_userdata;
 
 /**
@@ -90,6 +242,19 @@ typedef struct {
     char *buffer;
 } circular_buffer;
 
+/**
+ * Represents a linear buffer, used for input. Unread data
+ * is moved to the front before reads when the tail runs low,
+ * so a complete command is always contiguous and can be
+ * parsed in place.
+ */
+typedef struct {
+    uint32_t write_cursor;
+    uint32_t read_cursor;
+    uint32_t buf_size;
+    char *buffer;
+} linear_buffer;
+
 /**
  * Stores the connection specific data.
  * We initialize one of these per connection
@@ -108,21 +273,162 @@ typedef struct {
  * allows us to minimize copies and latency for most
  * clients, while still supporting the massive bulk
  * loads.
+ *
+ * While the input of a read is handled, the connection
+ * is corked and responses are gathered in the circular
+ * buffer, so a pipelining client gets a single write.
+ * Large batches are written early with MSG_MORE, so
+ * the kernel still sends full segments.
+ *
+ * A connection with more commands than its budget
+ * stops reading, and its idle watcher handles the rest
+ * once the other clients of the worker had their turn.
+ *
+ * A command on a filter that is not in memory parks the
+ * connection, which stops reading while the filter is
+ * faulted in on a fault thread. The command stays in
+ * place in the input buffer, and is handled first once
+ * the fault completes and the connection resumes.
+ *
+ * An admin command parks the connection in the same way, and
+ * is handled on an admin thread. Its responses are gathered
+ * aside, and written by the worker once the connection resumes.
+ *
+ * A file sent to a client, such as a dump, is sent by the write
+ * watcher once the output before it is written, and the client
+ * stops reading until it is. A file received from a client takes
+ * its input as it is read, and leaves a command once complete.
+ *
+ * A client on the Unix socket can move to a pair of shared memory
+ * rings. The read watcher then waits on the eventfd rung for its
+ * requests, and the write watcher on the eventfd rung once there
+ * is room for its responses. The socket only signals the close.
  */
 struct conn_info {
     worker_ev_userdata *thread_ev;
     int active;
 
     ev_io client;
-    circular_buffer input;
+    ev_idle resume;     // Handles the input left over by a yield
+    linear_buffer input;
+    int binary;         // Uses the binary protocol
+    int noreply;        // Sets are only answered on errors
+    int peer;           // From another node, commands are never proxied
+    int datagram;       // Handles UDP datagrams, responses are discarded
+    int local;          // Accepted on the Unix socket
+    bloom_shm_ring *shm;    // Rings of the requests and responses, or NULL
+    ev_io hangup;       // Watches the socket of a client on the rings
+    bloom_filtmgr_cache filter_cache;   // Last filter used
+    int parked;         // Waits on a fault, freed on its completion if closed
+    int parked_type;    // Command left by a park, or -1
+    char *parked_args;  // Arguments of the command, in the input buffer
+    int parked_args_len;
+    int deferring;      // Responses are gathered for the worker, on an admin thread
+    char *deferred;     // Responses gathered on an admin thread
+    int deferred_len;
+    int deferred_size;
+    int ahead_type;     // Command read ahead by the worker owning a filter, or -1
+    char *ahead_args;   // Arguments of the command, in the input buffer
+    int ahead_args_len;
+    int send_fd;        // File sent after the output, or -1
+    off_t send_offset;
+    uint64_t send_left;
+    int deferred_fd;    // File sent after the deferred responses, or -1
+    uint64_t deferred_fd_len;
+    int recv_fd;        // File taking the input, or -1 to drop it
+    char *recv_path;    // Deleted if the input ends early
+    uint64_t recv_left; // Input bytes left to receive
+    int recv_type;      // Command left once the file is received
+    char *recv_args;    // Arguments of the command, owned by the connection
+    int recv_args_len;
+    uint64_t tick_bytes;    // Bytes read in the tick of the worker
+    unsigned tick;          // Tick of the worker tick_bytes is from
+    int deadline_msec;      // Commands waiting longer are answered Timeout, or 0
+    char *tag;              // Tag prefixed to the next response, or NULL
+    int tag_len;
+    int tagged_pending;     // Tagged commands waiting on faults, the connection is freed after them
+    tagged_command *tagged_ready;   // Tagged commands to handle, oldest first
+    tagged_command *tagged_ready_tail;
+    tagged_command *tagged_running; // The tagged command handled last, freed with the next
+    int timestamps;         // Reads take the receive time of the kernel
+    uint64_t arrival_usec;  // Unix time the oldest unhandled input arrived
+    uint64_t read_usec;     // Unix time the input of the last read arrived
+    char client_name[CLIENT_NAME + 1];  // Name the usage is counted under, empty if none
+    bloom_client_usage usage;           // Usage not yet counted under the name
 
     int use_write_buf;
+    int corked;         // Responses are gathered until the input is handled
     ev_io write_client;
     circular_buffer output;
 
-    struct conn_info *next;
+    struct conn_info *next;     // Links the inactive list, or the handoffs of a worker
+    struct conn_info *client_next;      // Links the clients of the worker
+    struct conn_info **client_pprev;    // The link to this client, NULL if not scheduled
+    int ready;                  // On the ready list of the worker
+    struct conn_info *ready_next;
+};
+
+/**
+ * A tagged command on a filter that is not in memory. It waits
+ * for the fault on its own, while the commands after it on the
+ * connection are handled, so it owns a copy of its line.
+ */
+struct tagged_command {
+    conn_info *conn;
+    worker_ev_userdata *worker;     // The worker of the connection when parked
+    int type;
+    char *args;         // Arguments of the command, NUL terminated
+    int args_len;
+    char *tag;          // The tag, with its '#'
+    int tag_len;
+    struct tagged_command *next;
+};
+
+/**
+ * The buffers of a batch of UDP datagrams. Each
+ * buffer has room to NUL terminate its datagram.
+ */
+struct udp_batch {
+    uint32_t kernel_drops;  // Drops last reported by the kernel
+    int lens[UDP_BATCH_SIZE];
+    int flags[UDP_BATCH_SIZE];
+#ifdef __linux__
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+#else
+    struct msghdr msgs[UDP_BATCH_SIZE];
+#endif
+    struct iovec iovecs[UDP_BATCH_SIZE];
+    char control[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(uint32_t))];
+    char bufs[UDP_BATCH_SIZE][UDP_MAX_DATAGRAM + 1];
 };
 
+/**
+ * Forwards the connections of one worker to the worker owning
+ * the filters of their commands, with filter_affinity. Only the
+ * forwarding worker moves the tail, and only the owner moves the
+ * head, so neither takes a lock. They are on their own cache lines.
+ */
+typedef struct {
+    unsigned head __attribute__ ((aligned (64)));   // Next taken by the owner
+    unsigned tail __attribute__ ((aligned (64)));   // Next forwarded
+    conn_info *slots[AFFINE_RING_SIZE] __attribute__ ((aligned (64)));
+} affine_ring;
+
+/**
+ * Stores the state of a metrics scrape. Scrapes are served
+ * on the main loop, one request per connection, so they share
+ * nothing with the client connections of the workers.
+ */
+typedef struct {
+    ev_io client;
+    ev_timer timeout;
+    char request[METRICS_REQUEST_SIZE];
+    int request_len;
+    char *response;     // Set once the request is read
+    int response_len;
+    int sent;
+} metrics_conn;
+
 
 /**
  * Defines a structure that is
@@ -132,39 +438,140 @@ struct conn_info {
 struct bloom_networking {
     bloom_config *config;
     bloom_filtmgr *mgr;
+    bloom_cluster *cluster; // The cluster, or NULL
 
     int ev_mode;
     ev_loop *default_loop;
-    ev_io tcp_client;
-    ev_io udp_client;
+    ev_io tcp_client;       // Only started if the main thread accepts
+    bloom_accept_ring *accept_ring; // Accepts for tcp_client, or NULL
+    int *tcp_fds;           // TCP listeners, one per worker with SO_REUSEPORT
+    int num_tcp_fds;
+    int worker_accept;      // Workers accept on their own listeners
+    ev_io unix_client;      // Only started if unix_socket is set
+    int *udp_fds;           // UDP sockets, one per worker with SO_REUSEPORT
+    int num_udp_fds;
+    ev_io metrics_client;   // Only started if metrics_port is set
+    ev_timer main_periodic; // Wakes the main loop to check should_run
 
     barrier_t thread_barrier;
     pthread_t *threads; // Reference to all the workers
     worker_ev_userdata **workers;
     unsigned last_assign;    // Last thread we assigned to
+
+    // The workers before active_workers serve the clients. The
+    // others are parked, and hand their clients to the active ones.
+    int max_workers;                // Workers started, the most that can be active
+    int active_workers;             // Workers placed clients on
+
+    // Handle the admin commands of parked connections, in order
+    int num_admin_threads;
+    pthread_t *admin_threads;
+    int admin_run;                  // Cleared to stop the admin threads
+    pthread_mutex_t admin_lock;     // Protects the admin queue
+    pthread_cond_t admin_cond;      // Signaled when a command is queued, or to stop
+    conn_info *admin_queue;         // Oldest first, linked by next
+    conn_info *admin_tail;
+
+    // Forward the commands on a filter to the worker owning it
+    affine_ring *affine_rings;      // From worker i to j at j * workers + i, or NULL
+    int running_workers;            // Workers still in their event loop
+
+    bloom_bulk_pool *bulk;          // Runs large bulk commands in parallel, or NULL
+    int clients;                    // Client connections open, capped by max_connections
 };
 
 
+/**
+ * Listeners inherited from another process, used in
+ * place of opening new ones
+ */
+typedef struct {
+    int *fds;
+    int num;
+} inherited_listeners;
+static inherited_listeners INHERITED_TCP = {NULL, 0};
+static inherited_listeners INHERITED_UDP = {NULL, 0};
+
+// Closed connections kept for reuse by this thread, linked by next
+static __thread conn_info *CONN_POOL = NULL;
+static __thread int CONN_POOL_LEN = 0;
+
 // Static typedefs
 static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_worker_accept(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_new_unix_client(ev_loop *lp, ev_io *watcher, int ready_events);
+static conn_info* accept_client(bloom_networking *netconf, int listen_fd, bloom_accept_ring *ring, int tcp);
+static void start_accepting(ev_loop *lp, ev_io *watcher, void (*cb)(ev_loop*, ev_io*, int),
+        int listen_fd, bloom_accept_ring **ring);
+static void stop_accepting(ev_loop *lp, ev_io *watcher, bloom_accept_ring **ring);
+static void link_client(worker_ev_userdata *data, conn_info *conn);
+static void unlink_client(conn_info *conn);
+static void shrink_idle_clients(worker_ev_userdata *data);
+static int worker_load(worker_ev_userdata *data);
+static int least_loaded_worker(bloom_networking *netconf, unsigned start);
+static int worker_parked(worker_ev_userdata *data);
+static void drain_client(worker_ev_userdata *data, conn_info *conn);
+static void dispatch_client(worker_ev_userdata *data, conn_info *conn);
+static void plan_migration(worker_ev_userdata *data);
+static void migrate_client(worker_ev_userdata *data, conn_info *conn);
+static int open_tcp_socket(struct sockaddr_in *addr, int reuse_port);
+static int take_inherited_listener(inherited_listeners *inherited, struct sockaddr_in *addr);
+static void close_inherited_listeners(inherited_listeners *inherited);
+static void close_tcp_listener(bloom_networking *netconf);
+static void close_unix_listener(bloom_networking *netconf);
 static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events);
+static int open_udp_socket(struct sockaddr_in *addr, int reuse_port);
+static int read_udp_batch(int fd, udp_batch *batch);
+static void setup_worker_udp(worker_ev_userdata *data, int fd);
+static void close_worker_udp(worker_ev_userdata *data);
+static void handle_new_metrics_client(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_metrics_read(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_metrics_write(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_metrics_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static int prepare_metrics_response(bloom_networking *netconf, metrics_conn *conn);
+static void close_metrics_conn(ev_loop *lp, metrics_conn *conn);
 static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events);
 static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events);
+static ssize_t send_file_chunk(conn_info *conn);
+static void receive_file_input(conn_info *conn);
+static int drain_shm_output(conn_info *conn);
+static void handle_shm_hangup(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_client_resume(ev_loop *lp, ev_idle *watcher, int ready_events);
+static void handle_ready_clients(ev_loop *lp, ev_check *watcher, int ready_events);
+static void start_admin_threads(bloom_networking *netconf);
+static void stop_admin_threads(bloom_networking *netconf);
+static void* admin_thread_main(void *in);
+static int defer_client_response(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
+static int filter_owner(bloom_networking *netconf, char *filter_name);
+static void handle_affine_forwards(worker_ev_userdata *data);
+static void handle_fault_complete(void *data, int res);
+static void handle_tagged_fault_complete(void *data, int res);
+static void resume_tagged_commands(worker_ev_userdata *data);
+static void handle_client_input(ev_loop *lp, conn_info *conn);
 static int read_client_data(conn_info *conn);
-static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events);
+static ssize_t read_stamped(conn_info *conn, char *buf, size_t len, uint64_t *usec);
+static void enable_timestamps(conn_info *conn);
+static void handle_worker_notification(ev_loop *lp, ev_async *watcher, int ready_events);
 static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_main_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void reload_config(bloom_networking *netconf, char *config_file);
 
 static void close_client_connection(conn_info *conn);
+static void count_client_usage(conn_info *conn);
 static void deactivate_client_connection(conn_info *conn);
 
 // Helpers for send_client_response
 static int send_client_response_buffered(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
 static int send_client_response_direct(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs);
+static int flush_client_output(conn_info *conn, int more);
 
 
 // Utility methods
-static int set_client_sockopts(int client_fd);
+static int accept_nonblock(int listen_fd, struct sockaddr *addr, socklen_t *addr_len);
+static int set_client_sockopts(int client_fd, int tcp);
 static conn_info* get_conn();
+static void put_conn(conn_info *conn);
+static void shrink_client_buffers(conn_info *conn, uint64_t max_size);
 
 
 // Circular buffer method
@@ -172,14 +579,21 @@ static void circbuf_init(circular_buffer *buf);
 static void circbuf_free(circular_buffer *buf);
 static uint64_t circbuf_avail_buf(circular_buffer *buf);
 static void circbuf_grow_buf(circular_buffer *buf);
-static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
 static void circbuf_setup_writev_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
-static void circbuf_advance_write(circular_buffer *buf, uint64_t bytes);
 static void circbuf_advance_read(circular_buffer *buf, uint64_t bytes);
 static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes);
+static void linbuf_init(linear_buffer *buf);
+static void linbuf_free(linear_buffer *buf);
+static void linbuf_reserve(linear_buffer *buf);
+static void linbuf_shrink(linear_buffer *buf, uint64_t max_size);
+static void circbuf_shrink(circular_buffer *buf, uint64_t max_size);
 
 /**
- * Initializes the TCP listener
+ * Initializes the TCP listener. With SO_REUSEPORT each
+ * worker gets a listener of its own and accepts directly,
+ * so the kernel balances the connections between them.
+ * Otherwise the main thread accepts on a single listener,
+ * and hands the clients to the workers.
  * @arg netconf The network configuration
  * @return 0 on success.
  */
@@ -198,35 +612,159 @@ static int setup_tcp_listener(bloom_networking *netconf) {
     }
     addr.sin_addr = bind_addr;
 
-    // Make the socket, bind and listen
+#ifdef SO_REUSEPORT
+    netconf->worker_accept = 1;
+    int num_fds = netconf->max_workers;
+#else
+    netconf->worker_accept = 0;
+    int num_fds = 1;
+#endif
+    netconf->tcp_fds = calloc(num_fds, sizeof(int));
+    if (!netconf->tcp_fds) return 1;
+
+    // Make the sockets, bind and listen
+    for (int i=0; i < num_fds; i++) {
+        int fd = take_inherited_listener(&INHERITED_TCP, &addr);
+        if (fd < 0) fd = open_tcp_socket(&addr, netconf->worker_accept);
+        if (fd < 0) {
+            for (int j=0; j < i; j++) close(netconf->tcp_fds[j]);
+            free(netconf->tcp_fds);
+            netconf->tcp_fds = NULL;
+            return 1;
+        }
+        netconf->tcp_fds[i] = fd;
+    }
+    netconf->num_tcp_fds = num_fds;
+    close_inherited_listeners(&INHERITED_TCP);
+
+    // The workers start accepting once they are registered
+    if (netconf->worker_accept) return 0;
+
+    // Create the libev objects
+    start_accepting(netconf->default_loop, &netconf->tcp_client, handle_new_client,
+                netconf->tcp_fds[0], &netconf->accept_ring);
+    return 0;
+}
+
+/**
+ * Opens a non-blocking TCP listener bound to an address.
+ * @arg addr The address to bind to
+ * @arg reuse_port Should SO_REUSEPORT be set
+ * @return The socket, or -1 on error.
+ */
+static int open_tcp_socket(struct sockaddr_in *addr, int reuse_port) {
     int tcp_listener_fd = socket(PF_INET, SOCK_STREAM, 0);
     int optval = 1;
     if (setsockopt(tcp_listener_fd, SOL_SOCKET,
                 SO_REUSEADDR, &optval, sizeof(optval))) {
         syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
     }
-    if (bind(tcp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+#ifdef SO_REUSEPORT
+    if (reuse_port && setsockopt(tcp_listener_fd, SOL_SOCKET,
+                SO_REUSEPORT, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEPORT! Err: %s", strerror(errno));
+        close(tcp_listener_fd);
+        return -1;
+    }
+#else
+    (void)reuse_port;
+#endif
+    if (fcntl(tcp_listener_fd, F_SETFL, fcntl(tcp_listener_fd, F_GETFL, 0) | O_NONBLOCK)) {
+        syslog(LOG_ERR, "Failed to set O_NONBLOCK on TCP socket! Err: %s", strerror(errno));
+        close(tcp_listener_fd);
+        return -1;
+    }
+    if (bind(tcp_listener_fd, (struct sockaddr*)addr, sizeof(*addr)) != 0) {
         syslog(LOG_ERR, "Failed to bind on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
     }
     if (listen(tcp_listener_fd, BACKLOG_SIZE) != 0) {
         syslog(LOG_ERR, "Failed to listen on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
+        return -1;
+    }
+    return tcp_listener_fd;
+}
+
+/**
+ * Stops accepting on the main thread, if it
+ * accepts, and closes the TCP listeners.
+ * @arg netconf The network configuration
+ */
+static void close_tcp_listener(bloom_networking *netconf) {
+    if (!netconf->worker_accept) stop_accepting(netconf->default_loop, &netconf->tcp_client, &netconf->accept_ring);
+    for (int i=0; i < netconf->num_tcp_fds; i++) close(netconf->tcp_fds[i]);
+    free(netconf->tcp_fds);
+    netconf->tcp_fds = NULL;
+    netconf->num_tcp_fds = 0;
+}
+
+/**
+ * Initializes the Unix socket listener, if one is configured.
+ * The main thread accepts on it, and hands the clients to the
+ * workers. The socket of a previous bloomd is replaced.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_unix_listener(bloom_networking *netconf) {
+    char *path = netconf->config->unix_socket;
+    if (!path) return 0;
+
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // Make the socket, bind and listen
+    unlink(path);
+    int unix_listener_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unix_listener_fd < 0) {
+        syslog(LOG_ERR, "Failed to create the Unix socket! Err: %s", strerror(errno));
+        return 1;
+    }
+    if (fcntl(unix_listener_fd, F_SETFL, fcntl(unix_listener_fd, F_GETFL, 0) | O_NONBLOCK)) {
+        syslog(LOG_ERR, "Failed to set O_NONBLOCK on Unix socket! Err: %s", strerror(errno));
+        close(unix_listener_fd);
+        return 1;
+    }
+    if (bind(unix_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on Unix socket %s! Err: %s", path, strerror(errno));
+        close(unix_listener_fd);
+        return 1;
+    }
+    if (listen(unix_listener_fd, BACKLOG_SIZE) != 0) {
+        syslog(LOG_ERR, "Failed to listen on Unix socket %s! Err: %s", path, strerror(errno));
+        close(unix_listener_fd);
         return 1;
     }
 
     // Create the libev objects
-    ev_io_init(&netconf->tcp_client, handle_new_client,
-                tcp_listener_fd, EV_READ);
-    ev_io_start(netconf->default_loop, &netconf->tcp_client);
+    ev_io_init(&netconf->unix_client, handle_new_unix_client,
+                unix_listener_fd, EV_READ);
+    ev_io_start(netconf->default_loop, &netconf->unix_client);
     return 0;
 }
 
 /**
- * Initializes the UDP Listener.
+ * Stops accepting on the Unix socket, and closes it. The
+ * socket file is left, a restarted bloomd replaces it.
+ * @arg netconf The network configuration
+ */
+static void close_unix_listener(bloom_networking *netconf) {
+    if (!netconf->config->unix_socket) return;
+    ev_io_stop(netconf->default_loop, &netconf->unix_client);
+    close(netconf->unix_client.fd);
+}
+
+/**
+ * Initializes the UDP Listener. With SO_REUSEPORT each
+ * worker gets a socket of its own, and the kernel spreads
+ * the datagrams between them. Otherwise the first worker
+ * reads a single socket. The workers start reading once
+ * they are registered.
  * @arg netconf The network configuration
  * @return 0 on success.
  */
@@ -245,25 +783,153 @@ static int setup_udp_listener(bloom_networking *netconf) {
     }
     addr.sin_addr = bind_addr;
 
-    // Make the socket, bind and listen
+#ifdef SO_REUSEPORT
+    int num_fds = netconf->config->worker_threads;
+#else
+    int num_fds = 1;
+#endif
+    netconf->udp_fds = calloc(num_fds, sizeof(int));
+    if (!netconf->udp_fds) return 1;
+
+    // Make the sockets and bind them
+    for (int i=0; i < num_fds; i++) {
+        int fd = take_inherited_listener(&INHERITED_UDP, &addr);
+        if (fd < 0) fd = open_udp_socket(&addr, num_fds > 1);
+        if (fd < 0) {
+            for (int j=0; j < i; j++) close(netconf->udp_fds[j]);
+            free(netconf->udp_fds);
+            netconf->udp_fds = NULL;
+            return 1;
+        }
+        netconf->udp_fds[i] = fd;
+    }
+    netconf->num_udp_fds = num_fds;
+    close_inherited_listeners(&INHERITED_UDP);
+    return 0;
+}
+
+/**
+ * Takes an inherited listener bound to an address. The
+ * listeners bound elsewhere, as after a change of port,
+ * are closed.
+ * @arg inherited The inherited listeners
+ * @arg addr The address to listen on
+ * @return The listener, or -1 if there is none.
+ */
+static int take_inherited_listener(inherited_listeners *inherited, struct sockaddr_in *addr) {
+    struct sockaddr_in bound;
+    socklen_t len;
+    while (inherited->num) {
+        int fd = inherited->fds[--inherited->num];
+        len = sizeof(bound);
+        if (!getsockname(fd, (struct sockaddr*)&bound, &len) && len == sizeof(bound) &&
+                bound.sin_port == addr->sin_port &&
+                bound.sin_addr.s_addr == addr->sin_addr.s_addr) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+/**
+ * Closes the inherited listeners that were not taken
+ */
+static void close_inherited_listeners(inherited_listeners *inherited) {
+    for (int i=0; i < inherited->num; i++) close(inherited->fds[i]);
+    free(inherited->fds);
+    inherited->fds = NULL;
+    inherited->num = 0;
+}
+
+/**
+ * Opens a non-blocking UDP socket bound to an address.
+ * @arg addr The address to bind to
+ * @arg reuse_port Should SO_REUSEPORT be set
+ * @return The socket, or -1 on error.
+ */
+static int open_udp_socket(struct sockaddr_in *addr, int reuse_port) {
     int udp_listener_fd = socket(PF_INET, SOCK_DGRAM, 0);
     int optval = 1;
     if (setsockopt(udp_listener_fd, SOL_SOCKET,
                 SO_REUSEADDR, &optval, sizeof(optval))) {
         syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(udp_listener_fd);
-        return 1;
+        return -1;
+    }
+#ifdef SO_REUSEPORT
+    if (reuse_port && setsockopt(udp_listener_fd, SOL_SOCKET,
+                SO_REUSEPORT, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEPORT! Err: %s", strerror(errno));
+        close(udp_listener_fd);
+        return -1;
     }
-    if (bind(udp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+#endif
+#ifdef SO_RXQ_OVFL
+    // Have the kernel report the datagrams it drops
+    if (setsockopt(udp_listener_fd, SOL_SOCKET,
+                SO_RXQ_OVFL, &optval, sizeof(optval))) {
+        syslog(LOG_WARNING, "Failed to set SO_RXQ_OVFL! Err: %s", strerror(errno));
+    }
+#endif
+    if (fcntl(udp_listener_fd, F_SETFL, fcntl(udp_listener_fd, F_GETFL, 0) | O_NONBLOCK)) {
+        syslog(LOG_ERR, "Failed to set O_NONBLOCK on UDP socket! Err: %s", strerror(errno));
+        close(udp_listener_fd);
+        return -1;
+    }
+    if (bind(udp_listener_fd, (struct sockaddr*)addr, sizeof(*addr)) != 0) {
         syslog(LOG_ERR, "Failed to bind on UDP socket! Err: %s", strerror(errno));
         close(udp_listener_fd);
+        return -1;
+    }
+    return udp_listener_fd;
+}
+
+/**
+ * Initializes the metrics listener, which serves
+ * the metrics over HTTP.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_metrics_listener(bloom_networking *netconf) {
+    struct sockaddr_in addr;
+    struct in_addr bind_addr;
+    bzero(&addr, sizeof(addr));
+    bzero(&bind_addr, sizeof(bind_addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(netconf->config->metrics_port);
+
+    int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
+    if (ret != 1) {
+        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
+        return 1;
+    }
+    addr.sin_addr = bind_addr;
+
+    // Make the socket, bind and listen
+    int metrics_listener_fd = socket(PF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    if (setsockopt(metrics_listener_fd, SOL_SOCKET,
+                SO_REUSEADDR, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
+        close(metrics_listener_fd);
+        return 1;
+    }
+    if (bind(metrics_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on metrics socket! Err: %s", strerror(errno));
+        close(metrics_listener_fd);
+        return 1;
+    }
+    if (listen(metrics_listener_fd, BACKLOG_SIZE) != 0) {
+        syslog(LOG_ERR, "Failed to listen on metrics socket! Err: %s", strerror(errno));
+        close(metrics_listener_fd);
         return 1;
     }
 
     // Create the libev objects
-    ev_io_init(&netconf->udp_client, handle_new_udp_mesg,
-                udp_listener_fd, EV_READ);
-    ev_io_start(netconf->default_loop, &netconf->udp_client);
+    ev_io_init(&netconf->metrics_client, handle_new_metrics_client,
+                metrics_listener_fd, EV_READ);
+    ev_io_start(netconf->default_loop, &netconf->metrics_client);
     return 0;
 }
 
@@ -280,15 +946,35 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
     // Initialize
     netconf->config = config;
     netconf->mgr = mgr;
-    netconf->workers = calloc(config->worker_threads, sizeof(worker_ev_userdata*));
+    netconf->max_workers = networking_max_workers(config);
+    netconf->active_workers = config->worker_threads;
+    netconf->workers = calloc(netconf->max_workers, sizeof(worker_ev_userdata*));
     if (!netconf->workers) {
         free(netconf);
         perror("Failed to calloc() for worker threads");
         return 1;
     }
 
+    // Join the cluster, if there is one
+    if (config->cluster_nodes && *config->cluster_nodes) {
+        if (init_cluster(config, &netconf->cluster)) {
+            free(netconf->workers);
+            free(netconf);
+            return 1;
+        }
+        cluster_check_placement(netconf->cluster, mgr);
+    }
+
+    // Give each pair of workers a ring to forward commands through
+    netconf->running_workers = netconf->max_workers;
+    if (config->filter_affinity && netconf->max_workers > 1) {
+        size_t size = netconf->max_workers * netconf->max_workers * sizeof(affine_ring);
+        if (posix_memalign((void**)&netconf->affine_rings, 64, size)) abort();
+        memset(netconf->affine_rings, 0, size);
+    }
+
     // Setup the barrier
-    if (barrier_init(&netconf->thread_barrier, config->worker_threads + 1)) {
+    if (barrier_init(&netconf->thread_barrier, netconf->max_workers + 1)) {
         free(netconf->workers);
         free(netconf);
         return 1;
@@ -319,17 +1005,44 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
         return 1;
     }
 
-    // Setup the UDP listener
+    // Setup the UDP sockets
     res = setup_udp_listener(netconf);
     if (res != 0) {
-        ev_io_stop(netconf->default_loop, &netconf->tcp_client);
-        close(netconf->tcp_client.fd);
+        close_tcp_listener(netconf);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup the metrics listener, if enabled
+    if (config->metrics_port > 0) {
+        res = setup_metrics_listener(netconf);
+        if (res != 0) {
+            close_tcp_listener(netconf);
+            for (int i=0; i < netconf->num_udp_fds; i++) close(netconf->udp_fds[i]);
+            free(netconf->udp_fds);
+            free(netconf);
+            return 1;
+        }
+    }
+
+    // Setup the Unix socket listener, if enabled
+    res = setup_unix_listener(netconf);
+    if (res != 0) {
+        close_tcp_listener(netconf);
+        for (int i=0; i < netconf->num_udp_fds; i++) close(netconf->udp_fds[i]);
+        free(netconf->udp_fds);
+        if (config->metrics_port > 0) {
+            ev_io_stop(netconf->default_loop, &netconf->metrics_client);
+            close(netconf->metrics_client.fd);
+        }
         free(netconf);
         return 1;
     }
 
     // Prepare the conn handlers
     init_conn_handler();
+    start_admin_threads(netconf);
+    if (config->bulk_threads > 0) init_bulk_pool(mgr, config->bulk_threads, &netconf->bulk);
 
     // Success!
     *netconf_out = netconf;
@@ -338,617 +1051,2605 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
 
 
 /**
- * Invoked when a TCP listening socket fd is ready
- * to accept a new client. Accepts the client, initializes
- * the connection buffers, and prepares to start listening
- * for client data
+ * Invoked when the TCP listening socket of the main thread
+ * is ready to accept a new client, which is only the case
+ * without SO_REUSEPORT. Accepts the client, and dispatches
+ * it to the least loaded worker thread to start listening
+ * for client data.
  */
 static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
     // Get the network configuration
     bloom_networking *netconf = ev_userdata(lp);
 
     // Accept the client connection
-    struct sockaddr_in client_addr;
-    int client_addr_len = sizeof(client_addr);
-    int client_fd = accept(watcher->fd,
-                        (struct sockaddr*)&client_addr,
-                        &client_addr_len);
+    conn_info *conn = accept_client(netconf, watcher->fd, netconf->accept_ring, 1);
+    if (!conn) return;
 
-    // Check for an error
-    if (client_fd == -1) {
-        syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
-        return;
-    }
+    // Dispatch this client to a worker thread, rotating
+    // the first worker checked so that ties are spread
+    unsigned start = netconf->last_assign++;
+    dispatch_client(netconf->workers[least_loaded_worker(netconf, start)], conn);
+}
 
-    // Setup the socket
-    if (set_client_sockopts(client_fd)) {
-        return;
-    }
 
-    // Debug info
-    syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
-            inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
+/**
+ * Invoked when the Unix socket is ready to accept a new
+ * client. The client is dispatched to the least loaded
+ * worker, like a TCP client accepted on the main thread.
+ */
+static void handle_new_unix_client(ev_loop *lp, ev_io *watcher, int ready_events) {
+    bloom_networking *netconf = ev_userdata(lp);
+    conn_info *conn = accept_client(netconf, watcher->fd, NULL, 0);
+    if (!conn) return;
+    conn->local = 1;
 
-    // Get the associated conn object
-    conn_info *conn = get_conn();
+    unsigned start = netconf->last_assign++;
+    dispatch_client(netconf->workers[least_loaded_worker(netconf, start)], conn);
+}
 
-    // Initialize the libev stuff
-    ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
-    ev_io_init(&conn->write_client, handle_client_writebuf, client_fd, EV_WRITE);
 
-    // Dispatch this client to a worker thread
-    int next_thread = netconf->last_assign++ % netconf->config->worker_threads;
-    worker_ev_userdata *data = netconf->workers[next_thread];
+/**
+ * Invoked when the TCP listening socket of a worker is
+ * ready to accept new clients. The clients are scheduled
+ * directly on the worker, without a handoff, unless it is
+ * well above the least loaded worker.
+ */
+static void handle_worker_accept(ev_loop *lp, ev_io *watcher, int ready_events) {
+    worker_ev_userdata *data = ev_userdata(lp);
+    bloom_networking *netconf = data->netconf;
+    for (int i=0; i < MAX_ACCEPTS; i++) {
+        conn_info *conn = accept_client(netconf, watcher->fd, data->accept_ring, 1);
+        if (!conn) break;
+
+        // Place the client on the least loaded worker, checking
+        // this worker first so that it keeps the client on a tie.
+        // A parked worker keeps none of the clients it accepts.
+        worker_ev_userdata *least = netconf->workers[least_loaded_worker(netconf, data->id)];
+        if (least != data && (worker_load(least) + LOAD_SLACK < worker_load(data) || worker_parked(data))) {
+            dispatch_client(least, conn);
+            continue;
+        }
 
-    // Sent accept along with the connection
-    write(data->pipefd[1], "a", 1);
-    write(data->pipefd[1], &conn, sizeof(conn_info*));
+        // Schedule this connection on this thread
+        __atomic_add_fetch(&data->conns, 1, __ATOMIC_RELAXED);
+        conn->thread_ev = data;
+        link_client(data, conn);
+        ev_io_start(lp, &conn->client);
+    }
 }
 
 
 /**
- * Invoked to handle new UDP messages being available.
+ * Returns the load of a worker, in connection equivalents.
+ * @notes Thread safe.
  */
-static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // TODO: Handle UDP clients
-    syslog(LOG_WARNING, "UDP clients not currently supported!");
+static int worker_load(worker_ev_userdata *data) {
+    return __atomic_load_n(&data->conns, __ATOMIC_RELAXED) +
+           __atomic_load_n(&data->tick_load, __ATOMIC_RELAXED);
 }
 
 
 /**
- * Invoked when a client connection has data ready to be read.
- * We need to take care to add the data to our buffers, and then
- * invoke the connection handlers who have the business logic
- * of what to do.
+ * Finds the least loaded active worker.
+ * @arg netconf The network configuration
+ * @arg start The worker checked first, which wins ties. Taken
+ * modulo the active workers.
+ * @return The index of the worker.
  */
-static int read_client_data(conn_info *conn) {
-    /**
-     * Figure out how much space we have to write.
-     * If we have < 50% free, we resize the buffer using
-     * a multiplier.
-     */
-    int avail_buf = circbuf_avail_buf(&conn->input);
-    if (avail_buf < conn->input.buf_size / 2) {
-        circbuf_grow_buf(&conn->input);
+static int least_loaded_worker(bloom_networking *netconf, unsigned start) {
+    int num = __atomic_load_n(&netconf->active_workers, __ATOMIC_ACQUIRE);
+    int first = start % num;
+    int least = first, least_load = worker_load(netconf->workers[first]);
+    for (int i=1; i < num; i++) {
+        int idx = (first + i) % num;
+        int load = worker_load(netconf->workers[idx]);
+        if (load < least_load) {
+            least = idx;
+            least_load = load;
+        }
     }
+    return least;
+}
 
-    // Build the IO vectors to perform the read
-    struct iovec vectors[2];
-    int num_vectors;
-    circbuf_setup_readv_iovec(&conn->input, (struct iovec*)&vectors, &num_vectors);
 
-    // Issue the read
-    ssize_t read_bytes = readv(conn->client.fd, (struct iovec*)&vectors, num_vectors);
+/**
+ * Hands a connection to a worker. The connection is pushed on
+ * the handoffs of the worker without a lock, and the worker is
+ * woken with ev_async, which coalesces the wakeups until the
+ * worker runs, so a batch of handoffs costs a single syscall.
+ * The connection is counted in the load of the worker right
+ * away, so that a burst of clients is spread out.
+ * @notes Thread safe.
+ * @arg data The worker
+ * @arg conn The connection, which must not be scheduled
+ */
+static void dispatch_client(worker_ev_userdata *data, conn_info *conn) {
+    __atomic_add_fetch(&data->conns, 1, __ATOMIC_RELAXED);
+    conn_info *head = __atomic_load_n(&data->handoffs, __ATOMIC_RELAXED);
+    do {
+        conn->next = head;
+    } while (!__atomic_compare_exchange_n(&data->handoffs, &head, conn, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    ev_async_send(data->loop, &data->notify);
+}
 
-    // Make sure we actually read something
-    if (read_bytes == 0) {
-        syslog(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
-        return 1;
-    } else if (read_bytes == -1) {
-        if (errno != EAGAIN && errno != EINTR) {
-            syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
-                    conn->client.fd, strerror(errno));
-        }
-        return 1;
-    }
 
-    // Update the write cursor
-    circbuf_advance_write(&conn->input, read_bytes);
-    return 0;
+/**
+ * Invoked each periodic tick when migration is enabled. If the
+ * worker stays well above the least loaded worker for MIGRATE_TICKS,
+ * the next busy connection it reads from is migrated there.
+ * @arg data The worker
+ */
+static void plan_migration(worker_ev_userdata *data) {
+    bloom_networking *netconf = data->netconf;
+    int least = least_loaded_worker(netconf, data->id);
+    if (worker_load(netconf->workers[least]) + LOAD_SLACK >= worker_load(data)) {
+        data->overloaded_ticks = 0;
+        data->migrate_to = -1;
+        return;
+    }
+    if (++data->overloaded_ticks >= MIGRATE_TICKS) {
+        data->overloaded_ticks = 0;
+        data->migrate_to = least;
+    }
 }
 
 
 /**
- * Invoked when a client connection is ready to be written to.
+ * Migrates a connection to the worker picked by plan_migration,
+ * if it read at least its share of the bytes of this worker in
+ * the current tick. Only connections without buffered output or
+ * partial input are moved, so the other loop starts clean, and
+ * those on shared memory rings stay in place. The connection
+ * must not be used after it is migrated.
+ * @arg data The worker
+ * @arg conn The connection
  */
-static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // Get the associated connection struct
-    conn_info *conn = watcher->data;
+static void migrate_client(worker_ev_userdata *data, conn_info *conn) {
+    if (conn->use_write_buf || conn->shm) return;
+    if (conn->input.read_cursor != conn->input.write_cursor) return;
+    int conns = __atomic_load_n(&data->conns, __ATOMIC_RELAXED);
+    if (conns <= 1 || conn->tick != data->tick || conn->tick_bytes * conns < data->tick_bytes) return;
+
+    // The target may have been parked since it was planned
+    int to = data->migrate_to;
+    data->migrate_to = -1;
+    if (to >= __atomic_load_n(&data->netconf->active_workers, __ATOMIC_ACQUIRE)) return;
+
+    // Move the connection to the other event loop
+    worker_ev_userdata *target = data->netconf->workers[to];
+    ev_io_stop(data->loop, &conn->client);
+    unlink_client(conn);
+    __atomic_sub_fetch(&data->conns, 1, __ATOMIC_RELAXED);
+    syslog(LOG_DEBUG, "Migrating client connection to worker %d. [%d]", target->id, conn->client.fd);
+    dispatch_client(target, conn);
+}
 
-    // Bail if inactive
-    if (!conn->active) return;
 
-    // Build the IO vectors to perform the write
-    struct iovec vectors[2];
-    int num_vectors;
-    circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
+/**
+ * Checks if a worker is parked, so its clients are
+ * moved to the active workers.
+ * @notes Thread safe.
+ */
+static int worker_parked(worker_ev_userdata *data) {
+    return data->id >= __atomic_load_n(&data->netconf->active_workers, __ATOMIC_ACQUIRE);
+}
 
-    // Issue the write
-    ssize_t write_bytes = writev(watcher->fd, (struct iovec*)&vectors, num_vectors);
 
-    if (write_bytes > 0) {
-        // Update the cursor
-        circbuf_advance_read(&conn->output, write_bytes);
+/**
+ * Moves a connection off a parked worker to the least loaded
+ * active worker, once it has no buffered output or partial
+ * input, like a migration. Connections on shared memory rings
+ * stay in place. The connection must not be used after it is moved.
+ * @arg data The worker
+ * @arg conn The connection
+ */
+static void drain_client(worker_ev_userdata *data, conn_info *conn) {
+    if (conn->use_write_buf || conn->shm) return;
+    if (conn->input.read_cursor != conn->input.write_cursor) return;
+
+    worker_ev_userdata *target = data->netconf->workers[least_loaded_worker(data->netconf, 0)];
+    ev_io_stop(data->loop, &conn->client);
+    unlink_client(conn);
+    __atomic_sub_fetch(&data->conns, 1, __ATOMIC_RELAXED);
+    syslog(LOG_DEBUG, "Draining client connection to worker %d. [%d]", target->id, conn->client.fd);
+    dispatch_client(target, conn);
+}
 
-        // Check if we should reset the use_write_buf.
-        // This is done when the buffer size is 0.
-        if (conn->output.read_cursor == conn->output.write_cursor) {
-            conn->use_write_buf = 0;
-            ev_io_stop(lp, &conn->write_client);
+
+/**
+ * Starts accepting on a listener. A multishot accept on an
+ * io_uring is used when the kernel has one, and the watcher
+ * polls the ring for accepted clients. Otherwise the watcher
+ * polls the listener, and each client is accepted in turn.
+ * @arg lp The loop to accept on
+ * @arg watcher The watcher to start
+ * @arg cb The callback of the watcher
+ * @arg listen_fd The listening socket
+ * @arg ring Output, the ring, or NULL if the listener is polled
+ */
+static void start_accepting(ev_loop *lp, ev_io *watcher, void (*cb)(ev_loop*, ev_io*, int),
+        int listen_fd, bloom_accept_ring **ring) {
+    int fd = listen_fd;
+    int res = accept_ring_create(listen_fd, ring);
+    if (res == 0) {
+        fd = accept_ring_fd(*ring);
+    } else {
+        *ring = NULL;
+        if (res != -ENOTSUP) {
+            syslog(LOG_WARNING, "Failed to setup io_uring accepts, polling the listener. Err: %s",
+                    strerror(-res));
         }
     }
+    ev_io_init(watcher, cb, fd, EV_READ);
+    ev_io_start(lp, watcher);
+}
 
-    // Handle any errors
-    if (write_bytes <= 0 && (errno != EAGAIN && errno != EINTR)) {
-        syslog(LOG_ERR, "Failed to write() to connection [%d]! %s.",
-                conn->client.fd, strerror(errno));
-        deactivate_client_connection(conn);
-        return;
-    }
+
+/**
+ * Stops accepting on a listener, and closes its ring
+ */
+static void stop_accepting(ev_loop *lp, ev_io *watcher, bloom_accept_ring **ring) {
+    ev_io_stop(lp, watcher);
+    if (*ring) accept_ring_destroy(*ring);
+    *ring = NULL;
 }
 
 
-/*
- * Invoked when client read data is ready.
- * We just read all the available data,
- * append it to the buffers, and then invoke the
- * connection handlers.
+/**
+ * Accepts a client on a listening socket. Initializes
+ * the connection buffers, but does not schedule it.
+ * Clients over max_connections are told so and closed
+ * right away, before any buffers are allocated.
+ * @arg netconf The network configuration
+ * @arg listen_fd The listening socket
+ * @arg ring The ring accepting on the listener, or NULL
+ * @arg tcp Is the listener a TCP socket, or a Unix socket
+ * @return The connection, or NULL if none was accepted.
  */
-static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // Get the user data
-    worker_ev_userdata *data = ev_userdata(lp);
-    conn_info *conn = watcher->data;
+static conn_info* accept_client(bloom_networking *netconf, int listen_fd, bloom_accept_ring *ring, int tcp) {
+    // Accept the client connection. The ring does not
+    // give the address, which is only looked up to log.
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int client_fd;
+    if (ring) {
+        client_fd = accept_ring_next(ring);
+        if (client_fd < 0) {
+            errno = -client_fd;
+            client_fd = -1;
+        } else if (tcp && (netconf->config->syslog_log_level & LOG_MASK(LOG_DEBUG))) {
+            getpeername(client_fd, (struct sockaddr*)&client_addr, &client_addr_len);
+        } else {
+            memset(&client_addr, 0, sizeof(client_addr));
+        }
+    } else {
+        client_fd = accept_nonblock(listen_fd,
+                        (struct sockaddr*)&client_addr,
+                        &client_addr_len);
+    }
 
-    // Bail if inactive
-    if (!conn->active) return;
+    // Check for an error
+    if (client_fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
+        }
+        return NULL;
+    }
 
-    // Read in the data, and close on issues
-    if (read_client_data(conn)) {
-        deactivate_client_connection(conn);
-        return;
+    // Reject the client over the cap. The socket may still be
+    // blocking without accept4, so the error is sent without waiting.
+    int max_conns = netconf->config->max_connections;
+    if (__atomic_add_fetch(&netconf->clients, 1, __ATOMIC_RELAXED) > max_conns && max_conns) {
+        __atomic_sub_fetch(&netconf->clients, 1, __ATOMIC_RELAXED);
+        send(client_fd, TOO_MANY_CONNS, sizeof(TOO_MANY_CONNS) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(client_fd);
+        stats_add(STAT_CONN_REJECTS, 1);
+        syslog(LOG_DEBUG, "Rejected client connection over max_connections. [%d]", client_fd);
+        return NULL;
     }
 
-    // Prepare to invoke the handler
-    bloom_conn_handler handle;
-    handle.config = data->netconf->config;
-    handle.mgr = data->netconf->mgr;
-    handle.conn = conn;
+    // Setup the socket
+    if (set_client_sockopts(client_fd, tcp)) {
+        __atomic_sub_fetch(&netconf->clients, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
 
-    // Reschedule the watcher, unless it's non-active now
-    if (handle_client_connect(&handle))
-        deactivate_client_connection(conn);
+    // Debug info
+    if (tcp) {
+        syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
+                inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
+    } else {
+        syslog(LOG_DEBUG, "Accepted Unix socket connection. [%d]", client_fd);
+    }
+
+    // Get the associated conn object
+    conn_info *conn = get_conn();
+
+    // Initialize the libev stuff
+    ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
+    ev_io_init(&conn->write_client, handle_client_writebuf, client_fd, EV_WRITE);
+    return conn;
 }
 
 
 /**
- * Invoked to handle async notifications via the thread pipes
+ * Invoked to handle new UDP messages being available.
+ * Datagrams are read in batches and handed to the connection
+ * handlers, without any response. Truncated datagrams are
+ * dropped, since their last command may be cut short.
  */
-static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // Get the user data
+static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
     worker_ev_userdata *data = ev_userdata(lp);
+    udp_batch *batch = data->udp;
 
-    // Attempt to read a single character from the pipe
-    char cmd;
-    if (read(data->pipefd[0], &cmd, 1) != 1)
-        return;
-
-    // Handle the command
-    conn_info *conn;
-    switch (cmd) {
-        // Accept new connection
-        case 'a':
-            // Read the address of conn from the pipe
-            if (read(data->pipefd[0], &conn, sizeof(conn_info*)) < 0) {
-                perror("Failed to read from async pipe");
-                return;
+    // Prepare to invoke the handler
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.bulk = data->netconf->bulk;
+    handle.keys = 0;
+    handle.conn = data->udp_conn;
+
+    for (int b=0; b < UDP_MAX_BATCHES; b++) {
+        int num = read_udp_batch(watcher->fd, batch);
+        if (num <= 0) break;
+
+        stats_add(STAT_UDP_DATAGRAMS, num);
+        for (int i=0; i < num; i++) {
+            if (batch->flags[i] & MSG_TRUNC) {
+                stats_add(STAT_UDP_DROPS, 1);
+                continue;
             }
+            batch->bufs[i][batch->lens[i]] = '\0';
+            handle_client_datagram(&handle, batch->bufs[i], batch->lens[i]);
+        }
+        if (num < UDP_BATCH_SIZE) break;
+    }
+}
 
-            // Schedule this connection on this thread
-            conn->thread_ev = data;
-            ev_io_start(data->loop, &conn->client);
-            break;
 
-        // Quit
-        case 'q':
-            data->should_run = 0;
-            ev_break(lp, EVBREAK_ALL);
-            break;
+/**
+ * Reads a batch of datagrams, with recvmmsg where available.
+ * Datagrams the kernel reports as dropped are counted.
+ * @return The number of datagrams read, 0 if none are ready.
+ */
+static int read_udp_batch(int fd, udp_batch *batch) {
+    for (int i=0; i < UDP_BATCH_SIZE; i++) {
+#ifdef __linux__
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+#else
+        struct msghdr *hdr = batch->msgs + i;
+#endif
+        batch->iovecs[i].iov_base = batch->bufs[i];
+        batch->iovecs[i].iov_len = UDP_MAX_DATAGRAM;
+        bzero(hdr, sizeof(struct msghdr));
+        hdr->msg_iov = batch->iovecs + i;
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = batch->control[i];
+        hdr->msg_controllen = sizeof(batch->control[i]);
+    }
+
+    // Read the datagrams
+    int num;
+#ifdef __linux__
+    num = recvmmsg(fd, batch->msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+#else
+    for (num=0; num < UDP_BATCH_SIZE; num++) {
+        ssize_t len = recvmsg(fd, batch->msgs + num, MSG_DONTWAIT);
+        if (len < 0) break;
+        batch->lens[num] = len;
+    }
+    if (!num) num = -1;
+#endif
+    if (num < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to read from UDP socket! %s.", strerror(errno));
+        }
+        return 0;
+    }
 
-        default:
-            syslog(LOG_WARNING, "Received unknown comand: %c", cmd);
+    // Collect the lengths, flags and kernel drops
+    for (int i=0; i < num; i++) {
+#ifdef __linux__
+        struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+        batch->lens[i] = batch->msgs[i].msg_len;
+#else
+        struct msghdr *hdr = batch->msgs + i;
+#endif
+        batch->flags[i] = hdr->msg_flags;
+#ifdef SO_RXQ_OVFL
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(hdr); c; c = CMSG_NXTHDR(hdr, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SO_RXQ_OVFL) continue;
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+            stats_add(STAT_UDP_DROPS, (uint32_t)(drops - batch->kernel_drops));
+            batch->kernel_drops = drops;
+        }
+#endif
     }
+    return num;
 }
 
 
 /**
- * Invoked periodically to give the connection handlers
- * time to cleanup and handle state updates
+ * Starts reading a UDP socket on a worker
+ * @arg data The worker
+ * @arg fd The UDP socket
  */
-static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
-    // Get the user data
-    worker_ev_userdata *data = ev_userdata(lp);
-
-    // Prepare to invoke the handler
-    bloom_conn_handler handle;
-    handle.config = data->netconf->config;
-    handle.mgr = data->netconf->mgr;
-    handle.conn = NULL;
+static void setup_worker_udp(worker_ev_userdata *data, int fd) {
+    data->udp = calloc(1, sizeof(udp_batch));
+    data->udp_conn = calloc(1, sizeof(conn_info));
+    if (!data->udp || !data->udp_conn) {
+        syslog(LOG_ERR, "Failed to allocate UDP buffers for worker!");
+        free(data->udp);
+        free(data->udp_conn);
+        data->udp = NULL;
+        data->udp_conn = NULL;
+        return;
+    }
+    data->udp_conn->thread_ev = data;
+    data->udp_conn->active = 1;
+    data->udp_conn->datagram = 1;
 
-    // Invoke the connection handler layer
-    periodic_update(&handle);
+    ev_io_init(&data->udp_client, handle_new_udp_mesg, fd, EV_READ);
+    ev_io_start(data->loop, &data->udp_client);
 }
 
 
 /**
- * Entry point for threads to join the networking
- * stack. This method blocks indefinitely until the
- * network stack is shutdown.
- * @arg netconf The configuration for the networking stack.
+ * Stops reading the UDP socket of a worker, if it has
+ * one. The socket is closed after all the workers exit.
+ * @arg data The worker
  */
-void start_networking_worker(bloom_networking *netconf) {
-    // Allocate our user data
-    worker_ev_userdata data;
-    data.netconf = netconf;
-    data.should_run = 1;
-    data.inactive = NULL;
+static void close_worker_udp(worker_ev_userdata *data) {
+    if (!data->udp) return;
+    ev_io_stop(data->loop, &data->udp_client);
+    free(data->udp);
+    free(data->udp_conn);
+}
+
 
-    // Allocate our pipe
-    if (pipe(data.pipefd)) {
-        perror("failed to allocate worker pipes!");
+/**
+ * Invoked when the metrics listener is ready to accept
+ * a scrape. The scrape is read and answered on the main
+ * loop without blocking it.
+ */
+static void handle_new_metrics_client(ev_loop *lp, ev_io *watcher, int ready_events) {
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int client_fd = accept_nonblock(watcher->fd,
+                        (struct sockaddr*)&client_addr,
+                        &client_addr_len);
+    if (client_fd == -1) {
+        syslog(LOG_ERR, "Failed to accept() metrics connection! %s.", strerror(errno));
+        return;
+    }
+    if (set_client_sockopts(client_fd, 1)) {
         return;
     }
 
-    // Create the event loop
-    if (!(data.loop = ev_loop_new(netconf->ev_mode))) {
-        syslog(LOG_ERR, "Failed to create event loop for worker!");
+    metrics_conn *conn = calloc(1, sizeof(metrics_conn));
+    if (!conn) {
+        close(client_fd);
         return;
     }
 
-    // Set the user data to be for this thread
-    ev_set_userdata(data.loop, &data);
+    // Read the request, giving up on slow clients
+    ev_io_init(&conn->client, handle_metrics_read, client_fd, EV_READ);
+    ev_timer_init(&conn->timeout, handle_metrics_timeout, METRICS_TIMEOUT_SEC, 0);
+    conn->client.data = conn;
+    conn->timeout.data = conn;
+    ev_io_start(lp, &conn->client);
+    ev_timer_start(lp, &conn->timeout);
+}
 
-    // Setup the pipe listener
-    ev_io_init(&data.pipe_client, handle_worker_notification,
-                data.pipefd[0], EV_READ);
-    ev_io_start(data.loop, &data.pipe_client);
 
-    // Setup the periodic timers,
-    ev_timer_init(&data.periodic, handle_periodic_timeout,
-                PERIODIC_TIME_SEC, 1);
-    ev_timer_start(data.loop, &data.periodic);
+/**
+ * Invoked when a metrics client has sent data. Once
+ * the request headers are read, the response is written.
+ */
+static void handle_metrics_read(ev_loop *lp, ev_io *watcher, int ready_events) {
+    metrics_conn *conn = watcher->data;
+    int avail = METRICS_REQUEST_SIZE - 1 - conn->request_len;
+    ssize_t read_bytes = recv(watcher->fd, conn->request + conn->request_len, avail, 0);
+    if (read_bytes == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (read_bytes <= 0) {
+        close_metrics_conn(lp, conn);
+        return;
+    }
+    conn->request_len += read_bytes;
+    conn->request[conn->request_len] = '\0';
 
-    // Syncronize until netconf->threads is available
-    barrier_wait(&netconf->thread_barrier);
+    // Wait for the end of the headers, unless the buffer is full
+    if (conn->request_len < METRICS_REQUEST_SIZE - 1 &&
+        !strstr(conn->request, "\r\n\r\n") && !strstr(conn->request, "\n\n")) return;
 
-    // Register this thread so we can accept connections
-    assert(netconf->threads);
-    pthread_t id = pthread_self();
-    for (int i=0; i < netconf->config->worker_threads; i++) {
-        if (pthread_equal(id, netconf->threads[i])) {
-            // Provide a pointer to our data
-            netconf->workers[i] = &data;
-            break;
-        }
+    if (prepare_metrics_response(ev_userdata(lp), conn)) {
+        close_metrics_conn(lp, conn);
+        return;
     }
+    ev_io_stop(lp, &conn->client);
+    ev_io_set(&conn->client, conn->client.fd, EV_WRITE);
+    ev_set_cb(&conn->client, handle_metrics_write);
+    ev_io_start(lp, &conn->client);
+}
 
-    // Wait for everybody to be registered
-    barrier_wait(&netconf->thread_barrier);
-
-    // Run the event loop
-    while (data.should_run) {
-        ev_run(data.loop, EVRUN_ONCE);
 
-        // Free inactive connections
-        conn_info *c = data.inactive;
-        while (c) {
-            conn_info *n = c->next;
-            close_client_connection(c);
-            c = n;
-        }
-        data.inactive = NULL;
+/**
+ * Invoked when a metrics client can take more of its response
+ */
+static void handle_metrics_write(ev_loop *lp, ev_io *watcher, int ready_events) {
+    metrics_conn *conn = watcher->data;
+    ssize_t sent = send(watcher->fd, conn->response + conn->sent,
+                        conn->response_len - conn->sent, 0);
+    if (sent == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (sent > 0) conn->sent += sent;
+    if (sent <= 0 || conn->sent == conn->response_len) {
+        close_metrics_conn(lp, conn);
     }
+}
 
-    // Cleanup after exit
-    ev_timer_stop(data.loop, &data.periodic);
-    ev_io_stop(data.loop, &data.pipe_client);
-    close(data.pipefd[0]);
-    close(data.pipefd[1]);
-    ev_loop_destroy(data.loop);
+
+/**
+ * Invoked when a metrics client is too slow
+ */
+static void handle_metrics_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    close_metrics_conn(lp, t->data);
 }
 
 
 /**
- * Entry point for the main thread to start accepting
- * @arg netconf The configuration for the networking stack.
- * @arg should_run A flag checked to see if we should run
- * @arg threads The list of worker threads
+ * Formats the HTTP response to a metrics request.
+ * Only GET of /metrics, or of /, is served.
+ * @return 0 on success, 1 on error.
  */
-void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *threads) {
-    // Store a reference to the threads
-    netconf->threads = threads;
+static int prepare_metrics_response(bloom_networking *netconf, metrics_conn *conn) {
+    char *body = NULL;
+    int body_len;
+    const char *status, *type = "text/plain; charset=utf-8";
+    if (strncmp(conn->request, "GET ", 4)) {
+        status = "405 Method Not Allowed";
+        body_len = asprintf(&body, "Method not allowed\n");
+    } else if (strncmp(conn->request + 4, "/ ", 2) &&
+               (strncmp(conn->request + 4, "/metrics", 8) || !strchr(" ?", conn->request[12]))) {
+        status = "404 Not Found";
+        body_len = asprintf(&body, "Not found\n");
+    } else {
+        status = "200 OK";
+        type = METRICS_CONTENT_TYPE;
+        body_len = metrics_format(netconf->mgr, &body);
+    }
+    if (body_len < 0) return 1;
+
+    // Send the headers and the body together
+    char *header;
+    int header_len = asprintf(&header, "HTTP/1.0 %s\r\n\
+Content-Type: %s\r\n\
+Content-Length: %d\r\n\
+Connection: close\r\n\r\n", status, type, body_len);
+    if (header_len < 0) {
+        free(body);
+        return 1;
+    }
+    conn->response = malloc(header_len + body_len);
+    if (conn->response) {
+        memcpy(conn->response, header, header_len);
+        memcpy(conn->response + header_len, body, body_len);
+        conn->response_len = header_len + body_len;
+    }
+    free(header);
+    free(body);
+    return conn->response ? 0 : 1;
+}
 
-    // Set the user data of the main loop to netconf
-    ev_set_userdata(netconf->default_loop, netconf);
 
-    // Syncronize now that netconf->threads are ready
-    barrier_wait(&netconf->thread_barrier);
+/**
+ * Closes and frees a metrics connection
+ */
+static void close_metrics_conn(ev_loop *lp, metrics_conn *conn) {
+    ev_io_stop(lp, &conn->client);
+    ev_timer_stop(lp, &conn->timeout);
+    close(conn->client.fd);
+    free(conn->response);
+    free(conn);
+}
 
-    // Syncronize until threads are registered
-    barrier_wait(&netconf->thread_barrier);
 
-    // Run forever
-    while (*should_run) {
-        ev_run(netconf->default_loop, EVRUN_ONCE);
+/**
+ * Invoked when a client connection has data ready to be read.
+ * We need to take care to add the data to our buffers, and then
+ * invoke the connection handlers who have the business logic
+ * of what to do.
+ */
+static int read_client_data(conn_info *conn) {
+    // Make sure at least half the buffer is free to read into
+    linbuf_reserve(&conn->input);
+
+    // Time the input from its arrival while the worker sheds load
+    worker_ev_userdata *data = conn->thread_ev;
+    if (data->shedding && !conn->timestamps) enable_timestamps(conn);
+
+    // Copy the requests of a client on the rings, ringing the
+    // eventfd again for the ones that do not fit
+    linear_buffer *in = &conn->input;
+    int was_empty = in->read_cursor == in->write_cursor;
+    uint64_t stamp = 0;
+    ssize_t read_bytes;
+    if (conn->shm) {
+        shm_ring_clear(conn->client.fd);
+        read_bytes = shm_ring_read(conn->shm, in->buffer + in->write_cursor,
+                in->buf_size - in->write_cursor);
+        if (shm_ring_pending(conn->shm)) shm_ring_ring(conn->client.fd);
+    } else {
+        // Issue the read into the tail of the buffer
+        if (conn->timestamps)
+            read_bytes = read_stamped(conn, in->buffer + in->write_cursor,
+                    in->buf_size - in->write_cursor, &stamp);
+        else
+            read_bytes = read(conn->client.fd, in->buffer + in->write_cursor,
+                    in->buf_size - in->write_cursor);
+
+        // Make sure we actually read something
+        if (read_bytes == 0) {
+            syslog(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
+            return 1;
+        } else if (read_bytes == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
+                        conn->client.fd, strerror(errno));
+            }
+            return 1;
+        }
+    }
+
+    // Update the write cursor
+    in->write_cursor += read_bytes;
+
+    // Stamp the input with its arrival, or else the time the loop
+    // woke up for it. Unhandled input keeps its older stamp.
+    if (!stamp) stamp = ev_now(data->loop) * 1000000;
+    if (was_empty) conn->arrival_usec = stamp;
+    conn->read_usec = stamp;
+
+    // Count the bytes towards the load of the worker
+    if (conn->tick != data->tick) {
+        conn->tick = data->tick;
+        conn->tick_bytes = 0;
     }
+    conn->tick_bytes += read_bytes;
+    data->tick_bytes += read_bytes;
+    conn->usage.bytes_in += read_bytes;
+    return 0;
+}
+
+
+/**
+ * Reads from a client with SO_TIMESTAMP, which provides
+ * the time the last of the bytes read reached the socket.
+ * @arg usec Output, the Unix time in microseconds. Left
+ * unchanged if the kernel did not stamp the bytes.
+ * @return The bytes read, as read() does.
+ */
+static ssize_t read_stamped(conn_info *conn, char *buf, size_t len, uint64_t *usec) {
+    struct iovec iov = {buf, len};
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timeval))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t read_bytes = recvmsg(conn->client.fd, &msg, 0);
+    if (read_bytes <= 0) return read_bytes;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMP) continue;
+        struct timeval tv;
+        memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+        if (tv.tv_sec) *usec = tv.tv_sec * 1000000ULL + tv.tv_usec;
+    }
+    return read_bytes;
+}
+
+
+/**
+ * Turns on SO_TIMESTAMP for a client, so the time its input
+ * waited in the socket counts towards its deadline. Clients
+ * on the rings are only stamped when read.
+ */
+static void enable_timestamps(conn_info *conn) {
+    conn->timestamps = 1;
+    if (conn->shm || conn->datagram) return;
+    int flag = 1;
+    if (setsockopt(conn->client.fd, SOL_SOCKET, SO_TIMESTAMP, &flag, sizeof(flag))) {
+        syslog(LOG_WARNING, "Failed to set SO_TIMESTAMP on connection [%d]! %s.",
+                conn->client.fd, strerror(errno));
+        conn->timestamps = 0;
+    }
+}
+
+
+/**
+ * Invoked when a client connection is ready to be written to.
+ */
+static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events) {
+    // Get the associated connection struct
+    conn_info *conn = watcher->data;
+
+    // Bail if inactive
+    if (!conn->active) return;
+
+    // Copy the output of a client on the rings once it made room
+    ssize_t write_bytes;
+    if (conn->shm) {
+        shm_ring_clear(watcher->fd);
+        int res = drain_shm_output(conn);
+        if (res > 0) return;
+        write_bytes = (res) ? -1 : 1;
+    } else if (conn->output.read_cursor != conn->output.write_cursor) {
+        // Build the IO vectors to perform the write
+        struct iovec vectors[2];
+        int num_vectors;
+        circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
+
+        // Issue the write, and update the cursor
+        write_bytes = writev(watcher->fd, (struct iovec*)&vectors, num_vectors);
+        if (write_bytes > 0) circbuf_advance_read(&conn->output, write_bytes);
+    } else {
+        // Send the file once the output before it is written
+        write_bytes = send_file_chunk(conn);
+    }
+
+    if (write_bytes > 0) {
+        // Check if we should reset the use_write_buf.
+        // This is done when the buffer size is 0.
+        if (conn->output.read_cursor == conn->output.write_cursor && conn->send_fd < 0) {
+            conn->use_write_buf = 0;
+            ev_io_stop(lp, &conn->write_client);
+            circbuf_shrink(&conn->output, CONN_BUF_SHRINK_SIZE);
+
+            // Resume a connection that stopped reading, unless
+            // it waits on a fault
+            if (!ev_is_active(&conn->client) && !conn->parked)
+                ev_idle_start(lp, &conn->resume);
+        }
+    }
+
+    // Handle any errors
+    if (write_bytes <= 0 && (errno != EAGAIN && errno != EINTR)) {
+        syslog(LOG_ERR, "Failed to write() to connection [%d]! %s.",
+                conn->client.fd, strerror(errno));
+        deactivate_client_connection(conn);
+        return;
+    }
+}
+
+
+/**
+ * Sends the next chunk of the file of a connection, and closes
+ * the file once it is sent.
+ * @return The bytes sent, or -1 with errno set.
+ */
+static ssize_t send_file_chunk(conn_info *conn) {
+    size_t chunk = (conn->send_left > SEND_FILE_CHUNK) ? SEND_FILE_CHUNK : conn->send_left;
+#ifdef __linux__
+    ssize_t sent = sendfile(conn->client.fd, conn->send_fd, &conn->send_offset, chunk);
+#else
+    char buf[65536];
+    if (chunk > sizeof(buf)) chunk = sizeof(buf);
+    ssize_t sent = pread(conn->send_fd, buf, chunk, conn->send_offset);
+    if (sent > 0) sent = write(conn->client.fd, buf, sent);
+    if (sent > 0) conn->send_offset += sent;
+#endif
+
+    // The file is shorter than promised to the client
+    if (sent == 0) {
+        errno = EIO;
+        return -1;
+    }
+    if (sent > 0) {
+        conn->send_left -= sent;
+        if (!conn->send_left) {
+            close(conn->send_fd);
+            conn->send_fd = -1;
+        }
+    }
+    return sent;
+}
+
+
+/**
+ * Copies the output of a client on the rings to the response
+ * ring, followed by the file being sent, and wakes the client.
+ * Once the ring is full, bloomd waits for the client to make room.
+ * @return 0 once all of it is copied, 1 if the ring is full,
+ * or -1 with errno set.
+ */
+static int drain_shm_output(conn_info *conn) {
+    bloom_shm_ring *ring = conn->shm;
+    char buf[65536];
+    uint64_t copied;
+    while (1) {
+        if (conn->output.read_cursor != conn->output.write_cursor) {
+            struct iovec vectors[2];
+            int num_vectors;
+            circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
+            copied = shm_ring_write(ring, vectors[0].iov_base, vectors[0].iov_len);
+            if (copied == vectors[0].iov_len && num_vectors == 2)
+                copied += shm_ring_write(ring, vectors[1].iov_base, vectors[1].iov_len);
+            circbuf_advance_read(&conn->output, copied);
+
+        } else if (conn->send_fd >= 0) {
+            // Read no more of the file than the ring has room for
+            uint64_t chunk = shm_ring_room(ring);
+            if (chunk > sizeof(buf)) chunk = sizeof(buf);
+            if (chunk > conn->send_left) chunk = conn->send_left;
+            ssize_t got = (chunk) ? pread(conn->send_fd, buf, chunk, conn->send_offset) : 0;
+            if (chunk && got <= 0) {
+                if (got == -1 && errno == EINTR) continue;
+                if (!got) errno = EIO;
+                return -1;
+            }
+            copied = shm_ring_write(ring, buf, got);
+            conn->send_offset += got;
+            conn->send_left -= got;
+            if (!conn->send_left) {
+                close(conn->send_fd);
+                conn->send_fd = -1;
+            }
+
+        } else {
+            shm_ring_notify(ring);
+            return 0;
+        }
+
+        // Let the client read the ring, and wait for room
+        if (!copied) {
+            shm_ring_notify(ring);
+            if (!shm_ring_wait_room(ring)) return 1;
+        }
+    }
+}
+
+
+/*
+ * Invoked when client read data is ready.
+ * We just read all the available data,
+ * append it to the buffers, and then invoke the
+ * connection handlers.
+ */
+static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events) {
+    conn_info *conn = watcher->data;
+
+    // Bail if inactive
+    if (!conn->active) return;
+
+    // Read in the data, and close on issues
+    if (read_client_data(conn)) {
+        deactivate_client_connection(conn);
+        return;
+    }
+
+    // Wait for the other clients read in this pass to group checks,
+    // the input of a file being received is not commands
+    worker_ev_userdata *data = ev_userdata(lp);
+    if (data->netconf->config->group_checks && !conn->recv_left) {
+        if (!conn->ready) {
+            conn->ready = 1;
+            conn->ready_next = data->ready;
+            data->ready = conn;
+        }
+        return;
+    }
+    handle_client_input(lp, conn);
+}
+
+
+/**
+ * Invoked once the event loop of a worker handled the clients
+ * that became readable, with group_checks. Their leading checks
+ * are run together, and then the rest of their input is handled.
+ */
+static void handle_ready_clients(ev_loop *lp, ev_check *watcher, int ready_events) {
+    worker_ev_userdata *data = ev_userdata(lp);
+    if (!data->ready) return;
+
+    // Reverse the list, which is newest first
+    conn_info *conn = data->ready, *ordered = NULL, *next;
+    data->ready = NULL;
+    while (conn) {
+        next = conn->ready_next;
+        conn->ready_next = ordered;
+        ordered = conn;
+        conn = next;
+    }
+
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.bulk = data->netconf->bulk;
+    handle.keys = 0;
+    handle.budget = CONN_CMD_BUDGET;
+
+    conn_info *group[CHECK_GROUP_MAX];
+    int num;
+    while (ordered) {
+        // Gather the active clients, their responses are corked
+        for (num=0; ordered && num < CHECK_GROUP_MAX; ordered = ordered->ready_next) {
+            ordered->ready = 0;
+            if (!ordered->active) continue;
+            ordered->corked = 1;
+            group[num++] = ordered;
+        }
+
+        // The time of the checks is shared by the clients
+        uint64_t ticks = clients_ticks();
+        handle_client_checks(&handle, group, num);
+        ticks = clients_ticks() - ticks;
+        for (int i=0; i < num; i++) group[i]->usage.ticks += ticks / num;
+
+        // Handle the rest of the input, unless parked on a fault
+        for (int i=0; i < num; i++) {
+            conn = group[i];
+            if (!conn->parked) {
+                handle_client_input(lp, conn);
+                continue;
+            }
+            conn->corked = 0;
+            ev_io_stop(lp, &conn->client);
+        }
+    }
+}
+
+
+/**
+ * Invoked when the event loop is idle for a connection
+ * that yielded or stopped reading. Handles the rest of
+ * its input, which restarts reading once it is done.
+ */
+static void handle_client_resume(ev_loop *lp, ev_idle *watcher, int ready_events) {
+    conn_info *conn = watcher->data;
+    ev_idle_stop(lp, watcher);
+
+    // Bail if inactive
+    if (!conn->active) return;
+    handle_client_input(lp, conn);
+}
+
+
+/**
+ * Invokes the connection handlers on the input of a client,
+ * for at most CONN_CMD_BUDGET commands, and writes the
+ * responses. Reading stops while the budget leaves commands
+ * behind, or while the output is above OUTPUT_HIGH_WATER.
+ */
+static void handle_client_input(ev_loop *lp, conn_info *conn) {
+    // Prepare to invoke the handler
+    worker_ev_userdata *data = ev_userdata(lp);
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.bulk = data->netconf->bulk;
+    handle.keys = 0;
+    handle.conn = conn;
+    handle.budget = CONN_CMD_BUDGET;
+
+    // Write the input of a file being received, the
+    // handler only runs once all of it is written
+    if (conn->recv_left) {
+        receive_file_input(conn);
+        if (conn->recv_left) {
+            shrink_client_buffers(conn, CONN_BUF_SHRINK_SIZE);
+            ev_io_start(lp, &conn->client);
+            return;
+        }
+    }
+
+    // Gather the responses to all the commands read, and write
+    // them together. Reschedule the watcher, unless it's non-active now
+    conn->corked = 1;
+    uint64_t ticks = clients_ticks();
+    int res = handle_client_connect(&handle);
+    conn->corked = 0;
+
+    // Count the usage towards the client, with the bytes read
+    // and written since the last count
+    conn->usage.ticks += clients_ticks() - ticks;
+    conn->usage.commands += CONN_CMD_BUDGET - handle.budget;
+    conn->usage.keys += handle.keys;
+    count_client_usage(conn);
+    if (res || (conn->active && flush_client_output(conn, 0))) {
+        deactivate_client_connection(conn);
+        return;
+    }
+
+    // Wait for the fault of a parked connection, its
+    // command is in the input buffer until it resumes
+    if (conn->parked) {
+        ev_io_stop(lp, &conn->client);
+        return;
+    }
+
+    // Give back the memory of a large command
+    shrink_client_buffers(conn, CONN_BUF_SHRINK_SIZE);
+
+    // Wait for a file to be sent, the write watcher resumes
+    // the client once it is
+    if (conn->send_fd >= 0) {
+        ev_io_stop(lp, &conn->client);
+        return;
+    }
+
+    // Let the client wait for its responses to be written,
+    // the write watcher resumes it once they are
+    if (conn->output.buf_size - 1 - circbuf_avail_buf(&conn->output) > OUTPUT_HIGH_WATER) {
+        ev_io_stop(lp, &conn->client);
+        return;
+    }
+
+    // Let the other clients have a turn before the rest
+    if (handle.budget <= 0) {
+        ev_io_stop(lp, &conn->client);
+        ev_idle_start(lp, &conn->resume);
+        return;
+    }
+    ev_io_start(lp, &conn->client);
+
+    // Only part of a command is left, which is as new as the last read
+    conn->arrival_usec = conn->read_usec;
+
+    // Move a busy connection off an overloaded worker, and
+    // every connection off a parked worker
+    // A connection with tagged commands stays, since their
+    // faults complete on this worker
+    if (!conn->active || conn->tagged_pending || conn->tagged_ready) return;
+    if (worker_parked(data)) {
+        drain_client(data, conn);
+    } else if (data->migrate_to >= 0) {
+        migrate_client(data, conn);
+    }
+}
+
+
+/**
+ * Invoked to handle async notifications from other threads.
+ * Schedules all the connections handed to this worker, in the
+ * order they were handed off, or stops the worker.
+ */
+static void handle_worker_notification(ev_loop *lp, ev_async *watcher, int ready_events) {
+    // Get the user data
+    worker_ev_userdata *data = ev_userdata(lp);
+
+    // Quit
+    if (__atomic_load_n(&data->quit, __ATOMIC_ACQUIRE)) {
+        data->should_run = 0;
+        ev_break(lp, EVBREAK_ALL);
+        return;
+    }
+
+    // Take all the handoffs at once, so that no other
+    // thread can see the list while it is walked
+    conn_info *conn = __atomic_exchange_n(&data->handoffs, NULL, __ATOMIC_ACQUIRE);
+
+    // Reverse the list, which is newest first
+    conn_info *ordered = NULL, *next;
+    while (conn) {
+        next = conn->next;
+        conn->next = ordered;
+        ordered = conn;
+        conn = next;
+    }
+
+    // Schedule the connections on this thread
+    for (conn = ordered; conn; conn = next) {
+        next = conn->next;
+        conn->thread_ev = data;
+        link_client(data, conn);
+        ev_io_start(lp, &conn->client);
+    }
+
+    // Handle the commands forwarded to this worker
+    if (data->netconf->affine_rings) handle_affine_forwards(data);
+
+    // Resume the parked connections whose faults completed,
+    // or free those that were closed while they waited
+    conn = __atomic_exchange_n(&data->faulted, NULL, __ATOMIC_ACQUIRE);
+    for (; conn; conn = next) {
+        next = conn->next;
+        conn->parked = 0;
+        if (conn->active) {
+            ev_idle_start(lp, &conn->resume);
+        } else if (!conn->tagged_pending) {
+            conn->next = data->inactive;
+            data->inactive = conn;
+        }
+    }
+
+    // Queue the tagged commands whose faults completed
+    resume_tagged_commands(data);
+}
+
+
+/**
+ * Invoked on a fault thread once the filter of a parked
+ * connection is faulted in. Hands the connection back to
+ * its worker, like a handoff. The worker is not touched
+ * after the count of its faults drops, since it may exit.
+ */
+static void handle_fault_complete(void *data, int res) {
+    conn_info *conn = data;
+    worker_ev_userdata *worker = conn->thread_ev;
+    do {
+        conn->next = __atomic_load_n(&worker->faulted, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&worker->faulted, &conn->next, conn,
+                0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    ev_async_send(worker->loop, &worker->notify);
+    __atomic_sub_fetch(&worker->faults, 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Invoked on a fault thread once the filter of a tagged
+ * command is faulted in. Hands the command back to the
+ * worker of its connection, like handle_fault_complete.
+ */
+static void handle_tagged_fault_complete(void *data, int res) {
+    (void)res;
+    tagged_command *cmd = data;
+    worker_ev_userdata *worker = cmd->worker;
+    do {
+        cmd->next = __atomic_load_n(&worker->tagged, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&worker->tagged, &cmd->next, cmd,
+                0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    ev_async_send(worker->loop, &worker->notify);
+    __atomic_sub_fetch(&worker->faults, 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Queues the tagged commands whose faults completed on their
+ * connections, in the order they completed, and resumes the
+ * connections that are not parked. The commands of closed
+ * connections are dropped, and the connections freed after
+ * their last one.
+ */
+static void resume_tagged_commands(worker_ev_userdata *data) {
+    tagged_command *cmd = __atomic_exchange_n(&data->tagged, NULL, __ATOMIC_ACQUIRE);
+    tagged_command *ordered = NULL, *next;
+    for (; cmd; cmd = next) {
+        next = cmd->next;
+        cmd->next = ordered;
+        ordered = cmd;
+    }
+
+    conn_info *conn;
+    for (cmd = ordered; cmd; cmd = next) {
+        next = cmd->next;
+        conn = cmd->conn;
+        conn->tagged_pending--;
+        if (conn->active) {
+            cmd->next = NULL;
+            if (conn->tagged_ready_tail)
+                conn->tagged_ready_tail->next = cmd;
+            else
+                conn->tagged_ready = cmd;
+            conn->tagged_ready_tail = cmd;
+            if (!conn->parked) ev_idle_start(data->loop, &conn->resume);
+        } else {
+            free(cmd);
+            if (!conn->tagged_pending && !conn->parked) {
+                conn->next = data->inactive;
+                data->inactive = conn;
+            }
+        }
+    }
+}
+
+
+/**
+ * Starts the admin threads, if any are configured
+ */
+static void start_admin_threads(bloom_networking *netconf) {
+    pthread_mutex_init(&netconf->admin_lock, NULL);
+    pthread_cond_init(&netconf->admin_cond, NULL);
+    netconf->admin_run = 1;
+    netconf->admin_threads = calloc(netconf->config->admin_threads, sizeof(pthread_t));
+    for (; netconf->num_admin_threads < netconf->config->admin_threads; netconf->num_admin_threads++) {
+        if (pthread_create(netconf->admin_threads + netconf->num_admin_threads, NULL,
+                    admin_thread_main, netconf)) {
+            perror("Failed to start admin thread!");
+            break;
+        }
+    }
+}
+
+/**
+ * Stops the admin threads, once the queued commands are done
+ */
+static void stop_admin_threads(bloom_networking *netconf) {
+    pthread_mutex_lock(&netconf->admin_lock);
+    netconf->admin_run = 0;
+    pthread_cond_broadcast(&netconf->admin_cond);
+    pthread_mutex_unlock(&netconf->admin_lock);
+    for (int i=0; i < netconf->num_admin_threads; i++)
+        pthread_join(netconf->admin_threads[i], NULL);
+    free(netconf->admin_threads);
+    pthread_cond_destroy(&netconf->admin_cond);
+    pthread_mutex_destroy(&netconf->admin_lock);
+}
+
+/**
+ * Handles the admin commands of the parked connections, and
+ * hands each connection back to its worker, like a fault
+ */
+static void* admin_thread_main(void *in) {
+    bloom_networking *netconf = in;
+    bloom_conn_handler handle;
+    handle.config = netconf->config;
+    handle.mgr = netconf->mgr;
+    handle.cluster = netconf->cluster;
+    handle.bulk = netconf->bulk;
+    handle.keys = 0;
+
+    conn_info *conn;
+    int type;
+    while (1) {
+        // Wait for a command, the queue is drained before stopping
+        pthread_mutex_lock(&netconf->admin_lock);
+        while (netconf->admin_run && !netconf->admin_queue)
+            pthread_cond_wait(&netconf->admin_cond, &netconf->admin_lock);
+        conn = netconf->admin_queue;
+        if (conn) {
+            netconf->admin_queue = conn->next;
+            if (!netconf->admin_queue) netconf->admin_tail = NULL;
+        }
+        pthread_mutex_unlock(&netconf->admin_lock);
+        if (!conn) break;
+
+        // The command is done once the connection resumes
+        type = conn->parked_type;
+        conn->parked_type = -1;
+        conn->deferring = 1;
+        handle.conn = conn;
+        handle.budget = CONN_CMD_BUDGET;
+        handle.keys = 0;
+        uint64_t ticks = clients_ticks();
+        filtmgr_client_checkpoint(netconf->mgr);
+        handle_admin_command(&handle, type, conn->parked_args, conn->parked_args_len);
+        filtmgr_client_leave(netconf->mgr);
+        conn->usage.ticks += clients_ticks() - ticks;
+        conn->usage.commands++;
+        conn->usage.keys += handle.keys;
+        conn->deferring = 0;
+        handle_fault_complete(conn, 0);
+    }
+    return NULL;
+}
+
+/**
+ * Returns the worker owning a filter, with filter_affinity
+ */
+static int filter_owner(bloom_networking *netconf, char *filter_name) {
+    uint64_t hash[2];
+    WyHash128(filter_name, strlen(filter_name), 0, hash);
+    return hash[0] % netconf->max_workers;
+}
+
+/**
+ * Handles the commands forwarded to a worker by the other
+ * workers, in the order each forwarded them, and hands each
+ * connection back to its worker, like an admin thread
+ */
+static void handle_affine_forwards(worker_ev_userdata *data) {
+    bloom_networking *netconf = data->netconf;
+    bloom_conn_handler handle;
+    handle.config = netconf->config;
+    handle.mgr = netconf->mgr;
+    handle.cluster = netconf->cluster;
+    handle.bulk = netconf->bulk;
+    handle.keys = 0;
+
+    int workers = netconf->max_workers;
+    affine_ring *ring;
+    conn_info *conn;
+    unsigned head, tail;
+    int type;
+    for (int i=0; i < workers; i++) {
+        ring = netconf->affine_rings + data->id * workers + i;
+        head = ring->head;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            // The command is done once the connection resumes
+            conn = ring->slots[head % AFFINE_RING_SIZE];
+            type = conn->parked_type;
+            conn->parked_type = -1;
+            conn->deferring = 1;
+            handle.conn = conn;
+            handle.budget = CONN_CMD_BUDGET;
+            handle.keys = 0;
+            uint64_t ticks = clients_ticks();
+            handle_affine_command(&handle, type, conn->parked_args, conn->parked_args_len);
+            conn->usage.ticks += clients_ticks() - ticks;
+            conn->usage.commands++;
+            conn->usage.keys += handle.keys;
+            conn->deferring = 0;
+            handle_fault_complete(conn, 0);
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Gathers the responses of an admin command, to be written
+ * by the worker once the connection resumes
+ */
+static int defer_client_response(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
+    for (int i=0; i < num_bufs; i++) {
+        while (conn->deferred_len + buf_sizes[i] > conn->deferred_size) {
+            conn->deferred_size = (conn->deferred_size) ? conn->deferred_size * 2 : INIT_CONN_BUF_SIZE;
+            conn->deferred = realloc(conn->deferred, conn->deferred_size);
+        }
+        memcpy(conn->deferred + conn->deferred_len, response_buffers[i], buf_sizes[i]);
+        conn->deferred_len += buf_sizes[i];
+    }
+    return 0;
+}
+
+
+/**
+ * Invoked periodically to give the connection handlers
+ * time to cleanup and handle state updates
+ */
+static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    // Get the user data
+    worker_ev_userdata *data = ev_userdata(lp);
+
+    // Publish the load of this tick. The lag is how much
+    // later than its interval the timer fired.
+    ev_tstamp now = ev_now(lp);
+    double lag = (data->last_tick) ? now - data->last_tick - t->repeat : 0;
+    if (lag < 0) lag = 0;
+    data->last_tick = now;
+    int64_t load = data->tick_bytes / LOAD_TICK_BYTES + (int64_t)(lag / LOAD_LAG_SEC);
+    __atomic_store_n(&data->tick_load, load, __ATOMIC_RELAXED);
+
+    // Shed the late commands until the lag recovers
+    int shed_msec = data->netconf->config->shed_lag_msec;
+    int shedding = shed_msec && lag * 1000 > shed_msec;
+    if (shedding != data->shedding) {
+        if (shedding)
+            syslog(LOG_WARNING, "Worker %d lags %d msec, shedding the commands waiting over %d msec.",
+                    data->id, (int)(lag * 1000), shed_msec);
+        else
+            syslog(LOG_INFO, "Worker %d stopped shedding commands.", data->id);
+        data->shedding = shedding;
+    }
+    data->tick_bytes = 0;
+    data->tick++;
+    if (data->netconf->config->migrate_connections) plan_migration(data);
+    if (!(data->tick % IDLE_SHRINK_TICKS)) shrink_idle_clients(data);
+
+    // Prepare to invoke the handler
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.bulk = data->netconf->bulk;
+    handle.keys = 0;
+    handle.conn = NULL;
+
+    // Invoke the connection handler layer
+    periodic_update(&handle);
+}
+
+
+/**
+ * Entry point for threads to join the networking
+ * stack. This method blocks indefinitely until the
+ * network stack is shutdown.
+ * @arg netconf The configuration for the networking stack.
+ */
+void start_networking_worker(bloom_networking *netconf) {
+    // Allocate our user data
+    worker_ev_userdata data;
+    data.netconf = netconf;
+    data.should_run = 1;
+    data.inactive = NULL;
+    data.clients = NULL;
+    data.udp = NULL;
+    data.udp_conn = NULL;
+    data.handoffs = NULL;
+    data.accept_ring = NULL;
+    data.faults = 0;
+    data.faulted = NULL;
+    data.tagged = NULL;
+    data.quit = 0;
+    data.id = -1;
+    data.conns = 0;
+    data.tick_load = 0;
+    data.tick_bytes = 0;
+    data.tick = 0;
+    data.last_tick = 0;
+    data.overloaded_ticks = 0;
+    data.shedding = 0;
+    data.migrate_to = -1;
+
+    // Create the event loop
+    if (!(data.loop = ev_loop_new(netconf->ev_mode))) {
+        syslog(LOG_ERR, "Failed to create event loop for worker!");
+        return;
+    }
+
+    // Set the user data to be for this thread
+    ev_set_userdata(data.loop, &data);
+
+    // Setup the notifications from other threads
+    ev_async_init(&data.notify, handle_worker_notification);
+    ev_async_start(data.loop, &data.notify);
+
+    // Gather the checks of the clients read in each pass. Check
+    // watchers run first, so it has the lowest priority to
+    // run after the clients of the pass were read.
+    data.ready = NULL;
+    ev_check_init(&data.gather, handle_ready_clients);
+    ev_set_priority(&data.gather, EV_MINPRI);
+    if (netconf->config->group_checks) ev_check_start(data.loop, &data.gather);
+
+    // Setup the periodic timers,
+    ev_timer_init(&data.periodic, handle_periodic_timeout,
+                PERIODIC_TIME_SEC, 1);
+    ev_timer_start(data.loop, &data.periodic);
+
+    // Syncronize until netconf->threads is available
+    barrier_wait(&netconf->thread_barrier);
+
+    // Register this thread so we can accept connections
+    assert(netconf->threads);
+    pthread_t id = pthread_self();
+    for (int i=0; i < netconf->max_workers; i++) {
+        if (pthread_equal(id, netconf->threads[i])) {
+            // Provide a pointer to our data
+            data.id = i;
+            netconf->workers[i] = &data;
+
+            // Accept our share of the clients
+            if (netconf->worker_accept) {
+                start_accepting(data.loop, &data.tcp_client, handle_worker_accept,
+                            netconf->tcp_fds[i], &data.accept_ring);
+            }
+
+            // Read our share of the UDP datagrams
+            if (i < netconf->num_udp_fds) setup_worker_udp(&data, netconf->udp_fds[i]);
+            break;
+        }
+    }
+
+    // Wait for everybody to be registered
+    barrier_wait(&netconf->thread_barrier);
+
+    // Run the event loop
+    while (data.should_run) {
+        ev_run(data.loop, EVRUN_ONCE);
+
+        // Free inactive connections
+        conn_info *c = data.inactive;
+        while (c) {
+            conn_info *n = c->next;
+            close_client_connection(c);
+            c = n;
+        }
+        data.inactive = NULL;
+    }
+
+    // Stop accepting right away, a ring would accept
+    // clients that are never read while the worker waits
+    if (netconf->worker_accept) stop_accepting(data.loop, &data.tcp_client, &data.accept_ring);
+
+    // Wait for the faults of the parked connections, which
+    // signal this loop once they complete. The commands other
+    // workers forward are handled until they all left their
+    // loops, since they may be waiting on them.
+    __atomic_sub_fetch(&netconf->running_workers, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&data.faults, __ATOMIC_ACQUIRE) ||
+            (netconf->affine_rings && __atomic_load_n(&netconf->running_workers, __ATOMIC_ACQUIRE))) {
+        if (netconf->affine_rings) handle_affine_forwards(&data);
+        usleep(1000);
+    }
+    if (netconf->affine_rings) handle_affine_forwards(&data);
+
+    // Cleanup after exit
+    close_worker_udp(&data);
+    ev_timer_stop(data.loop, &data.periodic);
+    ev_check_stop(data.loop, &data.gather);
+    ev_async_stop(data.loop, &data.notify);
+    ev_loop_destroy(data.loop);
+}
+
+
+/**
+ * Hands listeners inherited from another process to the
+ * next init_networking. They are used in place of opening
+ * new listeners, if they are bound to the same address.
+ * @arg tcp_fds The TCP listeners
+ * @arg num_tcp The number of TCP listeners
+ * @arg udp_fds The UDP sockets
+ * @arg num_udp The number of UDP sockets
+ */
+void networking_inherit_listeners(int *tcp_fds, int num_tcp, int *udp_fds, int num_udp) {
+    close_inherited_listeners(&INHERITED_TCP);
+    close_inherited_listeners(&INHERITED_UDP);
+    if (num_tcp && (INHERITED_TCP.fds = malloc(num_tcp * sizeof(int)))) {
+        memcpy(INHERITED_TCP.fds, tcp_fds, num_tcp * sizeof(int));
+        INHERITED_TCP.num = num_tcp;
+    }
+    if (num_udp && (INHERITED_UDP.fds = malloc(num_udp * sizeof(int)))) {
+        memcpy(INHERITED_UDP.fds, udp_fds, num_udp * sizeof(int));
+        INHERITED_UDP.num = num_udp;
+    }
+}
+
+/**
+ * Returns the listeners, so they can be handed to another
+ * process. They stay open until the networking is shut down.
+ * @arg netconf The configuration for the networking stack.
+ * @arg tcp_fds Output, the TCP listeners
+ * @arg num_tcp Output, the number of TCP listeners
+ * @arg udp_fds Output, the UDP sockets
+ * @arg num_udp Output, the number of UDP sockets
+ */
+void networking_listeners(bloom_networking *netconf, int **tcp_fds, int *num_tcp, int **udp_fds, int *num_udp) {
+    *tcp_fds = netconf->tcp_fds;
+    *num_tcp = netconf->num_tcp_fds;
+    *udp_fds = netconf->udp_fds;
+    *num_udp = netconf->num_udp_fds;
+}
+
+
+/**
+ * Entry point for the main thread to start accepting
+ * @arg netconf The configuration for the networking stack.
+ * @arg should_run A flag checked to see if we should run
+ * @arg should_reload A flag checked to see if the configuration
+ * should be reloaded, and cleared once it is
+ * @arg config_file The configuration file, NULL for the defaults
+ * @arg threads The list of worker threads
+ */
+void enter_main_loop(bloom_networking *netconf, int *should_run, volatile sig_atomic_t *should_reload,
+        char *config_file, pthread_t *threads) {
+    // Store a reference to the threads
+    netconf->threads = threads;
+
+    // Set the user data of the main loop to netconf
+    ev_set_userdata(netconf->default_loop, netconf);
+
+    // Syncronize now that netconf->threads are ready
+    barrier_wait(&netconf->thread_barrier);
+
+    // Syncronize until threads are registered
+    barrier_wait(&netconf->thread_barrier);
+
+    // The main loop may have no listeners when the workers
+    // accept, so wake it periodically instead of spinning
+    ev_timer_init(&netconf->main_periodic, handle_main_timeout,
+                PERIODIC_TIME_SEC, PERIODIC_TIME_SEC);
+    ev_timer_start(netconf->default_loop, &netconf->main_periodic);
+
+    // Run forever
+    while (*should_run) {
+        ev_run(netconf->default_loop, EVRUN_ONCE);
+        if (*should_reload) {
+            *should_reload = 0;
+            reload_config(netconf, config_file);
+        }
+    }
+    ev_timer_stop(netconf->default_loop, &netconf->main_periodic);
+}
+
+
+/**
+ * Applies the tunable settings and the worker_threads of the
+ * configuration file, on a reload. The other settings need a
+ * restart to change.
+ */
+static void reload_config(bloom_networking *netconf, char *config_file) {
+    bloom_config config;
+    if (config_from_filename(config_file, &config) || sane_worker_threads(config.worker_threads) ||
+            config_update(netconf->config, &config)) {
+        syslog(LOG_ERR, "Failed to reload the configuration!");
+        return;
+    }
+    syslog(LOG_INFO, "Reloaded the configuration.");
+    networking_set_workers(netconf, config.worker_threads);
+}
+
+
+/**
+ * Returns the number of workers to start, which is the most
+ * that can be active. With filter_affinity the filters are
+ * owned by all the workers started, so none can be parked.
+ * @arg config The bloom server configuration
+ * @return The number of workers.
+ */
+int networking_max_workers(bloom_config *config) {
+    if (config->filter_affinity || config->max_worker_threads < config->worker_threads) {
+        return config->worker_threads;
+    }
+    return config->max_worker_threads;
+}
+
+
+/**
+ * Changes the number of active workers. The new workers
+ * take clients right away. The clients of the parked
+ * workers are moved to the active ones as they send their
+ * next commands, and new clients are not placed on them.
+ * @notes Thread safe.
+ * @arg netconf The configuration for the networking stack.
+ * @arg workers The workers to keep active
+ * @return 0 on success, -1 if the workers are out of range.
+ */
+int networking_set_workers(bloom_networking *netconf, int workers) {
+    if (workers < 1 || workers > netconf->max_workers) return -1;
+    if (netconf->config->filter_affinity && workers != netconf->max_workers) return -1;
+
+    int before = __atomic_exchange_n(&netconf->active_workers, workers, __ATOMIC_ACQ_REL);
+    if (before != workers) {
+        syslog(LOG_INFO, "Changed the active workers from %d to %d.", before, workers);
+    }
+    return 0;
+}
+
+
+/**
+ * Gets the number of active workers, of a client connection.
+ * @arg conn The client connection
+ * @arg max Output, the most workers that can be active
+ * @return The active workers.
+ */
+int conn_active_workers(conn_info *conn, int *max) {
+    bloom_networking *netconf = conn->thread_ev->netconf;
+    *max = netconf->max_workers;
+    return __atomic_load_n(&netconf->active_workers, __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * Changes the number of active workers, from a client connection.
+ * @arg conn The client connection
+ * @arg workers The workers to keep active
+ * @return 0 on success, -1 if the workers are out of range.
+ */
+int conn_set_active_workers(conn_info *conn, int workers) {
+    return networking_set_workers(conn->thread_ev->netconf, workers);
+}
+
+
+/**
+ * Invoked periodically on the main loop. Does nothing,
+ * other than returning to check should_run.
+ */
+static void handle_main_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+}
+
+
+/**
+ * Shuts down all the connections
+ * and listeners and prepares to exit.
+ * @arg netconf The config for the networking stack.
+ * @arg threads A list of worker threads
+ */
+int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
+    // Stop listening for new connections. Workers
+    // accepting on their own listeners stop on exit.
+    if (!netconf->worker_accept) stop_accepting(netconf->default_loop, &netconf->tcp_client, &netconf->accept_ring);
+    if (netconf->config->unix_socket) ev_io_stop(netconf->default_loop, &netconf->unix_client);
+    if (netconf->config->metrics_port > 0) {
+        ev_io_stop(netconf->default_loop, &netconf->metrics_client);
+        close(netconf->metrics_client.fd);
+    }
+
+    // Tell the threads to quit, async signal
+    for (int i=0; i < netconf->max_workers; i++) {
+        worker_ev_userdata *w = netconf->workers[i];
+        __atomic_store_n(&w->quit, 1, __ATOMIC_RELEASE);
+        ev_async_send(w->loop, &w->notify);
+    }
+
+    // Wait for the threads to return
+    pthread_t thread;
+    for (int i=0; i < netconf->max_workers; i++) {
+        thread = threads[i];
+        if (thread) pthread_join(thread, NULL);
+    }
+
+    // The workers waited for their admin commands
+    stop_admin_threads(netconf);
+    if (netconf->bulk) destroy_bulk_pool(netconf->bulk);
+
+    // The workers have stopped accepting and reading
+    close_tcp_listener(netconf);
+    close_unix_listener(netconf);
+    for (int i=0; i < netconf->num_udp_fds; i++) close(netconf->udp_fds[i]);
+    free(netconf->udp_fds);
+
+    // TODO: Close all the client connections
+    // ??? For now, we just leak the memory
+    // since we are shutdown down anyways...
+
+    // Shutdown the event loo
+    ev_loop_destroy(netconf->default_loop);
+
+    // Close the connections to the other nodes
+    if (netconf->cluster) destroy_cluster(netconf->cluster);
+
+    // Free the netconf
+    free(netconf->affine_rings);
+    free(netconf->workers);
+    free(netconf);
+    return 0;
+}
+
+/*
+ * These are externally visible methods for
+ * interacting with the connection buffers.
+ */
+
+/**
+ * Called to close and cleanup a client connection.
+ * Must be called when the connection is not already
+ * scheduled. e.g. After ev_io_stop() has been called.
+ * Leaves the connection in the conns list so that it
+ * can be re-used.
+ * @arg conn The connection to close
+ */
+static void close_client_connection(conn_info *conn) {
+    // Stop the libev clients
+    ev_io_stop(conn->thread_ev->loop, &conn->client);
+    ev_io_stop(conn->thread_ev->loop, &conn->write_client);
+    ev_idle_stop(conn->thread_ev->loop, &conn->resume);
+
+    // Close the fd, or the socket and the rings
+    syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
+    if (conn->shm) {
+        ev_io_stop(conn->thread_ev->loop, &conn->hangup);
+        close(conn->hangup.fd);
+        shm_ring_destroy(conn->shm);
+        conn->shm = NULL;
+    } else {
+        close(conn->client.fd);
+    }
+    __atomic_sub_fetch(&conn->thread_ev->conns, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&conn->thread_ev->netconf->clients, 1, __ATOMIC_RELAXED);
+    stats_add(STAT_CONNECTIONS, -1);
+    conn->usage.connections--;
+    count_client_usage(conn);
+    unlink_client(conn);
+
+    // Keep the connection and its buffers for reuse
+    put_conn(conn);
+}
+
+/**
+ * Marks a client connection as 'inactive' and
+ * to be closed when the event loop is finished.
+ */
+static void deactivate_client_connection(conn_info *conn) {
+    if (!conn->active) return;
+    conn->active = 0;
+
+    // A parked connection is freed once its fault completes,
+    // and one with tagged commands once theirs do
+    if (conn->parked || conn->tagged_pending) return;
+    conn->next = conn->thread_ev->inactive;
+    conn->thread_ev->inactive = conn;
+}
+
+/**
+ * Sends a response to a client.
+ * @arg conn The client connection
+ * @arg response_buffers A list of response buffers to send
+ * @arg buf_sizes A list of the buffer sizes
+ * @arg num_bufs The number of response buffers
+ * @return 0 on success.
+ */
+int send_client_response(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
+    // Prefix the first response of a tagged command with its tag
+    if (conn->tag) {
+        char *tag_bufs[TAG_MAX_BUFS + 2] = {conn->tag, " "};
+        int tag_sizes[TAG_MAX_BUFS + 2] = {conn->tag_len, 1};
+        conn->tag = NULL;
+        if (num_bufs <= TAG_MAX_BUFS) {
+            memcpy(tag_bufs + 2, response_buffers, num_bufs * sizeof(char*));
+            memcpy(tag_sizes + 2, buf_sizes, num_bufs * sizeof(int));
+            return send_client_response(conn, (char**)&tag_bufs, (int*)&tag_sizes, num_bufs + 2);
+        }
+        int res = send_client_response(conn, (char**)&tag_bufs, (int*)&tag_sizes, 2);
+        if (res) return res;
+    }
+
+    // Gather the responses of an admin thread for the worker
+    if (conn->deferring) return defer_client_response(conn, response_buffers, buf_sizes, num_bufs);
+
+    // Silently bail of the connection is not active,
+    // or discard the response to a datagram
+    if (!conn->active || conn->datagram) return 0;
+    for (int i=0; i < num_bufs; i++) conn->usage.bytes_out += buf_sizes[i];
+
+    int send_bufs, res = 0;
+    for (int offset=0; offset < num_bufs && res == 0; offset += IOV_MAX) {
+        // Determine how many buffers to send
+        send_bufs = ((num_bufs - offset) <= IOV_MAX) ? (num_bufs - offset) : IOV_MAX;
+
+        // Check if we are doing buffered writes, the
+        // output of a client on the rings always is
+        if (conn->use_write_buf || conn->corked || conn->shm) {
+            res = send_client_response_buffered(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
+        } else {
+            res = send_client_response_direct(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
+        }
+    }
+
+    // Write out a large batch of gathered responses early,
+    // more responses to this read are still to come
+    if (!res && conn->corked && !conn->use_write_buf &&
+            conn->output.buf_size - 1 - circbuf_avail_buf(&conn->output) >= CORK_FLUSH_SIZE) {
+        res = flush_client_output(conn, 1);
+    } else if (!res && conn->shm && !conn->corked) {
+        res = flush_client_output(conn, 0);
+    }
+
+    // Disable the connection on error
+    if (res) deactivate_client_connection(conn);
+    return res;
+}
+
+
+/**
+ * Writes the responses gathered in the output buffer with a
+ * single sendmsg. Whatever does not fit in the socket buffer is
+ * written once the socket is writable, and until then later
+ * responses are buffered behind it.
+ * @arg conn The client connection
+ * @arg more Are more responses to follow. If so, the kernel is
+ * told with MSG_MORE, so it does not push out a partial segment.
+ * @return 0 on success.
+ */
+static int flush_client_output(conn_info *conn, int more) {
+    // The write watcher is already draining the buffer
+    if (conn->use_write_buf) return 0;
+
+    // Copy the output of a client on the rings, which also
+    // wakes it for the room made in the request ring
+    if (conn->shm) {
+        int res = drain_shm_output(conn);
+        if (res < 0) {
+            syslog(LOG_ERR, "Failed to send a file to connection [%d]! %s.",
+                    conn->client.fd, strerror(errno));
+            return 1;
+        } else if (res > 0) {
+            conn->use_write_buf = 1;
+            ev_io_start(conn->thread_ev->loop, &conn->write_client);
+        }
+        return 0;
+    }
+    if (conn->output.read_cursor == conn->output.write_cursor) return 0;
+
+    // Build the IO vectors to perform the write
+    struct iovec vectors[2];
+    int num_vectors;
+    circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
+
+    // Issue the write
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = vectors;
+    msg.msg_iovlen = num_vectors;
+    int flags = 0;
+#ifdef MSG_MORE
+    if (more) flags |= MSG_MORE;
+#else
+    (void)more;
+#endif
+    ssize_t sent = sendmsg(conn->client.fd, &msg, flags);
+    if (sent == -1) {
+        if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
+            syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
+                    conn->client.fd, strerror(errno));
+            return 1;
+        }
+        sent = 0;
+    }
+    circbuf_advance_read(&conn->output, sent);
+
+    // Setup the async write of the rest
+    if (conn->output.read_cursor != conn->output.write_cursor) {
+        conn->use_write_buf = 1;
+        ev_io_start(conn->thread_ev->loop, &conn->write_client);
+    }
+    return 0;
+}
+
+
+static int send_client_response_buffered(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
+    // Copy the buffers to the output buffer
+    int res = 0;
+    for (int i=0; i< num_bufs; i++) {
+        res = circbuf_write(&conn->output, response_buffers[i], buf_sizes[i]);
+        if (res) break;
+    }
+    return res;
+}
+
+
+static int send_client_response_direct(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
+    // Stack allocate the iovectors
+    struct iovec *vectors = alloca(num_bufs * sizeof(struct iovec));
+
+    // Setup all the pointers
+    ssize_t total_bytes = 0;
+    for (int i=0; i < num_bufs; i++) {
+        vectors[i].iov_base = response_buffers[i];
+        vectors[i].iov_len = buf_sizes[i];
+        total_bytes += buf_sizes[i];
+    }
+
+    // Perform the write
+    ssize_t sent = writev(conn->client.fd, vectors, num_bufs);
+    if (sent == total_bytes) return 0;
+
+    // Check for a fatal error
+    if (sent == -1) {
+        if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
+            syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
+                    conn->client.fd, strerror(errno));
+            return 1;
+        }
+    }
+
+    // Figure out which buffer we left off on
+    int skip_bytes = 0;
+    int index = 0;
+    for (index; index < num_bufs; index++) {
+        skip_bytes += buf_sizes[index];
+        if (skip_bytes > sent) {
+            skip_bytes -= buf_sizes[index];
+            break;
+        }
+    }
+
+    // Copy the buffers
+    int res, offset;
+    for (int i=index; i < num_bufs; i++) {
+        offset = 0;
+        if (i == index && skip_bytes < sent) {
+            offset = sent - skip_bytes;
+        }
+        res = circbuf_write(&conn->output, response_buffers[i] + offset, buf_sizes[i] - offset);
+        if (res) return 1;
+    }
+
+    // Setup the async write
+    conn->use_write_buf = 1;
+    ev_io_start(conn->thread_ev->loop, &conn->write_client);
+
+    // Done
+    return 0;
+}
+
+
+/**
+ * This method is used to conveniently extract commands from the
+ * command buffer. It scans up to a terminator, and then sets the
+ * buf to the start of the buffer, and buf_len to the length
+ * of the buffer. The input buffer is linear, so the command is
+ * always returned in place and is valid until the next read.
+ * This method consumes the bytes from the underlying buffer, freeing
+ * space for later reads.
+ * @arg conn The client connection
+ * @arg terminator The terminator charactor to look for. Replaced by null terminator.
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg buf_len Output parameter, the length of the buffer.
+ * @return 0 on success, -1 if the terminator is not found.
+ */
+int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len) {
+    // Scan from the read cursor to the write cursor
+    linear_buffer *in = &conn->input;
+    char *term_addr = memchr(in->buffer + in->read_cursor,
+                             terminator,
+                             in->write_cursor - in->read_cursor);
+    if (!term_addr) return -1;
+
+    // Return the command in place, and move up the read cursor
+    *buf = in->buffer + in->read_cursor;
+    *buf_len = term_addr - *buf + 1;    // Difference between the terminator and location
+    *term_addr = '\0';                  // Add a null terminator
+    in->read_cursor = term_addr - in->buffer + 1;
+
+    // Minor optimization, if our read-cursor has caught up
+    // with the write cursor, reset them to the beginning
+    // to avoid compacting in the future
+    if (in->read_cursor == in->write_cursor) {
+        in->read_cursor = 0;
+        in->write_cursor = 0;
+    }
+    return 0;
+}
+
+
+/**
+ * Provides the unread input of a connection in place, without
+ * consuming it. Used to parse length prefixed frames.
+ * @arg conn The client connection
+ * @arg buf Output parameter, sets the start of the unread input.
+ * @return The number of unread bytes.
+ */
+int peek_input(bloom_conn_info *conn, char **buf) {
+    *buf = conn->input.buffer + conn->input.read_cursor;
+    return conn->input.write_cursor - conn->input.read_cursor;
+}
+
+
+/**
+ * Consumes bytes from the input of a connection, after
+ * they were handled in place with peek_input.
+ * @arg conn The client connection
+ * @arg bytes The number of bytes to consume
+ */
+void consume_input(bloom_conn_info *conn, int bytes) {
+    linear_buffer *in = &conn->input;
+    in->read_cursor += bytes;
+    if (in->read_cursor == in->write_cursor) {
+        in->read_cursor = 0;
+        in->write_cursor = 0;
+    }
+}
+
+
+/**
+ * Checks if a connection has switched to the binary protocol.
+ */
+int conn_binary_protocol(bloom_conn_info *conn) {
+    return conn->binary;
+}
+
+
+/**
+ * Switches a connection to the binary protocol, for
+ * all of its later input.
+ */
+void set_conn_binary_protocol(bloom_conn_info *conn) {
+    conn->binary = 1;
+}
+
+
+/**
+ * Checks if a connection is in no-reply mode.
+ */
+int conn_noreply(bloom_conn_info *conn) {
+    return conn->noreply;
+}
+
+
+/**
+ * Turns the no-reply mode of a connection on or off.
+ */
+void set_conn_noreply(bloom_conn_info *conn, int noreply) {
+    conn->noreply = noreply;
+}
+
+
+/**
+ * Sets the deadline of the commands of a connection.
+ */
+void set_conn_deadline(bloom_conn_info *conn, int msec) {
+    conn->deadline_msec = msec;
+    if (msec && !conn->timestamps) enable_timestamps(conn);
+}
+
+
+/**
+ * Checks if the unhandled input of a connection waited past
+ * its deadline, or past shed_lag_msec while its worker sheds.
+ */
+int conn_expired(bloom_conn_info *conn) {
+    int msec = conn->deadline_msec;
+    worker_ev_userdata *data = conn->thread_ev;
+    if (data && data->shedding) {
+        int shed_msec = data->netconf->config->shed_lag_msec;
+        if (!msec || shed_msec < msec) msec = shed_msec;
+    }
+    if (!msec) return 0;
+    return ev_time() * 1000000 > conn->arrival_usec + msec * 1000.0;
+}
+
+
+/**
+ * Checks if a connection is from another node of the cluster.
+ */
+int conn_peer(bloom_conn_info *conn) {
+    return conn->peer;
+}
+
+
+/**
+ * Marks a connection as one from another node of the cluster.
+ */
+void set_conn_peer(bloom_conn_info *conn) {
+    conn->peer = 1;
+}
+
+/**
+ * Sets the name the usage of a connection is counted under.
+ * The connection moves from the old name to the new one.
+ */
+void set_conn_client_name(bloom_conn_info *conn, char *name) {
+    conn->usage.connections--;
+    count_client_usage(conn);
+    strncpy(conn->client_name, name, CLIENT_NAME);
+    conn->client_name[CLIENT_NAME] = '\0';
+    conn->usage.connections = 1;
+}
+
+/**
+ * Counts usage of a connection outside of handle_client_connect.
+ * It is counted under the name with the rest of the usage.
+ */
+void conn_count_usage(bloom_conn_info *conn, int commands, uint64_t keys) {
+    conn->usage.commands += commands;
+    conn->usage.keys += keys;
+}
+
+/**
+ * Counts the usage of a connection under its name, on the
+ * table of the calling thread, and starts over.
+ */
+static void count_client_usage(conn_info *conn) {
+    clients_add(conn->client_name, &conn->usage);
+    memset(&conn->usage, 0, sizeof(bloom_client_usage));
 }
 
 
 /**
- * Shuts down all the connections
- * and listeners and prepares to exit.
- * @arg netconf The config for the networking stack.
- * @arg threads A list of worker threads
+ * Parks a connection while the filter of a command is faulted
+ * in, if the filter is not in memory. The connection stops
+ * reading, and the command is handed back by take_parked_command
+ * once the fault completes.
  */
-int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
-    // Stop listening for new connections
-    ev_io_stop(netconf->default_loop, &netconf->tcp_client);
-    ev_io_stop(netconf->default_loop, &netconf->udp_client);
-    close(netconf->tcp_client.fd);
-    close(netconf->udp_client.fd);
-
-    // Tell the threads to quit, async signal
-    for (int i=0; i < netconf->config->worker_threads; i++) {
-        write(netconf->workers[i]->pipefd[1], "q", 1);
+int park_client_command(bloom_conn_info *conn, bloom_filtmgr *mgr, char *filter_name,
+                        int type, char *args, int args_len) {
+    if (conn->datagram) return -1;
+
+    // Count the fault first, it may complete before the call returns
+    worker_ev_userdata *worker = conn->thread_ev;
+    __atomic_add_fetch(&worker->faults, 1, __ATOMIC_RELAXED);
+    conn->parked = 1;
+    conn->parked_type = type;
+    conn->parked_args = args;
+    conn->parked_args_len = args_len;
+    if (filtmgr_fault_filter_async(mgr, &conn->filter_cache, filter_name,
+                handle_fault_complete, conn) == 0) {
+        return 0;
     }
+    conn->parked = 0;
+    conn->parked_type = -1;
+    __atomic_sub_fetch(&worker->faults, 1, __ATOMIC_RELAXED);
+    return -1;
+}
 
-    // Wait for the threads to return
-    pthread_t thread;
-    for (int i=0; i < netconf->config->worker_threads; i++) {
-        thread = threads[i];
-        if (thread) pthread_join(thread, NULL);
-    }
 
-    // TODO: Close all the client connections
-    // ??? For now, we just leak the memory
-    // since we are shutdown down anyways...
+/**
+ * Parks a connection until a flush ticket completes. The
+ * connection resumes like after a fault, and the command
+ * is handed back by take_parked_command.
+ */
+int park_client_flush(bloom_conn_info *conn, bloom_filtmgr *mgr, uint64_t ticket,
+                      int type, char *args, int args_len) {
+    if (conn->datagram) return -1;
+
+    // Count the wait first, it may complete before the call returns
+    worker_ev_userdata *worker = conn->thread_ev;
+    __atomic_add_fetch(&worker->faults, 1, __ATOMIC_RELAXED);
+    conn->parked = 1;
+    conn->parked_type = type;
+    conn->parked_args = args;
+    conn->parked_args_len = args_len;
+    int res = filtmgr_wait_flush_async(mgr, ticket, handle_fault_complete, conn);
+    if (res == 0) return 0;
+    conn->parked = 0;
+    conn->parked_type = -1;
+    __atomic_sub_fetch(&worker->faults, 1, __ATOMIC_RELAXED);
+    return res;
+}
 
-    // Shutdown the event loo
-    ev_loop_destroy(netconf->default_loop);
 
-    // Free the netconf
-    free(netconf->workers);
-    free(netconf);
+/**
+ * Parks a connection while an admin command is handled on an
+ * admin thread. The responses are gathered aside, and written
+ * once the connection resumes.
+ */
+int park_client_admin(bloom_conn_info *conn, int type, char *args, int args_len) {
+    bloom_networking *netconf = conn->thread_ev->netconf;
+    if (conn->datagram || !netconf->num_admin_threads) return -1;
+
+    // Counted like a fault, so the worker waits for it on exit
+    __atomic_add_fetch(&conn->thread_ev->faults, 1, __ATOMIC_RELAXED);
+    conn->parked = 1;
+    conn->parked_type = type;
+    conn->parked_args = args;
+    conn->parked_args_len = args_len;
+    conn->next = NULL;
+
+    pthread_mutex_lock(&netconf->admin_lock);
+    if (netconf->admin_tail)
+        netconf->admin_tail->next = conn;
+    else
+        netconf->admin_queue = conn;
+    netconf->admin_tail = conn;
+    pthread_cond_signal(&netconf->admin_cond);
+    pthread_mutex_unlock(&netconf->admin_lock);
     return 0;
 }
 
-/*
- * These are externally visible methods for
- * interacting with the connection buffers.
- */
 
 /**
- * Called to close and cleanup a client connection.
- * Must be called when the connection is not already
- * scheduled. e.g. After ev_io_stop() has been called.
- * Leaves the connection in the conns list so that it
- * can be re-used.
- * @arg conn The connection to close
+ * Parks a connection while a command is handled by the worker
+ * owning its filter, with filter_affinity. The responses are
+ * gathered aside, and written once the connection resumes.
  */
-static void close_client_connection(conn_info *conn) {
-    // Stop the libev clients
-    ev_io_stop(conn->thread_ev->loop, &conn->client);
-    ev_io_stop(conn->thread_ev->loop, &conn->write_client);
+int park_client_affine(bloom_conn_info *conn, char *filter_name, int type, char *args, int args_len) {
+    worker_ev_userdata *worker = conn->thread_ev;
+    bloom_networking *netconf = worker->netconf;
+    if (conn->datagram || !netconf->affine_rings) return -1;
+    int owner = filter_owner(netconf, filter_name);
+    if (owner == worker->id) return -1;
+
+    // Handle the command here if the owner is behind
+    affine_ring *ring = netconf->affine_rings + owner * netconf->max_workers + worker->id;
+    unsigned tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= AFFINE_RING_SIZE) return -1;
+
+    // Counted like a fault, so the worker waits for it on exit
+    __atomic_add_fetch(&worker->faults, 1, __ATOMIC_RELAXED);
+    conn->parked = 1;
+    conn->parked_type = type;
+    conn->parked_args = args;
+    conn->parked_args_len = args_len;
+    ring->slots[tail % AFFINE_RING_SIZE] = conn;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    worker_ev_userdata *dest = netconf->workers[owner];
+    ev_async_send(dest->loop, &dest->notify);
+    return 0;
+}
 
-    // Clear everything out
-    circbuf_free(&conn->input);
-    circbuf_free(&conn->output);
 
-    // Close the fd
-    syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
-    close(conn->client.fd);
-    free(conn);
+/**
+ * Leaves a command read ahead by the worker owning a filter,
+ * to be handled by the worker of the connection once it resumes.
+ */
+void unread_command(bloom_conn_info *conn, int type, char *args, int args_len) {
+    conn->ahead_type = type;
+    conn->ahead_args = args;
+    conn->ahead_args_len = args_len;
 }
 
+
 /**
- * Marks a client connection as 'inactive' and
- * to be closed when the event loop is finished.
+ * Takes the command left by unread_command.
  */
-static void deactivate_client_connection(conn_info *conn) {
-    if (!conn->active) return;
-    conn->active = 0;
-    conn->next = conn->thread_ev->inactive;
-    conn->thread_ev->inactive = conn;
+int take_unread_command(bloom_conn_info *conn, char **args, int *args_len) {
+    int type = conn->ahead_type;
+    if (type < 0) return -1;
+    conn->ahead_type = -1;
+    *args = conn->ahead_args;
+    *args_len = conn->ahead_args_len;
+    return type;
 }
 
+
 /**
- * Sends a response to a client.
- * @arg conn The client connection
- * @arg response_buffers A list of response buffers to send
- * @arg buf_sizes A list of the buffer sizes
- * @arg num_bufs The number of response buffers
- * @return 0 on success.
+ * Takes the command left by a park, once the connection resumed.
  */
-int send_client_response(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
-    // Silently bail of the connection is not active
-    if (!conn->active) return 0;
+int take_parked_command(bloom_conn_info *conn, char **args, int *args_len) {
+    // Write the responses of an admin command
+    if (conn->deferred) {
+        send_client_response(conn, &conn->deferred, &conn->deferred_len, 1);
+        free(conn->deferred);
+        conn->deferred = NULL;
+        conn->deferred_len = conn->deferred_size = 0;
+    }
 
-    int send_bufs, res = 0;
-    for (int offset=0; offset < num_bufs && res == 0; offset += IOV_MAX) {
-        // Determine how many buffers to send
-        send_bufs = ((num_bufs - offset) <= IOV_MAX) ? (num_bufs - offset) : IOV_MAX;
+    // Then the file it sends
+    if (conn->deferred_fd >= 0) {
+        int fd = conn->deferred_fd;
+        conn->deferred_fd = -1;
+        send_client_file(conn, fd, conn->deferred_fd_len);
+    }
 
-        // Check if we are doing buffered writes
-        if (conn->use_write_buf) {
-            res = send_client_response_buffered(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
-        } else {
-            res = send_client_response_direct(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
-        }
+    int type = conn->parked_type;
+    if (type >= 0) {
+        conn->parked_type = -1;
+        *args = conn->parked_args;
+        *args_len = conn->parked_args_len;
+        return type;
     }
 
-    // Disable the connection on error
-    if (res) deactivate_client_connection(conn);
-    return res;
+    // Then the tagged commands whose filters faulted in, the
+    // one handled before is done with its arguments
+    free(conn->tagged_running);
+    tagged_command *cmd = conn->tagged_running = conn->tagged_ready;
+    if (!cmd) return -1;
+    conn->tagged_ready = cmd->next;
+    if (!conn->tagged_ready) conn->tagged_ready_tail = NULL;
+    set_client_tag(conn, cmd->tag, cmd->tag_len);
+    *args = cmd->args;
+    *args_len = cmd->args_len;
+    return cmd->type;
 }
 
 
-static int send_client_response_buffered(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
-    // Copy the buffers to the output buffer
-    int res = 0;
-    for (int i=0; i< num_bufs; i++) {
-        res = circbuf_write(&conn->output, response_buffers[i], buf_sizes[i]);
-        if (res) break;
+/**
+ * Parks a tagged command while the filter of the command is
+ * faulted in, if the filter is not in memory. Unlike with
+ * park_client_command, the connection keeps reading, and the
+ * command is handed back by take_parked_command once its fault
+ * completes. The tag and arguments are copied.
+ */
+int park_tagged_command(bloom_conn_info *conn, bloom_filtmgr *mgr, char *filter_name,
+                        int type, char *args, int args_len) {
+    if (conn->datagram || !conn->tag) return -1;
+
+    tagged_command *cmd = malloc(sizeof(tagged_command) + conn->tag_len + args_len);
+    cmd->conn = conn;
+    cmd->worker = conn->thread_ev;
+    cmd->type = type;
+    cmd->tag = (char*)(cmd + 1);
+    cmd->tag_len = conn->tag_len;
+    memcpy(cmd->tag, conn->tag, conn->tag_len);
+    cmd->args = cmd->tag + cmd->tag_len;
+    cmd->args_len = args_len;
+    memcpy(cmd->args, args, args_len);
+
+    // Count the fault first, it may complete before the call returns
+    __atomic_add_fetch(&cmd->worker->faults, 1, __ATOMIC_RELAXED);
+    conn->tagged_pending++;
+    if (filtmgr_fault_filter_async(mgr, &conn->filter_cache, filter_name,
+                handle_tagged_fault_complete, cmd) == 0) {
+        conn->tag = NULL;
+        return 0;
     }
-    return res;
+    conn->tagged_pending--;
+    __atomic_sub_fetch(&cmd->worker->faults, 1, __ATOMIC_RELAXED);
+    free(cmd);
+    return -1;
 }
 
 
-static int send_client_response_direct(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
-    // Stack allocate the iovectors
-    struct iovec *vectors = alloca(num_bufs * sizeof(struct iovec));
+/**
+ * Sets the tag prefixed to the next response on a connection,
+ * so that a tagged command is matched to its response.
+ */
+void set_client_tag(bloom_conn_info *conn, char *tag, int tag_len) {
+    conn->tag = tag;
+    conn->tag_len = tag_len;
+}
 
-    // Setup all the pointers
-    ssize_t total_bytes = 0;
-    for (int i=0; i < num_bufs; i++) {
-        vectors[i].iov_base = response_buffers[i];
-        vectors[i].iov_len = buf_sizes[i];
-        total_bytes += buf_sizes[i];
-    }
 
-    // Perform the write
-    ssize_t sent = writev(conn->client.fd, vectors, num_bufs);
-    if (sent == total_bytes) return 0;
+/**
+ * Checks if the command being handled on a connection is tagged
+ */
+int conn_tagged(bloom_conn_info *conn) {
+    return conn->tag != NULL;
+}
 
-    // Check for a fatal error
-    if (sent == -1) {
-        if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
-            syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
-                    conn->client.fd, strerror(errno));
-            return 1;
-        }
-    }
 
-    // Figure out which buffer we left off on
-    int skip_bytes = 0;
-    int index = 0;
-    for (index; index < num_bufs; index++) {
-        skip_bytes += buf_sizes[index];
-        if (skip_bytes > sent) {
-            skip_bytes -= buf_sizes[index];
-            break;
-        }
+/**
+ * Sends a file to a client after the responses before it.
+ * The write watcher sends it, and the client stops reading
+ * until it is sent.
+ */
+int send_client_file(conn_info *conn, int fd, uint64_t len) {
+    // An admin thread leaves the file to the worker
+    if (conn->deferring) {
+        if (conn->deferred_fd >= 0) close(conn->deferred_fd);
+        conn->deferred_fd = fd;
+        conn->deferred_fd_len = len;
+        return 0;
     }
 
-    // Copy the buffers
-    int res, offset;
-    for (int i=index; i < num_bufs; i++) {
-        offset = 0;
-        if (i == index && skip_bytes < sent) {
-            offset = sent - skip_bytes;
-        }
-        res = circbuf_write(&conn->output, response_buffers[i] + offset, buf_sizes[i] - offset);
-        if (res) return 1;
+    // Discard the file of a closed connection or a datagram
+    if (!conn->active || conn->datagram || !len || conn->send_fd >= 0) {
+        close(fd);
+        return (conn->send_fd >= 0) ? -1 : 0;
     }
+    conn->send_fd = fd;
+    conn->send_offset = 0;
+    conn->send_left = len;
 
-    // Setup the async write
+    // Later responses are buffered behind the file. The write
+    // watcher of a client on the rings waits on an eventfd, which
+    // is rung so it copies the file once the loop is back.
     conn->use_write_buf = 1;
     ev_io_start(conn->thread_ev->loop, &conn->write_client);
+    if (conn->shm) shm_ring_ring(conn->write_client.fd);
+    return 0;
+}
 
-    // Done
+
+/**
+ * Checks if a connection is sending a file.
+ */
+int conn_sending_file(conn_info *conn) {
+    return conn->send_fd >= 0;
+}
+
+
+/**
+ * Writes the next bytes of input of a client to a file. The
+ * input already read is written at once, the rest as it is read.
+ */
+int receive_client_file(conn_info *conn, int fd, char *path, uint64_t len,
+                        int type, char *args, int args_len) {
+    if (conn->datagram || conn->recv_left) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    free(conn->recv_path);
+    free(conn->recv_args);
+    conn->recv_fd = fd;
+    conn->recv_path = strdup(path);
+    conn->recv_left = len;
+    conn->recv_type = type;
+    conn->recv_args = (args) ? strndup(args, args_len) : NULL;
+    conn->recv_args_len = args_len;
+    receive_file_input(conn);
     return 0;
 }
 
 
 /**
- * This method is used to conveniently extract commands from the
- * command buffer. It scans up to a terminator, and then sets the
- * buf to the start of the buffer, and buf_len to the length
- * of the buffer. The output param should_free indicates that
- * the caller should free the buffer pointed to by buf when it is finished.
- * This method consumes the bytes from the underlying buffer, freeing
- * space for later reads.
- * @arg conn The client connection
- * @arg terminator The terminator charactor to look for. Replaced by null terminator.
- * @arg buf Output parameter, sets the start of the buffer.
- * @arg buf_len Output parameter, the length of the buffer.
- * @arg should_free Output parameter, should the buffer be freed by the caller.
- * @return 0 on success, -1 if the terminator is not found.
+ * Writes the input of a connection to the file being received.
+ * Once it is complete, the file is closed and the command of
+ * the file is left as read ahead.
  */
-int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free) {
-    // First we need to find the terminator...
-    char *term_addr = NULL;
-    if (conn->input.write_cursor < conn->input.read_cursor) {
-        /*
-         * We need to scan from the read cursor to the end of
-         * the buffer, and then from the start of the buffer to
-         * the write cursor.
-        */
-        term_addr = memchr(conn->input.buffer+conn->input.read_cursor,
-                           terminator,
-                           conn->input.buf_size - conn->input.read_cursor);
-
-        // If we've found the terminator, we can just move up
-        // the read cursor
-        if (term_addr) {
-            *buf = conn->input.buffer + conn->input.read_cursor;
-            *buf_len = term_addr - *buf + 1;    // Difference between the terminator and location
-            *term_addr = '\0';              // Add a null terminator
-            *should_free = 0;               // No need to free, in the buffer
-            conn->input.read_cursor = term_addr - conn->input.buffer + 1; // Push the read cursor forward
-            return 0;
+static void receive_file_input(conn_info *conn) {
+    linear_buffer *in = &conn->input;
+    uint64_t avail = in->write_cursor - in->read_cursor;
+    uint32_t take = (avail < conn->recv_left) ? avail : conn->recv_left;
+
+    // Drop the rest of the input once a write fails
+    ssize_t written;
+    for (uint32_t off=0; off < take && conn->recv_fd >= 0; off += written) {
+        written = write(conn->recv_fd, in->buffer + in->read_cursor + off, take - off);
+        if (written == -1 && errno == EINTR) {
+            written = 0;
+        } else if (written <= 0) {
+            syslog(LOG_ERR, "Failed to write the file '%s' of connection [%d]! %s.",
+                    conn->recv_path, conn->client.fd, strerror(errno));
+            close(conn->recv_fd);
+            conn->recv_fd = -1;
         }
+    }
+    consume_input(conn, take);
+    conn->recv_left -= take;
+    if (conn->recv_left) return;
 
-        // Wrap around
-        term_addr = memchr(conn->input.buffer,
-                           terminator,
-                           conn->input.write_cursor);
-
-        // If we've found the terminator, we need to allocate
-        // a contiguous buffer large enough to store everything
-        // and provide a linear buffer
-        if (term_addr) {
-            int start_size = term_addr - conn->input.buffer + 1;
-            int end_size = conn->input.buf_size - conn->input.read_cursor;
-            *buf_len = start_size + end_size;
-            *buf = malloc(*buf_len);
-
-            // Copy from the read cursor to the end
-            memcpy(*buf, conn->input.buffer+conn->input.read_cursor, end_size);
-
-            // Copy from the start to the terminator
-            *term_addr = '\0';              // Add a null terminator
-            memcpy(*buf+end_size, conn->input.buffer, start_size);
-
-            *should_free = 1;               // Must free, not in the buffer
-            conn->input.read_cursor = start_size; // Push the read cursor forward
-        }
+    if (conn->recv_fd >= 0) close(conn->recv_fd);
+    conn->recv_fd = -1;
+    if (conn->recv_type >= 0) unread_command(conn, conn->recv_type, conn->recv_args, conn->recv_args_len);
+}
 
-    } else {
-        /*
-         * We need to scan from the read cursor to write buffer.
-         */
-        term_addr = memchr(conn->input.buffer+conn->input.read_cursor,
-                           terminator,
-                           conn->input.write_cursor - conn->input.read_cursor);
-
-        // If we've found the terminator, we can just move up
-        // the read cursor
-        if (term_addr) {
-            *buf = conn->input.buffer + conn->input.read_cursor;
-            *buf_len = term_addr - *buf + 1; // Difference between the terminator and location
-            *term_addr = '\0';               // Add a null terminator
-            *should_free = 0;                // No need to free, in the buffer
-            conn->input.read_cursor = term_addr - conn->input.buffer + 1; // Push the read cursor forward
-        }
+
+/**
+ * Moves a client on the Unix socket to a pair of shared memory
+ * rings. The responses before it must be written, since the
+ * reply passing the memfd and eventfds is sent on the socket.
+ */
+int start_client_shm(conn_info *conn, uint32_t ring_size) {
+    if (!conn->local || conn->shm || conn->deferring || conn->datagram) return -1;
+    if (flush_client_output(conn, 0) || conn->use_write_buf) return -1;
+
+    bloom_shm_ring *ring;
+    int res = shm_ring_create(ring_size, &ring);
+    if (res == -ENOTSUP) return -2;
+    if (res) {
+        syslog(LOG_ERR, "Failed to create the shared memory rings of connection [%d]! %s.",
+                conn->client.fd, strerror(-res));
+        return -3;
     }
 
-    // Minor optimization, if our read-cursor has caught up
-    // with the write cursor, reset them to the beginning
-    // to avoid wrapping in the future
-    if (conn->input.read_cursor == conn->input.write_cursor) {
-        conn->input.read_cursor = 0;
-        conn->input.write_cursor = 0;
+    // Reply with the memfd and the eventfds
+    int fds[4] = {ring->memfd, ring->req_efd, ring->room_efd, ring->client_efd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {(void*)"Done\n", 5};
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    bzero(control, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(conn->client.fd, &msg, MSG_NOSIGNAL) != 5) {
+        syslog(LOG_ERR, "Failed to pass the shared memory rings to connection [%d]! %s.",
+                conn->client.fd, strerror(errno));
+        shm_ring_destroy(ring);
+        return -3;
     }
 
-    // Return success if we have a term address
-    return ((term_addr) ? 0 : -1);
+    // The mapping outlives the memfd
+    close(ring->memfd);
+    ring->memfd = -1;
+
+    // Wait on the eventfds, and on the socket for the close
+    ev_loop *lp = conn->thread_ev->loop;
+    ev_io_stop(lp, &conn->client);
+    ev_io_init(&conn->hangup, handle_shm_hangup, conn->client.fd, EV_READ);
+    conn->hangup.data = conn;
+    ev_io_start(lp, &conn->hangup);
+    ev_io_set(&conn->client, ring->req_efd, EV_READ);
+    ev_io_set(&conn->write_client, ring->room_efd, EV_READ);
+    conn->shm = ring;
+    syslog(LOG_DEBUG, "Moved connection to shared memory rings of %u bytes. [%d]",
+            ring_size, conn->hangup.fd);
+    return 0;
+}
+
+
+/**
+ * Invoked when the socket of a client on the rings is readable,
+ * which it only is once closed. Anything else sent is dropped.
+ */
+static void handle_shm_hangup(ev_loop *lp, ev_io *watcher, int ready_events) {
+    conn_info *conn = watcher->data;
+    char buf[256];
+    ssize_t read_bytes = read(watcher->fd, buf, sizeof(buf));
+    if (read_bytes > 0 || (read_bytes == -1 && (errno == EAGAIN || errno == EINTR))) return;
+    syslog(LOG_DEBUG, "Closed client connection. [%d]\n", watcher->fd);
+    ev_io_stop(lp, watcher);
+    deactivate_client_connection(conn);
+}
+
+
+/**
+ * Returns the filter cache of a connection.
+ */
+bloom_filtmgr_cache* conn_filter_cache(bloom_conn_info *conn) {
+    return &conn->filter_cache;
 }
 
 
+/**
+ * Accepts a connection that is already non-blocking.
+ * On Linux accept4() does this in the same syscall,
+ * sparing the fcntl() round trips of every new client.
+ * @return The client fd, or -1 on error.
+ */
+static int accept_nonblock(int listen_fd, struct sockaddr *addr, socklen_t *addr_len) {
+#ifdef __linux__
+    return accept4(listen_fd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    return accept(listen_fd, addr, addr_len);
+#endif
+}
+
 /**
  * Sets the client socket options.
  * @return 0 on success, 1 on error.
  */
-static int set_client_sockopts(int client_fd) {
+static int set_client_sockopts(int client_fd, int tcp) {
+#ifndef __linux__
     // Setup the socket to be non-blocking
     int sock_flags = fcntl(client_fd, F_GETFL, 0);
     if (sock_flags < 0) {
@@ -961,6 +3662,8 @@ static int set_client_sockopts(int client_fd) {
         close(client_fd);
         return 1;
     }
+#endif
+    if (!tcp) return 0;
 
     /**
      * Set TCP_NODELAY. This will allow us to send small response packets more
@@ -984,24 +3687,152 @@ static int set_client_sockopts(int client_fd) {
  * Returns a new conn_info struct
  */
 static conn_info* get_conn() {
-    // Allocate space
-    conn_info *conn = malloc(sizeof(conn_info));
+    // Reuse a closed connection of this thread, if any.
+    // Its buffers are empty and of the initial size.
+    conn_info *conn = CONN_POOL;
+    if (conn) {
+        CONN_POOL = conn->next;
+        CONN_POOL_LEN--;
+    } else {
+        conn = malloc(sizeof(conn_info));
+        linbuf_init(&conn->input);
+        circbuf_init(&conn->output);
+    }
+
+    stats_add(STAT_CONNECTIONS, 1);
 
     // Setup variables
     conn->active = 1;
     conn->use_write_buf = 0;
-
-    // Prepare the buffers
-    circbuf_init(&conn->input);
-    circbuf_init(&conn->output);
+    conn->corked = 0;
+    conn->binary = 0;
+    conn->noreply = 0;
+    conn->peer = 0;
+    conn->datagram = 0;
+    conn->local = 0;
+    conn->shm = NULL;
+    conn->parked = 0;
+    conn->parked_type = -1;
+    conn->ahead_type = -1;
+    conn->send_fd = conn->deferred_fd = conn->recv_fd = -1;
+    conn->recv_path = conn->recv_args = NULL;
+    conn->recv_left = 0;
+    conn->ready = 0;
+    conn->deferring = 0;
+    conn->deferred = NULL;
+    conn->deferred_len = conn->deferred_size = 0;
+    conn->tick_bytes = 0;
+    conn->tick = 0;
+    conn->deadline_msec = 0;
+    conn->client_name[0] = '\0';
+    memset(&conn->usage, 0, sizeof(bloom_client_usage));
+    conn->usage.connections = 1;
+    conn->tag = NULL;
+    conn->tagged_pending = 0;
+    conn->tagged_ready = conn->tagged_ready_tail = conn->tagged_running = NULL;
+    conn->timestamps = 0;
+    conn->arrival_usec = conn->read_usec = 0;
+    conn->filter_cache.filter = NULL;
+    conn->filter_cache.name[0] = '\0';
+    conn->client_next = NULL;
+    conn->client_pprev = NULL;
 
     // Store a reference to the conn object
+    ev_idle_init(&conn->resume, handle_client_resume);
     conn->client.data = conn;
     conn->write_client.data = conn;
+    conn->resume.data = conn;
 
     return conn;
 }
 
+/**
+ * Returns a closed connection to the free list of this
+ * thread, or frees it if the list is full.
+ */
+static void put_conn(conn_info *conn) {
+    // Drop the responses of an admin command never written
+    free(conn->deferred);
+    conn->deferred = NULL;
+
+    // And the files never sent, or never received in full
+    if (conn->send_fd >= 0) close(conn->send_fd);
+    if (conn->deferred_fd >= 0) close(conn->deferred_fd);
+    if (conn->recv_fd >= 0) close(conn->recv_fd);
+    if (conn->recv_path && conn->recv_left) unlink(conn->recv_path);
+    free(conn->recv_path);
+    free(conn->recv_args);
+
+    // And the tagged commands never handled
+    tagged_command *cmd, *next;
+    for (cmd = conn->tagged_ready; cmd; cmd = next) {
+        next = cmd->next;
+        free(cmd);
+    }
+    free(conn->tagged_running);
+
+    if (CONN_POOL_LEN >= CONN_POOL_SIZE) {
+        linbuf_free(&conn->input);
+        circbuf_free(&conn->output);
+        free(conn);
+        return;
+    }
+
+    // Drop any unread input or unsent output
+    conn->input.read_cursor = conn->input.write_cursor = 0;
+    conn->output.read_cursor = conn->output.write_cursor = 0;
+    shrink_client_buffers(conn, INIT_CONN_BUF_SIZE);
+
+    conn->next = CONN_POOL;
+    CONN_POOL = conn;
+    CONN_POOL_LEN++;
+}
+
+
+/**
+ * Links a connection into the clients of the worker it is scheduled on
+ */
+static void link_client(worker_ev_userdata *data, conn_info *conn) {
+    conn->client_next = data->clients;
+    if (data->clients) data->clients->client_pprev = &conn->client_next;
+    conn->client_pprev = &data->clients;
+    data->clients = conn;
+}
+
+/**
+ * Unlinks a connection from the clients of its worker, if linked
+ */
+static void unlink_client(conn_info *conn) {
+    if (!conn->client_pprev) return;
+    *conn->client_pprev = conn->client_next;
+    if (conn->client_next) conn->client_next->client_pprev = conn->client_pprev;
+    conn->client_next = NULL;
+    conn->client_pprev = NULL;
+}
+
+/**
+ * Shrinks the buffers of the clients of a worker that read
+ * nothing for IDLE_SHRINK_TICKS back to the initial size.
+ * Parked clients are left alone, since their command is
+ * in the input buffer and may be used by another thread.
+ */
+static void shrink_idle_clients(worker_ev_userdata *data) {
+    for (conn_info *conn = data->clients; conn; conn = conn->client_next) {
+        if (conn->parked || conn->deferring) continue;
+        if (data->tick - conn->tick < IDLE_SHRINK_TICKS) continue;
+        shrink_client_buffers(conn, INIT_CONN_BUF_SIZE);
+    }
+}
+
+/**
+ * Shrinks the drained buffers of a connection back
+ * to the initial size, if they are larger than max_size.
+ */
+static void shrink_client_buffers(conn_info *conn, uint64_t max_size) {
+    linbuf_shrink(&conn->input, max_size);
+    if (!conn->use_write_buf) circbuf_shrink(&conn->output, max_size);
+}
+
 /*
  * Methods for manipulating our circular buffers
  */
@@ -1012,11 +3843,22 @@ static void circbuf_init(circular_buffer *buf) {
     buf->write_cursor = 0;
     buf->buf_size = INIT_CONN_BUF_SIZE * sizeof(char);
     buf->buffer = malloc(buf->buf_size);
+    stats_add(STAT_BUFFER_BYTES, buf->buf_size);
+}
+
+// Shrinks an empty buffer back to the initial size, if it is larger than max_size
+static void circbuf_shrink(circular_buffer *buf, uint64_t max_size) {
+    if (buf->buf_size <= max_size || buf->read_cursor != buf->write_cursor) return;
+    circbuf_free(buf);
+    circbuf_init(buf);
 }
 
 // Frees a buffer
 static void circbuf_free(circular_buffer *buf) {
-    if (buf->buffer) free(buf->buffer);
+    if (buf->buffer) {
+        free(buf->buffer);
+        stats_add(STAT_BUFFER_BYTES, -(int64_t)buf->buf_size);
+    }
     buf->buffer = NULL;
 }
 
@@ -1062,6 +3904,7 @@ static void circbuf_grow_buf(circular_buffer *buf) {
 
     // Update the buffer locations and everything
     free(buf->buffer);
+    stats_add(STAT_BUFFER_BYTES, new_size - buf->buf_size);
     buf->buffer = new_buf;
     buf->buf_size = new_size;
     buf->read_cursor = 0;
@@ -1069,25 +3912,6 @@ static void circbuf_grow_buf(circular_buffer *buf) {
 }
 
 
-// Initializes a pair of iovectors to be used for readv
-static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors) {
-    // Check if we've wrapped around
-    *num_vectors = 1;
-    if (buf->write_cursor < buf->read_cursor) {
-        vectors[0].iov_base = buf->buffer + buf->write_cursor;
-        vectors[0].iov_len = buf->read_cursor - buf->write_cursor - 1;
-    } else {
-        vectors[0].iov_base = buf->buffer + buf->write_cursor;
-        vectors[0].iov_len = buf->buf_size - buf->write_cursor - 1;
-        if (buf->read_cursor > 0)  {
-            vectors[0].iov_len += 1;
-            vectors[1].iov_base = buf->buffer;
-            vectors[1].iov_len = buf->read_cursor - 1;
-            *num_vectors = 2;
-        }
-    }
-}
-
 // Initializes a pair of iovectors to be used for writev
 static void circbuf_setup_writev_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors) {
     // Check if we've wrapped around
@@ -1105,10 +3929,6 @@ static void circbuf_setup_writev_iovec(circular_buffer *buf, struct iovec *vecto
 }
 
 // Advances the cursors
-static void circbuf_advance_write(circular_buffer *buf, uint64_t bytes) {
-    buf->write_cursor = (buf->write_cursor + bytes) % buf->buf_size;
-}
-
 static void circbuf_advance_read(circular_buffer *buf, uint64_t bytes) {
     buf->read_cursor = (buf->read_cursor + bytes) % buf->buf_size;
 
@@ -1155,3 +3975,58 @@ static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes) {
     return 0;
 }
 
+
+/*
+ * Methods for manipulating our linear buffers
+ */
+
+// Allocates the initial buffer
+static void linbuf_init(linear_buffer *buf) {
+    buf->read_cursor = 0;
+    buf->write_cursor = 0;
+    buf->buf_size = INIT_CONN_BUF_SIZE * sizeof(char);
+    buf->buffer = malloc(buf->buf_size);
+    stats_add(STAT_BUFFER_BYTES, buf->buf_size);
+}
+
+// Shrinks an empty buffer back to the initial size, if it is larger than max_size
+static void linbuf_shrink(linear_buffer *buf, uint64_t max_size) {
+    if (buf->buf_size <= max_size || buf->read_cursor != buf->write_cursor) return;
+    linbuf_free(buf);
+    linbuf_init(buf);
+}
+
+// Frees a buffer
+static void linbuf_free(linear_buffer *buf) {
+    if (buf->buffer) {
+        free(buf->buffer);
+        stats_add(STAT_BUFFER_BYTES, -(int64_t)buf->buf_size);
+    }
+    buf->buffer = NULL;
+}
+
+/**
+ * Makes sure at least half of the buffer is free after the
+ * write cursor. Unread data is first moved to the front, and
+ * the buffer only grows by the multiplier if that is not enough.
+ * Only a partial command is ever left unread, so moves are small.
+ */
+static void linbuf_reserve(linear_buffer *buf) {
+    if (buf->buf_size - buf->write_cursor >= buf->buf_size / 2) return;
+
+    // Compact the unread bytes to the front
+    uint32_t unread = buf->write_cursor - buf->read_cursor;
+    if (buf->read_cursor > 0) {
+        memmove(buf->buffer, buf->buffer + buf->read_cursor, unread);
+        buf->read_cursor = 0;
+        buf->write_cursor = unread;
+    }
+
+    // Grow if a large command fills most of the buffer
+    if (buf->buf_size - buf->write_cursor < buf->buf_size / 2) {
+        uint32_t new_size = buf->buf_size * CONN_BUF_MULTIPLIER * sizeof(char);
+        buf->buffer = realloc(buf->buffer, new_size);
+        stats_add(STAT_BUFFER_BYTES, new_size - buf->buf_size);
+        buf->buf_size = new_size;
+    }
+}
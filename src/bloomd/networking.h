@@ -1,5 +1,6 @@
 #ifndef BLOOM_NETWORKING_H
 #define BLOOM_NETWORKING_H
+#include <signal.h>
 #include "config.h"
 #include "filter_manager.h"
 
@@ -15,13 +16,64 @@ typedef struct conn_info bloom_conn_info;
  */
 int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking **netconf_out);
 
+/**
+ * Hands listeners inherited from another process to the
+ * next init_networking. They are used in place of opening
+ * new listeners, if they are bound to the same address.
+ * @arg tcp_fds The TCP listeners
+ * @arg num_tcp The number of TCP listeners
+ * @arg udp_fds The UDP sockets
+ * @arg num_udp The number of UDP sockets
+ */
+void networking_inherit_listeners(int *tcp_fds, int num_tcp, int *udp_fds, int num_udp);
+
+/**
+ * Returns the listeners, so they can be handed to another
+ * process. They stay open until the networking is shut down.
+ * @arg netconf The configuration for the networking stack.
+ * @arg tcp_fds Output, the TCP listeners
+ * @arg num_tcp Output, the number of TCP listeners
+ * @arg udp_fds Output, the UDP sockets
+ * @arg num_udp Output, the number of UDP sockets
+ */
+void networking_listeners(bloom_networking *netconf, int **tcp_fds, int *num_tcp, int **udp_fds, int *num_udp);
+
 /**
  * Entry point for the main thread to start accepting
  * @arg netconf The configuration for the networking stack.
  * @arg should_run A flag checked to see if we should run
+ * @arg should_reload A flag checked to see if the configuration
+ * should be reloaded, and cleared once it is. Only the
+ * tunable settings and the worker_threads are reloaded.
+ * @arg config_file The configuration file, NULL for the defaults
  * @arg threads The list of worker threads
  */
-void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *threads);
+void enter_main_loop(bloom_networking *netconf, int *should_run, volatile sig_atomic_t *should_reload,
+        char *config_file, pthread_t *threads);
+
+/**
+ * Returns the number of worker threads to start, which is the
+ * most that can be active. The workers past worker_threads
+ * start out parked.
+ * @arg config The bloom server configuration
+ * @return The number of workers.
+ */
+int networking_max_workers(bloom_config *config);
+
+/**
+ * Changes the number of active workers, without a restart.
+ * New clients are only placed on the active workers, and the
+ * clients of the parked workers move to the active ones with
+ * their next command. Parked workers still accept their share
+ * of the TCP clients, which they hand on, and read their share
+ * of the UDP datagrams. With filter_affinity all the workers
+ * own filters, so the workers cannot change.
+ * @notes Thread safe.
+ * @arg netconf The configuration for the networking stack.
+ * @arg workers The workers to keep active
+ * @return 0 on success, -1 if the workers are out of range.
+ */
+int networking_set_workers(bloom_networking *netconf, int workers);
 
 /**
  * Entry point for threads to join the networking
@@ -58,17 +110,324 @@ int send_client_response(bloom_conn_info *conn, char **response_buffers, int *bu
  * This method is used to conveniently extract commands from the
  * command buffer. It scans up to a terminator, and then sets the
  * buf to the start of the buffer, and buf_len to the length
- * of the buffer. The output param should_free indicates that
- * the caller should free the buffer pointed to by buf when it is finished.
+ * of the buffer. The command is returned in place, and is
+ * valid until the next read of the connection.
  * This method consumes the bytes from the underlying buffer, freeing
  * space for later reads.
  * @arg conn The client connection
  * @arg terminator The terminator charactor to look for. Included in buf.
  * @arg buf Output parameter, sets the start of the buffer.
  * @arg buf_len Output parameter, the length of the buffer.
- * @arg should_free Output parameter, should the buffer be freed by the caller.
  * @return 0 on success, -1 if the terminator is not found.
  */
-int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free);
+int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len);
+
+/**
+ * Provides the unread input of a connection in place, without
+ * consuming it. Used to parse length prefixed frames. The input
+ * is valid until the next read of the connection.
+ * @arg conn The client connection
+ * @arg buf Output parameter, sets the start of the unread input.
+ * @return The number of unread bytes.
+ */
+int peek_input(bloom_conn_info *conn, char **buf);
+
+/**
+ * Consumes bytes from the input of a connection, after
+ * they were handled in place with peek_input.
+ * @arg conn The client connection
+ * @arg bytes The number of bytes to consume
+ */
+void consume_input(bloom_conn_info *conn, int bytes);
+
+/**
+ * Checks if a connection has switched to the binary protocol.
+ * @arg conn The client connection
+ * @return 1 if the connection uses the binary protocol, 0 otherwise.
+ */
+int conn_binary_protocol(bloom_conn_info *conn);
+
+/**
+ * Switches a connection to the binary protocol, for
+ * all of its later input.
+ * @arg conn The client connection
+ */
+void set_conn_binary_protocol(bloom_conn_info *conn);
+
+/**
+ * Checks if a connection is in no-reply mode, where
+ * sets are not answered unless they fail.
+ * @arg conn The client connection
+ * @return 1 if replies to sets are skipped, 0 otherwise.
+ */
+int conn_noreply(bloom_conn_info *conn);
+
+/**
+ * Turns the no-reply mode of a connection on or off.
+ * @arg conn The client connection
+ * @arg noreply 1 to skip the replies to sets, 0 to send them
+ */
+void set_conn_noreply(bloom_conn_info *conn, int noreply);
+
+/**
+ * Sets the deadline of the commands of a connection. A command
+ * that waited longer since its input arrived is not run. The
+ * wait counts from when the input reached the socket, so it
+ * includes the time the worker was busy with other clients.
+ * @arg conn The client connection
+ * @arg msec The deadline in milliseconds, 0 for none
+ */
+void set_conn_deadline(bloom_conn_info *conn, int msec);
+
+/**
+ * Checks if the next command of a connection waited past its
+ * deadline, or past shed_lag_msec while its worker lags by more
+ * than that and sheds load.
+ * @arg conn The client connection
+ * @return 1 if the command should be answered with a timeout.
+ */
+int conn_expired(bloom_conn_info *conn);
+
+/**
+ * Checks if a connection is from another node of the cluster,
+ * whose commands are never proxied.
+ * @arg conn The client connection
+ * @return 1 if the connection is from a peer, 0 otherwise.
+ */
+int conn_peer(bloom_conn_info *conn);
+
+/**
+ * Marks a connection as one from another node of the cluster.
+ * @arg conn The client connection
+ */
+void set_conn_peer(bloom_conn_info *conn);
+
+/**
+ * Sets the name the usage of a connection is counted under,
+ * see clients.h. The usage so far stays with the old name.
+ * @arg conn The client connection
+ * @arg name The name, at most CLIENT_NAME bytes are kept
+ */
+void set_conn_client_name(bloom_conn_info *conn, char *name);
+
+/**
+ * Counts usage of a connection outside of handle_client_connect,
+ * such as a check handled with the checks of other clients.
+ * @arg conn The client connection
+ * @arg commands The commands handled
+ * @arg keys The keys handled
+ */
+void conn_count_usage(bloom_conn_info *conn, int commands, uint64_t keys);
+
+/**
+ * Gets the number of active workers, of a client connection.
+ * @arg conn The client connection
+ * @arg max Output, the most workers that can be active
+ * @return The active workers.
+ */
+int conn_active_workers(bloom_conn_info *conn, int *max);
+
+/**
+ * Changes the number of active workers, like networking_set_workers,
+ * from a client connection.
+ * @arg conn The client connection
+ * @arg workers The workers to keep active
+ * @return 0 on success, -1 if the workers are out of range.
+ */
+int conn_set_active_workers(bloom_conn_info *conn, int workers);
+
+/**
+ * Returns the filter cache of a connection, which keeps
+ * the last filter used by the connection.
+ * @arg conn The client connection
+ * @return The cache, valid for the life of the connection.
+ */
+bloom_filtmgr_cache* conn_filter_cache(bloom_conn_info *conn);
+
+/**
+ * Parks a connection while the filter of a command is faulted
+ * in, if the filter is not in memory, so the worker is free to
+ * serve its other clients. The connection stops reading, and the
+ * command is handed back by take_parked_command once it resumes.
+ * The arguments are kept in place, and must not be changed.
+ * @arg conn The client connection
+ * @arg mgr The filter manager
+ * @arg filter_name The name of the filter of the command
+ * @arg type The type of the command
+ * @arg args The arguments of the command, in the input buffer
+ * @arg args_len The length of the arguments
+ * @return 0 if the connection was parked, -1 if the
+ * command should be handled now.
+ */
+int park_client_command(bloom_conn_info *conn, bloom_filtmgr *mgr, char *filter_name,
+                        int type, char *args, int args_len);
+
+/**
+ * Parks a tagged command while the filter of the command is
+ * faulted in, if the filter is not in memory. The connection
+ * keeps handling the commands after it, and the command is
+ * handed back by take_parked_command once its fault completes,
+ * with the tag set again. Its responses may then come after
+ * those of later commands, which the tag matches them by.
+ * @arg conn The client connection, with the tag of the command set
+ * @arg mgr The filter manager
+ * @arg filter_name The name of the filter of the command
+ * @arg type The type of the command
+ * @arg args The arguments of the command, copied
+ * @arg args_len The length of the arguments
+ * @return 0 if the command was parked, -1 if the
+ * command should be handled now.
+ */
+int park_tagged_command(bloom_conn_info *conn, bloom_filtmgr *mgr, char *filter_name,
+                        int type, char *args, int args_len);
+
+/**
+ * Sets the tag of the command being handled. The first response
+ * written after it is prefixed with the tag and a space.
+ * @arg conn The client connection
+ * @arg tag The tag, including its '#', or NULL to clear it.
+ * Must stay valid until the response is written.
+ * @arg tag_len The length of the tag
+ */
+void set_client_tag(bloom_conn_info *conn, char *tag, int tag_len);
+
+/**
+ * Checks if the command being handled has a tag that
+ * was not yet written.
+ * @arg conn The client connection
+ * @return 1 if tagged, 0 otherwise.
+ */
+int conn_tagged(bloom_conn_info *conn);
+
+/**
+ * Takes the command left by a park, once the connection resumed,
+ * or else a tagged command whose fault completed.
+ * @arg conn The client connection
+ * @arg args Output, the arguments of the command
+ * @arg args_len Output, the length of the arguments
+ * @return The type of the command, or -1 if there is none.
+ */
+int take_parked_command(bloom_conn_info *conn, char **args, int *args_len);
+
+/**
+ * Parks a connection until a flush of all the filters completes,
+ * so the worker is free to serve its other clients. The command
+ * is handed back by take_parked_command once it resumes, like
+ * with park_client_command.
+ * @arg conn The client connection
+ * @arg mgr The filter manager
+ * @arg ticket The ticket of the flush
+ * @arg type The type of the command
+ * @arg args The arguments of the command, in the input buffer
+ * @arg args_len The length of the arguments
+ * @return 0 if the connection was parked, 1 if the flush is
+ * already done, -1 if the ticket is unknown or the connection
+ * cannot be parked.
+ */
+int park_client_flush(bloom_conn_info *conn, bloom_filtmgr *mgr, uint64_t ticket,
+                      int type, char *args, int args_len);
+
+/**
+ * Parks a connection while an admin command is handled on an
+ * admin thread, so the worker is free to serve its other clients.
+ * The responses of the command are written once it resumes, and
+ * take_parked_command does not hand the command back.
+ * @arg conn The client connection
+ * @arg type The type of the command
+ * @arg args The arguments of the command, in the input buffer
+ * @arg args_len The length of the arguments
+ * @return 0 if the connection was parked, -1 if the
+ * command should be handled now.
+ */
+int park_client_admin(bloom_conn_info *conn, int type, char *args, int args_len);
+
+/**
+ * Parks a connection while a command is handled by the worker
+ * owning its filter, with filter_affinity, so that only one core
+ * touches a filter. The owner gathers the responses, which are
+ * written once the connection resumes, and take_parked_command
+ * does not hand the command back.
+ * @arg conn The client connection
+ * @arg filter_name The name of the filter of the command
+ * @arg type The type of the command
+ * @arg args The arguments of the command, in the input buffer
+ * @arg args_len The length of the arguments
+ * @return 0 if the connection was parked, -1 if the
+ * command should be handled now.
+ */
+int park_client_affine(bloom_conn_info *conn, char *filter_name, int type, char *args, int args_len);
+
+/**
+ * Leaves a command that was read ahead by the worker owning a
+ * filter, but is not its own, to the worker of the connection.
+ * It is handed back by take_unread_command once it resumes.
+ * @arg conn The client connection
+ * @arg type The type of the command
+ * @arg args The arguments of the command, in the input buffer
+ * @arg args_len The length of the arguments
+ */
+void unread_command(bloom_conn_info *conn, int type, char *args, int args_len);
+
+/**
+ * Takes the command left by unread_command. Unlike a parked
+ * command, it is handled as if it was just read.
+ * @arg conn The client connection
+ * @arg args Output, the arguments of the command
+ * @arg args_len Output, the length of the arguments
+ * @return The type of the command, or -1 if there is none.
+ */
+int take_unread_command(bloom_conn_info *conn, char **args, int *args_len);
+
+/**
+ * Sends a file to a client after the responses before it,
+ * with sendfile where the platform has it. The connection
+ * stops reading until the file is sent. On an admin thread,
+ * the file is sent once the connection resumes.
+ * @arg conn The client connection
+ * @arg fd The file, closed once it is sent or the
+ * connection is closed
+ * @arg len The number of bytes to send, from the start
+ * @return 0 on success.
+ */
+int send_client_file(bloom_conn_info *conn, int fd, uint64_t len);
+
+/**
+ * Checks if a connection is sending a file. Its handler
+ * must not handle more commands until it is sent.
+ * @arg conn The client connection
+ * @return 1 if a file is being sent.
+ */
+int conn_sending_file(bloom_conn_info *conn);
+
+/**
+ * Writes the next bytes of input of a client to a file, in
+ * place of handling them as commands. Once they are written,
+ * the file is closed and a command is left as by unread_command.
+ * If the connection closes first, the file is deleted.
+ * @arg conn The client connection
+ * @arg fd The file, or -1 to drop the input
+ * @arg path The path of the file, deleted if the input ends early
+ * @arg len The number of bytes to write
+ * @arg type The type of the command left once they are written,
+ * or -1 for none
+ * @arg args The arguments of the command, copied. Can be NULL.
+ * @arg args_len The length of the arguments
+ * @return 0 on success.
+ */
+int receive_client_file(bloom_conn_info *conn, int fd, char *path, uint64_t len,
+                        int type, char *args, int args_len);
+
+/**
+ * Moves a client on the Unix socket to a pair of shared memory
+ * rings, which are passed to it with a reply of "Done" on the
+ * socket. The commands already read are handled as if they
+ * were read from the request ring.
+ * @arg conn The client connection
+ * @arg ring_size The size of each ring, a power of two
+ * @return 0 on success, -1 if the connection is not an idle
+ * connection on the Unix socket, -2 if the platform has no
+ * shared memory rings, -3 on other failures.
+ */
+int start_client_shm(bloom_conn_info *conn, uint32_t ring_size);
 
 #endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <syslog.h>
+#include "numa.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#define NUMA_HAVE_AFFINITY 1
+#endif
+
+// Largest node count we handle, bounds the node masks
+#define NUMA_MAX_NODES 64
+
+// Memory policy values from linux/mempolicy.h
+#define NUMA_MPOL_BIND 2
+#define NUMA_MPOL_INTERLEAVE 3
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+
+/**
+ * Static declarations
+ */
+#ifdef NUMA_HAVE_AFFINITY
+static int parse_cpulist(char *list, cpu_set_t *set);
+#endif
+
+/**
+ * Returns the number of NUMA nodes, at least 1.
+ */
+int numa_num_nodes(void) {
+    static int num_nodes = 0;
+    if (num_nodes) return num_nodes;
+
+    // The possible nodes are listed as a range, e.g. "0-1"
+    int nodes = 1;
+    FILE *f = fopen("/sys/devices/system/node/possible", "r");
+    if (f) {
+        int first, last;
+        int matched = fscanf(f, "%d-%d", &first, &last);
+        if (matched == 2 && last >= 0) nodes = last + 1;
+        fclose(f);
+    }
+    if (nodes > NUMA_MAX_NODES) nodes = NUMA_MAX_NODES;
+    num_nodes = nodes;
+    return num_nodes;
+}
+
+/**
+ * Pins the calling thread to the CPUs of a node.
+ * @arg node The node to pin to
+ * @return 0 on success, negative on error.
+ */
+int numa_bind_thread(int node) {
+#ifdef NUMA_HAVE_AFFINITY
+    char path[64];
+    char list[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f) return -errno;
+    char *res = fgets(list, sizeof(list), f);
+    fclose(f);
+    if (!res) return -EINVAL;
+
+    cpu_set_t set;
+    if (parse_cpulist(list, &set)) return -EINVAL;
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &set)) {
+        syslog(LOG_WARNING, "Failed to pin thread to NUMA node %d: %s", node, strerror(errno));
+        return -errno;
+    }
+    return 0;
+#else
+    (void)node;
+    return 0;
+#endif
+}
+
+#ifdef NUMA_HAVE_AFFINITY
+/**
+ * Parses a CPU list such as "0-3,8-11" into a set
+ */
+static int parse_cpulist(char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    char *cur = list;
+    int first, last, count = 0;
+    while (*cur && *cur != '\n') {
+        first = strtol(cur, &cur, 10);
+        last = first;
+        if (*cur == '-') last = strtol(cur + 1, &cur, 10);
+        for (int cpu=first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+            count++;
+        }
+        if (*cur == ',') cur++;
+        else if (*cur && *cur != '\n') return -1;
+    }
+    return (count) ? 0 : -1;
+}
+#endif
+
+/**
+ * Places a memory region using a NUMA policy. Pages that
+ * are already faulted in are migrated.
+ * @arg addr The start of the region, page aligned
+ * @arg len The length of the region
+ * @arg policy NUMA_INTERLEAVE or NUMA_PER_FILTER
+ * @arg node The node to bind to, for NUMA_PER_FILTER
+ * @return 0 on success, negative on error.
+ */
+int numa_place_memory(void *addr, uint64_t len, bloom_numa_policy policy, int node) {
+    int nodes = numa_num_nodes();
+    if (policy == NUMA_OFF || nodes < 2) return 0;
+
+#if defined(__linux__) && defined(__NR_mbind)
+    unsigned long mask;
+    int mode;
+    if (policy == NUMA_INTERLEAVE) {
+        mode = NUMA_MPOL_INTERLEAVE;
+        mask = (nodes == 64) ? ~0UL : (1UL << nodes) - 1;
+    } else {
+        mode = NUMA_MPOL_BIND;
+        mask = 1UL << (node % nodes);
+    }
+
+    // maxnode counts bits, and the kernel expects one extra
+    if (syscall(__NR_mbind, addr, len, mode, &mask, NUMA_MAX_NODES + 1, NUMA_MPOL_MF_MOVE)) {
+        syslog(LOG_WARNING, "Failed to set the NUMA policy of a bitmap: %s", strerror(errno));
+        return -errno;
+    }
+    return 0;
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+    return 0;
+#endif
+}
+
+/**
+ * Picks the home node of a filter from its name.
+ * @arg filter_name The name of the filter
+ * @arg num_nodes The number of nodes
+ * @return The node of the filter
+ */
+int numa_filter_node(char *filter_name, int num_nodes) {
+    // FNV-1a, the placement only needs to be stable
+    uint32_t hash = 2166136261u;
+    for (char *c = filter_name; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return (num_nodes > 1) ? (int)(hash % num_nodes) : 0;
+}
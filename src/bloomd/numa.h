@@ -0,0 +1,46 @@
+#ifndef BLOOM_NUMA_H
+#define BLOOM_NUMA_H
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * Helpers to pin threads to NUMA nodes and to place
+ * bitmap memory. They use the kernel interfaces directly,
+ * so no libnuma is needed. On systems without NUMA support
+ * there is a single node, and the placement calls are no-ops.
+ */
+
+/**
+ * Returns the number of NUMA nodes, at least 1.
+ */
+int numa_num_nodes(void);
+
+/**
+ * Pins the calling thread to the CPUs of a node.
+ * @arg node The node to pin to
+ * @return 0 on success, negative on error.
+ */
+int numa_bind_thread(int node);
+
+/**
+ * Places a memory region using a NUMA policy. Pages that
+ * are already faulted in are migrated.
+ * @arg addr The start of the region, page aligned
+ * @arg len The length of the region
+ * @arg policy NUMA_INTERLEAVE to spread over all the nodes,
+ * or NUMA_PER_FILTER to bind to a single node.
+ * @arg node The node to bind to, for NUMA_PER_FILTER
+ * @return 0 on success, negative on error.
+ */
+int numa_place_memory(void *addr, uint64_t len, bloom_numa_policy policy, int node);
+
+/**
+ * Picks the home node of a filter from its name, so
+ * that a filter stays on the same node across restarts.
+ * @arg filter_name The name of the filter
+ * @arg num_nodes The number of nodes
+ * @return The node of the filter
+ */
+int numa_filter_node(char *filter_name, int num_nodes);
+
+#endif
@@ -0,0 +1,365 @@
+#include <alloca.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bloom.h"
+#include "catalog.h"
+#include "reader.h"
+
+/**
+ * The names of the data files, as bloomd writes them
+ */
+#define FILTER_FOLDER_NAME "bloomd.%s"
+#define PARTITION_FOLDER_NAME "part.%03d"
+#define CONTAINER_FILE_NAME "data.pack"
+#define DATA_FILE_SUFFIX ".mmap"
+#define SNAPSHOT_FILE_SUFFIX ".snap"
+
+/**
+ * Seeds the hash that picks the partition of a key, which
+ * must match the one bloomd sets the key with.
+ */
+#define PARTITION_SEED 0x5bd1e9955bd1e995ULL
+
+/**
+ * The number of keys hashed and prefetched together
+ * by bloomd_reader_check_keys.
+ */
+#define READER_BATCH_SIZE 16
+
+// Hashes keys to partitions, provided by libbloom
+extern void WyHash128(const void *key, uint64_t len, uint64_t seed, uint64_t *out);
+
+/**
+ * The layers of a filter, or of one of its partitions
+ */
+typedef struct {
+    bloom_bloomfilter *layers;
+    bloom_bitmap *maps;
+    int num_layers;
+    bloom_hash_family family;   // Family of the first layer
+} reader_part;
+
+/**
+ * The data files of a filter, as opened at a generation
+ */
+typedef struct {
+    reader_part *parts;
+    int num_parts;
+    int part_bits;              // High hash bits that pick the partition
+    uint32_t num_hashes;        // The most hashes of any layer
+    uint64_t generation;
+} reader_view;
+
+struct bloomd_reader {
+    char *path;                 // Folder of the filter
+    char *gen_path;             // Path of the generation file
+    const uint64_t *gen;        // Mapped generation, NULL until it exists
+    reader_view view;
+};
+
+static int open_view(bloomd_reader *r, reader_view *view);
+static int open_part(const char *path, reader_part *part);
+static void close_view(reader_view *view);
+static void map_generation(bloomd_reader *r);
+static int suffix_match(const char *name, const char *suffix);
+static char* make_path(const char *dir, const char *name);
+static inline reader_part* key_part(reader_view *view, const char *key, uint64_t len);
+static inline int part_contains(reader_part *part, const char *key, uint64_t len, uint64_t *hashes);
+
+/**
+ * Opens the data files of a filter.
+ */
+int bloomd_reader_open(const char *data_dir, const char *filter_name, bloomd_reader **reader) {
+    bloomd_reader *r = calloc(1, sizeof(bloomd_reader));
+    if (!r) return -ENOMEM;
+    char *folder = NULL;
+    if (asprintf(&folder, FILTER_FOLDER_NAME, filter_name) == -1) {
+        free(r);
+        return -ENOMEM;
+    }
+    r->path = make_path(data_dir, folder);
+    r->gen_path = make_path(data_dir, GENERATION_FILENAME);
+    free(folder);
+
+    map_generation(r);
+    int res = open_view(r, &r->view);
+    if (res) {
+        bloomd_reader_close(r);
+        return res;
+    }
+    *reader = r;
+    return 0;
+}
+
+/**
+ * Reopens the data files of the filter, if the generation
+ * moved since they were opened.
+ */
+int bloomd_reader_refresh(bloomd_reader *reader) {
+    if (!reader->gen) map_generation(reader);
+    if (!reader->gen ||
+            __atomic_load_n(reader->gen, __ATOMIC_ACQUIRE) == reader->view.generation) {
+        return 0;
+    }
+
+    reader_view view;
+    int res = open_view(reader, &view);
+    if (res) return res;
+    close_view(&reader->view);
+    reader->view = view;
+    return 1;
+}
+
+/**
+ * Returns the generation the data files were opened at.
+ */
+uint64_t bloomd_reader_generation(bloomd_reader *reader) {
+    return reader->view.generation;
+}
+
+/**
+ * Checks for a key.
+ */
+int bloomd_reader_check(bloomd_reader *reader, const char *key, size_t len) {
+    reader_view *view = &reader->view;
+    reader_part *part = key_part(view, key, len);
+    uint64_t *hashes = alloca(view->num_hashes * sizeof(uint64_t));
+    bf_compute_hashes_len(part->family, view->num_hashes, key, len, hashes);
+    return part_contains(part, key, len, hashes);
+}
+
+/**
+ * Checks for many keys. The keys of a batch are hashed and the
+ * probes of their first layer are prefetched, before any of them
+ * are checked, so their cache misses overlap.
+ */
+void bloomd_reader_check_keys(bloomd_reader *reader, const char **keys,
+        const uint64_t *lens, int num_keys, char *results) {
+    reader_view *view = &reader->view;
+    uint32_t stride = view->num_hashes;
+    uint64_t *hashes = alloca(READER_BATCH_SIZE * stride * sizeof(uint64_t));
+    reader_part *parts[READER_BATCH_SIZE];
+    uint64_t key_lens[READER_BATCH_SIZE];
+
+    for (int start=0; start < num_keys; start += READER_BATCH_SIZE) {
+        int batch = num_keys - start;
+        if (batch > READER_BATCH_SIZE) batch = READER_BATCH_SIZE;
+
+        for (int i=0; i < batch; i++) {
+            const char *key = keys[start + i];
+            key_lens[i] = (lens) ? lens[start + i] : strlen(key);
+            parts[i] = key_part(view, key, key_lens[i]);
+            bf_compute_hashes_len(parts[i]->family, stride, key, key_lens[i], hashes + i * stride);
+            if (parts[i]->num_layers) bf_prefetch_hashed(parts[i]->layers, hashes + i * stride);
+        }
+        for (int i=0; i < batch; i++) {
+            results[start + i] = part_contains(parts[i], keys[start + i], key_lens[i],
+                    hashes + i * stride);
+        }
+    }
+}
+
+/**
+ * Unmaps the data files, and frees the reader.
+ */
+void bloomd_reader_close(bloomd_reader *reader) {
+    close_view(&reader->view);
+    if (reader->gen) munmap((void*)reader->gen, GENERATION_FILE_SIZE);
+    free(reader->gen_path);
+    free(reader->path);
+    free(reader);
+}
+
+/**
+ * Opens the data files of the filter, at the current generation.
+ * The generation is read first, so that changes made during the
+ * scan bump it past the one recorded.
+ * @return 0 on success, negative errno on failure.
+ */
+static int open_view(bloomd_reader *r, reader_view *view) {
+    memset(view, 0, sizeof(reader_view));
+    if (r->gen) view->generation = __atomic_load_n(r->gen, __ATOMIC_ACQUIRE);
+
+    struct stat st;
+    if (stat(r->path, &st)) return -errno;
+
+    // Layers packed into a container are not read
+    char *path = make_path(r->path, CONTAINER_FILE_NAME);
+    int res = stat(path, &st);
+    free(path);
+    if (!res) return -ENOTSUP;
+
+    // Partitioned filters keep each partition in a folder
+    char name[32];
+    for (;;) {
+        snprintf(name, sizeof(name), PARTITION_FOLDER_NAME, view->num_parts);
+        path = make_path(r->path, name);
+        res = stat(path, &st);
+        free(path);
+        if (res) break;
+        view->num_parts++;
+    }
+    int partitioned = view->num_parts > 0;
+    if (!partitioned) view->num_parts = 1;
+
+    // There is a power of two of them, once they are all created
+    if (view->num_parts & (view->num_parts - 1)) return -EAGAIN;
+    while ((1 << view->part_bits) < view->num_parts) view->part_bits++;
+
+    view->parts = calloc(view->num_parts, sizeof(reader_part));
+    if (!view->parts) return -ENOMEM;
+    view->num_hashes = 4;
+    res = 0;
+    for (int i=0; i < view->num_parts && !res; i++) {
+        if (partitioned) {
+            snprintf(name, sizeof(name), PARTITION_FOLDER_NAME, i);
+            path = make_path(r->path, name);
+            res = open_part(path, view->parts + i);
+            free(path);
+        } else {
+            res = open_part(r->path, view->parts);
+        }
+        for (int j=0; !res && j < view->parts[i].num_layers; j++) {
+            uint32_t k_num = view->parts[i].layers[j].header->k_num;
+            if (k_num > view->num_hashes) view->num_hashes = k_num;
+        }
+    }
+    if (res) close_view(view);
+    return res;
+}
+
+/**
+ * Works with scandir to find the data and snapshot files
+ */
+static int filter_layer_files(const struct dirent *d) {
+    return suffix_match(d->d_name, DATA_FILE_SUFFIX) ||
+           suffix_match(d->d_name, SNAPSHOT_FILE_SUFFIX);
+}
+
+/**
+ * Maps the data files in a folder read only.
+ * @return 0 on success, -EAGAIN if a data file is not complete
+ * or is a snapshot, negative errno on other failures.
+ */
+static int open_part(const char *path, reader_part *part) {
+    struct dirent **namelist = NULL;
+    int num = scandir(path, &namelist, filter_layer_files, alphasort);
+    if (num == -1) return -errno;
+
+    part->layers = calloc(num + 1, sizeof(bloom_bloomfilter));
+    part->maps = calloc(num + 1, sizeof(bloom_bitmap));
+    int res = (part->layers && part->maps) ? 0 : -ENOMEM;
+    for (int i=0; i < num && !res; i++) {
+        // A cold filter is read once bloomd restores it
+        if (!suffix_match(namelist[i]->d_name, DATA_FILE_SUFFIX)) {
+            res = -EAGAIN;
+            break;
+        }
+
+        char *file_path = make_path(path, namelist[i]->d_name);
+        int fd = open(file_path, O_RDONLY);
+        free(file_path);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st)) {
+            res = -errno;
+            if (fd != -1) close(fd);
+            break;
+        }
+
+        // A data file is sized before its header is written
+        bloom_bitmap *map = part->maps + part->num_layers;
+        res = (st.st_size < (off_t)sizeof(bloom_filter_header)) ? -EAGAIN :
+            bitmap_from_file(fd, st.st_size, SHARED | READ_ONLY, map);
+        close(fd);
+        if (res) break;
+        bloom_bloomfilter *layer = part->layers + part->num_layers;
+        if (bf_from_bitmap(map, 1, 0, layer) || !layer->header->k_num) {
+            bitmap_close(map);
+            res = -EAGAIN;
+            break;
+        }
+        part->num_layers++;
+    }
+    if (part->num_layers) part->family = part->layers[0].header->hash_family;
+
+    for (int i=0; i < num; i++) free(namelist[i]);
+    free(namelist);
+    return res;
+}
+
+/**
+ * Unmaps the data files of a view
+ */
+static void close_view(reader_view *view) {
+    for (int i=0; view->parts && i < view->num_parts; i++) {
+        reader_part *part = view->parts + i;
+        for (int j=0; j < part->num_layers; j++) bitmap_close(part->maps + j);
+        free(part->layers);
+        free(part->maps);
+    }
+    free(view->parts);
+    view->parts = NULL;
+}
+
+/**
+ * Maps the generation file read only, once bloomd created it
+ */
+static void map_generation(bloomd_reader *r) {
+    int fd = open(r->gen_path, O_RDONLY);
+    if (fd == -1) return;
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size >= GENERATION_FILE_SIZE) {
+        void *addr = mmap(NULL, GENERATION_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) r->gen = addr;
+    }
+    close(fd);
+}
+
+/**
+ * Joins a folder and a file name. The reader does not link
+ * with the config of bloomd, which has join_path.
+ */
+static char* make_path(const char *dir, const char *name) {
+    char *path = NULL;
+    if (asprintf(&path, "%s/%s", dir, name) == -1) abort();
+    return path;
+}
+
+/**
+ * Checks if a file name ends with a suffix
+ */
+static int suffix_match(const char *name, const char *suffix) {
+    size_t len = strlen(name), suffix_len = strlen(suffix);
+    return len > suffix_len && !strcmp(name + len - suffix_len, suffix);
+}
+
+/**
+ * Picks the partition of a key
+ */
+static inline reader_part* key_part(reader_view *view, const char *key, uint64_t len) {
+    if (view->num_parts == 1) return view->parts;
+    uint64_t hash[2];
+    WyHash128(key, len, PARTITION_SEED, hash);
+    return view->parts + (hash[0] >> (64 - view->part_bits));
+}
+
+/**
+ * Checks the layers of a partition for a key, reusing its hashes
+ * for the layers of the same hash family.
+ */
+static inline int part_contains(reader_part *part, const char *key, uint64_t len, uint64_t *hashes) {
+    for (int i=0; i < part->num_layers; i++) {
+        bloom_bloomfilter *layer = part->layers + i;
+        int res = (layer->header->hash_family == part->family) ?
+            bf_contains_hashed(layer, hashes) : bf_contains_len(layer, key, len);
+        if (res == 1) return 1;
+    }
+    return 0;
+}
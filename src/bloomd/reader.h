@@ -0,0 +1,79 @@
+#ifndef BLOOMD_READER_H
+#define BLOOMD_READER_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Checks the keys of a filter from another process on the same
+ * host, by mapping its data files read only, without a lock or a
+ * round trip to bloomd. The data files of filters using use_mmap
+ * are the memory bloomd sets keys in, so checks see sets right
+ * away. The data files of other filters are only written by
+ * flushes, so checks only see the keys set before the last flush.
+ * Filters kept in memory or in a container cannot be read.
+ *
+ * bloomd bumps a generation kept in the data directory whenever
+ * the data files of a filter are added, removed or replaced.
+ * Readers poll it with bloomd_reader_refresh, which reopens the
+ * data files once it moved, and otherwise costs a single load.
+ * Until then, checks use the data files that were opened.
+ *
+ * Checks may run in many threads at once, but not while the
+ * same reader is refreshed or closed.
+ */
+typedef struct bloomd_reader bloomd_reader;
+
+/**
+ * Opens the data files of a filter.
+ * @arg data_dir The data_dir of bloomd
+ * @arg filter_name The name of the filter
+ * @arg reader Output, the reader
+ * @return 0 on success, -ENOENT if there is no such filter,
+ * -ENOTSUP if it cannot be read, -EAGAIN if its data files are
+ * being created or are snapshots of a cold filter, or another
+ * negative errno.
+ */
+int bloomd_reader_open(const char *data_dir, const char *filter_name, bloomd_reader **reader);
+
+/**
+ * Reopens the data files of the filter, if the generation
+ * moved since they were opened.
+ * @arg reader The reader
+ * @return 1 if reopened, 0 if unchanged, or a negative errno as
+ * returned by bloomd_reader_open. The data files that were open
+ * are kept on failure.
+ */
+int bloomd_reader_refresh(bloomd_reader *reader);
+
+/**
+ * Returns the generation the data files were opened at.
+ */
+uint64_t bloomd_reader_generation(bloomd_reader *reader);
+
+/**
+ * Checks for a key.
+ * @arg reader The reader
+ * @arg key The key, which need not be NUL terminated
+ * @arg len The length of the key
+ * @return 1 if the key is in the filter, 0 if it is not.
+ */
+int bloomd_reader_check(bloomd_reader *reader, const char *key, size_t len);
+
+/**
+ * Checks for many keys.
+ * @arg reader The reader
+ * @arg keys The keys
+ * @arg lens The lengths of the keys, or NULL if they are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output, 1 for each key that is in the filter, 0 otherwise
+ */
+void bloomd_reader_check_keys(bloomd_reader *reader, const char **keys,
+        const uint64_t *lens, int num_keys, char *results);
+
+/**
+ * Unmaps the data files, and frees the reader.
+ * @arg reader The reader
+ */
+void bloomd_reader_close(bloomd_reader *reader);
+
+#endif
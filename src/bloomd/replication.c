@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "replication.h"
+
+/**
+ * The initial size of the buffer of a replica.
+ * It grows as needed, up to the backlog.
+ */
+#define REPL_BUFFER_SIZE (64 * 1024)
+
+/**
+ * The longest line that sets are coalesced into. The
+ * replica applies a bulk in chunks, so this only bounds
+ * the input a replica buffers for one command.
+ */
+#define REPL_LINE_MAX (64 * 1024)
+
+/**
+ * How long to wait before reconnecting to a replica
+ */
+#define REPL_RETRY_MSEC 1000
+
+/**
+ * How long a send may block before the replica is
+ * considered stuck, and the connection is dropped
+ */
+#define REPL_SEND_TIMEOUT_SEC 5
+
+/**
+ * The first command of each connection
+ */
+static const char NOREPLY_CMD[] = "noreply on\n";
+
+/**
+ * A single replica, and the changes it has yet to be sent
+ */
+typedef struct {
+    bloom_replicator *repl;
+    char *host;
+    char *port;
+    pthread_t thread;
+    pthread_mutex_t lock;   // Protects the buffer
+    pthread_cond_t cond;    // Signaled on the first change of a batch, or to stop
+    char *buf;              // Changes not yet taken by the thread
+    uint64_t buf_len;
+    uint64_t buf_cap;
+    int64_t line_start;     // Offset of the line keys coalesce into, or -1
+    char *out;              // The batch being sent, owned by the thread
+    uint64_t out_len;
+    uint64_t out_cap;
+    int fd;                 // The connection, or -1
+    int failing;            // The last attempt to send failed
+} bloom_replica;
+
+struct bloom_replicator {
+    int should_run;         // Cleared to stop the threads
+    int batch_msec;         // How long a batch gathers before it is sent
+    uint64_t backlog;       // The most bytes buffered for a replica
+    uint64_t skipped;       // Keys that the text protocol cannot carry
+    int num_replicas;
+    bloom_replica *replicas;
+};
+
+static int parse_replicas(char *list, bloom_replicator *repl);
+static int key_sendable(const char *key, uint64_t len);
+static char* reserve(bloom_replicator *repl, bloom_replica *r, uint64_t len);
+static void append_line(bloom_replicator *repl, char *line, int len);
+static void* replica_thread_main(void *in);
+static void wait_msec(bloom_replica *r, int msec);
+static int send_batch(bloom_replica *r);
+static int connect_replica(bloom_replica *r);
+static int send_all(int fd, char *buf, uint64_t len);
+static int drain_replies(int fd);
+
+/**
+ * Starts replicating to the replicas of the config.
+ * @arg config The configuration, with a list of replicas
+ * @arg repl Output, the replicator
+ * @return 0 on success, -EINVAL if the list of replicas is bad,
+ * or another negative errno.
+ */
+int init_replicator(bloom_config *config, bloom_replicator **repl) {
+    bloom_replicator *rp = calloc(1, sizeof(bloom_replicator));
+    rp->batch_msec = config->replica_batch_msec;
+    rp->backlog = (uint64_t)config->replica_backlog_mb * 1024 * 1024;
+    rp->should_run = 1;
+    if (parse_replicas(config->replicas, rp)) {
+        syslog(LOG_ERR, "Bad list of replicas: %s", config->replicas);
+        destroy_replicator(rp);
+        return -EINVAL;
+    }
+
+    // Start a thread per replica
+    bloom_replica *r;
+    for (int i=0; i < rp->num_replicas; i++) {
+        r = rp->replicas + i;
+        if (pthread_create(&r->thread, NULL, replica_thread_main, r)) {
+            int res = -errno;
+            perror("Failed to start replica thread!");
+            destroy_replicator(rp);
+            return res;
+        }
+        syslog(LOG_INFO, "Replicating to %s:%s", r->host, r->port);
+    }
+    *repl = rp;
+    return 0;
+}
+
+/**
+ * Splits a list of host:port pairs, separated by commas
+ * @return 0 on success, 1 if the list is bad.
+ */
+static int parse_replicas(char *list, bloom_replicator *repl) {
+    char *copy = strdup(list);
+    char *save = NULL;
+    int num = 0;
+    for (char *p=copy; *p; p++) if (*p == ',') num++;
+    repl->replicas = calloc(num + 1, sizeof(bloom_replica));
+
+    int res = 0;
+    char *host, *port;
+    bloom_replica *r;
+    for (char *tok=strtok_r(copy, ", ", &save); tok; tok=strtok_r(NULL, ", ", &save)) {
+        // The port follows the last colon, an IPv6 host may be bracketed
+        port = strrchr(tok, ':');
+        if (!port || port == tok || !port[1] || atoi(port + 1) <= 0 || atoi(port + 1) > 65535) {
+            res = 1;
+            break;
+        }
+        *port++ = '\0';
+        host = tok;
+        if (host[0] == '[' && port[-2] == ']') {
+            port[-2] = '\0';
+            host++;
+        }
+
+        r = repl->replicas + repl->num_replicas++;
+        r->repl = repl;
+        r->host = strdup(host);
+        r->port = strdup(port);
+        r->fd = -1;
+        r->line_start = -1;
+        r->buf_cap = r->out_cap = REPL_BUFFER_SIZE;
+        r->buf = malloc(r->buf_cap);
+        r->out = malloc(r->out_cap);
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->cond, NULL);
+    }
+    free(copy);
+    return (res || !repl->num_replicas) ? 1 : 0;
+}
+
+/**
+ * Stops replicating. The backlog of each connected replica
+ * is sent first.
+ * @arg repl The replicator
+ * @return 0 on success.
+ */
+int destroy_replicator(bloom_replicator *repl) {
+    bloom_replica *r;
+    for (int i=0; i < repl->num_replicas; i++) {
+        r = repl->replicas + i;
+        pthread_mutex_lock(&r->lock);
+        __atomic_store_n(&repl->should_run, 0, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    for (int i=0; i < repl->num_replicas; i++) {
+        r = repl->replicas + i;
+        if (r->thread) pthread_join(r->thread, NULL);
+        if (r->fd != -1) close(r->fd);
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r->out);
+        free(r->buf);
+        free(r->port);
+        free(r->host);
+    }
+    free(repl->replicas);
+    free(repl);
+    return 0;
+}
+
+/**
+ * Replicates the creation of a filter. Thread safe.
+ * @arg repl The replicator
+ * @arg filter_name The name of the filter
+ * @arg config The config the filter was created with
+ */
+void repl_create(bloom_replicator *repl, char *filter_name, bloom_config *config) {
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+            "create %s capacity=%llu prob=%.17g in_memory=%d counting=%d window=%d "
+            "generations=%d scalable=%d reject_full=%d container=%d partitions=%d hashed=%d engine=%s\n",
+            filter_name, (unsigned long long)config->initial_capacity,
+            config->default_probability, config->in_memory, config->counting,
+            config->window, config->generations, config->scalable,
+            config->reject_full, config->container, config->partitions, config->hashed,
+            (config->engine_type == ENGINE_CUCKOO) ? "cuckoo" : "bloom");
+    if (len >= (int)sizeof(line)) return;
+    append_line(repl, line, len);
+}
+
+/**
+ * Replicates a command that only takes a filter name,
+ * like drop or reset. Thread safe.
+ * @arg repl The replicator
+ * @arg cmd The command
+ * @arg filter_name The name of the filter
+ */
+void repl_filter_cmd(bloom_replicator *repl, char *cmd, char *filter_name) {
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%s %s\n", cmd, filter_name);
+    if (len >= (int)sizeof(line)) return;
+    append_line(repl, line, len);
+}
+
+/**
+ * Replicates a union or intersect of filters. Thread safe.
+ * @arg repl The replicator
+ * @arg dest_name The filter that is changed
+ * @arg src_names The filters combined into it
+ * @arg num_srcs The number of source filters
+ * @arg intersect 1 for an intersect, 0 for a union
+ */
+void repl_combine(bloom_replicator *repl, char *dest_name, char **src_names, int num_srcs, int intersect) {
+    uint64_t cap = strlen(dest_name) + 16;
+    for (int i=0; i < num_srcs; i++) cap += strlen(src_names[i]) + 1;
+
+    char *line = malloc(cap);
+    int len = sprintf(line, "%s %s", (intersect) ? "intersect" : "union", dest_name);
+    for (int i=0; i < num_srcs; i++) len += sprintf(line + len, " %s", src_names[i]);
+    line[len++] = '\n';
+    append_line(repl, line, len);
+    free(line);
+}
+
+/**
+ * Replicates sets or unsets of keys. Thread safe.
+ * @arg repl The replicator
+ * @arg unset 1 for unsets, 0 for sets
+ * @arg filter_name The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL if the keys are
+ * NUL terminated
+ * @arg results Optional, only the keys with a result of 1 are
+ * sent. If NULL, all the keys are sent.
+ * @arg num_keys The number of keys
+ */
+void repl_keys(bloom_replicator *repl, int unset, char *filter_name, char **keys,
+        uint64_t *key_lens, char *results, int num_keys) {
+    // Each key may start a line of its own, bound the bytes needed
+    char *cmd = (unset) ? "mu" : "b";
+    uint64_t cmd_len = strlen(cmd), name_len = strlen(filter_name);
+    uint64_t prefix_len = cmd_len + 1 + name_len;
+    uint64_t bound = 0, key_len;
+    int num = 0, skipped = 0;
+    for (int i=0; i < num_keys; i++) {
+        if (results && results[i] != 1) continue;
+        key_len = (key_lens) ? key_lens[i] : strlen(keys[i]);
+        if (!key_sendable(keys[i], key_len)) {
+            skipped++;
+            continue;
+        }
+        bound += prefix_len + key_len + 2;
+        num++;
+    }
+
+    // Warn when the skipped keys reach each power of 2
+    if (skipped) {
+        uint64_t total = __atomic_add_fetch(&repl->skipped, skipped, __ATOMIC_RELAXED);
+        uint64_t before = total - skipped;
+        if (!before || __builtin_clzll(total) < __builtin_clzll(before)) {
+            syslog(LOG_WARNING, "Skipped %llu keys with spaces, newlines or NULs, "
+                    "which cannot be replicated.", (unsigned long long)total);
+        }
+    }
+    if (!num) return;
+
+    bloom_replica *r;
+    char *pos, *line;
+    for (int j=0; j < repl->num_replicas; j++) {
+        r = repl->replicas + j;
+        pthread_mutex_lock(&r->lock);
+        if (!reserve(repl, r, bound)) {
+            pthread_mutex_unlock(&r->lock);
+            continue;
+        }
+        int was_empty = !r->buf_len;
+
+        for (int i=0; i < num_keys; i++) {
+            if (results && results[i] != 1) continue;
+            key_len = (key_lens) ? key_lens[i] : strlen(keys[i]);
+            if (!key_sendable(keys[i], key_len)) continue;
+
+            // Reopen the last line if it is for the same command and filter
+            line = (r->line_start >= 0) ? r->buf + r->line_start : NULL;
+            if (line && r->buf_len - r->line_start > prefix_len &&
+                    r->buf_len - r->line_start + key_len + 1 <= REPL_LINE_MAX &&
+                    !memcmp(line, cmd, cmd_len) && line[cmd_len] == ' ' &&
+                    !memcmp(line + cmd_len + 1, filter_name, name_len) &&
+                    line[prefix_len] == ' ') {
+                r->buf_len--;
+            } else {
+                r->line_start = r->buf_len;
+                pos = r->buf + r->buf_len;
+                memcpy(pos, cmd, cmd_len);
+                pos[cmd_len] = ' ';
+                memcpy(pos + cmd_len + 1, filter_name, name_len);
+                r->buf_len += prefix_len;
+            }
+            pos = r->buf + r->buf_len;
+            pos[0] = ' ';
+            memcpy(pos + 1, keys[i], key_len);
+            pos[key_len + 1] = '\n';
+            r->buf_len += key_len + 2;
+        }
+
+        if (was_empty) pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/**
+ * Checks that a key can be sent as a text argument
+ */
+static int key_sendable(const char *key, uint64_t len) {
+    if (!len) return 0;
+    for (uint64_t i=0; i < len; i++) {
+        switch (key[i]) {
+            case ' ':
+            case '\n':
+            case '\r':
+            case '\0':
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Makes room for more changes of a replica. A replica over
+ * its backlog has it dropped. Must hold the lock of the replica.
+ * @return The end of the buffer, or NULL if the changes
+ * are larger than the whole backlog.
+ */
+static char* reserve(bloom_replicator *repl, bloom_replica *r, uint64_t len) {
+    if (r->buf_len + len > repl->backlog) {
+        syslog(LOG_ERR, "Replica %s:%s is over the backlog, dropping %llu bytes of changes. "
+                "It must be reseeded from the primary.", r->host, r->port,
+                (unsigned long long)r->buf_len);
+        r->buf_len = 0;
+        r->line_start = -1;
+        if (len > repl->backlog) return NULL;
+    }
+    if (r->buf_len + len > r->buf_cap) {
+        while (r->buf_len + len > r->buf_cap) r->buf_cap *= 2;
+        r->buf = realloc(r->buf, r->buf_cap);
+    }
+    return r->buf + r->buf_len;
+}
+
+/**
+ * Appends a whole command to the buffer of each replica
+ */
+static void append_line(bloom_replicator *repl, char *line, int len) {
+    bloom_replica *r;
+    char *pos;
+    for (int i=0; i < repl->num_replicas; i++) {
+        r = repl->replicas + i;
+        pthread_mutex_lock(&r->lock);
+        pos = reserve(repl, r, len);
+        if (pos) {
+            if (!r->buf_len) pthread_cond_signal(&r->cond);
+            memcpy(pos, line, len);
+            r->buf_len += len;
+            r->line_start = -1;
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/**
+ * Sends the changes of a replica in batches, until stopped
+ */
+static void* replica_thread_main(void *in) {
+    bloom_replica *r = in;
+    bloom_replicator *repl = r->repl;
+    int stopping, empty;
+    char *buf;
+    uint64_t cap;
+    for (;;) {
+        // Wait for a change
+        pthread_mutex_lock(&r->lock);
+        while (!r->buf_len && repl->should_run)
+            pthread_cond_wait(&r->cond, &r->lock);
+        stopping = !repl->should_run;
+        empty = !r->buf_len;
+        pthread_mutex_unlock(&r->lock);
+        if (empty) break;
+
+        // Let the batch gather, then swap it out, so the
+        // changes are not held up by sending it
+        if (!stopping && repl->batch_msec) wait_msec(r, repl->batch_msec);
+        pthread_mutex_lock(&r->lock);
+        buf = r->out;
+        cap = r->out_cap;
+        r->out = r->buf;
+        r->out_len = r->buf_len;
+        r->out_cap = r->buf_cap;
+        r->buf = buf;
+        r->buf_cap = cap;
+        r->buf_len = 0;
+        r->line_start = -1;
+        pthread_mutex_unlock(&r->lock);
+
+        // Retry the batch until it is sent, or we are stopped
+        while (send_batch(r)) {
+            if (!__atomic_load_n(&repl->should_run, __ATOMIC_ACQUIRE)) {
+                syslog(LOG_WARNING, "Dropping %llu bytes of changes for replica %s:%s on shutdown.",
+                        (unsigned long long)r->out_len, r->host, r->port);
+                return NULL;
+            }
+            wait_msec(r, REPL_RETRY_MSEC);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Waits for a number of milliseconds, or until stopped
+ */
+static void wait_msec(bloom_replica *r, int msec) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += msec / 1000;
+    deadline.tv_nsec += (msec % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    int res = 0;
+    while (res != ETIMEDOUT && r->repl->should_run)
+        res = pthread_cond_timedwait(&r->cond, &r->lock, &deadline);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Sends the batch of a replica, connecting if needed
+ * @return 0 on success, negative errno on failure.
+ */
+static int send_batch(bloom_replica *r) {
+    int res = (r->fd == -1) ? connect_replica(r) : 0;
+    if (!res) res = send_all(r->fd, r->out, r->out_len);
+
+    // The replica only answers errors, which are discarded
+    if (!res) res = drain_replies(r->fd);
+    if (res) {
+        if (!r->failing) {
+            syslog(LOG_WARNING, "Failed to replicate to %s:%s, retrying. %s",
+                    r->host, r->port, strerror(-res));
+        }
+        r->failing = 1;
+        if (r->fd != -1) close(r->fd);
+        r->fd = -1;
+        return res;
+    }
+    if (r->failing) syslog(LOG_INFO, "Replicating to %s:%s again", r->host, r->port);
+    r->failing = 0;
+    r->out_len = 0;
+    return 0;
+}
+
+/**
+ * Connects to a replica, and turns off the replies to sets
+ * @return 0 on success, negative errno on failure.
+ */
+static int connect_replica(bloom_replica *r) {
+    struct addrinfo hints, *addrs, *a;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(r->host, r->port, &hints, &addrs)) return -EHOSTUNREACH;
+
+    int fd = -1, res = -ECONNREFUSED;
+    for (a=addrs; a; a=a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd == -1) continue;
+        if (!connect(fd, a->ai_addr, a->ai_addrlen)) break;
+        res = -errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd == -1) return res;
+
+    // Do not block forever on a replica that stopped reading
+    struct timeval timeout = {REPL_SEND_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    res = send_all(fd, (char*)NOREPLY_CMD, sizeof(NOREPLY_CMD) - 1);
+    if (res) {
+        close(fd);
+        return res;
+    }
+    r->fd = fd;
+    return 0;
+}
+
+/**
+ * Sends a whole buffer, retrying short sends
+ * @return 0 on success, negative errno on failure.
+ */
+static int send_all(int fd, char *buf, uint64_t len) {
+    ssize_t res;
+    uint64_t total = 0;
+    while (total < len) {
+        res = send(fd, buf + total, len - total, MSG_NOSIGNAL);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN) ? -ETIMEDOUT : -errno;
+        }
+        total += res;
+    }
+    return 0;
+}
+
+/**
+ * Reads and discards the replies waiting on a connection
+ * @return 0 on success, negative errno if the connection is lost.
+ */
+static int drain_replies(int fd) {
+    char buf[4096];
+    ssize_t res;
+    for (;;) {
+        res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (res > 0) continue;
+        if (res == 0) return -EPIPE;
+        if (errno == EINTR) continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef BLOOM_REPLICATION_H
+#define BLOOM_REPLICATION_H
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * Replication streams the changes made to the filters of a primary
+ * to its replicas, which serve reads. It is asynchronous: changes
+ * are applied on the primary, buffered per replica, and sent in
+ * batches by a thread per replica, so a slow or down replica never
+ * holds up the clients of the primary.
+ *
+ * The changes are sent as text commands over a single connection
+ * to each replica, which is an unmodified bloomd. Sets of the same
+ * filter are coalesced into bulk commands, and the connection runs
+ * with noreply, so the replica only answers errors. A batch that
+ * fails to send is sent again once the replica is reconnected, so
+ * sets are delivered at least once. Sets of filters that only log
+ * new keys are idempotent, and only the keys new to the primary are
+ * sent. Keys that the text protocol cannot carry, those with spaces,
+ * newlines or NULs, are skipped.
+ *
+ * A replica that falls behind by more than the backlog drops its
+ * backlog, and must be reseeded from the data of the primary.
+ */
+
+/**
+ * The replicas of a primary
+ */
+typedef struct bloom_replicator bloom_replicator;
+
+/**
+ * Starts replicating to the replicas of the config.
+ * @arg config The configuration, with a list of replicas
+ * @arg repl Output, the replicator
+ * @return 0 on success, -EINVAL if the list of replicas is bad,
+ * or another negative errno.
+ */
+int init_replicator(bloom_config *config, bloom_replicator **repl);
+
+/**
+ * Stops replicating. The backlog of each connected replica
+ * is sent first.
+ * @arg repl The replicator
+ * @return 0 on success.
+ */
+int destroy_replicator(bloom_replicator *repl);
+
+/**
+ * Replicates the creation of a filter. Thread safe.
+ * @arg repl The replicator
+ * @arg filter_name The name of the filter
+ * @arg config The config the filter was created with
+ */
+void repl_create(bloom_replicator *repl, char *filter_name, bloom_config *config);
+
+/**
+ * Replicates a command that only takes a filter name,
+ * like drop or reset. Thread safe.
+ * @arg repl The replicator
+ * @arg cmd The command
+ * @arg filter_name The name of the filter
+ */
+void repl_filter_cmd(bloom_replicator *repl, char *cmd, char *filter_name);
+
+/**
+ * Replicates a union or intersect of filters. Thread safe.
+ * @arg repl The replicator
+ * @arg dest_name The filter that is changed
+ * @arg src_names The filters combined into it
+ * @arg num_srcs The number of source filters
+ * @arg intersect 1 for an intersect, 0 for a union
+ */
+void repl_combine(bloom_replicator *repl, char *dest_name, char **src_names, int num_srcs, int intersect);
+
+/**
+ * Replicates sets or unsets of keys. Thread safe.
+ * @arg repl The replicator
+ * @arg unset 1 for unsets, 0 for sets
+ * @arg filter_name The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL if the keys are
+ * NUL terminated
+ * @arg results Optional, only the keys with a result of 1 are
+ * sent. If NULL, all the keys are sent.
+ * @arg num_keys The number of keys
+ */
+void repl_keys(bloom_replicator *repl, int unset, char *filter_name, char **keys,
+        uint64_t *key_lens, char *results, int num_keys);
+
+#endif
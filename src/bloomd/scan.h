@@ -0,0 +1,31 @@
+#ifndef BLOOM_SCAN_H
+#define BLOOM_SCAN_H
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Returns a bitmask of the bytes of a 16 byte block
+ * that equal a byte, bit i for byte i. Used to split
+ * keys on their separators 16 bytes at a time.
+ */
+static inline unsigned byte_mask(const char *block, char byte) {
+#if defined(__SSE2__)
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(byte), _mm_loadu_si128((__m128i*)block));
+    return _mm_movemask_epi8(cmp);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t bits[16] = {1,2,4,8,16,32,64,128,1,2,4,8,16,32,64,128};
+    uint8x16_t cmp = vandq_u8(vceqq_u8(vdupq_n_u8(byte), vld1q_u8((uint8_t*)block)), vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(cmp)) | (vaddv_u8(vget_high_u8(cmp)) << 8);
+#else
+    unsigned bitfield = 0;
+    for (int i=0; i < 16; i++) {
+        if (block[i] == byte) bitfield |= 1 << i;
+    }
+    return bitfield;
+#endif
+}
+
+#endif
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "shm_ring.h"
+
+_Static_assert(sizeof(shm_ring_header) <= SHM_HEADER_SIZE, "shm header exceeds a page");
+
+/**
+ * Creates the memfd and eventfds of a pair of rings.
+ * @arg size The size of each ring, a power of two
+ * @arg ring Output, the rings
+ * @return 0 on success, -EINVAL on a bad size, -ENOTSUP
+ * without memfds, or negative on other failures.
+ */
+int shm_ring_create(uint32_t size, bloom_shm_ring **ring) {
+    if (size < SHM_RING_MIN || size > SHM_RING_MAX || (size & (size - 1))) return -EINVAL;
+#if defined(MFD_CLOEXEC) && defined(__linux__)
+    bloom_shm_ring *r = calloc(1, sizeof(bloom_shm_ring));
+    if (!r) return -ENOMEM;
+    r->size = size;
+    r->memfd = memfd_create("bloomd_shm", MFD_CLOEXEC);
+    r->req_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->room_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->client_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    // Map the header and both rings
+    size_t len = SHM_HEADER_SIZE + 2 * (size_t)size;
+    void *addr = MAP_FAILED;
+    if (r->memfd >= 0 && r->req_efd >= 0 && r->room_efd >= 0 && r->client_efd >= 0 &&
+            !ftruncate(r->memfd, len)) {
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, r->memfd, 0);
+    }
+    if (addr == MAP_FAILED) {
+        int err = errno;
+        r->header = NULL;
+        shm_ring_destroy(r);
+        return -err;
+    }
+
+    r->header = addr;
+    r->req = (char*)addr + SHM_HEADER_SIZE;
+    r->resp = r->req + size;
+    r->header->ring_size = size;
+    __atomic_store_n(&r->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    *ring = r;
+    return 0;
+#else
+    (void)ring;
+    return -ENOTSUP;
+#endif
+}
+
+
+/**
+ * Copies the requests written by the client, and frees
+ * their room in the ring.
+ */
+uint64_t shm_ring_read(bloom_shm_ring *ring, char *buf, uint64_t len) {
+    shm_ring_header *h = ring->header;
+    uint64_t head = h->req_head;
+    uint64_t avail = __atomic_load_n(&h->req_tail, __ATOMIC_ACQUIRE) - head;
+
+    // A client writing past the room it has is cut short
+    if (avail > ring->size) avail = ring->size;
+    if (len > avail) len = avail;
+    if (!len) return 0;
+
+    // Copy in up to two parts, around the end of the ring
+    uint64_t off = head & (ring->size - 1);
+    uint64_t first = (len < ring->size - off) ? len : ring->size - off;
+    memcpy(buf, ring->req + off, first);
+    memcpy(buf + first, ring->req, len - first);
+    __atomic_store_n(&h->req_head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+
+/**
+ * Returns the bytes of requests left in the ring.
+ */
+uint64_t shm_ring_pending(bloom_shm_ring *ring) {
+    shm_ring_header *h = ring->header;
+    return __atomic_load_n(&h->req_tail, __ATOMIC_ACQUIRE) - h->req_head;
+}
+
+
+/**
+ * Copies responses to the ring, as many as it has room for.
+ */
+uint64_t shm_ring_write(bloom_shm_ring *ring, const char *buf, uint64_t len) {
+    shm_ring_header *h = ring->header;
+    uint64_t tail = h->resp_tail;
+    uint64_t used = tail - __atomic_load_n(&h->resp_head, __ATOMIC_ACQUIRE);
+
+    // A client moving the head past the tail gets nothing
+    if (used > ring->size) return 0;
+    if (len > ring->size - used) len = ring->size - used;
+    if (!len) return 0;
+
+    uint64_t off = tail & (ring->size - 1);
+    uint64_t first = (len < ring->size - off) ? len : ring->size - off;
+    memcpy(ring->resp + off, buf, first);
+    memcpy(ring->resp, buf + first, len - first);
+    __atomic_store_n(&h->resp_tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+
+/**
+ * Returns the room left in the response ring.
+ */
+uint64_t shm_ring_room(bloom_shm_ring *ring) {
+    shm_ring_header *h = ring->header;
+    uint64_t used = h->resp_tail - __atomic_load_n(&h->resp_head, __ATOMIC_ACQUIRE);
+    return (used > ring->size) ? 0 : ring->size - used;
+}
+
+
+/**
+ * Marks bloomd as waiting for room in the response ring,
+ * then checks it again.
+ */
+int shm_ring_wait_room(bloom_shm_ring *ring) {
+    shm_ring_header *h = ring->header;
+    __atomic_store_n(&h->server_waiting, 1, __ATOMIC_SEQ_CST);
+    uint64_t used = h->resp_tail - __atomic_load_n(&h->resp_head, __ATOMIC_SEQ_CST);
+    if (used >= ring->size) return 0;
+    __atomic_store_n(&h->server_waiting, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+/**
+ * Wakes the client if it is waiting. The fence orders the
+ * moves of the tails before the check of the flag, against
+ * the client setting the flag before it checks the tails.
+ */
+void shm_ring_notify(bloom_shm_ring *ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&ring->header->client_waiting, __ATOMIC_RELAXED)) return;
+    if (__atomic_exchange_n(&ring->header->client_waiting, 0, __ATOMIC_ACQ_REL))
+        shm_ring_ring(ring->client_efd);
+}
+
+
+/**
+ * Clears an eventfd once it was rung.
+ */
+void shm_ring_clear(int efd) {
+    uint64_t count;
+    while (read(efd, &count, sizeof(count)) == -1 && errno == EINTR);
+}
+
+
+/**
+ * Rings an eventfd.
+ */
+void shm_ring_ring(int efd) {
+    uint64_t one = 1;
+    while (write(efd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+
+/**
+ * Unmaps the rings, and closes the eventfds.
+ */
+void shm_ring_destroy(bloom_shm_ring *ring) {
+    if (ring->header) munmap(ring->header, SHM_HEADER_SIZE + 2 * (size_t)ring->size);
+    if (ring->memfd >= 0) close(ring->memfd);
+    if (ring->req_efd >= 0) close(ring->req_efd);
+    if (ring->room_efd >= 0) close(ring->room_efd);
+    if (ring->client_efd >= 0) close(ring->client_efd);
+    free(ring);
+}
@@ -0,0 +1,128 @@
+#ifndef BLOOM_SHM_RING_H
+#define BLOOM_SHM_RING_H
+#include <stdint.h>
+
+/**
+ * A shared memory transport for clients on the same host. A
+ * memfd holds a header and a pair of rings, one of requests
+ * written by the client, and one of responses written by bloomd.
+ * Each ring has a tail moved only by its writer and a head moved
+ * only by its reader, both counting bytes since the start, so
+ * neither side takes a lock. They are on their own cache lines.
+ *
+ * The sides wake each other through eventfds. The client rings
+ * the request eventfd once it wrote a batch of requests, and the
+ * room eventfd once it read responses while bloomd waits for room.
+ * A client waits on the client eventfd once it sets client_waiting,
+ * and bloomd rings it once it wrote responses or read requests.
+ * A side sets its waiting flag and checks the ring again before it
+ * sleeps, so a wakeup is never lost.
+ */
+
+// The header is a page, the rings follow it
+#define SHM_HEADER_SIZE 4096
+#define SHM_MAGIC 0x626c6d72
+
+// Sizes of a ring, which must be a power of two
+#define SHM_RING_DEFAULT (1 << 20)
+#define SHM_RING_MIN (1 << 16)
+#define SHM_RING_MAX (1 << 26)
+
+/**
+ * The header of the memfd, shared with the client. The
+ * request ring starts at SHM_HEADER_SIZE, and the response
+ * ring follows it.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t ring_size;
+    uint64_t req_tail __attribute__ ((aligned (64)));   // Moved by the client
+    uint64_t req_head __attribute__ ((aligned (64)));   // Moved by bloomd
+    uint64_t resp_tail __attribute__ ((aligned (64)));  // Moved by bloomd
+    uint64_t resp_head __attribute__ ((aligned (64)));  // Moved by the client
+    uint32_t client_waiting __attribute__ ((aligned (64)));    // Set by a client before it sleeps
+    uint32_t server_waiting __attribute__ ((aligned (64)));    // Set by bloomd waiting for room
+} shm_ring_header;
+
+/**
+ * The rings of a connection, as mapped by bloomd
+ */
+typedef struct {
+    shm_ring_header *header;
+    char *req;
+    char *resp;
+    uint32_t size;
+    int memfd;          // Closed once passed to the client
+    int req_efd;        // Rung by the client after writing requests
+    int room_efd;       // Rung by the client after reading responses
+    int client_efd;     // Rung by bloomd to wake the client
+} bloom_shm_ring;
+
+/**
+ * Creates the memfd and eventfds of a pair of rings.
+ * @arg size The size of each ring, a power of two
+ * @arg ring Output, the rings
+ * @return 0 on success, -EINVAL on a bad size, -ENOTSUP
+ * without memfds, or negative on other failures.
+ */
+int shm_ring_create(uint32_t size, bloom_shm_ring **ring);
+
+/**
+ * Copies the requests written by the client, and frees
+ * their room in the ring.
+ * @arg ring The rings
+ * @arg buf The buffer to copy into
+ * @arg len The room of the buffer
+ * @return The bytes copied.
+ */
+uint64_t shm_ring_read(bloom_shm_ring *ring, char *buf, uint64_t len);
+
+/**
+ * Returns the bytes of requests left in the ring.
+ */
+uint64_t shm_ring_pending(bloom_shm_ring *ring);
+
+/**
+ * Copies responses to the ring, as many as it has room for.
+ * @arg ring The rings
+ * @arg buf The responses
+ * @arg len The bytes of responses
+ * @return The bytes copied.
+ */
+uint64_t shm_ring_write(bloom_shm_ring *ring, const char *buf, uint64_t len);
+
+/**
+ * Returns the room left in the response ring.
+ */
+uint64_t shm_ring_room(bloom_shm_ring *ring);
+
+/**
+ * Marks bloomd as waiting for room in the response ring,
+ * then checks it again.
+ * @return 1 if the ring has room after all, 0 if the
+ * client rings the room eventfd once it does.
+ */
+int shm_ring_wait_room(bloom_shm_ring *ring);
+
+/**
+ * Wakes the client if it is waiting.
+ */
+void shm_ring_notify(bloom_shm_ring *ring);
+
+/**
+ * Clears an eventfd once it was rung.
+ */
+void shm_ring_clear(int efd);
+
+/**
+ * Rings an eventfd.
+ */
+void shm_ring_ring(int efd);
+
+/**
+ * Unmaps the rings, and closes the eventfds.
+ * @arg ring The rings
+ */
+void shm_ring_destroy(bloom_shm_ring *ring);
+
+#endif
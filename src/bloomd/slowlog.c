@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "slowlog.h"
+
+/**
+ * An entry of a ring. The sequence is odd while
+ * the entry is written, and changes with each write.
+ */
+typedef struct {
+    uint64_t seq;
+    bloom_slowlog_entry entry;
+} slowlog_slot;
+
+/**
+ * The ring of one thread. Rings are aligned so
+ * that the threads never share a cache line.
+ */
+typedef struct slowlog_ring {
+    slowlog_slot slots[SLOWLOG_LEN];
+    uint64_t written;           // Entries written, the next slot is written % SLOWLOG_LEN
+    struct slowlog_ring *next;
+} __attribute__ ((aligned (64))) slowlog_ring;
+
+// The ring of the calling thread, allocated on first use
+static __thread slowlog_ring *LOCAL_RING = NULL;
+
+// The events of the command of the calling thread
+static __thread int LOCAL_EVENTS = 0;
+
+// All the rings. Pushed without a lock, and never freed so
+// that readers can walk them while threads exit.
+static slowlog_ring *RINGS = NULL;
+
+// The id of the next entry, and the first entry not reset
+static uint64_t NEXT_ID = 1;
+static uint64_t RESET_ID = 1;
+
+static slowlog_ring* local_ring(void);
+static int read_slot(slowlog_slot *slot, bloom_slowlog_entry *out);
+static int entry_cmp(const void *a, const void *b);
+
+/**
+ * Starts a command on the calling thread, clearing its events.
+ * @notes Thread safe.
+ */
+void slowlog_begin(void) {
+    LOCAL_EVENTS = 0;
+}
+
+/**
+ * Notes an event during the command of the calling thread.
+ * @notes Thread safe.
+ * @arg event A SLOWLOG_* event
+ */
+void slowlog_note(int event) {
+    LOCAL_EVENTS |= event;
+}
+
+/**
+ * Logs a slow command into the ring of the calling thread,
+ * with the events noted since slowlog_begin.
+ * @notes Thread safe.
+ */
+void slowlog_record(const char *command, const char *filter, int filter_len,
+        uint32_t keys, uint64_t usec) {
+    slowlog_ring *r = LOCAL_RING;
+    if (!r) r = local_ring();
+
+    // Mark the slot as written, readers skip it until it is done
+    slowlog_slot *slot = r->slots + (r->written++ % SLOWLOG_LEN);
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    bloom_slowlog_entry *e = &slot->entry;
+    e->id = __atomic_fetch_add(&NEXT_ID, 1, __ATOMIC_RELAXED);
+    e->time = time(NULL);
+    e->usec = usec;
+    e->command = command;
+    e->keys = keys;
+    e->events = LOCAL_EVENTS;
+
+    // The name ends at a space, the handlers may have terminated it
+    int len = 0;
+    if (filter) {
+        if (filter_len > SLOWLOG_NAME) filter_len = SLOWLOG_NAME;
+        while (len < filter_len && filter[len] != ' ' && filter[len] != '\0') len++;
+        memcpy(e->filter, filter, len);
+    }
+    e->filter[len] = '\0';
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reads the newest slow commands of all the threads.
+ * @notes Thread safe.
+ * @arg out Output, the entries, newest first
+ * @arg max The most entries to read
+ * @return The number of entries read.
+ */
+int slowlog_read(bloom_slowlog_entry *out, int max) {
+    if (max <= 0) return 0;
+
+    // Gather every entry, since the newest may be on any thread
+    int num_rings = 0;
+    slowlog_ring *r = __atomic_load_n(&RINGS, __ATOMIC_ACQUIRE);
+    for (slowlog_ring *it = r; it; it = it->next) num_rings++;
+    bloom_slowlog_entry *all = malloc(num_rings * SLOWLOG_LEN * sizeof(bloom_slowlog_entry) + 1);
+    int n = 0;
+    for (; r; r = r->next) {
+        for (int i=0; i < SLOWLOG_LEN; i++) {
+            if (read_slot(r->slots + i, all + n)) n++;
+        }
+    }
+
+    qsort(all, n, sizeof(bloom_slowlog_entry), entry_cmp);
+    if (n > max) n = max;
+    memcpy(out, all, n * sizeof(bloom_slowlog_entry));
+    free(all);
+    return n;
+}
+
+/**
+ * Counts the slow commands that can be read.
+ * @notes Thread safe.
+ */
+int slowlog_len(void) {
+    int n = 0;
+    bloom_slowlog_entry e;
+    slowlog_ring *r = __atomic_load_n(&RINGS, __ATOMIC_ACQUIRE);
+    for (; r; r = r->next) {
+        for (int i=0; i < SLOWLOG_LEN; i++) n += read_slot(r->slots + i, &e);
+    }
+    return n;
+}
+
+/**
+ * Forgets the slow commands logged so far. The entries
+ * stay in the rings, but are no longer read.
+ * @notes Thread safe.
+ */
+void slowlog_reset(void) {
+    __atomic_store_n(&RESET_ID, __atomic_load_n(&NEXT_ID, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies an entry out of its slot.
+ * @return 1 if the entry was copied, 0 if the slot is empty,
+ * reset or being written.
+ */
+static int read_slot(slowlog_slot *slot, bloom_slowlog_entry *out) {
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (!seq || seq & 1) return 0;
+    memcpy(out, &slot->entry, sizeof(bloom_slowlog_entry));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) return 0;
+    return out->id >= __atomic_load_n(&RESET_ID, __ATOMIC_RELAXED);
+}
+
+/**
+ * Orders entries newest first
+ */
+static int entry_cmp(const void *a, const void *b) {
+    uint64_t id_a = ((bloom_slowlog_entry*)a)->id;
+    uint64_t id_b = ((bloom_slowlog_entry*)b)->id;
+    return (id_a < id_b) ? 1 : (id_a > id_b) ? -1 : 0;
+}
+
+/**
+ * Allocates and registers the ring of the calling thread
+ */
+static slowlog_ring* local_ring(void) {
+    slowlog_ring *r;
+    if (posix_memalign((void**)&r, 64, sizeof(slowlog_ring))) abort();
+    memset(r, 0, sizeof(slowlog_ring));
+
+    // Push onto the list of rings
+    r->next = __atomic_load_n(&RINGS, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&RINGS, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    LOCAL_RING = r;
+    return r;
+}
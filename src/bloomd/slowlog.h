@@ -0,0 +1,87 @@
+#ifndef BLOOM_SLOWLOG_H
+#define BLOOM_SLOWLOG_H
+#include <stdint.h>
+
+/**
+ * Logs the commands slower than slowlog_usec, as the slowlog
+ * of Redis does. Each thread logs into a ring of its own, so
+ * logging takes no lock and only that thread writes the ring.
+ * Readers copy the entries under a sequence count, and skip
+ * an entry being overwritten. A ring keeps the newest
+ * SLOWLOG_LEN entries of its thread.
+ */
+#define SLOWLOG_LEN 128
+
+/**
+ * The most bytes of a filter name kept in an entry
+ */
+#define SLOWLOG_NAME 64
+
+/**
+ * The events noted while a command runs
+ */
+#define SLOWLOG_PAGE_IN 1       // A filter was faulted in
+#define SLOWLOG_GROWTH  2       // A filter added a layer
+
+/**
+ * A slow command
+ */
+typedef struct {
+    uint64_t id;                    // Increases with each entry, across the threads
+    uint64_t time;                  // Unix time the command finished
+    uint64_t usec;                  // How long the command took
+    const char *command;            // The name of the command, a static string
+    char filter[SLOWLOG_NAME + 1];  // The filter name, truncated, or empty
+    uint32_t keys;                  // The keys of the command
+    int events;                     // The SLOWLOG_* events during the command
+} bloom_slowlog_entry;
+
+/**
+ * Starts a command on the calling thread, clearing its events.
+ * @notes Thread safe.
+ */
+void slowlog_begin(void);
+
+/**
+ * Notes an event during the command of the calling thread.
+ * Harmless on threads that do not run commands.
+ * @notes Thread safe.
+ * @arg event A SLOWLOG_* event
+ */
+void slowlog_note(int event);
+
+/**
+ * Logs a slow command into the ring of the calling thread,
+ * with the events noted since slowlog_begin.
+ * @notes Thread safe.
+ * @arg command The name of the command, a static string
+ * @arg filter The filter name, which ends at a space or NUL. Can be NULL.
+ * @arg filter_len The most bytes of the filter name
+ * @arg keys The keys of the command
+ * @arg usec How long the command took
+ */
+void slowlog_record(const char *command, const char *filter, int filter_len,
+        uint32_t keys, uint64_t usec);
+
+/**
+ * Reads the newest slow commands of all the threads.
+ * @notes Thread safe.
+ * @arg out Output, the entries, newest first
+ * @arg max The most entries to read
+ * @return The number of entries read.
+ */
+int slowlog_read(bloom_slowlog_entry *out, int max);
+
+/**
+ * Counts the slow commands that can be read.
+ * @notes Thread safe.
+ */
+int slowlog_len(void);
+
+/**
+ * Forgets the slow commands logged so far.
+ * @notes Thread safe.
+ */
+void slowlog_reset(void);
+
+#endif
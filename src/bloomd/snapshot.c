@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "snapshot.h"
+
+/**
+ * Magic and version of the snapshot format
+ */
+#define SNAPSHOT_MAGIC 0x424e5331    // "BNS1"
+#define SNAPSHOT_VERSION 1
+
+/**
+ * Zero runs shorter than this are kept in literals,
+ * since each run costs at least two token bytes.
+ */
+#define MIN_ZERO_RUN 8
+
+/**
+ * Frame encodings
+ */
+typedef enum {
+    FRAME_ZERO = 0,     // All zero, nothing stored
+    FRAME_RAW = 1,      // Stored as is
+    FRAME_RUNS = 2,     // Zero and literal runs
+} frame_type;
+
+/**
+ * The header at the start of a snapshot
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frame_size;
+    uint32_t num_frames;
+    uint64_t size;          // Size of the bitmap
+} __attribute__ ((packed)) snapshot_header;
+
+/**
+ * An entry in the frame index, which follows the header
+ */
+typedef struct {
+    uint64_t offset;        // Offset of the frame in the snapshot
+    uint32_t len;           // Stored length of the frame
+    uint32_t type;          // The frame_type
+} __attribute__ ((packed)) snapshot_frame;
+
+/**
+ * Shared state of the restore threads
+ */
+typedef struct {
+    int in_fd;
+    int out_fd;
+    snapshot_header *header;
+    snapshot_frame *frames;
+    uint32_t next_frame;    // Next frame to claim
+    int err;                // Set on any failure
+} restore_state;
+
+/*
+ * Static declarations
+ */
+static uint32_t put_varint(unsigned char *out, uint64_t val);
+static int get_varint(const unsigned char *in, uint32_t len, uint32_t *pos, uint64_t *val);
+static int write_all(int fd, const void *buf, uint64_t len, uint64_t offset);
+static int read_all(int fd, void *buf, uint64_t len, uint64_t offset);
+static void* restore_thread_main(void *in);
+
+/**
+ * Appends a varint, returns the bytes used.
+ */
+static uint32_t put_varint(unsigned char *out, uint64_t val) {
+    uint32_t i = 0;
+    while (val >= 0x80) {
+        out[i++] = (val & 0x7f) | 0x80;
+        val >>= 7;
+    }
+    out[i++] = val;
+    return i;
+}
+
+/**
+ * Reads a varint, returns -1 if it is truncated.
+ */
+static int get_varint(const unsigned char *in, uint32_t len, uint32_t *pos, uint64_t *val) {
+    uint64_t res = 0;
+    for (int shift=0; shift < 64; shift += 7) {
+        if (*pos >= len) return -1;
+        unsigned char b = in[(*pos)++];
+        res |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *val = res;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Compresses a single frame.
+ * @arg in The input bytes
+ * @arg len The number of input bytes
+ * @arg out The output buffer
+ * @arg out_len The size of the output buffer
+ * @return The compressed size, 0 if the frame is all zeros,
+ * or UINT32_MAX if it does not fit.
+ */
+uint32_t snapshot_encode_frame(const unsigned char *in, uint32_t len, unsigned char *out, uint32_t out_len) {
+    uint32_t i = 0, pos = 0;
+    while (i < len) {
+        // Count the leading zeros, trailing zeros are implied
+        uint32_t zeros = 0;
+        while (i < len && in[i] == 0) {
+            zeros++;
+            i++;
+        }
+        if (i == len) break;
+
+        // Extend the literal until a long enough zero run
+        uint32_t start = i, run = 0;
+        while (i < len) {
+            if (in[i] == 0) {
+                if (++run == MIN_ZERO_RUN) break;
+            } else {
+                run = 0;
+            }
+            i++;
+        }
+
+        // Back up to the start of the zero run
+        if (i < len) {
+            i -= MIN_ZERO_RUN - 1;
+        } else {
+            i -= run;
+        }
+        uint32_t lit = i - start;
+
+        // Emit the token, leaving room for the varints
+        if ((uint64_t)pos + 20 + lit > out_len) return UINT32_MAX;
+        pos += put_varint(out + pos, zeros);
+        pos += put_varint(out + pos, lit);
+        memcpy(out + pos, in + start, lit);
+        pos += lit;
+    }
+    return pos;
+}
+
+/**
+ * Decompresses a single frame.
+ * @arg in The compressed bytes
+ * @arg len The number of compressed bytes
+ * @arg out The output buffer
+ * @arg out_len The expected number of output bytes
+ * @return 0 on success, -1 if the frame is corrupt.
+ */
+int snapshot_decode_frame(const unsigned char *in, uint32_t len, unsigned char *out, uint32_t out_len) {
+    uint32_t pos = 0, written = 0;
+    uint64_t zeros, lit;
+    while (pos < len) {
+        if (get_varint(in, len, &pos, &zeros)) return -1;
+        if (get_varint(in, len, &pos, &lit)) return -1;
+        if (zeros > out_len - written) return -1;
+        memset(out + written, 0, zeros);
+        written += zeros;
+        if (lit > out_len - written || lit > len - pos) return -1;
+        memcpy(out + written, in + pos, lit);
+        written += lit;
+        pos += lit;
+    }
+
+    // Trailing zeros are implied
+    memset(out + written, 0, out_len - written);
+    return 0;
+}
+
+/**
+ * Writes the whole buffer at an offset
+ */
+static int write_all(int fd, const void *buf, uint64_t len, uint64_t offset) {
+    const unsigned char *p = buf;
+    while (len) {
+        ssize_t res = pwrite(fd, p, len, offset);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        p += res;
+        len -= res;
+        offset += res;
+    }
+    return 0;
+}
+
+/**
+ * Reads the whole buffer from an offset
+ */
+static int read_all(int fd, void *buf, uint64_t len, uint64_t offset) {
+    unsigned char *p = buf;
+    while (len) {
+        ssize_t res = pread(fd, p, len, offset);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (res == 0) return -EIO;
+        p += res;
+        len -= res;
+        offset += res;
+    }
+    return 0;
+}
+
+/**
+ * Writes a snapshot of a bitmap. The snapshot is written to
+ * a temporary file, synced, and then renamed into place.
+ * @arg map The bitmap to snapshot
+ * @arg path The path of the snapshot
+ * @return 0 on success, negative on failure.
+ */
+int snapshot_write(bloom_bitmap *map, char *path) {
+    if (!map || !map->mmap || !path) return -EINVAL;
+
+    snapshot_header header = {
+        SNAPSHOT_MAGIC,
+        SNAPSHOT_VERSION,
+        SNAPSHOT_FRAME_SIZE,
+        (map->size + SNAPSHOT_FRAME_SIZE - 1) / SNAPSHOT_FRAME_SIZE,
+        map->size
+    };
+
+    char *tmp_path = NULL;
+    if (asprintf(&tmp_path, "%s.tmp", path) == -1) return -ENOMEM;
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        int res = -errno;
+        syslog(LOG_ERR, "Failed to create snapshot %s. %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return res;
+    }
+
+    snapshot_frame *frames = calloc(header.num_frames, sizeof(snapshot_frame));
+    unsigned char *buf = malloc(SNAPSHOT_FRAME_SIZE);
+    uint64_t offset = sizeof(snapshot_header) + header.num_frames * sizeof(snapshot_frame);
+    int res = 0;
+
+    for (uint32_t i=0; i < header.num_frames && !res; i++) {
+        uint64_t start = (uint64_t)i * SNAPSHOT_FRAME_SIZE;
+        uint32_t len = SNAPSHOT_FRAME_SIZE;
+        if (start + len > map->size) len = map->size - start;
+        const unsigned char *in = map->mmap + start;
+
+        uint32_t enc = snapshot_encode_frame(in, len, buf, len);
+        if (enc == 0) {
+            frames[i].type = FRAME_ZERO;
+            continue;
+        } else if (enc >= len) {
+            frames[i].type = FRAME_RAW;
+            frames[i].len = len;
+            res = write_all(fd, in, len, offset);
+        } else {
+            frames[i].type = FRAME_RUNS;
+            frames[i].len = enc;
+            res = write_all(fd, buf, enc, offset);
+        }
+        frames[i].offset = offset;
+        offset += frames[i].len;
+    }
+
+    // Write the header and index once the frames are down
+    if (!res) res = write_all(fd, &header, sizeof(header), 0);
+    if (!res) res = write_all(fd, frames, header.num_frames * sizeof(snapshot_frame), sizeof(header));
+    if (!res && fsync(fd)) res = -errno;
+    close(fd);
+
+    if (!res && rename(tmp_path, path)) res = -errno;
+    if (res) {
+        syslog(LOG_ERR, "Failed to write snapshot %s. Err: %d", path, res);
+        unlink(tmp_path);
+    } else {
+        syslog(LOG_INFO, "Wrote snapshot %s. Size: %llu Compressed: %llu",
+                path, (unsigned long long)map->size, (unsigned long long)offset);
+    }
+
+    free(buf);
+    free(frames);
+    free(tmp_path);
+    return res;
+}
+
+/**
+ * Packs a bitmap into memory. The frames are encoded
+ * into a buffer that grows as needed, and is trimmed
+ * to size at the end.
+ * @arg map The bitmap to pack
+ * @return The packed snapshot, or NULL on failure.
+ */
+snapshot_packed* snapshot_pack(bloom_bitmap *map) {
+    if (!map || !map->mmap) return NULL;
+
+    snapshot_packed *packed = calloc(1, sizeof(snapshot_packed));
+    packed->size = map->size;
+    packed->num_frames = (map->size + SNAPSHOT_FRAME_SIZE - 1) / SNAPSHOT_FRAME_SIZE;
+    snapshot_frame *frames = calloc(packed->num_frames, sizeof(snapshot_frame));
+    packed->frames = frames;
+
+    uint64_t capacity = 0, offset = 0;
+    for (uint32_t i=0; i < packed->num_frames; i++) {
+        uint64_t start = (uint64_t)i * SNAPSHOT_FRAME_SIZE;
+        uint32_t len = SNAPSHOT_FRAME_SIZE;
+        if (start + len > map->size) len = map->size - start;
+
+        // Make room for a raw frame, the worst case
+        if (offset + len > capacity) {
+            capacity = (capacity) ? capacity * 2 : SNAPSHOT_FRAME_SIZE;
+            if (capacity < offset + len) capacity = offset + len;
+            unsigned char *data = realloc(packed->data, capacity);
+            if (!data) {
+                snapshot_free_packed(packed);
+                return NULL;
+            }
+            packed->data = data;
+        }
+
+        const unsigned char *in = map->mmap + start;
+        uint32_t enc = snapshot_encode_frame(in, len, packed->data + offset, len);
+        if (enc == 0) {
+            frames[i].type = FRAME_ZERO;
+            continue;
+        } else if (enc >= len) {
+            frames[i].type = FRAME_RAW;
+            frames[i].len = len;
+            memcpy(packed->data + offset, in, len);
+        } else {
+            frames[i].type = FRAME_RUNS;
+            frames[i].len = enc;
+        }
+        frames[i].offset = offset;
+        offset += frames[i].len;
+    }
+
+    // Give back the unused room
+    if (offset < capacity) {
+        unsigned char *data = realloc(packed->data, (offset) ? offset : 1);
+        if (data) packed->data = data;
+    }
+    packed->packed_len = offset;
+    return packed;
+}
+
+/**
+ * Unpacks a packed snapshot into a bitmap of its size.
+ * The bitmap must be zeroed, all zero frames are skipped.
+ * @arg packed The packed snapshot
+ * @arg map The bitmap to fill
+ * @return 0 on success, negative on failure.
+ */
+int snapshot_unpack(snapshot_packed *packed, bloom_bitmap *map) {
+    if (!packed || !map || !map->mmap || map->size != packed->size) return -EINVAL;
+
+    snapshot_frame *frames = packed->frames;
+    for (uint32_t i=0; i < packed->num_frames; i++) {
+        uint64_t start = (uint64_t)i * SNAPSHOT_FRAME_SIZE;
+        uint32_t len = SNAPSHOT_FRAME_SIZE;
+        if (start + len > packed->size) len = packed->size - start;
+
+        snapshot_frame *frame = frames + i;
+        if (frame->type == FRAME_ZERO) {
+            continue;
+        } else if (frame->type == FRAME_RAW) {
+            memcpy(map->mmap + start, packed->data + frame->offset, len);
+        } else if (snapshot_decode_frame(packed->data + frame->offset, frame->len, map->mmap + start, len)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the bytes of memory held by a packed snapshot.
+ */
+uint64_t snapshot_packed_bytes(snapshot_packed *packed) {
+    return sizeof(snapshot_packed) + packed->num_frames * sizeof(snapshot_frame) + packed->packed_len;
+}
+
+/**
+ * Frees a packed snapshot.
+ */
+void snapshot_free_packed(snapshot_packed *packed) {
+    if (!packed) return;
+    free(packed->frames);
+    free(packed->data);
+    free(packed);
+}
+
+/**
+ * Restores frames until there are none left
+ */
+static void* restore_thread_main(void *in) {
+    restore_state *state = in;
+    unsigned char *comp = malloc(SNAPSHOT_FRAME_SIZE);
+    unsigned char *buf = malloc(SNAPSHOT_FRAME_SIZE);
+    uint32_t frame_size = state->header->frame_size;
+
+    while (!__atomic_load_n(&state->err, __ATOMIC_RELAXED)) {
+        uint32_t i = __atomic_fetch_add(&state->next_frame, 1, __ATOMIC_RELAXED);
+        if (i >= state->header->num_frames) break;
+
+        snapshot_frame *frame = state->frames + i;
+        uint64_t start = (uint64_t)i * frame_size;
+        uint32_t len = frame_size;
+        if (start + len > state->header->size) len = state->header->size - start;
+
+        int res = 0;
+        if (frame->type == FRAME_ZERO) {
+            continue;
+        } else if (frame->type == FRAME_RAW && frame->len == len) {
+            res = read_all(state->in_fd, buf, len, frame->offset);
+        } else if (frame->type == FRAME_RUNS && frame->len < len) {
+            res = read_all(state->in_fd, comp, frame->len, frame->offset);
+            if (!res) res = snapshot_decode_frame(comp, frame->len, buf, len);
+        } else {
+            res = -1;
+        }
+        if (!res) res = write_all(state->out_fd, buf, len, start);
+        if (res) __atomic_store_n(&state->err, res, __ATOMIC_RELAXED);
+    }
+
+    free(comp);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Restores a snapshot into a plain data file. The frames are
+ * decompressed in parallel into a temporary file, which is synced
+ * and renamed into place. All zero frames are left as holes.
+ * @arg path The path of the snapshot
+ * @arg out_path The path of the data file to create
+ * @arg threads The number of threads to use
+ * @return 0 on success, negative on failure.
+ */
+int snapshot_restore(char *path, char *out_path, int threads) {
+    if (!path || !out_path) return -EINVAL;
+    int in_fd = open(path, O_RDONLY);
+    if (in_fd == -1) return -errno;
+
+    // Read and validate the header
+    snapshot_header header;
+    int res = read_all(in_fd, &header, sizeof(header), 0);
+    if (!res && (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+                 header.frame_size == 0 || header.frame_size > SNAPSHOT_FRAME_SIZE ||
+                 header.num_frames != (header.size + header.frame_size - 1) / header.frame_size)) {
+        syslog(LOG_ERR, "Invalid snapshot header in %s.", path);
+        res = -1;
+    }
+    if (res) {
+        close(in_fd);
+        return res;
+    }
+
+    snapshot_frame *frames = malloc(header.num_frames * sizeof(snapshot_frame) + 1);
+    res = read_all(in_fd, frames, header.num_frames * sizeof(snapshot_frame), sizeof(header));
+
+    char *tmp_path = NULL;
+    int out_fd = -1;
+    if (!res && asprintf(&tmp_path, "%s.tmp", out_path) == -1) res = -ENOMEM;
+    if (!res) {
+        out_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out_fd == -1 || ftruncate(out_fd, header.size)) res = -errno;
+    }
+
+    // Decompress the frames in parallel
+    if (!res) {
+        restore_state state = {in_fd, out_fd, &header, frames, 0, 0};
+        if (threads < 1) threads = 1;
+        if ((uint32_t)threads > header.num_frames) threads = header.num_frames;
+        pthread_t *tids = calloc(threads, sizeof(pthread_t));
+        int started = 0;
+        for (; started < threads; started++) {
+            if (pthread_create(tids + started, NULL, restore_thread_main, &state)) break;
+        }
+        if (started == 0) restore_thread_main(&state);
+        for (int i=0; i < started; i++) pthread_join(tids[i], NULL);
+        free(tids);
+        res = state.err;
+    }
+    if (!res && fsync(out_fd)) res = -errno;
+    if (out_fd != -1) close(out_fd);
+    close(in_fd);
+
+    if (!res && rename(tmp_path, out_path)) res = -errno;
+    if (res) {
+        syslog(LOG_ERR, "Failed to restore snapshot %s. Err: %d", path, res);
+        if (tmp_path) unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(frames);
+    return res;
+}
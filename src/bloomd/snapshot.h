@@ -0,0 +1,105 @@
+#ifndef BLOOM_SNAPSHOT_H
+#define BLOOM_SNAPSHOT_H
+#include <stdint.h>
+#include "bitmap.h"
+
+/**
+ * Snapshots are a compressed on-disk format for the data
+ * files of cold filters. The bitmap is split into fixed size
+ * frames, each compressed on its own, with an index of the
+ * frames up front so they can be restored in parallel. Frames
+ * are encoded as runs of zero bytes and literal bytes, which
+ * suits sparse bitmaps. All zero frames are not stored at all.
+ */
+
+/**
+ * The size of a snapshot frame. 64KB.
+ */
+#define SNAPSHOT_FRAME_SIZE (64 * 1024)
+
+/**
+ * The default number of threads used to restore a snapshot.
+ */
+#define SNAPSHOT_RESTORE_THREADS 4
+
+/**
+ * A snapshot of a bitmap packed in memory, for the filters
+ * that have no data files. The frames are encoded as in a
+ * snapshot file, one after the other.
+ */
+typedef struct snapshot_packed {
+    uint64_t size;          // Size of the bitmap
+    uint64_t packed_len;    // Bytes of the encoded frames
+    uint32_t num_frames;
+    void *frames;           // The frame index
+    unsigned char *data;    // The encoded frames
+} snapshot_packed;
+
+/**
+ * Writes a snapshot of a bitmap. The snapshot is written to
+ * a temporary file, synced, and then renamed into place.
+ * @arg map The bitmap to snapshot
+ * @arg path The path of the snapshot
+ * @return 0 on success, negative on failure.
+ */
+int snapshot_write(bloom_bitmap *map, char *path);
+
+/**
+ * Restores a snapshot into a plain data file. The frames are
+ * decompressed in parallel into a temporary file, which is synced
+ * and renamed into place. All zero frames are left as holes.
+ * @arg path The path of the snapshot
+ * @arg out_path The path of the data file to create
+ * @arg threads The number of threads to use
+ * @return 0 on success, negative on failure.
+ */
+int snapshot_restore(char *path, char *out_path, int threads);
+
+/**
+ * Packs a bitmap into memory.
+ * @arg map The bitmap to pack
+ * @return The packed snapshot, or NULL on failure.
+ */
+snapshot_packed* snapshot_pack(bloom_bitmap *map);
+
+/**
+ * Unpacks a packed snapshot into a bitmap of its size.
+ * The bitmap must be zeroed, all zero frames are skipped.
+ * @arg packed The packed snapshot
+ * @arg map The bitmap to fill
+ * @return 0 on success, negative on failure.
+ */
+int snapshot_unpack(snapshot_packed *packed, bloom_bitmap *map);
+
+/**
+ * Returns the bytes of memory held by a packed snapshot.
+ */
+uint64_t snapshot_packed_bytes(snapshot_packed *packed);
+
+/**
+ * Frees a packed snapshot.
+ */
+void snapshot_free_packed(snapshot_packed *packed);
+
+/**
+ * Compresses a single frame.
+ * @arg in The input bytes
+ * @arg len The number of input bytes
+ * @arg out The output buffer
+ * @arg out_len The size of the output buffer
+ * @return The compressed size, 0 if the frame is all zeros,
+ * or UINT32_MAX if it does not fit.
+ */
+uint32_t snapshot_encode_frame(const unsigned char *in, uint32_t len, unsigned char *out, uint32_t out_len);
+
+/**
+ * Decompresses a single frame.
+ * @arg in The compressed bytes
+ * @arg len The number of compressed bytes
+ * @arg out The output buffer
+ * @arg out_len The expected number of output bytes
+ * @return 0 on success, -1 if the frame is corrupt.
+ */
+int snapshot_decode_frame(const unsigned char *in, uint32_t len, unsigned char *out, uint32_t out_len);
+
+#endif
@@ -0,0 +1,70 @@
+#include <sched.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "spinlock.h"
+#include "stats.h"
+
+static inline void spin_pause(void);
+static void sleep_on(bloom_spinlock *spin);
+
+/**
+ * Takes a contended lock, spinning and then sleeping.
+ * @arg spin The lock
+ */
+void bloom_spin_lock_slow(bloom_spinlock *spin) {
+    // Spin while the holder is likely running
+    int state;
+    for (int i=0; i < BLOOM_SPIN_TRIES; i++) {
+        spin_pause();
+        state = 0;
+        if (!__atomic_load_n(&spin->state, __ATOMIC_RELAXED) &&
+                __atomic_compare_exchange_n(&spin->state, &state, 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            stats_add(STAT_LOCK_SPINS, 1);
+            return;
+        }
+    }
+
+    // Mark the lock as having sleepers, so the unlock wakes us.
+    // We may then take the lock as 2 with no sleepers left,
+    // which only costs the next unlock a wake.
+    stats_add(STAT_LOCK_WAITS, 1);
+    while (__atomic_exchange_n(&spin->state, 2, __ATOMIC_ACQUIRE) != 0)
+        sleep_on(spin);
+}
+
+/**
+ * Wakes a thread sleeping on a lock.
+ * @arg spin The lock
+ */
+void bloom_spin_wake(bloom_spinlock *spin) {
+#ifdef __linux__
+    syscall(SYS_futex, &spin->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void)spin;
+#endif
+}
+
+/**
+ * Hints the CPU that we are spinning
+ */
+static inline void spin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Sleeps while the lock is locked with sleepers. Without
+ * a futex, this yields instead, and the wake is a no-op.
+ */
+static void sleep_on(bloom_spinlock *spin) {
+#ifdef __linux__
+    syscall(SYS_futex, &spin->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+#else
+    (void)spin;
+    sched_yield();
+#endif
+}
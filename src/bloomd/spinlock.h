@@ -4,30 +4,52 @@
 #ifndef BLOOM_SPINLOCK_H
 #define BLOOM_SPINLOCK_H
 
-#ifdef __MACH__
-// On OSX use OSAtomic
-#include <libkern/OSAtomic.h>
-typedef OSSpinLock bloom_spinlock;
-#define INIT_BLOOM_SPIN(spin) { *spin = OS_SPINLOCK_INIT; }
-#define LOCK_BLOOM_SPIN(spin) { OSSpinLockLock(spin); }
-#define UNLOCK_BLOOM_SPIN(spin) { OSSpinLockUnlock(spin); }
-
-#else
-#ifdef _POSIX_SPIN_LOCKS
-// On most POSIX systems, use pthreads spin locks
-typedef pthread_spinlock_t bloom_spinlock;
-#define INIT_BLOOM_SPIN(spin) { pthread_spin_init(spin, PTHREAD_PROCESS_PRIVATE); }
-#define LOCK_BLOOM_SPIN(spin) { pthread_spin_lock(spin); }
-#define UNLOCK_BLOOM_SPIN(spin) { pthread_spin_unlock(spin); }
-
-#else
-// Fall back onto a mutex
-typedef pthread_mutex_t bloom_spinlock;
-#define INIT_BLOOM_SPIN(spin) { pthread_mutex_init(spin, NULL); }
-#define LOCK_BLOOM_SPIN(spin) { pthread_mutex_lock(spin); }
-#define UNLOCK_BLOOM_SPIN(spin) { pthread_mutex_unlock(spin); }
+/**
+ * Adaptive locks for short critical sections on hot paths.
+ * A contended lock is spun on for a bounded number of tries,
+ * then the thread sleeps until woken by the unlock, on a futex
+ * on Linux. A holder that is descheduled then does not make
+ * the waiters burn their time slices.
+ *
+ * The acquisitions that spun and that slept are counted in
+ * the lock_spins and lock_waits statistics.
+ */
 
-#endif
-#endif
+/**
+ * The tries a contended lock is spun on before sleeping
+ */
+#define BLOOM_SPIN_TRIES 128
+
+/**
+ * An adaptive lock. The state is 0 if unlocked, 1 if
+ * locked, and 2 if locked and there may be sleepers.
+ */
+typedef struct {
+    volatile int state;
+} bloom_spinlock;
+
+/**
+ * Takes a contended lock, spinning and then sleeping.
+ * @arg spin The lock
+ */
+void bloom_spin_lock_slow(bloom_spinlock *spin);
+
+/**
+ * Wakes a thread sleeping on a lock.
+ * @arg spin The lock
+ */
+void bloom_spin_wake(bloom_spinlock *spin);
+
+#define INIT_BLOOM_SPIN(spin) { (spin)->state = 0; }
+#define LOCK_BLOOM_SPIN(spin) { \
+    int unlocked = 0; \
+    if (!__atomic_compare_exchange_n(&(spin)->state, &unlocked, 1, 0, \
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) \
+        bloom_spin_lock_slow(spin); \
+}
+#define UNLOCK_BLOOM_SPIN(spin) { \
+    if (__atomic_exchange_n(&(spin)->state, 0, __ATOMIC_RELEASE) == 2) \
+        bloom_spin_wake(spin); \
+}
 
 #endif
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "stats.h"
+
+/**
+ * The counters of one thread. Blocks are aligned so
+ * that the threads never share a cache line.
+ */
+typedef struct stats_block {
+    int64_t values[STAT_NUM];
+    latency_histogram latency[LAT_NUM];
+    struct stats_block *next;
+} __attribute__ ((aligned (64))) stats_block;
+
+/**
+ * The last sample the rates are measured from
+ */
+typedef struct {
+    double time;            // Monotonic time in seconds, 0 if none
+    int64_t checks;
+    int64_t sets;
+    double checks_per_sec;
+    double sets_per_sec;
+} stats_sample;
+
+// The block of the calling thread, allocated on first use
+static __thread stats_block *LOCAL_BLOCK = NULL;
+
+// All the blocks. Pushed without a lock, and never freed so
+// that the counts of exited threads remain in the sums.
+static stats_block *BLOCKS = NULL;
+
+static pthread_mutex_t SAMPLE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static stats_sample SAMPLE = {0, 0, 0, 0, 0};
+
+static stats_block* local_block(void);
+static double monotonic_time(void);
+
+/**
+ * Adds to a statistic of the calling thread.
+ * @notes Thread safe.
+ * @arg stat The statistic to change
+ * @arg delta The amount to add, negative for gauges going down
+ */
+void stats_add(bloom_stat stat, int64_t delta) {
+    stats_block *b = LOCAL_BLOCK;
+    if (!b) b = local_block();
+
+    // Only this thread writes the block, the store is
+    // atomic so that readers never see a torn value
+    __atomic_store_n(b->values + stat, b->values[stat] + delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records the latency of a command, in the
+ * histogram of the calling thread.
+ * @notes Thread safe.
+ * @arg cmd The command
+ * @arg usec The latency in microseconds
+ */
+void stats_record_latency(bloom_latency cmd, uint64_t usec) {
+    stats_block *b = LOCAL_BLOCK;
+    if (!b) b = local_block();
+    hist_record(b->latency + cmd, usec);
+}
+
+/**
+ * Reads the latency histogram of a command,
+ * summed over all the threads.
+ * @notes Thread safe.
+ * @arg cmd The command
+ * @arg out Output, the histogram
+ */
+void stats_read_latency(bloom_latency cmd, latency_histogram *out) {
+    memset(out, 0, sizeof(latency_histogram));
+    stats_block *b = __atomic_load_n(&BLOCKS, __ATOMIC_ACQUIRE);
+    for (; b; b = b->next) hist_merge(out, b->latency + cmd);
+}
+
+/**
+ * Reads a single statistic, summed over all the threads.
+ * Unlike stats_read, the rates are not sampled.
+ * @notes Thread safe.
+ * @arg stat The statistic to read
+ * @return The value of the statistic
+ */
+int64_t stats_value(bloom_stat stat) {
+    int64_t value = 0;
+    stats_block *b = __atomic_load_n(&BLOCKS, __ATOMIC_ACQUIRE);
+    for (; b; b = b->next) value += __atomic_load_n(b->values + stat, __ATOMIC_RELAXED);
+    return value;
+}
+
+/**
+ * Reads the server wide statistics. The rates are measured
+ * between two reads, at least STATS_RATE_INTERVAL seconds apart,
+ * so a monitor polling at a fixed interval gets the rate over it.
+ * @notes Thread safe.
+ * @arg out Output, the statistics
+ */
+void stats_read(bloom_stats *out) {
+    // Sum the blocks of all the threads
+    memset(out, 0, sizeof(bloom_stats));
+    stats_block *b = __atomic_load_n(&BLOCKS, __ATOMIC_ACQUIRE);
+    for (; b; b = b->next) {
+        for (int i=0; i < STAT_NUM; i++)
+            out->values[i] += __atomic_load_n(b->values + i, __ATOMIC_RELAXED);
+    }
+
+    // Measure the rates once an interval has passed
+    double now = monotonic_time();
+    pthread_mutex_lock(&SAMPLE_LOCK);
+    double elapsed = now - SAMPLE.time;
+    if (SAMPLE.time && elapsed >= STATS_RATE_INTERVAL) {
+        SAMPLE.checks_per_sec = (out->values[STAT_CHECKS] - SAMPLE.checks) / elapsed;
+        SAMPLE.sets_per_sec = (out->values[STAT_SETS] - SAMPLE.sets) / elapsed;
+    }
+    if (!SAMPLE.time || elapsed >= STATS_RATE_INTERVAL) {
+        SAMPLE.time = now;
+        SAMPLE.checks = out->values[STAT_CHECKS];
+        SAMPLE.sets = out->values[STAT_SETS];
+    }
+    out->checks_per_sec = SAMPLE.checks_per_sec;
+    out->sets_per_sec = SAMPLE.sets_per_sec;
+    pthread_mutex_unlock(&SAMPLE_LOCK);
+}
+
+/**
+ * Allocates and registers the block of the calling thread
+ */
+static stats_block* local_block(void) {
+    stats_block *b;
+    if (posix_memalign((void**)&b, 64, sizeof(stats_block))) abort();
+    memset(b, 0, sizeof(stats_block));
+
+    // Push onto the list of blocks
+    b->next = __atomic_load_n(&BLOCKS, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&BLOCKS, &b->next, b, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    LOCAL_BLOCK = b;
+    return b;
+}
+
+// Returns the monotonic time in seconds
+static double monotonic_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,113 @@
+#ifndef BLOOM_STATS_H
+#define BLOOM_STATS_H
+#include <stdint.h>
+#include "histogram.h"
+
+/**
+ * Server wide statistics, which are kept without walking
+ * the filters. Each thread counts into a block of its own,
+ * so counting takes no lock or atomic operation and shares
+ * no cache line with other threads. Reads sum the blocks of
+ * all the threads, and may be inconsistent between stats.
+ *
+ * Gauges such as the mapped filters are counted as deltas,
+ * so a filter mapped in by one thread and out by another
+ * still sums to zero.
+ */
+typedef enum {
+    STAT_CHECKS = 0,        // Keys checked
+    STAT_SETS,              // Keys set
+    STAT_PAGE_INS,          // Filters faulted in
+    STAT_PAGE_OUTS,         // Filters paged out
+    STAT_PAGE_IN_BYTES,     // Bytes read in by page ins
+    STAT_FLUSH_BYTES,       // Bytes written out by flushes
+    STAT_FILTERS,           // Gauge of the filters
+    STAT_MAPPED_FILTERS,    // Gauge of the filters mapped in
+    STAT_MAPPED_BYTES,      // Gauge of the bytes of mapped filters
+    STAT_PACKED_BYTES,      // Gauge of the bytes of packed in-memory filters
+    STAT_CONNECTIONS,       // Gauge of the client connections
+    STAT_UDP_DATAGRAMS,     // UDP datagrams received
+    STAT_UDP_DROPS,         // UDP datagrams dropped, truncated or by the kernel
+    STAT_UDP_REJECTS,       // UDP commands ignored, other than set and bulk
+    STAT_TIMEOUTS,          // Commands answered Timeout, past their deadline
+    STAT_LOCK_SPINS,        // Contended lock acquisitions taken by spinning
+    STAT_LOCK_WAITS,        // Contended lock acquisitions that slept
+    STAT_POSITIVE_HITS,     // Keys answered by the positive cache
+    STAT_CONN_REJECTS,      // Client connections rejected over max_connections
+    STAT_BUFFER_BYTES,      // Gauge of the bytes of the connection buffers
+    STAT_NUM                // The number of stats
+} bloom_stat;
+
+/**
+ * The commands with latency histograms
+ */
+typedef enum {
+    LAT_CHECK = 0,          // check
+    LAT_MULTI,              // multi
+    LAT_SET,                // set
+    LAT_BULK,               // bulk
+    LAT_CREATE,             // create
+    LAT_FLUSH,              // flush
+    LAT_NUM                 // The number of histograms
+} bloom_latency;
+
+/**
+ * A read of the server wide statistics
+ */
+typedef struct {
+    int64_t values[STAT_NUM];   // Indexed by bloom_stat
+    double checks_per_sec;      // Rate of checks between samples
+    double sets_per_sec;        // Rate of sets between samples
+} bloom_stats;
+
+/**
+ * Adds to a statistic of the calling thread.
+ * @notes Thread safe.
+ * @arg stat The statistic to change
+ * @arg delta The amount to add, negative for gauges going down
+ */
+void stats_add(bloom_stat stat, int64_t delta);
+
+/**
+ * Records the latency of a command, in the
+ * histogram of the calling thread.
+ * @notes Thread safe.
+ * @arg cmd The command
+ * @arg usec The latency in microseconds
+ */
+void stats_record_latency(bloom_latency cmd, uint64_t usec);
+
+/**
+ * Reads the latency histogram of a command,
+ * summed over all the threads.
+ * @notes Thread safe.
+ * @arg cmd The command
+ * @arg out Output, the histogram
+ */
+void stats_read_latency(bloom_latency cmd, latency_histogram *out);
+
+/**
+ * Reads a single statistic, summed over all the threads.
+ * Unlike stats_read, the rates are not sampled, so it can
+ * be polled by the background threads.
+ * @notes Thread safe.
+ * @arg stat The statistic to read
+ * @return The value of the statistic
+ */
+int64_t stats_value(bloom_stat stat);
+
+/**
+ * Reads the server wide statistics. The rates are measured
+ * between two reads, at least STATS_RATE_INTERVAL seconds apart,
+ * so a monitor polling at a fixed interval gets the rate over it.
+ * @notes Thread safe.
+ * @arg out Output, the statistics
+ */
+void stats_read(bloom_stats *out);
+
+/**
+ * The shortest interval in seconds the rates are measured over
+ */
+#define STATS_RATE_INTERVAL 1.0
+
+#endif
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "config.h"
+
+/**
+ * Each record is a header, followed by the key
+ */
+typedef struct {
+    uint32_t len;           // Length of the key
+    uint32_t check;         // Checksum of the key, to find torn records
+} __attribute__ ((packed)) wal_record;
+
+/**
+ * The initial size of the buffer. It grows as needed
+ * until the next sync.
+ */
+#define WAL_BUFFER_SIZE (64 * 1024)
+
+static int replay_file(char *path, wal_replay_cb cb, void *data);
+static uint32_t record_check(const char *key, uint32_t len);
+static int write_buffer(bloom_wal *wal);
+static int write_all(int fd, unsigned char *buf, uint32_t len);
+
+/**
+ * Replays the logs in a folder, the old log first. A record
+ * torn by a crash ends a log, and is truncated away.
+ * @arg dir The folder of the filter
+ * @arg cb The callback, invoked for each key
+ * @arg data Opaque handle passed to the callback
+ * @return The number of keys replayed, or negative errno.
+ */
+int wal_replay(char *dir, wal_replay_cb cb, void *data) {
+    char *path = join_path(dir, WAL_OLD_FILENAME);
+    int res = replay_file(path, cb, data);
+    free(path);
+    if (res < 0) return res;
+    int num = res;
+
+    path = join_path(dir, WAL_FILENAME);
+    res = replay_file(path, cb, data);
+    free(path);
+    return (res < 0) ? res : num + res;
+}
+
+/**
+ * Replays a single log
+ */
+static int replay_file(char *path, wal_replay_cb cb, void *data) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1) return (errno == ENOENT) ? 0 : -errno;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+    uint64_t len = st.st_size;
+    if (!len) {
+        close(fd);
+        return 0;
+    }
+
+    // Map the whole log, it is read once in order
+    unsigned char *buf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+    madvise(buf, len, MADV_SEQUENTIAL);
+
+    int num = 0;
+    uint64_t pos = 0;
+    wal_record rec;
+    while (pos + sizeof(wal_record) <= len) {
+        memcpy(&rec, buf + pos, sizeof(wal_record));
+        if (rec.len > len - pos - sizeof(wal_record)) break;
+        const char *key = (const char*)buf + pos + sizeof(wal_record);
+        if (rec.check != record_check(key, rec.len)) break;
+        cb(data, key, rec.len);
+        num++;
+        pos += sizeof(wal_record) + rec.len;
+    }
+    munmap(buf, len);
+
+    // Drop a torn record, so appends are not lost behind it
+    int res = 0;
+    if (pos < len) {
+        syslog(LOG_WARNING, "Truncating a torn record at %llu of the log '%s'.",
+                (unsigned long long)pos, path);
+        if (ftruncate(fd, pos)) res = -errno;
+    }
+    close(fd);
+    return (res) ? res : num;
+}
+
+/**
+ * Opens the log in a folder for appending, creating it if needed.
+ * @arg dir The folder of the filter
+ * @arg wal Output, the opened log
+ * @return 0 on success, negative errno on failure.
+ */
+int wal_open(char *dir, bloom_wal **wal) {
+    char *path = join_path(dir, WAL_FILENAME);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        int res = -errno;
+        syslog(LOG_ERR, "Failed to open the log '%s'. %s", path, strerror(errno));
+        free(path);
+        return res;
+    }
+
+    bloom_wal *w = calloc(1, sizeof(bloom_wal));
+    w->path = path;
+    w->old_path = join_path(dir, WAL_OLD_FILENAME);
+    w->fd = fd;
+    w->buf_cap = w->spare_cap = WAL_BUFFER_SIZE;
+    w->buf = malloc(w->buf_cap);
+    w->spare = malloc(w->spare_cap);
+
+    // An old log left by a crash waits on the next flush
+    struct stat st;
+    w->has_old = (stat(w->old_path, &st) == 0);
+
+    INIT_BLOOM_SPIN(&w->lock);
+    pthread_mutex_init(&w->io_lock, NULL);
+    *wal = w;
+    return 0;
+}
+
+/**
+ * Buffers the record of a key. Thread safe.
+ * @arg wal The log
+ * @arg key The key
+ * @arg len The length of the key
+ */
+void wal_append(bloom_wal *wal, const char *key, uint32_t len) {
+    wal_record rec = {len, record_check(key, len)};
+    uint32_t rec_len = sizeof(wal_record) + len;
+
+    LOCK_BLOOM_SPIN(&wal->lock);
+    if (wal->buf_len + rec_len > wal->buf_cap) {
+        while (wal->buf_len + rec_len > wal->buf_cap) wal->buf_cap *= 2;
+        wal->buf = realloc(wal->buf, wal->buf_cap);
+    }
+    memcpy(wal->buf + wal->buf_len, &rec, sizeof(wal_record));
+    memcpy(wal->buf + wal->buf_len + sizeof(wal_record), key, len);
+    wal->buf_len += rec_len;
+    UNLOCK_BLOOM_SPIN(&wal->lock);
+}
+
+/**
+ * Writes out the buffered records, and syncs them. Thread safe.
+ * @arg wal The log
+ * @return 0 on success, negative errno on failure.
+ */
+int wal_sync(bloom_wal *wal) {
+    pthread_mutex_lock(&wal->io_lock);
+    int res = write_buffer(wal);
+    if (!res && wal->unsynced) {
+        if (fdatasync(wal->fd)) {
+            res = -errno;
+            syslog(LOG_ERR, "Failed to sync the log '%s'. %s", wal->path, strerror(errno));
+        } else {
+            wal->unsynced = 0;
+        }
+    }
+    pthread_mutex_unlock(&wal->io_lock);
+    return res;
+}
+
+/**
+ * Called before a flush claims the dirty data. Moves the log
+ * aside, unless an earlier log is still waiting on a flush.
+ * @arg wal The log
+ */
+void wal_checkpoint_begin(bloom_wal *wal) {
+    pthread_mutex_lock(&wal->io_lock);
+    if (wal->checkpoints++ == 0) wal->failed = 0;
+    if (wal->has_old) {
+        pthread_mutex_unlock(&wal->io_lock);
+        return;
+    }
+
+    // The old log must be durable, in case the flush fails
+    int res = write_buffer(wal);
+    if (!res && wal->unsynced && fdatasync(wal->fd)) res = -errno;
+    if (!res && rename(wal->path, wal->old_path)) res = -errno;
+    int fd = -1;
+    if (!res) {
+        wal->has_old = 1;
+        wal->unsynced = 0;
+        fd = open(wal->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd == -1) res = -errno;
+    }
+
+    // Keep appending to the old log if a new one cannot be made
+    if (fd != -1) {
+        close(wal->fd);
+        wal->fd = fd;
+    } else if (res) {
+        syslog(LOG_ERR, "Failed to move the log '%s' aside. %s", wal->path, strerror(-res));
+        if (wal->has_old) wal->failed = 1;
+    }
+    pthread_mutex_unlock(&wal->io_lock);
+}
+
+/**
+ * Called once a flush is done. Deletes the old log once
+ * all the flushes in progress have succeeded.
+ * @arg wal The log
+ * @arg res The result of the flush
+ */
+void wal_checkpoint_end(bloom_wal *wal, int res) {
+    pthread_mutex_lock(&wal->io_lock);
+    if (res) wal->failed = 1;
+    if (--wal->checkpoints == 0 && !wal->failed && wal->has_old) {
+        if (unlink(wal->old_path) && errno != ENOENT) {
+            syslog(LOG_ERR, "Failed to delete: %s. %s", wal->old_path, strerror(errno));
+        } else {
+            wal->has_old = 0;
+        }
+    }
+    pthread_mutex_unlock(&wal->io_lock);
+}
+
+/**
+ * Drops all the records, once the keys are cleared and
+ * the cleared filter is flushed.
+ * @arg wal The log
+ * @return 0 on success, negative errno on failure.
+ */
+int wal_reset(bloom_wal *wal) {
+    int res = 0;
+    pthread_mutex_lock(&wal->io_lock);
+    LOCK_BLOOM_SPIN(&wal->lock);
+    wal->buf_len = 0;
+    UNLOCK_BLOOM_SPIN(&wal->lock);
+
+    if (wal->has_old && unlink(wal->old_path) && errno != ENOENT) res = -errno;
+    if (!res) wal->has_old = 0;
+    if (!res && (ftruncate(wal->fd, 0) || fdatasync(wal->fd))) res = -errno;
+    if (!res) wal->unsynced = 0;
+    pthread_mutex_unlock(&wal->io_lock);
+    return res;
+}
+
+/**
+ * Syncs and closes the log.
+ * @arg wal The log
+ * @arg discard If 1, the logs are deleted, unless a flush
+ * failed since the old log was made.
+ * @return 0 on success, negative errno on failure.
+ */
+int wal_close(bloom_wal *wal, int discard) {
+    int res = 0;
+    if (discard && !wal->failed && !wal->checkpoints) {
+        if (unlink(wal->path) && errno != ENOENT) res = -errno;
+        if (wal->has_old && unlink(wal->old_path) && errno != ENOENT) res = -errno;
+    } else {
+        res = wal_sync(wal);
+    }
+    close(wal->fd);
+
+    pthread_mutex_destroy(&wal->io_lock);
+    free(wal->spare);
+    free(wal->buf);
+    free(wal->old_path);
+    free(wal->path);
+    free(wal);
+    return res;
+}
+
+/**
+ * Returns the checksum of a record, FNV-1a over the key
+ * seeded with its length.
+ */
+static uint32_t record_check(const char *key, uint32_t len) {
+    uint32_t h = 2166136261u ^ len;
+    for (uint32_t i=0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Writes out the buffered records. The buffer is swapped
+ * out, so appends are not held up by the write. Must hold
+ * the io_lock.
+ */
+static int write_buffer(bloom_wal *wal) {
+    LOCK_BLOOM_SPIN(&wal->lock);
+    unsigned char *buf = wal->buf;
+    uint32_t len = wal->buf_len, cap = wal->buf_cap;
+    wal->buf = wal->spare;
+    wal->buf_cap = wal->spare_cap;
+    wal->buf_len = 0;
+    UNLOCK_BLOOM_SPIN(&wal->lock);
+
+    wal->spare = buf;
+    wal->spare_cap = cap;
+    if (!len) return 0;
+
+    int res = write_all(wal->fd, buf, len);
+    if (res) {
+        syslog(LOG_ERR, "Failed to write the log '%s'. %s", wal->path, strerror(-res));
+    } else {
+        wal->unsynced = 1;
+    }
+    return res;
+}
+
+/**
+ * Writes a whole buffer, retrying short writes
+ */
+static int write_all(int fd, unsigned char *buf, uint32_t len) {
+    ssize_t res;
+    uint32_t total = 0;
+    while (total < len) {
+        res = write(fd, buf + total, len - total);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        total += res;
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+#ifndef BLOOM_WAL_H
+#define BLOOM_WAL_H
+#include <stdint.h>
+#include <pthread.h>
+#include "spinlock.h"
+
+/**
+ * The write-ahead log of a filter records the keys set since its
+ * last flush, so that they survive a crash without the bitmaps
+ * being flushed often. Records are buffered in memory, and are
+ * written and synced together by wal_sync, which commits a group
+ * of sets with a single sync. Faulting in a filter replays its log.
+ *
+ * A flush starts by moving the log aside, and new records go to a
+ * fresh log. Once the flush is durable, the old log is deleted.
+ * Replaying a key that is already set is harmless, so the records
+ * that outlive their flush only cost replay time. For the same
+ * reason, only filters whose sets are idempotent are logged.
+ */
+
+/**
+ * The names of the logs in the folder of a filter
+ */
+#define WAL_FILENAME "wal.log"
+#define WAL_OLD_FILENAME "wal.old"
+
+/**
+ * An open log, which records are appended to
+ */
+typedef struct {
+    bloom_spinlock lock;        // Protects the buffer
+    pthread_mutex_t io_lock;    // Serializes the writes, syncs and renames
+    char *path;                 // Path of the log
+    char *old_path;             // Path of the log being checkpointed
+    int fd;
+    unsigned char *buf;         // Records not yet written
+    uint32_t buf_len;
+    uint32_t buf_cap;
+    unsigned char *spare;       // Swapped with the buffer to write it
+    uint32_t spare_cap;
+    int unsynced;               // Records written but not synced
+    int has_old;                // The old log exists
+    int checkpoints;            // Flushes in progress
+    int failed;                 // A flush failed since the old log was made
+} bloom_wal;
+
+/**
+ * Invoked for each key in the logs
+ * @arg data Opaque handle
+ * @arg key The key, not NUL terminated
+ * @arg len The length of the key
+ */
+typedef void(*wal_replay_cb)(void *data, const char *key, uint32_t len);
+
+/**
+ * Replays the logs in a folder, the old log first. A record
+ * torn by a crash ends a log, and is truncated away.
+ * @arg dir The folder of the filter
+ * @arg cb The callback, invoked for each key
+ * @arg data Opaque handle passed to the callback
+ * @return The number of keys replayed, or negative errno.
+ */
+int wal_replay(char *dir, wal_replay_cb cb, void *data);
+
+/**
+ * Opens the log in a folder for appending, creating it if needed.
+ * @arg dir The folder of the filter
+ * @arg wal Output, the opened log
+ * @return 0 on success, negative errno on failure.
+ */
+int wal_open(char *dir, bloom_wal **wal);
+
+/**
+ * Buffers the record of a key. The record is durable
+ * once the next wal_sync returns. Thread safe.
+ * @arg wal The log
+ * @arg key The key
+ * @arg len The length of the key
+ */
+void wal_append(bloom_wal *wal, const char *key, uint32_t len);
+
+/**
+ * Writes out the buffered records, and syncs them. Thread safe.
+ * @arg wal The log
+ * @return 0 on success, negative errno on failure.
+ */
+int wal_sync(bloom_wal *wal);
+
+/**
+ * Called before a flush claims the dirty data. Moves the log
+ * aside, unless an earlier log is still waiting on a flush.
+ * @arg wal The log
+ */
+void wal_checkpoint_begin(bloom_wal *wal);
+
+/**
+ * Called once a flush is done. Deletes the old log once
+ * all the flushes in progress have succeeded.
+ * @arg wal The log
+ * @arg res The result of the flush
+ */
+void wal_checkpoint_end(bloom_wal *wal, int res);
+
+/**
+ * Drops all the records, once the keys are cleared and
+ * the cleared filter is flushed.
+ * @arg wal The log
+ * @return 0 on success, negative errno on failure.
+ */
+int wal_reset(bloom_wal *wal);
+
+/**
+ * Syncs and closes the log.
+ * @arg wal The log
+ * @arg discard If 1, the logs are deleted, unless a flush
+ * failed since the old log was made.
+ * @return 0 on success, negative errno on failure.
+ */
+int wal_close(bloom_wal *wal, int discard);
+
+#endif
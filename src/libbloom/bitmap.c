@@ -4,20 +4,78 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "bitmap.h"
 
+/**
+ * Shared state of the threads filling a buffer
+ */
+typedef struct {
+    int fileno;
+    int direct;         // The fileno was opened with O_DIRECT
+    unsigned char *buf;
+    uint64_t file_offset;   // Offset of the buffer in the file
+    uint64_t len;
+    uint64_t next;      // Offset of the next chunk to claim
+    int err;            // Set on any failure
+} fill_state;
+
+/**
+ * A memfd backing a PERSISTENT bitmap, keyed by the file range
+ * the bitmap maps. Inherited memfds are not yet mapped.
+ */
+typedef struct memfd_entry {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t offset;
+    uint64_t len;
+    int fd;
+    int inherited;
+    struct memfd_entry *next;
+} memfd_entry;
+
+static pthread_mutex_t MEMFD_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int USE_MEMFD = 0;
+static memfd_entry *MEMFDS = NULL;
+
 /* Static declarations */
 static void* alloc_dirty_page_bitmap(uint64_t len);
-static int fill_buffer(int fileno, unsigned char* buf, uint64_t len);
+static unsigned char* map_huge_pages(uint64_t len, uint64_t *mapped_len);
+static unsigned char* map_memfd(int fileno, uint64_t offset, uint64_t len, int new_bitmap, int *memfd, int *adopted);
+static void release_memfd(int memfd);
+static int drop_pages(bloom_bitmap *map, uint64_t offset, uint64_t len);
+static int open_direct(int fileno);
+static unsigned char* map_dax(int fileno, uint64_t offset, uint64_t len);
+static int flush_dax_pages(bloom_bitmap *map);
+static void writeback_lines(unsigned char *addr, uint64_t len);
+static int fill_buffer(int fileno, int direct, unsigned char* buf, uint64_t file_offset, uint64_t len);
+static int fill_range(int fileno, int direct, unsigned char* buf, uint64_t offset, uint64_t len);
+static void* fill_thread_main(void *in);
 static int flush_dirty_pages(bloom_bitmap *map);
-static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page);
+static int flush_run(void *data, bloom_bitmap *map, uint64_t offset, uint64_t len);
+static int write_run(bloom_bitmap *map, unsigned char *buf, uint64_t offset, uint64_t len);
+static int stage_run(void *data, bloom_bitmap *map, uint64_t offset, uint64_t len);
+static int flush_staged(bloom_bitmap *map);
+static void unstage(bloom_bitmap *map);
+static int claimed_run(bloom_bitmap *map, bitmap_run_cb cb, void *data, uint64_t page, uint64_t num);
 extern inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx);
+extern inline void bitmap_mark_dirty(bloom_bitmap *map, uint64_t idx);
 extern inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx);
+extern inline void bitmap_mark_dirty_atomic(bloom_bitmap *map, uint64_t idx);
+extern inline int bitmap_setbit_atomic(bloom_bitmap *map, uint64_t idx);
+extern inline uint64_t bitmap_getword(bloom_bitmap *map, uint64_t widx);
+extern inline int bitmap_getbit_word(bloom_bitmap *map, uint64_t idx);
+extern inline void bitmap_setbit_word(bloom_bitmap *map, uint64_t idx);
+extern inline int bitmap_test_and_set_word(bloom_bitmap *map, uint64_t idx);
 
 /**
  * Returns a bloom_bitmap pointer from a file handle
@@ -29,52 +87,119 @@ extern inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx);
  * @return 0 on success. Negative on error.
  */
 int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *map) {
+    return bitmap_from_file_range(fileno, 0, len, mode, map);
+}
+
+/**
+ * Returns a bloom_bitmap pointer over a range of a file
+ * handle, so several bitmaps can share a single file. With
+ * BORROW_FILE, the handle is used without a dup, and must
+ * stay open until the bitmap is closed.
+ * @arg fileno The fileno
+ * @arg offset The offset of the bitmap in the file. Must be
+ * a multiple of the page size.
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode The mode to use for the bitmap.
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+int bitmap_from_file_range(int fileno, uint64_t offset, uint64_t len, bitmap_mode mode, bloom_bitmap *map) {
     // Hack for old kernels and bad length checking
-    if (len == 0) {
+    if (len == 0 || offset % 4096) {
         return -EINVAL;
     }
 
-    // Check for and clear NEW_BITMAP from the mode
+    // Check for and clear NEW_BITMAP, HUGE_PAGES, LAZY, BORROW_FILE, READ_ONLY, DIRECT_IO and DAX from the mode
     int new_bitmap = (mode & NEW_BITMAP) ? 1 : 0;
-    mode &= ~NEW_BITMAP;
+    int huge_pages = (mode & HUGE_PAGES) ? 1 : 0;
+    int lazy = (mode & LAZY) ? 1 : 0;
+    int borrowed = (mode & BORROW_FILE) ? 1 : 0;
+    int read_only = (mode & READ_ONLY) ? 1 : 0;
+    int direct = (mode & DIRECT_IO) ? 1 : 0;
+    int dax = (mode & DAX) ? 1 : 0;
+    mode &= ~(NEW_BITMAP | HUGE_PAGES | LAZY | BORROW_FILE | READ_ONLY | DIRECT_IO | DAX);
+
+    // Only the page cache can be mapped read only, an existing
+    // file is never read into memory we cannot write
+    if (read_only && (mode != SHARED || new_bitmap)) {
+        return -EINVAL;
+    }
 
     // Handle each mode
     int flags;
     int newfileno;
     if (mode == SHARED) {
         flags = MAP_SHARED;
-        newfileno = dup(fileno);
+        newfileno = (borrowed) ? fileno : dup(fileno);
         if (newfileno < 0) return -errno;
 
     } else if (mode == PERSISTENT) {
         flags = MAP_ANON | MAP_PRIVATE;
-        newfileno = dup(fileno);
+        newfileno = (borrowed) ? fileno : dup(fileno);
         if (newfileno < 0) return -errno;
 
+        // A lazy map is a private map of the file itself. Pages are
+        // read in by the kernel on first touch, and copied on write,
+        // so the file only changes when we flush. Huge pages need
+        // anonymous memory, and a short file would fault past the end,
+        // so both fall back to reading the whole file in.
+        struct stat buf;
+        if (lazy && (huge_pages || new_bitmap || fstat(newfileno, &buf) ||
+                    (uint64_t)buf.st_size < offset + len)) {
+            lazy = 0;
+        }
+        if (lazy) flags = MAP_PRIVATE;
+
     } else if (mode == ANONYMOUS) {
         flags = MAP_ANON | MAP_PRIVATE;
         newfileno = -1;
+        borrowed = 0;
 
     } else {
         return -1;
     }
 
-    // Perform the map in
-    unsigned char* addr = mmap(NULL, len, PROT_READ|PROT_WRITE,
-            flags, ((mode == PERSISTENT) ? -1 : newfileno), 0);
+    // Perform the map in. Only anonymous memory can use
+    // huge pages, the SHARED mode is backed by the page cache.
+    // A PERSISTENT bitmap may be backed by a memfd instead of
+    // anonymous memory, possibly one inherited with its contents.
+    unsigned char* addr = MAP_FAILED;
+    uint64_t mapped_len = len;
+    int memfd = -1, adopted = 0;
+    if (huge_pages && mode != SHARED) {
+        addr = map_huge_pages(len, &mapped_len);
+    } else if (dax && mode == SHARED && !read_only) {
+        addr = map_dax(newfileno, offset, len);
+        if (addr == MAP_FAILED) {
+            dax = 0;
+            addr = mmap(NULL, len, PROT_READ|PROT_WRITE, flags, newfileno, offset);
+        }
+    } else {
+        int anon = (mode == PERSISTENT && !lazy);
+        if (anon && __atomic_load_n(&USE_MEMFD, __ATOMIC_RELAXED)) {
+            addr = map_memfd(newfileno, offset, len, new_bitmap, &memfd, &adopted);
+        }
+        if (memfd < 0) {
+            addr = mmap(NULL, len, (read_only ? PROT_READ : PROT_READ|PROT_WRITE),
+                flags, (anon ? -1 : newfileno), (anon ? 0 : offset));
+        }
+    }
 
     // Check for an error, otherwise return
     if (addr == MAP_FAILED) {
         perror("mmap failed!");
-        if (newfileno >= 0) {
+        int res = -errno;
+        if (newfileno >= 0 && !borrowed) {
             close(newfileno);
         }
-        return -errno;
+        return res;
     }
 
     // Provide some advise on how the memory will be used
     int res;
-    if (mode == SHARED) {
+    if (mode == SHARED || lazy) {
+        // For a lazy map this starts reading the rest of the
+        // file into the page cache in the background.
         res = madvise(addr, len, MADV_WILLNEED);
         if (res != 0) {
             perror("Failed to call madvise() [MADV_WILLNEED]");
@@ -86,23 +211,50 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
     }
 
     // For the PERSISTENT case, we manually track
-    // dirty pages, and need a bit field for this
-    unsigned char* dirty = NULL;
+    // dirty pages, and need a bit field for this.
+    // DAX maps track them to flush the CPU caches.
+    uint64_t* dirty = NULL;
+    int direct_fd = -1;
+    if (mode != SHARED || read_only) dax = 0;
+    if (dax && !(dirty = alloc_dirty_page_bitmap(len))) {
+        res = -errno;
+        munmap(addr, mapped_len);
+        if (!borrowed) close(newfileno);
+        return res;
+    }
     if (mode == PERSISTENT) {
         // Allocate a dirty bitmap
         dirty = alloc_dirty_page_bitmap(len);
         if (!dirty) {
-            munmap(addr, len);
-            if (newfileno >= 0) close(newfileno);
-            return -errno;
+            res = -errno;
+            munmap(addr, mapped_len);
+            if (memfd >= 0) release_memfd(memfd);
+            if (!borrowed) close(newfileno);
+            return res;
         }
 
+        // The memory already holds the bitmap, a copy in the page
+        // cache would double it. A lazy map is the page cache.
+        // File systems without O_DIRECT use the page cache.
+        if (direct && !lazy) direct_fd = open_direct(newfileno);
+
         // For existing bitmaps we need to read in the data
-        // since we cannot use the kernel to fault it in
-        if (!new_bitmap && (res = fill_buffer(newfileno, addr, len))) {
+        // since we cannot use the kernel to fault it in.
+        // An inherited memfd already holds it.
+        if (!new_bitmap && !lazy && !adopted) {
+            res = -EINVAL;
+            if (direct_fd >= 0 && (res = fill_buffer(direct_fd, 1, addr, offset, len))) {
+                close(direct_fd);
+                direct_fd = -1;
+            }
+            if (res) res = fill_buffer(newfileno, 0, addr, offset, len);
+        }
+        if (!new_bitmap && !lazy && !adopted && res) {
             free(dirty);
-            munmap(addr, len);
-            if (newfileno >= 0) close(newfileno);
+            munmap(addr, mapped_len);
+            if (memfd >= 0) release_memfd(memfd);
+            if (direct_fd >= 0) close(direct_fd);
+            if (!borrowed) close(newfileno);
             return res;
         }
     }
@@ -110,17 +262,223 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
     // Allocate space for the map
     map->mode = mode;
     map->fileno = newfileno;
+    map->borrowed = borrowed;
+    map->offset = offset;
     map->size = len;
     map->mmap = addr;
+    map->mapped_len = mapped_len;
     map->dirty_pages = dirty;
+    map->max_flush_pages = BITMAP_DEFAULT_FLUSH_PAGES;
+    map->page_epochs = NULL;
+    map->epoch = NULL;
+    map->memfd = memfd;
+    map->read_only = read_only;
+    map->filled = (mode == PERSISTENT && !new_bitmap && !lazy && !adopted) ? len : 0;
+    map->io = NULL;
+    map->direct_fd = direct_fd;
+    map->dax = dax;
+    map->staged = NULL;
     return 0;
 }
 
+/**
+ * Maps a file on persistent memory with MAP_SYNC, so the
+ * stores to the mapping are durable once they leave the CPU
+ * caches, without a sync of the file.
+ * @return The address, or MAP_FAILED if the file system
+ * does not support DAX.
+ */
+static unsigned char* map_dax(int fileno, uint64_t offset, uint64_t len) {
+#ifdef MAP_SYNC
+    unsigned char *addr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+            MAP_SHARED_VALIDATE | MAP_SYNC, fileno, offset);
+    if (addr != MAP_FAILED) return addr;
+    syslog(LOG_WARNING, "Failed to map a bitmap with MAP_SYNC, using the page cache. %s",
+            strerror(errno));
+#else
+    (void)fileno;
+    (void)offset;
+    (void)len;
+    syslog(LOG_WARNING, "MAP_SYNC is not supported, using the page cache.");
+#endif
+    return MAP_FAILED;
+}
+
+/**
+ * Opens a file again with O_DIRECT. The new open file
+ * description leaves the flags of the fileno as they are.
+ * @return The new file descriptor, or -1 if the file
+ * system does not support O_DIRECT.
+ */
+static int open_direct(int fileno) {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno);
+    int fd = open(path, O_RDWR | O_DIRECT);
+    if (fd < 0) {
+        syslog(LOG_WARNING, "Failed to open a bitmap with O_DIRECT, using the page cache. %s",
+                strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * Maps anonymous memory backed by huge pages. Reserved huge
+ * pages are tried first with MAP_HUGETLB, which needs the length
+ * rounded up to the huge page size. If none are available, we
+ * fall back to a normal mapping and ask for transparent huge
+ * pages. Dirty tracking is unaffected, and stays at 4K.
+ */
+static unsigned char* map_huge_pages(uint64_t len, uint64_t *mapped_len) {
+    unsigned char* addr;
+#ifdef MAP_HUGETLB
+    uint64_t rounded = (len + BITMAP_HUGE_PAGE_SIZE - 1) & ~((uint64_t)BITMAP_HUGE_PAGE_SIZE - 1);
+    addr = mmap(NULL, rounded, PROT_READ|PROT_WRITE,
+            MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+        *mapped_len = rounded;
+        return addr;
+    }
+    syslog(LOG_INFO, "No reserved huge pages, falling back to transparent huge pages.");
+#endif
+
+    *mapped_len = len;
+    addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+#ifdef MADV_HUGEPAGE
+    if (addr != MAP_FAILED && madvise(addr, len, MADV_HUGEPAGE) != 0) {
+        perror("Failed to call madvise() [MADV_HUGEPAGE]");
+    }
+#endif
+    return addr;
+}
+
+/**
+ * Maps a memfd for a PERSISTENT bitmap. An inherited memfd of the
+ * same file range is adopted, otherwise a new one is created. The
+ * memfd is registered, so it can be exported.
+ * @arg fileno The file of the bitmap
+ * @arg offset The offset of the bitmap in the file
+ * @arg len The length of the bitmap
+ * @arg new_bitmap Set if the file range is new, never adopts
+ * @arg memfd Output, the memfd, or -1 if none could be mapped
+ * @arg adopted Output, set to 1 if the memfd was inherited
+ * @return The address of the mapping, or MAP_FAILED.
+ */
+static unsigned char* map_memfd(int fileno, uint64_t offset, uint64_t len, int new_bitmap, int *memfd, int *adopted) {
+    struct stat buf;
+    if (fstat(fileno, &buf)) return MAP_FAILED;
+
+    // Look for an inherited memfd of the range
+    pthread_mutex_lock(&MEMFD_LOCK);
+    memfd_entry *entry = MEMFDS;
+    while (entry && (new_bitmap || !entry->inherited || entry->dev != (uint64_t)buf.st_dev ||
+                entry->ino != (uint64_t)buf.st_ino || entry->offset != offset || entry->len != len)) {
+        entry = entry->next;
+    }
+
+    // Otherwise create a new one
+    if (entry) {
+        entry->inherited = 0;
+        *adopted = 1;
+    } else {
+        int fd = -1;
+#ifdef MFD_CLOEXEC
+        fd = memfd_create("bloom_bitmap", MFD_CLOEXEC);
+#endif
+        if (fd < 0 || ftruncate(fd, len) || !(entry = calloc(1, sizeof(memfd_entry)))) {
+            pthread_mutex_unlock(&MEMFD_LOCK);
+            if (fd >= 0) close(fd);
+            return MAP_FAILED;
+        }
+        entry->dev = buf.st_dev;
+        entry->ino = buf.st_ino;
+        entry->offset = offset;
+        entry->len = len;
+        entry->fd = fd;
+        entry->next = MEMFDS;
+        MEMFDS = entry;
+    }
+    int fd = entry->fd;
+    pthread_mutex_unlock(&MEMFD_LOCK);
+
+    unsigned char *addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        release_memfd(fd);
+        *adopted = 0;
+        return MAP_FAILED;
+    }
+    *memfd = fd;
+    return addr;
+}
+
+/**
+ * Unregisters and closes the memfd of a bitmap
+ */
+static void release_memfd(int memfd) {
+    pthread_mutex_lock(&MEMFD_LOCK);
+    memfd_entry **prev = &MEMFDS;
+    while (*prev && (*prev)->fd != memfd) prev = &(*prev)->next;
+    memfd_entry *entry = *prev;
+    if (entry) *prev = entry->next;
+    pthread_mutex_unlock(&MEMFD_LOCK);
+    free(entry);
+    close(memfd);
+}
+
+void bitmap_use_memfd(int enable) {
+    __atomic_store_n(&USE_MEMFD, enable, __ATOMIC_RELAXED);
+}
+
+int bitmap_export_memfds(bitmap_memfd_cb cb, void *data) {
+    int res = 0;
+    pthread_mutex_lock(&MEMFD_LOCK);
+    for (memfd_entry *entry = MEMFDS; entry && !res; entry = entry->next) {
+        if (entry->inherited) continue;
+        res = cb(data, entry->fd, entry->dev, entry->ino, entry->offset, entry->len);
+    }
+    pthread_mutex_unlock(&MEMFD_LOCK);
+    return res;
+}
+
+int bitmap_inherit_memfd(int memfd, uint64_t dev, uint64_t ino, uint64_t offset, uint64_t len) {
+    memfd_entry *entry = calloc(1, sizeof(memfd_entry));
+    if (!entry) return -ENOMEM;
+    entry->dev = dev;
+    entry->ino = ino;
+    entry->offset = offset;
+    entry->len = len;
+    entry->fd = memfd;
+    entry->inherited = 1;
+    pthread_mutex_lock(&MEMFD_LOCK);
+    entry->next = MEMFDS;
+    MEMFDS = entry;
+    pthread_mutex_unlock(&MEMFD_LOCK);
+    return 0;
+}
+
+int bitmap_release_inherited(void) {
+    int released = 0;
+    pthread_mutex_lock(&MEMFD_LOCK);
+    memfd_entry **prev = &MEMFDS;
+    while (*prev) {
+        memfd_entry *entry = *prev;
+        if (!entry->inherited) {
+            prev = &entry->next;
+            continue;
+        }
+        *prev = entry->next;
+        close(entry->fd);
+        free(entry);
+        released++;
+    }
+    pthread_mutex_unlock(&MEMFD_LOCK);
+    return released;
+}
+
 // Allocates a new dirty page bitmap
 static void* alloc_dirty_page_bitmap(uint64_t len) {
     // Calculate how big a bit field we need
     uint64_t pages = ceil(len / 4096.0);        // 1 bit per page
-    uint64_t field_size = ceil(pages / 8.0);    // 8 bits per byte
+    uint64_t field_size = ceil(pages / 64.0) * sizeof(uint64_t); // 64 bits per word
 
     // Allocate the field
     void* dirty = malloc(field_size);
@@ -136,21 +494,81 @@ static void* alloc_dirty_page_bitmap(uint64_t len) {
 
 
 /*
- * Populates a buffer with the contents of a file
+ * Populates a buffer with the contents of a file.
+ * Large files are read with parallel preads, split
+ * into chunks across several threads. With O_DIRECT,
+ * the reads skip the page cache, and the buffer must
+ * be page aligned.
+ */
+static int fill_buffer(int fileno, int direct, unsigned char* buf, uint64_t file_offset, uint64_t len) {
+    // Start the kernel reading ahead of us. Direct reads are
+    // large enough on their own, and read ahead would fill
+    // the page cache we are avoiding.
+    if (!direct) posix_fadvise(fileno, file_offset, len, POSIX_FADV_WILLNEED);
+
+    uint64_t chunks = (len + BITMAP_FILL_CHUNK - 1) / BITMAP_FILL_CHUNK;
+    if (chunks <= 1) return fill_range(fileno, direct, buf, file_offset, len);
+
+    // The calling thread reads chunks as well
+    fill_state state = {fileno, direct, buf, file_offset, len, 0, 0};
+    int helpers = ((chunks < BITMAP_FILL_THREADS) ? chunks : BITMAP_FILL_THREADS) - 1;
+    pthread_t threads[BITMAP_FILL_THREADS];
+    int started = 0;
+    for (; started < helpers; started++) {
+        if (pthread_create(threads + started, NULL, fill_thread_main, &state)) break;
+    }
+    fill_thread_main(&state);
+    for (int i=0; i < started; i++) pthread_join(threads[i], NULL);
+    return state.err;
+}
+
+/*
+ * Reads chunks until there are none left
+ */
+static void* fill_thread_main(void *in) {
+    fill_state *state = in;
+    while (!__atomic_load_n(&state->err, __ATOMIC_RELAXED)) {
+        uint64_t offset = __atomic_fetch_add(&state->next, BITMAP_FILL_CHUNK, __ATOMIC_RELAXED);
+        if (offset >= state->len) break;
+
+        uint64_t len = state->len - offset;
+        if (len > BITMAP_FILL_CHUNK) len = BITMAP_FILL_CHUNK;
+        int res = fill_range(state->fileno, state->direct, state->buf + offset,
+                state->file_offset + offset, len);
+        if (res) __atomic_store_n(&state->err, res, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * Reads a range of a file into the buffer. Stops
+ * early at the end of the file. A direct read of a
+ * partial page reads the rest of the page, so the
+ * bytes past the range are zeroed after.
  */
-static int fill_buffer(int fileno, unsigned char* buf, uint64_t len) {
+static int fill_range(int fileno, int direct, unsigned char* buf, uint64_t offset, uint64_t len) {
     uint64_t total_read = 0;
+    uint64_t want = len;
+    if (direct) want = (len + BITMAP_DIRECT_ALIGN - 1) & ~((uint64_t)BITMAP_DIRECT_ALIGN - 1);
     ssize_t more;
-    while (total_read < len) {
-        more = pread(fileno, buf+total_read, len-total_read, total_read);
+    while (total_read < want) {
+        more = pread(fileno, buf+total_read, want-total_read, offset+total_read);
         if (more == 0)
             break;
-        else if (more < 0 && errno != EINTR) {
+        else if (more > 0 && direct && more % BITMAP_DIRECT_ALIGN) {
+            // Only the end of the file is short
+            total_read += more;
+            break;
+        }
+        else if (more < 0 && errno == EINTR)
+            continue;
+        else if (more < 0) {
             perror("Failed to fill the bitmap buffer!");
             return -errno;
         } else
             total_read += more;
     }
+    if (total_read > len) memset(buf + len, 0, total_read - len);
     return 0;
 }
 
@@ -193,11 +611,24 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
             return -errno;
         }
 
-        // Only ever truncate a new file, never resize
-        // an existing file
+        // Only ever size a new file, never resize an existing file.
+        // The blocks are allocated up front, so the file is not
+        // fragmented by the writes and faults on it. File systems
+        // without fallocate get a sparse file instead.
         if ((uint64_t)buf.st_size == 0) {
             extra_flags |= NEW_BITMAP;
-            res = ftruncate(fileno, len);
+            res = -1;
+#ifdef FALLOC_FL_KEEP_SIZE
+            res = fallocate(fileno, 0, 0, len);
+            if (res != 0 && errno != EOPNOTSUPP) {
+                int err = errno;
+                syslog(LOG_ERR, "fallocate failed on the bitmap %s. %s", filename, strerror(err));
+                close(fileno);
+                unlink(filename);
+                return -err;
+            }
+#endif
+            if (res != 0) res = ftruncate(fileno, len);
             if (res != 0) {
                 perror("ftrunctate failed on the bitmap!");
                 close(fileno);
@@ -241,17 +672,21 @@ int bitmap_flush(bloom_bitmap *map) {
 
     // Do nothing for anonymous maps
     int res;
-    if (map->mode == ANONYMOUS || map->mmap == NULL)
+    if (map->mode == ANONYMOUS || map->mmap == NULL || map->read_only)
         return 0;
 
+    // A DAX map only needs the dirty lines written back
+    // from the CPU caches, there is no page cache to sync
+    if (map->dax) return flush_dax_pages(map);
+
     // For SHARED, we can use an msync and let the kernel deal
-    else if (map->mode == SHARED) {
+    if (map->mode == SHARED) {
         res = msync(map->mmap, map->size, MS_SYNC);
         if (res == -1) return -errno;
 
     } else if (map->mode == PERSISTENT) {
-        if ((res = flush_dirty_pages(map)))
-            return res;
+        res = bitmap_write(map);
+        if (res) return res;
     }
 
     // SHARED / PERSISTENT both have a file backing
@@ -261,79 +696,537 @@ int bitmap_flush(bloom_bitmap *map) {
 }
 
 
+/**
+ * Writes the dirty pages of the bitmap back to
+ * its file, without syncing the file.
+ * @arg map The bitmap
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_write(bloom_bitmap *map) {
+    if (map == NULL) return -EINVAL;
+    if (map->mode == ANONYMOUS || map->mmap == NULL || map->read_only)
+        return 0;
+    if (map->dax) return flush_dax_pages(map);
+    if (map->mode != PERSISTENT) return 0;
+    return (map->staged) ? flush_staged(map) : flush_dirty_pages(map);
+}
+
+
+/**
+ * Starts the writeback of the dirty pages of a SHARED
+ * bitmap, in runs of max_flush_pages, without waiting.
+ */
+int bitmap_writeback(bloom_bitmap *map) {
+    if (map == NULL || map->mode != SHARED || map->mmap == NULL || map->read_only || map->dax) return 0;
+
+    uint64_t run = (map->max_flush_pages) ? map->max_flush_pages : BITMAP_DEFAULT_FLUSH_PAGES;
+    run *= 4096;
+    for (uint64_t offset=0; offset < map->size; offset += run) {
+        uint64_t len = (map->size - offset < run) ? map->size - offset : run;
+#ifdef SYNC_FILE_RANGE_WRITE
+        // Queues the writes of the dirty pages of the range, the
+        // pages dirtied through the mapping are in the page cache
+        if (sync_file_range(map->fileno, map->offset + offset, len, SYNC_FILE_RANGE_WRITE))
+            return -errno;
+#else
+        if (msync(map->mmap + offset, len, MS_ASYNC)) return -errno;
+#endif
+    }
+    return 0;
+}
+
+
+/**
+ * Moves a PERSISTENT bitmap to the page cache, as a
+ * SHARED map of its file at the same address.
+ */
+int bitmap_share(bloom_bitmap *map) {
+    if (map->mode != PERSISTENT || map->mapped_len != map->size) return -EINVAL;
+
+    // The file must hold every change before it replaces the memory
+    unstage(map);
+    int res = bitmap_flush(map);
+    if (res) return res;
+
+    // Replacing the mapping in place keeps the address valid for
+    // readers, a fault during the swap waits for it to finish
+    unsigned char *addr = mmap(map->mmap, map->size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_FIXED, map->fileno, map->offset);
+    if (addr == MAP_FAILED) return -errno;
+    if (madvise(addr, map->size, MADV_RANDOM)) {
+        perror("Failed to call madvise() [MADV_RANDOM]");
+    }
+
+    // Shared pages are written back by the kernel, so
+    // they are no longer tracked
+    map->mode = SHARED;
+    if (map->direct_fd >= 0) {
+        close(map->direct_fd);
+        map->direct_fd = -1;
+    }
+    free(map->dirty_pages);
+    map->dirty_pages = NULL;
+    free(map->page_epochs);
+    map->page_epochs = NULL;
+    if (map->memfd >= 0) {
+        release_memfd(map->memfd);
+        map->memfd = -1;
+    }
+    return 0;
+}
+
+
 /**
  * Flushes all the dirty pages of the bitmap. We just
- * scan the dirty_pages bitfield and flush every 4K
- * block that is considered dirty. As a bit of a jank hack,
- * we always flush the first block, since it contains headers,
- * and is not reliably marked as dirty.
+ * scan the dirty_pages bitfield, and merge adjacent dirty
+ * pages into runs of up to max_flush_pages, which are each
+ * written with a single call. The header page is marked
+ * dirty by the bloom filter when it changes.
  */
 static int flush_dirty_pages(bloom_bitmap *map) {
+    return bitmap_flush_runs(map, flush_run, NULL);
+}
+
+
+/**
+ * Claims the dirty pages of a PERSISTENT bitmap, and invokes
+ * the callback for each run of adjacent dirty pages, of up to
+ * max_flush_pages. The pages are no longer dirty once claimed.
+ * If the callback fails, the unwritten pages are marked dirty
+ * again, and the error is returned.
+ * @arg map The bitmap
+ * @arg cb The callback for each run
+ * @arg data Opaque data passed to the callback
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_flush_runs(bloom_bitmap *map, bitmap_run_cb cb, void *data) {
+    if (map == NULL || map->mode != PERSISTENT) return -EINVAL;
+    unstage(map);
+
     /**
-     * The dirty page bitmap is a problematic
-     * shared data structure since reads and writes are
-     * byte aligned. This means when we set a single bit,
-     * we are doing a read/update/write on the whole byte.
-     * Because of this, concurrent updates are not safe.
-     * To solve this, we allocate a new fresh bitmap, and
-     * swap the old one out. This allows the other threads
-     * to mark bits as dirty, while we go through and flush.
-     * At the end, we free our old version.
+     * The dirty page bitmap is shared with the writers,
+     * which set bits with atomic word ORs. We claim the
+     * dirty pages one word at a time by atomically swapping
+     * in zero. A writer that marks a page after the swap
+     * leaves its bit set for the next flush, so no marks
+     * are lost and no allocation is needed.
      */
-    void *new_dirty = alloc_dirty_page_bitmap(map->size);
-    if (!new_dirty) {
-        syslog(LOG_ERR, "Failed to allocate new dirty page bitmap!");
-        return -1;
-    }
-    unsigned char* dirty_pages = map->dirty_pages;
-    map->dirty_pages = new_dirty;
-
     uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
-    unsigned char byte;
-    int dirty, res = 0;
-    for (uint64_t i=0; i < pages; i++) {
-        // Check if the page is dirty
-        byte = dirty_pages[i >> 3];
-        dirty = ((byte >> (7 - (i % 8))) & 0x1);
-
-        if (dirty || i == 0) {
-            // Flush the page
-            res = flush_page(map, i, map->size, pages - 1);
-            if (res) goto LEAVE;
+    uint64_t words = pages / 64 + ((pages % 64) ? 1 : 0);
+    uint64_t max_run = (map->max_flush_pages) ? map->max_flush_pages : 1;
+    uint64_t dirty, page, epoch = 0;
+    uint64_t run_start = 0, run_len = 0;
+    int res = 0;
+    for (uint64_t w=0; w < words; w++) {
+        // Skip clean words without a write
+        if (!__atomic_load_n(map->dirty_pages + w, __ATOMIC_RELAXED)) continue;
+
+        // Acquire pairs with the release in the writers, and
+        // seq_cst with the fence before their check of the mark
+        dirty = __atomic_exchange_n(map->dirty_pages + w, 0, __ATOMIC_SEQ_CST);
+
+        // The epoch is read after the claim, so a page changed
+        // after an epoch started is stamped with that epoch or later
+        if (map->page_epochs) epoch = __atomic_load_n(map->epoch, __ATOMIC_SEQ_CST);
+        while (dirty) {
+            page = w * 64 + __builtin_ctzll(dirty);
+            dirty &= dirty - 1;
+            if (map->page_epochs) {
+                __atomic_store_n(map->page_epochs + page, epoch, __ATOMIC_RELAXED);
+            }
+
+            // Extend the current run if we can
+            if (run_len && page == run_start + run_len && run_len < max_run) {
+                run_len++;
+                continue;
+            }
+
+            // Write out the previous run, start a new one
+            if (run_len && (res = claimed_run(map, cb, data, run_start, run_len))) {
+                bitmap_remark_dirty(map, page * 4096, 4096);
+                __atomic_fetch_or(map->dirty_pages + w, dirty, __ATOMIC_RELEASE);
+                return res;
+            }
+            run_start = page;
+            run_len = 1;
         }
     }
-LEAVE:
-    // Cleanup the old bitmap
-    free(dirty_pages);
+
+    // Write out the last run
+    if (run_len) {
+        res = claimed_run(map, cb, data, run_start, run_len);
+    }
+    return res;
+}
+
+
+/**
+ * Cuts a consistent image of a PERSISTENT bitmap for the next
+ * flush, by claiming the dirty pages and copying them aside.
+ * Nothing may write the bitmap during the call.
+ * @arg map The bitmap
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_stage(bloom_bitmap *map) {
+    if (map == NULL) return -EINVAL;
+    if (map->mode != PERSISTENT || map->mmap == NULL || map->read_only) return 0;
+
+    // The runs are appended in order, a failed copy
+    // leaves the pages it claimed dirty again
+    bitmap_staged_run **tail = &map->staged;
+    int res = bitmap_flush_runs(map, stage_run, &tail);
+    if (res) unstage(map);
+    return res;
+}
+
+
+/**
+ * Copies a claimed run aside. Used as the
+ * callback of bitmap_flush_runs.
+ */
+static int stage_run(void *data, bloom_bitmap *map, uint64_t offset, uint64_t len) {
+    bitmap_staged_run ***tail = data;
+    bitmap_staged_run *run = malloc(sizeof(bitmap_staged_run));
+    if (!run) return -ENOMEM;
+    if (posix_memalign((void**)&run->data, BITMAP_DIRECT_ALIGN, len)) {
+        free(run);
+        return -ENOMEM;
+    }
+    memcpy(run->data, map->mmap + offset, len);
+    run->offset = offset;
+    run->len = len;
+    run->next = NULL;
+    **tail = run;
+    *tail = &run->next;
+    return 0;
+}
+
+
+/**
+ * Writes out the runs cut by bitmap_stage. The pages of
+ * the runs that are not written are marked dirty again.
+ */
+static int flush_staged(bloom_bitmap *map) {
+    bitmap_staged_run *run = map->staged, *next;
+    map->staged = NULL;
+    int res = 0;
+    for (; run; run = next) {
+        next = run->next;
+        if (!res) res = write_run(map, run->data, run->offset, run->len);
+        if (res) bitmap_remark_dirty(map, run->offset, run->len);
+        free(run->data);
+        free(run);
+    }
     return res;
 }
 
 
 /**
- * Flushes out a single page that is dirty
+ * Drops a cut that was not flushed. Its pages are
+ * marked dirty again, to be written from the bitmap.
+ */
+static void unstage(bloom_bitmap *map) {
+    bitmap_staged_run *run = map->staged, *next;
+    map->staged = NULL;
+    for (; run; run = next) {
+        next = run->next;
+        bitmap_remark_dirty(map, run->offset, run->len);
+        free(run->data);
+        free(run);
+    }
+}
+
+
+/**
+ * Passes a claimed run to the callback. The last page may
+ * be partial. Marks the run dirty again on failure.
  */
-static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page) {
-    int res, total = 0;
+static int claimed_run(bloom_bitmap *map, bitmap_run_cb cb, void *data, uint64_t page, uint64_t num) {
     uint64_t offset = page * 4096;
+    uint64_t len = num * 4096;
+    if (offset + len > map->size) {
+        len = map->size - offset;
+    }
+    int res = cb(data, map, offset, len);
+    if (res) bitmap_remark_dirty(map, offset, len);
+    return res;
+}
+
+
+/**
+ * Marks a byte range of the bitmap as dirty again. Used
+ * to retry the pages of a failed asynchronous write.
+ * @arg map The bitmap
+ * @arg offset The byte offset of the range
+ * @arg len The length of the range in bytes
+ */
+void bitmap_remark_dirty(bloom_bitmap *map, uint64_t offset, uint64_t len) {
+    if (!map->dirty_pages || len == 0) return;
+    for (uint64_t i=offset / 4096; i <= (offset + len - 1) / 4096; i++) {
+        __atomic_fetch_or(map->dirty_pages + (i >> 6), 1ULL << (i & 63), __ATOMIC_RELEASE);
+    }
+}
+
+
+/**
+ * Returns the bytes of the dirty pages of a PERSISTENT
+ * bitmap, which the next flush writes. Other modes do not
+ * track their dirty pages, and return 0.
+ * @arg map The bitmap
+ * @return The dirty bytes.
+ */
+uint64_t bitmap_dirty_bytes(bloom_bitmap *map) {
+    if (map->mode != PERSISTENT || !map->dirty_pages) return 0;
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    uint64_t words = pages / 64 + ((pages % 64) ? 1 : 0);
+    uint64_t dirty = 0;
+    for (uint64_t w=0; w < words; w++) {
+        dirty += __builtin_popcountll(__atomic_load_n(map->dirty_pages + w, __ATOMIC_RELAXED));
+    }
+    dirty *= 4096;
+    return (dirty > map->size) ? map->size : dirty;
+}
+
+
+/**
+ * Starts tracking the epoch in which each page of a PERSISTENT
+ * bitmap last changed. Whenever a flush claims a dirty page, the
+ * page is stamped with the value of the epoch at that time. All
+ * the pages start out stamped with the current epoch.
+ * @arg map The bitmap
+ * @arg epoch The current epoch, owned by the caller. It must
+ * outlive the bitmap, and only ever increase.
+ * @return 0 on success, -EINVAL if the bitmap is not PERSISTENT.
+ */
+int bitmap_track_epochs(bloom_bitmap *map, const uint64_t *epoch) {
+    if (map->mode != PERSISTENT) return -EINVAL;
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    uint64_t *page_epochs = malloc(pages * sizeof(uint64_t));
+    if (!page_epochs) return -ENOMEM;
+
+    uint64_t start = __atomic_load_n(epoch, __ATOMIC_SEQ_CST);
+    for (uint64_t i=0; i < pages; i++) page_epochs[i] = start;
+    free(map->page_epochs);
+    map->page_epochs = page_epochs;
+    map->epoch = epoch;
+    return 0;
+}
+
+
+/**
+ * Starts counting the I/O of a bitmap, beginning with the
+ * bytes it read in when mapped.
+ */
+void bitmap_count_io(bloom_bitmap *map, bitmap_io_counters *io) {
+    map->io = io;
+    if (map->filled) __atomic_add_fetch(&io->bytes_read, map->filled, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Counts bytes of dirty pages written out for a bitmap.
+ */
+void bitmap_count_written(bloom_bitmap *map, uint64_t bytes) {
+    if (map->io) __atomic_add_fetch(&map->io->bytes_written, bytes, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Returns the epoch in which a page last changed. Pages
+ * of bitmaps that are not tracked may always have changed.
+ * @arg map The bitmap
+ * @arg page The index of the 4K page
+ * @return The epoch of the page, or UINT64_MAX if untracked.
+ */
+uint64_t bitmap_page_epoch(bloom_bitmap *map, uint64_t page) {
+    if (!map->page_epochs) return UINT64_MAX;
+    return __atomic_load_n(map->page_epochs + page, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Zeroes a byte range of the bitmap. Whole pages are dropped instead
+ * of cleared: the range is punched out of the file, and the memory
+ * is returned with MADV_DONTNEED, so the pages read back as zeros
+ * and are not written out. Partial pages at the edges, or pages that
+ * cannot be dropped, are cleared and marked dirty.
+ * @arg map The bitmap
+ * @arg offset The byte offset of the range
+ * @arg len The length of the range in bytes
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_zero(bloom_bitmap *map, uint64_t offset, uint64_t len) {
+    if (map == NULL || map->mmap == NULL || offset + len > map->size) return -EINVAL;
+    if (map->read_only) return -EROFS;
+    if (len == 0) return 0;
+
+    // A cut holds the old contents of the pages
+    unstage(map);
+
+    // Clear the partial pages at the edges
+    uint64_t start = (offset + 4095) & ~4095ULL;
+    uint64_t end = (offset + len) & ~4095ULL;
+    if (start >= end) {
+        memset(map->mmap + offset, 0, len);
+        bitmap_remark_dirty(map, offset, len);
+        return 0;
+    }
+    memset(map->mmap + offset, 0, start - offset);
+    bitmap_remark_dirty(map, offset, start - offset);
+    memset(map->mmap + end, 0, offset + len - end);
+    bitmap_remark_dirty(map, end, offset + len - end);
+
+    // Punch out the file first, since a lazy map reads the file back
+    int punched = 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (map->mode != ANONYMOUS) {
+        punched = fallocate(map->fileno, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                map->offset + start, end - start) == 0;
+    }
+#endif
+
+    // The page cache is zeroed by the punch, so a SHARED map
+    // is done. Otherwise, drop the pages of the mapping.
+    if (map->mode == SHARED) {
+        if (!punched) memset(map->mmap + start, 0, end - start);
+        return 0;
+    }
+    if (map->mode == ANONYMOUS || punched) {
+        if (drop_pages(map, start, end - start)) {
+            memset(map->mmap + start, 0, end - start);
+        }
+    } else {
+        memset(map->mmap + start, 0, end - start);
+    }
+
+    // Punched pages already match the file, so they need no write
+    if (map->mode != PERSISTENT) return 0;
+    if (!punched) {
+        bitmap_remark_dirty(map, start, end - start);
+        return 0;
+    }
+    for (uint64_t i=start / 4096; i < end / 4096; i++) {
+        __atomic_fetch_and(map->dirty_pages + (i >> 6), ~(1ULL << (i & 63)), __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * Drops whole pages of the mapping, so they read back as zeros.
+ * The pages of a memfd are shared, and must be punched out of it.
+ */
+static int drop_pages(bloom_bitmap *map, uint64_t offset, uint64_t len) {
+    if (map->memfd < 0) return madvise(map->mmap + offset, len, MADV_DONTNEED);
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return fallocate(map->memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Flushes the dirty pages of a DAX map by writing back
+ * their cache lines, and fencing the stores. The dirty
+ * words are claimed as in bitmap_flush_runs.
+ */
+static int flush_dax_pages(bloom_bitmap *map) {
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    uint64_t words = pages / 64 + ((pages % 64) ? 1 : 0);
+    uint64_t dirty, page, len, flushed = 0;
+    for (uint64_t w=0; w < words; w++) {
+        if (!__atomic_load_n(map->dirty_pages + w, __ATOMIC_RELAXED)) continue;
+        dirty = __atomic_exchange_n(map->dirty_pages + w, 0, __ATOMIC_SEQ_CST);
+        while (dirty) {
+            page = w * 64 + __builtin_ctzll(dirty);
+            dirty &= dirty - 1;
+            len = (map->size - page * 4096 < 4096) ? map->size - page * 4096 : 4096;
+            writeback_lines(map->mmap + page * 4096, len);
+            flushed += len;
+        }
+    }
+#if defined(__x86_64__)
+    _mm_sfence();
+#else
+    if (flushed && msync(map->mmap, map->size, MS_SYNC)) return -errno;
+#endif
+    bitmap_count_written(map, flushed);
+    return 0;
+}
 
-    // The last page may need a write size < 4096
-    int should_write = 4096;
-    if (page == max_page && size % 4096) {
-        should_write = size % 4096;
+#if defined(__x86_64__)
+__attribute__((target("clwb")))
+static void clwb_lines(unsigned char *addr, uint64_t len) {
+    for (uint64_t i=0; i < len; i += 64) _mm_clwb(addr + i);
+}
+
+__attribute__((target("clflushopt")))
+static void clflushopt_lines(unsigned char *addr, uint64_t len) {
+    for (uint64_t i=0; i < len; i += 64) _mm_clflushopt(addr + i);
+}
+#endif
+
+/**
+ * Writes back the cache lines of a range, with the best
+ * instruction the CPU has. CLWB keeps the lines cached.
+ * Other architectures rely on the msync of the flush.
+ */
+static void writeback_lines(unsigned char *addr, uint64_t len) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("clwb")) {
+        clwb_lines(addr, len);
+    } else if (__builtin_cpu_supports("clflushopt")) {
+        clflushopt_lines(addr, len);
+    } else {
+        for (uint64_t i=0; i < len; i += 64) _mm_clflush(addr + i);
     }
+#else
+    (void)addr;
+    (void)len;
+#endif
+}
+
+/**
+ * Writes out a run of adjacent dirty pages
+ * with a single write.
+ */
+static int flush_run(void *data, bloom_bitmap *map, uint64_t offset, uint64_t len) {
+    (void)data;
+    return write_run(map, map->mmap + offset, offset, len);
+}
 
-    while (total < should_write) {
-        res = pwrite(map->fileno, map->mmap + offset + total,
-                should_write - total, offset + total);
-        if (res == -1 && errno != EINTR)
+
+/**
+ * Writes a buffer holding a run of the bitmap
+ * to the file, at the offset of the run.
+ */
+static int write_run(bloom_bitmap *map, unsigned char *buf, uint64_t offset, uint64_t len) {
+    ssize_t res;
+    uint64_t total = 0;
+    int fd = bitmap_run_fd(map, len);
+    while (total < len) {
+        res = pwrite(fd, buf + total,
+                len - total, map->offset + offset + total);
+        if (res == -1) {
+            if (errno == EINTR) continue;
             return -errno;
-        else
-            total += res;
+        }
+        total += res;
     }
+    bitmap_count_written(map, len);
     return 0;
 }
 
 
+/**
+ * Returns the file descriptor to write a run with. Runs
+ * start on a page, so only a partial last page is unaligned.
+ */
+int bitmap_run_fd(bloom_bitmap *map, uint64_t len) {
+    if (map->direct_fd < 0 || len % BITMAP_DIRECT_ALIGN) return map->fileno;
+    return map->direct_fd;
+}
+
+
 /**
  * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
@@ -346,25 +1239,41 @@ int bitmap_close(bloom_bitmap *map) {
     // Return if there is no map provided
     if (map == NULL) return -EINVAL;
 
-    // Flush first
+    // Flush first, everything is written on close
+    unstage(map);
     int res = bitmap_flush(map);
     if (res != 0) return res;
 
     // Unmap the file
-    res = munmap(map->mmap, map->size);
+    res = munmap(map->mmap, map->mapped_len);
     if (res != 0) return -errno;
 
-    // Close the file descriptor if file backed
-    if (map->mode != ANONYMOUS) {
+    // Close the file descriptor if file backed, and ours
+    if (map->mode != ANONYMOUS && !map->borrowed) {
        res = close(map->fileno);
        if (res != 0) return -errno;
     }
 
+    if (map->direct_fd >= 0) {
+        close(map->direct_fd);
+        map->direct_fd = -1;
+    }
+
+    // Release the memfd. An exported copy keeps its memory.
+    if (map->memfd >= 0) {
+        release_memfd(map->memfd);
+        map->memfd = -1;
+    }
+
     // Remove the dirty bitfield if any
     if (map->dirty_pages) {
         free(map->dirty_pages);
         map->dirty_pages = NULL;
     }
+    if (map->page_epochs) {
+        free(map->page_epochs);
+        map->page_epochs = NULL;
+    }
 
     // Cleanup
     map->mmap = NULL;
@@ -8,17 +8,92 @@ typedef enum {
     SHARED      = 1, // MAP_SHARED mmap used, file backed.
     PERSISTENT  = 2, // MAP_ANONYMOUS used, file backed.
     ANONYMOUS   = 4, // MAP_ANONYMOUS mmap used. No file backing.
-    NEW_BITMAP  = 8  // File contents not read. Used with PERSISTENT
+    NEW_BITMAP  = 8, // File contents not read. Used with PERSISTENT
+    HUGE_PAGES  = 16, // Back with huge pages. Used with ANONYMOUS or PERSISTENT
+    LAZY        = 32, // Page in the file on first touch. Used with PERSISTENT
+    BORROW_FILE = 64, // Use the fileno as is, and leave it open on close
+    READ_ONLY   = 128, // Map the file read only, never written. Used with SHARED
+    DIRECT_IO   = 256, // Read and flush the file with O_DIRECT. Used with PERSISTENT
+    DAX         = 512 // Map persistent memory with MAP_SYNC. Used with SHARED
 } bitmap_mode;
 
+/**
+ * The huge page size used to round MAP_HUGETLB mappings.
+ */
+#define BITMAP_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Default limit on the number of adjacent dirty pages
+ * that are written back with a single call. 1MB.
+ */
+#define BITMAP_DEFAULT_FLUSH_PAGES 256
+
+/**
+ * Existing PERSISTENT bitmaps are read in by up to
+ * BITMAP_FILL_THREADS threads, each reading chunks of
+ * BITMAP_FILL_CHUNK bytes. Smaller files are read in
+ * by the calling thread alone.
+ */
+#define BITMAP_FILL_THREADS 4
+#define BITMAP_FILL_CHUNK (8 * 1024 * 1024)
+
+/**
+ * The alignment of the offsets and lengths of O_DIRECT I/O.
+ * A partial last page is read and written through the
+ * page cache instead.
+ */
+#define BITMAP_DIRECT_ALIGN 4096
+
+/**
+ * Counts the bytes bitmaps read from and write to their files.
+ * Several bitmaps may count into the same counters, which are
+ * only changed with atomic adds.
+ */
+typedef struct {
+    uint64_t bytes_read;    // Read in when mapped
+    uint64_t bytes_written; // Written out by flushes of the dirty pages
+} bitmap_io_counters;
+
+/**
+ * A run of dirty pages copied aside by bitmap_stage. The
+ * next flush writes the copy instead of the live pages.
+ */
+typedef struct bitmap_staged_run {
+    uint64_t offset;        // Byte offset of the run
+    uint64_t len;           // Length of the run in bytes
+    unsigned char *data;    // The copy, aligned for DIRECT_IO
+    struct bitmap_staged_run *next;
+} bitmap_staged_run;
+
 typedef struct {
     bitmap_mode mode;
     int fileno;          // Underlying fileno
+    int borrowed;        // The fileno belongs to the caller
+    uint64_t offset;     // Offset of the bitmap in the file
     uint64_t size;       // Size of bitmap in bytes
     unsigned char* mmap; // Starting address of the bitmap region
-    unsigned char* dirty_pages; // Used for the PERSISTENT mode.
+    uint64_t mapped_len; // Length of the mapping, rounded up for huge pages
+    uint64_t* dirty_pages; // Used for the PERSISTENT mode, 1 bit per page.
+    uint32_t max_flush_pages; // Max pages written at once by a PERSISTENT flush
+    uint64_t* page_epochs; // Epoch each page was last claimed by a flush, if tracked
+    const uint64_t* epoch; // The current epoch, stamped on the claimed pages
+    int memfd;           // The memfd backing a PERSISTENT bitmap, or -1
+    int read_only;       // Mapped read only, so never flushed
+    uint64_t filled;     // Bytes read in from the file when mapped
+    bitmap_io_counters* io; // Counts the I/O of the bitmap, if set
+    int direct_fd;       // The file opened with O_DIRECT for DIRECT_IO, or -1
+    int dax;             // Mapped with MAP_SYNC, flushed from the CPU caches
+    bitmap_staged_run* staged; // Dirty pages cut by bitmap_stage, or NULL
 } bloom_bitmap;
 
+/**
+ * Invoked for each memfd backing a PERSISTENT bitmap, with
+ * the identity of the file range the bitmap maps.
+ * Returns 0 to continue.
+ */
+typedef int (*bitmap_memfd_cb)(void *data, int memfd, uint64_t dev, uint64_t ino,
+        uint64_t offset, uint64_t len);
+
 /**
  * Returns a bloom_bitmap pointer from a file handle
  * that is already opened with read/write privileges.
@@ -30,6 +105,21 @@ typedef struct {
  */
 int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *map);
 
+/**
+ * Returns a bloom_bitmap pointer over a range of a file
+ * handle, so several bitmaps can share a single file. With
+ * BORROW_FILE, the handle is used without a dup, and must
+ * stay open until the bitmap is closed.
+ * @arg fileno The fileno
+ * @arg offset The offset of the bitmap in the file. Must be
+ * a multiple of the page size.
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode The mode to use for the bitmap.
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+int bitmap_from_file_range(int fileno, uint64_t offset, uint64_t len, bitmap_mode mode, bloom_bitmap *map);
+
 /**
  * Returns a bloom_bitmap pointer from a filename.
  * Opens the file with read/write privileges. If create
@@ -53,6 +143,197 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
  */
 int bitmap_flush(bloom_bitmap *map);
 
+/**
+ * Writes the dirty pages of the bitmap back to its file, like
+ * bitmap_flush, without syncing the file. The pages of a SHARED
+ * map are already in the page cache, so nothing is written.
+ * @arg map The bitmap
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_write(bloom_bitmap *map);
+
+/**
+ * Cuts a consistent image of a PERSISTENT bitmap for the next
+ * flush. The dirty pages are claimed and copied aside, and the
+ * next bitmap_flush writes the copies instead of the live pages.
+ * Changes made after the cut stay dirty for the flush after, so
+ * the writes need no lock, but nothing may write the bitmap
+ * during this call. A cut that was not flushed is replaced.
+ * It is a no-op for the other modes.
+ * @arg map The bitmap
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_stage(bloom_bitmap *map);
+
+/**
+ * Callback used to write back a run of dirty pages.
+ * @arg data Opaque callback data
+ * @arg map The bitmap
+ * @arg offset The byte offset of the run, in the map and the file
+ * @arg len The length of the run in bytes
+ * @return 0 on success, negative on failure.
+ */
+typedef int (*bitmap_run_cb)(void *data, bloom_bitmap *map, uint64_t offset, uint64_t len);
+
+/**
+ * Claims the dirty pages of a PERSISTENT bitmap, and invokes
+ * the callback for each run of adjacent dirty pages, of up to
+ * max_flush_pages. The pages are no longer dirty once claimed.
+ * If the callback fails, the unwritten pages are marked dirty
+ * again, and the error is returned. This lets callers write the
+ * pages asynchronously, bitmap_flush uses it with pwrite. A
+ * pending cut of bitmap_stage is dropped, its pages are claimed
+ * again from the live bitmap.
+ * @arg map The bitmap
+ * @arg cb The callback for each run
+ * @arg data Opaque data passed to the callback
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_flush_runs(bloom_bitmap *map, bitmap_run_cb cb, void *data);
+
+/**
+ * Marks a byte range of the bitmap as dirty again. Used
+ * to retry the pages of a failed asynchronous write.
+ * @arg map The bitmap
+ * @arg offset The byte offset of the range
+ * @arg len The length of the range in bytes
+ */
+void bitmap_remark_dirty(bloom_bitmap *map, uint64_t offset, uint64_t len);
+
+/**
+ * Returns the bytes of the dirty pages of a PERSISTENT
+ * bitmap, which the next flush writes. Other modes do not
+ * track their dirty pages, and return 0.
+ * @arg map The bitmap
+ * @return The dirty bytes.
+ */
+uint64_t bitmap_dirty_bytes(bloom_bitmap *map);
+
+/**
+ * Starts tracking the epoch in which each page of a PERSISTENT
+ * bitmap last changed. Whenever a flush claims a dirty page, the
+ * page is stamped with the value of the epoch at that time. All
+ * the pages start out stamped with the current epoch.
+ * @arg map The bitmap
+ * @arg epoch The current epoch, owned by the caller. It must
+ * outlive the bitmap, and only ever increase.
+ * @return 0 on success, -EINVAL if the bitmap is not PERSISTENT.
+ */
+int bitmap_track_epochs(bloom_bitmap *map, const uint64_t *epoch);
+
+/**
+ * Starts counting the I/O of a bitmap, beginning with the
+ * bytes it read in when mapped. Only the PERSISTENT mode
+ * reads and writes the file itself. SHARED and LAZY maps
+ * are paged by the kernel, and count nothing.
+ * @arg map The bitmap
+ * @arg io The counters, owned by the caller. They must
+ * outlive the bitmap.
+ */
+void bitmap_count_io(bloom_bitmap *map, bitmap_io_counters *io);
+
+/**
+ * Counts bytes of dirty pages written out for a bitmap.
+ * Used by writers other than bitmap_flush.
+ * @arg map The bitmap
+ * @arg bytes The bytes written
+ */
+void bitmap_count_written(bloom_bitmap *map, uint64_t bytes);
+
+/**
+ * Returns the file descriptor to write a run of a bitmap
+ * with. Runs of whole pages of a DIRECT_IO bitmap bypass
+ * the page cache, everything else uses the fileno.
+ * @arg map The bitmap
+ * @arg len The length of the run in bytes
+ * @return The file descriptor
+ */
+int bitmap_run_fd(bloom_bitmap *map, uint64_t len);
+
+/**
+ * Returns the epoch in which a page last changed. Pages
+ * of bitmaps that are not tracked may always have changed.
+ * @arg map The bitmap
+ * @arg page The index of the 4K page
+ * @return The epoch of the page, or UINT64_MAX if untracked.
+ */
+uint64_t bitmap_page_epoch(bloom_bitmap *map, uint64_t page);
+
+/**
+ * Zeroes a byte range of the bitmap. Whole pages are punched
+ * out of the file and dropped from memory where possible,
+ * which releases their memory and disk space, and they are
+ * not written out again. Needs exclusive access to the range,
+ * and no flush in progress.
+ * @arg map The bitmap
+ * @arg offset The byte offset of the range
+ * @arg len The length of the range in bytes
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_zero(bloom_bitmap *map, uint64_t offset, uint64_t len);
+
+/**
+ * Starts writing back the dirty pages of a SHARED bitmap, in
+ * runs of max_flush_pages, and returns without waiting for the
+ * writes. Calling this often trickles the pages out, so that the
+ * sync of the next bitmap_flush only has the rest to write. It
+ * is a no-op for the other modes.
+ * @arg map The bitmap
+ * @return 0 on success, negative on failure.
+ */
+int bitmap_writeback(bloom_bitmap *map);
+
+/**
+ * Moves a PERSISTENT bitmap to the page cache. The dirty pages
+ * are written out, then the file is mapped SHARED at the same
+ * address, so pointers into the bitmap stay valid and its memory
+ * is released. The kernel can then evict its pages. Needs that
+ * nothing writes the bitmap, and no flush is in progress.
+ * @arg map The bitmap
+ * @return 0 on success, -EINVAL if the bitmap is not PERSISTENT
+ * or uses huge pages, negative on failure.
+ */
+int bitmap_share(bloom_bitmap *map);
+
+/**
+ * Backs new PERSISTENT bitmaps with a memfd, instead of
+ * anonymous memory, so their memory can be handed to another
+ * process. Lazy and huge page bitmaps are not backed.
+ * @arg enable 1 to enable, 0 to disable
+ */
+void bitmap_use_memfd(int enable);
+
+/**
+ * Invokes the callback for the memfd of each open PERSISTENT
+ * bitmap. The bitmaps should be flushed first, since the file
+ * is expected to match the memfd. Thread safe.
+ * @arg cb The callback
+ * @arg data Opaque data passed to the callback
+ * @return 0 on success, or the first non-zero result of the callback.
+ */
+int bitmap_export_memfds(bitmap_memfd_cb cb, void *data);
+
+/**
+ * Adds a memfd inherited from another process. The next PERSISTENT
+ * bitmap opened over the same file range maps the memfd, and does
+ * not read the file. The memfd is owned by the bitmaps from now on.
+ * Thread safe.
+ * @arg memfd The memfd, holding the contents of the range
+ * @arg dev The device of the file
+ * @arg ino The inode of the file
+ * @arg offset The offset of the range in the file
+ * @arg len The length of the range
+ * @return 0 on success, negative on failure.
+ */
+int bitmap_inherit_memfd(int memfd, uint64_t dev, uint64_t ino, uint64_t offset, uint64_t len);
+
+/**
+ * Closes the inherited memfds that no bitmap has mapped.
+ * Thread safe.
+ * @return The number of memfds closed.
+ */
+int bitmap_release_inherited(void);
+
 /**
  * * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
@@ -71,6 +352,38 @@ inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx) {
     return (map->mmap[idx >> 3] >> (7 - (idx % 8))) & 0x1;
 }
 
+/*
+ * Marks the page containing the bit at index idx as dirty,
+ * if we are in the PERSISTENT mode or mapped with DAX. Used
+ * when bits are set without going through bitmap_setbit. The
+ * dirty bits are set with an atomic word OR, so this is safe
+ * to race with other writers and with a flush. The mark is
+ * skipped if it is already set, which avoids writing the
+ * shared word in the common case.
+ */
+inline void bitmap_mark_dirty(bloom_bitmap *map, uint64_t idx) {
+    if (map->dirty_pages) {
+        // >> 12 for 4096 (bytes/page), >> 3 for 8 (bits/byte)
+        uint64_t page = idx >> 15;
+        uint64_t *word = map->dirty_pages + (page >> 6);
+        uint64_t mask = 1ULL << (page & 63);
+
+        // A flush swaps the word to zero, then reads the pages.
+        // Without the fence, the data write may become visible
+        // after the check, so a check that sees the mark of a
+        // flush about to claim it would skip, and the flush would
+        // read the page without the write and clear its mark. The
+        // fence pairs with the seq_cst swap: either the check sees
+        // the swapped word and marks the page again, or the swap
+        // comes after the write, and the flush reads it.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & mask)) {
+            // Release orders the data write before the mark
+            __atomic_fetch_or(word, mask, __ATOMIC_RELEASE);
+        }
+    }
+}
+
 /*
  * Used to set a bit in the bitmap, and as a side affect,
  * mark the page as dirty if we are in the PERSISTENT mode
@@ -82,14 +395,78 @@ inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx) {
     map->mmap[idx >> 3] = byte;
 
     // Check if we need to dirty the page
-    if (map->mode == PERSISTENT) {
-        // >> 12 for 4096 (bytes/page), >> 3 for 8 (bits/byte)
-        uint64_t page = idx >> 15;
-        byte = map->dirty_pages[page >> 3];
-        byte_off = 7 - page % 8;
-        byte |= 1 << byte_off;
-        map->dirty_pages[page >> 3] = byte;
-    }
+    bitmap_mark_dirty(map, idx);
+}
+
+/*
+ * Atomically marks the page containing the bit at index idx
+ * as dirty, if we are in the PERSISTENT mode. Dirty tracking
+ * is always atomic, so this is the same as bitmap_mark_dirty.
+ */
+inline void bitmap_mark_dirty_atomic(bloom_bitmap *map, uint64_t idx) {
+    bitmap_mark_dirty(map, idx);
+}
+
+/*
+ * Atomically sets a bit in the bitmap, and marks the page
+ * as dirty if the bit was newly set. This is safe to use
+ * concurrently with other atomic sets and with reads.
+ * @return 1 if the bit was newly set, 0 if it was already set.
+ */
+inline int bitmap_setbit_atomic(bloom_bitmap *map, uint64_t idx) {
+    unsigned char mask = 1 << (7 - idx % 8);
+    unsigned char old = __atomic_fetch_or(map->mmap + (idx >> 3), mask, __ATOMIC_RELAXED);
+    if (old & mask) return 0;
+
+    // Check if we need to dirty the page
+    bitmap_mark_dirty_atomic(map, idx);
+    return 1;
+}
+
+/*
+ * Word granular access. In the word bit order, bit idx is
+ * bit (idx % 64) of the native 64bit word idx / 64. This is
+ * a different on-disk order from the byte functions above,
+ * the two must not be mixed on the same bitmap. The mmap
+ * region is page aligned, so the words are always aligned.
+ */
+
+/**
+ * Returns the 64bit word at word index widx
+ */
+inline uint64_t bitmap_getword(bloom_bitmap *map, uint64_t widx) {
+    return ((uint64_t*)map->mmap)[widx];
+}
+
+/**
+ * Returns the value of the bit at index idx, using
+ * the word bit order.
+ */
+inline int bitmap_getbit_word(bloom_bitmap *map, uint64_t idx) {
+    return (bitmap_getword(map, idx >> 6) >> (idx & 63)) & 0x1;
+}
+
+/*
+ * Sets a bit using the word bit order, and marks
+ * the page as dirty if we are in the PERSISTENT mode.
+ */
+inline void bitmap_setbit_word(bloom_bitmap *map, uint64_t idx) {
+    ((uint64_t*)map->mmap)[idx >> 6] |= 1ULL << (idx & 63);
+    bitmap_mark_dirty(map, idx);
+}
+
+/*
+ * Atomically sets a bit using the word bit order. The page
+ * is only marked dirty if the bit was newly set. This is safe
+ * to use concurrently with other atomic sets and with reads.
+ * @return 1 if the bit was newly set, 0 if it was already set.
+ */
+inline int bitmap_test_and_set_word(bloom_bitmap *map, uint64_t idx) {
+    uint64_t mask = 1ULL << (idx & 63);
+    uint64_t old = __atomic_fetch_or((uint64_t*)map->mmap + (idx >> 6), mask, __ATOMIC_RELAXED);
+    if (old & mask) return 0;
+    bitmap_mark_dirty_atomic(map, idx);
+    return 1;
 }
 
 #endif
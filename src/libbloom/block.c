@@ -0,0 +1,208 @@
+#include <string.h>
+#include "bloom.h"
+#include "block.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLOCK_HAVE_AVX2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BLOCK_HAVE_NEON 1
+#endif
+
+/**
+ * Static declarations
+ */
+static int scalar_block_contains(const unsigned char *block, const uint64_t *mask);
+static void scalar_block_set(unsigned char *block, const uint64_t *mask);
+static uint64_t scalar_popcount(const unsigned char *data, uint64_t len, int nibbles);
+static void block_kernel_init(void);
+
+typedef int (*block_contains_fn)(const unsigned char *block, const uint64_t *mask);
+typedef void (*block_set_fn)(unsigned char *block, const uint64_t *mask);
+typedef uint64_t (*popcount_fn)(const unsigned char *data, uint64_t len, int nibbles);
+
+// Selected on first use. Racing initializers all pick the same
+// kernel, so no synchronization is needed.
+static block_contains_fn contains_kernel = NULL;
+static block_set_fn set_kernel = NULL;
+static popcount_fn popcount_kernel = NULL;
+static const char *kernel_name = NULL;
+
+#define BLOCK_WORDS (BLOOM_BLOCK_BYTES / sizeof(uint64_t))
+
+/**
+ * Scalar kernels. Words are loaded with memcpy, so these
+ * are independent of alignment and byte order.
+ */
+static int scalar_block_contains(const unsigned char *block, const uint64_t *mask) {
+    uint64_t word;
+    for (unsigned i=0; i < BLOCK_WORDS; i++) {
+        memcpy(&word, block + i * sizeof(uint64_t), sizeof(uint64_t));
+        if ((word & mask[i]) != mask[i]) return 0;
+    }
+    return 1;
+}
+
+static void scalar_block_set(unsigned char *block, const uint64_t *mask) {
+    uint64_t word;
+    for (unsigned i=0; i < BLOCK_WORDS; i++) {
+        memcpy(&word, block + i * sizeof(uint64_t), sizeof(uint64_t));
+        word |= mask[i];
+        memcpy(block + i * sizeof(uint64_t), &word, sizeof(uint64_t));
+    }
+}
+
+/**
+ * Counts the set bits, or non-zero nibbles, of the data. Each
+ * nibble is folded into its low bit first, so the same popcount
+ * counts the counters of the counting layout.
+ */
+static inline __attribute__((always_inline)) uint64_t popcount_words(
+        const unsigned char *data, uint64_t len, int nibbles) {
+    uint64_t word, set = 0, i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        memcpy(&word, data + i, sizeof(uint64_t));
+        if (nibbles) word = (word | word >> 1 | word >> 2 | word >> 3) & 0x1111111111111111ULL;
+        set += __builtin_popcountll(word);
+    }
+    for (; i < len; i++) {
+        word = data[i];
+        if (nibbles) word = (word | word >> 1 | word >> 2 | word >> 3) & 0x11;
+        set += __builtin_popcountll(word);
+    }
+    return set;
+}
+
+/**
+ * Without a popcount instruction, the compiler counts with a
+ * few shifts and masks. On aarch64 this is already a cnt.
+ */
+static uint64_t scalar_popcount(const unsigned char *data, uint64_t len, int nibbles) {
+    return popcount_words(data, len, nibbles);
+}
+
+#ifdef BLOCK_HAVE_AVX2
+/**
+ * The same loop, built to use the popcnt instruction.
+ */
+__attribute__((target("popcnt")))
+static uint64_t popcnt_popcount(const unsigned char *data, uint64_t len, int nibbles) {
+    return popcount_words(data, len, nibbles);
+}
+
+/**
+ * AVX2 kernels. The 512bit block is handled as two 256bit
+ * halves, tested with a single and-not / testz per half.
+ */
+__attribute__((target("avx2")))
+static int avx2_block_contains(const unsigned char *block, const uint64_t *mask) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)block);
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(block + 32));
+    __m256i m0 = _mm256_loadu_si256((const __m256i*)mask);
+    __m256i m1 = _mm256_loadu_si256((const __m256i*)(mask + 4));
+
+    // testc returns 1 if (~b & m) == 0, e.g. all mask bits are set
+    return _mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1);
+}
+
+__attribute__((target("avx2")))
+static void avx2_block_set(unsigned char *block, const uint64_t *mask) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)block);
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(block + 32));
+    __m256i m0 = _mm256_loadu_si256((const __m256i*)mask);
+    __m256i m1 = _mm256_loadu_si256((const __m256i*)(mask + 4));
+    _mm256_storeu_si256((__m256i*)block, _mm256_or_si256(b0, m0));
+    _mm256_storeu_si256((__m256i*)(block + 32), _mm256_or_si256(b1, m1));
+}
+#endif
+
+#ifdef BLOCK_HAVE_NEON
+/**
+ * NEON kernels. NEON is always available on aarch64.
+ */
+static int neon_block_contains(const unsigned char *block, const uint64_t *mask) {
+    uint64x2_t missing = vdupq_n_u64(0);
+    for (unsigned i=0; i < BLOCK_WORDS; i += 2) {
+        uint64x2_t b = vreinterpretq_u64_u8(vld1q_u8(block + i * sizeof(uint64_t)));
+        uint64x2_t m = vld1q_u64(mask + i);
+        missing = vorrq_u64(missing, vbicq_u64(m, b));
+    }
+    return (vgetq_lane_u64(missing, 0) | vgetq_lane_u64(missing, 1)) == 0;
+}
+
+static void neon_block_set(unsigned char *block, const uint64_t *mask) {
+    for (unsigned i=0; i < BLOCK_WORDS; i += 2) {
+        uint64x2_t b = vreinterpretq_u64_u8(vld1q_u8(block + i * sizeof(uint64_t)));
+        uint64x2_t m = vld1q_u64(mask + i);
+        vst1q_u8(block + i * sizeof(uint64_t), vreinterpretq_u8_u64(vorrq_u64(b, m)));
+    }
+}
+#endif
+
+/**
+ * Picks the best kernel for this CPU.
+ */
+static void block_kernel_init(void) {
+    popcount_kernel = scalar_popcount;
+#ifdef BLOCK_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) popcount_kernel = popcnt_popcount;
+    if (__builtin_cpu_supports("avx2")) {
+        set_kernel = avx2_block_set;
+        kernel_name = "avx2";
+        contains_kernel = avx2_block_contains;
+        return;
+    }
+#endif
+#ifdef BLOCK_HAVE_NEON
+    set_kernel = neon_block_set;
+    kernel_name = "neon";
+    contains_kernel = neon_block_contains;
+    return;
+#endif
+    set_kernel = scalar_block_set;
+    kernel_name = "scalar";
+    contains_kernel = scalar_block_contains;
+}
+
+/**
+ * Checks if all the bits in the mask are set in the block.
+ * @arg block Pointer to the block, BLOOM_BLOCK_BYTES long
+ * @arg mask The mask to check, BLOOM_BLOCK_BYTES long
+ * @return 1 if all the bits are set, 0 otherwise.
+ */
+int bf_block_contains(const unsigned char *block, const uint64_t *mask) {
+    if (!contains_kernel) block_kernel_init();
+    return contains_kernel(block, mask);
+}
+
+/**
+ * Sets all the bits in the mask into the block.
+ * @arg block Pointer to the block, BLOOM_BLOCK_BYTES long
+ * @arg mask The mask to set, BLOOM_BLOCK_BYTES long
+ */
+void bf_block_set(unsigned char *block, const uint64_t *mask) {
+    if (!set_kernel) block_kernel_init();
+    set_kernel(block, mask);
+}
+
+/**
+ * Returns the name of the kernel in use, for diagnostics.
+ */
+const char* bf_block_kernel(void) {
+    if (!kernel_name) block_kernel_init();
+    return kernel_name;
+}
+
+/**
+ * Counts the set bits of the data, or its non-zero nibbles.
+ * @arg data The data to count
+ * @arg len The length of the data in bytes
+ * @arg nibbles If set, counts the non-zero nibbles instead
+ * @return The number of set bits, or non-zero nibbles.
+ */
+uint64_t bf_popcount(const unsigned char *data, uint64_t len, int nibbles) {
+    if (!popcount_kernel) block_kernel_init();
+    return popcount_kernel(data, len, nibbles);
+}
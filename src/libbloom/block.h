@@ -0,0 +1,44 @@
+#ifndef BLOOM_BLOCK_H
+#define BLOOM_BLOCK_H
+#include <inttypes.h>
+
+/**
+ * Kernels used to probe and set a whole block of the
+ * blocked layout at once. The mask is a BLOOM_BLOCK_BYTES
+ * long bit pattern, in the same bit order as the bitmap.
+ * The best implementation is picked at runtime, with a
+ * portable scalar fallback.
+ */
+
+/**
+ * Checks if all the bits in the mask are set in the block.
+ * @arg block Pointer to the block, BLOOM_BLOCK_BYTES long
+ * @arg mask The mask to check, BLOOM_BLOCK_BYTES long
+ * @return 1 if all the bits are set, 0 otherwise.
+ */
+int bf_block_contains(const unsigned char *block, const uint64_t *mask);
+
+/**
+ * Sets all the bits in the mask into the block.
+ * @arg block Pointer to the block, BLOOM_BLOCK_BYTES long
+ * @arg mask The mask to set, BLOOM_BLOCK_BYTES long
+ */
+void bf_block_set(unsigned char *block, const uint64_t *mask);
+
+/**
+ * Counts the set bits of the data, or its non-zero nibbles,
+ * for the counters of the counting layout. Uses the popcount
+ * instruction when the CPU has one.
+ * @arg data The data to count
+ * @arg len The length of the data in bytes
+ * @arg nibbles If set, counts the non-zero nibbles instead
+ * @return The number of set bits, or non-zero nibbles.
+ */
+uint64_t bf_popcount(const unsigned char *data, uint64_t len, int nibbles);
+
+/**
+ * Returns the name of the kernel in use, for diagnostics.
+ */
+const char* bf_block_kernel(void);
+
+#endif
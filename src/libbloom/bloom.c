@@ -1,198 +1,1867 @@
 #include <math.h>
+#include <stddef.h>
 #include <iso646.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <syslog.h>
 #include "bloom.h"
+#include "block.h"
 
 /*
  * Static definitions
  */
 static const uint32_t MAGIC_HEADER = 0xCB1005DD;  // Vaguely like CBLOOMDD
+static const uint32_t BLOCKED_MAGIC_HEADER = 0xCB1005DB;  // Blocked layout, CBLOOMDB
+static const uint32_t COUNTING_MAGIC_HEADER = 0xCB1005DC;  // Counting layout, CBLOOMDC
+static const uint32_t CUCKOO_MAGIC_HEADER = 0xCB1005DE;  // Cuckoo layout, CBLOOMDE
+
+// Fingerprints are read 8 bytes at a time, so the cuckoo
+// table is padded to never read past the end of the bitmap
+#define CUCKOO_PAD_BYTES 8
+#define CUCKOO_MIN_FP_BITS 4
+#define CUCKOO_MAX_FP_BITS 32
+
+// Marks the cached estimate of the distinct keys as stale
+#define BITS_UNKNOWN UINT64_MAX
 extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
 extern void SpookyHash128(const void *key, size_t len, uint64_t seed1, uint64_t seed2,
         uint64_t *hash1, uint64_t *hash2);
+extern void WyHash128(const void *key, uint64_t len, uint64_t seed, uint64_t *out);
+static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *hashes);
+static void bf_select_kernels(bloom_bloomfilter *filter);
+static uint32_t bf_internal_set(bloom_bloomfilter *filter, uint64_t *hashes);
+static uint32_t bf_counting_add_atomic(bloom_bloomfilter *filter, uint64_t *hashes);
+static int bf_cuckoo_contains(bloom_bloomfilter *filter, uint64_t *hashes);
+static int bf_cuckoo_insert(bloom_bloomfilter *filter, uint64_t *hashes);
+static int bf_cuckoo_remove(bloom_bloomfilter *filter, uint64_t *hashes);
+static uint32_t bf_cuckoo_fp_bits(double fp_prob);
+static uint64_t bf_round_pow2(uint64_t val);
+static uint64_t bf_floor_pow2(uint64_t val);
+static void bf_compute_spooky_hashes(uint32_t k_num, const char *key, uint64_t len, uint64_t *hashes);
+static void bf_parse_client_hash(const char *key, uint64_t len, uint64_t *out);
+static int bf_merge_geometry(bloom_bloomfilter *dst, bloom_bloomfilter *src,
+        uint64_t *parts, uint64_t *part_bytes, uint64_t *src_part_bytes);
+static double bf_merge_scan(bloom_bloomfilter *dst, bloom_bloomfilter *src,
+        uint64_t parts, uint64_t part_bytes, uint64_t src_part_bytes);
+static int bf_combine(bloom_bloomfilter *dst, bloom_bloomfilter *src, int intersect);
+static void bf_combine_words(unsigned char *out, unsigned char *in, uint64_t len, int intersect);
+static uint64_t bf_fold_bytes(bloom_bloomfilter *filter, uint32_t factor);
+static void bf_fold_blocks(bloom_bloomfilter *src, bloom_bloomfilter *dst, uint32_t factor);
+static void bf_fold_bits(bloom_bloomfilter *src, bloom_bloomfilter *dst, uint32_t factor);
+static void bf_fold_counters(bloom_bloomfilter *src, bloom_bloomfilter *dst, uint32_t factor);
+
+/**
+ * Reduces a hash value to the range [0, m) using
+ * the index mode of the filter.
+ */
+static inline uint64_t bf_reduce(bloom_index_mode mode, uint64_t h, uint64_t m) {
+    switch (mode) {
+        case INDEX_FASTRANGE:
+            // Lemire's multiply-shift, uses the high bits of h
+            return ((__uint128_t)h * m) >> 64;
+        case INDEX_POW2:
+            return h & (m - 1);
+        default:
+            return h % m;
+    }
+}
+
+/**
+ * Builds the mask of the bits a key sets in its block. The mask
+ * uses the bit order of the bitmap, so that it can be applied
+ * directly to the block bytes.
+ */
+static inline void bf_block_mask(bloom_bloomfilter *filter, uint64_t *hashes, uint64_t *mask) {
+    uint32_t k_num = filter->header->k_num;
+    uint64_t bit;
+    memset(mask, 0, BLOOM_BLOCK_BYTES);
+    if (filter->bit_order == BIT_ORDER_WORD) {
+        for (uint32_t i=0; i < k_num; i++) {
+            bit = hashes[i] >> 55;
+            mask[bit >> 6] |= 1ULL << (bit & 63);
+        }
+        return;
+    }
+
+    unsigned char *bytes = (unsigned char*)mask;
+    for (uint32_t i=0; i < k_num; i++) {
+        bit = hashes[i] >> 55;
+        bytes[bit >> 3] |= 1 << (7 - (bit % 8));
+    }
+}
+
+/**
+ * Returns the bit offset of the block for a key in the blocked layout.
+ * The top bits of each hash pick the bit inside the block. Since
+ * multiply-shift also uses the top bits, the hash is rotated first
+ * to keep the block and bit choices independent.
+ */
+static inline uint64_t bf_block_offset(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint64_t h = hashes[0];
+    if (filter->index_mode == INDEX_FASTRANGE) {
+        h = (h << 9) | (h >> 55);
+    }
+    return 8*sizeof(bloom_filter_header) +
+        bf_reduce(filter->index_mode, h, filter->num_blocks) * BLOOM_BLOCK_BITS;
+}
+
+/**
+ * Returns the counter a key uses in partition i of the counting layout.
+ */
+static inline uint64_t bf_counter_index(bloom_bloomfilter *filter, uint32_t i, uint64_t h) {
+    return i * filter->offset + bf_reduce(filter->index_mode, h, filter->offset);
+}
+
+/**
+ * Returns the byte holding a counter, and the shift of its nibble.
+ */
+static inline unsigned char* bf_counter_byte(bloom_bloomfilter *filter, uint64_t counter, int *shift) {
+    *shift = (counter & 1) * BLOOM_COUNTER_BITS;
+    return filter->map->mmap + sizeof(bloom_filter_header) + (counter >> 1);
+}
+
+/**
+ * Returns the fingerprint of a key in the cuckoo layout.
+ * Zero marks an empty slot, so it is never a fingerprint.
+ */
+static inline uint32_t bf_cuckoo_fingerprint(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint32_t fp = hashes[1] >> (64 - filter->fp_bits);
+    return fp ? fp : 1;
+}
+
+/**
+ * Returns the first bucket of a key in the cuckoo layout.
+ */
+static inline uint64_t bf_cuckoo_bucket(bloom_bloomfilter *filter, uint64_t *hashes) {
+    return ((__uint128_t)hashes[0] * filter->num_blocks) >> 64;
+}
+
+/**
+ * Returns the other bucket of a fingerprint. Using
+ * (h(fp) - bucket) mod n means applying this twice gives
+ * back the first bucket, for any number of buckets.
+ */
+static inline uint64_t bf_cuckoo_alt(bloom_bloomfilter *filter, uint64_t bucket, uint32_t fp) {
+    uint64_t n = filter->num_blocks;
+    uint64_t h = ((__uint128_t)(fp * 0x9E3779B97F4A7C15ULL) * n) >> 64;
+    return (h >= bucket) ? h - bucket : h + n - bucket;
+}
+
+/**
+ * Returns the bytes holding a slot of the cuckoo table, and the
+ * shift of the fingerprint inside the little endian word there.
+ */
+static inline unsigned char* bf_cuckoo_slot(bloom_bloomfilter *filter, uint64_t slot, int *shift) {
+    uint64_t bit = slot * filter->fp_bits;
+    *shift = bit & 7;
+    return filter->map->mmap + sizeof(bloom_filter_header) + (bit >> 3);
+}
+
+static inline uint64_t bf_load_le64(const unsigned char *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline void bf_store_le64(unsigned char *p, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(p, &word, sizeof(word));
+}
+
+static inline uint32_t bf_cuckoo_get(bloom_bloomfilter *filter, uint64_t slot) {
+    int shift;
+    unsigned char *p = bf_cuckoo_slot(filter, slot, &shift);
+    return (bf_load_le64(p) >> shift) & ((1ULL << filter->fp_bits) - 1);
+}
+
+static inline void bf_cuckoo_put(bloom_bloomfilter *filter, uint64_t slot, uint32_t fp) {
+    int shift;
+    unsigned char *p = bf_cuckoo_slot(filter, slot, &shift);
+    uint64_t mask = ((1ULL << filter->fp_bits) - 1) << shift;
+    uint64_t word = bf_load_le64(p);
+    bf_store_le64(p, (word & ~mask) | ((uint64_t)fp << shift));
+
+    // The fingerprint may straddle a page
+    uint64_t bit = (p - filter->map->mmap) * 8 + shift;
+    bitmap_mark_dirty(filter->map, bit);
+    bitmap_mark_dirty(filter->map, bit + filter->fp_bits - 1);
+}
+
+/**
+ * Creates a new bloom filter using a given bitmap and k-value.
+ * @arg map A bloom_bitmap pointer.
+ * @arg k_num The number of hash functions to use. Ignored if the header value is different.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloomfilter *filter) {
+    bloom_filter_params params = {0, k_num, 0, 0, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    return bf_from_bitmap_params(map, &params, new_filter, filter);
+}
+
+/**
+ * Creates a new bloom filter using a given bitmap and parameters.
+ * The k_num, layout, hash family, index mode and bit order are used
+ * for new filters, otherwise they are read from the existing header.
+ * @arg map A bloom_bitmap pointer.
+ * @arg params The parameters to use. Only k_num, layout, hash_family,
+ * index_mode and bit_order are used.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int bf_from_bitmap_params(bloom_bitmap *map, bloom_filter_params *params, int new_filter, bloom_bloomfilter *filter) {
+    // Check our args
+    if (map == NULL || params == NULL || params->k_num < 1 ||
+            params->layout > LAYOUT_CUCKOO || params->hash_family > HASH_CLIENT || params->index_mode > INDEX_POW2 ||
+            params->bit_order > BIT_ORDER_WORD) {
+        return -EINVAL;
+    }
+
+    // Check the size of the map
+    if (map->size < sizeof(bloom_filter_header)) {
+        return -ENOMEM;
+    }
+
+    // Setup the pointers
+    filter->map = map;
+    filter->header = (bloom_filter_header*)map->mmap;
+    filter->set_bits = (new_filter) ? 0 : BITS_UNKNOWN;
+
+    // Get the bitmap size
+    filter->bitmap_size = (map->size - sizeof(bloom_filter_header)) * 8;
+
+    // Setup the header if it is new
+    if (new_filter) {
+        // A blocked filter needs at least a single block
+        if (params->layout == LAYOUT_BLOCKED && filter->bitmap_size < BLOOM_BLOCK_BITS) {
+            return -ENOMEM;
+        }
+
+        // A cuckoo filter sizes its fingerprints from the probability,
+        // and needs at least a single bucket
+        uint32_t fp_bits = 0;
+        if (params->layout == LAYOUT_CUCKOO) {
+            if (params->fp_probability <= 0 || params->fp_probability >= 1) {
+                return -EINVAL;
+            }
+            fp_bits = bf_cuckoo_fp_bits(params->fp_probability);
+            if (map->size < sizeof(bloom_filter_header) + CUCKOO_PAD_BYTES + (fp_bits * BLOOM_CUCKOO_SLOTS + 7) / 8) {
+                return -ENOMEM;
+            }
+        }
+
+        switch (params->layout) {
+            case LAYOUT_BLOCKED:
+                filter->header->magic = BLOCKED_MAGIC_HEADER;
+                break;
+            case LAYOUT_COUNTING:
+                filter->header->magic = COUNTING_MAGIC_HEADER;
+                break;
+            case LAYOUT_CUCKOO:
+                filter->header->magic = CUCKOO_MAGIC_HEADER;
+                break;
+            default:
+                filter->header->magic = MAGIC_HEADER;
+                break;
+        }
+        filter->header->k_num = (params->layout == LAYOUT_CUCKOO) ? 2 : params->k_num;
+        filter->header->count = 0;
+        filter->header->hash_family = params->hash_family;
+        filter->header->index_mode = params->index_mode;
+        filter->header->bit_order = params->bit_order;
+        filter->header->fp_bits = fp_bits;
+        filter->header->has_victim = 0;
+        filter->header->capacity = params->capacity;
+        bitmap_mark_dirty(map, 0);
+
+        // Since this is a new filter, force a flush of
+        // the headers. This mainly affects bitmaps that
+        // are in the PERSIST mode. Since no flush happens
+        // until the first key is set, it can cause filters
+        // to be created that have no headers, and thus cannot
+        // be loaded.
+        bf_flush(filter);
+
+    // Check for the header if not new
+    } else if (filter->header->magic != MAGIC_HEADER &&
+               filter->header->magic != BLOCKED_MAGIC_HEADER &&
+               filter->header->magic != COUNTING_MAGIC_HEADER &&
+               filter->header->magic != CUCKOO_MAGIC_HEADER) {
+        syslog(LOG_ERR, "Magic byte for bloom filter is wrong! Aborting load.");
+        return -1;
+
+    // Check that the fingerprints are sane
+    } else if (filter->header->magic == CUCKOO_MAGIC_HEADER &&
+               (filter->header->fp_bits < CUCKOO_MIN_FP_BITS ||
+                filter->header->fp_bits > CUCKOO_MAX_FP_BITS)) {
+        syslog(LOG_ERR, "Bad fingerprint size %d for cuckoo filter! Aborting load.",
+                filter->header->fp_bits);
+        return -1;
+
+    // Check that we know the hash family
+    } else if (filter->header->hash_family > HASH_CLIENT) {
+        syslog(LOG_ERR, "Unknown hash family %d for bloom filter! Aborting load.",
+                filter->header->hash_family);
+        return -1;
+
+    // Check that we know the index mode
+    } else if (filter->header->index_mode > INDEX_POW2) {
+        syslog(LOG_ERR, "Unknown index mode %d for bloom filter! Aborting load.",
+                filter->header->index_mode);
+        return -1;
+
+    // Check that we know the bit order
+    } else if (filter->header->bit_order > BIT_ORDER_WORD) {
+        syslog(LOG_ERR, "Unknown bit order %d for bloom filter! Aborting load.",
+                filter->header->bit_order);
+        return -1;
+    }
+    filter->index_mode = filter->header->index_mode;
+    filter->bit_order = filter->header->bit_order;
+
+    // Determine the layout from the magic
+    if (filter->header->magic == BLOCKED_MAGIC_HEADER) {
+        filter->layout = LAYOUT_BLOCKED;
+        filter->num_blocks = filter->bitmap_size / BLOOM_BLOCK_BITS;
+        if (filter->num_blocks == 0) {
+            syslog(LOG_ERR, "Blocked bloom filter is smaller than a block! Aborting load.");
+            return -1;
+        }
+    } else if (filter->header->magic == COUNTING_MAGIC_HEADER) {
+        filter->layout = LAYOUT_COUNTING;
+        filter->num_blocks = 0;
+        filter->bitmap_size /= BLOOM_COUNTER_BITS;
+    } else if (filter->header->magic == CUCKOO_MAGIC_HEADER) {
+        filter->layout = LAYOUT_CUCKOO;
+        filter->fp_bits = filter->header->fp_bits;
+        uint64_t table_bits = filter->bitmap_size;
+        table_bits = (table_bits > CUCKOO_PAD_BYTES * 8) ? table_bits - CUCKOO_PAD_BYTES * 8 : 0;
+        filter->num_blocks = table_bits / (BLOOM_CUCKOO_SLOTS * filter->fp_bits);
+        if (filter->num_blocks == 0) {
+            syslog(LOG_ERR, "Cuckoo filter is smaller than a bucket! Aborting load.");
+            return -1;
+        }
+    } else {
+        filter->layout = LAYOUT_PARTITIONED;
+        filter->num_blocks = 0;
+    }
+
+    // Setup the offset
+    filter->offset = filter->bitmap_size / filter->header->k_num;
+
+    // Masking needs power of two sizes, round down so
+    // that we never index past the end of the bitmap.
+    // Cuckoo buckets are always reduced by multiply-shift.
+    if (filter->index_mode == INDEX_POW2 && filter->layout != LAYOUT_CUCKOO) {
+        filter->offset = bf_floor_pow2(filter->offset);
+        filter->num_blocks = bf_floor_pow2(filter->num_blocks);
+    }
+
+    // Pick the probe loops unrolled for this k_num
+    bf_select_kernels(filter);
+
+    // Done, return
+    return 0;
+}
+
+
+/*
+ * The probe kernels of the partitioned layout. The generic loops
+ * bound the probes by k_num from the header, so the compiler cannot
+ * unroll them, and reloads the hashes and the index mode on every
+ * probe. A kernel is built for each k_num up to BLOOM_KERNEL_MAX_K,
+ * with k a constant, so the steps past k fold away and the hashes
+ * stay in registers. The index mode and bit order are branched on
+ * once per key, outside the probes.
+ *
+ * A check ANDs the bits of each group of four probes without
+ * branches, so their loads overlap, and only exits between the
+ * groups. Most misses still stop after the first group.
+ */
+
+// The bit of probe i in the partitioned layout
+#define BF_PROBE_BIT(i) (8*sizeof(bloom_filter_header) + (i) * m + bf_reduce(mode, hashes[i], m))
+
+// Tests probe i, exiting after the last probe of a group
+#define BF_CHECK_STEP(i) \
+    if ((i) < k) { \
+        bit = BF_PROBE_BIT(i); \
+        res &= words ? (int)((((uint64_t*)bits)[bit >> 6] >> (bit & 63)) & 1) : \
+                       (bits[bit >> 3] >> (7 - (bit % 8))) & 1; \
+        if (((i) & 3) == 3 && (i) + 1 < k && !res) return 0; \
+    }
+
+// Sets probe i, counting it if it was clear
+#define BF_SET_STEP(i) \
+    if ((i) < k) { \
+        bit = BF_PROBE_BIT(i); \
+        if (words) { \
+            set += !bitmap_getbit_word(map, bit); \
+            bitmap_setbit_word(map, bit); \
+        } else { \
+            set += !bitmap_getbit(map, bit); \
+            bitmap_setbit(map, bit); \
+        } \
+    }
+
+#define BF_STEPS(step) \
+    step(0) step(1) step(2) step(3) step(4) step(5) step(6) step(7) step(8) step(9) \
+    step(10) step(11) step(12) step(13) step(14) step(15) step(16) step(17) step(18) step(19)
+
+static inline __attribute__((always_inline)) int bf_check_k(bloom_bloomfilter *filter,
+        uint64_t *hashes, const uint32_t k, const bloom_index_mode mode, const int words) {
+    const unsigned char *bits = filter->map->mmap;
+    uint64_t m = filter->offset;
+    uint64_t bit;
+    int res = 1;
+    BF_STEPS(BF_CHECK_STEP)
+    return res;
+}
+
+static inline __attribute__((always_inline)) uint32_t bf_set_k(bloom_bloomfilter *filter,
+        uint64_t *hashes, const uint32_t k, const bloom_index_mode mode, const int words) {
+    bloom_bitmap *map = filter->map;
+    uint64_t m = filter->offset;
+    uint64_t bit;
+    uint32_t set = 0;
+    BF_STEPS(BF_SET_STEP)
+    return set;
+}
+
+// Branches on the index mode and bit order, for a constant k
+#define BF_DISPATCH_K(call, k) \
+    int words = (filter->bit_order == BIT_ORDER_WORD); \
+    switch (filter->index_mode) { \
+        case INDEX_FASTRANGE: \
+            if (words) call(filter, hashes, k, INDEX_FASTRANGE, 1); \
+            else call(filter, hashes, k, INDEX_FASTRANGE, 0); \
+            break; \
+        case INDEX_POW2: \
+            if (words) call(filter, hashes, k, INDEX_POW2, 1); \
+            else call(filter, hashes, k, INDEX_POW2, 0); \
+            break; \
+        default: \
+            if (words) call(filter, hashes, k, INDEX_MODULO, 1); \
+            else call(filter, hashes, k, INDEX_MODULO, 0); \
+            break; \
+    }
+
+#define BF_KERNELS(k) \
+    static int bf_check_k##k(bloom_bloomfilter *filter, uint64_t *hashes) { \
+        int res; \
+        BF_DISPATCH_K(res = bf_check_k, k) \
+        return res; \
+    } \
+    static uint32_t bf_set_k##k(bloom_bloomfilter *filter, uint64_t *hashes) { \
+        uint32_t set; \
+        BF_DISPATCH_K(set = bf_set_k, k) \
+        return set; \
+    }
+
+BF_KERNELS(1) BF_KERNELS(2) BF_KERNELS(3) BF_KERNELS(4) BF_KERNELS(5)
+BF_KERNELS(6) BF_KERNELS(7) BF_KERNELS(8) BF_KERNELS(9) BF_KERNELS(10)
+BF_KERNELS(11) BF_KERNELS(12) BF_KERNELS(13) BF_KERNELS(14) BF_KERNELS(15)
+BF_KERNELS(16) BF_KERNELS(17) BF_KERNELS(18) BF_KERNELS(19) BF_KERNELS(20)
+
+static int (*const CHECK_KERNELS[BLOOM_KERNEL_MAX_K + 1])(bloom_bloomfilter*, uint64_t*) = {
+    NULL, bf_check_k1, bf_check_k2, bf_check_k3, bf_check_k4, bf_check_k5,
+    bf_check_k6, bf_check_k7, bf_check_k8, bf_check_k9, bf_check_k10,
+    bf_check_k11, bf_check_k12, bf_check_k13, bf_check_k14, bf_check_k15,
+    bf_check_k16, bf_check_k17, bf_check_k18, bf_check_k19, bf_check_k20
+};
+
+static uint32_t (*const SET_KERNELS[BLOOM_KERNEL_MAX_K + 1])(bloom_bloomfilter*, uint64_t*) = {
+    NULL, bf_set_k1, bf_set_k2, bf_set_k3, bf_set_k4, bf_set_k5,
+    bf_set_k6, bf_set_k7, bf_set_k8, bf_set_k9, bf_set_k10,
+    bf_set_k11, bf_set_k12, bf_set_k13, bf_set_k14, bf_set_k15,
+    bf_set_k16, bf_set_k17, bf_set_k18, bf_set_k19, bf_set_k20
+};
+
+/**
+ * Selects the probe kernels of a filter, once its layout
+ * and k_num are known. Only the partitioned layout has them.
+ */
+static void bf_select_kernels(bloom_bloomfilter *filter) {
+    uint32_t k_num = filter->header->k_num;
+    if (filter->layout == LAYOUT_PARTITIONED && k_num <= BLOOM_KERNEL_MAX_K) {
+        filter->contains_kernel = CHECK_KERNELS[k_num];
+        filter->set_kernel = SET_KERNELS[k_num];
+    } else {
+        filter->contains_kernel = NULL;
+        filter->set_kernel = NULL;
+    }
+}
+
+/**
+ * Internal bf_contains method.
+ * @arg filter The filter
+ * @arg key The key to check
+ * @arg hashes Contains at least K num hashes
+ * @return 0 if not contained, 1 if contained.
+ */
+static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint64_t m = filter->offset;
+    uint64_t offset;
+    uint64_t h;
+    uint32_t i;
+    uint64_t bit;
+    int res;
+
+    if (filter->contains_kernel) {
+        return filter->contains_kernel(filter, hashes);
+    }
+
+    // In the blocked layout, all the bits are in the block
+    // selected by the first hash. The top bits of each hash
+    // pick the bit inside the block, and the whole block is
+    // tested against a mask at once.
+    if (filter->layout == LAYOUT_BLOCKED) {
+        uint64_t mask[BLOOM_BLOCK_BYTES / sizeof(uint64_t)];
+        bf_block_mask(filter, hashes, mask);
+        offset = bf_block_offset(filter, hashes);
+        return bf_block_contains(filter->map->mmap + (offset >> 3), mask);
+    }
+
+    if (filter->layout == LAYOUT_CUCKOO) {
+        return bf_cuckoo_contains(filter, hashes);
+    }
+
+    // In the counting layout, every counter must be non-zero
+    if (filter->layout == LAYOUT_COUNTING) {
+        int shift;
+        unsigned char *byte;
+        for (i=0; i< filter->header->k_num; i++) {
+            byte = bf_counter_byte(filter, bf_counter_index(filter, i, hashes[i]), &shift);
+            if (((*byte >> shift) & BLOOM_COUNTER_MAX) == 0) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    int words = (filter->bit_order == BIT_ORDER_WORD);
+    for (i=0; i< filter->header->k_num; i++) {
+        h = hashes[i];                                  // Get the hash value
+        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
+        bit = offset + bf_reduce(filter->index_mode, h, m); // Compute the bit offset
+        res = words ? bitmap_getbit_word(filter->map, bit) : bitmap_getbit(filter->map, bit);
+        if (res == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Adds to the count of set bits of a filter, unless it has not
+ * been counted yet. The caller has the filter to itself, so the
+ * update is not atomic, it is only made whole for racing reads.
+ */
+static inline void bf_count_bits(bloom_bloomfilter *filter, int64_t delta) {
+    uint64_t set = __atomic_load_n(&filter->set_bits, __ATOMIC_RELAXED);
+    if (!delta || set == BITS_UNKNOWN) return;
+    __atomic_store_n(&filter->set_bits, set + delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds to the count of set bits of a filter, unless it has not
+ * been counted yet, racing with other atomic adds.
+ */
+static inline void bf_count_bits_atomic(bloom_bloomfilter *filter, uint64_t delta) {
+    if (!delta || __atomic_load_n(&filter->set_bits, __ATOMIC_RELAXED) == BITS_UNKNOWN) return;
+    __atomic_add_fetch(&filter->set_bits, delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * Internal method to set the bits for a key.
+ * @arg filter The filter
+ * @arg hashes Contains at least K num hashes
+ * @return The number of bits that were clear, or counters that were zero.
+ */
+static uint32_t bf_internal_set(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint64_t m = filter->offset;
+    uint64_t offset;
+    uint64_t h;
+    uint32_t i;
+    uint64_t bit;
+    uint32_t set = 0;
+
+    if (filter->set_kernel) {
+        return filter->set_kernel(filter, hashes);
+    }
+
+    if (filter->layout == LAYOUT_BLOCKED) {
+        uint64_t mask[BLOOM_BLOCK_BYTES / sizeof(uint64_t)];
+        bf_block_mask(filter, hashes, mask);
+        offset = bf_block_offset(filter, hashes);
+
+        // Blocks are 64 byte aligned, so the words are aligned
+        uint64_t *block = (uint64_t*)(filter->map->mmap + (offset >> 3));
+        for (i=0; i < BLOOM_BLOCK_BYTES / sizeof(uint64_t); i++) {
+            set += __builtin_popcountll(mask[i] & ~block[i]);
+        }
+        bf_block_set((unsigned char*)block, mask);
+
+        // Blocks are page aligned, so they have a single page
+        bitmap_mark_dirty(filter->map, offset);
+        return set;
+    }
+
+    // Increment the counters, saturated counters are left alone
+    if (filter->layout == LAYOUT_COUNTING) {
+        int shift;
+        unsigned char *byte, val;
+        for (i=0; i< filter->header->k_num; i++) {
+            byte = bf_counter_byte(filter, bf_counter_index(filter, i, hashes[i]), &shift);
+            val = (*byte >> shift) & BLOOM_COUNTER_MAX;
+            if (val == BLOOM_COUNTER_MAX) continue;
+            set += (val == 0);
+            *byte += 1 << shift;
+            bitmap_mark_dirty(filter->map, (byte - filter->map->mmap) * 8);
+        }
+        return set;
+    }
+
+    int words = (filter->bit_order == BIT_ORDER_WORD);
+    for (i=0; i< filter->header->k_num; i++) {
+        h = hashes[i];                                  // Get the hash value
+        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
+        bit = offset + bf_reduce(filter->index_mode, h, m); // Compute the bit offset
+        if (words) {
+            set += !bitmap_getbit_word(filter->map, bit);
+            bitmap_setbit_word(filter->map, bit);
+        } else {
+            set += !bitmap_getbit(filter->map, bit);
+            bitmap_setbit(filter->map, bit);
+        }
+    }
+    return set;
+}
+
+
+/**
+ * Adds a new key to the bloom filter.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int bf_add(bloom_bloomfilter *filter, char* key) {
+    return bf_add_len(filter, key, strlen(key));
+}
+
+/**
+ * Adds a new key of a given length to the bloom filter.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @arg len The length of the key
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int bf_add_len(bloom_bloomfilter *filter, const char* key, uint64_t len) {
+    // Allocate the hash space, the hash functions always produce 4.
+    // A fixed array covers the k_num of the kernels without alloca.
+    uint32_t num_hashes = (filter->header->k_num < 4) ? 4 : filter->header->k_num;
+    uint64_t fixed[BLOOM_KERNEL_MAX_K];
+    uint64_t *hashes = (num_hashes <= BLOOM_KERNEL_MAX_K) ? fixed : alloca(num_hashes * sizeof(uint64_t));
+
+    // Compute the hashes
+    bf_compute_hashes_len(filter->header->hash_family, filter->header->k_num, key, len, hashes);
+
+    // Add using the hashes
+    return bf_add_hashed(filter, hashes);
+}
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains(bloom_bloomfilter *filter, char* key) {
+    return bf_contains_len(filter, key, strlen(key));
+}
+
+/**
+ * Checks the filter for a key of a given length
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @arg len The length of the key
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains_len(bloom_bloomfilter *filter, const char* key, uint64_t len) {
+    // Allocate the hash space, the hash functions always produce 4.
+    // A fixed array covers the k_num of the kernels without alloca.
+    uint32_t num_hashes = (filter->header->k_num < 4) ? 4 : filter->header->k_num;
+    uint64_t fixed[BLOOM_KERNEL_MAX_K];
+    uint64_t *hashes = (num_hashes <= BLOOM_KERNEL_MAX_K) ? fixed : alloca(num_hashes * sizeof(uint64_t));
+
+    // Compute the hashes
+    bf_compute_hashes_len(filter->header->hash_family, filter->header->k_num, key, len, hashes);
+
+    // Use the internal contains method
+    return bf_internal_contains(filter, hashes);
+}
+
+/**
+ * Adds a new key to the bloom filter using precomputed hashes.
+ * The counting layout increments the counters of a key that is
+ * already present as well, so that a set of a false positive is
+ * counted, and unsetting the key it collides with leaves it.
+ * @arg filter The filter to add to
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * hashes computed with the hash family of the filter.
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int bf_add_hashed(bloom_bloomfilter *filter, uint64_t *hashes) {
+    // Check if the item exists
+    if (bf_internal_contains(filter, hashes) == 1) {
+        if (filter->layout == LAYOUT_COUNTING) bf_internal_set(filter, hashes);
+        return 0;  // Key already present, do not add.
+    }
+
+    // Insert the fingerprint, this may find the table full
+    if (filter->layout == LAYOUT_CUCKOO) {
+        int res = bf_cuckoo_insert(filter, hashes);
+        if (res != 0) return res;
+
+    // Set the bits
+    } else {
+        bf_count_bits(filter, bf_internal_set(filter, hashes));
+    }
+    filter->header->count += 1;
+    bitmap_mark_dirty(filter->map, 0);
+    return 1;
+}
+
+/**
+ * Adds a new key to the bloom filter using precomputed hashes.
+ * Bits are set with atomic operations, and the count is updated
+ * atomically, so this is safe to call concurrently with other
+ * atomic adds and with checks of the same filter.
+ * @arg filter The filter to add to
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * hashes computed with the hash family of the filter.
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bf_add_hashed_atomic(bloom_bloomfilter *filter, uint64_t *hashes) {
+    if (filter->layout == LAYOUT_CUCKOO) {
+        return -EINVAL;
+    }
+
+    // Avoid the atomic operations if the key is present
+    if (bf_internal_contains(filter, hashes) == 1) {
+        return 0;
+    }
+
+    // Another thread may be adding the same key, so the
+    // key is only new if we changed at least one bit
+    uint32_t changed = 0;
+    if (filter->layout == LAYOUT_COUNTING) {
+        changed = bf_counting_add_atomic(filter, hashes);
+
+    } else if (filter->layout == LAYOUT_BLOCKED) {
+        uint64_t mask[BLOOM_BLOCK_BYTES / sizeof(uint64_t)];
+        bf_block_mask(filter, hashes, mask);
+        uint64_t offset = bf_block_offset(filter, hashes);
+
+        // Blocks are 64 byte aligned, so the words are aligned
+        uint64_t *words = (uint64_t*)(filter->map->mmap + (offset >> 3));
+        uint64_t old;
+        for (unsigned i=0; i < BLOOM_BLOCK_BYTES / sizeof(uint64_t); i++) {
+            if (!mask[i]) continue;
+            old = __atomic_fetch_or(words + i, mask[i], __ATOMIC_RELAXED);
+            changed += __builtin_popcountll(mask[i] & ~old);
+        }
+        if (changed) bitmap_mark_dirty_atomic(filter->map, offset);
+
+    } else {
+        uint64_t m = filter->offset;
+        uint64_t bit;
+        int words = (filter->bit_order == BIT_ORDER_WORD);
+        for (uint32_t i=0; i< filter->header->k_num; i++) {
+            bit = 8*sizeof(bloom_filter_header) + i * m + bf_reduce(filter->index_mode, hashes[i], m);
+            if (words)
+                changed += bitmap_test_and_set_word(filter->map, bit);
+            else
+                changed += bitmap_setbit_atomic(filter->map, bit);
+        }
+    }
+    if (!changed) return 0;
+    bf_count_bits_atomic(filter, changed);
+
+    // The header is packed, so go through an explicit pointer
+    uint64_t *count = (uint64_t*)((char*)filter->header + offsetof(bloom_filter_header, count));
+    __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+    bitmap_mark_dirty_atomic(filter->map, 0);
+    return 1;
+}
+
+/**
+ * A word update of a sorted batch add. Entries of a
+ * key are made in order, and the sort is stable, so
+ * the entries of a word stay in key order.
+ */
+typedef struct {
+    uint64_t word;      // Index of the 64bit word in the bitmap
+    uint64_t mask;      // Bits to set, little endian in byte order
+    uint32_t key;       // Index of the key in the batch
+} bf_batch_entry;
+
+/**
+ * Stable LSD radix sort of batch entries by word. Digits
+ * above the largest word are skipped, so small filters
+ * take fewer passes.
+ * @return The sorted entries, either entries or tmp.
+ */
+static bf_batch_entry* bf_sort_batch(bf_batch_entry *entries, bf_batch_entry *tmp, uint64_t num, uint64_t max_word) {
+    uint64_t counts[1 << BLOOM_BATCH_RADIX_BITS];
+    uint64_t mask = (1 << BLOOM_BATCH_RADIX_BITS) - 1;
+    bf_batch_entry *swap;
+    uint64_t sum, c;
+    for (int shift=0; shift < 64 && (max_word >> shift); shift += BLOOM_BATCH_RADIX_BITS) {
+        memset(counts, 0, sizeof(counts));
+        for (uint64_t i=0; i < num; i++) counts[(entries[i].word >> shift) & mask]++;
+        sum = 0;
+        for (uint64_t d=0; d <= mask; d++) {
+            c = counts[d];
+            counts[d] = sum;
+            sum += c;
+        }
+        for (uint64_t i=0; i < num; i++) tmp[counts[(entries[i].word >> shift) & mask]++] = entries[i];
+        swap = entries;
+        entries = tmp;
+        tmp = swap;
+    }
+    return entries;
+}
+
+/**
+ * Adds many keys using precomputed hashes. The bits of the whole
+ * batch are computed first and radix sorted by the word they
+ * fall in, so the bitmap is updated in a single sweep of word
+ * ORs, with the words ahead prefetched. Pages are dirtied in
+ * order, instead of at random for each key. The results are the
+ * same as adding the keys in turn with bf_add_hashed.
+ * @arg filter The filter to add to, partitioned or blocked
+ * @arg hashes The hashes of the keys, at least k_num for each key
+ * @arg stride The number of hashes between keys
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if the key was added, 0 if present
+ * @returns The number of keys added, -EINVAL for the counting
+ * and cuckoo layouts, -ENOMEM on failure.
+ */
+int bf_add_batch_hashed(bloom_bloomfilter *filter, uint64_t *hashes, uint32_t stride,
+        int num_keys, char *results) {
+    if (filter->layout == LAYOUT_COUNTING || filter->layout == LAYOUT_CUCKOO) {
+        return -EINVAL;
+    }
+    if (num_keys <= 0) return 0;
+
+    uint32_t k_num = filter->header->k_num;
+    uint64_t per_key = (filter->layout == LAYOUT_BLOCKED) ? BLOOM_BLOCK_BYTES / sizeof(uint64_t) : k_num;
+    bf_batch_entry *entries = malloc(2 * num_keys * per_key * sizeof(bf_batch_entry));
+    if (!entries) return -ENOMEM;
+
+    // Compute the word and mask of every bit
+    int words = (filter->bit_order == BIT_ORDER_WORD);
+    uint64_t num = 0, m = filter->offset, bit;
+    uint64_t *key_hashes;
+    for (int i=0; i < num_keys; i++) {
+        key_hashes = hashes + (uint64_t)i * stride;
+        results[i] = 0;
+        if (filter->layout == LAYOUT_BLOCKED) {
+            uint64_t mask[BLOOM_BLOCK_BYTES / sizeof(uint64_t)];
+            bf_block_mask(filter, key_hashes, mask);
+            uint64_t word = bf_block_offset(filter, key_hashes) >> 6;
+            for (uint32_t j=0; j < BLOOM_BLOCK_BYTES / sizeof(uint64_t); j++) {
+                if (!mask[j]) continue;
+                entries[num].word = word + j;
+                entries[num].mask = words ? mask[j] : bf_load_le64((unsigned char*)(mask + j));
+                entries[num++].key = i;
+            }
+            continue;
+        }
+        for (uint32_t j=0; j < k_num; j++) {
+            bit = 8*sizeof(bloom_filter_header) + j * m + bf_reduce(filter->index_mode, key_hashes[j], m);
+            entries[num].word = bit >> 6;
+            if (words)
+                entries[num].mask = 1ULL << (bit & 63);
+            else
+                entries[num].mask = 1ULL << ((bit & 56) + 7 - (bit & 7));
+            entries[num++].key = i;
+        }
+    }
+
+    // Sort by word, so the bitmap is swept in address order
+    bf_batch_entry *sorted = bf_sort_batch(entries, entries + num, num, filter->map->size >> 3);
+
+    // Apply the ORs a word at a time. A key is new if any of its
+    // bits was clear before it, as the keys before it in the batch
+    // have already been applied to the word.
+    unsigned char *mmap = filter->map->mmap;
+    uint64_t last_page = UINT64_MAX;
+    uint64_t i = 0, word, val, old, set = 0;
+    while (i < num) {
+        word = sorted[i].word;
+        if (i + BLOOM_BATCH_PREFETCH < num) {
+            __builtin_prefetch(mmap + (sorted[i + BLOOM_BATCH_PREFETCH].word << 3), 1, 0);
+        }
+        val = old = words ? ((uint64_t*)mmap)[word] : bf_load_le64(mmap + (word << 3));
+        for (; i < num && sorted[i].word == word; i++) {
+            if ((val & sorted[i].mask) != sorted[i].mask) {
+                results[sorted[i].key] = 1;
+                val |= sorted[i].mask;
+            }
+        }
+        if (val == old) continue;
+        set += __builtin_popcountll(val ^ old);
+        if (words)
+            ((uint64_t*)mmap)[word] = val;
+        else
+            bf_store_le64(mmap + (word << 3), val);
+
+        // Pages only change in order, so each is marked once
+        if ((word >> 9) != last_page) {
+            last_page = word >> 9;
+            bitmap_mark_dirty(filter->map, word << 6);
+        }
+    }
+    free(entries);
+
+    int added = 0;
+    for (int k=0; k < num_keys; k++) added += results[k];
+    filter->header->count += added;
+    bf_count_bits(filter, set);
+    bitmap_mark_dirty(filter->map, 0);
+    return added;
+}
+
+/**
+ * Increments the counters of a key with compare and swap
+ * on the bytes holding them. Racing adds of the same key
+ * may both increment, which only delays a later removal.
+ * @return The number of counters that were zero.
+ */
+static uint32_t bf_counting_add_atomic(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint32_t changed = 0;
+    int shift;
+    unsigned char *byte, old, val;
+    for (uint32_t i=0; i< filter->header->k_num; i++) {
+        byte = bf_counter_byte(filter, bf_counter_index(filter, i, hashes[i]), &shift);
+        old = __atomic_load_n(byte, __ATOMIC_RELAXED);
+        do {
+            val = (old >> shift) & BLOOM_COUNTER_MAX;
+            if (val == BLOOM_COUNTER_MAX) break;
+        } while (!__atomic_compare_exchange_n(byte, &old, old + (1 << shift), 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if (val == BLOOM_COUNTER_MAX) continue;
+        changed += (val == 0);
+        bitmap_mark_dirty_atomic(filter->map, (byte - filter->map->mmap) * 8);
+    }
+    return changed;
+}
+
+/**
+ * Removes a key from a counting filter using precomputed hashes.
+ * The counters of the key are only decremented if it is present.
+ * @arg filter The filter to remove from
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * hashes computed with the hash family of the filter.
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filter does not use the counting layout.
+ */
+int bf_remove_hashed(bloom_bloomfilter *filter, uint64_t *hashes) {
+    if (filter->layout == LAYOUT_CUCKOO) {
+        return bf_cuckoo_remove(filter, hashes);
+    }
+    if (filter->layout != LAYOUT_COUNTING) {
+        return -EINVAL;
+    }
+    if (bf_internal_contains(filter, hashes) == 0) {
+        return 0;
+    }
+
+    // Decrement the counters, saturated counters are left alone
+    int shift;
+    unsigned char *byte, val;
+    int64_t cleared = 0;
+    for (uint32_t i=0; i< filter->header->k_num; i++) {
+        byte = bf_counter_byte(filter, bf_counter_index(filter, i, hashes[i]), &shift);
+        val = (*byte >> shift) & BLOOM_COUNTER_MAX;
+        if (val == BLOOM_COUNTER_MAX) continue;
+        cleared += (val == 1);
+        *byte -= 1 << shift;
+        bitmap_mark_dirty(filter->map, (byte - filter->map->mmap) * 8);
+    }
+    bf_count_bits(filter, -cleared);
+    if (filter->header->count > 0) filter->header->count -= 1;
+    bitmap_mark_dirty(filter->map, 0);
+    return 1;
+}
+
+/**
+ * Removes a key from a counting filter.
+ * @arg filter The filter to remove from
+ * @arg key The key to remove
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filter does not use the counting layout.
+ */
+int bf_remove(bloom_bloomfilter *filter, char* key) {
+    return bf_remove_len(filter, key, strlen(key));
+}
+
+/**
+ * Removes a key of a given length from a counting or cuckoo filter.
+ * @arg filter The filter to remove from
+ * @arg key The key to remove
+ * @arg len The length of the key
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filter does not use the counting or cuckoo layout.
+ */
+int bf_remove_len(bloom_bloomfilter *filter, const char* key, uint64_t len) {
+    // Allocate the hash space, the hash functions always produce 4.
+    // A fixed array covers the k_num of the kernels without alloca.
+    uint32_t num_hashes = (filter->header->k_num < 4) ? 4 : filter->header->k_num;
+    uint64_t fixed[BLOOM_KERNEL_MAX_K];
+    uint64_t *hashes = (num_hashes <= BLOOM_KERNEL_MAX_K) ? fixed : alloca(num_hashes * sizeof(uint64_t));
+    bf_compute_hashes_len(filter->header->hash_family, filter->header->k_num, key, len, hashes);
+    return bf_remove_hashed(filter, hashes);
+}
+
+/**
+ * Returns the slot holding a fingerprint in a bucket, or -1.
+ */
+static int64_t bf_cuckoo_find(bloom_bloomfilter *filter, uint64_t bucket, uint32_t fp) {
+    uint64_t slot = bucket * BLOOM_CUCKOO_SLOTS;
+    for (int i=0; i < BLOOM_CUCKOO_SLOTS; i++) {
+        if (bf_cuckoo_get(filter, slot + i) == fp) return slot + i;
+    }
+    return -1;
+}
+
+/**
+ * Stores a fingerprint in an empty slot of a bucket.
+ * @return 1 if stored, 0 if the bucket is full.
+ */
+static int bf_cuckoo_place(bloom_bloomfilter *filter, uint64_t bucket, uint32_t fp) {
+    int64_t slot = bf_cuckoo_find(filter, bucket, 0);
+    if (slot < 0) return 0;
+    bf_cuckoo_put(filter, slot, fp);
+    return 1;
+}
+
+/**
+ * Checks both buckets of a key, and the left over fingerprint.
+ */
+static int bf_cuckoo_contains(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint32_t fp = bf_cuckoo_fingerprint(filter, hashes);
+    uint64_t b1 = bf_cuckoo_bucket(filter, hashes);
+    uint64_t b2 = bf_cuckoo_alt(filter, b1, fp);
+    if (bf_cuckoo_find(filter, b1, fp) >= 0 || bf_cuckoo_find(filter, b2, fp) >= 0) {
+        return 1;
+    }
+    bloom_filter_header *header = filter->header;
+    return header->has_victim && header->victim_fp == fp &&
+        (header->victim_bucket == b1 || header->victim_bucket == b2);
+}
+
+/**
+ * Inserts the fingerprint of a key. If both buckets are full,
+ * random fingerprints are evicted to their other bucket. If that
+ * does not find a free slot, the last evicted fingerprint is kept
+ * in the header, and further inserts that need evictions fail.
+ * @return 0 on success, -ENOSPC if the table is full.
+ */
+static int bf_cuckoo_insert(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint32_t fp = bf_cuckoo_fingerprint(filter, hashes);
+    uint64_t bucket = bf_cuckoo_bucket(filter, hashes);
+    uint64_t alt = bf_cuckoo_alt(filter, bucket, fp);
+    if (bf_cuckoo_place(filter, bucket, fp) || bf_cuckoo_place(filter, alt, fp)) {
+        return 0;
+    }
+    bloom_filter_header *header = filter->header;
+    if (header->has_victim) return -ENOSPC;
+
+    // Evictions are picked by an xorshift seeded by the key,
+    // so they are reproducible without any shared state
+    uint64_t rng = (hashes[0] ^ hashes[1]) | 1;
+    if (rng & 2) bucket = alt;
+
+    uint32_t old;
+    uint64_t slot;
+    for (int n=0; n < BLOOM_CUCKOO_MAX_KICKS; n++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        slot = bucket * BLOOM_CUCKOO_SLOTS + (rng % BLOOM_CUCKOO_SLOTS);
+        old = bf_cuckoo_get(filter, slot);
+        bf_cuckoo_put(filter, slot, fp);
+        fp = old;
+        bucket = bf_cuckoo_alt(filter, bucket, fp);
+        if (bf_cuckoo_place(filter, bucket, fp)) return 0;
+    }
+
+    // Hold onto the homeless fingerprint
+    header->victim_fp = fp;
+    header->victim_bucket = bucket;
+    header->has_victim = 1;
+    bitmap_mark_dirty(filter->map, 0);
+    return 0;
+}
+
+/**
+ * Removes the fingerprint of a key, and then tries
+ * to move the left over fingerprint into the table.
+ * @return 1 if removed, 0 if not present.
+ */
+static int bf_cuckoo_remove(bloom_bloomfilter *filter, uint64_t *hashes) {
+    bloom_filter_header *header = filter->header;
+    uint32_t fp = bf_cuckoo_fingerprint(filter, hashes);
+    uint64_t b1 = bf_cuckoo_bucket(filter, hashes);
+    uint64_t b2 = bf_cuckoo_alt(filter, b1, fp);
+
+    int64_t slot = bf_cuckoo_find(filter, b1, fp);
+    if (slot < 0) slot = bf_cuckoo_find(filter, b2, fp);
+    if (slot >= 0) {
+        bf_cuckoo_put(filter, slot, 0);
+    } else if (header->has_victim && header->victim_fp == fp &&
+            (header->victim_bucket == b1 || header->victim_bucket == b2)) {
+        header->has_victim = 0;
+    } else {
+        return 0;
+    }
+
+    // There may be room for the left over fingerprint now
+    if (header->has_victim) {
+        uint64_t bucket = header->victim_bucket;
+        if (bf_cuckoo_place(filter, bucket, header->victim_fp) ||
+            bf_cuckoo_place(filter, bf_cuckoo_alt(filter, bucket, header->victim_fp), header->victim_fp)) {
+            header->has_victim = 0;
+        }
+    }
+    if (header->count > 0) header->count -= 1;
+    bitmap_mark_dirty(filter->map, 0);
+    return 1;
+}
+
+/**
+ * Checks the filter for a key using precomputed hashes.
+ * @arg filter The filter to check
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * hashes computed with the hash family of the filter.
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains_hashed(bloom_bloomfilter *filter, uint64_t *hashes) {
+    return bf_internal_contains(filter, hashes);
+}
+
+/**
+ * Issues prefetches for all the bits a key would probe. Used
+ * to overlap the memory accesses of many keys in batch paths.
+ * @arg filter The filter to prefetch in
+ * @arg hashes The hashes of the key, must contain at least k_num
+ */
+void bf_prefetch_hashed(bloom_bloomfilter *filter, uint64_t *hashes) {
+    unsigned char *mmap = filter->map->mmap;
+
+    // The blocked layout only needs the single cache line
+    if (filter->layout == LAYOUT_BLOCKED) {
+        __builtin_prefetch(mmap + (bf_block_offset(filter, hashes) >> 3), 0, 0);
+        return;
+    }
+
+    // Both buckets of the cuckoo layout
+    if (filter->layout == LAYOUT_CUCKOO) {
+        int shift;
+        uint32_t fp = bf_cuckoo_fingerprint(filter, hashes);
+        uint64_t bucket = bf_cuckoo_bucket(filter, hashes);
+        __builtin_prefetch(bf_cuckoo_slot(filter, bucket * BLOOM_CUCKOO_SLOTS, &shift), 0, 0);
+        bucket = bf_cuckoo_alt(filter, bucket, fp);
+        __builtin_prefetch(bf_cuckoo_slot(filter, bucket * BLOOM_CUCKOO_SLOTS, &shift), 0, 0);
+        return;
+    }
+
+    if (filter->layout == LAYOUT_COUNTING) {
+        int shift;
+        for (uint32_t i=0; i< filter->header->k_num; i++) {
+            __builtin_prefetch(bf_counter_byte(filter, bf_counter_index(filter, i, hashes[i]), &shift), 0, 0);
+        }
+        return;
+    }
+
+    uint64_t m = filter->offset;
+    uint64_t bit;
+    for (uint32_t i=0; i< filter->header->k_num; i++) {
+        bit = 8*sizeof(bloom_filter_header) + i * m + bf_reduce(filter->index_mode, hashes[i], m);
+        __builtin_prefetch(mmap + (bit >> 3), 0, 0);
+    }
+}
+
+/**
+ * Returns the size of the bloom filter in item count
+ */
+uint64_t bf_size(bloom_bloomfilter *filter) {
+    // Read it from the file header directly
+    return filter->header->count;
+}
+
+/**
+ * Estimates the number of distinct keys in the filter.
+ * @note The set bits of a filter that was loaded are counted by
+ * the first estimate. Adds racing with that count may be missed.
+ * @arg filter The filter
+ * @return The estimated number of distinct keys.
+ */
+uint64_t bf_estimate_size(bloom_bloomfilter *filter) {
+    if (filter->layout == LAYOUT_CUCKOO) {
+        // The header is packed, so go through an explicit pointer
+        uint64_t *count = (uint64_t*)((char*)filter->header + offsetof(bloom_filter_header, count));
+        return __atomic_load_n(count, __ATOMIC_RELAXED);
+    }
+
+    // Only the bits or counters the keys map to are counted. Each
+    // key sets one in each partition, or k_num in a single block.
+    double m;
+    switch (filter->layout) {
+        case LAYOUT_BLOCKED:
+            m = (double)filter->num_blocks * BLOOM_BLOCK_BITS;
+            break;
+        default:
+            m = (double)filter->offset * filter->header->k_num;
+            break;
+    }
+
+    // The adds keep the count once the bits have been counted
+    uint64_t set_bits = __atomic_load_n(&filter->set_bits, __ATOMIC_RELAXED);
+    if (set_bits == BITS_UNKNOWN) {
+        uint64_t data_bytes = filter->map->size - sizeof(bloom_filter_header);
+        uint64_t counted = bf_popcount(filter->map->mmap + sizeof(bloom_filter_header),
+                data_bytes, filter->layout == LAYOUT_COUNTING);
+        if (__atomic_compare_exchange_n(&filter->set_bits, &set_bits, counted, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            set_bits = counted;
+        }
+    }
+
+    // A full filter has no estimate, one less bit bounds it
+    double set = set_bits;
+    uint64_t estimate = 0;
+    if (m > 0) {
+        if (set >= m) set = m - 1;
+        estimate = llround(-(m / filter->header->k_num) * log1p(-set / m));
+    }
+    return estimate;
+}
+
+/**
+ * Flushes the filter, and updates the metadata.
+ * @return 0 on success, negative on failure.
+ */
+int bf_flush(bloom_bloomfilter *filter) {
+    // Flush the bitmap if we have one
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    return bitmap_flush(filter->map);
+}
+
+/**
+ * Flushes and closes the filter. Closes the underlying bitmap,
+ * but does not free it.
+ * @return 0 on success, negative on failure.
+ */
+int bf_close(bloom_bloomfilter *filter) {
+    // Make sure we have a filter
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+
+    // Flush first
+    bf_flush(filter);
+
+    // Clean up the map
+    bitmap_close(filter->map);
+    filter->map = NULL;
+
+    // Clear all the fields
+    filter->header = NULL;
+    filter->offset = 0;
+    filter->bitmap_size = 0;
+    filter->num_blocks = 0;
+    filter->fp_bits = 0;
+
+    return 0;
+}
+
+/**
+ * Clears all the keys of a filter in place.
+ * @arg filter The filter to clear
+ * @return 0 on success, negative on failure.
+ */
+int bf_clear(bloom_bloomfilter *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    uint64_t data_bytes = filter->map->size - sizeof(bloom_filter_header);
+    int res = bitmap_zero(filter->map, sizeof(bloom_filter_header), data_bytes);
+    if (res) return res;
+    filter->header->count = 0;
+    filter->header->has_victim = 0;
+    filter->header->victim_fp = 0;
+    filter->header->victim_bucket = 0;
+    filter->set_bits = 0;
+    bitmap_remark_dirty(filter->map, 0, sizeof(bloom_filter_header));
+    return 0;
+}
+
+/**
+ * Checks if the keys of one filter can be merged into another.
+ * @arg dst The filter to merge into
+ * @arg src The filter to merge from
+ * @return 1 if the filters can be merged, 0 otherwise.
+ */
+int bf_can_merge(bloom_bloomfilter *dst, bloom_bloomfilter *src) {
+    uint64_t parts, part_bytes, src_part_bytes;
+    return bf_merge_geometry(dst, src, &parts, &part_bytes, &src_part_bytes) == 0;
+}
+
+/**
+ * Merges the keys of a filter into another.
+ * @arg dst The filter to merge into
+ * @arg src The filter to merge from, which is left as is
+ * @return 0 on success, -EINVAL if the filters cannot be merged.
+ */
+int bf_merge(bloom_bloomfilter *dst, bloom_bloomfilter *src) {
+    int res = bf_combine(dst, src, 0);
+    if (res) return res;
+    dst->header->count += src->header->count;
+    dst->header->capacity += src->header->capacity;
+    return 0;
+}
+
+/**
+ * Intersects the keys of a filter with another.
+ * @arg dst The filter to intersect into
+ * @arg src The filter to intersect with, which is left as is
+ * @return 0 on success, -EINVAL if the filters cannot be intersected.
+ */
+int bf_intersect(bloom_bloomfilter *dst, bloom_bloomfilter *src) {
+    int res = bf_combine(dst, src, 1);
+    if (res) return res;
+    if (src->header->count < dst->header->count) {
+        dst->header->count = src->header->count;
+    }
+    return 0;
+}
+
+/**
+ * Combines the data of src into dst, OR-ing (or AND-ing) bits, and
+ * adding (or taking the minimum of) counters. Filters of the same
+ * size are combined a word at a time, which the compiler vectorizes.
+ * @return 0 on success, -EINVAL if the filters cannot be combined.
+ */
+static int bf_combine(bloom_bloomfilter *dst, bloom_bloomfilter *src, int intersect) {
+    uint64_t parts, part_bytes, src_part_bytes;
+    int res = bf_merge_geometry(dst, src, &parts, &part_bytes, &src_part_bytes);
+    if (res) return res;
+
+    unsigned char *base = dst->map->mmap + sizeof(bloom_filter_header);
+    unsigned char *src_base = src->map->mmap + sizeof(bloom_filter_header);
+    dst->set_bits = BITS_UNKNOWN;
+    if (dst->map->size == src->map->size && dst->layout != LAYOUT_COUNTING) {
+        bf_combine_words(base, src_base, part_bytes, intersect);
+        bitmap_remark_dirty(dst->map, 0, dst->map->size);
+        return 0;
+    }
+
+    unsigned char *out, *in;
+    unsigned int lo, hi, in_lo, in_hi;
+    for (uint64_t p=0; p < parts; p++) {
+        out = base + p * part_bytes;
+        in = src_base + p * src_part_bytes;
+
+        // Repeat the source part across the destination part
+        for (uint64_t t=0; t < part_bytes; t++, out++) {
+            if (dst->layout != LAYOUT_COUNTING) {
+                if (intersect)
+                    *out &= in[t & (src_part_bytes - 1)];
+                else
+                    *out |= in[t & (src_part_bytes - 1)];
+                continue;
+            }
+            lo = *out & 0xF;
+            hi = *out >> 4;
+            in_lo = in[t & (src_part_bytes - 1)] & 0xF;
+            in_hi = in[t & (src_part_bytes - 1)] >> 4;
+            if (intersect) {
+                lo = (in_lo < lo) ? in_lo : lo;
+                hi = (in_hi < hi) ? in_hi : hi;
+            } else {
+                lo += in_lo;
+                hi += in_hi;
+            }
+            *out = ((hi > BLOOM_COUNTER_MAX) ? BLOOM_COUNTER_MAX : hi) << 4 |
+                ((lo > BLOOM_COUNTER_MAX) ? BLOOM_COUNTER_MAX : lo);
+        }
+    }
+    bitmap_remark_dirty(dst->map, 0, sizeof(bloom_filter_header) + parts * part_bytes);
+    return 0;
+}
+
+/**
+ * ORs, or ANDs, len bytes of in into out. The words are
+ * copied through memcpy, since the data is only byte aligned
+ * in general, and the loop is left simple to be vectorized.
+ */
+static void bf_combine_words(unsigned char *out, unsigned char *in, uint64_t len, int intersect) {
+    uint64_t a, b, i = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&a, out + i, 8);
+        memcpy(&b, in + i, 8);
+        a = intersect ? (a & b) : (a | b);
+        memcpy(out + i, &a, 8);
+    }
+    for (; i < len; i++) {
+        out[i] = intersect ? (out[i] & in[i]) : (out[i] | in[i]);
+    }
+}
 
 /**
- * Creates a new bloom filter using a given bitmap and k-value.
- * @arg map A bloom_bitmap pointer.
- * @arg k_num The number of hash functions to use. Ignored if the header value is different.
- * @arg new_filter 1 if new, sets the magic byte and does not check it.
- * @arg filter The filter to setup
- * @return 0 for success. Negative for error.
+ * Creates an empty bit-sliced group with the geometry of a filter.
+ * @return 0 on success, negative on failure.
  */
-int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloomfilter *filter) {
-    // Check our args
-    if (map == NULL || k_num < 1) {
+int bf_slice_init(bloom_bloomfilter *filter, uint32_t max_filters, bloom_slice *slice) {
+    if (filter->layout != LAYOUT_PARTITIONED || max_filters < 1 || max_filters > BLOOM_SLICE_MAX)
         return -EINVAL;
+    slice->k_num = filter->header->k_num;
+    slice->offset = filter->offset;
+    slice->index_mode = filter->index_mode;
+    slice->hash_family = filter->header->hash_family;
+    slice->width = 8;
+    while (slice->width < max_filters) slice->width *= 2;
+    slice->num_filters = 0;
+    slice->words = calloc(slice->k_num * slice->offset, slice->width / 8);
+    return (slice->words) ? 0 : -ENOMEM;
+}
+
+/**
+ * Checks if a filter has the geometry of a bit-sliced group.
+ * @return 1 if it can be added, 0 otherwise.
+ */
+int bf_slice_matches(bloom_slice *slice, bloom_bloomfilter *filter) {
+    return filter->layout == LAYOUT_PARTITIONED &&
+        filter->header->k_num == slice->k_num &&
+        filter->offset == slice->offset &&
+        filter->index_mode == slice->index_mode &&
+        filter->header->hash_family == slice->hash_family;
+}
+
+/**
+ * Sets the bit of a filter in a word of a bit-sliced group
+ */
+static inline void bf_slice_set(bloom_slice *slice, uint64_t pos, uint32_t idx) {
+    switch (slice->width) {
+        case 8: ((uint8_t*)slice->words)[pos] |= 1U << idx; break;
+        case 16: ((uint16_t*)slice->words)[pos] |= 1U << idx; break;
+        case 32: ((uint32_t*)slice->words)[pos] |= 1U << idx; break;
+        default: ((uint64_t*)slice->words)[pos] |= 1ULL << idx; break;
     }
+}
 
-    // Check the size of the map
-    if (map->size < sizeof(bloom_filter_header)) {
-        return -ENOMEM;
+/**
+ * Adds a filter to a bit-sliced group. Only the set bits are
+ * visited, so sparse filters are quick to add.
+ * @return The index of the filter, or negative on failure.
+ */
+int bf_slice_add(bloom_slice *slice, bloom_bloomfilter *filter) {
+    if (!bf_slice_matches(slice, filter)) return -EINVAL;
+    if (slice->num_filters == slice->width) return -ENOSPC;
+    uint32_t idx = slice->num_filters++;
+
+    // The bits of the partitions follow the header, and
+    // the bits past the last partition are not used
+    const unsigned char *bits = filter->map->mmap + sizeof(bloom_filter_header);
+    uint64_t num_bits = slice->k_num * slice->offset;
+    uint64_t word, pos;
+    for (uint64_t w=0; w * 64 < num_bits; w++) {
+        memcpy(&word, bits + w * 8, sizeof(word));
+        if (!word) continue;
+        if (filter->bit_order == BIT_ORDER_BYTE) {
+            // Bit idx is bit 7 - idx % 8 of its byte, so bring
+            // the bytes of the word to the same order as a word
+            for (int b=0; b < 8; b++) {
+                unsigned char byte = bits[w * 8 + b];
+                while (byte) {
+                    pos = w * 64 + b * 8 + (7 - __builtin_ctz(byte));
+                    byte &= byte - 1;
+                    if (pos < num_bits) bf_slice_set(slice, pos, idx);
+                }
+            }
+            continue;
+        }
+        while (word) {
+            pos = w * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+            if (pos < num_bits) bf_slice_set(slice, pos, idx);
+        }
     }
+    return idx;
+}
 
-    // Setup the pointers
-    filter->map = map;
-    filter->header = (bloom_filter_header*)map->mmap;
+/**
+ * Returns a word of a bit-sliced group
+ */
+static inline uint64_t bf_slice_word(bloom_slice *slice, uint64_t pos) {
+    switch (slice->width) {
+        case 8: return ((uint8_t*)slice->words)[pos];
+        case 16: return ((uint16_t*)slice->words)[pos];
+        case 32: return ((uint32_t*)slice->words)[pos];
+        default: return ((uint64_t*)slice->words)[pos];
+    }
+}
 
-    // Get the bitmap size
-    filter->bitmap_size = (map->size - sizeof(bloom_filter_header)) * 8;
+/**
+ * Checks a key in all the filters of a bit-sliced group.
+ * @return A bit set for each filter that contains the key.
+ */
+uint64_t bf_slice_contains_hashed(bloom_slice *slice, uint64_t *hashes) {
+    uint64_t m = slice->offset;
+    uint64_t res = (slice->num_filters == 64) ? UINT64_MAX : (1ULL << slice->num_filters) - 1;
+    for (uint32_t i=0; i < slice->k_num && res; i++) {
+        res &= bf_slice_word(slice, i * m + bf_reduce(slice->index_mode, hashes[i], m));
+    }
+    return res;
+}
 
-    // Setup the header if it is new
-    if (new_filter) {
-        filter->header->magic = MAGIC_HEADER;
-        filter->header->k_num = k_num;
-        filter->header->count = 0;
+/**
+ * Returns the bytes of memory used by a bit-sliced group.
+ */
+uint64_t bf_slice_bytes(bloom_slice *slice) {
+    return slice->k_num * slice->offset * (slice->width / 8);
+}
 
-        // Since this is a new filter, force a flush of
-        // the headers. This mainly affects bitmaps that
-        // are in the PERSIST mode. Since no flush happens
-        // until the first key is set, it can cause filters
-        // to be created that have no headers, and thus cannot
-        // be loaded.
-        bf_flush(filter);
+/**
+ * Frees the words of a bit-sliced group.
+ */
+void bf_slice_destroy(bloom_slice *slice) {
+    free(slice->words);
+    slice->words = NULL;
+    slice->num_filters = 0;
+}
 
-    // Check for the header if not new
-    } else if (filter->header->magic != MAGIC_HEADER) {
-        syslog(LOG_ERR, "Magic byte for bloom filter is wrong! Aborting load.");
-        return -1;
+/**
+ * Estimates the false positive probability of a filter
+ * from the fraction of bits, or counters, that are set.
+ * @arg filter The filter
+ * @return The estimated probability.
+ */
+double bf_estimate_fp_probability(bloom_bloomfilter *filter) {
+    // Each lookup compares against the slots of two buckets
+    if (filter->layout == LAYOUT_CUCKOO) {
+        double fp = 2.0 * filter->header->count / filter->num_blocks / pow(2, filter->fp_bits);
+        return (fp > 1) ? 1 : fp;
     }
 
-    // Setup the offset
-    filter->offset = filter->bitmap_size / filter->header->k_num;
+    uint64_t parts, part_bytes, src_part_bytes;
+    bf_merge_geometry(filter, filter, &parts, &part_bytes, &src_part_bytes);
+    return bf_merge_scan(filter, NULL, parts, part_bytes, src_part_bytes);
+}
 
-    // Done, return
+/**
+ * Estimates the false positive probability of a filter
+ * after merging another into it, without merging them.
+ * @return The estimated probability, or 1 if the filters
+ * cannot be merged.
+ */
+double bf_estimate_merged_fp_probability(bloom_bloomfilter *dst, bloom_bloomfilter *src) {
+    uint64_t parts, part_bytes, src_part_bytes;
+    if (bf_merge_geometry(dst, src, &parts, &part_bytes, &src_part_bytes)) return 1;
+    return bf_merge_scan(dst, src, parts, part_bytes, src_part_bytes);
+}
+
+/**
+ * Returns the factor a filter folds by.
+ * @return The factor, or 0 if the filter cannot be folded.
+ */
+uint32_t bf_fold_factor(bloom_bloomfilter *filter) {
+    for (uint32_t d=2; d <= BLOOM_MAX_FOLD; d++) {
+        if (bf_fold_bytes(filter, d)) return d;
+    }
     return 0;
 }
 
+/**
+ * Returns the bytes of the bitmap a filter folds into.
+ * @return The bytes, or 0 if the filter cannot be folded.
+ */
+uint64_t bf_folded_bytes(bloom_bloomfilter *filter) {
+    uint32_t factor = bf_fold_factor(filter);
+    return (factor) ? bf_fold_bytes(filter, factor) : 0;
+}
 
 /**
- * Internal bf_contains method.
- * @arg filter The filter
- * @arg key The key to check
- * @arg hashes Contains at least K num hashes
- * @return 0 if not contained, 1 if contained.
+ * Estimates the false positive probability of a filter after folding it.
+ * @return The estimated probability, or 1 if the filter cannot be folded.
  */
-static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *hashes) {
-    uint64_t m = filter->offset;
-    uint64_t offset;
-    uint64_t h;
-    uint32_t i;
-    uint64_t bit;
-    int res;
+double bf_estimate_folded_fp_probability(bloom_bloomfilter *filter) {
+    uint32_t factor = bf_fold_factor(filter);
+    if (!factor) return 1;
 
-    for (i=0; i< filter->header->k_num; i++) {
-        h = hashes[i];                                  // Get the hash value
-        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
-        bit = offset + (h % m);                         // Compute the bit offset
-        res = bitmap_getbit(filter->map, bit);
-        if (res == 0) {
-            return 0;
-        }
-    }
-    return 1;
+    // The slices are about independent, so a folded bit
+    // is only clear if all the bits folded into it are
+    double k_num = filter->header->k_num;
+    double fill = pow(bf_estimate_fp_probability(filter), 1 / k_num);
+    return pow(1 - pow(1 - fill, factor), k_num);
 }
 
-
 /**
- * Adds a new key to the bloom filter.
- * @arg filter The filter to add to
- * @arg key The key to add
- * @returns 1 if the key was added, 0 if present. Negative on failure.
+ * Folds a filter into a new filter, smaller by the fold factor.
+ * @arg src The filter to fold
+ * @arg map The zeroed bitmap of the folded filter
+ * @arg dst The folded filter to setup
+ * @return 0 on success, -EINVAL if the filter cannot be folded.
  */
-int bf_add(bloom_bloomfilter *filter, char* key) {
-    // Allocate the hash space
-    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
+int bf_fold(bloom_bloomfilter *src, bloom_bitmap *map, bloom_bloomfilter *dst) {
+    uint32_t factor = bf_fold_factor(src);
+    if (!factor || map == NULL || map->size != bf_fold_bytes(src, factor)) return -EINVAL;
 
-    // Compute the hashes
-    bf_compute_hashes(filter->header->k_num, key, hashes);
+    bloom_filter_params params = {0, src->header->k_num, src->header->capacity / factor, 0, src->layout,
+        src->header->hash_family, src->index_mode, src->bit_order, OPTIMIZE_MEMORY};
+    int res = bf_from_bitmap_params(map, &params, 1, dst);
+    if (res) return res;
 
-    // Check if the item exists
-    int res = bf_internal_contains(filter, hashes);
-    if (res == 1) {
-        return 0;  // Key already present, do not add.
+    if (src->layout == LAYOUT_BLOCKED) {
+        bf_fold_blocks(src, dst, factor);
+    } else if (src->layout == LAYOUT_COUNTING) {
+        bf_fold_counters(src, dst, factor);
+    } else {
+        bf_fold_bits(src, dst, factor);
     }
 
-    uint64_t m = filter->offset;
-    uint64_t offset;
-    uint64_t h;
-    uint32_t i;
-    uint64_t bit;
+    dst->header->count = src->header->count;
+    dst->header->epoch = src->header->epoch;
+    dst->set_bits = BITS_UNKNOWN;
+    return 0;
+}
 
-    for (i=0; i< filter->header->k_num; i++) {
-        h = hashes[i];                                  // Get the hash value
-        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
-        bit = offset + (h % m);                         // Compute the bit offset
-        bitmap_setbit(filter->map, bit);
+/**
+ * Returns the bytes of the bitmap a filter folds into by
+ * a factor, or 0 if the filter cannot be folded by it.
+ */
+static uint64_t bf_fold_bytes(bloom_bloomfilter *filter, uint32_t factor) {
+    switch (filter->layout) {
+        case LAYOUT_BLOCKED:
+            if (filter->num_blocks < factor || filter->num_blocks % factor) return 0;
+            return sizeof(bloom_filter_header) + filter->num_blocks / factor * BLOOM_BLOCK_BYTES;
+        case LAYOUT_CUCKOO:
+            return 0;
+        default:
+            break;
     }
+    if (filter->offset < factor || filter->offset % factor) return 0;
 
-    filter->header->count += 1;
-    return 1;
+    // The partitions are sized from the bitmap, so the smallest
+    // bitmap that holds the slices must give them the same size
+    uint64_t slice = filter->offset / factor;
+    uint32_t k_num = filter->header->k_num;
+    uint64_t bits = (filter->layout == LAYOUT_COUNTING) ? BLOOM_COUNTER_BITS : 1;
+    uint64_t bytes = (k_num * slice * bits + 7) / 8;
+    uint64_t offset = bytes * 8 / bits / k_num;
+    if (filter->index_mode == INDEX_POW2) offset = bf_floor_pow2(offset);
+    if (offset != slice) return 0;
+    return sizeof(bloom_filter_header) + bytes;
 }
 
 /**
- * Checks the filter for a key
- * @arg filter The filter to check
- * @arg key The key to check
- * @returns 1 if present, 0 if not present, negative on error.
+ * Returns the index of the source a slot of a folded
+ * filter takes its i-th input from.
  */
-int bf_contains(bloom_bloomfilter *filter, char* key) {
-    // Allocate the hash space
-    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
-
-    // Compute the hashes
-    bf_compute_hashes(filter->header->k_num, key, hashes);
+static inline uint64_t bf_fold_index(int runs, uint64_t slot, uint64_t slots, uint32_t factor, uint32_t i) {
+    return (runs) ? slot * factor + i : i * slots + slot;
+}
 
-    // Use the internal contains method
-    return bf_internal_contains(filter, hashes);
+/**
+ * Folds the blocks of the blocked layout. Blocks are whole
+ * cache lines, so they are OR-ed a word at a time.
+ */
+static void bf_fold_blocks(bloom_bloomfilter *src, bloom_bloomfilter *dst, uint32_t factor) {
+    unsigned char *in = src->map->mmap + sizeof(bloom_filter_header);
+    unsigned char *out = dst->map->mmap + sizeof(bloom_filter_header);
+    uint64_t blocks = dst->num_blocks;
+    if (src->index_mode == INDEX_FASTRANGE) {
+        for (uint64_t b=0; b < blocks; b++) {
+            for (uint32_t i=0; i < factor; i++) {
+                bf_combine_words(out + b * BLOOM_BLOCK_BYTES,
+                        in + bf_fold_index(1, b, blocks, factor, i) * BLOOM_BLOCK_BYTES, BLOOM_BLOCK_BYTES, 0);
+            }
+        }
+    } else {
+        for (uint32_t i=0; i < factor; i++) {
+            bf_combine_words(out, in + i * blocks * BLOOM_BLOCK_BYTES, blocks * BLOOM_BLOCK_BYTES, 0);
+        }
+    }
+    bitmap_remark_dirty(dst->map, 0, dst->map->size);
 }
 
 /**
- * Returns the size of the bloom filter in item count
+ * Folds the partitions of the partitioned layout. Slices that
+ * start on a word are OR-ed a word at a time, which holds for
+ * both bit orders, and the others a bit at a time.
  */
-uint64_t bf_size(bloom_bloomfilter *filter) {
-    // Read it from the file header directly
-    return filter->header->count;
+static void bf_fold_bits(bloom_bloomfilter *src, bloom_bloomfilter *dst, uint32_t factor) {
+    uint32_t k_num = src->header->k_num;
+    uint64_t slots = dst->offset;
+    uint64_t base = 8 * sizeof(bloom_filter_header);
+    int words = src->bit_order == BIT_ORDER_WORD;
+    int runs = src->index_mode == INDEX_FASTRANGE;
+    if (!runs && slots % 64 == 0) {
+        unsigned char *in = src->map->mmap + sizeof(bloom_filter_header);
+        unsigned char *out = dst->map->mmap + sizeof(bloom_filter_header);
+        for (uint32_t p=0; p < k_num; p++) {
+            for (uint32_t i=0; i < factor; i++) {
+                bf_combine_words(out + p * slots / 8, in + (p * src->offset + i * slots) / 8, slots / 8, 0);
+            }
+        }
+        bitmap_remark_dirty(dst->map, 0, dst->map->size);
+        return;
+    }
+
+    uint64_t bit;
+    int set;
+    for (uint32_t p=0; p < k_num; p++) {
+        for (uint64_t j=0; j < slots; j++) {
+            set = 0;
+            for (uint32_t i=0; i < factor && !set; i++) {
+                bit = base + p * src->offset + bf_fold_index(runs, j, slots, factor, i);
+                set = (words) ? bitmap_getbit_word(src->map, bit) : bitmap_getbit(src->map, bit);
+            }
+            if (!set) continue;
+            bit = base + p * slots + j;
+            if (words) bitmap_setbit_word(dst->map, bit);
+            else bitmap_setbit(dst->map, bit);
+        }
+    }
 }
 
 /**
- * Flushes the filter, and updates the metadata.
- * @return 0 on success, negative on failure.
+ * Folds the partitions of the counting layout. The counters
+ * folded together are added, and saturate at the maximum.
  */
-int bf_flush(bloom_bloomfilter *filter) {
-    // Flush the bitmap if we have one
-    if (filter == NULL || filter->map == NULL) {
-        return -1;
+static void bf_fold_counters(bloom_bloomfilter *src, bloom_bloomfilter *dst, uint32_t factor) {
+    uint32_t k_num = src->header->k_num;
+    uint64_t slots = dst->offset;
+    int runs = src->index_mode == INDEX_FASTRANGE;
+    uint64_t counter;
+    unsigned char *byte;
+    unsigned int sum;
+    int shift;
+    for (uint32_t p=0; p < k_num; p++) {
+        for (uint64_t j=0; j < slots; j++) {
+            sum = 0;
+            for (uint32_t i=0; i < factor && sum < BLOOM_COUNTER_MAX; i++) {
+                counter = p * src->offset + bf_fold_index(runs, j, slots, factor, i);
+                byte = bf_counter_byte(src, counter, &shift);
+                sum += (*byte >> shift) & BLOOM_COUNTER_MAX;
+            }
+            if (!sum) continue;
+            if (sum > BLOOM_COUNTER_MAX) sum = BLOOM_COUNTER_MAX;
+
+            counter = p * slots + j;
+            byte = bf_counter_byte(dst, counter, &shift);
+            *byte |= sum << shift;
+        }
     }
-    return bitmap_flush(filter->map);
+    bitmap_remark_dirty(dst->map, 0, dst->map->size);
 }
 
 /**
- * Flushes and closes the filter. Closes the underlying bitmap,
- * but does not free it.
- * @return 0 on success, negative on failure.
+ * Works out how the bytes of two filters line up for a merge.
+ * The data is split into parts, and byte t of a part of dst
+ * lines up with byte t % src_part_bytes of the same part of src.
+ * Filters of the same size line up byte for byte. Smaller power
+ * of two partitions line up since masking keeps the low bits.
+ * @return 0 if the filters can be merged, -EINVAL otherwise.
  */
-int bf_close(bloom_bloomfilter *filter) {
-    // Make sure we have a filter
-    if (filter == NULL || filter->map == NULL) {
-        return -1;
+static int bf_merge_geometry(bloom_bloomfilter *dst, bloom_bloomfilter *src,
+        uint64_t *parts, uint64_t *part_bytes, uint64_t *src_part_bytes) {
+    if (dst->layout != src->layout || dst->layout == LAYOUT_CUCKOO ||
+            dst->header->k_num != src->header->k_num ||
+            dst->header->hash_family != src->header->hash_family ||
+            dst->index_mode != src->index_mode ||
+            dst->bit_order != src->bit_order) {
+        return -EINVAL;
     }
 
-    // Flush first
-    bf_flush(filter);
+    // The same size is the same geometry, use the whole bitmap as one
+    // part. The part size only needs to be a power of two for the masking
+    // to match the offset, and the offset is always less than the size.
+    uint64_t data_bytes = dst->map->size - sizeof(bloom_filter_header);
+    if (dst->map->size == src->map->size) {
+        *parts = 1;
+        *part_bytes = data_bytes;
+        *src_part_bytes = bf_round_pow2(data_bytes);
+        return 0;
+    }
 
-    // Clean up the map
-    bitmap_close(filter->map);
-    filter->map = NULL;
+    // Partitions must be whole bytes to be repeated
+    if (dst->index_mode != INDEX_POW2) return -EINVAL;
+    switch (dst->layout) {
+        case LAYOUT_BLOCKED:
+            *parts = 1;
+            *part_bytes = dst->num_blocks * BLOOM_BLOCK_BYTES;
+            *src_part_bytes = src->num_blocks * BLOOM_BLOCK_BYTES;
+            break;
+        case LAYOUT_COUNTING:
+            if (dst->offset % 2 || src->offset % 2) return -EINVAL;
+            *parts = dst->header->k_num;
+            *part_bytes = dst->offset / 2;
+            *src_part_bytes = src->offset / 2;
+            break;
+        default:
+            if (dst->offset % 8 || src->offset % 8) return -EINVAL;
+            *parts = dst->header->k_num;
+            *part_bytes = dst->offset / 8;
+            *src_part_bytes = src->offset / 8;
+            break;
+    }
+    if (*src_part_bytes == 0 || *src_part_bytes > *part_bytes) return -EINVAL;
+    return 0;
+}
 
-    // Clear all the fields
-    filter->header = NULL;
-    filter->offset = 0;
-    filter->bitmap_size = 0;
+/**
+ * Estimates the false positive probability of dst, with the
+ * bytes of src merged in if it is given. A lookup probes k
+ * locations, so this is the fraction of set locations to the k.
+ */
+static double bf_merge_scan(bloom_bloomfilter *dst, bloom_bloomfilter *src,
+        uint64_t parts, uint64_t part_bytes, uint64_t src_part_bytes) {
+    unsigned char *base = dst->map->mmap + sizeof(bloom_filter_header);
+    unsigned char *src_base = (src) ? src->map->mmap + sizeof(bloom_filter_header) : NULL;
+    int counting = dst->layout == LAYOUT_COUNTING;
+    uint64_t set = 0;
+    unsigned char b;
+    for (uint64_t p=0; p < parts; p++) {
+        unsigned char *out = base + p * part_bytes;
+        unsigned char *in = (src_base) ? src_base + p * src_part_bytes : NULL;
+        for (uint64_t t=0; t < part_bytes; t++) {
+            b = out[t];
+            // A counter is also set in the merge if it is set in either
+            if (in) b |= in[t & (src_part_bytes - 1)];
+            set += (counting) ? (uint64_t)(((b & 0xF) != 0) + ((b >> 4) != 0)) : (uint64_t)__builtin_popcount(b);
+        }
+    }
 
-    return 0;
+    uint64_t total = parts * part_bytes * ((counting) ? 2 : 8);
+    if (total == 0) return 1;
+    return pow((double)set / total, dst->header->k_num);
 }
 
 /*
@@ -204,7 +1873,42 @@ int bf_close(bloom_bloomfilter *filter) {
  * and sets the bytes and k_num that should be used.
  * @return 0 on success, negative on error.
  */
+/**
+ * Lowers k to the smallest value whose bitmap fits the growth
+ * allowed by the optimize profile, and sizes the bitmap for it.
+ * A partitioned filter with m bits, n keys and k probes has a
+ * false positive rate of (1 - e^(-kn/m))^k, so meeting p with
+ * k probes takes m = -kn / ln(1 - p^(1/k)) bits.
+ * Expects bytes and k_num to be set for the ideal k.
+ */
+static void bf_optimize_k_num(bloom_filter_params *params) {
+    if (params->optimize == OPTIMIZE_MEMORY) return;
+    double growth = (params->optimize == OPTIMIZE_SPEED) ? BLOOM_SPEED_GROWTH : BLOOM_BALANCED_GROWTH;
+    double budget = params->bytes * 8.0 * growth;
+    for (uint32_t k=1; k < params->k_num; k++) {
+        double bits = -(k * (double)params->capacity) / log1p(-pow(params->fp_probability, 1.0 / k));
+        if (bits <= budget) {
+            params->k_num = k;
+            params->bytes = ceil(ceil(bits) / 8.0);
+            return;
+        }
+    }
+}
+
 int bf_params_for_capacity(bloom_filter_params *params) {
+    // The cuckoo layout is sized by slots instead of bits
+    if (params->layout == LAYOUT_CUCKOO) {
+        if (params->capacity == 0 || params->fp_probability <= 0 || params->fp_probability >= 1) {
+            return -1;
+        }
+        uint32_t fp_bits = bf_cuckoo_fp_bits(params->fp_probability);
+        uint64_t buckets = ceil(params->capacity / (BLOOM_CUCKOO_LOAD * BLOOM_CUCKOO_SLOTS));
+        params->k_num = 2;
+        params->bytes = sizeof(bloom_filter_header) + CUCKOO_PAD_BYTES +
+            ceil(buckets * BLOOM_CUCKOO_SLOTS * fp_bits / 8.0);
+        return 0;
+    }
+
     // Sets the required size
     int res = bf_size_for_capacity_prob(params);
     if (res != 0) return res;
@@ -213,11 +1917,92 @@ int bf_params_for_capacity(bloom_filter_params *params) {
     res = bf_ideal_k_num(params);
     if (res != 0) return res;
 
+    // Trade bits for fewer probes, if the profile allows it
+    bf_optimize_k_num(params);
+
+    // Round the partitions up to a power of two. This only
+    // lowers the false positive rate, so k is unchanged.
+    if (params->index_mode == INDEX_POW2 && params->layout != LAYOUT_BLOCKED) {
+        if (params->k_num < 1) params->k_num = 1;
+        uint64_t partition = ceil(params->bytes * 8.0 / params->k_num);
+        partition = bf_round_pow2(partition < 8 ? 8 : partition);
+        params->bytes = (partition * params->k_num) / 8;
+    }
+
+    // Each bit becomes a counter
+    if (params->layout == LAYOUT_COUNTING) {
+        params->bytes *= BLOOM_COUNTER_BITS;
+    }
+
+    // The blocked layout has a worse false positive rate
+    // for the same size, since keys are not spread evenly
+    // over the blocks. Grow the size until we meet the target.
+    if (params->layout == LAYOUT_BLOCKED) {
+        double target = params->fp_probability;
+        params->bytes = ceil(params->bytes / (double)BLOOM_BLOCK_BYTES) * BLOOM_BLOCK_BYTES;
+        for (int i=0; i < 256; i++) {
+            if (params->k_num < 1) params->k_num = 1;
+            res = bf_blocked_fp_probability(params);
+            if (res != 0) break;
+            if (params->fp_probability <= target) break;
+
+            // Grow by ~3%, in whole blocks
+            uint64_t grow = params->bytes / 32;
+            if (grow < BLOOM_BLOCK_BYTES) grow = BLOOM_BLOCK_BYTES;
+            params->bytes += ceil(grow / (double)BLOOM_BLOCK_BYTES) * BLOOM_BLOCK_BYTES;
+
+            // The k chosen by the profile is kept as the size grows
+            if (params->optimize != OPTIMIZE_MEMORY) continue;
+            res = bf_ideal_k_num(params);
+            if (res != 0) break;
+        }
+        params->fp_probability = target;
+        if (res != 0) return res;
+
+        // Round the number of blocks up to a power of two
+        if (params->index_mode == INDEX_POW2) {
+            params->bytes = bf_round_pow2(params->bytes / BLOOM_BLOCK_BYTES) * BLOOM_BLOCK_BYTES;
+        }
+    }
+
     // Adjust for the header size
     params->bytes += sizeof(bloom_filter_header);
     return 0;
 }
 
+/*
+ * Expects bytes, capacity and k_num to be set. Computes the
+ * expected false positive probability of a blocked layout filter.
+ * The number of keys per block is Poisson distributed, so we sum
+ * the false positive rate of a single block over that distribution.
+ * See "Cache-, Hash- and Space-Efficient Bloom Filters", Putze 2007.
+ * @return 0 on success, negative on error.
+ */
+int bf_blocked_fp_probability(bloom_filter_params *params) {
+    uint64_t blocks = params->bytes / BLOOM_BLOCK_BYTES;
+    uint64_t capacity = params->capacity;
+    uint32_t k_num = params->k_num;
+    if (blocks == 0 || capacity == 0 || k_num == 0) {
+        return -1;
+    }
+
+    // Expected keys per block, and the range to sum over
+    double lambda = (double)capacity / blocks;
+    double spread = 10 * sqrt(lambda) + 10;
+    uint64_t low = (lambda > spread) ? lambda - spread : 0;
+    uint64_t high = lambda + spread;
+
+    double fp_prob = 0;
+    double log_pj, block_fp;
+    for (uint64_t j=low; j <= high; j++) {
+        log_pj = -lambda + j * log(lambda) - lgamma(j + 1);
+        block_fp = pow(1 - pow(1 - 1.0 / BLOOM_BLOCK_BITS, (double)j * k_num), k_num);
+        fp_prob += exp(log_pj) * block_fp;
+    }
+    params->fp_probability = fp_prob;
+    return 0;
+}
+
 /*
  * Expects capacity and probability to be set, computes the
  * minimum byte size required.
@@ -284,8 +2069,85 @@ int bf_ideal_k_num(bloom_filter_params *params) {
     return 0;
 }
 
+// Computes our hashes with the given family
+void bf_compute_hashes_family(bloom_hash_family family, uint32_t k_num, char *key, uint64_t *hashes) {
+    bf_compute_hashes_len(family, k_num, key, strlen(key), hashes);
+}
+
+// Computes the hashes of a key of a given length
+void bf_compute_hashes_len(bloom_hash_family family, uint32_t k_num, const char *key, uint64_t len, uint64_t *hashes) {
+    uint64_t out[2];
+    if (family == HASH_CLIENT) {
+        // The key is the 128bit hash, so only decode it
+        bf_parse_client_hash(key, len, out);
+    } else if (family == HASH_WYHASH) {
+        // Compute a single 128bit hash
+        WyHash128(key, len, 0, out);
+    } else {
+        bf_compute_spooky_hashes(k_num, key, len, hashes);
+        return;
+    }
+
+    // Derive all the hashes by Kirsch-Mitzenmacher, using
+    // g_i(x) = h1(x) + i * h2(x). Forcing h2 to be odd ensures
+    // the hashes do not cycle on power of two sized regions.
+    uint64_t h1 = out[0];
+    uint64_t h2 = out[1] | 1;
+    for (uint32_t i=0; i < k_num; i++) {
+        hashes[i] = h1 + i * h2;
+    }
+}
+
+// Returns the value of a hex digit, or -1
+static inline int bf_hex_digit(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Checks that a key is a client hash
+int bf_is_client_hash(const char *key, uint64_t len) {
+    if (len != BLOOM_CLIENT_HASH_LEN) return 0;
+    for (int i=0; i < BLOOM_CLIENT_HASH_LEN; i++) {
+        if (bf_hex_digit(key[i]) < 0) return 0;
+    }
+    return 1;
+}
+
+// Decodes a client hash into its two 64bit halves, the
+// first 16 digits are the first half. Digits that are not
+// hex are read as 0, so any key has some hash.
+static void bf_parse_client_hash(const char *key, uint64_t len, uint64_t *out) {
+    out[0] = out[1] = 0;
+    if (len > BLOOM_CLIENT_HASH_LEN) len = BLOOM_CLIENT_HASH_LEN;
+    for (uint64_t i=0; i < len; i++) {
+        int digit = bf_hex_digit(key[i]);
+        if (digit > 0) out[i / 16] |= (uint64_t)digit << (60 - 4 * (i % 16));
+    }
+}
+
+// Extends the hashes to a larger k_num
+void bf_extend_hashes(bloom_hash_family family, uint32_t k_have, uint32_t k_num, uint64_t *hashes) {
+    if (family == HASH_WYHASH || family == HASH_CLIENT) {
+        uint64_t h2 = hashes[1] - hashes[0];
+        for (uint32_t i=k_have; i < k_num; i++) {
+            hashes[i] = hashes[0] + i * h2;
+        }
+    } else {
+        for (uint32_t i=k_have; i < k_num; i++) {
+            hashes[i] = hashes[1] + ((i * hashes[3]) % 18446744073709551557U);
+        }
+    }
+}
+
 // Computes our hashes
 void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes) {
+    bf_compute_spooky_hashes(k_num, key, strlen(key), hashes);
+}
+
+// Computes the original hashes of a key of a given length
+static void bf_compute_spooky_hashes(uint32_t k_num, const char *key, uint64_t len, uint64_t *hashes) {
     /**
      * We use the results of
      * 'Less Hashing, Same Performance: Building a Better Bloom Filter'
@@ -298,9 +2160,6 @@ void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes) {
      *
      */
 
-    // Get the length of the key
-    uint64_t len = strlen(key);
-
     // Compute the first hash
     uint64_t out[2];
     MurmurHash3_x64_128(key, len, 0, out);
@@ -327,3 +2186,34 @@ void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes) {
     }
 }
 
+
+/**
+ * Returns the fingerprint size for a false positive probability.
+ * A lookup compares against the 2 * BLOOM_CUCKOO_SLOTS fingerprints
+ * in its buckets, so each matches with probability 2^-f.
+ */
+static uint32_t bf_cuckoo_fp_bits(double fp_prob) {
+    uint32_t bits = ceil(log2(2 * BLOOM_CUCKOO_SLOTS / fp_prob));
+    if (bits < CUCKOO_MIN_FP_BITS) bits = CUCKOO_MIN_FP_BITS;
+    if (bits > CUCKOO_MAX_FP_BITS) bits = CUCKOO_MAX_FP_BITS;
+    return bits;
+}
+
+/**
+ * Rounds up to the next power of two.
+ */
+static uint64_t bf_round_pow2(uint64_t val) {
+    uint64_t pow2 = 1;
+    while (pow2 < val) pow2 <<= 1;
+    return pow2;
+}
+
+/**
+ * Rounds down to the previous power of two. Zero stays zero.
+ */
+static uint64_t bf_floor_pow2(uint64_t val) {
+    if (val == 0) return 0;
+    uint64_t pow2 = 1;
+    while (pow2 <= val / 2) pow2 <<= 1;
+    return pow2;
+}
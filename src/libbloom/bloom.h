@@ -13,18 +13,162 @@ struct bloom_filter_header {
     uint32_t magic;     // Magic 4 bytes
     uint32_t k_num;     // K_num value
     uint64_t count;     // Count of items
-    char __buf[496];     // Pad out to 512 bytes
+    uint8_t hash_family; // Hash family, 0 for the original hashes
+    uint8_t index_mode;  // Index reduction, 0 for modulo
+    uint8_t bit_order;   // Bitmap bit order, 0 for bytes
+    uint8_t fp_bits;     // Fingerprint bits, for the cuckoo layout
+    uint8_t has_victim;  // Is a cuckoo fingerprint left over
+    uint32_t victim_fp;  // The left over fingerprint
+    uint64_t victim_bucket; // The bucket of the left over fingerprint
+    uint64_t capacity;   // Capacity the filter was sized for, 0 if unknown
+    uint64_t epoch;      // When a windowed generation was started, 0 if never
+    char __buf[463];     // Pad out to 512 bytes
 } __attribute__ ((packed));
 typedef struct bloom_filter_header bloom_filter_header;
 
+/**
+ * The bit layout used by a filter. The layout is encoded
+ * in the header magic, so it does not need to be provided
+ * when loading an existing filter.
+ */
+typedef enum {
+    LAYOUT_PARTITIONED = 0, // k partitions, one bit per partition
+    LAYOUT_BLOCKED     = 1, // All k bits in a single cache line block
+    LAYOUT_COUNTING    = 2, // k partitions of counters, supports removal
+    LAYOUT_CUCKOO      = 3, // Cuckoo hash table of fingerprints, supports removal
+} bloom_layout;
+
+/**
+ * The hash family used to derive the k hashes. This is
+ * stored in the header, and zero is the original family,
+ * so existing filters are read as HASH_MURMUR_SPOOKY.
+ * With HASH_CLIENT the keys are 128bit hashes computed by
+ * the client, written as 32 hex digits, which are used as
+ * the two base hashes without hashing the key again.
+ */
+typedef enum {
+    HASH_MURMUR_SPOOKY = 0, // Murmur3 and Spooky, double hashing
+    HASH_WYHASH        = 1, // Single pass 128bit wyhash
+    HASH_CLIENT        = 2, // 128bit hashes supplied as the keys
+} bloom_hash_family;
+
+/**
+ * The length of a key of the HASH_CLIENT family
+ */
+#define BLOOM_CLIENT_HASH_LEN 32
+
+/**
+ * How a hash is reduced to an index inside a partition (or to
+ * a block in the blocked layout). This is stored in the header,
+ * and zero is the original modulo reduction.
+ */
+typedef enum {
+    INDEX_MODULO    = 0, // h % m, any size
+    INDEX_FASTRANGE = 1, // (h * m) >> 64, any size, no division
+    INDEX_POW2      = 2, // h & (m - 1), sizes rounded to a power of two
+} bloom_index_mode;
+
+/**
+ * The order of the bits in the bitmap. This is stored in
+ * the header, and zero is the original MSB first byte order.
+ * The word order addresses the bitmap as native 64bit words,
+ * which allows word sized atomic updates.
+ */
+typedef enum {
+    BIT_ORDER_BYTE = 0, // Bit idx is bit 7 - idx % 8 of byte idx / 8
+    BIT_ORDER_WORD = 1, // Bit idx is bit idx % 64 of word idx / 64
+} bloom_bit_order;
+
+/**
+ * How new filters trade memory for probes. The memory profile
+ * uses the ideal k, which needs the fewest bits. The others use
+ * a smaller k, and grow the bitmap to keep the false positive
+ * rate, up to BLOOM_BALANCED_GROWTH or BLOOM_SPEED_GROWTH times
+ * the ideal size. Fewer probes touch fewer cache lines per key.
+ */
+typedef enum {
+    OPTIMIZE_MEMORY   = 0, // The ideal k, the smallest bitmap
+    OPTIMIZE_BALANCED = 1, // Fewer probes for a modestly larger bitmap
+    OPTIMIZE_SPEED    = 2, // The fewest probes within twice the size
+} bloom_optimize;
+
+/**
+ * Size of a block in the blocked layout. Matches
+ * the cache line size, so each key touches one line.
+ */
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_BYTES * 8)
+
+/**
+ * The most a bitmap may grow over the ideal size to
+ * lower k, with the balanced and speed profiles
+ */
+#define BLOOM_BALANCED_GROWTH 1.25
+#define BLOOM_SPEED_GROWTH 2.0
+
+/**
+ * Size of a counter in the counting layout. Two counters
+ * are packed per byte, the even counter in the low nibble.
+ * Counters saturate at the maximum, and are then never
+ * decremented, so that removals cannot cause false negatives.
+ */
+#define BLOOM_COUNTER_BITS 4
+#define BLOOM_COUNTER_MAX 15
+
+/**
+ * The largest factor a filter is folded by at once. Folding
+ * needs a factor of the partition size, and sizes with no
+ * small factor cannot be folded.
+ */
+#define BLOOM_MAX_FOLD 64
+
+/**
+ * Geometry of the cuckoo layout. Each key has a fingerprint
+ * stored in one of two buckets, and each bucket packs a few
+ * fingerprints back to back. Tables are sized to be at most
+ * BLOOM_CUCKOO_LOAD full at capacity. An insert that keeps
+ * evicting fingerprints gives up after BLOOM_CUCKOO_MAX_KICKS,
+ * and the last fingerprint is kept aside in the header.
+ */
+#define BLOOM_CUCKOO_SLOTS 4
+#define BLOOM_CUCKOO_LOAD 0.95
+#define BLOOM_CUCKOO_MAX_KICKS 500
+
+/*
+ * Sorted batch adds compute the bits of all the keys, and
+ * radix sort them by word, BLOOM_BATCH_RADIX_BITS at a time.
+ * The words are prefetched BLOOM_BATCH_PREFETCH updates ahead.
+ * Batches smaller than BLOOM_BATCH_MIN are added key by key,
+ * as they are too sparse to share pages.
+ */
+#define BLOOM_BATCH_RADIX_BITS 11
+#define BLOOM_BATCH_PREFETCH 16
+#define BLOOM_BATCH_MIN 256
+
+/*
+ * The largest k_num that has specialized probe kernels.
+ * Partitioned filters with a larger k_num use the generic loops.
+ */
+#define BLOOM_KERNEL_MAX_K 20
+
 /*
  * This is the struct we use to represent a bloom filter.
  */
-typedef struct {
+typedef struct bloom_bloomfilter {
     bloom_filter_header *header;   // Pointer to the header in the bitmap region
     bloom_bitmap *map;             // Underlying bitmap
     uint64_t offset;                // The offset size between hash regions
-    uint64_t bitmap_size;           // The size of the bitmap to use, minus buffers
+    uint64_t bitmap_size;           // The size of the bitmap to use, minus buffers.
+                                    // In counters for the counting layout.
+    bloom_layout layout;            // The bit layout of the filter
+    uint64_t num_blocks;            // Number of blocks, for the blocked layout.
+                                    // Number of buckets for the cuckoo layout.
+    uint32_t fp_bits;               // Fingerprint bits, for the cuckoo layout
+    bloom_index_mode index_mode;    // How hashes are reduced to indexes
+    bloom_bit_order bit_order;      // The bit order of the bitmap
+    uint64_t set_bits;              // Bits or counters set, UINT64_MAX until counted
+    int (*contains_kernel)(struct bloom_bloomfilter*, uint64_t*); // Specialized check, or NULL
+    uint32_t (*set_kernel)(struct bloom_bloomfilter*, uint64_t*); // Specialized set, or NULL
 } bloom_bloomfilter;
 
 /*
@@ -36,8 +180,37 @@ typedef struct {
     uint32_t k_num;
     uint64_t capacity;
     double   fp_probability;
+    bloom_layout layout;
+    bloom_hash_family hash_family;
+    bloom_index_mode index_mode;
+    bloom_bit_order bit_order;
+    bloom_optimize optimize;        // Memory and probe trade off, for bf_params_for_capacity
 } bloom_filter_params;
 
+/**
+ * The most filters a bit-sliced group holds
+ */
+#define BLOOM_SLICE_MAX 64
+
+/*
+ * A bit-sliced group of partitioned filters with the same geometry.
+ * The bitmaps are stored transposed: there is a word for each bit
+ * of the filters, and bit j of the word is the bit of filter j. A
+ * check ANDs the k words of a key, which answers it for all the
+ * filters at once. The words are as wide as the group needs, of
+ * 8, 16, 32 or 64 bits. The group is a copy of the filters, so
+ * later changes to them are not seen.
+ */
+typedef struct {
+    uint32_t k_num;                 // Hashes of the filters
+    uint64_t offset;                // Bits in each partition
+    bloom_index_mode index_mode;    // How hashes are reduced to indexes
+    bloom_hash_family hash_family;  // The hashes the filters take
+    uint32_t width;                 // Bits of each word, the most filters
+    uint32_t num_filters;           // Filters added so far
+    unsigned char *words;           // The k_num * offset words
+} bloom_slice;
+
 
 /**
  * Creates a new bloom filter using a given bitmap and k-value.
@@ -49,14 +222,38 @@ typedef struct {
  */
 int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloomfilter *filter);
 
+/**
+ * Creates a new bloom filter using a given bitmap and parameters.
+ * The k_num, layout, hash family, index mode and bit order are used
+ * for new filters, otherwise they are read from the existing header.
+ * @arg map A bloom_bitmap pointer.
+ * @arg params The parameters to use. Only k_num, layout, hash_family,
+ * index_mode and bit_order are used.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int bf_from_bitmap_params(bloom_bitmap *map, bloom_filter_params *params, int new_filter, bloom_bloomfilter *filter);
+
 /**
  * Adds a new key to the bloom filter.
  * @arg filter The filter to add to
  * @arg key The key to add
  * @returns 1 if the key was added, 0 if present. Negative on failure.
+ * A cuckoo layout filter returns -ENOSPC once it is full.
  */
 int bf_add(bloom_bloomfilter *filter, char* key);
 
+/**
+ * Adds a new key of a given length to the bloom filter. The key
+ * does not need to be NUL terminated, so it can be hashed in place.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @arg len The length of the key
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int bf_add_len(bloom_bloomfilter *filter, const char* key, uint64_t len);
+
 /**
  * Checks the filter for a key
  * @arg filter The filter to check
@@ -65,11 +262,122 @@ int bf_add(bloom_bloomfilter *filter, char* key);
  */
 int bf_contains(bloom_bloomfilter *filter, char* key);
 
+/**
+ * Checks the filter for a key of a given length, which does
+ * not need to be NUL terminated.
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @arg len The length of the key
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains_len(bloom_bloomfilter *filter, const char* key, uint64_t len);
+
+/**
+ * Adds a new key to the bloom filter using precomputed hashes.
+ * @arg filter The filter to add to
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * hashes computed with the hash family of the filter.
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ * A cuckoo layout filter returns -ENOSPC once it is full.
+ */
+int bf_add_hashed(bloom_bloomfilter *filter, uint64_t *hashes);
+
+/**
+ * Adds a new key to the bloom filter using precomputed hashes.
+ * Bits are set with atomic operations, and the count is updated
+ * atomically, so this is safe to call concurrently with other
+ * atomic adds and with checks of the same filter.
+ * @arg filter The filter to add to
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * hashes computed with the hash family of the filter.
+ * @returns 1 if the key was added, 0 if present, -EINVAL for
+ * the cuckoo layout, which moves fingerprints on insert.
+ */
+int bf_add_hashed_atomic(bloom_bloomfilter *filter, uint64_t *hashes);
+
+/**
+ * Adds many keys using precomputed hashes. The bits of the batch
+ * are sorted by address and set in a single sweep, so the pages
+ * are written and dirtied in order. The results are the same as
+ * adding the keys in turn.
+ * @arg filter The filter to add to
+ * @arg hashes The hashes of the keys, at least k_num for each key
+ * @arg stride The number of hashes between keys
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if the key was added, 0 if present
+ * @returns The number of keys added, -EINVAL for the counting
+ * and cuckoo layouts, -ENOMEM on failure.
+ */
+int bf_add_batch_hashed(bloom_bloomfilter *filter, uint64_t *hashes, uint32_t stride,
+        int num_keys, char *results);
+
+/**
+ * Removes a key from a counting or cuckoo filter using precomputed
+ * hashes. The key is only removed if it is present.
+ * @arg filter The filter to remove from
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * hashes computed with the hash family of the filter.
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filter does not use the counting or cuckoo layout.
+ */
+int bf_remove_hashed(bloom_bloomfilter *filter, uint64_t *hashes);
+
+/**
+ * Removes a key from a counting or cuckoo filter.
+ * @arg filter The filter to remove from
+ * @arg key The key to remove
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filter does not use the counting or cuckoo layout.
+ */
+int bf_remove(bloom_bloomfilter *filter, char* key);
+
+/**
+ * Removes a key of a given length, which does not need to be
+ * NUL terminated, from a counting or cuckoo filter.
+ * @arg filter The filter to remove from
+ * @arg key The key to remove
+ * @arg len The length of the key
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filter does not use the counting or cuckoo layout.
+ */
+int bf_remove_len(bloom_bloomfilter *filter, const char* key, uint64_t len);
+
+/**
+ * Checks the filter for a key using precomputed hashes.
+ * @arg filter The filter to check
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * hashes computed with the hash family of the filter.
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains_hashed(bloom_bloomfilter *filter, uint64_t *hashes);
+
+/**
+ * Issues prefetches for all the bits a key would probe. Used
+ * to overlap the memory accesses of many keys in batch paths.
+ * @arg filter The filter to prefetch in
+ * @arg hashes The hashes of the key, must contain at least k_num
+ */
+void bf_prefetch_hashed(bloom_bloomfilter *filter, uint64_t *hashes);
+
 /**
  * Returns the size of the bloom filter in item count
  */
 uint64_t bf_size(bloom_bloomfilter *filter);
 
+/**
+ * Estimates the number of distinct keys in the filter from the
+ * fraction of bits, or counters, that are set, using the estimate
+ * of Swamidass and Baldi: -(m / k) * ln(1 - X / m), for X of m
+ * bits set. Unlike bf_size, this holds after merges and is not
+ * raised by adds of keys that were false positives. The adds keep
+ * a count of the bits they set, so only a loaded, merged or folded
+ * filter has its bits counted, once, by the next estimate.
+ * For the cuckoo layout, this is the count.
+ * @arg filter The filter
+ * @return The estimated number of distinct keys.
+ */
+uint64_t bf_estimate_size(bloom_bloomfilter *filter);
+
 /**
  * Flushes the filter, and updates the metadata.
  * @return 0 on success, negative on failure.
@@ -83,6 +391,164 @@ int bf_flush(bloom_bloomfilter *filter);
  */
 int bf_close(bloom_bloomfilter *filter);
 
+/**
+ * Clears all the keys of a filter in place, keeping its bitmap
+ * and parameters. The count and any cuckoo victim are reset. The
+ * data is zeroed with bitmap_zero, so whole pages are dropped
+ * instead of written, and the header is marked dirty. Needs
+ * exclusive access, and no flush of the bitmap in progress.
+ * @arg filter The filter to clear
+ * @return 0 on success, negative on failure.
+ */
+int bf_clear(bloom_bloomfilter *filter);
+
+/**
+ * Checks if the keys of one filter can be merged into another.
+ * The filters must share the layout, hash family, k_num, index mode
+ * and bit order, and have the same size. With INDEX_POW2, the source
+ * may also be smaller, since its partitions (or blocks) can be
+ * repeated across the larger ones. Cuckoo filters cannot be merged.
+ * @arg dst The filter to merge into
+ * @arg src The filter to merge from
+ * @return 1 if the filters can be merged, 0 otherwise.
+ */
+int bf_can_merge(bloom_bloomfilter *dst, bloom_bloomfilter *src);
+
+/**
+ * Merges the keys of a filter into another. Bits are OR-ed, and
+ * counters are added, saturating at BLOOM_COUNTER_MAX. The counts
+ * and capacities are summed. Every key of src is then contained in
+ * dst, but the false positive probability of dst increases.
+ * @arg dst The filter to merge into
+ * @arg src The filter to merge from, which is left as is
+ * @return 0 on success, -EINVAL if the filters cannot be merged.
+ */
+int bf_merge(bloom_bloomfilter *dst, bloom_bloomfilter *src);
+
+/**
+ * Intersects the keys of a filter with another. The filters must
+ * line up as for bf_merge. Bits are AND-ed, and the minimum of the
+ * counters is kept. Keys added to both filters are still contained
+ * in dst, as are some keys of only one of them, so the false positive
+ * probability is at least that of the smaller set. The count becomes
+ * the smaller of the two, an upper bound, and the capacity is kept.
+ * @arg dst The filter to intersect into
+ * @arg src The filter to intersect with, which is left as is
+ * @return 0 on success, -EINVAL if the filters cannot be intersected.
+ */
+int bf_intersect(bloom_bloomfilter *dst, bloom_bloomfilter *src);
+
+/**
+ * Estimates the false positive probability of a filter from
+ * the fraction of bits, or counters, that are set. This reads
+ * the whole bitmap. For the cuckoo layout, it is estimated
+ * from the load of the table.
+ * @arg filter The filter
+ * @return The estimated probability.
+ */
+double bf_estimate_fp_probability(bloom_bloomfilter *filter);
+
+/**
+ * Estimates the false positive probability of a filter
+ * after merging another into it, without merging them.
+ * @arg dst The filter to merge into
+ * @arg src The filter to merge from
+ * @return The estimated probability, or 1 if the filters
+ * cannot be merged.
+ */
+double bf_estimate_merged_fp_probability(bloom_bloomfilter *dst, bloom_bloomfilter *src);
+
+/**
+ * Returns the factor a filter folds by. A filter folded by a
+ * factor d has 1/d of the bits, or counters, in each partition,
+ * and 1/d of the blocks in the blocked layout. Every index of the
+ * filter reduces to an index of the folded filter, so folding keeps
+ * all the keys at a higher false positive probability. The factor
+ * is the smallest one of the partition size, or of the number of
+ * blocks, up to BLOOM_MAX_FOLD. The cuckoo layout cannot be folded.
+ * @arg filter The filter
+ * @return The factor, or 0 if the filter cannot be folded.
+ */
+uint32_t bf_fold_factor(bloom_bloomfilter *filter);
+
+/**
+ * Returns the bytes of the bitmap a filter folds into.
+ * @arg filter The filter
+ * @return The bytes, or 0 if the filter cannot be folded.
+ */
+uint64_t bf_folded_bytes(bloom_bloomfilter *filter);
+
+/**
+ * Estimates the false positive probability of a filter after
+ * folding it, without folding it. This reads the whole bitmap.
+ * @arg filter The filter
+ * @return The estimated probability, or 1 if the filter
+ * cannot be folded.
+ */
+double bf_estimate_folded_fp_probability(bloom_bloomfilter *filter);
+
+/**
+ * Folds a filter into a new filter, smaller by bf_fold_factor.
+ * With modulo and power of two indexing, each partition is cut in
+ * d slices that are OR-ed together. With multiply-shift indexing,
+ * each run of d adjacent bits is OR-ed into one. Counters are added,
+ * and saturate. The count is kept, and the capacity divided by the
+ * factor, since the same fill gives the same false positive probability.
+ * @arg src The filter to fold, which is left as is
+ * @arg map The zeroed bitmap of the folded filter, of
+ * bf_folded_bytes(src) bytes
+ * @arg dst The folded filter to setup over the map
+ * @return 0 on success, -EINVAL if the filter cannot be folded
+ * into the map.
+ */
+int bf_fold(bloom_bloomfilter *src, bloom_bitmap *map, bloom_bloomfilter *dst);
+
+/**
+ * Creates an empty bit-sliced group with the geometry of a filter.
+ * @arg filter A filter of the partitioned layout
+ * @arg max_filters The most filters that will be added, up to
+ * BLOOM_SLICE_MAX. Sets the width of the words.
+ * @arg slice The group to initialize
+ * @return 0 on success, -EINVAL if the filter is not partitioned
+ * or max_filters is out of range, -ENOMEM on failure.
+ */
+int bf_slice_init(bloom_bloomfilter *filter, uint32_t max_filters, bloom_slice *slice);
+
+/**
+ * Checks if a filter has the geometry of a bit-sliced group,
+ * so that it can be added to it.
+ * @return 1 if it can be added, 0 otherwise.
+ */
+int bf_slice_matches(bloom_slice *slice, bloom_bloomfilter *filter);
+
+/**
+ * Adds a filter to a bit-sliced group, copying its set bits.
+ * Only reads the filter.
+ * @arg slice The group
+ * @arg filter The filter to add
+ * @return The index of the filter in the group, -EINVAL if the
+ * geometry differs, -ENOSPC if the group is full.
+ */
+int bf_slice_add(bloom_slice *slice, bloom_bloomfilter *filter);
+
+/**
+ * Checks a key in all the filters of a bit-sliced group.
+ * @arg slice The group
+ * @arg hashes The hashes of the key, must contain at least k_num
+ * @return A bit set for each filter that contains the key.
+ */
+uint64_t bf_slice_contains_hashed(bloom_slice *slice, uint64_t *hashes);
+
+/**
+ * Returns the bytes of memory used by a bit-sliced group.
+ */
+uint64_t bf_slice_bytes(bloom_slice *slice);
+
+/**
+ * Frees the words of a bit-sliced group.
+ */
+void bf_slice_destroy(bloom_slice *slice);
+
 /*
  * Computes the hashes for a bloom filter
  * @arg k_num the number of hashes to compute
@@ -91,6 +557,46 @@ int bf_close(bloom_bloomfilter *filter);
  */
 void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes);
 
+/*
+ * Computes the hashes for a bloom filter using a given hash family
+ * @arg family The hash family to use
+ * @arg k_num the number of hashes to compute
+ * @arg key The key to hash
+ * @arg hashes Array to write to
+ */
+void bf_compute_hashes_family(bloom_hash_family family, uint32_t k_num, char *key, uint64_t *hashes);
+
+/*
+ * Computes the hashes of a key of a given length, using a given
+ * hash family. The key does not need to be NUL terminated.
+ * @arg family The hash family to use
+ * @arg k_num the number of hashes to compute
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @arg hashes Array to write to
+ */
+void bf_compute_hashes_len(bloom_hash_family family, uint32_t k_num, const char *key, uint64_t len, uint64_t *hashes);
+
+/*
+ * Checks that a key is a hash of the HASH_CLIENT family,
+ * which is BLOOM_CLIENT_HASH_LEN hex digits.
+ * @arg key The key, need not be NUL terminated
+ * @arg len The length of the key
+ * @return 1 if the key is a client hash, 0 otherwise.
+ */
+int bf_is_client_hash(const char *key, uint64_t len);
+
+/*
+ * Extends previously computed hashes to a larger k_num, without
+ * re-hashing the key. The hashes of both families are linear
+ * combinations, so the first k hashes do not depend on k_num.
+ * @arg family The hash family used
+ * @arg k_have The number of hashes already computed. Must be at least 4.
+ * @arg k_num The number of hashes required
+ * @arg hashes Array to extend, must have room for k_num hashes
+ */
+void bf_extend_hashes(bloom_hash_family family, uint32_t k_have, uint32_t k_num, uint64_t *hashes);
+
 /*
  * Utility methods for computing parameters
  */
@@ -99,10 +605,29 @@ void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes);
  * Expects capacity and probability to be set,
  * and sets the bytes and k_num that should be used.
  * This byte size accounts for the headers we need.
+ * Unless the optimize profile is OPTIMIZE_MEMORY, k is lowered
+ * as far as the growth of the profile allows, and the size grown
+ * to keep the probability.
+ * If the layout is LAYOUT_BLOCKED, the size is grown
+ * until the blocked false positive rate meets the target.
+ * If the index mode is INDEX_POW2, the partitions (or the
+ * number of blocks) are rounded up to a power of two.
+ * If the layout is LAYOUT_COUNTING, each bit is sized as
+ * a counter of BLOOM_COUNTER_BITS. If the layout is
+ * LAYOUT_CUCKOO, the fingerprint size is chosen from the
+ * probability, and k_num is set to the 2 buckets per key.
  * @return 0 on success, negative on error.
  */
 int bf_params_for_capacity(bloom_filter_params *params);
 
+/*
+ * Expects bytes, capacity and k_num to be set. Computes the
+ * expected false positive probability of a blocked layout filter.
+ * The bytes should not include the header size.
+ * @return 0 on success, negative on error.
+ */
+int bf_blocked_fp_probability(bloom_filter_params *params);
+
 /*
  * Expects capacity and probability to be set, computes the
  * minimum byte size required. Does not include header size.
@@ -0,0 +1,704 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "flusher.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define FLUSHER_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+// Number of submission queue entries, bounds the operations in flight
+#define FLUSHER_QUEUE_DEPTH 128
+
+// Devices get their own in flight cap, the rest share the last slot
+#define FLUSHER_MAX_DEVICES 16
+
+/**
+ * A single flush of a bitmap. It is finished once all
+ * the page writes and the fsync complete.
+ */
+typedef struct flush_req {
+    bloom_flusher *flusher;
+    bloom_bitmap *map;
+    bloom_flush_cb cb;
+    void *data;
+    int device;     // Device slot
+    int pending;    // Operations in flight
+    int queued;     // Set once all the writes are queued
+    int synced;     // Set once the fsync is complete
+    int res;        // First error
+    bitmap_staged_run *staged; // The cut being written, freed when finished
+    struct flush_req *next;    // The next written flush waiting for the commit
+} flush_req;
+
+/**
+ * A single write or fsync in flight.
+ */
+typedef struct {
+    flush_req *req;
+    int is_sync;
+    struct iovec iov;   // The remaining data to write
+    uint64_t offset;    // The offset of the remaining data
+    uint64_t len;       // Bytes counted against the device cap
+} flush_op;
+
+typedef struct {
+    dev_t dev;
+    uint64_t inflight;
+} flush_device;
+
+struct bloom_flusher {
+    uint64_t max_inflight;  // Max bytes in flight per device
+    int num_requests;       // Flushes in flight, or waiting for the commit
+    int num_written;        // Flushes waiting for the commit
+    int finished;           // Flushes finished since the last poll
+    int group_commit;       // Set if the syncs wait for flusher_commit
+    flush_req *written;     // Flushes written, waiting for the commit
+    int num_devices;
+    flush_device devices[FLUSHER_MAX_DEVICES];
+
+    uint64_t rate;          // Bytes per second, 0 if unlimited
+    double tokens;          // Bytes that may be written now
+    uint64_t refill_usec;   // Last time the tokens were refilled
+
+    int ring_fd;            // -1 if io_uring is not used
+#ifdef FLUSHER_HAVE_IO_URING
+    unsigned ops_inflight;  // Queued operations
+    unsigned to_submit;     // Queued but not submitted
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+#endif
+};
+
+/**
+ * Static declarations
+ */
+static int device_slot(bloom_flusher *fl, bloom_bitmap *map);
+static void finish_req(bloom_flusher *fl, flush_req *req);
+static void park_req(bloom_flusher *fl, flush_req *req);
+static int sync_device(flush_req *req);
+static int throttle(bloom_flusher *fl, uint64_t len);
+static uint64_t now_usec(void);
+#ifdef FLUSHER_HAVE_IO_URING
+static int ring_setup(bloom_flusher *fl);
+static void ring_teardown(bloom_flusher *fl);
+static int ring_submit(bloom_flusher *fl, unsigned wait_nr);
+static int ring_reap(bloom_flusher *fl);
+static int ring_wait_one(bloom_flusher *fl);
+static void ring_queue_op(bloom_flusher *fl, flush_op *op);
+static int queue_new_op(bloom_flusher *fl, flush_op *op);
+static int queue_sync(bloom_flusher *fl, flush_req *req);
+static void maybe_finish(bloom_flusher *fl, flush_req *req);
+static int queue_run(void *data, bloom_bitmap *map, uint64_t offset, uint64_t len);
+static int queue_staged(flush_req *req);
+static int queue_write(flush_req *req, unsigned char *buf, uint64_t offset, uint64_t len);
+#endif
+
+/**
+ * Creates a new flusher.
+ * @arg max_inflight The maximum bytes in flight per device.
+ * Zero uses FLUSHER_DEFAULT_INFLIGHT.
+ * @arg flusher Output, set to the new flusher
+ * @return 0 on success, negative on failure.
+ */
+int flusher_create(uint64_t max_inflight, bloom_flusher **flusher) {
+    bloom_flusher *fl = calloc(1, sizeof(bloom_flusher));
+    if (!fl) return -ENOMEM;
+    fl->max_inflight = (max_inflight) ? max_inflight : FLUSHER_DEFAULT_INFLIGHT;
+    fl->ring_fd = -1;
+
+#ifdef FLUSHER_HAVE_IO_URING
+    int res = ring_setup(fl);
+    if (res) {
+        syslog(LOG_WARNING, "Failed to setup io_uring, flushes are synchronous. Err: %s",
+                strerror(-res));
+    }
+#endif
+
+    *flusher = fl;
+    return 0;
+}
+
+/**
+ * Checks if the flusher is asynchronous, or has fallen back to
+ * synchronous flushes.
+ * @return 1 if io_uring is used, 0 otherwise.
+ */
+int flusher_is_async(bloom_flusher *flusher) {
+    return flusher->ring_fd >= 0;
+}
+
+/**
+ * Limits the bytes per second the flusher writes.
+ * @arg flusher The flusher
+ * @arg bytes_per_sec The budget, 0 for no limit
+ */
+void flusher_set_rate(bloom_flusher *flusher, uint64_t bytes_per_sec) {
+    flusher->rate = bytes_per_sec;
+    flusher->tokens = (double)bytes_per_sec * FLUSHER_RATE_BURST_MSEC / 1000;
+    flusher->refill_usec = now_usec();
+}
+
+/**
+ * Enables or disables group commit.
+ * @arg flusher The flusher
+ * @arg enabled 1 to group the syncs, 0 to sync each flush
+ */
+void flusher_set_group_commit(bloom_flusher *flusher, int enabled) {
+    flusher->group_commit = enabled;
+}
+
+/**
+ * Starts an asynchronous flush of the bitmap. The callback is
+ * invoked from flusher_poll or flusher_drain once all the dirty
+ * pages are written and the file is synced, or from flusher_commit.
+ * @arg flusher The flusher
+ * @arg map The bitmap to flush
+ * @arg cb The completion callback
+ * @arg data Opaque data for the callback
+ * @return 0 if the flush was started, negative on failure.
+ */
+int bitmap_flush_async(bloom_flusher *flusher, bloom_bitmap *map, bloom_flush_cb cb, void *data) {
+    if (flusher == NULL || map == NULL) return -EINVAL;
+
+    // Nothing to write for anonymous maps
+    if (map->mode == ANONYMOUS || map->mmap == NULL) {
+        if (cb) cb(data, 0);
+        return 0;
+    }
+
+    // Fall back to a synchronous flush, or write
+    if (flusher->ring_fd < 0) {
+        int res = throttle(flusher, bitmap_dirty_bytes(map));
+        if (res || !flusher->group_commit) {
+            if (!res) res = bitmap_flush(map);
+            if (cb) cb(data, res);
+            return 0;
+        }
+        res = bitmap_write(map);
+        flush_req *req = calloc(1, sizeof(flush_req));
+        if (res || !req) {
+            free(req);
+            if (cb) cb(data, (res) ? res : -ENOMEM);
+            return 0;
+        }
+        req->flusher = flusher;
+        req->map = map;
+        req->cb = cb;
+        req->data = data;
+        req->device = device_slot(flusher, map);
+        flusher->num_requests++;
+        park_req(flusher, req);
+        return 0;
+    }
+
+#ifdef FLUSHER_HAVE_IO_URING
+    flush_req *req = calloc(1, sizeof(flush_req));
+    if (!req) return -ENOMEM;
+    req->flusher = flusher;
+    req->map = map;
+    req->cb = cb;
+    req->data = data;
+    req->device = device_slot(flusher, map);
+    flusher->num_requests++;
+
+    // Queue the dirty runs. The kernel writes back the pages
+    // of SHARED maps itself, so they only need the fsync. A
+    // cut of bitmap_stage is written from its copies, which
+    // the request holds until the writes complete.
+    int res = 0;
+    if (map->mode == PERSISTENT && map->staged) {
+        req->staged = map->staged;
+        map->staged = NULL;
+        res = queue_staged(req);
+        if (res) req->res = res;
+    } else if (map->mode == PERSISTENT) {
+        res = bitmap_flush_runs(map, queue_run, req);
+        if (res) req->res = res;
+    }
+
+    // The fsync is queued once all the writes complete
+    req->queued = 1;
+    maybe_finish(flusher, req);
+
+    // Start the writes now, instead of on the next poll
+    ring_submit(flusher, 0);
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/**
+ * Reaps completed writes and invokes the callbacks of
+ * finished flushes.
+ * @arg flusher The flusher
+ * @arg wait If 1, blocks until at least one flush finishes,
+ * unless there are none in flight.
+ * @return The number of flushes finished, negative on failure.
+ */
+int flusher_poll(bloom_flusher *flusher, int wait) {
+#ifdef FLUSHER_HAVE_IO_URING
+    if (flusher->ring_fd >= 0) {
+        int res = ring_submit(flusher, 0);
+        if (!res) res = ring_reap(flusher);
+        while (!res && wait && !flusher->finished && flusher->num_requests > flusher->num_written) {
+            res = ring_wait_one(flusher);
+        }
+        if (res) return res;
+    }
+#else
+    (void)wait;
+#endif
+    int finished = flusher->finished;
+    flusher->finished = 0;
+    return finished;
+}
+
+/**
+ * Waits for all the flushes in flight to finish, and
+ * commits the ones written with group commit.
+ * @arg flusher The flusher
+ * @return 0 on success, negative on failure.
+ */
+int flusher_drain(bloom_flusher *flusher) {
+    int res;
+    while (flusher->num_requests > flusher->num_written) {
+        res = flusher_poll(flusher, 1);
+        if (res < 0) return res;
+    }
+    flusher_commit(flusher);
+    flusher->finished = 0;
+    return 0;
+}
+
+/**
+ * Makes the written flushes of group commit durable, then
+ * invokes their callbacks.
+ * @arg flusher The flusher
+ * @return The number of flushes committed.
+ */
+int flusher_commit(bloom_flusher *flusher) {
+    flush_req *written = flusher->written;
+    if (!written) return 0;
+    flusher->written = NULL;
+    flusher->num_written = 0;
+
+    // Sync each device once. Devices past the slots share
+    // the last one, so its flushes are synced file by file.
+    int synced[FLUSHER_MAX_DEVICES] = {0};
+    int results[FLUSHER_MAX_DEVICES];
+    int res;
+    for (flush_req *req = written; req; req = req->next) {
+        if (req->device == FLUSHER_MAX_DEVICES - 1) {
+            res = (fsync(req->map->fileno)) ? -errno : 0;
+        } else if (synced[req->device]) {
+            res = results[req->device];
+        } else {
+            res = results[req->device] = sync_device(req);
+            synced[req->device] = 1;
+        }
+        if (res < 0 && !req->res) req->res = res;
+    }
+
+    int committed = 0;
+    flush_req *next;
+    for (flush_req *req = written; req; req = next) {
+        next = req->next;
+        finish_req(flusher, req);
+        committed++;
+    }
+    return committed;
+}
+
+/**
+ * Drains and destroys the flusher.
+ * @arg flusher The flusher
+ * @return 0 on success, negative on failure.
+ */
+int flusher_destroy(bloom_flusher *flusher) {
+    int res = flusher_drain(flusher);
+#ifdef FLUSHER_HAVE_IO_URING
+    ring_teardown(flusher);
+#endif
+    free(flusher);
+    return res;
+}
+
+/**
+ * Returns the device slot of the file backing a map
+ */
+static int device_slot(bloom_flusher *fl, bloom_bitmap *map) {
+    struct stat buf;
+    if (fstat(map->fileno, &buf) != 0) return FLUSHER_MAX_DEVICES - 1;
+    for (int i=0; i < fl->num_devices; i++) {
+        if (fl->devices[i].dev == buf.st_dev) return i;
+    }
+    if (fl->num_devices == FLUSHER_MAX_DEVICES) return FLUSHER_MAX_DEVICES - 1;
+    fl->devices[fl->num_devices].dev = buf.st_dev;
+    fl->devices[fl->num_devices].inflight = 0;
+    return fl->num_devices++;
+}
+
+/**
+ * Waits until the budget allows writing the bytes, then
+ * charges them. Writes larger than the burst only wait for
+ * a full burst, and leave the budget in debt. Completions
+ * are reaped while waiting.
+ */
+static int throttle(bloom_flusher *fl, uint64_t len) {
+    if (!fl->rate || !len) return 0;
+    double burst = (double)fl->rate * FLUSHER_RATE_BURST_MSEC / 1000;
+    double need = ((double)len < burst) ? (double)len : burst;
+    uint64_t now, wait;
+    while (1) {
+        now = now_usec();
+        fl->tokens += (double)(now - fl->refill_usec) * fl->rate / 1000000;
+        fl->refill_usec = now;
+        if (fl->tokens > burst) fl->tokens = burst;
+        if (fl->tokens >= need) break;
+
+#ifdef FLUSHER_HAVE_IO_URING
+        if (fl->ring_fd >= 0) {
+            int res = ring_submit(fl, 0);
+            if (!res) res = ring_reap(fl);
+            if (res) return res;
+        }
+#endif
+        // Sleep in short steps, so completions are not held up
+        wait = (need - fl->tokens) * 1000000 / fl->rate + 1;
+        usleep((wait < 10000) ? wait : 10000);
+    }
+    fl->tokens -= len;
+    return 0;
+}
+
+/**
+ * Returns a monotonic time in microseconds
+ */
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Holds a written flush until the next commit
+ */
+static void park_req(bloom_flusher *fl, flush_req *req) {
+    req->next = fl->written;
+    fl->written = req;
+    fl->num_written++;
+}
+
+/**
+ * Syncs the filesystem holding the bitmap of a flush
+ */
+static int sync_device(flush_req *req) {
+#ifdef __linux__
+    if (syncfs(req->map->fileno)) return -errno;
+#else
+    if (fsync(req->map->fileno)) return -errno;
+#endif
+    return 0;
+}
+
+/**
+ * Invokes the callback of a finished flush
+ */
+static void finish_req(bloom_flusher *fl, flush_req *req) {
+    if (req->cb) req->cb(req->data, req->res);
+    bitmap_staged_run *next;
+    for (bitmap_staged_run *run = req->staged; run; run = next) {
+        next = run->next;
+        free(run->data);
+        free(run);
+    }
+    free(req);
+    fl->num_requests--;
+    fl->finished++;
+}
+
+#ifdef FLUSHER_HAVE_IO_URING
+/**
+ * Sets up the io_uring and maps the rings
+ */
+static int ring_setup(bloom_flusher *fl) {
+    struct io_uring_params p;
+    int res;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, FLUSHER_QUEUE_DEPTH, &p);
+    if (fd < 0) return -errno;
+
+    fl->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    fl->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    fl->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    fl->sq_ring = mmap(NULL, fl->sq_ring_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (fl->sq_ring == MAP_FAILED) goto ERROR;
+    fl->cq_ring = mmap(NULL, fl->cq_ring_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (fl->cq_ring == MAP_FAILED) {
+        munmap(fl->sq_ring, fl->sq_ring_size);
+        goto ERROR;
+    }
+    fl->sqes = mmap(NULL, fl->sqes_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (fl->sqes == MAP_FAILED) {
+        munmap(fl->sq_ring, fl->sq_ring_size);
+        munmap(fl->cq_ring, fl->cq_ring_size);
+        goto ERROR;
+    }
+
+    char *sq = fl->sq_ring, *cq = fl->cq_ring;
+    fl->sq_head = (unsigned*)(sq + p.sq_off.head);
+    fl->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    fl->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    fl->sq_array = (unsigned*)(sq + p.sq_off.array);
+    fl->cq_head = (unsigned*)(cq + p.cq_off.head);
+    fl->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    fl->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    fl->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    fl->sq_entries = p.sq_entries;
+    fl->ring_fd = fd;
+    return 0;
+
+ERROR:
+    res = -errno;
+    close(fd);
+    return res;
+}
+
+/**
+ * Unmaps the rings and closes the io_uring
+ */
+static void ring_teardown(bloom_flusher *fl) {
+    if (fl->ring_fd < 0) return;
+    munmap(fl->sqes, fl->sqes_size);
+    munmap(fl->cq_ring, fl->cq_ring_size);
+    munmap(fl->sq_ring, fl->sq_ring_size);
+    close(fl->ring_fd);
+    fl->ring_fd = -1;
+}
+
+/**
+ * Submits the queued operations, and optionally
+ * waits for some completions.
+ */
+static int ring_submit(bloom_flusher *fl, unsigned wait_nr) {
+    int res;
+    unsigned flags = (wait_nr) ? IORING_ENTER_GETEVENTS : 0;
+    if (!fl->to_submit && !wait_nr) return 0;
+    do {
+        res = syscall(__NR_io_uring_enter, fl->ring_fd, fl->to_submit, wait_nr, flags, NULL, 0);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to submit flush writes! Err: %s", strerror(errno));
+        return -errno;
+    }
+    fl->to_submit -= res;
+    return 0;
+}
+
+/**
+ * Puts an operation in the submission queue. There is always
+ * room, since the operations in flight are bounded by the
+ * queue size and submitted entries are consumed immediately.
+ */
+static void ring_queue_op(bloom_flusher *fl, flush_op *op) {
+    unsigned tail = *fl->sq_tail;
+    unsigned idx = tail & *fl->sq_mask;
+    struct io_uring_sqe *sqe = fl->sqes + idx;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = op->req->map->fileno;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    if (op->is_sync) {
+        sqe->opcode = IORING_OP_FSYNC;
+    } else {
+        sqe->fd = bitmap_run_fd(op->req->map, op->len);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+        sqe->len = 1;
+        sqe->off = op->req->map->offset + op->offset;
+    }
+    fl->sq_array[idx] = idx;
+    __atomic_store_n(fl->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    fl->to_submit++;
+}
+
+/**
+ * Waits for at least one completion, and reaps it
+ */
+static int ring_wait_one(bloom_flusher *fl) {
+    int res = ring_submit(fl, (fl->ops_inflight) ? 1 : 0);
+    if (res) return res;
+    return ring_reap(fl);
+}
+
+/**
+ * Queues a new operation, waiting for room in the ring
+ */
+static int queue_new_op(bloom_flusher *fl, flush_op *op) {
+    int res;
+    while (fl->ops_inflight >= fl->sq_entries) {
+        if ((res = ring_wait_one(fl))) return res;
+    }
+    fl->ops_inflight++;
+    op->req->pending++;
+    ring_queue_op(fl, op);
+    return 0;
+}
+
+/**
+ * Queues the fsync of a flush
+ */
+static int queue_sync(bloom_flusher *fl, flush_req *req) {
+    flush_op *op = calloc(1, sizeof(flush_op));
+    if (!op) return -ENOMEM;
+    op->req = req;
+    op->is_sync = 1;
+    int res = queue_new_op(fl, op);
+    if (res) free(op);
+    return res;
+}
+
+/**
+ * Queues the fsync once all the writes are done,
+ * and finishes the flush after the fsync.
+ */
+static void maybe_finish(bloom_flusher *fl, flush_req *req) {
+    if (!req->queued || req->pending) return;
+    if (!req->synced && !req->res && fl->group_commit) {
+        park_req(fl, req);
+        return;
+    }
+    if (!req->synced && !req->res) {
+        int res = queue_sync(fl, req);
+        if (!res) return;
+        req->res = res;
+    }
+    finish_req(fl, req);
+}
+
+/**
+ * Queues the write of a run of dirty pages. Used as
+ * the callback of bitmap_flush_runs.
+ */
+static int queue_run(void *data, bloom_bitmap *map, uint64_t offset, uint64_t len) {
+    return queue_write(data, map->mmap + offset, offset, len);
+}
+
+/**
+ * Queues the writes of the runs of a cut. The runs
+ * that are not queued are marked dirty again.
+ */
+static int queue_staged(flush_req *req) {
+    int res = 0;
+    for (bitmap_staged_run *run = req->staged; run; run = run->next) {
+        if (!res) res = queue_write(req, run->data, run->offset, run->len);
+        if (res) bitmap_remark_dirty(req->map, run->offset, run->len);
+    }
+    return res;
+}
+
+/**
+ * Queues the write of a buffer holding a run
+ * of the bitmap, at the offset of the run.
+ */
+static int queue_write(flush_req *req, unsigned char *buf, uint64_t offset, uint64_t len) {
+    bloom_flusher *fl = req->flusher;
+    flush_device *dev = fl->devices + req->device;
+
+    // Wait for the bandwidth budget
+    int res;
+    if ((res = throttle(fl, len))) return res;
+
+    // Wait for the device to drain below the cap
+    while (dev->inflight && dev->inflight + len > fl->max_inflight) {
+        if ((res = ring_wait_one(fl))) return res;
+    }
+
+    flush_op *op = calloc(1, sizeof(flush_op));
+    if (!op) return -ENOMEM;
+    op->req = req;
+    op->iov.iov_base = buf;
+    op->iov.iov_len = len;
+    op->offset = offset;
+    op->len = len;
+    if ((res = queue_new_op(fl, op))) {
+        free(op);
+        return res;
+    }
+    dev->inflight += len;
+    return 0;
+}
+
+/**
+ * Handles all the available completions
+ */
+static int ring_reap(bloom_flusher *fl) {
+    unsigned head = *fl->cq_head;
+    unsigned tail;
+    struct io_uring_cqe *cqe;
+    flush_op *op;
+    flush_req *req;
+    int res;
+    while (head != (tail = __atomic_load_n(fl->cq_tail, __ATOMIC_ACQUIRE))) {
+        cqe = fl->cqes + (head & *fl->cq_mask);
+        op = (flush_op*)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        head++;
+        __atomic_store_n(fl->cq_head, head, __ATOMIC_RELEASE);
+        req = op->req;
+
+        // Retry interrupted operations and short writes
+        if (res == -EINTR || res == -EAGAIN) {
+            ring_queue_op(fl, op);
+            continue;
+        } else if (!op->is_sync && res >= 0 && (uint64_t)res < op->iov.iov_len) {
+            op->iov.iov_base = (char*)op->iov.iov_base + res;
+            op->iov.iov_len -= res;
+            op->offset += res;
+            ring_queue_op(fl, op);
+            continue;
+        }
+
+        // Record the result
+        if (op->is_sync) {
+            req->synced = 1;
+            if (res < 0 && !req->res) req->res = res;
+        } else {
+            fl->devices[req->device].inflight -= op->len;
+            if (res < 0) {
+                if (!req->res) req->res = res;
+                bitmap_remark_dirty(req->map, op->offset, op->iov.iov_len);
+            } else {
+                bitmap_count_written(req->map, op->len);
+            }
+        }
+        free(op);
+        fl->ops_inflight--;
+        req->pending--;
+        maybe_finish(fl, req);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,127 @@
+#ifndef BLOOM_FLUSHER_H
+#define BLOOM_FLUSHER_H
+#include <inttypes.h>
+#include "bitmap.h"
+
+/**
+ * The flusher is an asynchronous flush engine for bitmaps.
+ * The dirty page writes and the final fsync of a bitmap are
+ * queued on an io_uring, so the flushes of many bitmaps can
+ * overlap. The bytes in flight are capped per device. If the
+ * kernel does not support io_uring, the flusher falls back to
+ * a synchronous bitmap_flush. A flusher is not thread safe, and
+ * should be used from a single thread.
+ *
+ * A flusher may also be given a bandwidth budget, so that its
+ * writes do not saturate the disk and starve the page ins.
+ *
+ * With group commit, the flushes only write the dirty pages.
+ * The written flushes wait until flusher_commit, which makes
+ * them durable with one syncfs per device, instead of an fsync
+ * per bitmap, and only then invokes their callbacks.
+ */
+typedef struct bloom_flusher bloom_flusher;
+
+/**
+ * Callback invoked when an asynchronous flush completes.
+ * @arg data The opaque callback data
+ * @arg res 0 on success, negative on failure.
+ */
+typedef void (*bloom_flush_cb)(void *data, int res);
+
+/**
+ * Default cap on the bytes in flight per device. 64MB.
+ */
+#define FLUSHER_DEFAULT_INFLIGHT (64 * 1024 * 1024)
+
+/**
+ * The budget allows a burst of this many milliseconds of writes
+ */
+#define FLUSHER_RATE_BURST_MSEC 100
+
+/**
+ * Creates a new flusher.
+ * @arg max_inflight The maximum bytes in flight per device.
+ * Zero uses FLUSHER_DEFAULT_INFLIGHT.
+ * @arg flusher Output, set to the new flusher
+ * @return 0 on success, negative on failure.
+ */
+int flusher_create(uint64_t max_inflight, bloom_flusher **flusher);
+
+/**
+ * Checks if the flusher is asynchronous, or has fallen back to
+ * synchronous flushes.
+ * @return 1 if io_uring is used, 0 otherwise.
+ */
+int flusher_is_async(bloom_flusher *flusher);
+
+/**
+ * Limits the bytes per second the flusher writes. Writes wait
+ * once the budget is spent, beyond a burst of
+ * FLUSHER_RATE_BURST_MSEC. Synchronous flushes are charged for
+ * the dirty pages of the bitmap before they start.
+ * @arg flusher The flusher
+ * @arg bytes_per_sec The budget, 0 for no limit
+ */
+void flusher_set_rate(bloom_flusher *flusher, uint64_t bytes_per_sec);
+
+/**
+ * Enables or disables group commit. The flushes started while
+ * it is enabled are not synced until flusher_commit.
+ * @arg flusher The flusher
+ * @arg enabled 1 to group the syncs, 0 to sync each flush
+ */
+void flusher_set_group_commit(bloom_flusher *flusher, int enabled);
+
+/**
+ * Starts an asynchronous flush of the bitmap. The callback is
+ * invoked from flusher_poll or flusher_drain once all the dirty
+ * pages are written and the file is synced, or from flusher_commit
+ * with group commit. The callback may also be invoked before this
+ * returns, if there is nothing to wait on.
+ * The bitmap must not be closed until the callback is invoked.
+ * @arg flusher The flusher
+ * @arg map The bitmap to flush
+ * @arg cb The completion callback
+ * @arg data Opaque data for the callback
+ * @return 0 if the flush was started, negative on failure.
+ * The callback is not invoked on failure.
+ */
+int bitmap_flush_async(bloom_flusher *flusher, bloom_bitmap *map, bloom_flush_cb cb, void *data);
+
+/**
+ * Reaps completed writes and invokes the callbacks of
+ * finished flushes.
+ * @arg flusher The flusher
+ * @arg wait If 1, blocks until at least one flush finishes,
+ * unless there are none in flight.
+ * @return The number of flushes finished, negative on failure.
+ */
+int flusher_poll(bloom_flusher *flusher, int wait);
+
+/**
+ * Waits for all the flushes in flight to finish, and
+ * commits the ones written with group commit.
+ * @arg flusher The flusher
+ * @return 0 on success, negative on failure.
+ */
+int flusher_drain(bloom_flusher *flusher);
+
+/**
+ * Makes the written flushes of group commit durable, with one
+ * syncfs per device, then invokes their callbacks. Flushes that
+ * are still writing are left for the next commit. A failed
+ * sync is passed to the callbacks of its flushes.
+ * @arg flusher The flusher
+ * @return The number of flushes committed.
+ */
+int flusher_commit(bloom_flusher *flusher);
+
+/**
+ * Drains and destroys the flusher.
+ * @arg flusher The flusher
+ * @return 0 on success, negative on failure.
+ */
+int flusher_destroy(bloom_flusher *flusher);
+
+#endif
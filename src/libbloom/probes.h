@@ -0,0 +1,35 @@
+#ifndef BLOOM_PROBES_H
+#define BLOOM_PROBES_H
+
+/**
+ * Static USDT probes of the bloomd provider, on the hot paths of
+ * bloomd and libbloom. They are built in when sys/sdt.h is found,
+ * unless BLOOM_NO_PROBES is defined. A disabled probe is a single
+ * nop, so they can stay in production builds, and bpftrace can
+ * attach to them in a running process, such as:
+ *
+ *   bpftrace -e 'usdt:./bloomd:bloomd:flush__start { @[str(arg0)] = count(); }'
+ *
+ * The arguments are only integers and pointers, so they should
+ * not be computed just for a probe.
+ */
+#if !defined(BLOOM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define BLOOM_HAVE_PROBES
+#endif
+#endif
+
+#ifdef BLOOM_HAVE_PROBES
+#include <sys/sdt.h>
+#define BLOOM_PROBE(name) DTRACE_PROBE(bloomd, name)
+#define BLOOM_PROBE1(name, a) DTRACE_PROBE1(bloomd, name, a)
+#define BLOOM_PROBE2(name, a, b) DTRACE_PROBE2(bloomd, name, a, b)
+#define BLOOM_PROBE3(name, a, b, c) DTRACE_PROBE3(bloomd, name, a, b, c)
+#else
+#define BLOOM_PROBE(name) do {} while (0)
+#define BLOOM_PROBE1(name, a) do {} while (0)
+#define BLOOM_PROBE2(name, a, b) do {} while (0)
+#define BLOOM_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
@@ -2,14 +2,57 @@
 #include <math.h>
 #include <stdio.h>
 #include <iso646.h>
+#include <sched.h>
 #include "sbf.h"
+#include "probes.h"
+
+/**
+ * The number of keys hashed and prefetched together
+ * by sbf_contains_batch. This bounds the number of
+ * outstanding prefetches and the hash buffer size.
+ */
+#define SBF_BATCH_SIZE 16
 
 /**
  * Static declarations
  */
 static int sbf_append_filter(bloom_sbf *sbf);
+static int sbf_create_filter(bloom_sbf *sbf, bloom_bloomfilter **out);
+static void sbf_claim_growth(bloom_sbf *sbf);
 static void sbf_init_capacities(bloom_sbf *sbf);
+static void sbf_sort_generations(bloom_sbf *sbf);
+static void sbf_reset_order(bloom_sbf *sbf);
+static void sbf_drop_filter(bloom_bloomfilter *filter);
+static int sbf_can_fold(bloom_sbf *sbf, uint32_t idx);
+static inline void sbf_count_hit(bloom_sbf *sbf, uint32_t idx);
 static double sbf_inital_probability(double fp_prob, double r);
+static int sbf_count_present(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes);
+static int sbf_add_window(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes);
+static void sbf_layer_flushed(void *data, int res);
+static inline int sbf_summary_contains(bloom_sbf *sbf, uint64_t *hashes);
+static void sbf_summary_add(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes, int atomic);
+static int sbf_flush_summary(bloom_sbf *sbf, uint64_t size);
+
+/**
+ * Tracks an asynchronous flush of an SBF. The filters
+ * are kept by pointer, since growth shifts the indexes.
+ */
+typedef struct {
+    bloom_sbf *sbf;
+    bloom_flush_cb cb;
+    void *data;
+    int pending;        // Filters not yet flushed, plus one while queuing
+    int res;            // First error
+    int layers;         // Filters queued, the summary is flushed after them
+    uint64_t size;      // Size of the SBF when the flush started
+} sbf_flush_state;
+
+typedef struct {
+    sbf_flush_state *state;
+    bloom_bloomfilter *filter;
+} sbf_layer_flush;
+
+static void sbf_flush_done(sbf_flush_state *state);
 
 int sbf_from_filters(bloom_sbf_params *params,
                      bloom_sbf_callback cb,
@@ -24,6 +67,13 @@ int sbf_from_filters(bloom_sbf_params *params,
     // Set the callback and its args
     sbf->callback = cb;
     sbf->callback_input = cb_in;
+    sbf->spare = NULL;
+    sbf->growing = 0;
+    sbf->rotation = 0;
+    sbf->summary = NULL;
+    sbf->summary_stale = 0;
+    sbf->staged = 0;
+    sbf->staged_size = 0;
 
     // Copy the filters
     if (num_filters > 0) {
@@ -32,18 +82,29 @@ int sbf_from_filters(bloom_sbf_params *params,
         memcpy(sbf->filters, filters, num_filters*sizeof(bloom_bloomfilter*));
         sbf->dirty_filters = calloc(num_filters, sizeof(unsigned char));
         sbf->capacities = calloc(num_filters, sizeof(uint64_t));
+        sbf->hits = calloc(num_filters, sizeof(uint64_t));
+        sbf->order = calloc(num_filters, sizeof(uint32_t));
+        sbf_reset_order(sbf);
 
         // Compute the capacities of the existing filters
+        if (sbf->params.generations) sbf_sort_generations(sbf);
         sbf_init_capacities(sbf);
     } else {
         sbf->num_filters = 0;
         sbf->filters = NULL;
         sbf->dirty_filters = NULL;
         sbf->capacities = NULL;
+        sbf->hits = NULL;
+        sbf->order = NULL;
 
-        int res = sbf_append_filter(sbf);
-        if (res != 0) {
-            return res;
+        // Windowed SBFs start with all their generations
+        uint32_t initial = (sbf->params.generations) ? sbf->params.generations : 1;
+        int res;
+        for (uint32_t i=0; i < initial; i++) {
+            res = sbf_append_filter(sbf);
+            if (res != 0) {
+                return res;
+            }
         }
     }
 
@@ -57,16 +118,49 @@ int sbf_from_filters(bloom_sbf_params *params,
  * @returns 1 if the key was added, 0 if present. Negative on failure.
  */
 int sbf_add(bloom_sbf *sbf, char* key) {
+    return sbf_add_len(sbf, key, strlen(key));
+}
+
+/**
+ * Adds a new key of a given length to the bloom filter.
+ * @arg sbf The filter to add to
+ * @arg key The key to add, need not be NUL terminated
+ * @arg len The length of the key
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int sbf_add_len(bloom_sbf *sbf, const char* key, uint64_t len) {
+    // Hash once for all the layers
+    uint32_t num_hashes = sbf_num_hashes(sbf);
+    uint64_t *hashes = alloca(num_hashes * sizeof(uint64_t));
+    sbf_compute_hashes_len(sbf, key, len, hashes);
+    return sbf_add_hashed(sbf, hashes, num_hashes);
+}
+
+/**
+ * Adds a new key to the bloom filter using precomputed hashes.
+ * The hashes are extended as needed for layers with a larger k_num.
+ * A key present in counting filters is counted again, see sbf_count_present.
+ * Windowed SBFs add to the newest generation, see sbf_add_window.
+ * @arg sbf The filter to add to
+ * @arg hashes The hashes of the key, computed with sbf_compute_hashes
+ * @arg num_hashes The number of hashes provided, at least 4
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int sbf_add_hashed(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes) {
+    if (sbf->params.generations) return sbf_add_window(sbf, hashes, num_hashes);
+
     // Check if the key is contained first.
-    if (sbf_contains(sbf, key) == 1) {
+    if (sbf->filters[0]->layout == LAYOUT_COUNTING) {
+        if (sbf_count_present(sbf, hashes, num_hashes)) return 0;
+    } else if (sbf_contains_hashed(sbf, hashes, num_hashes) == 1) {
         return 0;
     }
 
     // Get the largest filter
     bloom_bloomfilter *filter = sbf->filters[0];
 
-    // Check if we are over capacity
-    if (bf_size(filter) >= sbf->capacities[0]) {
+    // Check if we are over capacity, windowed SBFs never grow
+    if (!sbf->params.generations && bf_size(filter) >= sbf->capacities[0]) {
         int res = sbf_append_filter(sbf);
         if (res != 0) {
             return res;
@@ -74,12 +168,269 @@ int sbf_add(bloom_sbf *sbf, char* key) {
         filter = sbf->filters[0];
     }
 
-    // Mark as dirty, add to the largest filter
+    // The largest filter may need more hashes
+    if (filter->header->k_num > num_hashes) {
+        uint64_t *extended = alloca(filter->header->k_num * sizeof(uint64_t));
+        memcpy(extended, hashes, num_hashes * sizeof(uint64_t));
+        bf_extend_hashes(filter->header->hash_family, num_hashes,
+                filter->header->k_num, extended);
+        hashes = extended;
+    }
+
+    // Mark as dirty, add to the summary and then to the largest
+    // filter, so the summary has every key the layers have
+    sbf_summary_add(sbf, hashes, num_hashes, 0);
     sbf->dirty_filters[0] = 1;
-    int res = bf_add(filter, key);
+    int res = bf_add_hashed(filter, hashes);
+
+    // A cuckoo filter can fill up before its capacity,
+    // in that case start the next filter early
+    if (res == -ENOSPC && !sbf->params.generations) {
+        res = sbf_append_filter(sbf);
+        if (res != 0) {
+            return res;
+        }
+        sbf->dirty_filters[0] = 1;
+        res = bf_add_hashed(sbf->filters[0], hashes);
+    }
     return res;
 }
 
+/**
+ * Adds a key to the newest generation of a windowed SBF. A key
+ * that is only in the older generations is added as well, so it
+ * does not expire with them, but it is still reported as present.
+ * @arg sbf The filter to add to
+ * @arg hashes The hashes of the key, computed with sbf_compute_hashes
+ * @arg num_hashes The number of hashes provided, at least 4
+ * @returns 1 if the key was in no generation, 0 if present. Negative on failure.
+ */
+static int sbf_add_window(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes) {
+    uint32_t needed = sbf_num_hashes(sbf);
+    if (needed > num_hashes) {
+        uint64_t *extended = alloca(needed * sizeof(uint64_t));
+        memcpy(extended, hashes, num_hashes * sizeof(uint64_t));
+        bf_extend_hashes(sbf_hash_family(sbf), num_hashes, needed, extended);
+        hashes = extended;
+        num_hashes = needed;
+    }
+
+    // Counting generations count a key in the newest generation again
+    bloom_bloomfilter *filter = sbf->filters[0];
+    int present = bf_contains_hashed(filter, hashes);
+    if (present == 1 && filter->layout != LAYOUT_COUNTING) return 0;
+    if (present != 1) present = sbf_contains_hashed(sbf, hashes, num_hashes);
+
+    sbf_summary_add(sbf, hashes, num_hashes, 0);
+    sbf->dirty_filters[0] = 1;
+    int res = bf_add_hashed(filter, hashes);
+    return (res < 0 || present != 1) ? res : 0;
+}
+
+/**
+ * Adds a new key to the bloom filter, without growing the SBF.
+ * This is safe to call concurrently with other concurrent adds
+ * and with checks, but not with sbf_add. If the newest filter is
+ * full, nothing is added and -EAGAIN is returned, so the caller can
+ * retry with sbf_add once it has exclusive access. Counting and cuckoo
+ * filters always return -EAGAIN, since removals and evictions are not atomic.
+ * @arg sbf The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present, -EAGAIN if the SBF
+ * needs to grow. Negative on failure.
+ */
+int sbf_add_concurrent(bloom_sbf *sbf, char* key) {
+    return sbf_add_concurrent_len(sbf, key, strlen(key));
+}
+
+/**
+ * Adds a new key of a given length to the bloom filter, without
+ * growing the SBF. Same as sbf_add_concurrent otherwise.
+ * @arg sbf The filter to add to
+ * @arg key The key to add, need not be NUL terminated
+ * @arg len The length of the key
+ * @returns 1 if the key was added, 0 if present, -EAGAIN if the SBF
+ * needs to grow. Negative on failure.
+ */
+int sbf_add_concurrent_len(bloom_sbf *sbf, const char* key, uint64_t len) {
+    // Removals need exclusive access, so adds do as well
+    bloom_layout layout = sbf->filters[0]->layout;
+    if (layout == LAYOUT_COUNTING || layout == LAYOUT_CUCKOO) {
+        return -EAGAIN;
+    }
+
+    // Hash once for all the layers
+    uint32_t num_hashes = sbf_num_hashes(sbf);
+    uint64_t *hashes = alloca(num_hashes * sizeof(uint64_t));
+    sbf_compute_hashes_len(sbf, key, len, hashes);
+
+    // Check if the key is contained first. Windowed SBFs still add a key
+    // that is only in the older generations, see sbf_add_window.
+    bloom_bloomfilter *filter = sbf->filters[0];
+    int present = (sbf->params.generations) ? bf_contains_hashed(filter, hashes) :
+        sbf_contains_hashed(sbf, hashes, num_hashes);
+    if (present == 1) return 0;
+    if (sbf->params.generations) present = sbf_contains_hashed(sbf, hashes, num_hashes);
+
+    // Growing replaces the filter arrays, which needs exclusive access
+    if (!sbf->params.generations && bf_size(filter) >= sbf->capacities[0]) {
+        return -EAGAIN;
+    }
+
+    // Mark as dirty, add to the largest filter. Racing
+    // writers all store the same value to the dirty flag.
+    sbf_summary_add(sbf, hashes, num_hashes, 1);
+    sbf->dirty_filters[0] = 1;
+    int res = bf_add_hashed_atomic(filter, hashes);
+    return (res < 0 || present != 1) ? res : 0;
+}
+
+/**
+ * Adds many keys to the newest filter as a sorted batch, so
+ * the bits are set in address order. The batch is added
+ * entirely or not at all. If the newest filter would go over
+ * its capacity, or does not support sorted batches, nothing
+ * is added and -EAGAIN is returned, so the caller can add
+ * the keys in turn, growing the SBF as needed.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add, need not be NUL terminated
+ * @arg key_lens The lengths of the keys, or NULL if the
+ * keys are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if the key was added, 0 if present
+ * @returns 0 on success, -EAGAIN if the keys must be added in
+ * turn. Negative on failure.
+ */
+int sbf_add_batch_len(bloom_sbf *sbf, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    bloom_bloomfilter *filter = sbf->filters[0];
+    if (num_keys < BLOOM_BATCH_MIN || filter->layout == LAYOUT_COUNTING ||
+            filter->layout == LAYOUT_CUCKOO) {
+        return -EAGAIN;
+    }
+
+    uint32_t num_hashes = sbf_num_hashes(sbf);
+    uint64_t *hashes = malloc(num_keys * (num_hashes * sizeof(uint64_t) + sizeof(int) + 2));
+    if (!hashes) return -ENOMEM;
+    int *new_keys = (int*)(hashes + (uint64_t)num_keys * num_hashes);
+    char *new_results = (char*)(new_keys + num_keys);
+    char *older = new_results + num_keys;
+
+    // Keys in the older layers are present, the rest are
+    // packed to the front for the newest filter. Windowed SBFs
+    // add those keys as well, see sbf_add_window.
+    int num_new = 0;
+    uint64_t *key_hashes;
+    for (int i=0; i < num_keys; i++) {
+        key_hashes = hashes + (uint64_t)num_new * num_hashes;
+        sbf_compute_hashes_len(sbf, keys[i], (key_lens) ? key_lens[i] : strlen(keys[i]), key_hashes);
+        uint32_t j;
+        for (j=1; j < sbf->num_filters; j++) {
+            if (bf_contains_hashed(sbf->filters[j], key_hashes) == 1) break;
+        }
+        if (j == sbf->num_filters || sbf->params.generations) {
+            older[num_new] = (j < sbf->num_filters);
+            new_keys[num_new++] = i;
+        }
+    }
+
+    // The whole batch must fit, windowed SBFs never grow
+    int res = -EAGAIN;
+    if (sbf->params.generations || bf_size(filter) + num_new <= sbf->capacities[0]) {
+        for (int i=0; i < num_new; i++) sbf_summary_add(sbf, hashes + (uint64_t)i * num_hashes, num_hashes, 0);
+        sbf->dirty_filters[0] = 1;
+        res = bf_add_batch_hashed(filter, hashes, num_hashes, num_new, new_results);
+        if (res >= 0) {
+            memset(results, 0, num_keys);
+            for (int i=0; i < num_new; i++) results[new_keys[i]] = new_results[i] && !older[i];
+            res = 0;
+        }
+    }
+    free(hashes);
+    return res;
+}
+
+/**
+ * Counts a key again in the newest counting filter that has it,
+ * which is the filter sbf_remove takes it from. A set of a false
+ * positive is then counted, and unsetting the key it collides
+ * with does not remove it.
+ * @return 1 if the key was present, 0 otherwise.
+ */
+static int sbf_count_present(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes) {
+    uint32_t needed = sbf_num_hashes(sbf);
+    if (needed > num_hashes) {
+        uint64_t *extended = alloca(needed * sizeof(uint64_t));
+        memcpy(extended, hashes, num_hashes * sizeof(uint64_t));
+        bf_extend_hashes(sbf_hash_family(sbf), num_hashes, needed, extended);
+        hashes = extended;
+    }
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        if (bf_contains_hashed(sbf->filters[i], hashes) != 1) continue;
+        bf_add_hashed(sbf->filters[i], hashes);
+        sbf->dirty_filters[i] = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Removes a key from the SBF. The key is removed from the
+ * newest filter that contains it. Only supported if the
+ * filters use the counting or cuckoo layout.
+ * @arg sbf The filter to remove from
+ * @arg key The key to remove
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filters do not use the counting or cuckoo layout.
+ */
+int sbf_remove(bloom_sbf *sbf, char* key) {
+    return sbf_remove_len(sbf, key, strlen(key));
+}
+
+/**
+ * Removes a key of a given length from the SBF.
+ * @arg sbf The filter to remove from
+ * @arg key The key to remove, need not be NUL terminated
+ * @arg len The length of the key
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filters do not use the counting or cuckoo layout.
+ */
+int sbf_remove_len(bloom_sbf *sbf, const char* key, uint64_t len) {
+    // Hash once for all the layers
+    uint32_t num_hashes = sbf_num_hashes(sbf);
+    uint64_t *hashes = alloca(num_hashes * sizeof(uint64_t));
+    sbf_compute_hashes_len(sbf, key, len, hashes);
+    return sbf_remove_hashed(sbf, hashes, num_hashes);
+}
+
+/**
+ * Removes a key from the SBF using precomputed hashes.
+ * @arg sbf The filter to remove from
+ * @arg hashes The hashes of the key, computed with sbf_compute_hashes
+ * @arg num_hashes The number of hashes provided, at least 4
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filters do not use the counting or cuckoo layout.
+ */
+int sbf_remove_hashed(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes) {
+    // Extend the hashes if some layer needs more
+    uint32_t needed = sbf_num_hashes(sbf);
+    if (needed > num_hashes) {
+        uint64_t *extended = alloca(needed * sizeof(uint64_t));
+        memcpy(extended, hashes, num_hashes * sizeof(uint64_t));
+        bf_extend_hashes(sbf_hash_family(sbf), num_hashes, needed, extended);
+        hashes = extended;
+    }
+
+    // Remove from the newest filter that has the key
+    int res;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        res = bf_remove_hashed(sbf->filters[i], hashes);
+        if (res == 0) continue;
+        if (res == 1) sbf->dirty_filters[i] = 1;
+        return res;
+    }
+    return 0;
+}
+
 /**
  * Checks the filter for a key
  * @arg sbf The filter to check
@@ -87,15 +438,177 @@ int sbf_add(bloom_sbf *sbf, char* key) {
  * @returns 1 if present, 0 if not present, negative on error.
  */
 int sbf_contains(bloom_sbf *sbf, char* key) {
-    // Check each filter from largest to smallest
+    return sbf_contains_len(sbf, key, strlen(key));
+}
+
+/**
+ * Checks the filter for a key of a given length
+ * @arg sbf The filter to check
+ * @arg key The key to check, need not be NUL terminated
+ * @arg len The length of the key
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int sbf_contains_len(bloom_sbf *sbf, const char* key, uint64_t len) {
+    // Hash once for all the layers
+    uint32_t num_hashes = sbf_num_hashes(sbf);
+    uint64_t *hashes = alloca(num_hashes * sizeof(uint64_t));
+    sbf_compute_hashes_len(sbf, key, len, hashes);
+    return sbf_contains_hashed(sbf, hashes, num_hashes);
+}
+
+/**
+ * Checks the filter for a key using precomputed hashes.
+ * @arg sbf The filter to check
+ * @arg hashes The hashes of the key, computed with sbf_compute_hashes
+ * @arg num_hashes The number of hashes provided, at least 4
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int sbf_contains_hashed(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes) {
+    // Extend the hashes if some layer needs more
+    uint32_t needed = sbf_num_hashes(sbf);
+    if (needed > num_hashes) {
+        uint64_t *extended = alloca(needed * sizeof(uint64_t));
+        memcpy(extended, hashes, num_hashes * sizeof(uint64_t));
+        bf_extend_hashes(sbf_hash_family(sbf), num_hashes, needed, extended);
+        hashes = extended;
+    }
+
+    // A miss in the summary skips all the layers
+    if (!sbf_summary_contains(sbf, hashes)) return 0;
+
+    // Check each filter in the probe order
     int res;
+    uint32_t idx;
     for (uint32_t i=0;i<sbf->num_filters;i++) {
-        res = bf_contains(sbf->filters[i], key);
-        if (res == 1) return 1;
+        idx = sbf->order[i];
+        res = bf_contains_hashed(sbf->filters[idx], hashes);
+        if (res == 1) {
+            sbf_count_hit(sbf, idx);
+            return 1;
+        }
     }
     return 0;
 }
 
+/**
+ * Checks the filter for many keys at once. All the keys in a
+ * batch are hashed and their probe locations prefetched, before
+ * any probe is resolved, so the cache misses of the keys overlap.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if present, 0 if not present
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_batch(bloom_sbf *sbf, char **keys, int num_keys, char *results) {
+    return sbf_contains_batch_len(sbf, keys, NULL, num_keys, results);
+}
+
+/**
+ * Checks the filter for many keys of given lengths at once.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check, need not be NUL terminated
+ * @arg key_lens The lengths of the keys, or NULL if the
+ * keys are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if present, 0 if not present
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_batch_len(bloom_sbf *sbf, char **keys, uint64_t *key_lens, int num_keys, char *results) {
+    if (sbf == NULL || sbf->num_filters == 0 || num_keys < 0) {
+        return -1;
+    }
+
+    uint32_t num_hashes = sbf_num_hashes(sbf);
+    uint64_t *hashes = alloca(SBF_BATCH_SIZE * num_hashes * sizeof(uint64_t));
+    uint64_t *key_hashes;
+    int batch, i;
+    uint32_t j, idx;
+    int summarized = sbf->summary && !sbf->summary_stale;
+    char passed[SBF_BATCH_SIZE];
+
+    for (int start=0; start < num_keys; start += SBF_BATCH_SIZE) {
+        batch = num_keys - start;
+        if (batch > SBF_BATCH_SIZE) batch = SBF_BATCH_SIZE;
+
+        // Hash all the keys, and prefetch every probe location.
+        // With a summary, only its line is prefetched at first.
+        for (i=0; i < batch; i++) {
+            key_hashes = hashes + i * num_hashes;
+            sbf_compute_hashes_len(sbf, keys[start + i],
+                    (key_lens) ? key_lens[start + i] : strlen(keys[start + i]), key_hashes);
+            if (summarized) {
+                bf_prefetch_hashed(sbf->summary, key_hashes);
+                continue;
+            }
+            for (j=0; j < sbf->num_filters; j++) {
+                bf_prefetch_hashed(sbf->filters[j], key_hashes);
+            }
+        }
+
+        // Resolve the summary, and prefetch the layers of the keys it passes
+        for (i=0; i < batch; i++) {
+            passed[i] = !summarized || bf_contains_hashed(sbf->summary, hashes + i * num_hashes) == 1;
+            for (j=0; summarized && passed[i] && j < sbf->num_filters; j++) {
+                bf_prefetch_hashed(sbf->filters[j], hashes + i * num_hashes);
+            }
+        }
+
+        // Resolve the probes, the lines should now be in flight
+        for (i=0; i < batch; i++) {
+            key_hashes = hashes + i * num_hashes;
+            results[start + i] = 0;
+            for (j=0; passed[i] && j < sbf->num_filters; j++) {
+                idx = sbf->order[j];
+                if (bf_contains_hashed(sbf->filters[idx], key_hashes) == 1) {
+                    sbf_count_hit(sbf, idx);
+                    results[start + i] = 1;
+                    break;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the number of hashes needed to probe every layer
+ * of the SBF. This is the largest k_num, and at least 4.
+ */
+uint32_t sbf_num_hashes(bloom_sbf *sbf) {
+    uint32_t num_hashes = 4;
+    if (sbf->summary && sbf->summary->header->k_num > num_hashes) {
+        num_hashes = sbf->summary->header->k_num;
+    }
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        if (sbf->filters[i]->header->k_num > num_hashes) {
+            num_hashes = sbf->filters[i]->header->k_num;
+        }
+    }
+    return num_hashes;
+}
+
+/**
+ * Computes the hashes of a key for all layers of the SBF.
+ * @arg sbf The filter
+ * @arg key The key to hash
+ * @arg hashes Output array, must have room for sbf_num_hashes
+ */
+void sbf_compute_hashes(bloom_sbf *sbf, char *key, uint64_t *hashes) {
+    sbf_compute_hashes_len(sbf, key, strlen(key), hashes);
+}
+
+/**
+ * Computes the hashes of a key of a given length for all layers.
+ * @arg sbf The filter
+ * @arg key The key to hash, need not be NUL terminated
+ * @arg len The length of the key
+ * @arg hashes Output array, must have room for sbf_num_hashes
+ */
+void sbf_compute_hashes_len(bloom_sbf *sbf, const char *key, uint64_t len, uint64_t *hashes) {
+    bf_compute_hashes_len(sbf_hash_family(sbf), sbf_num_hashes(sbf), key, len, hashes);
+}
+
 /**
  * Returns the size of the bloom filter in item count
  */
@@ -107,6 +620,17 @@ uint64_t sbf_size(bloom_sbf *sbf) {
     return size;
 }
 
+/**
+ * Estimates the distinct keys of the SBF, summing the layers.
+ */
+uint64_t sbf_estimate_size(bloom_sbf *sbf) {
+    uint64_t size = 0;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        size += bf_estimate_size(sbf->filters[i]);
+    }
+    return size;
+}
+
 /**
  * Flushes the filter, and updates the metadata.
  * @return 0 on success, negative on failure.
@@ -117,17 +641,160 @@ int sbf_flush(bloom_sbf *sbf) {
         return -1;
     }
 
-    int res = 0;
+    // The summary is flushed after the layers, with the size they had.
+    // After a cut, that is the size at the cut, and the layers cut
+    // clean wait for the next flush, since they may have changed.
+    int staged = sbf->staged;
+    sbf->staged = 0;
+    uint64_t size = (staged) ? sbf->staged_size : sbf_size(sbf);
+    int res = 0, flushed = 0, cut;
+    bloom_bitmap *map;
     for (uint32_t i=0;i<sbf->num_filters;i++) {
-        if (sbf->dirty_filters[i] == 1) {
-            res = bf_flush(sbf->filters[i]);
-            if (res != 0) break;
-            sbf->dirty_filters[i] = 0;
-        }
+        map = sbf->filters[i]->map;
+        cut = map->staged != NULL;
+        if (staged && !cut && map->mode == PERSISTENT) continue;
+        if (!cut && sbf->dirty_filters[i] != 1) continue;
+
+        // The flag of a cut layer was cleared at the cut
+        res = bf_flush(sbf->filters[i]);
+        if (res != 0) break;
+        if (!cut) sbf->dirty_filters[i] = 0;
+        flushed = 1;
     }
+    if (!res && flushed) res = sbf_flush_summary(sbf, size);
     return res;
 }
 
+/**
+ * Flushes the summary, once the layers it covers are flushed.
+ * The size of the SBF is recorded as the count of the summary, so
+ * a summary that misses the keys of a later flush of the layers is
+ * found stale on load. A stale summary records a size no SBF has.
+ * @arg size The size of the SBF before the layers were flushed
+ */
+static int sbf_flush_summary(bloom_sbf *sbf, uint64_t size) {
+    bloom_bloomfilter *summary = sbf->summary;
+    if (!summary) return 0;
+    summary->header->count = (sbf->summary_stale) ? UINT64_MAX : size;
+    bitmap_mark_dirty(summary->map, 0);
+    return bf_flush(summary);
+}
+
+/**
+ * Cuts a consistent image of the SBF for the next flush.
+ * The flags of the cut layers are cleared, so that adds
+ * after the cut mark them dirty for the flush after.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_stage(bloom_sbf *sbf) {
+    if (sbf == NULL || sbf->num_filters == 0) return -1;
+
+    int res;
+    bloom_bitmap *map;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        map = sbf->filters[i]->map;
+        if (map->mode != PERSISTENT) continue;
+        if (sbf->dirty_filters[i] != 1 && !map->staged) continue;
+        if ((res = bitmap_stage(map))) return res;
+        sbf->dirty_filters[i] = 0;
+    }
+    sbf->staged_size = sbf_size(sbf);
+    sbf->staged = 1;
+    return 0;
+}
+
+/**
+ * Starts an asynchronous flush of the dirty filters.
+ * @arg sbf The SBF to flush
+ * @arg flusher The flusher to use
+ * @arg cb The completion callback
+ * @arg data Opaque data for the callback
+ * @return 0 if the flush was started, negative on failure.
+ */
+int sbf_flush_async(bloom_sbf *sbf, bloom_flusher *flusher, bloom_flush_cb cb, void *data) {
+    // Check if it has been previously closed
+    if (sbf == NULL || sbf->num_filters == 0) {
+        return -1;
+    }
+
+    sbf_flush_state *state = calloc(1, sizeof(sbf_flush_state));
+    if (!state) return -ENOMEM;
+    state->sbf = sbf;
+    state->cb = cb;
+    state->data = data;
+    state->pending = 1;
+
+    // A cut is written as in sbf_flush
+    int staged = sbf->staged;
+    sbf->staged = 0;
+    state->size = (staged) ? sbf->staged_size : sbf_size(sbf);
+    int res, cut;
+    bloom_bitmap *map;
+    sbf_layer_flush *layer;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        map = sbf->filters[i]->map;
+        cut = map->staged != NULL;
+        if (staged && !cut && map->mode == PERSISTENT) continue;
+        if (!cut && sbf->dirty_filters[i] != 1) continue;
+        layer = malloc(sizeof(sbf_layer_flush));
+        if (!layer) {
+            state->res = -ENOMEM;
+            break;
+        }
+        layer->state = state;
+        layer->filter = sbf->filters[i];
+
+        // Clear first, so that sets during the flush redirty it
+        if (!cut) sbf->dirty_filters[i] = 0;
+        state->pending++;
+        state->layers++;
+        res = bitmap_flush_async(flusher, sbf->filters[i]->map, sbf_layer_flushed, layer);
+        if (res) {
+            sbf->dirty_filters[i] = 1;
+            state->pending--;
+            state->res = res;
+            free(layer);
+            break;
+        }
+    }
+
+    // Drop the guard, this may complete the flush
+    if (--state->pending == 0) sbf_flush_done(state);
+    return 0;
+}
+
+/**
+ * Completes an asynchronous flush, once all the filters
+ * are written. The summary is then flushed in turn.
+ */
+static void sbf_flush_done(sbf_flush_state *state) {
+    if (!state->res && state->layers) state->res = sbf_flush_summary(state->sbf, state->size);
+    if (state->cb) state->cb(state->data, state->res);
+    free(state);
+}
+
+/**
+ * Invoked by the flusher as each filter completes
+ */
+static void sbf_layer_flushed(void *data, int res) {
+    sbf_layer_flush *layer = data;
+    sbf_flush_state *state = layer->state;
+
+    // Redirty the filter on failure, it may have moved
+    if (res) {
+        if (!state->res) state->res = res;
+        for (uint32_t i=0;i<state->sbf->num_filters;i++) {
+            if (state->sbf->filters[i] == layer->filter) {
+                state->sbf->dirty_filters[i] = 1;
+                break;
+            }
+        }
+    }
+    free(layer);
+
+    if (--state->pending == 0) sbf_flush_done(state);
+}
+
 /**
  * Flushes and closes the filter. Closes the underlying bitmap and filters,
  * and frees them.
@@ -150,6 +817,20 @@ int sbf_close(bloom_sbf *sbf) {
         free(sbf->filters[i]);
         free(map);
     }
+    if (sbf->spare) {
+        map = sbf->spare->map;
+        res |= bf_close(sbf->spare);
+        free(sbf->spare);
+        free(map);
+        sbf->spare = NULL;
+    }
+    if (sbf->summary) {
+        map = sbf->summary->map;
+        res |= bf_close(sbf->summary);
+        free(sbf->summary);
+        free(map);
+        sbf->summary = NULL;
+    }
 
     // Clean up memory
     free(sbf->filters);
@@ -158,6 +839,10 @@ int sbf_close(bloom_sbf *sbf) {
     sbf->dirty_filters = NULL;
     free(sbf->capacities);
     sbf->capacities = NULL;
+    free(sbf->hits);
+    sbf->hits = NULL;
+    free(sbf->order);
+    sbf->order = NULL;
 
     // Zero out
     sbf->num_filters = 0;
@@ -167,6 +852,352 @@ int sbf_close(bloom_sbf *sbf) {
     return res;
 }
 
+/**
+ * Merges an older layer of the SBF into the next newer layer.
+ * @arg sbf The SBF to compact
+ * @arg merged Output, set to the index of the layer that was merged away
+ * @return 1 if a layer was merged, 0 if not, negative on failure.
+ */
+int sbf_compact(bloom_sbf *sbf, uint32_t *merged) {
+    // Check if it has been previously closed
+    if (sbf == NULL || sbf->num_filters == 0) {
+        return -1;
+    }
+
+    // Generations age out on their own, they are not merged
+    if (sbf->params.generations) return 0;
+
+    // Check for a pair of layers that line up first, since
+    // estimating the probabilities reads all the bitmaps
+    uint32_t i;
+    for (i=sbf->num_filters - 1; i > 1; i--) {
+        if (bf_can_merge(sbf->filters[i-1], sbf->filters[i])) break;
+    }
+    if (i <= 1) return 0;
+
+    // The probability of the SBF is bounded by the sum of the layers
+    double *fp = malloc(sbf->num_filters * sizeof(double));
+    double total = 0;
+    for (uint32_t j=0; j < sbf->num_filters; j++) {
+        fp[j] = bf_estimate_fp_probability(sbf->filters[j]);
+        total += fp[j];
+    }
+
+    // Merge the oldest pair that stays within the budget
+    double merged_fp;
+    for (; i > 1; i--) {
+        if (!bf_can_merge(sbf->filters[i-1], sbf->filters[i])) continue;
+        merged_fp = bf_estimate_merged_fp_probability(sbf->filters[i-1], sbf->filters[i]);
+        if (total - fp[i-1] - fp[i] + merged_fp <= sbf->params.fp_probability) break;
+    }
+    free(fp);
+    if (i <= 1) return 0;
+
+    // Record the capacities in the headers, since they can
+    // no longer be computed from the positions of the layers
+    for (uint32_t j=0; j < sbf->num_filters; j++) {
+        if (sbf->filters[j]->header->capacity) continue;
+        sbf->filters[j]->header->capacity = sbf->capacities[j];
+        bitmap_mark_dirty(sbf->filters[j]->map, 0);
+        sbf->dirty_filters[j] = 1;
+    }
+    int res = sbf_flush(sbf);
+    if (res) return res;
+
+    // Merge, and make the merged layer durable before dropping the old one
+    bloom_bloomfilter *dst = sbf->filters[i-1];
+    bloom_bloomfilter *src = sbf->filters[i];
+    res = bf_merge(dst, src);
+    if (res) return res;
+    sbf->capacities[i-1] += sbf->capacities[i];
+    sbf->hits[i-1] += sbf->hits[i];
+    res = bf_flush(dst);
+    if (res) {
+        sbf->dirty_filters[i-1] = 1;
+        return res;
+    }
+
+    // Close the old layer
+    bloom_bitmap *map = src->map;
+    bf_close(src);
+    free(src);
+    free(map);
+
+    // Shift the older layers down
+    uint32_t older = sbf->num_filters - i - 1;
+    memmove(sbf->filters+i, sbf->filters+i+1, older*sizeof(bloom_bloomfilter*));
+    memmove(sbf->dirty_filters+i, sbf->dirty_filters+i+1, older*sizeof(unsigned char));
+    memmove(sbf->capacities+i, sbf->capacities+i+1, older*sizeof(uint64_t));
+    memmove(sbf->hits+i, sbf->hits+i+1, older*sizeof(uint64_t));
+    sbf->num_filters--;
+    sbf_reset_order(sbf);
+
+    *merged = i;
+    return 1;
+}
+
+/**
+ * Finds a layer of the SBF to fold into a smaller one.
+ * @arg sbf The SBF
+ * @arg fp_probability The probability the SBF must stay within
+ * @arg idx Output, set to the index of the layer to fold
+ * @return 1 if a layer can be folded, 0 if not, negative on failure.
+ */
+int sbf_fold_candidate(bloom_sbf *sbf, double fp_probability, uint32_t *idx) {
+    // Check if it has been previously closed
+    if (sbf == NULL || sbf->num_filters == 0) {
+        return -1;
+    }
+
+    // Generations are recycled at their size, they are not folded
+    if (sbf->params.generations) return 0;
+
+    // Check for a sparse layer first, since estimating
+    // the probabilities reads all the bitmaps
+    uint32_t i;
+    for (i=sbf->num_filters; i > 0; i--) {
+        if (sbf_can_fold(sbf, i-1)) break;
+    }
+    if (i == 0) return 0;
+
+    // The probability of the SBF is bounded by the sum of the layers
+    double *fp = malloc(sbf->num_filters * sizeof(double));
+    double total = 0;
+    for (uint32_t j=0; j < sbf->num_filters; j++) {
+        fp[j] = bf_estimate_fp_probability(sbf->filters[j]);
+        total += fp[j];
+    }
+
+    // Fold the oldest layer that stays within the budget
+    double folded_fp;
+    for (; i > 0; i--) {
+        if (!sbf_can_fold(sbf, i-1)) continue;
+        folded_fp = bf_estimate_folded_fp_probability(sbf->filters[i-1]);
+        if (total - fp[i-1] + folded_fp <= fp_probability) break;
+    }
+    free(fp);
+    if (i == 0) return 0;
+
+    *idx = i-1;
+    return 1;
+}
+
+/**
+ * Folds a layer of the SBF into a new, smaller bitmap.
+ * @arg sbf The SBF
+ * @arg idx The index of the layer
+ * @arg map The bitmap of the folded layer
+ * @return 0 on success, negative on failure.
+ */
+int sbf_fold_layer(bloom_sbf *sbf, uint32_t idx, bloom_bitmap *map) {
+    // Check if it has been previously closed
+    if (sbf == NULL || idx >= sbf->num_filters) {
+        return -1;
+    }
+
+    // Fold, and make the folded layer durable before dropping the old one
+    bloom_bloomfilter *src = sbf->filters[idx];
+    bloom_bloomfilter *dst = calloc(1, sizeof(bloom_bloomfilter));
+    uint32_t factor = bf_fold_factor(src);
+    int res = bf_fold(src, map, dst);
+    if (!res) {
+        dst->header->capacity = sbf->capacities[idx] / factor;
+        res = bf_flush(dst);
+    }
+    if (res) {
+        free(dst);
+        return res;
+    }
+    sbf->filters[idx] = dst;
+    sbf->dirty_filters[idx] = 0;
+    sbf->capacities[idx] = dst->header->capacity;
+
+    // Close the old layer
+    bloom_bitmap *old_map = src->map;
+    bf_close(src);
+    free(src);
+    free(old_map);
+    return 0;
+}
+
+/**
+ * Checks if a layer has a geometry that can be folded, and
+ * is sparse enough that the folded layer is at most half full.
+ */
+static int sbf_can_fold(bloom_sbf *sbf, uint32_t idx) {
+    uint32_t factor = bf_fold_factor(sbf->filters[idx]);
+    return factor && bf_size(sbf->filters[idx]) * 2 * factor <= sbf->capacities[idx];
+}
+
+/**
+ * Merges, or intersects, the layers of another SBF into this one.
+ * @arg sbf The SBF to change
+ * @arg src The SBF to read
+ * @arg intersect Intersect instead of merging
+ * @return 0 on success, -EINVAL if the layers do not line up,
+ * negative on failure.
+ */
+int sbf_combine(bloom_sbf *sbf, bloom_sbf *src, int intersect) {
+    // Check if it has been previously closed
+    if (sbf == NULL || sbf->num_filters == 0 || src == NULL || src->num_filters == 0) {
+        return -1;
+    }
+
+    // Check every pair first, so a mismatch changes nothing
+    if (sbf->num_filters != src->num_filters ||
+            sbf->params.generations || src->params.generations) {
+        return -EINVAL;
+    }
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        if (sbf->filters[i]->map->size != src->filters[i]->map->size ||
+                !bf_can_merge(sbf->filters[i], src->filters[i])) {
+            return -EINVAL;
+        }
+    }
+
+    int res;
+    uint64_t capacity;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        if (intersect) {
+            res = bf_intersect(sbf->filters[i], src->filters[i]);
+        } else {
+            // Record the capacity, since it no longer follows the position
+            capacity = sbf->capacities[i] + src->capacities[i];
+            res = bf_merge(sbf->filters[i], src->filters[i]);
+            sbf->filters[i]->header->capacity = capacity;
+            sbf->capacities[i] = capacity;
+        }
+        if (res) return res;
+        sbf->dirty_filters[i] = 1;
+    }
+
+    // Merged keys are not in the summary
+    if (!intersect) sbf->summary_stale = 1;
+    return 0;
+}
+
+/**
+ * Clears the SBF, dropping all but its oldest layer.
+ * @arg sbf The SBF to reset
+ * @return The number of layers kept, negative on failure.
+ */
+int sbf_reset(bloom_sbf *sbf) {
+    // Check if it has been previously closed
+    if (sbf == NULL || sbf->num_filters == 0) {
+        return -1;
+    }
+
+    // Keep a filter from being prepared while the layers change
+    sbf_claim_growth(sbf);
+    bloom_bloomfilter *filter = sbf->spare;
+    sbf->spare = NULL;
+    if (filter) sbf_drop_filter(filter);
+
+    // Generations are all kept, the oldest layer has the initial capacity
+    uint32_t keep = (sbf->params.generations) ? sbf->num_filters : 1;
+    uint32_t last = sbf->num_filters - 1;
+    if (keep == 1 && last) {
+        for (uint32_t i=0; i < last; i++) sbf_drop_filter(sbf->filters[i]);
+        sbf->filters[0] = sbf->filters[last];
+        sbf->capacities[0] = sbf->capacities[last];
+        sbf->num_filters = 1;
+        sbf_reset_order(sbf);
+    }
+
+    int res = 0;
+    for (uint32_t i=0; i < sbf->num_filters && !res; i++) {
+        res = bf_clear(sbf->filters[i]);
+        sbf->dirty_filters[i] = 1;
+        sbf->hits[i] = 0;
+    }
+
+    // An empty summary covers the empty layers, even if it was stale
+    if (!res && sbf->summary) {
+        res = bf_clear(sbf->summary);
+        sbf->summary_stale = (res != 0);
+    }
+    __atomic_store_n(&sbf->growing, 0, __ATOMIC_RELEASE);
+    return (res) ? res : (int)keep;
+}
+
+/**
+ * Closes and frees a layer that is dropped. The data is zeroed
+ * first, so that none of it is written out on close.
+ */
+static void sbf_drop_filter(bloom_bloomfilter *filter) {
+    bloom_bitmap *map = filter->map;
+    bitmap_zero(map, 0, map->size);
+    bf_close(filter);
+    free(filter);
+    free(map);
+}
+
+/**
+ * Rotates a windowed SBF, recycling the oldest generation.
+ * @arg sbf The SBF to rotate
+ * @arg epoch The epoch of the new generation
+ * @return 0 on success, negative on failure.
+ */
+int sbf_rotate(bloom_sbf *sbf, uint64_t epoch) {
+    // Check if it has been previously closed
+    if (sbf == NULL || sbf->num_filters == 0) {
+        return -1;
+    }
+    if (!sbf->params.generations) return -EINVAL;
+
+    // Clear the oldest generation
+    uint32_t last = sbf->num_filters - 1;
+    bloom_bloomfilter *filter = sbf->filters[last];
+    uint64_t capacity = sbf->capacities[last];
+    int res = bf_clear(filter);
+    if (res) return res;
+    filter->header->epoch = epoch;
+
+    // Move it to the front
+    memmove(sbf->filters+1, sbf->filters, last*sizeof(bloom_bloomfilter*));
+    memmove(sbf->dirty_filters+1, sbf->dirty_filters, last*sizeof(unsigned char));
+    memmove(sbf->capacities+1, sbf->capacities, last*sizeof(uint64_t));
+    memmove(sbf->hits+1, sbf->hits, last*sizeof(uint64_t));
+    sbf->filters[0] = filter;
+    sbf->dirty_filters[0] = 1;
+    sbf->capacities[0] = capacity;
+    sbf->hits[0] = 0;
+    sbf_reset_order(sbf);
+    sbf->rotation = (sbf->rotation + 1) % sbf->num_filters;
+    return 0;
+}
+
+/**
+ * Orders the probes of checks by the hits of the filters.
+ * @arg sbf The SBF
+ * @arg apply If 0, only checks if the order would change
+ * @return 1 if the order changes, 0 otherwise.
+ */
+int sbf_reorder(bloom_sbf *sbf, int apply) {
+    // Insertion sort, there are only a few filters
+    uint32_t *order = alloca(sbf->num_filters * sizeof(uint32_t));
+    uint64_t hits;
+    uint32_t i, j;
+    for (i=0; i < sbf->num_filters; i++) {
+        hits = __atomic_load_n(sbf->hits + i, __ATOMIC_RELAXED);
+        for (j=i; j > 0 && __atomic_load_n(sbf->hits + order[j-1], __ATOMIC_RELAXED) < hits; j--) {
+            order[j] = order[j-1];
+        }
+        order[j] = i;
+    }
+
+    if (!memcmp(order, sbf->order, sbf->num_filters * sizeof(uint32_t))) return 0;
+    if (apply) memcpy(sbf->order, order, sbf->num_filters * sizeof(uint32_t));
+    return 1;
+}
+
+/**
+ * Returns the epoch of the newest generation.
+ */
+uint64_t sbf_epoch(bloom_sbf *sbf) {
+    return sbf->filters[0]->header->epoch;
+}
+
 /**
  * Returns the total capacity of the SBF currently.
  */
@@ -188,48 +1219,111 @@ uint64_t sbf_total_byte_size(bloom_sbf *sbf) {
         filter = sbf->filters[i];
         size += filter->map->size;
     }
+    if (sbf->summary) size += sbf->summary->map->size;
     return size;
 }
 
 /**
- * Appends a new filter to the SBF
+ * Computes the parameters of a summary for the SBF.
+ * @arg sbf The SBF
+ * @arg capacity The number of keys to size the summary for
+ * @arg params Output, the parameters of the summary
+ * @return 0 on success, -EINVAL if the SBF cannot have a summary.
  */
-static int sbf_append_filter(bloom_sbf *sbf) {
-    // Start with the initial configs
-    uint64_t capacity = sbf->params.initial_capacity;
-    double fp_prob = sbf_inital_probability(sbf->params.fp_probability, sbf->params.probability_reduction);
+int sbf_summary_params(bloom_sbf *sbf, uint64_t capacity, bloom_filter_params *params) {
+    bloom_layout layout = (sbf->num_filters) ? sbf->filters[0]->layout : sbf->params.layout;
+    if (sbf->params.generations || layout == LAYOUT_COUNTING || layout == LAYOUT_CUCKOO || !capacity) {
+        return -EINVAL;
+    }
+
+    // Blocked, so a check probes a single cache line
+    bloom_filter_params summary = {0, 0, capacity, SBF_SUMMARY_PROBABILITY, LAYOUT_BLOCKED,
+        sbf_hash_family(sbf), sbf->params.index_mode, sbf->params.bit_order, OPTIMIZE_MEMORY};
+    int res = bf_params_for_capacity(&summary);
+    if (res) return res;
+    *params = summary;
+    return 0;
+}
 
-    // Get the settings for the new filter
-    capacity *= pow(sbf->params.scale_size, sbf->num_filters);
-    fp_prob *= pow(sbf->params.probability_reduction, sbf->num_filters);
+/**
+ * Adds a summary to the SBF.
+ * @arg sbf The SBF
+ * @arg map The bitmap of the summary
+ * @arg params The params of a new summary, or NULL to load one
+ * @return 1 if the summary is used, 0 if it is stale, negative on failure.
+ */
+int sbf_attach_summary(bloom_sbf *sbf, bloom_bitmap *map, bloom_filter_params *params) {
+    bloom_filter_params check;
+    if (sbf->summary || sbf_summary_params(sbf, 1, &check)) return -EINVAL;
 
-    // Compute the new parameters
-    bloom_filter_params params = {0, 0, capacity, fp_prob};
-    int res = bf_params_for_capacity(&params);
-    if (res != 0) {
+    bloom_bloomfilter *summary = calloc(1, sizeof(bloom_bloomfilter));
+    int res = (params) ? bf_from_bitmap_params(map, params, 1, summary) : bf_from_bitmap(map, 1, 0, summary);
+    if (!res && (summary->layout != LAYOUT_BLOCKED || summary->header->hash_family != sbf_hash_family(sbf))) {
+        res = -EINVAL;
+    }
+    if (res) {
+        free(summary);
         return res;
     }
 
-    // Allocate a new bitmap
-    bloom_bitmap *map = calloc(1, sizeof(bloom_bitmap));
+    // The summary only covers the layers if it saw all their keys
+    sbf->summary_stale = bf_size(summary) != sbf_size(sbf);
+    sbf->summary = summary;
+    return !sbf->summary_stale;
+}
 
-    // Try to use our call back if we have one
-    if (sbf->callback) {
-        res = sbf->callback(sbf->callback_input, params.bytes, map);
-    } else {
-        res = bitmap_from_file(-1, params.bytes, ANONYMOUS, map);
+/**
+ * Creates the next filter ahead of time.
+ * @arg sbf The SBF
+ * @arg fill The fraction of the capacity of the newest filter
+ * @return 1 if a filter was prepared, 0 if not needed, negative on failure.
+ */
+int sbf_prepare_filter(bloom_sbf *sbf, double fill) {
+    // Skip if a filter is already prepared, or being created.
+    // Windowed SBFs have all their generations already.
+    if (sbf->params.generations || sbf->spare || !__sync_bool_compare_and_swap(&sbf->growing, 0, 1)) {
+        return 0;
     }
-    if (res != 0) {
-        free(map);
-        return res;
+
+    // Adds cannot grow the SBF while we hold growing
+    int res = 0;
+    if (!sbf->spare && bf_size(sbf->filters[0]) >= fill * sbf->capacities[0]) {
+        bloom_bloomfilter *filter;
+        res = sbf_create_filter(sbf, &filter);
+        if (res == 0) {
+            __atomic_store_n(&sbf->spare, filter, __ATOMIC_RELEASE);
+            res = 1;
+        }
     }
+    __atomic_store_n(&sbf->growing, 0, __ATOMIC_RELEASE);
+    return res;
+}
 
-    // Create a new bloom filter
-    bloom_bloomfilter *filter = calloc(1, sizeof(bloom_bloomfilter));
-    res = bf_from_bitmap(map, params.k_num, 1, filter);
+/**
+ * Waits to be the only thread creating a filter.
+ */
+static void sbf_claim_growth(bloom_sbf *sbf) {
+    while (!__sync_bool_compare_and_swap(&sbf->growing, 0, 1)) {
+        sched_yield();
+    }
+}
+
+/**
+ * Appends a new filter to the SBF. The prepared
+ * filter is used if there is one.
+ */
+static int sbf_append_filter(bloom_sbf *sbf) {
+    sbf_claim_growth(sbf);
+    BLOOM_PROBE1(sbf__grow__start, sbf->num_filters);
+    bloom_bloomfilter *filter = __atomic_load_n(&sbf->spare, __ATOMIC_ACQUIRE);
+    sbf->spare = NULL;
+    int res = 0;
+    if (!filter) {
+        res = sbf_create_filter(sbf, &filter);
+    }
     if (res != 0) {
-        free(filter);
-        free(map);
+        __atomic_store_n(&sbf->growing, 0, __ATOMIC_RELEASE);
+        BLOOM_PROBE2(sbf__grow__done, sbf->num_filters, 0);
         return res;
     }
 
@@ -237,28 +1331,102 @@ static int sbf_append_filter(bloom_sbf *sbf) {
     bloom_bloomfilter **old_filters = sbf->filters;
     unsigned char *old_dirty = sbf->dirty_filters;
     uint64_t *old_capacities = sbf->capacities;
+    uint64_t *old_hits = sbf->hits;
 
     // Increase the filter count, re-allocate the arrays
     sbf->num_filters++;
     sbf->filters = malloc(sbf->num_filters*sizeof(bloom_bloomfilter*));
     sbf->dirty_filters = calloc(sbf->num_filters, sizeof(unsigned char));
     sbf->capacities = calloc(sbf->num_filters, sizeof(uint64_t));
+    sbf->hits = calloc(sbf->num_filters, sizeof(uint64_t));
+    free(sbf->order);
+    sbf->order = calloc(sbf->num_filters, sizeof(uint32_t));
 
     // Copy the old filters and release
     if (sbf->num_filters > 1) {
         memcpy(sbf->filters+1, old_filters, (sbf->num_filters-1)*sizeof(bloom_bloomfilter*));
         memcpy(sbf->dirty_filters+1, old_dirty, (sbf->num_filters-1)*sizeof(unsigned char));
         memcpy(sbf->capacities+1, old_capacities, (sbf->num_filters-1)*sizeof(uint64_t));
+        memcpy(sbf->hits+1, old_hits, (sbf->num_filters-1)*sizeof(uint64_t));
         free(old_filters);
         free(old_dirty);
         free(old_capacities);
+        free(old_hits);
     }
+    sbf_reset_order(sbf);
 
     // Set the new filter, set dirty false
     sbf->filters[0] = filter;
     sbf->dirty_filters[0] = 0;
-    sbf->capacities[0] = capacity;
+    sbf->capacities[0] = filter->header->capacity;
+
+    __atomic_store_n(&sbf->growing, 0, __ATOMIC_RELEASE);
+    BLOOM_PROBE2(sbf__grow__done, sbf->num_filters, filter->header->capacity);
+    return 0;
+}
+
+/**
+ * Creates the next filter of the SBF, without adding it.
+ * Must be invoked while holding growing.
+ */
+static int sbf_create_filter(bloom_sbf *sbf, bloom_bloomfilter **out) {
+    // Start with the initial configs
+    uint64_t capacity = sbf->params.initial_capacity;
+    double fp_prob = sbf_inital_probability(sbf->params.fp_probability, sbf->params.probability_reduction);
+
+    // Generations share the probability evenly, and do not scale
+    if (sbf->params.generations) {
+        fp_prob = sbf->params.fp_probability / sbf->params.generations;
+    }
+
+    // Each filter grows the SBF by one step. Compaction removes
+    // filters, so the step follows the capacity of the newest one.
+    uint32_t step = (sbf->params.generations) ? 0 : sbf->num_filters;
+    if (step > 0 && sbf->params.scale_size > 1 && sbf->capacities[0] >= capacity) {
+        step = lround(log((double)sbf->capacities[0] / capacity) / log(sbf->params.scale_size)) + 1;
+    }
+
+    // Get the settings for the new filter. A folded newest filter
+    // may be below the initial capacity, the next one scales from it.
+    if (step > 0 && sbf->capacities[0] < capacity) {
+        capacity = sbf->capacities[0] * sbf->params.scale_size;
+    } else {
+        capacity *= pow(sbf->params.scale_size, step);
+    }
+    fp_prob *= pow(sbf->params.probability_reduction, step);
+
+    // Compute the new parameters. All the filters must share
+    // a hash family, so new filters inherit it.
+    bloom_filter_params params = {0, 0, capacity, fp_prob, sbf->params.layout, sbf_hash_family(sbf),
+        sbf->params.index_mode, sbf->params.bit_order, sbf->params.optimize};
+    int res = bf_params_for_capacity(&params);
+    if (res != 0) {
+        return res;
+    }
+
+    // Allocate a new bitmap
+    bloom_bitmap *map = calloc(1, sizeof(bloom_bitmap));
 
+    // Try to use our call back if we have one
+    if (sbf->callback) {
+        res = sbf->callback(sbf->callback_input, params.bytes, map);
+    } else {
+        res = bitmap_from_file(-1, params.bytes, ANONYMOUS, map);
+    }
+    if (res != 0) {
+        free(map);
+        return res;
+    }
+
+    // Create a new bloom filter, with the capacity in the header
+    bloom_bloomfilter *filter = calloc(1, sizeof(bloom_bloomfilter));
+    res = bf_from_bitmap_params(map, &params, 1, filter);
+    if (res != 0) {
+        free(filter);
+        free(map);
+        return res;
+    }
+    *out = filter;
     return 0;
 }
 
@@ -273,15 +1441,105 @@ static double sbf_inital_probability(double fp_prob, double r) {
 
 /**
  * Computes the capacities for the existing filters
- * when we are initialized with filters.
+ * when we are initialized with filters. Older filters
+ * have no capacity in the header, and they are sized
+ * by their position.
  */
 static void sbf_init_capacities(bloom_sbf *sbf) {
     uint64_t init_capacity = sbf->params.initial_capacity;
     uint64_t capacity;
 
     for (uint32_t i=0;i<sbf->num_filters;i++) {
+        // Use the capacity in the header, if it was recorded
+        capacity = sbf->filters[i]->header->capacity;
+
         // Compute the capacity of the ith filter
-        capacity = init_capacity * pow(sbf->params.scale_size, (sbf->num_filters - i - 1));
+        if (!capacity) {
+            capacity = init_capacity * pow(sbf->params.scale_size, (sbf->num_filters - i - 1));
+        }
         sbf->capacities[i] = capacity;
     }
 }
+
+/**
+ * Resets the probe order to the newest filter first
+ */
+static void sbf_reset_order(bloom_sbf *sbf) {
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        sbf->order[i] = i;
+    }
+}
+
+/**
+ * Counts a hit of a filter. Concurrent checks may lose
+ * some counts, which is fine for ordering the probes, and
+ * avoids a locked instruction on the check path.
+ */
+static inline void sbf_count_hit(bloom_sbf *sbf, uint32_t idx) {
+    uint64_t *hits = sbf->hits + idx;
+    __atomic_store_n(hits, __atomic_load_n(hits, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Orders the generations of a windowed SBF from the newest epoch
+ * to the oldest. Rotating moves the generations as a ring, so the
+ * ring is started at the first generation with the newest epoch.
+ * Generations that were never rotated keep the order they were given in.
+ */
+static void sbf_sort_generations(bloom_sbf *sbf) {
+    uint32_t num = sbf->num_filters, newest = 0;
+    for (uint32_t i=1; i < num; i++) {
+        if (sbf->filters[i]->header->epoch > sbf->filters[newest]->header->epoch) newest = i;
+    }
+    if (!newest) return;
+
+    bloom_bloomfilter **given = malloc(num * sizeof(bloom_bloomfilter*));
+    memcpy(given, sbf->filters, num * sizeof(bloom_bloomfilter*));
+    for (uint32_t i=0; i < num; i++) {
+        sbf->filters[i] = given[(newest + i) % num];
+    }
+    free(given);
+    sbf->rotation = num - newest;
+}
+
+/**
+ * Returns the hash family shared by all the filters. This is
+ * inherited from the existing filters, or the params if there are none.
+ */
+bloom_hash_family sbf_hash_family(bloom_sbf *sbf) {
+    if (sbf->num_filters > 0) {
+        return sbf->filters[0]->header->hash_family;
+    }
+    return sbf->params.hash_family;
+}
+
+/**
+ * Checks the summary for a key. Returns 0 only if no layer
+ * has the key, so the layers need not be probed.
+ */
+static inline int sbf_summary_contains(bloom_sbf *sbf, uint64_t *hashes) {
+    if (!sbf->summary || sbf->summary_stale) return 1;
+    return bf_contains_hashed(sbf->summary, hashes) == 1;
+}
+
+/**
+ * Adds a key to the summary, before it is added to a layer.
+ * @arg atomic Adds with atomic operations, for concurrent adds
+ */
+static void sbf_summary_add(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes, int atomic) {
+    bloom_bloomfilter *summary = sbf->summary;
+    if (!summary || sbf->summary_stale) return;
+
+    // The hashes may have been computed before the summary was added
+    if (summary->header->k_num > num_hashes) {
+        uint64_t *extended = alloca(summary->header->k_num * sizeof(uint64_t));
+        memcpy(extended, hashes, num_hashes * sizeof(uint64_t));
+        bf_extend_hashes(summary->header->hash_family, num_hashes, summary->header->k_num, extended);
+        hashes = extended;
+    }
+    if (atomic) {
+        bf_add_hashed_atomic(summary, hashes);
+    } else {
+        bf_add_hashed(summary, hashes);
+    }
+}
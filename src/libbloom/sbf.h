@@ -1,6 +1,7 @@
 #ifndef BLOOM_SBF_H
 #define BLOOM_SBF_H
 #include "bloom.h"
+#include "flusher.h"
 
 /**
  * Defines a callback function that
@@ -19,6 +20,12 @@ typedef struct {
     double fp_probability;          // FP probability
     uint32_t scale_size;              // Scale size for new filters
     double probability_reduction;   // New filter, fp_prob reduciton
+    bloom_layout layout;            // Bit layout for new filters
+    bloom_hash_family hash_family;  // Hash family, used if there are no filters
+    bloom_index_mode index_mode;    // Index reduction for new filters
+    bloom_bit_order bit_order;      // Bitmap bit order for new filters
+    uint32_t generations;           // Fixed generations of a windowed SBF, 0 to scale
+    bloom_optimize optimize;        // Memory and probe trade off for new filters
 } bloom_sbf_params;
 
 /**
@@ -26,9 +33,12 @@ typedef struct {
  * Creates an initial capacity for 1 million items, 1/1000
  * false positive rate, 4x scaling, and a 90% false positive
  * probability reduction with each new filter. This works well
- * in most situations.
+ * in most situations. New filters use the partitioned layout,
+ * the original hash family, modulo indexing and byte bit order.
+ * The SBF scales, instead of using windowed generations, and
+ * new filters use the ideal k.
  */
-#define SBF_DEFAULT_PARAMS {1e5, 1e-4, 4, 0.9}
+#define SBF_DEFAULT_PARAMS {1e5, 1e-4, 4, 0.9, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, 0, OPTIMIZE_MEMORY}
 
 /**
  * These are memory sensitive parameters for bloom_sbf_params.
@@ -38,10 +48,17 @@ typedef struct {
  * false positive rate, 2x scaling, and a 80% false positive
  * probability reduction with each new filter.
  */
-#define SBF_SLOW_GROW_PARAMS {1e5, 1e-4, 2, 0.8}
+#define SBF_SLOW_GROW_PARAMS {1e5, 1e-4, 2, 0.8, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, 0, OPTIMIZE_MEMORY}
 
 /**
- * Represents a scalable bloom filters
+ * Represents a scalable bloom filters.
+ *
+ * With generations set in the params, the SBF is windowed
+ * instead. It is created with that many filters, each sized for
+ * the initial capacity with an even share of the fp probability,
+ * and it never grows. Adds go to the newest generation, checks
+ * probe all of them, and sbf_rotate recycles the oldest generation
+ * as the newest one, which ages out the keys it held.
  */
 typedef struct {
     bloom_sbf_params params;              // Our parameters
@@ -55,8 +72,29 @@ typedef struct {
     unsigned char *dirty_filters;   // Used to set a dirty flag
 
     uint64_t *capacities;            // Tracks the per-filter capacity
+
+    uint64_t *hits;                 // Checks found in each filter, approximate
+    uint32_t *order;                // The order checks probe the filters in
+
+    bloom_bloomfilter * volatile spare; // Next filter, created ahead of time
+    int growing;                    // Set while a filter is being created
+
+    uint32_t rotation;              // Windowed SBFs, the newest generation was
+                                    // given at index (num_filters - 1 + rotation) % num_filters
+
+    bloom_bloomfilter *summary;     // Summary of the keys of all the layers, or NULL
+    int summary_stale;              // Set if the summary may miss keys, so it is not used
+
+    int staged;                     // Set if the next flush writes the cut of sbf_stage
+    uint64_t staged_size;           // The size of the SBF at the cut
 } bloom_sbf;
 
+/**
+ * The false positive probability of a summary. Only the
+ * misses that pass the summary go on to probe the layers.
+ */
+#define SBF_SUMMARY_PROBABILITY 0.01
+
 /**
  * Creates a new scalable bloom filter using given bloom filters.
  * @arg params The parameters of the new SBF
@@ -65,6 +103,8 @@ typedef struct {
  * @arg num_filters The number of fileters in filters. 0 for none.
  * @arg filters Pointer to an array of the existing filters. Will be copied.
  * This array should be ordered from the largest filter to the smallest.
+ * Windowed SBFs start from the generation with the newest epoch instead,
+ * since rotating shifts the generations around as a ring.
  * @arg sbf The filter to setup
  * @return 0 for success. Negative for error.
  */
@@ -83,6 +123,88 @@ int sbf_from_filters(bloom_sbf_params *params,
  */
 int sbf_add(bloom_sbf *sbf, char* key);
 
+/**
+ * Adds a new key of a given length to the bloom filter. The key
+ * does not need to be NUL terminated, so it can be hashed in place.
+ * @arg sbf The filter to add to
+ * @arg key The key to add
+ * @arg len The length of the key
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int sbf_add_len(bloom_sbf *sbf, const char* key, uint64_t len);
+
+/**
+ * Adds a new key to the bloom filter, without growing the SBF.
+ * This is safe to call concurrently with other concurrent adds
+ * and with checks, but not with sbf_add. If the newest filter is
+ * full, nothing is added and -EAGAIN is returned, so the caller can
+ * retry with sbf_add once it has exclusive access. Counting and cuckoo
+ * filters always return -EAGAIN, since removals and evictions are not atomic.
+ * @arg sbf The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present, -EAGAIN if the SBF
+ * needs to grow. Negative on failure.
+ */
+int sbf_add_concurrent(bloom_sbf *sbf, char* key);
+
+/**
+ * Adds a new key of a given length to the bloom filter, without
+ * growing the SBF. Same as sbf_add_concurrent otherwise.
+ * @arg sbf The filter to add to
+ * @arg key The key to add, need not be NUL terminated
+ * @arg len The length of the key
+ * @returns 1 if the key was added, 0 if present, -EAGAIN if the SBF
+ * needs to grow. Negative on failure.
+ */
+int sbf_add_concurrent_len(bloom_sbf *sbf, const char* key, uint64_t len);
+
+/**
+ * Adds many keys to the newest filter as a sorted batch, so the
+ * bits are set in address order. Nothing is added if the batch
+ * is small, would take the newest filter over its capacity, or
+ * its layout has no sorted batches.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add, need not be NUL terminated
+ * @arg key_lens The lengths of the keys, or NULL if the
+ * keys are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if the key was added, 0 if present
+ * @returns 0 on success, -EAGAIN if the keys must be added in
+ * turn. Negative on failure.
+ */
+int sbf_add_batch_len(bloom_sbf *sbf, char **keys, uint64_t *key_lens, int num_keys, char *results);
+
+/**
+ * Removes a key from the SBF. The key is removed from the
+ * newest filter that contains it. Only supported if the
+ * filters use the counting or cuckoo layout.
+ * @arg sbf The filter to remove from
+ * @arg key The key to remove
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filters do not use the counting or cuckoo layout.
+ */
+int sbf_remove(bloom_sbf *sbf, char* key);
+
+/**
+ * Removes a key of a given length from the SBF.
+ * @arg sbf The filter to remove from
+ * @arg key The key to remove, need not be NUL terminated
+ * @arg len The length of the key
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filters do not use the counting or cuckoo layout.
+ */
+int sbf_remove_len(bloom_sbf *sbf, const char* key, uint64_t len);
+
+/**
+ * Removes a key from the SBF using precomputed hashes.
+ * @arg sbf The filter to remove from
+ * @arg hashes The hashes of the key, computed with sbf_compute_hashes
+ * @arg num_hashes The number of hashes provided, at least 4
+ * @returns 1 if the key was removed, 0 if not present, -EINVAL
+ * if the filters do not use the counting or cuckoo layout.
+ */
+int sbf_remove_hashed(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes);
+
 /**
  * Checks the filter for a key
  * @arg sbf The filter to check
@@ -91,17 +213,130 @@ int sbf_add(bloom_sbf *sbf, char* key);
  */
 int sbf_contains(bloom_sbf *sbf, char* key);
 
+/**
+ * Checks the filter for a key of a given length
+ * @arg sbf The filter to check
+ * @arg key The key to check, need not be NUL terminated
+ * @arg len The length of the key
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int sbf_contains_len(bloom_sbf *sbf, const char* key, uint64_t len);
+
+/**
+ * Adds a new key to the bloom filter using precomputed hashes.
+ * The hashes are extended as needed for layers with a larger k_num.
+ * @arg sbf The filter to add to
+ * @arg hashes The hashes of the key, computed with sbf_compute_hashes
+ * @arg num_hashes The number of hashes provided, at least 4
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int sbf_add_hashed(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes);
+
+/**
+ * Checks the filter for a key using precomputed hashes.
+ * @arg sbf The filter to check
+ * @arg hashes The hashes of the key, computed with sbf_compute_hashes
+ * @arg num_hashes The number of hashes provided, at least 4
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int sbf_contains_hashed(bloom_sbf *sbf, uint64_t *hashes, uint32_t num_hashes);
+
+/**
+ * Checks the filter for many keys at once. All the keys in a
+ * batch are hashed and their probe locations prefetched, before
+ * any probe is resolved, so the cache misses of the keys overlap.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if present, 0 if not present
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_batch(bloom_sbf *sbf, char **keys, int num_keys, char *results);
+
+/**
+ * Checks the filter for many keys of given lengths at once.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check, need not be NUL terminated
+ * @arg key_lens The lengths of the keys, or NULL if the
+ * keys are NUL terminated
+ * @arg num_keys The number of keys
+ * @arg results Output array, 1 if present, 0 if not present
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_batch_len(bloom_sbf *sbf, char **keys, uint64_t *key_lens, int num_keys, char *results);
+
+/**
+ * Returns the number of hashes needed to probe every layer
+ * of the SBF. This is the largest k_num, and at least 4.
+ */
+uint32_t sbf_num_hashes(bloom_sbf *sbf);
+
+/**
+ * Returns the hash family of the SBF, which all its layers share.
+ */
+bloom_hash_family sbf_hash_family(bloom_sbf *sbf);
+
+/**
+ * Computes the hashes of a key for all layers of the SBF.
+ * @arg sbf The filter
+ * @arg key The key to hash
+ * @arg hashes Output array, must have room for sbf_num_hashes
+ */
+void sbf_compute_hashes(bloom_sbf *sbf, char *key, uint64_t *hashes);
+
+/**
+ * Computes the hashes of a key of a given length for all layers.
+ * @arg sbf The filter
+ * @arg key The key to hash, need not be NUL terminated
+ * @arg len The length of the key
+ * @arg hashes Output array, must have room for sbf_num_hashes
+ */
+void sbf_compute_hashes_len(bloom_sbf *sbf, const char *key, uint64_t len, uint64_t *hashes);
+
 /**
  * Returns the size of the bloom filter in item count
  */
 uint64_t sbf_size(bloom_sbf *sbf);
 
+/**
+ * Estimates the number of distinct keys in the SBF from the bits
+ * set in each layer, as bf_estimate_size does. A key is counted
+ * once per layer it was added to, which only happens after merges.
+ */
+uint64_t sbf_estimate_size(bloom_sbf *sbf);
+
 /**
  * Flushes the filter, and updates the metadata.
  * @return 0 on success, negative on failure.
  */
 int sbf_flush(bloom_sbf *sbf);
 
+/**
+ * Cuts a consistent image of the SBF for the next sbf_flush, as
+ * bitmap_stage does for each dirty layer. The flush then writes
+ * the layers and the summary as they were at the cut, while adds
+ * go on, and leaves the later changes for the flush after. Layers
+ * that are not PERSISTENT are written as they are at the flush.
+ * Needs exclusive access.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_stage(bloom_sbf *sbf);
+
+/**
+ * Starts an asynchronous flush of the dirty filters. The
+ * callback is invoked by the flusher once all the dirty
+ * filters are written and synced. Filters that fail to
+ * flush are marked dirty again. The SBF must not be closed
+ * until the callback is invoked.
+ * @arg sbf The SBF to flush
+ * @arg flusher The flusher to use
+ * @arg cb The completion callback
+ * @arg data Opaque data for the callback
+ * @return 0 if the flush was started, negative on failure.
+ * The callback is not invoked on failure.
+ */
+int sbf_flush_async(bloom_sbf *sbf, bloom_flusher *flusher, bloom_flush_cb cb, void *data);
+
 /**
  * Flushes and closes the filter. Closes the underlying bitmap and filters,
  * and frees them.
@@ -110,13 +345,157 @@ int sbf_flush(bloom_sbf *sbf);
 
 int sbf_close(bloom_sbf *sbf);
 
+/**
+ * Creates the next filter ahead of time, once the newest filter
+ * is filled past a fraction of its capacity. When the newest filter
+ * is full, the prepared filter is swapped in without invoking the
+ * callback, so the add that grows the SBF does not stall. This is
+ * safe to call concurrently with the other methods, except
+ * sbf_compact, sbf_reset and sbf_close. A growing sbf_add waits for it.
+ * @arg sbf The SBF
+ * @arg fill The fraction of the capacity of the newest filter
+ * @return 1 if a filter was prepared, 0 if not needed, negative on failure.
+ */
+int sbf_prepare_filter(bloom_sbf *sbf, double fill);
+
+/**
+ * Merges an older layer of the SBF into the next newer layer, so
+ * that misses probe one layer less. Layers are only merged if
+ * bf_can_merge allows it, and if the estimated false positive
+ * probability of the whole SBF stays within the fp_probability of
+ * the params. The newest layer takes the adds, so it is never merged.
+ * This reads the bitmaps of the layers, and needs exclusive access.
+ * @arg sbf The SBF to compact
+ * @arg merged Output, set to the index of the layer that was merged
+ * away. It is closed and freed, and the older layers shift down.
+ * @return 1 if a layer was merged, 0 if not, negative on failure.
+ */
+int sbf_compact(bloom_sbf *sbf, uint32_t *merged);
+
+/**
+ * Finds a layer of the SBF to fold into a smaller one, see
+ * bf_fold. A layer is only folded if the folded layer is
+ * at most half full, and if
+ * the estimated false positive probability of the whole SBF stays
+ * within fp_probability. The oldest layer that fits is picked.
+ * Windowed SBFs recycle their generations at the same size, so
+ * they are never folded. This reads the bitmaps of the layers.
+ * @arg sbf The SBF
+ * @arg fp_probability The probability the SBF must stay within
+ * @arg idx Output, set to the index of the layer to fold
+ * @return 1 if a layer can be folded, 0 if not, negative on failure.
+ */
+int sbf_fold_candidate(bloom_sbf *sbf, double fp_probability, uint32_t *idx);
+
+/**
+ * Folds a layer of the SBF into a new, smaller bitmap. The
+ * folded layer is flushed, and replaces the layer, which is
+ * closed. Its capacity is divided by the fold factor, and
+ * recorded in the header.
+ * This reads the bitmap of the layer, and needs exclusive access.
+ * @arg sbf The SBF
+ * @arg idx The index of the layer, from sbf_fold_candidate
+ * @arg map The zeroed bitmap of the folded layer, of bf_folded_bytes
+ * bytes. It is owned by the SBF on success, and the caller must
+ * close it on failure.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_fold_layer(bloom_sbf *sbf, uint32_t idx, bloom_bitmap *map);
+
+/**
+ * Merges, or intersects, the keys of another SBF into this one,
+ * layer by layer. Both must have the same number of layers, with
+ * the same geometry, and must not be windowed. The layers are
+ * combined in place, using bf_merge or bf_intersect.
+ * This needs exclusive access to sbf, and read access to src.
+ * @arg sbf The SBF to change
+ * @arg src The SBF to read, which is left as is
+ * @arg intersect Intersect the keys instead of merging them
+ * @return 0 on success, -EINVAL if the layers do not line up,
+ * negative on failure.
+ */
+int sbf_combine(bloom_sbf *sbf, bloom_sbf *src, int intersect);
+
+/**
+ * Clears all the keys of the SBF in place. All but the oldest layer,
+ * which has the initial capacity, are closed, as is any prepared
+ * filter. A windowed SBF keeps all its generations. The kept layers
+ * are cleared with bf_clear, which drops their pages instead of
+ * writing zeros. This needs exclusive access.
+ * @arg sbf The SBF to reset
+ * @return The number of layers kept, negative on failure. The layers
+ * closed were the newer ones, so the kept layers are the first data
+ * files.
+ */
+int sbf_reset(bloom_sbf *sbf);
+
+/**
+ * Rotates a windowed SBF. The oldest generation is cleared in
+ * place, stamped with the epoch, and becomes the newest generation.
+ * This needs exclusive access.
+ * @arg sbf The SBF to rotate
+ * @arg epoch The epoch of the new generation, usually the time
+ * @return 0 on success, -EINVAL if the SBF is not windowed,
+ * negative on failure.
+ */
+int sbf_rotate(bloom_sbf *sbf, uint64_t epoch);
+
+/**
+ * Returns the epoch of the newest generation.
+ */
+uint64_t sbf_epoch(bloom_sbf *sbf);
+
+/**
+ * Orders the probes of checks by the hits of the filters, so
+ * that positive checks find their key with fewer probes. The
+ * filters with the most hits are probed first, and ties keep the
+ * newest first. Misses still probe every filter. The order is reset
+ * to newest first whenever the filters change.
+ * @arg sbf The SBF
+ * @arg apply If 0, only checks if the order would change, which is
+ * safe to call concurrently. Otherwise the order is updated, which
+ * needs exclusive access.
+ * @return 1 if the order changes, 0 otherwise.
+ */
+int sbf_reorder(bloom_sbf *sbf, int apply);
+
+/**
+ * Computes the parameters of a summary for the SBF. A summary is
+ * a blocked filter over the keys of all the layers, so a check that
+ * misses probes a single cache line instead of every layer.
+ * @arg sbf The SBF
+ * @arg capacity The number of keys to size the summary for
+ * @arg params Output, the parameters of the summary. The bitmap
+ * of the summary must have params->bytes.
+ * @return 0 on success, -EINVAL if the SBF cannot have a summary.
+ */
+int sbf_summary_params(bloom_sbf *sbf, uint64_t capacity, bloom_filter_params *params);
+
+/**
+ * Adds a summary to the SBF, which checks consult before the
+ * layers, and adds update along with the newest layer. Windowed
+ * SBFs and the layouts that support removal cannot have one, since
+ * keys leave their layers but not the summary. The summary records
+ * the size of the SBF when it is flushed, so on load it is only used
+ * if the layers have the same size. Otherwise it is stale, which
+ * keeps it attached but unused until sbf_reset clears it.
+ * @arg sbf The SBF
+ * @arg map The bitmap of the summary, owned by the SBF on success
+ * @arg params The params from sbf_summary_params for a new
+ * summary, or NULL to load a summary written by sbf_flush
+ * @return 1 if the summary is used, 0 if it is stale, negative
+ * on failure. -EINVAL if the SBF cannot have a summary.
+ */
+int sbf_attach_summary(bloom_sbf *sbf, bloom_bitmap *map, bloom_filter_params *params);
+
 /**
  * Returns the total capacity of the SBF currently.
  */
 uint64_t sbf_total_capacity(bloom_sbf *sbf);
 
 /**
- * Returns the total bytes size of the SBF currently.
+ * Returns the total bytes size of the SBF currently,
+ * including the summary.
  */
 uint64_t sbf_total_byte_size(bloom_sbf *sbf);
 
@@ -0,0 +1,96 @@
+/**
+ * A 128bit variant of wyhash (https://github.com/wangyi-fudan/wyhash).
+ * The input is consumed in a single pass, and the two 64bit outputs
+ * are both derived from the final 128bit multiply state. This lets
+ * us generate all the bloom filter hashes from one pass over the key,
+ * instead of running both Murmur and Spooky.
+ */
+#include <stdint.h>
+#include <string.h>
+
+static const uint64_t WY_SECRET[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+// 64x64 -> 128bit multiply, returns the low and high halves
+static inline void wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+// Multiply and fold the halves together
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+/**
+ * Computes a 128bit hash of the key.
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @arg seed The seed value
+ * @arg out Output array of two 64bit values
+ */
+void WyHash128(const void *key, uint64_t len, uint64_t seed, uint64_t *out) {
+    const uint8_t *p = (const uint8_t*)key;
+    uint64_t a, b;
+    seed ^= wymix(seed ^ WY_SECRET[0], WY_SECRET[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        uint64_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ WY_SECRET[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ WY_SECRET[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ WY_SECRET[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ WY_SECRET[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+
+    // Final mixing, both outputs come from the 128bit state
+    a ^= WY_SECRET[1];
+    b ^= seed;
+    wymum(&a, &b);
+    out[0] = wymix(a ^ WY_SECRET[0] ^ len, b ^ WY_SECRET[1]);
+    out[1] = wymix(a ^ WY_SECRET[3], b ^ WY_SECRET[2] ^ len);
+}
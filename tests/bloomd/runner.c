@@ -26,6 +26,8 @@ int main(void)
     tcase_add_test(tc1, test_config_basic_config);
     tcase_add_test(tc1, test_validate_default_config);
     tcase_add_test(tc1, test_validate_bad_config);
+    tcase_add_test(tc1, test_config_set);
+    tcase_add_test(tc1, test_config_update);
     tcase_add_test(tc1, test_join_path_no_slash);
     tcase_add_test(tc1, test_join_path_with_slash);
     tcase_add_test(tc1, test_sane_log_level);
@@ -38,6 +40,26 @@ int main(void)
     tcase_add_test(tc1, test_sane_in_memory);
     tcase_add_test(tc1, test_sane_use_mmap);
     tcase_add_test(tc1, test_sane_worker_threads);
+    tcase_add_test(tc1, test_sane_concurrent_sets);
+    tcase_add_test(tc1, test_sane_flush_run_pages);
+    tcase_add_test(tc1, test_sane_flush_inflight_mb);
+    tcase_add_test(tc1, test_sane_use_huge_pages);
+    tcase_add_test(tc1, test_sane_numa_mode);
+    tcase_add_test(tc1, test_sane_cold_snapshots);
+    tcase_add_test(tc1, test_sane_lazy_page_in);
+    tcase_add_test(tc1, test_sane_direct_io);
+    tcase_add_test(tc1, test_sane_use_dax);
+    tcase_add_test(tc1, test_sane_consistent_flush);
+    tcase_add_test(tc1, test_sane_positive_cache);
+    tcase_add_test(tc1, test_sane_group_commit);
+    tcase_add_test(tc1, test_sane_max_connections);
+    tcase_add_test(tc1, test_sane_counting);
+    tcase_add_test(tc1, test_sane_engine);
+    tcase_add_test(tc1, test_sane_optimize);
+    tcase_add_test(tc1, test_sane_hashed);
+    tcase_add_test(tc1, test_sane_prealloc_fill);
+    tcase_add_test(tc1, test_sane_window);
+    tcase_add_test(tc1, test_sane_scalable);
     tcase_add_test(tc1, test_filter_config_bad_file);
     tcase_add_test(tc1, test_filter_config_empty_file);
     tcase_add_test(tc1, test_filter_config_basic_config);
@@ -56,9 +78,40 @@ int main(void)
     tcase_add_test(tc3, test_filter_add_check_in_mem);
     tcase_add_test(tc3, test_filter_grow);
     tcase_add_test(tc3, test_filter_grow_restore);
+    tcase_add_test(tc3, test_filter_container);
+    tcase_add_test(tc3, test_filter_partitioned);
+    tcase_add_test(tc3, test_filter_wal);
+    tcase_add_test(tc3, test_filter_delta);
     tcase_add_test(tc3, test_filter_restore_order);
     tcase_add_test(tc3, test_filter_page_out);
     tcase_add_test(tc3, test_filter_bounded_fp);
+    tcase_add_test(tc3, test_filter_contains_batch);
+    tcase_add_test(tc3, test_filter_cold_snapshot);
+    tcase_add_test(tc3, test_filter_cold_packed);
+    tcase_add_test(tc3, test_filter_stage_flush);
+    tcase_add_test(tc3, test_snapshot_frame_roundtrip);
+    tcase_add_test(tc3, test_filter_counting_remove);
+    tcase_add_test(tc3, test_filter_engine_ops);
+    tcase_add_test(tc3, test_filter_compact);
+    tcase_add_test(tc3, test_filter_shrink);
+    tcase_add_test(tc3, test_filter_renumber_data_files);
+    tcase_add_test(tc3, test_filter_prepare);
+    tcase_add_test(tc3, test_filter_windowed);
+    tcase_add_test(tc3, test_filter_fixed);
+    tcase_add_test(tc3, test_filter_counters_threads);
+    tcase_add_test(tc3, test_filter_latency_histograms);
+    tcase_add_test(tc3, test_filter_frozen);
+    tcase_add_test(tc3, test_filter_reader);
+    tcase_add_test(tc3, test_filter_tiered_layers);
+    tcase_add_test(tc3, test_filter_pin);
+    tcase_add_test(tc3, test_filter_writeback);
+    tcase_add_test(tc3, test_filter_optimize);
+    tcase_add_test(tc3, test_filter_slowlog);
+    tcase_add_test(tc3, test_filter_hot);
+    tcase_add_test(tc3, test_clients_usage);
+    tcase_add_test(tc3, test_filter_io_bytes);
+    tcase_add_test(tc3, test_filter_layer_summary);
+    tcase_add_test(tc3, test_filter_positive_cache);
 
     // Add the filter tests
     suite_add_tcase(s1, tc4);
@@ -77,6 +130,10 @@ int main(void)
     tcase_add_test(tc4, test_mgr_unmap_no_filter);
     tcase_add_test(tc4, test_mgr_unmap);
     tcase_add_test(tc4, test_mgr_unmap_add_keys);
+    tcase_add_test(tc4, test_mgr_fault_async);
+    tcase_add_test(tc4, test_mgr_warm);
+    tcase_add_test(tc4, test_mgr_evict_clock);
+    tcase_add_test(tc4, test_mgr_list_dirty);
     tcase_add_test(tc4, test_mgr_clear_no_filter);
     tcase_add_test(tc4, test_mgr_clear_not_proxied);
     tcase_add_test(tc4, test_mgr_clear);
@@ -86,8 +143,37 @@ int main(void)
     tcase_add_test(tc4, test_mgr_unmap_in_mem);
     tcase_add_test(tc4, test_mgr_create_custom_config);
     tcase_add_test(tc4, test_mgr_grow);
+    tcase_add_test(tc4, test_mgr_concurrent_sets);
     tcase_add_test(tc4, test_mgr_restore);
+    tcase_add_test(tc4, test_mgr_catalog);
+    tcase_add_test(tc4, test_mgr_stubs);
     tcase_add_test(tc4, test_mgr_callback);
+    tcase_add_test(tc4, test_mgr_unset_keys);
+    tcase_add_test(tc4, test_mgr_cuckoo_engine);
+    tcase_add_test(tc4, test_mgr_fixed_reject_full);
+    tcase_add_test(tc4, test_mgr_layer_hits);
+    tcase_add_test(tc4, test_mgr_keys_len);
+    tcase_add_test(tc4, test_mgr_check_filters);
+    tcase_add_test(tc4, test_mgr_combine_filters);
+    tcase_add_test(tc4, test_mgr_filter_cache);
+    tcase_add_test(tc4, test_mgr_drop_churn);
+    tcase_add_test(tc4, test_mgr_many_filters);
+    tcase_add_test(tc4, test_mgr_list_pages);
+    tcase_add_test(tc4, test_mgr_stats);
+    tcase_add_test(tc4, test_mgr_metrics);
+    tcase_add_test(tc4, test_mgr_replication);
+    tcase_add_test(tc4, test_mgr_cluster_ring);
+    tcase_add_test(tc4, test_mgr_flush_tickets);
+    tcase_add_test(tc4, test_mgr_freeze);
+    tcase_add_test(tc4, test_mgr_biased_checks);
+    tcase_add_test(tc4, test_mgr_load_key_file);
+    tcase_add_test(tc4, test_mgr_restore_filter);
+    tcase_add_test(tc4, test_mgr_size_like);
+    tcase_add_test(tc4, test_mgr_hashed_filter);
+    tcase_add_test(tc4, test_mgr_batch_create_drop);
+    tcase_add_test(tc4, test_mgr_client_slots);
+    tcase_add_test(tc4, test_mgr_spinlock);
+    tcase_add_test(tc4, test_mgr_slice);
 
     // Add the art tests
     suite_add_tcase(s1, tc5);
@@ -100,6 +186,9 @@ int main(void)
     tcase_add_test(tc5, test_art_insert_iter);
     tcase_add_test(tc5, test_art_iter_prefix);
     tcase_add_test(tc5, test_art_insert_copy_delete);
+    tcase_add_test(tc5, test_art_copy_on_write);
+    tcase_add_test(tc5, test_art_iter_high_bytes);
+    tcase_add_test(tc5, test_art_iter_from);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
@@ -384,3 +384,144 @@ START_TEST(test_art_insert_copy_delete)
 }
 END_TEST
 
+
+START_TEST(test_art_copy_on_write)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1, nlines;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+    nlines = line - 1;
+
+    // Change the copy, deleting the even lines and updating the odd
+    art_tree t2;
+    fail_unless(art_copy(&t2, &t) == 0);
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        if (line % 2 == 0)
+            fail_unless(line == (uintptr_t)art_delete(&t2, (unsigned char*)buf, len));
+        else
+            fail_unless(line == (uintptr_t)art_insert(&t2, (unsigned char*)buf, len, (void*)(line + nlines)));
+        line++;
+    }
+    fail_unless(art_size(&t2) == (nlines + 1) / 2);
+    fail_unless(art_size(&t) == nlines);
+
+    // The original is unchanged
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(line == (uintptr_t)art_search(&t, (unsigned char*)buf, len));
+        line++;
+    }
+
+    // The copy outlives the original
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        uintptr_t val = (uintptr_t)art_search(&t2, (unsigned char*)buf, len);
+        if (line % 2 == 0)
+            fail_unless(val == 0);
+        else
+            fail_unless(val == line + nlines);
+        line++;
+    }
+
+    res = destroy_art_tree(&t2);
+    fail_unless(res == 0);
+    fclose(f);
+}
+END_TEST
+
+static int test_order_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    (void)value;
+    int *last = data;
+    fail_unless(key[1] > *last);
+    *last = key[1];
+    return 0;
+}
+
+START_TEST(test_art_iter_high_bytes)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    // Enough keys for a node16, half of them over 127
+    unsigned char key[3] = {'k', 0, 0};
+    for (int i=0; i < 14; i++) {
+        key[1] = (i % 2) ? 0x10 + i : 0xF0 - i;
+        art_insert(&t, key, 3, (void*)key);
+    }
+
+    // Iteration is in unsigned byte order
+    int last = -1;
+    fail_unless(art_iter(&t, test_order_cb, &last) == 0);
+    fail_unless(last == 0xF0);
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static int test_from_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    (void)value;
+    char *out = data;
+    strcat(out, (char*)key);
+    return 0;
+}
+
+START_TEST(test_art_iter_from)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    char *s[] = {"a", "ab", "abc", "b", "ba", "c"};
+    for (int i=0; i < 6; i++)
+        art_insert(&t, (unsigned char*)s[i], strlen(s[i])+1, NULL);
+
+    // Starts past the given key, which need not exist
+    char out[32] = "";
+    fail_unless(art_iter_from(&t, (unsigned char*)"ab", 3, 0, test_from_cb, out) == 0);
+    fail_unless(strcmp(out, "abcbbac") == 0);
+
+    out[0] = 0;
+    fail_unless(art_iter_from(&t, (unsigned char*)"ab", 3, 1, test_from_cb, out) == 0);
+    fail_unless(strcmp(out, "ababcbbac") == 0);
+
+    out[0] = 0;
+    fail_unless(art_iter_from(&t, (unsigned char*)"b", 1, 1, test_from_cb, out) == 0);
+    fail_unless(strcmp(out, "bbac") == 0);
+
+    out[0] = 0;
+    fail_unless(art_iter_from(&t, (unsigned char*)"d", 1, 1, test_from_cb, out) == 0);
+    fail_unless(out[0] == 0);
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
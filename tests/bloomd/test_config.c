@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -27,6 +28,40 @@ START_TEST(test_config_get_default)
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
     fail_unless(config.use_mmap == 0);
+    fail_unless(config.metrics_port == 0);
+    fail_unless(config.migrate_connections == 0);
+    fail_unless(config.fault_threads == 2);
+    fail_unless(config.prewarm_lead == 300);
+    fail_unless(config.max_memory == 0);
+    fail_unless(config.container == 0);
+    fail_unless(config.flush_threads == 1);
+    fail_unless(config.flush_bandwidth_mb == 0);
+    fail_unless(config.wal == 0);
+    fail_unless(config.wal_sync_msec == 200);
+    fail_unless(config.delta_snapshots == 0);
+    fail_unless(config.replicas == NULL);
+    fail_unless(config.replica_batch_msec == 10);
+    fail_unless(config.replica_backlog_mb == 64);
+    fail_unless(config.cluster_nodes == NULL);
+    fail_unless(config.cluster_self == NULL);
+    fail_unless(config.partitions == 1);
+    fail_unless(config.admin_threads == 1);
+    fail_unless(config.handoff_socket == NULL);
+    fail_unless(config.filter_affinity == 0);
+    fail_unless(config.bulk_threads == 0);
+    fail_unless(config.group_checks == 0);
+    fail_unless(config.unix_socket == NULL);
+    fail_unless(config.tiered_layers == 0);
+    fail_unless(config.pin == 0);
+    fail_unless(config.writeback_msec == 0);
+    fail_unless(strcmp(config.optimize, "memory") == 0);
+    fail_unless(config.optimize_type == OPTIMIZE_MEMORY);
+    fail_unless(config.slowlog_usec == 10000);
+    fail_unless(config.hot_sample == 100);
+    fail_unless(config.max_worker_threads == 0);
+    fail_unless(config.hashed == 0);
+    fail_unless(config.shed_lag_msec == 0);
+    fail_unless(config.summary_capacity == 0);
 }
 END_TEST
 
@@ -90,6 +125,38 @@ START_TEST(test_config_basic_config)
     char *buf = "[bloomd]\n\
 port = 10000\n\
 udp_port = 10001\n\
+metrics_port = 10002\n\
+migrate_connections = 1\n\
+fault_threads = 4\n\
+prewarm_lead = 600\n\
+max_memory = 2048\n\
+container = 1\n\
+flush_threads = 4\n\
+flush_bandwidth_mb = 200\n\
+wal = 1\n\
+wal_sync_msec = 50\n\
+delta_snapshots = 1\n\
+replicas = 10.0.0.2:8673,10.0.0.3:8673\n\
+replica_batch_msec = 5\n\
+replica_backlog_mb = 128\n\
+cluster_nodes = 10.0.0.1:8673,10.0.0.4:8673\n\
+cluster_self = 10.0.0.4:8673\n\
+partitions = 8\n\
+admin_threads = 3\n\
+handoff_socket = /tmp/bloomd.handoff\n\
+filter_affinity = 1\n\
+bulk_threads = 4\n\
+group_checks = 1\n\
+unix_socket = /tmp/bloomd.sock\n\
+tiered_layers = 1\n\
+pin = 1\n\
+writeback_msec = 500\n\
+optimize = speed\n\
+slowlog_usec = 2500\n\
+hot_sample = 10\n\
+shed_lag_msec = 250\n\
+summary_capacity = 5000000\n\
+max_workers = 8\n\
 scale_size = 2\n\
 flush_interval = 120\n\
 cold_interval = 12000\n\
@@ -112,6 +179,38 @@ log_level = INFO\n";
     // Should get the config
     fail_unless(config.tcp_port == 10000);
     fail_unless(config.udp_port == 10001);
+    fail_unless(config.metrics_port == 10002);
+    fail_unless(config.migrate_connections == 1);
+    fail_unless(config.fault_threads == 4);
+    fail_unless(config.prewarm_lead == 600);
+    fail_unless(config.max_memory == 2048);
+    fail_unless(config.container == 1);
+    fail_unless(config.flush_threads == 4);
+    fail_unless(config.flush_bandwidth_mb == 200);
+    fail_unless(config.wal == 1);
+    fail_unless(config.wal_sync_msec == 50);
+    fail_unless(config.delta_snapshots == 1);
+    fail_unless(strcmp(config.replicas, "10.0.0.2:8673,10.0.0.3:8673") == 0);
+    fail_unless(config.replica_batch_msec == 5);
+    fail_unless(config.replica_backlog_mb == 128);
+    fail_unless(strcmp(config.cluster_nodes, "10.0.0.1:8673,10.0.0.4:8673") == 0);
+    fail_unless(strcmp(config.cluster_self, "10.0.0.4:8673") == 0);
+    fail_unless(config.partitions == 8);
+    fail_unless(config.admin_threads == 3);
+    fail_unless(strcmp(config.handoff_socket, "/tmp/bloomd.handoff") == 0);
+    fail_unless(config.filter_affinity == 1);
+    fail_unless(config.bulk_threads == 4);
+    fail_unless(config.group_checks == 1);
+    fail_unless(strcmp(config.unix_socket, "/tmp/bloomd.sock") == 0);
+    fail_unless(config.tiered_layers == 1);
+    fail_unless(config.pin == 1);
+    fail_unless(config.writeback_msec == 500);
+    fail_unless(strcmp(config.optimize, "speed") == 0);
+    fail_unless(config.slowlog_usec == 2500);
+    fail_unless(config.hot_sample == 10);
+    fail_unless(config.shed_lag_msec == 250);
+    fail_unless(config.summary_capacity == 5000000);
+    fail_unless(config.max_worker_threads == 8);
     fail_unless(strcmp(config.data_dir, "/tmp/test") == 0);
     fail_unless(strcmp(config.log_level, "INFO") == 0);
     fail_unless(config.initial_capacity == 2000000);
@@ -153,6 +252,59 @@ START_TEST(test_validate_bad_config)
 }
 END_TEST
 
+START_TEST(test_config_set)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    fail_unless(config_set(&config, "flush_interval", "30") == 0);
+    fail_unless(config.flush_interval == 30);
+    fail_unless(config_set(&config, "initial_capacity", "500000") == 0);
+    fail_unless(config.initial_capacity == 500000);
+    fail_unless(config_set(&config, "default_probability", "0.001") == 0);
+    fail_unless(config.default_probability == 0.001);
+
+    // Not tunable, or not valid
+    fail_unless(config_set(&config, "port", "1234") == 1);
+    fail_unless(config_set(&config, "scale_size", "3") == -1);
+    fail_unless(config_set(&config, "flush_interval", "10s") == -1);
+    fail_unless(config.flush_interval == 30);
+
+    // The background threads cannot be turned on or off
+    fail_unless(config_set(&config, "flush_interval", "0") == -1);
+    fail_unless(config_set(&config, "cold_interval", "0") == -1);
+
+    char *tunables = config_tunables(&config);
+    fail_unless(strstr(tunables, "flush_interval 30\n") != NULL);
+    fail_unless(strstr(tunables, "default_probability 0.001\n") != NULL);
+    free(tunables);
+}
+END_TEST
+
+START_TEST(test_config_update)
+{
+    bloom_config config, next;
+    config_from_filename(NULL, &config);
+    config_from_filename(NULL, &next);
+
+    // Only the tunable settings are taken
+    next.cold_interval = 600;
+    next.scale_size = 2;
+    next.tcp_port = 1234;
+    fail_unless(config_update(&config, &next) == 0);
+    fail_unless(config.cold_interval == 600);
+    fail_unless(config.scale_size == 2);
+    fail_unless(config.tcp_port == 8673);
+
+    // None are taken if one is invalid
+    next.cold_interval = 900;
+    next.default_probability = 1.0;
+    fail_unless(config_update(&config, &next) == -1);
+    fail_unless(config.cold_interval == 600);
+}
+END_TEST
+
 START_TEST(test_join_path_no_slash)
 {
     char *s1 = "/tmp/path";
@@ -285,6 +437,284 @@ START_TEST(test_sane_worker_threads)
 }
 END_TEST
 
+START_TEST(test_sane_concurrent_sets)
+{
+    fail_unless(sane_concurrent_sets(-1) == 1);
+    fail_unless(sane_concurrent_sets(0) == 0);
+    fail_unless(sane_concurrent_sets(1) == 0);
+    fail_unless(sane_concurrent_sets(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_flush_run_pages)
+{
+    fail_unless(sane_flush_run_pages(-1) == 1);
+    fail_unless(sane_flush_run_pages(0) == 1);
+    fail_unless(sane_flush_run_pages(1) == 0);
+    fail_unless(sane_flush_run_pages(256) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_flush_inflight_mb)
+{
+    fail_unless(sane_flush_inflight_mb(-1) == 1);
+    fail_unless(sane_flush_inflight_mb(0) == 1);
+    fail_unless(sane_flush_inflight_mb(1) == 0);
+    fail_unless(sane_flush_inflight_mb(64) == 0);
+    fail_unless(sane_flush_threads(0) == 1);
+    fail_unless(sane_flush_threads(1) == 0);
+    fail_unless(sane_flush_threads(8) == 0);
+    fail_unless(sane_flush_bandwidth_mb(-1) == 1);
+    fail_unless(sane_flush_bandwidth_mb(0) == 0);
+    fail_unless(sane_flush_bandwidth_mb(100) == 0);
+    fail_unless(sane_wal(2) == 1);
+    fail_unless(sane_wal(1) == 0);
+    fail_unless(sane_wal_sync_msec(0) == 1);
+    fail_unless(sane_wal_sync_msec(200) == 0);
+    fail_unless(sane_delta_snapshots(2) == 1);
+    fail_unless(sane_delta_snapshots(1) == 0);
+    fail_unless(sane_replicas(NULL) == 0);
+    fail_unless(sane_replicas("10.0.0.2:8673, [::1]:8673") == 0);
+    fail_unless(sane_replicas("10.0.0.2") == 1);
+    fail_unless(sane_replicas("10.0.0.2:0") == 1);
+    fail_unless(sane_replica_batch_msec(-1) == 1);
+    fail_unless(sane_replica_batch_msec(0) == 0);
+    fail_unless(sane_replica_backlog_mb(0) == 1);
+    fail_unless(sane_replica_backlog_mb(64) == 0);
+    fail_unless(sane_cluster_nodes(NULL) == 0);
+    fail_unless(sane_cluster_nodes("10.0.0.1:8673, [::1]:8673") == 0);
+    fail_unless(sane_cluster_nodes("10.0.0.1") == 1);
+    fail_unless(sane_cluster_self(NULL, NULL) == 0);
+    fail_unless(sane_cluster_self(NULL, "10.0.0.1:8673") == 1);
+    fail_unless(sane_cluster_self("10.0.0.1:8673", "10.0.0.1:8673,10.0.0.4:8673") == 0);
+    fail_unless(sane_cluster_self("10.0.0.2:8673", "10.0.0.1:8673,10.0.0.4:8673") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_use_huge_pages)
+{
+    fail_unless(sane_use_huge_pages(-1) == 1);
+    fail_unless(sane_use_huge_pages(0) == 0);
+    fail_unless(sane_use_huge_pages(1) == 0);
+    fail_unless(sane_use_huge_pages(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_numa_mode)
+{
+    bloom_numa_policy policy;
+    fail_unless(sane_numa_mode("off", &policy) == 0);
+    fail_unless(policy == NUMA_OFF);
+    fail_unless(sane_numa_mode("INTERLEAVE", &policy) == 0);
+    fail_unless(policy == NUMA_INTERLEAVE);
+    fail_unless(sane_numa_mode("filter", &policy) == 0);
+    fail_unless(policy == NUMA_PER_FILTER);
+    fail_unless(sane_numa_mode("socket", &policy) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_cold_snapshots)
+{
+    fail_unless(sane_cold_snapshots(-1) == 1);
+    fail_unless(sane_cold_snapshots(0) == 0);
+    fail_unless(sane_cold_snapshots(1) == 0);
+    fail_unless(sane_cold_snapshots(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_lazy_page_in)
+{
+    fail_unless(sane_lazy_page_in(-1) == 1);
+    fail_unless(sane_lazy_page_in(0) == 0);
+    fail_unless(sane_lazy_page_in(1) == 0);
+    fail_unless(sane_lazy_page_in(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_direct_io)
+{
+    fail_unless(sane_direct_io(-1) == 1);
+    fail_unless(sane_direct_io(0) == 0);
+    fail_unless(sane_direct_io(1) == 0);
+    fail_unless(sane_direct_io(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_use_dax)
+{
+    fail_unless(sane_use_dax(-1) == 1);
+    fail_unless(sane_use_dax(0) == 0);
+    fail_unless(sane_use_dax(1) == 0);
+    fail_unless(sane_use_dax(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_consistent_flush)
+{
+    fail_unless(sane_consistent_flush(-1) == 1);
+    fail_unless(sane_consistent_flush(0) == 0);
+    fail_unless(sane_consistent_flush(1) == 0);
+    fail_unless(sane_consistent_flush(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_positive_cache)
+{
+    fail_unless(sane_positive_cache(-1) == 1);
+    fail_unless(sane_positive_cache(0) == 0);
+    fail_unless(sane_positive_cache(4096) == 0);
+    fail_unless(sane_positive_cache((1 << 24) + 1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_group_commit)
+{
+    fail_unless(sane_group_commit(-1) == 1);
+    fail_unless(sane_group_commit(0) == 0);
+    fail_unless(sane_group_commit(1) == 0);
+    fail_unless(sane_group_commit(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_max_connections)
+{
+    fail_unless(sane_max_connections(-1) == 1);
+    fail_unless(sane_max_connections(0) == 0);
+    fail_unless(sane_max_connections(10000) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_engine)
+{
+    bloom_filter_engine type;
+    fail_unless(sane_engine("bloom", &type) == 0);
+    fail_unless(type == ENGINE_BLOOM);
+    fail_unless(sane_engine("Cuckoo", &type) == 0);
+    fail_unless(type == ENGINE_CUCKOO);
+    fail_unless(sane_engine("quotient", &type) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_optimize)
+{
+    bloom_optimize type;
+    fail_unless(sane_optimize("memory", &type) == 0);
+    fail_unless(type == OPTIMIZE_MEMORY);
+    fail_unless(sane_optimize("Balanced", &type) == 0);
+    fail_unless(type == OPTIMIZE_BALANCED);
+    fail_unless(sane_optimize("speed", &type) == 0);
+    fail_unless(type == OPTIMIZE_SPEED);
+    fail_unless(sane_optimize("latency", &type) == 1);
+    fail_unless(strcmp(optimize_name(OPTIMIZE_SPEED), "speed") == 0);
+}
+END_TEST
+
+START_TEST(test_sane_hashed)
+{
+    fail_unless(sane_hashed(-1) == 1);
+    fail_unless(sane_hashed(0) == 0);
+    fail_unless(sane_hashed(1) == 0);
+    fail_unless(sane_hashed(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_prealloc_fill)
+{
+    fail_unless(sane_prealloc_fill(-0.1) == 1);
+    fail_unless(sane_prealloc_fill(0) == 0);
+    fail_unless(sane_prealloc_fill(0.9) == 0);
+    fail_unless(sane_prealloc_fill(1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_window)
+{
+    fail_unless(sane_window(-1) == 1);
+    fail_unless(sane_window(0) == 0);
+    fail_unless(sane_window(3600) == 0);
+    fail_unless(sane_generations(1) == 1);
+    fail_unless(sane_generations(2) == 0);
+    fail_unless(sane_generations(32) == 0);
+    fail_unless(sane_generations(33) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_scalable)
+{
+    fail_unless(sane_scalable(0) == 0);
+    fail_unless(sane_scalable(1) == 0);
+    fail_unless(sane_scalable(2) == 1);
+    fail_unless(sane_reject_full(0) == 0);
+    fail_unless(sane_reject_full(1) == 0);
+    fail_unless(sane_reject_full(-1) == 1);
+    fail_unless(sane_container(0) == 0);
+    fail_unless(sane_container(1) == 0);
+    fail_unless(sane_container(2) == 1);
+    fail_unless(sane_partitions(1) == 0);
+    fail_unless(sane_partitions(4) == 0);
+    fail_unless(sane_partitions(64) == 0);
+    fail_unless(sane_partitions(0) == 1);
+    fail_unless(sane_partitions(3) == 1);
+    fail_unless(sane_partitions(128) == 1);
+    fail_unless(sane_admin_threads(0) == 0);
+    fail_unless(sane_admin_threads(4) == 0);
+    fail_unless(sane_admin_threads(-1) == 1);
+    fail_unless(sane_handoff_socket(NULL) == 0);
+    fail_unless(sane_handoff_socket("/var/run/bloomd.handoff") == 0);
+    fail_unless(sane_handoff_socket("bloomd.handoff") == 1);
+    fail_unless(sane_adaptive_checks(1) == 0);
+    fail_unless(sane_adaptive_checks(2) == 1);
+    fail_unless(sane_migrate_connections(0) == 0);
+    fail_unless(sane_migrate_connections(1) == 0);
+    fail_unless(sane_migrate_connections(2) == 1);
+    fail_unless(sane_filter_affinity(0) == 0);
+    fail_unless(sane_filter_affinity(1) == 0);
+    fail_unless(sane_filter_affinity(2) == 1);
+    fail_unless(sane_bulk_threads(0) == 0);
+    fail_unless(sane_bulk_threads(8) == 0);
+    fail_unless(sane_bulk_threads(-1) == 1);
+    fail_unless(sane_group_checks(0) == 0);
+    fail_unless(sane_group_checks(1) == 0);
+    fail_unless(sane_group_checks(2) == 1);
+    fail_unless(sane_unix_socket(NULL) == 0);
+    fail_unless(sane_unix_socket("/var/run/bloomd.sock") == 0);
+    fail_unless(sane_unix_socket("bloomd.sock") == 1);
+    fail_unless(sane_tiered_layers(0) == 0);
+    fail_unless(sane_tiered_layers(1) == 0);
+    fail_unless(sane_tiered_layers(2) == 1);
+    fail_unless(sane_pin(0) == 0);
+    fail_unless(sane_pin(1) == 0);
+    fail_unless(sane_pin(2) == 1);
+    fail_unless(sane_writeback_msec(-1) == 1);
+    fail_unless(sane_writeback_msec(0) == 0);
+    fail_unless(sane_writeback_msec(1000) == 0);
+    fail_unless(sane_slowlog_usec(-1) == 1);
+    fail_unless(sane_slowlog_usec(0) == 0);
+    fail_unless(sane_slowlog_usec(10000) == 0);
+    fail_unless(sane_hot_sample(-1) == 1);
+    fail_unless(sane_hot_sample(0) == 0);
+    fail_unless(sane_hot_sample(100) == 0);
+    fail_unless(sane_shed_lag_msec(-1) == 1);
+    fail_unless(sane_shed_lag_msec(0) == 0);
+    fail_unless(sane_shed_lag_msec(100) == 0);
+    fail_unless(sane_summary_capacity(-1) == 1);
+    fail_unless(sane_summary_capacity(0) == 0);
+    fail_unless(sane_summary_capacity(1000000) == 0);
+    fail_unless(sane_max_worker_threads(-1) == 1);
+    fail_unless(sane_max_worker_threads(0) == 0);
+    fail_unless(sane_max_worker_threads(16) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_counting)
+{
+    fail_unless(sane_counting(-1) == 1);
+    fail_unless(sane_counting(0) == 0);
+    fail_unless(sane_counting(1) == 0);
+    fail_unless(sane_counting(2) == 1);
+}
+END_TEST
+
 START_TEST(test_filter_config_bad_file)
 {
     bloom_filter_config config;
@@ -372,6 +802,13 @@ START_TEST(test_update_filename_from_filter_config)
     config.capacity = 4000000;
     config.bytes = 999999;
     config.in_memory = 0;
+    config.counting = 1;
+    config.engine = ENGINE_CUCKOO;
+    config.container = 1;
+    config.partitions = 4;
+    config.frozen = 1;
+    config.pin = 1;
+    config.optimize = OPTIMIZE_BALANCED;
 
     int res = update_filename_from_filter_config("/tmp/update_filter", &config);
     chmod("/tmp/update_filter", 777);
@@ -391,6 +828,13 @@ START_TEST(test_update_filename_from_filter_config)
     fail_unless(config2.capacity == 4000000);
     fail_unless(config2.bytes == 999999);
     fail_unless(config2.in_memory == 0);
+    fail_unless(config2.counting == 1);
+    fail_unless(config2.engine == ENGINE_CUCKOO);
+    fail_unless(config2.container == 1);
+    fail_unless(config2.partitions == 4);
+    fail_unless(config2.frozen == 1);
+    fail_unless(config2.pin == 1);
+    fail_unless(config2.optimize == OPTIMIZE_BALANCED);
 
     unlink("/tmp/update_filter");
 }
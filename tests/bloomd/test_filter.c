@@ -7,8 +7,17 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <string.h>
+#include <pthread.h>
 #include "config.h"
 #include "filter.h"
+#include "snapshot.h"
+#include "delta.h"
+#include "reader.h"
+#include "slowlog.h"
+#include "hot.h"
+#include "clients.h"
+#include "stats.h"
 
 static int filter_out_special(const struct dirent *d) {
     const char *name = d->d_name;
@@ -111,13 +120,14 @@ START_TEST(test_filter_init_proxied)
     res = init_bloom_filter(&config, "test_filter3", 0, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
-    fail_unless(counters->check_hits == 0);
-    fail_unless(counters->check_misses == 0);
-    fail_unless(counters->set_hits == 0);
-    fail_unless(counters->set_misses == 0);
-    fail_unless(counters->page_ins == 0);
-    fail_unless(counters->page_outs == 0);
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 0);
+    fail_unless(counters.check_misses == 0);
+    fail_unless(counters.set_hits == 0);
+    fail_unless(counters.set_misses == 0);
+    fail_unless(counters.page_ins == 0);
+    fail_unless(counters.page_outs == 0);
 
     fail_unless(bloomf_is_proxied(filter) == 1);
     fail_unless(bloomf_capacity(filter) == 100000);
@@ -140,7 +150,7 @@ START_TEST(test_filter_add_check)
     res = init_bloom_filter(&config, "test_filter4", 0, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -153,7 +163,8 @@ START_TEST(test_filter_add_check)
     fail_unless(bloomf_size(filter) == 10000);
     fail_unless(bloomf_byte_size(filter) > 32*1024);
     fail_unless(bloomf_capacity(filter) == 100000);
-    fail_unless(counters->set_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits == 10000);
 
     // Check all the keys exist
     for (int i=0;i<10000;i++) {
@@ -162,7 +173,8 @@ START_TEST(test_filter_add_check)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters->check_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 10000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -179,7 +191,7 @@ START_TEST(test_filter_restore)
     bloom_filter *filter = NULL;
     res = init_bloom_filter(&config, "test_filter5", 0, &filter);
     fail_unless(res == 0);
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -196,7 +208,6 @@ START_TEST(test_filter_restore)
     // Remake the filter
     res = init_bloom_filter(&config, "test_filter5", 1, &filter);
     fail_unless(res == 0);
-    counters = bloomf_counters(filter);
 
     // Re-check
     fail_unless(bloomf_size(filter) == 10000);
@@ -210,8 +221,9 @@ START_TEST(test_filter_restore)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters->set_hits == 0);
-    fail_unless(counters->check_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits == 0);
+    fail_unless(counters.check_hits == 10000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -249,7 +261,7 @@ START_TEST(test_filter_flush)
     bloom_filter *filter2 = NULL;
     res = init_bloom_filter(&config, "test_filter6", 1, &filter2);
     fail_unless(res == 0);
-    filter_counters *counters2 = bloomf_counters(filter2);
+    filter_counters counters2;
 
     // Re-check
     fail_unless(bloomf_size(filter2) == 10000);
@@ -263,8 +275,9 @@ START_TEST(test_filter_flush)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters2->set_hits == 0);
-    fail_unless(counters2->check_hits == 10000);
+    bloomf_counters(filter2, &counters2);
+    fail_unless(counters2.set_hits == 0);
+    fail_unless(counters2.check_hits == 10000);
 
     // Destroy the filter
     res = destroy_bloom_filter(filter);
@@ -287,7 +300,7 @@ START_TEST(test_filter_add_check_in_mem)
     res = init_bloom_filter(&config, "test_filter7", 0, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -300,7 +313,8 @@ START_TEST(test_filter_add_check_in_mem)
     fail_unless(bloomf_size(filter) == 10000);
     fail_unless(bloomf_byte_size(filter) > 32*1024);
     fail_unless(bloomf_capacity(filter) == 100000);
-    fail_unless(counters->set_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits == 10000);
 
     // Check all the keys exist
     for (int i=0;i<10000;i++) {
@@ -309,7 +323,8 @@ START_TEST(test_filter_add_check_in_mem)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters->check_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 10000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -328,7 +343,7 @@ START_TEST(test_filter_grow)
     res = init_bloom_filter(&config, "test_filter8", 1, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -339,14 +354,16 @@ START_TEST(test_filter_grow)
     fail_unless(bloomf_size(filter) > 99000);
     fail_unless(bloomf_byte_size(filter) > 512*1024);
     fail_unless(bloomf_capacity(filter) == 210000);
-    fail_unless(counters->set_hits > 99000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits > 99000);
 
     // Check all the keys exist
     for (int i=0;i<100000;i++) {
         snprintf((char*)&buf, 100, "foobar%d", i);
         res = bloomf_contains(filter, (char*)&buf);
     }
-    fail_unless(counters->check_hits == 100000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 100000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -481,7 +498,7 @@ START_TEST(test_filter_page_out)
     res = init_bloom_filter(&config, "test_filter10", 0, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -494,8 +511,9 @@ START_TEST(test_filter_page_out)
     fail_unless(bloomf_close(filter) == 0);
     fail_unless(bloomf_size(filter) == 10000);
     fail_unless(bloomf_capacity(filter) == 100000);
-    fail_unless(counters->page_outs == 1);
-    fail_unless(counters->page_ins == 0);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.page_outs == 1);
+    fail_unless(counters.page_ins == 0);
 
     // FUCKING annoying umask permissions bullshit
     // Cused by the Check test framework
@@ -508,9 +526,10 @@ START_TEST(test_filter_page_out)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters->check_hits == 10000);
-    fail_unless(counters->page_outs == 1);
-    fail_unless(counters->page_ins == 1);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 10000);
+    fail_unless(counters.page_outs == 1);
+    fail_unless(counters.page_ins == 1);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -538,18 +557,20 @@ START_TEST(test_filter_bounded_fp)
         bloomf_add(filter, (char*)&buf);
     }
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
     fail_unless(bloomf_size(filter) > 999000);
     fail_unless(bloomf_capacity(filter) > 1000000);
-    fail_unless(counters->set_hits > 990000);
-    fail_unless(counters->set_misses < 1000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits > 990000);
+    fail_unless(counters.set_misses < 1000);
 
     // Check all the keys exist
     for (int i=0;i<1000000;i++) {
         snprintf((char*)&buf, 100, "foobar%d", i);
         bloomf_contains(filter, (char*)&buf);
     }
-    fail_unless(counters->check_hits == 1000000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 1000000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -557,3 +578,1512 @@ START_TEST(test_filter_bounded_fp)
 }
 END_TEST
 
+
+START_TEST(test_filter_contains_batch)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter12", 0, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+
+    // Half the keys are present
+    char *keys[100];
+    char results[100];
+    for (int i=0;i<100;i++) {
+        keys[i] = malloc(100);
+        snprintf(keys[i], 100, "foobar%d", (i % 2) ? i : i + 100000);
+    }
+    res = bloomf_contains_batch(filter, (char**)&keys, 100, (char*)&results);
+    fail_unless(res == 0);
+    for (int i=0;i<100;i++) {
+        if (i % 2) fail_unless(results[i] == 1);
+        free(keys[i]);
+    }
+
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits + counters.check_misses == 100);
+    fail_unless(counters.check_hits >= 50);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter12");
+}
+END_TEST
+
+START_TEST(test_filter_cold_snapshot)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.cold_snapshots = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter13", 0, &filter);
+    fail_unless(res == 0);
+
+    filter_counters counters;
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_add(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    // The data file is replaced by a smaller snapshot
+    fail_unless(bloomf_unmap(filter) == 0);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.page_outs == 1);
+    struct stat st;
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter13/data.000.mmap", &st) == -1);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter13/data.000.snap", &st) == 0);
+    fail_unless((uint64_t)st.st_size < filter->filter_config.bytes);
+
+    // Faulting in restores the data file
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_contains(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.page_ins == 1);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter13/data.000.mmap", &st) == 0);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter13/data.000.snap", &st) == -1);
+    fail_unless(bloomf_size(filter) == 10000);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter13") == 2);
+}
+END_TEST
+
+START_TEST(test_filter_cold_packed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.in_memory = 1;
+    config.cold_snapshots = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter40", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    uint64_t size = bloomf_size(filter);
+
+    // The layers are packed into memory, nothing is on disk
+    fail_unless(bloomf_unmap(filter) == 0);
+    fail_unless(bloomf_is_proxied(filter) == 1);
+    fail_unless(filter->num_packed > 1);
+    struct stat st;
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter40/data.000.mmap", &st) == -1);
+
+    // Faulting in unpacks the layers
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_is_proxied(filter) == 0);
+    fail_unless(filter->packed == NULL);
+    fail_unless(bloomf_size(filter) == size);
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.page_ins == 1);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter40");
+}
+END_TEST
+
+START_TEST(test_filter_stage_flush)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 100000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter41", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+
+    // The flush writes the filter as it was at the cut
+    fail_unless(bloomf_stage(filter) == 0);
+    for (int i=1000;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    fail_unless(bloomf_flush(filter) == 0);
+    fail_unless(filter->filter_config.size == 1000);
+    fail_unless(bloomf_size(filter) == 2000);
+
+    // The sets after the cut go out with the next flush
+    fail_unless(bloomf_flush(filter) == 0);
+    fail_unless(filter->filter_config.size == 2000);
+    fail_unless(bloomf_close(filter) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter41/data.000.mmap", 0777) == 0);
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_size(filter) == 2000);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter41");
+}
+END_TEST
+
+START_TEST(test_snapshot_frame_roundtrip)
+{
+    unsigned char in[4096], enc[4096], out[4096];
+
+    // All zeros encode to nothing
+    memset(in, 0, sizeof(in));
+    fail_unless(snapshot_encode_frame(in, sizeof(in), enc, sizeof(enc)) == 0);
+    fail_unless(snapshot_decode_frame(enc, 0, out, sizeof(out)) == 0);
+    fail_unless(memcmp(in, out, sizeof(in)) == 0);
+
+    // Sparse frames shrink, and short zero runs stay in the literals
+    in[0] = 1;
+    in[3] = 0xff;
+    in[1000] = 0x10;
+    in[4095] = 0x80;
+    uint32_t len = snapshot_encode_frame(in, sizeof(in), enc, sizeof(enc));
+    fail_unless(len > 0 && len < 32);
+    fail_unless(snapshot_decode_frame(enc, len, out, sizeof(out)) == 0);
+    fail_unless(memcmp(in, out, sizeof(in)) == 0);
+
+    // Truncated frames are rejected
+    fail_unless(snapshot_decode_frame(enc, len - 1, out, sizeof(out)) == -1);
+
+    // Dense frames do not fit
+    for (int i=0; i < 4096; i++) in[i] = i | 1;
+    fail_unless(snapshot_encode_frame(in, sizeof(in), enc, sizeof(enc)) == UINT32_MAX);
+}
+END_TEST
+
+START_TEST(test_filter_counting_remove)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.counting = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter14", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_add(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    for (int i=0;i<1000;i+=2) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_remove(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.unset_hits == 500);
+    fail_unless(bloomf_size(filter) == 500);
+    fail_unless(bloomf_flush(filter) == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Re-discovering keeps the counting layout, even
+    // if the daemon default has changed
+    config.counting = 0;
+    res = init_bloom_filter(&config, "test_filter14", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.counting == 1);
+    fail_unless(bloomf_size(filter) == 500);
+    for (int i=1;i<1000;i+=2) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_contains(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    res = bloomf_remove(filter, "foobar1");
+    fail_unless(res == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_engine_ops)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.engine_type = ENGINE_CUCKOO;
+
+    fail_unless(strcmp(engine_ops(ENGINE_BLOOM)->name, "bloom") == 0);
+    fail_unless(strcmp(engine_ops(ENGINE_CUCKOO)->name, "cuckoo") == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter15", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->ops == engine_ops(ENGINE_CUCKOO));
+
+    // Cuckoo inserts need exclusive access
+    res = bloomf_add_concurrent(filter, "foobar");
+    fail_unless(res == -2);
+    res = bloomf_add(filter, "foobar");
+    fail_unless(res == 1);
+    res = bloomf_contains(filter, "foobar");
+    fail_unless(res == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_container)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+    config.container = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter27", 1, &filter);
+    fail_unless(res == 0);
+
+    // Grow a few layers
+    char buf[100];
+    for (int i=0;i<100000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    uint64_t size = bloomf_size(filter);
+    uint64_t byte_size = bloomf_byte_size(filter);
+    fail_unless(filter->container->header.num_layers == 3);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // The layers are restored from the container
+    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter27/data.pack", 0777) == 0);
+    res = init_bloom_filter(&config, "test_filter27", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) == size);
+    fail_unless(bloomf_byte_size(filter) == byte_size);
+    for (int i=0;i<100000;i+=997) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+
+    // A reset drops the layers it grew into
+    fail_unless(bloomf_reset(filter) == 0);
+    fail_unless(filter->container->header.num_layers == 1);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Only the config and the container are on disk
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter27") == 2);
+}
+END_TEST
+
+START_TEST(test_filter_partitioned)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 40000;
+    config.partitions = 4;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter30", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.partitions == 4);
+    fail_unless(filter->parts != NULL);
+
+    // Batches are split over the partitions
+    char buf[100][16];
+    char *keys[100];
+    char results[100];
+    for (int i=0;i<100;i++) {
+        snprintf(buf[i], 16, "foobar%d", i);
+        keys[i] = buf[i];
+    }
+    fail_unless(bloomf_add_batch_len(filter, keys, NULL, 100, results) == 0);
+    for (int i=0;i<100;i++) {
+        fail_unless(results[i] == 1);
+        fail_unless(bloomf_contains(filter, keys[i]) == 1);
+    }
+    fail_unless(bloomf_size(filter) == 100);
+    fail_unless(bloomf_add(filter, keys[7]) == 0);
+
+    // Every partition got a share of the keys
+    for (int i=0;i<4;i++) {
+        uint64_t part_size = bloomf_size(filter->parts[i]);
+        fail_unless(part_size > 0 && part_size < 100);
+    }
+    uint64_t byte_size = bloomf_byte_size(filter);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // The partitions are restored with the filter
+    config.partitions = 1;
+    res = init_bloom_filter(&config, "test_filter30", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.partitions == 4);
+    fail_unless(bloomf_size(filter) == 100);
+    fail_unless(bloomf_byte_size(filter) == byte_size);
+    for (int i=0;i<100;i++) {
+        fail_unless(bloomf_contains(filter, keys[i]) == 1);
+    }
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_compact)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter16", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<6000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    uint64_t size = bloomf_size(filter);
+    uint64_t capacity = bloomf_capacity(filter);
+
+    // Full layers are never merged away
+    fail_unless(bloomf_compact(filter) == 0);
+    fail_unless(bloomf_size(filter) == size);
+    fail_unless(bloomf_capacity(filter) == capacity);
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.compactions == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_shrink)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter43", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+    uint64_t bytes = bloomf_byte_size(filter);
+
+    // Nothing folds within a tiny probability
+    fail_unless(bloomf_shrink(filter, 1e-30) == 0);
+    fail_unless(bloomf_byte_size(filter) == bytes);
+
+    // The sparse layer is folded in place of its data file
+    fail_unless(bloomf_shrink(filter, 0) == 1);
+    fail_unless(bloomf_byte_size(filter) < bytes / 4);
+    fail_unless(bloomf_capacity(filter) < 100000 / 4);
+    fail_unless(bloomf_size(filter) == 1000);
+    struct stat st;
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter43/data.000.fold", &st) == -1);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter43/data.000.mmap", &st) == 0);
+    fail_unless((uint64_t)st.st_size == bloomf_byte_size(filter));
+    fail_unless(bloomf_flush(filter) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter43/config.ini", 0777) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter43/data.000.mmap", 0777) == 0);
+
+    // The folded layer is read back
+    bloom_filter *filter2 = NULL;
+    res = init_bloom_filter(&config, "test_filter43", 1, &filter2);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter2) == 1000);
+    fail_unless(bloomf_capacity(filter2) == bloomf_capacity(filter));
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter2, (char*)&buf) == 1);
+    }
+    fail_unless(destroy_bloom_filter(filter2) == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_renumber_data_files)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter17", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    uint64_t size = bloomf_size(filter);
+    fail_unless(bloomf_close(filter) == 0);
+
+    // Leave a gap as an interrupted compaction would
+    fail_unless(rename("/tmp/bloomd/bloomd.test_filter17/data.001.mmap",
+                "/tmp/bloomd/bloomd.test_filter17/data.002.mmap") == 0);
+
+    // Faulting in closes the gap
+    fail_unless(bloomf_contains(filter, "foobar0") == 1);
+    fail_unless(bloomf_size(filter) == size);
+
+    struct stat buf_stat;
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter17/data.001.mmap", &buf_stat) == 0);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter17/data.002.mmap", &buf_stat) == -1);
+    fail_unless(filter->num_files == 2);
+
+    // A reset drops the counted files, so growing reuses their names
+    fail_unless(bloomf_reset(filter) == 0);
+    fail_unless(filter->num_files == 1);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter17/data.001.mmap", &buf_stat) == -1);
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    fail_unless(filter->num_files == 2);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter17/data.001.mmap", &buf_stat) == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_prepare)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter18", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<800;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    fail_unless(bloomf_prepare(filter) == 0);
+    for (int i=800;i<950;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+
+    // The next data file is created ahead of the adds
+    struct stat buf_stat;
+    fail_unless(bloomf_prepare(filter) == 1);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter18/data.001.mmap", &buf_stat) == 0);
+    fail_unless(bloomf_prepare(filter) == 0);
+
+    for (int i=950;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    uint64_t size = bloomf_size(filter);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter18/data.002.mmap", &buf_stat) == -1);
+
+    // Survives a fault
+    fail_unless(bloomf_close(filter) == 0);
+    fail_unless(bloomf_contains(filter, "foobar1999") == 1);
+    fail_unless(bloomf_size(filter) == size);
+    fail_unless(bloomf_capacity(filter) == 5000);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_windowed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.window = 30;
+    config.generations = 3;
+    config.cold_snapshots = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter19", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_capacity(filter) == 3000);
+
+    struct stat buf_stat;
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter19/data.002.mmap", &buf_stat) == 0);
+
+    // The first rotation stamps the newest generation
+    fail_unless(bloomf_rotate(filter) == 1);
+    fail_unless(bloomf_rotate(filter) == 0);
+    fail_unless(bloomf_add(filter, "old") == 1);
+
+    // Age a generation, the key is still kept
+    bloom_sbf *sbf = filter->engine;
+    uint64_t epoch = sbf_epoch(sbf);
+    fail_unless(filter->ops->rotate(filter->engine, epoch + 10, 10) == 1);
+    fail_unless(bloomf_add(filter, "new") == 1);
+    fail_unless(bloomf_contains(filter, "old") == 1);
+
+    // Survives a snapshot and a fault, in the rotated order
+    fail_unless(bloomf_unmap(filter) == 0);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter19/data.000.snap", &buf_stat) == 0);
+    fail_unless(bloomf_contains(filter, "old") == 1);
+    fail_unless(bloomf_contains(filter, "new") == 1);
+    sbf = filter->engine;
+    fail_unless(sbf_epoch(sbf) == epoch + 10);
+
+    // Catching up recycles the older generations
+    fail_unless(filter->ops->rotate(filter->engine, epoch + 35, 10) == 2);
+    fail_unless(bloomf_contains(filter, "old") == 0);
+    fail_unless(bloomf_contains(filter, "new") == 1);
+    fail_unless(sbf_epoch(sbf) == epoch + 30);
+    fail_unless(filter->ops->rotate(filter->engine, epoch + 100, 10) == 3);
+    fail_unless(bloomf_contains(filter, "new") == 0);
+    fail_unless(sbf_epoch(sbf) == epoch + 100);
+    fail_unless(bloomf_capacity(filter) == 3000);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_fixed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.scalable = 0;
+    config.counting = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter20", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(strcmp(filter->ops->name, "fixed") == 0);
+    fail_unless(bloomf_capacity(filter) == 1000);
+
+    // Full filters keep accepting sets, without growing
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) >= 0);
+    }
+    fail_unless(bloomf_capacity(filter) == 1000);
+    fail_unless(bloomf_remove(filter, "foobar1999") == 1);
+
+    // A single data file, which survives a fault
+    struct stat buf_stat;
+    fail_unless(bloomf_close(filter) == 0);
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter20/data.001.mmap", &buf_stat) == -1);
+    fail_unless(bloomf_contains(filter, "foobar1") == 1);
+    fail_unless(strcmp(filter->ops->name, "fixed") == 0);
+    fail_unless(filter->filter_config.counting == 1);
+    fail_unless(bloomf_capacity(filter) == 1000);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void* test_filter_check_thread(void *in) {
+    bloom_filter *filter = in;
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_contains(filter, (char*)&buf);
+    }
+    return NULL;
+}
+
+START_TEST(test_filter_counters_threads)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.worker_threads = 4;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter21", 0, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<500;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+
+    // The counts of each thread are summed on read
+    pthread_t t[6];
+    for (int i=0;i<6;i++)
+        pthread_create(t+i, NULL, test_filter_check_thread, filter);
+    for (int i=0;i<6;i++)
+        pthread_join(t[i], NULL);
+
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits == 500);
+    fail_unless(counters.check_hits + counters.check_misses == 6000);
+    fail_unless(counters.check_hits >= 3000);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter21");
+}
+END_TEST
+
+START_TEST(test_filter_latency_histograms)
+{
+    // Percentiles are within a bucket of the recorded values
+    latency_histogram hist;
+    memset(&hist, 0, sizeof(hist));
+    fail_unless(hist_percentile(&hist, 50) == 0);
+    for (int i=1; i <= 1000; i++) hist_record(&hist, i);
+    uint64_t p50 = hist_percentile(&hist, 50);
+    uint64_t p99 = hist_percentile(&hist, 99);
+    fail_unless(p50 >= 500 && p50 <= 500 * 1.25);
+    fail_unless(p99 >= 990 && p99 <= 990 * 1.25);
+    fail_unless(hist_percentile(&hist, 100) >= 1000);
+    hist_record(&hist, 1ULL << 40);
+    fail_unless(hist_percentile(&hist, 100) == (1ULL << HIST_MAX_BITS) - 1);
+
+    // Faults and flushes of a filter are timed
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter22", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_add(filter, "foo") == 1);
+    fail_unless(bloomf_flush(filter) == 0);
+
+    filter_hot_state *hot = bloomf_hot_state(filter);
+    fail_unless(hot != NULL);
+    uint64_t faults = 0, flushes = 0;
+    for (int i=0; i < HIST_BUCKETS; i++) {
+        faults += hot->page_in_latency.counts[i];
+        flushes += hot->flush_latency.counts[i];
+    }
+    fail_unless(faults == 1);
+    fail_unless(flushes == 2);
+
+    // An unmapped filter gives up its latencies, and keeps its counters
+    filter_counters counters, before;
+    fail_unless(bloomf_unmap(filter) == 0);
+    bloomf_counters(filter, &before);
+    hot = bloomf_detach_hot(filter);
+    fail_unless(hot != NULL);
+    fail_unless(bloomf_hot_state(filter) == NULL);
+    bloomf_free_hot(hot);
+    bloomf_counters(filter, &counters);
+    fail_unless(memcmp(&counters, &before, sizeof(counters)) == 0);
+    fail_unless(counters.set_hits == 1);
+    fail_unless(counters.page_outs == 1);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter22");
+}
+END_TEST
+
+static void test_filter_count_wal(void *data, const char *key, uint32_t len) {
+    (void)key;
+    (void)len;
+    (*(int*)data)++;
+}
+
+START_TEST(test_filter_wal)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.wal = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter28", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->wal != NULL);
+
+    // Keys set before a flush are not left in the log
+    char buf[100];
+    for (int i=0;i<200;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+        if (i == 99) fail_unless(bloomf_flush(filter) == 0);
+    }
+    fail_unless(bloomf_sync_wal(filter) == 0);
+
+    int num = 0;
+    fail_unless(wal_replay("/tmp/bloomd/bloomd.test_filter28", test_filter_count_wal, &num) == 100);
+    fail_unless(num == 100);
+
+    // Without a flush, the data file only has the first keys,
+    // and the rest are replayed from the log
+    bloom_filter *crashed = NULL;
+    res = init_bloom_filter(&config, "test_filter28", 1, &crashed);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(crashed) == 200);
+    for (int i=0;i<200;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(crashed, (char*)&buf) == 1);
+    }
+
+    res = destroy_bloom_filter(crashed);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Closing flushes the filter, and deletes the log
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter28") == 2);
+}
+END_TEST
+
+static void test_filter_apply_delta(void *data, uint32_t layer, uint64_t offset, const unsigned char *bytes, uint32_t len) {
+    fail_unless(layer == 0);
+    memcpy((unsigned char*)data + offset, bytes, len);
+}
+
+START_TEST(test_filter_delta)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.delta_snapshots = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter29", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    fail_unless(bloomf_flush(filter) == 0);
+
+    // The first delta holds every page
+    uint64_t epoch, next;
+    char *path;
+    delta_header header;
+    delta_layer *layers;
+    res = bloomf_export_delta(filter, 0, &epoch, &path);
+    uint64_t byte_size = bloomf_byte_size(filter);
+    fail_unless(res == (int)((byte_size + 4095) / 4096));
+    unsigned char *copy = calloc(1, byte_size);
+    fail_unless(delta_read(path, &header, &layers, test_filter_apply_delta, copy) == res);
+    fail_unless(header.full == 1);
+    fail_unless(header.epoch == epoch);
+    fail_unless(header.num_layers == 1);
+    fail_unless(layers[0].size == byte_size);
+    free(layers);
+    free(path);
+
+    // Only the pages flushed since are in the next one
+    fail_unless(bloomf_add(filter, "new key") == 1);
+    fail_unless(bloomf_flush(filter) == 0);
+    res = bloomf_export_delta(filter, epoch, &next, &path);
+    fail_unless(res > 0 && res < (int)((byte_size + 4095) / 4096) / 2);
+    fail_unless(next > epoch);
+    fail_unless(delta_read(path, &header, &layers, test_filter_apply_delta, copy) == res);
+    fail_unless(header.full == 0);
+    free(layers);
+    free(path);
+
+    // The copy matches the data file
+    unsigned char *disk = malloc(byte_size);
+    int fd = open("/tmp/bloomd/bloomd.test_filter29/data.000.mmap", O_RDONLY);
+    fail_unless(pread(fd, disk, byte_size, 0) == (ssize_t)byte_size);
+    close(fd);
+    fail_unless(memcmp(copy, disk, byte_size) == 0);
+    free(disk);
+    free(copy);
+
+    // Without changes, the delta is empty
+    res = bloomf_export_delta(filter, next, &epoch, &path);
+    fail_unless(res == 0);
+    free(path);
+
+    // A reset clears pages without flushing them
+    fail_unless(bloomf_reset(filter) == 0);
+    res = bloomf_export_delta(filter, epoch, &next, &path);
+    fail_unless(res == (int)((byte_size + 4095) / 4096));
+    free(path);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter29") == 6);
+}
+END_TEST
+
+
+START_TEST(test_filter_frozen)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter31", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+
+    // Frozen filters keep their keys, and refuse changes
+    fail_unless(bloomf_freeze(filter) == 0);
+    fail_unless(bloomf_freeze(filter) == 0);
+    fail_unless(filter->filter_config.frozen == 1);
+    fail_unless(strcmp(filter->ops->name, "frozen bloom") == 0);
+    fail_unless(bloomf_contains(filter, "foobar1999") == 1);
+    fail_unless(bloomf_add(filter, "new") == -3);
+    fail_unless(bloomf_add_concurrent(filter, "new") == -3);
+    fail_unless(bloomf_reset(filter) == -EROFS);
+    fail_unless(bloomf_contains(filter, "new") == 0);
+    fail_unless(bloomf_size(filter) == 2000);
+    fail_unless(bloomf_dirty_bytes(filter) == 0);
+    fail_unless(filter->mapped_bytes == 0);
+
+    // The filter stays frozen once loaded again
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter31", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.frozen == 1);
+    fail_unless(strcmp(filter->ops->name, "frozen bloom") == 0);
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_add(filter, "new") == -3);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // In-memory filters have no data files to map read only
+    config.in_memory = 1;
+    res = init_bloom_filter(&config, "test_filter31", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_freeze(filter) == -2);
+    fail_unless(bloomf_add(filter, "new") == 1);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_reader)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.use_mmap = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter32", 1, &filter);
+    fail_unless(res == 0);
+    bloom_catalog *catalog = NULL;
+    fail_unless(init_catalog(config.data_dir, &catalog) == 0);
+    filter->catalog = catalog;
+
+    char buf[100];
+    for (int i=0;i<500;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+
+    // The reader sees the keys in the shared data files
+    bloomd_reader *reader = NULL;
+    res = bloomd_reader_open(config.data_dir, "test_filter32", &reader);
+    fail_unless(res == 0);
+    uint64_t gen = bloomd_reader_generation(reader);
+    fail_unless(gen == *catalog->generation);
+    fail_unless(bloomd_reader_check(reader, "foobar1", 7) == 1);
+    fail_unless(bloomd_reader_check(reader, "foobar0", 7) == 1);
+    fail_unless(bloomd_reader_refresh(reader) == 0);
+
+    // Keys set since are seen without a refresh
+    fail_unless(bloomf_add(filter, "new") == 1);
+    fail_unless(bloomd_reader_check(reader, "new", 3) == 1);
+
+    // Growing adds a data file, and bumps the generation
+    for (int i=500;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+    fail_unless(*catalog->generation > gen);
+    fail_unless(bloomd_reader_refresh(reader) == 1);
+    fail_unless(bloomd_reader_generation(reader) == *catalog->generation);
+
+    const char *keys[3000];
+    char names[3000][16];
+    char results[3000];
+    for (int i=0;i<3000;i++) {
+        snprintf(names[i], 16, "foobar%d", i);
+        keys[i] = names[i];
+    }
+    bloomd_reader_check_keys(reader, keys, NULL, 3000, results);
+    for (int i=0;i<3000;i++) fail_unless(results[i] == 1);
+    bloomd_reader_close(reader);
+
+    // Deleting the filter bumps the generation too
+    gen = *catalog->generation;
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    fail_unless(*catalog->generation > gen);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomd_reader_open(config.data_dir, "test_filter32", &reader) == -ENOENT);
+    destroy_catalog(catalog);
+}
+END_TEST
+
+START_TEST(test_filter_tiered_layers)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.tiered_layers = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter33", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+
+    // Layers are only moved once they are flushed
+    fail_unless(bloomf_seal(filter) == 0);
+    fail_unless(bloomf_flush(filter) == 0);
+    fail_unless(bloomf_seal(filter) >= 1);
+    fail_unless(bloomf_seal(filter) == 0);
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+
+    // The newest layer still takes adds
+    fail_unless(bloomf_add(filter, "new") == 1);
+    fail_unless(bloomf_contains(filter, "new") == 1);
+    uint64_t size = bloomf_size(filter);
+
+    // Older layers are mapped from their data files when faulted in
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter33", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) == size);
+    fail_unless(bloomf_contains(filter, "new") == 1);
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_seal(filter) == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_pin)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.pin = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter34", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.pin == 1);
+
+    // Every page of a pinned filter is resident, even untouched ones
+    fail_unless(bloomf_resident_bytes(filter) >= bloomf_byte_size(filter));
+
+    char buf[100];
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_resident_bytes(filter) >= bloomf_byte_size(filter));
+
+    // The pin is kept with the filter
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    config.pin = 0;
+    res = init_bloom_filter(&config, "test_filter34", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.pin == 1);
+    fail_unless(bloomf_resident_bytes(filter) >= bloomf_byte_size(filter));
+
+    // Proxied filters have nothing resident
+    res = bloomf_unmap(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_resident_bytes(filter) == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_writeback)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.use_mmap = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter35", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+
+    // The writeback is started for every layer, and leaves the keys
+    fail_unless(bloomf_writeback(filter) == 0);
+    fail_unless(bloomf_flush(filter) == 0);
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+
+    // Proxied filters have nothing to write back
+    res = bloomf_unmap(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_writeback(filter) == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_optimize)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.in_memory = 1;
+
+    bloom_filter *memory = NULL;
+    res = init_bloom_filter(&config, "test_filter36a", 1, &memory);
+    fail_unless(res == 0);
+
+    config.in_memory = 0;
+    config.optimize_type = OPTIMIZE_SPEED;
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter36", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.optimize == OPTIMIZE_SPEED);
+
+    // Fewer probes take more memory for the same capacity
+    fail_unless(bloomf_byte_size(filter) > bloomf_byte_size(memory));
+    fail_unless(bloomf_byte_size(filter) <= bloomf_byte_size(memory) * BLOOM_SPEED_GROWTH);
+
+    // New layers use the profile too
+    char buf[100];
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+        fail_unless(bloomf_add(memory, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_byte_size(filter) > bloomf_byte_size(memory));
+
+    // The profile is kept with the filter
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    config.optimize_type = OPTIMIZE_MEMORY;
+    res = init_bloom_filter(&config, "test_filter36", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.optimize == OPTIMIZE_SPEED);
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = bloomf_delete(memory);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(memory);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_slowlog)
+{
+    // Faults and new layers are noted against the command
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    slowlog_reset();
+    fail_unless(slowlog_len() == 0);
+
+    slowlog_begin();
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter37", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_add(filter, "foo") == 1);
+    slowlog_record("set", "test_filter37 foo", 17, 1, 20000);
+
+    slowlog_begin();
+    fail_unless(bloomf_contains(filter, "foo") == 1);
+    slowlog_record("check", "test_filter37\0foo", 17, 1, 15000);
+
+    bloom_slowlog_entry entries[4];
+    fail_unless(slowlog_read(entries, 4) == 2);
+    fail_unless(strcmp(entries[0].command, "check") == 0);
+    fail_unless(strcmp(entries[0].filter, "test_filter37") == 0);
+    fail_unless(entries[0].usec == 15000);
+    fail_unless(entries[0].events == 0);
+    fail_unless(strcmp(entries[1].command, "set") == 0);
+    fail_unless(entries[1].keys == 1);
+    fail_unless(entries[1].events == (SLOWLOG_PAGE_IN | SLOWLOG_GROWTH));
+    fail_unless(entries[0].id > entries[1].id);
+
+    // The ring keeps the newest entries, and reset forgets them
+    for (int i=0; i < SLOWLOG_LEN + 10; i++) slowlog_record("list", NULL, 0, 0, i);
+    fail_unless(slowlog_len() == SLOWLOG_LEN);
+    fail_unless(slowlog_read(entries, 1) == 1);
+    fail_unless(entries[0].usec == SLOWLOG_LEN + 9);
+    fail_unless(entries[0].filter[0] == '\0');
+    slowlog_reset();
+    fail_unless(slowlog_len() == 0);
+    fail_unless(slowlog_read(entries, 4) == 0);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter37");
+}
+END_TEST
+
+START_TEST(test_filter_hot)
+{
+    // One in every few commands is sampled
+    int sampled = 0;
+    for (int i=0; i < 100; i++) sampled += hot_sample_next(10);
+    fail_unless(sampled == 10);
+
+    // Heavy keys outlast the slots taken by many light ones
+    char key[32];
+    char *keys[1] = {key};
+    int lens[1];
+    for (int i=0; i < HOT_SLOTS * 4; i++) {
+        lens[0] = sprintf(key, "heavy");
+        hot_count("test_hot_a extra", 16, keys, lens, 1);
+        lens[0] = sprintf(key, "light%d", i);
+        hot_count("test_hot_b", 10, keys, lens, 1);
+    }
+
+    bloom_hot_entry filters[4], hot_keys[4];
+    int num_filters = 4, num_keys = 4;
+    hot_read(filters, &num_filters, hot_keys, &num_keys);
+    fail_unless(num_filters == 2);
+    fail_unless(filters[0].count == HOT_SLOTS * 4);
+    fail_unless(filters[1].count == HOT_SLOTS * 4);
+    fail_unless(num_keys == 4);
+    fail_unless(strcmp(hot_keys[0].filter, "test_hot_a") == 0);
+    fail_unless(hot_keys[0].key_hash == hot_key_hash("heavy", 5));
+    fail_unless(hot_keys[0].count == HOT_SLOTS * 4);
+    fail_unless(hot_keys[0].error == 0);
+    fail_unless(strcmp(hot_keys[1].filter, "test_hot_b") == 0);
+    fail_unless(hot_keys[1].count - hot_keys[1].error <= 1);
+}
+END_TEST
+
+START_TEST(test_clients_usage)
+{
+    // Usage is summed by name, unnamed clients together
+    bloom_client_usage usage = {1, 10, 100, 1000, 50, 500};
+    clients_add("test_client_a", &usage);
+    clients_add("test_client_a", &usage);
+    usage.ticks = 5000000;
+    clients_add("test_client_b", &usage);
+    usage.connections = -1;
+    usage.ticks = 0;
+    clients_add(NULL, &usage);
+
+    bloom_client_entry clients[CLIENT_SLOTS];
+    int num = CLIENT_SLOTS;
+    clients_read(clients, &num);
+    fail_unless(num == 3);
+    fail_unless(strcmp(clients[0].name, "test_client_b") == 0);
+    fail_unless(strcmp(clients[1].name, "test_client_a") == 0);
+    fail_unless(clients[1].usage.connections == 2);
+    fail_unless(clients[1].usage.commands == 20);
+    fail_unless(clients[1].usage.keys == 200);
+    fail_unless(clients[1].usage.bytes_in == 2000);
+    fail_unless(clients[1].usage.bytes_out == 100);
+    fail_unless(clients[1].usage.ticks == 1000);
+    fail_unless(clients[0].cpu_usec > clients[1].cpu_usec);
+    fail_unless(strcmp(clients[2].name, CLIENT_UNNAMED) == 0);
+    fail_unless(clients[2].usage.connections == -1);
+
+    // The names past the table of a thread share a slot
+    char name[32];
+    for (int i=0; i < CLIENT_SLOTS; i++) {
+        snprintf(name, sizeof(name), "test_many%d", i);
+        clients_add(name, &usage);
+    }
+    num = CLIENT_SLOTS;
+    clients_read(clients, &num);
+    fail_unless(num == CLIENT_SLOTS);
+    int found = 0;
+    for (int i=0; i < num; i++) {
+        if (strcmp(clients[i].name, CLIENT_OVERFLOW) == 0) {
+            fail_unless(clients[i].usage.commands == 10 * (uint64_t)(3 + 1));
+            found = 1;
+        }
+    }
+    fail_unless(found);
+
+    // The timestamps move forward
+    uint64_t ticks = clients_ticks();
+    fail_unless(clients_ticks() >= ticks);
+}
+END_TEST
+
+START_TEST(test_filter_io_bytes)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter38", 1, &filter);
+    fail_unless(res == 0);
+
+    // A new filter reads nothing in
+    bitmap_io_counters io;
+    bloomf_io(filter, &io);
+    fail_unless(io.bytes_read == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+    uint64_t dirty = bloomf_dirty_page_bytes(filter);
+    fail_unless(dirty > 0);
+    fail_unless(dirty <= bloomf_byte_size(filter) + 4096);
+
+    // The flush writes out the dirty pages
+    uint64_t written = io.bytes_written;
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_dirty_page_bytes(filter) == 0);
+    bloomf_io(filter, &io);
+    fail_unless(io.bytes_written >= written + dirty);
+
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.flushes >= 1);
+
+    // A page in reads the whole filter
+    res = bloomf_unmap(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_dirty_page_bytes(filter) == 0);
+    fail_unless(bloomf_contains(filter, "foobar1") == 1);
+    bloomf_io(filter, &io);
+    fail_unless(io.bytes_read == bloomf_byte_size(filter));
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_layer_summary)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.summary_capacity = 1000000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter39", 0, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+    bloom_sbf *sbf = filter->engine;
+    fail_unless(sbf->summary != NULL);
+    fail_unless(sbf->summary_stale == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // The summary is kept next to the data files, and covers them on load
+    struct stat st;
+    fail_unless(stat("/tmp/bloomd/bloomd.test_filter39/summary.bits", &st) == 0);
+    config.summary_capacity = 0;
+    res = init_bloom_filter(&config, "test_filter39", 1, &filter);
+    fail_unless(res == 0);
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_contains(filter, "other") == 0);
+    sbf = filter->engine;
+    fail_unless(sbf->summary != NULL);
+    fail_unless(sbf->summary_stale == 0);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter39") == 3);
+}
+END_TEST
+
+static int64_t positive_hits(void) {
+    bloom_stats stats;
+    stats_read(&stats);
+    return stats.values[STAT_POSITIVE_HITS];
+}
+
+START_TEST(test_filter_positive_cache)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.counting = 1;
+    config.in_memory = 1;
+    config.positive_cache = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter42", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_add(filter, "foo") == 1);
+
+    // Only the positives are remembered
+    char *keys[] = {"foo", "bar"};
+    char results[2];
+    int64_t hits = positive_hits();
+    fail_unless(bloomf_contains_batch(filter, keys, 2, results) == 0);
+    fail_unless(results[0] == 1 && results[1] == 0);
+    fail_unless(positive_hits() == hits);
+    fail_unless(bloomf_contains_batch(filter, keys, 2, results) == 0);
+    fail_unless(results[0] == 1 && results[1] == 0);
+    fail_unless(positive_hits() == hits + 1);
+
+    // A removal forgets the positives
+    fail_unless(bloomf_remove(filter, "foo") == 1);
+    fail_unless(bloomf_contains_batch(filter, keys, 2, results) == 0);
+    fail_unless(results[0] == 0 && results[1] == 0);
+    fail_unless(positive_hits() == hits + 1);
+
+    // So does a reset
+    fail_unless(bloomf_add(filter, "foo") == 1);
+    fail_unless(bloomf_contains_batch(filter, keys, 1, results) == 0);
+    fail_unless(bloomf_contains_batch(filter, keys, 1, results) == 0);
+    fail_unless(results[0] == 1);
+    fail_unless(positive_hits() == hits + 2);
+    fail_unless(bloomf_reset(filter) == 0);
+    fail_unless(bloomf_contains_batch(filter, keys, 1, results) == 0);
+    fail_unless(results[0] == 0);
+    fail_unless(positive_hits() == hits + 2);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
@@ -2,14 +2,24 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include "config.h"
 #include "filter.h"
 #include "filter_manager.h"
+#include "stats.h"
+#include "spinlock.h"
+#include "metrics.h"
+#include "cluster.h"
+#include "load.h"
 
 START_TEST(test_mgr_init_destroy)
 {
@@ -402,6 +412,245 @@ START_TEST(test_mgr_unmap_add_keys)
 }
 END_TEST
 
+/* Asynchronous faults */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int res;
+} fault_wait;
+
+static void test_mgr_fault_cb(void *data, int res) {
+    fault_wait *w = data;
+    pthread_mutex_lock(&w->lock);
+    w->res = res;
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void test_mgr_proxied_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(int*)data = bloomf_is_proxied(filter);
+}
+
+START_TEST(test_mgr_fault_async)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    fault_wait w = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, -1};
+    res = filtmgr_fault_filter_async(mgr, NULL, "zab11", test_mgr_fault_cb, &w);
+    fail_unless(res == -1);
+
+    res = filtmgr_create_filter(mgr, "zab11", NULL);
+    fail_unless(res == 0);
+
+    // Nothing to do while the filter is in memory
+    res = filtmgr_fault_filter_async(mgr, NULL, "zab11", test_mgr_fault_cb, &w);
+    fail_unless(res == 1);
+
+    res = filtmgr_unmap_filter(mgr, "zab11");
+    fail_unless(res == 0);
+
+    int proxied = 0;
+    filtmgr_filter_cb(mgr, "zab11", test_mgr_proxied_cb, &proxied);
+    fail_unless(proxied == 1);
+
+    // Fault in on a fault thread, and wait for the callback
+    res = filtmgr_fault_filter_async(mgr, NULL, "zab11", test_mgr_fault_cb, &w);
+    fail_unless(res == 0);
+    pthread_mutex_lock(&w.lock);
+    while (!w.done) pthread_cond_wait(&w.cond, &w.lock);
+    pthread_mutex_unlock(&w.lock);
+    fail_unless(w.res == 0);
+
+    filtmgr_filter_cb(mgr, "zab11", test_mgr_proxied_cb, &proxied);
+    fail_unless(proxied == 0);
+
+    res = filtmgr_drop_filter(mgr, "zab11");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_warm)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_warm_filter(mgr, "zab12");
+    fail_unless(res == -1);
+
+    res = filtmgr_create_filter(mgr, "zab12", NULL);
+    fail_unless(res == 0);
+
+    res = filtmgr_warm_filter(mgr, "zab12");
+    fail_unless(res == 0);
+
+    res = filtmgr_unmap_filter(mgr, "zab12");
+    fail_unless(res == 0);
+
+    // The warm returns before the fault thread is done
+    res = filtmgr_warm_filter(mgr, "zab12");
+    fail_unless(res == 0);
+    int proxied = 1;
+    for (int i=0; i < 5000 && proxied; i++) {
+        filtmgr_filter_cb(mgr, "zab12", test_mgr_proxied_cb, &proxied);
+        if (proxied) usleep(1000);
+    }
+    fail_unless(proxied == 0);
+
+    // Nothing was predicted to be used
+    bloom_filter_list_head *head;
+    res = filtmgr_list_prewarm_filters(mgr, 300, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    res = filtmgr_drop_filter(mgr, "zab12");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_evict_clock)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *names[] = {"evict1", "evict2", "evict3"};
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_create_filter(mgr, names[i], NULL);
+        fail_unless(res == 0);
+    }
+
+    // New filters are hot, so the hand goes around twice
+    bloom_filter_list_head *head;
+    res = filtmgr_list_evict_filters(mgr, 1, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    char *first = strdup(head->head->filter_name);
+    filtmgr_cleanup_list(head);
+
+    // Use the listed filter and one other, the third is evicted
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    char *unused = NULL;
+    int used = 0;
+    for (int i=0; i < 3; i++) {
+        if (strcmp(names[i], first) && used) {
+            unused = names[i];
+            continue;
+        }
+        if (strcmp(names[i], first)) used = 1;
+        res = filtmgr_check_keys(mgr, names[i], (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+    }
+    res = filtmgr_list_evict_filters(mgr, 1, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, unused) == 0);
+    filtmgr_cleanup_list(head);
+
+    // Proxied filters are never listed
+    res = filtmgr_unmap_filter(mgr, unused);
+    fail_unless(res == 0);
+    res = filtmgr_list_evict_filters(mgr, UINT64_MAX, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 2);
+    filtmgr_cleanup_list(head);
+
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_drop_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+    free(first);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_list_dirty)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *names[] = {"dirty1", "dirty2", "dirty3"};
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_create_filter(mgr, names[i], NULL);
+        fail_unless(res == 0);
+        res = filtmgr_flush_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+
+    // Flushed filters are clean
+    bloom_filter_list_head *head;
+    res = filtmgr_list_dirty_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    // The filter with more changes is listed first
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "dirty1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "dirty2", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_list_dirty_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 2);
+    fail_unless(strcmp(head->head->filter_name, "dirty2") == 0);
+    fail_unless(strcmp(head->head->next->filter_name, "dirty1") == 0);
+    filtmgr_cleanup_list(head);
+
+    // Proxied filters are not listed
+    res = filtmgr_unmap_filter(mgr, "dirty2");
+    fail_unless(res == 0);
+    res = filtmgr_list_dirty_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, "dirty1") == 0);
+    filtmgr_cleanup_list(head);
+
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_drop_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 /* Clear command */
 START_TEST(test_mgr_clear_no_filter)
 {
@@ -724,6 +973,76 @@ START_TEST(test_mgr_grow)
 }
 END_TEST
 
+struct set_worker_args {
+    bloom_filtmgr *mgr;
+    int offset;
+};
+
+static void* concurrent_set_worker(void *in) {
+    struct set_worker_args *args = in;
+    char *keys[10];
+    char result[10];
+    for (int iter=0;iter<2000;iter++) {
+        for (int i=0;i<10;i++) asprintf(&keys[i], "test_key_%d_%d", args->offset, iter*10+i);
+        if (filtmgr_set_keys(args->mgr, "conc1", (char**)&keys, 10, (char*)&result) != 0) {
+            return (void*)1;
+        }
+        for (int i=0;i<10;i++) free(keys[i]);
+    }
+    return NULL;
+}
+
+START_TEST(test_mgr_concurrent_sets)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.initial_capacity = 10000;
+    config.concurrent_sets = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "conc1", NULL);
+    fail_unless(res == 0);
+
+    // Run several writers, enough keys to force growth
+    pthread_t threads[4];
+    struct set_worker_args args[4];
+    for (int i=0;i<4;i++) {
+        args[i].mgr = mgr;
+        args[i].offset = i;
+        pthread_create(&threads[i], NULL, concurrent_set_worker, &args[i]);
+    }
+    void *ret;
+    for (int i=0;i<4;i++) {
+        pthread_join(threads[i], &ret);
+        fail_unless(ret == NULL);
+    }
+
+    // All the keys should be present
+    char *keys[1];
+    char result[1];
+    for (int t=0;t<4;t++) {
+        for (int k=0;k<20000;k+=7) {
+            asprintf(&keys[0], "test_key_%d_%d", t, k);
+            res = filtmgr_check_keys(mgr, "conc1", (char**)&keys, 1, (char*)&result);
+            fail_unless(res == 0);
+            fail_unless(result[0] == 1);
+            free(keys[0]);
+        }
+    }
+
+    res = filtmgr_drop_filter(mgr, "conc1");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 /* Close & Restore */
 
 START_TEST(test_mgr_restore)
@@ -775,6 +1094,122 @@ START_TEST(test_mgr_restore)
 }
 END_TEST
 
+START_TEST(test_mgr_catalog)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "cat1", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "cat2", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "cat1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    // The drop is recorded once the filter is deleted
+    res = filtmgr_drop_filter(mgr, "cat2");
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+    fail_unless(access("/tmp/bloomd/filters.catalog", F_OK) == 0);
+
+    // Restore from the catalog
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    for (int i=0;i<3;i++) result[i] = 0;
+    res = filtmgr_check_keys(mgr, "cat1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0]);
+    fail_unless(result[1]);
+    fail_unless(result[2]);
+    res = filtmgr_check_keys(mgr, "cat2", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -1);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    // A corrupt catalog falls back to scanning the folders
+    FILE *f = fopen("/tmp/bloomd/filters.catalog", "a");
+    fail_unless(f != NULL);
+    fputs("corrupt\n", f);
+    fclose(f);
+
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    for (int i=0;i<3;i++) result[i] = 0;
+    res = filtmgr_check_keys(mgr, "cat1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0]);
+
+    res = filtmgr_drop_filter(mgr, "cat1");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_stubs)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "stub1", NULL);
+    fail_unless(res == 0);
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "stub1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    // The filters found without the catalog are read by the
+    // sweep thread, which then writes a new catalog
+    unlink("/tmp/bloomd/filters.catalog");
+    res = init_filter_manager(&config, 1, &mgr);
+    fail_unless(res == 0);
+    for (int i=0; i < 500 && access("/tmp/bloomd/filters.catalog", F_OK); i++) usleep(10000);
+    fail_unless(access("/tmp/bloomd/filters.catalog", F_OK) == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    // Cataloged filters are loaded on first use, and not faulted in
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    int proxied = 0;
+    res = filtmgr_filter_cb(mgr, "stub1", test_mgr_proxied_cb, &proxied);
+    fail_unless(res == 0);
+    fail_unless(proxied);
+
+    for (int i=0;i<3;i++) result[i] = 0;
+    res = filtmgr_check_keys(mgr, "stub1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    res = filtmgr_drop_filter(mgr, "stub1");
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 void test_mgr_cb(void *data, char *filter_name, bloom_filter* filter) {
     (void)filter_name;
     (void)filter;
@@ -809,3 +1244,1397 @@ START_TEST(test_mgr_callback)
 }
 END_TEST
 
+
+START_TEST(test_mgr_unset_keys)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->counting = 1;
+    res = filtmgr_create_filter(mgr, "unset1", custom);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "unset2", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "unset1", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    res = filtmgr_unset_keys(mgr, "unset1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+    fail_unless(result[1] == 1);
+    fail_unless(result[2] == 0);
+
+    res = filtmgr_check_keys(mgr, "unset1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(!result[0]);
+    fail_unless(!result[1]);
+    fail_unless(!result[2]);
+
+    // Plain filters and missing filters
+    res = filtmgr_unset_keys(mgr, "unset2", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -3);
+    res = filtmgr_unset_keys(mgr, "unset3", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+
+    res = filtmgr_drop_filter(mgr, "unset1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "unset2");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_cuckoo_engine)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->engine_type = ENGINE_CUCKOO;
+    res = filtmgr_create_filter(mgr, "cuckoo1", custom);
+    fail_unless(res == 0);
+
+    // Grow past the first layer
+    char buf[100];
+    char *keys[1] = {(char*)&buf};
+    char result[1];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        res = filtmgr_set_keys(mgr, "cuckoo1", (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+        fail_unless(result[0] == 1);
+    }
+
+    // Cuckoo filters support unset without counting
+    snprintf((char*)&buf, 100, "key%d", 42);
+    res = filtmgr_unset_keys(mgr, "cuckoo1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+    res = filtmgr_check_keys(mgr, "cuckoo1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0);
+
+    // The engine survives a reload of the data files
+    fail_unless(filtmgr_flush_filter(mgr, "cuckoo1") == 0);
+    fail_unless(destroy_filter_manager(mgr) == 0);
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    snprintf((char*)&buf, 100, "key%d", 43);
+    res = filtmgr_check_keys(mgr, "cuckoo1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+    res = filtmgr_unset_keys(mgr, "cuckoo1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+
+    res = filtmgr_drop_filter(mgr, "cuckoo1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_fixed_reject_full)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.concurrent_sets = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->scalable = 0;
+    custom->reject_full = 1;
+    res = filtmgr_create_filter(mgr, "fixed1", custom);
+    fail_unless(res == 0);
+
+    char buf[100];
+    char *keys[1] = {(char*)&buf};
+    char result[1];
+    int added = 0;
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        res = filtmgr_set_keys(mgr, "fixed1", (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+        added += result[0];
+    }
+
+    // New keys are rejected once full, known keys are still found
+    while (added < 1000) {
+        snprintf((char*)&buf, 100, "more%d", added);
+        res = filtmgr_set_keys(mgr, "fixed1", (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+        added += result[0];
+    }
+    snprintf((char*)&buf, 100, "rejected");
+    res = filtmgr_set_keys(mgr, "fixed1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -4);
+    snprintf((char*)&buf, 100, "key%d", 1);
+    res = filtmgr_set_keys(mgr, "fixed1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0);
+    fail_unless(filtmgr_check_keys(mgr, "fixed1", (char**)&keys, 1, (char*)&result) == 0);
+    fail_unless(result[0] == 1);
+
+    res = filtmgr_drop_filter(mgr, "fixed1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_layer_hits)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "hits1", NULL);
+    fail_unless(res == 0);
+
+    char buf[100];
+    char *keys[1] = {(char*)&buf};
+    char result[1];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        res = filtmgr_set_keys(mgr, "hits1", (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+    }
+
+    // An old key is found in the oldest data file, which is then probed first
+    snprintf((char*)&buf, 100, "key%d", 1);
+    for (int i=0;i<10;i++) {
+        res = filtmgr_check_keys(mgr, "hits1", (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+        fail_unless(result[0] == 1);
+    }
+    uint64_t hits[4];
+    res = filtmgr_layer_hits(mgr, "hits1", (uint64_t*)&hits, 4);
+    fail_unless(res == 2);
+    fail_unless(hits[1] >= 10);
+    fail_unless(filtmgr_reorder_filter(mgr, "hits1") == 0);
+    res = filtmgr_check_keys(mgr, "hits1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+    fail_unless(filtmgr_layer_hits(mgr, "hits2", (uint64_t*)&hits, 4) == -1);
+
+    res = filtmgr_drop_filter(mgr, "hits1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_keys_len)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "keylen1", NULL);
+    fail_unless(res == 0);
+
+    // Keys are sliced out of one buffer without terminators
+    char line[] = "abc def ghi";
+    char *keys[] = {line, line + 4, line + 8};
+    uint64_t lens[] = {3, 3, 3};
+    char result[3] = {0, 0, 0};
+    res = filtmgr_set_keys_len(mgr, NULL, "keylen1", (char**)&keys, (uint64_t*)&lens, 2, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1);
+
+    char *terminated[] = {"abc", "def", "ghi"};
+    res = filtmgr_check_keys(mgr, "keylen1", (char**)&terminated, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+    res = filtmgr_check_keys_len(mgr, NULL, "keylen1", (char**)&keys, (uint64_t*)&lens, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+
+    res = filtmgr_drop_filter(mgr, "keylen1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_check_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Filters of different engines and hash counts share the hashes
+    res = filtmgr_create_filter(mgr, "mcheck1", NULL);
+    fail_unless(res == 0);
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->default_probability = 1e-7;
+    res = filtmgr_create_filter(mgr, "mcheck2", custom);
+    fail_unless(res == 0);
+    custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->engine_type = ENGINE_CUCKOO;
+    res = filtmgr_create_filter(mgr, "mcheck3", custom);
+    fail_unless(res == 0);
+
+    char *keys[] = {"abc"};
+    char result[3];
+    res = filtmgr_set_keys(mgr, "mcheck1", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "mcheck3", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+
+    // The key need not be terminated
+    char *names[] = {"mcheck1", "mcheck2", "mcheck3"};
+    res = filtmgr_check_filters(mgr, (char**)&names, 3, "abcdef", 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 0 && result[2] == 1);
+    res = filtmgr_check_filters(mgr, (char**)&names, 3, "xyz", 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0 && result[1] == 0 && result[2] == 0);
+
+    // A missing filter fails the check
+    char *missing[] = {"mcheck1", "mcheck4"};
+    res = filtmgr_check_filters(mgr, (char**)&missing, 2, "abc", 3, (char*)&result);
+    fail_unless(res == -1);
+
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_drop_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_combine_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *names[] = {"combine1", "combine2", "combine3"};
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_create_filter(mgr, names[i], NULL);
+        fail_unless(res == 0);
+    }
+
+    char *keys1[] = {"abc", "def"};
+    char *keys2[] = {"def", "ghi"};
+    char result[3];
+    res = filtmgr_set_keys(mgr, "combine1", (char**)&keys1, 2, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "combine2", (char**)&keys2, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    // The union has the keys of both
+    char *all[] = {"abc", "def", "ghi"};
+    res = filtmgr_combine_filters(mgr, "combine3", (char**)&names, 2, 0);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "combine3", (char**)&all, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 1);
+
+    // The intersection keeps the shared key
+    res = filtmgr_combine_filters(mgr, "combine1", names + 1, 1, 1);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "combine1", (char**)&all, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0 && result[1] == 1 && result[2] == 0);
+
+    // Filters must exist and line up
+    char *missing[] = {"combine4"};
+    res = filtmgr_combine_filters(mgr, "combine1", (char**)&missing, 1, 0);
+    fail_unless(res == -1);
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->engine_type = ENGINE_CUCKOO;
+    res = filtmgr_create_filter(mgr, "combine4", custom);
+    fail_unless(res == 0);
+    res = filtmgr_combine_filters(mgr, "combine1", (char**)&missing, 1, 0);
+    fail_unless(res == -3);
+
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_drop_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+    res = filtmgr_drop_filter(mgr, "combine4");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_filter_cache)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "cache1", NULL);
+    fail_unless(res == 0);
+
+    bloom_filtmgr_cache cache;
+    memset(&cache, 0, sizeof(cache));
+    char *keys[] = {"abc"};
+    char result[1];
+    res = filtmgr_set_keys_len(mgr, &cache, "cache1", (char**)&keys, NULL, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+    fail_unless(cache.filter != NULL);
+    fail_unless(strcmp(cache.name, "cache1") == 0);
+
+    // Hits the cache, and the cached name can be passed back in
+    res = filtmgr_check_keys_len(mgr, &cache, cache.name, (char**)&keys, NULL, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+
+    // A drop invalidates the cache, a new filter of the same name is found
+    res = filtmgr_drop_filter(mgr, "cache1");
+    fail_unless(res == 0);
+    res = filtmgr_check_keys_len(mgr, &cache, "cache1", (char**)&keys, NULL, 1, (char*)&result);
+    fail_unless(res == -1);
+    fail_unless(cache.filter == NULL);
+    filtmgr_vacuum(mgr);
+
+    res = filtmgr_create_filter(mgr, "cache1", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys_len(mgr, &cache, "cache1", (char**)&keys, NULL, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0);
+    fail_unless(cache.filter != NULL);
+
+    res = filtmgr_drop_filter(mgr, "cache1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_drop_churn)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "churn0", NULL);
+    fail_unless(res == 0);
+
+    // Many versions without a vacuum
+    char name[16];
+    for (int i=1; i < 100; i++) {
+        snprintf(name, sizeof(name), "churn%d", i);
+        res = filtmgr_create_filter(mgr, name, NULL);
+        fail_unless(res == 0);
+        res = filtmgr_drop_filter(mgr, name);
+        fail_unless(res == 0);
+    }
+
+    char *keys[] = {"abc"};
+    char result[1];
+    res = filtmgr_set_keys(mgr, "churn0", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "churn50", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+
+    bloom_filter_list_head *head;
+    res = filtmgr_list_filters(mgr, NULL, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    filtmgr_cleanup_list(head);
+
+    // Dropped filters are pending deletes until vacuumed
+    res = filtmgr_create_filter(mgr, "churn50", NULL);
+    fail_unless(res == -3);
+    filtmgr_vacuum(mgr);
+    res = filtmgr_create_filter(mgr, "churn50", NULL);
+    fail_unless(res == 0);
+
+    res = filtmgr_drop_filter(mgr, "churn50");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "churn0");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_many_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.initial_capacity = 1000;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Enough filters to grow the name index several times
+    char name[16];
+    for (int i=0; i < 200; i++) {
+        snprintf(name, sizeof(name), "many%d", i);
+        res = filtmgr_create_filter(mgr, name, NULL);
+        fail_unless(res == 0);
+    }
+
+    char *keys[] = {"abc"};
+    char result[1];
+    for (int i=0; i < 200; i++) {
+        snprintf(name, sizeof(name), "many%d", i);
+        res = filtmgr_check_keys(mgr, name, (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+    }
+    res = filtmgr_check_keys(mgr, "many200", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+    res = filtmgr_check_keys(mgr, "many", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+
+    for (int i=0; i < 200; i++) {
+        snprintf(name, sizeof(name), "many%d", i);
+        res = filtmgr_drop_filter(mgr, name);
+        fail_unless(res == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void test_page_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter;
+    char *last = data;
+    fail_unless(strncmp(filter_name, "page", 4) == 0);
+    fail_unless(strcmp(filter_name, last) > 0);
+    strcpy(last, filter_name);
+}
+
+static void test_page_last_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter;
+    strcpy(data, filter_name);
+}
+
+START_TEST(test_mgr_list_pages)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Spread over the shards, around filters without the prefix
+    char name[32];
+    for (int i=0; i < 50; i++) {
+        snprintf(name, sizeof(name), "page%02d", i);
+        fail_unless(filtmgr_create_filter(mgr, name, NULL) == 0);
+    }
+    fail_unless(filtmgr_create_filter(mgr, "aaa", NULL) == 0);
+    fail_unless(filtmgr_create_filter(mgr, "zzz", NULL) == 0);
+
+    // Page through in order, resuming after the last name
+    char last[32] = "";
+    int total = 0;
+    while ((res = filtmgr_iter_filters(mgr, "page", (total) ? last : NULL, 7, test_page_cb, last)) > 0)
+        total += res;
+    fail_unless(total == 50);
+    fail_unless(strcmp(last, "page49") == 0);
+
+    // A cursor before the prefix starts at the prefix
+    last[0] = 0;
+    fail_unless(filtmgr_iter_filters(mgr, "page", "aaa", 0, test_page_cb, last) == 50);
+
+    // Without a prefix, the cursor alone bounds the listing
+    last[0] = 0;
+    fail_unless(filtmgr_iter_filters(mgr, NULL, "page48", 0, test_page_last_cb, last) == 2);
+    fail_unless(strcmp(last, "zzz") == 0);
+    fail_unless(filtmgr_iter_filters(mgr, NULL, NULL, 2, test_page_last_cb, last) == 2);
+    fail_unless(strcmp(last, "page00") == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_stats)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_stats before, after;
+    stats_read(&before);
+
+    res = filtmgr_create_filter(mgr, "zab9", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab9", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab9", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    // The totals move without walking the filters
+    stats_read(&after);
+    fail_unless(after.values[STAT_FILTERS] - before.values[STAT_FILTERS] == 1);
+    fail_unless(after.values[STAT_MAPPED_FILTERS] - before.values[STAT_MAPPED_FILTERS] == 1);
+    fail_unless(after.values[STAT_MAPPED_BYTES] > before.values[STAT_MAPPED_BYTES]);
+    fail_unless(after.values[STAT_SETS] - before.values[STAT_SETS] == 3);
+    fail_unless(after.values[STAT_CHECKS] - before.values[STAT_CHECKS] == 2);
+
+    // Dropping the filter returns the gauges
+    res = filtmgr_drop_filter(mgr, "zab9");
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    stats_read(&after);
+    fail_unless(after.values[STAT_FILTERS] == before.values[STAT_FILTERS]);
+    fail_unless(after.values[STAT_MAPPED_FILTERS] == before.values[STAT_MAPPED_FILTERS]);
+    fail_unless(after.values[STAT_MAPPED_BYTES] == before.values[STAT_MAPPED_BYTES]);
+    fail_unless(filtmgr_version_backlog(mgr) == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_metrics)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab10", NULL);
+    fail_unless(res == 0);
+    stats_record_latency(LAT_SET, 5);
+
+    char *out;
+    int len = metrics_format(mgr, &out);
+    fail_unless(len > 0);
+    fail_unless(strlen(out) == (size_t)len);
+
+    // Counters and gauges are single samples
+    fail_unless(strstr(out, "# TYPE bloomd_checks counter\n") != NULL);
+    fail_unless(strstr(out, "\nbloomd_checks_total ") != NULL);
+    fail_unless(strstr(out, "# TYPE bloomd_filters gauge\n") != NULL);
+    fail_unless(strstr(out, "\nbloomd_version_backlog ") != NULL);
+    fail_unless(strstr(out, "\nbloomd_lock_waits_total ") != NULL);
+
+    // The latency lands in the bucket up to 8 microseconds
+    fail_unless(strstr(out, "bloomd_command_latency_seconds_bucket{command=\"set\",le=\"0.000004\"} ") != NULL);
+    fail_unless(strstr(out, "bloomd_command_latency_seconds_bucket{command=\"set\",le=\"0.000008\"} ") != NULL);
+    fail_unless(strstr(out, "bloomd_command_latency_seconds_bucket{command=\"set\",le=\"+Inf\"} ") != NULL);
+    fail_unless(strstr(out, "bloomd_command_latency_seconds_sum{command=\"flush\"} ") != NULL);
+
+    // The exposition is terminated
+    fail_unless(strcmp(out + len - 6, "# EOF\n") == 0);
+    free(out);
+
+    res = filtmgr_drop_filter(mgr, "zab10");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_replication)
+{
+    // Stand in for a replica, the connection waits in the backlog
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    fail_unless(lfd != -1);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fail_unless(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    fail_unless(listen(lfd, 1) == 0);
+    socklen_t addr_len = sizeof(addr);
+    fail_unless(getsockname(lfd, (struct sockaddr*)&addr, &addr_len) == 0);
+
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    char replicas[64];
+    snprintf(replicas, sizeof(replicas), "127.0.0.1:%d", ntohs(addr.sin_port));
+    config.replicas = replicas;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "repl1", NULL);
+    fail_unless(res == 0);
+
+    // Only new keys are sent, and sets of a filter are coalesced
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "repl1", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "repl1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    // Keys with spaces cannot be sent as text
+    char *bad_keys[] = {"bad key"};
+    res = filtmgr_set_keys(mgr, "repl1", (char**)&bad_keys, 1, (char*)&result);
+    fail_unless(res == 0);
+
+    res = filtmgr_drop_filter(mgr, "repl1");
+    fail_unless(res == 0);
+
+    // The backlog is sent before the manager is destroyed
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    int fd = accept(lfd, NULL, NULL);
+    fail_unless(fd != -1);
+    char buf[4096];
+    int len = 0, n;
+    while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) len += n;
+    buf[len] = '\0';
+    close(fd);
+    close(lfd);
+
+    char *start = "noreply on\ncreate repl1 capacity=";
+    fail_unless(strncmp(buf, start, strlen(start)) == 0);
+    fail_unless(strstr(buf, "\nb repl1 hey there person\ndrop repl1\n") != NULL);
+    fail_unless(strstr(buf, "bad") == NULL);
+}
+END_TEST
+
+START_TEST(test_mgr_cluster_ring)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    // This node must be one of the nodes
+    bloom_cluster *cluster;
+    config.cluster_nodes = "10.0.0.1:8673,10.0.0.2:8673,10.0.0.3:8673";
+    config.cluster_self = "10.0.0.4:8673";
+    fail_unless(init_cluster(&config, &cluster) == -EINVAL);
+
+    config.cluster_self = "10.0.0.2:8673";
+    res = init_cluster(&config, &cluster);
+    fail_unless(res == 0);
+    fail_unless(cluster_num_nodes(cluster) == 3);
+    fail_unless(cluster_self(cluster) == 1);
+    fail_unless(strcmp(cluster_node_name(cluster, 2), "10.0.0.3:8673") == 0);
+
+    // Every node owns a fair share of the filters
+    char name[32];
+    int owners[3000], counts[3] = {0, 0, 0};
+    for (int i=0; i < 3000; i++) {
+        int len = snprintf(name, sizeof(name), "filter%d", i);
+        owners[i] = cluster_owner(cluster, name, len);
+        fail_unless(owners[i] >= 0 && owners[i] < 3);
+        fail_unless(cluster_owner(cluster, name, len) == owners[i]);
+        counts[owners[i]]++;
+    }
+    for (int i=0; i < 3; i++) fail_unless(counts[i] > 600 && counts[i] < 1400);
+    destroy_cluster(cluster);
+
+    // Adding a node only moves filters to the new node
+    config.cluster_nodes = "10.0.0.1:8673,10.0.0.2:8673,10.0.0.3:8673,10.0.0.4:8673";
+    res = init_cluster(&config, &cluster);
+    fail_unless(res == 0);
+    int moved = 0;
+    for (int i=0; i < 3000; i++) {
+        int len = snprintf(name, sizeof(name), "filter%d", i);
+        int owner = cluster_owner(cluster, name, len);
+        if (owner == owners[i]) continue;
+        fail_unless(owner == 3);
+        moved++;
+    }
+    fail_unless(moved > 400 && moved < 1100);
+    destroy_cluster(cluster);
+}
+END_TEST
+
+START_TEST(test_mgr_flush_tickets)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Without a flush thread, the caller flushes
+    uint64_t ticket = 0;
+    fail_unless(filtmgr_request_flush(mgr, &ticket) == -1);
+    fail_unless(filtmgr_flush_requested(mgr) == 0);
+
+    filtmgr_set_flush_scheduler(mgr, 1);
+    fail_unless(filtmgr_request_flush(mgr, &ticket) == 0);
+    fail_unless(ticket == 1);
+    fail_unless(filtmgr_request_flush(mgr, &ticket) == 0);
+    fail_unless(ticket == 2);
+    fail_unless(filtmgr_flush_requested(mgr) == 2);
+
+    // Unknown tickets are rejected, waiters are called back
+    fault_wait w;
+    memset(&w, 0, sizeof(w));
+    fail_unless(filtmgr_wait_flush_async(mgr, 3, test_mgr_fault_cb, &w) == -1);
+    fail_unless(filtmgr_wait_flush_async(mgr, 0, test_mgr_fault_cb, &w) == -1);
+    fail_unless(filtmgr_wait_flush_async(mgr, 2, test_mgr_fault_cb, &w) == 0);
+    filtmgr_complete_flush(mgr, 1);
+    fail_unless(!w.done);
+    fail_unless(filtmgr_wait_flush_async(mgr, 1, test_mgr_fault_cb, &w) == 1);
+    filtmgr_complete_flush(mgr, 2);
+    fail_unless(w.done);
+    fail_unless(filtmgr_flush_requested(mgr) == 0);
+
+    // Stopping the flush thread completes the outstanding tickets
+    memset(&w, 0, sizeof(w));
+    fail_unless(filtmgr_request_flush(mgr, &ticket) == 0);
+    fail_unless(filtmgr_wait_flush_async(mgr, ticket, test_mgr_fault_cb, &w) == 0);
+    filtmgr_set_flush_scheduler(mgr, 0);
+    fail_unless(w.done);
+    fail_unless(filtmgr_request_flush(mgr, &ticket) == -1);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_freeze)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_freeze_filter(mgr, "frozen1") == -1);
+
+    res = filtmgr_create_filter(mgr, "frozen1", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "frozen2", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "frozen1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_freeze_filter(mgr, "frozen1") == 0);
+
+    // Checks still find the keys, changes are refused
+    res = filtmgr_check_keys(mgr, "frozen1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    char *new_keys[] = {"new"};
+    fail_unless(filtmgr_set_keys(mgr, "frozen1", (char**)&new_keys, 1, (char*)&result) == -5);
+    fail_unless(filtmgr_reset_filter(mgr, "frozen1") == -5);
+    char *srcs[] = {"frozen2"};
+    fail_unless(filtmgr_combine_filters(mgr, "frozen1", (char**)&srcs, 1, 0) == -5);
+
+    // A frozen filter can be read into another, and stays mapped
+    srcs[0] = "frozen1";
+    fail_unless(filtmgr_combine_filters(mgr, "frozen2", (char**)&srcs, 1, 0) == 0);
+    res = filtmgr_check_keys(mgr, "frozen2", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    fail_unless(filtmgr_unmap_filter(mgr, "frozen1") == 0);
+    fail_unless(filtmgr_check_filters(mgr, (char**)&srcs, 1, "hey", 3, (char*)&result) == 0);
+    fail_unless(result[0] == 1);
+
+    res = filtmgr_drop_filter(mgr, "frozen1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "frozen2");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    bloom_filtmgr *mgr;
+    volatile int *stop;
+    int missed;
+} biased_checker;
+
+// The most checks of a checker, so the test is bounded
+// even if the checkers starve the sets of the CPU
+#define BIASED_CHECKS 20000
+
+static void* biased_check_thread(void *arg) {
+    biased_checker *c = arg;
+    char *keys[] = {"hey","there","person"};
+    char result[3];
+    for (int i=0; i < BIASED_CHECKS && !*c->stop; i++) {
+        if (filtmgr_check_keys(c->mgr, "biased1", (char**)&keys, 3, (char*)&result) ||
+                !result[0] || !result[1] || !result[2])
+            c->missed++;
+        if (i % 100 == 0) sched_yield();
+    }
+    return NULL;
+}
+
+START_TEST(test_mgr_biased_checks)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "biased1", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "biased1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    // Sets revoke the bias of the checks, which must
+    // still find the keys set before them
+    volatile int stop = 0;
+    biased_checker checkers[2];
+    pthread_t threads[2];
+    for (int i=0; i < 2; i++) {
+        checkers[i].mgr = mgr;
+        checkers[i].stop = &stop;
+        checkers[i].missed = 0;
+        pthread_create(threads + i, NULL, biased_check_thread, checkers + i);
+    }
+
+    char buf[32];
+    char *new_keys[] = {buf};
+    for (int i=0; i < 200; i++) {
+        snprintf(buf, sizeof(buf), "key%d", i);
+        res = filtmgr_set_keys(mgr, "biased1", (char**)&new_keys, 1, (char*)&result);
+        fail_unless(res == 0);
+        if (i % 20 == 0) usleep(1000);
+    }
+    stop = 1;
+    for (int i=0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        fail_unless(checkers[i].missed == 0);
+    }
+
+    res = filtmgr_check_keys(mgr, "biased1", (char**)&new_keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+
+    res = filtmgr_drop_filter(mgr, "biased1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_load_key_file)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "load1", NULL);
+    fail_unless(res == 0);
+
+    // Lines span several segments, with empty lines
+    // and carriage returns mixed in
+    char path[] = "/tmp/bloomd_load_XXXXXX";
+    int fd = mkstemp(path);
+    fail_unless(fd >= 0);
+    FILE *f = fdopen(fd, "w");
+    for (int i=0; i < 600000; i++) {
+        fprintf(f, (i % 7) ? "key%d\n" : "key%d\r\n\n", i);
+    }
+    fprintf(f, "last");
+    fclose(f);
+
+    bloom_bulk_pool *pool;
+    res = init_bulk_pool(mgr, 2, &pool);
+    fail_unless(res == 0);
+    res = load_key_file(mgr, pool, "load1", path, 4);
+    fail_unless(res == 0);
+
+    char *keys[] = {"key0", "key299999", "key599999", "last", "key7\r", "key600000"};
+    char result[] = {0, 0, 0, 0, 0, 0};
+    res = filtmgr_check_keys(mgr, "load1", (char**)&keys, 6, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 1 && result[3] == 1);
+    fail_unless(result[4] == 0 && result[5] == 0);
+
+    // Missing filters and files fail
+    res = load_key_file(mgr, NULL, "load2", path, 1);
+    fail_unless(res == -1);
+    res = load_key_file(mgr, NULL, "load1", "/tmp/bloomd_load_none", 1);
+    fail_unless(res == -6);
+
+    // Loading again on a single lane is harmless
+    res = load_key_file(mgr, NULL, "load1", path, 1);
+    fail_unless(res == 0);
+    unlink(path);
+
+    res = destroy_bulk_pool(pool);
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "load1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_restore_filter)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "restore1", NULL);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        char *key = (char*)&buf;
+        char result;
+        filtmgr_set_keys(mgr, "restore1", &key, 1, &result);
+    }
+
+    // A full delta is a dump
+    uint64_t epoch;
+    char *path;
+    res = filtmgr_export_delta(mgr, "restore1", 0, &epoch, &path);
+    fail_unless(res == 0);
+    res = filtmgr_restore_filter(mgr, "restore2", path);
+    fail_unless(res == 0);
+
+    char *keys[] = {"key0", "key999", "key1000"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_check_keys(mgr, "restore2", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+
+    // Existing filters are not replaced
+    res = filtmgr_restore_filter(mgr, "restore1", path);
+    fail_unless(res == -1);
+    unlink(path);
+    free(path);
+
+    // Corrupt dumps leave no filter
+    char bad[] = "/tmp/bloomd_restore_XXXXXX";
+    int fd = mkstemp(bad);
+    fail_unless(fd >= 0);
+    fail_unless(write(fd, "not a delta at all, too short", 29) == 29);
+    close(fd);
+    res = filtmgr_restore_filter(mgr, "restore3", bad);
+    fail_unless(res == -4);
+    fail_unless(filtmgr_drop_filter(mgr, "restore3") == -1);
+    unlink(bad);
+
+    res = filtmgr_drop_filter(mgr, "restore1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "restore2");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_size_like)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 20000;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "lineage1", NULL);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0; i < 40000; i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        char *key = (char*)&buf;
+        char result;
+        filtmgr_set_keys(mgr, "lineage1", &key, 1, &result);
+    }
+
+    // The next filter of the lineage holds its keys in one layer
+    bloom_config *like = malloc(sizeof(bloom_config));
+    memcpy(like, &config, sizeof(bloom_config));
+    char options[] = "prob=0.001 like=lineage1";
+    char *like_name = NULL;
+    fail_unless(apply_filter_options(like, options, &like_name) == 0);
+    fail_unless(strcmp(like_name, "lineage1") == 0);
+    fail_unless(filtmgr_size_like(mgr, like_name, like) == 0);
+    fail_unless(like->initial_capacity >= 40000);
+    res = filtmgr_create_filter(mgr, "lineage2", like);
+    fail_unless(res == 0);
+    for (int i=0; i < 40000; i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        char *key = (char*)&buf;
+        char result;
+        filtmgr_set_keys(mgr, "lineage2", &key, 1, &result);
+    }
+    uint64_t hits[4];
+    fail_unless(filtmgr_layer_hits(mgr, "lineage2", (uint64_t*)&hits, 4) == 1);
+
+    // The capacity is never lowered, and the filter must exist
+    bloom_config big;
+    memcpy(&big, &config, sizeof(bloom_config));
+    big.initial_capacity = 1000000;
+    fail_unless(filtmgr_size_like(mgr, "lineage1", &big) == 0);
+    fail_unless(big.initial_capacity == 1000000);
+    fail_unless(filtmgr_size_like(mgr, "lineage0", &big) == -1);
+
+    res = filtmgr_drop_filter(mgr, "lineage1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "lineage2");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_hashed_filter)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "plain1", NULL);
+    fail_unless(res == 0);
+
+    bloom_config *hashed = malloc(sizeof(bloom_config));
+    memcpy(hashed, &config, sizeof(bloom_config));
+    char options[] = "hashed=1";
+    fail_unless(apply_filter_options(hashed, options, NULL) == 0);
+    fail_unless(hashed->hashed == 1);
+    res = filtmgr_create_filter(mgr, "hashed1", hashed);
+    fail_unless(res == 0);
+
+    fail_unless(filtmgr_filter_hashed(mgr, NULL, "hashed1") == 1);
+    fail_unless(filtmgr_filter_hashed(mgr, NULL, "plain1") == 0);
+    fail_unless(filtmgr_filter_hashed(mgr, NULL, "hashed0") == -1);
+
+    char *keys[] = {"0123456789abcdef0123456789ABCDEF", "fedcba9876543210fedcba9876543210"};
+    uint64_t lens[] = {32, 32};
+    char result[2];
+    res = filtmgr_set_keys_len(mgr, NULL, "hashed1", keys, lens, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+    res = filtmgr_check_keys_len(mgr, NULL, "hashed1", keys, lens, 2, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+    fail_unless(result[1] == 0);
+
+    // Keys that are not hashes are rejected
+    char *bad[] = {"foo", "0123456789abcdef0123456789abcdeg"};
+    uint64_t bad_lens[] = {3, 32};
+    res = filtmgr_check_keys_len(mgr, NULL, "hashed1", bad, bad_lens, 1, (char*)&result);
+    fail_unless(res == -6);
+    res = filtmgr_set_keys_len(mgr, NULL, "hashed1", bad + 1, bad_lens + 1, 1, (char*)&result);
+    fail_unless(res == -6);
+
+    res = filtmgr_drop_filter(mgr, "plain1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "hashed1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_batch_create_drop)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "batch.old", NULL);
+    fail_unless(res == 0);
+
+    // The batch is a single version, a repeated name exists
+    char buf[100];
+    char *names[101];
+    int results[101];
+    for (int i=0; i < 100; i++) {
+        snprintf((char*)&buf, 100, "batch.%d", i);
+        names[i] = strdup(buf);
+    }
+    names[100] = "batch.7";
+    filtmgr_client_checkpoint(mgr);
+    fail_unless(filtmgr_create_filters(mgr, names, 101, NULL, (int*)&results) == 100);
+    fail_unless(filtmgr_version_backlog(mgr) == 1);
+    for (int i=0; i < 100; i++) fail_unless(results[i] == 0);
+    fail_unless(results[100] == -1);
+
+    bloom_filter_list_head *head;
+    res = filtmgr_list_filters(mgr, "batch.", &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 101);
+    filtmgr_cleanup_list(head);
+
+    char *keys[] = {"hey"};
+    char result[1];
+    fail_unless(filtmgr_set_keys(mgr, "batch.42", keys, 1, (char*)&result) == 0);
+
+    // Drop a part of the batch, and a missing filter
+    char *drops[] = {names[0], names[1], "batch.none"};
+    filtmgr_client_checkpoint(mgr);
+    fail_unless(filtmgr_drop_filters(mgr, drops, 3, (int*)&results) == 2);
+    fail_unless(filtmgr_version_backlog(mgr) == 1);
+    fail_unless(results[0] == 0 && results[1] == 0 && results[2] == -1);
+    fail_unless(filtmgr_check_keys(mgr, "batch.0", keys, 1, (char*)&result) == -1);
+
+    // The dropped filters are pending deletes until vacuumed
+    fail_unless(filtmgr_create_filters(mgr, names, 2, NULL, (int*)&results) == 0);
+    fail_unless(results[0] == -3 && results[1] == -3);
+    filtmgr_client_leave(mgr);
+    filtmgr_vacuum(mgr);
+
+    // Drop the rest by prefix
+    fail_unless(filtmgr_drop_prefix(mgr, "batch.") == 99);
+    fail_unless(filtmgr_drop_prefix(mgr, "batch.") == 0);
+    res = filtmgr_list_filters(mgr, "batch.", &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    for (int i=0; i < 100; i++) free(names[i]);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void* checkpoint_thread(void *in) {
+    bloom_filtmgr *mgr = in;
+    filtmgr_client_checkpoint(mgr);
+    return NULL;
+}
+
+START_TEST(test_mgr_client_slots)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr, *other;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = init_filter_manager(&config, 0, &other);
+    fail_unless(res == 0);
+
+    // Alternating managers keeps one slot in each
+    filtmgr_client_checkpoint(mgr);
+    fail_unless(filtmgr_create_filter(mgr, "slots1", NULL) == 0);
+    fail_unless(filtmgr_version_backlog(mgr) == 1);
+    filtmgr_client_checkpoint(other);
+    filtmgr_client_checkpoint(mgr);
+    fail_unless(filtmgr_version_backlog(mgr) == 0);
+    filtmgr_client_leave(other);
+
+    // More clients than a block of slots, which never leave
+    pthread_t threads[100];
+    for (int i=0; i < 100; i++)
+        pthread_create(threads + i, NULL, checkpoint_thread, mgr);
+    for (int i=0; i < 100; i++)
+        pthread_join(threads[i], NULL);
+    fail_unless(filtmgr_create_filter(mgr, "slots2", NULL) == 0);
+    filtmgr_client_checkpoint(mgr);
+    fail_unless(filtmgr_version_backlog(mgr) == 1);
+
+    // A left client does not hold back the vacuum
+    filtmgr_client_leave(mgr);
+    fail_unless(filtmgr_version_backlog(mgr) == 1);
+    filtmgr_client_checkpoint(mgr);
+    filtmgr_client_leave(mgr);
+
+    res = destroy_filter_manager(other);
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    bloom_spinlock *lock;
+    long *count;
+} spin_args;
+
+static void* spin_thread(void *in) {
+    spin_args *args = in;
+    for (int i=0; i < 100000; i++) {
+        LOCK_BLOOM_SPIN(args->lock);
+        (*args->count)++;
+        UNLOCK_BLOOM_SPIN(args->lock);
+    }
+    return NULL;
+}
+
+START_TEST(test_mgr_spinlock)
+{
+    bloom_spinlock lock;
+    INIT_BLOOM_SPIN(&lock);
+    long count = 0;
+
+    // The increments are not lost, however the lock is taken
+    spin_args args = {&lock, &count};
+    pthread_t threads[4];
+    for (int i=0; i < 4; i++)
+        pthread_create(threads + i, NULL, spin_thread, &args);
+    for (int i=0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    fail_unless(count == 400000);
+    fail_unless(lock.state == 0);
+}
+END_TEST
+
+// Checks if a filter is listed
+static int list_has(bloom_filter_list_head *head, char *name) {
+    for (bloom_filter_list *node=head->head; node; node=node->next) {
+        if (!strcmp(node->filter_name, name)) return 1;
+    }
+    return 0;
+}
+
+START_TEST(test_mgr_slice)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    bloom_filter_list_head *head;
+    fail_unless(filtmgr_scheck_filters(mgr, "slice-", "key0", 4, &head) == -1);
+    fail_unless(filtmgr_unslice_filters(mgr, "slice-") == -1);
+
+    // Frozen filters are sliced, the others are checked directly
+    char name[32], key[32];
+    char *keys[] = {key};
+    char result[1];
+    for (int i=0; i < 7; i++) {
+        snprintf(name, sizeof(name), (i < 6) ? "slice-%d" : "slicer", i);
+        fail_unless(filtmgr_create_filter(mgr, name, NULL) == 0);
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(filtmgr_set_keys(mgr, name, (char**)&keys, 1, (char*)&result) == 0);
+        if (i < 5) fail_unless(filtmgr_freeze_filter(mgr, name) == 0);
+    }
+    fail_unless(filtmgr_slice_filters(mgr, "slice-") == 0);
+
+    // The key need not be terminated
+    fail_unless(filtmgr_scheck_filters(mgr, "slice-", "key2xyz", 4, &head) == 0);
+    fail_unless(list_has(head, "slice-2"));
+    fail_unless(!list_has(head, "slice-1"));
+    filtmgr_cleanup_list(head);
+    fail_unless(filtmgr_scheck_filters(mgr, "slice-", "key5", 4, &head) == 0);
+    fail_unless(list_has(head, "slice-5"));
+    filtmgr_cleanup_list(head);
+    fail_unless(filtmgr_scheck_filters(mgr, "slice-", "key6", 4, &head) == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    // Changes under the prefix are seen by the next check
+    fail_unless(filtmgr_drop_filter(mgr, "slice-2") == 0);
+    fail_unless(filtmgr_freeze_filter(mgr, "slice-5") == 0);
+    fail_unless(filtmgr_create_filter(mgr, "slice-7", NULL) == 0);
+    snprintf(key, sizeof(key), "key2");
+    fail_unless(filtmgr_set_keys(mgr, "slice-7", (char**)&keys, 1, (char*)&result) == 0);
+    fail_unless(filtmgr_scheck_filters(mgr, "slice-", "key2", 4, &head) == 0);
+    fail_unless(!list_has(head, "slice-2"));
+    fail_unless(list_has(head, "slice-7"));
+    filtmgr_cleanup_list(head);
+    fail_unless(filtmgr_scheck_filters(mgr, "slice-", "key5", 4, &head) == 0);
+    fail_unless(list_has(head, "slice-5"));
+    filtmgr_cleanup_list(head);
+
+    fail_unless(filtmgr_unslice_filters(mgr, "slice-") == 0);
+    fail_unless(filtmgr_scheck_filters(mgr, "slice-", "key0", 4, &head) == -1);
+
+    char *names[] = {"slice-0", "slice-1", "slice-3", "slice-4", "slice-5", "slice-7", "slicer"};
+    for (int i=0; i < 7; i++) fail_unless(filtmgr_drop_filter(mgr, names[i]) == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
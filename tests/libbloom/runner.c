@@ -55,6 +55,22 @@ int main(void)
     tcase_add_test(tc1, close_does_flush);
     tcase_add_test(tc1, flush_does_write_persist);
     tcase_add_test(tc1, close_does_flush_persist);
+    tcase_add_test(tc1, flush_clears_dirty_persist);
+    tcase_add_test(tc1, flush_stamps_epochs_persist);
+    tcase_add_test(tc1, flush_coalesces_runs_persist);
+    tcase_add_test(tc1, flush_async_persist);
+    tcase_add_test(tc1, flush_async_rate);
+    tcase_add_test(tc1, flush_async_group_commit);
+    tcase_add_test(tc1, fill_parallel_persist);
+    tcase_add_test(tc1, lazy_page_in_persist);
+    tcase_add_test(tc1, direct_io_persist);
+    tcase_add_test(tc1, dax_shared);
+    tcase_add_test(tc1, stage_persist);
+    tcase_add_test(tc1, zero_bitmap_persist);
+    tcase_add_test(tc1, file_range_persist);
+    tcase_add_test(tc1, memfd_handoff_persist);
+    tcase_add_test(tc1, make_huge_page_bitmaps);
+    tcase_add_test(tc1, setbit_word_order);
 
     // Add the bloom tests
     suite_add_tcase(s1, tc2);
@@ -64,20 +80,31 @@ int main(void)
     tcase_add_test(tc2, bloom_filter_header_size);
     tcase_add_test(tc2, make_bf_fresh_then_restore);
     tcase_add_test(tc2, test_bf_value_sanity);
+    tcase_add_test(tc2, make_bf_blocked_too_small);
+    tcase_add_test(tc2, make_bf_blocked_then_restore);
 
     tcase_add_test(tc2, test_size_for_capacity_prob);
     tcase_add_test(tc2, test_fp_prob_for_capacity_size);
     tcase_add_test(tc2, test_capacity_for_size_prob);
     tcase_add_test(tc2, test_ideal_k_num);
     tcase_add_test(tc2, test_params_for_capacity);
+    tcase_add_test(tc2, test_blocked_fp_probability);
+    tcase_add_test(tc2, test_params_for_capacity_blocked);
+    tcase_add_test(tc2, test_params_for_capacity_optimize);
+    tcase_add_test(tc2, test_params_for_capacity_pow2);
 
     tcase_add_test(tc2, test_hashes_basic);
     tcase_add_test(tc2, test_hashes_one_byte);
     tcase_add_test(tc2, test_hashes_consistent);
     tcase_add_test(tc2, test_hashes_key_length);
     tcase_add_test(tc2, test_hashes_same_buffer);
+    tcase_add_test(tc2, test_hashes_wyhash);
+    tcase_add_test(tc2, test_hashes_client);
+    tcase_add_test(tc2, test_hashes_extend);
+    tcase_add_test(tc2, make_bf_bad_hash_family);
 
     tcase_add_test(tc2, test_add_with_check);
+    tcase_add_test(tc2, test_add_hashed);
     tcase_add_test(tc2, test_length);
 
     tcase_add_test(tc2, test_bf_double_close);
@@ -90,6 +117,32 @@ int main(void)
 
     tcase_add_test(tc2, test_bf_shared_compatible_persist);
 
+    tcase_add_test(tc2, test_bf_blocked_add_with_check);
+    tcase_add_test(tc2, test_bf_blocked_fp_prob);
+    tcase_add_test(tc2, test_bf_blocked_persist_restore);
+    tcase_add_test(tc2, test_bf_wyhash_restore);
+    tcase_add_test(tc2, test_bf_wyhash_fp_prob);
+    tcase_add_test(tc2, test_bf_index_modes);
+    tcase_add_test(tc2, test_block_kernel);
+    tcase_add_test(tc2, test_bf_blocked_bit_order);
+    tcase_add_test(tc2, test_bf_word_bit_order);
+    tcase_add_test(tc2, test_bf_word_bit_order_bits);
+    tcase_add_test(tc2, make_bf_bad_bit_order);
+    tcase_add_test(tc2, test_bf_counting_add_remove);
+    tcase_add_test(tc2, test_bf_counting_saturates);
+    tcase_add_test(tc2, test_bf_counting_false_positive);
+    tcase_add_test(tc2, test_bf_cuckoo_add_remove);
+    tcase_add_test(tc2, test_bf_cuckoo_full);
+    tcase_add_test(tc2, test_bf_merge);
+    tcase_add_test(tc2, test_bf_intersect);
+    tcase_add_test(tc2, test_bf_fold);
+    tcase_add_test(tc2, test_bf_estimate_size);
+    tcase_add_test(tc2, test_bf_keys_len);
+    tcase_add_test(tc2, test_bf_add_batch_matches);
+    tcase_add_test(tc2, test_bf_kernels_match);
+    tcase_add_test(tc2, test_bf_slice_matches);
+    tcase_add_test(tc2, test_bf_slice_limits);
+
     // Add the sbf tests
     suite_add_tcase(s1, tc3);
     tcase_add_test(tc3, sbf_initial_size);
@@ -99,8 +152,25 @@ int main(void)
     tcase_add_test(tc3, test_sbf_double_close);
     tcase_add_test(tc3, test_sbf_flush_close);
     tcase_add_test(tc3, test_sbf_flush);
+    tcase_add_test(tc3, test_sbf_flush_async);
     tcase_add_test(tc3, test_sbf_close_does_flush);
     tcase_add_test(tc3, sbf_fp_prob);
+    tcase_add_test(tc3, sbf_blocked_layout);
+    tcase_add_test(tc3, sbf_hash_family_inherited);
+    tcase_add_test(tc3, sbf_add_hashed_layers);
+    tcase_add_test(tc3, sbf_contains_batch_matches);
+    tcase_add_test(tc3, sbf_add_concurrent_full);
+    tcase_add_test(tc3, sbf_counting_remove);
+    tcase_add_test(tc3, sbf_cuckoo_grow);
+    tcase_add_test(tc3, sbf_compact_sparse_layers);
+    tcase_add_test(tc3, sbf_fold_sparse_layers);
+    tcase_add_test(tc3, sbf_prepare_filter_swap);
+    tcase_add_test(tc3, sbf_rotate_generations);
+    tcase_add_test(tc3, sbf_rotate_refresh);
+    tcase_add_test(tc3, sbf_reset_layers);
+    tcase_add_test(tc3, sbf_reorder_by_hits);
+    tcase_add_test(tc3, sbf_add_batch_sorted);
+    tcase_add_test(tc3, sbf_layer_summary);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
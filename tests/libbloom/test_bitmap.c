@@ -2,11 +2,14 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <errno.h>
 #include "bitmap.h"
+#include "flusher.h"
 
 /*
 bloom_bitmap *bitmap_from_file(int fileno, size_t len) {
@@ -428,3 +431,595 @@ START_TEST(close_does_flush_persist) {
 }
 END_TEST
 
+
+START_TEST(setbit_word_order)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+
+    bitmap_setbit_word(&map, 0);
+    bitmap_setbit_word(&map, 65);
+    fail_unless(bitmap_getword(&map, 0) == 1);
+    fail_unless(bitmap_getword(&map, 1) == 2);
+    fail_unless(bitmap_getbit_word(&map, 0) == 1);
+    fail_unless(bitmap_getbit_word(&map, 1) == 0);
+    fail_unless(bitmap_getbit_word(&map, 65) == 1);
+
+    fail_unless(bitmap_test_and_set_word(&map, 127) == 1);
+    fail_unless(bitmap_test_and_set_word(&map, 127) == 0);
+    fail_unless(bitmap_getword(&map, 1) == (2 | (1ULL << 63)));
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(flush_clears_dirty_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_dirty_clear", 8*4096, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+
+    // Pages are tracked as bits in words
+    bitmap_setbit((&map), 3*4096*8);
+    fail_unless(map.dirty_pages[0] == (1 << 3));
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(map.dirty_pages[0] == 0);
+
+    // Marks after a flush are kept for the next one
+    bitmap_setbit((&map), 5*4096*8 + 7);
+    fail_unless(map.dirty_pages[0] == (1 << 5));
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(map.dirty_pages[0] == 0);
+    bitmap_close(&map);
+
+    res = bitmap_from_filename("/tmp/persist_dirty_clear", 8*4096, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_getbit((&map), 3*4096*8) == 1);
+    fail_unless(bitmap_getbit((&map), 5*4096*8 + 7) == 1);
+    fail_unless(bitmap_getbit((&map), 5*4096*8 + 6) == 0);
+    bitmap_close(&map);
+    unlink("/tmp/persist_dirty_clear");
+}
+END_TEST
+
+START_TEST(flush_stamps_epochs_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_epochs", 8*4096, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    fail_unless(bitmap_page_epoch(&map, 3) == UINT64_MAX);
+
+    // All the pages start in the current epoch
+    uint64_t epoch = 5;
+    fail_unless(bitmap_track_epochs(&map, &epoch) == 0);
+    fail_unless(bitmap_page_epoch(&map, 3) == 5);
+
+    // Pages are stamped as a flush claims them, not as they change
+    bitmap_setbit((&map), 3*4096*8);
+    epoch = 9;
+    fail_unless(bitmap_page_epoch(&map, 3) == 5);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_page_epoch(&map, 3) == 9);
+    fail_unless(bitmap_page_epoch(&map, 2) == 5);
+    bitmap_close(&map);
+    unlink("/tmp/persist_epochs");
+
+    // Only PERSISTENT bitmaps know their changed pages
+    res = bitmap_from_file(-1, 8*4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_track_epochs(&map, &epoch) == -EINVAL);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(flush_coalesces_runs_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_flush_runs", 8*4096 + 100, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    map.max_flush_pages = 2;
+
+    // An adjacent run longer than the limit, a gap, and the partial last page
+    bitmap_setbit((&map), 1*4096*8);
+    bitmap_setbit((&map), 2*4096*8 + 1);
+    bitmap_setbit((&map), 3*4096*8 + 2);
+    bitmap_setbit((&map), 5*4096*8 + 3);
+    bitmap_setbit((&map), 8*4096*8 + 4);
+
+    // Not marked dirty, so it should not be written
+    map.mmap[0] = 0xff;
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(map.dirty_pages[0] == 0);
+    bitmap_close(&map);
+
+    res = bitmap_from_filename("/tmp/persist_flush_runs", 8*4096 + 100, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(map.mmap[0] == 0);
+    fail_unless(bitmap_getbit((&map), 1*4096*8) == 1);
+    fail_unless(bitmap_getbit((&map), 2*4096*8 + 1) == 1);
+    fail_unless(bitmap_getbit((&map), 3*4096*8 + 2) == 1);
+    fail_unless(bitmap_getbit((&map), 5*4096*8 + 3) == 1);
+    fail_unless(bitmap_getbit((&map), 8*4096*8 + 4) == 1);
+    bitmap_close(&map);
+    unlink("/tmp/persist_flush_runs");
+}
+END_TEST
+
+static void flush_async_cb(void *data, int res) {
+    int *out = data;
+    *out = res;
+}
+
+START_TEST(flush_async_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_flush_async", 16*4096, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+
+    // Small runs and cap, so that the writes are queued in pieces
+    map.max_flush_pages = 2;
+    bloom_flusher *flusher;
+    fail_unless(flusher_create(4096, &flusher) == 0);
+
+    for (int idx = 0; idx < 16*4096*8; idx += 4096*4) {
+        bitmap_setbit((&map), idx);
+    }
+
+    int done = 1;
+    fail_unless(bitmap_flush_async(flusher, &map, flush_async_cb, &done) == 0);
+    fail_unless(flusher_drain(flusher) == 0);
+    fail_unless(done == 0);
+    fail_unless(map.dirty_pages[0] == 0);
+    fail_unless(flusher_destroy(flusher) == 0);
+    bitmap_close(&map);
+
+    res = bitmap_from_filename("/tmp/persist_flush_async", 16*4096, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    for (int idx = 0; idx < 16*4096*8; idx++) {
+        fail_unless(bitmap_getbit((&map), idx) == ((idx % (4096*4)) == 0));
+    }
+    bitmap_close(&map);
+    unlink("/tmp/persist_flush_async");
+}
+END_TEST
+
+START_TEST(flush_async_group_commit) {
+    bloom_bitmap maps[2];
+    char *names[] = {"/tmp/persist_group_commit0", "/tmp/persist_group_commit1"};
+    for (int i=0; i < 2; i++) {
+        int res = bitmap_from_filename(names[i], 16*4096, 1, PERSISTENT, maps + i);
+        fail_unless(res == 0);
+        fchmod(maps[i].fileno, 0777);
+    }
+
+    bloom_flusher *flusher;
+    fail_unless(flusher_create(0, &flusher) == 0);
+    flusher_set_group_commit(flusher, 1);
+
+    // The flushes only finish once they are committed
+    int done[2] = {1, 1};
+    for (int i=0; i < 2; i++) {
+        bitmap_setbit((maps + i), 4096*8*i + 1);
+        fail_unless(bitmap_flush_async(flusher, maps + i, flush_async_cb, done + i) == 0);
+        fail_unless(done[i] == 1);
+    }
+    fail_unless(flusher_drain(flusher) == 0);
+    fail_unless(done[0] == 0 && done[1] == 0);
+    fail_unless(flusher_commit(flusher) == 0);
+    fail_unless(flusher_destroy(flusher) == 0);
+
+    for (int i=0; i < 2; i++) {
+        bitmap_close(maps + i);
+        fail_unless(bitmap_from_filename(names[i], 16*4096, 0, PERSISTENT, maps + i) == 0);
+        fail_unless(bitmap_getbit((maps + i), 4096*8*i + 1) == 1);
+        bitmap_close(maps + i);
+        unlink(names[i]);
+    }
+}
+END_TEST
+
+START_TEST(flush_async_rate) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_flush_rate", 1024*4096, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+
+    // 8MB/s, with a 100 msec burst
+    bloom_flusher *flusher;
+    fail_unless(flusher_create(0, &flusher) == 0);
+    flusher_set_rate(flusher, 8*1024*1024);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    int done;
+    for (int i=0; i < 2; i++) {
+        // Dirty every page, 4MB
+        for (uint64_t idx = 0; idx < 1024*4096*8ULL; idx += 4096*8) {
+            bitmap_setbit((&map), idx + i);
+        }
+        fail_unless(bitmap_dirty_bytes(&map) == 1024*4096);
+
+        done = 1;
+        fail_unless(bitmap_flush_async(flusher, &map, flush_async_cb, &done) == 0);
+        fail_unless(flusher_drain(flusher) == 0);
+        fail_unless(done == 0);
+        fail_unless(bitmap_dirty_bytes(&map) == 0);
+    }
+    gettimeofday(&end, NULL);
+
+    // The writes past the burst waited for the budget. A synchronous
+    // flush is charged up front, so only the second one waits.
+    uint64_t usec = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+    fail_unless(usec >= 400000);
+    fail_unless(flusher_destroy(flusher) == 0);
+    bitmap_close(&map);
+    unlink("/tmp/persist_flush_rate");
+}
+END_TEST
+
+START_TEST(fill_parallel_persist) {
+    // Spans several fill chunks, with a partial last chunk
+    uint64_t len = 3 * BITMAP_FILL_CHUNK + 4096;
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_fill_parallel", len, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    for (uint64_t off = 0; off < len; off += 4096) {
+        map.mmap[off] = (off / 4096) & 0xff;
+        bitmap_remark_dirty(&map, off, 1);
+    }
+    fail_unless(bitmap_close(&map) == 0);
+
+    res = bitmap_from_filename("/tmp/persist_fill_parallel", len, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    for (uint64_t off = 0; off < len; off += 4096) {
+        fail_unless(map.mmap[off] == ((off / 4096) & 0xff));
+    }
+    bitmap_close(&map);
+    unlink("/tmp/persist_fill_parallel");
+}
+END_TEST
+
+START_TEST(lazy_page_in_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_lazy", 16*4096, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    bitmap_setbit((&map), 5*4096*8);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Existing contents are seen without being read in
+    res = bitmap_from_filename("/tmp/persist_lazy", 16*4096, 0,
+            PERSISTENT | LAZY, &map);
+    fail_unless(res == 0);
+    fail_unless(map.mode == PERSISTENT);
+    fail_unless(bitmap_getbit((&map), 5*4096*8) == 1);
+
+    // Writes stay private until the flush
+    unsigned char byte;
+    bitmap_setbit((&map), 9*4096*8);
+    fail_unless(pread(map.fileno, &byte, 1, 9*4096) == 1);
+    fail_unless(byte == 0);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(pread(map.fileno, &byte, 1, 9*4096) == 1);
+    fail_unless(byte == 128);
+    fail_unless(bitmap_close(&map) == 0);
+
+    res = bitmap_from_filename("/tmp/persist_lazy", 16*4096, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    for (int idx = 0; idx < 16*4096*8; idx++) {
+        fail_unless(bitmap_getbit((&map), idx) == (idx == 5*4096*8 || idx == 9*4096*8));
+    }
+    bitmap_close(&map);
+    unlink("/tmp/persist_lazy");
+}
+END_TEST
+
+START_TEST(direct_io_persist) {
+    // The last page is partial, and written through the page cache
+    bloom_bitmap map;
+    uint64_t len = 16*4096 + 100;
+    int res = bitmap_from_filename("/tmp/persist_direct", len, 1,
+            PERSISTENT | DIRECT_IO, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    fail_unless(map.direct_fd >= 0);
+    fail_unless((fcntl(map.fileno, F_GETFL) & O_DIRECT) == 0);
+    bitmap_setbit((&map), 5*4096*8);
+    bitmap_setbit((&map), 16*4096*8 + 7);
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(map.direct_fd == -1);
+
+    res = bitmap_from_filename("/tmp/persist_direct", len, 0,
+            PERSISTENT | DIRECT_IO, &map);
+    fail_unless(res == 0);
+    for (uint64_t idx = 0; idx < len*8; idx++) {
+        fail_unless(bitmap_getbit((&map), idx) == (idx == 5*4096*8 || idx == 16*4096*8 + 7));
+    }
+    bitmap_setbit((&map), 9*4096*8);
+    fail_unless(bitmap_close(&map) == 0);
+
+    res = bitmap_from_filename("/tmp/persist_direct", len, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(map.direct_fd == -1);
+    fail_unless(bitmap_getbit((&map), 9*4096*8) == 1);
+    fail_unless(bitmap_getbit((&map), 16*4096*8 + 7) == 1);
+    bitmap_close(&map);
+    unlink("/tmp/persist_direct");
+}
+END_TEST
+
+START_TEST(dax_shared) {
+    // Without a DAX file system, the map falls back to the page cache
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/shared_dax", 16*4096, 1,
+            SHARED | DAX, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    fail_unless(map.mode == SHARED);
+    fail_unless(map.dax || map.dirty_pages == NULL);
+    bitmap_setbit((&map), 5*4096*8);
+    bitmap_setbit((&map), 15*4096*8 + 1);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+
+    res = bitmap_from_filename("/tmp/shared_dax", 16*4096, 0,
+            SHARED, &map);
+    fail_unless(res == 0);
+    for (int idx = 0; idx < 16*4096*8; idx++) {
+        fail_unless(bitmap_getbit((&map), idx) == (idx == 5*4096*8 || idx == 15*4096*8 + 1));
+    }
+    bitmap_close(&map);
+    unlink("/tmp/shared_dax");
+}
+END_TEST
+
+static int file_bit(int fd, uint64_t idx) {
+    unsigned char byte = 0;
+    fail_unless(pread(fd, &byte, 1, idx >> 3) == 1);
+    return (byte >> (7 - (idx & 7))) & 1;
+}
+
+START_TEST(stage_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_stage", 16*4096, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+
+    // Changes after the cut are left for the next flush
+    bitmap_setbit((&map), 5*4096*8);
+    fail_unless(bitmap_stage(&map) == 0);
+    fail_unless(map.staged != NULL);
+    fail_unless(bitmap_dirty_bytes(&map) == 0);
+    bitmap_setbit((&map), 5*4096*8 + 1);
+    bitmap_setbit((&map), 9*4096*8);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(map.staged == NULL);
+    fail_unless(file_bit(map.fileno, 5*4096*8) == 1);
+    fail_unless(file_bit(map.fileno, 5*4096*8 + 1) == 0);
+    fail_unless(file_bit(map.fileno, 9*4096*8) == 0);
+    fail_unless(bitmap_dirty_bytes(&map) == 2*4096);
+
+    // The flusher writes a cut from the copies too
+    bloom_flusher *flusher;
+    fail_unless(flusher_create(0, &flusher) == 0);
+    fail_unless(bitmap_stage(&map) == 0);
+    bitmap_setbit((&map), 12*4096*8);
+    fail_unless(bitmap_flush_async(flusher, &map, NULL, NULL) == 0);
+    fail_unless(flusher_drain(flusher) == 0);
+    fail_unless(file_bit(map.fileno, 5*4096*8 + 1) == 1);
+    fail_unless(file_bit(map.fileno, 9*4096*8) == 1);
+    fail_unless(file_bit(map.fileno, 12*4096*8) == 0);
+    flusher_destroy(flusher);
+
+    // A cut that is not flushed is written on close
+    fail_unless(bitmap_stage(&map) == 0);
+    bitmap_setbit((&map), 13*4096*8);
+    fail_unless(bitmap_close(&map) == 0);
+    res = bitmap_from_filename("/tmp/persist_stage", 16*4096, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_getbit((&map), 12*4096*8) == 1);
+    fail_unless(bitmap_getbit((&map), 13*4096*8) == 1);
+    bitmap_close(&map);
+    unlink("/tmp/persist_stage");
+}
+END_TEST
+
+START_TEST(zero_bitmap_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_zero", 16*4096, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    memset(map.mmap, 0xFF, 16*4096);
+    bitmap_remark_dirty(&map, 0, 16*4096);
+    fail_unless(bitmap_flush(&map) == 0);
+
+    // Zero from the middle of page 1 to the middle of page 9
+    bitmap_remark_dirty(&map, 0, 16*4096);
+    fail_unless(bitmap_zero(&map, 4096 + 100, 8*4096) == 0);
+    fail_unless(bitmap_zero(&map, 16*4096, 1) == -EINVAL);
+    for (int idx = 0; idx < 16*4096; idx++) {
+        fail_unless(map.mmap[idx] == ((idx >= 4096 + 100 && idx < 9*4096 + 100) ? 0 : 0xFF));
+    }
+
+    // The partial pages are written, the whole ones already match
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+    res = bitmap_from_filename("/tmp/persist_zero", 16*4096, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    for (int idx = 0; idx < 16*4096; idx++) {
+        fail_unless(map.mmap[idx] == ((idx >= 4096 + 100 && idx < 9*4096 + 100) ? 0 : 0xFF));
+    }
+    bitmap_close(&map);
+    unlink("/tmp/persist_zero");
+
+    // Anonymous pages read back as zeros
+    fail_unless(bitmap_from_file(-1, 4*4096, ANONYMOUS, &map) == 0);
+    memset(map.mmap, 0xFF, 4*4096);
+    fail_unless(bitmap_zero(&map, 0, 4*4096) == 0);
+    for (int idx = 0; idx < 4*4096; idx++) {
+        fail_unless(map.mmap[idx] == 0);
+    }
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(make_huge_page_bitmaps)
+{
+    // Works with or without reserved huge pages
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 3*1024*1024 + 4096, ANONYMOUS | HUGE_PAGES, &map);
+    fail_unless(res == 0);
+    fail_unless(map.size == 3*1024*1024 + 4096);
+    fail_unless(map.mapped_len >= map.size);
+    bitmap_setbit((&map), map.size * 8 - 1);
+    fail_unless(bitmap_getbit((&map), map.size * 8 - 1) == 1);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Dirty tracking stays at 4K pages
+    res = bitmap_from_filename("/tmp/persist_huge_pages", 4*1024*1024, 1,
+            PERSISTENT | HUGE_PAGES, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    bitmap_setbit((&map), 3*4096*8);
+    fail_unless(map.dirty_pages[0] == (1 << 3));
+    fail_unless(bitmap_close(&map) == 0);
+
+    res = bitmap_from_filename("/tmp/persist_huge_pages", 4*1024*1024, 0,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_getbit((&map), 3*4096*8) == 1);
+    bitmap_close(&map);
+    unlink("/tmp/persist_huge_pages");
+}
+END_TEST
+
+typedef struct {
+    int fd;
+    uint64_t dev, ino, offset, len;
+} exported_memfd;
+
+static int export_memfd_cb(void *data, int memfd, uint64_t dev, uint64_t ino,
+        uint64_t offset, uint64_t len) {
+    exported_memfd *out = data;
+    out->fd = dup(memfd);
+    out->dev = dev;
+    out->ino = ino;
+    out->offset = offset;
+    out->len = len;
+    return 0;
+}
+
+START_TEST(memfd_handoff_persist) {
+    bitmap_use_memfd(1);
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_memfd", 4*4096, 1,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(map.memfd >= 0);
+    bitmap_setbit((&map), 0);
+    fail_unless(bitmap_flush(&map) == 0);
+
+    // Export a copy of the memfd, and close the bitmap
+    exported_memfd out;
+    memset(&out, 0, sizeof(out));
+    fail_unless(bitmap_export_memfds(export_memfd_cb, &out) == 0);
+    fail_unless(out.fd >= 0);
+    fail_unless(out.offset == 0);
+    fail_unless(out.len == 4*4096);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Change the memfd only, so we can tell it is mapped
+    unsigned char byte = 0xFF;
+    fail_unless(pwrite(out.fd, &byte, 1, 100) == 1);
+    fail_unless(bitmap_inherit_memfd(out.fd, out.dev, out.ino, out.offset, out.len) == 0);
+
+    // A different range does not adopt it
+    int fd = open("/tmp/persist_memfd", O_RDWR);
+    fail_unless(bitmap_from_file_range(fd, 4096, 3*4096, PERSISTENT, &map) == 0);
+    fail_unless(map.mmap[0] == 0);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // The same range maps the memfd, without reading the file
+    fail_unless(bitmap_from_file_range(fd, 0, 4*4096, PERSISTENT, &map) == 0);
+    fail_unless(bitmap_getbit((&map), 0) == 1);
+    fail_unless(map.mmap[100] == 0xFF);
+    fail_unless(bitmap_release_inherited() == 0);
+
+    // Dropped pages read back as zeros
+    memset(map.mmap, 0xFF, 4*4096);
+    fail_unless(bitmap_zero(&map, 0, 4*4096) == 0);
+    for (int idx = 0; idx < 4*4096; idx++) {
+        fail_unless(map.mmap[idx] == 0);
+    }
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Unmapped inherited memfds are released
+    fail_unless(bitmap_inherit_memfd(dup(fd), 1, 2, 0, 4096) == 0);
+    fail_unless(bitmap_release_inherited() == 1);
+    close(fd);
+    unlink("/tmp/persist_memfd");
+    bitmap_use_memfd(0);
+}
+END_TEST
+
+START_TEST(file_range_persist) {
+    int fd = open("/tmp/persist_range", O_RDWR|O_CREAT, 0777);
+    fail_unless(fd >= 0);
+    fail_unless(ftruncate(fd, 12*4096) == 0);
+
+    // Two bitmaps over a single borrowed file
+    bloom_bitmap first, second;
+    fail_unless(bitmap_from_file_range(fd, 100, 4096, PERSISTENT, &first) == -EINVAL);
+    int res = bitmap_from_file_range(fd, 4096, 4*4096,
+            PERSISTENT | BORROW_FILE | NEW_BITMAP, &first);
+    fail_unless(res == 0);
+    fail_unless(first.fileno == fd);
+    res = bitmap_from_file_range(fd, 8*4096, 4*4096,
+            PERSISTENT | BORROW_FILE | NEW_BITMAP, &second);
+    fail_unless(res == 0);
+
+    bitmap_setbit((&first), 0);
+    bitmap_setbit((&second), 4*4096*8 - 1);
+    fail_unless(bitmap_close(&first) == 0);
+    fail_unless(bitmap_close(&second) == 0);
+
+    // The writes land at the offsets, and the file stays open
+    unsigned char byte;
+    fail_unless(pread(fd, &byte, 1, 4096) == 1);
+    fail_unless(byte == 128);
+    fail_unless(pread(fd, &byte, 1, 12*4096 - 1) == 1);
+    fail_unless(byte == 1);
+
+    // Both a read in and a lazy map see the range
+    res = bitmap_from_file_range(fd, 8*4096, 4*4096, PERSISTENT, &second);
+    fail_unless(res == 0);
+    fail_unless(bitmap_getbit((&second), 4*4096*8 - 1) == 1);
+    fail_unless(bitmap_getbit((&second), 0) == 0);
+    fail_unless(bitmap_close(&second) == 0);
+    res = bitmap_from_file_range(fd, 4096, 4*4096, PERSISTENT | LAZY, &first);
+    fail_unless(res == 0);
+    fail_unless(bitmap_getbit((&first), 0) == 1);
+    fail_unless(bitmap_close(&first) == 0);
+
+    close(fd);
+    unlink("/tmp/persist_range");
+}
+END_TEST
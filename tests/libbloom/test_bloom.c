@@ -6,7 +6,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <string.h>
+#include <math.h>
 #include "bloom.h"
+#include "block.h"
 
 START_TEST(bloom_filter_header_size)
 {
@@ -62,6 +65,38 @@ START_TEST(make_bf_fresh_then_restore)
 }
 END_TEST
 
+START_TEST(make_bf_blocked_too_small)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bitmap_from_file(-1, 512 + 32, ANONYMOUS, &map);
+    bloom_filter_params params = {0, 10, 0, 0, LAYOUT_BLOCKED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    int res = bf_from_bitmap_params(&map, &params, 1, &filter);
+    fail_unless(res == -ENOMEM);
+}
+END_TEST
+
+START_TEST(make_bf_blocked_then_restore)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    bloom_filter_params params = {0, 10, 0, 0, LAYOUT_BLOCKED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    int res = bf_from_bitmap_params(&map, &params, 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter.layout == LAYOUT_BLOCKED);
+    fail_unless(filter.num_blocks == 56);
+
+    // Layout should be detected from the header
+    bloom_bloomfilter filter2;
+    res = bf_from_bitmap(&map, 1, 0, &filter2);
+    fail_unless(res == 0);
+    fail_unless(filter2.layout == LAYOUT_BLOCKED);
+    fail_unless(filter2.num_blocks == 56);
+    fail_unless(filter2.header->k_num == 10);
+}
+END_TEST
+
 START_TEST(test_bf_value_sanity)
 {
     // Use -1 for anonymous
@@ -125,7 +160,7 @@ END_TEST
 
 START_TEST(test_params_for_capacity)
 {
-    bloom_filter_params params;
+    bloom_filter_params params = {0, 0, 0, 0, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     params.capacity = 1e6;
     params.fp_probability = 1e-4;
     int res = bf_params_for_capacity(&params);
@@ -135,6 +170,71 @@ START_TEST(test_params_for_capacity)
 }
 END_TEST
 
+START_TEST(test_blocked_fp_probability)
+{
+    bloom_filter_params params = {2396265, 13, 1e6, 0, LAYOUT_BLOCKED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    int res = bf_blocked_fp_probability(&params);
+    fail_unless(res == 0);
+
+    // Blocked filters are worse than partitioned at the same size
+    fail_unless(params.fp_probability > 1e-4);
+    fail_unless(params.fp_probability < 1e-3);
+}
+END_TEST
+
+START_TEST(test_params_for_capacity_blocked)
+{
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_BLOCKED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    int res = bf_params_for_capacity(&params);
+    fail_unless(res == 0);
+    fail_unless(params.fp_probability == 1e-4);
+
+    // Should be larger than the partitioned layout, in whole blocks
+    fail_unless(params.bytes > 2396265 + 512);
+    fail_unless((params.bytes - 512) % BLOOM_BLOCK_BYTES == 0);
+
+    // Should meet the target probability
+    params.bytes -= 512;
+    fail_unless(bf_blocked_fp_probability(&params) == 0);
+    fail_unless(params.fp_probability <= 1e-4);
+}
+END_TEST
+
+START_TEST(test_params_for_capacity_optimize)
+{
+    bloom_filter_params memory = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bloom_filter_params balanced = memory, speed = memory;
+    balanced.optimize = OPTIMIZE_BALANCED;
+    speed.optimize = OPTIMIZE_SPEED;
+    fail_unless(bf_params_for_capacity(&memory) == 0);
+    fail_unless(bf_params_for_capacity(&balanced) == 0);
+    fail_unless(bf_params_for_capacity(&speed) == 0);
+    fail_unless(memory.k_num == 13);
+
+    // Fewer probes for more bits, within the growth of each profile
+    fail_unless(balanced.k_num == 7);
+    fail_unless(speed.k_num == 4);
+    fail_unless(balanced.bytes > memory.bytes);
+    fail_unless(balanced.bytes <= memory.bytes * BLOOM_BALANCED_GROWTH);
+    fail_unless(speed.bytes > balanced.bytes);
+    fail_unless(speed.bytes <= memory.bytes * BLOOM_SPEED_GROWTH);
+
+    // Should still meet the target probability
+    double bits = (speed.bytes - 512) * 8.0;
+    fail_unless(pow(1 - exp(-(speed.k_num * 1e6) / bits), speed.k_num) <= 1e-4);
+
+    // The blocked layout keeps the k of the profile as it grows
+    bloom_filter_params blocked = speed;
+    blocked.bytes = blocked.k_num = 0;
+    blocked.layout = LAYOUT_BLOCKED;
+    fail_unless(bf_params_for_capacity(&blocked) == 0);
+    fail_unless(blocked.k_num == 4);
+    blocked.bytes -= 512;
+    fail_unless(bf_blocked_fp_probability(&blocked) == 0);
+    fail_unless(blocked.fp_probability <= 1e-4);
+}
+END_TEST
+
 START_TEST(test_hashes_basic)
 {
     uint32_t k_num = 1000;
@@ -264,9 +364,186 @@ END_TEST
 
 
 
+START_TEST(test_hashes_wyhash)
+{
+    uint32_t k_num = 10;
+    uint64_t hashes[10];
+    uint64_t hashes2[10];
+    char *key = "the quick brown fox jumps over the lazy dog";
+    bf_compute_hashes_family(HASH_WYHASH, k_num, key, (uint64_t*)&hashes);
+
+    // Should be consistent
+    bf_compute_hashes_family(HASH_WYHASH, k_num, key, (uint64_t*)&hashes2);
+    fail_unless(memcmp(hashes, hashes2, sizeof(hashes)) == 0);
+
+    // Should differ from the original family
+    bf_compute_hashes(k_num, key, (uint64_t*)&hashes2);
+    fail_unless(memcmp(hashes, hashes2, sizeof(hashes)) != 0);
+
+    // Should be a linear combination
+    for (uint32_t i=2; i < k_num; i++) {
+        fail_unless(hashes[i] - hashes[i-1] == hashes[1] - hashes[0]);
+    }
+
+    // Should differ with key length, for all the length classes
+    char buf[100];
+    uint64_t last = 0;
+    for (int i=0; i < 80; i++) {
+        memset(buf, 'a', i);
+        buf[i] = 0;
+        bf_compute_hashes_family(HASH_WYHASH, k_num, (char*)&buf, (uint64_t*)&hashes);
+        fail_unless(hashes[0] != last);
+        last = hashes[0];
+    }
+}
+END_TEST
+
+START_TEST(test_hashes_client)
+{
+    uint32_t k_num = 10;
+    uint64_t hashes[10];
+    char *key = "0123456789abcdefFEDCBA9876543210";
+    fail_unless(bf_is_client_hash(key, 32));
+    fail_unless(!bf_is_client_hash(key, 31));
+    fail_unless(!bf_is_client_hash("0123456789abcdefFEDCBA987654321g", 32));
+
+    // The halves are used as the base hashes, with an odd step
+    bf_compute_hashes_family(HASH_CLIENT, k_num, key, (uint64_t*)&hashes);
+    fail_unless(hashes[0] == 0x0123456789abcdefULL);
+    fail_unless(hashes[1] - hashes[0] == 0xfedcba9876543211ULL);
+    for (uint32_t i=2; i < k_num; i++) {
+        fail_unless(hashes[i] - hashes[i-1] == hashes[1] - hashes[0]);
+    }
+
+    // Extending gives the hashes computed at once
+    uint64_t extended[10];
+    memcpy(extended, hashes, 4 * sizeof(uint64_t));
+    bf_extend_hashes(HASH_CLIENT, 4, k_num, (uint64_t*)&extended);
+    fail_unless(memcmp(hashes, extended, sizeof(hashes)) == 0);
+}
+END_TEST
+
+START_TEST(test_bf_wyhash_restore)
+{
+    bloom_filter_params params = {0, 0, 1e5, 1e-4, LAYOUT_PARTITIONED, HASH_WYHASH, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_filename("/tmp/wyhash_restore.mmap", params.bytes, 1, SHARED, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fchmod(map.fileno, 0777);
+
+    char buf[100];
+    int res;
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_add(&filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    fail_unless(bf_close(&filter) == 0);
+
+    // The family should be read from the header
+    fail_unless(bitmap_from_filename("/tmp/wyhash_restore.mmap", params.bytes, 1, SHARED, &map) == 0);
+    fail_unless(bf_from_bitmap(&map, 1, 0, &filter) == 0);
+    fail_unless(filter.header->hash_family == HASH_WYHASH);
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_contains(&filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    unlink("/tmp/wyhash_restore.mmap");
+}
+END_TEST
+
+START_TEST(make_bf_bad_hash_family)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    bloom_filter_params params = {0, 10, 0, 0, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    // Corrupt the family, should refuse to load
+    filter.header->hash_family = 200;
+    bloom_bloomfilter filter2;
+    fail_unless(bf_from_bitmap(&map, 1, 0, &filter2) == -1);
+}
+END_TEST
+
+START_TEST(test_bf_wyhash_fp_prob)
+{
+    bloom_filter_params params = {0, 0, 1e5, 0.001, LAYOUT_PARTITIONED, HASH_WYHASH, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    char buf[100];
+    int res;
+    int num_wrong = 0;
+    for (int i=0;i<1e5;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_add(&filter, (char*)&buf);
+        if (res == 0) num_wrong++;
+    }
+
+    // Technically we should have 100 false positives
+    fail_unless(num_wrong <= 100);
+}
+END_TEST
+
+START_TEST(test_hashes_extend)
+{
+    uint64_t hashes[20];
+    uint64_t extended[20];
+    char *key = "foobar";
+
+    // Legacy family
+    bf_compute_hashes(20, key, (uint64_t*)&hashes);
+    bf_compute_hashes(4, key, (uint64_t*)&extended);
+    bf_extend_hashes(HASH_MURMUR_SPOOKY, 4, 20, (uint64_t*)&extended);
+    fail_unless(memcmp(hashes, extended, sizeof(hashes)) == 0);
+
+    // Wyhash family
+    bf_compute_hashes_family(HASH_WYHASH, 20, key, (uint64_t*)&hashes);
+    bf_compute_hashes_family(HASH_WYHASH, 7, key, (uint64_t*)&extended);
+    bf_extend_hashes(HASH_WYHASH, 7, 20, (uint64_t*)&extended);
+    fail_unless(memcmp(hashes, extended, sizeof(hashes)) == 0);
+}
+END_TEST
+
+START_TEST(test_add_hashed)
+{
+    bloom_filter_params params = {0, 0, 1e4, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    bloom_bloomfilter filter;
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    uint64_t hashes[32];
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        bf_compute_hashes(params.k_num, (char*)&buf, (uint64_t*)&hashes);
+        fail_unless(bf_add_hashed(&filter, (uint64_t*)&hashes) == 1);
+        fail_unless(bf_contains_hashed(&filter, (uint64_t*)&hashes) == 1);
+        fail_unless(bf_add_hashed(&filter, (uint64_t*)&hashes) == 0);
+    }
+    fail_unless(bf_size(&filter) == 1000);
+
+    // Should agree with the un-hashed API
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+    }
+}
+END_TEST
+
 START_TEST(test_add_with_check)
 {
-    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
@@ -304,7 +581,7 @@ END_TEST
 
 START_TEST(test_length)
 {
-    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
@@ -331,7 +608,7 @@ END_TEST
 
 START_TEST(test_bf_double_close)
 {
-    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bloom_bloomfilter filter;
@@ -345,7 +622,7 @@ END_TEST
 
 START_TEST(test_flush_close)
 {
-    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bloom_bloomfilter filter;
@@ -361,7 +638,7 @@ END_TEST
 
 START_TEST(test_bf_flush)
 {
-    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bloom_bloomfilter filter;
@@ -397,7 +674,7 @@ END_TEST
 
 START_TEST(test_bf_close_does_flush)
 {
-    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bloom_bloomfilter filter;
@@ -429,7 +706,7 @@ END_TEST
 
 START_TEST(test_bf_fp_prob)
 {
-    bloom_filter_params params = {0, 0, 1000, 0.01};
+    bloom_filter_params params = {0, 0, 1000, 0.01, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bloom_bloomfilter filter;
@@ -454,7 +731,7 @@ END_TEST
 
 START_TEST(test_bf_fp_prob_extended)
 {
-    bloom_filter_params params = {0, 0, 1e6, 0.001};
+    bloom_filter_params params = {0, 0, 1e6, 0.001, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bloom_bloomfilter filter;
@@ -479,7 +756,7 @@ END_TEST
 
 START_TEST(test_bf_shared_compatible_persist)
 {
-    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&params);
     bloom_bitmap map;
     bloom_bloomfilter filter;
@@ -509,3 +786,980 @@ START_TEST(test_bf_shared_compatible_persist)
 }
 END_TEST
 
+
+START_TEST(test_bf_blocked_add_with_check)
+{
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_BLOCKED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    bloom_bloomfilter filter;
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    char buf[100];
+    int res;
+
+    // Check all the keys get added
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_add(&filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    fail_unless(bf_size(&filter) == 1000);
+
+    // Test all the keys are contained
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_contains(&filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+}
+END_TEST
+
+START_TEST(test_bf_blocked_fp_prob)
+{
+    bloom_filter_params params = {0, 0, 1e5, 0.001, LAYOUT_BLOCKED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    char buf[100];
+    int res;
+    int num_wrong = 0;
+    for (int i=0;i<1e5;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_add(&filter, (char*)&buf);
+        if (res == 0) num_wrong++;
+    }
+
+    // We added 100K items, with a capacity of 100K and error of 1/1000.
+    // Technically we should have 100 false positives
+    fail_unless(num_wrong <= 100);
+}
+END_TEST
+
+START_TEST(test_bf_blocked_persist_restore)
+{
+    bloom_filter_params params = {0, 0, 1e5, 1e-4, LAYOUT_BLOCKED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_filename("/tmp/blocked_persist.mmap", params.bytes, 1, PERSISTENT, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fchmod(map.fileno, 0777);
+
+    char buf[100];
+    int res;
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_add(&filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    fail_unless(bf_close(&filter) == 0);
+
+    // Reload without knowing the layout
+    fail_unless(bitmap_from_filename("/tmp/blocked_persist.mmap", params.bytes, 1, SHARED, &map) == 0);
+    fail_unless(bf_from_bitmap(&map, 1, 0, &filter) == 0);
+    fail_unless(filter.layout == LAYOUT_BLOCKED);
+    fail_unless(bf_size(&filter) == 1000);
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_contains(&filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    unlink("/tmp/blocked_persist.mmap");
+}
+END_TEST
+
+START_TEST(test_params_for_capacity_pow2)
+{
+    bloom_filter_params params = {0, 0, 1e6, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_POW2, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    int res = bf_params_for_capacity(&params);
+    fail_unless(res == 0);
+    fail_unless(params.k_num == 13);
+
+    // Each partition should be a power of two
+    uint64_t partition = (params.bytes - 512) * 8 / 13;
+    fail_unless((partition & (partition - 1)) == 0);
+    fail_unless(partition * 13 == (params.bytes - 512) * 8);
+    fail_unless(params.bytes >= 2396265 + 512);
+
+    // Blocked should have a power of two blocks
+    bloom_filter_params params2 = {0, 0, 1e6, 1e-4, LAYOUT_BLOCKED, HASH_MURMUR_SPOOKY, INDEX_POW2, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    res = bf_params_for_capacity(&params2);
+    fail_unless(res == 0);
+    uint64_t blocks = (params2.bytes - 512) / BLOOM_BLOCK_BYTES;
+    fail_unless((blocks & (blocks - 1)) == 0);
+}
+END_TEST
+
+START_TEST(test_bf_index_modes)
+{
+    bloom_index_mode modes[] = {INDEX_FASTRANGE, INDEX_POW2};
+    bloom_layout layouts[] = {LAYOUT_PARTITIONED, LAYOUT_BLOCKED};
+    for (int m=0; m < 2; m++) {
+        for (int l=0; l < 2; l++) {
+            bloom_filter_params params = {0, 0, 1e5, 1e-3, layouts[l], HASH_WYHASH, modes[m], BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+            fail_unless(bf_params_for_capacity(&params) == 0);
+            bloom_bitmap map;
+            bloom_bloomfilter filter;
+            fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+            fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+            fail_unless(filter.index_mode == modes[m]);
+
+            char buf[100];
+            int num_wrong = 0;
+            for (int i=0;i<1e5;i++) {
+                snprintf((char*)&buf, 100, "test%d", i);
+                if (bf_add(&filter, (char*)&buf) == 0) num_wrong++;
+            }
+
+            // Technically we should have ~100 false positives
+            fail_unless(num_wrong <= 100);
+
+            // Should restore with the same mode
+            bloom_bloomfilter filter2;
+            fail_unless(bf_from_bitmap(&map, 1, 0, &filter2) == 0);
+            fail_unless(filter2.index_mode == modes[m]);
+            for (int i=0;i<1e5;i++) {
+                snprintf((char*)&buf, 100, "test%d", i);
+                fail_unless(bf_contains(&filter2, (char*)&buf) == 1);
+            }
+            bitmap_close(&map);
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_block_kernel)
+{
+    unsigned char block[BLOOM_BLOCK_BYTES];
+    uint64_t mask[BLOOM_BLOCK_BYTES / sizeof(uint64_t)];
+    memset(block, 0, sizeof(block));
+    memset(mask, 0, sizeof(mask));
+    fail_unless(bf_block_kernel() != NULL);
+
+    // Empty mask is always contained
+    fail_unless(bf_block_contains(block, mask) == 1);
+
+    // Set a bit in each half
+    unsigned char *mask_bytes = (unsigned char*)mask;
+    mask_bytes[3] = 0x10;
+    mask_bytes[60] = 0x01;
+    fail_unless(bf_block_contains(block, mask) == 0);
+    bf_block_set(block, mask);
+    fail_unless(block[3] == 0x10);
+    fail_unless(block[60] == 0x01);
+    fail_unless(bf_block_contains(block, mask) == 1);
+
+    // A single missing bit in the upper half fails
+    mask_bytes[63] = 0x80;
+    fail_unless(bf_block_contains(block, mask) == 0);
+}
+END_TEST
+
+START_TEST(test_bf_blocked_bit_order)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    bloom_filter_params params = {0, 7, 0, 0, LAYOUT_BLOCKED, HASH_WYHASH, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fail_unless(bf_add(&filter, "foobar") == 1);
+
+    // The bits set by the kernel should match the bitmap bit order
+    uint64_t hashes[7];
+    bf_compute_hashes_family(HASH_WYHASH, 7, "foobar", (uint64_t*)&hashes);
+    uint64_t offset = 8*512 + (hashes[0] % filter.num_blocks) * BLOOM_BLOCK_BITS;
+    for (int i=0; i < 7; i++) {
+        fail_unless(bitmap_getbit(&map, offset + (hashes[i] >> 55)) == 1);
+    }
+}
+END_TEST
+
+START_TEST(test_bf_word_bit_order)
+{
+    bloom_layout layouts[] = {LAYOUT_PARTITIONED, LAYOUT_BLOCKED};
+    for (int l=0; l < 2; l++) {
+        bloom_filter_params params = {0, 0, 1e5, 1e-3, layouts[l], HASH_WYHASH, INDEX_FASTRANGE, BIT_ORDER_WORD, OPTIMIZE_MEMORY};
+        fail_unless(bf_params_for_capacity(&params) == 0);
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+        fail_unless(filter.bit_order == BIT_ORDER_WORD);
+
+        char buf[100];
+        int num_wrong = 0;
+        for (int i=0;i<1e5;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            if (bf_add(&filter, (char*)&buf) == 0) num_wrong++;
+        }
+
+        // Technically we should have ~100 false positives
+        fail_unless(num_wrong <= 100);
+
+        // Should restore with the same bit order
+        bloom_bloomfilter filter2;
+        fail_unless(bf_from_bitmap(&map, 1, 0, &filter2) == 0);
+        fail_unless(filter2.bit_order == BIT_ORDER_WORD);
+        for (int i=0;i<1e5;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            fail_unless(bf_contains(&filter2, (char*)&buf) == 1);
+        }
+        bitmap_close(&map);
+    }
+}
+END_TEST
+
+START_TEST(test_bf_word_bit_order_bits)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_params params = {0, 1, 0, 0, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_POW2, BIT_ORDER_WORD, OPTIMIZE_MEMORY};
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    // With k=1, the key sets a single bit in the word order
+    uint64_t hashes[4] = {3, 0, 0, 0};
+    fail_unless(bf_add_hashed(&filter, hashes) == 1);
+    uint64_t widx = sizeof(bloom_filter_header) / sizeof(uint64_t);
+    fail_unless(bitmap_getword(&map, widx) == 0x8);
+    fail_unless(bitmap_getbit_word(&map, 8*sizeof(bloom_filter_header) + 3) == 1);
+
+    // Atomic adds use the same bit
+    hashes[0] = 4;
+    fail_unless(bf_add_hashed_atomic(&filter, hashes) == 1);
+    fail_unless(bf_add_hashed_atomic(&filter, hashes) == 0);
+    fail_unless(bitmap_getword(&map, widx) == 0x18);
+    fail_unless(bf_size(&filter) == 2);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(make_bf_bad_bit_order)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    bloom_filter_params params = {0, 4, 0, 0, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, 7, OPTIMIZE_MEMORY};
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == -EINVAL);
+
+    // An unknown bit order on disk should fail to load
+    fail_unless(bf_from_bitmap(&map, 4, 1, &filter) == 0);
+    filter.header->bit_order = 7;
+    fail_unless(bf_from_bitmap(&map, 4, 0, &filter) == -1);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(test_bf_counting_add_remove)
+{
+    bloom_filter_params params = {0, 0, 1e4, 1e-3, LAYOUT_COUNTING, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+
+    // Counters take four times the space of bits
+    bloom_filter_params plain = {0, 0, 1e4, 1e-3, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&plain) == 0);
+    fail_unless(params.bytes - sizeof(bloom_filter_header) ==
+            (plain.bytes - sizeof(bloom_filter_header)) * BLOOM_COUNTER_BITS);
+
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fail_unless(filter.layout == LAYOUT_COUNTING);
+
+    char buf[100];
+    for (int i=0;i<1e4;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        bf_add(&filter, (char*)&buf);
+    }
+    uint64_t added = bf_size(&filter);
+    fail_unless(added > 9900);
+
+    // Remove the odd keys, the even keys must stay
+    int removed = 0;
+    for (int i=1;i<1e4;i+=2) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        removed += bf_remove(&filter, (char*)&buf);
+    }
+    fail_unless(bf_size(&filter) == added - removed);
+    for (int i=0;i<1e4;i+=2) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+    }
+
+    // Most of the removed keys are gone
+    int present = 0;
+    for (int i=1;i<1e4;i+=2) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        present += bf_contains(&filter, (char*)&buf);
+    }
+    fail_unless(present < 100);
+
+    // Restores as a counting filter
+    bloom_bloomfilter filter2;
+    fail_unless(bf_from_bitmap(&map, 1, 0, &filter2) == 0);
+    fail_unless(filter2.layout == LAYOUT_COUNTING);
+    fail_unless(filter2.offset == filter.offset);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(test_bf_counting_saturates)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_params params = {0, 1, 0, 0, LAYOUT_COUNTING, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bitmap_from_file(-1, sizeof(bloom_filter_header) + 1, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    // Two counters, each in its own nibble
+    fail_unless(filter.offset == 2);
+    uint64_t even[] = {0, 0, 0, 0};
+    uint64_t odd[] = {1, 1, 1, 1};
+    fail_unless(bf_add_hashed(&filter, even) == 1);
+    fail_unless(map.mmap[sizeof(bloom_filter_header)] == 1);
+    map.mmap[sizeof(bloom_filter_header)] = BLOOM_COUNTER_MAX;
+    fail_unless(bf_contains_hashed(&filter, odd) == 0);
+    fail_unless(bf_add_hashed(&filter, odd) == 1);
+    fail_unless(map.mmap[sizeof(bloom_filter_header)] == (1 << 4 | BLOOM_COUNTER_MAX));
+
+    // Saturated counters are never decremented
+    fail_unless(bf_remove_hashed(&filter, even) == 1);
+    fail_unless(bf_contains_hashed(&filter, even) == 1);
+    fail_unless(bf_remove_hashed(&filter, odd) == 1);
+    fail_unless(bf_remove_hashed(&filter, odd) == 0);
+    fail_unless(map.mmap[sizeof(bloom_filter_header)] == BLOOM_COUNTER_MAX);
+    bitmap_close(&map);
+
+    // Removal needs the counting layout
+    params.layout = LAYOUT_PARTITIONED;
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fail_unless(bf_remove_hashed(&filter, even) == -EINVAL);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(test_bf_counting_false_positive)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_params params = {0, 1, 0, 0, LAYOUT_COUNTING, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bitmap_from_file(-1, sizeof(bloom_filter_header) + 1, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    // B shares the counter of A, so it looks present once A is set
+    uint64_t a[] = {0, 0, 0, 0};
+    uint64_t b[] = {2, 2, 2, 2};
+    fail_unless(bf_add_hashed(&filter, a) == 1);
+    fail_unless(bf_add_hashed(&filter, b) == 0);
+    fail_unless(map.mmap[sizeof(bloom_filter_header)] == 2);
+    fail_unless(bf_size(&filter) == 1);
+
+    // The set of B was counted, so unsetting A keeps it
+    fail_unless(bf_remove_hashed(&filter, a) == 1);
+    fail_unless(bf_contains_hashed(&filter, b) == 1);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(test_bf_cuckoo_add_remove)
+{
+    bloom_filter_params params = {0, 0, 10000, 1e-4, LAYOUT_CUCKOO, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+    fail_unless(params.k_num == 2);
+
+    // 17 bit fingerprints, smaller than the bloom filter
+    bloom_filter_params bloom = {0, 0, 10000, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&bloom) == 0);
+    fail_unless(params.bytes < bloom.bytes);
+
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fail_unless(filter.layout == LAYOUT_CUCKOO);
+    fail_unless(filter.fp_bits == 17);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_add(&filter, (char*)&buf) == 1);
+    }
+    fail_unless(bf_size(&filter) == 10000);
+
+    int fps = 0;
+    for (int i=10000;i<110000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fps += bf_contains(&filter, (char*)&buf);
+    }
+    fail_unless(fps < 30);
+
+    for (int i=0;i<10000;i+=2) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_remove(&filter, (char*)&buf) == 1);
+    }
+    fail_unless(bf_size(&filter) == 5000);
+    for (int i=1;i<10000;i+=2) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+    }
+
+    // Concurrent adds are not supported
+    uint64_t hashes[4] = {1, 2, 3, 4};
+    fail_unless(bf_add_hashed_atomic(&filter, hashes) == -EINVAL);
+
+    bf_close(&filter);
+}
+END_TEST
+
+START_TEST(test_bf_cuckoo_full)
+{
+    bloom_filter_params params = {0, 0, 100, 1e-6, LAYOUT_CUCKOO, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_filename("/tmp/cuckoo_full.mmap", params.bytes, 1, SHARED, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    // Fill the table until it refuses keys
+    char buf[100];
+    int added = 0, res;
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_add(&filter, (char*)&buf);
+        if (res == -ENOSPC) break;
+        fail_unless(res == 1);
+        added++;
+    }
+    fail_unless(res == -ENOSPC);
+    fail_unless(added >= 90);
+    fail_unless(filter.header->has_victim == 1);
+    fail_unless(bf_size(&filter) == (uint64_t)added);
+    bf_close(&filter);
+
+    // Reload, the layout and the left over key are kept
+    fail_unless(bitmap_from_filename("/tmp/cuckoo_full.mmap", params.bytes, 0, SHARED, &map) == 0);
+    bloom_filter_params none = {0, 1, 0, 0, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_from_bitmap_params(&map, &none, 0, &filter) == 0);
+    fail_unless(filter.layout == LAYOUT_CUCKOO);
+    for (int i=0;i<added;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+    }
+
+    // Removing makes room for the left over key
+    int removed = 0;
+    while (filter.header->has_victim && removed < added) {
+        snprintf((char*)&buf, 100, "test%d", removed++);
+        fail_unless(bf_remove(&filter, (char*)&buf) == 1);
+    }
+    fail_unless(filter.header->has_victim == 0);
+    fail_unless(bf_size(&filter) == (uint64_t)(added - removed));
+    for (int i=removed;i<added;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+    }
+    bf_close(&filter);
+    unlink("/tmp/cuckoo_full.mmap");
+}
+END_TEST
+
+START_TEST(test_bf_merge)
+{
+    // Power of two partitions line up across sizes
+    bloom_filter_params small_params = {0, 0, 1e3, 1e-3, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_POW2, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bloom_filter_params large_params = {0, 0, 4e3, 1e-3, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_POW2, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&small_params) == 0);
+    fail_unless(bf_params_for_capacity(&large_params) == 0);
+    fail_unless(small_params.k_num == large_params.k_num);
+
+    bloom_bitmap small_map, large_map;
+    bloom_bloomfilter small, large;
+    fail_unless(bitmap_from_file(-1, small_params.bytes, ANONYMOUS, &small_map) == 0);
+    fail_unless(bitmap_from_file(-1, large_params.bytes, ANONYMOUS, &large_map) == 0);
+    fail_unless(bf_from_bitmap_params(&small_map, &small_params, 1, &small) == 0);
+    fail_unless(bf_from_bitmap_params(&large_map, &large_params, 1, &large) == 0);
+    fail_unless(small.header->capacity == 1e3);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        bf_add((i < 500) ? &small : &large, (char*)&buf);
+    }
+    uint64_t count = bf_size(&small) + bf_size(&large);
+
+    // Only smaller filters can be repeated into larger ones
+    fail_unless(bf_can_merge(&large, &small) == 1);
+    fail_unless(bf_can_merge(&small, &large) == 0);
+    fail_unless(bf_merge(&small, &large) == -EINVAL);
+
+    double fp = bf_estimate_fp_probability(&large);
+    double merged_fp = bf_estimate_merged_fp_probability(&large, &small);
+    fail_unless(fp > 0 && fp < 1e-3);
+    fail_unless(merged_fp > fp);
+
+    fail_unless(bf_merge(&large, &small) == 0);
+    fail_unless(bf_size(&large) == count);
+    fail_unless(large.header->capacity == 5e3);
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_contains(&large, (char*)&buf) == 1);
+    }
+    fail_unless(bf_estimate_fp_probability(&large) == merged_fp);
+    bitmap_close(&small_map);
+    bitmap_close(&large_map);
+
+    // Modulo indexing only lines up for the same size
+    small_params.index_mode = large_params.index_mode = INDEX_MODULO;
+    fail_unless(bf_params_for_capacity(&small_params) == 0);
+    fail_unless(bf_params_for_capacity(&large_params) == 0);
+    fail_unless(bitmap_from_file(-1, small_params.bytes, ANONYMOUS, &small_map) == 0);
+    fail_unless(bitmap_from_file(-1, large_params.bytes, ANONYMOUS, &large_map) == 0);
+    fail_unless(bf_from_bitmap_params(&small_map, &small_params, 1, &small) == 0);
+    fail_unless(bf_from_bitmap_params(&large_map, &large_params, 1, &large) == 0);
+    fail_unless(bf_can_merge(&large, &small) == 0);
+    bitmap_close(&large_map);
+
+    bloom_bloomfilter other;
+    fail_unless(bitmap_from_file(-1, small_params.bytes, ANONYMOUS, &large_map) == 0);
+    fail_unless(bf_from_bitmap_params(&large_map, &small_params, 1, &other) == 0);
+    fail_unless(bf_add(&small, "foo") == 1);
+    fail_unless(bf_can_merge(&other, &small) == 1);
+    fail_unless(bf_merge(&other, &small) == 0);
+    fail_unless(bf_contains(&other, "foo") == 1);
+    fail_unless(bf_size(&other) == 1);
+    bitmap_close(&small_map);
+    bitmap_close(&large_map);
+}
+END_TEST
+
+START_TEST(test_bf_intersect)
+{
+    bloom_filter_params params = {0, 0, 1e3, 1e-3, LAYOUT_BLOCKED, HASH_WYHASH, INDEX_POW2, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+    bloom_bitmap map, other_map;
+    bloom_bloomfilter filter, other;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &other_map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fail_unless(bf_from_bitmap_params(&other_map, &params, 1, &other) == 0);
+
+    // Keys 250-499 are in both filters
+    char buf[100];
+    for (int i=0;i<500;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        bf_add(&filter, (char*)&buf);
+        snprintf((char*)&buf, 100, "test%d", i + 250);
+        bf_add(&other, (char*)&buf);
+    }
+    fail_unless(bf_intersect(&filter, &other) == 0);
+    fail_unless(filter.header->capacity == 1e3);
+    fail_unless(bf_size(&filter) <= 500);
+
+    int found = 0;
+    for (int i=0;i<750;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        if (i >= 250 && i < 500) {
+            fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+        } else {
+            found += bf_contains(&filter, (char*)&buf);
+        }
+    }
+    fail_unless(found < 25);
+    bitmap_close(&map);
+    bitmap_close(&other_map);
+
+    // Counting filters keep the smaller counter
+    params.layout = LAYOUT_COUNTING;
+    fail_unless(bf_params_for_capacity(&params) == 0);
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &other_map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fail_unless(bf_from_bitmap_params(&other_map, &params, 1, &other) == 0);
+    fail_unless(bf_add(&filter, "foo") == 1);
+    fail_unless(bf_add(&filter, "bar") == 1);
+    fail_unless(bf_add(&other, "foo") == 1);
+    fail_unless(bf_intersect(&filter, &other) == 0);
+    fail_unless(bf_contains(&filter, "foo") == 1);
+    fail_unless(bf_contains(&filter, "bar") == 0);
+    fail_unless(bf_size(&filter) == 1);
+    bitmap_close(&other_map);
+
+    // Cuckoo filters cannot be intersected
+    params.layout = LAYOUT_CUCKOO;
+    fail_unless(bf_params_for_capacity(&params) == 0);
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &other_map) == 0);
+    fail_unless(bf_from_bitmap_params(&other_map, &params, 1, &other) == 0);
+    fail_unless(bf_intersect(&other, &filter) == -EINVAL);
+    bitmap_close(&map);
+    bitmap_close(&other_map);
+}
+END_TEST
+
+START_TEST(test_bf_fold)
+{
+    // Each layout and index mode folds, keeping all the keys
+    struct {
+        bloom_layout layout;
+        bloom_index_mode index_mode;
+        bloom_bit_order bit_order;
+    } cases[] = {
+        {LAYOUT_PARTITIONED, INDEX_MODULO, BIT_ORDER_BYTE},
+        {LAYOUT_PARTITIONED, INDEX_FASTRANGE, BIT_ORDER_WORD},
+        {LAYOUT_PARTITIONED, INDEX_POW2, BIT_ORDER_WORD},
+        {LAYOUT_BLOCKED, INDEX_MODULO, BIT_ORDER_BYTE},
+        {LAYOUT_BLOCKED, INDEX_FASTRANGE, BIT_ORDER_WORD},
+        {LAYOUT_COUNTING, INDEX_MODULO, BIT_ORDER_BYTE},
+        {LAYOUT_COUNTING, INDEX_FASTRANGE, BIT_ORDER_BYTE},
+    };
+    char buf[100];
+    uint64_t data_bytes = 5 * 1001;
+    for (int c=0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+        bloom_filter_params params = {sizeof(bloom_filter_header) + data_bytes, 5, 4000, 0, cases[c].layout,
+            HASH_MURMUR_SPOOKY, cases[c].index_mode, cases[c].bit_order, OPTIMIZE_MEMORY};
+        bloom_bitmap map, folded_map;
+        bloom_bloomfilter filter, folded;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+        for (int i=0;i<1000;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            bf_add(&filter, (char*)&buf);
+        }
+
+        fail_unless(bf_fold_factor(&filter) == 2);
+        uint64_t bytes = bf_folded_bytes(&filter);
+        fail_unless(bytes > sizeof(bloom_filter_header));
+        fail_unless(bytes - sizeof(bloom_filter_header) <= data_bytes / 2 + 1);
+        double fp = bf_estimate_fp_probability(&filter);
+        double folded_fp = bf_estimate_folded_fp_probability(&filter);
+        fail_unless(folded_fp > fp && folded_fp < 1);
+
+        // The bitmap must have the folded size
+        fail_unless(bitmap_from_file(-1, bytes + 64, ANONYMOUS, &folded_map) == 0);
+        fail_unless(bf_fold(&filter, &folded_map, &folded) == -EINVAL);
+        bitmap_close(&folded_map);
+
+        fail_unless(bitmap_from_file(-1, bytes, ANONYMOUS, &folded_map) == 0);
+        fail_unless(bf_fold(&filter, &folded_map, &folded) == 0);
+        fail_unless(folded.layout == filter.layout);
+        fail_unless(bf_size(&folded) == bf_size(&filter));
+        fail_unless(folded.header->capacity == 2000);
+        for (int i=0;i<1000;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            fail_unless(bf_contains(&folded, (char*)&buf) == 1);
+        }
+        bitmap_close(&map);
+        bitmap_close(&folded_map);
+    }
+
+    // Partitions of a prime size, and cuckoo filters, cannot be folded
+    bloom_filter_params odd = {sizeof(bloom_filter_header) + 1001, 5, 0, 0, LAYOUT_PARTITIONED,
+        HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    bloom_filter_params cuckoo = {0, 0, 1e3, 1e-3, LAYOUT_CUCKOO, HASH_MURMUR_SPOOKY,
+        INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&cuckoo) == 0);
+    bloom_bitmap odd_map, cuckoo_map;
+    bloom_bloomfilter odd_filter, cuckoo_filter;
+    fail_unless(bitmap_from_file(-1, odd.bytes, ANONYMOUS, &odd_map) == 0);
+    fail_unless(bitmap_from_file(-1, cuckoo.bytes, ANONYMOUS, &cuckoo_map) == 0);
+    fail_unless(bf_from_bitmap_params(&odd_map, &odd, 1, &odd_filter) == 0);
+    fail_unless(bf_from_bitmap_params(&cuckoo_map, &cuckoo, 1, &cuckoo_filter) == 0);
+    fail_unless(odd_filter.offset == 1601);
+    fail_unless(bf_fold_factor(&odd_filter) == 0);
+    fail_unless(bf_folded_bytes(&odd_filter) == 0);
+    fail_unless(bf_folded_bytes(&cuckoo_filter) == 0);
+    fail_unless(bf_estimate_folded_fp_probability(&cuckoo_filter) == 1);
+    bitmap_close(&odd_map);
+    bitmap_close(&cuckoo_map);
+}
+END_TEST
+
+START_TEST(test_bf_estimate_size)
+{
+    bloom_layout layouts[] = {LAYOUT_PARTITIONED, LAYOUT_BLOCKED, LAYOUT_COUNTING};
+    bloom_bitmap map, other_map;
+    bloom_bloomfilter filter, other;
+    char buf[100];
+    for (int l=0; l < 3; l++) {
+        bloom_filter_params params = {0, 0, 1e4, 1e-3, layouts[l], HASH_WYHASH, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+        fail_unless(bf_params_for_capacity(&params) == 0);
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &other_map) == 0);
+        fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+        fail_unless(bf_from_bitmap_params(&other_map, &params, 1, &other) == 0);
+        fail_unless(bf_estimate_size(&filter) == 0);
+
+        for (int i=0;i<5000;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            bf_add(&filter, (char*)&buf);
+            snprintf((char*)&buf, 100, "test%d", i + 2500);
+            bf_add(&other, (char*)&buf);
+        }
+        uint64_t estimate = bf_estimate_size(&filter);
+        fail_unless(estimate > 4900 && estimate < 5100);
+
+        // The adds keep the count of set bits without a rescan
+        uint64_t hashes[16];
+        char results[100];
+        for (int i=0;i<100;i++) {
+            snprintf((char*)&buf, 100, "atomic%d", i);
+            bf_compute_hashes_len(HASH_WYHASH, params.k_num, buf, strlen(buf), hashes);
+            bf_add_hashed_atomic(&filter, hashes);
+            snprintf((char*)&buf, 100, "test%d", i);
+            if (layouts[l] == LAYOUT_COUNTING) bf_remove(&filter, (char*)&buf);
+        }
+        if (layouts[l] != LAYOUT_COUNTING) {
+            uint64_t batch[100 * 16];
+            for (int i=0;i<100;i++) {
+                snprintf((char*)&buf, 100, "batch%d", i);
+                bf_compute_hashes_len(HASH_WYHASH, params.k_num, buf, strlen(buf), batch + i * 16);
+            }
+            fail_unless(bf_add_batch_hashed(&filter, batch, 16, 100, (char*)&results) > 0);
+        }
+        fail_unless(filter.set_bits == bf_popcount(map.mmap + sizeof(bloom_filter_header),
+                    params.bytes - sizeof(bloom_filter_header), layouts[l] == LAYOUT_COUNTING));
+
+        // A loaded filter counts its bits once, to the same estimate
+        bloom_bloomfilter loaded;
+        estimate = bf_estimate_size(&filter);
+        fail_unless(bf_from_bitmap(&map, 1, 0, &loaded) == 0);
+        fail_unless(bf_estimate_size(&loaded) == estimate);
+        fail_unless(loaded.set_bits == filter.set_bits);
+
+        // The merged counts add up, the estimate counts the shared keys once
+        fail_unless(bf_merge(&filter, &other) == 0);
+        fail_unless(bf_size(&filter) >= 9900);
+        estimate = bf_estimate_size(&filter);
+        fail_unless(estimate > 7300 && estimate < 7900);
+
+        fail_unless(bf_clear(&filter) == 0);
+        fail_unless(bf_estimate_size(&filter) == 0);
+        bitmap_close(&map);
+        bitmap_close(&other_map);
+    }
+}
+END_TEST
+
+START_TEST(test_bf_keys_len)
+{
+    // Hashing a slice matches hashing the same key NUL terminated
+    uint64_t hashes[8], hashes2[8];
+    bf_compute_hashes_family(HASH_MURMUR_SPOOKY, 8, "foo", (uint64_t*)&hashes);
+    bf_compute_hashes_len(HASH_MURMUR_SPOOKY, 8, "foo bar", 3, (uint64_t*)&hashes2);
+    fail_unless(memcmp(hashes, hashes2, sizeof(hashes)) == 0);
+    bf_compute_hashes_family(HASH_WYHASH, 8, "foo", (uint64_t*)&hashes);
+    bf_compute_hashes_len(HASH_WYHASH, 8, "foo bar", 3, (uint64_t*)&hashes2);
+    fail_unless(memcmp(hashes, hashes2, sizeof(hashes)) == 0);
+
+    bloom_filter_params params = {0, 0, 1000, 1e-4, LAYOUT_COUNTING, HASH_WYHASH, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+
+    // Keys are not NUL terminated at their length
+    char *keys = "foo bar baz";
+    fail_unless(bf_add_len(&filter, keys, 3) == 1);
+    fail_unless(bf_add_len(&filter, keys + 4, 3) == 1);
+    fail_unless(bf_contains(&filter, "foo") == 1);
+    fail_unless(bf_contains(&filter, "bar") == 1);
+    fail_unless(bf_contains_len(&filter, keys + 8, 3) == 0);
+    fail_unless(bf_contains(&filter, "foo bar") == 0);
+    fail_unless(bf_remove_len(&filter, keys + 4, 3) == 1);
+    fail_unless(bf_contains(&filter, "bar") == 0);
+    fail_unless(bf_size(&filter) == 1);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(test_bf_add_batch_matches)
+{
+    // Sorted batches set the same bits and results as adding in turn
+    bloom_layout layouts[3] = {LAYOUT_PARTITIONED, LAYOUT_PARTITIONED, LAYOUT_BLOCKED};
+    bloom_bit_order orders[3] = {BIT_ORDER_BYTE, BIT_ORDER_WORD, BIT_ORDER_BYTE};
+    for (int l=0; l < 3; l++) {
+        bloom_filter_params params = {0, 0, 1e4, 1e-3, layouts[l], HASH_WYHASH, INDEX_FASTRANGE, orders[l], OPTIMIZE_MEMORY};
+        fail_unless(bf_params_for_capacity(&params) == 0);
+        bloom_bitmap map, map2;
+        bloom_bloomfilter filter, filter2;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map2) == 0);
+        fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+        fail_unless(bf_from_bitmap_params(&map2, &params, 1, &filter2) == 0);
+
+        // Keys repeat inside the batch, and some are already present
+        uint32_t k = (params.k_num > 4) ? params.k_num : 4;
+        uint64_t *hashes = malloc(5000 * k * sizeof(uint64_t));
+        char results[5000];
+        char buf[100];
+        for (int i=0; i < 5000; i++) {
+            snprintf((char*)&buf, 100, "test%d", i % 3000);
+            bf_compute_hashes_family(HASH_WYHASH, k, (char*)&buf, hashes + i * k);
+            if (i < 500) fail_unless(bf_add_hashed(&filter, hashes + i * k) == 1);
+        }
+        fail_unless(bf_add_batch_hashed(&filter, hashes + 500 * k, k, 4500, (char*)&results) == 2500);
+        for (int i=0; i < 5000; i++) {
+            int res = bf_add_hashed(&filter2, hashes + i * k);
+            if (i >= 500) fail_unless(results[i - 500] == res);
+        }
+        fail_unless(bf_size(&filter) == bf_size(&filter2));
+        fail_unless(memcmp(map.mmap, map2.mmap, params.bytes) == 0);
+        free(hashes);
+        bitmap_close(&map);
+        bitmap_close(&map2);
+    }
+
+    // Counting filters have no sorted batches
+    bloom_filter_params params = {0, 0, 1e3, 1e-3, LAYOUT_COUNTING, HASH_WYHASH, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    uint64_t hashes[16] = {0};
+    char results[1];
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fail_unless(bf_add_batch_hashed(&filter, hashes, 16, 1, (char*)&results) == -EINVAL);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(test_bf_kernels_match)
+{
+    // The unrolled kernels set and check the bits of the generic loops
+    uint32_t ks[5] = {1, 3, 13, BLOOM_KERNEL_MAX_K, BLOOM_KERNEL_MAX_K + 1};
+    bloom_index_mode modes[3] = {INDEX_MODULO, INDEX_FASTRANGE, INDEX_POW2};
+    for (int i=0; i < 5; i++) {
+        for (int j=0; j < 6; j++) {
+            bloom_filter_params params = {0, ks[i], 0, 0, LAYOUT_PARTITIONED, HASH_WYHASH,
+                modes[j / 2], (j % 2) ? BIT_ORDER_WORD : BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+            bloom_bitmap map, map2;
+            bloom_bloomfilter filter, filter2;
+            fail_unless(bitmap_from_file(-1, 65536, ANONYMOUS, &map) == 0);
+            fail_unless(bitmap_from_file(-1, 65536, ANONYMOUS, &map2) == 0);
+            fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+            fail_unless(bf_from_bitmap_params(&map2, &params, 1, &filter2) == 0);
+            fail_unless((filter.contains_kernel != NULL) == (ks[i] <= BLOOM_KERNEL_MAX_K));
+            filter2.contains_kernel = NULL;
+            filter2.set_kernel = NULL;
+
+            char buf[100];
+            for (int n=0; n < 2000; n++) {
+                snprintf((char*)&buf, 100, "test%d", n);
+                fail_unless(bf_add(&filter, (char*)&buf) == bf_add(&filter2, (char*)&buf));
+            }
+            fail_unless(memcmp(map.mmap, map2.mmap, 65536) == 0);
+            for (int n=0; n < 4000; n++) {
+                snprintf((char*)&buf, 100, "test%d", n);
+                fail_unless(bf_contains(&filter, (char*)&buf) == bf_contains(&filter2, (char*)&buf));
+                if (n < 2000) fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+            }
+            bitmap_close(&map);
+            bitmap_close(&map2);
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_bf_slice_matches)
+{
+    // A bit-sliced group answers like checking each filter in turn
+    for (int o=0; o < 2; o++) {
+        bloom_filter_params params = {0, 0, 1e3, 1e-3, LAYOUT_PARTITIONED, HASH_WYHASH,
+            INDEX_FASTRANGE, (o) ? BIT_ORDER_WORD : BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+        fail_unless(bf_params_for_capacity(&params) == 0);
+        bloom_bitmap maps[10];
+        bloom_bloomfilter filters[10];
+        char buf[100];
+        for (int f=0; f < 10; f++) {
+            fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &maps[f]) == 0);
+            fail_unless(bf_from_bitmap_params(&maps[f], &params, 1, &filters[f]) == 0);
+            for (int n=0; n < 500; n++) {
+                snprintf((char*)&buf, 100, "test%d", f * 100 + n);
+                bf_add(&filters[f], (char*)&buf);
+            }
+        }
+
+        bloom_slice slice;
+        fail_unless(bf_slice_init(&filters[0], 10, &slice) == 0);
+        fail_unless(slice.width == 16);
+        for (int f=0; f < 10; f++) {
+            fail_unless(bf_slice_add(&slice, &filters[f]) == f);
+        }
+        fail_unless(bf_slice_bytes(&slice) == params.k_num * filters[0].offset * 2);
+
+        uint64_t hashes[32];
+        for (int n=0; n < 3000; n++) {
+            snprintf((char*)&buf, 100, "test%d", n);
+            bf_compute_hashes_family(HASH_WYHASH, params.k_num, (char*)&buf, (uint64_t*)&hashes);
+            uint64_t expect = 0;
+            for (int f=0; f < 10; f++) {
+                if (bf_contains_hashed(&filters[f], (uint64_t*)&hashes) == 1) expect |= 1ULL << f;
+            }
+            fail_unless(bf_slice_contains_hashed(&slice, (uint64_t*)&hashes) == expect);
+        }
+        bf_slice_destroy(&slice);
+        for (int f=0; f < 10; f++) bitmap_close(&maps[f]);
+    }
+}
+END_TEST
+
+START_TEST(test_bf_slice_limits)
+{
+    bloom_filter_params params = {0, 0, 1e3, 1e-3, LAYOUT_PARTITIONED, HASH_WYHASH,
+        INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+    bloom_filter_params other = params;
+    other.capacity = 1e4;
+    fail_unless(bf_params_for_capacity(&other) == 0);
+    bloom_filter_params blocked = params;
+    blocked.layout = LAYOUT_BLOCKED;
+    fail_unless(bf_params_for_capacity(&blocked) == 0);
+
+    bloom_bitmap map, map2, map3;
+    bloom_bloomfilter filter, filter2, filter3;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bitmap_from_file(-1, other.bytes, ANONYMOUS, &map2) == 0);
+    fail_unless(bitmap_from_file(-1, blocked.bytes, ANONYMOUS, &map3) == 0);
+    fail_unless(bf_from_bitmap_params(&map, &params, 1, &filter) == 0);
+    fail_unless(bf_from_bitmap_params(&map2, &other, 1, &filter2) == 0);
+    fail_unless(bf_from_bitmap_params(&map3, &blocked, 1, &filter3) == 0);
+
+    // Only partitioned filters of the same geometry are sliced
+    bloom_slice slice;
+    fail_unless(bf_slice_init(&filter3, 8, &slice) == -EINVAL);
+    fail_unless(bf_slice_init(&filter, 0, &slice) == -EINVAL);
+    fail_unless(bf_slice_init(&filter, BLOOM_SLICE_MAX + 1, &slice) == -EINVAL);
+    fail_unless(bf_slice_init(&filter, 3, &slice) == 0);
+    fail_unless(slice.width == 8);
+    fail_unless(bf_slice_add(&slice, &filter2) == -EINVAL);
+    fail_unless(bf_slice_add(&slice, &filter3) == -EINVAL);
+
+    // An empty group has no filters, so no key is in it
+    uint64_t hashes[32] = {0};
+    fail_unless(bf_slice_contains_hashed(&slice, (uint64_t*)&hashes) == 0);
+
+    for (int i=0; i < 8; i++) fail_unless(bf_slice_add(&slice, &filter) == i);
+    fail_unless(bf_slice_add(&slice, &filter) == -ENOSPC);
+    bf_slice_destroy(&slice);
+
+    // A full group of the widest words has all its bits in use
+    fail_unless(bf_slice_init(&filter, BLOOM_SLICE_MAX, &slice) == 0);
+    fail_unless(bf_add(&filter, "foo") == 1);
+    for (int i=0; i < BLOOM_SLICE_MAX; i++) fail_unless(bf_slice_add(&slice, &filter) == i);
+    bf_compute_hashes_family(HASH_WYHASH, params.k_num, "foo", (uint64_t*)&hashes);
+    fail_unless(bf_slice_contains_hashed(&slice, (uint64_t*)&hashes) == UINT64_MAX);
+    bf_slice_destroy(&slice);
+
+    bitmap_close(&map);
+    bitmap_close(&map2);
+    bitmap_close(&map3);
+}
+END_TEST
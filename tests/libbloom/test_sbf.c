@@ -11,7 +11,7 @@
 
 START_TEST(sbf_initial_size)
 {
-    bloom_filter_params config_params = {0, 0, 1e4, 1e-4};
+    bloom_filter_params config_params = {0, 0, 1e4, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&config_params);
 
     bloom_sbf_params params = SBF_DEFAULT_PARAMS;
@@ -85,7 +85,7 @@ START_TEST(sbf_add_filter_2)
     }
 
     // Byte size should be greater than a static filter of the same config
-    bloom_filter_params config_params = {0, 0, 21e3, 1e-4};
+    bloom_filter_params config_params = {0, 0, 21e3, 1e-4, LAYOUT_PARTITIONED, HASH_MURMUR_SPOOKY, INDEX_MODULO, BIT_ORDER_BYTE, OPTIMIZE_MEMORY};
     bf_params_for_capacity(&config_params);
     uint64_t total_size = sbf_total_byte_size(&sbf);
     fail_unless(total_size > config_params.bytes);
@@ -233,6 +233,53 @@ START_TEST(test_sbf_flush)
 }
 END_TEST
 
+static void sbf_flush_async_cb(void *data, int res) {
+    int *out = data;
+    *out = res;
+}
+
+START_TEST(test_sbf_flush_async)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+
+    nextfile next;
+    next.format = "/tmp/mmap_flush_async.%d.data";
+    next.num = 0;
+
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, sbf_make_callback, &next, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(sbf.num_filters == 2);
+
+    bloom_flusher *flusher;
+    fail_unless(flusher_create(0, &flusher) == 0);
+    int done = 1;
+    fail_unless(sbf_flush_async(&sbf, flusher, sbf_flush_async_cb, &done) == 0);
+    fail_unless(flusher_drain(flusher) == 0);
+    fail_unless(done == 0);
+    fail_unless(sbf.dirty_filters[0] == 0);
+    fail_unless(sbf.dirty_filters[1] == 0);
+
+    // Nothing is dirty, so it completes right away
+    done = 1;
+    fail_unless(sbf_flush_async(&sbf, flusher, sbf_flush_async_cb, &done) == 0);
+    fail_unless(done == 0);
+    fail_unless(flusher_destroy(flusher) == 0);
+    fail_unless(sbf_close(&sbf) == 0);
+
+    unlink("/tmp/mmap_flush_async.0.data");
+    unlink("/tmp/mmap_flush_async.1.data");
+}
+END_TEST
+
 START_TEST(test_sbf_close_does_flush)
 {
     bloom_sbf_params params = SBF_DEFAULT_PARAMS;
@@ -311,3 +358,719 @@ START_TEST(sbf_fp_prob)
 }
 END_TEST
 
+
+START_TEST(sbf_blocked_layout)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    params.layout = LAYOUT_BLOCKED;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = sbf_add(&sbf, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    // All the layers should be blocked
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf.filters[0]->layout == LAYOUT_BLOCKED);
+    fail_unless(sbf.filters[1]->layout == LAYOUT_BLOCKED);
+
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = sbf_contains(&sbf, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_hash_family_inherited)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    params.hash_family = HASH_WYHASH;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Change the params, new layers must still match
+    sbf.params.hash_family = HASH_MURMUR_SPOOKY;
+
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = sbf_add(&sbf, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf.filters[0]->header->hash_family == HASH_WYHASH);
+    fail_unless(sbf.filters[1]->header->hash_family == HASH_WYHASH);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_add_hashed_layers)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-2;
+    params.probability_reduction = 0.5;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Hash with the initial number of hashes only, new
+    // layers should extend them as needed.
+    uint32_t num_hashes = sbf_num_hashes(&sbf);
+    uint64_t hashes[64];
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bf_compute_hashes(num_hashes, (char*)&buf, (uint64_t*)&hashes);
+        res = sbf_add_hashed(&sbf, (uint64_t*)&hashes, num_hashes);
+        fail_unless(res == 0 || res == 1);
+    }
+    fail_unless(sbf.num_filters == 3);
+    fail_unless(sbf_num_hashes(&sbf) > num_hashes);
+
+    // All the keys should be found by the un-hashed API
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+
+    // And by the hashed API with a short hash list
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bf_compute_hashes(num_hashes, (char*)&buf, (uint64_t*)&hashes);
+        fail_unless(sbf_contains_hashed(&sbf, (uint64_t*)&hashes, num_hashes) == 1);
+    }
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_contains_batch_matches)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-3;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(sbf.num_filters > 1);
+
+    // Mix of present and missing keys, not a multiple of the batch size
+    int num_keys = 1037;
+    char **keys = calloc(num_keys, sizeof(char*));
+    char *results = calloc(num_keys, sizeof(char));
+    for (int i=0;i<num_keys;i++) {
+        keys[i] = malloc(100);
+        snprintf(keys[i], 100, "foobar%d", (i % 2) ? i : i + 100000);
+    }
+    fail_unless(sbf_contains_batch(&sbf, keys, num_keys, results) == 0);
+    for (int i=0;i<num_keys;i++) {
+        fail_unless(results[i] == sbf_contains(&sbf, keys[i]));
+        if (i % 2) fail_unless(results[i] == 1);
+        free(keys[i]);
+    }
+    free(keys);
+    free(results);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_add_concurrent_full)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Fill the first filter
+    char buf[100];
+    int i;
+    for (i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = sbf_add_concurrent(&sbf, (char*)&buf);
+        if (res == -EAGAIN) break;
+        fail_unless(res == 1);
+    }
+
+    // Should refuse to grow, then grow with sbf_add
+    fail_unless(res == -EAGAIN);
+    fail_unless(i == 1000);
+    fail_unless(sbf.num_filters == 1);
+    fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf_add_concurrent(&sbf, "another") == 1);
+    fail_unless(sbf_add_concurrent(&sbf, "another") == 0);
+    fail_unless(sbf_size(&sbf) == 1002);
+
+    for (i=0;i<=1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_counting_remove)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    params.layout = LAYOUT_COUNTING;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf.filters[1]->layout == LAYOUT_COUNTING);
+
+    // Keys are removed from whichever layer holds them
+    for (int i=0;i<2000;i+=2) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_remove(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf_size(&sbf) == 1000);
+    fail_unless(sbf.dirty_filters[0] == 1);
+    fail_unless(sbf.dirty_filters[1] == 1);
+    for (int i=1;i<2000;i+=2) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+
+    // Removed keys can be added again
+    fail_unless(sbf_add(&sbf, "foobar0") == 1);
+
+    // Each set is counted, so a key set twice needs two unsets
+    fail_unless(sbf_add(&sbf, "foobar1") == 0);
+    fail_unless(sbf_remove(&sbf, "foobar1") == 1);
+    fail_unless(sbf_contains(&sbf, "foobar1") == 1);
+    fail_unless(sbf_remove(&sbf, "foobar1") == 1);
+
+    // Concurrent adds need exclusive access
+    fail_unless(sbf_add_concurrent(&sbf, "foobar2") == -EAGAIN);
+    fail_unless(sbf_close(&sbf) == 0);
+
+    // Plain filters do not support removal
+    params.layout = LAYOUT_PARTITIONED;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+    fail_unless(sbf_add(&sbf, "foobar0") == 1);
+    fail_unless(sbf_remove(&sbf, "foobar0") == -EINVAL);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_cuckoo_grow)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    params.layout = LAYOUT_CUCKOO;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters >= 2);
+    fail_unless(sbf.filters[0]->layout == LAYOUT_CUCKOO);
+    fail_unless(sbf_size(&sbf) == 10000);
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+
+    // Keys are removed from whichever layer holds them
+    for (int i=0;i<10000;i+=2) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_remove(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf_size(&sbf) == 5000);
+    fail_unless(sbf_add_concurrent(&sbf, "foobar0") == -EAGAIN);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_compact_sparse_layers)
+{
+    bloom_sbf_params params = {1e3, 1e-4, 2, 0.9, LAYOUT_COUNTING, HASH_MURMUR_SPOOKY, INDEX_POW2, BIT_ORDER_BYTE, 0, OPTIMIZE_MEMORY};
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<6000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 3);
+    fail_unless(bf_can_merge(sbf.filters[1], sbf.filters[2]) == 1);
+
+    // Full layers would exceed the probability budget
+    uint32_t merged = 0;
+    fail_unless(sbf_compact(&sbf, &merged) == 0);
+
+    // Drain the older layers
+    for (int i=0;i<3000;i++) {
+        if (i % 100 == 0) continue;
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_remove(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf_compact(&sbf, &merged) == 1);
+    fail_unless(merged == 2);
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf_total_capacity(&sbf) == 7000);
+    fail_unless(sbf_size(&sbf) == 3030);
+    for (int i=0;i<6000;i++) {
+        if (i < 3000 && i % 100) continue;
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+
+    // The newest layer is never merged
+    fail_unless(sbf_compact(&sbf, &merged) == 0);
+
+    // Growth continues from the newest layer
+    for (int i=6000;i<7001;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 3);
+    fail_unless(sbf.capacities[0] == 8000);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_fold_sparse_layers)
+{
+    bloom_sbf_params params = {1e5, 1e-3, 4, 0.9, LAYOUT_PARTITIONED, HASH_WYHASH, INDEX_POW2, BIT_ORDER_WORD, 0, OPTIMIZE_MEMORY};
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    uint64_t bytes = sbf_total_byte_size(&sbf);
+
+    // Nothing folds within a tiny probability
+    uint32_t idx;
+    fail_unless(sbf_fold_candidate(&sbf, 1e-30, &idx) == 0);
+
+    // Fold until the layer is over a quarter full
+    int folds = 0;
+    bloom_bitmap *map;
+    while (sbf_fold_candidate(&sbf, params.fp_probability, &idx) == 1) {
+        fail_unless(idx == 0);
+        map = calloc(1, sizeof(bloom_bitmap));
+        fail_unless(bitmap_from_file(-1, bf_folded_bytes(sbf.filters[idx]), ANONYMOUS, map) == 0);
+        fail_unless(sbf_fold_layer(&sbf, idx, map) == 0);
+        folds++;
+    }
+    fail_unless(folds == 5);
+    fail_unless(sbf.capacities[0] == 3125);
+    fail_unless(sbf.filters[0]->header->capacity == 3125);
+    fail_unless(sbf_total_byte_size(&sbf) < bytes / 16);
+    fail_unless(sbf_size(&sbf) == 1000);
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+
+    // Growth scales from the folded layer
+    for (int i=1000;i<3126;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf.capacities[0] == 12500);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_prepare_filter_swap)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+
+    bloom_sbf sbf;
+    uint64_t counter = 0;
+    int res = sbf_from_filters(&params, sbf_test_callback, &counter, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<900;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+
+    // Only prepared past the fill
+    fail_unless(sbf_prepare_filter(&sbf, 0.95) == 0);
+    fail_unless(sbf.spare == NULL);
+    fail_unless(sbf_prepare_filter(&sbf, 0.9) == 1);
+    fail_unless(sbf.spare != NULL);
+    fail_unless(counter == 2);
+    fail_unless(sbf_prepare_filter(&sbf, 0.9) == 0);
+    fail_unless(counter == 2);
+
+    // Growing swaps in the prepared filter
+    bloom_bloomfilter *spare = sbf.spare;
+    for (int i=900;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf.filters[0] == spare);
+    fail_unless(sbf.spare == NULL);
+    fail_unless(sbf.capacities[0] == 4000);
+    fail_unless(counter == 2);
+    fail_unless(sbf_size(&sbf) == 2000);
+
+    // An unused filter is closed with the SBF
+    fail_unless(sbf_prepare_filter(&sbf, 0.1) == 1);
+    fail_unless(sbf_close(&sbf) == 0);
+    fail_unless(sbf.spare == NULL);
+}
+END_TEST
+
+START_TEST(sbf_rotate_generations)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-3;
+    params.generations = 3;
+
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+    fail_unless(sbf.num_filters == 3);
+    fail_unless(sbf_total_capacity(&sbf) == 3000);
+
+    // Generations never grow
+    char buf[100];
+    for (int i=0;i<1500;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) >= 0);
+    }
+    fail_unless(sbf.num_filters == 3);
+    fail_unless(sbf_prepare_filter(&sbf, 0.1) == 0);
+    uint32_t merged;
+    fail_unless(sbf_compact(&sbf, &merged) == 0);
+
+    // Keys survive until their generation is recycled
+    bloom_bloomfilter *oldest = sbf.filters[2];
+    fail_unless(sbf_rotate(&sbf, 10) == 0);
+    fail_unless(sbf.filters[0] == oldest);
+    fail_unless(sbf_epoch(&sbf) == 10);
+    fail_unless(sbf_contains(&sbf, "foobar1") == 1);
+    fail_unless(sbf_add(&sbf, "newkey") == 1);
+    fail_unless(sbf_rotate(&sbf, 20) == 0);
+    fail_unless(sbf_contains(&sbf, "foobar1") == 1);
+    fail_unless(sbf_rotate(&sbf, 30) == 0);
+    fail_unless(sbf_contains(&sbf, "foobar1") == 0);
+    fail_unless(sbf_contains(&sbf, "newkey") == 1);
+    fail_unless(sbf_size(&sbf) == 1);
+    fail_unless(sbf_rotate(&sbf, 40) == 0);
+    fail_unless(sbf_contains(&sbf, "newkey") == 0);
+
+    // Reloading orders the generations by epoch
+    bloom_bloomfilter *filters[3] = {sbf.filters[2], sbf.filters[0], sbf.filters[1]};
+    bloom_sbf loaded;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 3, filters, &loaded) == 0);
+    fail_unless(sbf_epoch(&loaded) == 40);
+    fail_unless(loaded.filters[1]->header->epoch == 30);
+    fail_unless(loaded.filters[2]->header->epoch == 20);
+    fail_unless(loaded.rotation == 2);
+    fail_unless(sbf_close(&loaded) == 0);
+    free(sbf.filters);
+    free(sbf.dirty_filters);
+    free(sbf.capacities);
+
+    // Scaling SBFs cannot rotate
+    params.generations = 0;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+    fail_unless(sbf_rotate(&sbf, 10) == -EINVAL);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_rotate_refresh)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-3;
+    params.generations = 2;
+
+    bloom_sbf sbf;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+
+    // Setting a key again moves it to the newest generation,
+    // but it is still reported as present
+    char buf[100];
+    char *keys[BLOOM_BATCH_MIN];
+    uint64_t key_lens[BLOOM_BATCH_MIN];
+    char results[BLOOM_BATCH_MIN];
+    fail_unless(sbf_add(&sbf, "foo") == 1);
+    fail_unless(sbf_add(&sbf, "bar") == 1);
+    for (int i=0;i<BLOOM_BATCH_MIN;i++) {
+        snprintf((char*)&buf, 100, "batch%d", i);
+        keys[i] = strdup(buf);
+        key_lens[i] = strlen(buf);
+    }
+    fail_unless(sbf_add_batch_len(&sbf, keys, key_lens, BLOOM_BATCH_MIN, results) == 0);
+    fail_unless(results[0] == 1);
+
+    fail_unless(sbf_rotate(&sbf, 10) == 0);
+    fail_unless(sbf_add(&sbf, "foo") == 0);
+    fail_unless(sbf_add_concurrent(&sbf, "bar") == 0);
+    fail_unless(sbf_add_batch_len(&sbf, keys, key_lens, BLOOM_BATCH_MIN, results) == 0);
+    for (int i=0;i<BLOOM_BATCH_MIN;i++) fail_unless(results[i] == 0);
+
+    // The keys survive the rotation of their first generation
+    fail_unless(sbf_rotate(&sbf, 20) == 0);
+    fail_unless(sbf_contains(&sbf, "foo") == 1);
+    fail_unless(sbf_contains(&sbf, "bar") == 1);
+    for (int i=0;i<BLOOM_BATCH_MIN;i++) {
+        fail_unless(sbf_contains(&sbf, keys[i]) == 1);
+        free(keys[i]);
+    }
+    fail_unless(sbf_rotate(&sbf, 30) == 0);
+    fail_unless(sbf_contains(&sbf, "foo") == 0);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_reset_layers)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-3;
+
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) >= 0);
+    }
+    fail_unless(sbf.num_filters > 1);
+    fail_unless(sbf_prepare_filter(&sbf, 0.1) == 1);
+    bloom_bloomfilter *oldest = sbf.filters[sbf.num_filters - 1];
+
+    // Only the initial layer is kept, and it is empty
+    fail_unless(sbf_reset(&sbf) == 1);
+    fail_unless(sbf.num_filters == 1);
+    fail_unless(sbf.filters[0] == oldest);
+    fail_unless(sbf.spare == NULL);
+    fail_unless(sbf_size(&sbf) == 0);
+    fail_unless(sbf_total_capacity(&sbf) == 1000);
+    fail_unless(sbf_contains(&sbf, "foobar1") == 0);
+
+    // It grows again as before
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) >= 0);
+    }
+    fail_unless(sbf.num_filters > 1);
+    fail_unless(sbf_close(&sbf) == 0);
+
+    // Generations are all kept
+    params.generations = 3;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+    fail_unless(sbf_add(&sbf, "foobar") == 1);
+    fail_unless(sbf_reset(&sbf) == 3);
+    fail_unless(sbf.num_filters == 3);
+    fail_unless(sbf_contains(&sbf, "foobar") == 0);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_reorder_by_hits)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf_reorder(&sbf, 0) == 0);
+
+    // Hits in the oldest layer move it first
+    uint64_t newest = sbf.hits[0];
+    for (int i=0;i<100;i++) {
+        fail_unless(sbf_contains(&sbf, "foobar1") == 1);
+    }
+    fail_unless(sbf.hits[1] >= 100);
+    fail_unless(sbf.hits[0] == newest);
+    fail_unless(sbf_reorder(&sbf, 0) == 1);
+    fail_unless(sbf.order[0] == 0);
+    fail_unless(sbf_reorder(&sbf, 1) == 1);
+    fail_unless(sbf.order[0] == 1);
+    fail_unless(sbf.order[1] == 0);
+    fail_unless(sbf_reorder(&sbf, 0) == 0);
+
+    // Every key is still found, by either path
+    char *keys[2] = {"foobar1", "foobar1999"};
+    char results[2];
+    fail_unless(sbf_contains(&sbf, "foobar1999") == 1);
+    fail_unless(sbf_contains_batch(&sbf, (char**)&keys, 2, (char*)&results) == 0);
+    fail_unless(results[0] == 1 && results[1] == 1);
+
+    // Growing resets the order, the hits move with the layers
+    uint64_t oldest = sbf.hits[1];
+    for (int i=2000;i<6000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) >= 0);
+    }
+    fail_unless(sbf.num_filters == 3);
+    fail_unless(sbf.order[0] == 0 && sbf.order[2] == 2);
+    fail_unless(sbf.hits[2] >= oldest);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_add_batch_sorted)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e4;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+
+    char *keys[4000];
+    char results[4000];
+    for (int i=0; i < 4000; i++) {
+        keys[i] = malloc(20);
+        snprintf(keys[i], 20, "foobar%d", i % 3000);
+    }
+
+    // Small batches are left to the caller
+    fail_unless(sbf_add_batch_len(&sbf, keys, NULL, BLOOM_BATCH_MIN - 1, results) == -EAGAIN);
+    fail_unless(sbf_size(&sbf) == 0);
+
+    fail_unless(sbf_add(&sbf, keys[0]) == 1);
+    fail_unless(sbf_add_batch_len(&sbf, keys, NULL, 4000, results) == 0);
+    fail_unless(results[0] == 0);
+    for (int i=1; i < 4000; i++) fail_unless(results[i] == (i < 3000));
+    fail_unless(sbf_size(&sbf) == 3000);
+    for (int i=0; i < 3000; i++) fail_unless(sbf_contains(&sbf, keys[i]) == 1);
+
+    // Batches that would go over capacity are refused whole
+    for (int i=0; i < 4000; i++) snprintf(keys[i], 20, "other%d", i);
+    for (int i=0; i < 3; i++) {
+        fail_unless(sbf_add_batch_len(&sbf, keys, NULL, 4000, results) == (i < 1 ? 0 : -EAGAIN));
+        for (int j=0; j < 4000; j++) snprintf(keys[j], 20, "more%d_%d", i, j);
+    }
+    fail_unless(sbf_size(&sbf) == 7000);
+    fail_unless(sbf.num_filters == 1);
+    for (int i=0; i < 4000; i++) free(keys[i]);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_layer_summary)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+
+    // A new summary of an empty SBF is used
+    bloom_filter_params summary_params;
+    fail_unless(sbf_summary_params(&sbf, 2e4, &summary_params) == 0);
+    fail_unless(summary_params.layout == LAYOUT_BLOCKED);
+    unlink("/tmp/sbf_summary.bits");
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    fail_unless(bitmap_from_filename("/tmp/sbf_summary.bits", summary_params.bytes, 1, PERSISTENT, map) == 0);
+    fail_unless(sbf_attach_summary(&sbf, map, &summary_params) == 1);
+    fail_unless(sbf_attach_summary(&sbf, map, &summary_params) == -EINVAL);
+
+    // Keys are found through the summary, in every layer
+    char buf[100];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters > 1);
+    int misses = 0;
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+        snprintf((char*)&buf, 100, "other%d", i);
+        misses += sbf_contains(&sbf, (char*)&buf) == 0;
+    }
+    fail_unless(misses > 4990);
+    char *keys[3] = {"foobar1", "other1", "foobar4999"};
+    char results[3];
+    fail_unless(sbf_contains_batch(&sbf, (char**)&keys, 3, (char*)&results) == 0);
+    fail_unless(results[0] == 1 && results[1] == 0 && results[2] == 1);
+
+    // Flushing records the size of the layers it covers
+    fail_unless(sbf_flush(&sbf) == 0);
+    fail_unless(bf_size(sbf.summary) == 5000);
+    fail_unless(sbf_close(&sbf) == 0);
+
+    // The summary does not cover the keys of other layers, so it is stale
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+    fail_unless(sbf_add(&sbf, "foobar1") == 1);
+    map = malloc(sizeof(bloom_bitmap));
+    fail_unless(bitmap_from_filename("/tmp/sbf_summary.bits", summary_params.bytes, 0, PERSISTENT, map) == 0);
+    fail_unless(sbf_attach_summary(&sbf, map, NULL) == 0);
+    fail_unless(sbf_add(&sbf, "foobar2") == 1);
+    fail_unless(sbf_contains(&sbf, "foobar2") == 1);
+
+    // A reset clears the summary, which is then used again
+    fail_unless(sbf_reset(&sbf) == 1);
+    fail_unless(sbf.summary_stale == 0);
+    fail_unless(sbf_add(&sbf, "foobar3") == 1);
+    fail_unless(sbf_contains(&sbf, "foobar3") == 1);
+    fail_unless(sbf_contains(&sbf, "foobar2") == 0);
+    fail_unless(sbf_close(&sbf) == 0);
+
+    // Windowed SBFs cannot have a summary
+    params.generations = 3;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+    fail_unless(sbf_summary_params(&sbf, 2e4, &summary_params) == -EINVAL);
+    fail_unless(sbf_close(&sbf) == 0);
+    unlink("/tmp/sbf_summary.bits");
+}
+END_TEST